@@ -23,41 +23,58 @@
 #include <setjmp.h>
 #include <windows.h>
 #include <stdint.h>
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#include <emmintrin.h>
+#endif
 
 #include "rufus.h"
+#include "missing.h"
 #include "resource.h"
 #include "msapi_utf8.h"
 #include "localization.h"
 
 #include "badblocks.h"
 #include "file.h"
+#include "winio.h"
+#include "ext2fs/rbtree.h"
 
 FILE* log_fd = NULL;
 static const char abort_msg[] = "Too many bad blocks, aborting test\n";
 static const char bb_prefix[] = "Bad Blocks: ";
 
-/*
- *From e2fsprogs/lib/ext2fs/badblocks.c
- */
-
 /*
  * Badblocks list
+ *
+ * Unlike the sorted array of e2fsprogs/lib/ext2fs/badblocks.c, bad blocks are stored as
+ * extents in a red-black tree, so that a dying drive, with runs of many thousands of bad
+ * blocks, doesn't turn every insertion into a memmove and the list into a memory hog.
  */
+struct bb_extent_node {
+	struct rb_node node;		/* must be first, we cast from it */
+	blk64_t start;
+	blk64_t count;
+};
+
 struct bb_struct_u64_list {
 	int   magic;
-	int   num;
-	int   size;
-	uint64_t *list;
-	int   badblocks_flags;
+	int   num;					/* number of blocks */
+	int   num_extents;
+	struct rb_root root;
 };
 
 struct bb_struct_u64_iterate {
 	int         magic;
 	bb_u64_list bb;
-	int         ptr;
+	struct rb_node *node;
+	blk64_t     ptr;
 };
 
-static errcode_t make_u64_list(int size, int num, uint64_t *list, bb_u64_list *ret)
+#define to_extent(n) ((struct bb_extent_node*)(n))
+
+/*
+ * This procedure creates an empty badblocks list.
+ */
+static errcode_t bb_badblocks_list_create(bb_badblocks_list *ret)
 {
 	bb_u64_list bb;
 
@@ -65,75 +82,91 @@ static errcode_t make_u64_list(int size, int num, uint64_t *list, bb_u64_list *r
 	if (bb == NULL)
 		return BB_ET_NO_MEMORY;
 	bb->magic = BB_ET_MAGIC_BADBLOCKS_LIST;
-	bb->size = size ? size : 10;
-	bb->num = num;
-	bb->list = malloc(sizeof(blk64_t) * bb->size);
-	if (bb->list == NULL) {
-		free(bb);
-		bb = NULL;
-		return BB_ET_NO_MEMORY;
-	}
-	if (list)
-		memcpy(bb->list, list, bb->size * sizeof(blk64_t));
-	else
-		memset(bb->list, 0, bb->size * sizeof(blk64_t));
 	*ret = bb;
 	return 0;
 }
 
+static void bb_extent_free(struct rb_node *n)
+{
+	if (n == NULL)
+		return;
+	bb_extent_free(n->rb_left);
+	bb_extent_free(n->rb_right);
+	free(n);
+}
+
+static void bb_badblocks_list_free(bb_badblocks_list bb)
+{
+	if (bb == NULL)
+		return;
+	bb_extent_free(bb->root.rb_node);
+	free(bb);
+}
+
 /*
- * This procedure creates an empty badblocks list.
+ * Find the extent that starts at or right before blk. If next is not NULL, it
+ * receives the extent that follows it (or the first extent, if there is none).
  */
-static errcode_t bb_badblocks_list_create(bb_badblocks_list *ret, int size)
+static struct bb_extent_node *bb_u64_list_lookup(bb_u64_list bb, blk64_t blk, struct bb_extent_node **next)
 {
-	return make_u64_list(size, 0, 0, (bb_badblocks_list *) ret);
+	struct rb_node *n = bb->root.rb_node;
+	struct bb_extent_node *ext, *prev = NULL, *succ = NULL;
+
+	while (n != NULL) {
+		ext = to_extent(n);
+		if (blk < ext->start) {
+			succ = ext;
+			n = n->rb_left;
+		} else {
+			prev = ext;
+			n = n->rb_right;
+		}
+	}
+	if (next != NULL)
+		*next = succ;
+	return prev;
 }
 
 /*
- * This procedure adds a block to a badblocks list.
+ * This procedure adds a block to a badblocks list, merging it with the
+ * adjacent extents where possible.
  */
 static errcode_t bb_u64_list_add(bb_u64_list bb, uint64_t blk)
 {
-	int		i, j;
-	uint64_t* old_bb_list = bb->list;
+	struct rb_node **p, *parent = NULL;
+	struct bb_extent_node *prev, *next, *ext;
 
 	BB_CHECK_MAGIC(bb, BB_ET_MAGIC_BADBLOCKS_LIST);
 
-	if (bb->num >= bb->size) {
-		bb->size += 100;
-		bb->list = realloc(bb->list, bb->size * sizeof(uint64_t));
-		if (bb->list == NULL) {
-			bb->list = old_bb_list;
-			bb->size -= 100;
-			return BB_ET_NO_MEMORY;
-		}
-		// coverity[suspicious_sizeof]
-		memset(&bb->list[bb->size-100], 0, 100 * sizeof(uint64_t));
-	}
-
-	/*
-	 * Add special case code for appending to the end of the list
-	 */
-	i = bb->num-1;
-	if ((bb->num != 0) && (bb->list[i] == blk))
-		return 0;
-	if ((bb->num == 0) || (bb->list[i] < blk)) {
-		bb->list[bb->num++] = blk;
+	prev = bb_u64_list_lookup(bb, blk, &next);
+	if ((prev != NULL) && (blk < prev->start + prev->count))
 		return 0;
-	}
-
-	j = bb->num;
-	for (i=0; i < bb->num; i++) {
-		if (bb->list[i] == blk)
-			return 0;
-		if (bb->list[i] > blk) {
-			j = i;
-			break;
+	if ((prev != NULL) && (blk == prev->start + prev->count)) {
+		prev->count++;
+		if ((next != NULL) && (next->start == blk + 1)) {
+			prev->count += next->count;
+			ext2fs_rb_erase(&next->node, &bb->root);
+			free(next);
+			bb->num_extents--;
 		}
+	} else if ((next != NULL) && (next->start == blk + 1)) {
+		next->start--;
+		next->count++;
+	} else {
+		ext = calloc(1, sizeof(struct bb_extent_node));
+		if (ext == NULL)
+			return BB_ET_NO_MEMORY;
+		ext->start = blk;
+		ext->count = 1;
+		p = &bb->root.rb_node;
+		while (*p != NULL) {
+			parent = *p;
+			p = (blk < to_extent(parent)->start) ? &parent->rb_left : &parent->rb_right;
+		}
+		ext2fs_rb_link_node(&ext->node, parent, p);
+		ext2fs_rb_insert_color(&ext->node, &bb->root);
+		bb->num_extents++;
 	}
-	for (i=bb->num; i > j; i--)
-		bb->list[i] = bb->list[i-1];
-	bb->list[j] = blk;
 	bb->num++;
 	return 0;
 }
@@ -144,75 +177,95 @@ static errcode_t bb_badblocks_list_add(bb_badblocks_list bb, blk64_t blk)
 }
 
 /*
- * This procedure finds a particular block is on a badblocks
- * list.
+ * This procedure returns the number of blocks of a range that are
+ * on a badblocks list.
  */
-static int bb_u64_list_find(bb_u64_list bb, blk64_t blk)
+static blk64_t bb_u64_list_test_range(bb_u64_list bb, blk64_t start, blk64_t count)
 {
-	int	low, high, mid;
+	struct bb_extent_node *ext, *next;
+	struct rb_node *n;
+	blk64_t lo, hi, r = 0;
 
-	if (bb->magic != BB_ET_MAGIC_BADBLOCKS_LIST)
-		return -1;
-
-	if (bb->num == 0)
-		return -1;
-
-	low = 0;
-	high = bb->num-1;
-	if (blk == bb->list[low])
-		return low;
-	if (blk == bb->list[high])
-		return high;
+	if ((bb->magic != BB_ET_MAGIC_BADBLOCKS_LIST) || (count == 0))
+		return 0;
 
-	while (low < high) {
-		mid = ((unsigned)low + (unsigned)high)/2;
-		if (mid == low || mid == high)
+	ext = bb_u64_list_lookup(bb, start, &next);
+	n = (ext != NULL) ? &ext->node : ((next != NULL) ? &next->node : NULL);
+	for (; n != NULL; n = ext2fs_rb_next(n)) {
+		ext = to_extent(n);
+		if (ext->start >= start + count)
 			break;
-		if (blk == bb->list[mid])
-			return mid;
-		if (blk < bb->list[mid])
-			high = mid;
-		else
-			low = mid;
+		lo = max(ext->start, start);
+		hi = min(ext->start + ext->count, start + count);
+		if (hi > lo)
+			r += hi - lo;
 	}
-	return -1;
+	return r;
 }
 
 /*
  * This procedure tests to see if a particular block is on a badblocks
  * list.
  */
-static int bb_u64_list_test(bb_u64_list bb, blk64_t blk)
+static int bb_badblocks_list_test(bb_badblocks_list bb, blk64_t blk)
 {
-	if (bb_u64_list_find(bb, blk) < 0)
-		return 0;
-	else
-		return 1;
+	return (bb_u64_list_test_range((bb_u64_list) bb, blk, 1) != 0);
 }
 
-static int bb_badblocks_list_test(bb_badblocks_list bb, blk64_t blk)
+static errcode_t bb_badblocks_list_iterate_begin(bb_badblocks_list bb, bb_badblocks_iterate *ret)
 {
-	return bb_u64_list_test((bb_u64_list) bb, blk);
+	bb_u64_iterate iter;
+
+	BB_CHECK_MAGIC(bb, BB_ET_MAGIC_BADBLOCKS_LIST);
+
+	iter = calloc(1, sizeof(struct bb_struct_u64_iterate));
+	if (iter == NULL)
+		return BB_ET_NO_MEMORY;
+	iter->magic = BB_ET_MAGIC_BADBLOCKS_ITERATE;
+	iter->bb = bb;
+	iter->node = ext2fs_rb_first(&bb->root);
+	iter->ptr = 0;
+	*ret = iter;
+	return 0;
 }
 
-static int bb_u64_list_iterate(bb_u64_iterate iter, blk64_t *blk)
+/* Return the next extent of bad blocks, as start and count */
+static int bb_u64_list_iterate_extent(bb_u64_iterate iter, blk64_t *start, blk64_t *count)
 {
-	bb_u64_list bb;
+	struct bb_extent_node *ext;
 
-	if (iter->magic != BB_ET_MAGIC_BADBLOCKS_ITERATE)
+	if ((iter->magic != BB_ET_MAGIC_BADBLOCKS_ITERATE) || (iter->bb->magic != BB_ET_MAGIC_BADBLOCKS_LIST))
+		return 0;
+	if (iter->node == NULL) {
+		*start = 0;
+		*count = 0;
 		return 0;
+	}
+	ext = to_extent(iter->node);
+	*start = ext->start + iter->ptr;
+	*count = ext->count - iter->ptr;
+	iter->node = ext2fs_rb_next(iter->node);
+	iter->ptr = 0;
+	return 1;
+}
 
-	bb = iter->bb;
+static int bb_u64_list_iterate(bb_u64_iterate iter, blk64_t *blk)
+{
+	struct bb_extent_node *ext;
 
-	if (bb->magic != BB_ET_MAGIC_BADBLOCKS_LIST)
+	if ((iter->magic != BB_ET_MAGIC_BADBLOCKS_ITERATE) || (iter->bb->magic != BB_ET_MAGIC_BADBLOCKS_LIST))
+		return 0;
+	if (iter->node == NULL) {
+		*blk = 0;
 		return 0;
-
-	if (iter->ptr < bb->num) {
-		*blk = bb->list[iter->ptr++];
-		return 1;
 	}
-	*blk = 0;
-	return 0;
+	ext = to_extent(iter->node);
+	*blk = ext->start + iter->ptr++;
+	if (iter->ptr >= ext->count) {
+		iter->node = ext2fs_rb_next(iter->node);
+		iter->ptr = 0;
+	}
+	return 1;
 }
 
 static int bb_badblocks_list_iterate(bb_badblocks_iterate iter, blk64_t *blk)
@@ -220,52 +273,110 @@ static int bb_badblocks_list_iterate(bb_badblocks_iterate iter, blk64_t *blk)
 	return bb_u64_list_iterate((bb_u64_iterate) iter, blk);
 }
 
+static void bb_badblocks_list_iterate_end(bb_badblocks_iterate iter)
+{
+	free(iter);
+}
+
 /*
  * from e2fsprogs/misc/badblocks.c
  */
 static int v_flag = 1;					/* verbose */
 static int s_flag = 1;					/* show progress of test */
-static int cancel_ops = 0;				/* abort current operation */
-static int cur_pattern, nr_pattern;
-static int cur_op;
 /* Abort test if more than this number of bad blocks has been encountered */
 static unsigned int max_bb = BB_BAD_BLOCKS_THRESHOLD;
-static blk64_t currently_testing = 0;
-static blk64_t num_blocks = 0;
-static uint32_t num_read_errors = 0;
-static uint32_t num_write_errors = 0;
-static uint32_t num_corruption_errors = 0;
-static bb_badblocks_list bb_list = NULL;
-static blk64_t next_bad = 0;
-static bb_badblocks_iterate bb_iter = NULL;
+
+/*
+ * Everything that is specific to the test of one drive lives in a context,
+ * so that several drives can be tested concurrently.
+ */
+typedef struct {
+	HANDLE hDrive;
+	char prefix[32];					/* prefix for the log messages */
+	char log_prefix[16];				/* prefix for the log file entries */
+	int cancel_ops;						/* abort current operation */
+	int cur_pattern, nr_pattern;
+	int cur_op;
+	DWORD queue_depth;
+	blk64_t currently_testing;
+	blk64_t num_blocks;
+	uint32_t num_read_errors;
+	uint32_t num_write_errors;
+	uint32_t num_corruption_errors;
+	bb_badblocks_list bb_list;
+	blk64_t next_bad;
+	bb_badblocks_iterate bb_iter;
+	BOOL random_pattern;
+	uint64_t random_seed;
+	uint8_t ALIGNED(16) pattern_cycle[2 * BB_PATTERN_CYCLE];
+	/* checkpoint journal */
+	const char *id;
+	char journal[MAX_PATH];				/* empty if checkpoints are disabled */
+	uint64_t journal_time;
+	ULONGLONG disk_size;
+	int flash_type, nb_passes;
+	int pat_idx;
+	size_t id_offset;
+	BOOL resume;
+	int resume_op;
+	blk64_t resume_block;
+	IO_HEATMAP *heatmap;
+} bb_context;
+
+/*
+ * Checkpoint journal, followed by num_extents extents of bad blocks (64-bit start and count).
+ * Every block before 'block' has been processed by operation 'op' of pass 'pat_idx'.
+ */
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t flash_type;
+	uint32_t nb_passes;
+	uint32_t pat_idx;
+	uint32_t op;
+	uint32_t num_read_errors;
+	uint32_t num_write_errors;
+	uint32_t num_corruption_errors;
+	uint32_t num_extents;
+	uint32_t reserved;
+	uint64_t disk_size;
+	uint64_t block;
+	uint64_t random_seed;
+	uint64_t id_offset;
+	char device_id[256];
+} bb_journal;
+
+/* The contexts of the drives being tested, for the status timer */
+static bb_context *bb_ctx = NULL;
+static int bb_num_ctx = 0;
 
 static __inline void *allocate_buffer(size_t size) {
-	return _mm_malloc(size, BB_SYS_PAGE_SIZE);
+	return AllocIoBuffer(size);
 }
 
 static __inline void free_buffer(void* p) {
-	_mm_free(p);
+	FreeIoBuffer(p);
 }
 
 /*
  * This routine reports a new bad block.  If the bad block has already
  * been seen before, then it returns 0; otherwise it returns 1.
  */
-static int bb_output (blk64_t bad, enum error_types error_type)
+static int bb_output (bb_context *ctx, blk64_t bad, enum error_types error_type)
 {
 	errcode_t error_code;
 
-	if (bb_badblocks_list_test(bb_list, bad))
+	if (bb_badblocks_list_test(ctx->bb_list, bad))
 		return 0;
 
-	uprintf("%s%lu\n", bb_prefix, (unsigned long)bad);
-	fprintf(log_fd, "Block %lu: %s error\n", (unsigned long)bad, (error_type==READ_ERROR)?"read":
+	uprintf("%s%lu\n", ctx->prefix, (unsigned long)bad);
+	fprintf(log_fd, "%sBlock %lu: %s error\n", ctx->log_prefix, (unsigned long)bad, (error_type==READ_ERROR)?"read":
 		((error_type == WRITE_ERROR)?"write":"corruption"));
 	fflush(log_fd);
 
-	error_code = bb_badblocks_list_add(bb_list, bad);
+	error_code = bb_badblocks_list_add(ctx->bb_list, bad);
 	if (error_code) {
-		uprintf("%sError %d adding to in-memory bad block list", bb_prefix, error_code);
+		uprintf("%sError %d adding to in-memory bad block list", ctx->prefix, error_code);
 		return 0;
 	}
 
@@ -273,15 +384,15 @@ static int bb_output (blk64_t bad, enum error_types error_type)
 	   increment the iteration through the bb_list if
 	   an element was just added before the current iteration
 	   position.  This should not cause next_bad to change. */
-	if (bb_iter && bad < next_bad)
-		bb_badblocks_list_iterate (bb_iter, &next_bad);
+	if (ctx->bb_iter && bad < ctx->next_bad)
+		bb_badblocks_list_iterate (ctx->bb_iter, &ctx->next_bad);
 
 	if (error_type == READ_ERROR) {
-	  num_read_errors++;
+	  ctx->num_read_errors++;
 	} else if (error_type == WRITE_ERROR) {
-	  num_write_errors++;
+	  ctx->num_write_errors++;
 	} else if (error_type == CORRUPTION_ERROR) {
-	  num_corruption_errors++;
+	  ctx->num_corruption_errors++;
 	}
 	return 1;
 }
@@ -298,49 +409,104 @@ static float calc_percent(unsigned long current, unsigned long total) {
 	return percent;
 }
 
+/* Overall progress of a drive, across all patterns and operations */
+static float calc_progress(bb_context *ctx)
+{
+	float percent = calc_percent((unsigned long) ctx->currently_testing,
+					(unsigned long) ctx->num_blocks);
+	percent = (percent/2.0f) + ((ctx->cur_op==OP_READ)? 50.0f : 0.0f);
+	return (ctx->nr_pattern == 0) ? 0.0f : (((ctx->cur_pattern-1)*100.0f) + percent) / ctx->nr_pattern;
+}
+
+/* When testing several drives, the status is the one of the drive that lags behind */
 static void print_status(void)
 {
+	int i, slowest = 0;
 	float percent;
+	bb_context *ctx;
 
-	percent = calc_percent((unsigned long) currently_testing,
-					(unsigned long) num_blocks);
-	PrintInfo(0, MSG_235, lmprintf(MSG_191 + ((cur_op==OP_WRITE)?0:1)),
-				cur_pattern, nr_pattern,
+	if (bb_num_ctx == 0)
+		return;
+	for (i = 1; i < bb_num_ctx; i++) {
+		if (calc_progress(&bb_ctx[i]) < calc_progress(&bb_ctx[slowest]))
+			slowest = i;
+	}
+	ctx = &bb_ctx[slowest];
+	percent = calc_percent((unsigned long) ctx->currently_testing,
+					(unsigned long) ctx->num_blocks);
+	PrintInfo(0, MSG_235, lmprintf(MSG_191 + ((ctx->cur_op==OP_WRITE)?0:1)),
+				ctx->cur_pattern, ctx->nr_pattern,
 				percent,
-				num_read_errors,
-				num_write_errors,
-				num_corruption_errors);
-	percent = (percent/2.0f) + ((cur_op==OP_READ)? 50.0f : 0.0f);
-	UpdateProgress(OP_BADBLOCKS, (((cur_pattern-1)*100.0f) + percent) / nr_pattern);
+				ctx->num_read_errors,
+				ctx->num_write_errors,
+				ctx->num_corruption_errors);
+	UpdateProgress(OP_BADBLOCKS, calc_progress(ctx));
 }
 
 static void CALLBACK alarm_intr(HWND hwnd, UINT uMsg, UINT_PTR idEvent, DWORD dwTime)
 {
-	if (!num_blocks)
+	int i;
+	BOOL active = FALSE;
+
+	for (i = 0; i < bb_num_ctx; i++)
+		active |= (bb_ctx[i].num_blocks != 0);
+	if (!active)
 		return;
 	if (FormatStatus) {
-		uprintf("%sInterrupting at block %" PRIu64 "\n", bb_prefix,
-			(unsigned long long) currently_testing);
-		cancel_ops = -1;
+		for (i = 0; i < bb_num_ctx; i++) {
+			if (bb_ctx[i].cancel_ops)
+				continue;
+			uprintf("%sInterrupting at block %" PRIu64 "\n", bb_ctx[i].prefix,
+				(unsigned long long) bb_ctx[i].currently_testing);
+			bb_ctx[i].cancel_ops = -1;
+		}
 	}
 	print_status();
 }
 
-static void pattern_fill(unsigned char *buffer, unsigned int pattern,
-			 size_t n)
+/* SplitMix64 finalizer, for reproducible pseudorandom data */
+static __inline uint64_t mix64(uint64_t z)
+{
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/*
+ * The test patterns repeat every 1, 2, 3 or 4 bytes, so a cycle of BB_PATTERN_CYCLE bytes
+ * (a multiple of all these periods and of the SSE2 vector size) is all we need to generate
+ * or check any part of a request, from its offset. The cycle is stored twice, so that it
+ * can be read from any phase without wrapping.
+ */
+
+/*
+ * The random pattern is generated from a counter, one 64-bit word for each 8 bytes of a
+ * request, so that any part of it can be regenerated on verification without a copy.
+ */
+static __inline uint64_t random_word(bb_context *ctx, size_t offset)
+{
+	return mix64(ctx->random_seed + ((uint64_t)(offset >> 3) + 1) * 0x9e3779b97f4a7c15ULL);
+}
+
+/* Random pattern byte for a specific offset of a request */
+static __inline uint8_t random_byte(bb_context *ctx, size_t offset)
+{
+	return (uint8_t)(random_word(ctx, offset) >> (8 * (offset & 7)));
+}
+
+static void pattern_init(bb_context *ctx, unsigned int pattern)
 {
 	unsigned int	i, nb;
-	unsigned char	bpattern[sizeof(pattern)], *ptr;
+	unsigned char	bpattern[sizeof(pattern)];
 
 	if (pattern == (unsigned int) ~0) {
 		PrintInfo(3500, MSG_236);
-		srand((unsigned int)GetTickCount64());
-		for (ptr = buffer; ptr < buffer + n; ptr++) {
-			// coverity[dont_call]
-			(*ptr) = rand() % (1 << (8 * sizeof(char)));
-		}
+		ctx->random_pattern = TRUE;
+		if (!ctx->resume)
+			ctx->random_seed = GetTickCount64() ^ (uintptr_t)ctx->hDrive;
 	} else {
 		PrintInfo(3500, MSG_237, pattern);
+		ctx->random_pattern = FALSE;
 		bpattern[0] = 0;
 		for (i = 0; i < sizeof(bpattern); i++) {
 			if (pattern == 0)
@@ -349,35 +515,101 @@ static void pattern_fill(unsigned char *buffer, unsigned int pattern,
 			pattern = pattern >> 8;
 		}
 		nb = i ? (i-1) : 0;
-		for (ptr = buffer, i = nb; ptr < buffer + n; ptr++) {
-			*ptr = bpattern[i];
-			if (i == 0)
-				i = nb;
-			else
-				i--;
+		for (i = 0; i < sizeof(ctx->pattern_cycle); i++)
+			ctx->pattern_cycle[i] = bpattern[nb - (i % (nb + 1))];
+		ctx->cur_pattern++;
+	}
+}
+
+/* Generate len bytes of the test pattern, as found at a specific offset of a request */
+static void pattern_generate(bb_context *ctx, unsigned char *buffer, size_t offset, size_t len)
+{
+	size_t i, n, phase = offset % BB_PATTERN_CYCLE;
+	uint64_t z;
+
+	if (ctx->random_pattern) {
+		for (i = 0; (i < len) && ((offset + i) & 7); i++)
+			buffer[i] = random_byte(ctx, offset + i);
+		for (; i + sizeof(z) <= len; i += sizeof(z)) {
+			z = random_word(ctx, offset + i);
+			memcpy(&buffer[i], &z, sizeof(z));
 		}
-		cur_pattern++;
+		for (; i < len; i++)
+			buffer[i] = random_byte(ctx, offset + i);
+		return;
+	}
+	// Copy a single cycle, then keep doubling what has already been generated, since
+	// every copy then starts on a cycle boundary and can be as large as we want.
+	n = min(len, BB_PATTERN_CYCLE);
+	memcpy(buffer, &ctx->pattern_cycle[phase], n);
+	for (i = n; i < len; i += n) {
+		n = min(len - i, i);
+		memcpy(&buffer[i], buffer, n);
 	}
 }
 
+/*
+ * Check len bytes of data that was read back against the test pattern expected at a
+ * specific offset of a request, without having to generate a reference buffer.
+ * Returns the index of the first mismatching byte, or len if the data matches.
+ */
+static size_t pattern_mismatch(bb_context *ctx, const unsigned char *buffer, size_t offset, size_t len)
+{
+	size_t i = 0, phase = offset % BB_PATTERN_CYCLE;
+	uint64_t z;
+
+	if (ctx->random_pattern) {
+		for (; (i < len) && ((offset + i) & 7); i++) {
+			if (buffer[i] != random_byte(ctx, offset + i))
+				return i;
+		}
+		for (; i + sizeof(z) <= len; i += sizeof(z)) {
+			z = random_word(ctx, offset + i);
+			if (memcmp(&buffer[i], &z, sizeof(z)) != 0)
+				break;
+		}
+		for (; (i < len) && (buffer[i] == random_byte(ctx, offset + i)); i++);
+		return i;
+	}
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+	{
+		int j, mask;
+		__m128i exp[BB_PATTERN_CYCLE / 16];
+		for (j = 0; j < BB_PATTERN_CYCLE / 16; j++)
+			exp[j] = _mm_loadu_si128((const __m128i*)&ctx->pattern_cycle[phase + 16 * j]);
+		for (; i + BB_PATTERN_CYCLE <= len; i += BB_PATTERN_CYCLE) {
+			mask = 0xFFFF;
+			for (j = 0; j < BB_PATTERN_CYCLE / 16; j++)
+				mask &= _mm_movemask_epi8(_mm_cmpeq_epi8(exp[j],
+					_mm_loadu_si128((const __m128i*)&buffer[i + 16 * j])));
+			if (mask != 0xFFFF)
+				break;
+		}
+	}
+#endif
+	for (; (i < len) && (buffer[i] == ctx->pattern_cycle[(phase + i) % BB_PATTERN_CYCLE]); i++);
+	return i;
+}
+
 /*
  * Perform a read of a sequence of blocks; return the number of blocks
  *    successfully sequentially read.
  */
-static int64_t do_read (HANDLE hDrive, unsigned char * buffer, uint64_t tryout,
+static int64_t do_read (bb_context *ctx, unsigned char * buffer, uint64_t tryout,
 					    uint64_t block_size, blk64_t current_block)
 {
 	int64_t got;
+	DWORD size = 0;
 
 	if (v_flag > 1)
 		print_status();
 
 	/* Try the read */
-	got = read_sectors(hDrive, block_size, current_block, tryout, buffer);
-	if (got < 0)
-		got = 0;
-	if (got & 511)
-		uprintf("%sWeird value (%ld) in do_read\n", bb_prefix, got);
+	BlockIo(ctx->hDrive, FALSE, buffer, (DWORD)(tryout * block_size), current_block * block_size, 0,
+		ctx->heatmap, &size);
+	got = size;
+	if (got % block_size)
+		uprintf("%sWeird value (%ld) in do_read\n", ctx->prefix, got);
 	got /= block_size;
 	return got;
 }
@@ -386,212 +618,896 @@ static int64_t do_read (HANDLE hDrive, unsigned char * buffer, uint64_t tryout,
  * Perform a write of a sequence of blocks; return the number of blocks
  *    successfully sequentially written.
  */
-static int64_t do_write(HANDLE hDrive, unsigned char * buffer, uint64_t tryout,
+static int64_t do_write(bb_context *ctx, unsigned char * buffer, uint64_t tryout,
 					    uint64_t block_size, blk64_t current_block)
 {
 	int64_t got;
+	DWORD size = 0;
 
 	if (v_flag > 1)
 		print_status();
 
 	/* Try the write */
-	got = write_sectors(hDrive, block_size, current_block, tryout, buffer);
-	if (got < 0)
-		got = 0;
-	if (got & 511)
-		uprintf("%sWeird value (%ld) in do_write\n", bb_prefix, got);
+	BlockIo(ctx->hDrive, TRUE, buffer, (DWORD)(tryout * block_size), current_block * block_size, WRITE_RETRIES,
+		ctx->heatmap, &size);
+	got = size;
+	if (got % block_size)
+		uprintf("%sWeird value (%ld) in do_write\n", ctx->prefix, got);
 	got /= block_size;
 	return got;
 }
 
-static unsigned int test_rw(HANDLE hDrive, blk64_t last_block, size_t block_size, blk64_t first_block,
+/*
+ * Fill a request buffer with the test pattern and, if requested, add the block number
+ * at a fixed (random) offset of each block, to allow for the detection of 'fake' media
+ * (eg. 2GB USB masquerading as 16GB).
+ */
+static void fill_request(bb_context *ctx, unsigned char *buffer, size_t block_size, blk64_t first_block,
+			 blk64_t count, BOOL add_ids, size_t id_offset)
+{
+	blk64_t i;
+
+	pattern_generate(ctx, buffer, 0, (size_t)count * block_size);
+	if (add_ids) {
+		for (i = 0; i < count; i++)
+			*(blk64_t*)(intptr_t)(buffer + id_offset + i * block_size) = first_block + i;
+	}
+}
+
+/*
+ * Compare blocks that were read back against the expected data, and report the ones
+ * that don't match, along with the offset of their first mismatching byte. 'index' is
+ * the position of the first block in its request. Returns the number of new bad blocks.
+ */
+static unsigned int check_blocks(bb_context *ctx, const unsigned char *buffer, size_t block_size,
+				 blk64_t first_block, blk64_t count, blk64_t index, BOOL add_ids, size_t id_offset)
+{
+	const unsigned char *block;
+	blk64_t i, id;
+	size_t j, offset, pos;
+	unsigned int bb_count = 0;
+
+	for (i = 0; i < count; i++) {
+		block = buffer + i * block_size;
+		offset = (size_t)(index + i) * block_size;
+		if (add_ids) {
+			id = first_block + i;
+			pos = pattern_mismatch(ctx, block, offset, id_offset);
+			if (pos == id_offset) {
+				for (j = 0; (j < sizeof(id)) && (block[id_offset + j] == ((uint8_t*)&id)[j]); j++);
+				pos += j;
+				if (j == sizeof(id))
+					pos += pattern_mismatch(ctx, &block[pos], offset + pos, block_size - pos);
+			}
+		} else {
+			pos = pattern_mismatch(ctx, block, offset, block_size);
+		}
+		if ((pos < block_size) && (bb_output(ctx, first_block + i, CORRUPTION_ERROR))) {
+			bb_count++;
+			fprintf(log_fd, "%s  First mismatch at byte offset %lu of the block\n", ctx->log_prefix,
+				(unsigned long)pos);
+			fflush(log_fd);
+		}
+	}
+	return bb_count;
+}
+
+/*
+ * Issue an overlapped read or write request for up to blocks_at_once blocks on a slot
+ * of the queue. A request that fails to be issued is retried block by block on reap.
+ */
+static void issue_request(HANDLE hQueue, DWORD slot, BOOL write, unsigned char *buffer,
+			  size_t block_size, blk64_t block, blk64_t count)
+{
+	IssueAsyncQueue(hQueue, slot, write, buffer, (DWORD)(count * block_size), block * block_size);
+}
+
+/*
+ * Reap the request on a slot of the queue. If the request did not fully succeed, the blocks
+ * it covered are processed again synchronously, one at a time, so that the exact bad blocks
+ * can be identified. For reads, the data is then compared against the expected pattern.
+ * Returns the number of new bad blocks.
+ */
+static unsigned int reap_request(bb_context *ctx, HANDLE hQueue, DWORD slot, BOOL write,
+				 unsigned char *buffer, size_t block_size, blk64_t block, blk64_t count,
+				 BOOL add_ids, size_t id_offset)
+{
+	DWORD size;
+	blk64_t i;
+	unsigned int bb_count = 0;
+
+	if (v_flag > 1)
+		print_status();
+	if (WaitAsyncQueue(hQueue, slot, DRIVE_ACCESS_TIMEOUT, &size) && (size == count * block_size)) {
+		if (!write)
+			bb_count += check_blocks(ctx, buffer, block_size, block, count, 0, add_ids, id_offset);
+		return bb_count;
+	}
+	// A request that timed out may still be in flight
+	CancelAsyncRequest(hQueue, slot);
+	for (i = 0; i < count; i++) {
+		if (ctx->cancel_ops)
+			break;
+		if (write) {
+			if (do_write(ctx, buffer + i * block_size, 1, block_size, block + i) == 0)
+				bb_count += bb_output(ctx, block + i, WRITE_ERROR);
+		} else {
+			if (do_read(ctx, buffer + i * block_size, 1, block_size, block + i) == 0)
+				bb_count += bb_output(ctx, block + i, READ_ERROR);
+			else
+				bb_count += check_blocks(ctx, buffer + i * block_size, block_size,
+					block + i, 1, i, add_ids, id_offset);
+		}
+	}
+	return bb_count;
+}
+
+/*
+ * Checkpoints: every BB_JOURNAL_INTERVAL, as well as when a test is interrupted, the
+ * position of the test and the bad blocks found so far are saved in a journal that is
+ * specific to the device, so that a new test with the same parameters on the same device
+ * can pick up from there, rather than start again from scratch.
+ */
+static void journal_init(bb_context *ctx)
+{
+	uint32_t hash = 2166136261U;
+	const char *p;
+
+	ctx->journal[0] = 0;
+	if ((ctx->id == NULL) || (ctx->id[0] == 0) || (app_data_dir[0] == 0))
+		return;
+	// FNV-1a, as device IDs are too long and contain too many backslashes to be used as is
+	for (p = ctx->id; *p != 0; p++)
+		hash = (hash ^ (uint8_t)*p) * 16777619U;
+	static_sprintf(ctx->journal, "%s\\%s", app_data_dir, FILES_DIR);
+	IGNORE_RETVAL(_mkdirExU(ctx->journal));
+	static_sprintf(ctx->journal, "%s\\%s\\badblocks_%08X.journal", app_data_dir, FILES_DIR, hash);
+}
+
+static void journal_save(bb_context *ctx)
+{
+	FILE* fd;
+	bb_journal jnl = { 0 };
+	bb_badblocks_iterate iter = NULL;
+	uint64_t ext[2];
+	uint32_t i;
+	char tmp[MAX_PATH];
+
+	if (ctx->journal[0] == 0)
+		return;
+	memcpy(jnl.magic, BB_JOURNAL_MAGIC, sizeof(jnl.magic));
+	jnl.version = BB_JOURNAL_VERSION;
+	jnl.flash_type = ctx->flash_type;
+	jnl.nb_passes = ctx->nb_passes;
+	jnl.pat_idx = ctx->pat_idx;
+	jnl.op = ctx->cur_op;
+	jnl.num_read_errors = ctx->num_read_errors;
+	jnl.num_write_errors = ctx->num_write_errors;
+	jnl.num_corruption_errors = ctx->num_corruption_errors;
+	jnl.num_extents = ctx->bb_list->num_extents;
+	jnl.disk_size = ctx->disk_size;
+	jnl.block = ctx->currently_testing;
+	jnl.random_seed = ctx->random_seed;
+	jnl.id_offset = ctx->id_offset;
+	static_strcpy(jnl.device_id, ctx->id);
+
+	// Write to a temporary file first, so that a crash cannot leave us with a truncated journal
+	static_sprintf(tmp, "%s.tmp", ctx->journal);
+	fd = fopenU(tmp, "wb");
+	if (fd == NULL) {
+		uprintf("%sCould not create checkpoint '%s'", ctx->prefix, tmp);
+		return;
+	}
+	i = 0;
+	if ((fwrite(&jnl, sizeof(jnl), 1, fd) == 1) && (bb_badblocks_list_iterate_begin(ctx->bb_list, &iter) == 0)) {
+		for (; bb_u64_list_iterate_extent(iter, &ext[0], &ext[1]) && (fwrite(ext, sizeof(ext), 1, fd) == 1); i++);
+		bb_badblocks_list_iterate_end(iter);
+	}
+	fclose(fd);
+	if ((iter == NULL) || (i != jnl.num_extents)) {
+		uprintf("%sCould not write checkpoint '%s'", ctx->prefix, tmp);
+		DeleteFileU(tmp);
+		return;
+	}
+	if (!MoveFileExU(tmp, ctx->journal, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+		uprintf("%sCould not commit checkpoint: %s", ctx->prefix, WindowsErrorString());
+		DeleteFileU(tmp);
+	}
+	ctx->journal_time = GetTickCount64();
+}
+
+static void journal_delete(bb_context *ctx)
+{
+	if (ctx->journal[0] != 0)
+		DeleteFileU(ctx->journal);
+}
+
+/* Restore the state of an interrupted test, if its journal matches the current one */
+static void journal_load(bb_context *ctx, blk64_t last_block)
+{
+	FILE* fd;
+	bb_journal jnl;
+	uint32_t i;
+	uint64_t ext[2], blk;
+
+	if (ctx->journal[0] == 0)
+		return;
+	fd = fopenU(ctx->journal, "rb");
+	if (fd == NULL)
+		return;
+	if ((fread(&jnl, sizeof(jnl), 1, fd) != 1) || (memcmp(jnl.magic, BB_JOURNAL_MAGIC, sizeof(jnl.magic)) != 0) ||
+		(jnl.version != BB_JOURNAL_VERSION)) {
+		uprintf("%sIgnoring invalid checkpoint '%s'", ctx->prefix, ctx->journal);
+		goto out;
+	}
+	jnl.device_id[sizeof(jnl.device_id) - 1] = 0;
+	if ((strcmp(jnl.device_id, ctx->id) != 0) || (jnl.disk_size != ctx->disk_size) ||
+		(jnl.flash_type != (uint32_t)ctx->flash_type) || (jnl.nb_passes != (uint32_t)ctx->nb_passes) ||
+		(jnl.pat_idx >= jnl.nb_passes) || (jnl.op > OP_WRITE) || (jnl.block > last_block) ||
+		(jnl.id_offset > BADBLOCK_BLOCK_SIZE - sizeof(blk64_t))) {
+		uprintf("%sIgnoring checkpoint from a different test", ctx->prefix);
+		goto out;
+	}
+	for (i = 0; i < jnl.num_extents; i++) {
+		if ((fread(ext, sizeof(ext), 1, fd) != 1) || (ext[0] + ext[1] > last_block)) {
+			uprintf("%sIgnoring truncated checkpoint '%s'", ctx->prefix, ctx->journal);
+			goto out;
+		}
+	}
+	// Only populate the list once we know that the journal is usable
+	fseek(fd, sizeof(jnl), SEEK_SET);
+	for (i = 0; i < jnl.num_extents; i++) {
+		if (fread(ext, sizeof(ext), 1, fd) != 1)
+			break;
+		for (blk = ext[0]; blk < ext[0] + ext[1]; blk++)
+			bb_badblocks_list_add(ctx->bb_list, blk);
+	}
+	ctx->resume = TRUE;
+	ctx->pat_idx = jnl.pat_idx;
+	ctx->resume_op = jnl.op;
+	ctx->resume_block = jnl.block;
+	ctx->random_seed = jnl.random_seed;
+	ctx->id_offset = (size_t)jnl.id_offset;
+	ctx->num_read_errors = jnl.num_read_errors;
+	ctx->num_write_errors = jnl.num_write_errors;
+	ctx->num_corruption_errors = jnl.num_corruption_errors;
+	uprintf("%sResuming interrupted test: pass %d, %s from block %" PRIu64 " (%d bad block%s found so far)",
+		ctx->prefix, jnl.pat_idx + 1, (jnl.op == OP_WRITE) ? "writing" : "reading", jnl.block,
+		ctx->bb_list->num, (ctx->bb_list->num == 1) ? "" : "s");
+
+out:
+	fclose(fd);
+}
+
+/*
+ * Partition records get zapped between two runs of a test, which clobbers the start and
+ * end of the drive. Rewrite the pattern there, for the blocks that the resumed operation
+ * relies on: the ones that were already written for a write pass, and the ones that are
+ * left to read for a read pass.
+ */
+static void resume_rewrite(bb_context *ctx, unsigned char *buffer, size_t block_size,
+			   blk64_t last_block, BOOL add_ids)
+{
+	blk64_t i, lo, hi, n = min(BB_JOURNAL_REWRITE_BLOCKS, last_block);
+	blk64_t zone[2][2] = { { 0, n }, { last_block - n, last_block } };
+	int z;
+
+	for (z = 0; z < 2; z++) {
+		lo = (ctx->resume_op == OP_WRITE) ? zone[z][0] : max(zone[z][0], ctx->resume_block);
+		hi = (ctx->resume_op == OP_WRITE) ? min(zone[z][1], ctx->resume_block) : zone[z][1];
+		for (i = lo; i < hi; i++) {
+			fill_request(ctx, buffer, block_size, i, 1, add_ids, ctx->id_offset);
+			if (do_write(ctx, buffer, 1, block_size, i) == 0)
+				bb_output(ctx, i, WRITE_ERROR);
+		}
+	}
+}
+
+/*
+ * Before resuming a read pass, make sure that the pattern is still there, in case the drive
+ * was written to in the meantime. Returns FALSE if the pass must be started all over again.
+ */
+static BOOL resume_check(bb_context *ctx, unsigned char *buffer, size_t block_size,
+			 blk64_t last_block, BOOL add_ids)
+{
+	blk64_t block;
+	size_t pos;
+
+	if ((ctx->resume_op != OP_READ) || (ctx->resume_block + 2 * BB_JOURNAL_REWRITE_BLOCKS >= last_block))
+		return TRUE;
+	block = ctx->resume_block + (last_block - ctx->resume_block) / 2;
+	if (do_read(ctx, buffer, 1, block_size, block) != 1)
+		return TRUE;
+	pos = pattern_mismatch(ctx, buffer, 0, add_ids ? ctx->id_offset : block_size);
+	if (add_ids && (pos == ctx->id_offset) && (*(blk64_t*)(intptr_t)(buffer + pos) == block))
+		pos = block_size;
+	return (pos >= block_size);
+}
+
+/*
+ * The write and read passes are driven through an overlapped I/O queue, with up to
+ * queue_depth requests of blocks_at_once blocks in flight, so that the device is
+ * kept busy while the next request is prepared or the last one read is compared.
+ */
+static unsigned int test_rw(bb_context *ctx, blk64_t last_block, size_t block_size, blk64_t first_block,
 							size_t blocks_at_once, int pattern_type, int nb_passes)
 {
 	const unsigned int pattern[BADLOCKS_PATTERN_TYPES][BADBLOCK_PATTERN_COUNT] =
 		{ BADBLOCK_PATTERN_ONE_PASS, BADBLOCK_PATTERN_TWO_PASSES, BADBLOCK_PATTERN_SLC,
 		  BADCLOCK_PATTERN_MLC, BADBLOCK_PATTERN_TLC };
-	unsigned char *buffer = NULL, *read_buffer;
-	int i, pat_idx;
-	unsigned int bb_count = 0;
-	blk64_t got, tryout, recover_block = ~0, *blk_id;
-	size_t id_offset = 0;
+	unsigned char *buffer = NULL;
+	HANDLE hQueue = NULL;
+	BOOL add_ids;
+	DWORD slot, nb_slots;
+	int op;
+	unsigned int bb_count = ctx->bb_list->num;
+	blk64_t next_block, req_block[BB_QUEUE_DEPTH], req_count[BB_QUEUE_DEPTH];
+	size_t id_offset = 0, req_size = blocks_at_once * block_size;
 
 	if ((pattern_type < 0) || (pattern_type >= BADLOCKS_PATTERN_TYPES)) {
-		uprintf("%sInvalid pattern type\n", bb_prefix);
-		cancel_ops = -1;
+		uprintf("%sInvalid pattern type\n", ctx->prefix);
+		ctx->cancel_ops = -1;
 		return 0;
 	}
 	if ((nb_passes < 1) || (nb_passes > BADBLOCK_PATTERN_COUNT)) {
-		uprintf("%sInvalid number of passes\n", bb_prefix);
-		cancel_ops = -1;
+		uprintf("%sInvalid number of passes\n", ctx->prefix);
+		ctx->cancel_ops = -1;
 		return 0;
 	}
 
-	buffer = allocate_buffer(2 * blocks_at_once * block_size);
+	// One buffer per request slot. The expected data is generated on the fly for checks.
+	for (nb_slots = min(ctx->queue_depth, BB_QUEUE_DEPTH); nb_slots > 0; nb_slots--) {
+		buffer = allocate_buffer(nb_slots * req_size);
+		if (buffer != NULL)
+			break;
+	}
 	if (!buffer) {
-		uprintf("%sError while allocating buffers\n", bb_prefix);
-		cancel_ops = -1;
+		uprintf("%sError while allocating buffers\n", ctx->prefix);
+		ctx->cancel_ops = -1;
 		return 0;
 	}
-	read_buffer = buffer + blocks_at_once * block_size;
 
-	uprintf("%sChecking from block %lu to %lu (1 block = %s)\n", bb_prefix,
+	hQueue = BlockCreateQueue(ctx->hDrive, GENERIC_READ | GENERIC_WRITE, nb_slots, ctx->heatmap);
+	if (hQueue == NULL) {
+		uprintf("%sError while creating I/O queue: %s\n", ctx->prefix, WindowsErrorString());
+		ctx->cancel_ops = -1;
+		goto out;
+	}
+
+	uprintf("%sChecking from block %lu to %lu (1 block = %s, %d request%s in flight)\n", ctx->prefix,
 		(unsigned long) first_block, (unsigned long) last_block - 1,
-		SizeToHumanReadable(BADBLOCK_BLOCK_SIZE, FALSE, FALSE));
-	nr_pattern = nb_passes;
-	cur_pattern = 0;
+		SizeToHumanReadable(BADBLOCK_BLOCK_SIZE, FALSE, FALSE), nb_slots, (nb_slots == 1) ? "" : "s");
+	ctx->nr_pattern = nb_passes;
+	ctx->cur_pattern = ctx->resume ? ctx->pat_idx : 0;
+	ctx->journal_time = GetTickCount64();
 
-	for (pat_idx = 0; pat_idx < nb_passes; pat_idx++) {
-		if (cancel_ops)
+	for (ctx->pat_idx = ctx->resume ? ctx->pat_idx : 0; ctx->pat_idx < nb_passes; ctx->pat_idx++) {
+		if (ctx->cancel_ops)
 			goto out;
-		if (detect_fakes && (pat_idx == 0)) {
-			srand((unsigned int)GetTickCount64());
-			id_offset = rand() * (block_size - sizeof(blk64_t)) / RAND_MAX;
-			uprintf("%sUsing offset %d for fake device check\n", bb_prefix, id_offset);
+		add_ids = detect_fakes && (ctx->pat_idx == 0);
+		if (add_ids) {
+			if (ctx->resume)
+				id_offset = ctx->id_offset;
+			else
+				id_offset = (size_t)(mix64(GetTickCount64() ^ (uintptr_t)ctx->hDrive) %
+					(block_size - sizeof(blk64_t)));
+			ctx->id_offset = id_offset;
+			uprintf("%sUsing offset %d for fake device check\n", ctx->prefix, id_offset);
 		}
-		// coverity[dont_call]
-		pattern_fill(buffer, pattern[pattern_type][pat_idx], blocks_at_once * block_size);
-		num_blocks = last_block - 1;
-		currently_testing = first_block;
-		if (s_flag | v_flag)
-			uprintf("%sWriting test pattern 0x%02X\n", bb_prefix, pattern[pattern_type][pat_idx]);
-		cur_op = OP_WRITE;
-		tryout = blocks_at_once;
-		while (currently_testing < last_block) {
-			if (cancel_ops)
-				goto out;
-			if (max_bb && bb_count >= max_bb) {
-				if (s_flag || v_flag) {
-					uprintf(abort_msg);
-					fprintf(log_fd, "%s", abort_msg);
-					fflush(log_fd);
-				}
-				cancel_ops = -1;
-				goto out;
-			}
-			if (currently_testing + tryout > last_block)
-				tryout = last_block - currently_testing;
-			if (detect_fakes && (pat_idx == 0)) {
-				/* Add the block number at a fixed (random) offset during each pass to
-				   allow for the detection of 'fake' media (eg. 2GB USB masquerading as 16GB) */
-				for (i=0; i<(int)blocks_at_once; i++) {
-					blk_id = (blk64_t*)(intptr_t)(buffer + id_offset+ i*block_size);
-					*blk_id = (blk64_t)(currently_testing + i);
-				}
-			}
-			got = do_write(hDrive, buffer, tryout, block_size, currently_testing);
-			if (v_flag > 1)
-				print_status();
-
-			if (got == 0 && tryout == 1)
-				bb_count += bb_output(currently_testing++, WRITE_ERROR);
-			currently_testing += got;
-			if (got != tryout) {
-				tryout = 1;
-				if (recover_block == ~0)
-					recover_block = currently_testing -
-						got + blocks_at_once;
-				continue;
-			} else if (currently_testing == recover_block) {
-				tryout = blocks_at_once;
-				recover_block = ~0;
+		pattern_init(ctx, pattern[pattern_type][ctx->pat_idx]);
+		if (ctx->resume) {
+			if (resume_check(ctx, buffer, block_size, last_block, add_ids)) {
+				resume_rewrite(ctx, buffer, block_size, last_block, add_ids);
+			} else {
+				uprintf("%sThe test data was altered since the checkpoint: Restarting pass %d\n",
+					ctx->prefix, ctx->pat_idx + 1);
+				ctx->resume_op = OP_WRITE;
+				ctx->resume_block = 0;
 			}
 		}
 
-		num_blocks = 0;
-		if (s_flag | v_flag)
-			uprintf("%sReading and comparing\n", bb_prefix);
-		cur_op = OP_READ;
-		num_blocks = last_block;
-		currently_testing = first_block;
-
-		tryout = blocks_at_once;
-		while (currently_testing < last_block) {
-			if (cancel_ops) goto out;
-			if (max_bb && bb_count >= max_bb) {
-				if (s_flag || v_flag) {
-					uprintf(abort_msg);
-					fprintf(log_fd, "%s", abort_msg);
-					fflush(log_fd);
-				}
-				cancel_ops = -1;
-				goto out;
+		for (op = ctx->resume ? ctx->resume_op : OP_WRITE; op >= OP_READ; op--) {
+			ctx->num_blocks = 0;
+			if (s_flag | v_flag) {
+				if (op == OP_WRITE)
+					uprintf("%sWriting test pattern 0x%02X\n", ctx->prefix, pattern[pattern_type][ctx->pat_idx]);
+				else
+					uprintf("%sReading and comparing\n", ctx->prefix);
 			}
-			if (currently_testing + tryout > last_block)
-				tryout = last_block - currently_testing;
-			if (detect_fakes && (pat_idx == 0)) {
-				for (i=0; i<(int)blocks_at_once; i++) {
-					blk_id = (blk64_t*)(intptr_t)(buffer + id_offset+ i*block_size);
-					*blk_id = (blk64_t)(currently_testing + i);
-				}
+			ctx->cur_op = op;
+			ctx->num_blocks = (op == OP_WRITE) ? last_block - 1 : last_block;
+			ctx->currently_testing = first_block;
+			if (ctx->resume) {
+				ctx->currently_testing = ctx->resume_block;
+				ctx->resume = FALSE;
 			}
-			got = do_read(hDrive, read_buffer, tryout, block_size,
-				       currently_testing);
-			if (got == 0 && tryout == 1)
-				bb_count += bb_output(currently_testing++, READ_ERROR);
-			currently_testing += got;
-			if (got != tryout) {
-				tryout = 1;
-				if (recover_block == ~0)
-					recover_block = currently_testing -
-						got + blocks_at_once;
-				continue;
-			} else if (currently_testing == recover_block) {
-				tryout = blocks_at_once;
-				recover_block = ~0;
+			next_block = ctx->currently_testing;
+
+			// Fill the queue
+			for (slot = 0; (slot < nb_slots) && (next_block < last_block); slot++) {
+				req_block[slot] = next_block;
+				req_count[slot] = min(blocks_at_once, last_block - next_block);
+				if (op == OP_WRITE)
+					fill_request(ctx, buffer + slot * req_size, block_size,
+						req_block[slot], req_count[slot], add_ids, id_offset);
+				issue_request(hQueue, slot, op == OP_WRITE, buffer + slot * req_size, block_size,
+					req_block[slot], req_count[slot]);
+				next_block += req_count[slot];
 			}
-			for (i=0; i < got; i++) {
-				if (memcmp(read_buffer + i * block_size,
-					   buffer + i * block_size,
-					   block_size))
-					bb_count += bb_output(currently_testing+i-got, CORRUPTION_ERROR);
+
+			// Reap the requests in order, and reissue each slot for the next range
+			for (slot = 0; ctx->currently_testing < last_block; slot = (slot + 1) % nb_slots) {
+				if (ctx->cancel_ops) {
+					journal_save(ctx);
+					goto out;
+				}
+				if (max_bb && bb_count >= max_bb) {
+					if (s_flag || v_flag) {
+						uprintf("%s%s", ctx->prefix, abort_msg);
+						fprintf(log_fd, "%s%s", ctx->log_prefix, abort_msg);
+						fflush(log_fd);
+					}
+					ctx->cancel_ops = -1;
+					// No point in resuming a test that was aborted
+					journal_delete(ctx);
+					goto out;
+				}
+				bb_count += reap_request(ctx, hQueue, slot, op == OP_WRITE, buffer + slot * req_size,
+					block_size, req_block[slot], req_count[slot], add_ids, id_offset);
+				ctx->currently_testing += req_count[slot];
+				if (GetTickCount64() > ctx->journal_time + BB_JOURNAL_INTERVAL)
+					journal_save(ctx);
+				if (next_block < last_block) {
+					req_block[slot] = next_block;
+					req_count[slot] = min(blocks_at_once, last_block - next_block);
+					if (op == OP_WRITE)
+						fill_request(ctx, buffer + slot * req_size, block_size,
+							req_block[slot], req_count[slot], add_ids, id_offset);
+					issue_request(hQueue, slot, op == OP_WRITE, buffer + slot * req_size, block_size,
+						req_block[slot], req_count[slot]);
+					next_block += req_count[slot];
+				}
 			}
-			if (v_flag > 1)
-				print_status();
 		}
 
-		num_blocks = 0;
+		ctx->num_blocks = 0;
 	}
 out:
+	// Must be closed before the buffers get freed, as it waits for in-flight requests
+	CloseAsyncQueue(hQueue);
 	free_buffer(buffer);
 	return bb_count;
 }
 
-BOOL BadBlocks(HANDLE hPhysicalDrive, ULONGLONG disk_size, int nb_passes,
-			   int flash_type, badblocks_report *report, FILE* fd)
+/*
+ * Batch scheduler: drives are handed out to a pool of worker threads (sized to the number
+ * of cores), each drive with its own I/O queue. Drives that sit behind the same hub or
+ * controller share a budget of BB_GROUP_QUEUE_DEPTH requests in flight, which is split
+ * between them in proportion to what their USB link can sustain (or evenly, if we don't
+ * know), so that a slow drive cannot hog the bandwidth of its siblings. The drives that
+ * should take the longest, from their size and link speed, are handed out first, so that
+ * they don't end up being started last, when there are more drives than workers.
+ */
+static bb_drive *batch_drives;
+static int batch_num_drives, batch_nb_passes, batch_flash_type, *batch_order;
+static volatile LONG batch_next;
+
+static void test_drive(bb_context *ctx, bb_drive *drive)
 {
-	errcode_t error_code;
-	blk64_t last_block = disk_size / BADBLOCK_BLOCK_SIZE;
+	blk64_t last_block = drive->disk_size / BADBLOCK_BLOCK_SIZE;
+
+	drive->report.bb_count = test_rw(ctx, last_block, BADBLOCK_BLOCK_SIZE, 0, BB_BLOCKS_AT_ONCE,
+		batch_flash_type, batch_nb_passes);
+	drive->report.num_read_errors = ctx->num_read_errors;
+	drive->report.num_write_errors = ctx->num_write_errors;
+	drive->report.num_corruption_errors = ctx->num_corruption_errors;
+	drive->completed = !ctx->cancel_ops || drive->report.bb_count;
+	if (!ctx->cancel_ops)
+		journal_delete(ctx);
+	PrintIoHeatmap(ctx->heatmap, ctx->prefix);
+	ctx->num_blocks = 0;
+}
 
-	if (report == NULL) return FALSE;
-	num_read_errors = 0;
-	num_write_errors = 0;
-	num_corruption_errors = 0;
-	report->bb_count = 0;
+static void test_drives(void)
+{
+	LONG i;
+
+	while ((i = InterlockedIncrement(&batch_next) - 1) < batch_num_drives)
+		test_drive(&bb_ctx[batch_order[i]], &batch_drives[batch_order[i]]);
+}
+
+/* Order the drives by decreasing estimate of the time they should take */
+static void order_drives(bb_drive *drives, int num_drives)
+{
+	int i, j, k;
+	uint32_t max_speed = 1;
+	double *duration = calloc(num_drives, sizeof(double));
+
+	for (i = 0; i < num_drives; i++) {
+		batch_order[i] = i;
+		max_speed = max(max_speed, drives[i].link_speed);
+	}
+	if (duration == NULL)
+		return;
+	// Drives we don't know the link of (non USB) are assumed to be as fast as the fastest one
+	for (i = 0; i < num_drives; i++)
+		duration[i] = (double)drives[i].disk_size / ((drives[i].link_speed != 0) ? drives[i].link_speed : max_speed);
+	for (i = 1; i < num_drives; i++) {
+		k = batch_order[i];
+		for (j = i; (j > 0) && (duration[batch_order[j - 1]] < duration[k]); j--)
+			batch_order[j] = batch_order[j - 1];
+		batch_order[j] = k;
+	}
+	free(duration);
+}
+
+/* Share of the group queue depth that a drive gets, according to the link speeds */
+static int group_queue_depth(bb_drive *drives, int num_drives, int i)
+{
+	int j, group_size = 0;
+	uint64_t group_speed = 0;
+	BOOL known = TRUE;
+
+	if (num_drives == 1)
+		return BB_QUEUE_DEPTH;
+	for (j = 0; j < num_drives; j++) {
+		if (drives[j].group != drives[i].group)
+			continue;
+		group_size++;
+		group_speed += drives[j].link_speed;
+		known = known && (drives[j].link_speed != 0);
+	}
+	if (!known)
+		return max(1, min(BB_QUEUE_DEPTH, BB_GROUP_QUEUE_DEPTH / group_size));
+	return (int)max(1, min(BB_QUEUE_DEPTH, (BB_GROUP_QUEUE_DEPTH * (uint64_t)drives[i].link_speed) / group_speed));
+}
+
+static DWORD WINAPI BadBlocksWorkerThread(void* param)
+{
+	test_drives();
+	ExitThread(0);
+}
+
+BOOL BadBlocksBatch(bb_drive *drives, int num_drives, int nb_passes, int flash_type, FILE* fd)
+{
+	BOOL r = FALSE;
+	int i, j, num_workers = 0;
+	HANDLE worker[BB_MAX_WORKERS];
+	SYSTEM_INFO si;
+	bb_badblocks_iterate iter;
+	blk64_t start, count;
+
+	if ((drives == NULL) || (num_drives <= 0))
+		return FALSE;
 	if (fd != NULL) {
 		log_fd = fd;
 	} else {
 		log_fd = freopen(NULL, "w", stderr);
 	}
 
-	error_code = bb_badblocks_list_create(&bb_list, 0);
-	if (error_code) {
-		uprintf("%sError %d while creating in-memory bad blocks list", bb_prefix, error_code);
+	bb_ctx = (bb_context*)_mm_malloc(num_drives * sizeof(bb_context), 16);
+	if (bb_ctx == NULL) {
+		uprintf("%sCould not allocate the drive contexts", bb_prefix);
 		return FALSE;
 	}
+	memset(bb_ctx, 0, num_drives * sizeof(bb_context));
+	for (i = 0; i < num_drives; i++) {
+		drives[i].completed = FALSE;
+		memset(&drives[i].report, 0, sizeof(drives[i].report));
+		bb_ctx[i].hDrive = drives[i].hDrive;
+		if (num_drives == 1) {
+			static_strcpy(bb_ctx[i].prefix, bb_prefix);
+		} else {
+			static_sprintf(bb_ctx[i].prefix, "Bad Blocks [Disk %d]: ", (int)drives[i].index);
+			static_sprintf(bb_ctx[i].log_prefix, "Disk %d: ", (int)drives[i].index);
+		}
+		bb_ctx[i].queue_depth = group_queue_depth(drives, num_drives, i);
+		if (bb_badblocks_list_create(&bb_ctx[i].bb_list) != 0) {
+			uprintf("%sError while creating in-memory bad blocks list", bb_ctx[i].prefix);
+			goto out;
+		}
+		bb_ctx[i].id = drives[i].id;
+		bb_ctx[i].disk_size = drives[i].disk_size;
+		bb_ctx[i].flash_type = flash_type;
+		bb_ctx[i].nb_passes = nb_passes;
+		bb_ctx[i].heatmap = CreateIoHeatmap(drives[i].disk_size);
+		journal_init(&bb_ctx[i]);
+		journal_load(&bb_ctx[i], drives[i].disk_size / BADBLOCK_BLOCK_SIZE);
+	}
+	batch_order = calloc(num_drives, sizeof(int));
+	if (batch_order == NULL) {
+		uprintf("%sCould not allocate the drive order", bb_prefix);
+		goto out;
+	}
+	order_drives(drives, num_drives);
+	bb_num_ctx = num_drives;
+	batch_drives = drives;
+	batch_num_drives = num_drives;
+	batch_nb_passes = nb_passes;
+	batch_flash_type = flash_type;
+	batch_next = 0;
 
-	cancel_ops = 0;
 	/* use a timer to update status every second */
 	SetTimer(hMainDialog, TID_BADBLOCKS_UPDATE, 1000, alarm_intr);
-	report->bb_count = test_rw(hPhysicalDrive, last_block, BADBLOCK_BLOCK_SIZE, 0, BB_BLOCKS_AT_ONCE, flash_type, nb_passes);
+	if (num_drives == 1) {
+		test_drives();
+	} else {
+		GetSystemInfo(&si);
+		num_workers = min(num_drives, min(BB_MAX_WORKERS, (int)max(1, si.dwNumberOfProcessors)));
+		uprintf("%sTesting %d drives with %d worker threads", bb_prefix, num_drives, num_workers);
+		for (i = 0; i < num_workers; i++) {
+			worker[i] = CreateThread(NULL, 0, BadBlocksWorkerThread, NULL, 0, NULL);
+			if (worker[i] == NULL) {
+				uprintf("%sUnable to start worker thread: %s", bb_prefix, WindowsErrorString());
+				break;
+			}
+			SetThreadClass(worker[i], THREAD_CLASS_IO, i);
+		}
+		num_workers = i;
+		// Use this thread, if we couldn't get any worker
+		if (num_workers == 0)
+			test_drives();
+		else
+			WaitForMultipleObjects(num_workers, worker, TRUE, INFINITE);
+		for (i = 0; i < num_workers; i++)
+			CloseHandle(worker[i]);
+	}
 	KillTimer(hMainDialog, TID_BADBLOCKS_UPDATE);
-	free(bb_list->list);
-	free(bb_list);
-	report->num_read_errors = num_read_errors;
-	report->num_write_errors = num_write_errors;
-	report->num_corruption_errors = num_corruption_errors;
 
-	if ((cancel_ops) && (!report->bb_count))
+	// Aggregated report, with the list of bad blocks of each drive
+	if (num_drives > 1) {
+		for (i = 0; i < num_drives; i++) {
+			uprintf("%s%s: %d bad block%s found (%d/%d/%d errors)", bb_ctx[i].prefix,
+				drives[i].completed ? "Completed" : "Interrupted",
+				drives[i].report.bb_count, (drives[i].report.bb_count == 1) ? "" : "s",
+				drives[i].report.num_read_errors, drives[i].report.num_write_errors,
+				drives[i].report.num_corruption_errors);
+			fprintf(log_fd, "\nDisk %d: %s, %d bad block(s) found (%d/%d/%d errors)\n",
+				(int)drives[i].index, drives[i].completed ? "completed" : "interrupted",
+				drives[i].report.bb_count, drives[i].report.num_read_errors,
+				drives[i].report.num_write_errors, drives[i].report.num_corruption_errors);
+			if (bb_badblocks_list_iterate_begin(bb_ctx[i].bb_list, &iter) == 0) {
+				while (bb_u64_list_iterate_extent(iter, &start, &count)) {
+					if (count == 1)
+						fprintf(log_fd, "  %" PRIu64 "\n", start);
+					else
+						fprintf(log_fd, "  %" PRIu64 "-%" PRIu64 "\n", start, start + count - 1);
+				}
+				bb_badblocks_list_iterate_end(iter);
+			}
+		}
+		fflush(log_fd);
+	}
+	r = TRUE;
+	for (i = 0; i < num_drives; i++)
+		r = r && drives[i].completed;
+
+out:
+	bb_num_ctx = 0;
+	for (i = 0; i < num_drives; i++) {
+		if (bb_ctx[i].bb_list != NULL) {
+			// Hand the bad blocks over to the caller, for ext file systems
+			drives[i].report.extents = NULL;
+			drives[i].report.num_extents = 0;
+			if ((drives[i].completed) && (bb_ctx[i].bb_list->num_extents != 0) &&
+				(bb_badblocks_list_iterate_begin(bb_ctx[i].bb_list, &iter) == 0)) {
+				drives[i].report.extents = calloc(bb_ctx[i].bb_list->num_extents, sizeof(bb_extent));
+				for (j = 0; (drives[i].report.extents != NULL) && bb_u64_list_iterate_extent(iter,
+					&drives[i].report.extents[j].start, &drives[i].report.extents[j].count); j++);
+				drives[i].report.num_extents = (drives[i].report.extents != NULL) ? j : 0;
+				bb_badblocks_list_iterate_end(iter);
+			}
+			bb_badblocks_list_free(bb_ctx[i].bb_list);
+		}
+		drives[i].report.heatmap = bb_ctx[i].heatmap;
+	}
+	_mm_free(bb_ctx);
+	bb_ctx = NULL;
+	safe_free(batch_order);
+	return r;
+}
+
+void FreeBadBlocksReport(badblocks_report *report)
+{
+	if (report == NULL)
+		return;
+	safe_free(report->extents);
+	safe_free(report->heatmap);
+	memset(report, 0, sizeof(*report));
+}
+
+BOOL BadBlocks(HANDLE hPhysicalDrive, ULONGLONG disk_size, const char* id, int nb_passes,
+			   int flash_type, badblocks_report *report, FILE* fd)
+{
+	bb_drive drive = { 0 };
+
+	if (report == NULL) return FALSE;
+	drive.hDrive = hPhysicalDrive;
+	drive.disk_size = disk_size;
+	drive.id = id;
+	BadBlocksBatch(&drive, 1, nb_passes, flash_type, fd);
+	*report = drive.report;
+	return drive.completed;
+}
+
+/*
+ * Quick capacity check, for the detection of fake drives (that report more space than they
+ * actually have, and either drop or wrap around the writes that land past their real size).
+ * Rather than going through the whole surface, we write a few thousand uniquely tagged units,
+ * at a logarithmic and random spread of the drive, read them back and then bisect the boundary
+ * between the last unit that can be trusted and the first one that can't.
+ * Because the address decoder of a fake drive usually wraps data by ignoring the high bits of
+ * the address, each probe also gets its power of two "twins" (same address with the high bits
+ * masked). These are written after the probe, so that an aliased probe reads back a twin's tag.
+ */
+static uint64_t cap_nonce;
+static uint8_t *cap_buf = NULL, *cap_ref = NULL;
+static DWORD cap_unit_size, cap_sector_size;
+
+static int cap_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+/* Generate the (unique to this run) data for a specific unit */
+static void cap_fill(uint8_t *buffer, uint64_t unit)
+{
+	size_t i;
+	uint64_t *p = (uint64_t*)buffer;
+
+	p[0] = BB_CAP_MAGIC;
+	p[1] = cap_nonce;
+	p[2] = unit;
+	for (i = 3; i < cap_unit_size / sizeof(uint64_t); i++)
+		p[i] = mix64(cap_nonce + unit * 0x9e3779b97f4a7c15ULL + i);
+}
+
+static void cap_write(HANDLE hDrive, uint64_t unit)
+{
+	cap_fill(cap_buf, unit);
+	// Write errors are not fatal, as some fakes reject the writes past their real capacity,
+	// in which case the read back will fail to validate.
+	write_sectors(hDrive, cap_sector_size, unit * (cap_unit_size / cap_sector_size),
+		cap_unit_size / cap_sector_size, cap_buf);
+}
+
+static BOOL cap_check(HANDLE hDrive, uint64_t unit)
+{
+	if (read_sectors(hDrive, cap_sector_size, unit * (cap_unit_size / cap_sector_size),
+		cap_unit_size / cap_sector_size, cap_buf) != (int64_t)cap_unit_size)
+		return FALSE;
+	cap_fill(cap_ref, unit);
+	return (memcmp(cap_buf, cap_ref, cap_unit_size) == 0);
+}
+
+/* Write a unit along with its twins */
+static void cap_write_twins(HANDLE hDrive, uint64_t unit)
+{
+	uint64_t k;
+
+	cap_write(hDrive, unit);
+	for (k = BB_CAP_MIN_ALIAS / cap_unit_size; k < unit; k <<= 1)
+		cap_write(hDrive, unit & (k - 1));
+}
+
+static void cap_progress(float percent)
+{
+	PrintInfo(0, MSG_328, percent);
+	UpdateProgress(OP_BADBLOCKS, percent);
+}
+
+/*
+ * Returns FALSE if the check could not be carried out, otherwise real_size is set to the
+ * number of bytes, from the start of the drive, that can actually store data.
+ */
+BOOL CheckCapacity(HANDLE hPhysicalDrive, ULONGLONG disk_size, DWORD sector_size, ULONGLONG *real_size)
+{
+	BOOL r = FALSE;
+	size_t i, j, n = 0, steps = 0;
+	uint64_t *probes = NULL, *p, num_units, k, lo, hi, mid;
+
+	if ((real_size == NULL) || (sector_size == 0))
+		return FALSE;
+	cap_sector_size = sector_size;
+	cap_unit_size = max(sector_size, BB_SYS_PAGE_SIZE);
+	num_units = disk_size / cap_unit_size;
+	if (num_units < 2)
 		return FALSE;
-	return TRUE;
+	*real_size = disk_size;
+
+	// Log spread (2 probes per power of two), first and last units, random probes, and then
+	// at most 64 twins for each of the above.
+	probes = malloc((2 * 64 + 2 + BB_CAP_RANDOM_PROBES) * 65 * sizeof(uint64_t));
+	cap_buf = allocate_buffer(cap_unit_size);
+	cap_ref = allocate_buffer(cap_unit_size);
+	if ((probes == NULL) || (cap_buf == NULL) || (cap_ref == NULL)) {
+		uprintf("Capacity check: Could not allocate buffers");
+		goto out;
+	}
+	cap_nonce = mix64(GetTickCount64() ^ ((uint64_t)time(NULL) << 32));
+	probes[n++] = 0;
+	probes[n++] = num_units - 1;
+	for (k = 1; k < num_units; k <<= 1) {
+		probes[n++] = k;
+		if ((k > 1) && (k + k / 2 < num_units))
+			probes[n++] = k + k / 2;
+	}
+	for (i = 0; i < BB_CAP_RANDOM_PROBES; i++)
+		probes[n++] = mix64(cap_nonce + i + 1) % num_units;
+	for (i = 0, j = n; i < j; i++) {
+		for (k = BB_CAP_MIN_ALIAS / cap_unit_size; k < probes[i]; k <<= 1)
+			probes[n++] = probes[i] & (k - 1);
+	}
+	qsort(probes, n, sizeof(uint64_t), cap_cmp);
+	for (i = 1, j = 1; i < n; i++) {
+		if (probes[i] != probes[j - 1])
+			probes[j++] = probes[i];
+	}
+	n = j;
+	uprintf("Capacity check: Probing %d locations (%s units)", (int)n,
+		SizeToHumanReadable(cap_unit_size, TRUE, FALSE));
+
+	// Write the probes from the top, so that the twins (lower addresses) are written last
+	for (i = n; i > 0; i--) {
+		if (IS_ERROR(FormatStatus))
+			goto out;
+		cap_write(hPhysicalDrive, probes[i - 1]);
+		if ((i % 64) == 0)
+			cap_progress(45.0f * (n - i) / n);
+	}
+	FlushFileBuffers(hPhysicalDrive);
+
+	// Only the lowest failing probe matters
+	for (i = 0; i < n; i++) {
+		if (IS_ERROR(FormatStatus))
+			goto out;
+		if (!cap_check(hPhysicalDrive, probes[i]))
+			break;
+		if ((i % 64) == 0)
+			cap_progress(45.0f + 45.0f * i / n);
+	}
+	if (i >= n) {
+		uprintf("Capacity check: All locations could be read back");
+		r = TRUE;
+		goto out;
+	}
+	p = (uint64_t*)cap_buf;
+	if ((p[0] == BB_CAP_MAGIC) && (p[1] == cap_nonce))
+		uprintf("Capacity check: Unit %" PRIu64 " reads back the data of unit %" PRIu64, probes[i], p[2]);
+	else
+		uprintf("Capacity check: Unit %" PRIu64 " could not be read back", probes[i]);
+	if (i == 0) {
+		*real_size = 0;
+		r = TRUE;
+		goto out;
+	}
+
+	// Bisect the boundary between the last good and first bad probes
+	lo = probes[i - 1];
+	hi = probes[i];
+	while (hi - lo > 1) {
+		if (IS_ERROR(FormatStatus))
+			goto out;
+		mid = lo + (hi - lo) / 2;
+		cap_write_twins(hPhysicalDrive, mid);
+		FlushFileBuffers(hPhysicalDrive);
+		if (cap_check(hPhysicalDrive, mid))
+			lo = mid;
+		else
+			hi = mid;
+		cap_progress(min(90.0f + (float)(++steps) / 4.0f, 99.0f));
+	}
+	*real_size = hi * cap_unit_size;
+	uprintf("Capacity check: Only the first %s (%" PRIu64 " bytes) can store data",
+		SizeToHumanReadable(*real_size, TRUE, FALSE), *real_size);
+	r = TRUE;
+
+out:
+	free(probes);
+	free_buffer(cap_buf);
+	free_buffer(cap_ref);
+	cap_buf = NULL;
+	cap_ref = NULL;
+	return r;
 }
@@ -22,6 +22,7 @@
 #include <stdint.h>
 
 #include "ext2fs/ext2fs.h"
+#include "drive.h"
 
 typedef struct bb_struct_u64_list         *bb_badblocks_list;
 typedef struct bb_struct_u64_iterate      *bb_badblocks_iterate;
@@ -36,23 +37,60 @@ typedef struct bb_struct_u64_iterate      *bb_u64_iterate;
 	if ((struct)->magic != (code)) return (code)
 #define BB_BAD_BLOCKS_THRESHOLD           256
 #define BB_BLOCKS_AT_ONCE                 64
+#define BB_QUEUE_DEPTH                    5
+#define BB_GROUP_QUEUE_DEPTH              8
+#define BB_MAX_WORKERS                    MAXIMUM_WAIT_OBJECTS
+#define BB_PATTERN_CYCLE                  96
 #define BB_SYS_PAGE_SIZE                  4096
+#define BB_JOURNAL_MAGIC                  "RUFUSBBJ"
+#define BB_JOURNAL_VERSION                2
+#define BB_JOURNAL_INTERVAL               60000	// Checkpoint every minute
+#define BB_JOURNAL_REWRITE_BLOCKS         8
+#define BB_CAP_MAGIC                      0x5041435355465552ULL	// "RUFUSCAP"
+#define BB_CAP_RANDOM_PROBES              64
+#define BB_CAP_MIN_ALIAS                  (1024 * 1024)
 
 enum error_types { READ_ERROR, WRITE_ERROR, CORRUPTION_ERROR };
 enum op_type { OP_READ, OP_WRITE };
 
 /*
- * Badblocks report
+ * Badblocks report. The bad blocks (in BADBLOCK_BLOCK_SIZE units) are only provided
+ * for tests that completed, and must be released with FreeBadBlocksReport().
  */
+typedef struct {
+	uint64_t start;
+	uint64_t count;
+} bb_extent;
+
 typedef struct {
 	uint32_t bb_count;
 	uint32_t num_read_errors;
 	uint32_t num_write_errors;
 	uint32_t num_corruption_errors;
+	uint32_t num_extents;
+	bb_extent *extents;
+	IO_HEATMAP *heatmap;		// Per zone timings of the test (may be NULL)
 } badblocks_report;
 
+/*
+ * Drive to be tested in a batch
+ */
+typedef struct {
+	HANDLE hDrive;
+	ULONGLONG disk_size;
+	DWORD index;				// Drive index, for the report
+	const char* id;				// Device ID, for checkpoints (may be NULL)
+	int group;					// Drives behind the same hub or controller share a group
+	uint32_t link_speed;		// Throughput ceiling of the USB link, in KB/s (0 if unknown)
+	BOOL completed;
+	badblocks_report report;
+} bb_drive;
+
 /*
  * Shared prototypes
  */
-BOOL BadBlocks(HANDLE hPhysicalDrive, ULONGLONG disk_size, int nb_passes,
+BOOL BadBlocks(HANDLE hPhysicalDrive, ULONGLONG disk_size, const char* id, int nb_passes,
 	int flash_type, badblocks_report *report, FILE* fd);
+void FreeBadBlocksReport(badblocks_report *report);
+BOOL BadBlocksBatch(bb_drive *drives, int num_drives, int nb_passes, int flash_type, FILE* fd);
+BOOL CheckCapacity(HANDLE hPhysicalDrive, ULONGLONG disk_size, DWORD sector_size, ULONGLONG *real_size);
@@ -0,0 +1,488 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Drive I/O benchmark
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The benchmark measures, on the physical drive:
+ * - the sequential read and write throughput, for a range of block sizes
+ * - the sequential write throughput, for a range of queue depths
+ * - the 4K random read and write IOPS, at QD1 and at the largest queue depth we support
+ * - the sustained sequential write throughput, until the write cache of the drive
+ *   (e.g. the SLC cache of flash media) is exhausted, if that happens early enough
+ * This is destructive, as the write tests overwrite the drive from its beginning.
+ *
+ * The results are logged and exported as JSON, and the smallest block size and queue
+ * depth that get close to the best sequential write throughput are saved for the drive
+ * model, so that WriteDrive() can use them the next time an image is written to it.
+ */
+
+#ifdef _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#include <windows.h>
+#include <windowsx.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <ctype.h>
+
+#include "rufus.h"
+#include "missing.h"
+#include "resource.h"
+#include "msapi_utf8.h"
+#include "localization.h"
+
+#include "drive.h"
+#include "winio.h"
+#include "settings.h"
+
+extern StrArray DriveId;
+
+#define BENCH_SEQ_SIZE              (512 * MB)	// Maximum amount of data for a sequential test
+#define BENCH_SEQ_DURATION          5000		// Maximum duration of a sequential test (in ms)
+#define BENCH_SEQ_QUEUE_DEPTH       4			// Queue depth for the block size tests
+#define BENCH_RANDOM_BLOCK_SIZE     (4 * KB)
+#define BENCH_RANDOM_AREA           (1 * GB)	// Random accesses are spread over that much of the drive
+#define BENCH_RANDOM_DURATION       5000
+#define BENCH_MAX_IN_FLIGHT         (128 * MB)	// Data in flight is capped by our buffer size
+#define BENCH_SUSTAINED_SIZE        (32 * GB)
+#define BENCH_SUSTAINED_DURATION    180000
+#define BENCH_SAMPLE_INTERVAL       1000		// Sustained write throughput sampling (in ms)
+#define BENCH_MAX_SAMPLES           (BENCH_SUSTAINED_DURATION / BENCH_SAMPLE_INTERVAL + 1)
+#define BENCH_CACHE_CLIFF_RATIO     0.5f		// A cache is exhausted when throughput drops below this...
+#define BENCH_CACHE_CLIFF_SAMPLES   3			// ...for that many consecutive samples
+#define BENCH_POST_CLIFF_SAMPLES    5			// Samples to measure once the cache is exhausted
+#define BENCH_TUNE_TOLERANCE        0.95f		// Prefer smaller settings within 5% of the best throughput
+#define BENCH_MAX_RESULTS           24
+
+static const DWORD block_sizes[] = { 128 * KB, 1 * MB, 4 * MB, 16 * MB, 32 * MB };
+static const DWORD queue_depths[] = { 1, 2, 4, 8, MAX_ASYNC_QUEUE_DEPTH - 1 };
+
+typedef struct {
+	const char* name;
+	BOOL write;
+	BOOL random;
+	DWORD block_size;
+	DWORD queue_depth;
+	uint64_t bytes;
+	uint64_t ops;
+	uint64_t duration_us;
+} bench_result;
+
+typedef struct {
+	uint64_t bytes;
+	uint64_t duration_us;
+	uint64_t initial_speed;
+	uint64_t cache_size;		// 0 if the write cache wasn't exhausted
+	uint64_t post_cache_speed;
+	uint64_t sample[BENCH_MAX_SAMPLES];
+	int nb_samples;
+	int nb_low;
+	BOOL done;
+} bench_sustained;
+
+typedef struct {
+	HANDLE hQueue;
+	uint8_t* buffer;
+	uint64_t disk_size;
+	uint64_t rand_state;
+	uint64_t offset[MAX_ASYNC_QUEUE_DEPTH];
+	BOOL pending[MAX_ASYNC_QUEUE_DEPTH];
+} bench_ctx;
+
+static __inline uint64_t BenchRand(bench_ctx* ctx)
+{
+	// xorshift64
+	ctx->rand_state ^= ctx->rand_state << 13;
+	ctx->rand_state ^= ctx->rand_state >> 7;
+	ctx->rand_state ^= ctx->rand_state << 17;
+	return ctx->rand_state;
+}
+
+static __inline uint64_t BenchSpeed(uint64_t bytes, uint64_t duration_us)
+{
+	return (duration_us == 0) ? 0 : (bytes * 1000000ULL) / duration_us;
+}
+
+// The settings key the tuned I/O parameters of a drive model are saved under
+static BOOL GetTunedDriveIOKey(DWORD DriveIndex, char* key, size_t key_size)
+{
+	int i;
+	const char *id = NULL, *p;
+	uint32_t hash = 2166136261U;
+
+	for (i = 0; i < ComboBox_GetCount(hDeviceList); i++) {
+		if ((DWORD)ComboBox_GetItemData(hDeviceList, i) == DriveIndex) {
+			id = (i < (int)DriveId.Index) ? DriveId.String[i] : NULL;
+			break;
+		}
+	}
+	if (id == NULL)
+		return FALSE;
+	// The model is identified by the device instance ID without its serial (last) part
+	p = strrchr(id, '\\');
+	if (p == NULL)
+		p = &id[strlen(id)];
+	// FNV-1a
+	for (; id < p; id++)
+		hash = (hash ^ (uint8_t)toupper(*id)) * 16777619U;
+	safe_sprintf(key, key_size, "%s_%08X", SETTING_TUNED_DRIVE_IO, hash);
+	return TRUE;
+}
+
+/*
+ * Return the buffer size and queue depth that the benchmark found to be the best for
+ * writing to the model of the drive at DriveIndex, if it was benchmarked before.
+ * The parameters are left untouched otherwise.
+ */
+BOOL GetTunedDriveIO(DWORD DriveIndex, DWORD* buf_size, int* queue_depth)
+{
+	char key[64];
+	int32_t val;
+
+	if (!GetTunedDriveIOKey(DriveIndex, key, sizeof(key)))
+		return FALSE;
+	val = ReadSetting32(key);
+	if ((val <= 0) || ((val & 0xff) == 0) || ((val & 0xff) >= MAX_ASYNC_QUEUE_DEPTH))
+		return FALSE;
+	*buf_size = (DWORD)(val >> 8) * KB;
+	*queue_depth = val & 0xff;
+	return TRUE;
+}
+
+// Save the best buffer size and queue depth for writing to the model of the drive at DriveIndex
+BOOL SetTunedDriveIO(DWORD DriveIndex, DWORD buf_size, int queue_depth)
+{
+	char key[64];
+
+	if ((buf_size < KB) || (queue_depth <= 0) || (queue_depth >= MAX_ASYNC_QUEUE_DEPTH) ||
+		!GetTunedDriveIOKey(DriveIndex, key, sizeof(key)))
+		return FALSE;
+	return WriteSetting32(key, (int32_t)(((buf_size / KB) << 8) | queue_depth));
+}
+
+static BOOL BenchIssue(bench_ctx* ctx, bench_result* r, DWORD slot, uint64_t area, uint64_t* offset)
+{
+	if (r->random) {
+		ctx->offset[slot] = (BenchRand(ctx) % (area / r->block_size)) * r->block_size;
+	} else {
+		if (*offset + r->block_size > area)
+			*offset = 0;
+		ctx->offset[slot] = *offset;
+		*offset += r->block_size;
+	}
+	ctx->pending[slot] = IssueAsyncQueue(ctx->hQueue, slot, r->write,
+		&ctx->buffer[(size_t)slot * r->block_size], r->block_size, ctx->offset[slot]);
+	if (!ctx->pending[slot])
+		uprintf("Benchmark: Could not %s %s at offset 0x%llx: %s", r->write ? "write" : "read",
+			SizeToHumanReadable(r->block_size, FALSE, FALSE), ctx->offset[slot], WindowsErrorString());
+	return ctx->pending[slot];
+}
+
+static void BenchSample(bench_sustained* s, uint64_t bytes, uint64_t speed)
+{
+	int i;
+
+	if (s->nb_samples >= BENCH_MAX_SAMPLES) {
+		s->done = TRUE;
+		return;
+	}
+	s->sample[s->nb_samples++] = speed;
+	// The initial throughput is the best of the first samples
+	if (s->nb_samples <= BENCH_CACHE_CLIFF_SAMPLES) {
+		s->initial_speed = max(s->initial_speed, speed);
+		return;
+	}
+	if (s->cache_size == 0) {
+		s->nb_low = (speed < (uint64_t)(BENCH_CACHE_CLIFF_RATIO * s->initial_speed)) ? s->nb_low + 1 : 0;
+		if (s->nb_low >= BENCH_CACHE_CLIFF_SAMPLES) {
+			// The cache was exhausted when the first of the slow samples started
+			s->cache_size = bytes;
+			for (i = 0; i < BENCH_CACHE_CLIFF_SAMPLES; i++)
+				s->cache_size -= s->sample[s->nb_samples - 1 - i] * BENCH_SAMPLE_INTERVAL / 1000;
+		}
+	} else if (++s->nb_low >= BENCH_CACHE_CLIFF_SAMPLES + BENCH_POST_CLIFF_SAMPLES) {
+		for (i = 0; i < BENCH_POST_CLIFF_SAMPLES; i++)
+			s->post_cache_speed += s->sample[s->nb_samples - 1 - i];
+		s->post_cache_speed /= BENCH_POST_CLIFF_SAMPLES;
+		s->done = TRUE;
+	}
+}
+
+/*
+ * Run a single test, until max_bytes have been transferred or max_duration has elapsed.
+ * Requests are kept in flight on queue_depth slots, that each use their own part of
+ * the buffer, and are spread over the area at the beginning of the drive.
+ */
+static BOOL BenchRun(bench_ctx* ctx, bench_result* r, uint64_t area, uint64_t max_bytes,
+	DWORD max_duration, bench_sustained* s)
+{
+	BOOL ret = FALSE;
+	DWORD slot, size, in_flight = 0;
+	uint64_t offset = 0, issued = 0, start, now, last_sample, sample_bytes = 0;
+
+	r->bytes = 0;
+	r->ops = 0;
+	area = (area / r->block_size) * r->block_size;
+	if (area == 0)
+		return FALSE;
+	start = GetIoTimestamp();
+	last_sample = start;
+	for (slot = 0; slot < r->queue_depth; slot++) {
+		if (!BenchIssue(ctx, r, slot, area, &offset))
+			goto out;
+		issued += r->block_size;
+		in_flight++;
+	}
+	for (slot = 0; in_flight > 0; slot = (slot + 1) % r->queue_depth) {
+		if (!ctx->pending[slot])
+			continue;
+		ctx->pending[slot] = FALSE;
+		in_flight--;
+		if ((!WaitAsyncQueue(ctx->hQueue, slot, DRIVE_ACCESS_TIMEOUT, &size)) || (size != r->block_size)) {
+			uprintf("Benchmark: Could not %s %s at offset 0x%llx: %s", r->write ? "write" : "read",
+				SizeToHumanReadable(r->block_size, FALSE, FALSE), ctx->offset[slot], WindowsErrorString());
+			goto out;
+		}
+		r->bytes += size;
+		r->ops++;
+		now = GetIoTimestamp();
+		if ((s != NULL) && (now - last_sample >= BENCH_SAMPLE_INTERVAL * 1000ULL)) {
+			BenchSample(s, r->bytes, BenchSpeed(r->bytes - sample_bytes, now - last_sample));
+			sample_bytes = r->bytes;
+			last_sample = now;
+		}
+		if (IS_ERROR(FormatStatus) || (issued >= max_bytes) || (now - start >= max_duration * 1000ULL) ||
+			((s != NULL) && s->done))
+			continue;
+		if (!BenchIssue(ctx, r, slot, area, &offset))
+			goto out;
+		issued += r->block_size;
+		in_flight++;
+	}
+	r->duration_us = GetIoTimestamp() - start;
+	ret = TRUE;
+
+out:
+	CancelAsyncQueue(ctx->hQueue);
+	memset(ctx->pending, 0, sizeof(ctx->pending));
+	if (!ret && !IS_ERROR(FormatStatus))
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | (r->write ? ERROR_WRITE_FAULT : ERROR_READ_FAULT);
+	return ret;
+}
+
+static void BenchLog(bench_result* r)
+{
+	uint64_t speed = BenchSpeed(r->bytes, r->duration_us);
+
+	uprintf("  %-12s %8s QD%-2d %10s/s %8llu IOPS", r->name, SizeToHumanReadable(r->block_size, FALSE, FALSE),
+		r->queue_depth, SizeToHumanReadable(speed, FALSE, FALSE), BenchSpeed(r->ops, r->duration_us));
+}
+
+static void BenchExport(DWORD DriveIndex, bench_result* result, int nb_results, bench_sustained* s,
+	DWORD tuned_size, DWORD tuned_depth)
+{
+	char path[MAX_PATH], *userdir;
+	SYSTEMTIME lt;
+	FILE* fd;
+	int i;
+
+	userdir = getenvU("USERPROFILE");
+	GetLocalTime(&lt);
+	static_sprintf(path, "%s\\rufus_%04d%02d%02d_%02d%02d%02d_disk%d_benchmark.json", userdir,
+		lt.wYear, lt.wMonth, lt.wDay, lt.wHour, lt.wMinute, lt.wSecond, (int)(DriveIndex - DRIVE_INDEX_MIN));
+	safe_free(userdir);
+	fd = fopenU(path, "w");
+	if (fd == NULL) {
+		uprintf("Could not create '%s'", path);
+		return;
+	}
+	fprintf(fd, "{\n  \"disk_size\": %llu,\n  \"sector_size\": %u,\n  \"tests\": [\n",
+		SelectedDrive.DiskSize, SelectedDrive.SectorSize);
+	for (i = 0; i < nb_results; i++)
+		fprintf(fd, "    { \"name\": \"%s\", \"block_size\": %u, \"queue_depth\": %u, \"bytes\": %llu, "
+			"\"duration_us\": %llu, \"speed_bps\": %llu, \"iops\": %llu }%s\n", result[i].name,
+			result[i].block_size, result[i].queue_depth, result[i].bytes, result[i].duration_us,
+			BenchSpeed(result[i].bytes, result[i].duration_us), BenchSpeed(result[i].ops, result[i].duration_us),
+			(i < nb_results - 1) ? "," : "");
+	fprintf(fd, "  ],\n  \"sustained_write\": {\n    \"bytes\": %llu,\n    \"duration_us\": %llu,\n"
+		"    \"initial_speed_bps\": %llu,\n    \"cache_size\": %llu,\n    \"post_cache_speed_bps\": %llu,\n"
+		"    \"samples_bps\": [", s->bytes, s->duration_us, s->initial_speed, s->cache_size, s->post_cache_speed);
+	for (i = 0; i < s->nb_samples; i++)
+		fprintf(fd, "%s%llu", (i == 0) ? "" : ", ", s->sample[i]);
+	fprintf(fd, "]\n  },\n  \"tuned\": { \"buffer_size\": %u, \"queue_depth\": %u }\n}\n", tuned_size, tuned_depth);
+	fclose(fd);
+	uprintf("Benchmark results saved as '%s'", path);
+}
+
+/*
+ * Benchmark the drive and save the I/O parameters that work best for writing to it.
+ * THIS DESTROYS THE DATA ON THE DRIVE.
+ */
+BOOL BenchmarkDrive(HANDLE hPhysicalDrive, DWORD DriveIndex)
+{
+	BOOL ret = FALSE;
+	int i, j, test = 0, nb_tests, nb_results = 0;
+	uint64_t speed, best_speed;
+	DWORD tuned_size = 0, tuned_depth = 0, max_depth, random_size;
+	bench_ctx ctx = { 0 };
+	bench_result result[BENCH_MAX_RESULTS] = { 0 }, r;
+	bench_sustained* sustained = NULL;
+
+	if (SelectedDrive.SectorSize < 512) {
+		uprintf("Unexpected sector size (%d) - Aborting", SelectedDrive.SectorSize);
+		return FALSE;
+	}
+	nb_tests = 2 * ARRAYSIZE(block_sizes) + ARRAYSIZE(queue_depths) + 4 + 1;
+	random_size = max(BENCH_RANDOM_BLOCK_SIZE, SelectedDrive.SectorSize);
+	ctx.disk_size = SelectedDrive.DiskSize;
+	ctx.rand_state = GetIoTimestamp() | 1;
+	sustained = calloc(1, sizeof(bench_sustained));
+	ctx.buffer = (uint8_t*)AllocIoBuffer(BENCH_MAX_IN_FLIGHT);
+	if ((sustained == NULL) || (ctx.buffer == NULL)) {
+		uprintf("Could not allocate benchmark buffer");
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+		goto out;
+	}
+	// Don't let drives that compress or deduplicate data look faster than they are
+	for (i = 0; i < BENCH_MAX_IN_FLIGHT / sizeof(uint64_t); i++)
+		((uint64_t*)ctx.buffer)[i] = BenchRand(&ctx);
+	ctx.hQueue = CreateAsyncQueue(hPhysicalDrive, GENERIC_READ | GENERIC_WRITE, MAX_ASYNC_QUEUE_DEPTH);
+	if (ctx.hQueue == NULL) {
+		uprintf("Could not create benchmark queue: %s", WindowsErrorString());
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+		goto out;
+	}
+	if (((ASYNC_QUEUE*)ctx.hQueue)->bSync)
+		uprintf("Notice: Could not reopen drive for overlapped I/O - Queue depths will have no effect");
+
+	uprintf("Benchmarking %s drive (%d bytes per sector):", SizeToHumanReadable(SelectedDrive.DiskSize, FALSE, FALSE),
+		SelectedDrive.SectorSize);
+
+	// Sequential read, then write, for each block size
+	for (j = 0; j < 2; j++) {
+		best_speed = 0;
+		for (i = 0; i < ARRAYSIZE(block_sizes); i++) {
+			PrintInfo(0, MSG_332, (100.0f * test) / nb_tests);
+			UpdateProgress(OP_FORMAT, (100.0f * test++) / nb_tests);
+			r.name = (j == 0) ? "seq_read" : "seq_write";
+			r.write = (j != 0);
+			r.random = FALSE;
+			r.block_size = block_sizes[i];
+			r.queue_depth = min(BENCH_SEQ_QUEUE_DEPTH, BENCH_MAX_IN_FLIGHT / block_sizes[i]);
+			if (!BenchRun(&ctx, &r, min(ctx.disk_size, BENCH_SEQ_SIZE), BENCH_SEQ_SIZE, BENCH_SEQ_DURATION, NULL))
+				goto out;
+			CHECK_FOR_USER_CANCEL;
+			BenchLog(&r);
+			result[nb_results++] = r;
+			speed = BenchSpeed(r.bytes, r.duration_us);
+			if (r.write && (speed > best_speed)) {
+				best_speed = speed;
+				tuned_size = r.block_size;
+			}
+		}
+	}
+	// Use the smallest block size that gets close enough to the best write throughput
+	for (i = nb_results - ARRAYSIZE(block_sizes); i < nb_results; i++) {
+		if (BenchSpeed(result[i].bytes, result[i].duration_us) >= (uint64_t)(BENCH_TUNE_TOLERANCE * best_speed)) {
+			tuned_size = result[i].block_size;
+			break;
+		}
+	}
+
+	// Sequential write queue depth sweep, with that block size
+	best_speed = 0;
+	max_depth = BENCH_MAX_IN_FLIGHT / tuned_size;
+	for (i = 0; i < ARRAYSIZE(queue_depths); i++) {
+		PrintInfo(0, MSG_332, (100.0f * test) / nb_tests);
+		UpdateProgress(OP_FORMAT, (100.0f * test++) / nb_tests);
+		if (queue_depths[i] > max_depth)
+			continue;
+		r.name = "seq_write_qd";
+		r.write = TRUE;
+		r.random = FALSE;
+		r.block_size = tuned_size;
+		r.queue_depth = queue_depths[i];
+		if (!BenchRun(&ctx, &r, min(ctx.disk_size, BENCH_SEQ_SIZE), BENCH_SEQ_SIZE, BENCH_SEQ_DURATION, NULL))
+			goto out;
+		CHECK_FOR_USER_CANCEL;
+		BenchLog(&r);
+		result[nb_results++] = r;
+		speed = BenchSpeed(r.bytes, r.duration_us);
+		if (speed > best_speed)
+			best_speed = speed;
+	}
+	for (i = nb_results - 1; (i >= 0) && (strcmp(result[i].name, "seq_write_qd") == 0); i--) {
+		if (BenchSpeed(result[i].bytes, result[i].duration_us) >= (uint64_t)(BENCH_TUNE_TOLERANCE * best_speed))
+			tuned_depth = result[i].queue_depth;
+	}
+	if (tuned_depth == 0)
+		tuned_depth = 1;
+
+	// 4K random read, then write, at QD1 and at our maximum queue depth
+	for (j = 0; j < 4; j++) {
+		PrintInfo(0, MSG_332, (100.0f * test) / nb_tests);
+		UpdateProgress(OP_FORMAT, (100.0f * test++) / nb_tests);
+		r.name = (j < 2) ? "rand_read" : "rand_write";
+		r.write = (j >= 2);
+		r.random = TRUE;
+		r.block_size = random_size;
+		r.queue_depth = (j % 2 == 0) ? 1 : MAX_ASYNC_QUEUE_DEPTH;
+		if (!BenchRun(&ctx, &r, min(ctx.disk_size, BENCH_RANDOM_AREA), UINT64_MAX, BENCH_RANDOM_DURATION, NULL))
+			goto out;
+		CHECK_FOR_USER_CANCEL;
+		BenchLog(&r);
+		result[nb_results++] = r;
+	}
+
+	// Sustained write, with the tuned parameters, until the write cache is exhausted
+	PrintInfo(0, MSG_332, (100.0f * test) / nb_tests);
+	UpdateProgress(OP_FORMAT, (100.0f * test++) / nb_tests);
+	r.name = "sustained";
+	r.write = TRUE;
+	r.random = FALSE;
+	r.block_size = tuned_size;
+	r.queue_depth = tuned_depth;
+	if (!BenchRun(&ctx, &r, ctx.disk_size, min(ctx.disk_size, BENCH_SUSTAINED_SIZE), BENCH_SUSTAINED_DURATION, sustained))
+		goto out;
+	CHECK_FOR_USER_CANCEL;
+	sustained->bytes = r.bytes;
+	sustained->duration_us = r.duration_us;
+	BenchLog(&r);
+	if (sustained->cache_size != 0)
+		uprintf("  Write cache exhausted after %s: %s/s → %s/s", SizeToHumanReadable(sustained->cache_size, FALSE, FALSE),
+			SizeToHumanReadable(sustained->initial_speed, FALSE, FALSE), SizeToHumanReadable(sustained->post_cache_speed, FALSE, FALSE));
+	else
+		uprintf("  No write cache exhaustion detected after %s", SizeToHumanReadable(sustained->bytes, FALSE, FALSE));
+	UpdateProgress(OP_FORMAT, 100.0f);
+
+	uprintf("Best write parameters for this drive: %s buffers, queue depth %d",
+		SizeToHumanReadable(tuned_size, FALSE, FALSE), tuned_depth);
+	SetTunedDriveIO(DriveIndex, tuned_size, tuned_depth);
+	BenchExport(DriveIndex, result, nb_results, sustained, tuned_size, tuned_depth);
+	ret = TRUE;
+
+out:
+	CloseAsyncQueue(ctx.hQueue);
+	FreeIoBuffer(ctx.buffer);
+	free(sustained);
+	return ret;
+}
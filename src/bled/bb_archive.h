@@ -215,6 +215,7 @@ typedef struct transformer_state_t {
 	const char  *dst_dir;               /* if non-NULL, extract to dir */
 	char        *dst_name;
 	uint64_t    dst_size;
+	uint64_t    skip_output;            /* number of output bytes to discard, when resuming */
 	size_t      mem_output_size_max;    /* if non-zero, decompress to RAM instead of fd */
 	size_t      mem_output_size;
 	char        *mem_output_buf;
@@ -260,6 +261,7 @@ static inline int transformer_switch_file(transformer_state_t* xstate)
 }
 
 IF_DESKTOP(long long) int inflate_unzip(transformer_state_t *xstate) FAST_FUNC;
+IF_DESKTOP(long long) int inflate_unzip_from_buffer(unsigned char *in, unsigned in_size, char *out, size_t out_size, uint32_t *crc) FAST_FUNC;
 IF_DESKTOP(long long) int unpack_zip_stream(transformer_state_t *xstate) FAST_FUNC;
 IF_DESKTOP(long long) int unpack_Z_stream(transformer_state_t *xstate) FAST_FUNC;
 IF_DESKTOP(long long) int unpack_gz_stream(transformer_state_t *xstate) FAST_FUNC;
@@ -267,6 +269,7 @@ IF_DESKTOP(long long) int unpack_bz2_stream(transformer_state_t *xstate) FAST_FU
 IF_DESKTOP(long long) int unpack_lzma_stream(transformer_state_t *xstate) FAST_FUNC;
 IF_DESKTOP(long long) int unpack_xz_stream(transformer_state_t *xstate) FAST_FUNC;
 IF_DESKTOP(long long) int unpack_vtsi_stream(transformer_state_t *xstate) FAST_FUNC;
+IF_DESKTOP(long long) int unpack_zstd_stream(transformer_state_t *xstate) FAST_FUNC;
 
 char* append_ext(char *filename, const char *expected_ext) FAST_FUNC;
 int bbunpack(char **argv,
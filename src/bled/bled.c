@@ -23,6 +23,9 @@ uint64_t bb_total_rb;
 printf_t bled_printf = NULL;
 read_t bled_read = NULL;
 write_t bled_write = NULL;
+seek_t bled_seek = NULL;
+alloc_t bled_alloc = NULL;
+free_t bled_free = NULL;
 progress_t bled_progress = NULL;
 switch_t bled_switch = NULL;
 unsigned long* bled_cancel_request;
@@ -32,6 +35,187 @@ char* bb_virtual_buf = NULL;
 size_t bb_virtual_len = 0, bb_virtual_pos = 0;
 int bb_virtual_fd = -1;
 
+/*
+ * The large decoder buffers come from the allocator set with bled_set_alloc_functions(), if
+ * any, so that the application can pool them across jobs, and from malloc() otherwise or if
+ * that allocator fails. The free function to use is recorded ahead of the buffer, so that it
+ * doesn't matter if the allocator was changed or reset in the meantime.
+ */
+#define BB_LARGE_HEADER_SIZE 16
+
+void* bb_large_alloc(size_t size)
+{
+	uint8_t* ptr = NULL;
+	free_t free_function = free;
+
+	if (size > SIZE_MAX - BB_LARGE_HEADER_SIZE)
+		return NULL;
+	if (bled_alloc != NULL && bled_free != NULL) {
+		ptr = bled_alloc(size + BB_LARGE_HEADER_SIZE);
+		free_function = bled_free;
+	}
+	if (ptr == NULL) {
+		ptr = malloc(size + BB_LARGE_HEADER_SIZE);
+		free_function = free;
+	}
+	if (ptr == NULL)
+		return NULL;
+	*(free_t*)ptr = free_function;
+	return ptr + BB_LARGE_HEADER_SIZE;
+}
+
+void bb_large_free(void* ptr)
+{
+	uint8_t* p = ptr;
+
+	if (p == NULL)
+		return;
+	p -= BB_LARGE_HEADER_SIZE;
+	(*(free_t*)p)(p);
+}
+
+/*
+ * Read-ahead of the source, for the formats that read it sequentially: a dedicated thread
+ * reads large blocks into a ring, starting from where the source is when the decoder first
+ * asks for data, so that the decoder only copies from memory and doesn't wait on the source,
+ * unless the latter is slower than the decoding. The formats that seek the source (zip, xz,
+ * vtsi) read it directly, as does everything when a read function was provided.
+ */
+#define READ_AHEAD_SLOTS        4
+#define READ_AHEAD_SLOT_SIZE    (4 * 1024 * 1024)
+
+int bb_read_ahead_fd = -1;
+static struct {
+	HANDLE hFile;
+	HANDLE hThread;
+	HANDLE hFree, hFull;			/* Semaphores for the slots that can be read into or copied from */
+	uint8_t* buf;
+	int size[READ_AHEAD_SLOTS];		/* Size of the data in a slot: 0 on end of file and -1 on error */
+	int64_t pos;
+	uint32_t next_read, next_copy;
+	int copied;					/* Bytes of the current slot we already copied */
+	bool started, has_slot, done, error;
+	volatile bool stop;
+} read_ahead = { 0 };
+
+static DWORD WINAPI read_ahead_thread(void* param)
+{
+	OVERLAPPED ov;
+	DWORD rs;
+	int i = 0;
+
+	do {
+		WaitForSingleObject(read_ahead.hFree, INFINITE);
+		if (read_ahead.stop)
+			break;
+		i = read_ahead.next_read++ % READ_AHEAD_SLOTS;
+		/* Read at an explicit offset, so that we don't depend on the file pointer */
+		memset(&ov, 0, sizeof(ov));
+		ov.Offset = (DWORD)read_ahead.pos;
+		ov.OffsetHigh = (DWORD)(read_ahead.pos >> 32);
+		rs = 0;
+		if (ReadFile(read_ahead.hFile, &read_ahead.buf[(size_t)i * READ_AHEAD_SLOT_SIZE],
+			READ_AHEAD_SLOT_SIZE, &rs, &ov) || ((GetLastError() == ERROR_IO_PENDING) &&
+			GetOverlappedResult(read_ahead.hFile, &ov, &rs, TRUE)))
+			read_ahead.size[i] = (int)rs;
+		else
+			read_ahead.size[i] = (GetLastError() == ERROR_HANDLE_EOF) ? 0 : -1;
+		read_ahead.pos += rs;
+		ReleaseSemaphore(read_ahead.hFull, 1, NULL);
+	} while (read_ahead.size[i] > 0);
+	return 0;
+}
+
+/* Set up the read-ahead of 'fd', if 'type' reads its source sequentially */
+static void read_ahead_init(int fd, int type)
+{
+	if ((bled_read != NULL) || ((type != BLED_COMPRESSION_LZW) && (type != BLED_COMPRESSION_GZIP) &&
+		(type != BLED_COMPRESSION_LZMA) && (type != BLED_COMPRESSION_BZIP2) && (type != BLED_COMPRESSION_ZSTD)))
+		return;
+	memset(&read_ahead, 0, sizeof(read_ahead));
+	read_ahead.hFile = (HANDLE)_get_osfhandle(fd);
+	if (read_ahead.hFile == INVALID_HANDLE_VALUE)
+		return;
+	bb_read_ahead_fd = fd;
+}
+
+/* Start the read-ahead thread, on the first read of the decoder, or have it read directly */
+static bool read_ahead_start(void)
+{
+	read_ahead.started = true;
+	read_ahead.pos = _lseeki64(bb_read_ahead_fd, 0, SEEK_CUR);
+	read_ahead.buf = malloc((size_t)READ_AHEAD_SLOTS * READ_AHEAD_SLOT_SIZE);
+	read_ahead.hFree = CreateSemaphore(NULL, READ_AHEAD_SLOTS, READ_AHEAD_SLOTS, NULL);
+	read_ahead.hFull = CreateSemaphore(NULL, 0, READ_AHEAD_SLOTS, NULL);
+	if ((read_ahead.pos >= 0) && (read_ahead.buf != NULL) && (read_ahead.hFree != NULL) && (read_ahead.hFull != NULL))
+		read_ahead.hThread = CreateThread(NULL, 0, read_ahead_thread, NULL, 0, NULL);
+	return (read_ahead.hThread != NULL);
+}
+
+/* Stop the read-ahead thread, which only ever waits for a free slot or for a read to complete */
+static void read_ahead_exit(void)
+{
+	if (bb_read_ahead_fd < 0)
+		return;
+	if (read_ahead.hThread != NULL) {
+		read_ahead.stop = true;
+		ReleaseSemaphore(read_ahead.hFree, 1, NULL);
+		WaitForSingleObject(read_ahead.hThread, INFINITE);
+		CloseHandle(read_ahead.hThread);
+	}
+	if (read_ahead.hFree != NULL)
+		CloseHandle(read_ahead.hFree);
+	if (read_ahead.hFull != NULL)
+		CloseHandle(read_ahead.hFull);
+	free(read_ahead.buf);
+	memset(&read_ahead, 0, sizeof(read_ahead));
+	bb_read_ahead_fd = -1;
+}
+
+/* Copy up to 'count' bytes of the source from the read-ahead ring */
+int bb_read_ahead(void* buf, unsigned int count)
+{
+	int i, size, rb = 0;
+
+	if (!read_ahead.started && !read_ahead_start())
+		bb_printf("Could not start the read-ahead of the source");
+	if (read_ahead.hThread == NULL)
+		return _read(bb_read_ahead_fd, buf, count);
+	while ((rb < (int)count) && !read_ahead.done) {
+		if (!read_ahead.has_slot) {
+			while (WaitForSingleObject(read_ahead.hFull, 100) == WAIT_TIMEOUT) {
+				if ((bled_cancel_request != NULL) && (*bled_cancel_request != 0)) {
+					errno = EINTR;
+					return -1;
+				}
+			}
+			read_ahead.has_slot = true;
+			read_ahead.copied = 0;
+		}
+		i = read_ahead.next_copy % READ_AHEAD_SLOTS;
+		if (read_ahead.size[i] <= 0) {
+			/* The end of file or error is reported to all further reads */
+			read_ahead.done = true;
+			read_ahead.error = (read_ahead.size[i] < 0);
+			break;
+		}
+		size = MIN((int)count - rb, read_ahead.size[i] - read_ahead.copied);
+		memcpy((uint8_t*)buf + rb, &read_ahead.buf[(size_t)i * READ_AHEAD_SLOT_SIZE + read_ahead.copied], size);
+		rb += size;
+		read_ahead.copied += size;
+		if (read_ahead.copied == read_ahead.size[i]) {
+			read_ahead.has_slot = false;
+			read_ahead.next_copy++;
+			ReleaseSemaphore(read_ahead.hFree, 1, NULL);
+		}
+	}
+	if ((rb == 0) && read_ahead.error) {
+		errno = EIO;
+		return -1;
+	}
+	return rb;
+}
+
 static long long int unpack_none(transformer_state_t *xstate)
 {
 	bb_error_msg("This compression type is not supported");
@@ -48,6 +232,7 @@ unpacker_t unpacker[BLED_COMPRESSION_MAX] = {
 	unpack_xz_stream,
 	unpack_none,
 	unpack_vtsi_stream,
+	unpack_zstd_stream,
 };
 
 /* Uncompress file 'src', compressed using 'type', to file 'dst' */
@@ -84,14 +269,17 @@ int64_t bled_uncompress(const char* src, const char* dst, int type)
 		goto err;
 	}
 
+	read_ahead_init(xstate.src_fd, type);
 	if (setjmp(bb_error_jmp))
 		goto err;
 	ret = unpacker[type](&xstate);
+	read_ahead_exit();
 	_close(xstate.src_fd);
 	_close(xstate.dst_fd);
 	return ret;
 
 err:
+	read_ahead_exit();
 	if (xstate.src_fd > 0)
 		_close(xstate.src_fd);
 	if (xstate.dst_fd > 0)
@@ -101,8 +289,15 @@ err:
 
 /* Uncompress using Windows handles */
 int64_t bled_uncompress_with_handles(HANDLE hSrc, HANDLE hDst, int type)
+{
+	return bled_uncompress_with_handles_from(hSrc, hDst, type, 0);
+}
+
+/* Uncompress using Windows handles, discarding the first 'offset' bytes of output */
+int64_t bled_uncompress_with_handles_from(HANDLE hSrc, HANDLE hDst, int type, uint64_t offset)
 {
 	transformer_state_t xstate;
+	int64_t ret;
 
 	if (!bled_initialized) {
 		bb_error_msg("The library has not been initialized");
@@ -114,6 +309,7 @@ int64_t bled_uncompress_with_handles(HANDLE hSrc, HANDLE hDst, int type)
 	xstate.src_fd = -1;
 	xstate.dst_fd = -1;
 	xstate.check_signature = 1;
+	xstate.skip_output = offset;
 
 	xstate.src_fd = _open_osfhandle((intptr_t)hSrc, _O_RDONLY);
 	if (xstate.src_fd < 0) {
@@ -132,9 +328,14 @@ int64_t bled_uncompress_with_handles(HANDLE hSrc, HANDLE hDst, int type)
 		return -1;
 	}
 
-	if (setjmp(bb_error_jmp))
+	read_ahead_init(xstate.src_fd, type);
+	if (setjmp(bb_error_jmp)) {
+		read_ahead_exit();
 		return -1;
-	return unpacker[type](&xstate);
+	}
+	ret = unpacker[type](&xstate);
+	read_ahead_exit();
+	return ret;
 }
 
 /* Uncompress file 'src', compressed using 'type', to buffer 'buf' of size 'size' */
@@ -271,6 +472,174 @@ int64_t bled_uncompress_from_buffer_to_buffer(const char* src, const size_t src_
 	return ret;
 }
 
+/* Read 'len' bytes at offset 'off' of 'fd', without going through the read callbacks */
+static bool probe_read(int fd, int64_t off, void* buf, unsigned int len)
+{
+	if (_lseeki64(fd, off, SEEK_SET) != off)
+		return false;
+	return (_read(fd, buf, len) == (int)len);
+}
+
+/* Decode an xz multibyte integer from 'buf', advancing 'pos' */
+static bool xz_get_vli(const uint8_t* buf, size_t len, size_t* pos, uint64_t* val)
+{
+	int i;
+
+	*val = 0;
+	for (i = 0; (i < 9) && (*pos < len); i++) {
+		*val |= (uint64_t)(buf[*pos] & 0x7F) << (7 * i);
+		if ((buf[(*pos)++] & 0x80) == 0)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Walk the xz streams backwards from the end of the file, summing the uncompressed
+ * sizes recorded in each stream index. Only the footers and indexes get read.
+ */
+static int64_t xz_uncompressed_size(int fd, int64_t file_size)
+{
+	static const uint8_t xz_header_magic[6] = { 0xFD, '7', 'z', 'X', 'Z', 0x00 };
+	uint8_t footer[12], *index = NULL;
+	uint64_t nb_records, unpadded, uncompressed, blocks_size;
+	int64_t pos = file_size, total = 0;
+	uint32_t index_size;
+	size_t i;
+
+	while (pos > 0) {
+		/* Skip stream padding */
+		while ((pos >= 4) && probe_read(fd, pos - 4, footer, 4) && (get_le32(footer) == 0))
+			pos -= 4;
+		if ((pos < 24) || !probe_read(fd, pos - 12, footer, sizeof(footer)) ||
+			(footer[10] != 'Y') || (footer[11] != 'Z'))
+			goto err;
+		index_size = (get_le32(&footer[4]) + 1) * 4;
+		if ((index_size > 16 * 1024 * 1024) || (pos < 24 + (int64_t)index_size))
+			goto err;
+		index = malloc(index_size);
+		if ((index == NULL) || !probe_read(fd, pos - 12 - index_size, index, index_size) || (index[0] != 0x00))
+			goto err;
+		i = 1;
+		if (!xz_get_vli(index, index_size, &i, &nb_records))
+			goto err;
+		for (blocks_size = 0; nb_records > 0; nb_records--) {
+			if (!xz_get_vli(index, index_size, &i, &unpadded) || !xz_get_vli(index, index_size, &i, &uncompressed))
+				goto err;
+			blocks_size += (unpadded + 3) & ~3ULL;
+			total += uncompressed;
+		}
+		free(index);
+		index = NULL;
+		pos -= 12 + (int64_t)index_size + (int64_t)blocks_size + 12;
+		if ((pos < 0) || !probe_read(fd, pos, footer, sizeof(footer)) ||
+			(memcmp(footer, xz_header_magic, sizeof(xz_header_magic)) != 0))
+			goto err;
+	}
+	return total;
+
+err:
+	free(index);
+	return -1;
+}
+
+/*
+ * Read the uncompressed size of the first entry from the zip central directory,
+ * which, unlike the local header, is always filled (even when streamed).
+ */
+static int64_t zip_uncompressed_size(int fd, int64_t file_size)
+{
+	uint8_t buf[46], *eocd = NULL;
+	uint16_t fn_len, extra_len, id, sz;
+	uint64_t cd_offset, size;
+	int64_t eocd_offset;
+	int i, len;
+
+	len = (file_size < 0xFFFF + 22) ? (int)file_size : 0xFFFF + 22;
+	eocd = malloc(len);
+	if ((eocd == NULL) || !probe_read(fd, file_size - len, eocd, len))
+		goto err;
+	for (i = len - 22; (i >= 0) && (get_le32(&eocd[i]) != 0x06054b50); i--);
+	if (i < 0)
+		goto err;
+	eocd_offset = file_size - len + i;
+	cd_offset = get_le32(&eocd[i + 16]);
+	free(eocd);
+	eocd = NULL;
+	if (cd_offset == 0xFFFFFFFF) {
+		/* Zip64 end of central directory locator, then record */
+		if ((eocd_offset < 20) || !probe_read(fd, eocd_offset - 20, buf, 20) || (get_le32(buf) != 0x07064b50))
+			goto err;
+		if (!probe_read(fd, get_le64(&buf[8]), buf, 56) || (get_le32(buf) != 0x06064b50))
+			goto err;
+		cd_offset = get_le64(&buf[48]);
+	}
+	if (!probe_read(fd, cd_offset, buf, 46) || (get_le32(buf) != 0x02014b50))
+		goto err;
+	size = get_le32(&buf[24]);
+	fn_len = get_le16(&buf[28]);
+	extra_len = get_le16(&buf[30]);
+	if (size != 0xFFFFFFFF)
+		return (int64_t)size;
+	/* The zip64 extended information starts with the uncompressed size when present */
+	eocd = malloc(extra_len);
+	if ((eocd == NULL) || !probe_read(fd, cd_offset + 46 + fn_len, eocd, extra_len))
+		goto err;
+	for (i = 0; i + 4 <= extra_len; i += 4 + sz) {
+		id = get_le16(&eocd[i]);
+		sz = get_le16(&eocd[i + 2]);
+		if ((id == 0x0001) && (sz >= 8) && (i + 4 + 8 <= extra_len)) {
+			size = get_le64(&eocd[i + 4]);
+			free(eocd);
+			return (int64_t)size;
+		}
+	}
+
+err:
+	free(eocd);
+	return -1;
+}
+
+/*
+ * Return the uncompressed size of file 'src', compressed using 'type', by parsing
+ * the container metadata only, or -1 if it can't be determined this way.
+ */
+int64_t bled_get_uncompressed_size(const char* src, int type)
+{
+	int fd;
+	int64_t file_size, ret = -1;
+
+	if (!bled_initialized) {
+		bb_error_msg("The library has not been initialized");
+		return -1;
+	}
+
+	if (src == NULL) {
+		bb_error_msg("Invalid parameter");
+		return -1;
+	}
+
+	fd = _openU(src, _O_RDONLY | _O_BINARY, 0);
+	if (fd < 0)
+		return -1;
+	file_size = _lseeki64(fd, 0, SEEK_END);
+	if (file_size > 0) {
+		switch (type) {
+		case BLED_COMPRESSION_XZ:
+			ret = xz_uncompressed_size(fd, file_size);
+			break;
+		case BLED_COMPRESSION_ZIP:
+			ret = zip_uncompressed_size(fd, file_size);
+			break;
+		default:
+			/* gzip only records the size modulo 2^32, and others don't record it at all */
+			break;
+		}
+	}
+	_close(fd);
+	return ret;
+}
+
 /* Initialize the library.
  * When the parameters are not NULL you can:
  * - specify the printf-like function you want to use to output message
@@ -297,10 +666,34 @@ int bled_init(printf_t print_function, read_t read_function, write_t write_funct
 	return 0;
 }
 
+/* Set the function to use to position the output, for the formats that seek it (vtsi),
+ * so that it can be used along with a write function that doesn't use the file offset:
+ *   int64_t seek_function(int fd, int64_t offset);
+ * which must return the new offset. Must be called after bled_init(). */
+void bled_set_seek_function(seek_t seek_function)
+{
+	bled_seek = seek_function;
+}
+
+/* Set the functions to use for the large decoder buffers, i.e. the LZMA and xz dictionaries,
+ * the bzip2 block buffers and the multithreaded xz block buffers:
+ *   void* alloc_function(size_t size);
+ *   void free_function(void* ptr);
+ * where alloc_function() may return NULL, in which case malloc() is used instead.
+ * Must be called after bled_init(). */
+void bled_set_alloc_functions(alloc_t alloc_function, free_t free_function)
+{
+	bled_alloc = alloc_function;
+	bled_free = free_function;
+}
+
 /* This call frees any resource used by the library */
 void bled_exit(void)
 {
 	bled_printf = NULL;
+	bled_seek = NULL;
+	bled_alloc = NULL;
+	bled_free = NULL;
 	bled_progress = NULL;
 	bled_switch = NULL;
 	bled_cancel_request = NULL;
@@ -308,5 +701,9 @@ void bled_exit(void)
 		free(global_crc32_table);
 		global_crc32_table = NULL;
 	}
+	if (global_crc64_table) {
+		free(global_crc64_table);
+		global_crc64_table = NULL;
+	}
 	bled_initialized = false;
 }
@@ -19,7 +19,10 @@ typedef void (*printf_t) (const char* format, ...);
 typedef void (*progress_t) (const uint64_t read_bytes);
 typedef int (*read_t)(int fd, void* buf, unsigned int count);
 typedef int (*write_t)(int fd, const void* buf, unsigned int count);
+typedef int64_t (*seek_t)(int fd, int64_t offset);
 typedef void (*switch_t)(const char* filename, const uint64_t size);
+typedef void* (*alloc_t)(size_t size);
+typedef void (*free_t)(void* ptr);
 
 typedef enum {
 	BLED_COMPRESSION_NONE = 0,
@@ -31,6 +34,7 @@ typedef enum {
 	BLED_COMPRESSION_XZ,		// .xz
 	BLED_COMPRESSION_7ZIP,		// .7z
 	BLED_COMPRESSION_VTSI,		// .vtsi
+	BLED_COMPRESSION_ZSTD,		// .zst
 	BLED_COMPRESSION_MAX
 } bled_compression_type;
 
@@ -40,6 +44,10 @@ int64_t bled_uncompress(const char* src, const char* dst, int type);
 /* Uncompress using Windows handles */
 int64_t bled_uncompress_with_handles(HANDLE hSrc, HANDLE hDst, int type);
 
+/* Uncompress using Windows handles, discarding the first 'offset' bytes of output.
+ * Formats that have restart points (multi-block xz) don't decode the data they skip. */
+int64_t bled_uncompress_with_handles_from(HANDLE hSrc, HANDLE hDst, int type, uint64_t offset);
+
 /* Uncompress file 'src', compressed using 'type', to buffer 'buf' of size 'size' */
 int64_t bled_uncompress_to_buffer(const char* src, char* buf, size_t size, int type);
 
@@ -49,6 +57,9 @@ int64_t bled_uncompress_to_dir(const char* src, const char* dir, int type);
 /* Uncompress buffer 'src' of length 'src_len' to buffer 'dst' of size 'dst_len' */
 int64_t bled_uncompress_from_buffer_to_buffer(const char* src, const size_t src_len, char* dst, size_t dst_len, int type);
 
+/* Return the uncompressed size of file 'src', compressed using 'type', from its metadata only, or -1 if unknown */
+int64_t bled_get_uncompressed_size(const char* src, int type);
+
 /* Initialize the library.
  * When the parameters are not NULL you can:
  * - specify the printf-like function you want to use to output message
@@ -63,5 +74,12 @@ int64_t bled_uncompress_from_buffer_to_buffer(const char* src, const size_t src_
 int bled_init(printf_t print_function, read_t read_function, write_t write_function,
     progress_t progress_function, switch_t switch_function, unsigned long* cancel_request);
 
+/* Set the function used to position the output, for the formats that don't write it sequentially */
+void bled_set_seek_function(seek_t seek_function);
+
+/* Set the functions used to allocate the large decoder buffers (dictionaries, blocks), so that
+ * the application can keep these around from one job to the next */
+void bled_set_alloc_functions(alloc_t alloc_function, free_t free_function);
+
 /* This call frees any resource used by the library */
 void bled_exit(void);
@@ -93,6 +93,9 @@ struct bunzip_data {
 	int writeCopies, writePos, writeRunCountdown, writeCount;
 	int writeCurrent; /* actually a uint8_t */
 
+	/* Set when decoding a standalone block, to stop at the end of it */
+	int singleBlock;
+
 	/* The CRC values stored in the block header and calculated from the data */
 	uint32_t headerCRC, totalCRC, writeCRC;
 
@@ -630,6 +633,11 @@ int FAST_FUNC read_bunzip(bunzip_data *bd, char *outbuf, int len)
 			bd->totalCRC = bd->headerCRC + 1;
 			return RETVAL_LAST_BLOCK;
 		}
+
+		if (bd->singleBlock) {
+			bd->writeCount = RETVAL_LAST_BLOCK;
+			return len;
+		}
 	}
 
 	/* Refill the intermediate buffer by Huffman-decoding next block of input */
@@ -716,7 +724,7 @@ int FAST_FUNC start_bunzip(bunzip_data **bdp, int in_fd,
 	bd->dbufSize = 100000 * (i - h0);
 
 	/* Cannot use xmalloc - may leak bd in NOFORK case! */
-	bd->dbuf = malloc_or_warn(bd->dbufSize * sizeof(bd->dbuf[0]));
+	bd->dbuf = bb_large_alloc(bd->dbufSize * sizeof(bd->dbuf[0]));
 	if (!bd->dbuf) {
 		free(bd);
 		xfunc_die();
@@ -726,11 +734,353 @@ int FAST_FUNC start_bunzip(bunzip_data **bdp, int in_fd,
 
 void FAST_FUNC dealloc_bunzip(bunzip_data *bd)
 {
-	free(bd->dbuf);
+	bb_large_free(bd->dbuf);
 	free(bd);
 }
 
 
+/*
+ * Multithreaded decoding of bzip2 streams. Since bzip2 blocks are independent, but
+ * only aligned on bits, the source is scanned for the 48-bit block and end of stream
+ * magics, and each block is handed to a pool of workers (one per job slot), that
+ * decode it as a standalone block. The output is then written out in order, after
+ * the block CRCs have been combined and validated against the stream CRC.
+ * Since a block magic may also appear in compressed data (with a 2^-48 probability
+ * per bit), a block that unexpectedly runs out of input is reported as an error.
+ */
+#define BZ2_MT_MAX_THREADS      16
+#define BZ2_BLOCK_MAGIC         0x314159265359ULL
+#define BZ2_EOS_MAGIC           0x177245385090ULL
+#define BZ2_MAGIC_MASK          0xFFFFFFFFFFFFULL
+
+typedef struct {
+	HANDLE thread;
+	HANDLE start;
+	HANDLE done;
+	volatile bool quit;
+	uint8_t *in;
+	size_t in_size;
+	size_t in_max;
+	unsigned bit_offset;	/* offset of the block magic in the first byte of 'in' */
+	unsigned dbuf_size;
+	uint8_t *out;
+	size_t out_size;
+	size_t out_max;
+	uint32_t crc;
+	uint32_t stream_crc;
+	bool first_in_stream;
+	bool last_in_stream;
+	int ret;
+} bz2_job_t;
+
+static int bz2_mt_decode_block(bunzip_data *bd, bz2_job_t *job)
+{
+	int i, len, r;
+
+	bd->in_fd = -1;
+	bd->inbuf = job->in;
+	bd->inbufCount = (int)job->in_size;
+	bd->inbufPos = 0;
+	bd->inbufBitCount = 0;
+	bd->inbufBits = 0;
+	bd->writeCopies = 0;
+	bd->writeCount = 0;
+	bd->writeCRC = 0;
+	bd->headerCRC = 0;
+	bd->dbufSize = job->dbuf_size;
+	bd->singleBlock = 1;
+	job->out_size = 0;
+
+	i = setjmp(bd->jmpbuf);
+	if (i)
+		return i;
+	if (job->bit_offset != 0)
+		get_bits(bd, job->bit_offset);
+	while (1) {
+		if (job->out_size == job->out_max) {
+			uint8_t *out = realloc(job->out, job->out_max * 2);
+			if (out == NULL)
+				return RETVAL_OUT_OF_MEMORY;
+			job->out = out;
+			job->out_max *= 2;
+		}
+		len = (int)MIN(job->out_max - job->out_size, INT_MAX);
+		r = read_bunzip(bd, (char *)&job->out[job->out_size], len);
+		if (r < 0)
+			break;
+		job->out_size += len - r;
+		if (r > 0)
+			break;
+	}
+	/* A block that ends right at the end of the buffer is only reported on the next call */
+	if ((r >= 0 || (r == RETVAL_LAST_BLOCK && bd->writeCRC == bd->headerCRC)) && job->out_size != 0) {
+		job->crc = bd->headerCRC;
+		return RETVAL_OK;
+	}
+	return (r < 0) ? r : RETVAL_DATA_ERROR;
+}
+
+static DWORD WINAPI bz2_mt_worker(LPVOID param)
+{
+	bz2_job_t *job = (bz2_job_t *)param;
+	bunzip_data *bd;
+
+	bd = xzalloc(sizeof(bunzip_data));
+	if (bd != NULL) {
+		crc32_filltable(bd->crc32Table, 1);
+		bd->dbuf = bb_large_alloc(900000 * sizeof(bd->dbuf[0]));
+	}
+	while (true) {
+		if (WaitForSingleObject(job->start, INFINITE) != WAIT_OBJECT_0)
+			break;
+		if (job->quit)
+			break;
+		job->ret = (bd == NULL || bd->dbuf == NULL) ? RETVAL_OUT_OF_MEMORY : bz2_mt_decode_block(bd, job);
+		SetEvent(job->done);
+	}
+	if (bd != NULL)
+		dealloc_bunzip(bd);
+	return 0;
+}
+
+static void bz2_mt_free_jobs(bz2_job_t *jobs, size_t nb_jobs)
+{
+	size_t i;
+
+	for (i = 0; i < nb_jobs; i++) {
+		if (jobs[i].thread != NULL) {
+			jobs[i].quit = true;
+			SetEvent(jobs[i].start);
+			WaitForSingleObject(jobs[i].thread, INFINITE);
+			CloseHandle(jobs[i].thread);
+		}
+		if (jobs[i].start != NULL)
+			CloseHandle(jobs[i].start);
+		if (jobs[i].done != NULL)
+			CloseHandle(jobs[i].done);
+		free(jobs[i].in);
+		free(jobs[i].out);
+	}
+	free(jobs);
+}
+
+/* Append a byte to the input of a job that is being filled */
+static inline bool bz2_mt_append(bz2_job_t *job, uint8_t b)
+{
+	if (job->in_size == job->in_max) {
+		uint8_t *in = realloc(job->in, job->in_max * 2);
+		if (in == NULL)
+			return false;
+		job->in = in;
+		job->in_max *= 2;
+	}
+	job->in[job->in_size++] = b;
+	return true;
+}
+
+/* Wait for a job to complete, validate its CRC and write its output */
+static ssize_t bz2_mt_write_job(transformer_state_t *xstate, bz2_job_t *job, uint32_t *combined_crc, size_t index)
+{
+	ssize_t nwrote;
+
+	if (WaitForSingleObject(job->done, INFINITE) != WAIT_OBJECT_0) {
+		bb_error_msg("wait error");
+		return -1;
+	}
+	if (job->ret == RETVAL_UNEXPECTED_INPUT_EOF) {
+		bb_error_msg("unexpected end of block (block %d)", (int)index);
+		return -1;
+	}
+	if (job->ret != RETVAL_OK) {
+		bb_error_msg("bunzip error %d (block %d)", job->ret, (int)index);
+		return -1;
+	}
+	if (job->first_in_stream)
+		*combined_crc = 0;
+	*combined_crc = ((*combined_crc << 1) | (*combined_crc >> 31)) ^ job->crc;
+	if (job->last_in_stream && (*combined_crc != job->stream_crc)) {
+		bb_error_msg("CRC error");
+		return -1;
+	}
+	nwrote = transformer_write(xstate, job->out, job->out_size);
+	if (nwrote < 0)
+		bb_error_msg("write error (errno: %d)", errno);
+	return nwrote;
+}
+
+/*
+ * Returns the number of bytes written, -1 on error, or -2 if the source
+ * doesn't qualify for multithreaded decoding (in which case the source
+ * descriptor is rewound so that the regular decoder can be used).
+ */
+static long long int bz2_mt_decode(transformer_state_t *xstate)
+{
+	enum { BZ2_MT_HEADER, BZ2_MT_BLOCKS, BZ2_MT_STREAM_CRC, BZ2_MT_TRAILER } state = BZ2_MT_HEADER;
+	uint8_t *buf = NULL, header[4];
+	uint64_t reg = 0, magic, bit_pos, start, scan_from = 0, crc_end = 0, offset = 0;
+	uint32_t combined_crc = 0;
+	uint16_t filter[256] = { 0 };
+	size_t i, nb_jobs, next_read = 0, next_write = 0, header_len = 0;
+	unsigned dbuf_size = 0;
+	int s, r, len;
+	long long int n = 0;
+	ssize_t nwrote;
+	bool new_stream = false;
+	bz2_job_t *jobs = NULL, *cur = NULL, *eos_job = NULL;
+	SYSTEM_INFO si;
+
+	/* Only worth it for decompression to a file or device, on multicore systems */
+	GetSystemInfo(&si);
+	if ((xstate->mem_output_size_max != 0) || (xstate->dst_fd < 0) || (si.dwNumberOfProcessors < 2))
+		return -2;
+	if (lseek(xstate->src_fd, 0, SEEK_CUR) != 0)
+		return -2;
+	r = _read(xstate->src_fd, header, sizeof(header));
+	lseek(xstate->src_fd, 0, SEEK_SET);
+	if ((r != sizeof(header)) || (memcmp(header, "BZh", 3) != 0) || (header[3] < '1') || (header[3] > '9'))
+		return -2;
+	nb_jobs = MIN(si.dwNumberOfProcessors, BZ2_MT_MAX_THREADS);
+
+	/*
+	 * Whatever its bit offset in the last byte, a magic always fully covers the 4th
+	 * last byte, so we use that byte to filter the offsets that need to be checked.
+	 */
+	for (s = 0; s < 8; s++) {
+		filter[(BZ2_BLOCK_MAGIC >> (24 - s)) & 0xFF] |= 1 << s;
+		filter[(BZ2_EOS_MAGIC >> (24 - s)) & 0xFF] |= 0x100 << s;
+	}
+
+	buf = malloc(IOBUF_SIZE);
+	jobs = calloc(nb_jobs, sizeof(bz2_job_t));
+	if ((buf == NULL) || (jobs == NULL))
+		goto err;
+	for (i = 0; i < nb_jobs; i++) {
+		/* Enough for a level 9 block in most cases, and grown as needed */
+		jobs[i].in_max = 1024 * 1024;
+		jobs[i].out_max = 1024 * 1024;
+		jobs[i].in = malloc(jobs[i].in_max);
+		jobs[i].out = malloc(jobs[i].out_max);
+		jobs[i].start = CreateEvent(NULL, FALSE, FALSE, NULL);
+		jobs[i].done = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if ((jobs[i].in == NULL) || (jobs[i].out == NULL) || (jobs[i].start == NULL) || (jobs[i].done == NULL))
+			goto err;
+		jobs[i].thread = CreateThread(NULL, 0, bz2_mt_worker, &jobs[i], 0, NULL);
+		if (jobs[i].thread == NULL)
+			goto err;
+	}
+	bb_printf("Using %d threads to decode bzip2 blocks", (int)nb_jobs);
+
+	while (state != BZ2_MT_TRAILER) {
+		len = safe_read(xstate->src_fd, buf, IOBUF_SIZE);
+		if (len < 0)
+			bb_error_msg_and_err("read error (errno: %d)", errno);
+		if (len == 0)
+			break;
+		for (i = 0; (i < (size_t)len) && (state != BZ2_MT_TRAILER); i++) {
+			reg = (reg << 8) | buf[i];
+			bit_pos = ++offset * 8;
+			if ((cur != NULL) && !bz2_mt_append(cur, buf[i]))
+				bb_error_msg_and_err("memory allocation error");
+			switch (state) {
+			case BZ2_MT_HEADER:
+				/* Anything that isn't another "BZh[1-9]" stream is trailing data, that we ignore */
+				header[header_len] = buf[i];
+				if (((header_len < 3) && (buf[i] != "BZh"[header_len])) ||
+					((header_len == 3) && ((buf[i] < '1') || (buf[i] > '9')))) {
+					state = BZ2_MT_TRAILER;
+					break;
+				}
+				if (++header_len == 4) {
+					dbuf_size = 100000 * (buf[i] - '0');
+					scan_from = bit_pos;
+					new_stream = true;
+					state = BZ2_MT_BLOCKS;
+				}
+				break;
+			case BZ2_MT_BLOCKS:
+				/* Look for a magic at each of the bit offsets that this byte completes */
+				if (filter[(reg >> 24) & 0xFF] == 0)
+					break;
+				for (s = 7; s >= 0; s--) {
+					if (((filter[(reg >> 24) & 0xFF] & (0x101 << s)) == 0) || (bit_pos < (uint64_t)s + 48))
+						continue;
+					start = bit_pos - s - 48;
+					if (start < scan_from)
+						continue;
+					magic = (reg >> s) & BZ2_MAGIC_MASK;
+					if ((magic != BZ2_BLOCK_MAGIC) && (magic != BZ2_EOS_MAGIC))
+						continue;
+					if (cur != NULL) {
+						cur->last_in_stream = (magic == BZ2_EOS_MAGIC);
+						SetEvent(cur->start);
+						next_read++;
+					}
+					if (magic == BZ2_EOS_MAGIC) {
+						eos_job = cur;
+						cur = NULL;
+						crc_end = start + 48 + 32;
+						state = BZ2_MT_STREAM_CRC;
+						break;
+					}
+					/* Write out the oldest job if all the slots are busy */
+					if (next_read >= next_write + nb_jobs) {
+						nwrote = bz2_mt_write_job(xstate, &jobs[next_write % nb_jobs], &combined_crc, next_write);
+						if (nwrote < 0)
+							goto err;
+						n += nwrote;
+						next_write++;
+					}
+					cur = &jobs[next_read % nb_jobs];
+					cur->in_size = 0;
+					cur->bit_offset = (unsigned)(start & 7);
+					cur->dbuf_size = dbuf_size;
+					cur->first_in_stream = new_stream;
+					new_stream = false;
+					/* The bytes that hold the magic are still in our register */
+					for (r = (int)((bit_pos - (start & ~7ULL)) / 8); r > 0; r--) {
+						if (!bz2_mt_append(cur, (uint8_t)(reg >> (8 * (r - 1)))))
+							bb_error_msg_and_err("memory allocation error");
+					}
+					scan_from = start + 48;
+				}
+				break;
+			case BZ2_MT_STREAM_CRC:
+				if (bit_pos >= crc_end) {
+					/* Validated once the last block of the stream has been written */
+					if (eos_job != NULL)
+						eos_job->stream_crc = (uint32_t)(reg >> (bit_pos - crc_end));
+					/* Streams are padded to a byte boundary */
+					header_len = 0;
+					state = BZ2_MT_HEADER;
+				}
+				break;
+			default:
+				break;
+			}
+		}
+	}
+	if ((state == BZ2_MT_BLOCKS) || (state == BZ2_MT_STREAM_CRC))
+		bb_error_msg_and_err("unexpected end of data");
+
+	/* Write out the remaining jobs */
+	while (next_write < next_read) {
+		nwrote = bz2_mt_write_job(xstate, &jobs[next_write % nb_jobs], &combined_crc, next_write);
+		if (nwrote < 0)
+			goto err;
+		n += nwrote;
+		next_write++;
+	}
+	bz2_mt_free_jobs(jobs, nb_jobs);
+	free(buf);
+	return n;
+
+err:
+	if (jobs != NULL)
+		bz2_mt_free_jobs(jobs, nb_jobs);
+	free(buf);
+	return -1;
+}
+
 /* Decompress src_fd to dst_fd.  Stops at end of bzip data, not end of file. */
 IF_DESKTOP(long long) int FAST_FUNC
 unpack_bz2_stream(transformer_state_t *xstate)
@@ -740,6 +1090,11 @@ unpack_bz2_stream(transformer_state_t *xstate)
 	char *outbuf;
 	int i, nwrote;
 	unsigned len;
+	long long int mt_written;
+
+	mt_written = bz2_mt_decode(xstate);
+	if (mt_written != -2)
+		return mt_written;
 
 	if (check_signature16(xstate, BZIP2_MAGIC))
 		return -1;
@@ -500,6 +500,131 @@ static void inflate_codes_setup(STATE_PARAM unsigned my_bl, unsigned my_bd)
 	ml = mask_bits[bl];		/* precompute masks for speed */
 	md = mask_bits[bd];
 }
+
+/*
+ * Fast inner loop for inflate_codes(), used as long as there are at least
+ * 8 bytes of input in the bytebuffer and room for a full match (plus the
+ * overrun of our wide copies) in the window, which is the case for the vast
+ * majority of the data. Instead of refilling the bit buffer one byte at a time
+ * with bounds checks, we top up a 64-bit bit buffer with a single unaligned
+ * load, which guarantees that a full length + distance pair (at most 48 bits)
+ * can be decoded without further refill, and we use the leftover bits to
+ * decode more literals from the same refill.
+ * Return 1 if the end of block was reached, 0 if the slow path must take over.
+ */
+#define INFLATE_FAST_MIN_INPUT  8
+#define INFLATE_FAST_OVERRUN    8
+#define INFLATE_FAST_MAX_MATCH  258
+#define INFLATE_FAST_MAX_CODE   15
+static int inflate_codes_fast(STATE_PARAM_ONLY)
+{
+	const unsigned char *in = bytebuffer;
+	unsigned char *win = gunzip_window;
+	const unsigned start = bytebuffer_offset;
+	const unsigned in_end = bytebuffer_size - INFLATE_FAST_MIN_INPUT;
+	const unsigned w_end = GUNZIP_WSIZE - INFLATE_FAST_MAX_MATCH - INFLATE_FAST_OVERRUN;
+	unsigned pos = start, nbits = k, e, len, dist, rewind;
+	uint64_t bits = bb, v;
+	huft_t *t;
+	int ret = 0;
+
+#define CONSUME(n) do { bits >>= (n); nbits -= (n); } while (0)
+	while (pos <= in_end && w <= w_end) {
+		/* Top up to 56-63 bits. The bits above nbits are either zero or
+		 * the same data we OR in again on the next refill, which is fine. */
+		memcpy(&v, &in[pos], sizeof(v));
+		bits |= SWAP_LE64(v) << nbits;
+		pos += (63 - nbits) >> 3;
+		nbits |= 56;
+
+		t = tl + ((unsigned)bits & ml);
+		e = t->e;
+		while (e > 16) {
+			if (e == 99)
+				abort_unzip(PASS_STATE_ONLY);
+			CONSUME(t->b);
+			e -= 16;
+			t = t->v.t + ((unsigned)bits & mask_bits[e]);
+			e = t->e;
+		}
+		CONSUME(t->b);
+		if (e == 16) {
+			win[w++] = (unsigned char)t->v.n;
+			/* Decode more literals (first level lookups only) while we have enough bits */
+			while (nbits >= INFLATE_FAST_MAX_CODE) {
+				t = tl + ((unsigned)bits & ml);
+				if (t->e != 16)
+					break;
+				CONSUME(t->b);
+				win[w++] = (unsigned char)t->v.n;
+			}
+			continue;
+		}
+		if (e == 15) {
+			ret = 1;
+			break;
+		}
+
+		/* Length + distance: at most 15 + 5 + 15 + 13 bits, which we have */
+		len = t->v.n + ((unsigned)bits & mask_bits[e]);
+		CONSUME(e);
+		t = td + ((unsigned)bits & md);
+		e = t->e;
+		while (e > 16) {
+			if (e == 99)
+				abort_unzip(PASS_STATE_ONLY);
+			CONSUME(t->b);
+			e -= 16;
+			t = t->v.t + ((unsigned)bits & mask_bits[e]);
+			e = t->e;
+		}
+		CONSUME(t->b);
+		dist = t->v.n + ((unsigned)bits & mask_bits[e]);
+		CONSUME(e);
+
+		if (dist <= w) {
+			unsigned char *dst = &win[w];
+			const unsigned char *src = dst - dist;
+			w += len;
+			if (dist >= 8) {
+				/* Wide copy, that may overrun by up to 7 bytes */
+				do {
+					memcpy(dst, src, 8);
+					dst += 8;
+					src += 8;
+				} while (dst < &win[w]);
+			} else if (dist == 1) {
+				memset(dst, *src, len);
+			} else {
+				do {
+					*dst++ = *src++;
+				} while (--len);
+			}
+		} else {
+			/* The match wraps around the window */
+			unsigned src = (w - dist) & (GUNZIP_WSIZE - 1);
+			do {
+				win[w++] = win[src];
+				src = (src + 1) & (GUNZIP_WSIZE - 1);
+			} while (--len);
+		}
+	}
+#undef CONSUME
+
+	/* Give back the whole bytes we read ahead, but never more than we loaded here */
+	rewind = nbits >> 3;
+	if (rewind > pos - start)
+		rewind = pos - start;
+	pos -= rewind;
+	nbits -= rewind << 3;
+	bits &= ((uint64_t)1 << nbits) - 1;
+
+	bytebuffer_offset = pos;
+	bb = (unsigned)bits;
+	k = nbits;
+	return ret;
+}
+
 /* called once from inflate_get_next_window */
 static NOINLINE int inflate_codes(STATE_PARAM_ONLY)
 {
@@ -510,6 +635,12 @@ static NOINLINE int inflate_codes(STATE_PARAM_ONLY)
 		goto do_copy;
 
 	while (1) {			/* do until end of block */
+		if (bytebuffer_size - bytebuffer_offset >= INFLATE_FAST_MIN_INPUT
+		 && w <= GUNZIP_WSIZE - INFLATE_FAST_MAX_MATCH - INFLATE_FAST_OVERRUN
+		) {
+			if (inflate_codes_fast(PASS_STATE_ONLY))
+				break;	/* end of block */
+		}
 		bb = fill_bitbuffer(PASS_STATE bb, &k, bl);
 		t = tl + ((unsigned) bb & ml);
 		e = t->e;
@@ -1055,6 +1186,37 @@ inflate_unzip(transformer_state_t *xstate)
 	return n;
 }
 
+/* For the multithreaded unzip, that inflates an entry that was read in memory */
+IF_DESKTOP(long long) int FAST_FUNC
+inflate_unzip_from_buffer(unsigned char *in, unsigned in_size, char *out, size_t out_size, uint32_t *crc)
+{
+	transformer_state_t xs;
+	IF_DESKTOP(long long) int n;
+	DECLARE_STATE;
+
+	ALLOC_STATE;
+	if (state == NULL)
+		return -1;
+
+	memset(&xs, 0, sizeof(xs));
+	xs.src_fd = -1;
+	xs.dst_fd = -1;
+	xs.mem_output_buf = out;
+	/* +1 so that an entry that inflates past out_size is reported */
+	xs.mem_output_size_max = out_size + 1;
+	/* With to_read at 0 and no source descriptor, going past the data is reported as corruption */
+	bytebuffer = in;
+	bytebuffer_offset = 0;
+	bytebuffer_size = in_size;
+	to_read = 0;
+	n = inflate_unzip_internal(PASS_STATE &xs);
+	if ((n >= 0) && ((xs.mem_output_size != out_size) || ((size_t)gunzip_bytes_out != out_size)))
+		n = -1;
+	*crc = ~gunzip_crc;
+	DEALLOC_STATE;
+	return n;
+}
+
 
 /* For gunzip */
 
@@ -1183,11 +1345,233 @@ static int check_header_gzip(STATE_PARAM transformer_state_t *xstate)
 	return 1;
 }
 
+/*
+ * Multithreaded decoding of BGZF files (as produced by bgzip, and which some
+ * tools use for disk images). BGZF is a sequence of regular gzip members of
+ * at most 64 KB each, that record their compressed size in a 'BC' extra field,
+ * which lets us hand whole members to a pool of workers (one per job slot) and
+ * write the results out in order. A non BGZF member is decoded by the regular
+ * single threaded code, since plain multi-member gzip files have no way to
+ * locate the next member without inflating the current one.
+ */
+#define GZ_MT_MAX_THREADS       16
+#define BGZF_MAX_BLOCK_SIZE     0x10000
+/* Fixed part of a gzip header past the magic, plus XLEN */
+#define GZ_HEADER_SIZE          (8 + 2)
+#define GZ_TRAILER_SIZE         8
+
+typedef struct {
+	HANDLE thread;
+	HANDLE start;
+	HANDLE done;
+	volatile bool quit;
+	unsigned char *in;
+	unsigned data_offset;
+	unsigned data_size;
+	char *out;
+	uint32_t out_size;
+	uint32_t crc;
+	int ret;
+} gz_job_t;
+
+/*
+ * Check if the member header at the current bytebuffer position (past the
+ * magic) is a BGZF one and return the size of the rest of the member, or 0.
+ */
+static unsigned bgzf_member_size(STATE_PARAM_ONLY)
+{
+	unsigned char *h;
+	unsigned xlen, i, size = 0;
+
+	if (!top_up(PASS_STATE GZ_HEADER_SIZE))
+		return 0;
+	h = &bytebuffer[bytebuffer_offset];
+	/* Deflate, with only FEXTRA set */
+	if (h[0] != 8 || h[1] != 0x04)
+		return 0;
+	xlen = h[8] | (h[9] << 8);
+	if (!top_up(PASS_STATE GZ_HEADER_SIZE + xlen))
+		return 0;
+	h = &bytebuffer[bytebuffer_offset + GZ_HEADER_SIZE];
+	for (i = 0; i + 4 <= xlen; i += 4 + (h[i + 2] | (h[i + 3] << 8))) {
+		if (h[i] == 'B' && h[i + 1] == 'C' && (h[i + 2] | (h[i + 3] << 8)) == 2 && i + 6 <= xlen) {
+			/* BSIZE is the total member size minus 1, and we've already read the magic */
+			size = (h[i + 4] | (h[i + 5] << 8)) - 1;
+			break;
+		}
+	}
+	return (size > GZ_HEADER_SIZE + xlen + GZ_TRAILER_SIZE && size < BGZF_MAX_BLOCK_SIZE) ? size : 0;
+}
+
+static DWORD WINAPI gz_mt_worker(LPVOID param)
+{
+	gz_job_t *job = (gz_job_t *)param;
+	transformer_state_t xs;
+	DECLARE_STATE;
+
+	while (1) {
+		if (WaitForSingleObject(job->start, INFINITE) != WAIT_OBJECT_0)
+			break;
+		if (job->quit)
+			break;
+		job->ret = -1;
+		ALLOC_STATE;
+		if (state != NULL) {
+			memset(&xs, 0, sizeof(xs));
+			xs.src_fd = -1;
+			xs.dst_fd = -1;
+			xs.mem_output_buf = job->out;
+			/* +1 so that an empty member doesn't mean "write to fd" */
+			xs.mem_output_size_max = job->out_size + 1;
+			/* Inflate straight from the job buffer. With to_read at 0 and no
+			 * source descriptor, going past the data is reported as corruption. */
+			bytebuffer = job->in;
+			bytebuffer_offset = job->data_offset;
+			bytebuffer_size = job->data_offset + job->data_size;
+			to_read = 0;
+			if (inflate_unzip_internal(PASS_STATE &xs) >= 0
+			 && xs.mem_output_size == job->out_size
+			 && (uint32_t)gunzip_bytes_out == job->out_size
+			 && ~gunzip_crc == job->crc
+			)
+				job->ret = 0;
+			DEALLOC_STATE;
+		}
+		SetEvent(job->done);
+	}
+	return 0;
+}
+
+static void gz_mt_free_jobs(gz_job_t *jobs, size_t nb_jobs)
+{
+	size_t i;
+
+	for (i = 0; i < nb_jobs; i++) {
+		if (jobs[i].thread != NULL) {
+			jobs[i].quit = true;
+			SetEvent(jobs[i].start);
+			WaitForSingleObject(jobs[i].thread, INFINITE);
+			CloseHandle(jobs[i].thread);
+		}
+		if (jobs[i].start != NULL)
+			CloseHandle(jobs[i].start);
+		if (jobs[i].done != NULL)
+			CloseHandle(jobs[i].done);
+		free(jobs[i].in);
+		free(jobs[i].out);
+	}
+	free(jobs);
+}
+
+/*
+ * Returns the number of bytes written, -1 on error, or -2 if the stream isn't
+ * BGZF (in which case the header is left in the bytebuffer for the regular
+ * decoder). If a non BGZF member follows, *more is set, and its header is
+ * likewise left in the bytebuffer, past the magic.
+ */
+static long long int gz_mt_decode(STATE_PARAM transformer_state_t *xstate, int *more)
+{
+	size_t i, nb_jobs, next_read = 0, next_write = 0;
+	unsigned size, xlen;
+	long long int n = 0;
+	ssize_t nwrote;
+	int eof = 0;
+	gz_job_t *jobs = NULL, *job;
+	SYSTEM_INFO si;
+
+	*more = 0;
+	/* Only worth it for decompression to a file or device, on multicore systems */
+	GetSystemInfo(&si);
+	if ((xstate->mem_output_size_max != 0) || (xstate->dst_fd < 0) || (si.dwNumberOfProcessors < 2))
+		return -2;
+	size = bgzf_member_size(PASS_STATE_ONLY);
+	if (size == 0)
+		return -2;
+
+	nb_jobs = MIN(si.dwNumberOfProcessors, GZ_MT_MAX_THREADS);
+	jobs = calloc(nb_jobs, sizeof(gz_job_t));
+	if (jobs == NULL)
+		goto err;
+	for (i = 0; i < nb_jobs; i++) {
+		jobs[i].in = malloc(BGZF_MAX_BLOCK_SIZE);
+		jobs[i].out = malloc(BGZF_MAX_BLOCK_SIZE);
+		jobs[i].start = CreateEvent(NULL, FALSE, FALSE, NULL);
+		jobs[i].done = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if ((jobs[i].in == NULL) || (jobs[i].out == NULL) || (jobs[i].start == NULL) || (jobs[i].done == NULL))
+			goto err;
+		jobs[i].thread = CreateThread(NULL, 0, gz_mt_worker, &jobs[i], 0, NULL);
+		if (jobs[i].thread == NULL)
+			goto err;
+	}
+	bb_printf("Using %d threads to decode BGZF members", (int)nb_jobs);
+
+	while (1) {
+		/* Keep all the job slots busy */
+		while (!eof && (next_read < next_write + nb_jobs)) {
+			if (size == 0) {
+				if (!top_up(PASS_STATE 2)
+				 || bytebuffer[bytebuffer_offset] != 0x1f
+				 || bytebuffer[bytebuffer_offset + 1] != 0x8b
+				) {
+					/* EOF or trailing garbage */
+					eof = 1;
+					break;
+				}
+				bytebuffer_offset += 2;
+				size = bgzf_member_size(PASS_STATE_ONLY);
+				if (size == 0) {
+					*more = 1;
+					eof = 1;
+					break;
+				}
+			}
+			if (!top_up(PASS_STATE size))
+				bb_error_msg_and_err("corrupted data");
+			job = &jobs[next_read % nb_jobs];
+			memcpy(job->in, &bytebuffer[bytebuffer_offset], size);
+			bytebuffer_offset += size;
+			xlen = job->in[8] | (job->in[9] << 8);
+			job->data_offset = GZ_HEADER_SIZE + xlen;
+			job->data_size = size - GZ_HEADER_SIZE - xlen - GZ_TRAILER_SIZE;
+			move_from_unaligned32(job->crc, &job->in[size - 8]);
+			move_from_unaligned32(job->out_size, &job->in[size - 4]);
+			job->crc = SWAP_LE32(job->crc);
+			job->out_size = SWAP_LE32(job->out_size);
+			if (job->out_size > BGZF_MAX_BLOCK_SIZE)
+				bb_error_msg_and_err("corrupted data (member %d)", (int)next_read);
+			SetEvent(job->start);
+			next_read++;
+			size = 0;
+		}
+		if (next_write == next_read)
+			break;
+		/* Write the next member in sequence, once it has been decoded */
+		job = &jobs[next_write % nb_jobs];
+		if (WaitForSingleObject(job->done, INFINITE) != WAIT_OBJECT_0)
+			bb_error_msg_and_err("wait error");
+		if (job->ret != 0)
+			bb_error_msg_and_err("corrupted data (member %d)", (int)next_write);
+		nwrote = transformer_write(xstate, job->out, job->out_size);
+		if (nwrote < 0)
+			bb_error_msg_and_err("write error (errno: %d)", errno);
+		n += nwrote;
+		next_write++;
+	}
+	gz_mt_free_jobs(jobs, nb_jobs);
+	return n;
+
+err:
+	if (jobs != NULL)
+		gz_mt_free_jobs(jobs, nb_jobs);
+	return -1;
+}
+
 IF_DESKTOP(long long) int FAST_FUNC
 unpack_gz_stream(transformer_state_t *xstate)
 {
 	uint32_t v32;
 	IF_DESKTOP(long long) int total, n;
+	int more;
 	DECLARE_STATE;
 
 #if !ENABLE_FEATURE_SEAMLESS_Z
@@ -1228,6 +1612,12 @@ unpack_gz_stream(transformer_state_t *xstate)
 	}
 	gunzip_src_fd = xstate->src_fd;
 
+	total = gz_mt_decode(PASS_STATE xstate, &more);
+	if (total == -2)
+		total = 0;
+	else if (total < 0 || !more)
+		goto ret;
+
  again:
 	if (!check_header_gzip(PASS_STATE xstate)) {
 		bb_error_msg("corrupted data");
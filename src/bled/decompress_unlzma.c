@@ -250,7 +250,9 @@ unpack_lzma_stream(transformer_state_t *xstate)
 	if (header.dict_size == 0)
 		header.dict_size++;
 
-	buffer = xmalloc((size_t)MIN(header.dst_size, header.dict_size));
+	buffer = bb_large_alloc((size_t)MIN(header.dst_size, header.dict_size));
+	if (buffer == NULL)
+		bb_error_msg_and_die("memory allocation error");
 
 	{
 		int num_probs;
@@ -467,7 +469,7 @@ unpack_lzma_stream(transformer_state_t *xstate)
 		}
 		rc_free(rc);
 		free(p);
-		free(buffer);
+		bb_large_free(buffer);
 		return total_written;
 	}
 }
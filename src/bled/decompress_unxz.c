@@ -13,6 +13,7 @@
 #define XZ_EXTERN static
 // We get XZ_OPTIONS_ERROR in xz_dec_stream if this is not defined
 #define XZ_DEC_ANY_CHECK
+#define XZ_USE_CRC64
 
 #define XZ_BUFSIZE BB_BUFSIZE
 
@@ -32,6 +33,428 @@ static uint32_t XZ_FUNC xz_crc32(const uint8_t *buf, size_t size, uint32_t crc)
 	return ~crc32_block_endian0(~crc, buf, size, global_crc32_table);
 }
 
+static void XZ_FUNC xz_crc64_init(void)
+{
+	if (!global_crc64_table)
+		global_crc64_table = crc64_filltable(NULL);
+}
+
+static uint64_t XZ_FUNC xz_crc64(const uint8_t *buf, size_t size, uint64_t crc)
+{
+	return ~crc64_le(~crc, buf, size, global_crc64_table);
+}
+
+/*
+ * Multithreaded decoding of xz streams that are split into multiple blocks,
+ * such as the ones produced by 'xz -T0'. The stream index is used to locate
+ * the blocks, which are then decoded concurrently by a pool of workers (one per
+ * job slot), and written out in order. Since XZ Embedded has no block level API,
+ * each job is fed a standalone single block stream that we synthesize from the
+ * original stream header, the block data and a matching single record index.
+ */
+#define XZ_MT_MAX_THREADS       16
+#define XZ_MT_MAX_BLOCKS        (1 << 20)
+#if defined(_WIN64)
+#define XZ_MT_MEMORY_BUDGET     (1024 * 1024 * 1024ULL)
+#else
+#define XZ_MT_MEMORY_BUDGET     (256 * 1024 * 1024ULL)
+#endif
+/* The largest dictionary that the multi-call decoder is allowed to allocate */
+#define XZ_MT_DICT_MAX          (1 << 26)
+#define XZ_STREAM_HEADER_SIZE   12
+#define XZ_STREAM_FOOTER_SIZE   12
+/* Max size of the single record index we synthesize: indicator + count + 2 VLIs + padding + CRC */
+#define XZ_MT_INDEX_MAX_SIZE    (1 + 1 + 2 * 9 + 3 + 4)
+
+typedef struct {
+	uint64_t offset;		/* offset of the block in the source */
+	uint64_t unpadded_size;
+	uint64_t uncompressed_size;
+} xz_block_t;
+
+typedef struct {
+	HANDLE thread;
+	HANDLE start;
+	HANDLE done;
+	volatile bool quit;
+	uint8_t *in;
+	size_t in_size;
+	size_t in_max;
+	uint8_t *out;
+	size_t out_size;
+	size_t out_max;
+	uint32_t dict_max;		/* for the multi-call decoder, if the check requires it */
+	enum xz_ret ret;
+} xz_job_t;
+
+static size_t xz_put_vli(uint8_t *buf, uint64_t num)
+{
+	size_t i = 0;
+
+	while (num >= 0x80) {
+		buf[i++] = (uint8_t)num | 0x80;
+		num >>= 7;
+	}
+	buf[i++] = (uint8_t)num;
+	return i;
+}
+
+static size_t xz_get_vli(const uint8_t *buf, size_t size, uint64_t *num)
+{
+	size_t i;
+
+	*num = 0;
+	for (i = 0; (i < size) && (i < 9); i++) {
+		*num |= (uint64_t)(buf[i] & 0x7F) << (i * 7);
+		if ((buf[i] & 0x80) == 0)
+			return ((i > 0) && (buf[i] == 0)) ? 0 : i + 1;
+	}
+	return 0;
+}
+
+/*
+ * Parse the index of a single stream xz file, that must start at the current position
+ * of the source descriptor and span the rest of the file, and fill the list of blocks.
+ * Returns the number of blocks, or 0 if the stream doesn't qualify for MT decoding.
+ */
+static size_t xz_mt_parse_index(int fd, uint8_t *header, xz_block_t **blocks)
+{
+	uint8_t footer[XZ_STREAM_FOOTER_SIZE], *index = NULL;
+	uint64_t file_size, index_size, offset, nb_blocks = 0, i;
+	size_t pos, n;
+	xz_block_t *list = NULL;
+
+	*blocks = NULL;
+	if (lseek(fd, 0, SEEK_CUR) != 0)
+		return 0;
+	file_size = lseek(fd, 0, SEEK_END);
+	if ((file_size == (uint64_t)-1) || (file_size < XZ_STREAM_HEADER_SIZE + XZ_STREAM_FOOTER_SIZE + 8))
+		goto out;
+	if ((lseek(fd, 0, SEEK_SET) != 0) || (_read(fd, header, XZ_STREAM_HEADER_SIZE) != XZ_STREAM_HEADER_SIZE))
+		goto out;
+	if ((lseek(fd, file_size - XZ_STREAM_FOOTER_SIZE, SEEK_SET) == -1) ||
+		(_read(fd, footer, XZ_STREAM_FOOTER_SIZE) != XZ_STREAM_FOOTER_SIZE))
+		goto out;
+	/* Validate the footer against the header (this also excludes multi-stream files) */
+	if ((memcmp(header, HEADER_MAGIC, HEADER_MAGIC_SIZE) != 0) || (footer[10] != 'Y') || (footer[11] != 'Z') ||
+		(memcmp(&footer[8], &header[HEADER_MAGIC_SIZE], 2) != 0) ||
+		(xz_crc32(&footer[4], 6, 0) != get_le32(footer)))
+		goto out;
+	index_size = ((uint64_t)get_le32(&footer[4]) + 1) * 4;
+	if (index_size > file_size - XZ_STREAM_HEADER_SIZE - XZ_STREAM_FOOTER_SIZE)
+		goto out;
+	index = malloc((size_t)index_size);
+	if (index == NULL)
+		goto out;
+	if ((lseek(fd, file_size - XZ_STREAM_FOOTER_SIZE - index_size, SEEK_SET) == -1) ||
+		(_read(fd, index, (unsigned int)index_size) != (int)index_size))
+		goto out;
+	if ((index[0] != 0x00) || (xz_crc32(index, (size_t)index_size - 4, 0) != get_le32(&index[index_size - 4])))
+		goto out;
+	pos = 1;
+	n = xz_get_vli(&index[pos], (size_t)index_size - 4 - pos, &nb_blocks);
+	if ((n == 0) || (nb_blocks < 2) || (nb_blocks > XZ_MT_MAX_BLOCKS))
+		goto out;
+	pos += n;
+	list = calloc((size_t)nb_blocks, sizeof(xz_block_t));
+	if (list == NULL)
+		goto out;
+	offset = XZ_STREAM_HEADER_SIZE;
+	for (i = 0; i < nb_blocks; i++) {
+		n = xz_get_vli(&index[pos], (size_t)index_size - 4 - pos, &list[i].unpadded_size);
+		if (n == 0)
+			goto out;
+		pos += n;
+		n = xz_get_vli(&index[pos], (size_t)index_size - 4 - pos, &list[i].uncompressed_size);
+		if ((n == 0) || (list[i].unpadded_size == 0) || (list[i].uncompressed_size == 0) ||
+			(list[i].unpadded_size > SIZE_MAX / 2) || (list[i].uncompressed_size > SIZE_MAX / 2))
+			goto out;
+		pos += n;
+		list[i].offset = offset;
+		offset += (list[i].unpadded_size + 3) & ~3ULL;
+	}
+	/* The blocks, index and footer must account for the whole file */
+	if (offset + index_size + XZ_STREAM_FOOTER_SIZE != file_size)
+		goto out;
+	*blocks = list;
+	list = NULL;
+
+out:
+	free(index);
+	free(list);
+	lseek(fd, 0, SEEK_SET);
+	return (*blocks == NULL) ? 0 : (size_t)nb_blocks;
+}
+
+/*
+ * Return the dictionary size of the LZMA2 filter of a block, which is the last of the filters
+ * that are listed in its header, or XZ_MT_DICT_MAX if it can't be read.
+ */
+static uint32_t xz_mt_get_dict_size(int fd, const xz_block_t *block)
+{
+	uint8_t header[1024];
+	uint64_t id = 0, props_size = 0, dummy;
+	size_t header_size, pos = 2, n;
+	int i, nb_filters;
+
+	if ((lseek(fd, block->offset, SEEK_SET) == -1) || (_read(fd, header, 1) != 1) || (header[0] == 0))
+		return XZ_MT_DICT_MAX;
+	header_size = ((size_t)header[0] + 1) * 4;
+	if (_read(fd, &header[1], (unsigned int)header_size - 1) != (int)header_size - 1)
+		return XZ_MT_DICT_MAX;
+	nb_filters = (header[1] & 0x03) + 1;
+	/* Skip the optional compressed and uncompressed sizes */
+	for (i = 6; i <= 7; i++) {
+		if (header[1] & (1 << i)) {
+			n = xz_get_vli(&header[pos], header_size - 4 - pos, &dummy);
+			if (n == 0)
+				return XZ_MT_DICT_MAX;
+			pos += n;
+		}
+	}
+	for (i = 0; i < nb_filters; i++) {
+		n = xz_get_vli(&header[pos], header_size - 4 - pos, &id);
+		if (n == 0)
+			return XZ_MT_DICT_MAX;
+		pos += n;
+		n = xz_get_vli(&header[pos], header_size - 4 - pos, &props_size);
+		if ((n == 0) || (props_size > header_size - 4 - pos - n))
+			return XZ_MT_DICT_MAX;
+		pos += n + (size_t)props_size;
+	}
+	/* LZMA2 has a single property byte, which encodes the dictionary size */
+	if ((id != 0x21) || (props_size != 1) || (header[pos - 1] > 39))
+		return XZ_MT_DICT_MAX;
+	return MIN((uint32_t)(2 | (header[pos - 1] & 1)) << (header[pos - 1] / 2 + 11), XZ_MT_DICT_MAX);
+}
+
+/* Append a single record index and a footer matching the block that was read into the job */
+static void xz_mt_finalize_job(xz_job_t *job, const uint8_t *header, const xz_block_t *block)
+{
+	uint8_t *index = &job->in[job->in_size], *footer;
+	size_t index_size = 0;
+
+	index[index_size++] = 0x00;
+	index[index_size++] = 0x01;
+	index_size += xz_put_vli(&index[index_size], block->unpadded_size);
+	index_size += xz_put_vli(&index[index_size], block->uncompressed_size);
+	while (index_size & 3)
+		index[index_size++] = 0x00;
+	put_unaligned_le32(xz_crc32(index, index_size, 0), &index[index_size]);
+	index_size += 4;
+
+	footer = &index[index_size];
+	put_unaligned_le32((uint32_t)(index_size / 4 - 1), &footer[4]);
+	memcpy(&footer[8], &header[HEADER_MAGIC_SIZE], 2);
+	put_unaligned_le32(xz_crc32(&footer[4], 6, 0), footer);
+	footer[10] = 'Y';
+	footer[11] = 'Z';
+	job->in_size += index_size + XZ_STREAM_FOOTER_SIZE;
+	job->out_size = (size_t)block->uncompressed_size;
+}
+
+static DWORD WINAPI xz_mt_worker(LPVOID param)
+{
+	xz_job_t *job = (xz_job_t *)param;
+	struct xz_dec *s, *s_single, *s_multi = NULL;
+	struct xz_buf b;
+	enum xz_ret ret;
+	uint8_t check_type;
+
+	/*
+	 * Each job holds a complete stream, and its whole output buffer, so for
+	 * the checks we can verify, we use the single-call decoder, which uses
+	 * the output as its dictionary. This avoids both the dictionary
+	 * allocation and copying the decoded data out of it.
+	 */
+	s_single = xz_dec_init(XZ_SINGLE, 0);
+	while (true) {
+		if (WaitForSingleObject(job->start, INFINITE) != WAIT_OBJECT_0)
+			break;
+		if (job->quit)
+			break;
+		check_type = job->in[HEADER_MAGIC_SIZE + 1];
+		if ((check_type == XZ_CHECK_NONE) || (check_type == XZ_CHECK_CRC32) || (check_type == XZ_CHECK_CRC64)) {
+			s = s_single;
+		} else {
+			/* Single-call mode can't skip over the checks it doesn't support */
+			if (s_multi == NULL)
+				s_multi = xz_dec_init(XZ_DYNALLOC, job->dict_max);
+			s = s_multi;
+		}
+		if (s == NULL) {
+			job->ret = XZ_MEM_ERROR;
+			SetEvent(job->done);
+			continue;
+		}
+		xz_dec_reset(s);
+		b.in = job->in;
+		b.in_pos = 0;
+		b.in_size = job->in_size;
+		b.out = job->out;
+		b.out_pos = 0;
+		b.out_size = job->out_size;
+		do {
+			ret = xz_dec_run(s, &b);
+		} while ((s != s_single) && ((ret == XZ_OK) || (ret == XZ_UNSUPPORTED_CHECK)));
+		/* On XZ_STREAM_END, the decoder has validated the block against our index */
+		job->ret = ((ret == XZ_STREAM_END) && (b.out_pos == job->out_size)) ? XZ_OK : ret;
+		SetEvent(job->done);
+	}
+	xz_dec_end(s_single);
+	xz_dec_end(s_multi);
+	return 0;
+}
+
+static void xz_mt_free_jobs(xz_job_t *jobs, size_t nb_jobs)
+{
+	size_t i;
+
+	for (i = 0; i < nb_jobs; i++) {
+		if (jobs[i].thread != NULL) {
+			jobs[i].quit = true;
+			SetEvent(jobs[i].start);
+			WaitForSingleObject(jobs[i].thread, INFINITE);
+			CloseHandle(jobs[i].thread);
+		}
+		if (jobs[i].start != NULL)
+			CloseHandle(jobs[i].start);
+		if (jobs[i].done != NULL)
+			CloseHandle(jobs[i].done);
+		bb_large_free(jobs[i].in);
+		bb_large_free(jobs[i].out);
+	}
+	free(jobs);
+}
+
+/*
+ * Returns the number of bytes written, -1 on error, or -2 if the stream
+ * doesn't qualify for multithreaded decoding (in which case the source
+ * descriptor is rewound so that the regular decoder can be used).
+ */
+static long long int xz_mt_decode(transformer_state_t *xstate)
+{
+	uint8_t header[XZ_STREAM_HEADER_SIZE];
+	size_t i, nb_blocks, nb_jobs, next_read = 0, next_write = 0;
+	size_t max_in = 0, max_out = 0;
+	uint8_t check_type;
+	uint32_t dict_max = 0;
+	long long int n = 0;
+	ssize_t nwrote;
+	xz_block_t *blocks = NULL;
+	xz_job_t *jobs = NULL, *job;
+	SYSTEM_INFO si;
+
+	/* Only worth it for decompression to a file or device, on multicore systems */
+	GetSystemInfo(&si);
+	if ((xstate->mem_output_size_max != 0) || (xstate->dst_fd < 0) || (si.dwNumberOfProcessors < 2))
+		return -2;
+	nb_blocks = xz_mt_parse_index(xstate->src_fd, header, &blocks);
+	if (nb_blocks == 0)
+		return -2;
+	for (i = 0; i < nb_blocks; i++) {
+		max_in = MAX(max_in, (size_t)((blocks[i].unpadded_size + 3) & ~3ULL));
+		max_out = MAX(max_out, (size_t)blocks[i].uncompressed_size);
+	}
+	max_in += XZ_STREAM_HEADER_SIZE + XZ_MT_INDEX_MAX_SIZE + XZ_STREAM_FOOTER_SIZE;
+	/*
+	 * The workers only need a dictionary of their own if the check forces them to use the
+	 * multi-call decoder (see xz_mt_worker), in which case it must count towards the budget.
+	 */
+	check_type = header[HEADER_MAGIC_SIZE + 1];
+	if ((check_type != XZ_CHECK_NONE) && (check_type != XZ_CHECK_CRC32) && (check_type != XZ_CHECK_CRC64)) {
+		for (i = 0; (i < nb_blocks) && (dict_max < XZ_MT_DICT_MAX); i++)
+			dict_max = MAX(dict_max, xz_mt_get_dict_size(xstate->src_fd, &blocks[i]));
+		lseek(xstate->src_fd, 0, SEEK_SET);
+	}
+	nb_jobs = MIN(MIN(si.dwNumberOfProcessors, XZ_MT_MAX_THREADS), nb_blocks);
+	nb_jobs = (size_t)MIN(nb_jobs, MAX(XZ_MT_MEMORY_BUDGET / (max_in + max_out + dict_max), 1));
+	/* With a single worker, the regular decoder does the same, with a lot less memory */
+	if (nb_jobs < 2) {
+		free(blocks);
+		return -2;
+	}
+
+	jobs = calloc(nb_jobs, sizeof(xz_job_t));
+	if (jobs == NULL)
+		goto err;
+	for (i = 0; i < nb_jobs; i++) {
+		jobs[i].in_max = max_in;
+		jobs[i].out_max = max_out;
+		jobs[i].dict_max = dict_max;
+		jobs[i].in = bb_large_alloc(max_in);
+		jobs[i].out = bb_large_alloc(max_out);
+		jobs[i].start = CreateEvent(NULL, FALSE, FALSE, NULL);
+		jobs[i].done = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if ((jobs[i].in == NULL) || (jobs[i].out == NULL) || (jobs[i].start == NULL) || (jobs[i].done == NULL))
+			goto err;
+		jobs[i].thread = CreateThread(NULL, 0, xz_mt_worker, &jobs[i], 0, NULL);
+		if (jobs[i].thread == NULL)
+			goto err;
+	}
+	bb_printf("Using %d threads to decode %d xz blocks", (int)nb_jobs, (int)nb_blocks);
+
+	/* The blocks are restart points, so the ones we are asked to skip don't need to be decoded */
+	while ((next_write < nb_blocks) && (blocks[next_write].uncompressed_size <= xstate->skip_output)) {
+		xstate->skip_output -= blocks[next_write].uncompressed_size;
+		n += blocks[next_write].uncompressed_size;
+		next_write++;
+	}
+	if (next_write != 0)
+		bb_printf("Skipping %d xz blocks that were already written", (int)next_write);
+	next_read = next_write;
+
+	while (next_write < nb_blocks) {
+		/* Keep all the job slots busy */
+		while ((next_read < nb_blocks) && (next_read < next_write + nb_jobs)) {
+			job = &jobs[next_read % nb_jobs];
+			memcpy(job->in, header, XZ_STREAM_HEADER_SIZE);
+			job->in_size = XZ_STREAM_HEADER_SIZE + (size_t)((blocks[next_read].unpadded_size + 3) & ~3ULL);
+			if (lseek(xstate->src_fd, blocks[next_read].offset, SEEK_SET) == -1)
+				bb_error_msg_and_err("seek error (errno: %d)", errno);
+			for (i = XZ_STREAM_HEADER_SIZE; i < job->in_size; ) {
+				int r = safe_read(xstate->src_fd, &job->in[i], (unsigned int)MIN(job->in_size - i, XZ_BUFSIZE));
+				if (r <= 0)
+					bb_error_msg_and_err("read error (errno: %d)", errno);
+				i += r;
+			}
+			xz_mt_finalize_job(job, header, &blocks[next_read]);
+			SetEvent(job->start);
+			next_read++;
+		}
+		/* Write the next block in sequence, once it has been decoded */
+		job = &jobs[next_write % nb_jobs];
+		if (WaitForSingleObject(job->done, INFINITE) != WAIT_OBJECT_0)
+			bb_error_msg_and_err("wait error");
+		switch (job->ret) {
+		case XZ_OK:
+			break;
+		case XZ_MEM_ERROR:
+			bb_error_msg_and_err("memory allocation error");
+		case XZ_MEMLIMIT_ERROR:
+			bb_error_msg_and_err("memory usage limit error");
+		case XZ_OPTIONS_ERROR:
+			bb_error_msg_and_err("unsupported XZ header option");
+		default:
+			bb_error_msg_and_err("corrupted archive (block %d)", (int)next_write);
+		}
+		nwrote = transformer_write(xstate, job->out, job->out_size);
+		if (nwrote < 0)
+			bb_error_msg_and_err("write error (errno: %d)", errno);
+		n += nwrote;
+		next_write++;
+	}
+	xz_mt_free_jobs(jobs, nb_jobs);
+	free(blocks);
+	return n;
+
+err:
+	if (jobs != NULL)
+		xz_mt_free_jobs(jobs, nb_jobs);
+	free(blocks);
+	return -1;
+}
+
 IF_DESKTOP(long long) int FAST_FUNC unpack_xz_stream(transformer_state_t *xstate)
 {
 	IF_DESKTOP(long long) int n = 0;
@@ -42,6 +465,12 @@ IF_DESKTOP(long long) int FAST_FUNC unpack_xz_stream(transformer_state_t *xstate
 	ssize_t nwrote;
 
 	xz_crc32_init();
+	xz_crc64_init();
+
+	n = xz_mt_decode(xstate);
+	if (n != -2)
+		return (n < 0) ? -XZ_DATA_ERROR : n;
+	n = 0;
 
 	/*
 	 * Support up to 64 MiB dictionary. The actually needed memory
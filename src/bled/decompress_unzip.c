@@ -239,12 +239,303 @@ static void unzip_skip(int fd, off_t skip)
 			bb_copyfd_exact_size(fd, -1, skip);
 }
 
+#if ENABLE_DESKTOP
+/*
+ * Multithreaded extraction of archives with many entries, for bled_uncompress_to_dir().
+ * The entries are listed from the central directory and handed to a pool of workers
+ * (one per job slot), that read the compressed data with positioned reads, inflate it
+ * in memory, and write it to a preallocated file. This only applies to archives where
+ * all the files are deflated, not encrypted and small enough to be inflated in memory.
+ */
+#define ZIP_MT_MAX_THREADS      8
+#define ZIP_MT_MAX_ENTRIES      65536
+#define ZIP_MT_MAX_ENTRY_SIZE   (32 * 1024 * 1024)
+#if defined(_WIN64)
+#define ZIP_MT_MEMORY_BUDGET    (1024 * 1024 * 1024ULL)
+#else
+#define ZIP_MT_MEMORY_BUDGET    (256 * 1024 * 1024ULL)
+#endif
+
+typedef struct {
+	char *name;
+	uint32_t data_offset;
+	uint32_t cmpsize;
+	uint32_t ucmpsize;
+	uint32_t crc32;
+} zip_entry_t;
+
+typedef struct {
+	HANDLE thread;
+	HANDLE start;
+	HANDLE done;
+	volatile bool quit;
+	HANDLE src;
+	const zip_entry_t *entry;
+	char path[MAX_PATH];
+	uint8_t *in;
+	size_t in_max;
+	uint8_t *out;
+	size_t out_max;
+	int ret;
+} zip_job_t;
+
+static int zip_mt_extract_entry(zip_job_t *job)
+{
+	const zip_entry_t *entry = job->entry;
+	OVERLAPPED overlapped = { 0 };
+	FILE_ALLOCATION_INFO alloc_info;
+	DWORD size;
+	uint32_t crc;
+	int fd;
+
+	overlapped.Offset = entry->data_offset;
+	if (!ReadFile(job->src, job->in, entry->cmpsize, &size, &overlapped) || (size != entry->cmpsize))
+		return -EIO;
+	if ((inflate_unzip_from_buffer(job->in, entry->cmpsize, (char *)job->out, entry->ucmpsize, &crc) < 0) ||
+		(crc != entry->crc32))
+		return -EILSEQ;
+	fd = _openU(job->path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+	if (fd < 0)
+		return -errno;
+	/* Preallocate the file, so that it doesn't get fragmented by the concurrent writes */
+	alloc_info.AllocationSize.QuadPart = entry->ucmpsize;
+	SetFileInformationByHandle((HANDLE)_get_osfhandle(fd), FileAllocationInfo, &alloc_info, sizeof(alloc_info));
+	if (full_write(fd, job->out, entry->ucmpsize) != (ssize_t)entry->ucmpsize) {
+		_close(fd);
+		return -EIO;
+	}
+	_close(fd);
+	return 0;
+}
+
+static DWORD WINAPI zip_mt_worker(LPVOID param)
+{
+	zip_job_t *job = (zip_job_t *)param;
+
+	while (1) {
+		if (WaitForSingleObject(job->start, INFINITE) != WAIT_OBJECT_0)
+			break;
+		if (job->quit)
+			break;
+		job->ret = zip_mt_extract_entry(job);
+		SetEvent(job->done);
+	}
+	return 0;
+}
+
+static void zip_mt_free_jobs(zip_job_t *jobs, size_t nb_jobs)
+{
+	size_t i;
+
+	for (i = 0; i < nb_jobs; i++) {
+		if (jobs[i].thread != NULL) {
+			jobs[i].quit = true;
+			SetEvent(jobs[i].start);
+			WaitForSingleObject(jobs[i].thread, INFINITE);
+			CloseHandle(jobs[i].thread);
+		}
+		if (jobs[i].start != NULL)
+			CloseHandle(jobs[i].start);
+		if (jobs[i].done != NULL)
+			CloseHandle(jobs[i].done);
+		free(jobs[i].in);
+		free(jobs[i].out);
+	}
+	free(jobs);
+}
+
+static void zip_mt_free_entries(zip_entry_t *entries, size_t nb_entries)
+{
+	size_t i;
+
+	for (i = 0; i < nb_entries; i++)
+		free(entries[i].name);
+	free(entries);
+}
+
+/*
+ * List the file entries from the central directory, along with the offset of their
+ * data. Returns the number of entries, or 0 if the archive doesn't qualify.
+ */
+static size_t zip_mt_list_entries(int fd, zip_entry_t **list, size_t *max_in, size_t *max_out)
+{
+	zip_entry_t *entries = NULL;
+	zip_header_t zip_header;
+	cdf_header_t cdf_header;
+	uint32_t magic, cdf_offset, nb_entries = 0;
+	size_t len;
+
+	*max_in = 0;
+	*max_out = 0;
+	cdf_offset = find_cdf_offset(fd);
+	if ((cdf_offset == 0) || (cdf_offset == BAD_CDF_OFFSET))
+		return 0;
+	entries = calloc(ZIP_MT_MAX_ENTRIES, sizeof(zip_entry_t));
+	if (entries == NULL)
+		return 0;
+	while (1) {
+		if ((lseek(fd, cdf_offset, SEEK_SET) != cdf_offset) || (_read(fd, &magic, 4) != 4) ||
+			(magic != ZIP_CDF_MAGIC) || (_read(fd, cdf_header.raw, CDF_HEADER_LEN) != CDF_HEADER_LEN))
+			break;
+		FIX_ENDIANNESS_CDF(cdf_header);
+		cdf_header.formatted.cdf_flags = SWAP_LE16(cdf_header.formatted.cdf_flags);
+		cdf_header.formatted.method = SWAP_LE16(cdf_header.formatted.method);
+		cdf_header.formatted.relative_offset_of_local_header =
+			SWAP_LE32(cdf_header.formatted.relative_offset_of_local_header);
+		len = cdf_header.formatted.file_name_length;
+		cdf_offset += 4 + CDF_HEADER_LEN + cdf_header.formatted.file_name_length +
+			cdf_header.formatted.extra_field_length + cdf_header.formatted.file_comment_length;
+		if ((len == 0) || (nb_entries >= ZIP_MT_MAX_ENTRIES))
+			goto err;
+		entries[nb_entries].name = xzalloc(len + 1);
+		if ((entries[nb_entries].name == NULL) || (_read(fd, entries[nb_entries].name, (unsigned)len) != (int)len))
+			goto err;
+		/* Directories get created along with the files they contain */
+		if ((cdf_header.formatted.external_file_attributes & 0x40000010) ||
+			(entries[nb_entries].name[len - 1] == '/')) {
+			free(entries[nb_entries].name);
+			entries[nb_entries].name = NULL;
+			continue;
+		}
+		/* Stored files, encryption, Zip64 and large entries are left to the regular extraction */
+		if ((cdf_header.formatted.method != 8) || (cdf_header.formatted.cdf_flags & 0x0001) ||
+			(cdf_header.formatted.cmpsize > ZIP_MT_MAX_ENTRY_SIZE) ||
+			(cdf_header.formatted.ucmpsize > ZIP_MT_MAX_ENTRY_SIZE))
+			goto err;
+		entries[nb_entries].cmpsize = cdf_header.formatted.cmpsize;
+		entries[nb_entries].ucmpsize = cdf_header.formatted.ucmpsize;
+		entries[nb_entries].crc32 = cdf_header.formatted.crc32;
+		/* The local header must agree with the central directory */
+		if ((lseek(fd, cdf_header.formatted.relative_offset_of_local_header, SEEK_SET) !=
+			cdf_header.formatted.relative_offset_of_local_header) || (_read(fd, &magic, 4) != 4) ||
+			(magic != ZIP_FILEHEADER_MAGIC) || (_read(fd, zip_header.raw, ZIP_HEADER_LEN) != ZIP_HEADER_LEN))
+			goto err;
+		FIX_ENDIANNESS_ZIP(zip_header);
+		if (zip_header.formatted.method != 8)
+			goto err;
+		entries[nb_entries].data_offset = cdf_header.formatted.relative_offset_of_local_header + 4 +
+			ZIP_HEADER_LEN + zip_header.formatted.filename_len + zip_header.formatted.extra_len;
+		*max_in = MAX(*max_in, entries[nb_entries].cmpsize);
+		/* +1 for the overflow check of inflate_unzip_from_buffer() */
+		*max_out = MAX(*max_out, entries[nb_entries].ucmpsize + 1);
+		nb_entries++;
+	}
+	/* Only worth it if there's more than one file to extract */
+	if (nb_entries < 2)
+		goto err;
+	*list = entries;
+	return nb_entries;
+
+err:
+	/* The entry we failed on may have its name allocated */
+	zip_mt_free_entries(entries, MIN(nb_entries + 1, ZIP_MT_MAX_ENTRIES));
+	return 0;
+}
+
+/*
+ * Returns the number of bytes extracted, -1 on error, or -2 if the archive
+ * doesn't qualify for multithreaded extraction (in which case the source
+ * descriptor is rewound so that the regular extraction can be used).
+ */
+static long long int zip_mt_extract(transformer_state_t *xstate)
+{
+	size_t i, nb_entries, nb_jobs, next = 0, max_in, max_out, last_slash;
+	long long int n = 0;
+	off_t org;
+	zip_entry_t *entries = NULL;
+	zip_job_t *jobs = NULL, *job;
+	SYSTEM_INFO si;
+
+	GetSystemInfo(&si);
+	if ((xstate->dst_dir == NULL) || (si.dwNumberOfProcessors < 2))
+		return -2;
+	org = lseek(xstate->src_fd, 0, SEEK_CUR);
+	nb_entries = zip_mt_list_entries(xstate->src_fd, &entries, &max_in, &max_out);
+	lseek(xstate->src_fd, org, SEEK_SET);
+	if (nb_entries == 0)
+		return -2;
+	nb_jobs = MIN(MIN(si.dwNumberOfProcessors, ZIP_MT_MAX_THREADS), nb_entries);
+	nb_jobs = (size_t)MIN(nb_jobs, ZIP_MT_MEMORY_BUDGET / (max_in + max_out));
+	if (nb_jobs < 2) {
+		zip_mt_free_entries(entries, nb_entries);
+		return -2;
+	}
+
+	jobs = calloc(nb_jobs, sizeof(zip_job_t));
+	if (jobs == NULL)
+		goto err;
+	for (i = 0; i < nb_jobs; i++) {
+		jobs[i].src = (HANDLE)_get_osfhandle(xstate->src_fd);
+		jobs[i].in_max = max_in;
+		jobs[i].out_max = max_out;
+		/* Zero sized entries still need a buffer */
+		jobs[i].in = malloc(max_in + 1);
+		jobs[i].out = malloc(max_out);
+		jobs[i].start = CreateEvent(NULL, FALSE, FALSE, NULL);
+		jobs[i].done = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if ((jobs[i].in == NULL) || (jobs[i].out == NULL) || (jobs[i].start == NULL) || (jobs[i].done == NULL))
+			goto err;
+		jobs[i].thread = CreateThread(NULL, 0, zip_mt_worker, &jobs[i], 0, NULL);
+		if (jobs[i].thread == NULL)
+			goto err;
+	}
+	bb_printf("Using %d threads to extract %d zip entries", (int)nb_jobs, (int)nb_entries);
+
+	for (next = 0; next < nb_entries + nb_jobs; next++) {
+		job = &jobs[next % nb_jobs];
+		/* Wait for the previous entry of this slot to be done */
+		if (next >= nb_jobs) {
+			if (WaitForSingleObject(job->done, INFINITE) != WAIT_OBJECT_0)
+				bb_error_msg_and_err("wait error");
+			if (job->ret == -EILSEQ)
+				bb_error_msg_and_err("corrupted data (%s)", job->entry->name);
+			if (job->ret != 0)
+				bb_error_msg_and_err("Could not extract '%s' (errno: %d)", job->path, -job->ret);
+			n += job->entry->ucmpsize;
+		}
+		if (next >= nb_entries)
+			continue;
+		if ((bled_cancel_request != NULL) && (*bled_cancel_request != 0))
+			bb_error_msg_and_err("Cancelled");
+		/* Directories are created here, so that the workers don't race for them */
+		job->entry = &entries[next];
+		_snprintf_s(job->path, sizeof(job->path), _TRUNCATE, "%s/%s", xstate->dst_dir, entries[next].name);
+		for (i = 0, last_slash = 0; i < strlen(job->path); i++) {
+			if (job->path[i] == '/')
+				job->path[i] = '\\';
+			if (job->path[i] == '\\')
+				last_slash = i;
+		}
+		if (bled_switch != NULL)
+			bled_switch(job->path, entries[next].ucmpsize);
+		job->path[last_slash] = 0;
+		bb_make_directory(job->path, 0, 0);
+		job->path[last_slash] = '\\';
+		SetEvent(job->start);
+	}
+	zip_mt_free_jobs(jobs, nb_jobs);
+	zip_mt_free_entries(entries, nb_entries);
+	return n;
+
+err:
+	if (jobs != NULL)
+		zip_mt_free_jobs(jobs, nb_jobs);
+	zip_mt_free_entries(entries, nb_entries);
+	return -1;
+}
+#endif
+
 IF_DESKTOP(long long) int FAST_FUNC unpack_zip_stream(transformer_state_t *xstate)
 {
 	IF_DESKTOP(long long) int n = -EFAULT;
 	zip_header_t zip_header;
 #if ENABLE_DESKTOP
 	uint32_t cdf_offset = 0;
+
+	n = zip_mt_extract(xstate);
+	if (n != -2)
+		return n;
+	n = -EFAULT;
 #endif
 
 	while (1) {
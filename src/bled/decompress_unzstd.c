@@ -0,0 +1,107 @@
+/*
+ * unzstd implementation for Bled/busybox
+ *
+ * Copyright © 2014-2020 Pete Batard <pete@akeo.ie>
+ * Based on the Zstandard reference library © Meta Platforms, Inc. - BSD License
+ *
+ * Licensed under GPLv2 or later, see file LICENSE in this source tree.
+ */
+
+#include "libbb.h"
+#include "bb_archive.h"
+
+#define ZSTD_STATIC_LINKING_ONLY
+#include "zstd.h"
+
+/*
+ * zstd decompresses in blocks of at most 128 KB into a window of at most
+ * ZSTD_WINDOWLOG_LIMIT_DEFAULT, so the input buffer size doesn't matter
+ * much, but we want large output buffers to limit the transformer_write()
+ * overhead, which, for disk images, ends up as a device write.
+ */
+#define ZSTD_BUFSIZE BB_BUFSIZE
+
+IF_DESKTOP(long long) int FAST_FUNC unpack_zstd_stream(transformer_state_t *xstate)
+{
+	IF_DESKTOP(long long) int n = 0;
+	ZSTD_DStream *s = NULL;
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	uint8_t *in_buf = NULL, *out_buf = NULL;
+	size_t ret = 0, out_size;
+	ssize_t nwrote;
+	int rb;
+	bool flush = false;
+
+	s = ZSTD_createDStream();
+	if (s == NULL)
+		bb_error_msg_and_err("memory allocation error");
+	/* Compressed disk images often use --long, which needs more than the default 128 MB */
+	ZSTD_DCtx_setParameter(s, ZSTD_d_windowLogMax, ZSTD_WINDOWLOG_LIMIT_DEFAULT + 4);
+
+	in_buf = malloc(ZSTD_BUFSIZE);
+	/* When decompressing to memory, decompress straight into the destination */
+	out_size = (xstate->mem_output_size_max != 0) ? 0 : ZSTD_BUFSIZE;
+	if (out_size != 0)
+		out_buf = malloc(out_size);
+	if ((in_buf == NULL) || ((out_size != 0) && (out_buf == NULL)))
+		bb_error_msg_and_err("memory allocation error");
+
+	in.src = in_buf;
+	in.size = 0;
+	in.pos = 0;
+	while (1) {
+		/* Only read more data once the decoder has flushed everything it could */
+		if (in.pos == in.size && !flush) {
+			rb = safe_read(xstate->src_fd, in_buf, ZSTD_BUFSIZE);
+			if (rb < 0)
+				bb_error_msg_and_err("read error (errno: %d)", errno);
+			if (rb == 0)
+				break;
+			in.size = rb;
+			in.pos = 0;
+		}
+		if (out_size == 0) {
+			out.dst = xstate->mem_output_buf;
+			out.size = xstate->mem_output_size_max;
+			out.pos = xstate->mem_output_size;
+		} else {
+			out.dst = out_buf;
+			out.size = out_size;
+			out.pos = 0;
+		}
+		ret = ZSTD_decompressStream(s, &out, &in);
+		if (ZSTD_isError(ret))
+			bb_error_msg_and_err("corrupted data: %s", ZSTD_getErrorName(ret));
+		flush = (out.pos == out.size);
+		if (out_size == 0) {
+			n += out.pos - xstate->mem_output_size;
+			xstate->mem_output_size = out.pos;
+			/* Our buffer is full, which callers expect to be reported by returning its size */
+			if (flush) {
+				n = xstate->mem_output_size_max;
+				ret = 0;
+				break;
+			}
+		} else if (out.pos != 0) {
+			nwrote = transformer_write(xstate, out_buf, out.pos);
+			if (nwrote < 0)
+				bb_error_msg_and_err("write error (errno: %d)", errno);
+			n += nwrote;
+		}
+	}
+	/* A non zero ret means that the last frame wasn't complete */
+	if (ret != 0)
+		bb_error_msg_and_err("unexpected end of file");
+
+	ZSTD_freeDStream(s);
+	free(in_buf);
+	free(out_buf);
+	return n;
+
+err:
+	ZSTD_freeDStream(s);
+	free(in_buf);
+	free(out_buf);
+	return -1;
+}
@@ -111,6 +111,52 @@ err:
 	return valid;
 }
 
+static int compare_vtsi_segment(const void* a, const void* b)
+{
+	const VTSI_SEGMENT* sa = (const VTSI_SEGMENT*)a;
+	const VTSI_SEGMENT* sb = (const VTSI_SEGMENT*)b;
+
+	if (sa->disk_start_sector == sb->disk_start_sector)
+		return 0;
+	return (sa->disk_start_sector < sb->disk_start_sector) ? -1 : 1;
+}
+
+/*
+ * Sort the segments by disk position, so that the target gets written in a single forward
+ * sweep, and merge the ones that are contiguous, on disk as well as in the image, so that
+ * they don't need a seek. The data of each segment is laid out in segment order, right
+ * from the start of the image, which is what data_offset gets set to before sorting.
+ * Returns the new number of segments, or -1 if the segments are invalid.
+ */
+static int64_t sort_vtsi_segments(VTSI_FOOTER* footer, VTSI_SEGMENT* segment)
+{
+	uint32_t i, j;
+	uint64_t offset = 0;
+
+	for (i = 0; i < footer->segment_num; i++) {
+		segment[i].data_offset = offset;
+		offset += segment[i].sector_num * 512;
+		if (offset > footer->segment_offset)
+			bb_error_msg_and_err("vtsi segment %d is out of bounds", i);
+	}
+	qsort(segment, footer->segment_num, sizeof(VTSI_SEGMENT), compare_vtsi_segment);
+	for (i = 0, j = 0; i < footer->segment_num; i++) {
+		if (segment[i].sector_num == 0)
+			continue;
+		if ((j > 0) && (segment[i].disk_start_sector < segment[j - 1].disk_start_sector + segment[j - 1].sector_num))
+			bb_error_msg_and_err("vtsi segments overlap at sector %lld", segment[i].disk_start_sector);
+		if ((j > 0) && (segment[i].disk_start_sector == segment[j - 1].disk_start_sector + segment[j - 1].sector_num) &&
+			(segment[i].data_offset == segment[j - 1].data_offset + segment[j - 1].sector_num * 512)) {
+			segment[j - 1].sector_num += segment[i].sector_num;
+			continue;
+		}
+		segment[j++] = segment[i];
+	}
+	return j;
+err:
+	return -1;
+}
+
 IF_DESKTOP(long long) int FAST_FUNC unpack_vtsi_stream(transformer_state_t* xstate)
 {
 	IF_DESKTOP(long long) int n = -EFAULT;
@@ -119,9 +165,9 @@ IF_DESKTOP(long long) int FAST_FUNC unpack_vtsi_stream(transformer_state_t* xsta
 	int src_fd = 0;
 	size_t wsize = 0;
 	ssize_t retval = 0;
-	uint64_t seg = 0;
+	int64_t seg = 0, nb_segs = 0;
 	int64_t datalen = 0;
-	uint64_t phy_offset = 0;
+	uint64_t phy_offset = 0, src_offset = 0;
 	size_t max_buflen = MAX_READ_BUF;
 	uint8_t* buf = NULL;
 	VTSI_SEGMENT* segment = NULL;
@@ -155,15 +201,25 @@ IF_DESKTOP(long long) int FAST_FUNC unpack_vtsi_stream(transformer_state_t* xsta
 	if (!check_vtsi_segment(&footer, segment))
 		goto err;
 
+	nb_segs = sort_vtsi_segments(&footer, segment);
+	if (nb_segs < 0)
+		goto err;
+
 	/* read data */
 	lseek(src_fd, 0, SEEK_SET);
-	for (seg = 0; seg < footer.segment_num; seg++) {
+	for (seg = 0; seg < nb_segs; seg++) {
 		cur_seg = segment + seg;
 		datalen = (int64_t)cur_seg->sector_num * 512;
 		phy_offset = cur_seg->disk_start_sector * 512;
 
-		if (xstate->mem_output_size_max == 0 && xstate->dst_fd >= 0)
-			lseek(xstate->dst_fd, phy_offset, SEEK_SET);
+		/* only seek the source when the segments weren't already in disk order */
+		if (cur_seg->data_offset != src_offset)
+			lseek(src_fd, cur_seg->data_offset, SEEK_SET);
+		src_offset = cur_seg->data_offset + datalen;
+
+		if (xstate->mem_output_size_max == 0 && xstate->dst_fd >= 0 &&
+			full_seek(xstate->dst_fd, phy_offset) != (int64_t)phy_offset)
+			bb_error_msg_and_err("could not seek to vtsi segment at 0x%llX", phy_offset);
 
 		while (datalen > 0) {
 			wsize = MIN((size_t)datalen, max_buflen);
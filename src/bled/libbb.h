@@ -100,14 +100,21 @@ typedef unsigned int uid_t;
 
 extern smallint bb_got_signal;
 extern uint32_t *global_crc32_table;
+extern uint64_t *global_crc64_table;
 extern jmp_buf bb_error_jmp;
 extern char* bb_virtual_buf;
 extern size_t bb_virtual_len, bb_virtual_pos;
 extern int bb_virtual_fd;
+extern int bb_read_ahead_fd;
+int bb_read_ahead(void* buf, unsigned int count);
+void* bb_large_alloc(size_t size);
+void bb_large_free(void* ptr);
 
 uint32_t* crc32_filltable(uint32_t *crc_table, int endian);
 uint32_t crc32_le(uint32_t crc, unsigned char const *p, size_t len, uint32_t *crc32table_le);
 uint32_t crc32_be(uint32_t crc, unsigned char const *p, size_t len, uint32_t *crc32table_be);
+uint64_t* crc64_filltable(uint64_t *crc_table);
+uint64_t crc64_le(uint64_t crc, unsigned char const *p, size_t len, uint64_t *crc64table_le);
 #define crc32_block_endian0 crc32_le
 #define crc32_block_endian1 crc32_be
 
@@ -131,6 +138,9 @@ extern void (*bled_progress) (const uint64_t processed_bytes);
 extern void (*bled_switch) (const char* filename, const uint64_t filesize);
 extern int (*bled_read)(int fd, void* buf, unsigned int count);
 extern int (*bled_write)(int fd, const void* buf, unsigned int count);
+extern int64_t (*bled_seek)(int fd, int64_t offset);
+extern void* (*bled_alloc)(size_t size);
+extern void (*bled_free)(void* ptr);
 extern unsigned long* bled_cancel_request;
 
 #define xfunc_die() longjmp(bb_error_jmp, 1)
@@ -189,6 +199,8 @@ static inline int full_read(int fd, void *buf, unsigned int count) {
 		memcpy(buf, &bb_virtual_buf[bb_virtual_pos], count);
 		bb_virtual_pos += count;
 		rb = (int)count;
+	} else if (fd == bb_read_ahead_fd) {
+		rb = bb_read_ahead(buf, count);
 	} else {
 		rb = (bled_read != NULL) ? bled_read(fd, buf, count) : _read(fd, buf, count);
 	}
@@ -205,6 +217,12 @@ static inline int full_write(int fd, const void* buffer, unsigned int count)
 	return (bled_write != NULL) ? bled_write(fd, buffer, count) : _write(fd, buffer, count);
 }
 
+/* Position the output, for the formats that don't write it sequentially */
+static inline int64_t full_seek(int fd, int64_t offset)
+{
+	return (bled_seek != NULL) ? bled_seek(fd, offset) : _lseeki64(fd, offset, SEEK_SET);
+}
+
 static inline struct tm *localtime_r(const time_t *timep, struct tm *result) {
 	if (localtime_s(result, timep) != 0)
 		result = NULL;
@@ -30,6 +30,17 @@ int FAST_FUNC check_signature16(transformer_state_t *xstate, unsigned magic16)
 ssize_t FAST_FUNC transformer_write(transformer_state_t *xstate, const void *buf, size_t bufsize)
 {
 	ssize_t nwrote;
+	size_t skipped = 0;
+
+	/* Output that was already written by a previous attempt is discarded */
+	if (xstate->skip_output != 0) {
+		skipped = (size_t)MIN(bufsize, xstate->skip_output);
+		xstate->skip_output -= skipped;
+		if (skipped == bufsize)
+			return bufsize;
+		buf = (const uint8_t *)buf + skipped;
+		bufsize -= skipped;
+	}
 
 	if (xstate->mem_output_size_max != 0) {
 		size_t pos = xstate->mem_output_size;
@@ -53,7 +64,7 @@ ssize_t FAST_FUNC transformer_write(transformer_state_t *xstate, const void *buf
 		}
 	}
  ret:
-	return nwrote;
+	return (nwrote < 0) ? nwrote : nwrote + skipped;
 }
 
 ssize_t FAST_FUNC xtransformer_write(transformer_state_t *xstate, const void *buf, size_t bufsize)
@@ -276,6 +276,22 @@ XZ_EXTERN uint32_t XZ_FUNC xz_crc32(
 		const uint8_t *buf, size_t size, uint32_t crc);
 #endif
 
+#ifdef XZ_USE_CRC64
+/*
+ * This must be called before any other xz_* function (except xz_crc32_init())
+ * to initialize the CRC64 lookup table.
+ */
+XZ_EXTERN void XZ_FUNC xz_crc64_init(void);
+
+/*
+ * Update CRC64 value using the polynomial from ECMA-182. To start a new
+ * calculation, the third argument must be zero. To continue the calculation,
+ * the previously returned value is passed as the third argument.
+ */
+XZ_EXTERN uint64_t XZ_FUNC xz_crc64(
+		const uint8_t *buf, size_t size, uint64_t crc);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
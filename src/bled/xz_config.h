@@ -26,8 +26,11 @@
 
 #define kmalloc(size, flags) malloc(size)
 #define kfree(ptr) free(ptr)
-#define vmalloc(size) malloc(size)
-#define vfree(ptr) free(ptr)
+/* The dictionary, which can be up to 64 MB, comes from the application's allocator, if any */
+void* bb_large_alloc(size_t size);
+void bb_large_free(void* ptr);
+#define vmalloc(size) bb_large_alloc(size)
+#define vfree(ptr) bb_large_free(ptr)
 
 #define memeq(a, b, size) (memcmp(a, b, size) == 0)
 #define memzero(buf, size) memset(buf, 0, size)
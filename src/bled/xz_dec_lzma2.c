@@ -343,12 +343,20 @@ static inline void XZ_FUNC dict_put(struct dictionary *dict, uint8_t byte)
  * Repeat given number of bytes from the given distance. If the distance is
  * invalid, false is returned. On success, true is returned and *len is
  * updated to indicate how many bytes were left to be repeated.
+ *
+ * Rather than going byte by byte, the data is copied in as few runs as
+ * possible: the source is split where it wraps around the end of the
+ * dictionary and, when it overlaps the destination (i.e. the distance is
+ * shorter than the length), it is repeated with 8-byte copies for
+ * distances of 8 or more, as a memset() for a distance of 0, and in
+ * steps of dist + 1 bytes otherwise.
  */
 static bool XZ_FUNC dict_repeat(
 		struct dictionary *dict, uint32_t *len, uint32_t dist)
 {
-	size_t back;
-	uint32_t left;
+	uint8_t *src, *dst;
+	size_t back, step;
+	uint32_t left, copy, i;
 
 	if (dist >= dict->full || dist >= dict->size)
 		return false;
@@ -360,11 +368,35 @@ static bool XZ_FUNC dict_repeat(
 	if (dist >= dict->pos)
 		back += dict->end;
 
-	do {
-		dict->buf[dict->pos++] = dict->buf[back++];
+	while (left > 0) {
+		copy = (uint32_t)min_t(size_t, left, dict->end - back);
+		src = &dict->buf[back];
+		dst = &dict->buf[dict->pos];
+		step = dict->pos - back;
+
+		if (back > dict->pos || copy <= step) {
+			/* No overlap, or the destination comes first */
+			memmove(dst, src, copy);
+		} else if (step == 1) {
+			memset(dst, *src, copy);
+		} else if (step >= 8) {
+			for (i = 0; i + 8 <= copy; i += 8)
+				memcpy(&dst[i], &src[i], 8);
+			for (; i < copy; i++)
+				dst[i] = src[i];
+		} else {
+			for (i = 0; i + step <= copy; i += (uint32_t)step)
+				memcpy(&dst[i], &src[i], step);
+			for (; i < copy; i++)
+				dst[i] = src[i];
+		}
+
+		dict->pos += copy;
+		back += copy;
 		if (back == dict->end)
 			back = 0;
-	} while (--left > 0);
+		left -= copy;
+	}
 
 	if (dict->full < dict->pos)
 		dict->full = dict->pos;
@@ -517,6 +549,31 @@ static __always_inline int XZ_FUNC rc_bit(struct rc_dec *rc, uint16_t *prob)
 	return bit;
 }
 
+/*
+ * Same as rc_bit(), but without branching on the value of the bit. This is
+ * for the bittrees, where the bits are only used to compute the next index,
+ * and where the branch of rc_bit() would be mispredicted about half of the
+ * time. Besides the masks, the probability update relies on an arithmetic
+ * right shift, with (31 - p) >> 5 being the same as -(p >> 5).
+ */
+static __always_inline uint32_t XZ_FUNC rc_bit_nb(struct rc_dec *rc,
+		uint16_t *prob)
+{
+	uint32_t bound;
+	uint32_t mask;
+
+	rc_normalize(rc);
+	bound = (rc->range >> RC_BIT_MODEL_TOTAL_BITS) * *prob;
+	mask = (uint32_t)0 - (uint32_t)(rc->code >= bound);
+	rc->range = (bound & ~mask) | ((rc->range - bound) & mask);
+	rc->code -= bound & mask;
+	*prob = (uint16_t)(*prob + ((int32_t)((RC_BIT_MODEL_TOTAL & ~mask)
+			+ (((1 << RC_MOVE_BITS) - 1) & mask) - *prob)
+			>> RC_MOVE_BITS));
+
+	return mask & 1;
+}
+
 /* Decode a bittree starting from the most significant bit. */
 static __always_inline uint32_t XZ_FUNC rc_bittree(
 		struct rc_dec *rc, uint16_t *probs, uint32_t limit)
@@ -524,10 +581,7 @@ static __always_inline uint32_t XZ_FUNC rc_bittree(
 	uint32_t symbol = 1;
 
 	do {
-		if (rc_bit(rc, &probs[symbol]))
-			symbol = (symbol << 1) + 1;
-		else
-			symbol <<= 1;
+		symbol = (symbol << 1) + rc_bit_nb(rc, &probs[symbol]);
 	} while (symbol < limit);
 
 	return symbol;
@@ -538,15 +592,13 @@ static __always_inline void XZ_FUNC rc_bittree_reverse(struct rc_dec *rc,
 		uint16_t *probs, uint32_t *dest, uint32_t limit)
 {
 	uint32_t symbol = 1;
+	uint32_t bit;
 	uint32_t i = 0;
 
 	do {
-		if (rc_bit(rc, &probs[symbol])) {
-			symbol = (symbol << 1) + 1;
-			*dest += 1 << i;
-		} else {
-			symbol <<= 1;
-		}
+		bit = rc_bit_nb(rc, &probs[symbol]);
+		symbol = (symbol << 1) + bit;
+		*dest += bit << i;
 	} while (++i < limit);
 }
 
@@ -587,6 +639,7 @@ static void XZ_FUNC lzma_literal(struct xz_dec_lzma2 *s)
 	uint32_t match_byte;
 	uint32_t match_bit;
 	uint32_t offset;
+	uint32_t bit;
 	uint32_t i;
 
 	probs = lzma_literal_probs(s);
@@ -598,19 +651,23 @@ static void XZ_FUNC lzma_literal(struct xz_dec_lzma2 *s)
 		match_byte = dict_get(&s->dict, s->lzma.rep0) << 1;
 		offset = 0x100;
 
+		/*
+		 * Use the matched byte for as long as the decoded bits agree
+		 * with it. After the first mismatch, offset is zero, and the
+		 * remaining bits are decoded as a regular bittree.
+		 */
 		do {
 			match_bit = match_byte & offset;
 			match_byte <<= 1;
 			i = offset + match_bit + symbol;
 
-			if (rc_bit(&s->rc, &probs[i])) {
-				symbol = (symbol << 1) + 1;
-				offset &= match_bit;
-			} else {
-				symbol <<= 1;
-				offset &= ~match_bit;
-			}
-		} while (symbol < 0x100);
+			bit = rc_bit_nb(&s->rc, &probs[i]);
+			symbol = (symbol << 1) + bit;
+			offset &= match_bit ^ ~((uint32_t)0 - bit);
+		} while (offset != 0 && symbol < 0x100);
+
+		while (symbol < 0x100)
+			symbol = (symbol << 1) + rc_bit_nb(&s->rc, &probs[symbol]);
 	}
 
 	dict_put(&s->dict, (uint8_t)symbol);
@@ -0,0 +1,169 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Block device I/O
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The raw accesses to drives and volumes go through this layer, whether they are the large
+ * asynchronous streams of the image writes, verification, saves, zeroing and bad blocks checks,
+ * which use a queue from BlockCreateQueue(), or the small synchronous ones that access the partition
+ * tables, boot records and file system structures (ms-sys, FAT32 and ext formatting, libfat, bad
+ * blocks...), which use BlockIo(). Either way, each request:
+ * - is positioned, so that it doesn't depend on (or alter) a file pointer, which also makes the
+ *   retry of a failed request trivial,
+ * - has its size and offset checked against the minimum sector size, so that a misaligned access
+ *   fails with a proper error, rather than with whatever the storage driver makes of it,
+ * - gets reported to UpdateIoHeatmap(), which adds it to the timeline of the operation and to ETW,
+ *   and, when the caller provides a heatmap, to the per zone statistics and the drive health checks.
+ * TRIMs and cache flushes, as well as retries and errors, are tallied in the timeline too.
+ */
+
+#ifdef _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rufus.h"
+#include "missing.h"
+#include "drive.h"
+#include "winio.h"
+
+#define BLOCK_IO_MIN_SECTOR_SIZE    512
+
+/*
+ * Issue a positioned read or write, of dwSize bytes at u64Offset, with up to nRetries retries
+ * on error. Between retries, we check for processes that may be conflicting with our access,
+ * and give up if the user cancelled the operation. hDrive can be a synchronous handle, or one
+ * that was opened for overlapped I/O, in which case we wait for the request to complete.
+ * The number of bytes that were actually transferred is returned in lpTransferred, if not NULL.
+ */
+BOOL BlockIo(HANDLE hDrive, BOOL bWrite, void* lpBuffer, DWORD dwSize, uint64_t u64Offset,
+	DWORD nRetries, IO_HEATMAP* heatmap, DWORD* lpTransferred)
+{
+	BOOL r;
+	DWORD nTry, err, transferred = 0;
+	OVERLAPPED overlapped;
+	uint64_t start, duration;
+
+	if (lpTransferred != NULL)
+		*lpTransferred = 0;
+	if ((dwSize % BLOCK_IO_MIN_SECTOR_SIZE != 0) || (u64Offset % BLOCK_IO_MIN_SECTOR_SIZE != 0)) {
+		uprintf("Block I/O: Unaligned %s of %d bytes at offset 0x%llX", bWrite ? "write" : "read", dwSize, u64Offset);
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	for (nTry = 0; ; nTry++) {
+		memset(&overlapped, 0, sizeof(overlapped));
+		overlapped.Offset = (DWORD)u64Offset;
+		overlapped.OffsetHigh = (DWORD)(u64Offset >> 32);
+		start = GetIoTimestamp();
+		r = bWrite ? WriteFile(hDrive, lpBuffer, dwSize, &transferred, &overlapped) :
+			ReadFile(hDrive, lpBuffer, dwSize, &transferred, &overlapped);
+		if (!r && (GetLastError() == ERROR_IO_PENDING))
+			r = GetOverlappedResult(hDrive, &overlapped, &transferred, TRUE);
+		err = r ? (bWrite ? ERROR_WRITE_FAULT : ERROR_READ_FAULT) : GetLastError();
+		if (r) {
+			duration = GetIoTimestamp() - start;
+			UpdateIoHeatmap(heatmap, bWrite, u64Offset, transferred, duration, duration);
+			if (lpTransferred != NULL)
+				*lpTransferred = transferred;
+			if (bWrite)
+				LastWriteError = 0;
+			if (transferred == dwSize)
+				return TRUE;
+			// Some large drives return 0, even though all the data was written - See github #787
+			if (bWrite && large_drive && (transferred == 0)) {
+				uprintf("Warning: Possible short write");
+				return TRUE;
+			}
+		}
+		if (bWrite)
+			LastWriteError = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | err;
+		TraceTally(bWrite ? "write errors" : "read errors", 1, 0, dwSize);
+		if ((nTry >= nRetries) || IS_ERROR(FormatStatus))
+			break;
+		if (r)
+			uprintf("Block I/O: %s %d bytes at offset 0x%llX, instead of %d", bWrite ? "Wrote" : "Read",
+				transferred, u64Offset, dwSize);
+		else
+			uprintf("Block I/O: %s error at offset 0x%llX: %s", bWrite ? "Write" : "Read", u64Offset,
+				WindowsErrorString());
+		uprintf("Retrying in up to %d seconds...", WRITE_TIMEOUT / 1000);
+		start = GetIoTimestamp();
+		// Don't sit idly but use the downtime to check for conflicting processes...
+		if (!CancellableSleep(CheckDriveAccess(WRITE_TIMEOUT, FALSE)))
+			break;
+		TraceTally(bWrite ? "write retries" : "read retries", 1, GetIoTimestamp() - start, 0);
+	}
+	SetLastError(err);
+	return FALSE;
+}
+
+/*
+ * Create an asynchronous queue of up to dwDepth requests for a drive, whose requests get
+ * reported the same way as the ones from BlockIo(). heatmap can be NULL.
+ */
+HANDLE BlockCreateQueue(HANDLE hDrive, DWORD dwDesiredAccess, DWORD dwDepth, IO_HEATMAP* heatmap)
+{
+	HANDLE hQueue = CreateAsyncQueue(hDrive, dwDesiredAccess, max(1, min(dwDepth, MAX_ASYNC_QUEUE_DEPTH)));
+
+	if (hQueue != NULL)
+		SetAsyncQueueMonitor(hQueue, UpdateIoHeatmap, heatmap);
+	return hQueue;
+}
+
+// Issue a TRIM for a byte range of a drive, in chunks that no driver should be tempted to reject
+BOOL BlockTrim(HANDLE hDrive, uint64_t u64Offset, uint64_t u64Size)
+{
+	DWORD size, count = 0;
+	DSM_TRIM_REQUEST dsm;
+	uint64_t start = GetIoTimestamp(), trimmed = 0;
+	BOOL r = TRUE;
+
+	for (; u64Size > 0; u64Offset += dsm.LengthInBytes, u64Size -= dsm.LengthInBytes) {
+		memset(&dsm, 0, sizeof(dsm));
+		dsm.Size = offsetof(DSM_TRIM_REQUEST, StartingOffset);
+		dsm.Action = DSM_ACTION_TRIM;
+		dsm.DataSetRangesOffset = offsetof(DSM_TRIM_REQUEST, StartingOffset);
+		dsm.DataSetRangesLength = sizeof(dsm) - offsetof(DSM_TRIM_REQUEST, StartingOffset);
+		dsm.StartingOffset = u64Offset;
+		dsm.LengthInBytes = min(u64Size, MAX_TRIM_SIZE);
+		if (!DeviceIoControl(hDrive, IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES, &dsm, sizeof(dsm), NULL, 0, &size, NULL)) {
+			r = FALSE;
+			break;
+		}
+		count++;
+		trimmed += dsm.LengthInBytes;
+	}
+	TraceTally("trims", count, GetIoTimestamp() - start, trimmed);
+	return r;
+}
+
+// Flush the write cache of a drive or volume
+BOOL BlockFlush(HANDLE hDrive)
+{
+	uint64_t start = GetIoTimestamp();
+	BOOL r = FlushFileBuffers(hDrive);
+
+	TraceTally("flushes", 1, GetIoTimestamp() - start, 0);
+	return r;
+}
@@ -55,7 +55,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <malloc.h>
 #include <string.h>
+#include <ctype.h>
 #include <inttypes.h>
 #include <errno.h>
 #include <windowsx.h>
@@ -70,14 +72,12 @@
 
 #undef BIG_ENDIAN_HOST
 
-#define BUFFER_SIZE         (64*KB)
-#define WAIT_TIME           5000
-
 /* Blocksize for each algorithm - Must be a power of 2 */
 #define MD5_BLOCKSIZE       64
 #define SHA1_BLOCKSIZE      64
 #define SHA256_BLOCKSIZE    64
 #define SHA512_BLOCKSIZE    128
+#define BLAKE3_BLOCKSIZE    64
 #define MAX_BLOCKSIZE       SHA512_BLOCKSIZE
 
 /* Hashsize for each algorithm */
@@ -85,20 +85,71 @@
 #define SHA1_HASHSIZE       20
 #define SHA256_HASHSIZE     32
 #define SHA512_HASHSIZE     64
+#define BLAKE3_HASHSIZE     32
 #define MAX_HASHSIZE        SHA512_HASHSIZE
 
-/* Number of buffers we work with */
-#define NUM_BUFFERS         3   // 2 + 1 as a mere double buffered async I/O
-                                // would modify the buffer being processed.
+/* BLAKE3 tree parameters */
+#define BLAKE3_CHUNK_LEN    1024
+#define BLAKE3_MAX_DEPTH    54
+
+/* Number of buffers in the ring shared by the reader and the checksum threads */
+#define SUM_RING_SLOTS      8   // Must be a power of 2
+#define SUM_RING_MAX_SIZE   16  // Maximum size of an individual ring buffer, in MB
+#define SUM_SPIN_COUNT      1024
+
+/*
+ * Single producer (SumThread or the hash stream writer), multiple consumers
+ * (IndividualSumThread) ring. The producer publishes each slot by incrementing
+ * 'produced' and each hash thread releases it by incrementing its own 'consumed'
+ * counter, so that the producer only has to wait when the slowest hash is a full
+ * ring behind. Counters are kept on separate cache lines to avoid false sharing.
+ */
+typedef struct {
+	volatile LONG value;
+	uint8_t padding[64 - sizeof(LONG)];
+} sum_counter_t;
+
+static struct {
+	sum_counter_t produced;
+	// One more consumer than checksums, for the block manifest thread
+	sum_counter_t consumed[CHECKSUM_MAX + 1];
+	volatile LONG abort;
+	int num_checksums;
+	int num_consumers;
+	HANDLE thread[CHECKSUM_MAX + 1];
+	block_manifest* manifest;
+	DWORD buf_size;
+	DWORD size[SUM_RING_SLOTS];
+	uint8_t* data;
+	// Hash stream producer state
+	LONG fill_pos;
+	DWORD fill_size;
+	BOOL is_open;
+} ALIGNED(64) sum_ring;
+
+#define SUM_RING_BUF(n)     (&sum_ring.data[(size_t)((n) & (SUM_RING_SLOTS - 1)) * sum_ring.buf_size])
 
 /* Globals */
 char sum_str[CHECKSUM_MAX][150];
-uint32_t proc_bufnum, sum_count[CHECKSUM_MAX] = { MD5_HASHSIZE, SHA1_HASHSIZE, SHA256_HASHSIZE, SHA512_HASHSIZE };
-HANDLE data_ready[CHECKSUM_MAX] = { 0 }, thread_ready[CHECKSUM_MAX] = { 0 };
-DWORD read_size[NUM_BUFFERS];
-BOOL enable_extra_hashes = FALSE;
-uint8_t ALIGNED(64) buffer[NUM_BUFFERS][BUFFER_SIZE];
-extern int default_thread_priority;
+uint32_t sum_count[CHECKSUM_MAX] = { MD5_HASHSIZE, SHA1_HASHSIZE, SHA256_HASHSIZE, SHA512_HASHSIZE, BLAKE3_HASHSIZE };
+BOOL enable_extra_hashes = FALSE, enable_write_hashes = FALSE;
+extern int default_thread_priority, checksum_buffer_size;
+
+/* The file that sum_str[] was computed for, so that we don't have to hash it again */
+static struct {
+	char* path;
+	uint64_t stamp[2];
+	BOOL extra_hashes;
+} sum_file = { 0 };
+
+/* The outcome of the last IsFileInDB() lookups, for files that get checked repeatedly */
+#define MAX_DB_LOOKUPS 16
+static struct {
+	char* path;
+	uint64_t stamp[2];
+	BOOL in_db;
+} db_lookup[MAX_DB_LOOKUPS] = { 0 };
+static int db_lookup_next = 0;
 
 /*
  * Rotate 32 or 64 bit integers by n bytes.
@@ -152,6 +203,25 @@ static const uint64_t K512[80] = {
 	0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
 };
 
+/*
+ * BLAKE3 hashes the data as a binary tree of 1 KB chunks, so that, unlike the other algorithms,
+ * large buffers can be split into subtrees that get hashed on separate threads. The chaining
+ * values of the completed subtrees wait on a stack, until they can be merged into parents.
+ */
+typedef struct {
+	uint32_t cv[8];
+	uint64_t chunk_counter;
+	uint8_t buf[BLAKE3_BLOCKSIZE];
+	uint8_t buf_len;
+	uint8_t blocks_compressed;
+} BLAKE3_CHUNK_STATE;
+
+typedef struct {
+	BLAKE3_CHUNK_STATE chunk;
+	uint8_t cv_stack_len;
+	uint32_t cv_stack[BLAKE3_MAX_DEPTH + 1][8];
+} BLAKE3_HASHER;
+
 /*
  * For convenience, we use a common context for all the checksum algorithms,
  * which means some elements may be unused...
@@ -160,6 +230,7 @@ typedef struct ALIGNED(64) {
 	uint8_t buf[MAX_BLOCKSIZE];
 	uint64_t state[8];
 	uint64_t bytecount;
+	BLAKE3_HASHER blake3;
 } SUM_CONTEXT;
 
 static void md5_init(SUM_CONTEXT *ctx)
@@ -735,6 +806,504 @@ static void md5_write(SUM_CONTEXT *ctx, const uint8_t *buf, size_t len)
 	memcpy(ctx->buf, buf, len);
 }
 
+/*
+ * Hardware accelerated kernels, selected at runtime by DetectChecksumAcceleration():
+ * - SHA-1 and SHA-256 using the Intel SHA extensions (SHA-NI), based on the public
+ *   domain code from Jeffrey Walton, itself based on Intel's and Sean Gulley's.
+ * - SHA-512 using AVX2 to compute the message schedule of 4 blocks in parallel (one
+ *   per 64-bit lane), with the rounds, that can't be parallelized, done in scalar.
+ * - SHA-256 of 8 independent messages at once using AVX2 (one per 32-bit lane), for
+ *   the files of HashFiles(), when SHA-NI is not available.
+ * - SHA-1 and SHA-256 using the ARMv8 cryptographic extensions on ARM64.
+ * These process all the full blocks of a write in one call, so that the state can
+ * stay in registers, and are otherwise plugged into the regular sum_write[] table.
+ */
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define CPU_X86_ACCELERATION
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TARGET(x)
+#else
+#include <cpuid.h>
+#define TARGET(x) __attribute__((target(x)))
+#endif
+#elif defined(_M_ARM64) || (defined(__aarch64__) && defined(__ARM_FEATURE_CRYPTO))
+#define CPU_ARM64_ACCELERATION
+#if defined(_MSC_VER)
+#include <arm64_neon.h>
+#else
+#include <arm_neon.h>
+#endif
+#endif
+
+#if defined(CPU_X86_ACCELERATION) || defined(CPU_ARM64_ACCELERATION)
+typedef void sum_transform_blocks_t(SUM_CONTEXT *ctx, const uint8_t *data, size_t nblocks);
+
+/* Same as the regular sha#_write() calls, but with a multiblock transform */
+static __inline void sum_write_blocks(SUM_CONTEXT *ctx, const uint8_t *buf, size_t len,
+	const size_t blocksize, sum_transform_blocks_t *transform)
+{
+	size_t num = ctx->bytecount & (blocksize - 1);
+
+	/* Update bytecount */
+	ctx->bytecount += len;
+
+	/* Handle any leading odd-sized chunks */
+	if (num) {
+		uint8_t *p = ctx->buf + num;
+
+		num = blocksize - num;
+		if (len < num) {
+			memcpy(p, buf, len);
+			return;
+		}
+		memcpy(p, buf, num);
+		transform(ctx, ctx->buf, 1);
+		buf += num;
+		len -= num;
+	}
+
+	/* Process all the full blocks at once */
+	if (len >= blocksize) {
+		transform(ctx, buf, len / blocksize);
+		buf += len & ~(blocksize - 1);
+		len &= blocksize - 1;
+	}
+
+	/* Handle any remaining bytes of data. */
+	memcpy(ctx->buf, buf, len);
+}
+#endif
+
+#if defined(CPU_X86_ACCELERATION)
+TARGET("sha,sse4.1")
+static void sha1_transform_ni(SUM_CONTEXT *ctx, const uint8_t *data, size_t nblocks)
+{
+	__m128i abcd, abcd_save, e0, e0_save, e1, m0, m1, m2, m3;
+	const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+	abcd = _mm_set_epi32((int)ctx->state[0], (int)ctx->state[1], (int)ctx->state[2], (int)ctx->state[3]);
+	e0 = _mm_set_epi32((int)ctx->state[4], 0, 0, 0);
+
+// Rounds 4*i to 4*i+3, with e_cur holding the E value for that group and m its message words
+#define SHA1_NI_ROUNDS(e_cur, e_next, m, f) do { \
+	e_cur = _mm_sha1nexte_epu32(e_cur, m); \
+	e_next = abcd; \
+	abcd = _mm_sha1rnds4_epu32(abcd, e_cur, f); } while (0)
+
+	while (nblocks--) {
+		abcd_save = abcd;
+		e0_save = e0;
+
+		/* Rounds 0-15: load the message */
+		m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 0)), mask);
+		e0 = _mm_add_epi32(e0, m0);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+		m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16)), mask);
+		SHA1_NI_ROUNDS(e1, e0, m1, 0);
+		m0 = _mm_sha1msg1_epu32(m0, m1);
+		m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 32)), mask);
+		SHA1_NI_ROUNDS(e0, e1, m2, 0);
+		m1 = _mm_sha1msg1_epu32(m1, m2);
+		m0 = _mm_xor_si128(m0, m2);
+		m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 48)), mask);
+		m0 = _mm_sha1msg2_epu32(m0, m3);
+		SHA1_NI_ROUNDS(e1, e0, m3, 0);
+		m2 = _mm_sha1msg1_epu32(m2, m3);
+		m1 = _mm_xor_si128(m1, m3);
+
+		/* Rounds 16-67: extend the message as we go */
+#define SHA1_NI_EXTEND(e_cur, e_next, mc, mp1, mp2, mn1, f) do { \
+	mn1 = _mm_sha1msg2_epu32(mn1, mc); \
+	SHA1_NI_ROUNDS(e_cur, e_next, mc, f); \
+	mp1 = _mm_sha1msg1_epu32(mp1, mc); \
+	mp2 = _mm_xor_si128(mp2, mc); } while (0)
+		SHA1_NI_EXTEND(e0, e1, m0, m3, m2, m1, 0);
+		SHA1_NI_EXTEND(e1, e0, m1, m0, m3, m2, 1);
+		SHA1_NI_EXTEND(e0, e1, m2, m1, m0, m3, 1);
+		SHA1_NI_EXTEND(e1, e0, m3, m2, m1, m0, 1);
+		SHA1_NI_EXTEND(e0, e1, m0, m3, m2, m1, 1);
+		SHA1_NI_EXTEND(e1, e0, m1, m0, m3, m2, 1);
+		SHA1_NI_EXTEND(e0, e1, m2, m1, m0, m3, 2);
+		SHA1_NI_EXTEND(e1, e0, m3, m2, m1, m0, 2);
+		SHA1_NI_EXTEND(e0, e1, m0, m3, m2, m1, 2);
+		SHA1_NI_EXTEND(e1, e0, m1, m0, m3, m2, 2);
+		SHA1_NI_EXTEND(e0, e1, m2, m1, m0, m3, 2);
+		SHA1_NI_EXTEND(e1, e0, m3, m2, m1, m0, 3);
+		SHA1_NI_EXTEND(e0, e1, m0, m3, m2, m1, 3);
+#undef SHA1_NI_EXTEND
+
+		/* Rounds 68-79: finish the message extension */
+		m2 = _mm_sha1msg2_epu32(m2, m1);
+		SHA1_NI_ROUNDS(e1, e0, m1, 3);
+		m3 = _mm_xor_si128(m3, m1);
+		m3 = _mm_sha1msg2_epu32(m3, m2);
+		SHA1_NI_ROUNDS(e0, e1, m2, 3);
+		SHA1_NI_ROUNDS(e1, e0, m3, 3);
+
+		e0 = _mm_sha1nexte_epu32(e0, e0_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+		data += SHA1_BLOCKSIZE;
+	}
+#undef SHA1_NI_ROUNDS
+
+	ctx->state[0] = (uint32_t)_mm_extract_epi32(abcd, 3);
+	ctx->state[1] = (uint32_t)_mm_extract_epi32(abcd, 2);
+	ctx->state[2] = (uint32_t)_mm_extract_epi32(abcd, 1);
+	ctx->state[3] = (uint32_t)_mm_extract_epi32(abcd, 0);
+	ctx->state[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+
+TARGET("sha,sse4.1")
+static void sha256_transform_ni(SUM_CONTEXT *ctx, const uint8_t *data, size_t nblocks)
+{
+	__m128i state0, state1, save0, save1, msg, tmp, m0, m1, m2, m3;
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+	/* The SHA-NI instructions use an ABEF/CDGH state layout */
+	tmp = _mm_set_epi32((int)ctx->state[3], (int)ctx->state[2], (int)ctx->state[1], (int)ctx->state[0]);
+	state1 = _mm_set_epi32((int)ctx->state[7], (int)ctx->state[6], (int)ctx->state[5], (int)ctx->state[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);			// CDAB
+	state1 = _mm_shuffle_epi32(state1, 0x1B);		// EFGH
+	state0 = _mm_alignr_epi8(tmp, state1, 8);		// ABEF
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);	// CDGH
+
+// Rounds i to i+3, with m holding the message words for these
+#define SHA256_NI_ROUNDS(m, i) do { \
+	msg = _mm_add_epi32(m, _mm_loadu_si128((const __m128i*)&K256[i])); \
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg); \
+	state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E)); } while (0)
+// Compute the next 4 message words into m0, from the previous 16 in m0-m3
+#define SHA256_NI_EXTEND(m0, m1, m2, m3) \
+	m0 = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(m0, m1), _mm_alignr_epi8(m3, m2, 4)), m3)
+#define SHA256_NI_ROUNDS_16(i) do { \
+	SHA256_NI_EXTEND(m0, m1, m2, m3); SHA256_NI_ROUNDS(m0, i); \
+	SHA256_NI_EXTEND(m1, m2, m3, m0); SHA256_NI_ROUNDS(m1, i + 4); \
+	SHA256_NI_EXTEND(m2, m3, m0, m1); SHA256_NI_ROUNDS(m2, i + 8); \
+	SHA256_NI_EXTEND(m3, m0, m1, m2); SHA256_NI_ROUNDS(m3, i + 12); } while (0)
+
+	while (nblocks--) {
+		save0 = state0;
+		save1 = state1;
+
+		m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 0)), mask);
+		SHA256_NI_ROUNDS(m0, 0);
+		m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16)), mask);
+		SHA256_NI_ROUNDS(m1, 4);
+		m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 32)), mask);
+		SHA256_NI_ROUNDS(m2, 8);
+		m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 48)), mask);
+		SHA256_NI_ROUNDS(m3, 12);
+		SHA256_NI_ROUNDS_16(16);
+		SHA256_NI_ROUNDS_16(32);
+		SHA256_NI_ROUNDS_16(48);
+
+		state0 = _mm_add_epi32(state0, save0);
+		state1 = _mm_add_epi32(state1, save1);
+		data += SHA256_BLOCKSIZE;
+	}
+#undef SHA256_NI_ROUNDS_16
+#undef SHA256_NI_EXTEND
+#undef SHA256_NI_ROUNDS
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);			// FEBA
+	state1 = _mm_shuffle_epi32(state1, 0xB1);		// DCHG
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);	// DCBA
+	state1 = _mm_alignr_epi8(state1, tmp, 8);		// HGFE
+	ctx->state[0] = (uint32_t)_mm_extract_epi32(state0, 0);
+	ctx->state[1] = (uint32_t)_mm_extract_epi32(state0, 1);
+	ctx->state[2] = (uint32_t)_mm_extract_epi32(state0, 2);
+	ctx->state[3] = (uint32_t)_mm_extract_epi32(state0, 3);
+	ctx->state[4] = (uint32_t)_mm_extract_epi32(state1, 0);
+	ctx->state[5] = (uint32_t)_mm_extract_epi32(state1, 1);
+	ctx->state[6] = (uint32_t)_mm_extract_epi32(state1, 2);
+	ctx->state[7] = (uint32_t)_mm_extract_epi32(state1, 3);
+}
+
+TARGET("avx2")
+static void sha512_transform_avx2(SUM_CONTEXT *ctx, const uint8_t *data, size_t nblocks)
+{
+	uint64_t ALIGNED(32) wk[80][4];
+	uint64_t a, b, c, d, e, f, g, h;
+	__m256i w[16];
+	uint32_t i, j;
+
+#define S0(x) (ROR64(ROR64(ROR64(x,5)^(x),6)^(x),28))	// Σ0 (Sigma 0)
+#define S1(x) (ROR64(ROR64(ROR64(x,23)^(x),4)^(x),14))	// Σ1 (Sigma 1)
+#define VROR64(x,n) _mm256_or_si256(_mm256_srli_epi64(x, n), _mm256_slli_epi64(x, 64 - (n)))
+#define vs0(x) _mm256_xor_si256(_mm256_xor_si256(VROR64(x, 1), VROR64(x, 8)), _mm256_srli_epi64(x, 7))	// σ0 (sigma 0)
+#define vs1(x) _mm256_xor_si256(_mm256_xor_si256(VROR64(x, 19), VROR64(x, 61)), _mm256_srli_epi64(x, 6))	// σ1 (sigma 1)
+#define R(a, b, c, d, e, f, g, h, i) \
+	h += S1(e) + Ch(e, f, g) + wk[i][j]; \
+	d += h; \
+	h += S0(a) + Ma(a, b, c)
+
+	for (; nblocks >= 4; nblocks -= 4, data += 4 * SHA512_BLOCKSIZE) {
+		/* Compute W[t] + K[t] for 4 blocks at once, with block j in lane j */
+		for (i = 0; i < 80; i++) {
+			if (i < 16) {
+				w[i] = _mm256_set_epi64x((int64_t)read_swap64(&data[3 * SHA512_BLOCKSIZE + 8 * i]),
+					(int64_t)read_swap64(&data[2 * SHA512_BLOCKSIZE + 8 * i]),
+					(int64_t)read_swap64(&data[1 * SHA512_BLOCKSIZE + 8 * i]),
+					(int64_t)read_swap64(&data[8 * i]));
+			} else {
+				w[i & 15] = _mm256_add_epi64(_mm256_add_epi64(vs1(w[(i - 2) & 15]), w[(i - 7) & 15]),
+					_mm256_add_epi64(vs0(w[(i - 15) & 15]), w[i & 15]));
+			}
+			_mm256_store_si256((__m256i*)wk[i], _mm256_add_epi64(w[i & 15], _mm256_set1_epi64x((int64_t)K512[i])));
+		}
+
+		for (j = 0; j < 4; j++) {
+			a = ctx->state[0];
+			b = ctx->state[1];
+			c = ctx->state[2];
+			d = ctx->state[3];
+			e = ctx->state[4];
+			f = ctx->state[5];
+			g = ctx->state[6];
+			h = ctx->state[7];
+			for (i = 0; i < 80; i += 8) {
+				R(a, b, c, d, e, f, g, h, i);
+				R(h, a, b, c, d, e, f, g, i+1);
+				R(g, h, a, b, c, d, e, f, i+2);
+				R(f, g, h, a, b, c, d, e, i+3);
+				R(e, f, g, h, a, b, c, d, i+4);
+				R(d, e, f, g, h, a, b, c, i+5);
+				R(c, d, e, f, g, h, a, b, i+6);
+				R(b, c, d, e, f, g, h, a, i+7);
+			}
+			ctx->state[0] += a;
+			ctx->state[1] += b;
+			ctx->state[2] += c;
+			ctx->state[3] += d;
+			ctx->state[4] += e;
+			ctx->state[5] += f;
+			ctx->state[6] += g;
+			ctx->state[7] += h;
+		}
+	}
+
+#undef S0
+#undef S1
+#undef VROR64
+#undef vs0
+#undef vs1
+#undef R
+
+	/* Leftover blocks */
+	for (; nblocks > 0; nblocks--, data += SHA512_BLOCKSIZE)
+		sha512_transform(ctx, data);
+}
+
+/*
+ * Multi-buffer SHA-256, for HashFiles(): the rounds of a single message can't be parallelized,
+ * but those of 8 independent messages can, so this processes one block of each of 8 messages,
+ * with message j in 32-bit lane j of every register. state[i][j] is word i of the state of j.
+ */
+#define SHA256_LANES						8
+
+TARGET("avx2")
+static void sha256_transform_x8_avx2(uint32_t state[8][SHA256_LANES], const uint8_t *data[SHA256_LANES])
+{
+	__m256i s[8], v[8], t[8], w[16], a, b, c, d, e, f, g, h, t1, t2;
+	const __m256i bswap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+		12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	int i, j;
+
+#define VROR32(x,n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define VS0(x) _mm256_xor_si256(_mm256_xor_si256(VROR32(x, 2), VROR32(x, 13)), VROR32(x, 22))	// Σ0 (Sigma 0)
+#define VS1(x) _mm256_xor_si256(_mm256_xor_si256(VROR32(x, 6), VROR32(x, 11)), VROR32(x, 25))	// Σ1 (Sigma 1)
+#define vs0(x) _mm256_xor_si256(_mm256_xor_si256(VROR32(x, 7), VROR32(x, 18)), _mm256_srli_epi32(x, 3))	// σ0 (sigma 0)
+#define vs1(x) _mm256_xor_si256(_mm256_xor_si256(VROR32(x, 17), VROR32(x, 19)), _mm256_srli_epi32(x, 10))	// σ1 (sigma 1)
+#define VCh(x,y,z) _mm256_xor_si256(z, _mm256_and_si256(x, _mm256_xor_si256(y, z)))
+#define VMa(x,y,z) _mm256_or_si256(_mm256_and_si256(x, y), _mm256_and_si256(z, _mm256_or_si256(x, y)))
+
+	for (i = 0; i < 8; i++)
+		s[i] = _mm256_loadu_si256((const __m256i*)state[i]);
+
+	/* Load 8 words of each message, and transpose them so that w[8 * j + i] is word 8 * j + i of all of them */
+	for (j = 0; j < 2; j++) {
+		for (i = 0; i < 8; i++)
+			v[i] = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)&data[i][32 * j]), bswap);
+		for (i = 0; i < 8; i += 2) {
+			t[i] = _mm256_unpacklo_epi32(v[i], v[i + 1]);
+			t[i + 1] = _mm256_unpackhi_epi32(v[i], v[i + 1]);
+		}
+		for (i = 0; i < 8; i += 4) {
+			v[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+			v[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+			v[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+			v[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+		}
+		for (i = 0; i < 4; i++) {
+			w[8 * j + i] = _mm256_permute2x128_si256(v[i], v[i + 4], 0x20);
+			w[8 * j + i + 4] = _mm256_permute2x128_si256(v[i], v[i + 4], 0x31);
+		}
+	}
+
+	a = s[0]; b = s[1]; c = s[2]; d = s[3];
+	e = s[4]; f = s[5]; g = s[6]; h = s[7];
+	for (i = 0; i < 64; i++) {
+		if (i >= 16)
+			w[i & 15] = _mm256_add_epi32(_mm256_add_epi32(vs1(w[(i - 2) & 15]), w[(i - 7) & 15]),
+				_mm256_add_epi32(vs0(w[(i - 15) & 15]), w[i & 15]));
+		t1 = _mm256_add_epi32(_mm256_add_epi32(h, VS1(e)), _mm256_add_epi32(VCh(e, f, g),
+			_mm256_add_epi32(w[i & 15], _mm256_set1_epi32((int)K256[i]))));
+		t2 = _mm256_add_epi32(VS0(a), VMa(a, b, c));
+		h = g; g = f; f = e;
+		e = _mm256_add_epi32(d, t1);
+		d = c; c = b; b = a;
+		a = _mm256_add_epi32(t1, t2);
+	}
+	s[0] = _mm256_add_epi32(s[0], a); s[1] = _mm256_add_epi32(s[1], b);
+	s[2] = _mm256_add_epi32(s[2], c); s[3] = _mm256_add_epi32(s[3], d);
+	s[4] = _mm256_add_epi32(s[4], e); s[5] = _mm256_add_epi32(s[5], f);
+	s[6] = _mm256_add_epi32(s[6], g); s[7] = _mm256_add_epi32(s[7], h);
+
+	for (i = 0; i < 8; i++)
+		_mm256_storeu_si256((__m256i*)state[i], s[i]);
+
+#undef VROR32
+#undef VS0
+#undef VS1
+#undef vs0
+#undef vs1
+#undef VCh
+#undef VMa
+}
+
+static void sha1_write_ni(SUM_CONTEXT *ctx, const uint8_t *buf, size_t len)
+{
+	sum_write_blocks(ctx, buf, len, SHA1_BLOCKSIZE, sha1_transform_ni);
+}
+
+static void sha256_write_ni(SUM_CONTEXT *ctx, const uint8_t *buf, size_t len)
+{
+	sum_write_blocks(ctx, buf, len, SHA256_BLOCKSIZE, sha256_transform_ni);
+}
+
+static void sha512_write_avx2(SUM_CONTEXT *ctx, const uint8_t *buf, size_t len)
+{
+	sum_write_blocks(ctx, buf, len, SHA512_BLOCKSIZE, sha512_transform_avx2);
+}
+
+static void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+{
+#if defined(_MSC_VER)
+	__cpuidex((int*)regs, (int)leaf, (int)subleaf);
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static uint64_t xgetbv(uint32_t index)
+{
+#if defined(_MSC_VER)
+	return _xgetbv(index);
+#else
+	uint32_t eax, edx;
+	__asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(index));
+	return ((uint64_t)edx << 32) | eax;
+#endif
+}
+#endif
+
+#if defined(CPU_ARM64_ACCELERATION)
+#if !defined(PF_ARM_V8_CRYPTO_INSTRUCTIONS_AVAILABLE)
+#define PF_ARM_V8_CRYPTO_INSTRUCTIONS_AVAILABLE 30
+#endif
+#define VREV32(m) vreinterpretq_u32_u8(vrev32q_u8(vreinterpretq_u8_u32(m)))
+
+/*
+ * Each iteration does 4 rounds, from the W[t] of msg[i & 3], which then gets replaced
+ * by the W[t] that are needed 4 iterations later.
+ */
+static void sha1_transform_ce(SUM_CONTEXT *ctx, const uint8_t *data, size_t nblocks)
+{
+	static const uint32_t k[4] = { 0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6 };
+	uint32_t state[4] = { (uint32_t)ctx->state[0], (uint32_t)ctx->state[1],
+		(uint32_t)ctx->state[2], (uint32_t)ctx->state[3] };
+	uint32x4_t abcd, abcd_save, tmp, msg[4];
+	uint32_t e, e_save, e_next;
+	int i;
+
+	abcd = vld1q_u32(state);
+	e = (uint32_t)ctx->state[4];
+	for (; nblocks > 0; nblocks--, data += SHA1_BLOCKSIZE) {
+		abcd_save = abcd;
+		e_save = e;
+		for (i = 0; i < 4; i++)
+			msg[i] = VREV32(vld1q_u32((const uint32_t*)(data + 16 * i)));
+		for (i = 0; i < 20; i++) {
+			tmp = vaddq_u32(msg[i & 3], vdupq_n_u32(k[i / 5]));
+			e_next = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+			if (i < 5)
+				abcd = vsha1cq_u32(abcd, e, tmp);
+			else if ((i < 10) || (i >= 15))
+				abcd = vsha1pq_u32(abcd, e, tmp);
+			else
+				abcd = vsha1mq_u32(abcd, e, tmp);
+			e = e_next;
+			if (i < 16)
+				msg[i & 3] = vsha1su1q_u32(vsha1su0q_u32(msg[i & 3], msg[(i + 1) & 3], msg[(i + 2) & 3]),
+					msg[(i + 3) & 3]);
+		}
+		abcd = vaddq_u32(abcd, abcd_save);
+		e += e_save;
+	}
+	vst1q_u32(state, abcd);
+	for (i = 0; i < 4; i++)
+		ctx->state[i] = state[i];
+	ctx->state[4] = e;
+}
+
+static void sha256_transform_ce(SUM_CONTEXT *ctx, const uint8_t *data, size_t nblocks)
+{
+	uint32_t state[8];
+	uint32x4_t state0, state1, save0, save1, prev0, tmp, msg[4];
+	int i;
+
+	for (i = 0; i < 8; i++)
+		state[i] = (uint32_t)ctx->state[i];
+	state0 = vld1q_u32(&state[0]);
+	state1 = vld1q_u32(&state[4]);
+	for (; nblocks > 0; nblocks--, data += SHA256_BLOCKSIZE) {
+		save0 = state0;
+		save1 = state1;
+		for (i = 0; i < 4; i++)
+			msg[i] = VREV32(vld1q_u32((const uint32_t*)(data + 16 * i)));
+		for (i = 0; i < 16; i++) {
+			tmp = vaddq_u32(msg[i & 3], vld1q_u32(&K256[4 * i]));
+			prev0 = state0;
+			state0 = vsha256hq_u32(state0, state1, tmp);
+			state1 = vsha256h2q_u32(state1, prev0, tmp);
+			if (i < 12)
+				msg[i & 3] = vsha256su1q_u32(vsha256su0q_u32(msg[i & 3], msg[(i + 1) & 3]),
+					msg[(i + 2) & 3], msg[(i + 3) & 3]);
+		}
+		state0 = vaddq_u32(state0, save0);
+		state1 = vaddq_u32(state1, save1);
+	}
+	vst1q_u32(&state[0], state0);
+	vst1q_u32(&state[4], state1);
+	for (i = 0; i < 8; i++)
+		ctx->state[i] = state[i];
+}
+#undef VREV32
+
+static void sha1_write_ce(SUM_CONTEXT *ctx, const uint8_t *buf, size_t len)
+{
+	sum_write_blocks(ctx, buf, len, SHA1_BLOCKSIZE, sha1_transform_ce);
+}
+
+static void sha256_write_ce(SUM_CONTEXT *ctx, const uint8_t *buf, size_t len)
+{
+	sum_write_blocks(ctx, buf, len, SHA256_BLOCKSIZE, sha256_transform_ce);
+}
+#endif
+
 /* Finalize the computation and write the digest in ctx->state[] (SHA-1) */
 static void sha1_final(SUM_CONTEXT *ctx)
 {
@@ -935,6 +1504,371 @@ static void md5_final(SUM_CONTEXT *ctx)
 #undef X
 }
 
+/*
+ * BLAKE3, from the specifications at https://github.com/BLAKE3-team/BLAKE3-specs
+ */
+#define BLAKE3_CHUNK_START  (1 << 0)
+#define BLAKE3_CHUNK_END    (1 << 1)
+#define BLAKE3_PARENT       (1 << 2)
+#define BLAKE3_ROOT         (1 << 3)
+
+static const uint32_t blake3_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint8_t blake3_schedule[7][16] = {
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+	{ 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+	{ 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+	{ 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+	{ 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+	{ 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+#define B3G(a, b, c, d, x, y) do { \
+	s[a] = s[a] + s[b] + (x); s[d] = ROR32(s[d] ^ s[a], 16); \
+	s[c] = s[c] + s[d]; s[b] = ROR32(s[b] ^ s[c], 12); \
+	s[a] = s[a] + s[b] + (y); s[d] = ROR32(s[d] ^ s[a], 8); \
+	s[c] = s[c] + s[d]; s[b] = ROR32(s[b] ^ s[c], 7); } while (0)
+
+// Compress a block, with the message words in m[], and leave the new chaining value in cv[]
+static void blake3_compress(uint32_t cv[8], const uint32_t m[16], uint32_t block_len, uint64_t counter, uint32_t flags)
+{
+	uint32_t s[16];
+	const uint8_t* w;
+	int r, i;
+
+	memcpy(s, cv, 8 * sizeof(uint32_t));
+	memcpy(&s[8], blake3_iv, 4 * sizeof(uint32_t));
+	s[12] = (uint32_t)counter;
+	s[13] = (uint32_t)(counter >> 32);
+	s[14] = block_len;
+	s[15] = flags;
+	for (r = 0; r < 7; r++) {
+		w = blake3_schedule[r];
+		B3G(0, 4, 8, 12, m[w[0]], m[w[1]]);
+		B3G(1, 5, 9, 13, m[w[2]], m[w[3]]);
+		B3G(2, 6, 10, 14, m[w[4]], m[w[5]]);
+		B3G(3, 7, 11, 15, m[w[6]], m[w[7]]);
+		B3G(0, 5, 10, 15, m[w[8]], m[w[9]]);
+		B3G(1, 6, 11, 12, m[w[10]], m[w[11]]);
+		B3G(2, 7, 8, 13, m[w[12]], m[w[13]]);
+		B3G(3, 4, 9, 14, m[w[14]], m[w[15]]);
+	}
+	for (i = 0; i < 8; i++)
+		cv[i] = s[i] ^ s[i + 8];
+}
+#undef B3G
+
+static __inline void blake3_load_block(uint32_t m[16], const uint8_t* block)
+{
+#ifdef BIG_ENDIAN_HOST
+	int i;
+	for (i = 0; i < 16; i++)
+		m[i] = read_swap32(&block[4 * i]);
+#else
+	memcpy(m, block, BLAKE3_BLOCKSIZE);
+#endif
+}
+
+static void blake3_chunk_init(BLAKE3_CHUNK_STATE* chunk, uint64_t chunk_counter)
+{
+	memcpy(chunk->cv, blake3_iv, sizeof(chunk->cv));
+	chunk->chunk_counter = chunk_counter;
+	chunk->buf_len = 0;
+	chunk->blocks_compressed = 0;
+}
+
+static __inline size_t blake3_chunk_len(const BLAKE3_CHUNK_STATE* chunk)
+{
+	return (size_t)chunk->blocks_compressed * BLAKE3_BLOCKSIZE + chunk->buf_len;
+}
+
+static __inline uint32_t blake3_chunk_start_flag(const BLAKE3_CHUNK_STATE* chunk)
+{
+	return (chunk->blocks_compressed == 0) ? BLAKE3_CHUNK_START : 0;
+}
+
+// Add data to a chunk, which must not go over BLAKE3_CHUNK_LEN. The last block is always kept
+// buffered, as it can only be compressed once we know whether it is the end of the chunk.
+static void blake3_chunk_update(BLAKE3_CHUNK_STATE* chunk, const uint8_t* buf, size_t len)
+{
+	uint32_t m[16];
+	size_t size;
+
+	while (len > 0) {
+		if (chunk->buf_len == BLAKE3_BLOCKSIZE) {
+			blake3_load_block(m, chunk->buf);
+			blake3_compress(chunk->cv, m, BLAKE3_BLOCKSIZE, chunk->chunk_counter, blake3_chunk_start_flag(chunk));
+			chunk->blocks_compressed++;
+			chunk->buf_len = 0;
+		}
+		// Full blocks that aren't the last ones of the data can be compressed in place
+		if ((chunk->buf_len == 0) && (len > BLAKE3_BLOCKSIZE)) {
+			blake3_load_block(m, buf);
+			blake3_compress(chunk->cv, m, BLAKE3_BLOCKSIZE, chunk->chunk_counter, blake3_chunk_start_flag(chunk));
+			chunk->blocks_compressed++;
+			buf += BLAKE3_BLOCKSIZE;
+			len -= BLAKE3_BLOCKSIZE;
+			continue;
+		}
+		size = min(len, (size_t)(BLAKE3_BLOCKSIZE - chunk->buf_len));
+		memcpy(&chunk->buf[chunk->buf_len], buf, size);
+		chunk->buf_len += (uint8_t)size;
+		buf += size;
+		len -= size;
+	}
+}
+
+// Compute the chaining value of a chunk, or its root hash words if BLAKE3_ROOT is in flags
+static void blake3_chunk_output(const BLAKE3_CHUNK_STATE* chunk, uint32_t flags, uint32_t cv[8])
+{
+	uint32_t m[16];
+	uint8_t block[BLAKE3_BLOCKSIZE] = { 0 };
+
+	memcpy(block, chunk->buf, chunk->buf_len);
+	blake3_load_block(m, block);
+	memcpy(cv, chunk->cv, 8 * sizeof(uint32_t));
+	blake3_compress(cv, m, chunk->buf_len, (flags & BLAKE3_ROOT) ? 0 : chunk->chunk_counter,
+		blake3_chunk_start_flag(chunk) | BLAKE3_CHUNK_END | flags);
+}
+
+// Compute the chaining value of a parent node, or its root hash words if BLAKE3_ROOT is in flags
+static void blake3_parent_output(const uint32_t left[8], const uint32_t right[8], uint32_t flags, uint32_t cv[8])
+{
+	uint32_t m[16];
+
+	memcpy(m, left, 8 * sizeof(uint32_t));
+	memcpy(&m[8], right, 8 * sizeof(uint32_t));
+	memcpy(cv, blake3_iv, 8 * sizeof(uint32_t));
+	blake3_compress(cv, m, BLAKE3_BLOCKSIZE, 0, BLAKE3_PARENT | flags);
+}
+
+// Compute the chaining value of a complete subtree, of a power of 2 number of chunks
+static void blake3_subtree_cv(const uint8_t* buf, size_t len, uint64_t chunk_counter, uint32_t cv[8])
+{
+	BLAKE3_CHUNK_STATE chunk;
+	uint32_t left[8], right[8];
+
+	if (len <= BLAKE3_CHUNK_LEN) {
+		blake3_chunk_init(&chunk, chunk_counter);
+		blake3_chunk_update(&chunk, buf, len);
+		blake3_chunk_output(&chunk, 0, cv);
+		return;
+	}
+	blake3_subtree_cv(buf, len / 2, chunk_counter, left);
+	blake3_subtree_cv(&buf[len / 2], len / 2, chunk_counter + len / 2 / BLAKE3_CHUNK_LEN, right);
+	blake3_parent_output(left, right, 0, cv);
+}
+
+/*
+ * Pool of threads, that hash the pieces of large subtrees in parallel. The thread that
+ * submits a job also hashes pieces, and waits for all the workers to be done with it,
+ * so that no worker can still be looking at a job when the next one gets set up.
+ */
+#define BLAKE3_MAX_WORKERS      15
+#define BLAKE3_MAX_PIECES       256
+#define BLAKE3_MIN_PIECE_LEN    (16 * 1024)
+#define BLAKE3_MT_MIN_LEN       (128 * 1024)
+
+static struct {
+	SRWLOCK lock;
+	BOOL initialized;
+	int nb_workers;
+	HANDLE hStart, hDone;
+	volatile LONG next, active;
+	const uint8_t* buf;
+	size_t piece_len;
+	uint64_t chunk_counter;
+	LONG nb_pieces;
+	uint32_t cv[BLAKE3_MAX_PIECES][8];
+} blake3_pool = { SRWLOCK_INIT };
+
+static void blake3_pool_run(void)
+{
+	LONG i;
+
+	while ((i = InterlockedIncrement(&blake3_pool.next) - 1) < blake3_pool.nb_pieces)
+		blake3_subtree_cv(&blake3_pool.buf[i * blake3_pool.piece_len], blake3_pool.piece_len,
+			blake3_pool.chunk_counter + i * (blake3_pool.piece_len / BLAKE3_CHUNK_LEN), blake3_pool.cv[i]);
+}
+
+static DWORD WINAPI Blake3WorkerThread(void* param)
+{
+	while (WaitForSingleObject(blake3_pool.hStart, INFINITE) == WAIT_OBJECT_0) {
+		blake3_pool_run();
+		if (InterlockedDecrement(&blake3_pool.active) == 0)
+			SetEvent(blake3_pool.hDone);
+	}
+	return 0;
+}
+
+// Start the workers on first use. These stay around, waiting for jobs, until we exit.
+static void blake3_pool_init(void)
+{
+	HANDLE hThread;
+	int i;
+
+	blake3_pool.initialized = TRUE;
+	blake3_pool.hStart = CreateSemaphore(NULL, 0, BLAKE3_MAX_WORKERS, NULL);
+	blake3_pool.hDone = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if ((blake3_pool.hStart == NULL) || (blake3_pool.hDone == NULL))
+		return;
+	// SMT siblings would just compete for the same vector units
+	for (i = 0; i < min(BLAKE3_MAX_WORKERS, GetComputeCoreCount() - 1); i++) {
+		hThread = CreateThread(NULL, 0, Blake3WorkerThread, NULL, 0, NULL);
+		if (hThread == NULL)
+			break;
+		// The thread that hands out the jobs also takes a share of them
+		SetThreadClass(hThread, THREAD_CLASS_COMPUTE, i + 1);
+		CloseHandle(hThread);
+		blake3_pool.nb_workers++;
+	}
+}
+
+/*
+ * Compute the chaining values of the two halves of a subtree of a power of 2 number of chunks,
+ * using all the cores if the subtree is large enough. We stop at the halves, as the subtree
+ * may end up being the root, which can only be determined once the end of the data is known.
+ */
+static void blake3_subtree_halves(const uint8_t* buf, size_t len, uint64_t chunk_counter, uint32_t left[8], uint32_t right[8])
+{
+	LONG i, n, pieces;
+
+	if ((len >= BLAKE3_MT_MIN_LEN) && TryAcquireSRWLockExclusive(&blake3_pool.lock)) {
+		if (!blake3_pool.initialized)
+			blake3_pool_init();
+		if (blake3_pool.nb_workers > 0) {
+			// A few pieces per thread, so that a slow or preempted thread doesn't hold the others up
+			for (pieces = 2; (pieces < 4 * (blake3_pool.nb_workers + 1)) && (pieces < BLAKE3_MAX_PIECES) &&
+				(len / (2 * pieces) >= BLAKE3_MIN_PIECE_LEN); pieces *= 2);
+			blake3_pool.buf = buf;
+			blake3_pool.piece_len = len / pieces;
+			blake3_pool.chunk_counter = chunk_counter;
+			blake3_pool.nb_pieces = pieces;
+			blake3_pool.next = 0;
+			blake3_pool.active = blake3_pool.nb_workers;
+			ReleaseSemaphore(blake3_pool.hStart, blake3_pool.nb_workers, NULL);
+			blake3_pool_run();
+			WaitForSingleObject(blake3_pool.hDone, INFINITE);
+			// Merge the pieces up to the two halves
+			for (n = pieces; n > 2; n /= 2) {
+				for (i = 0; i < n / 2; i++)
+					blake3_parent_output(blake3_pool.cv[2 * i], blake3_pool.cv[2 * i + 1], 0, blake3_pool.cv[i]);
+			}
+			memcpy(left, blake3_pool.cv[0], 8 * sizeof(uint32_t));
+			memcpy(right, blake3_pool.cv[1], 8 * sizeof(uint32_t));
+			ReleaseSRWLockExclusive(&blake3_pool.lock);
+			return;
+		}
+		ReleaseSRWLockExclusive(&blake3_pool.lock);
+	}
+	blake3_subtree_cv(buf, len / 2, chunk_counter, left);
+	blake3_subtree_cv(&buf[len / 2], len / 2, chunk_counter + len / 2 / BLAKE3_CHUNK_LEN, right);
+}
+
+// Merge the stack entries that are complete subtrees, once we know that more data follows them
+static void blake3_merge_cv_stack(BLAKE3_HASHER* b3, uint64_t total_chunks)
+{
+	uint8_t nb_bits;
+
+	for (nb_bits = 0; total_chunks != 0; total_chunks &= total_chunks - 1)
+		nb_bits++;
+	while (b3->cv_stack_len > nb_bits) {
+		b3->cv_stack_len--;
+		blake3_parent_output(b3->cv_stack[b3->cv_stack_len - 1], b3->cv_stack[b3->cv_stack_len], 0,
+			b3->cv_stack[b3->cv_stack_len - 1]);
+	}
+}
+
+static void blake3_push_cv(BLAKE3_HASHER* b3, const uint32_t cv[8], uint64_t chunk_counter)
+{
+	blake3_merge_cv_stack(b3, chunk_counter);
+	memcpy(b3->cv_stack[b3->cv_stack_len++], cv, 8 * sizeof(uint32_t));
+}
+
+static void blake3_init(SUM_CONTEXT *ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	blake3_chunk_init(&ctx->blake3.chunk, 0);
+}
+
+static void blake3_write(SUM_CONTEXT *ctx, const uint8_t *buf, size_t len)
+{
+	BLAKE3_HASHER* b3 = &ctx->blake3;
+	uint32_t cv[8], right[8];
+	uint64_t count;
+	size_t size;
+
+	ctx->bytecount += len;
+	// Complete the current chunk, if any
+	if (blake3_chunk_len(&b3->chunk) > 0) {
+		size = min(len, BLAKE3_CHUNK_LEN - blake3_chunk_len(&b3->chunk));
+		blake3_chunk_update(&b3->chunk, buf, size);
+		buf += size;
+		len -= size;
+		if (len == 0)
+			return;
+		blake3_chunk_output(&b3->chunk, 0, cv);
+		blake3_push_cv(b3, cv, b3->chunk.chunk_counter);
+		blake3_chunk_init(&b3->chunk, b3->chunk.chunk_counter + 1);
+	}
+	// Then hash the largest subtrees we can, that must start at a multiple of their size.
+	// The last chunk is kept in the chunk state, as it may be the root.
+	while (len > BLAKE3_CHUNK_LEN) {
+		for (size = BLAKE3_CHUNK_LEN; 2 * size <= len; size *= 2);
+		count = b3->chunk.chunk_counter * BLAKE3_CHUNK_LEN;
+		while (((size - 1) & count) != 0)
+			size /= 2;
+		if (size <= BLAKE3_CHUNK_LEN) {
+			blake3_subtree_cv(buf, size, b3->chunk.chunk_counter, cv);
+			blake3_push_cv(b3, cv, b3->chunk.chunk_counter);
+		} else {
+			blake3_subtree_halves(buf, size, b3->chunk.chunk_counter, cv, right);
+			blake3_push_cv(b3, cv, b3->chunk.chunk_counter);
+			blake3_push_cv(b3, right, b3->chunk.chunk_counter + size / 2 / BLAKE3_CHUNK_LEN);
+		}
+		b3->chunk.chunk_counter += size / BLAKE3_CHUNK_LEN;
+		buf += size;
+		len -= size;
+	}
+	if (len > 0) {
+		blake3_chunk_update(&b3->chunk, buf, len);
+		blake3_merge_cv_stack(b3, b3->chunk.chunk_counter);
+	}
+}
+
+/* Finalize the computation and write the digest in ctx->buf[] (BLAKE3) */
+static void blake3_final(SUM_CONTEXT *ctx)
+{
+	BLAKE3_HASHER* b3 = &ctx->blake3;
+	uint32_t cv[8];
+	int i = b3->cv_stack_len;
+
+	if (i == 0) {
+		blake3_chunk_output(&b3->chunk, BLAKE3_ROOT, cv);
+	} else {
+		// Fold the stack into the root, starting from the chunk state if it has any data
+		if (blake3_chunk_len(&b3->chunk) > 0) {
+			blake3_chunk_output(&b3->chunk, 0, cv);
+		} else {
+			i -= 2;
+			blake3_parent_output(b3->cv_stack[i], b3->cv_stack[i + 1], (i == 0) ? BLAKE3_ROOT : 0, cv);
+		}
+		while (i > 0) {
+			i--;
+			blake3_parent_output(b3->cv_stack[i], cv, (i == 0) ? BLAKE3_ROOT : 0, cv);
+		}
+	}
+#ifdef BIG_ENDIAN_HOST
+	for (i = 0; i < 8; i++)
+		write_swap32(&ctx->buf[4 * i], cv[i]);
+#else
+	memcpy(ctx->buf, cv, BLAKE3_HASHSIZE);
+#endif
+}
+
 //#define NULL_TEST
 #ifdef NULL_TEST
 // These 'null' calls are useful for testing load balancing and individual algorithm speed
@@ -946,9 +1880,52 @@ static void null_final(SUM_CONTEXT *ctx) { }
 typedef void sum_init_t(SUM_CONTEXT *ctx);
 typedef void sum_write_t(SUM_CONTEXT *ctx, const uint8_t *buf, size_t len);
 typedef void sum_final_t(SUM_CONTEXT *ctx);
-sum_init_t *sum_init[CHECKSUM_MAX] = { md5_init, sha1_init , sha256_init, sha512_init };
-sum_write_t *sum_write[CHECKSUM_MAX] = { md5_write, sha1_write , sha256_write, sha512_write };
-sum_final_t *sum_final[CHECKSUM_MAX] = { md5_final, sha1_final , sha256_final, sha512_final };
+sum_init_t *sum_init[CHECKSUM_MAX] = { md5_init, sha1_init , sha256_init, sha512_init, blake3_init };
+sum_write_t *sum_write[CHECKSUM_MAX] = { md5_write, sha1_write , sha256_write, sha512_write, blake3_write };
+sum_final_t *sum_final[CHECKSUM_MAX] = { md5_final, sha1_final , sha256_final, sha512_final, blake3_final };
+// The portable kernels, for the ones that DetectChecksumAcceleration() may replace
+static sum_write_t *sum_write_generic[CHECKSUM_MAX] = { md5_write, sha1_write , sha256_write, sha512_write, blake3_write };
+// Whether HashFiles() should use sha256_transform_x8_avx2()
+static BOOL use_sha256_lanes = FALSE;
+
+// Switch the sum_write[] entries to the hardware accelerated kernels, if the CPU supports them
+void DetectChecksumAcceleration(void)
+{
+#if defined(CPU_X86_ACCELERATION)
+	uint32_t regs[4], max_leaf;
+	BOOL has_ssse3_sse41, has_avx = FALSE, has_sha = FALSE, has_avx2 = FALSE;
+
+	cpuid(0, 0, regs);
+	max_leaf = regs[0];
+	cpuid(1, 0, regs);
+	has_ssse3_sse41 = (regs[2] & (1 << 9)) && (regs[2] & (1 << 19));
+	// AVX needs both CPU support and the OS saving the YMM registers (OSXSAVE + XCR0)
+	if ((regs[2] & (1 << 27)) && (regs[2] & (1 << 28)))
+		has_avx = ((xgetbv(0) & 0x06) == 0x06);
+	if (max_leaf >= 7) {
+		cpuid(7, 0, regs);
+		has_sha = has_ssse3_sse41 && (regs[1] & (1 << 29));
+		has_avx2 = has_avx && (regs[1] & (1 << 5));
+	}
+	if (has_sha) {
+		sum_write[CHECKSUM_SHA1] = sha1_write_ni;
+		sum_write[CHECKSUM_SHA256] = sha256_write_ni;
+	}
+	if (has_avx2)
+		sum_write[CHECKSUM_SHA512] = sha512_write_avx2;
+	// SHA-NI is about as fast on a single message as AVX2 is on 8
+	use_sha256_lanes = has_avx2 && !has_sha;
+	if (has_sha || has_avx2)
+		uprintf("Checksum acceleration:%s%s", has_sha ? " SHA-NI (SHA-1, SHA-256)" : "",
+			has_avx2 ? (has_sha ? " AVX2 (SHA-512)" : " AVX2 (SHA-512, multi-buffer SHA-256)") : "");
+#elif defined(CPU_ARM64_ACCELERATION)
+	if (IsProcessorFeaturePresent(PF_ARM_V8_CRYPTO_INSTRUCTIONS_AVAILABLE)) {
+		sum_write[CHECKSUM_SHA1] = sha1_write_ce;
+		sum_write[CHECKSUM_SHA256] = sha256_write_ce;
+		uprintf("Checksum acceleration: ARMv8 crypto extensions (SHA-1, SHA-256)");
+	}
+#endif
+}
 
 // Compute an individual checksum without threading or buffering, for a single file
 BOOL HashFile(const unsigned type, const char* path, uint8_t* sum)
@@ -992,16 +1969,89 @@ out:
 	return r;
 }
 
-BOOL HashBuffer(const unsigned type, const uint8_t* buf, const size_t len, uint8_t* sum)
+/*
+ * Compute an individual checksum for a single file, through the async reader, so that the next
+ * block is being read while the current one is hashed. Unlike HashFile(), this can be called from
+ * several threads at once and doesn't alter FormatStatus on error, so that the batch checksum of
+ * a set of files can carry on past a file that can't be read. The number of bytes hashed so far
+ * is added to processed, if not NULL, for progress reporting.
+ */
+BOOL HashFileAsync(const unsigned type, const char* path, uint8_t* sum, volatile LONG64* processed)
+{
+	return HashFileAsyncEx(type, path, sum, processed, NULL);
+}
+
+// Same as HashFileAsync(), but aborted when *abort is set, if not NULL, rather than on user cancel
+BOOL HashFileAsyncEx(const unsigned type, const char* path, uint8_t* sum, volatile LONG64* processed,
+	volatile BOOL* abort)
 {
 	BOOL r = FALSE;
 	SUM_CONTEXT sum_ctx = { {0} };
+	VOID* fd = NULL;
+	uint8_t* buf[2] = { NULL, NULL };
+	DWORD size;
+	int i;
 
-	if ((type >= CHECKSUM_MAX) || (sum == NULL))
-		goto out;
+	if ((type >= CHECKSUM_MAX) || (path == NULL) || (sum == NULL))
+		return FALSE;
 
-	sum_init[type](&sum_ctx);
-	sum_write[type](&sum_ctx, buf, len);
+	// Aligned, in case the file is large enough to be read unbuffered
+	buf[0] = (uint8_t*)AllocIoBuffer(HASH_FILE_BUFFER_SIZE);
+	buf[1] = (uint8_t*)AllocIoBuffer(HASH_FILE_BUFFER_SIZE);
+	if ((buf[0] == NULL) || (buf[1] == NULL)) {
+		uprintf("Could not allocate checksum buffers for '%s'", path);
+		goto out;
+	}
+	fd = OpenSequentialFileAsync(path);
+	if (fd == NULL) {
+		uprintf("Could not open '%s': %s", path, WindowsErrorString());
+		goto out;
+	}
+
+	sum_init[type](&sum_ctx);
+	ReadFileAsync(fd, buf[0], HASH_FILE_BUFFER_SIZE);
+	for (i = 0; ; i ^= 1) {
+		if ((abort != NULL) ? *abort : IS_USER_CANCEL)
+			goto out;
+		if ((!WaitFileAsync(fd, DRIVE_ACCESS_TIMEOUT)) || (!GetSizeAsync(fd, &size))) {
+			uprintf("Read error on '%s': %s", path, WindowsErrorString());
+			goto out;
+		}
+		if (size == 0)
+			break;
+		// Start reading the next block before we hash the current one
+		ReadFileAsync(fd, buf[i ^ 1], HASH_FILE_BUFFER_SIZE);
+		sum_write[type](&sum_ctx, buf[i], (size_t)size);
+		if (processed != NULL)
+			InterlockedExchangeAdd64(processed, size);
+	}
+	sum_final[type](&sum_ctx);
+
+	memcpy(sum, sum_ctx.buf, sum_count[type]);
+	r = TRUE;
+
+out:
+	// On cancel, the read of the next block may still be in flight
+	if ((fd != NULL) && (((ASYNC_FD*)fd)->iStatus < 0)) {
+		CancelIo(((ASYNC_FD*)fd)->hFile);
+		WaitFileAsync(fd, DRIVE_ACCESS_TIMEOUT);
+	}
+	CloseFileAsync(fd);
+	safe_free_io_buffer(buf[0]);
+	safe_free_io_buffer(buf[1]);
+	return r;
+}
+
+static BOOL HashBufferWith(sum_write_t* write, const unsigned type, const uint8_t* buf, const size_t len, uint8_t* sum)
+{
+	BOOL r = FALSE;
+	SUM_CONTEXT sum_ctx = { {0} };
+
+	if ((type >= CHECKSUM_MAX) || (sum == NULL))
+		goto out;
+
+	sum_init[type](&sum_ctx);
+	write(&sum_ctx, buf, len);
 	sum_final[type](&sum_ctx);
 
 	memcpy(sum, sum_ctx.buf, sum_count[type]);
@@ -1011,6 +2061,175 @@ out:
 	return r;
 }
 
+BOOL HashBuffer(const unsigned type, const uint8_t* buf, const size_t len, uint8_t* sum)
+{
+	return (type < CHECKSUM_MAX) && HashBufferWith(sum_write[type], type, buf, len, sum);
+}
+
+// Same as HashBuffer(), with the portable kernel, so that the accelerated ones can be compared against it
+BOOL HashBufferGeneric(const unsigned type, const uint8_t* buf, const size_t len, uint8_t* sum)
+{
+	return (type < CHECKSUM_MAX) && HashBufferWith(sum_write_generic[type], type, buf, len, sum);
+}
+
+/*
+ * Read a file of up to HASH_FILES_MAX_SIZE in one go, into a buffer that has room for the
+ * SHA-256 padding. *buf is set to NULL, which isn't an error, if the file is larger.
+ */
+static BOOL ReadSmallFile(const char* path, uint8_t** buf, DWORD* size)
+{
+	BOOL r = FALSE;
+	HANDLE h;
+	LARGE_INTEGER li;
+	DWORD rs;
+
+	*buf = NULL;
+	h = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (h == INVALID_HANDLE_VALUE) {
+		uprintf("Could not open '%s': %s", path, WindowsErrorString());
+		return FALSE;
+	}
+	if (!GetFileSizeEx(h, &li)) {
+		uprintf("Could not get the size of '%s': %s", path, WindowsErrorString());
+		goto out;
+	}
+	r = TRUE;
+	if (li.QuadPart > HASH_FILES_MAX_SIZE)
+		goto out;
+	*size = (DWORD)li.QuadPart;
+	*buf = (uint8_t*)malloc(*size + 2 * SHA256_BLOCKSIZE);
+	if ((*buf == NULL) || !ReadFile(h, *buf, *size, &rs, NULL) || (rs != *size)) {
+		uprintf("Read error on '%s': %s", path, WindowsErrorString());
+		safe_free(*buf);
+		r = FALSE;
+	}
+
+out:
+	CloseHandle(h);
+	return r;
+}
+
+#if defined(CPU_X86_ACCELERATION)
+/* Pad a message in place, as sha256_final() does, and return its number of blocks */
+static size_t sha256_pad(uint8_t* buf, size_t len)
+{
+	size_t nblocks = (len + 9 + SHA256_BLOCKSIZE - 1) / SHA256_BLOCKSIZE;
+	uint64_t bitcount = (uint64_t)len << 3;
+	int i;
+
+	buf[len] = 0x80;
+	memset(&buf[len + 1], 0, nblocks * SHA256_BLOCKSIZE - len - 9);
+	for (i = 0; i < 8; i++)
+		buf[nblocks * SHA256_BLOCKSIZE - 1 - i] = (uint8_t)(bitcount >> (8 * i));
+	return nblocks;
+}
+
+/*
+ * Hash the files through sha256_transform_x8_avx2(), with a lane being given the next small
+ * file as soon as it's done with its current one, so that the lanes are kept busy regardless
+ * of the sizes. The lanes that run out of files are fed a dummy block until the others end.
+ */
+static uint32_t HashFilesSha256x8(const char** path, const uint32_t nb_files, uint8_t* sum, BOOL* hashed, volatile LONG64* processed)
+{
+	static const uint8_t dummy_block[SHA256_BLOCKSIZE] = { 0 };
+	struct {
+		uint8_t* buf;
+		size_t block, nblocks;
+		DWORD size;
+		uint32_t file;
+	} lane[SHA256_LANES] = { { 0 } };
+	uint32_t ALIGNED(32) state[8][SHA256_LANES];
+	const uint8_t* data[SHA256_LANES];
+	SUM_CONTEXT iv;
+	uint32_t i, k, f, next = 0, nb_hashed = 0, nb_active;
+
+	sha256_init(&iv);
+	for (;;) {
+		for (nb_active = 0, i = 0; i < SHA256_LANES; i++) {
+			while ((lane[i].buf == NULL) && (next < nb_files) && !IS_USER_CANCEL) {
+				f = next++;
+				if (!ReadSmallFile(path[f], &lane[i].buf, &lane[i].size))
+					continue;
+				if (lane[i].buf == NULL) {
+					// Too large to be worth holding in memory
+					hashed[f] = HashFileAsync(CHECKSUM_SHA256, path[f], &sum[SHA256_HASHSIZE * f], processed);
+					nb_hashed += hashed[f] ? 1 : 0;
+					continue;
+				}
+				lane[i].file = f;
+				lane[i].block = 0;
+				lane[i].nblocks = sha256_pad(lane[i].buf, lane[i].size);
+				for (k = 0; k < 8; k++)
+					state[k][i] = (uint32_t)iv.state[k];
+			}
+			if (lane[i].buf != NULL)
+				nb_active++;
+			data[i] = (lane[i].buf == NULL) ? dummy_block : &lane[i].buf[lane[i].block * SHA256_BLOCKSIZE];
+		}
+		if (nb_active == 0)
+			break;
+		sha256_transform_x8_avx2(state, data);
+		for (i = 0; i < SHA256_LANES; i++) {
+			if ((lane[i].buf == NULL) || (++lane[i].block < lane[i].nblocks))
+				continue;
+			f = lane[i].file;
+			for (k = 0; k < 8; k++)
+				write_swap32(&sum[SHA256_HASHSIZE * f + 4 * k], state[k][i]);
+			hashed[f] = TRUE;
+			nb_hashed++;
+			if (processed != NULL)
+				InterlockedExchangeAdd64(processed, lane[i].size);
+			safe_free(lane[i].buf);
+		}
+	}
+	return nb_hashed;
+}
+#endif
+
+/*
+ * Compute the checksums of a set of files, with sum[i * sum_count[type]] receiving the one of
+ * path[i], and hashed[i] telling whether it could be computed. As with HashFileAsync(), this
+ * doesn't alter FormatStatus on error, so that a file that can't be read doesn't prevent the
+ * others from being hashed. Files of up to HASH_FILES_MAX_SIZE are read in one go and, for
+ * SHA-256 on a CPU that has AVX2 but not SHA-NI, hashed 8 at a time. Returns TRUE if all the
+ * files were hashed.
+ */
+BOOL HashFiles(const unsigned type, const char** path, const uint32_t nb_files, uint8_t* sum, BOOL* hashed,
+	volatile LONG64* processed)
+{
+	uint8_t* buf;
+	DWORD size;
+	uint32_t i, nb_hashed = 0;
+
+	if ((type >= CHECKSUM_MAX) || (path == NULL) || (sum == NULL) || (hashed == NULL))
+		return FALSE;
+	memset(hashed, 0, nb_files * sizeof(BOOL));
+
+#if defined(CPU_X86_ACCELERATION)
+	if ((type == CHECKSUM_SHA256) && use_sha256_lanes)
+		return (HashFilesSha256x8(path, nb_files, sum, hashed, processed) == nb_files);
+#endif
+	for (i = 0; (i < nb_files) && !IS_USER_CANCEL; i++) {
+		if (!ReadSmallFile(path[i], &buf, &size))
+			continue;
+		if (buf == NULL) {
+			hashed[i] = HashFileAsync(type, path[i], &sum[i * sum_count[type]], processed);
+		} else {
+			hashed[i] = HashBuffer(type, buf, size, &sum[i * sum_count[type]]);
+			free(buf);
+			if (processed != NULL)
+				InterlockedExchangeAdd64(processed, size);
+		}
+		nb_hashed += hashed[i] ? 1 : 0;
+	}
+	return (nb_hashed == nb_files);
+}
+
+BOOL IsChecksumAccelerated(const unsigned type)
+{
+	return (type < CHECKSUM_MAX) && (sum_write[type] != sum_write_generic[type]);
+}
+
 /*
  * Checksum dialog callback
  */
@@ -1033,13 +2252,17 @@ INT_PTR CALLBACK ChecksumCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM
 		SendDlgItemMessageA(hDlg, IDC_SHA1, WM_SETFONT, (WPARAM)hFont, TRUE);
 		SendDlgItemMessageA(hDlg, IDC_SHA256, WM_SETFONT, (WPARAM)hFont, TRUE);
 		SendDlgItemMessageA(hDlg, IDC_SHA512, WM_SETFONT, (WPARAM)hFont, TRUE);
+		SendDlgItemMessageA(hDlg, IDC_BLAKE3, WM_SETFONT, (WPARAM)hFont, TRUE);
 		SetWindowTextA(GetDlgItem(hDlg, IDC_MD5), sum_str[0]);
 		SetWindowTextA(GetDlgItem(hDlg, IDC_SHA1), sum_str[1]);
 		SetWindowTextA(GetDlgItem(hDlg, IDC_SHA256), sum_str[2]);
-		if (enable_extra_hashes)
+		if (enable_extra_hashes) {
 			SetWindowTextA(GetDlgItem(hDlg, IDC_SHA512), sum_str[3]);
-		else
+			SetWindowTextA(GetDlgItem(hDlg, IDC_BLAKE3), sum_str[4]);
+		} else {
 			SetWindowTextU(GetDlgItem(hDlg, IDC_SHA512), lmprintf(MSG_311, "<Alt>-<H>"));
+			SetWindowTextU(GetDlgItem(hDlg, IDC_BLAKE3), lmprintf(MSG_311, "<Alt>-<H>"));
+		}
 
 		// Move/Resize the controls as needed to fit our text
 		hDC = GetDC(GetDlgItem(hDlg, IDC_MD5));
@@ -1053,6 +2276,7 @@ INT_PTR CALLBACK ChecksumCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM
 		dh = rc.bottom - rc.top - dh + 6;
 		ResizeMoveCtrl(hDlg, GetDlgItem(hDlg, IDC_SHA256), 0, 0, dw, dh, 1.0f);
 		ResizeMoveCtrl(hDlg, GetDlgItem(hDlg, IDC_SHA512), 0, 0, dw, dh, 1.0f);
+		ResizeMoveCtrl(hDlg, GetDlgItem(hDlg, IDC_BLAKE3), 0, 0, dw, dh, 1.0f);
 
 		GetWindowRect(GetDlgItem(hDlg, IDC_SHA1), &rc);
 		dw = rc.right - rc.left;
@@ -1083,173 +2307,722 @@ INT_PTR CALLBACK ChecksumCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM
 	return (INT_PTR)FALSE;
 }
 
+// Read a ring counter with acquire semantics, so that the slot data it guards is visible
+static __inline LONG SumRingLoad(volatile LONG* counter)
+{
+	LONG value = *counter;
+	MemoryBarrier();
+	return value;
+}
+
+// Spin for a short while before yielding, then sleeping, as the other side may take some time
+static __inline void SumRingBackoff(uint32_t* spins)
+{
+	if (++(*spins) < SUM_SPIN_COUNT)
+		YieldProcessor();
+	else if (*spins < 2 * SUM_SPIN_COUNT)
+		SwitchToThread();
+	else
+		Sleep(1);
+}
+
+// Convert a digest to the lowercase hex string that we display
+static void SumToString(const uint8_t* sum, uint32_t len, char* str)
+{
+	uint32_t j;
+
+	for (j = 0; j < len; j++) {
+		str[2 * j] = ((sum[j] >> 4) < 10) ? ((sum[j] >> 4) + '0') : ((sum[j] >> 4) - 0xa + 'a');
+		str[2 * j + 1] = ((sum[j] & 15) < 10) ? ((sum[j] & 15) + '0') : ((sum[j] & 15) - 0xa + 'a');
+	}
+	str[2 * j] = 0;
+}
+
 // Individual thread that computes one of MD5, SHA1, SHA256 or SHA512 in parallel
 DWORD WINAPI IndividualSumThread(void* param)
 {
 	SUM_CONTEXT sum_ctx = { {0} }; // There's a memset in sum_init, but static analyzers still bug us
-	uint32_t i = (uint32_t)(uintptr_t)param, j;
+	uint32_t i = (uint32_t)(uintptr_t)param, spins;
+	LONG pos;
 
 	sum_init[i](&sum_ctx);
-	// Signal that we're ready to service requests
-	if (!SetEvent(thread_ready[i]))
-		goto error;
 
-	// Wait for requests
-	while (1) {
-		if (WaitForSingleObject(data_ready[i], WAIT_TIME) != WAIT_OBJECT_0) {
-			uprintf("Failed to wait for event for checksum thread #%d: %s", i, WindowsErrorString());
-			return 1;
+	for (pos = 0; ; pos++) {
+		// Wait for the reader to publish the next slot
+		for (spins = 0; SumRingLoad(&sum_ring.produced.value) - pos <= 0; SumRingBackoff(&spins)) {
+			if (sum_ring.abort)
+				return 1;
 		}
-		if (read_size[proc_bufnum] != 0) {
-			sum_write[i](&sum_ctx, buffer[proc_bufnum], (size_t)read_size[proc_bufnum]);
-			if (!SetEvent(thread_ready[i]))
-				goto error;
-		} else {
-			sum_final[i](&sum_ctx);
-			memset(&sum_str[i], 0, ARRAYSIZE(sum_str[i]));
-			for (j = 0; j < sum_count[i]; j++) {
-				sum_str[i][2 * j] = ((sum_ctx.buf[j] >> 4) < 10) ?
-					((sum_ctx.buf[j] >> 4) + '0') : ((sum_ctx.buf[j] >> 4) - 0xa + 'a');
-				sum_str[i][2 * j + 1] = ((sum_ctx.buf[j] & 15) < 10) ?
-					((sum_ctx.buf[j] & 15) + '0') : ((sum_ctx.buf[j] & 15) - 0xa + 'a');
+		if (sum_ring.size[pos & (SUM_RING_SLOTS - 1)] == 0)
+			break;
+		sum_write[i](&sum_ctx, SUM_RING_BUF(pos), (size_t)sum_ring.size[pos & (SUM_RING_SLOTS - 1)]);
+		// Hand the slot back to the reader
+		InterlockedExchange(&sum_ring.consumed[i].value, pos + 1);
+	}
+
+	sum_final[i](&sum_ctx);
+	SumToString(sum_ctx.buf, sum_count[i], sum_str[i]);
+	return 0;
+}
+
+static BOOL ManifestAddChunk(block_manifest* m, SUM_CONTEXT* ctx)
+{
+	uint8_t (*chunk)[32];
+
+	if (m->nb_chunks >= m->max_chunks) {
+		m->max_chunks = max(2 * m->max_chunks, 1024);
+		chunk = realloc(m->chunk, (size_t)m->max_chunks * 32);
+		if (chunk == NULL)
+			return FALSE;
+		m->chunk = chunk;
+	}
+	sum_final[CHECKSUM_SHA256](ctx);
+	memcpy(m->chunk[m->nb_chunks++], ctx->buf, 32);
+	return TRUE;
+}
+
+// Thread that hashes each MANIFEST_CHUNK_SIZE chunk of the ring data, for the block manifest
+DWORD WINAPI ManifestSumThread(void* param)
+{
+	SUM_CONTEXT sum_ctx = { {0} };
+	block_manifest* m = sum_ring.manifest;
+	uint32_t i = (uint32_t)(uintptr_t)param, spins;
+	DWORD size, len, off, chunk_fill = 0;
+	uint8_t* buf;
+	LONG pos;
+
+	sum_init[CHECKSUM_SHA256](&sum_ctx);
+	for (pos = 0; ; pos++) {
+		for (spins = 0; SumRingLoad(&sum_ring.produced.value) - pos <= 0; SumRingBackoff(&spins)) {
+			if (sum_ring.abort)
+				return 1;
+		}
+		size = sum_ring.size[pos & (SUM_RING_SLOTS - 1)];
+		if (size == 0)
+			break;
+		buf = SUM_RING_BUF(pos);
+		for (off = 0; off < size; off += len) {
+			len = min(size - off, MANIFEST_CHUNK_SIZE - chunk_fill);
+			sum_write[CHECKSUM_SHA256](&sum_ctx, &buf[off], len);
+			chunk_fill += len;
+			if (chunk_fill == MANIFEST_CHUNK_SIZE) {
+				if (!ManifestAddChunk(m, &sum_ctx))
+					goto error;
+				sum_init[CHECKSUM_SHA256](&sum_ctx);
+				chunk_fill = 0;
 			}
-			sum_str[i][2 * j] = 0;
-			return 0;
 		}
+		m->size += size;
+		InterlockedExchange(&sum_ring.consumed[i].value, pos + 1);
 	}
+	if ((chunk_fill != 0) && !ManifestAddChunk(m, &sum_ctx))
+		goto error;
+	if (m->nb_chunks != 0)
+		HashBuffer(CHECKSUM_SHA256, m->chunk[0], (size_t)m->nb_chunks * 32, m->root);
+	m->complete = TRUE;
+	return 0;
+
 error:
-	uprintf("Failed to set event for checksum thread #%d: %s", i, WindowsErrorString());
-	return 1;
+	// The manifest is optional, so this must not fail the other checksums. Just make
+	// sure that the producer doesn't wait on us anymore.
+	uprintf("Could not allocate the block manifest");
+	InterlockedExchange(&sum_ring.consumed[i].value, MAXLONG);
+	return 0;
+}
+
+/*
+ * Allocate the ring and start the checksum threads, each on a core of its own if possible.
+ * If manifest is not NULL, an extra thread also computes the block manifest.
+ */
+static BOOL SumRingOpen(int num_checksums, block_manifest* manifest)
+{
+	int i;
+
+	memset(&sum_ring, 0, sizeof(sum_ring));
+	sum_ring.buf_size = (DWORD)(min(max(checksum_buffer_size, 1), SUM_RING_MAX_SIZE) * MB);
+	// Aligned for unbuffered reads, which also suits the vectorized hashing kernels
+	sum_ring.data = (uint8_t*)AllocIoBuffer((size_t)sum_ring.buf_size * SUM_RING_SLOTS);
+	if (sum_ring.data == NULL) {
+		uprintf("Could not allocate checksum buffers");
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+		return FALSE;
+	}
+	sum_ring.num_checksums = num_checksums;
+	sum_ring.num_consumers = num_checksums;
+	sum_ring.manifest = manifest;
+	sum_ring.is_open = TRUE;
+
+	for (i = 0; i < num_checksums; i++) {
+		sum_ring.thread[i] = CreateThread(NULL, 0, IndividualSumThread, (LPVOID)(uintptr_t)i, 0, NULL);
+		if (sum_ring.thread[i] == NULL) {
+			uprintf("Unable to start checksum thread #%d", i);
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | APPERR(ERROR_CANT_START_THREAD);
+			return FALSE;
+		}
+		SetThreadPriority(sum_ring.thread[i], default_thread_priority);
+		SetThreadClass(sum_ring.thread[i], THREAD_CLASS_COMPUTE, i);
+	}
+	if (manifest != NULL) {
+		sum_ring.thread[i] = CreateThread(NULL, 0, ManifestSumThread, (LPVOID)(uintptr_t)i, 0, NULL);
+		if (sum_ring.thread[i] == NULL) {
+			uprintf("Unable to start block manifest thread");
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | APPERR(ERROR_CANT_START_THREAD);
+			return FALSE;
+		}
+		SetThreadPriority(sum_ring.thread[i], default_thread_priority);
+		SetThreadClass(sum_ring.thread[i], THREAD_CLASS_COMPUTE, i);
+		sum_ring.num_consumers++;
+	}
+	return TRUE;
+}
+
+// Return the buffer of slot 'pos', once the slowest of the checksum threads has
+// released it, or NULL if the operation was cancelled or failed in the meantime.
+static uint8_t* SumRingAcquire(LONG pos)
+{
+	uint32_t spins;
+	LONG consumed, slowest;
+	int i;
+
+	for (spins = 0; ; SumRingBackoff(&spins)) {
+		for (slowest = pos, i = 0; i < sum_ring.num_consumers; i++) {
+			consumed = SumRingLoad(&sum_ring.consumed[i].value);
+			if (consumed < slowest)
+				slowest = consumed;
+		}
+		if (pos - slowest < SUM_RING_SLOTS)
+			return SUM_RING_BUF(pos);
+		if (IS_ERROR(FormatStatus))
+			return NULL;
+	}
+}
+
+// Hand slot 'pos' over to the checksum threads (a zero size slot tells them to finalize)
+static __inline void SumRingPublish(LONG pos, DWORD size)
+{
+	sum_ring.size[pos & (SUM_RING_SLOTS - 1)] = size;
+	InterlockedExchange(&sum_ring.produced.value, pos + 1);
+}
+
+// Stop the checksum threads and free the ring. If 'finalize' is set, the end
+// of the data must have been published and the digests are left in sum_str[].
+static BOOL SumRingClose(BOOL finalize)
+{
+	BOOL r = finalize;
+	DWORD exit_code;
+	int i;
+
+	if (!sum_ring.is_open)
+		return FALSE;
+	// Any thread still waiting for data sees the abort flag and exits
+	if (!finalize)
+		InterlockedExchange(&sum_ring.abort, TRUE);
+	for (i = 0; i < sum_ring.num_consumers; i++) {
+		if (sum_ring.thread[i] == NULL) {
+			r = FALSE;
+			continue;
+		}
+		WaitForSingleObject(sum_ring.thread[i], INFINITE);
+		if (!GetExitCodeThread(sum_ring.thread[i], &exit_code) || (exit_code != 0))
+			r = FALSE;
+		safe_closehandle(sum_ring.thread[i]);
+	}
+	safe_free_io_buffer(sum_ring.data);
+	sum_ring.is_open = FALSE;
+	return r;
+}
+
+static void PrintSums(void)
+{
+	uprintf("  MD5:    %s", sum_str[0]);
+	uprintf("  SHA1:   %s", sum_str[1]);
+	uprintf("  SHA256: %s", sum_str[2]);
+	if (enable_extra_hashes) {
+		char c = sum_str[3][SHA512_HASHSIZE];
+		sum_str[3][SHA512_HASHSIZE] = 0;
+		uprintf("  SHA512: %s", sum_str[3]);
+		sum_str[3][SHA512_HASHSIZE] = c;
+		uprintf("          %s", &sum_str[3][SHA512_HASHSIZE]);
+		uprintf("  BLAKE3: %s", sum_str[4]);
+	}
 }
 
 DWORD WINAPI SumThread(void* param)
 {
-	DWORD_PTR* thread_affinity = (DWORD_PTR*)param;
-	HANDLE sum_thread[CHECKSUM_MAX] = { NULL, NULL, NULL, NULL };
-	DWORD wr;
 	VOID* fd = NULL;
 	uint64_t processed_bytes;
-	int i, read_bufnum, r = -1;
-	int num_checksums = CHECKSUM_MAX - (enable_extra_hashes ? 0 : 1);
+	uint8_t* buf;
+	DWORD size;
+	LONG pos;
+	int r = -1;
+	int num_checksums = enable_extra_hashes ? CHECKSUM_MAX : CHECKSUM_EXTRA_FIRST;
 
-	if ((image_path == NULL) || (thread_affinity == NULL))
+	if (image_path == NULL)
 		ExitThread(r);
 
 	uprintf("\r\nComputing checksum for '%s'...", image_path);
 
-	if (thread_affinity[0] != 0)
-		// Use the first affinity mask, as our read thread is the least
-		// CPU intensive (mostly waits on disk I/O or on the other threads)
-		// whereas the OS is likely to requisition the first Core, which
-		// is usually in this first mask, for other tasks.
-		SetThreadAffinityMask(GetCurrentThread(), thread_affinity[0]);
+	// Our read thread is the least CPU intensive, as it mostly waits on disk I/O
+	// or on the other threads, so it doesn't need one of the better cores
+	SetThreadClass(GetCurrentThread(), THREAD_CLASS_IO, 0);
 
-	for (i = 0; i < num_checksums; i++) {
-		// NB: Can't use a single manual-reset event for data_ready as we
-		// wouldn't be able to ensure the event is reset before the thread
-		// gets into its next wait loop
-		data_ready[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
-		thread_ready[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
-		if ((data_ready[i] == NULL) || (thread_ready[i] == NULL)) {
-			uprintf("Unable to create checksum thread event: %s", WindowsErrorString());
-			goto out;
-		}
-		sum_thread[i] = CreateThread(NULL, 0, IndividualSumThread, (LPVOID)(uintptr_t)i, 0, NULL);
-		if (sum_thread[i] == NULL) {
-			uprintf("Unable to start checksum thread #%d", i);
-			goto out;
-		}
-		SetThreadPriority(sum_thread[i], default_thread_priority);
-		if (thread_affinity[i+1] != 0)
-			SetThreadAffinityMask(sum_thread[i], thread_affinity[i+1]);
-	}
+	if (!SumRingOpen(num_checksums, NULL))
+		goto out;
 
-	fd = CreateFileAsync(image_path, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN);
+	fd = OpenSequentialFileAsync(image_path);
 	if (fd == NULL) {
 		uprintf("Could not open file: %s", WindowsErrorString());
 		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_OPEN_FAILED;
 		goto out;
 	}
+	// Don't compete with any drive write that may be going on
+	SetFileIoPriority(((ASYNC_FD*)fd)->hFile, TRUE);
 
-	read_bufnum = 0;
-	proc_bufnum = 1;
-	read_size[proc_bufnum] = 1;	// To avoid early loop exit
 	UpdateProgressWithInfoInit(hMainDialog, FALSE);
 
 	// Start the initial read
-	ReadFileAsync(fd, buffer[read_bufnum], BUFFER_SIZE);
+	ReadFileAsync(fd, SUM_RING_BUF(0), sum_ring.buf_size);
 
-	for (processed_bytes = 0; read_size[proc_bufnum] != 0; processed_bytes += read_size[proc_bufnum]) {
+	for (pos = 0, processed_bytes = 0; ; pos++) {
 		// 0. Update the progress and check for cancel
 		UpdateProgressWithInfo(OP_NOOP_WITH_TASKBAR, MSG_271, processed_bytes, img_report.image_size);
 		CHECK_FOR_USER_CANCEL;
 
 		// 1. Wait for the current read operation to complete (and update the read size)
-		if ((!WaitFileAsync(fd, DRIVE_ACCESS_TIMEOUT)) ||
-			(!GetSizeAsync(fd, &read_size[read_bufnum]))) {
+		if ((!WaitFileAsync(fd, DRIVE_ACCESS_TIMEOUT)) || (!GetSizeAsync(fd, &size))) {
 			uprintf("Read error: %s", WindowsErrorString());
 			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_READ_FAULT;
 			goto out;
 		}
+		processed_bytes += size;
 
-		// 2. Switch to the next reading buffer
-		read_bufnum = (read_bufnum + 1) % NUM_BUFFERS;
+		// 2. Unless we reached the end of the file, wait for the slowest of the sum
+		// threads to release the next slot, and launch the next asynchronous read
+		if (size != 0) {
+			buf = SumRingAcquire(pos + 1);
+			if (buf == NULL)
+				goto out;
+			ReadFileAsync(fd, buf, sum_ring.buf_size);
+		}
 
-		// 3. Launch the next asynchronous read operation
-		ReadFileAsync(fd, buffer[read_bufnum], BUFFER_SIZE);
+		// 3. Publish the slot we just read to the sum threads
+		SumRingPublish(pos, size);
+		if (size == 0)
+			break;
+	}
 
-		// 4. Wait for all the sum threads to indicate that they are ready to process data
-		wr = WaitForMultipleObjects(num_checksums, thread_ready, TRUE, WAIT_TIME);
-		if (wr != WAIT_OBJECT_0) {
-			if (wr == STATUS_TIMEOUT)
-				SetLastError(ERROR_TIMEOUT);
-			uprintf("Checksum threads failed to signal: %s", WindowsErrorString());
-			goto out;
-		}
+	// Wait for the sum threads to finalize
+	if (!SumRingClose(TRUE)) {
+		uprintf("Checksum threads did not finalize");
+		goto out;
+	}
+	PrintSums();
+	SetFileSums(image_path);
+	SaveFileSums(image_path, sum_str, num_checksums);
+	r = 0;
+
+out:
+	SumRingClose(FALSE);
+	CloseFileAsync(fd);
+	PostMessage(hMainDialog, UM_FORMAT_COMPLETED, (WPARAM)FALSE, 0);
+	if (r == 0)
+		MyDialogBox(hMainInstance, IDD_CHECKSUM, hMainDialog, ChecksumCallback);
+	ExitThread(r);
+}
 
-		// 5. Set the target buffer we want to process to the buffer we just read data into
-		// Note that this variable should only be updated AFTER all the threads have signalled.
-		proc_bufnum = (read_bufnum + NUM_BUFFERS - 1) % NUM_BUFFERS;
+static BOOL GetFileStamp(const char* path, uint64_t stamp[2]);
 
-		// 6. Signal the waiting threads that there is data available
-		for (i = 0; i < num_checksums; i++) {
-			if (!SetEvent(data_ready[i])) {
-				uprintf("Could not signal checksum thread %d: %s", i, WindowsErrorString());
-				goto out;
-			}
+/*
+ * Hash streams compute all the checksums of data that is being produced by another
+ * operation (such as the image data being written to a drive), on the same threads
+ * and ring as SumThread(), so that the source doesn't have to be read a second time.
+ */
+BOOL OpenHashStream(void)
+{
+	return OpenHashStreamEx(NULL);
+}
+
+// Same as OpenHashStream(), but also compute the block manifest of the data into 'manifest'
+BOOL OpenHashStreamEx(block_manifest* manifest)
+{
+	if (manifest != NULL) {
+		FreeManifest(manifest);
+		if (image_path != NULL)
+			GetFileStamp(image_path, manifest->stamp);
+	}
+	if (!SumRingOpen(enable_extra_hashes ? CHECKSUM_MAX : CHECKSUM_EXTRA_FIRST, manifest)) {
+		SumRingClose(FALSE);
+		return FALSE;
+	}
+	sum_ring.fill_pos = 0;
+	sum_ring.fill_size = 0;
+	return (SumRingAcquire(0) != NULL);
+}
+
+BOOL WriteHashStream(const uint8_t* buf, size_t len)
+{
+	uint8_t* dst;
+	DWORD size;
+
+	if (!sum_ring.is_open)
+		return FALSE;
+	while (len > 0) {
+		size = (DWORD)min(len, (size_t)(sum_ring.buf_size - sum_ring.fill_size));
+		memcpy(&SUM_RING_BUF(sum_ring.fill_pos)[sum_ring.fill_size], buf, size);
+		sum_ring.fill_size += size;
+		buf += size;
+		len -= size;
+		if (sum_ring.fill_size == sum_ring.buf_size) {
+			dst = SumRingAcquire(sum_ring.fill_pos + 1);
+			if (dst == NULL)
+				return FALSE;
+			SumRingPublish(sum_ring.fill_pos++, sum_ring.fill_size);
+			sum_ring.fill_size = 0;
+		}
+	}
+	return TRUE;
+}
+
+// Close a hash stream. If 'finalize' is set, the digests are computed and left in sum_str[].
+BOOL CloseHashStream(BOOL finalize)
+{
+	if (!sum_ring.is_open)
+		return FALSE;
+	if (finalize) {
+		if (sum_ring.fill_size != 0) {
+			if (SumRingAcquire(sum_ring.fill_pos + 1) == NULL)
+				return SumRingClose(FALSE);
+			SumRingPublish(sum_ring.fill_pos++, sum_ring.fill_size);
 		}
+		SumRingPublish(sum_ring.fill_pos, 0);
 	}
+	return SumRingClose(finalize);
+}
+
+// Log the digests of a hash stream, under the provided heading
+void PrintHashStream(const char* heading)
+{
+	uprintf("%s", heading);
+	PrintSums();
+}
+
+// Identify a file's content through its size and last write time
+static BOOL GetFileStamp(const char* path, uint64_t stamp[2])
+{
+	BOOL r;
+	LARGE_INTEGER li;
+	FILETIME ft;
+	HANDLE h = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (h == INVALID_HANDLE_VALUE)
+		return FALSE;
+	r = GetFileSizeEx(h, &li) && GetFileTime(h, NULL, NULL, &ft);
+	CloseHandle(h);
+	stamp[0] = li.QuadPart;
+	stamp[1] = (((uint64_t)ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+	return r;
+}
+
+// Record that the current digests, from SumThread() or a hash stream, are the ones of 'path'
+void SetFileSums(const char* path)
+{
+	safe_free(sum_file.path);
+	if ((path == NULL) || !GetFileStamp(path, sum_file.stamp))
+		return;
+	sum_file.path = safe_strdup(path);
+	sum_file.extra_hashes = enable_extra_hashes;
+}
+
+// Check whether the current digests are the ones of 'path', as it is now
+BOOL HasFileSums(const char* path)
+{
+	uint64_t stamp[2];
+
+	if ((path == NULL) || (sum_file.path == NULL) || (strcmp(path, sum_file.path) != 0) ||
+		(sum_file.extra_hashes != enable_extra_hashes) || !GetFileStamp(path, stamp))
+		return FALSE;
+	return (memcmp(stamp, sum_file.stamp, sizeof(stamp)) == 0);
+}
+
+/*
+ * Persisted digests, so that the checksums of an image, as computed by SumThread() or by the
+ * image library indexer, can be displayed right away the next time the image is selected.
+ * As with the scan cache, there is one file per image path, and the digests are only used if
+ * the size and last write time of the image are the same as when they were computed.
+ */
+#define SUMS_CACHE_MAGIC          "RfCS"
+#define SUMS_CACHE_VERSION        1
+
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	char path[MAX_PATH];
+	uint64_t stamp[2];
+	uint32_t nb_sums;
+	char sum[CHECKSUM_MAX][150];
+} sums_cache;
+
+static BOOL GetSumsCachePath(const char* path, char* cache_path, size_t size)
+{
+	uint32_t hash = 2166136261U;
+	const char* p;
 
-	// Our last event with read_size=0 signaled the threads to exit - wait for that to happen
-	if (WaitForMultipleObjects(num_checksums, sum_thread, TRUE, WAIT_TIME) != WAIT_OBJECT_0) {
-		uprintf("Checksum threads did not finalize: %s", WindowsErrorString());
+	if ((path == NULL) || (app_data_dir[0] == 0) || (strlen(path) >= MAX_PATH))
+		return FALSE;
+	// FNV-1a of the path, as with the scan cache
+	for (p = path; *p != 0; p++)
+		hash = (hash ^ (uint8_t)tolower((uint8_t)*p)) * 16777619U;
+	safe_sprintf(cache_path, size, "%s\\%s", app_data_dir, FILES_DIR);
+	IGNORE_RETVAL(_mkdirExU(cache_path));
+	safe_sprintf(cache_path, size, "%s\\%s\\sums_%08X.cache", app_data_dir, FILES_DIR, hash);
+	return TRUE;
+}
+
+// Save the first nb_sums digests from sums[], which must have been computed for 'path', as it is now
+void SaveFileSums(const char* path, char sums[CHECKSUM_MAX][150], uint32_t nb_sums)
+{
+	BOOL r;
+	FILE* fd;
+	sums_cache* cache;
+	char cache_path[MAX_PATH], tmp[MAX_PATH];
+
+	if ((nb_sums == 0) || (nb_sums > CHECKSUM_MAX) || !GetSumsCachePath(path, cache_path, sizeof(cache_path)))
+		return;
+	cache = (sums_cache*)calloc(1, sizeof(sums_cache));
+	if (cache == NULL)
+		return;
+	memcpy(cache->magic, SUMS_CACHE_MAGIC, sizeof(cache->magic));
+	cache->version = SUMS_CACHE_VERSION;
+	static_strcpy(cache->path, path);
+	cache->nb_sums = nb_sums;
+	memcpy(cache->sum, sums, nb_sums * sizeof(cache->sum[0]));
+	if (!GetFileStamp(path, cache->stamp))
 		goto out;
+	static_sprintf(tmp, "%s.tmp", cache_path);
+	fd = fopenU(tmp, "wb");
+	if (fd == NULL)
+		goto out;
+	r = (fwrite(cache, sizeof(sums_cache), 1, fd) == 1);
+	fclose(fd);
+	if (!r || !MoveFileExU(tmp, cache_path, MOVEFILE_REPLACE_EXISTING))
+		DeleteFileU(tmp);
+
+out:
+	free(cache);
+}
+
+/*
+ * Restore the digests of 'path' into sums[], if they were saved, are still valid, and include
+ * all the ones we display. sums may be NULL, to only check for these.
+ */
+BOOL LoadFileSums(const char* path, char sums[CHECKSUM_MAX][150])
+{
+	BOOL r = FALSE;
+	FILE* fd;
+	sums_cache* cache;
+	uint64_t stamp[2];
+	uint32_t i, nb_sums = enable_extra_hashes ? CHECKSUM_MAX : CHECKSUM_EXTRA_FIRST;
+	char cache_path[MAX_PATH];
+
+	if (!GetSumsCachePath(path, cache_path, sizeof(cache_path)))
+		return FALSE;
+	cache = (sums_cache*)malloc(sizeof(sums_cache));
+	if (cache == NULL)
+		return FALSE;
+	fd = fopenU(cache_path, "rb");
+	if (fd == NULL)
+		goto out;
+	r = (fread(cache, sizeof(sums_cache), 1, fd) == 1);
+	fclose(fd);
+	r = r && (memcmp(cache->magic, SUMS_CACHE_MAGIC, sizeof(cache->magic)) == 0) &&
+		(cache->version == SUMS_CACHE_VERSION) && (cache->nb_sums >= nb_sums) &&
+		(cache->nb_sums <= CHECKSUM_MAX) && (strncmp(cache->path, path, MAX_PATH) == 0) &&
+		GetFileStamp(path, stamp) && (memcmp(stamp, cache->stamp, sizeof(stamp)) == 0);
+	if (!r || (sums == NULL))
+		goto out;
+	for (i = 0; i < nb_sums; i++) {
+		cache->sum[i][sizeof(cache->sum[i]) - 1] = 0;
+		memcpy(sums[i], cache->sum[i], sizeof(cache->sum[i]));
 	}
 
-	uprintf("  MD5:    %s", sum_str[0]);
-	uprintf("  SHA1:   %s", sum_str[1]);
-	uprintf("  SHA256: %s", sum_str[2]);
-	if (enable_extra_hashes) {
-		char c = sum_str[3][SHA512_HASHSIZE];
-		sum_str[3][SHA512_HASHSIZE] = 0;
-		uprintf("  SHA512: %s", sum_str[3]);
-		sum_str[3][SHA512_HASHSIZE] = c;
-		uprintf("          %s", &sum_str[3][SHA512_HASHSIZE]);
+out:
+	free(cache);
+	return r;
+}
+
+/*
+ * Compute all the digests of a file in a single pass, into sums[], on the calling thread and
+ * at low I/O priority, for work that nobody is waiting on. As with HashFileAsync(), this can
+ * be called from another thread than the one of an operation, and FormatStatus is left alone.
+ * The computation is aborted (and FALSE returned) as soon as *abort is set.
+ */
+BOOL ComputeFileSums(const char* path, char sums[CHECKSUM_MAX][150], volatile BOOL* abort)
+{
+	BOOL r = FALSE;
+	SUM_CONTEXT* sum_ctx;
+	VOID* fd = NULL;
+	uint8_t* buf[2] = { NULL, NULL };
+	DWORD size;
+	int i, type;
+
+	if ((path == NULL) || (sums == NULL))
+		return FALSE;
+	sum_ctx = (SUM_CONTEXT*)_mm_malloc(CHECKSUM_MAX * sizeof(SUM_CONTEXT), 64);
+	buf[0] = (uint8_t*)AllocIoBuffer(HASH_FILE_BUFFER_SIZE);
+	buf[1] = (uint8_t*)AllocIoBuffer(HASH_FILE_BUFFER_SIZE);
+	if ((sum_ctx == NULL) || (buf[0] == NULL) || (buf[1] == NULL))
+		goto out;
+	fd = OpenSequentialFileAsync(path);
+	if (fd == NULL) {
+		uprintf("Could not open '%s': %s", path, WindowsErrorString());
+		goto out;
 	}
-	r = 0;
+	SetFileIoPriority(((ASYNC_FD*)fd)->hFile, TRUE);
+
+	for (type = 0; type < CHECKSUM_MAX; type++)
+		sum_init[type](&sum_ctx[type]);
+	ReadFileAsync(fd, buf[0], HASH_FILE_BUFFER_SIZE);
+	for (i = 0; ; i ^= 1) {
+		if ((abort != NULL) && *abort)
+			goto out;
+		if ((!WaitFileAsync(fd, DRIVE_ACCESS_TIMEOUT)) || (!GetSizeAsync(fd, &size))) {
+			uprintf("Read error on '%s': %s", path, WindowsErrorString());
+			goto out;
+		}
+		if (size == 0)
+			break;
+		ReadFileAsync(fd, buf[i ^ 1], HASH_FILE_BUFFER_SIZE);
+		for (type = 0; type < CHECKSUM_MAX; type++)
+			sum_write[type](&sum_ctx[type], buf[i], (size_t)size);
+	}
+	for (type = 0; type < CHECKSUM_MAX; type++) {
+		sum_final[type](&sum_ctx[type]);
+		SumToString(sum_ctx[type].buf, sum_count[type], sums[type]);
+	}
+	r = TRUE;
 
 out:
-	for (i = 0; i < num_checksums; i++) {
-		if (sum_thread[i] != NULL)
-			TerminateThread(sum_thread[i], 1);
-		safe_closehandle(data_ready[i]);
-		safe_closehandle(thread_ready[i]);
+	if ((fd != NULL) && (((ASYNC_FD*)fd)->iStatus < 0)) {
+		CancelIo(((ASYNC_FD*)fd)->hFile);
+		WaitFileAsync(fd, DRIVE_ACCESS_TIMEOUT);
 	}
 	CloseFileAsync(fd);
-	PostMessage(hMainDialog, UM_FORMAT_COMPLETED, (WPARAM)FALSE, 0);
-	if (r == 0)
-		MyDialogBox(hMainInstance, IDD_CHECKSUM, hMainDialog, ChecksumCallback);
-	ExitThread(r);
+	safe_free_io_buffer(buf[0]);
+	safe_free_io_buffer(buf[1]);
+	_mm_free(sum_ctx);
+	return r;
+}
+
+void FreeManifest(block_manifest* manifest)
+{
+	if (manifest == NULL)
+		return;
+	safe_free(manifest->chunk);
+	memset(manifest, 0, sizeof(*manifest));
+}
+
+/*
+ * Block manifest files start with a header, followed by the chunk hashes. The stamp of
+ * the image they were computed for lets us discard the ones that no longer apply.
+ */
+typedef struct {
+	char magic[8];
+	uint32_t chunk_size;
+	uint32_t nb_chunks;
+	uint64_t size;
+	uint64_t stamp[2];
+	uint8_t root[32];
+} manifest_header;
+
+#define MANIFEST_MAGIC "RUFUSBM1"
+
+BOOL SaveManifest(block_manifest* manifest, const char* path)
+{
+	BOOL r = FALSE;
+	FILE* fd;
+	manifest_header hdr = { 0 };
+
+	if ((manifest == NULL) || !manifest->complete || (path == NULL))
+		return FALSE;
+	fd = fopenU(path, "wb");
+	if (fd == NULL) {
+		uprintf("Could not create '%s': %s", path, strerror(errno));
+		return FALSE;
+	}
+	memcpy(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic));
+	hdr.chunk_size = MANIFEST_CHUNK_SIZE;
+	hdr.nb_chunks = manifest->nb_chunks;
+	hdr.size = manifest->size;
+	memcpy(hdr.stamp, manifest->stamp, sizeof(hdr.stamp));
+	memcpy(hdr.root, manifest->root, sizeof(hdr.root));
+	r = (fwrite(&hdr, sizeof(hdr), 1, fd) == 1) &&
+		(fwrite(manifest->chunk, 32, manifest->nb_chunks, fd) == manifest->nb_chunks);
+	fclose(fd);
+	if (!r) {
+		uprintf("Could not write '%s'", path);
+		DeleteFileU(path);
+	}
+	return r;
+}
+
+// Load a block manifest, provided that it still applies to the current image
+BOOL LoadManifest(block_manifest* manifest, const char* path)
+{
+	FILE* fd;
+	manifest_header hdr;
+	uint64_t stamp[2];
+	uint8_t root[32];
+
+	FreeManifest(manifest);
+	if ((path == NULL) || (image_path == NULL) || !GetFileStamp(image_path, stamp))
+		return FALSE;
+	fd = fopenU(path, "rb");
+	if (fd == NULL)
+		return FALSE;
+	if ((fread(&hdr, sizeof(hdr), 1, fd) != 1) || (memcmp(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic)) != 0) ||
+		(hdr.chunk_size != MANIFEST_CHUNK_SIZE) || (memcmp(hdr.stamp, stamp, sizeof(stamp)) != 0) ||
+		(hdr.nb_chunks != (hdr.size + MANIFEST_CHUNK_SIZE - 1) / MANIFEST_CHUNK_SIZE))
+		goto out;
+	manifest->chunk = malloc((size_t)hdr.nb_chunks * 32);
+	if ((manifest->chunk == NULL) || (fread(manifest->chunk, 32, hdr.nb_chunks, fd) != hdr.nb_chunks))
+		goto out;
+	// Make sure that the chunk hashes weren't altered
+	HashBuffer(CHECKSUM_SHA256, manifest->chunk[0], (size_t)hdr.nb_chunks * 32, root);
+	if (memcmp(root, hdr.root, sizeof(root)) != 0) {
+		uprintf("Block manifest '%s' is corrupted - Ignoring", path);
+		goto out;
+	}
+	manifest->size = hdr.size;
+	manifest->nb_chunks = manifest->max_chunks = hdr.nb_chunks;
+	memcpy(manifest->stamp, stamp, sizeof(stamp));
+	memcpy(manifest->root, root, sizeof(root));
+	manifest->complete = TRUE;
+
+out:
+	fclose(fd);
+	if (!manifest->complete)
+		FreeManifest(manifest);
+	return manifest->complete;
+}
+
+static int sha256db_cmp(const void* a, const void* b)
+{
+	return memcmp(a, b, 32);
+}
+
+/*
+ * Binary search of our hash DB. The data is generated sorted, but since entries
+ * may also be added manually, we still sort it once, on first use, to be safe.
+ */
+static BOOL IsSumInDB(const uint8_t* sum)
+{
+	static BOOL sorted = FALSE;
+
+	if (!sorted) {
+		qsort(sha256db, ARRAYSIZE(sha256db) / 32, 32, sha256db_cmp);
+		sorted = TRUE;
+	}
+	return (bsearch(sum, sha256db, ARRAYSIZE(sha256db) / 32, 32, sha256db_cmp) != NULL);
 }
 
 /*
@@ -1257,26 +3030,41 @@ out:
  */
 BOOL IsBufferInDB(const unsigned char* buf, const size_t len)
 {
-	int i;
 	uint8_t sum[32];
 	if (!HashBuffer(CHECKSUM_SHA256, buf, len, sum))
 		return FALSE;
-	for (i = 0; i < ARRAYSIZE(sha256db); i += 32)
-		if (memcmp(sum, &sha256db[i], 32) == 0)
-			return TRUE;
-	return FALSE;
+	return IsSumInDB(sum);
 }
 
 BOOL IsFileInDB(const char* path)
 {
 	int i;
 	uint8_t sum[32];
+	uint64_t stamp[2];
+	BOOL has_stamp;
+
+	// Local files, such as the .c32 replacements, may be checked once for every copy
+	// that an image contains, so only hash them again if they were modified.
+	has_stamp = (path != NULL) && GetFileStamp(path, stamp);
+	if (has_stamp) {
+		for (i = 0; i < MAX_DB_LOOKUPS; i++) {
+			if ((db_lookup[i].path != NULL) && (strcmp(db_lookup[i].path, path) == 0) &&
+				(memcmp(db_lookup[i].stamp, stamp, sizeof(stamp)) == 0))
+				return db_lookup[i].in_db;
+		}
+	}
 	if (!HashFile(CHECKSUM_SHA256, path, sum))
 		return FALSE;
-	for (i = 0; i < ARRAYSIZE(sha256db); i += 32)
-		if (memcmp(sum, &sha256db[i], 32) == 0)
-			return TRUE;
-	return FALSE;
+	if (has_stamp) {
+		i = db_lookup_next;
+		db_lookup_next = (db_lookup_next + 1) % MAX_DB_LOOKUPS;
+		safe_free(db_lookup[i].path);
+		db_lookup[i].path = safe_strdup(path);
+		memcpy(db_lookup[i].stamp, stamp, sizeof(stamp));
+		db_lookup[i].in_db = IsSumInDB(sum);
+		return db_lookup[i].in_db;
+	}
+	return IsSumInDB(sum);
 }
 
 #if defined(_DEBUG)
@@ -1340,14 +3128,19 @@ const char* test_hash[CHECKSUM_MAX][4] = {
 		"4913ace12f1169e5a5f524ef87ab8fc39dff0418851fbbbb1f609d3261b2b4072bd1746e6accb91bf38f3b1b3d59b0a60af5de67aab87b76c2456fde523efc1c",
 		"33df8a16dd624cbc4613b5ae902b722411c7e90f37dd3947c9a86e01c51ada68fcf5a0cd4ca928d7cc1ed469bb34c2ed008af069d8b28cc4512e6c8b2e7a5592",
 		"999b4eae14de584cce5fa5962b768beda076b06df00d384bb502c6389df8159c006a5b94d1324f47e8d7bd2efe9d8d3dc1fa1429798e49826987ab5ae7ed5c21"
+	}, {
+		"af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262",
+		"620a624cc3f28a68f029a79481b929ca6a2e75eab06d9961196b2892e92c2993",
+		"198cb8b5c0cc6547200336f9885656c92a8d761f2d4af79cb21d2ceee2697e3f",
+		"ea2cdca7db831bcd95cff60c7d9a8098cb1d5c337251e414722d56bffb0d0aab"
 	},
 };
 
 /* Tests the message digest algorithms */
 int TestChecksum(void)
 {
-	const uint32_t blocksize[CHECKSUM_MAX] = { MD5_BLOCKSIZE, SHA1_BLOCKSIZE, SHA256_BLOCKSIZE, SHA512_BLOCKSIZE };
-	const char* hash_name[4] = { "MD5   ", "SHA1  ", "SHA256", "SHA512" };
+	const uint32_t blocksize[CHECKSUM_MAX] = { MD5_BLOCKSIZE, SHA1_BLOCKSIZE, SHA256_BLOCKSIZE, SHA512_BLOCKSIZE, BLAKE3_BLOCKSIZE };
+	const char* hash_name[CHECKSUM_MAX] = { "MD5   ", "SHA1  ", "SHA256", "SHA512", "BLAKE3" };
 	int i, j, errors = 0;
 	uint8_t sum[MAX_HASHSIZE], *sum_expected;
 	size_t full_msg_len = strlen(test_msg);
@@ -33,6 +33,7 @@
 #include <commctrl.h>
 #include <setupapi.h>
 #include <cfg.h>
+#include <dbt.h>
 #include <assert.h>
 
 #include "rufus.h"
@@ -44,8 +45,11 @@
 #include "drive.h"
 #include "dev.h"
 
-extern StrArray DriveId, DriveName, DriveLabel, DriveHub;
+extern StrArray DriveId, DriveName, DriveLabel, DriveHub, DriveLocation;
 extern uint32_t DrivePort[MAX_DRIVES];
+extern const char* DriveSpeedName[MAX_DRIVES];
+extern uint32_t DriveLinkSpeed[MAX_DRIVES];
+extern uint8_t DriveLowerSpeed[MAX_DRIVES];
 extern BOOL enable_HDDs, enable_VHDs, use_fake_units, enable_vmdk, usb_debug;
 extern BOOL list_non_usb_removable_drives, its_a_me_mario;
 
@@ -330,7 +334,6 @@ BOOL GetOpticalMedia(IMG_SAVE* img_save)
 	SP_DEVICE_INTERFACE_DATA devint_data;
 	PSP_DEVICE_INTERFACE_DETAIL_DATA_A devint_detail_data;
 	HANDLE hDrive = INVALID_HANDLE_VALUE;
-	LARGE_INTEGER li;
 
 	dev_info = SetupDiGetClassDevsA(&GUID_DEVINTERFACE_CDROM, NULL, NULL, DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
 	if (dev_info == INVALID_HANDLE_VALUE) {
@@ -394,10 +397,8 @@ BOOL GetOpticalMedia(IMG_SAVE* img_save)
 			if (DiskGeometry->DiskSize.QuadPart <= 4096)
 				continue;
 			// Read the label directly, since it's a massive PITA to get it from Windows
-			li.QuadPart = 0x8000LL;
 			buffer = malloc(2048);
-			if ((buffer != NULL) && (SetFilePointerEx(hDrive, li, NULL, FILE_BEGIN)) &&
-				ReadFile(hDrive, buffer, 2048, &size, NULL) && (size == 2048)) {
+			if ((buffer != NULL) && BlockIo(hDrive, FALSE, buffer, 2048, 0x8000ULL, 0, NULL, NULL)) {
 				memcpy(label, &buffer[0x28], sizeof(label) - 1);
 				label[sizeof(label) - 1] = 0;
 				for (k = (int)strlen(label) - 1; (k >= 0) && (label[k] == 0x20); k--)
@@ -416,6 +417,41 @@ BOOL GetOpticalMedia(IMG_SAVE* img_save)
 	return FALSE;
 }
 
+/*
+ * Have an optical drive read at the maximum speed it can sustain for the whole disc. Drives
+ * otherwise tend to stay at the low speed they picked for the first random accesses, or to
+ * slow down on the outer part of the disc. SET STREAMING, which also tells the drive that we
+ * are going to read sequentially, is tried first, then SET CD SPEED for older drives.
+ */
+BOOL SetOpticalReadSpeed(HANDLE hDrive, uint64_t DiskSize)
+{
+	DWORD size;
+	CDROM_SET_STREAMING_REDEF streaming = { 0 };
+	CDROM_SET_SPEED_REDEF speed = { 0 };
+
+	streaming.RequestType = CDROM_SET_STREAMING_REQUEST;
+	// The drive picks the closest performance it supports to that (unreachable) one
+	streaming.ReadSize = UINT32_MAX;
+	streaming.ReadTime = 1000;
+	streaming.WriteSize = UINT32_MAX;
+	streaming.WriteTime = 1000;
+	streaming.StartLba = 0;
+	streaming.EndLba = (ULONG)(DiskSize / 2048) - 1;
+	if (DeviceIoControl(hDrive, IOCTL_CDROM_SET_SPEED, &streaming, sizeof(streaming), NULL, 0, &size, NULL)) {
+		uprintf("Optical drive set to its maximum streaming read speed");
+		return TRUE;
+	}
+	speed.RequestType = CDROM_SET_SPEED_REQUEST;
+	speed.ReadSpeed = CDROM_MAX_SPEED;
+	speed.WriteSpeed = CDROM_MAX_SPEED;
+	if (DeviceIoControl(hDrive, IOCTL_CDROM_SET_SPEED, &speed, sizeof(speed), NULL, 0, &size, NULL)) {
+		uprintf("Optical drive set to its maximum read speed");
+		return TRUE;
+	}
+	uprintf("Notice: Could not set the optical drive read speed: %s", WindowsErrorString());
+	return FALSE;
+}
+
 /* For debugging user reports of HDDs vs UFDs */
 //#define FORCED_DEVICE
 #ifdef FORCED_DEVICE
@@ -427,7 +463,227 @@ BOOL GetOpticalMedia(IMG_SAVE* img_save)
 /*
  * Refresh the list of USB devices
  */
-BOOL GetDevices(DWORD devnum)
+static dev_cache_entry dev_cache[MAX_DRIVES];
+static int dev_cache_size = 0;
+
+// Find the cache entry of a device, creating it if needed, and mark it as present
+static dev_cache_entry* GetDevCacheEntry(const char* instance_id)
+{
+	int i;
+
+	if ((instance_id == NULL) || (instance_id[0] == '<'))
+		return NULL;
+	for (i = 0; i < dev_cache_size; i++) {
+		if (strcmp(dev_cache[i].instance_id, instance_id) == 0)
+			break;
+	}
+	if (i >= dev_cache_size) {
+		if (dev_cache_size >= ARRAYSIZE(dev_cache))
+			return NULL;
+		memset(&dev_cache[i], 0, sizeof(dev_cache_entry));
+		dev_cache[i].instance_id = safe_strdup(instance_id);
+		if (dev_cache[i].instance_id == NULL)
+			return NULL;
+		dev_cache_size++;
+	}
+	dev_cache[i].seen = TRUE;
+	return &dev_cache[i];
+}
+
+// Remove the entries of the devices that weren't seen during the last enumeration
+static void PruneDevCache(void)
+{
+	int i, j;
+
+	for (i = 0, j = 0; i < dev_cache_size; i++) {
+		if (!dev_cache[i].seen) {
+			free(dev_cache[i].instance_id);
+			free(dev_cache[i].path);
+			continue;
+		}
+		dev_cache[i].seen = FALSE;
+		dev_cache[j++] = dev_cache[i];
+	}
+	dev_cache_size = j;
+}
+
+// Keep the probing results of a disk, so that the next incremental refresh can reuse them
+static void StoreDevProbe(dev_cache_entry* cache, dev_probe* dev)
+{
+	// Card readers may have their media swapped without any notification, and a blank
+	// one doesn't have volumes to notify us about, so we always probe these.
+	cache->has_probe = (dev->drive_number >= 0) && (dev->has_media) && (!dev->props.is_CARD);
+	if (!cache->has_probe)
+		return;
+	if (safe_stricmp(cache->path, dev->path.String[0]) != 0) {
+		safe_free(cache->path);
+		cache->path = safe_strdup(dev->path.String[0]);
+		if (cache->path == NULL) {
+			cache->has_probe = FALSE;
+			return;
+		}
+	}
+	cache->probe.drive_number = dev->drive_number;
+	cache->probe.has_media = dev->has_media;
+	cache->probe.has_label = dev->has_label;
+	cache->probe.has_fixed_volume = dev->has_fixed_volume;
+	cache->probe.size = dev->size;
+	cache->probe.uefi_togo = dev->uefi_togo;
+	static_strcpy(cache->probe.letters, dev->letters);
+	static_strcpy(cache->probe.label, dev->label);
+}
+
+static BOOL LoadDevProbe(dev_cache_entry* cache, dev_probe* dev)
+{
+	if (!cache->has_probe || (safe_stricmp(cache->path, dev->path.String[0]) != 0))
+		return FALSE;
+	dev->drive_number = cache->probe.drive_number;
+	dev->has_media = cache->probe.has_media;
+	dev->has_label = cache->probe.has_label;
+	dev->has_fixed_volume = cache->probe.has_fixed_volume;
+	dev->size = cache->probe.size;
+	dev->uefi_togo = cache->probe.uefi_togo;
+	static_strcpy(dev->letters, cache->probe.letters);
+	static_strcpy(dev->label, cache->probe.label);
+	dev->cached = TRUE;
+	return TRUE;
+}
+
+/*
+ * Flag the disk with the Device Interface Path we got a hotplug notification for,
+ * so that the next incremental refresh probes it again.
+ */
+void InvalidateDevice(const char* path)
+{
+	int i;
+
+	for (i = 0; i < dev_cache_size; i++) {
+		if (safe_stricmp(dev_cache[i].path, path) == 0)
+			dev_cache[i].has_probe = FALSE;
+	}
+}
+
+// Same, for the disks that have, or now host, one of the volumes from a letter mask
+void InvalidateDriveLetters(DWORD unitmask)
+{
+	HANDLE hDrive;
+	char *p, logical_drive[] = "\\\\.\\#:";
+	int i, drive_number;
+	DWORD letter;
+
+	for (letter = 0; letter < 26; letter++) {
+		if (!(unitmask & (1 << letter)))
+			continue;
+		drive_number = -1;
+		logical_drive[4] = (char)('A' + letter);
+		// No access rights are needed to get the device number
+		hDrive = CreateFileA(logical_drive, 0, FILE_SHARE_READ|FILE_SHARE_WRITE,
+			NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hDrive != INVALID_HANDLE_VALUE) {
+			drive_number = GetDriveNumber(hDrive, logical_drive);
+			CloseHandle(hDrive);
+		}
+		for (i = 0; i < dev_cache_size; i++) {
+			if (!dev_cache[i].has_probe)
+				continue;
+			if (dev_cache[i].probe.drive_number == drive_number) {
+				dev_cache[i].has_probe = FALSE;
+				continue;
+			}
+			for (p = dev_cache[i].probe.letters; *p; p++) {
+				if (*p == 'A' + letter) {
+					dev_cache[i].has_probe = FALSE;
+					break;
+				}
+			}
+		}
+	}
+}
+
+// Register for the arrival and removal notifications of disk interfaces
+HDEVNOTIFY RegisterDiskNotifications(HWND hWnd)
+{
+	DEV_BROADCAST_DEVICEINTERFACE_A filter = { 0 };
+
+	filter.dbcc_size = sizeof(filter);
+	filter.dbcc_devicetype = DBT_DEVTYP_DEVICEINTERFACE;
+	filter.dbcc_classguid = GUID_DEVINTERFACE_DISK;
+	return RegisterDeviceNotificationA(hWnd, &filter, DEVICE_NOTIFY_WINDOW_HANDLE);
+}
+
+// Probe the media of a disk. This is called from the probing threads, so it
+// must not touch the UI or any of the global drive lists.
+static void ProbeDevice(dev_probe* dev)
+{
+	HANDLE hDrive;
+	DWORD i, drive_index;
+	char *p, drive_name[] = "?:\\", uefi_togo_check[] = "?:\\EFI\\Rufus\\ntfs_x64.efi";
+
+	dev->drive_number = -1;
+	for (i = 0; i < dev->path.Index; i++) {
+		hDrive = CreateFileA(dev->path.String[i], GENERIC_READ|GENERIC_WRITE,
+			FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hDrive == INVALID_HANDLE_VALUE) {
+			uprintf("Could not open '%s': %s", dev->path.String[i], WindowsErrorString());
+			continue;
+		}
+		dev->drive_number = GetDriveNumber(hDrive, dev->path.String[i]);
+		CloseHandle(hDrive);
+		if (dev->drive_number >= 0)
+			break;
+	}
+	if (dev->drive_number < 0)
+		return;
+
+	drive_index = dev->drive_number + DRIVE_INDEX_MIN;
+	dev->has_media = IsMediaPresent(drive_index);
+	if (!dev->has_media)
+		return;
+	dev->size = GetDriveSize(drive_index);
+	if (dev->size < (MIN_DRIVE_SIZE*MB))
+		return;
+	dev->has_label = GetDriveLabel(drive_index, dev->letters, dev->label);
+	if (!dev->has_label)
+		return;
+	for (p = dev->letters; *p; p++) {
+		drive_name[0] = *p;
+		if (GetDriveTypeA(drive_name) != DRIVE_REMOVABLE)
+			dev->has_fixed_volume = TRUE;
+		// Find the UEFI:TOGO partition(s), which we eliminate from our listing
+		uefi_togo_check[0] = *p;
+		if (PathFileExistsA(uefi_togo_check))
+			dev->uefi_togo |= 1 << (*p - 'A');
+	}
+	// Reuse the HDD score from the cache, unless the media has changed size
+	if ((!enable_HDDs) && (!dev->props.is_VHD) && (!dev->props.is_CARD) && (dev->hdd_size != dev->size)) {
+		dev->hdd_score = IsHDD(drive_index, (uint16_t)dev->props.vid, (uint16_t)dev->props.pid, dev->name);
+		dev->hdd_size = dev->size;
+	}
+}
+
+static void ProbeDevices(dev_probe_list* list)
+{
+	LONG i;
+
+	while ((i = InterlockedIncrement(&list->next) - 1) < (LONG)list->count) {
+		if (!list->probe[i].cached)
+			ProbeDevice(&list->probe[i]);
+		if (list->probe[i].done != NULL)
+			SetEvent(list->probe[i].done);
+	}
+}
+
+static DWORD WINAPI ProbeDeviceThread(void* param)
+{
+	ProbeDevices((dev_probe_list*)param);
+	ExitThread(0);
+}
+
+/*
+ * Refresh the device list. For an incremental refresh, the disks that are already known,
+ * and that haven't been flagged by a hotplug notification, are not probed again.
+ */
+static BOOL EnumerateDevices(DWORD devnum, BOOL incremental)
 {
 	// List of USB storage drivers we know - list may be incomplete!
 	const char* usbstor_name[] = {
@@ -457,14 +713,14 @@ BOOL GetDevices(DWORD devnum)
 	const char* scsi_card_name[] = {
 		"_SD_", "_SDHC_", "_MMC_", "_MS_", "_MSPro_", "_xDPicture_", "_O2Media_"
 	};
-	const char* usb_speed_name[USB_SPEED_MAX] = { "USB", "USB 1.0", "USB 1.1", "USB 2.0", "USB 3.0", "USB 3.1" };
+	static const char* usb_speed_name[USB_SPEED_MAX] = { "USB", "USB 1.0", "USB 1.1", "USB 2.0", "USB 3.0", "USB 3.1" };
+	// What each link speed can sustain for mass storage, in KB/s, once the protocol overhead is accounted for
+	static const uint32_t usb_link_speed[USB_SPEED_MAX] = { 0, 150, 1000, 40000, 400000, 1000000 };
 	const char* windows_sandbox_vhd_label = "PortableBaseLayer";
 	// Hash table and String Array used to match a Device ID with the parent hub's Device Interface Path
 	htab_table htab_devid = HTAB_EMPTY;
 	StrArray dev_if_path;
 	char letter_name[] = " (?:)";
-	char drive_name[] = "?:\\";
-	char uefi_togo_check[] = "?:\\EFI\\Rufus\\ntfs_x64.efi";
 	char scsi_card_name_copy[16];
 	BOOL r = FALSE, found = FALSE, post_backslash;
 	HDEVINFO dev_info = NULL;
@@ -475,18 +731,23 @@ BOOL GetDevices(DWORD devnum)
 	DWORD size, i, j, k, l, data_type, drive_index;
 	DWORD uasp_start = ARRAYSIZE(usbstor_name), card_start = ARRAYSIZE(genstor_name);
 	ULONG list_size[ARRAYSIZE(usbstor_name)] = { 0 }, list_start[ARRAYSIZE(usbstor_name)] = { 0 }, full_list_size, ulFlags;
-	HANDLE hDrive;
+	HANDLE probe_thread[DEV_PROBE_THREADS];
+	DWORD nb_threads = 0;
 	LONG maxwidth = 0;
 	int s, score, drive_number, remove_drive;
-	char drive_letters[27], *device_id, *devid_list = NULL, entry_msg[128];
-	char *p, *label, *entry, buffer[MAX_PATH], str[MAX_PATH], device_instance_id[MAX_PATH], *method_str, *hub_path;
+	char *drive_letters, *device_id, *devid_list = NULL, entry_msg[128], info[MAX_PATH + 64];
+	char *label, *entry, buffer[MAX_PATH], str[MAX_PATH], device_instance_id[MAX_PATH], *method_str, *hub_path;
 	usb_device_props props;
+	dev_probe_list list = { 0 };
+	dev_probe *dev, *probe;
+	dev_cache_entry* cache;
 
 	IGNORE_RETVAL(ComboBox_ResetContent(hDeviceList));
 	StrArrayClear(&DriveId);
 	StrArrayClear(&DriveName);
 	StrArrayClear(&DriveLabel);
 	StrArrayClear(&DriveHub);
+	StrArrayClear(&DriveLocation);
 	StrArrayCreate(&dev_if_path, 128);
 	// Add a dummy for string index zero, as this is what non matching hashes will point to
 	StrArrayAdd(&dev_if_path, "", TRUE);
@@ -748,9 +1009,27 @@ BOOL GetDevices(DWORD devnum)
 				if ((uintptr_t)htab_devid.table[j].data > 0) {
 					uuprintf("  Matched with Hub[%d]: '%s'", (uintptr_t)htab_devid.table[j].data,
 							dev_if_path.String[(uintptr_t)htab_devid.table[j].data]);
-					if (GetUSBProperties(dev_if_path.String[(uintptr_t)htab_devid.table[j].data], device_id, &props)) {
+					// Querying the hub is slow, so reuse what we got the last time we saw this device
+					cache = GetDevCacheEntry(device_instance_id);
+					if ((cache != NULL) && (cache->has_usb_props)) {
+						props.vid = cache->vid;
+						props.pid = cache->pid;
+						props.speed = cache->speed;
+						props.lower_speed = cache->lower_speed;
+						props.port = cache->port;
+						method_str = "";
+						hub_path = dev_if_path.String[(uintptr_t)htab_devid.table[j].data];
+					} else if (GetUSBProperties(dev_if_path.String[(uintptr_t)htab_devid.table[j].data], device_id, &props)) {
 						method_str = "";
 						hub_path = dev_if_path.String[(uintptr_t)htab_devid.table[j].data];
+						if (cache != NULL) {
+							cache->has_usb_props = TRUE;
+							cache->vid = props.vid;
+							cache->pid = props.pid;
+							cache->speed = props.speed;
+							cache->lower_speed = props.lower_speed;
+							cache->port = props.port;
+						}
 					}
 #ifdef FORCED_DEVICE
 					props.vid = FORCED_VID;
@@ -762,16 +1041,16 @@ BOOL GetDevices(DWORD devnum)
 			}
 		}
 		if (props.is_VHD) {
-			uprintf("Found VHD device '%s'", buffer);
+			static_sprintf(info, "Found VHD device '%s'", buffer);
 		} else if ((props.is_CARD) && ((!props.is_USB) || ((props.vid == 0) && (props.pid == 0)))) {
-			uprintf("Found card reader device '%s'", buffer);
+			static_sprintf(info, "Found card reader device '%s'", buffer);
 		} else if ((!props.is_USB) && (!props.is_UASP) && (props.is_Removable)) {
 			if (!list_non_usb_removable_drives) {
 				uprintf("Found non-USB removable device '%s' => Eliminated", buffer);
 				uuprintf("If you *REALLY* need, you can enable listing of this device with <Ctrl><Alt><F>");
 				continue;
 			}
-			uprintf("Found non-USB removable device '%s'", buffer);
+			static_sprintf(info, "Found non-USB removable device '%s'", buffer);
 		} else {
 			if ((props.vid == 0) && (props.pid == 0)) {
 				if (!props.is_USB) {
@@ -793,10 +1072,22 @@ BOOL GetDevices(DWORD devnum)
 			}
 			if (props.speed >= USB_SPEED_MAX)
 				props.speed = 0;
-			uprintf("Found %s%s%s device '%s' (%s) %s", props.is_UASP?"UAS (":"",
+			static_sprintf(info, "Found %s%s%s device '%s' (%s) %s", props.is_UASP?"UAS (":"",
 				usb_speed_name[props.speed], props.is_UASP?")":"", buffer, str, method_str);
-			if (props.lower_speed)
-				uprintf("NOTE: This device is a USB 3.%c device operating at lower speed...", '0' + props.lower_speed - 1);
+		}
+
+		// Collect the Device Interface Paths, that the probing threads will try to open
+		dev = NULL;
+		probe = (dev_probe*)realloc(list.probe, (list.count + 1) * sizeof(dev_probe));
+		if (probe != NULL) {
+			list.probe = probe;
+			dev = &list.probe[list.count];
+			memset(dev, 0, sizeof(dev_probe));
+			StrArrayCreate(&dev->path, 2);
+		}
+		if ((dev == NULL) || (dev->path.String == NULL)) {
+			uprintf("Could not allocate device probe");
+			continue;
 		}
 		devint_data.cbSize = sizeof(devint_data);
 		devint_detail_data = NULL;
@@ -804,11 +1095,8 @@ BOOL GetDevices(DWORD devnum)
 			safe_free(devint_detail_data);
 
 			if (!SetupDiEnumDeviceInterfaces(dev_info, &dev_info_data, &GUID_DEVINTERFACE_DISK, j, &devint_data)) {
-				if(GetLastError() != ERROR_NO_MORE_ITEMS) {
+				if(GetLastError() != ERROR_NO_MORE_ITEMS)
 					uprintf("SetupDiEnumDeviceInterfaces failed: %s", WindowsErrorString());
-				} else {
-					uprintf("A device was eliminated because it didn't report itself as a disk");
-				}
 				break;
 			}
 
@@ -833,136 +1121,177 @@ BOOL GetDevices(DWORD devnum)
 				uprintf("SetupDiGetDeviceInterfaceDetail (actual) failed: %s", WindowsErrorString());
 				continue;
 			}
+			StrArrayAdd(&dev->path, devint_detail_data->DevicePath, TRUE);
+		}
+		safe_free(devint_detail_data);
+		if (dev->path.Index == 0) {
+			uprintf("%s", info);
+			uprintf("A device was eliminated because it didn't report itself as a disk");
+			StrArrayDestroy(&dev->path);
+			continue;
+		}
+		dev->props = props;
+		static_strcpy(dev->name, buffer);
+		static_strcpy(dev->instance_id, device_instance_id);
+		static_strcpy(dev->info, info);
+		dev->hub_path = hub_path;
+		cache = GetDevCacheEntry(device_instance_id);
+		if (cache != NULL) {
+			dev->hdd_size = cache->hdd_size;
+			dev->hdd_score = cache->hdd_score;
+			if (incremental)
+				LoadDevProbe(cache, dev);
+		}
+		list.count++;
+	}
+	SetupDiDestroyDeviceInfoList(dev_info);
 
-			hDrive = CreateFileA(devint_detail_data->DevicePath, GENERIC_READ|GENERIC_WRITE,
-				FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-			if(hDrive == INVALID_HANDLE_VALUE) {
-				uprintf("Could not open '%s': %s", devint_detail_data->DevicePath, WindowsErrorString());
-				continue;
-			}
-
-			drive_number = GetDriveNumber(hDrive, devint_detail_data->DevicePath);
-			CloseHandle(hDrive);
-			if (drive_number < 0)
-				continue;
-
-			drive_index = drive_number + DRIVE_INDEX_MIN;
-			if (!IsMediaPresent(drive_index)) {
-				uprintf("Device eliminated because it appears to contain no media");
-				safe_free(devint_detail_data);
+	// Now probe the media of all these disks in parallel. If we can't have threads, just do it from here.
+	for (i = 0; i < list.count; i++) {
+		list.probe[i].done = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (list.probe[i].done == NULL)
+			break;
+	}
+	if (i >= list.count) {
+		for (nb_threads = 0; nb_threads < min(DEV_PROBE_THREADS, list.count); nb_threads++) {
+			probe_thread[nb_threads] = CreateThread(NULL, 0, ProbeDeviceThread, &list, 0, NULL);
+			if (probe_thread[nb_threads] == NULL) {
+				uprintf("Unable to start device probing thread: %s", WindowsErrorString());
 				break;
 			}
-			if (GetDriveSize(drive_index) < (MIN_DRIVE_SIZE*MB)) {
-				uprintf("Device eliminated because it is smaller than %d MB", MIN_DRIVE_SIZE);
-				safe_free(devint_detail_data);
-				break;
+		}
+	}
+	if (nb_threads == 0)
+		ProbeDevices(&list);
+
+	// Add the disks to the list in enumeration order, as soon as each of them has been probed
+	for (i = 0; i < list.count; i++) {
+		dev = &list.probe[i];
+		if (nb_threads != 0)
+			WaitForSingleObject(dev->done, INFINITE);
+		uprintf("%s", dev->info);
+		if (dev->props.lower_speed)
+			uprintf("NOTE: This device is a USB 3.%c device operating at lower speed...", '0' + dev->props.lower_speed - 1);
+		if ((cache = GetDevCacheEntry(dev->instance_id)) != NULL) {
+			if (dev->hdd_size != 0) {
+				cache->hdd_size = dev->hdd_size;
+				cache->hdd_score = dev->hdd_score;
 			}
+			if (!dev->cached)
+				StoreDevProbe(cache, dev);
+		}
+		if (dev->drive_number < 0) {
+			uprintf("A device was eliminated because it didn't report itself as a disk");
+			continue;
+		}
+		drive_number = dev->drive_number;
+		drive_index = drive_number + DRIVE_INDEX_MIN;
+		if (!dev->has_media) {
+			uprintf("Device eliminated because it appears to contain no media");
+			continue;
+		}
+		if (dev->size < (MIN_DRIVE_SIZE*MB)) {
+			uprintf("Device eliminated because it is smaller than %d MB", MIN_DRIVE_SIZE);
+			continue;
+		}
+		if (!dev->has_label)
+			continue;
 
-			if (GetDriveLabel(drive_index, drive_letters, &label)) {
-				if ((props.is_SCSI) && (!props.is_UASP) && (!props.is_VHD)) {
-					if (!props.is_Removable) {
-						// Non removables should have been eliminated above, but since we
-						// are potentially dealing with system drives, better safe than sorry
-						safe_free(devint_detail_data);
-						break;
-					}
-					if (!list_non_usb_removable_drives) {
-						// Go over the mounted partitions and find if GetDriveType() says they are
-						// removable. If they are not removable, don't allow the drive to be listed
-						for (p = drive_letters; *p; p++) {
-							drive_name[0] = *p;
-							if (GetDriveTypeA(drive_name) != DRIVE_REMOVABLE)
-								break;
-						}
-						if (*p) {
-							uprintf("Device eliminated because it contains a mounted partition that is set as non-removable");
-							safe_free(devint_detail_data);
-							break;
-						}
-					}
-				}
-				if ((!enable_HDDs) && (!props.is_VHD) && (!props.is_CARD) &&
-					((score = IsHDD(drive_index, (uint16_t)props.vid, (uint16_t)props.pid, buffer)) > 0)) {
-					uprintf("Device eliminated because it was detected as a Hard Drive (score %d > 0)", score);
-					if (!list_non_usb_removable_drives)
-						uprintf("If this device is not a Hard Drive, please e-mail the author of this application");
-					uprintf("NOTE: You can enable the listing of Hard Drives under 'advanced drive properties'");
-					safe_free(devint_detail_data);
-					break;
-				} else if ((!enable_HDDs) && (props.is_CARD) && (GetDriveSize(drive_index) > MAX_DEFAULT_LIST_CARD_SIZE * GB)) {
-					uprintf("Device eliminated because it was detected as a card larger than %d GB", MAX_DEFAULT_LIST_CARD_SIZE);
-					uprintf("To use such a card, check 'List USB Hard Drives' under 'advanced drive properties'");
-					safe_free(devint_detail_data);
-					break;
-				}
-				// Windows 10 19H1 mounts a 'PortableBaseLayer' for its Windows Sandbox feature => unlist those
-				if (safe_strcmp(label, windows_sandbox_vhd_label) == 0) {
-					uprintf("Device eliminated because it is a Windows Sandbox VHD");
-					safe_free(devint_detail_data);
-					break;
-				}
-				if (props.is_VHD && (!enable_VHDs)) {
-					uprintf("Device eliminated because listing of VHDs is disabled (Alt-G)");
-					safe_free(devint_detail_data);
-					break;
-				}
+		if ((dev->props.is_SCSI) && (!dev->props.is_UASP) && (!dev->props.is_VHD)) {
+			// Non removables should have been eliminated above, but since we
+			// are potentially dealing with system drives, better safe than sorry
+			if (!dev->props.is_Removable)
+				continue;
+			// If any of the mounted partitions is not removable according to GetDriveType(),
+			// don't allow the drive to be listed
+			if ((!list_non_usb_removable_drives) && (dev->has_fixed_volume)) {
+				uprintf("Device eliminated because it contains a mounted partition that is set as non-removable");
+				continue;
+			}
+		}
+		if ((!enable_HDDs) && (!dev->props.is_VHD) && (!dev->props.is_CARD) && ((score = dev->hdd_score) > 0)) {
+			uprintf("Device eliminated because it was detected as a Hard Drive (score %d > 0)", score);
+			if (!list_non_usb_removable_drives)
+				uprintf("If this device is not a Hard Drive, please e-mail the author of this application");
+			uprintf("NOTE: You can enable the listing of Hard Drives under 'advanced drive properties'");
+			continue;
+		} else if ((!enable_HDDs) && (dev->props.is_CARD) && (dev->size > MAX_DEFAULT_LIST_CARD_SIZE * GB)) {
+			uprintf("Device eliminated because it was detected as a card larger than %d GB", MAX_DEFAULT_LIST_CARD_SIZE);
+			uprintf("To use such a card, check 'List USB Hard Drives' under 'advanced drive properties'");
+			continue;
+		}
+		// Windows 10 19H1 mounts a 'PortableBaseLayer' for its Windows Sandbox feature => unlist those
+		if (safe_strcmp(dev->label, windows_sandbox_vhd_label) == 0) {
+			uprintf("Device eliminated because it is a Windows Sandbox VHD");
+			continue;
+		}
+		if (dev->props.is_VHD && (!enable_VHDs)) {
+			uprintf("Device eliminated because listing of VHDs is disabled (Alt-G)");
+			continue;
+		}
 
-				// The empty string is returned for drives that don't have any volumes assigned
-				if (drive_letters[0] == 0) {
-					entry = lmprintf(MSG_046, label, drive_number,
-						SizeToHumanReadable(GetDriveSize(drive_index), FALSE, use_fake_units));
-				} else {
-					// Find the UEFI:TOGO partition(s) (and eliminate them form our listing)
-					for (k=0; drive_letters[k]; k++) {
-						uefi_togo_check[0] = drive_letters[k];
-						if (PathFileExistsA(uefi_togo_check)) {
-							for (l=k; drive_letters[l]; l++)
-								drive_letters[l] = drive_letters[l+1];
-							k--;
-						}
-					}
-					// We have multiple volumes assigned to the same device (multiple partitions)
-					// If that is the case, use "Multiple Volumes" instead of the label
-					static_strcpy(entry_msg, (((drive_letters[0] != 0) && (drive_letters[1] != 0))?
-						lmprintf(MSG_047):label));
-					for (k=0, remove_drive=0; drive_letters[k] && (!remove_drive); k++) {
-						// Append all the drive letters we detected
-						letter_name[2] = drive_letters[k];
-						if (right_to_left_mode)
-							static_strcat(entry_msg, RIGHT_TO_LEFT_MARK);
-						static_strcat(entry_msg, letter_name);
-						if (drive_letters[k] == (PathGetDriveNumberU(app_dir) + 'A'))
-							remove_drive = 1;
-						if (drive_letters[k] == (PathGetDriveNumberU(system_dir) + 'A'))
-							remove_drive = 2;
-					}
-					// Make sure that we don't list any drive that should not be listed
-					if (remove_drive) {
-						uprintf("Removing %C: from the list: This is the %s!", drive_letters[--k],
-							(remove_drive==1)?"disk from which " APPLICATION_NAME " is running":"system disk");
-						safe_free(devint_detail_data);
-						break;
-					}
-					safe_sprintf(&entry_msg[strlen(entry_msg)], sizeof(entry_msg) - strlen(entry_msg),
-						"%s [%s]", (right_to_left_mode)?RIGHT_TO_LEFT_MARK:"", SizeToHumanReadable(GetDriveSize(drive_index), FALSE, use_fake_units));
-					entry = entry_msg;
+		label = dev->label;
+		drive_letters = dev->letters;
+		// The empty string is returned for drives that don't have any volumes assigned
+		if (drive_letters[0] == 0) {
+			entry = lmprintf(MSG_046, label, drive_number,
+				SizeToHumanReadable(dev->size, FALSE, use_fake_units));
+		} else {
+			// Eliminate the UEFI:TOGO partition(s) from our listing
+			for (k=0; drive_letters[k]; k++) {
+				if (dev->uefi_togo & (1 << (drive_letters[k] - 'A'))) {
+					for (l=k; drive_letters[l]; l++)
+						drive_letters[l] = drive_letters[l+1];
+					k--;
 				}
-
-				// Must ensure that the combo box is UNSORTED for indexes to be the same
-				StrArrayAdd(&DriveId, device_instance_id, TRUE);
-				StrArrayAdd(&DriveName, buffer, TRUE);
-				StrArrayAdd(&DriveLabel, label, TRUE);
-				if ((hub_path != NULL) && (StrArrayAdd(&DriveHub, hub_path, TRUE) >= 0))
-					DrivePort[DriveHub.Index - 1] = props.port;
-
-				IGNORE_RETVAL(ComboBox_SetItemData(hDeviceList, ComboBox_AddStringU(hDeviceList, entry), drive_index));
-				maxwidth = max(maxwidth, GetEntryWidth(hDeviceList, entry));
-				safe_free(devint_detail_data);
-				break;
 			}
+			// We have multiple volumes assigned to the same device (multiple partitions)
+			// If that is the case, use "Multiple Volumes" instead of the label
+			static_strcpy(entry_msg, (((drive_letters[0] != 0) && (drive_letters[1] != 0))?
+				lmprintf(MSG_047):label));
+			for (k=0, remove_drive=0; drive_letters[k] && (!remove_drive); k++) {
+				// Append all the drive letters we detected
+				letter_name[2] = drive_letters[k];
+				if (right_to_left_mode)
+					static_strcat(entry_msg, RIGHT_TO_LEFT_MARK);
+				static_strcat(entry_msg, letter_name);
+				if (drive_letters[k] == (PathGetDriveNumberU(app_dir) + 'A'))
+					remove_drive = 1;
+				if (drive_letters[k] == (PathGetDriveNumberU(system_dir) + 'A'))
+					remove_drive = 2;
+			}
+			// Make sure that we don't list any drive that should not be listed
+			if (remove_drive) {
+				uprintf("Removing %C: from the list: This is the %s!", drive_letters[--k],
+					(remove_drive==1)?"disk from which " APPLICATION_NAME " is running":"system disk");
+				continue;
+			}
+			safe_sprintf(&entry_msg[strlen(entry_msg)], sizeof(entry_msg) - strlen(entry_msg),
+				"%s [%s]", (right_to_left_mode)?RIGHT_TO_LEFT_MARK:"", SizeToHumanReadable(dev->size, FALSE, use_fake_units));
+			entry = entry_msg;
 		}
+
+		// Must ensure that the combo box is UNSORTED for indexes to be the same
+		StrArrayAdd(&DriveId, dev->instance_id, TRUE);
+		StrArrayAdd(&DriveName, dev->name, TRUE);
+		StrArrayAdd(&DriveLabel, label, TRUE);
+		if ((dev->hub_path != NULL) && (StrArrayAdd(&DriveHub, dev->hub_path, TRUE) >= 0))
+			DrivePort[DriveHub.Index - 1] = dev->props.port;
+		// For the device history, where "<hub path>#<port>" identifies the port of a duplicator hub
+		DriveSpeedName[DriveId.Index - 1] = dev->props.is_USB ? usb_speed_name[dev->props.speed] : NULL;
+		// For the multi-target scheduling and warnings
+		DriveLinkSpeed[DriveId.Index - 1] = dev->props.is_USB ? usb_link_speed[dev->props.speed] : 0;
+		DriveLowerSpeed[DriveId.Index - 1] = dev->props.is_USB ? (uint8_t)dev->props.lower_speed : 0;
+		if (dev->hub_path != NULL)
+			static_sprintf(str, "%s#%d", dev->hub_path, dev->props.port);
+		else
+			str[0] = 0;
+		StrArrayAdd(&DriveLocation, str, TRUE);
+
+		IGNORE_RETVAL(ComboBox_SetItemData(hDeviceList, ComboBox_AddStringU(hDeviceList, entry), drive_index));
+		maxwidth = max(maxwidth, GetEntryWidth(hDeviceList, entry));
 	}
-	SetupDiDestroyDeviceInfoList(dev_info);
+	PruneDevCache();
 
 	// Adjust the Dropdown width to the maximum text size
 	SendMessage(hDeviceList, CB_SETDROPPEDWIDTH, (WPARAM)maxwidth, 0);
@@ -984,8 +1313,28 @@ BOOL GetDevices(DWORD devnum)
 out:
 	// Set 'Start' as the selected button, so that tab selection works
 	SendMessage(hMainDialog, WM_NEXTDLGCTL, (WPARAM)GetDlgItem(hMainDialog, IDC_START), TRUE);
+	if (nb_threads != 0) {
+		WaitForMultipleObjects(nb_threads, probe_thread, TRUE, INFINITE);
+		for (i = 0; i < nb_threads; i++)
+			CloseHandle(probe_thread[i]);
+	}
+	for (i = 0; i < list.count; i++) {
+		safe_closehandle(list.probe[i].done);
+		StrArrayDestroy(&list.probe[i].path);
+	}
+	safe_free(list.probe);
 	safe_free(devid_list);
 	StrArrayDestroy(&dev_if_path);
 	htab_destroy(&htab_devid);
 	return r;
 }
+
+BOOL GetDevices(DWORD devnum)
+{
+	return EnumerateDevices(devnum, FALSE);
+}
+
+BOOL RefreshDevices(DWORD devnum)
+{
+	return EnumerateDevices(devnum, TRUE);
+}
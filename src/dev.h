@@ -171,3 +171,53 @@ const GUID GUID_DEVINTERFACE_USB_HUB =
 	{ 0xf18a0e88L, 0xc30c, 0x11d0, {0x88, 0x15, 0x00, 0xa0, 0xc9, 0x06, 0xbe, 0xd8} };
 
 #define DEVID_HTAB_SIZE		257
+#define DEV_PROBE_THREADS	8
+
+/*
+ * A disk that passed the identification pass of GetDevices(). Its media is then probed
+ * from a pool of threads, as opening devices can take a while with slow or sleeping drives.
+ */
+typedef struct {
+	usb_device_props props;
+	StrArray path;					// The Device Interface Paths of the disk
+	char name[MAX_PATH];
+	char instance_id[MAX_PATH];
+	char* hub_path;
+	char info[MAX_PATH + 64];		// The "Found ... device" line for the log
+	HANDLE done;					// Signaled once the probing is complete
+	BOOL cached;					// The results below come from the cache
+	// Results of the probing
+	int drive_number;
+	BOOL has_media;
+	BOOL has_label;
+	BOOL has_fixed_volume;
+	uint64_t size;
+	uint64_t hdd_size;				// The drive size for which hdd_score was computed
+	int hdd_score;
+	uint32_t uefi_togo;				// Mask of the UEFI:TOGO drive letters (bit 0 = 'A')
+	char letters[27];
+	char label[MAX_PATH + 1];
+} dev_probe;
+
+typedef struct {
+	dev_probe* probe;
+	DWORD count;
+	volatile LONG next;
+} dev_probe_list;
+
+/*
+ * The results of the slow USB and HDD queries, cached by Device Instance ID across
+ * refreshes, along with the last probing results, which an incremental refresh can
+ * reuse until a hotplug notification for the device or one of its volumes comes in.
+ */
+typedef struct {
+	char* instance_id;
+	char* path;						// The first Device Interface Path of the disk
+	BOOL seen;
+	BOOL has_usb_props;
+	BOOL has_probe;
+	uint32_t vid, pid, speed, lower_speed, port;
+	uint64_t hdd_size;
+	int hdd_score;
+	dev_probe probe;				// Only the results of the probing are valid
+} dev_cache_entry;
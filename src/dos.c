@@ -36,7 +36,7 @@
 
 #include "dos.h"
 
-static BYTE* DiskImage = NULL;
+static const BYTE* DiskImage = NULL;
 static DWORD DiskImageSize;
 
 /*
@@ -166,7 +166,7 @@ static void FatDateTimeToSystemTime(PLARGE_INTEGER SystemTime, PFAT_DATETIME Fat
  * IO.SYS            000003AA          75 -> EB
  * COMMAND.COM       00006510          75 -> EB
  */
-static BOOL Patch_COMMAND_COM(size_t filestart, size_t filesize)
+static BOOL Patch_COMMAND_COM(BYTE* filedata, size_t filesize)
 {
 	const BYTE expected[8] = { 0x15, 0x80, 0xFA, 0x03, 0x75, 0x10, 0xB8, 0x0E };
 
@@ -175,15 +175,15 @@ static BOOL Patch_COMMAND_COM(size_t filestart, size_t filesize)
 		uprintf("  unexpected file size");
 		return FALSE;
 	}
-	if (memcmp(&DiskImage[filestart+0x650c], expected, sizeof(expected)) != 0) {
+	if (memcmp(&filedata[0x650c], expected, sizeof(expected)) != 0) {
 		uprintf("  unexpected binary data");
 		return FALSE;
 	}
-	DiskImage[filestart+0x6510] = 0xeb;
+	filedata[0x6510] = 0xeb;
 	return TRUE;
 }
 
-static BOOL Patch_IO_SYS(size_t filestart, size_t filesize)
+static BOOL Patch_IO_SYS(BYTE* filedata, size_t filesize)
 {
 	const BYTE expected[8] = { 0xFA, 0x80, 0x75, 0x09, 0x8D, 0xB6, 0x99, 0x00 };
 
@@ -192,22 +192,25 @@ static BOOL Patch_IO_SYS(size_t filestart, size_t filesize)
 		uprintf("  unexpected file size");
 		return FALSE;
 	}
-	if (memcmp(&DiskImage[filestart+0x3a8], expected, sizeof(expected)) != 0) {
+	if (memcmp(&filedata[0x3a8], expected, sizeof(expected)) != 0) {
 		uprintf("  unexpected binary data");
 		return FALSE;
 	}
-	DiskImage[filestart+0x3aa] = 0xeb;
+	filedata[0x3aa] = 0xeb;
 	return TRUE;
 }
 
 /* Extract the file identified by FAT RootDir index 'entry' to 'path' */
 static BOOL ExtractFAT(int entry, const char* path)
 {
-	HANDLE hFile;
+	BOOL r = FALSE;
+	HANDLE hFile = INVALID_HANDLE_VALUE;
 	DWORD Size;
 	char filename[MAX_PATH];
 	size_t i, pos, fnamepos;
 	size_t filestart, filesize;
+	const BYTE* filedata;
+	BYTE* patched = NULL;
 	FAT_DATETIME LastAccessTime;
 	LARGE_INTEGER liCreationTime, liLastAccessTime, liLastWriteTime;
 	FILETIME ftCreationTime, ftLastAccessTime, ftLastWriteTime;
@@ -241,11 +244,21 @@ static BOOL ExtractFAT(int entry, const char* path)
 		return FALSE;
 	}
 
-	/* WinME DOS files need to be patched */
-	if (strcmp(&filename[fnamepos], "COMMAND.COM") == 0) {
-		Patch_COMMAND_COM(filestart, filesize);
-	} else if (strcmp(&filename[fnamepos], "IO.SYS") == 0) {
-		Patch_IO_SYS(filestart, filesize);
+	/* Files are written straight from the resource, apart from the WinME
+	 * DOS ones, which need to be patched, and thus get a private copy */
+	filedata = &DiskImage[filestart];
+	if ((strcmp(&filename[fnamepos], "COMMAND.COM") == 0) || (strcmp(&filename[fnamepos], "IO.SYS") == 0)) {
+		patched = (BYTE*)malloc(filesize);
+		if (patched == NULL) {
+			uprintf("Could not allocate buffer to patch '%s'", filename);
+			return FALSE;
+		}
+		memcpy(patched, filedata, filesize);
+		if (filename[fnamepos] == 'C')
+			Patch_COMMAND_COM(patched, filesize);
+		else
+			Patch_IO_SYS(patched, filesize);
+		filedata = patched;
 	}
 
 	/* Create a file, using the same attributes as found in the FAT */
@@ -253,13 +266,12 @@ static BOOL ExtractFAT(int entry, const char* path)
 		NULL, CREATE_ALWAYS, dir_entry->Attributes, NULL);
 	if (hFile == INVALID_HANDLE_VALUE) {
 		uprintf("Unable to create file '%s': %s.", filename, WindowsErrorString());
-		return FALSE;
+		goto out;
 	}
 
-	if (!WriteFileWithRetry(hFile, &DiskImage[filestart], (DWORD)filesize, &Size, WRITE_RETRIES)) {
+	if (!WriteFileWithRetry(hFile, filedata, (DWORD)filesize, &Size, WRITE_RETRIES)) {
 		uprintf("Could not write file '%s': %s.", filename, WindowsErrorString());
-		safe_closehandle(hFile);
-		return FALSE;
+		goto out;
 	}
 
 	/* Restore timestamps from FAT */
@@ -278,10 +290,13 @@ static BOOL ExtractFAT(int entry, const char* path)
 		uprintf("Could not set timestamps: %s\n", WindowsErrorString());
 	}
 
-	safe_closehandle(hFile);
 	uprintf("Successfully wrote '%s' (%d bytes)", filename, filesize);
+	r = TRUE;
 
-	return TRUE;
+out:
+	safe_closehandle(hFile);
+	safe_free(patched);
+	return r;
 }
 
 /* Extract the MS-DOS files contained in the FAT12 1.4MB floppy
@@ -311,7 +326,8 @@ static BOOL ExtractMSDOS(const char* path)
 	}
 
 	DiskImageSize = 0;
-	DiskImage = (BYTE*)GetResource(hDLL, MAKEINTRESOURCEA(1), "BINFILE", "disk image", &DiskImageSize, TRUE);
+	// No need to duplicate the resource, as we only read from it
+	DiskImage = (const BYTE*)GetResource(hDLL, MAKEINTRESOURCEA(1), "BINFILE", "disk image", &DiskImageSize, FALSE);
 	if (DiskImage == NULL)
 		goto out;
 
@@ -336,7 +352,7 @@ static BOOL ExtractMSDOS(const char* path)
 		r = SetDOSLocale(path, FALSE);
 
 out:
-	safe_free(DiskImage);
+	DiskImage = NULL;
 	return r;
 }
 
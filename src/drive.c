@@ -41,6 +41,7 @@
 
 #include "file.h"
 #include "drive.h"
+#include "winio.h"
 #include "mbr_types.h"
 #include "gpt_types.h"
 #include "br.h"
@@ -72,8 +73,8 @@ PF_TYPE_DECL(NTAPI, NTSTATUS, NtQueryVolumeInformationFile, (HANDLE, PIO_STATUS_
  * Globals
  */
 RUFUS_DRIVE_INFO SelectedDrive;
-extern BOOL write_as_esp;
-extern int nWindowsVersion, nWindowsBuildNumber;
+extern BOOL write_as_esp, fast_repartition;
+extern int nWindowsVersion, nWindowsBuildNumber, health_min_speed, health_max_latency;
 uint64_t partition_offset[PI_MAX];
 uint64_t persistence_size = 0;
 
@@ -132,13 +133,18 @@ BOOL GetAutoMount(BOOL* enabled)
 /*
  * Open a drive or volume with optional write and lock access
  * Return INVALID_HANDLE_VALUE (/!\ which is DIFFERENT from NULL /!\) on failure.
+ *
+ * When the drive is busy, the delay between retries starts at DRIVE_ACCESS_MIN_DELAY and
+ * doubles up to DRIVE_ACCESS_MAX_DELAY, since Explorer or an AV that happens to be looking at
+ * a freshly created volume usually lets go of it within a few ms. If a search for conflicting
+ * processes comes up empty, the holder is gone, so we retry right away.
  */
 static HANDLE GetHandle(char* Path, BOOL bLockDrive, BOOL bWriteAccess, BOOL bWriteShare)
 {
 	int i;
 	BYTE access_mask = 0;
-	DWORD size;
-	uint64_t EndTime;
+	DWORD size, delay = DRIVE_ACCESS_MIN_DELAY;
+	uint64_t StartTime = 0, EndTime;
 	HANDLE hDrive = INVALID_HANDLE_VALUE;
 	char DevPath[MAX_PATH];
 
@@ -151,7 +157,9 @@ static HANDLE GetHandle(char* Path, BOOL bLockDrive, BOOL bWriteAccess, BOOL bWr
 	else if (QueryDosDeviceA(&Path[4], DevPath, sizeof(DevPath)) == 0)
 		strcpy(DevPath, "???");
 
-	for (i = 0; i < DRIVE_ACCESS_RETRIES; i++) {
+	StartTime = GetTickCount64();
+	EndTime = StartTime + DRIVE_ACCESS_TIMEOUT;
+	for (i = 0; ; i++) {
 		// Try without FILE_SHARE_WRITE (unless specifically requested) so that
 		// we won't be bothered by the OS or other apps when we set up our data.
 		// However this means we might have to wait for an access gap...
@@ -167,15 +175,23 @@ static HANDLE GetHandle(char* Path, BOOL bLockDrive, BOOL bWriteAccess, BOOL bWr
 		if (i == 0) {
 			uprintf("Notice: Volume Device Path is %s", DevPath);
 			uprintf("Waiting for access on %s...", Path);
-		} else if (!bWriteShare && (i > DRIVE_ACCESS_RETRIES/3)) {
+		} else if (!bWriteShare && (GetTickCount64() > StartTime + DRIVE_ACCESS_TIMEOUT / 3)) {
 			// If we can't seem to get a hold of the drive for some time, try to enable FILE_SHARE_WRITE...
 			uprintf("Warning: Could not obtain exclusive rights. Retrying with write sharing enabled...");
 			bWriteShare = TRUE;
 			// Try to report the process that is locking the drive
 			// We also use bit 6 as a flag to indicate that SearchProcess was called.
 			access_mask = SearchProcess(DevPath, SEARCH_PROCESS_TIMEOUT, TRUE, TRUE, FALSE) | 0x40;
+			// No process holds the drive anymore => retry immediately
+			if ((access_mask & 0x80) == 0) {
+				delay = DRIVE_ACCESS_MIN_DELAY;
+				continue;
+			}
 		}
-		Sleep(DRIVE_ACCESS_TIMEOUT / DRIVE_ACCESS_RETRIES);
+		if ((GetTickCount64() >= EndTime) || IS_ERROR(FormatStatus))
+			break;
+		Sleep(delay);
+		delay = min(2 * delay, DRIVE_ACCESS_MAX_DELAY);
 	}
 	if (hDrive == INVALID_HANDLE_VALUE) {
 		uprintf("Could not open %s: %s", Path, WindowsErrorString());
@@ -192,12 +208,14 @@ static HANDLE GetHandle(char* Path, BOOL bLockDrive, BOOL bWriteAccess, BOOL bWr
 		}
 
 		EndTime = GetTickCount64() + DRIVE_ACCESS_TIMEOUT;
+		delay = DRIVE_ACCESS_MIN_DELAY;
 		do {
 			if (DeviceIoControl(hDrive, FSCTL_LOCK_VOLUME, NULL, 0, NULL, 0, &size, NULL))
 				goto out;
 			if (IS_ERROR(FormatStatus))	// User cancel
 				break;
-			Sleep(DRIVE_ACCESS_TIMEOUT / DRIVE_ACCESS_RETRIES);
+			Sleep(delay);
+			delay = min(2 * delay, DRIVE_ACCESS_MAX_DELAY);
 		} while (GetTickCount64() < EndTime);
 		// If we reached this section, either we didn't manage to get a lock or the user cancelled
 		uprintf("Could not lock access to %s: %s", Path, WindowsErrorString());
@@ -210,6 +228,12 @@ static HANDLE GetHandle(char* Path, BOOL bLockDrive, BOOL bWriteAccess, BOOL bWr
 	}
 
 out:
+	// Report how long we had to wait, so that contention issues can be diagnosed
+	if ((StartTime != 0) && EtwEnabled(ETW_LEVEL_INFO, ETW_KEYWORD_LOCK))
+		EtwLockWait(Path, GetTickCount64() - StartTime, hDrive != INVALID_HANDLE_VALUE);
+	if ((hDrive != INVALID_HANDLE_VALUE) && (StartTime != 0) &&
+		(GetTickCount64() - StartTime >= DRIVE_ACCESS_MIN_DELAY))
+		uprintf("Waited %" PRIu64 " ms to access %s", GetTickCount64() - StartTime, Path);
 	return hDrive;
 }
 
@@ -242,40 +266,99 @@ HANDLE GetPhysicalHandle(DWORD DriveIndex, BOOL bLockDrive, BOOL bWriteAccess, B
 }
 
 /*
- * Return the GUID volume name for the disk and partition specified, or NULL if not found.
- * See http://msdn.microsoft.com/en-us/library/cc542456.aspx
- * If PartitionOffset is 0, the offset is ignored and the first partition found is returned.
- * The returned string is allocated and must be freed.
+ * Snapshot of the GUID volumes that reside on a single extent of a removable or fixed disk.
+ * Opening every volume of the system is slow, so GetLogicalName() only rebuilds this list
+ * when the mount manager reports a change, which is what the arrival or removal of a
+ * volume always results in. A snapshot that had failures is never reused.
  */
-char* GetLogicalName(DWORD DriveIndex, uint64_t PartitionOffset, BOOL bKeepTrailingBackslash, BOOL bSilent)
+typedef struct {
+	char name[MAX_PATH];
+	DWORD disk_number;
+	uint64_t offset;
+} volume_entry;
+
+static struct {
+	SRWLOCK lock;
+	BOOL valid;
+	ULONG epic;
+	uint32_t nb_entries;
+	uint32_t max_entries;
+	volume_entry* entry;
+} volume_cache = { SRWLOCK_INIT, FALSE, 0, 0, 0, NULL };
+
+/*
+ * Get the current epic number from the mount manager, without waiting for it to change.
+ */
+static BOOL GetMountMgrEpicNumber(ULONG* epic)
+{
+	BOOL r = FALSE;
+	DWORD size;
+	HANDLE hMountMgr;
+	OVERLAPPED overlapped = { 0 };
+	MOUNTMGR_CHANGE_NOTIFY_INFO notify = { 0 };
+
+	hMountMgr = CreateFileA(MOUNTMGR_DOS_DEVICE_NAME, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+	if (hMountMgr == INVALID_HANDLE_VALUE)
+		return FALSE;
+	overlapped.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+	if (overlapped.hEvent == NULL)
+		goto out;
+
+	// An epic number of zero is never current, so the request should complete straight away
+	if (DeviceIoControl(hMountMgr, IOCTL_MOUNTMGR_CHANGE_NOTIFY, &notify, sizeof(notify),
+		&notify, sizeof(notify), &size, &overlapped)) {
+		r = TRUE;
+	} else if (GetLastError() == ERROR_IO_PENDING) {
+		if (WaitForSingleObject(overlapped.hEvent, 0) != WAIT_OBJECT_0)
+			CancelIo(hMountMgr);
+		r = GetOverlappedResult(hMountMgr, &overlapped, &size, TRUE);
+	}
+	if (r)
+		*epic = notify.EpicNumber;
+
+out:
+	safe_closehandle(overlapped.hEvent);
+	safe_closehandle(hMountMgr);
+	return r;
+}
+
+/*
+ * Enumerate the GUID volumes into the cache. Must be called with the cache lock held.
+ * Returns FALSE if the volumes could not be enumerated at all.
+ */
+static BOOL RefreshVolumeCache(BOOL bSilent)
 {
 	static const char* ignore_device[] = { "\\Device\\CdRom", "\\Device\\Floppy" };
 	static const char* volume_start = "\\\\?\\";
-	char *ret = NULL, volume_name[MAX_PATH], path[MAX_PATH];
-	BOOL bPrintHeader = TRUE;
-	HANDLE hDrive = INVALID_HANDLE_VALUE, hVolume = INVALID_HANDLE_VALUE;
+	char volume_name[MAX_PATH], path[MAX_PATH];
+	BOOL bComplete = TRUE;
+	HANDLE hDrive, hVolume;
 	VOLUME_DISK_EXTENTS_REDEF DiskExtents;
+	volume_entry* new_entry;
 	DWORD size;
 	UINT drive_type;
-	StrArray found_name;
-	uint64_t found_offset[MAX_PARTITIONS] = { 0 };
+	ULONG epic;
 	uint32_t i, j;
 	size_t len;
 
-	StrArrayCreate(&found_name, MAX_PARTITIONS);
-	CheckDriveIndex(DriveIndex);
+	volume_cache.valid = FALSE;
+	volume_cache.nb_entries = 0;
+	if (!GetMountMgrEpicNumber(&epic))
+		bComplete = FALSE;
 
-	for (i = 0; hDrive == INVALID_HANDLE_VALUE; i++) {
+	for (i = 0; ; i++) {
 		if (i == 0) {
 			hVolume = FindFirstVolumeA(volume_name, sizeof(volume_name));
 			if (hVolume == INVALID_HANDLE_VALUE) {
 				suprintf("Could not access first GUID volume: %s", WindowsErrorString());
-				goto out;
+				return FALSE;
 			}
 		} else {
 			if (!FindNextVolumeA(hVolume, volume_name, sizeof(volume_name))) {
 				if (GetLastError() != ERROR_NO_MORE_FILES) {
 					suprintf("Could not access next GUID volume: %s", WindowsErrorString());
+					bComplete = FALSE;
 				}
 				break;
 			}
@@ -295,6 +378,7 @@ char* GetLogicalName(DWORD DriveIndex, uint64_t PartitionOffset, BOOL bKeepTrail
 
 		if (QueryDosDeviceA(&volume_name[4], path, sizeof(path)) == 0) {
 			suprintf("Failed to get device path for GUID volume '%s': %s", volume_name, WindowsErrorString());
+			bComplete = FALSE;
 			continue;
 		}
 
@@ -309,6 +393,7 @@ char* GetLogicalName(DWORD DriveIndex, uint64_t PartitionOffset, BOOL bKeepTrail
 			NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
 		if (hDrive == INVALID_HANDLE_VALUE) {
 			suprintf("Could not open GUID volume '%s': %s", volume_name, WindowsErrorString());
+			bComplete = FALSE;
 			continue;
 		}
 
@@ -316,6 +401,7 @@ char* GetLogicalName(DWORD DriveIndex, uint64_t PartitionOffset, BOOL bKeepTrail
 			&DiskExtents, sizeof(DiskExtents), &size, NULL)) || (size <= 0)) {
 			suprintf("Could not get Disk Extents: %s", WindowsErrorString());
 			safe_closehandle(hDrive);
+			bComplete = FALSE;
 			continue;
 		}
 		safe_closehandle(hDrive);
@@ -329,27 +415,77 @@ char* GetLogicalName(DWORD DriveIndex, uint64_t PartitionOffset, BOOL bKeepTrail
 			suprintf("Ignoring volume '%s' because it has more than one extent (RAID?)...", volume_name);
 			continue;
 		}
-		if (DiskExtents.Extents[0].DiskNumber != DriveIndex)
+
+		if (volume_cache.nb_entries >= volume_cache.max_entries) {
+			new_entry = realloc(volume_cache.entry, (volume_cache.max_entries + 16) * sizeof(volume_entry));
+			if (new_entry == NULL) {
+				bComplete = FALSE;
+				break;
+			}
+			volume_cache.entry = new_entry;
+			volume_cache.max_entries += 16;
+		}
+		static_strcpy(volume_cache.entry[volume_cache.nb_entries].name, volume_name);
+		volume_cache.entry[volume_cache.nb_entries].disk_number = DiskExtents.Extents[0].DiskNumber;
+		volume_cache.entry[volume_cache.nb_entries].offset = DiskExtents.Extents[0].StartingOffset.QuadPart;
+		volume_cache.nb_entries++;
+	}
+	FindVolumeClose(hVolume);
+
+	volume_cache.epic = epic;
+	volume_cache.valid = bComplete;
+	return TRUE;
+}
+
+/*
+ * Return the GUID volume name for the disk and partition specified, or NULL if not found.
+ * See http://msdn.microsoft.com/en-us/library/cc542456.aspx
+ * If PartitionOffset is 0, the offset is ignored and the first partition found is returned.
+ * The returned string is allocated and must be freed.
+ */
+char* GetLogicalName(DWORD DriveIndex, uint64_t PartitionOffset, BOOL bKeepTrailingBackslash, BOOL bSilent)
+{
+	char *ret = NULL, volume_name[MAX_PATH];
+	BOOL bPrintHeader = TRUE;
+	StrArray found_name;
+	uint64_t found_offset[MAX_PARTITIONS] = { 0 };
+	ULONG epic;
+	uint32_t i;
+
+	StrArrayCreate(&found_name, MAX_PARTITIONS);
+	CheckDriveIndex(DriveIndex);
+
+	AcquireSRWLockExclusive(&volume_cache.lock);
+	if ((!volume_cache.valid || !GetMountMgrEpicNumber(&epic) || (epic != volume_cache.epic)) &&
+		!RefreshVolumeCache(bSilent)) {
+		ReleaseSRWLockExclusive(&volume_cache.lock);
+		goto out;
+	}
+	for (i = 0; i < volume_cache.nb_entries; i++) {
+		if (volume_cache.entry[i].disk_number != DriveIndex)
 			// Not on our disk
 			continue;
 
 		if (found_name.Index == MAX_PARTITIONS) {
 			uprintf("Error: Trying to process a disk with more than %d partitions!", MAX_PARTITIONS);
+			ReleaseSRWLockExclusive(&volume_cache.lock);
 			goto out;
 		}
 
+		static_strcpy(volume_name, volume_cache.entry[i].name);
 		if (bKeepTrailingBackslash)
-			volume_name[len - 1] = '\\';
-		found_offset[found_name.Index] = DiskExtents.Extents[0].StartingOffset.QuadPart;
+			static_strcat(volume_name, "\\");
+		found_offset[found_name.Index] = volume_cache.entry[i].offset;
 		StrArrayAdd(&found_name, volume_name, TRUE);
 		if (!bSilent) {
 			if (bPrintHeader) {
 				bPrintHeader = FALSE;
 				uuprintf("Windows volumes from this device:");
 			}
-			uuprintf("● %s @%lld", volume_name, DiskExtents.Extents[0].StartingOffset.QuadPart);
+			uuprintf("● %s @%lld", volume_name, volume_cache.entry[i].offset);
 		}
 	}
+	ReleaseSRWLockExclusive(&volume_cache.lock);
 
 	if (found_name.Index == 0)
 		goto out;
@@ -367,8 +503,6 @@ char* GetLogicalName(DWORD DriveIndex, uint64_t PartitionOffset, BOOL bKeepTrail
 	}
 
 out:
-	if (hVolume != INVALID_HANDLE_VALUE)
-		FindVolumeClose(hVolume);
 	StrArrayDestroy(&found_name);
 	return ret;
 }
@@ -484,18 +618,69 @@ out:
 }
 
 /*
- * Call on VDS to refresh the drive layout
+ * Loading the VDS service takes from a few hundred ms to several seconds, and an operation
+ * may call on VDS several times, so, between BeginVdsSession() and EndVdsSession(), we keep
+ * the service, as well as the disk interfaces we looked up, rather than reload everything
+ * on each call. Since these are apartment threaded COM objects, they are only handed out to
+ * the thread that started the session, and any other thread loads its own.
  */
-BOOL RefreshLayout(DWORD DriveIndex)
+static struct {
+	DWORD thread_id;
+	IVdsService* pService;
+	IVdsDisk* pDisk[DRIVE_INDEX_MAX - DRIVE_INDEX_MIN + 1];
+} vds_session = { 0 };
+
+#define IsVdsSessionThread() ((vds_session.thread_id != 0) && (vds_session.thread_id == GetCurrentThreadId()))
+
+void BeginVdsSession(void)
 {
-	HRESULT hr = S_FALSE;
-	wchar_t wPhysicalName[24];
-	IVdsServiceLoader* pLoader = NULL;
-	IVdsService* pService = NULL;
-	IEnumVdsObject *pEnum;
+	if (vds_session.thread_id != 0)
+		return;
+	// Keep COM initialized for the lifetime of our objects, whatever our callers do
+	IGNORE_RETVAL(CoInitializeEx(NULL, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE));
+	vds_session.thread_id = GetCurrentThreadId();
+}
 
-	CheckDriveIndex(DriveIndex);
-	wnsprintf(wPhysicalName, ARRAYSIZE(wPhysicalName), L"\\\\?\\PhysicalDrive%lu", DriveIndex);
+// Drop the disk interfaces, which layout changes and rescans may make stale
+static void FlushVdsDisks(void)
+{
+	int i;
+
+	if (!IsVdsSessionThread())
+		return;
+	for (i = 0; i < ARRAYSIZE(vds_session.pDisk); i++) {
+		if (vds_session.pDisk[i] != NULL)
+			IVdsDisk_Release(vds_session.pDisk[i]);
+		vds_session.pDisk[i] = NULL;
+	}
+}
+
+void EndVdsSession(void)
+{
+	if (!IsVdsSessionThread())
+		return;
+	FlushVdsDisks();
+	if (vds_session.pService != NULL)
+		IVdsService_Release(vds_session.pService);
+	vds_session.pService = NULL;
+	vds_session.thread_id = 0;
+	CoUninitialize();
+}
+
+/*
+ * Get a ready VDS service, which must be released with IVdsService_Release().
+ */
+HRESULT GetVdsService(IVdsService** ppService, BOOL bSilent)
+{
+	HRESULT hr;
+	IVdsServiceLoader* pLoader;
+
+	*ppService = NULL;
+	if (IsVdsSessionThread() && (vds_session.pService != NULL)) {
+		IVdsService_AddRef(vds_session.pService);
+		*ppService = vds_session.pService;
+		return S_OK;
+	}
 
 	// Initialize COM
 	IGNORE_RETVAL(CoInitializeEx(NULL, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE));
@@ -504,32 +689,61 @@ BOOL RefreshLayout(DWORD DriveIndex)
 
 	// Create a VDS Loader Instance
 	hr = CoCreateInstance(&CLSID_VdsLoader, NULL, CLSCTX_LOCAL_SERVER | CLSCTX_REMOTE_SERVER,
-		&IID_IVdsServiceLoader, (void **)&pLoader);
+		&IID_IVdsServiceLoader, (void**)&pLoader);
 	if (hr != S_OK) {
-		uprintf("Could not create VDS Loader Instance: %s", VdsErrorString(hr));
-		goto out;
+		suprintf("Could not create VDS Loader Instance: %s", VdsErrorString(hr));
+		return hr;
 	}
 
 	// Load the VDS Service
-	hr = IVdsServiceLoader_LoadService(pLoader, L"", &pService);
+	hr = IVdsServiceLoader_LoadService(pLoader, L"", ppService);
+	IVdsServiceLoader_Release(pLoader);
 	if (hr != S_OK) {
-		uprintf("Could not load VDS Service: %s", VdsErrorString(hr));
-		goto out;
+		suprintf("Could not load VDS Service: %s", VdsErrorString(hr));
+		*ppService = NULL;
+		return hr;
 	}
 
 	// Wait for the Service to become ready if needed
-	hr = IVdsService_WaitForServiceReady(pService);
+	hr = IVdsService_WaitForServiceReady(*ppService);
 	if (hr != S_OK) {
-		uprintf("VDS Service is not ready: %s", VdsErrorString(hr));
-		goto out;
+		suprintf("VDS Service is not ready: %s", VdsErrorString(hr));
+		IVdsService_Release(*ppService);
+		*ppService = NULL;
+		return hr;
 	}
 
+	if (IsVdsSessionThread()) {
+		IVdsService_AddRef(*ppService);
+		vds_session.pService = *ppService;
+	}
+	return S_OK;
+}
+
+/*
+ * Call on VDS to refresh the drive layout
+ */
+BOOL RefreshLayout(DWORD DriveIndex)
+{
+	HRESULT hr = S_FALSE;
+	IVdsService* pService = NULL;
+	IEnumVdsObject *pEnum;
+
+	CheckDriveIndex(DriveIndex);
+
+	hr = GetVdsService(&pService, FALSE);
+	if (hr != S_OK)
+		goto out;
+	// The layout we refresh may no longer match our disk interfaces
+	FlushVdsDisks();
+
 	// Query the VDS Service Providers
 	hr = IVdsService_QueryProviders(pService, VDS_QUERY_SOFTWARE_PROVIDERS, &pEnum);
 	if (hr != S_OK) {
 		uprintf("Could not query VDS Service Providers: %s", VdsErrorString(hr));
 		goto out;
 	}
+	IEnumVdsObject_Release(pEnum);
 
 	// Remove mountpoints
 	hr = IVdsService_CleanupObsoleteMountPoints(pService);
@@ -555,8 +769,6 @@ BOOL RefreshLayout(DWORD DriveIndex)
 out:
 	if (pService != NULL)
 		IVdsService_Release(pService);
-	if (pLoader != NULL)
-		IVdsServiceLoader_Release(pLoader);
 	VDS_SET_ERROR(hr);
 	return (hr == S_OK);
 }
@@ -571,7 +783,6 @@ static BOOL GetVdsDiskInterface(DWORD DriveIndex, const IID* InterfaceIID, void*
 	HRESULT hr = S_FALSE;
 	ULONG ulFetched;
 	wchar_t wPhysicalName[24];
-	IVdsServiceLoader* pLoader;
 	IVdsService* pService;
 	IEnumVdsObject* pEnum;
 	IUnknown* pUnk;
@@ -580,33 +791,18 @@ static BOOL GetVdsDiskInterface(DWORD DriveIndex, const IID* InterfaceIID, void*
 	CheckDriveIndex(DriveIndex);
 	wnsprintf(wPhysicalName, ARRAYSIZE(wPhysicalName), L"\\\\?\\PhysicalDrive%lu", DriveIndex);
 
-	// Initialize COM
-	IGNORE_RETVAL(CoInitializeEx(NULL, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE));
-	IGNORE_RETVAL(CoInitializeSecurity(NULL, -1, NULL, NULL, RPC_C_AUTHN_LEVEL_CONNECT,
-		RPC_C_IMP_LEVEL_IMPERSONATE, NULL, 0, NULL));
-
-	// Create a VDS Loader Instance
-	hr = CoCreateInstance(&CLSID_VdsLoader, NULL, CLSCTX_LOCAL_SERVER | CLSCTX_REMOTE_SERVER,
-		&IID_IVdsServiceLoader, (void**)&pLoader);
-	if (hr != S_OK) {
-		suprintf("Could not create VDS Loader Instance: %s", VdsErrorString(hr));
-		goto out;
-	}
-
-	// Load the VDS Service
-	hr = IVdsServiceLoader_LoadService(pLoader, L"", &pService);
-	IVdsServiceLoader_Release(pLoader);
-	if (hr != S_OK) {
-		suprintf("Could not load VDS Service: %s", VdsErrorString(hr));
-		goto out;
+	// Use the disk we looked up earlier in the session, if any
+	if (IsVdsSessionThread() && (vds_session.pDisk[DriveIndex] != NULL)) {
+		hr = IVdsDisk_QueryInterface(vds_session.pDisk[DriveIndex], InterfaceIID, pInterfaceInstance);
+		if (hr == S_OK)
+			goto out;
+		IVdsDisk_Release(vds_session.pDisk[DriveIndex]);
+		vds_session.pDisk[DriveIndex] = NULL;
 	}
 
-	// Wait for the Service to become ready if needed
-	hr = IVdsService_WaitForServiceReady(pService);
-	if (hr != S_OK) {
-		suprintf("VDS Service is not ready: %s", VdsErrorString(hr));
+	hr = GetVdsService(&pService, bSilent);
+	if (hr != S_OK)
 		goto out;
-	}
 
 	// Query the VDS Service Providers
 	hr = IVdsService_QueryProviders(pService, VDS_QUERY_SOFTWARE_PROVIDERS, &pEnum);
@@ -699,7 +895,10 @@ static BOOL GetVdsDiskInterface(DWORD DriveIndex, const IID* InterfaceIID, void*
 
 				// Instantiate the requested VDS disk interface
 				hr = IVdsDisk_QueryInterface(pDisk, InterfaceIID, pInterfaceInstance);
-				IVdsDisk_Release(pDisk);
+				if ((hr == S_OK) && IsVdsSessionThread())
+					vds_session.pDisk[DriveIndex] = pDisk;
+				else
+					IVdsDisk_Release(pDisk);
 				if (hr != S_OK)
 					suprintf("Could not access the requested Disk interface: %s", VdsErrorString(hr));
 
@@ -726,32 +925,11 @@ BOOL VdsRescan(DWORD dwRescanType, DWORD dwSleepTime, BOOL bSilent)
 {
 	BOOL ret = TRUE;
 	HRESULT hr = S_FALSE;
-	IVdsServiceLoader* pLoader;
 	IVdsService* pService;
 
-	IGNORE_RETVAL(CoInitializeEx(NULL, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE));
-	IGNORE_RETVAL(CoInitializeSecurity(NULL, -1, NULL, NULL, RPC_C_AUTHN_LEVEL_CONNECT,
-		RPC_C_IMP_LEVEL_IMPERSONATE, NULL, 0, NULL));
-
-	hr = CoCreateInstance(&CLSID_VdsLoader, NULL, CLSCTX_LOCAL_SERVER | CLSCTX_REMOTE_SERVER,
-		&IID_IVdsServiceLoader, (void**)&pLoader);
-	if (hr != S_OK) {
-		suprintf("Could not create VDS Loader Instance: %s", VdsErrorString(hr));
-		return FALSE;
-	}
-
-	hr = IVdsServiceLoader_LoadService(pLoader, L"", &pService);
-	IVdsServiceLoader_Release(pLoader);
-	if (hr != S_OK) {
-		suprintf("Could not load VDS Service: %s", VdsErrorString(hr));
-		return FALSE;
-	}
-
-	hr = IVdsService_WaitForServiceReady(pService);
-	if (hr != S_OK) {
-		suprintf("VDS Service is not ready: %s", VdsErrorString(hr));
+	if (GetVdsService(&pService, bSilent) != S_OK)
 		return FALSE;
-	}
+	FlushVdsDisks();
 
 	// https://docs.microsoft.com/en-us/windows/win32/api/vds/nf-vds-ivdsservice-refresh
 	// This method synchronizes the disk layout to the layout known to the disk driver.
@@ -776,6 +954,7 @@ BOOL VdsRescan(DWORD dwRescanType, DWORD dwSleepTime, BOOL bSilent)
 		}
 	}
 
+	IVdsService_Release(pService);
 	if (dwSleepTime != 0)
 		Sleep(dwSleepTime);
 
@@ -840,38 +1019,13 @@ BOOL ListVdsVolumes(BOOL bSilent)
 {
 	HRESULT hr = S_FALSE;
 	ULONG ulFetched;
-	IVdsServiceLoader* pLoader;
 	IVdsService* pService;
 	IEnumVdsObject* pEnum;
 	IUnknown* pUnk;
 
-	// Initialize COM
-	IGNORE_RETVAL(CoInitializeEx(NULL, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE));
-	IGNORE_RETVAL(CoInitializeSecurity(NULL, -1, NULL, NULL, RPC_C_AUTHN_LEVEL_CONNECT,
-		RPC_C_IMP_LEVEL_IMPERSONATE, NULL, 0, NULL));
-
-	// Create a VDS Loader Instance
-	hr = CoCreateInstance(&CLSID_VdsLoader, NULL, CLSCTX_LOCAL_SERVER | CLSCTX_REMOTE_SERVER,
-		&IID_IVdsServiceLoader, (void**)&pLoader);
-	if (hr != S_OK) {
-		suprintf("Could not create VDS Loader Instance: %s", VdsErrorString(hr));
-		goto out;
-	}
-
-	// Load the VDS Service
-	hr = IVdsServiceLoader_LoadService(pLoader, L"", &pService);
-	IVdsServiceLoader_Release(pLoader);
-	if (hr != S_OK) {
-		suprintf("Could not load VDS Service: %s", VdsErrorString(hr));
+	hr = GetVdsService(&pService, bSilent);
+	if (hr != S_OK)
 		goto out;
-	}
-
-	// Wait for the Service to become ready if needed
-	hr = IVdsService_WaitForServiceReady(pService);
-	if (hr != S_OK) {
-		suprintf("VDS Service is not ready: %s", VdsErrorString(hr));
-		goto out;
-	}
 
 	// Query the VDS Service Providers
 	hr = IVdsService_QueryProviders(pService, VDS_QUERY_SOFTWARE_PROVIDERS, &pEnum);
@@ -989,29 +1143,76 @@ out:
 	return (hr == S_OK);
 }
 
-/* Wait for a logical drive to reappear - Used when a drive has just been repartitioned */
+/*
+ * Wait for a logical drive to reappear - Used when a drive has just been repartitioned
+ * Rather than polling GetLogicalName(), which may be slow, we have the mount manager
+ * notify us of changes to its mount points (which is what the arrival of a volume
+ * results in) and only look for the volume then, with a slower poll as fallback.
+ */
 BOOL WaitForLogical(DWORD DriveIndex, uint64_t PartitionOffset)
 {
-	uint64_t EndTime;
+	BOOL r = FALSE, pending = FALSE;
+	int i;
+	DWORD size;
+	uint64_t EndTime, CurTime;
 	char* LogicalPath = NULL;
+	HANDLE hMountMgr;
+	OVERLAPPED overlapped = { 0 };
+	MOUNTMGR_CHANGE_NOTIFY_INFO notify = { 0 };
+
+	hMountMgr = CreateFileA(MOUNTMGR_DOS_DEVICE_NAME, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+	overlapped.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+	if (overlapped.hEvent == NULL)
+		safe_closehandle(hMountMgr);
 
-	// GetLogicalName() calls may be slow, so use the system time to
-	// make sure we don't spend more than DRIVE_ACCESS_TIMEOUT in wait.
+	// Use the system time to make sure we don't spend more than DRIVE_ACCESS_TIMEOUT in wait.
 	EndTime = GetTickCount64() + DRIVE_ACCESS_TIMEOUT;
 	do {
+		// Arm the notification before we look for the volume, so that we can't miss its arrival.
+		// The first request returns the current epic number straight away, so we may need two.
+		for (i = 0; (i < 2) && !pending && (hMountMgr != INVALID_HANDLE_VALUE); i++) {
+			ResetEvent(overlapped.hEvent);
+			if (DeviceIoControl(hMountMgr, IOCTL_MOUNTMGR_CHANGE_NOTIFY, &notify, sizeof(notify),
+				&notify, sizeof(notify), &size, &overlapped))
+				continue;
+			if (GetLastError() == ERROR_IO_PENDING)
+				pending = TRUE;
+			else
+				safe_closehandle(hMountMgr);
+		}
 		LogicalPath = GetLogicalName(DriveIndex, PartitionOffset, FALSE, TRUE);
 		// Need to filter out GlobalRoot devices as we don't want to wait on those
 		if ((LogicalPath != NULL) && (strncmp(LogicalPath, groot_name, groot_len) != 0)) {
 			free(LogicalPath);
-			return TRUE;
+			r = TRUE;
+			goto out;
 		}
 		free(LogicalPath);
 		if (IS_ERROR(FormatStatus))	// User cancel
-			return FALSE;
-		Sleep(DRIVE_ACCESS_TIMEOUT / DRIVE_ACCESS_RETRIES);
+			goto out;
+		CurTime = GetTickCount64();
+		if (CurTime >= EndTime)
+			break;
+		if (!pending) {
+			CancellableSleep(DRIVE_ACCESS_TIMEOUT / DRIVE_ACCESS_RETRIES);
+		} else if (WaitForSingleObject(overlapped.hEvent,
+			(DWORD)min(EndTime - CurTime, DRIVE_ACCESS_MAX_DELAY)) == WAIT_OBJECT_0) {
+			pending = FALSE;
+			if (!GetOverlappedResult(hMountMgr, &overlapped, &size, FALSE))
+				safe_closehandle(hMountMgr);
+		}
 	} while (GetTickCount64() < EndTime);
 	uprintf("Timeout while waiting for logical drive");
-	return FALSE;
+
+out:
+	if (pending) {
+		CancelIo(hMountMgr);
+		GetOverlappedResult(hMountMgr, &overlapped, &size, TRUE);
+	}
+	safe_closehandle(hMountMgr);
+	safe_closehandle(overlapped.hEvent);
+	return r;
 }
 
 /*
@@ -1288,17 +1489,21 @@ BOOL IsDriveLetterInUse(const char drive_letter)
 /*
  * Return the drive letter and volume label
  * If the drive doesn't have a volume assigned, space is returned for the letter
+ * The label buffer must be at least MAX_PATH + 1 chars. As this is called from
+ * the device probing threads, no static buffer must be used here.
  */
-BOOL GetDriveLabel(DWORD DriveIndex, char* letters, char** label)
+BOOL GetDriveLabel(DWORD DriveIndex, char* letters, char* label)
 {
+	// GetExtFsLabel() returns a static buffer, so we must serialize our callers
+	static SRWLOCK ext_label_lock = SRWLOCK_INIT;
 	HANDLE hPhysical;
 	DWORD size, error;
-	static char VolumeLabel[MAX_PATH + 1] = { 0 };
+	const char* ext_label;
 	char DrivePath[] = "#:\\", AutorunPath[] = "#:\\autorun.inf", *AutorunLabel = NULL;
 	WCHAR VolumeName[MAX_PATH + 1] = { 0 }, FileSystemName[64];
 	DWORD VolumeSerialNumber, MaximumComponentLength, FileSystemFlags;
 
-	*label = STR_NO_LABEL;
+	strcpy(label, STR_NO_LABEL);
 
 	if (!GetDriveLetters(DriveIndex, letters))
 		return FALSE;
@@ -1307,8 +1512,9 @@ BOOL GetDriveLabel(DWORD DriveIndex, char* letters, char** label)
 		HANDLE h = GetLogicalHandle(DriveIndex, 0, FALSE, FALSE, FALSE);
 		if (GetVolumeInformationByHandleW(h, VolumeName, 64, &VolumeSerialNumber,
 			&MaximumComponentLength, &FileSystemFlags, FileSystemName, 64)) {
-			wchar_to_utf8_no_alloc(VolumeName, VolumeLabel, sizeof(VolumeLabel));
-			*label = (VolumeLabel[0] != 0) ? VolumeLabel : STR_NO_LABEL;
+			wchar_to_utf8_no_alloc(VolumeName, label, MAX_PATH + 1);
+			if (label[0] == 0)
+				strcpy(label, STR_NO_LABEL);
 		}
 		safe_closehandle(h);
 		// Drive without volume assigned - always enabled
@@ -1330,21 +1536,22 @@ BOOL GetDriveLabel(DWORD DriveIndex, char* letters, char** label)
 	safe_closehandle(hPhysical);
 	if (AutorunLabel != NULL) {
 		uprintf("Using autorun.inf label for drive %c: '%s'", letters[0], AutorunLabel);
-		static_strcpy(VolumeLabel, AutorunLabel);
+		safe_strcpy(label, MAX_PATH + 1, AutorunLabel);
 		safe_free(AutorunLabel);
-		*label = VolumeLabel;
-	} else if (GetVolumeInformationU(DrivePath, VolumeLabel, ARRAYSIZE(VolumeLabel),
-		NULL, NULL, NULL, NULL, 0) && (VolumeLabel[0] != 0)) {
-		*label = VolumeLabel;
-	} else {
+	} else if (!GetVolumeInformationU(DrivePath, label, MAX_PATH + 1, NULL, NULL, NULL, NULL, 0) ||
+		(label[0] == 0)) {
 		// Might be an extfs label
 		error = GetLastError();
-		*label = (char*)GetExtFsLabel(DriveIndex, 0);
-		if (*label == NULL) {
+		AcquireSRWLockExclusive(&ext_label_lock);
+		ext_label = GetExtFsLabel(DriveIndex, 0);
+		if (ext_label != NULL)
+			safe_strcpy(label, MAX_PATH + 1, ext_label);
+		ReleaseSRWLockExclusive(&ext_label_lock);
+		if (ext_label == NULL) {
 			SetLastError(error);
 			if (error != ERROR_UNRECOGNIZED_VOLUME)
 				duprintf("Failed to read label: %s", WindowsErrorString());
-			*label = STR_NO_LABEL;
+			strcpy(label, STR_NO_LABEL);
 		}
 	}
 	return TRUE;
@@ -1411,10 +1618,13 @@ BOOL AnalyzeMBR(HANDLE hPhysicalDrive, const char* TargetName, BOOL bSilent)
 {
 	FAKE_FD fake_fd = { 0 };
 	FILE* fp = (FILE*)&fake_fd;
+	uint8_t br[BR_CACHE_LEN];
 	int i;
 
 	fake_fd._handle = (char*)hPhysicalDrive;
 	set_bytes_per_sector(SelectedDrive.SectorSize);
+	// Read the boot record once, rather than once for every signature we test
+	IGNORE_RETVAL(cache_data(fp, br, sizeof(br)));
 
 	if (!is_br(fp)) {
 		suprintf("%s does not have a Boot Marker", TargetName);
@@ -1447,10 +1657,13 @@ BOOL AnalyzePBR(HANDLE hLogicalVolume)
 	const char* pbr_name = "Partition Boot Record";
 	FAKE_FD fake_fd = { 0 };
 	FILE* fp = (FILE*)&fake_fd;
+	uint8_t br[BR_CACHE_LEN];
 	int i;
 
 	fake_fd._handle = (char*)hLogicalVolume;
 	set_bytes_per_sector(SelectedDrive.SectorSize);
+	// Read the boot record once, rather than once for every signature we test
+	IGNORE_RETVAL(cache_data(fp, br, sizeof(br)));
 
 	if (!is_br(fp)) {
 		uprintf("Volume does not have an x86 %s", pbr_name);
@@ -1622,6 +1835,110 @@ out:
 	return ret;
 }
 
+/*
+ * Populate the physical sector size, the I/O alignment, the maximum transfer size and, if
+ * the device reports it, the erase block size of the selected drive. Many 512e drives, as
+ * well as some USB SSDs that report 512 byte sectors, have to read-modify-write internally
+ * unless writes are aligned to 4 KB.
+ * For flash media, the only generic source for the erase block (or SD allocation unit) size
+ * is the optimal unmap granularity, which the devices that expose it usually set to that.
+ */
+static void GetDriveAlignment(HANDLE hPhysical, DWORD DriveIndex, BOOL bSilent)
+{
+	DWORD size;
+	STORAGE_PROPERTY_QUERY query = { 0 };
+	ACCESS_ALIGNMENT_DESCRIPTOR alignment = { 0 };
+	STORAGE_ADAPTER_DESCRIPTOR adapter = { 0 };
+	LB_PROVISIONING_DESCRIPTOR provisioning = { 0 };
+	uint64_t granularity;
+
+	SelectedDrive.PhysicalSectorSize = SelectedDrive.SectorSize;
+	SelectedDrive.IoAlignment = SelectedDrive.SectorSize;
+	SelectedDrive.MaxTransferSize = 0;
+	SelectedDrive.EraseBlockSize = 0;
+
+	query.PropertyId = (STORAGE_PROPERTY_ID)STORAGE_ACCESS_ALIGNMENT_PROPERTY;
+	query.QueryType = PropertyStandardQuery;
+	if (DeviceIoControl(hPhysical, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+		&alignment, sizeof(alignment), &size, NULL) && (size >= sizeof(alignment)) &&
+		(alignment.BytesPerPhysicalSector > SelectedDrive.SectorSize)) {
+		SelectedDrive.PhysicalSectorSize = alignment.BytesPerPhysicalSector;
+		// Only use the physical sector size if we can actually align to it
+		if ((alignment.BytesOffsetForSectorAlignment == 0) &&
+			(alignment.BytesPerPhysicalSector <= MAX_IO_ALIGNMENT) &&
+			(alignment.BytesPerPhysicalSector % SelectedDrive.SectorSize == 0))
+			SelectedDrive.IoAlignment = alignment.BytesPerPhysicalSector;
+		else
+			suprintf("Warning: Drive 0x%02x physical sectors can not be aligned to (offset: %d)",
+				DriveIndex, alignment.BytesOffsetForSectorAlignment);
+	}
+
+	query.PropertyId = StorageAdapterProperty;
+	if (DeviceIoControl(hPhysical, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+		&adapter, sizeof(adapter), &size, NULL) && (size >= offsetof(STORAGE_ADAPTER_DESCRIPTOR, MaximumPhysicalPages)))
+		SelectedDrive.MaxTransferSize = adapter.MaximumTransferLength;
+
+	query.PropertyId = (STORAGE_PROPERTY_ID)STORAGE_LB_PROVISIONING_PROPERTY;
+	if (DeviceIoControl(hPhysical, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+		&provisioning, sizeof(provisioning), &size, NULL) && (size >= sizeof(provisioning)) &&
+		(provisioning.UnmapGranularityAlignmentValid) && (provisioning.UnmapGranularityAlignment == 0)) {
+		granularity = provisioning.OptimalUnmapGranularity;
+		// Depending on the driver, this may be expressed in bytes or in logical sectors
+		if (granularity < MIN_ERASE_BLOCK_SIZE)
+			granularity *= SelectedDrive.SectorSize;
+		if ((granularity >= MIN_ERASE_BLOCK_SIZE) && (granularity <= MAX_ERASE_BLOCK_SIZE) &&
+			((granularity & (granularity - 1)) == 0))
+			SelectedDrive.EraseBlockSize = (DWORD)granularity;
+	}
+
+	if (SelectedDrive.PhysicalSectorSize != SelectedDrive.SectorSize)
+		suprintf("Physical sector size: %d bytes, I/O alignment: %d bytes",
+			SelectedDrive.PhysicalSectorSize, SelectedDrive.IoAlignment);
+	if (SelectedDrive.MaxTransferSize != 0)
+		suprintf("Maximum transfer size: %s", SizeToHumanReadable(SelectedDrive.MaxTransferSize, FALSE, FALSE));
+	if (SelectedDrive.EraseBlockSize != 0)
+		suprintf("Erase block size: %s", SizeToHumanReadable(SelectedDrive.EraseBlockSize, FALSE, FALSE));
+}
+
+/*
+ * Check whether a drive has any partition, including the ones we don't care about destroying.
+ * Returns TRUE if we can't tell.
+ */
+BOOL HasPartitions(DWORD DriveIndex)
+{
+	BOOL r;
+	HANDLE hPhysical;
+	DWORD size, i;
+	BYTE layout[4096] = {0};
+	PDRIVE_LAYOUT_INFORMATION_EX DriveLayout = (PDRIVE_LAYOUT_INFORMATION_EX)(void*)layout;
+
+	hPhysical = GetPhysicalHandle(DriveIndex, FALSE, FALSE, TRUE);
+	if (hPhysical == INVALID_HANDLE_VALUE)
+		return TRUE;
+	r = DeviceIoControl(hPhysical, IOCTL_DISK_GET_DRIVE_LAYOUT_EX, NULL, 0, layout, sizeof(layout), &size, NULL);
+	CloseHandle(hPhysical);
+	if (!r || size <= 0)
+		return TRUE;
+	switch (DriveLayout->PartitionStyle) {
+	case PARTITION_STYLE_MBR:
+		for (i = 0; i < DriveLayout->PartitionCount; i++) {
+			if (DriveLayout->PartitionEntry[i].Mbr.PartitionType == PARTITION_ENTRY_UNUSED)
+				continue;
+			// See GetDrivePartitionData() for the "Small FAT16" that Windows reports for zeroed drives
+			if ((i == 0) && (DriveLayout->PartitionEntry[0].Mbr.PartitionType == 0x04) &&
+				(DriveLayout->PartitionEntry[0].StartingOffset.QuadPart == 0LL) &&
+				(DriveLayout->PartitionEntry[0].PartitionLength.QuadPart > 16 * MB))
+				continue;
+			return TRUE;
+		}
+		return FALSE;
+	case PARTITION_STYLE_GPT:
+		return (DriveLayout->PartitionCount != 0);
+	default:
+		return FALSE;
+	}
+}
+
 /*
  * Fill the drive properties (size, FS, etc)
  * Returns TRUE if the drive has a partition that can be mounted in Windows, FALSE otherwise
@@ -1678,6 +1995,7 @@ BOOL GetDrivePartitionData(DWORD DriveIndex, char* FileSystemName, DWORD FileSys
 		SizeToHumanReadable(SelectedDrive.DiskSize, FALSE, TRUE), SelectedDrive.SectorSize);
 	suprintf("Cylinders: %" PRIi64 ", Tracks per cylinder: %d, Sectors per track: %d",
 		DiskGeometry->Geometry.Cylinders, DiskGeometry->Geometry.TracksPerCylinder, DiskGeometry->Geometry.SectorsPerTrack);
+	GetDriveAlignment(hPhysical, DriveIndex, bSilent);
 
 	r = DeviceIoControl(hPhysical, IOCTL_DISK_GET_DRIVE_LAYOUT_EX,
 			NULL, 0, layout, sizeof(layout), &size, NULL );
@@ -1828,6 +2146,127 @@ out:
 	return r;
 }
 
+/*
+ * Removable drives are set for "quick removal" by default, which disables their write cache,
+ * so that every write, including the ones for the FS metadata of each file we extract, has to
+ * complete on the media. Since we flush everything before we report that an operation has
+ * completed, we can enable the cache while we write, and restore the original policy after
+ * a final flush of the device. The change is not made persistent (ParametersSavable is
+ * cleared), so that the drive reverts to its own policy on power cycle if we can't restore it.
+ */
+static struct {
+	BOOL active;
+	DWORD DriveIndex;
+	DISK_CACHE_INFORMATION original;
+} write_cache_override = { 0 };
+
+BOOL EnableDriveWriteCache(DWORD DriveIndex)
+{
+	BOOL r = FALSE;
+	DWORD size;
+	DISK_CACHE_INFORMATION dci;
+	HANDLE hPhysical;
+
+	if (write_cache_override.active)
+		return FALSE;
+	hPhysical = GetPhysicalHandle(DriveIndex, FALSE, TRUE, TRUE);
+	if (hPhysical == INVALID_HANDLE_VALUE)
+		return FALSE;
+	if (!DeviceIoControl(hPhysical, IOCTL_DISK_GET_CACHE_INFORMATION, NULL, 0, &dci, sizeof(dci), &size, NULL)) {
+		uprintf("Could not query the drive write cache: %s", WindowsErrorString());
+		goto out;
+	}
+	if (dci.WriteCacheEnabled) {
+		uprintf("Drive write cache is already enabled");
+		goto out;
+	}
+	write_cache_override.original = dci;
+	dci.WriteCacheEnabled = TRUE;
+	dci.ParametersSavable = FALSE;
+	if (!DeviceIoControl(hPhysical, IOCTL_DISK_SET_CACHE_INFORMATION, &dci, sizeof(dci), NULL, 0, &size, NULL)) {
+		uprintf("Could not enable the drive write cache: %s", WindowsErrorString());
+		goto out;
+	}
+	write_cache_override.original.ParametersSavable = FALSE;
+	write_cache_override.DriveIndex = DriveIndex;
+	write_cache_override.active = TRUE;
+	uprintf("Enabled the drive write cache for the duration of the operation");
+	r = TRUE;
+
+out:
+	safe_closehandle(hPhysical);
+	return r;
+}
+
+/*
+ * Flush the drive and restore its original write cache policy, if EnableDriveWriteCache()
+ * changed it. This must be called, once we are done writing, on error as well as on success.
+ * Returns FALSE if the flush failed.
+ */
+BOOL RestoreDriveWriteCache(void)
+{
+	BOOL r;
+	DWORD size;
+	HANDLE hPhysical;
+
+	if (!write_cache_override.active)
+		return TRUE;
+	write_cache_override.active = FALSE;
+	hPhysical = GetPhysicalHandle(write_cache_override.DriveIndex, FALSE, TRUE, TRUE);
+	if (hPhysical == INVALID_HANDLE_VALUE) {
+		uprintf("Could not flush the drive or restore its write cache policy");
+		return FALSE;
+	}
+	// This is the barrier for all the data that was written with the cache enabled
+	r = FlushFileBuffers(hPhysical);
+	if (!r)
+		uprintf("Could not flush the drive: %s", WindowsErrorString());
+	// Not being able to restore the policy is not an error, since it's not persistent
+	if (!DeviceIoControl(hPhysical, IOCTL_DISK_SET_CACHE_INFORMATION, &write_cache_override.original,
+		sizeof(write_cache_override.original), NULL, 0, &size, NULL))
+		uprintf("Could not restore the drive write cache policy: %s", WindowsErrorString());
+	safe_closehandle(hPhysical);
+	return r;
+}
+
+/*
+ * Enable or disable the generation of 8.3 short names on an NTFS volume. By default, NTFS
+ * creates a short name for each file, which requires checking the directory for collisions
+ * and gets slower as directories fill, which is what large Windows images are made of. The
+ * flag persists on the volume, so the caller should restore the previous state, as returned
+ * in pbWasEnabled, once it is done. Note that this is ignored, without error, if the
+ * administrator has enabled short names system-wide (NtfsDisable8dot3NameCreation = 0).
+ */
+BOOL SetShortNameCreation(DWORD DriveIndex, uint64_t PartitionOffset, BOOL bEnable, BOOL* pbWasEnabled)
+{
+	BOOL r;
+	DWORD size;
+	FILE_FS_PERSISTENT_VOLUME_INFORMATION_REDEF pvi = { 0 };
+	HANDLE hLogical = GetLogicalHandle(DriveIndex, PartitionOffset, FALSE, TRUE, TRUE);
+
+	if ((hLogical == INVALID_HANDLE_VALUE) || (hLogical == NULL))
+		return FALSE;
+	if (pbWasEnabled != NULL) {
+		pvi.Version = 1;
+		if (!DeviceIoControl(hLogical, FSCTL_QUERY_PERSISTENT_VOLUME_STATE, &pvi, sizeof(pvi),
+			&pvi, sizeof(pvi), &size, NULL)) {
+			uprintf("Could not query short name creation: %s", WindowsErrorString());
+			CloseHandle(hLogical);
+			return FALSE;
+		}
+		*pbWasEnabled = !(pvi.VolumeFlags & PERSISTENT_VOLUME_STATE_SHORT_NAME_CREATION_DISABLED);
+		memset(&pvi, 0, sizeof(pvi));
+	}
+	pvi.VolumeFlags = bEnable ? 0 : PERSISTENT_VOLUME_STATE_SHORT_NAME_CREATION_DISABLED;
+	pvi.FlagMask = PERSISTENT_VOLUME_STATE_SHORT_NAME_CREATION_DISABLED;
+	pvi.Version = 1;
+	r = DeviceIoControl(hLogical, FSCTL_SET_PERSISTENT_VOLUME_STATE, &pvi, sizeof(pvi), NULL, 0, &size, NULL);
+	if (!r)
+		uprintf("Could not %s short name creation: %s", bEnable ? "enable" : "disable", WindowsErrorString());
+	CloseHandle(hLogical);
+	return r;
+}
+
 /*
  * Unmount of volume using the DISMOUNT_VOLUME ioctl
  */
@@ -2011,12 +2450,7 @@ static BOOL ClearPartition(HANDLE hDrive, LARGE_INTEGER offset, DWORD size)
 	if (buffer == NULL)
 		return FALSE;
 
-	if (!SetFilePointerEx(hDrive, offset, NULL, FILE_BEGIN)) {
-		free(buffer);
-		return FALSE;
-	}
-
-	r = WriteFileWithRetry(hDrive, buffer, size, &size, WRITE_RETRIES);
+	r = BlockIo(hDrive, TRUE, buffer, size, offset.QuadPart, WRITE_RETRIES, NULL, NULL);
 	free(buffer);
 	return r;
 }
@@ -2040,7 +2474,7 @@ BOOL CreatePartition(HANDLE hDrive, int partition_style, int file_system, BOOL m
 	CREATE_DISK CreateDisk = {PARTITION_STYLE_RAW, {{0}}};
 	DRIVE_LAYOUT_INFORMATION_EX4 DriveLayoutEx = {0};
 	BOOL r;
-	DWORD i, size, bufsize, pn = 0;
+	DWORD i, size, bufsize, align_sectors, pn = 0;
 	LONGLONG main_part_size_in_sectors, extra_part_size_in_tracks = 0;
 	// Go for a 260 MB sized ESP by default to keep everyone happy, including 4K sector users:
 	// https://docs.microsoft.com/en-us/windows-hardware/manufacture/desktop/configure-uefigpt-based-hard-drive-partitions
@@ -2064,8 +2498,9 @@ BOOL CreatePartition(HANDLE hDrive, int partition_style, int file_system, BOOL m
 
 	// Compute the start offset of our first partition
 	if ((partition_style == PARTITION_STYLE_GPT) || (!IsChecked(IDC_OLD_BIOS_FIXES))) {
-		// Go with the MS 1 MB wastage at the beginning...
-		DriveLayoutEx.PartitionEntry[pn].StartingOffset.QuadPart = MB;
+		// Go with the MS 1 MB wastage at the beginning, or the erase block size if larger,
+		// so that the file system clusters don't straddle erase blocks.
+		DriveLayoutEx.PartitionEntry[pn].StartingOffset.QuadPart = GetPartitionAlignment();
 	} else {
 		// Some folks appear to think that 'Fixes for old BIOSes' is some kind of magic
 		// wand and are adamant to try to apply them when creating *MODERN* VHD drives.
@@ -2166,6 +2601,13 @@ BOOL CreatePartition(HANDLE hDrive, int partition_style, int file_system, BOOL m
 		// this extra partition is indexed on main size, it does not overflow into the backup GPT.
 		main_part_size_in_sectors = ((main_part_size_in_sectors / SelectedDrive.SectorsPerTrack) -
 			extra_part_size_in_tracks) * SelectedDrive.SectorsPerTrack;
+		// Unless we were asked to stick to tracks, also make sure that the extra partition,
+		// which follows, is aligned like the first one.
+		if ((partition_style == PARTITION_STYLE_GPT) || (!IsChecked(IDC_OLD_BIOS_FIXES))) {
+			align_sectors = max(GetPartitionAlignment() / SelectedDrive.SectorSize, 1);
+			main_part_size_in_sectors -= (DriveLayoutEx.PartitionEntry[pn].StartingOffset.QuadPart /
+				SelectedDrive.SectorSize + main_part_size_in_sectors) % align_sectors;
+		}
 	}
 	if (main_part_size_in_sectors <= 0) {
 		uprintf("Error: Invalid %S size", main_part_name);
@@ -2325,8 +2767,9 @@ BOOL CreatePartition(HANDLE hDrive, int partition_style, int file_system, BOOL m
 		return FALSE;
 	}
 
-	// "The goggles, they do nothing!"
-	RefreshDriveLayout(hDrive);
+	// "The goggles, they do nothing!", so the fast path only refreshes the drive layout once we're done
+	if (!fast_repartition)
+		RefreshDriveLayout(hDrive);
 
 	size = sizeof(DriveLayoutEx) - ((partition_style == PARTITION_STYLE_GPT)?((4-pn)*sizeof(PARTITION_INFORMATION_EX)):0);
 	r = DeviceIoControl(hDrive, IOCTL_DISK_SET_DRIVE_LAYOUT_EX, (BYTE*)&DriveLayoutEx, size, NULL, 0, &size, NULL);
@@ -2397,3 +2840,467 @@ const char* GetGPTPartitionType(const GUID* guid)
 	for (i = 0; (i < ARRAYSIZE(gpt_type)) && !CompareGUID(guid, gpt_type[i].guid); i++);
 	return (i < ARRAYSIZE(gpt_type)) ? gpt_type[i].name : GuidToString(guid);
 }
+
+/*
+ * I/O heatmap
+ */
+IO_HEATMAP* CreateIoHeatmap(uint64_t disk_size)
+{
+	IO_HEATMAP* heatmap;
+
+	if (disk_size == 0)
+		return NULL;
+	heatmap = calloc(1, sizeof(IO_HEATMAP));
+	if (heatmap == NULL)
+		return NULL;
+	heatmap->disk_size = disk_size;
+	heatmap->zone_size = (disk_size + IO_HEATMAP_ZONES - 1) / IO_HEATMAP_ZONES;
+	return heatmap;
+}
+
+// Speed, in MB/s
+static __inline double IoSpeed(uint64_t bytes, uint64_t busy_us)
+{
+	return ((double)bytes / (double)MB) * 1000000.0 / (double)max(busy_us, 1);
+}
+
+// Upper bound of the latency bucket that contains the requested percentile of requests
+static uint32_t IoLatencyPercentile(uint32_t* latency, uint64_t requests, int percentile)
+{
+	int b;
+	uint64_t n = 0, target = (requests * percentile + 99) / 100;
+
+	for (b = 0; b < IO_HEATMAP_BUCKETS - 1; b++) {
+		n += latency[b];
+		if (n >= target)
+			break;
+	}
+	return 1U << b;
+}
+
+/*
+ * Drive health: the writes are grouped in windows of IO_HEALTH_WINDOW_US and, past the grace
+ * period, a drive gets flagged once it spends IO_HEALTH_SUSTAIN windows in a row with either
+ * a smoothed write speed below health_min_speed (in MB/s), or with the 99th percentile of its
+ * write latency (rounded down to a power of 2) at or above health_max_latency (in ms). The
+ * speed only counts the time the drive had requests to process, so that a slow source can't
+ * get a drive flagged, and the isolated stalls of a drive that reclaims blocks don't last
+ * long enough to trip either limit.
+ */
+static void UpdateIoHealth(IO_HEALTH* health, DWORD dwSize, uint32_t bucket, uint64_t busy_us)
+{
+	uint64_t now = GetIoTimestamp();
+	uint32_t p99;
+	double speed;
+
+	if (health->failed || ((health_min_speed <= 0) && (health_max_latency <= 0)))
+		return;
+	if (health->start_us == 0) {
+		health->start_us = now;
+		health->window_start_us = now;
+	}
+	health->window_bytes += dwSize;
+	health->window_busy_us += busy_us;
+	health->window_requests++;
+	health->window_latency[bucket]++;
+	if (now - health->window_start_us < IO_HEALTH_WINDOW_US)
+		return;
+
+	speed = IoSpeed(health->window_bytes, health->window_busy_us);
+	// Blend in the previous windows, so that we follow the trend rather than the last window
+	health->speed = (health->speed == 0.0) ? speed : (health->speed + speed) / 2.0;
+	p99 = IoLatencyPercentile(health->window_latency, health->window_requests, 99) / 2;
+	if (now - health->start_us >= IO_HEALTH_GRACE_US) {
+		health->nb_slow = ((health_min_speed > 0) && (health->speed < health_min_speed)) ? health->nb_slow + 1 : 0;
+		health->nb_stalled = ((health_max_latency > 0) && (p99 >= (uint32_t)health_max_latency)) ? health->nb_stalled + 1 : 0;
+		if (health->nb_slow >= IO_HEALTH_SUSTAIN) {
+			uprintf("\r\nDrive health: Write speed has stayed below %d MB/s (%0.1f MB/s) for %d seconds",
+				health_min_speed, health->speed, (int)(IO_HEALTH_SUSTAIN * IO_HEALTH_WINDOW_US / 1000000));
+			health->failed = TRUE;
+		} else if (health->nb_stalled >= IO_HEALTH_SUSTAIN) {
+			uprintf("\r\nDrive health: 99%% of writes have been taking %d ms or more for %d seconds",
+				p99, (int)(IO_HEALTH_SUSTAIN * IO_HEALTH_WINDOW_US / 1000000));
+			health->failed = TRUE;
+		}
+	}
+	health->window_start_us = now;
+	health->window_bytes = 0;
+	health->window_busy_us = 0;
+	health->window_requests = 0;
+	memset(health->window_latency, 0, sizeof(health->window_latency));
+}
+
+/*
+ * Returns TRUE if the drive that a heatmap belongs to was flagged by the health monitor,
+ * in which case it should be dropped, as if it had failed a write.
+ */
+BOOL IsDriveUnhealthy(IO_HEATMAP* heatmap)
+{
+	return (heatmap != NULL) && heatmap->health.failed;
+}
+
+// This has the prototype of an async queue monitor, so that it can be set as one.
+void UpdateIoHeatmap(LPVOID lpContext, BOOL bWrite, ULONG64 u64Offset, DWORD dwSize, ULONG64 u64LatencyUs, ULONG64 u64BusyUs)
+{
+	IO_HEATMAP* heatmap = (IO_HEATMAP*)lpContext;
+	IO_ZONE_STATS* zone;
+	uint32_t ms, bucket;
+
+	if (dwSize == 0)
+		return;
+	// The timeline gets all the requests, including the ones from queues without a heatmap
+	TraceIo(bWrite, u64Offset, dwSize, u64LatencyUs);
+	if (heatmap == NULL)
+		return;
+	zone = &heatmap->zone[bWrite ? 1 : 0][min(u64Offset / heatmap->zone_size, IO_HEATMAP_ZONES - 1)];
+	ms = (uint32_t)min(u64LatencyUs / 1000, UINT32_MAX);
+	for (bucket = 0; (bucket < IO_HEATMAP_BUCKETS - 1) && ((ms >> bucket) != 0); bucket++);
+	zone->bytes += dwSize;
+	zone->busy_us += u64BusyUs;
+	zone->requests++;
+	zone->latency[bucket]++;
+	zone->max_latency_ms = max(zone->max_latency_ms, ms);
+	if (bWrite)
+		UpdateIoHealth(&heatmap->health, dwSize, bucket, u64BusyUs);
+}
+
+/*
+ * Look for the zone where the speed falls off a cliff, such as when the SLC cache of a
+ * flash drive is exhausted. This is the first zone that is less than a third of the peak
+ * speed of the zones before it, with the rest of the drive averaging less than half of
+ * that peak (so that we don't report a single slow zone). Returns -1 if there is none.
+ */
+static int FindIoSpeedCliff(IO_HEATMAP* heatmap, int op, double* peak, double* tail)
+{
+	int z;
+	uint64_t tail_bytes[IO_HEATMAP_ZONES + 1] = { 0 }, tail_us[IO_HEATMAP_ZONES + 1] = { 0 };
+	double tail_speed;
+	IO_ZONE_STATS* zone = heatmap->zone[op];
+
+	for (z = IO_HEATMAP_ZONES - 1; z >= 0; z--) {
+		tail_bytes[z] = tail_bytes[z + 1] + zone[z].bytes;
+		tail_us[z] = tail_us[z + 1] + zone[z].busy_us;
+	}
+	*peak = 0.0;
+	for (z = 0; z < IO_HEATMAP_ZONES; z++) {
+		if (zone[z].requests == 0)
+			continue;
+		if ((*peak > 0.0) && (IoSpeed(zone[z].bytes, zone[z].busy_us) < *peak / 3.0)) {
+			tail_speed = IoSpeed(tail_bytes[z], tail_us[z]);
+			if (tail_speed < *peak / 2.0) {
+				*tail = tail_speed;
+				return z;
+			}
+		}
+		*peak = max(*peak, IoSpeed(zone[z].bytes, zone[z].busy_us));
+	}
+	return -1;
+}
+
+/*
+ * Print a summary of the heatmap to the log
+ */
+void PrintIoHeatmap(IO_HEATMAP* heatmap, const char* prefix)
+{
+	const char* op_name[2] = { "Read", "Write" };
+	int op, z, b, slowest, cliff;
+	uint32_t max_latency_ms, latency[IO_HEATMAP_BUCKETS];
+	uint64_t bytes, busy_us, requests;
+	double speed, min_speed = 0.0, peak, tail;
+
+	if (heatmap == NULL)
+		return;
+	for (op = 0; op < 2; op++) {
+		bytes = busy_us = requests = 0;
+		max_latency_ms = 0;
+		memset(latency, 0, sizeof(latency));
+		slowest = -1;
+		for (z = 0; z < IO_HEATMAP_ZONES; z++) {
+			IO_ZONE_STATS* zone = &heatmap->zone[op][z];
+			if (zone->requests == 0)
+				continue;
+			bytes += zone->bytes;
+			busy_us += zone->busy_us;
+			requests += zone->requests;
+			max_latency_ms = max(max_latency_ms, zone->max_latency_ms);
+			for (b = 0; b < IO_HEATMAP_BUCKETS; b++)
+				latency[b] += zone->latency[b];
+			speed = IoSpeed(zone->bytes, zone->busy_us);
+			if ((slowest < 0) || (speed < min_speed)) {
+				slowest = z;
+				min_speed = speed;
+			}
+		}
+		if (requests == 0)
+			continue;
+		uprintf("%s%s: %s in %lld requests, at %0.1f MB/s", prefix, op_name[op],
+			SizeToHumanReadable(bytes, FALSE, FALSE), requests, IoSpeed(bytes, busy_us));
+		uprintf("%s%s latency: 50%% < %d ms, 99%% < %d ms, max = %d ms", prefix, op_name[op],
+			IoLatencyPercentile(latency, requests, 50), IoLatencyPercentile(latency, requests, 99), max_latency_ms);
+		uprintf("%s%s: Slowest zone is at %s (%0.1f MB/s)", prefix, op_name[op],
+			SizeToHumanReadable(slowest * heatmap->zone_size, FALSE, FALSE), min_speed);
+		tail = IoSpeed(bytes, busy_us);
+		cliff = FindIoSpeedCliff(heatmap, op, &peak, &tail);
+		if (cliff >= 0)
+			uprintf("%s%s speed drops from %0.1f MB/s to %0.1f MB/s after %s", prefix, op_name[op],
+				peak, tail, SizeToHumanReadable(cliff * heatmap->zone_size, FALSE, FALSE));
+		if (tail < (double)IO_HEATMAP_SLOW_SPEED / (double)MB)
+			uprintf("%sWARNING: The sustained %s speed of this drive is only %0.1f MB/s", prefix,
+				(op == 0) ? "read" : "write", tail);
+	}
+}
+
+/*
+ * Export the heatmap, both as CSV and JSON, to '<path>.csv' and '<path>.json'
+ */
+BOOL ExportIoHeatmap(IO_HEATMAP* heatmap, const char* path)
+{
+	const char* op_name[2] = { "read", "write" };
+	char filename[MAX_PATH];
+	int op, z, b;
+	FILE* fd;
+	IO_ZONE_STATS* zone;
+
+	if (heatmap == NULL)
+		return FALSE;
+
+	static_sprintf(filename, "%s.csv", path);
+	fd = fopenU(filename, "w");
+	if (fd == NULL) {
+		uprintf("Could not create '%s'", filename);
+		return FALSE;
+	}
+	fprintf(fd, "operation,zone,offset,size,requests,bytes,busy_us,speed_mbps,max_latency_ms");
+	for (b = 0; b < IO_HEATMAP_BUCKETS - 1; b++)
+		fprintf(fd, ",latency_lt_%dms", 1 << b);
+	fprintf(fd, ",latency_ge_%dms\n", 1 << (IO_HEATMAP_BUCKETS - 2));
+	for (op = 0; op < 2; op++) {
+		for (z = 0; z < IO_HEATMAP_ZONES; z++) {
+			zone = &heatmap->zone[op][z];
+			fprintf(fd, "%s,%d,%llu,%llu,%u,%llu,%llu,%0.2f,%u", op_name[op], z, z * heatmap->zone_size,
+				heatmap->zone_size, zone->requests, zone->bytes, zone->busy_us,
+				(zone->requests == 0) ? 0.0 : IoSpeed(zone->bytes, zone->busy_us), zone->max_latency_ms);
+			for (b = 0; b < IO_HEATMAP_BUCKETS; b++)
+				fprintf(fd, ",%u", zone->latency[b]);
+			fprintf(fd, "\n");
+		}
+	}
+	fclose(fd);
+
+	static_sprintf(filename, "%s.json", path);
+	fd = fopenU(filename, "w");
+	if (fd == NULL) {
+		uprintf("Could not create '%s'", filename);
+		return FALSE;
+	}
+	fprintf(fd, "{\n  \"disk_size\": %llu,\n  \"zone_size\": %llu,\n  \"latency_buckets_ms\": [",
+		heatmap->disk_size, heatmap->zone_size);
+	for (b = 0; b < IO_HEATMAP_BUCKETS; b++)
+		fprintf(fd, "%s%d", (b == 0) ? "" : ", ", 1 << b);
+	fprintf(fd, "],\n");
+	for (op = 0; op < 2; op++) {
+		fprintf(fd, "  \"%s\": [\n", op_name[op]);
+		for (z = 0; z < IO_HEATMAP_ZONES; z++) {
+			zone = &heatmap->zone[op][z];
+			fprintf(fd, "    { \"offset\": %llu, \"requests\": %u, \"bytes\": %llu, \"busy_us\": %llu, "
+				"\"max_latency_ms\": %u, \"latency\": [", z * heatmap->zone_size, zone->requests,
+				zone->bytes, zone->busy_us, zone->max_latency_ms);
+			for (b = 0; b < IO_HEATMAP_BUCKETS; b++)
+				fprintf(fd, "%s%u", (b == 0) ? "" : ", ", zone->latency[b]);
+			fprintf(fd, "] }%s\n", (z == IO_HEATMAP_ZONES - 1) ? "" : ",");
+		}
+		fprintf(fd, "  ]%s\n", (op == 0) ? "," : "");
+	}
+	fprintf(fd, "}\n");
+	fclose(fd);
+	uprintf("Saved I/O heatmap as '%s.csv' and '%s.json'", path, path);
+	return TRUE;
+}
+
+/*
+ * Returns TRUE if the volume a file resides on incurs a seek penalty, i.e. sits on a rotational
+ * drive. When this can't be determined (network shares, spanned volumes, old drivers) we assume
+ * that it does, as reading several files at once from an HDD is much worse than reading them one
+ * at a time from an SSD.
+ */
+BOOL IncursSeekPenalty(const char* path)
+{
+	BOOL r = TRUE;
+	DWORD size;
+	HANDLE hVolume;
+	char volume_name[] = "\\\\.\\#:";
+	wchar_t volume_path[MAX_PATH];
+	STORAGE_PROPERTY_QUERY query = { 0 };
+	SEEK_PENALTY_DESCRIPTOR desc = { 0 };
+	wconvert(path);
+
+	if ((!GetVolumePathNameW(wpath, volume_path, ARRAYSIZE(volume_path))) || (volume_path[1] != L':'))
+		goto out;
+	volume_name[4] = (char)volume_path[0];
+	hVolume = CreateFileA(volume_name, 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	if (hVolume == INVALID_HANDLE_VALUE)
+		goto out;
+	query.PropertyId = (STORAGE_PROPERTY_ID)STORAGE_SEEK_PENALTY_PROPERTY;
+	query.QueryType = PropertyStandardQuery;
+	if (DeviceIoControl(hVolume, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query), &desc, sizeof(desc), &size, NULL) &&
+		(size >= sizeof(desc)))
+		r = desc.IncursSeekPenalty;
+	CloseHandle(hVolume);
+
+out:
+	wfree(path);
+	return r;
+}
+
+/*
+ * Zero-fill engine
+ */
+// Returns TRUE if the device reports that trimmed blocks read back as zeroes (LBPRZ)
+BOOL TrimReadsZeroes(HANDLE hDrive)
+{
+	DWORD size;
+	STORAGE_PROPERTY_QUERY query = { 0 };
+	LB_PROVISIONING_DESCRIPTOR desc = { 0 };
+
+	query.PropertyId = (STORAGE_PROPERTY_ID)STORAGE_LB_PROVISIONING_PROPERTY;
+	query.QueryType = PropertyStandardQuery;
+	if (!DeviceIoControl(hDrive, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query), &desc, sizeof(desc), &size, NULL))
+		return FALSE;
+	return (size >= offsetof(LB_PROVISIONING_DESCRIPTOR, Reserved1)) &&
+		desc.ThinProvisioningEnabled && desc.ThinProvisioningReadZeros;
+}
+
+// Read back sectors spread across a trimmed range, to make sure the device does return zeroes
+BOOL TrimmedRangeReadsZeroes(HANDLE hDrive, uint64_t Offset, uint64_t Size)
+{
+	BOOL r = FALSE;
+	OVERLAPPED overlapped;
+	DWORD i, j, read, sector_size = max(SelectedDrive.SectorSize, 512);
+	uint64_t nb_sectors = Size / sector_size, offset;
+	uint32_t* buffer;
+
+	if (nb_sectors == 0)
+		return TRUE;
+	buffer = (uint32_t*)_mm_malloc(sector_size, 4 * KB);
+	if (buffer == NULL)
+		return FALSE;
+	for (i = 0; i < TRIM_VERIFY_SAMPLES; i++) {
+		// Always check the first and last sectors, and spread the other samples in between
+		offset = Offset + ((nb_sectors - 1) * i / (TRIM_VERIFY_SAMPLES - 1)) * sector_size;
+		memset(&overlapped, 0, sizeof(overlapped));
+		overlapped.Offset = (DWORD)offset;
+		overlapped.OffsetHigh = (DWORD)(offset >> 32);
+		if (!ReadFile(hDrive, buffer, sector_size, &read, &overlapped) || (read != sector_size))
+			goto out;
+		for (j = 0; (j < sector_size / sizeof(uint32_t)) && (buffer[j] == 0); j++);
+		if (j < sector_size / sizeof(uint32_t)) {
+			uprintf("Trimmed sector at offset 0x%llx does not read back as zeroes", offset);
+			goto out;
+		}
+	}
+	r = TRUE;
+
+out:
+	_mm_free(buffer);
+	return r;
+}
+
+// Retry a failed zero-fill write synchronously, through the original handle
+static BOOL ZeroFillRetry(HANDLE hDrive, uint8_t* buffer, uint64_t offset, DWORD size)
+{
+	uprintf("Zero-fill error at offset 0x%llx: %s", offset, WindowsErrorString());
+	if (IS_ERROR(FormatStatus))
+		return FALSE;
+	return BlockIo(hDrive, TRUE, buffer, size, offset, WRITE_RETRIES - 1, NULL, NULL);
+}
+
+/*
+ * Zero a range of a drive (or image file), with the fastest method available: a TRIM if
+ * allowed and the device guarantees (and delivers) zeroes for trimmed blocks,
+ * FSCTL_SET_ZERO_DATA for files, and otherwise multiple overlapped writes of
+ * ZERO_FILL_CHUNK_SIZE in flight.
+ * Offset and Size must be aligned to the sector size, and hDrive must be a synchronous
+ * handle, as this is what failed writes are retried with.
+ */
+BOOL ZeroDriveRange(HANDLE hDrive, uint64_t Offset, uint64_t Size, DWORD Flags, IO_HEATMAP* heatmap,
+	ZERO_FILL_PROGRESS pfnProgress)
+{
+	BOOL r = FALSE;
+	HANDLE hQueue = NULL;
+	FILE_ZERO_DATA_INFORMATION zero_data;
+	uint8_t* buffer = NULL;
+	uint64_t pos, end = Offset + Size, done = 0, slot_offset[ZERO_FILL_QUEUE_DEPTH];
+	DWORD slot, size, slot_size[ZERO_FILL_QUEUE_DEPTH] = { 0 };
+
+	if (Size == 0)
+		return TRUE;
+
+	// Some devices claim deterministic zeroes after TRIM but don't deliver, so we sample what
+	// the range reads back as, and fall back to writing zeroes if it isn't what we expect.
+	if ((Flags & ZF_ALLOW_TRIM) && TrimReadsZeroes(hDrive) && BlockTrim(hDrive, Offset, Size)) {
+		if (TrimmedRangeReadsZeroes(hDrive, Offset, Size)) {
+			if (pfnProgress != NULL)
+				pfnProgress(Size, Size);
+			return TRUE;
+		}
+		uprintf("Falling back to writing zeroes");
+	}
+	zero_data.FileOffset.QuadPart = Offset;
+	zero_data.BeyondFinalZero.QuadPart = end;
+	if (DeviceIoControl(hDrive, FSCTL_SET_ZERO_DATA, &zero_data, sizeof(zero_data), NULL, 0, &size, NULL)) {
+		if (pfnProgress != NULL)
+			pfnProgress(Size, Size);
+		return TRUE;
+	}
+
+	// The same zeroed buffer can be used by all the requests in flight
+	buffer = (uint8_t*)AllocIoBuffer(ZERO_FILL_CHUNK_SIZE);
+	hQueue = BlockCreateQueue(hDrive, GENERIC_READ | GENERIC_WRITE, ZERO_FILL_QUEUE_DEPTH, heatmap);
+	if ((buffer == NULL) || (hQueue == NULL)) {
+		uprintf("Could not set up zero-fill: %s", WindowsErrorString());
+		goto out;
+	}
+	memset(buffer, 0, ZERO_FILL_CHUNK_SIZE);
+
+	for (pos = Offset, slot = 0; (pos < end) || (done < Size); slot = (slot + 1) % ZERO_FILL_QUEUE_DEPTH) {
+		if (IS_ERROR(FormatStatus))
+			goto out;
+		// Reap the previous request from this slot
+		if (slot_size[slot] != 0) {
+			if (!WaitAsyncQueue(hQueue, slot, DRIVE_ACCESS_TIMEOUT, &size) || (size != slot_size[slot])) {
+				CancelAsyncRequest(hQueue, slot);
+				if (!ZeroFillRetry(hDrive, buffer, slot_offset[slot], slot_size[slot]))
+					goto out;
+			}
+			if (IsDriveUnhealthy(heatmap)) {
+				FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_DEVICE_HARDWARE_ERROR;
+				goto out;
+			}
+			done += slot_size[slot];
+			slot_size[slot] = 0;
+			if (pfnProgress != NULL)
+				pfnProgress(done, Size);
+		}
+		if (pos < end) {
+			size = (DWORD)min(end - pos, ZERO_FILL_CHUNK_SIZE);
+			slot_offset[slot] = pos;
+			slot_size[slot] = size;
+			if (!IssueAsyncQueue(hQueue, slot, TRUE, buffer, size, pos)) {
+				slot_size[slot] = 0;
+				if (!ZeroFillRetry(hDrive, buffer, pos, size))
+					goto out;
+				done += size;
+				if (pfnProgress != NULL)
+					pfnProgress(done, Size);
+			}
+			pos += size;
+		}
+	}
+	r = TRUE;
+
+out:
+	// Must be closed before the buffer gets freed, as it waits for in-flight writes
+	CloseAsyncQueue(hQueue);
+	FreeIoBuffer(buffer);
+	return r;
+}
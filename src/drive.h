@@ -31,6 +31,13 @@
 	CTL_CODE(MOUNTMGRCONTROLTYPE, 15, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define IOCTL_MOUNTMGR_SET_AUTO_MOUNT       \
 	CTL_CODE(MOUNTMGRCONTROLTYPE, 16, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+#ifndef IOCTL_MOUNTMGR_CHANGE_NOTIFY
+#define IOCTL_MOUNTMGR_CHANGE_NOTIFY        \
+	CTL_CODE(MOUNTMGRCONTROLTYPE, 8, METHOD_BUFFERED, FILE_READ_ACCESS)
+typedef struct _MOUNTMGR_CHANGE_NOTIFY_INFO {
+	ULONG EpicNumber;
+} MOUNTMGR_CHANGE_NOTIFY_INFO, *PMOUNTMGR_CHANGE_NOTIFY_INFO;
+#endif
 
 #define XP_MSR                              0x01
 #define XP_ESP                              0x02
@@ -51,6 +58,7 @@
 #define FP_LARGE_FAT32                      0x00010000
 #define FP_NO_BOOT                          0x00020000
 #define FP_CREATE_PERSISTENCE_CONF          0x00040000
+#define FP_BACKGROUND                       0x00080000	// Don't report progress, as another format is running
 
 #define FILE_FLOPPY_DISKETTE                0x00000004
 
@@ -301,6 +309,7 @@ interface IVdsAsync {
 #define IVdsService_CleanupObsoleteMountPoints(This) ((This)->lpVtbl->CleanupObsoleteMountPoints(This))
 #define IVdsService_Refresh(This) ((This)->lpVtbl->Refresh(This))
 #define IVdsService_Reenumerate(This) ((This)->lpVtbl->Reenumerate(This))
+#define IVdsService_AddRef(This) (This)->lpVtbl->AddRef(This)
 #define IVdsService_Release(This) (This)->lpVtbl->Release(This)
 #define IVdsSwProvider_QueryInterface(This, riid, ppvObject) (This)->lpVtbl->QueryInterface(This, riid, ppvObject)
 #define IVdsProvider_Release(This) (This)->lpVtbl->Release(This)
@@ -353,6 +362,10 @@ typedef struct {
 	DWORD DeviceNumber;
 	DWORD SectorsPerTrack;
 	DWORD SectorSize;
+	DWORD PhysicalSectorSize;
+	DWORD IoAlignment;	// Size writes should be aligned to, so that the device doesn't have to read-modify-write
+	DWORD MaxTransferSize;
+	DWORD EraseBlockSize;	// 0 if unknown
 	DWORD FirstDataSector;
 	MEDIA_TYPE MediaType;
 	int PartitionStyle;
@@ -369,8 +382,183 @@ typedef struct {
 	} ClusterSize[FS_MAX];
 } RUFUS_DRIVE_INFO;
 extern RUFUS_DRIVE_INFO SelectedDrive;
+static __inline DWORD GetIoAlignment(void) {
+	return max(SelectedDrive.IoAlignment, SelectedDrive.SectorSize);
+}
+// Alignment for the partitions and the file system data areas (at least 1 MB, as per Windows)
+static __inline DWORD GetPartitionAlignment(void) {
+	return max(max(SelectedDrive.EraseBlockSize, GetIoAlignment()), 1024 * 1024);
+}
 extern uint64_t partition_offset[PI_MAX];
 
+/*
+ * I/O heatmap: latency and throughput statistics of the read and write requests
+ * issued to a drive, for each of a fixed number of LBA zones. This is used to spot
+ * worn regions, SLC cache exhaustion points or thermal throttling.
+ */
+#define IO_HEATMAP_ZONES                    128
+#define IO_HEATMAP_BUCKETS                  16		// < 1 ms, then [2^(n-1), 2^n) ms
+#define IO_HEATMAP_SLOW_SPEED               (5 * MB)
+
+typedef struct {
+	uint64_t bytes;
+	uint64_t busy_us;
+	uint32_t requests;
+	uint32_t max_latency_ms;
+	uint32_t latency[IO_HEATMAP_BUCKETS];
+} IO_ZONE_STATS;
+
+/*
+ * Drive health monitor: failing and counterfeit drives tend to see their write speed collapse,
+ * or their write latency explode, well before they report an error, so the writes that go to
+ * a heatmap are also checked against the limits the user set (none by default).
+ */
+#define IO_HEALTH_WINDOW_US                 (2 * 1000000ULL)
+#define IO_HEALTH_GRACE_US                  (10 * 1000000ULL)	// Leave time for the device caches to fill
+#define IO_HEALTH_SUSTAIN                   3		// Consecutive windows over a limit, for a drive to be flagged
+#ifndef ERROR_DEVICE_HARDWARE_ERROR
+#define ERROR_DEVICE_HARDWARE_ERROR         483		// What we report for a drive that got flagged
+#endif
+
+typedef struct {
+	uint64_t start_us;
+	uint64_t window_start_us;
+	uint64_t window_bytes;
+	uint64_t window_busy_us;
+	uint32_t window_requests;
+	uint32_t window_latency[IO_HEATMAP_BUCKETS];
+	double speed;				// Smoothed write speed, in MB/s
+	int nb_slow;
+	int nb_stalled;
+	BOOL failed;
+} IO_HEALTH;
+
+typedef struct {
+	uint64_t disk_size;
+	uint64_t zone_size;
+	IO_ZONE_STATS zone[2][IO_HEATMAP_ZONES];	// [0] = reads, [1] = writes
+	IO_HEALTH health;
+} IO_HEATMAP;
+
+/*
+ * Zero-fill engine, shared by the drive zeroing, the partition table clearing and ext2fs.
+ * The TRIM structures are our own, as not all SDKs have DEVICE_DSM_ / LB_PROVISIONING ones.
+ */
+#define ZF_ALLOW_TRIM                       0x00000001	// Zero with a TRIM when the device reads trimmed blocks as zeroes
+#define ZERO_FILL_CHUNK_SIZE                (4 * MB)
+#define ZERO_FILL_QUEUE_DEPTH               4
+#define MAX_TRIM_SIZE                       (1 * GB)
+#define TRIM_VERIFY_SAMPLES                 16		// Sectors read back after a TRIM, to confirm they are zeroed
+#define DSM_ACTION_TRIM                     1
+#define STORAGE_LB_PROVISIONING_PROPERTY    11		// StorageDeviceLBProvisioningProperty
+
+#ifndef IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES
+#define IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES \
+	CTL_CODE(IOCTL_STORAGE_BASE, 0x0501, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+#endif
+
+#ifndef FSCTL_SET_PERSISTENT_VOLUME_STATE
+#define FSCTL_SET_PERSISTENT_VOLUME_STATE   \
+	CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 142, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#endif
+#ifndef FSCTL_QUERY_PERSISTENT_VOLUME_STATE
+#define FSCTL_QUERY_PERSISTENT_VOLUME_STATE \
+	CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 143, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#endif
+#define PERSISTENT_VOLUME_STATE_SHORT_NAME_CREATION_DISABLED 0x00000001
+
+// From ntifs.h
+typedef struct {
+	ULONG VolumeFlags;
+	ULONG FlagMask;
+	ULONG Version;
+	ULONG Reserved;
+} FILE_FS_PERSISTENT_VOLUME_INFORMATION_REDEF;
+
+// DEVICE_MANAGE_DATA_SET_ATTRIBUTES, followed by a single DEVICE_DATA_SET_RANGE
+typedef struct {
+	DWORD Size;
+	DWORD Action;
+	DWORD Flags;
+	DWORD ParameterBlockOffset;
+	DWORD ParameterBlockLength;
+	DWORD DataSetRangesOffset;
+	DWORD DataSetRangesLength;
+	LONGLONG StartingOffset;
+	ULONGLONG LengthInBytes;
+} DSM_TRIM_REQUEST;
+
+typedef struct {
+	DWORD Version;
+	DWORD Size;
+	BYTE ThinProvisioningEnabled : 1;
+	BYTE ThinProvisioningReadZeros : 1;
+	BYTE AnchorSupported : 1;
+	BYTE UnmapGranularityAlignmentValid : 1;
+	BYTE Reserved0 : 4;
+	BYTE Reserved1[7];
+	ULONGLONG OptimalUnmapGranularity;
+	ULONGLONG UnmapGranularityAlignment;
+} LB_PROVISIONING_DESCRIPTOR;
+
+typedef void (*ZERO_FILL_PROGRESS)(uint64_t done, uint64_t total);
+
+/* Physical sector alignment, as reported through StorageAccessAlignmentProperty */
+#define STORAGE_ACCESS_ALIGNMENT_PROPERTY   6
+#define MAX_IO_ALIGNMENT                    (64 * KB)
+#define MIN_ERASE_BLOCK_SIZE                (1 * MB)
+#define MAX_ERASE_BLOCK_SIZE                (64 * MB)
+
+typedef struct {
+	DWORD Version;
+	DWORD Size;
+	DWORD BytesPerCacheLine;
+	DWORD BytesOffsetForCacheAlignment;
+	DWORD BytesPerLogicalSector;
+	DWORD BytesPerPhysicalSector;
+	DWORD BytesOffsetForSectorAlignment;
+} ACCESS_ALIGNMENT_DESCRIPTOR;
+
+/* Rotational media detection, through StorageDeviceSeekPenaltyProperty */
+#define STORAGE_SEEK_PENALTY_PROPERTY       7
+
+typedef struct {
+	DWORD Version;
+	DWORD Size;
+	BOOLEAN IncursSeekPenalty;
+} SEEK_PENALTY_DESCRIPTOR;
+
+/* Optical drive read speed. The structures are our own, as they are only in the DDK's ntddcdrm.h */
+#ifndef IOCTL_CDROM_SET_SPEED
+#define IOCTL_CDROM_SET_SPEED               \
+	CTL_CODE(FILE_DEVICE_CD_ROM, 0x0018, METHOD_BUFFERED, FILE_READ_ACCESS)
+#endif
+#define CDROM_SET_SPEED_REQUEST             0		// CdromSetSpeed (SET CD SPEED)
+#define CDROM_SET_STREAMING_REQUEST         1		// CdromSetStreaming (SET STREAMING)
+#define CDROM_MAX_SPEED                     0xFFFF	// In kB/s, for the drive to use its maximum
+
+typedef struct {
+	DWORD RequestType;
+	USHORT ReadSpeed;
+	USHORT WriteSpeed;
+	DWORD RotationControl;
+} CDROM_SET_SPEED_REDEF;
+
+typedef struct {
+	DWORD RequestType;
+	ULONG ReadSize;				// In kB, per ReadTime
+	ULONG ReadTime;				// In ms
+	ULONG WriteSize;
+	ULONG WriteTime;
+	ULONG StartLba;
+	ULONG EndLba;
+	DWORD RotationControl;
+	BOOLEAN RestoreDefaults;
+	BOOLEAN SetExact;
+	BOOLEAN RandomAccess;
+	BOOLEAN Persistent;
+} CDROM_SET_STREAMING_REDEF;
+
 BOOL SetAutoMount(BOOL enable);
 BOOL GetAutoMount(BOOL* enabled);
 char* GetPhysicalName(DWORD DriveIndex);
@@ -378,6 +566,9 @@ BOOL DeletePartition(DWORD DriveIndex, ULONGLONG PartitionOffset, BOOL bSilent);
 BOOL IsVdsAvailable(BOOL bSilent);
 BOOL ListVdsVolumes(BOOL bSilent);
 BOOL VdsRescan(DWORD dwRescanType, DWORD dwSleepTime, BOOL bSilent);
+void BeginVdsSession(void);
+void EndVdsSession(void);
+HRESULT GetVdsService(IVdsService** ppService, BOOL bSilent);
 HANDLE GetPhysicalHandle(DWORD DriveIndex, BOOL bLockDrive, BOOL bWriteAccess, BOOL bWriteShare);
 char* GetLogicalName(DWORD DriveIndex, uint64_t PartitionOffset, BOOL bKeepTrailingBackslash, BOOL bSilent);
 char* AltGetLogicalName(DWORD DriveIndex, uint64_t PartitionOffset, BOOL bKeepTrailingBackslash, BOOL bSilent);
@@ -390,17 +581,21 @@ UINT GetDriveTypeFromIndex(DWORD DriveIndex);
 char GetUnusedDriveLetter(void);
 BOOL IsDriveLetterInUse(const char drive_letter);
 char RemoveDriveLetters(DWORD DriveIndex, BOOL bUseLast, BOOL bSilent);
-BOOL GetDriveLabel(DWORD DriveIndex, char* letter, char** label);
+BOOL GetDriveLabel(DWORD DriveIndex, char* letter, char* label);
 uint64_t GetDriveSize(DWORD DriveIndex);
 BOOL IsMediaPresent(DWORD DriveIndex);
 BOOL AnalyzeMBR(HANDLE hPhysicalDrive, const char* TargetName, BOOL bSilent);
 BOOL AnalyzePBR(HANDLE hLogicalVolume);
 BOOL GetDrivePartitionData(DWORD DriveIndex, char* FileSystemName, DWORD FileSystemNameSize, BOOL bSilent);
+BOOL HasPartitions(DWORD DriveIndex);
 BOOL UnmountVolume(HANDLE hDrive);
 BOOL MountVolume(char* drive_name, char *drive_guid);
 BOOL AltUnmountVolume(const char* drive_name, BOOL bSilent);
 char* AltMountVolume(DWORD DriveIndex, uint64_t PartitionOffset, BOOL bSilent);
 BOOL RemountVolume(char* drive_name, BOOL bSilent);
+BOOL EnableDriveWriteCache(DWORD DriveIndex);
+BOOL RestoreDriveWriteCache(void);
+BOOL SetShortNameCreation(DWORD DriveIndex, uint64_t PartitionOffset, BOOL bEnable, BOOL* pbWasEnabled);
 BOOL CreatePartition(HANDLE hDrive, int partition_style, int file_system, BOOL mbr_uefi_marker, uint8_t extra_partitions);
 BOOL InitializeDisk(HANDLE hDrive);
 BOOL RefreshDriveLayout(HANDLE hDrive);
@@ -408,8 +603,31 @@ const char* GetMBRPartitionType(const uint8_t type);
 const char* GetGPTPartitionType(const GUID* guid);
 const char* GetExtFsLabel(DWORD DriveIndex, uint64_t PartitionOffset);
 BOOL GetDevices(DWORD devnum);
+BOOL RefreshDevices(DWORD devnum);
+void InvalidateDevice(const char* path);
+void InvalidateDriveLetters(DWORD unitmask);
+HDEVNOTIFY RegisterDiskNotifications(HWND hWnd);
 BOOL CyclePort(int index);
 int CycleDevice(int index);
 BOOL RefreshLayout(DWORD DriveIndex);
 BOOL GetOpticalMedia(IMG_SAVE* img_save);
+BOOL SetOpticalReadSpeed(HANDLE hDrive, uint64_t DiskSize);
 BOOL ToggleEsp(DWORD DriveIndex, uint64_t PartitionOffset);
+IO_HEATMAP* CreateIoHeatmap(uint64_t disk_size);
+void UpdateIoHeatmap(LPVOID lpContext, BOOL bWrite, ULONG64 u64Offset, DWORD dwSize, ULONG64 u64LatencyUs, ULONG64 u64BusyUs);
+BOOL IsDriveUnhealthy(IO_HEATMAP* heatmap);
+void PrintIoHeatmap(IO_HEATMAP* heatmap, const char* prefix);
+BOOL ExportIoHeatmap(IO_HEATMAP* heatmap, const char* path);
+BOOL IncursSeekPenalty(const char* path);
+BOOL BlockIo(HANDLE hDrive, BOOL bWrite, void* lpBuffer, DWORD dwSize, uint64_t u64Offset,
+	DWORD nRetries, IO_HEATMAP* heatmap, DWORD* lpTransferred);
+HANDLE BlockCreateQueue(HANDLE hDrive, DWORD dwDesiredAccess, DWORD dwDepth, IO_HEATMAP* heatmap);
+BOOL BlockTrim(HANDLE hDrive, uint64_t u64Offset, uint64_t u64Size);
+BOOL BlockFlush(HANDLE hDrive);
+BOOL TrimReadsZeroes(HANDLE hDrive);
+BOOL TrimmedRangeReadsZeroes(HANDLE hDrive, uint64_t Offset, uint64_t Size);
+BOOL ZeroDriveRange(HANDLE hDrive, uint64_t Offset, uint64_t Size, DWORD Flags, IO_HEATMAP* heatmap,
+	ZERO_FILL_PROGRESS pfnProgress);
+BOOL BenchmarkDrive(HANDLE hPhysicalDrive, DWORD DriveIndex);
+BOOL GetTunedDriveIO(DWORD DriveIndex, DWORD* buf_size, int* queue_depth);
+BOOL SetTunedDriveIO(DWORD DriveIndex, DWORD buf_size, int queue_depth);
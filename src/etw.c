@@ -0,0 +1,242 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Event Tracing for Windows provider
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Our ETW provider emits self-describing (TraceLogging) events, so that WPA or PerfView can
+ * decode them without having to register a manifest on the machine first. Since MinGW does
+ * not have TraceLoggingProvider.h, the event metadata is built here and passed to EventWrite(),
+ * as the TraceLogging macros would do. The provider is named "Rufus" and its GUID is the one
+ * that is derived from that name, so it can be enabled as "*Rufus" in PerfView, or with:
+ *   xperf -on PROC_THREAD+LOADER+FILE_IO+DISK_IO -start rufus -on 453619f8-57f0-51b8-1c69-5e9dbee8e0e4
+ * Events are only built when a session has enabled the provider for their level and
+ * keyword, which is checked with EtwEnabled() before calling the functions below.
+ */
+
+#ifdef _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#include <windows.h>
+#include <evntprov.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rufus.h"
+#include "missing.h"
+
+// {453619F8-57F0-51B8-1C69-5E9DBEE8E0E4}, derived from "Rufus"
+static const GUID rufus_provider_guid =
+	{ 0x453619f8, 0x57f0, 0x51b8, { 0x1c, 0x69, 0x5e, 0x9d, 0xbe, 0xe8, 0xe0, 0xe4 } };
+
+#define ETW_CHANNEL_TRACELOGGING    11
+#define ETW_PROVIDER_SET_TRAITS     2		// EventProviderSetTraits
+#define ETW_DESCRIPTOR_EVENT_META   1		// EVENT_DATA_DESCRIPTOR_TYPE_EVENT_METADATA
+#define ETW_DESCRIPTOR_PROVIDER_META 2		// EVENT_DATA_DESCRIPTOR_TYPE_PROVIDER_METADATA
+#define ETW_MAX_FIELDS              8
+#define ETW_OPCODE_INFO             0
+#define ETW_OPCODE_START            1
+#define ETW_OPCODE_STOP             2
+
+// TraceLogging field types
+#define ETW_TYPE_ANSISTRING         2
+#define ETW_TYPE_UINT32             8
+#define ETW_TYPE_UINT64             10
+#define ETW_TYPE_BOOL32             13
+#define ETW_TYPE_HEXINT32           20
+
+typedef struct {
+	const char* name;
+	UCHAR type;
+	const void* data;
+	ULONG size;
+} etw_field;
+
+PF_TYPE_DECL(WINAPI, ULONG, EventRegister, (LPCGUID, PENABLECALLBACK, PVOID, PREGHANDLE));
+PF_TYPE_DECL(WINAPI, ULONG, EventUnregister, (REGHANDLE));
+PF_TYPE_DECL(WINAPI, ULONG, EventWrite, (REGHANDLE, PCEVENT_DESCRIPTOR, ULONG, PEVENT_DATA_DESCRIPTOR));
+PF_TYPE_DECL(WINAPI, ULONG, EventSetInformation, (REGHANDLE, int, PVOID, ULONG));
+
+UCHAR etw_level = 0;
+ULONGLONG etw_keywords = 0;
+static REGHANDLE etw_handle = 0;
+// Provider traits: total size (including the NUL terminator), followed by the provider name
+static const char etw_traits[] = "\x08\x00" "Rufus";
+
+static void NTAPI EtwEnableCallback(LPCGUID SourceId, ULONG IsEnabled, UCHAR Level, ULONGLONG MatchAnyKeyword,
+	ULONGLONG MatchAllKeyword, PEVENT_FILTER_DESCRIPTOR FilterData, PVOID CallbackContext)
+{
+	if (IsEnabled == 0) {
+		etw_keywords = 0;
+		etw_level = 0;
+		return;
+	}
+	// Per ETW conventions, a level or keyword of zero means everything
+	etw_level = (Level == 0) ? 0xff : Level;
+	etw_keywords = (MatchAnyKeyword == 0) ? ~0ULL : MatchAnyKeyword;
+}
+
+void EtwRegister(void)
+{
+	PF_INIT_OR_OUT(EventRegister, Advapi32);
+	PF_INIT_OR_OUT(EventUnregister, Advapi32);
+	PF_INIT_OR_OUT(EventWrite, Advapi32);
+	PF_INIT(EventSetInformation, Advapi32);
+
+	if (pfEventRegister(&rufus_provider_guid, EtwEnableCallback, NULL, &etw_handle) != ERROR_SUCCESS) {
+		etw_handle = 0;
+		goto out;
+	}
+	if (pfEventSetInformation != NULL)
+		pfEventSetInformation(etw_handle, ETW_PROVIDER_SET_TRAITS, (PVOID)etw_traits, sizeof(etw_traits));
+out:
+	return;
+}
+
+void EtwUnregister(void)
+{
+	if (etw_handle == 0)
+		return;
+	etw_keywords = 0;
+	etw_level = 0;
+	pfEventUnregister(etw_handle);
+	etw_handle = 0;
+}
+
+static __inline void EtwSetData(EVENT_DATA_DESCRIPTOR* data, const void* ptr, ULONG size, ULONG type)
+{
+	data->Ptr = (ULONGLONG)(uintptr_t)ptr;
+	data->Size = size;
+	data->Reserved = type;
+}
+
+/*
+ * Write an event, along with the metadata that describes its name and fields
+ */
+static void EtwWrite(const char* event, UCHAR level, UCHAR opcode, ULONGLONG keyword,
+	const etw_field* field, int nb_fields)
+{
+	EVENT_DESCRIPTOR desc = { 0, 0, ETW_CHANNEL_TRACELOGGING, level, opcode, 0, keyword };
+	EVENT_DATA_DESCRIPTOR data[2 + ETW_MAX_FIELDS];
+	UCHAR meta[256];
+	size_t len;
+	int i;
+
+	if ((etw_handle == 0) || (nb_fields > ETW_MAX_FIELDS))
+		return;
+	// Event metadata: total size, tags, event name and, for each field, its name and type
+	meta[2] = 0;
+	len = 3;
+	for (i = -1; i < nb_fields; i++) {
+		const char* name = (i < 0) ? event : field[i].name;
+		size_t name_len = strlen(name) + 1;
+		if (len + name_len + 1 > sizeof(meta))
+			return;
+		memcpy(&meta[len], name, name_len);
+		len += name_len;
+		if (i >= 0)
+			meta[len++] = field[i].type;
+	}
+	meta[0] = (UCHAR)(len & 0xff);
+	meta[1] = (UCHAR)(len >> 8);
+
+	EtwSetData(&data[0], etw_traits, sizeof(etw_traits), ETW_DESCRIPTOR_PROVIDER_META);
+	EtwSetData(&data[1], meta, (ULONG)len, ETW_DESCRIPTOR_EVENT_META);
+	for (i = 0; i < nb_fields; i++)
+		EtwSetData(&data[2 + i], field[i].data, field[i].size, 0);
+	pfEventWrite(etw_handle, &desc, 2 + nb_fields, data);
+}
+
+#define ETW_STRING(n, s)    { n, ETW_TYPE_ANSISTRING, (s), (ULONG)strlen(s) + 1 }
+#define ETW_VALUE(n, t, v)  { n, t, &(v), sizeof(v) }
+
+/*
+ * Operations (format, write, save, etc.) and their phases
+ */
+void EtwJob(BOOL bStart, const char* job, DWORD disk, DWORD status)
+{
+	etw_field field[] = {
+		ETW_STRING("Operation", job),
+		ETW_VALUE("Disk", ETW_TYPE_UINT32, disk),
+		ETW_VALUE("Status", ETW_TYPE_HEXINT32, status),
+	};
+
+	if (EtwEnabled(ETW_LEVEL_INFO, ETW_KEYWORD_PHASE))
+		EtwWrite("Operation", ETW_LEVEL_INFO, bStart ? ETW_OPCODE_START : ETW_OPCODE_STOP,
+			ETW_KEYWORD_PHASE, field, bStart ? 2 : 3);
+}
+
+void EtwPhase(BOOL bStart, const char* name, uint64_t bytes, uint64_t duration_us)
+{
+	etw_field field[] = {
+		ETW_STRING("Phase", name),
+		ETW_VALUE("Bytes", ETW_TYPE_UINT64, bytes),
+		ETW_VALUE("DurationUs", ETW_TYPE_UINT64, duration_us),
+	};
+
+	if (EtwEnabled(ETW_LEVEL_INFO, ETW_KEYWORD_PHASE))
+		EtwWrite("Phase", ETW_LEVEL_INFO, bStart ? ETW_OPCODE_START : ETW_OPCODE_STOP,
+			ETW_KEYWORD_PHASE, field, bStart ? 1 : 3);
+}
+
+/*
+ * Completed device read or write request
+ */
+void EtwIo(BOOL bWrite, uint64_t offset, DWORD size, uint64_t latency_us)
+{
+	etw_field field[] = {
+		ETW_VALUE("Offset", ETW_TYPE_UINT64, offset),
+		ETW_VALUE("Size", ETW_TYPE_UINT32, size),
+		ETW_VALUE("LatencyUs", ETW_TYPE_UINT64, latency_us),
+	};
+
+	if (EtwEnabled(ETW_LEVEL_VERBOSE, ETW_KEYWORD_IO))
+		EtwWrite(bWrite ? "Write" : "Read", ETW_LEVEL_VERBOSE, ETW_OPCODE_INFO, ETW_KEYWORD_IO, field, 3);
+}
+
+/*
+ * Time spent waiting to open (and lock) a drive or volume
+ */
+void EtwLockWait(const char* path, uint64_t wait_ms, BOOL success)
+{
+	etw_field field[] = {
+		ETW_STRING("Path", path),
+		ETW_VALUE("WaitMs", ETW_TYPE_UINT64, wait_ms),
+		ETW_VALUE("Success", ETW_TYPE_BOOL32, success),
+	};
+
+	if (EtwEnabled(ETW_LEVEL_INFO, ETW_KEYWORD_LOCK))
+		EtwWrite("LockWait", ETW_LEVEL_INFO, ETW_OPCODE_INFO, ETW_KEYWORD_LOCK, field, 3);
+}
+
+/*
+ * Search for the processes that hold a handle on a device
+ */
+void EtwProcessScan(const char* device, uint64_t duration_ms, DWORD access_mask)
+{
+	etw_field field[] = {
+		ETW_STRING("Device", device),
+		ETW_VALUE("DurationMs", ETW_TYPE_UINT64, duration_ms),
+		ETW_VALUE("AccessMask", ETW_TYPE_HEXINT32, access_mask),
+	};
+
+	if (EtwEnabled(ETW_LEVEL_INFO, ETW_KEYWORD_PROCESS))
+		EtwWrite("ProcessScan", ETW_LEVEL_INFO, ETW_OPCODE_INFO, ETW_KEYWORD_PROCESS, field, 3);
+}
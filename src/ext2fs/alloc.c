@@ -285,7 +285,7 @@ errcode_t ext2fs_alloc_block(ext2_filsys fs, blk_t goal,
 errcode_t ext2fs_get_free_blocks2(ext2_filsys fs, blk64_t start, blk64_t finish,
 				 int num, ext2fs_block_bitmap map, blk64_t *ret)
 {
-	blk64_t	b = start;
+	blk64_t	b = start, used, next, end;
 	int	c_ratio;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
@@ -313,6 +313,26 @@ errcode_t ext2fs_get_free_blocks2(ext2_filsys fs, blk64_t start, blk64_t finish,
 			*ret = b;
 			return 0;
 		}
+		/*
+		 * Rather than trying every single block, skip to the end
+		 * of the first run of blocks in use that got in the way,
+		 * which, with extent based bitmaps, is a single lookup.
+		 * The search stops at finish, or at the end of the
+		 * filesystem if we must first wrap around.
+		 */
+		end = (b < finish) ? finish - 1 : ext2fs_blocks_count(fs->super) - 1;
+		if ((ext2fs_find_first_set_block_bitmap2(map, b, b + num - 1,
+							 &used) == 0) &&
+		    (used <= end)) {
+			if (ext2fs_find_first_zero_block_bitmap2(map, used, end,
+								 &next))
+				next = end + 1;
+			next = (next + c_ratio - 1) & ~((blk64_t) c_ratio - 1);
+			if (next > b) {
+				b = next;
+				continue;
+			}
+		}
 		b += c_ratio;
 	} while (b != finish);
 	return EXT2_ET_BLOCK_ALLOC_FAIL;
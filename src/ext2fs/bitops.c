@@ -12,6 +12,10 @@
 
 #include "config.h"
 #include <stdio.h>
+#include <string.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 #if HAVE_SYS_TYPES_H
 #include <sys/types.h>
 #endif
@@ -116,6 +120,110 @@ int ext2fs_test_bit64(__u64 nr, const void * addr)
 	return (mask & *ADDR);
 }
 
+/*
+ * Range ops, for the bitarray bitmaps, which only go bit by bit for the
+ * partial bytes at both ends of the range.
+ */
+void ext2fs_set_bit_range64(__u64 nr, __u64 len, void *addr)
+{
+	__u64	end = nr + len;
+
+	for (; (nr & 0x07) && (nr < end); nr++)
+		ext2fs_set_bit64(nr, addr);
+	if (end - nr >= 8) {
+		memset((unsigned char *) addr + (nr >> 3), 0xff,
+		       (size_t) ((end - nr) >> 3));
+		nr += (end - nr) & ~((__u64) 0x07);
+	}
+	for (; nr < end; nr++)
+		ext2fs_set_bit64(nr, addr);
+}
+
+void ext2fs_clear_bit_range64(__u64 nr, __u64 len, void *addr)
+{
+	__u64	end = nr + len;
+
+	for (; (nr & 0x07) && (nr < end); nr++)
+		ext2fs_clear_bit64(nr, addr);
+	if (end - nr >= 8) {
+		memset((unsigned char *) addr + (nr >> 3), 0,
+		       (size_t) ((end - nr) >> 3));
+		nr += (end - nr) & ~((__u64) 0x07);
+	}
+	for (; nr < end; nr++)
+		ext2fs_clear_bit64(nr, addr);
+}
+
+/* Index of the lowest set bit of a non-zero value */
+static __inline unsigned int ctz32(__u32 w)
+{
+#if defined(_MSC_VER)
+	unsigned long r;
+
+	_BitScanForward(&r, w);
+	return (unsigned int) r;
+#elif defined(__GNUC__)
+	return (unsigned int) __builtin_ctz(w);
+#else
+	unsigned int r = 0;
+
+	for (; !(w & 1); w >>= 1)
+		r++;
+	return r;
+#endif
+}
+
+/*
+ * Find the first bit that is set (or clear, if set is 0) in [nr, end).
+ * Once aligned, the bitmap is skipped over a 64-bit word at a time, so
+ * that sparse or full regions are scanned at memory speed, and the bit
+ * is then located in the first byte that has one, with a single ctz.
+ */
+errcode_t ext2fs_find_first_bit64(const void *addr, __u64 nr, __u64 end,
+				  int set, __u64 *ret)
+{
+	const unsigned char	*cp;
+	const unsigned char	skip = set ? 0x00 : 0xff;
+	const __u64		skip64 = set ? 0 : ~((__u64) 0);
+
+	if (nr >= end)
+		return ENOENT;
+	for (; (nr & 0x07) && (nr < end); nr++) {
+		if (!ext2fs_test_bit64(nr, addr) == !set) {
+			*ret = nr;
+			return 0;
+		}
+	}
+
+	cp = (const unsigned char *) addr + (nr >> 3);
+	while ((end - nr >= 8) && (((uintptr_t) cp) & 0x07) && (*cp == skip)) {
+		cp++;
+		nr += 8;
+	}
+	if ((((uintptr_t) cp) & 0x07) == 0) {
+		while ((end - nr >= 64) && (*((const __u64 *) cp) == skip64)) {
+			cp += 8;
+			nr += 64;
+		}
+	}
+	while ((end - nr >= 8) && (*cp == skip)) {
+		cp++;
+		nr += 8;
+	}
+	if (end - nr >= 8) {
+		*ret = nr + ctz32(set ? *cp : (unsigned char) ~*cp);
+		return 0;
+	}
+
+	for (; nr < end; nr++) {
+		if (!ext2fs_test_bit64(nr, addr) == !set) {
+			*ret = nr;
+			return 0;
+		}
+	}
+	return ENOENT;
+}
+
 static unsigned int popcount8(unsigned int w)
 {
 	unsigned int res = w - ((w >> 1) & 0x55);
@@ -701,3 +701,7 @@ extern int ext2fs_set_bit64(__u64 nr,void * addr);
 extern int ext2fs_clear_bit64(__u64 nr, void * addr);
 extern int ext2fs_test_bit64(__u64 nr, const void * addr);
 extern unsigned int ext2fs_bitcount(const void *addr, unsigned int nbytes);
+extern void ext2fs_set_bit_range64(__u64 nr, __u64 len, void *addr);
+extern void ext2fs_clear_bit_range64(__u64 nr, __u64 len, void *addr);
+extern errcode_t ext2fs_find_first_bit64(const void *addr, __u64 nr, __u64 end,
+					 int set, __u64 *ret);
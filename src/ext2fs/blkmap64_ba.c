@@ -191,10 +191,8 @@ static void ba_mark_bmap_extent(ext2fs_generic_bitmap_64 bitmap, __u64 arg,
 {
 	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
 	blk64_t bitno = (blk64_t) arg;
-	unsigned int i;
 
-	for (i = 0; i < num; i++)
-		ext2fs_fast_set_bit64(bitno + i - bitmap->start, bp->bitarray);
+	ext2fs_set_bit_range64(bitno - bitmap->start, num, bp->bitarray);
 }
 
 static void ba_unmark_bmap_extent(ext2fs_generic_bitmap_64 bitmap, __u64 arg,
@@ -202,10 +200,8 @@ static void ba_unmark_bmap_extent(ext2fs_generic_bitmap_64 bitmap, __u64 arg,
 {
 	ext2fs_ba_private bp = (ext2fs_ba_private) bitmap->private;
 	blk64_t bitno = (blk64_t) arg;
-	unsigned int i;
 
-	for (i = 0; i < num; i++)
-		ext2fs_fast_clear_bit64(bitno + i - bitmap->start, bp->bitarray);
+	ext2fs_clear_bit_range64(bitno - bitmap->start, num, bp->bitarray);
 }
 
 static int ba_test_clear_bmap_extent(ext2fs_generic_bitmap_64 bitmap,
@@ -328,73 +324,13 @@ static errcode_t ba_find_first_zero(ext2fs_generic_bitmap_64 bitmap,
 				    __u64 start, __u64 end, __u64 *out)
 {
 	ext2fs_ba_private bp = (ext2fs_ba_private)bitmap->private;
-	unsigned long bitpos = start - bitmap->start;
-	unsigned long count = end - start + 1;
-	int byte_found = 0; /* whether a != 0xff byte has been found */
-	const unsigned char *pos;
-	unsigned long max_loop_count, i;
-
-	/* scan bits until we hit a byte boundary */
-	while ((bitpos & 0x7) != 0 && count > 0) {
-		if (!ext2fs_test_bit64(bitpos, bp->bitarray)) {
-			*out = bitpos + bitmap->start;
-			return 0;
-		}
-		bitpos++;
-		count--;
-	}
+	__u64 bitpos;
 
-	if (!count)
+	if (ext2fs_find_first_bit64(bp->bitarray, start - bitmap->start,
+				    end - bitmap->start + 1, 0, &bitpos))
 		return ENOENT;
-
-	pos = ((unsigned char *)bp->bitarray) + (bitpos >> 3);
-	/* scan bytes until 8-byte (64-bit) aligned */
-	while (count >= 8 && (((uintptr_t)pos) & 0x07)) {
-		if (*pos != 0xff) {
-			byte_found = 1;
-			break;
-		}
-		pos++;
-		count -= 8;
-		bitpos += 8;
-	}
-
-	if (!byte_found) {
-		max_loop_count = count >> 6; /* 8-byte blocks */
-		i = max_loop_count;
-		while (i) {
-			if (*((const __u64 *)pos) != ((__u64)-1))
-				break;
-			pos += 8;
-			i--;
-		}
-		count -= 64 * (max_loop_count - i);
-		bitpos += 64 * (max_loop_count - i);
-
-		max_loop_count = count >> 3;
-		i = max_loop_count;
-		while (i) {
-			if (*pos != 0xff) {
-				byte_found = 1;
-				break;
-			}
-			pos++;
-			i--;
-		}
-		count -= 8 * (max_loop_count - i);
-		bitpos += 8 * (max_loop_count - i);
-	}
-
-	/* Here either count < 8 or byte_found == 1. */
-	while (count-- > 0) {
-		if (!ext2fs_test_bit64(bitpos, bp->bitarray)) {
-			*out = bitpos + bitmap->start;
-			return 0;
-		}
-		bitpos++;
-	}
-
-	return ENOENT;
+	*out = bitpos + bitmap->start;
+	return 0;
 }
 
 /* Find the first one bit between start and end, inclusive. */
@@ -402,73 +338,13 @@ static errcode_t ba_find_first_set(ext2fs_generic_bitmap_64 bitmap,
 				    __u64 start, __u64 end, __u64 *out)
 {
 	ext2fs_ba_private bp = (ext2fs_ba_private)bitmap->private;
-	unsigned long bitpos = start - bitmap->start;
-	unsigned long count = end - start + 1;
-	int byte_found = 0; /* whether a != 0xff byte has been found */
-	const unsigned char *pos;
-	unsigned long max_loop_count, i;
-
-	/* scan bits until we hit a byte boundary */
-	while ((bitpos & 0x7) != 0 && count > 0) {
-		if (ext2fs_test_bit64(bitpos, bp->bitarray)) {
-			*out = bitpos + bitmap->start;
-			return 0;
-		}
-		bitpos++;
-		count--;
-	}
+	__u64 bitpos;
 
-	if (!count)
+	if (ext2fs_find_first_bit64(bp->bitarray, start - bitmap->start,
+				    end - bitmap->start + 1, 1, &bitpos))
 		return ENOENT;
-
-	pos = ((unsigned char *)bp->bitarray) + (bitpos >> 3);
-	/* scan bytes until 8-byte (64-bit) aligned */
-	while (count >= 8 && (((uintptr_t)pos) & 0x07)) {
-		if (*pos != 0) {
-			byte_found = 1;
-			break;
-		}
-		pos++;
-		count -= 8;
-		bitpos += 8;
-	}
-
-	if (!byte_found) {
-		max_loop_count = count >> 6; /* 8-byte blocks */
-		i = max_loop_count;
-		while (i) {
-			if (*((const __u64 *)pos) != 0)
-				break;
-			pos += 8;
-			i--;
-		}
-		count -= 64 * (max_loop_count - i);
-		bitpos += 64 * (max_loop_count - i);
-
-		max_loop_count = count >> 3;
-		i = max_loop_count;
-		while (i) {
-			if (*pos != 0) {
-				byte_found = 1;
-				break;
-			}
-			pos++;
-			i--;
-		}
-		count -= 8 * (max_loop_count - i);
-		bitpos += 8 * (max_loop_count - i);
-	}
-
-	/* Here either count < 8 or byte_found == 1. */
-	while (count-- > 0) {
-		if (ext2fs_test_bit64(bitpos, bp->bitarray)) {
-			*out = bitpos + bitmap->start;
-			return 0;
-		}
-		bitpos++;
-	}
-
-	return ENOENT;
+	*out = bitpos + bitmap->start;
+	return 0;
 }
 
 struct ext2_bitmap_ops ext2fs_blkmap64_bitarray = {
@@ -250,9 +250,16 @@ void ext2fs_update_dynamic_rev(ext2_filsys fs)
 	/* other fields should be left alone */
 }
 
+/*
+ * If block_buf is provided, the backup is written as a whole block, so that
+ * it can go through the I/O manager's cache and be merged with the group
+ * descriptors that follow it, rather than as a small synchronous write.
+ * The rest of that block is not used by anything else in backup groups.
+ */
 static errcode_t write_backup_super(ext2_filsys fs, dgrp_t group,
 				    blk64_t group_block,
-				    struct ext2_super_block *super_shadow)
+				    struct ext2_super_block *super_shadow,
+				    char *block_buf)
 {
 	errcode_t retval;
 	dgrp_t	sgrp = group;
@@ -266,6 +273,11 @@ static errcode_t write_backup_super(ext2_filsys fs, dgrp_t group,
 	if (retval)
 		return retval;
 
+	if (block_buf) {
+		memcpy(block_buf, super_shadow, SUPERBLOCK_SIZE);
+		return io_channel_write_blk64(fs->io, group_block, 1,
+					      block_buf);
+	}
 	return io_channel_write_blk64(fs->io, group_block, -SUPERBLOCK_SIZE,
 				    super_shadow);
 }
@@ -288,6 +300,7 @@ errcode_t ext2fs_flush2(ext2_filsys fs, int flags)
 	dgrp_t		j;
 #endif
 	char	*group_ptr;
+	char	*backup_buf = NULL;
 	blk64_t	old_desc_blocks;
 	struct ext2fs_numeric_progress_struct progress;
 
@@ -378,6 +391,10 @@ errcode_t ext2fs_flush2(ext2_filsys fs, int flags)
 		(fs->progress_ops->init)(fs, &progress, NULL,
 					 fs->group_desc_count);
 
+	if ((fs->blocksize >= SUPERBLOCK_SIZE) &&
+	    !(fs->flags & EXT2_FLAG_MASTER_SB_ONLY) &&
+	    (io_channel_alloc_buf(fs->io, 0, &backup_buf) == 0))
+		memset(backup_buf, 0, fs->blocksize);
 
 	for (i = 0; i < fs->group_desc_count; i++) {
 		blk64_t	super_blk, old_desc_blk, new_desc_blk;
@@ -389,7 +406,7 @@ errcode_t ext2fs_flush2(ext2_filsys fs, int flags)
 
 		if (!(fs->flags & EXT2_FLAG_MASTER_SB_ONLY) &&i && super_blk) {
 			retval = write_backup_super(fs, i, super_blk,
-						    super_shadow);
+						    super_shadow, backup_buf);
 			if (retval)
 				goto errout;
 		}
@@ -434,7 +451,7 @@ write_primary_superblock_only:
 
 	retval = ext2fs_superblock_csum_set(fs, super_shadow);
 	if (retval)
-		return retval;
+		goto errout;
 
 	if (!(flags & EXT2_FLAG_FLUSH_NO_SYNC)) {
 		retval = io_channel_flush(fs->io);
@@ -454,6 +471,8 @@ write_primary_superblock_only:
 	}
 errout:
 	fs->super->s_state = fs_state;
+	if (backup_buf)
+		ext2fs_free_mem(&backup_buf);
 #ifdef WORDS_BIGENDIAN
 	if (super_shadow)
 		ext2fs_free_mem(&super_shadow);
@@ -42,6 +42,29 @@
 #include "crc32c_defs.h"
 
 #include "ext2fs.h"
+
+/*
+ * Hardware accelerated CRC32C, through the SSE4.2 CRC32 instruction on x86 or the
+ * ARMv8 CRC32C instructions on ARM64, with the table driven code as fallback.
+ */
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define CRC32C_X86
+#include <nmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define CRC32C_TARGET
+#else
+#include <cpuid.h>
+#define CRC32C_TARGET __attribute__((target("sse4.2")))
+#endif
+#elif defined(_M_ARM64) || (defined(__aarch64__) && defined(__ARM_FEATURE_CRC32))
+#define CRC32C_ARM64
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <arm_acle.h>
+#endif
+#endif
 #ifdef WORDS_BIGENDIAN
 #define __constant_cpu_to_le32(x) ___constant_swab32((x))
 #define __constant_cpu_to_be32(x) (x)
@@ -185,11 +208,77 @@ static inline uint32_t crc32_le_generic(uint32_t crc, unsigned char const *p,
 	return crc;
 }
 
-uint32_t ext2fs_crc32c_le(uint32_t crc, unsigned char const *p, size_t len)
+static uint32_t crc32c_le_sw(uint32_t crc, unsigned char const *p, size_t len)
 {
 	return crc32_le_generic(crc, p, len, crc32ctable_le, CRC32C_POLY_LE);
 }
 
+#if defined(CRC32C_X86)
+CRC32C_TARGET
+static uint32_t crc32c_le_hw(uint32_t crc, unsigned char const *p, size_t len)
+{
+	for (; len > 0 && ((uintptr_t)p & 7); len--)
+		crc = _mm_crc32_u8(crc, *p++);
+#if defined(_M_X64) || defined(__x86_64__)
+	{
+		uint64_t crc64 = crc;
+		for (; len >= 8; p += 8, len -= 8)
+			crc64 = _mm_crc32_u64(crc64, *(const uint64_t *)p);
+		crc = (uint32_t)crc64;
+	}
+#endif
+	for (; len >= 4; p += 4, len -= 4)
+		crc = _mm_crc32_u32(crc, *(const uint32_t *)p);
+	for (; len > 0; len--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+
+static int crc32c_hw_available(void)
+{
+	unsigned int regs[4];
+
+#if defined(_MSC_VER)
+	__cpuid((int *)regs, 1);
+#else
+	if (!__get_cpuid(1, &regs[0], &regs[1], &regs[2], &regs[3]))
+		return 0;
+#endif
+	return (regs[2] & (1 << 20)) != 0;	/* SSE4.2 */
+}
+#elif defined(CRC32C_ARM64)
+static uint32_t crc32c_le_hw(uint32_t crc, unsigned char const *p, size_t len)
+{
+	for (; len > 0 && ((uintptr_t)p & 7); len--)
+		crc = __crc32cb(crc, *p++);
+	for (; len >= 8; p += 8, len -= 8)
+		crc = __crc32cd(crc, *(const uint64_t *)p);
+	for (; len > 0; len--)
+		crc = __crc32cb(crc, *p++);
+	return crc;
+}
+
+/* The CRC32 instructions are mandatory for Windows on ARM64 */
+static int crc32c_hw_available(void)
+{
+	return 1;
+}
+#endif
+
+uint32_t ext2fs_crc32c_le(uint32_t crc, unsigned char const *p, size_t len)
+{
+	static uint32_t (*crc32c_le_impl)(uint32_t, unsigned char const *, size_t) = NULL;
+
+	if (crc32c_le_impl == NULL) {
+#if defined(CRC32C_X86) || defined(CRC32C_ARM64)
+		crc32c_le_impl = crc32c_hw_available() ? crc32c_le_hw : crc32c_le_sw;
+#else
+		crc32c_le_impl = crc32c_le_sw;
+#endif
+	}
+	return crc32c_le_impl(crc, p, len);
+}
+
 /**
  * crc32_be() - Calculate bitwise big-endian Ethernet AUTODIN II CRC32
  * @crc: seed value for computation.  ~0 for Ethernet, sometimes 0 for
@@ -260,6 +260,90 @@ static blk64_t get_midpoint_journal_block(ext2_filsys fs)
 	return ext2fs_group_first_block2(fs, group);
 }
 
+/*
+ * Without extents, ext2fs_fallocate() maps the journal one block at a time,
+ * through the block map, which is very slow for large journals. Instead,
+ * allocate a single contiguous range for the journal and its indirect
+ * blocks, laid out as the block map would (each indirect block ahead of the
+ * data it maps), zero it all at once, and fill the block map directly.
+ * Returns EXT2_ET_OP_NOT_SUPPORTED if the caller should use the slow path.
+ */
+static errcode_t write_journal_indirect(ext2_filsys fs,
+					struct ext2_inode *inode,
+					blk_t num_blocks, blk64_t goal,
+					int flags)
+{
+	blk_t		apb = EXT2_ADDR_PER_BLOCK(fs->super);
+	blk_t		i, j, nb_meta = 0;
+	blk64_t		start, p, ind_blk = 0, dind_blk = 0;
+	__u32		*ind = NULL, *dind = NULL;
+	errcode_t	retval;
+
+	/* Triple indirect journals only exist with 1 KB blocks */
+	if ((num_blocks > EXT2_NDIR_BLOCKS + apb + (blk64_t) apb * apb) ||
+	    (ext2fs_blocks_count(fs->super) > 0xffffffffULL))
+		return EXT2_ET_OP_NOT_SUPPORTED;
+	if (num_blocks > EXT2_NDIR_BLOCKS)
+		nb_meta++;
+	if (num_blocks > EXT2_NDIR_BLOCKS + apb)
+		nb_meta += 1 + ext2fs_div_ceil(num_blocks -
+					       EXT2_NDIR_BLOCKS - apb, apb);
+
+	retval = ext2fs_get_memzero(2 * fs->blocksize, &ind);
+	if (retval)
+		return retval;
+	dind = ind + apb;
+	retval = ext2fs_alloc_range(fs, (flags & EXT2_MKJOURNAL_LAZYINIT) ? 0 :
+				    EXT2_ALLOCRANGE_ZERO_BLOCKS, goal,
+				    num_blocks + nb_meta, &start);
+	/* No contiguous range large enough => do it the slow way */
+	if (retval == EXT2_ET_BLOCK_ALLOC_FAIL)
+		retval = EXT2_ET_OP_NOT_SUPPORTED;
+	if (retval)
+		goto out;
+
+	for (i = 0, p = start; i < num_blocks; i++) {
+		if (i < EXT2_NDIR_BLOCKS) {
+			inode->i_block[i] = (__u32) p++;
+			continue;
+		}
+		j = i - EXT2_NDIR_BLOCKS;
+		if (j >= apb) {
+			j -= apb;
+			if (j == 0)
+				inode->i_block[EXT2_DIND_BLOCK] =
+					(__u32) (dind_blk = p++);
+			if (j % apb == 0) {
+				ind_blk = p++;
+				dind[j / apb] = ext2fs_cpu_to_le32((__u32) ind_blk);
+			}
+		} else if (j == 0) {
+			inode->i_block[EXT2_IND_BLOCK] = (__u32) (ind_blk = p++);
+		}
+		ind[j % apb] = ext2fs_cpu_to_le32((__u32) p++);
+		if ((j % apb == apb - 1) || (i == num_blocks - 1)) {
+			retval = io_channel_write_blk64(fs->io, ind_blk, 1, ind);
+			if (retval)
+				goto out;
+			memset(ind, 0, fs->blocksize);
+			/* For Rufus usage */
+			retval = ext2fs_print_progress(i, num_blocks);
+			if (retval)
+				goto out;
+		}
+	}
+	if (dind_blk) {
+		retval = io_channel_write_blk64(fs->io, dind_blk, 1, dind);
+		if (retval)
+			goto out;
+	}
+	retval = ext2fs_iblk_set(fs, inode, num_blocks + nb_meta);
+
+out:
+	ext2fs_free_mem(&ind);
+	return retval;
+}
+
 /*
  * This function creates a journal using direct I/O routines.
  */
@@ -305,8 +389,13 @@ static errcode_t write_journal_inode(ext2_filsys fs, ext2_ino_t journal_ino,
 	if (retval)
 		goto out2;
 
-	retval = ext2fs_fallocate(fs, falloc_flags, journal_ino,
-				  &inode, goal, 0, num_blocks);
+	retval = EXT2_ET_OP_NOT_SUPPORTED;
+	if (!(inode.i_flags & EXT4_EXTENTS_FL))
+		retval = write_journal_indirect(fs, &inode, num_blocks, goal,
+						flags);
+	if (retval == EXT2_ET_OP_NOT_SUPPORTED)
+		retval = ext2fs_fallocate(fs, falloc_flags, journal_ino,
+					  &inode, goal, 0, num_blocks);
 	if (retval)
 		goto out2;
 
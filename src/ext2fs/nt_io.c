@@ -1,7 +1,10 @@
 /*
  * nt_io.c --- This is the Nt I/O interface to the I/O manager.
  *
- * Implements a one-block write-through cache.
+ * Implements a write-back block cache, with dirty blocks sorted and merged into
+ * large writes when flushed, and read-ahead for sequential reads. Writes are
+ * queued, with several of them in flight at once, and only waited for when they
+ * overlap a later request, or at flush time.
  *
  * Copyright (C) 1993, 1994, 1995 Theodore Ts'o.
  * Copyright (C) 1998 Andrey Shedel <andreys@ns.cr.cyco.com>
@@ -28,7 +31,10 @@
 #include "config.h"
 #include "ext2fs.h"
 #include "rufus.h"
+#include "drive.h"
+#include "missing.h"
 #include "msapi_utf8.h"
+#include "winio.h"
 
 extern char* NtStatusError(NTSTATUS Status);
 static DWORD LastWinError = 0;
@@ -36,9 +42,6 @@ static DWORD LastWinError = 0;
 PF_TYPE_DECL(NTAPI, ULONG, RtlNtStatusToDosError, (NTSTATUS));
 PF_TYPE_DECL(NTAPI, NTSTATUS, NtClose, (HANDLE));
 PF_TYPE_DECL(NTAPI, NTSTATUS, NtOpenFile, (PHANDLE, ACCESS_MASK, POBJECT_ATTRIBUTES, PIO_STATUS_BLOCK, ULONG, ULONG));
-PF_TYPE_DECL(NTAPI, NTSTATUS, NtFlushBuffersFile, (HANDLE, PIO_STATUS_BLOCK));
-PF_TYPE_DECL(NTAPI, NTSTATUS, NtReadFile, (HANDLE, HANDLE, PIO_APC_ROUTINE, PVOID, PIO_STATUS_BLOCK, PVOID, ULONG, PLARGE_INTEGER, PULONG));
-PF_TYPE_DECL(NTAPI, NTSTATUS, NtWriteFile, (HANDLE, HANDLE, PIO_APC_ROUTINE, PVOID, PIO_STATUS_BLOCK, PVOID, ULONG, PLARGE_INTEGER, PULONG));
 PF_TYPE_DECL(NTAPI, NTSTATUS, NtDeviceIoControlFile, (HANDLE, HANDLE, PIO_APC_ROUTINE, PVOID, PIO_STATUS_BLOCK, ULONG, PVOID, ULONG, PVOID, ULONG));
 PF_TYPE_DECL(NTAPI, NTSTATUS, NtFsControlFile, (HANDLE, HANDLE, PIO_APC_ROUTINE, PVOID, PIO_STATUS_BLOCK, ULONG, PVOID, ULONG, PVOID, ULONG));
 PF_TYPE_DECL(NTAPI, NTSTATUS, NtDelayExecution, (BOOLEAN, PLARGE_INTEGER));
@@ -53,16 +56,62 @@ PF_TYPE_DECL(NTAPI, NTSTATUS, NtDelayExecution, (BOOLEAN, PLARGE_INTEGER));
 
 #define EXT2_ET_MAGIC_NT_IO_CHANNEL         0x10ed
 
+// Default cache and read-ahead sizes, which can be changed with the "cache_size"
+// and "readahead" options (in bytes, where a cache size of 0 disables the cache)
+#define NT_CACHE_SIZE                       (32 * 1024 * 1024)
+#define NT_READAHEAD_SIZE                   (1 * 1024 * 1024)
+// Largest I/O we issue when merging dirty blocks. Requests larger than this bypass the cache.
+#define NT_MAX_IO_SIZE                      (4 * 1024 * 1024)
+#define NT_MIN_CACHE_BLOCKS                 16
+// Number of writes we keep in flight, which can be changed with the "queue_depth" option
+// (where a depth of 0 makes all the writes synchronous)
+#define NT_QUEUE_DEPTH                      4
+#define NT_CACHE_NONE                       0xffffffff
+
+typedef struct {
+    __u64   block;
+    __u32   hash_next;
+    __u32   lru_prev;
+    __u32   lru_next;
+    BOOLEAN valid;
+    BOOLEAN dirty;
+} NT_CACHE_ENTRY;
+
+typedef struct {
+    __u64   block;
+    __u32   index;
+} NT_DIRTY_BLOCK;
+
 // Private data block
 typedef struct _NT_PRIVATE_DATA {
     int     magic;
     HANDLE  handle;
     int     flags;
-    char*   buffer;
-    __u32   buffer_block_number;
-    ULONG   buffer_size;
     BOOLEAN read_only;
     BOOLEAN written;
+    // Block cache
+    NT_CACHE_ENTRY* cache;
+    char*   cache_data;
+    __u32*  cache_hash;
+    NT_DIRTY_BLOCK* dirty_list;
+    __u32   cache_count;
+    __u32   cache_hash_mask;
+    __u32   lru_head;               // Most recently used
+    __u32   lru_tail;               // Least recently used
+    __u32   nb_dirty;
+    ULONG   cache_size;
+    ULONG   readahead_size;
+    char*   flush_buffer;
+    char*   read_buffer;
+    __u64   next_read_block;        // Used to detect sequential reads
+    // Asynchronous writes
+    HANDLE  queue;
+    __u32   queue_depth;
+    __u32   next_slot;
+    char*   slot_buffer[MAX_ASYNC_QUEUE_DEPTH];
+    __u64   slot_offset[MAX_ASYNC_QUEUE_DEPTH];
+    ULONG   slot_size[MAX_ASYNC_QUEUE_DEPTH];  // 0 if the slot is free
+    errcode_t async_error;          // From a write that failed after we returned
     // Used by Rufus
     __u64   offset;
     __u64   size;
@@ -80,6 +129,9 @@ static errcode_t nt_read_blk64(io_channel channel, unsigned long long block, int
 static errcode_t nt_write_blk(io_channel channel, unsigned long block, int count, const void *data);
 static errcode_t nt_write_blk64(io_channel channel, unsigned long long block, int count, const void* data);
 static errcode_t nt_flush(io_channel channel);
+static errcode_t nt_set_option(io_channel channel, const char *option, const char *arg);
+static errcode_t nt_discard(io_channel channel, unsigned long long block, unsigned long long count);
+static errcode_t nt_zeroout(io_channel channel, unsigned long long block, unsigned long long count);
 
 struct struct_io_manager struct_nt_manager = {
 	.magic		= EXT2_ET_MAGIC_IO_MANAGER,
@@ -91,7 +143,10 @@ struct struct_io_manager struct_nt_manager = {
 	.read_blk64	= nt_read_blk64,
 	.write_blk	= nt_write_blk,
 	.write_blk64	= nt_write_blk64,
-	.flush		= nt_flush
+	.flush		= nt_flush,
+	.set_option	= nt_set_option,
+	.discard	= nt_discard,
+	.zeroout	= nt_zeroout
 };
 
 io_manager nt_io_manager = &struct_nt_manager;
@@ -244,13 +299,6 @@ static NTSTATUS _OpenDriveLetter(IN CHAR Letter, IN BOOLEAN ReadOnly, OUT PHANDL
 	return _OpenNtName(Buffer, ReadOnly, Handle, OpenedReadonly);
 }
 
-static __inline NTSTATUS _FlushDrive(IN HANDLE Handle)
-{
-	IO_STATUS_BLOCK IoStatusBlock;
-	PF_INIT(NtFlushBuffersFile, NtDll);
-	return (pfNtFlushBuffersFile == NULL) ? STATUS_DLL_NOT_FOUND : pfNtFlushBuffersFile(Handle, &IoStatusBlock);
-}
-
 
 static __inline NTSTATUS _LockDrive(IN HANDLE Handle)
 {
@@ -387,29 +435,11 @@ static BOOLEAN _Ext2OpenDevice(IN PCSTR Name, IN BOOLEAN ReadOnly, OUT PHANDLE H
 
 static BOOLEAN _BlockIo(IN HANDLE Handle, IN LARGE_INTEGER Offset, IN ULONG Bytes, IN OUT PCHAR Buffer, IN BOOLEAN Read, OUT errcode_t *Errno OPTIONAL)
 {
-	IO_STATUS_BLOCK IoStatusBlock;
-	NTSTATUS Status = STATUS_DLL_NOT_FOUND;
-	PF_INIT_OR_OUT(NtReadFile, NtDll);
-	PF_INIT_OR_OUT(NtWriteFile, NtDll);
-
-	// Should be aligned
-	assert((Bytes % 512) == 0);
-	assert((Offset.LowPart % 512) == 0);
-
 	LastWinError = 0;
-	// Perform io
-	if(Read) {
-		Status = pfNtReadFile(Handle, NULL, NULL, NULL,
-			&IoStatusBlock, Buffer, Bytes, &Offset, NULL);
-	} else	{
-		Status = pfNtWriteFile(Handle, NULL, NULL, NULL,
-			&IoStatusBlock, Buffer, Bytes, &Offset, NULL);
-	}
-
-out:
-	if (!NT_SUCCESS(Status)) {
+	// The request goes through the common block layer, which also checks the alignment
+	if (!BlockIo(Handle, !Read, Buffer, Bytes, Offset.QuadPart, 0, NULL, NULL)) {
 		if (ARGUMENT_PRESENT(Errno))
-			*Errno = _MapNtStatus(Status);
+			*Errno = _MapDosError(GetLastError());
 		return FALSE;
 	}
 
@@ -438,6 +468,331 @@ static BOOLEAN _SetPartType(IN HANDLE Handle, IN UCHAR Type)
 						  IOCTL_DISK_SET_PARTITION_INFO, &Type, sizeof(Type), NULL, 0));
 }
 
+//
+// Block cache
+//
+static void _CacheFree(PNT_PRIVATE_DATA nt_data)
+{
+	free(nt_data->cache);
+	_mm_free(nt_data->cache_data);
+	free(nt_data->cache_hash);
+	free(nt_data->dirty_list);
+	nt_data->cache = NULL;
+	nt_data->cache_data = NULL;
+	nt_data->cache_hash = NULL;
+	nt_data->dirty_list = NULL;
+	nt_data->cache_count = 0;
+	nt_data->nb_dirty = 0;
+	nt_data->lru_head = NT_CACHE_NONE;
+	nt_data->lru_tail = NT_CACHE_NONE;
+}
+
+static errcode_t _CacheAlloc(PNT_PRIVATE_DATA nt_data, int block_size)
+{
+	__u32 i, count, hash_size;
+
+	_CacheFree(nt_data);
+	if (nt_data->cache_size == 0)
+		return 0;
+	count = max(nt_data->cache_size / block_size, NT_MIN_CACHE_BLOCKS);
+	for (hash_size = 1; hash_size < 2 * count; hash_size <<= 1);
+
+	nt_data->cache = (NT_CACHE_ENTRY*)calloc(count, sizeof(NT_CACHE_ENTRY));
+	nt_data->cache_data = (char*)_mm_malloc((size_t)count * block_size, 4096);
+	nt_data->cache_hash = (__u32*)malloc(hash_size * sizeof(__u32));
+	nt_data->dirty_list = (NT_DIRTY_BLOCK*)malloc(count * sizeof(NT_DIRTY_BLOCK));
+	if ((nt_data->cache == NULL) || (nt_data->cache_data == NULL) ||
+		(nt_data->cache_hash == NULL) || (nt_data->dirty_list == NULL)) {
+		_CacheFree(nt_data);
+		return ENOMEM;
+	}
+	memset(nt_data->cache_hash, 0xff, hash_size * sizeof(__u32));
+	nt_data->cache_hash_mask = hash_size - 1;
+	nt_data->cache_count = count;
+	// All the entries start in the LRU list, unused
+	for (i = 0; i < count; i++) {
+		nt_data->cache[i].hash_next = NT_CACHE_NONE;
+		nt_data->cache[i].lru_prev = (i == 0) ? NT_CACHE_NONE : i - 1;
+		nt_data->cache[i].lru_next = (i == count - 1) ? NT_CACHE_NONE : i + 1;
+	}
+	nt_data->lru_head = 0;
+	nt_data->lru_tail = count - 1;
+	return 0;
+}
+
+static __inline __u32 _CacheHash(PNT_PRIVATE_DATA nt_data, __u64 block)
+{
+	return (__u32)((block * 0x9E3779B97F4A7C15ULL) >> 32) & nt_data->cache_hash_mask;
+}
+
+static __inline char* _CacheData(io_channel channel, __u32 i)
+{
+	return &((PNT_PRIVATE_DATA)channel->private_data)->cache_data[(size_t)i * channel->block_size];
+}
+
+static __u32 _CacheLookup(PNT_PRIVATE_DATA nt_data, __u64 block)
+{
+	__u32 i;
+
+	if (nt_data->cache_count == 0)
+		return NT_CACHE_NONE;
+	for (i = nt_data->cache_hash[_CacheHash(nt_data, block)]; i != NT_CACHE_NONE; i = nt_data->cache[i].hash_next) {
+		if (nt_data->cache[i].block == block)
+			return i;
+	}
+	return NT_CACHE_NONE;
+}
+
+// Move an entry to the head of the LRU list
+static void _CacheTouch(PNT_PRIVATE_DATA nt_data, __u32 i)
+{
+	NT_CACHE_ENTRY* e = &nt_data->cache[i];
+
+	if (nt_data->lru_head == i)
+		return;
+	if (e->lru_next != NT_CACHE_NONE)
+		nt_data->cache[e->lru_next].lru_prev = e->lru_prev;
+	else
+		nt_data->lru_tail = e->lru_prev;
+	nt_data->cache[e->lru_prev].lru_next = e->lru_next;
+	e->lru_prev = NT_CACHE_NONE;
+	e->lru_next = nt_data->lru_head;
+	nt_data->cache[nt_data->lru_head].lru_prev = i;
+	nt_data->lru_head = i;
+}
+
+static void _CacheUnhash(PNT_PRIVATE_DATA nt_data, __u32 i)
+{
+	__u32* p = &nt_data->cache_hash[_CacheHash(nt_data, nt_data->cache[i].block)];
+
+	while (*p != i)
+		p = &nt_data->cache[*p].hash_next;
+	*p = nt_data->cache[i].hash_next;
+	nt_data->cache[i].valid = FALSE;
+}
+
+static int _DirtyBlockCmp(const void* a, const void* b)
+{
+	__u64 ba = ((const NT_DIRTY_BLOCK*)a)->block, bb = ((const NT_DIRTY_BLOCK*)b)->block;
+
+	return (ba < bb) ? -1 : ((ba > bb) ? 1 : 0);
+}
+
+//
+// Asynchronous writes
+//
+// Reap the write from a slot. If it failed, we retry it synchronously and, if that fails too,
+// keep the error so that it gets reported by the next flush.
+static void _AsyncReap(io_channel channel, PNT_PRIVATE_DATA nt_data, __u32 slot)
+{
+	LARGE_INTEGER offset;
+	DWORD size;
+	errcode_t r = 0;
+
+	if (nt_data->slot_size[slot] == 0)
+		return;
+	if (!WaitAsyncQueue(nt_data->queue, slot, DRIVE_ACCESS_TIMEOUT, &size) || (size != nt_data->slot_size[slot])) {
+		CancelAsyncRequest(nt_data->queue, slot);
+		offset.QuadPart = nt_data->slot_offset[slot];
+		if (!_RawWrite(nt_data->handle, offset, nt_data->slot_size[slot], nt_data->slot_buffer[slot], &r) &&
+			channel->write_error)
+			r = (channel->write_error)(channel, (unsigned long)((nt_data->slot_offset[slot] - nt_data->offset) /
+				channel->block_size), nt_data->slot_size[slot] / channel->block_size,
+				nt_data->slot_buffer[slot], nt_data->slot_size[slot], 0, r);
+		if (r && !nt_data->async_error)
+			nt_data->async_error = r;
+	}
+	nt_data->slot_size[slot] = 0;
+}
+
+// Wait for the writes in flight that overlap a device range, so that the requests that follow
+// are not reordered with them. A size of 0 waits for all of them, and acts as a barrier, that
+// reports the errors from all the writes that completed since the previous one.
+static errcode_t _AsyncWait(io_channel channel, PNT_PRIVATE_DATA nt_data, __u64 offset, __u64 size)
+{
+	errcode_t errcode;
+	__u32 i;
+
+	if (nt_data->queue != NULL) {
+		for (i = 0; i < nt_data->queue_depth; i++) {
+			if ((size == 0) || ((nt_data->slot_offset[i] < offset + size) &&
+				(offset < nt_data->slot_offset[i] + nt_data->slot_size[i])))
+				_AsyncReap(channel, nt_data, i);
+		}
+	}
+	if (size != 0)
+		return 0;
+	errcode = nt_data->async_error;
+	nt_data->async_error = 0;
+	return errcode;
+}
+
+static void _AsyncFree(io_channel channel, PNT_PRIVATE_DATA nt_data)
+{
+	__u32 i;
+
+	if (nt_data->queue == NULL)
+		return;
+	CloseAsyncQueue(nt_data->queue);
+	nt_data->queue = NULL;
+	for (i = 0; i < MAX_ASYNC_QUEUE_DEPTH; i++) {
+		safe_free_io_buffer(nt_data->slot_buffer[i]);
+		nt_data->slot_size[i] = 0;
+	}
+	nt_data->next_slot = 0;
+}
+
+// Return the buffer to fill for the next asynchronous write, which is then issued with
+// _AsyncIssue(), or NULL if the write must be issued synchronously. Either way, the writes
+// in flight that overlap the range are waited for first.
+static char* _AsyncBuffer(io_channel channel, PNT_PRIVATE_DATA nt_data, __u64 offset, ULONG size)
+{
+	__u32 slot;
+
+	if ((nt_data->queue == NULL) && (nt_data->queue_depth != 0)) {
+		nt_data->queue = BlockCreateQueue(nt_data->handle, GENERIC_READ | GENERIC_WRITE, nt_data->queue_depth, NULL);
+		// Not worth the extra copies if the requests are going to complete synchronously
+		if ((nt_data->queue != NULL) && ((ASYNC_QUEUE*)nt_data->queue)->bSync)
+			_AsyncFree(channel, nt_data);
+		if (nt_data->queue == NULL)
+			nt_data->queue_depth = 0;
+	}
+	_AsyncWait(channel, nt_data, offset, size);
+	if ((nt_data->queue == NULL) || (size > NT_MAX_IO_SIZE))
+		return NULL;
+	slot = nt_data->next_slot;
+	_AsyncReap(channel, nt_data, slot);
+	if (nt_data->slot_buffer[slot] == NULL)
+		nt_data->slot_buffer[slot] = AllocIoBuffer(NT_MAX_IO_SIZE);
+	return nt_data->slot_buffer[slot];
+}
+
+// Issue the write that was set up with _AsyncBuffer(), or perform it synchronously if it can't
+// be queued. Once this returns, the caller's buffer can be modified.
+static BOOLEAN _AsyncIssue(io_channel channel, PNT_PRIVATE_DATA nt_data, __u64 offset, ULONG size, OUT errcode_t* Errno)
+{
+	LARGE_INTEGER li;
+	__u32 slot = nt_data->next_slot;
+
+	if (!IssueAsyncQueue(nt_data->queue, slot, TRUE, nt_data->slot_buffer[slot], size, offset)) {
+		li.QuadPart = offset;
+		return _RawWrite(nt_data->handle, li, size, nt_data->slot_buffer[slot], Errno);
+	}
+	nt_data->slot_offset[slot] = offset;
+	nt_data->slot_size[slot] = size;
+	nt_data->next_slot = (slot + 1) % nt_data->queue_depth;
+	*Errno = 0;
+	return TRUE;
+}
+
+// Write all the dirty blocks, sorted, with contiguous runs merged into single writes,
+// that are queued so that the device can process several of them at once
+static errcode_t _CacheFlush(io_channel channel, PNT_PRIVATE_DATA nt_data)
+{
+	__u32 i, j, n, max_run, nb = 0;
+	LARGE_INTEGER offset;
+	errcode_t errcode = 0, r;
+	char *data, *async_data;
+	BOOLEAN success;
+
+	if (nt_data->nb_dirty == 0)
+		return 0;
+	for (i = 0; i < nt_data->cache_count; i++) {
+		if (nt_data->cache[i].dirty) {
+			nt_data->dirty_list[nb].block = nt_data->cache[i].block;
+			nt_data->dirty_list[nb++].index = i;
+		}
+	}
+	qsort(nt_data->dirty_list, nb, sizeof(NT_DIRTY_BLOCK), _DirtyBlockCmp);
+
+	max_run = max(NT_MAX_IO_SIZE / channel->block_size, 1);
+	for (i = 0; i < nb; i += n) {
+		for (n = 1; (i + n < nb) && (n < max_run) &&
+			(nt_data->dirty_list[i + n].block == nt_data->dirty_list[i].block + n); n++);
+		offset.QuadPart = nt_data->dirty_list[i].block * channel->block_size + nt_data->offset;
+		async_data = _AsyncBuffer(channel, nt_data, offset.QuadPart, n * channel->block_size);
+		if ((n == 1) && (async_data == NULL)) {
+			data = _CacheData(channel, nt_data->dirty_list[i].index);
+		} else {
+			data = (async_data != NULL) ? async_data : nt_data->flush_buffer;
+			for (j = 0; j < n; j++)
+				memcpy(&data[(size_t)j * channel->block_size],
+					_CacheData(channel, nt_data->dirty_list[i + j].index), channel->block_size);
+		}
+		if (async_data != NULL)
+			success = _AsyncIssue(channel, nt_data, offset.QuadPart, n * channel->block_size, &r);
+		else
+			success = _RawWrite(nt_data->handle, offset, n * channel->block_size, data, &r);
+		if (!success) {
+			if (channel->write_error)
+				r = (channel->write_error)(channel, (unsigned long)nt_data->dirty_list[i].block, n,
+					data, n * channel->block_size, 0, r);
+			// Keep the blocks dirty if the error wasn't handled
+			if (r) {
+				errcode = r;
+				continue;
+			}
+		}
+		for (j = 0; j < n; j++)
+			nt_data->cache[nt_data->dirty_list[i + j].index].dirty = FALSE;
+		nt_data->nb_dirty -= n;
+	}
+	return errcode;
+}
+
+// Return the cache entry for a block, recycling the least recently used one if needed
+static errcode_t _CacheGet(io_channel channel, PNT_PRIVATE_DATA nt_data, __u64 block, __u32* index)
+{
+	errcode_t errcode;
+	__u32 i, h;
+
+	i = _CacheLookup(nt_data, block);
+	if (i == NT_CACHE_NONE) {
+		i = nt_data->lru_tail;
+		// Write back in bulk, rather than one block at a time, as the cache fills up
+		if (nt_data->cache[i].dirty) {
+			errcode = _CacheFlush(channel, nt_data);
+			if (errcode)
+				return errcode;
+		}
+		if (nt_data->cache[i].valid)
+			_CacheUnhash(nt_data, i);
+		h = _CacheHash(nt_data, block);
+		nt_data->cache[i].block = block;
+		nt_data->cache[i].valid = TRUE;
+		nt_data->cache[i].dirty = FALSE;
+		nt_data->cache[i].hash_next = nt_data->cache_hash[h];
+		nt_data->cache_hash[h] = i;
+	}
+	_CacheTouch(nt_data, i);
+	*index = i;
+	return 0;
+}
+
+// Copy the cached part of a range of blocks to (read) or from (write) a buffer
+static void _CacheOverlay(io_channel channel, PNT_PRIVATE_DATA nt_data, __u64 block, ULONG size, char* buf, BOOLEAN read)
+{
+	ULONG pos, len;
+	__u32 i;
+
+	for (pos = 0; pos < size; pos += channel->block_size, block++) {
+		i = _CacheLookup(nt_data, block);
+		if (i == NT_CACHE_NONE)
+			continue;
+		len = min(size - pos, (ULONG)channel->block_size);
+		if (read) {
+			memcpy(&buf[pos], _CacheData(channel, i), len);
+		} else {
+			memcpy(_CacheData(channel, i), &buf[pos], len);
+			// A full block that was just written directly is no longer dirty
+			if ((len == (ULONG)channel->block_size) && nt_data->cache[i].dirty) {
+				nt_data->cache[i].dirty = FALSE;
+				nt_data->nb_dirty--;
+			}
+		}
+	}
+}
+
 //
 // Interface functions.
 // Is_mounted is set to 1 if the device is mounted, 0 otherwise
@@ -519,11 +874,19 @@ static errcode_t nt_open(const char *name, int flags, io_channel *channel)
 		goto out;
 	}
 
-	nt_data->buffer = malloc(EXT2_MIN_BLOCK_SIZE);
-	if (nt_data->buffer == NULL) {
+	nt_data->cache_size = NT_CACHE_SIZE;
+	nt_data->readahead_size = NT_READAHEAD_SIZE;
+	nt_data->queue_depth = NT_QUEUE_DEPTH;
+	nt_data->next_read_block = ~0ULL;
+	nt_data->flush_buffer = _mm_malloc(NT_MAX_IO_SIZE, 4096);
+	nt_data->read_buffer = _mm_malloc(NT_MAX_IO_SIZE, 4096);
+	if ((nt_data->flush_buffer == NULL) || (nt_data->read_buffer == NULL)) {
 		errcode = ENOMEM;
 		goto out;
 	}
+	errcode = _CacheAlloc(nt_data, EXT2_MIN_BLOCK_SIZE);
+	if (errcode)
+		goto out;
 
 	// Initialize data
 	io->magic = EXT2_ET_MAGIC_IO_CHANNEL;
@@ -533,8 +896,6 @@ static errcode_t nt_open(const char *name, int flags, io_channel *channel)
 	io->refcount = 1;
 
 	nt_data->magic = EXT2_ET_MAGIC_NT_IO_CHANNEL;
-	nt_data->buffer_block_number = 0xffffffff;
-	nt_data->buffer_size = EXT2_MIN_BLOCK_SIZE;
 	io->private_data = nt_data;
 
 	// Open the device
@@ -545,6 +906,9 @@ static errcode_t nt_open(const char *name, int flags, io_channel *channel)
 		goto out;
 	}
 
+	if (TrimReadsZeroes(nt_data->handle))
+		io->flags |= CHANNEL_FLAGS_DISCARD_ZEROES;
+
 	// Done
 	*channel = io;
 
@@ -560,7 +924,9 @@ out:
 				_UnlockDrive(nt_data->handle);
 				_CloseDisk(nt_data->handle);
 			}
-			free(nt_data->buffer);
+			_CacheFree(nt_data);
+			_mm_free(nt_data->flush_buffer);
+			_mm_free(nt_data->read_buffer);
 			free(nt_data);
 		}
 	}
@@ -571,6 +937,7 @@ out:
 static errcode_t nt_close(io_channel channel)
 {
 	PNT_PRIVATE_DATA nt_data = NULL;
+	errcode_t errcode = 0, r;
 
 	if (channel == NULL)
 		return 0;
@@ -582,91 +949,247 @@ static errcode_t nt_close(io_channel channel)
 	if (--channel->refcount > 0)
 		return 0;
 
+	// Don't lose the blocks that haven't been written back yet
+	errcode = _CacheFlush(channel, nt_data);
+	r = _AsyncWait(channel, nt_data, 0, 0);
+	if (!errcode)
+		errcode = r;
+	_AsyncFree(channel, nt_data);
+
 	free(channel->name);
 	free(channel);
 
 	if (nt_data != NULL) {
 		if (nt_data->handle != NULL)
 			CloseHandle(nt_data->handle);
-		free(nt_data->buffer);
+		_CacheFree(nt_data);
+		_mm_free(nt_data->flush_buffer);
+		_mm_free(nt_data->read_buffer);
 		free(nt_data);
 	}
 
-	return 0;
+	return errcode;
 }
 
 static errcode_t nt_set_blksize(io_channel channel, int blksize)
 {
 	PNT_PRIVATE_DATA nt_data = NULL;
+	errcode_t errcode;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	nt_data = (PNT_PRIVATE_DATA) channel->private_data;
 	EXT2_CHECK_MAGIC(nt_data, EXT2_ET_MAGIC_NT_IO_CHANNEL);
 
 	if (channel->block_size != blksize) {
+		// The cached blocks must be written with the block size they were cached with,
+		// and the writes in flight must complete with it, in case one of them fails
+		errcode = _CacheFlush(channel, nt_data);
+		if (!errcode)
+			errcode = _AsyncWait(channel, nt_data, 0, 0);
+		if (errcode)
+			return errcode;
 		channel->block_size = blksize;
-
-		free(nt_data->buffer);
-		nt_data->buffer_block_number = 0xffffffff;
-		nt_data->buffer_size = channel->block_size;
-		assert((nt_data->buffer_size % 512) == 0);
-
-		nt_data->buffer = malloc(nt_data->buffer_size);
-		if (nt_data->buffer == NULL)
-			return ENOMEM;
+		assert((blksize % 512) == 0);
+		nt_data->next_read_block = ~0ULL;
+		return _CacheAlloc(nt_data, blksize);
 	}
 
 	return 0;
 }
 
-static errcode_t nt_read_blk64(io_channel channel, unsigned long long block, int count, void *buf)
+static errcode_t nt_set_option(io_channel channel, const char *option, const char *arg)
 {
-	PVOID read_buffer;
-	ULONG read_size;
-	ULONG size;
-	LARGE_INTEGER offset;
 	PNT_PRIVATE_DATA nt_data = NULL;
-	errcode_t errcode = 0;
+	unsigned long long size;
+	errcode_t errcode;
+	char *end;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	nt_data = (PNT_PRIVATE_DATA) channel->private_data;
 	EXT2_CHECK_MAGIC(nt_data, EXT2_ET_MAGIC_NT_IO_CHANNEL);
 
-	// If it's in the cache, use it!
-	if ((count == 1) && (block == nt_data->buffer_block_number) &&
-	    (nt_data->buffer_block_number != 0xffffffff)) {
-		memcpy(buf, nt_data->buffer, channel->block_size);
+	if (arg == NULL)
+		return EXT2_ET_INVALID_ARGUMENT;
+	size = strtoull(arg, &end, 0);
+	if ((*end != 0) || (size > 0x80000000ULL))
+		return EXT2_ET_INVALID_ARGUMENT;
+
+	if (strcmp(option, "cache_size") == 0) {
+		errcode = _CacheFlush(channel, nt_data);
+		if (errcode)
+			return errcode;
+		nt_data->cache_size = (ULONG)size;
+		return _CacheAlloc(nt_data, channel->block_size);
+	}
+	if (strcmp(option, "readahead") == 0) {
+		nt_data->readahead_size = (ULONG)min(size, NT_MAX_IO_SIZE);
 		return 0;
 	}
+	if (strcmp(option, "queue_depth") == 0) {
+		if (size > MAX_ASYNC_QUEUE_DEPTH)
+			return EXT2_ET_INVALID_ARGUMENT;
+		errcode = _AsyncWait(channel, nt_data, 0, 0);
+		_AsyncFree(channel, nt_data);
+		nt_data->queue_depth = (__u32)size;
+		return errcode;
+	}
+	return EXT2_ET_INVALID_ARGUMENT;
+}
 
-	size = (count < 0) ? (ULONG)(-count) : (ULONG)(count * channel->block_size);
+static errcode_t nt_discard(io_channel channel, unsigned long long block, unsigned long long count)
+{
+	PNT_PRIVATE_DATA nt_data = NULL;
+	errcode_t errcode = 0;
+	__u32 i;
 
-	offset.QuadPart = block * channel->block_size + nt_data->offset;
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	nt_data = (PNT_PRIVATE_DATA) channel->private_data;
+	EXT2_CHECK_MAGIC(nt_data, EXT2_ET_MAGIC_NT_IO_CHANNEL);
 
-	// If not fit to the block
-	if (size <= nt_data->buffer_size) {
-		// Update the cache
-		nt_data->buffer_block_number = block;
-		read_buffer = nt_data->buffer;
-		read_size = nt_data->buffer_size;
-	} else {
-		read_size = size;
-		read_buffer = buf;
-		assert((read_size % channel->block_size) == 0);
+	if (nt_data->read_only)
+		return EACCES;
+
+	// Whatever we cached for these blocks, including pending writes, is meant to be gone
+	for (i = 0; i < nt_data->cache_count; i++) {
+		if (nt_data->cache[i].valid && (nt_data->cache[i].block >= block) && (nt_data->cache[i].block < block + count)) {
+			if (nt_data->cache[i].dirty) {
+				nt_data->cache[i].dirty = FALSE;
+				nt_data->nb_dirty--;
+			}
+			_CacheUnhash(nt_data, i);
+		}
 	}
+	nt_data->next_read_block = ~0ULL;
+	_AsyncWait(channel, nt_data, block * channel->block_size + nt_data->offset, count * channel->block_size);
 
-	if (!_RawRead(nt_data->handle, offset, read_size, read_buffer, &errcode)) {
-		if (channel->read_error)
-			return (channel->read_error)(channel, block, count, buf, size, 0, errcode);
-		else
-			return errcode;
+	LastWinError = 0;
+	if (!BlockTrim(nt_data->handle, block * channel->block_size + nt_data->offset, count * channel->block_size))
+		return _MapDosError(GetLastError());
+	nt_data->written = TRUE;
+	// Some devices claim deterministic zeroes after TRIM but don't deliver, and the callers
+	// skip zeroing on our word, so make sure that what we trimmed does read back as zeroes
+	if ((channel->flags & CHANNEL_FLAGS_DISCARD_ZEROES) && !TrimmedRangeReadsZeroes(nt_data->handle,
+		block * channel->block_size + nt_data->offset, count * channel->block_size))
+		channel->flags &= ~CHANNEL_FLAGS_DISCARD_ZEROES;
+
+	return 0;
+}
+
+// Zeroes blocks through the shared zero-fill engine, which can use a TRIM if the device
+// guarantees that trimmed blocks read back as zeroes, or overlapped writes otherwise
+static errcode_t nt_zeroout(io_channel channel, unsigned long long block, unsigned long long count)
+{
+	PNT_PRIVATE_DATA nt_data = NULL;
+	__u32 i;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	nt_data = (PNT_PRIVATE_DATA) channel->private_data;
+	EXT2_CHECK_MAGIC(nt_data, EXT2_ET_MAGIC_NT_IO_CHANNEL);
+
+	if (nt_data->read_only)
+		return EACCES;
+
+	_AsyncWait(channel, nt_data, block * channel->block_size + nt_data->offset, count * channel->block_size);
+	LastWinError = 0;
+	if (!ZeroDriveRange(nt_data->handle, block * channel->block_size + nt_data->offset,
+		count * channel->block_size, (channel->flags & CHANNEL_FLAGS_DISCARD_ZEROES) ? ZF_ALLOW_TRIM : 0, NULL, NULL))
+		return _MapDosError(GetLastError());
+
+	// Keep the cached copies of these blocks in line with what is now on the device
+	for (i = 0; i < nt_data->cache_count; i++) {
+		if (nt_data->cache[i].valid && (nt_data->cache[i].block >= block) && (nt_data->cache[i].block < block + count)) {
+			memset(_CacheData(channel, i), 0, channel->block_size);
+			if (nt_data->cache[i].dirty) {
+				nt_data->cache[i].dirty = FALSE;
+				nt_data->nb_dirty--;
+			}
+		}
 	}
+	nt_data->written = TRUE;
+
+	return 0;
+}
 
-	if (read_buffer != buf) {
-		assert(size <= read_size);
-		memcpy(buf, read_buffer, size);
+static errcode_t nt_read_blk64(io_channel channel, unsigned long long block, int count, void *buf)
+{
+	ULONG size, read_size, pos;
+	ULONG block_size;
+	LARGE_INTEGER offset;
+	PNT_PRIVATE_DATA nt_data = NULL;
+	errcode_t errcode = 0;
+	__u64 b, start, end, ra_end;
+	__u32 i;
+	char* data = (char*)buf;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	nt_data = (PNT_PRIVATE_DATA) channel->private_data;
+	EXT2_CHECK_MAGIC(nt_data, EXT2_ET_MAGIC_NT_IO_CHANNEL);
+
+	block_size = channel->block_size;
+	size = (count < 0) ? (ULONG)(-count) : (ULONG)(count * block_size);
+
+	// Reads that aren't whole blocks, or that are too large, go straight to the device,
+	// with whatever is more recent in the cache copied over.
+	if ((count < 0) || (size > NT_MAX_IO_SIZE) || (nt_data->cache_count == 0)) {
+		offset.QuadPart = block * block_size + nt_data->offset;
+		_AsyncWait(channel, nt_data, offset.QuadPart, size);
+		if (!_RawRead(nt_data->handle, offset, size, data, &errcode)) {
+			if (channel->read_error)
+				return (channel->read_error)(channel, (unsigned long)block, count, buf, size, 0, errcode);
+			else
+				return errcode;
+		}
+		_CacheOverlay(channel, nt_data, block, size, data, TRUE);
+		return 0;
 	}
 
+	end = block + count;
+	for (b = block; b < end; ) {
+		// If it's in the cache, use it!
+		i = _CacheLookup(nt_data, b);
+		if (i != NT_CACHE_NONE) {
+			memcpy(&data[(b - block) * block_size], _CacheData(channel, i), block_size);
+			_CacheTouch(nt_data, i);
+			b++;
+			continue;
+		}
+
+		// Read the whole run of missing blocks, and more if the reads are sequential
+		for (start = b++; (b < end) && (_CacheLookup(nt_data, b) == NT_CACHE_NONE); b++);
+		ra_end = b;
+		if ((start == nt_data->next_read_block) && (nt_data->readahead_size > (b - start) * block_size))
+			ra_end = start + nt_data->readahead_size / block_size;
+		if ((nt_data->size != 0) && (ra_end * block_size > nt_data->size))
+			ra_end = max(b, nt_data->size / block_size);
+		// Only read ahead blocks that we don't have, as the cached ones may be more recent
+		for (pos = (ULONG)(b - start); (start + pos < ra_end) && (_CacheLookup(nt_data, start + pos) == NT_CACHE_NONE); pos++);
+		ra_end = start + pos;
+		offset.QuadPart = start * block_size + nt_data->offset;
+		read_size = (ULONG)((ra_end - start) * block_size);
+		// Blocks that were evicted from the cache may still be on their way to the device
+		_AsyncWait(channel, nt_data, offset.QuadPart, read_size);
+		if ((ra_end > b) && !_RawRead(nt_data->handle, offset, read_size, nt_data->read_buffer, &errcode)) {
+			// Read-ahead is opportunistic, so just retry without it
+			ra_end = b;
+			read_size = (ULONG)((ra_end - start) * block_size);
+		}
+		if ((ra_end == b) && !_RawRead(nt_data->handle, offset, read_size, nt_data->read_buffer, &errcode)) {
+			if (channel->read_error)
+				return (channel->read_error)(channel, (unsigned long)block, count, buf, size, 0, errcode);
+			else
+				return errcode;
+		}
+		for (pos = 0; start + pos / block_size < ra_end; pos += block_size) {
+			errcode = _CacheGet(channel, nt_data, start + pos / block_size, &i);
+			if (errcode)
+				return errcode;
+			memcpy(_CacheData(channel, i), &nt_data->read_buffer[pos], block_size);
+			if (start + pos / block_size < b)
+				memcpy(&data[(start - block) * block_size + pos], &nt_data->read_buffer[pos], block_size);
+		}
+	}
+	nt_data->next_read_block = end;
+
 	return 0;
 }
 
@@ -677,10 +1200,14 @@ static errcode_t nt_read_blk(io_channel channel, unsigned long block, int count,
 
 static errcode_t nt_write_blk64(io_channel channel, unsigned long long block, int count, const void *buf)
 {
-	ULONG write_size;
-	LARGE_INTEGER offset;
+	ULONG write_size, pos, size;
+	LARGE_INTEGER offset, li;
 	PNT_PRIVATE_DATA nt_data = NULL;
 	errcode_t errcode = 0;
+	BOOLEAN success;
+	char* data;
+	__u32 i;
+	int j;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	nt_data = (PNT_PRIVATE_DATA) channel->private_data;
@@ -689,32 +1216,48 @@ static errcode_t nt_write_blk64(io_channel channel, unsigned long long block, in
 	if (nt_data->read_only)
 		return EACCES;
 
-	if (count == 1) {
-		write_size = channel->block_size;
-	} else {
-		nt_data->buffer_block_number = 0xffffffff;
-		if (count < 0)
-			write_size = (ULONG)(-count);
-		else
-			write_size = (ULONG)(count * channel->block_size);
-	}
-
-
+	if (count < 0)
+		write_size = (ULONG)(-count);
+	else
+		write_size = (ULONG)(count * channel->block_size);
 	assert((write_size % 512) == 0);
-	offset.QuadPart = block * channel->block_size + nt_data->offset;
 
-	if (!_RawWrite(nt_data->handle, offset, write_size, buf, &errcode)) {
-		if (channel->write_error)
-			return (channel->write_error)(channel, block, count, buf, write_size, 0, errcode);
-		else
-			return errcode;
-	}
-
-
-	// Stash a copy.
-	if(write_size >= nt_data->buffer_size) {
-		nt_data->buffer_block_number = block;
-		memcpy(nt_data->buffer, buf, nt_data->buffer_size);
+	// Partial and large writes go straight to the device, with the cache updated to match.
+	// Large ones get split, so that several parts can be in flight at once.
+	if ((count < 0) || (write_size > NT_MAX_IO_SIZE) || (nt_data->cache_count == 0)) {
+		offset.QuadPart = block * channel->block_size + nt_data->offset;
+		for (pos = 0; pos < write_size; pos += size) {
+			size = min(write_size - pos, NT_MAX_IO_SIZE);
+			data = _AsyncBuffer(channel, nt_data, offset.QuadPart + pos, size);
+			if (data != NULL) {
+				memcpy(data, &((const char*)buf)[pos], size);
+				success = _AsyncIssue(channel, nt_data, offset.QuadPart + pos, size, &errcode);
+			} else {
+				// Write whatever is left in one go
+				size = write_size - pos;
+				li.QuadPart = offset.QuadPart + pos;
+				_AsyncWait(channel, nt_data, li.QuadPart, size);
+				success = _RawWrite(nt_data->handle, li, size, &((const char*)buf)[pos], &errcode);
+			}
+			if (!success) {
+				if (channel->write_error)
+					return (channel->write_error)(channel, (unsigned long)block, count, buf, write_size, 0, errcode);
+				else
+					return errcode;
+			}
+		}
+		_CacheOverlay(channel, nt_data, block, write_size, (char*)buf, FALSE);
+	} else {
+		for (j = 0; j < count; j++) {
+			errcode = _CacheGet(channel, nt_data, block + j, &i);
+			if (errcode)
+				return errcode;
+			memcpy(_CacheData(channel, i), &((const char*)buf)[(size_t)j * channel->block_size], channel->block_size);
+			if (!nt_data->cache[i].dirty) {
+				nt_data->cache[i].dirty = TRUE;
+				nt_data->nb_dirty++;
+			}
+		}
 	}
 
 	nt_data->written = TRUE;
@@ -730,6 +1273,7 @@ static errcode_t nt_write_blk(io_channel channel, unsigned long block, int count
 static errcode_t nt_flush(io_channel channel)
 {
 	PNT_PRIVATE_DATA nt_data = NULL;
+	errcode_t errcode;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	nt_data = (PNT_PRIVATE_DATA) channel->private_data;
@@ -738,9 +1282,15 @@ static errcode_t nt_flush(io_channel channel)
 	if(nt_data->read_only)
 		return 0;
 
+	// Write back the cache, in as few and as large writes as we can, and wait for all of them
+	errcode = _CacheFlush(channel, nt_data);
+	if (!errcode)
+		errcode = _AsyncWait(channel, nt_data, 0, 0);
+	if (errcode)
+		return errcode;
 
 	// Flush file buffers.
-	_FlushDrive(nt_data->handle);
+	BlockFlush(nt_data->handle);
 
 
 	// Test and correct partition type.
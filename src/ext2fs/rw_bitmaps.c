@@ -28,6 +28,111 @@
 #include "ext2fs.h"
 #include "e2image.h"
 
+/*
+ * Rather than issuing one write per bitmap block, which means thousands of
+ * small scattered writes on large filesystems, the bitmap blocks are staged
+ * in a batch, which is then sorted and submitted as runs of contiguous
+ * blocks. With flex_bg, the bitmaps of a whole flex group are contiguous.
+ */
+#define BITMAP_BATCH_SIZE	(1024 * 1024)
+
+struct bitmap_batch_entry {
+	blk64_t		blk;
+	int		slot;
+	errcode_t	err;
+};
+
+struct bitmap_batch {
+	ext2_filsys	fs;
+	int		size, count;
+	struct bitmap_batch_entry *ent;
+	char		*data;		/* Staged blocks, in the order they were added */
+	char		*run;		/* Staged blocks, sorted by location */
+};
+
+static int bitmap_batch_cmp(const void *a, const void *b)
+{
+	blk64_t ba = ((const struct bitmap_batch_entry *) a)->blk;
+	blk64_t bb = ((const struct bitmap_batch_entry *) b)->blk;
+
+	return (ba < bb) ? -1 : ((ba > bb) ? 1 : 0);
+}
+
+static errcode_t flush_bitmap_batch(struct bitmap_batch *b)
+{
+	ext2_filsys	fs = b->fs;
+	int		i, n;
+
+	qsort(b->ent, b->count, sizeof(struct bitmap_batch_entry),
+	      bitmap_batch_cmp);
+	for (i = 0; i < b->count; i++)
+		memcpy(b->run + (size_t) i * fs->blocksize,
+		       b->data + (size_t) b->ent[i].slot * fs->blocksize,
+		       fs->blocksize);
+	for (i = 0; i < b->count; i += n) {
+		for (n = 1; (i + n < b->count) &&
+			     (b->ent[i + n].blk == b->ent[i].blk + n); n++);
+		if (io_channel_write_blk64(fs->io, b->ent[i].blk, n,
+					   b->run + (size_t) i * fs->blocksize))
+			return b->ent[i].err;
+	}
+	b->count = 0;
+	return 0;
+}
+
+static errcode_t add_bitmap_block(struct bitmap_batch *b, blk64_t blk,
+				  const char *buf, errcode_t err)
+{
+	errcode_t	retval;
+
+	if (b->count >= b->size) {
+		retval = flush_bitmap_batch(b);
+		if (retval)
+			return retval;
+	}
+	memcpy(b->data + (size_t) b->count * b->fs->blocksize, buf,
+	       b->fs->blocksize);
+	b->ent[b->count].blk = blk;
+	b->ent[b->count].slot = b->count;
+	b->ent[b->count].err = err;
+	b->count++;
+	return 0;
+}
+
+/*
+ * A group whose block bitmap only has its own superblock, descriptors and
+ * metadata in use is exactly what the kernel (and read_bitmaps() below)
+ * rebuild for BLOCK_UNINIT groups, so its bitmap doesn't need writing.
+ * As with ext2fs_initialize(), the first and last groups are excluded.
+ */
+static int block_bitmap_can_uninit(ext2_filsys fs, dgrp_t group,
+				   const char *bitmap, int nbytes)
+{
+	blk64_t	first, last, blk;
+	blk_t	used;
+
+	if ((group == 0) || (group == fs->group_desc_count - 1) ||
+	    (EXT2FS_CLUSTER_RATIO(fs) > 1))
+		return 0;
+	ext2fs_super_and_bgd_loc2(fs, group, NULL, NULL, NULL, &used);
+	first = ext2fs_group_first_block2(fs, group);
+	last = ext2fs_group_last_block2(fs, group);
+	blk = ext2fs_block_bitmap_loc(fs, group);
+	if ((blk >= first) && (blk <= last))
+		used++;
+	blk = ext2fs_inode_bitmap_loc(fs, group);
+	if ((blk >= first) && (blk <= last))
+		used++;
+	blk = ext2fs_inode_table_loc(fs, group);
+	if ((blk >= first) && (blk <= last)) {
+		/* An inode table that straddles groups is not worth it */
+		if (blk + fs->inode_blocks_per_group - 1 > last)
+			return 0;
+		used += fs->inode_blocks_per_group;
+	}
+	return ext2fs_bitcount(bitmap, nbytes) == used;
+}
+
 static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 {
 	dgrp_t 		i;
@@ -40,6 +145,7 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 	blk64_t		blk;
 	blk64_t		blk_itr = EXT2FS_B2C(fs, fs->super->s_first_data_block);
 	ext2_ino_t	ino_itr = 1;
+	struct bitmap_batch batch;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
@@ -48,6 +154,20 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 
 	csum_flag = ext2fs_has_group_desc_csum(fs);
 
+	memset(&batch, 0, sizeof(batch));
+	batch.fs = fs;
+	batch.size = BITMAP_BATCH_SIZE / fs->blocksize;
+	retval = ext2fs_get_array(batch.size, sizeof(struct bitmap_batch_entry),
+				  &batch.ent);
+	if (retval)
+		goto errout;
+	retval = io_channel_alloc_buf(fs->io, batch.size, &batch.data);
+	if (retval)
+		goto errout;
+	retval = io_channel_alloc_buf(fs->io, batch.size, &batch.run);
+	if (retval)
+		goto errout;
+
 	inode_nbytes = block_nbytes = 0;
 	if (do_block) {
 		block_nbytes = EXT2_CLUSTERS_PER_GROUP(fs->super) / 8;
@@ -78,6 +198,14 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		if (retval)
 			goto errout;
 
+		if (csum_flag &&
+		    block_bitmap_can_uninit(fs, i, block_buf, block_nbytes)) {
+			ext2fs_bg_flags_set(fs, i, EXT2_BG_BLOCK_UNINIT);
+			ext2fs_group_desc_csum_set(fs, i);
+			fs->flags |= EXT2_FLAG_DIRTY;
+			goto skip_this_block_bitmap;
+		}
+
 		if (i == fs->group_desc_count - 1) {
 			/* Force bitmap padding for the last group */
 			nbits = EXT2FS_NUM_B2C(fs,
@@ -92,18 +220,16 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		retval = ext2fs_block_bitmap_csum_set(fs, i, block_buf,
 						      block_nbytes);
 		if (retval)
-			return retval;
+			goto errout;
 		ext2fs_group_desc_csum_set(fs, i);
 		fs->flags |= EXT2_FLAG_DIRTY;
 
 		blk = ext2fs_block_bitmap_loc(fs, i);
 		if (blk) {
-			retval = io_channel_write_blk64(fs->io, blk, 1,
-							block_buf);
-			if (retval) {
-				retval = EXT2_ET_BLOCK_BITMAP_WRITE;
+			retval = add_bitmap_block(&batch, blk, block_buf,
+						  EXT2_ET_BLOCK_BITMAP_WRITE);
+			if (retval)
 				goto errout;
-			}
 		}
 	skip_this_block_bitmap:
 		blk_itr += (blk64_t)block_nbytes << 3;
@@ -121,6 +247,16 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		if (retval)
 			goto errout;
 
+		/* Same as what ext2fs_set_gdt_csum() does for unused groups */
+		if (csum_flag && (ext2fs_bitcount(inode_buf, inode_nbytes) == 0)) {
+			ext2fs_bg_flags_set(fs, i, EXT2_BG_INODE_UNINIT);
+			ext2fs_bg_itable_unused_set(fs, i,
+				EXT2_INODES_PER_GROUP(fs->super));
+			ext2fs_group_desc_csum_set(fs, i);
+			fs->flags |= EXT2_FLAG_DIRTY;
+			goto skip_this_inode_bitmap;
+		}
+
 		retval = ext2fs_inode_bitmap_csum_set(fs, i, inode_buf,
 						      inode_nbytes);
 		if (retval)
@@ -130,31 +266,33 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 
 		blk = ext2fs_inode_bitmap_loc(fs, i);
 		if (blk) {
-			retval = io_channel_write_blk64(fs->io, blk, 1,
-						      inode_buf);
-			if (retval) {
-				retval = EXT2_ET_INODE_BITMAP_WRITE;
+			retval = add_bitmap_block(&batch, blk, inode_buf,
+						  EXT2_ET_INODE_BITMAP_WRITE);
+			if (retval)
 				goto errout;
-			}
 		}
 	skip_this_inode_bitmap:
 		ino_itr += inode_nbytes << 3;
 
 	}
-	if (do_block) {
+	retval = flush_bitmap_batch(&batch);
+	if (retval)
+		goto errout;
+	if (do_block)
 		fs->flags &= ~EXT2_FLAG_BB_DIRTY;
-		ext2fs_free_mem(&block_buf);
-	}
-	if (do_inode) {
+	if (do_inode)
 		fs->flags &= ~EXT2_FLAG_IB_DIRTY;
-		ext2fs_free_mem(&inode_buf);
-	}
-	return 0;
 errout:
 	if (inode_buf)
 		ext2fs_free_mem(&inode_buf);
 	if (block_buf)
 		ext2fs_free_mem(&block_buf);
+	if (batch.run)
+		ext2fs_free_mem(&batch.run);
+	if (batch.data)
+		ext2fs_free_mem(&batch.data);
+	if (batch.ent)
+		ext2fs_free_mem(&batch.ent);
 	return retval;
 }
 
@@ -53,9 +53,6 @@
 #include "bled/bled.h"
 #include "../res/grub/grub_version.h"
 
-/* Numbers of buffer used for asynchronous DD reads */
-#define NUM_BUFFERS 2
-
 /*
  * Globals
  */
@@ -64,14 +61,25 @@ DWORD FormatStatus = 0, LastWriteError = 0;
 badblocks_report report = { 0 };
 static float format_percent = 0.0f;
 static int task_number = 0;
-static unsigned int sec_buf_pos = 0;
+static BOOL hash_on_write = FALSE, image_badblocks_pass = FALSE;
+static FILE* image_pass_log_fd = NULL;
+static uint64_t image_written_size = 0;
+static char write_sum_str[CHECKSUM_MAX][150];
+static block_manifest write_manifest = { 0 };
 extern const int nb_steps[FS_MAX];
 extern uint32_t dur_mins, dur_secs;
 extern uint32_t wim_nb_files, wim_proc_files, wim_extra_files;
 static int actual_fs_type, wintogo_index = -1, wininst_index = 0;
-extern BOOL force_large_fat32, enable_ntfs_compression, lock_drive, zero_drive, fast_zeroing, enable_file_indexing, write_as_image;
+extern BOOL force_large_fat32, enable_ntfs_compression, lock_drive, zero_drive, bench_drive, fast_zeroing, enable_file_indexing, write_as_image;
 extern BOOL use_vds, write_as_esp, is_vds_available;
-uint8_t *grub2_buf = NULL, *sec_buf = NULL;
+extern BOOL fast_repartition, enable_write_cache, sparse_write, delta_write, enable_write_hashes, verify_write, batch_badblocks, batch_write, export_heatmap, enable_image_cache;
+extern BOOL enable_block_manifest, rescue_capture, badblocks_image_pass;
+extern uint32_t DriveLinkSpeed[MAX_DRIVES];
+extern uint8_t DriveLowerSpeed[MAX_DRIVES];
+extern int write_queue_depth, default_thread_priority, image_cache_ram_size, verify_sample_interval;
+extern char sum_str[CHECKSUM_MAX][150];
+extern StrArray DriveId, DriveHub;
+uint8_t *grub2_buf = NULL;
 long grub2_len;
 
 /*
@@ -334,7 +342,6 @@ static BOOL FormatNativeVds(DWORD DriveIndex, uint64_t PartitionOffset, DWORD Cl
 	BOOL r = FALSE, bFoundVolume = FALSE;
 	HRESULT hr;
 	ULONG ulFetched;
-	IVdsServiceLoader *pLoader;
 	IVdsService *pService;
 	IEnumVdsObject *pEnum;
 	IUnknown *pUnk;
@@ -357,39 +364,18 @@ static BOOL FormatNativeVds(DWORD DriveIndex, uint64_t PartitionOffset, DWORD Cl
 		goto out;
 	}
 
-	// Initialize COM
+	// Initialize COM, for the CoUninitialize() below
 	IGNORE_RETVAL(CoInitializeEx(NULL, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE));
-	IGNORE_RETVAL(CoInitializeSecurity(NULL, -1, NULL, NULL, RPC_C_AUTHN_LEVEL_CONNECT,
-		RPC_C_IMP_LEVEL_IMPERSONATE, NULL, 0, NULL));
-
-	// Create a VDS Loader Instance
-	hr = CoCreateInstance(&CLSID_VdsLoader, NULL, CLSCTX_LOCAL_SERVER | CLSCTX_REMOTE_SERVER,
-		&IID_IVdsServiceLoader, (void **)&pLoader);
-	if (hr != S_OK) {
-		VDS_SET_ERROR(hr);
-		uprintf("Could not create VDS Loader Instance: %s", WindowsErrorString());
-		goto out;
-	}
-
-	// Load the VDS Service
-	hr = IVdsServiceLoader_LoadService(pLoader, L"", &pService);
-	IVdsServiceLoader_Release(pLoader);
-	if (hr != S_OK) {
-		VDS_SET_ERROR(hr);
-		uprintf("Could not load VDS Service: %s", WindowsErrorString());
-		goto out;
-	}
 
-	// Wait for the Service to become ready if needed
-	hr = IVdsService_WaitForServiceReady(pService);
+	hr = GetVdsService(&pService, FALSE);
 	if (hr != S_OK) {
 		VDS_SET_ERROR(hr);
-		uprintf("VDS Service is not ready: %s", WindowsErrorString());
 		goto out;
 	}
 
 	// Query the VDS Service Providers
 	hr = IVdsService_QueryProviders(pService, VDS_QUERY_SOFTWARE_PROVIDERS, &pEnum);
+	IVdsService_Release(pService);
 	if (hr != S_OK) {
 		VDS_SET_ERROR(hr);
 		uprintf("Could not query VDS Service Providers: %s", WindowsErrorString());
@@ -629,7 +615,8 @@ static BOOL FormatNative(DWORD DriveIndex, uint64_t PartitionOffset, DWORD Clust
 		if (!IS_ERROR(FormatStatus) || (HRESULT_CODE(FormatStatus) == ERROR_CANCELLED))
 			break;
 		uprintf("%s - Retrying...", WindowsErrorString());
-		Sleep(WRITE_TIMEOUT);
+		if (!CancellableSleep(WRITE_TIMEOUT))
+			break;
 	}
 	if (IS_ERROR(FormatStatus))
 		goto out;
@@ -668,6 +655,8 @@ static BOOL FormatPartition(DWORD DriveIndex, uint64_t PartitionOffset, DWORD Un
 	actual_fs_type = FSType;
 	if ((FSType == FS_FAT32) && ((SelectedDrive.DiskSize > LARGE_FAT32_SIZE) || (force_large_fat32) || (Flags & FP_LARGE_FAT32)))
 		return FormatLargeFAT32(DriveIndex, PartitionOffset, UnitAllocationSize, FileSystemLabel[FSType], Label, Flags);
+	else if ((FSType == FS_EXFAT) && (Flags & FP_QUICK))
+		return FormatExFAT(DriveIndex, PartitionOffset, UnitAllocationSize, FileSystemLabel[FSType], Label, Flags);
 	else if (FSType >= FS_EXT2)
 		return FormatExtFs(DriveIndex, PartitionOffset, UnitAllocationSize, FileSystemLabel[FSType], Label, Flags);
 	else if (use_vds)
@@ -714,9 +703,7 @@ out:
 static BOOL ClearMBRGPT(HANDLE hPhysicalDrive, LONGLONG DiskSize, DWORD SectorSize, BOOL add1MB)
 {
 	BOOL r = FALSE;
-	LARGE_INTEGER liFilePointer;
 	uint64_t num_sectors_to_clear;
-	unsigned char* pZeroBuf = NULL;
 
 	PrintInfoDebug(0, MSG_224);
 	// http://en.wikipedia.org/wiki/GUID_Partition_Table tells us we should clear 34 sectors at the
@@ -734,28 +721,16 @@ static BOOL ClearMBRGPT(HANDLE hPhysicalDrive, LONGLONG DiskSize, DWORD SectorSi
 		num_sectors_to_clear = (DWORD)((add1MB ? 2048 : 0) + MAX_SECTORS_TO_CLEAR);
 
 	uprintf("Erasing %d sectors", num_sectors_to_clear);
-	pZeroBuf = calloc(SectorSize, (size_t)num_sectors_to_clear);
-	if (pZeroBuf == NULL) {
-		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
-		goto out;
-	}
-	liFilePointer.QuadPart = 0ULL;
-	if (!SetFilePointerEx(hPhysicalDrive, liFilePointer, &liFilePointer, FILE_BEGIN) || (liFilePointer.QuadPart != 0ULL))
-		uprintf("Warning: Could not reset disk position");
-	if (!WriteFileWithRetry(hPhysicalDrive, pZeroBuf, (DWORD)(SectorSize * num_sectors_to_clear), NULL, WRITE_RETRIES))
+	if (!ZeroDriveRange(hPhysicalDrive, 0, SectorSize * num_sectors_to_clear, 0, NULL, NULL))
 		goto out;
 	CHECK_FOR_USER_CANCEL;
-	liFilePointer.QuadPart = DiskSize - (LONGLONG)SectorSize * MAX_SECTORS_TO_CLEAR;
 	// Windows seems to be an ass about keeping a lock on a backup GPT,
 	// so we try to be lenient about not being able to clear it.
-	if (SetFilePointerEx(hPhysicalDrive, liFilePointer, &liFilePointer, FILE_BEGIN)) {
-		IGNORE_RETVAL(WriteFileWithRetry(hPhysicalDrive, pZeroBuf,
-			SectorSize * MAX_SECTORS_TO_CLEAR, NULL, WRITE_RETRIES));
-	}
+	IGNORE_RETVAL(ZeroDriveRange(hPhysicalDrive, DiskSize - (LONGLONG)SectorSize * MAX_SECTORS_TO_CLEAR,
+		(uint64_t)SectorSize * MAX_SECTORS_TO_CLEAR, 0, NULL, NULL));
 	r = TRUE;
 
 out:
-	safe_free(pZeroBuf);
 	return r;
 }
 
@@ -766,6 +741,7 @@ static BOOL WriteMBR(HANDLE hPhysicalDrive)
 {
 	BOOL r = FALSE;
 	DWORD size;
+	BYTE part_type, boot_flag;
 	unsigned char* buffer = NULL;
 	FAKE_FD fake_fd = { 0 };
 	FILE* fp = (FILE*)&fake_fd;
@@ -774,64 +750,61 @@ static BOOL WriteMBR(HANDLE hPhysicalDrive)
 	if (SelectedDrive.SectorSize < 512)
 		goto out;
 
-	if (partition_type == PARTITION_STYLE_GPT) {
-		// Add a notice with a protective MBR
-		fake_fd._handle = (char*)hPhysicalDrive;
-		set_bytes_per_sector(SelectedDrive.SectorSize);
-		uprintf(using_msg, "Rufus protective");
-		r = write_rufus_msg_mbr(fp);
-		goto notify;
-	}
-
-	// FormatEx rewrites the MBR and removes the LBA attribute of FAT16
-	// and FAT32 partitions - we need to correct this in the MBR
-	buffer = (unsigned char*)_mm_malloc(SelectedDrive.SectorSize, 16);
+	// The MBR is assembled in memory, from the current one, and then written with a single aligned
+	// write, rather than going through a read-modify-write of the sector for every chunk we patch.
+	buffer = (unsigned char*)_mm_malloc(SelectedDrive.SectorSize, 4096);
 	if (buffer == NULL) {
 		uprintf("Could not allocate memory for MBR");
 		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_NOT_ENOUGH_MEMORY;
 		goto out;
 	}
 
-	if (!read_sectors(hPhysicalDrive, SelectedDrive.SectorSize, 0, 1, buffer)) {
+	fake_fd._handle = (char*)hPhysicalDrive;
+	set_bytes_per_sector(SelectedDrive.SectorSize);
+	if (!stage_data(fp, buffer, SelectedDrive.SectorSize)) {
 		uprintf("Could not read MBR\n");
 		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_READ_FAULT;
 		goto out;
 	}
 
+	if (partition_type == PARTITION_STYLE_GPT) {
+		// Add a notice with a protective MBR
+		uprintf(using_msg, "Rufus protective");
+		r = write_rufus_msg_mbr(fp);
+		goto notify;
+	}
+
+	// FormatEx rewrites the MBR and removes the LBA attribute of FAT16
+	// and FAT32 partitions - we need to correct this in the MBR
+	part_type = buffer[0x1c2];
 	switch (ComboBox_GetCurItemData(hFileSystem)) {
 	case FS_FAT16:
-		if (buffer[0x1c2] == 0x0e) {
+		if (part_type == 0x0e) {
 			uprintf("Partition is already FAT16 LBA...\n");
-		} else if ((buffer[0x1c2] != 0x04) && (buffer[0x1c2] != 0x06)) {
-			uprintf("Warning: converting a non FAT16 partition to FAT16 LBA: FS type=0x%02x\n", buffer[0x1c2]);
+		} else if ((part_type != 0x04) && (part_type != 0x06)) {
+			uprintf("Warning: converting a non FAT16 partition to FAT16 LBA: FS type=0x%02x\n", part_type);
 		}
-		buffer[0x1c2] = 0x0e;
+		part_type = 0x0e;
 		break;
 	case FS_FAT32:
-		if (buffer[0x1c2] == 0x0c) {
+		if (part_type == 0x0c) {
 			uprintf("Partition is already FAT32 LBA...\n");
-		} else if (buffer[0x1c2] != 0x0b) {
-			uprintf("Warning: converting a non FAT32 partition to FAT32 LBA: FS type=0x%02x\n", buffer[0x1c2]);
+		} else if (part_type != 0x0b) {
+			uprintf("Warning: converting a non FAT32 partition to FAT32 LBA: FS type=0x%02x\n", part_type);
 		}
-		buffer[0x1c2] = 0x0c;
+		part_type = 0x0c;
 		break;
 	}
+	if (part_type != buffer[0x1c2])
+		write_data(fp, 0x1c2, &part_type, 1);
 	if ((boot_type != BT_NON_BOOTABLE) && (target_type == TT_BIOS)) {
 		// Set first partition bootable - masquerade as per the DiskID selected
-		buffer[0x1be] = IsChecked(IDC_RUFUS_MBR) ?
+		boot_flag = IsChecked(IDC_RUFUS_MBR) ?
 			(BYTE)ComboBox_GetCurItemData(hDiskID):0x80;
-		uprintf("Set bootable USB partition as 0x%02X\n", buffer[0x1be]);
-	}
-
-	if (!write_sectors(hPhysicalDrive, SelectedDrive.SectorSize, 0, 1, buffer)) {
-		uprintf("Could not write MBR\n");
-		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
-		goto out;
+		write_data(fp, 0x1be, &boot_flag, 1);
+		uprintf("Set bootable USB partition as 0x%02X\n", boot_flag);
 	}
 
-	fake_fd._handle = (char*)hPhysicalDrive;
-	set_bytes_per_sector(SelectedDrive.SectorSize);
-
 	// What follows is really a case statement with complex conditions listed
 	// by order of preference
 	if ((boot_type == BT_IMAGE) && HAS_WINDOWS(img_report) && (allow_dual_uefi_bios) && (target_type == TT_BIOS))
@@ -891,6 +864,11 @@ windows_mbr:
 	}
 
 notify:
+	if (r && !flush_data(fp)) {
+		uprintf("Could not write MBR\n");
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+		r = FALSE;
+	}
 	// Tell the system we've updated the disk properties
 	if (!DeviceIoControl(hPhysicalDrive, IOCTL_DISK_UPDATE_PROPERTIES, NULL, 0, NULL, 0, &size, NULL))
 		uprintf("Failed to notify system about disk properties update: %s\n", WindowsErrorString());
@@ -998,17 +976,29 @@ static __inline const char* bt_to_name(void) {
 BOOL WritePBR(HANDLE hLogicalVolume)
 {
 	int i;
+	BOOL r = FALSE;
+	// Large enough for all the boot records we write, and for at least one sector
+	DWORD br_len = max(BR_CACHE_LEN, SelectedDrive.SectorSize);
+	unsigned char* buffer;
 	FAKE_FD fake_fd = { 0 };
 	FILE* fp = (FILE*)&fake_fd;
 	const char* using_msg = "Using %s %s partition boot record";
 
+	// As with the MBR, each boot record is assembled in memory, and then written with a single aligned write
+	buffer = (unsigned char*)_mm_malloc(br_len, 4096);
+	if (buffer == NULL) {
+		uprintf("Could not allocate memory for PBR");
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_NOT_ENOUGH_MEMORY;
+		return FALSE;
+	}
+
 	fake_fd._handle = (char*)hLogicalVolume;
 	set_bytes_per_sector(SelectedDrive.SectorSize);
 
 	switch (actual_fs_type) {
 	case FS_FAT16:
 		uprintf(using_msg, bt_to_name(), "FAT16");
-		if (!is_fat_16_fs(fp)) {
+		if (!stage_data(fp, buffer, br_len) || !is_fat_16_fs(fp)) {
 			uprintf("New volume does not have a FAT16 boot sector - aborting");
 			break;
 		}
@@ -1025,11 +1015,14 @@ BOOL WritePBR(HANDLE hLogicalVolume)
 		// Disk Drive ID needs to be corrected on XP
 		if (!write_partition_physical_disk_drive_id_fat16(fp))
 			break;
-		return TRUE;
+		if (!flush_data(fp))
+			break;
+		r = TRUE;
+		goto out;
 	case FS_FAT32:
 		uprintf(using_msg, bt_to_name(), "FAT32");
 		for (i = 0; i < 2; i++) {
-			if (!is_fat_32_fs(fp)) {
+			if (!stage_data(fp, buffer, br_len) || !is_fat_32_fs(fp)) {
 				uprintf("New volume does not have a %s FAT32 boot sector - aborting\n", i?"secondary":"primary");
 				break;
 			}
@@ -1051,31 +1044,41 @@ BOOL WritePBR(HANDLE hLogicalVolume)
 			// Disk Drive ID needs to be corrected on XP
 			if (!write_partition_physical_disk_drive_id_fat32(fp))
 				break;
+			// The backup boot record overlaps the range we staged, so it must be flushed before we move to it
+			if (!flush_data(fp))
+				break;
 			fake_fd._offset += 6 * SelectedDrive.SectorSize;
 		}
-		return TRUE;
+		r = TRUE;
+		goto out;
 	case FS_NTFS:
 		uprintf(using_msg, bt_to_name(), "NTFS");
-		if (!is_ntfs_fs(fp)) {
+		if (!stage_data(fp, buffer, br_len) || !is_ntfs_fs(fp)) {
 			uprintf("New volume does not have an NTFS boot sector - aborting\n");
 			break;
 		}
 		uprintf("Confirmed new volume has an NTFS boot sector\n");
 		if (!write_ntfs_br(fp)) break;
+		if (!flush_data(fp)) break;
 		// Note: NTFS requires a full remount after writing the PBR. We dismount when we lock
 		// and also go through a forced remount, so that shouldn't be an issue.
 		// But with NTFS, if you don't remount, you don't boot!
-		return TRUE;
+		r = TRUE;
+		goto out;
 	case FS_EXT2:
 	case FS_EXT3:
 	case FS_EXT4:
-		return TRUE;
+		r = TRUE;
+		goto out;
 	default:
 		uprintf("Unsupported FS for FS BR processing - aborting\n");
 		break;
 	}
 	FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
-	return FALSE;
+
+out:
+	safe_mm_free(buffer);
+	return r;
 }
 
 /*
@@ -1219,11 +1222,10 @@ out:
 // Returns -2 on user cancel, -1 on other error, >=0 on success.
 int SetWinToGoIndex(void)
 {
-	char *mounted_iso, *build, mounted_image_path[128];
-	char xml_file[MAX_PATH] = "";
-	char *install_names[MAX_WININST];
-	StrArray version_name, version_index;
-	int i, build_nr = 0;
+	char *mounted_iso, mounted_image_path[128];
+	char *install_names[MAX_WININST], **version_name = NULL;
+	wim_image_info* images = NULL;
+	int i, nb_images;
 	BOOL bNonStandard = FALSE;
 
 	// Sanity checks
@@ -1246,93 +1248,103 @@ int SetWinToGoIndex(void)
 			wininst_index = 0;
 	}
 
-	// If we're not using a straight install.wim, we need to mount the ISO to access it
-	if (!img_report.is_windows_img) {
+	// Now take a look at the XML data of install.wim to list our versions. We read it straight from
+	// the ISO and only mount the latter, to let Windows access the file, if this didn't work out.
+	nb_images = GetWimImageInfo(image_path, img_report.is_windows_img ? NULL : &img_report.wininst_path[wininst_index][2], &images);
+	if ((nb_images < 0) && !img_report.is_windows_img) {
 		mounted_iso = MountISO(image_path);
 		if (mounted_iso == NULL) {
 			uprintf("Could not mount ISO for Windows To Go selection");
-			return FALSE;
+			return -1;
 		}
 		static_sprintf(mounted_image_path, "%s%s", mounted_iso, &img_report.wininst_path[wininst_index][2]);
+		nb_images = GetWimImageInfo(mounted_image_path, NULL, &images);
+		UnMountISO();
 	}
-
-	// Now take a look at the XML file in install.wim to list our versions
-	if ((GetTempFileNameU(temp_dir, APPLICATION_NAME, 0, xml_file) == 0) || (xml_file[0] == 0)) {
-		// Last ditch effort to get a tmp file - just extract it to the current directory
-		static_strcpy(xml_file, ".\\RufVXml.tmp");
-	}
-	// GetTempFileName() may leave a file behind
-	DeleteFileU(xml_file);
-
-	// Must use the Windows WIM API as 7z messes up the XML
-	if (!WimExtractFile_API(img_report.is_windows_img ? image_path : mounted_image_path,
-		0, "[1].xml", xml_file, FALSE)) {
+	if (nb_images <= 0) {
 		uprintf("Could not acquire WIM index");
 		goto out;
 	}
 
-	StrArrayCreate(&version_name, 16);
-	StrArrayCreate(&version_index, 16);
-	for (i = 0; StrArrayAdd(&version_index, get_token_data_file_indexed("IMAGE INDEX", xml_file, i + 1), FALSE) >= 0; i++) {
+	version_name = (char**)calloc(nb_images, sizeof(char*));
+	if (version_name == NULL)
+		goto out;
+	for (i = 0; i < nb_images; i++) {
 		// Some people are apparently creating *unofficial* Windows ISOs that don't have DISPLAYNAME elements.
-		// If we are parsing such an ISO, try to fall back to using DESCRIPTION. Of course, since we don't use
-		// a formal XML parser, if an ISO mixes entries with both DISPLAYNAME and DESCRIPTION and others with
-		// only DESCRIPTION, the version names we report will be wrong.
-		// But hey, there's only so far I'm willing to go to help people who, not content to have demonstrated
-		// their utter ignorance on development matters, are also trying to lecture experienced developers
-		// about specific "noob mistakes"... that don't exist in the code they are trying to criticize.
-		if (StrArrayAdd(&version_name, get_token_data_file_indexed("DISPLAYNAME", xml_file, i + 1), FALSE) < 0) {
+		// If we are parsing such an ISO, try to fall back to using DESCRIPTION.
+		version_name[i] = images[i].name;
+		if (version_name[i] == NULL) {
 			bNonStandard = TRUE;
-			if (StrArrayAdd(&version_name, get_token_data_file_indexed("DESCRIPTION", xml_file, i + 1), FALSE) < 0) {
-				uprintf("Warning: Could not find a description for image index %d", i + 1);
-				StrArrayAdd(&version_name, "Unknown Windows Version", TRUE);
+			version_name[i] = images[i].description;
+			if (version_name[i] == NULL) {
+				uprintf("Warning: Could not find a description for image index %d", images[i].index);
+				version_name[i] = "Unknown Windows Version";
 			}
 		}
 	}
 	if (bNonStandard)
 		uprintf("Warning: Nonstandard Windows image (missing <DISPLAYNAME> entries)");
 
+	i = nb_images;
 	if (i > 1)
-		i = SelectionDialog(lmprintf(MSG_291), lmprintf(MSG_292), version_name.String, i);
+		i = SelectionDialog(lmprintf(MSG_291), lmprintf(MSG_292), version_name, i);
 	if (i < 0) {
 		wintogo_index = -2;	// Cancelled by the user
 	} else if (i == 0) {
 		wintogo_index = 1;
 	} else {
-		wintogo_index = atoi(version_index.String[i - 1]);
+		wintogo_index = images[i - 1].index;
 	}
 	if (i > 0) {
-		// Get the build version
-		build = get_token_data_file_indexed("BUILD", xml_file, i);
-		if (build != NULL)
-			build_nr = atoi(build);
-		free(build);
-		uprintf("Will use '%s' (Build: %d, Index %s) for Windows To Go",
-			version_name.String[i - 1], build_nr, version_index.String[i - 1]);
+		uprintf("Will use '%s' (Build: %d, Index %d) for Windows To Go",
+			version_name[i - 1], images[i - 1].build, images[i - 1].index);
 		// Need Windows 10 Creator Update or later for boot on REMOVABLE to work
-		if ((build_nr < 15000) && (SelectedDrive.MediaType != FixedMedia)) {
+		if ((images[i - 1].build < 15000) && (SelectedDrive.MediaType != FixedMedia)) {
 			if (MessageBoxExU(hMainDialog, lmprintf(MSG_098), lmprintf(MSG_190),
 				MB_YESNO | MB_ICONWARNING | MB_IS_RTL, selected_langid) != IDYES)
 				wintogo_index = -2;
 		}
 		// Display a notice about WppRecorder.sys for 1809 ISOs
-		if (build_nr == 17763) {
+		if (images[i - 1].build == 17763) {
 			notification_info more_info;
 			more_info.id = MORE_INFO_URL;
 			more_info.url = WPPRECORDER_MORE_INFO_URL;
 			Notification(MSG_INFO, NULL, &more_info, lmprintf(MSG_128, "Windows To Go"), lmprintf(MSG_133));
 		}
 	}
-	StrArrayDestroy(&version_name);
-	StrArrayDestroy(&version_index);
 
 out:
-	DeleteFileU(xml_file);
-	if (!img_report.is_windows_img)
-		UnMountISO();
+	free(version_name);
+	FreeWimImageInfo(images, nb_images);
 	return wintogo_index;
 }
 
+/*
+ * An install.wim that is larger than what FAT32 can hold is left out by ExtractISO(), and split
+ * into install.swm, install2.swm, ... parts instead, which Windows Setup knows how to use. The
+ * parts are written directly from the mounted ISO, using the same 4000 MB limit as DISM does.
+ */
+#define WIM_SPLIT_PART_SIZE  (4000 * MB)
+static BOOL SplitWinInstall(const char* drive_name)
+{
+	BOOL r;
+	char *mounted_iso, src[128], dst[128];
+
+	uprintf("Splitting %s for FAT32", &img_report.wininst_path[0][2]);
+	mounted_iso = MountISO(image_path);
+	if (mounted_iso == NULL) {
+		uprintf("Could not mount ISO to split the Windows installation image");
+		return FALSE;
+	}
+	static_sprintf(src, "%s%s", mounted_iso, &img_report.wininst_path[0][2]);
+	static_sprintf(dst, "%c:%s", drive_name[0], &img_report.wininst_path[0][2]);
+	// Replace the .wim extension with .swm
+	dst[strlen(dst) - 3] = 's';
+	r = WimSplitImage(src, dst, WIM_SPLIT_PART_SIZE);
+	UnMountISO();
+	return r;
+}
+
 // https://docs.microsoft.com/en-us/previous-versions/windows/it-pro/windows-8.1-and-8/jj721578(v=ws.11)
 // As opposed to the technet guide above, we don't set internal drives offline,
 // due to people wondering why they can't see them by default and we also use
@@ -1436,8 +1448,66 @@ static BOOL SetupWinToGo(DWORD DriveIndex, const char* drive_name, BOOL use_esp)
 	return TRUE;
 }
 
+static const char* labconfig_key_name[] = { "BypassTPMCheck", "BypassSecureBootCheck" };
+
+/*
+ * Have Windows Setup create the LabConfig registry keys that remove the Windows 11 install
+ * restrictions itself, from the windowsPE pass of an 'autounattend.xml' at the root of the
+ * drive. This takes no time at all, compared to mounting boot.wim, editing its registry and
+ * committing the changes back to it. We leave any existing answer file alone.
+ */
+static BOOL CreateLabConfigUnattend(char drive_letter)
+{
+	const char* arch[] = { "x86", "amd64", "arm64" };
+	char path[] = "#:\\autounattend.xml";
+	FILE* fd;
+	int i, j;
+
+	path[0] = drive_letter;
+	if (PathFileExistsU(path)) {
+		uprintf("'%s' already exists - Editing 'boot.wim' instead", path);
+		return FALSE;
+	}
+	fd = fopenU(path, "w");
+	if (fd == NULL) {
+		uprintf("Could not create '%s'", path);
+		return FALSE;
+	}
+	fprintf(fd, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n");
+	fprintf(fd, "<unattend xmlns=\"urn:schemas-microsoft-com:unattend\">\n");
+	fprintf(fd, "  <settings pass=\"windowsPE\">\n");
+	// Setup only processes the component that matches the architecture it runs on
+	for (i = 0; i < ARRAYSIZE(arch); i++) {
+		fprintf(fd, "    <component name=\"Microsoft-Windows-Setup\" processorArchitecture=\"%s\" language=\"neutral\" "
+			"xmlns:wcm=\"http://schemas.microsoft.com/WMIConfig/2002/State\" "
+			"xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" "
+			"publicKeyToken=\"31bf3856ad364e35\" versionScope=\"nonSxS\">\n", arch[i]);
+		fprintf(fd, "      <RunSynchronous>\n");
+		for (j = 0; j < ARRAYSIZE(labconfig_key_name); j++) {
+			fprintf(fd, "        <RunSynchronousCommand wcm:action=\"add\">\n");
+			fprintf(fd, "          <Order>%d</Order>\n", j + 1);
+			fprintf(fd, "          <Path>reg add HKLM\\SYSTEM\\Setup\\LabConfig /v %s /t REG_DWORD /d 1 /f</Path>\n",
+				labconfig_key_name[j]);
+			fprintf(fd, "        </RunSynchronousCommand>\n");
+		}
+		fprintf(fd, "      </RunSynchronous>\n");
+		fprintf(fd, "    </component>\n");
+	}
+	fprintf(fd, "  </settings>\n");
+	fprintf(fd, "</unattend>\n");
+	if (fclose(fd) != 0) {
+		uprintf("Could not write '%s'", path);
+		DeleteFileU(path);
+		return FALSE;
+	}
+	for (j = 0; j < ARRAYSIZE(labconfig_key_name); j++)
+		uprintf("Set 'HKLM\\SYSTEM\\Setup\\LabConfig\\%s' to be created by '%s'", labconfig_key_name[j], path);
+	return TRUE;
+}
+
 /*
- * Edit sources/boot.wim registry to remove Windows 11 install restrictions
+ * Remove Windows 11 install restrictions, through an answer file if we can, or else by
+ * editing the sources/boot.wim registry
  */
 BOOL RemoveWindows11Restrictions(char drive_letter)
 {
@@ -1445,7 +1515,6 @@ BOOL RemoveWindows11Restrictions(char drive_letter)
 	int i;
 	const int wim_index = 2;
 	const char* offline_hive_name = "RUFUS_OFFLINE_HIVE";
-	const char* key_name[] = { "BypassTPMCheck", "BypassSecureBootCheck" };
 	char boot_wim_path[] = "#:\\sources\\boot.wim", key_path[64];
 	char* mount_path = NULL;
 	char path[MAX_PATH];
@@ -1456,6 +1525,10 @@ BOOL RemoveWindows11Restrictions(char drive_letter)
 	boot_wim_path[0] = drive_letter;
 
 	UpdateProgressWithInfoForce(OP_PATCH, MSG_324, 0, PATCH_PROGRESS_TOTAL);
+	if (CreateLabConfigUnattend(drive_letter)) {
+		UpdateProgressWithInfo(OP_PATCH, MSG_324, PATCH_PROGRESS_TOTAL, PATCH_PROGRESS_TOTAL);
+		return TRUE;
+	}
 	uprintf("Mounting '%s'...", boot_wim_path);
 
 	mount_path = WimMountImage(boot_wim_path, wim_index);
@@ -1484,15 +1557,15 @@ BOOL RemoveWindows11Restrictions(char drive_letter)
 		goto out;
 	}
 
-	for (i = 0; i < ARRAYSIZE(key_name); i++) {
-		status = RegSetValueExA(hSubKey, key_name[i], 0, REG_DWORD, (LPBYTE)&dwVal, sizeof(DWORD));
+	for (i = 0; i < ARRAYSIZE(labconfig_key_name); i++) {
+		status = RegSetValueExA(hSubKey, labconfig_key_name[i], 0, REG_DWORD, (LPBYTE)&dwVal, sizeof(DWORD));
 		if (status != ERROR_SUCCESS) {
 			SetLastError(status);
 			uprintf("Could not set 'HKLM\\SYSTEM\\Setup\\LabConfig\\%s' registry key: %s",
-				key_name[i], WindowsErrorString());
+				labconfig_key_name[i], WindowsErrorString());
 			goto out;
 		}
-		uprintf("Created 'HKLM\\SYSTEM\\Setup\\LabConfig\\%s' registry key", key_name[i]);
+		uprintf("Created 'HKLM\\SYSTEM\\Setup\\LabConfig\\%s' registry key", labconfig_key_name[i]);
 	}
 	UpdateProgressWithInfoForce(OP_PATCH, MSG_324, 103, PATCH_PROGRESS_TOTAL);
 	r = TRUE;
@@ -1529,171 +1602,1342 @@ static void update_progress(const uint64_t processed_bytes)
 	}
 }
 
-// Some compressed images use streams that aren't multiple of the sector
-// size and cause write failures => Use a write override that alleviates
-// the problem. See GitHub issue #1422 for details.
-static int sector_write(int fd, const void* _buf, unsigned int count)
+static void zero_progress(uint64_t done, uint64_t total)
 {
-	const uint8_t* buf = (const uint8_t*)_buf;
-	unsigned int sec_size = (unsigned int)SelectedDrive.SectorSize;
-	int written, fill_size = 0;
-
-	if (sec_size == 0)
-		sec_size = 512;
-
-	// If we are on a sector boundary and count is multiple of the
-	// sector size, just issue a regular write
-	if ((sec_buf_pos == 0) && (count % sec_size == 0))
-		return _write(fd, buf, count);
-
-	// If we have an existing partial sector, fill and write it
-	if (sec_buf_pos > 0) {
-		fill_size = min(sec_size - sec_buf_pos, count);
-		memcpy(&sec_buf[sec_buf_pos], buf, fill_size);
-		sec_buf_pos += fill_size;
-		// If we don't have a full sector just buffer it for next call
-		if (sec_buf_pos < sec_size)
-			return (int)count;
-		sec_buf_pos = 0;
-		written = _write(fd, sec_buf, sec_size);
-		if (written != sec_size)
-			return written;
-	}
-
-	// Now write as many full sectors as we can
-	uint32_t sec_num = (count - fill_size) / sec_size;
-	written = _write(fd, &buf[fill_size], sec_num * sec_size);
-	if (written < 0)
-		return written;
-	else if (written != sec_num * sec_size)
-		return fill_size + written;
-	sec_buf_pos = count - fill_size - written;
-	assert(sec_buf_pos < sec_size);
-
-	// Keep leftover bytes, if any, in the sector buffer
-	if (sec_buf_pos != 0)
-		memcpy(sec_buf, &buf[fill_size + written], sec_buf_pos);
-	return (int)count;
+	static uint64_t last_value = UINT64_MAX;
+	uint64_t cur_value;
+
+	UpdateProgressWithInfo(OP_FORMAT, MSG_286, done, total);
+	cur_value = (done * min(80, total)) / total;
+	if (cur_value != last_value) {
+		last_value = cur_value;
+		uprintfs("+");
+	}
 }
 
-/* Write an image file or zero a drive */
-static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
+/*
+ * Reap an in-flight write from the drive queue. If that write failed, only that
+ * specific request is retried, while the other ones are left to proceed. This also
+ * fails once the drive health monitor has flagged the drive.
+ * If bFatal is FALSE, a write that couldn't be completed doesn't update FormatStatus.
+ */
+static BOOL CompleteDriveWrite(HANDLE hDriveQueue, DWORD slot, BOOL bFatal)
 {
-	BOOL s, ret = FALSE;
-	LARGE_INTEGER li;
-	HANDLE hSourceImage = INVALID_HANDLE_VALUE;
-	DWORD i, read_size[NUM_BUFFERS], write_size, comp_size, buf_size;
-	uint64_t wb, target_size = bZeroDrive ? SelectedDrive.DiskSize : img_report.image_size;
-	uint64_t cur_value, last_value = UINT64_MAX;
-	int64_t bled_ret;
-	uint8_t* buffer = NULL;
-	uint32_t zero_data, *cmp_buffer = NULL;
-	int throttle_fast_zeroing = 0, read_bufnum = 0, proc_bufnum = 1;
-
-	if (SelectedDrive.SectorSize < 512) {
-		uprintf("Unexpected sector size (%d) - Aborting", SelectedDrive.SectorSize);
-		return FALSE;
-	}
+	ASYNC_REQUEST* req = &((ASYNC_QUEUE*)hDriveQueue)->Request[slot];
+	DWORD i, write_size;
+	BOOL s;
 
-	// We poked the MBR and other stuff, so we need to rewind
-	li.QuadPart = 0;
-	if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN))
-		uprintf("Warning: Unable to rewind image position - wrong data might be copied!");
-	UpdateProgressWithInfoInit(NULL, FALSE);
+	// Nothing was issued on this slot
+	if (req->lpBuffer == NULL)
+		return TRUE;
 
-	if (bZeroDrive) {
-		uprintf(fast_zeroing ? "Fast-zeroing drive:" : "Zeroing drive:");
-		// Our buffer size must be a multiple of the sector size and *ALIGNED* to the sector size
-		buf_size = ((DD_BUFFER_SIZE + SelectedDrive.SectorSize - 1) / SelectedDrive.SectorSize) * SelectedDrive.SectorSize;
-		buffer = (uint8_t*)_mm_malloc(buf_size, SelectedDrive.SectorSize);
-		if (buffer == NULL) {
-			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
-			uprintf("Could not allocate disk zeroing buffer");
-			goto out;
+	for (i = 1; i <= WRITE_RETRIES; i++) {
+		// A slow drive can take a long time to complete a large write, so we only give up
+		// on a request that failed, or when the user cancels, but not on a timeout
+		do {
+			s = (req->bPending) && WaitAsyncQueue(hDriveQueue, slot, DRIVE_ACCESS_TIMEOUT, &write_size);
+		} while ((!s) && (req->bPending) && (GetLastError() == ERROR_TIMEOUT) && (!IS_USER_CANCEL));
+		if ((!s) && IS_USER_CANCEL) {
+			CancelAsyncRequest(hDriveQueue, slot);
+			return FALSE;
 		}
-		assert((uintptr_t)buffer % SelectedDrive.SectorSize == 0);
-
-		// Clear buffer
-		memset(buffer, fast_zeroing ? 0xff : 0x00, buf_size);
-
-		if (fast_zeroing) {
-			cmp_buffer = (uint32_t*)_mm_malloc(buf_size, SelectedDrive.SectorSize);
-			if (cmp_buffer == NULL) {
-				FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
-				uprintf("Could not allocate disk comparison buffer");
-				goto out;
+		if ((s) && (write_size == req->dwSize)) {
+			req->lpBuffer = NULL;
+			// A drive that the health monitor flagged is handled as one that failed a write
+			if ((((ASYNC_QUEUE*)hDriveQueue)->pfnMonitor == UpdateIoHeatmap) &&
+				IsDriveUnhealthy((IO_HEATMAP*)((ASYNC_QUEUE*)hDriveQueue)->lpMonitorContext)) {
+				if (bFatal)
+					FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_DEVICE_HARDWARE_ERROR;
+				return FALSE;
 			}
-			assert((uintptr_t)cmp_buffer % SelectedDrive.SectorSize == 0);
+			return TRUE;
 		}
+		if (s)
+			uprintf("\r\nWrite error: Wrote %d bytes, expected %d bytes", write_size, req->dwSize);
+		else
+			uprintf("\r\nWrite error at sector %lld: %s", req->Overlapped.Offset / SelectedDrive.SectorSize, WindowsErrorString());
+		// Make sure that the failed request is no longer in flight
+		CancelAsyncRequest(hDriveQueue, slot);
+		if (i >= WRITE_RETRIES)
+			break;
+		uprintf("Retrying in %d seconds...", WRITE_TIMEOUT / 1000);
+		TraceTally("write retries", 1, 0, 0);
+		if (!CancellableSleep(WRITE_TIMEOUT))
+			return FALSE;
+		IssueAsyncQueue(hDriveQueue, slot, TRUE, req->lpBuffer, req->dwSize, req->Overlapped.Offset);
+	}
+	if (bFatal)
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT;
+	return FALSE;
+}
 
-		read_size[0] = buf_size;
-		for (wb = 0, write_size = 0; wb < target_size; wb += write_size) {
-			UpdateProgressWithInfo(OP_FORMAT, fast_zeroing ? MSG_306 : MSG_286, wb, target_size);
-			cur_value = (wb * min(80, target_size)) / target_size;
-			if (cur_value != last_value) {
-				last_value = cur_value;
-				uprintfs("+");
-			}
-			// Don't overflow our projected size (mostly for VHDs)
-			if (wb + read_size[0] > target_size)
-				read_size[0] = (DWORD)(target_size - wb);
+/*
+ * For sparse writes, check if a DD block can be skipped, which is the case if it only
+ * contains zeros and the matching area of the target already reads back as zeros.
+ * Note that, unlike what we do for fast-zeroing, an erased flash block (all 0xFF) is
+ * not good enough here, since the data from the image must read back as zeros.
+ */
+static BOOL IsSkippableBlock(HANDLE hPhysicalDrive, const uint8_t* buf, uint8_t* cmp_buf,
+	DWORD size, uint64_t offset, BOOL known_zero)
+{
+	OVERLAPPED overlapped = { 0 };
+	DWORD read_size;
 
-			// WriteFile fails unless the size is a multiple of sector size
-			if (read_size[0] % SelectedDrive.SectorSize != 0)
-				read_size[0] = ((read_size[0] + SelectedDrive.SectorSize - 1) / SelectedDrive.SectorSize) * SelectedDrive.SectorSize;
+	if (!known_zero && !IsBufferZero(buf, size))
+		return FALSE;
+	overlapped.Offset = (DWORD)offset;
+	overlapped.OffsetHigh = (DWORD)(offset >> 32);
+	if (!ReadFile(hPhysicalDrive, cmp_buf, size, &read_size, &overlapped) || (read_size != size))
+		return FALSE;
+	return IsBufferZero(cmp_buf, size);
+}
 
-			// Fast-zeroing: Depending on your hardware, reading from flash may be much faster than writing, so
-			// we might speed things up by skipping empty blocks, or skipping the write if the data is the same.
-			// Notes: A block is declared empty when all bits are either 0 (zeros) or 1 (flash block erased).
-			// Also, a back-off strategy is used to limit reading.
-			if (throttle_fast_zeroing) {
-				throttle_fast_zeroing--;
-			} else if (fast_zeroing) {
-				CHECK_FOR_USER_CANCEL;
+/*
+ * Compressed image write pipeline: bled decompresses into a pool of large, sector
+ * aligned, buffers that a separate writer thread drains to the target drive through
+ * an asynchronous queue, so that decompression and device writes can overlap.
+ * Buffers are filled and drained in sequence, so that they can be handled as a ring.
+ * Each buffer carries its own target offset, so that the images that aren't written
+ * sequentially (VTSI) can go through the pipeline as well.
+ *
+ * In batch mode, the ring is fanned out to several drives, that each get their own
+ * writer thread and queue, and a buffer only goes back to the producer once all the
+ * drives have written it. So that a slow drive doesn't hold back the other ones, the
+ * ring then gets DD_BATCH_LAG_BUFFERS extra buffers, which is how far behind the
+ * fastest drive a drive can fall before the producer has to wait for it.
+ * When sparse, each writer only writes the buffers of zeros that its drive doesn't
+ * already read back as zeros, as for sparse writes.
+ */
+#define MAX_PIPELINE_BUFFERS (MAX_ASYNC_QUEUE_DEPTH + DD_BATCH_LAG_BUFFERS)
+
+typedef struct {
+	HANDLE hDrive;
+	HANDLE hDriveQueue;
+	HANDLE hThread;
+	HANDLE hFull;		// Counts the buffers that this writer can drain
+	DWORD index;		// Drive index, for the log
+	uint8_t* cmp_buffer;	// For the check of the zeroed blocks, when sparse
+	uint64_t written;
+	uint64_t skipped;
+	uint64_t duration;
+	DWORD throttle;		// Number of zeroed blocks to write before checking the drive again
+	BOOL failed;
+} pipeline_target;
+
+static struct {
+	pipeline_target target[MAX_DRIVES];
+	DWORD nb_targets;
+	HANDLE hFree;		// Counts the buffers that the producer can fill
+	uint8_t* buffer;
+	DWORD buf_size;
+	DWORD nb_buffers;
+	DWORD queue_depth;
+	DWORD fill_size[MAX_PIPELINE_BUFFERS];
+	uint64_t fill_offset[MAX_PIPELINE_BUFFERS];
+	volatile LONG pending[MAX_PIPELINE_BUFFERS];	// Number of writers that still use each buffer
+	DWORD fill_index;
+	DWORD fill_pos;
+	BOOL has_buffer;
+	uint64_t next_offset;	// Target offset of the buffer being filled, which starts where a write resumes
+	uint64_t skip;			// Data from a previous attempt, that only needs to be hashed
+	BOOL sparse;
+	BOOL is_zero[MAX_PIPELINE_BUFFERS];
+	volatile LONG error;
+} pipeline = { 0 };
+
+// The drives that the image also gets written to, in batch mode
+static struct {
+	HANDLE hDrive;
+	DWORD index;
+	IO_HEATMAP* heatmap;
+} batch_target[MAX_DRIVES - 1];
+static DWORD nb_batch_targets = 0;
+
+// Hand a buffer back to the producer, once all the writers are done with it
+static void PipelineReleaseBuffer(DWORD i)
+{
+	if (InterlockedDecrement(&pipeline.pending[i]) == 0)
+		ReleaseSemaphore(pipeline.hFree, 1, NULL);
+}
 
-				// Read block and compare against the block that needs to be written
-				s = ReadFile(hPhysicalDrive, cmp_buffer, read_size[0], &comp_size, NULL);
-				if ((!s) || (comp_size != read_size[0])) {
-					uprintf("\r\nRead error: Could not read data for fast zeroing comparison - %s", WindowsErrorString());
-					goto out;
-				}
+// Drop a drive from a batch, after cancelling its in-flight writes, so that their buffers can be released
+static void PipelineDropTarget(pipeline_target* t, DWORD* reap_seq, DWORD end_seq)
+{
+	uprintf("\r\nBatch: Disk %d failed, and was dropped from the batch", (int)t->index);
+	t->failed = TRUE;
+	for (; *reap_seq < end_seq; (*reap_seq)++) {
+		CancelAsyncRequest(t->hDriveQueue, *reap_seq % pipeline.queue_depth);
+		PipelineReleaseBuffer(*reap_seq % pipeline.nb_buffers);
+	}
+}
 
-				// Check for an empty block by comparing with the first element
-				zero_data = cmp_buffer[0];
-				// Check all bits are the same
-				if ((zero_data == 0) || (zero_data == 0xffffffff)) {
-					// Compare the rest of the block against the first element
-					for (i = 1; (i < read_size[0] / sizeof(uint32_t)) && (cmp_buffer[i] == zero_data); i++);
-					if (i >= read_size[0] / sizeof(uint32_t)) {
-						// Block is empty, skip write
-						write_size = read_size[0];
-						continue;
-					}
-				}
+// Reap the oldest in-flight write of a drive, where end_seq is the sequence number
+// past the last write that was issued. Only a failure of the selected drive is fatal.
+static BOOL PipelineReapWrite(pipeline_target* t, DWORD* reap_seq, DWORD end_seq)
+{
+	DWORD i = *reap_seq % pipeline.nb_buffers;
+	BOOL is_selected = (t == &pipeline.target[0]);
 
-				// Move the file pointer position back for writing
-				li.QuadPart = wb;
-				if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
-					uprintf("\r\nError: Could not reset position - %s", WindowsErrorString());
-					goto out;
+	if (!CompleteDriveWrite(t->hDriveQueue, *reap_seq % pipeline.queue_depth, is_selected)) {
+		if (is_selected)
+			return FALSE;
+		PipelineDropTarget(t, reap_seq, end_seq);
+		return TRUE;
+	}
+	t->written += pipeline.fill_size[i];
+	(*reap_seq)++;
+	PipelineReleaseBuffer(i);
+	return TRUE;
+}
+
+static DWORD WINAPI PipelineWriterThread(void* param)
+{
+	pipeline_target* t = (pipeline_target*)param;
+	DWORD i, slot, seq, reap_seq = 0;
+	uint64_t start = GetIoTimestamp();
+
+	for (seq = 0; ; seq++) {
+		if (WaitForSingleObject(t->hFull, INFINITE) != WAIT_OBJECT_0)
+			goto error;
+		i = seq % pipeline.nb_buffers;
+		// A zero sized buffer indicates the end of the stream
+		if (pipeline.fill_size[i] == 0)
+			break;
+		// No point in going further if the selected drive failed or the user cancelled
+		if ((pipeline.error) || (IS_ERROR(FormatStatus) && (SCODE_CODE(FormatStatus) == ERROR_CANCELLED)))
+			goto error;
+		// A drive that was dropped from the batch keeps draining the ring, so that the others can proceed
+		if (t->failed) {
+			PipelineReleaseBuffer(i);
+			continue;
+		}
+		// Skip the blocks of zeros that the drive already holds. If the drive doesn't read as zeros,
+		// back off from checking the next blocks. The writes still in flight must be reaped first, so
+		// that the buffer can be handed back without being issued.
+		if (pipeline.sparse && pipeline.is_zero[i]) {
+			if (t->throttle != 0) {
+				t->throttle--;
+			} else {
+				while ((!t->failed) && (reap_seq < seq)) {
+					if (!PipelineReapWrite(t, &reap_seq, seq))
+						goto error;
 				}
-				// Throttle read operations
-				throttle_fast_zeroing = 15;
+				if (t->failed) {
+					PipelineReleaseBuffer(i);
+					continue;
+				}
+				if (IsSkippableBlock(t->hDrive, &pipeline.buffer[i * pipeline.buf_size], t->cmp_buffer,
+					pipeline.fill_size[i], pipeline.fill_offset[i], TRUE)) {
+					t->skipped += pipeline.fill_size[i];
+					reap_seq = seq + 1;
+					PipelineReleaseBuffer(i);
+					continue;
+				}
+				t->throttle = 4;
 			}
+		}
+		slot = seq % pipeline.queue_depth;
+		if ((!IssueAsyncQueue(t->hDriveQueue, slot, TRUE, &pipeline.buffer[i * pipeline.buf_size],
+			pipeline.fill_size[i], pipeline.fill_offset[i])) && (!CompleteDriveWrite(t->hDriveQueue, slot, t == &pipeline.target[0]))) {
+			if (t == &pipeline.target[0])
+				goto error;
+			PipelineDropTarget(t, &reap_seq, seq + 1);
+			continue;
+		}
+		// Keep up to queue_depth writes in flight, by reaping the oldest one
+		if ((seq + 1 - reap_seq >= pipeline.queue_depth) && (!PipelineReapWrite(t, &reap_seq, seq + 1)))
+			goto error;
+	}
+	while ((!t->failed) && (reap_seq < seq)) {
+		if (!PipelineReapWrite(t, &reap_seq, seq))
+			goto error;
+	}
+	t->duration = GetIoTimestamp() - start;
+	ExitThread(t->failed ? 1 : 0);
+
+error:
+	InterlockedExchange(&pipeline.error, 1);
+	// Make sure the producer doesn't stay blocked waiting for a buffer
+	ReleaseSemaphore(pipeline.hFree, pipeline.nb_buffers, NULL);
+	ExitThread(1);
+}
 
-			for (i = 1; i <= WRITE_RETRIES; i++) {
-				CHECK_FOR_USER_CANCEL;
-				s = WriteFile(hPhysicalDrive, buffer, read_size[0], &write_size, NULL);
-				if ((s) && (write_size == read_size[0]))
-					break;
-				if (s)
-					uprintf("\r\nWrite error: Wrote %d bytes, expected %d bytes", write_size, read_size[0]);
-				else
-					uprintf("\r\nWrite error at sector %lld: %s", wb / SelectedDrive.SectorSize, WindowsErrorString());
+static void PipelinePostBuffer(void)
+{
+	DWORD i;
+
+	pipeline.fill_size[pipeline.fill_index] = pipeline.fill_pos;
+	pipeline.fill_offset[pipeline.fill_index] = pipeline.next_offset;
+	pipeline.is_zero[pipeline.fill_index] = pipeline.sparse &&
+		IsBufferZero(&pipeline.buffer[pipeline.fill_index * pipeline.buf_size], pipeline.fill_pos);
+	pipeline.next_offset += pipeline.fill_pos;
+	pipeline.pending[pipeline.fill_index] = pipeline.nb_targets;
+	pipeline.fill_index = (pipeline.fill_index + 1) % pipeline.nb_buffers;
+	pipeline.has_buffer = FALSE;
+	for (i = 0; i < pipeline.nb_targets; i++)
+		ReleaseSemaphore(pipeline.target[i].hFull, 1, NULL);
+}
+
+static BOOL PipelineAcquireBuffer(void)
+{
+	if (!pipeline.has_buffer) {
+		if ((WaitForSingleObject(pipeline.hFree, INFINITE) != WAIT_OBJECT_0) || (pipeline.error))
+			return FALSE;
+		pipeline.has_buffer = TRUE;
+		pipeline.fill_pos = 0;
+	}
+	return TRUE;
+}
+
+/*
+ * Decompressed image cache. When the same compressed image gets written more than once, as when
+ * flashing a series of drives one after the other, we keep the decompressed data from the first
+ * write, in RAM if it fits our budget or else in a sparse file under the app data directory, so
+ * that the next writes can just stream it, instead of going through the decompression again.
+ */
+static struct {
+	char* src;					// Path of the compressed image
+	uint64_t src_size;
+	FILETIME src_time;
+	int compression_type;
+	uint64_t size;				// Size of the decompressed data
+	uint8_t* data;				// RAM copy, or NULL when the cache is a file
+	HANDLE hFile;
+	BOOL filling, valid;
+} image_cache = { NULL, 0, { 0, 0 }, 0, 0, NULL, INVALID_HANDLE_VALUE, FALSE, FALSE };
+
+void FreeImageCache(void)
+{
+	safe_free(image_cache.src);
+	safe_free(image_cache.data);
+	// The cache file is created with FILE_FLAG_DELETE_ON_CLOSE, so this also deletes it
+	safe_closehandle(image_cache.hFile);
+	image_cache.size = 0;
+	image_cache.filling = FALSE;
+	image_cache.valid = FALSE;
+}
+
+static BOOL GetImageCacheKey(HANDLE hSourceImage, uint64_t* size, FILETIME* time)
+{
+	BY_HANDLE_FILE_INFORMATION fi;
+
+	if (!GetFileInformationByHandle(hSourceImage, &fi))
+		return FALSE;
+	*size = (((uint64_t)fi.nFileSizeHigh) << 32) | fi.nFileSizeLow;
+	*time = fi.ftLastWriteTime;
+	return TRUE;
+}
+
+static BOOL IsImageCached(HANDLE hSourceImage)
+{
+	uint64_t size;
+	FILETIME time;
+
+	if (!image_cache.valid || !GetImageCacheKey(hSourceImage, &size, &time))
+		return FALSE;
+	return (size == image_cache.src_size) && (CompareFileTime(&time, &image_cache.src_time) == 0) &&
+		(image_cache.compression_type == img_report.compression_type) && (safe_stricmp(image_path, image_cache.src) == 0);
+}
+
+// Start caching the decompressed data of the current image, which replaces any previous cache
+static BOOL OpenImageCache(HANDLE hSourceImage)
+{
+	char path[MAX_PATH];
+	DWORD size;
+
+	FreeImageCache();
+	if (!GetImageCacheKey(hSourceImage, &image_cache.src_size, &image_cache.src_time))
+		return FALSE;
+	image_cache.src = safe_strdup(image_path);
+	image_cache.compression_type = img_report.compression_type;
+	if ((img_report.image_size != 0) && (img_report.image_size <= (uint64_t)image_cache_ram_size * MB))
+		image_cache.data = (uint8_t*)malloc((size_t)img_report.image_size);
+	if (image_cache.data == NULL) {
+		static_sprintf(path, "%s\\%s", app_data_dir, FILES_DIR);
+		SHCreateDirectoryExU(NULL, path, NULL);
+		static_strcat(path, "\\image.cache");
+		image_cache.hFile = CreateFileU(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+			FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+		if (image_cache.hFile == INVALID_HANDLE_VALUE) {
+			uprintf("Could not create image cache '%s': %s", path, WindowsErrorString());
+			FreeImageCache();
+			return FALSE;
+		}
+		// The runs of zeroes are left as holes, so that mostly empty images don't take much room
+		if (!DeviceIoControl(image_cache.hFile, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &size, NULL))
+			uprintf("Could not make image cache sparse: %s", WindowsErrorString());
+	}
+	image_cache.filling = TRUE;
+	return TRUE;
+}
+
+static void ImageCacheAppend(const uint8_t* buf, unsigned int count)
+{
+	LARGE_INTEGER li;
+	DWORD size;
+	unsigned int pos, len;
+
+	if (image_cache.data != NULL) {
+		if (image_cache.size + count > img_report.image_size) {
+			uprintf("Image cache overflow - Disabling");
+			FreeImageCache();
+			return;
+		}
+		memcpy(&image_cache.data[image_cache.size], buf, count);
+		image_cache.size += count;
+		return;
+	}
+	for (pos = 0; pos < count; pos += len) {
+		len = min(count - pos, IMG_SAVE_SPARSE_CHUNK);
+		if ((len == IMG_SAVE_SPARSE_CHUNK) && IsBufferZero(&buf[pos], len)) {
+			li.QuadPart = len;
+			if (!SetFilePointerEx(image_cache.hFile, li, NULL, FILE_CURRENT))
+				goto error;
+		} else if (!WriteFile(image_cache.hFile, &buf[pos], len, &size, NULL) || (size != len)) {
+			goto error;
+		}
+		image_cache.size += len;
+	}
+	return;
+
+error:
+	uprintf("Could not write image cache: %s - Disabling", WindowsErrorString());
+	FreeImageCache();
+}
+
+static void CloseImageCache(BOOL success)
+{
+	LARGE_INTEGER li;
+
+	if (!image_cache.filling)
+		return;
+	image_cache.filling = FALSE;
+	if (!success) {
+		FreeImageCache();
+		return;
+	}
+	if (image_cache.hFile != INVALID_HANDLE_VALUE) {
+		// Extend the file over any trailing hole
+		li.QuadPart = image_cache.size;
+		if (!SetFilePointerEx(image_cache.hFile, li, NULL, FILE_BEGIN) || !SetEndOfFile(image_cache.hFile)) {
+			uprintf("Could not finalize image cache: %s", WindowsErrorString());
+			FreeImageCache();
+			return;
+		}
+	}
+	image_cache.valid = TRUE;
+	uprintf("Kept %s of decompressed data in %s, for the next writes of this image",
+		SizeToHumanReadable(image_cache.size, FALSE, FALSE), (image_cache.data != NULL) ? "RAM" : "the cache file");
+}
+
+// bled write override, that feeds the pipeline. Since the pipeline buffers are a
+// multiple of the sector size, this also takes care of streams that aren't.
+static int pipeline_write(int fd, const void* _buf, unsigned int count)
+{
+	const uint8_t* buf = (const uint8_t*)_buf;
+	unsigned int size, written = 0;
+
+	if (hash_on_write && !WriteHashStream(buf, count))
+		return -1;
+	if (image_cache.filling)
+		ImageCacheAppend(buf, count);
+	image_written_size += count;
+	if (pipeline.skip != 0) {
+		written = (unsigned int)min(count, pipeline.skip);
+		pipeline.skip -= written;
+	}
+	while (written < count) {
+		if (!PipelineAcquireBuffer())
+			return -1;
+		size = min(count - written, pipeline.buf_size - pipeline.fill_pos);
+		memcpy(&pipeline.buffer[pipeline.fill_index * pipeline.buf_size + pipeline.fill_pos], &buf[written], size);
+		pipeline.fill_pos += size;
+		written += size;
+		if (pipeline.fill_pos == pipeline.buf_size)
+			PipelinePostBuffer();
+	}
+	return (int)count;
+}
+
+// bled seek override, for the VTSI segments. Contiguous segments just keep filling the
+// current buffer, so that the target gets the same large writes as for other images.
+static int64_t pipeline_seek(int fd, int64_t offset)
+{
+	DWORD sec_size = SelectedDrive.SectorSize;
+
+	if ((uint64_t)offset == pipeline.next_offset + (pipeline.has_buffer ? pipeline.fill_pos : 0))
+		return offset;
+	if ((offset % sec_size != 0) || (pipeline.has_buffer && (pipeline.fill_pos % sec_size != 0))) {
+		uprintf("\r\nCannot write image segment at unaligned offset 0x%llX", offset);
+		return -1;
+	}
+	// A zero sized buffer would be taken as the end of the stream
+	if (pipeline.has_buffer && (pipeline.fill_pos != 0))
+		PipelinePostBuffer();
+	pipeline.next_offset = offset;
+	return offset;
+}
+
+// Feed the pipeline with an uncompressed image, that gets read straight into the ring buffers
+static BOOL PipelineReadImage(HANDLE hSourceImage, uint64_t target_size)
+{
+	DWORD size, sec_size = SelectedDrive.SectorSize;
+	uint8_t* buf;
+
+	for (image_written_size = 0; image_written_size < target_size; image_written_size += size) {
+		update_progress(image_written_size);
+		if (IS_ERROR(FormatStatus) && (SCODE_CODE(FormatStatus) == ERROR_CANCELLED))
+			return FALSE;
+		if (!PipelineAcquireBuffer())
+			return FALSE;
+		buf = &pipeline.buffer[pipeline.fill_index * pipeline.buf_size];
+		if (!ReadFile(hSourceImage, buf, pipeline.buf_size, &size, NULL)) {
+			uprintf("\r\nRead error: %s", WindowsErrorString());
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_READ_FAULT;
+			return FALSE;
+		}
+		// Don't overflow our projected size (mostly for VHDs)
+		if (image_written_size + size > target_size)
+			size = (DWORD)(target_size - image_written_size);
+		if (size == 0)
+			break;
+		if (hash_on_write && !WriteHashStream(buf, size))
+			return FALSE;
+		// WriteFile fails unless the size is a multiple of sector size
+		pipeline.fill_pos = ((size + sec_size - 1) / sec_size) * sec_size;
+		memset(&buf[size], 0, pipeline.fill_pos - size);
+		PipelinePostBuffer();
+	}
+	return TRUE;
+}
+
+// Feed the pipeline with an area of a drive, that gets read straight into the ring buffers
+static BOOL PipelineReadDrive(HANDLE hSourceDrive, uint64_t offset, uint64_t size, uint64_t* done, uint64_t total)
+{
+	OVERLAPPED overlapped = { 0 };
+	DWORD len, read_size;
+	uint64_t pos;
+	uint8_t* buf;
+
+	if (pipeline_seek(0, offset) < 0)
+		return FALSE;
+	for (pos = offset; pos < offset + size; pos += len, *done += len) {
+		UpdateProgressWithInfo(OP_FORMAT, MSG_261, *done, total);
+		if (IS_ERROR(FormatStatus) && (SCODE_CODE(FormatStatus) == ERROR_CANCELLED))
+			return FALSE;
+		if (!PipelineAcquireBuffer())
+			return FALSE;
+		buf = &pipeline.buffer[pipeline.fill_index * pipeline.buf_size];
+		len = (DWORD)min(pipeline.buf_size, offset + size - pos);
+		overlapped.Offset = (DWORD)pos;
+		overlapped.OffsetHigh = (DWORD)(pos >> 32);
+		if (!ReadFile(hSourceDrive, buf, len, &read_size, &overlapped) || (read_size != len)) {
+			uprintf("\r\nRead error at offset 0x%llX: %s", pos, WindowsErrorString());
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_READ_FAULT;
+			return FALSE;
+		}
+		pipeline.fill_pos = len;
+		PipelinePostBuffer();
+	}
+	return TRUE;
+}
+
+// Feed the pipeline with the decompressed data we kept from a previous write
+static BOOL PipelineReadCache(void)
+{
+	LARGE_INTEGER li;
+	uint64_t pos;
+	unsigned int len;
+
+	if (image_cache.data == NULL) {
+		li.QuadPart = 0;
+		if (!SetFilePointerEx(image_cache.hFile, li, NULL, FILE_BEGIN)) {
+			uprintf("Could not rewind image cache: %s", WindowsErrorString());
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_READ_FAULT;
+			return FALSE;
+		}
+		return PipelineReadImage(image_cache.hFile, image_cache.size);
+	}
+	for (pos = 0; pos < image_cache.size; pos += len) {
+		update_progress(pos);
+		if (IS_ERROR(FormatStatus) && (SCODE_CODE(FormatStatus) == ERROR_CANCELLED))
+			return FALSE;
+		len = (unsigned int)min(image_cache.size - pos, DD_BUFFER_SIZE);
+		if (pipeline_write(0, &image_cache.data[pos], len) < 0)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static BOOL OpenPipeline(HANDLE hPhysicalDrive, IO_HEATMAP* heatmap, uint64_t start_offset, BOOL sparse)
+{
+	DWORD i, queue_depth, nb_lag_buffers = (nb_batch_targets > 0) ? DD_BATCH_LAG_BUFFERS : 0;
+	pipeline_target* t;
+
+	memset(&pipeline, 0, sizeof(pipeline));
+	pipeline.next_offset = start_offset;
+	pipeline.sparse = sparse;
+	// Align to the physical sector size, so that only the very last write may not be a multiple of it
+	pipeline.buf_size = ((DD_BUFFER_SIZE + GetIoAlignment() - 1) / GetIoAlignment()) * GetIoAlignment();
+	// One buffer gets filled by the producer, while the others are being written
+	for (queue_depth = min(write_queue_depth, MAX_ASYNC_QUEUE_DEPTH - 1); queue_depth > 0; queue_depth--) {
+		pipeline.buffer = (uint8_t*)AllocIoBuffer((size_t)pipeline.buf_size * (queue_depth + 1 + nb_lag_buffers));
+		if (pipeline.buffer != NULL)
+			break;
+	}
+	if (pipeline.buffer == NULL) {
+		uprintf("Could not allocate disk write buffer");
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+		return FALSE;
+	}
+	pipeline.queue_depth = queue_depth;
+	pipeline.nb_buffers = queue_depth + 1 + nb_lag_buffers;
+	pipeline.nb_targets = nb_batch_targets + 1;
+	pipeline.target[0].hDrive = hPhysicalDrive;
+	pipeline.target[0].index = SelectedDrive.DeviceNumber;
+	for (i = 0; i < nb_batch_targets; i++) {
+		pipeline.target[i + 1].hDrive = batch_target[i].hDrive;
+		pipeline.target[i + 1].index = batch_target[i].index;
+	}
+	pipeline.hFree = CreateSemaphore(NULL, pipeline.nb_buffers, 2 * pipeline.nb_buffers, NULL);
+	if (pipeline.hFree == NULL) {
+		uprintf("Could not create write pipeline: %s", WindowsErrorString());
+		goto error;
+	}
+	for (i = 0; i < pipeline.nb_targets; i++) {
+		t = &pipeline.target[i];
+		t->hDriveQueue = BlockCreateQueue(t->hDrive, GENERIC_READ | GENERIC_WRITE, queue_depth,
+			(i == 0) ? heatmap : batch_target[i - 1].heatmap);
+		t->hFull = CreateSemaphore(NULL, 0, pipeline.nb_buffers, NULL);
+		if ((t->hDriveQueue == NULL) || (t->hFull == NULL)) {
+			uprintf("Could not create write pipeline: %s", WindowsErrorString());
+			goto error;
+		}
+		if (sparse) {
+			t->cmp_buffer = (uint8_t*)AllocIoBuffer(pipeline.buf_size);
+			if (t->cmp_buffer == NULL) {
+				uprintf("Could not allocate disk comparison buffer");
+				goto error;
+			}
+		}
+	}
+	for (i = 0; i < pipeline.nb_targets; i++) {
+		t = &pipeline.target[i];
+		t->hThread = CreateThread(NULL, 0, PipelineWriterThread, t, 0, NULL);
+		if (t->hThread == NULL) {
+			uprintf("Could not start write pipeline thread: %s", WindowsErrorString());
+			goto error;
+		}
+		SetThreadPriority(t->hThread, default_thread_priority);
+		SetThreadClass(t->hThread, THREAD_CLASS_IO, (int)i);
+	}
+	uprintf("Using a write pipeline with %d buffers of %s", pipeline.nb_buffers,
+		SizeToHumanReadable(pipeline.buf_size, FALSE, FALSE));
+	if (pipeline.nb_targets > 1)
+		uprintf("Batch: Writing the image to %d drives, with a lag window of %d buffers", pipeline.nb_targets, nb_lag_buffers);
+	return TRUE;
+
+error:
+	// Have the writers that we already started exit right away
+	InterlockedExchange(&pipeline.error, 1);
+	for (i = 0; i < pipeline.nb_targets; i++) {
+		t = &pipeline.target[i];
+		if (t->hThread != NULL) {
+			ReleaseSemaphore(t->hFull, 1, NULL);
+			WaitForSingleObject(t->hThread, INFINITE);
+			safe_closehandle(t->hThread);
+		}
+		CloseAsyncQueue(t->hDriveQueue);
+		safe_closehandle(t->hFull);
+		safe_free_io_buffer(t->cmp_buffer);
+	}
+	safe_closehandle(pipeline.hFree);
+	safe_free_io_buffer(pipeline.buffer);
+	FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | APPERR(ERROR_CANT_START_THREAD);
+	return FALSE;
+}
+
+// Flush the data remaining in the pipeline (if requested), then tear it down.
+// The returned status is the one of the selected drive.
+static BOOL ClosePipeline(BOOL flush)
+{
+	DWORD i, exit_code, sec_size = SelectedDrive.SectorSize;
+	BOOL ret = FALSE;
+	pipeline_target* t;
+	char str[32];
+
+	if (flush && pipeline.has_buffer && (pipeline.fill_pos % sec_size != 0)) {
+		// A disk image that doesn't end up on disk boundary should be a rare
+		// enough case, so we just pad the last sector and issue a notice.
+		uprintf("Notice: Compressed image data didn't end on block boundary.");
+		memset(&pipeline.buffer[pipeline.fill_index * pipeline.buf_size + pipeline.fill_pos], 0,
+			sec_size - (pipeline.fill_pos % sec_size));
+		pipeline.fill_pos += sec_size - (pipeline.fill_pos % sec_size);
+	}
+	if (flush && pipeline.has_buffer && (pipeline.fill_pos != 0))
+		PipelinePostBuffer();
+	// Post the end of stream marker, using the current buffer if we have one
+	if (!pipeline.has_buffer)
+		PipelineAcquireBuffer();
+	pipeline.fill_pos = 0;
+	PipelinePostBuffer();
+	for (i = 0; i < pipeline.nb_targets; i++) {
+		t = &pipeline.target[i];
+		exit_code = 1;
+		WaitForSingleObject(t->hThread, INFINITE);
+		GetExitCodeThread(t->hThread, &exit_code);
+		safe_closehandle(t->hThread);
+		CloseAsyncQueue(t->hDriveQueue);
+		safe_closehandle(t->hFull);
+		safe_free_io_buffer(t->cmp_buffer);
+		if (i == 0) {
+			ret = (exit_code == 0) && (!pipeline.error);
+		} else if ((exit_code == 0) && (!pipeline.error)) {
+			RefreshDriveLayout(t->hDrive);
+			static_strcpy(str, SizeToHumanReadable(t->written, FALSE, FALSE));
+			uprintf("Batch: Disk %d: Wrote %s (%s/s)", (int)t->index, str, SizeToHumanReadable(
+				(t->duration == 0) ? 0 : (t->written * 1000000ULL) / t->duration, FALSE, FALSE));
+			if (t->skipped != 0)
+				uprintf("Batch: Disk %d: Skipped %s of already zeroed data", (int)t->index,
+					SizeToHumanReadable(t->skipped, FALSE, FALSE));
+		} else {
+			uprintf("Batch: Disk %d: Write FAILED", (int)t->index);
+		}
+	}
+	safe_closehandle(pipeline.hFree);
+	safe_free_io_buffer(pipeline.buffer);
+	return ret;
+}
+
+/*
+ * Retrieve the allocated ranges of a (possibly sparse) source image, so that sparse
+ * writes can skip the ranges that are known to be zeroed without having to scan them.
+ * Returns the number of ranges, or 0 if this information is not available.
+ */
+static DWORD GetAllocatedRanges(const char* path, FILE_ALLOCATED_RANGE_BUFFER** ranges)
+{
+	FILE_ALLOCATED_RANGE_BUFFER query, *new_ranges;
+	HANDLE hFile;
+	DWORD size, max_ranges = 64, nb_ranges = 0;
+
+	*ranges = NULL;
+	// We can't issue a synchronous IOCTL on the overlapped source handle
+	hFile = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return 0;
+	query.FileOffset.QuadPart = 0;
+	if (!GetFileSizeEx(hFile, &query.Length))
+		goto out;
+	do {
+		max_ranges *= 2;
+		new_ranges = (FILE_ALLOCATED_RANGE_BUFFER*)realloc(*ranges, max_ranges * sizeof(FILE_ALLOCATED_RANGE_BUFFER));
+		if (new_ranges == NULL)
+			break;
+		*ranges = new_ranges;
+		if (DeviceIoControl(hFile, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query), *ranges,
+			max_ranges * sizeof(FILE_ALLOCATED_RANGE_BUFFER), &size, NULL)) {
+			nb_ranges = size / sizeof(FILE_ALLOCATED_RANGE_BUFFER);
+			break;
+		}
+	} while ((GetLastError() == ERROR_MORE_DATA) && (max_ranges < 65536));
+
+out:
+	if (nb_ranges == 0)
+		safe_free(*ranges);
+	CloseHandle(hFile);
+	return nb_ranges;
+}
+
+/*
+ * Check if a block from the source image intersects any allocated range. <cursor> is used
+ * to keep track of the current range, since blocks are always processed in sequence.
+ */
+static BOOL IsRangeAllocated(FILE_ALLOCATED_RANGE_BUFFER* ranges, DWORD nb_ranges, DWORD* cursor,
+	uint64_t offset, DWORD size)
+{
+	// No information => everything must be treated as allocated
+	if (nb_ranges == 0)
+		return TRUE;
+	while ((*cursor < nb_ranges) && ((uint64_t)(ranges[*cursor].FileOffset.QuadPart +
+		ranges[*cursor].Length.QuadPart) <= offset))
+		(*cursor)++;
+	return (*cursor < nb_ranges) && ((uint64_t)ranges[*cursor].FileOffset.QuadPart < offset + size);
+}
+
+/*
+ * For delta writes, compare a DD block with the matching area of the target, in chunks of
+ * DELTA_WRITE_CHUNK, and report the part of the block that needs to be written as [*start, *end[,
+ * which is empty if the target already holds the same data. Since reading from flash media is
+ * a lot faster than writing, re-flashing a drive with a newer build of the same image becomes
+ * mostly read-bound. Returns FALSE if the target couldn't be read, so the whole block gets written.
+ */
+static BOOL GetDeltaRange(HANDLE hPhysicalDrive, const uint8_t* buf, uint8_t* cmp_buf,
+	DWORD size, uint64_t offset, DWORD* start, DWORD* end)
+{
+	OVERLAPPED overlapped = { 0 };
+	DWORD read_size, pos, len;
+
+	overlapped.Offset = (DWORD)offset;
+	overlapped.OffsetHigh = (DWORD)(offset >> 32);
+	if (!ReadFile(hPhysicalDrive, cmp_buf, size, &read_size, &overlapped) || (read_size != size))
+		return FALSE;
+	*start = size;
+	*end = 0;
+	for (pos = 0; pos < size; pos += len) {
+		len = min(size - pos, DELTA_WRITE_CHUNK);
+		if (memcmp(&buf[pos], &cmp_buf[pos], len) != 0) {
+			if (*start == size)
+				*start = pos;
+			*end = pos + len;
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Export an I/O heatmap, if requested, as CSV and JSON files that are named after the
+ * drive and the operation, in the same directory as the bad blocks log.
+ */
+static void SaveIoHeatmap(IO_HEATMAP* heatmap, DWORD DeviceNumber, const char* operation)
+{
+	char path[MAX_PATH], *userdir;
+	SYSTEMTIME lt;
+
+	if (!export_heatmap || (heatmap == NULL))
+		return;
+	userdir = getenvU("USERPROFILE");
+	GetLocalTime(&lt);
+	static_sprintf(path, "%s\\rufus_%04d%02d%02d_%02d%02d%02d_disk%d_%s", userdir,
+		lt.wYear, lt.wMonth, lt.wDay, lt.wHour, lt.wMinute, lt.wSecond, (int)DeviceNumber, operation);
+	safe_free(userdir);
+	ExportIoHeatmap(heatmap, path);
+}
+
+/*
+ * Online tuning of the image write parameters, for the drive models that haven't been
+ * benchmarked yet. The beginning of the image is written in successive phases, that each
+ * use a different request size and then a different queue depth, and are timed. The rest
+ * of the image is written with the best combination, which is also saved for the model.
+ */
+static const DWORD tune_sizes[] = { 1 * MB, 4 * MB, 16 * MB, 32 * MB };
+static const DWORD tune_depths[] = { 1, 2, 4, 8, MAX_ASYNC_QUEUE_DEPTH - 1 };
+#define NB_TUNE_SIZES  ARRAYSIZE(tune_sizes)
+#define NB_TUNE_PHASES (ARRAYSIZE(tune_sizes) + ARRAYSIZE(tune_depths))
+
+typedef struct {
+	int phase;						// -1 when not tuning
+	size_t mem_size;				// Size of the buffer the requests are carved from
+	DWORD max_size;
+	uint64_t start_time;
+	uint64_t start_bytes;
+	DWORD size[NB_TUNE_PHASES];
+	DWORD ring[NB_TUNE_PHASES];		// Number of buffers, i.e. queue depth + 1
+	uint64_t speed[NB_TUNE_PHASES];
+} dd_tuner;
+
+static void GetTunePhase(dd_tuner* t, DWORD* size, DWORD* ring)
+{
+	DWORD depth;
+
+	*size = (t->phase < (int)NB_TUNE_SIZES) ? min(tune_sizes[t->phase], t->max_size) : t->size[NB_TUNE_SIZES];
+	depth = (t->phase < (int)NB_TUNE_SIZES) ? DD_TUNE_SIZE_DEPTH : tune_depths[t->phase - NB_TUNE_SIZES];
+	*ring = (DWORD)min(min(depth + 1, MAX_ASYNC_QUEUE_DEPTH), t->mem_size / *size);
+}
+
+// Pick the smallest value of a tuning parameter that gets close enough to the best throughput
+static int PickTunePhase(dd_tuner* t, int first, int last, DWORD* values)
+{
+	int i, best = -1;
+	uint64_t best_speed = 0;
+
+	for (i = first; i < last; i++)
+		best_speed = max(best_speed, t->speed[i]);
+	for (i = first; i < last; i++) {
+		if (t->speed[i] < (uint64_t)(DD_TUNE_TOLERANCE * best_speed))
+			continue;
+		if ((best < 0) || (values[i] < values[best]))
+			best = i;
+	}
+	return best;
+}
+
+// The size of the data to write before moving to the next phase
+static __inline uint64_t TunePhaseSize(DWORD size, DWORD ring)
+{
+	return max(DD_TUNE_PHASE_SIZE, 2ULL * size * ring);
+}
+
+/*
+ * Time the phase that just completed, at bytes written, and return the request size and
+ * number of buffers for the next one. Once all the phases are done, the best combination
+ * is returned, and saved for the drive model.
+ */
+static void NextTunePhase(dd_tuner* t, uint64_t bytes, DWORD* size, DWORD* ring)
+{
+	int best_size, best_ring;
+	uint64_t now = GetIoTimestamp();
+
+	t->size[t->phase] = *size;
+	t->ring[t->phase] = *ring;
+	t->speed[t->phase] = (now == t->start_time) ? 0 : ((bytes - t->start_bytes) * 1000000ULL) / (now - t->start_time);
+	uprintf("\r\nWrite tuning: %s requests, queue depth %d: %s/s", SizeToHumanReadable(*size, FALSE, FALSE),
+		*ring - 1, SizeToHumanReadable(t->speed[t->phase], FALSE, FALSE));
+	if (++t->phase == NB_TUNE_SIZES) {
+		// Keep the best request size for the queue depth phases (in the slot of the first one)
+		best_size = PickTunePhase(t, 0, NB_TUNE_SIZES, t->size);
+		t->size[NB_TUNE_SIZES] = t->size[best_size];
+	}
+	// Skip the queue depths that can't be reached with this request size, or that were already tried
+	for (; t->phase < (int)NB_TUNE_PHASES; t->phase++) {
+		GetTunePhase(t, size, ring);
+		if ((t->phase < (int)NB_TUNE_SIZES) || (t->phase == NB_TUNE_SIZES) || (*ring != t->ring[t->phase - 1]))
+			break;
+		t->size[t->phase] = *size;
+		t->ring[t->phase] = *ring;
+		t->speed[t->phase] = 0;
+	}
+	if (t->phase < (int)NB_TUNE_PHASES) {
+		t->start_time = GetIoTimestamp();
+		t->start_bytes = bytes;
+		return;
+	}
+	best_ring = PickTunePhase(t, NB_TUNE_SIZES, NB_TUNE_PHASES, t->ring);
+	*size = t->size[best_ring];
+	*ring = t->ring[best_ring];
+	t->phase = -1;
+	uprintf("Write tuning: Using %s requests at queue depth %d for the rest of the image",
+		SizeToHumanReadable(*size, FALSE, FALSE), *ring - 1);
+	SetTunedDriveIO(SelectedDrive.DeviceNumber, *size, *ring - 1);
+}
+
+/*
+ * Write a dynamic VHD or VHDX image through its block allocation map, so that only the
+ * allocated blocks get read from the image. The runs of unallocated blocks are zeroed on
+ * the target instead, with a TRIM when the device reads trimmed blocks as zeroes.
+ */
+static uint64_t vdisk_zero_base, vdisk_size;
+static void vdisk_zero_progress(uint64_t done, uint64_t total)
+{
+	UpdateProgressWithInfo(OP_FORMAT, MSG_261, vdisk_zero_base + done, vdisk_size);
+}
+
+static BOOL WriteVirtualDisk(HANDLE hPhysicalDrive, IO_HEATMAP* heatmap)
+{
+	BOOL ret = FALSE;
+	HANDLE hSourceImage = INVALID_HANDLE_VALUE, hDriveQueue = NULL;
+	LARGE_INTEGER li;
+	VDISK_MAP* map = NULL;
+	DWORD i, slot = 0, size, read_size, write_size, chunk, nb_buffers = 0, sec_size = SelectedDrive.SectorSize;
+	uint64_t offset, zero_start = 0, zero_size = 0, zeroed_size = 0, allocated_size = 0;
+	uint64_t cur_value, last_value = UINT64_MAX;
+	uint8_t *buffer = NULL, *zero_buffer = NULL;
+	uint32_t block;
+	int queue_depth;
+
+	hSourceImage = CreateFileU(image_path, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hSourceImage == INVALID_HANDLE_VALUE) {
+		uprintf("Could not open image '%s': %s", image_path, WindowsErrorString());
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_OPEN_FAILED;
+		goto out;
+	}
+	map = GetVirtualDiskMap(hSourceImage);
+	if ((map == NULL) || (map->block_size % sec_size != 0)) {
+		uprintf("Could not use the block allocation map of the image");
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_READ_FAULT;
+		goto out;
+	}
+
+	// Requests never span more than one block of the image
+	chunk = min(map->block_size, DD_BUFFER_SIZE);
+	for (queue_depth = min(write_queue_depth, MAX_ASYNC_QUEUE_DEPTH); queue_depth > 0; queue_depth--) {
+		nb_buffers = queue_depth;
+		buffer = (uint8_t*)AllocIoBuffer((size_t)chunk * nb_buffers);
+		if (buffer != NULL)
+			break;
+	}
+	// Unallocated blocks must still go through the checksums
+	if (hash_on_write)
+		zero_buffer = (uint8_t*)calloc(1, chunk);
+	if ((buffer == NULL) || (hash_on_write && (zero_buffer == NULL))) {
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+		uprintf("Could not allocate disk write buffer");
+		goto out;
+	}
+	hDriveQueue = BlockCreateQueue(hPhysicalDrive, GENERIC_READ | GENERIC_WRITE, nb_buffers, heatmap);
+	if (hDriveQueue == NULL) {
+		uprintf("Could not create drive write queue: %s", WindowsErrorString());
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+		goto out;
+	}
+
+	vdisk_size = map->disk_size;
+	for (offset = 0; offset < map->disk_size; offset += size) {
+		UpdateProgressWithInfo(OP_FORMAT, MSG_261, offset, map->disk_size);
+		cur_value = (offset * min(80, map->disk_size)) / map->disk_size;
+		if (cur_value != last_value) {
+			last_value = cur_value;
+			uprintfs("+");
+		}
+		CHECK_FOR_USER_CANCEL;
+		block = (uint32_t)(offset / map->block_size);
+		size = (DWORD)min(min(chunk, (uint64_t)(block + 1) * map->block_size - offset), map->disk_size - offset);
+		if (map->block[block] == 0) {
+			if (zero_size == 0)
+				zero_start = offset;
+			zero_size += size;
+			if (hash_on_write && !WriteHashStream(zero_buffer, size))
+				goto out;
+			continue;
+		}
+		if (zero_size != 0) {
+			vdisk_zero_base = zero_start;
+			if (!ZeroDriveRange(hPhysicalDrive, zero_start, zero_size, ZF_ALLOW_TRIM, heatmap, vdisk_zero_progress))
+				goto zero_error;
+			zeroed_size += zero_size;
+			zero_size = 0;
+		}
+		// Reuse the buffer once the write that used it has completed
+		if (!CompleteDriveWrite(hDriveQueue, slot, TRUE))
+			goto out;
+		li.QuadPart = map->block[block] + offset % map->block_size;
+		if ((!SetFilePointerEx(hSourceImage, li, NULL, FILE_BEGIN)) ||
+			(!ReadFile(hSourceImage, &buffer[(size_t)slot * chunk], size, &read_size, NULL)) || (read_size != size)) {
+			uprintf("\r\nRead error: %s", WindowsErrorString());
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_READ_FAULT;
+			goto out;
+		}
+		if (hash_on_write && !WriteHashStream(&buffer[(size_t)slot * chunk], size))
+			goto out;
+		// WriteFile fails unless the size is a multiple of sector size
+		write_size = ((size + sec_size - 1) / sec_size) * sec_size;
+		memset(&buffer[(size_t)slot * chunk + size], 0, write_size - size);
+		if ((!IssueAsyncQueue(hDriveQueue, slot, TRUE, &buffer[(size_t)slot * chunk], write_size, offset)) &&
+			(!CompleteDriveWrite(hDriveQueue, slot, TRUE)))
+			goto out;
+		allocated_size += size;
+		slot = (slot + 1) % nb_buffers;
+	}
+	if (zero_size != 0) {
+		vdisk_zero_base = zero_start;
+		if (!ZeroDriveRange(hPhysicalDrive, zero_start, zero_size, ZF_ALLOW_TRIM, heatmap, vdisk_zero_progress))
+			goto zero_error;
+		zeroed_size += zero_size;
+	}
+	for (i = 0; i < nb_buffers; i++) {
+		if (!CompleteDriveWrite(hDriveQueue, i, TRUE))
+			goto out;
+	}
+	image_written_size = map->disk_size;
+	uprintfs("\r\n");
+	uprintf("Dynamic image: Wrote %s of allocated blocks", SizeToHumanReadable(allocated_size, FALSE, FALSE));
+	uprintf("Dynamic image: Zeroed %s of unallocated blocks", SizeToHumanReadable(zeroed_size, FALSE, FALSE));
+	ret = TRUE;
+	goto out;
+
+zero_error:
+	if (!IS_ERROR(FormatStatus))
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT;
+
+out:
+	// Must be closed before the buffers get freed, as it waits for in-flight writes
+	CloseAsyncQueue(hDriveQueue);
+	safe_free_io_buffer(buffer);
+	free(zero_buffer);
+	FreeVirtualDiskMap(map);
+	safe_closehandle(hSourceImage);
+	return ret;
+}
+
+/*
+ * Write a Full Flash Update image. Its payload is read sequentially, and each run of blocks
+ * is written at the disk locations that its write descriptor lists, so that only the payload
+ * gets written. Each chunk of the payload is validated against the image hash table first.
+ */
+static BOOL WriteFFU(HANDLE hPhysicalDrive, IO_HEATMAP* heatmap)
+{
+	BOOL ret = FALSE;
+	HANDLE hSourceImage = INVALID_HANDLE_VALUE, hDriveQueue = NULL;
+	LARGE_INTEGER li;
+	FFU_IMAGE* ffu = NULL;
+	FFU_LOCATION* loc;
+	DWORD i, j, slot = 0, size, read_size, buf_size, nb_buffers = 0;
+	uint64_t rb = 0, wb = 0, entry_size, entry_offset, disk_offset;
+	uint64_t cur_value, last_value = UINT64_MAX;
+	uint8_t* buffer = NULL;
+	int queue_depth;
+
+	hSourceImage = CreateFileU(image_path, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hSourceImage == INVALID_HANDLE_VALUE) {
+		uprintf("Could not open image '%s': %s", image_path, WindowsErrorString());
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_OPEN_FAILED;
+		goto out;
+	}
+	ffu = GetFFUImage(hSourceImage);
+	if ((ffu == NULL) || (ffu->block_size % SelectedDrive.SectorSize != 0)) {
+		uprintf("Could not use the write descriptors of the image");
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_READ_FAULT;
+		goto out;
+	}
+	if (ffu->nb_hashes == 0)
+		uprintf("Notice: The payload of this image can not be validated");
+
+	// Requests are whole blocks, and therefore whole hashed chunks
+	buf_size = max(DD_BUFFER_SIZE / ffu->block_size, 1) * ffu->block_size;
+	for (queue_depth = min(write_queue_depth, MAX_ASYNC_QUEUE_DEPTH); queue_depth > 0; queue_depth--) {
+		nb_buffers = queue_depth;
+		buffer = (uint8_t*)AllocIoBuffer((size_t)buf_size * nb_buffers);
+		if (buffer != NULL)
+			break;
+	}
+	if (buffer == NULL) {
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+		uprintf("Could not allocate disk write buffer");
+		goto out;
+	}
+	hDriveQueue = BlockCreateQueue(hPhysicalDrive, GENERIC_READ | GENERIC_WRITE, nb_buffers, heatmap);
+	if (hDriveQueue == NULL) {
+		uprintf("Could not create drive write queue: %s", WindowsErrorString());
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+		goto out;
+	}
+
+	li.QuadPart = ffu->payload_offset;
+	if (!SetFilePointerEx(hSourceImage, li, NULL, FILE_BEGIN))
+		goto read_error;
+	for (i = 0; i < ffu->nb_entries; i++) {
+		entry_size = (uint64_t)ffu->entry[i].nb_blocks * ffu->block_size;
+		for (entry_offset = 0; entry_offset < entry_size; entry_offset += size) {
+			UpdateProgressWithInfo(OP_FORMAT, MSG_261, rb, ffu->payload_size);
+			cur_value = (rb * min(80, ffu->payload_size)) / ffu->payload_size;
+			if (cur_value != last_value) {
+				last_value = cur_value;
+				uprintfs("+");
+			}
+			CHECK_FOR_USER_CANCEL;
+			size = (DWORD)min(buf_size, entry_size - entry_offset);
+			// Reuse the buffer once the writes that used it have completed
+			if (!CompleteDriveWrite(hDriveQueue, slot, TRUE))
+				goto out;
+			if ((!ReadFile(hSourceImage, &buffer[(size_t)slot * buf_size], size, &read_size, NULL)) || (read_size != size))
+				goto read_error;
+			if (!CheckFFUChunks(ffu, ffu->first_hash + (uint32_t)(rb / ffu->chunk_size), &buffer[(size_t)slot * buf_size], size)) {
+				uprintf("\r\nThe image is corrupted (at payload offset 0x%llx)", rb);
+				FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_FILE_CORRUPT;
+				goto out;
+			}
+			for (j = 0; j < ffu->entry[i].nb_locations; j++) {
+				loc = &ffu->entry[i].location[j];
+				if (loc->from_end && ((uint64_t)(loc->block_index + 1) * ffu->block_size > (uint64_t)SelectedDrive.DiskSize))
+					goto location_error;
+				disk_offset = (loc->from_end ? SelectedDrive.DiskSize - (uint64_t)(loc->block_index + 1) * ffu->block_size :
+					(uint64_t)loc->block_index * ffu->block_size) + entry_offset;
+				if (disk_offset + size > (uint64_t)SelectedDrive.DiskSize)
+					goto location_error;
+				// The same buffer is written at each location, one after the other
+				if ((j > 0) && !CompleteDriveWrite(hDriveQueue, slot, TRUE))
+					goto out;
+				if ((!IssueAsyncQueue(hDriveQueue, slot, TRUE, &buffer[(size_t)slot * buf_size], size, disk_offset)) &&
+					(!CompleteDriveWrite(hDriveQueue, slot, TRUE)))
+					goto out;
+				wb += size;
+			}
+			rb += size;
+			slot = (slot + 1) % nb_buffers;
+		}
+	}
+	for (i = 0; i < nb_buffers; i++) {
+		if (!CompleteDriveWrite(hDriveQueue, i, TRUE))
+			goto out;
+	}
+	uprintfs("\r\n");
+	uprintf("FFU image: Wrote %s to the drive, from %s of payload", SizeToHumanReadable(wb, FALSE, FALSE),
+		SizeToHumanReadable(rb, FALSE, FALSE));
+	ret = TRUE;
+	goto out;
+
+location_error:
+	uprintf("\r\nThe image has blocks that are located outside of the drive");
+	FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_FILE_TOO_LARGE;
+	goto out;
+
+read_error:
+	uprintf("\r\nRead error: %s", WindowsErrorString());
+	FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_READ_FAULT;
+
+out:
+	// Must be closed before the buffers get freed, as it waits for in-flight writes
+	CloseAsyncQueue(hDriveQueue);
+	safe_free_io_buffer(buffer);
+	FreeFFUImage(ffu);
+	safe_closehandle(hSourceImage);
+	return ret;
+}
+
+// Open the hash stream for the data being written, which also computes its block manifest if needed
+static BOOL OpenWriteHashStream(void)
+{
+	return OpenHashStreamEx((enable_block_manifest || image_badblocks_pass) ? &write_manifest : NULL);
+}
+
+/* Write an image file or zero a drive */
+static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
+{
+	BOOL s, ret = FALSE;
+	LARGE_INTEGER li;
+	HANDLE hSourceImage = INVALID_HANDLE_VALUE, hDriveQueue = NULL;
+	DWORD i, read_size[MAX_ASYNC_QUEUE_DEPTH], write_size, comp_size, buf_size, nb_buffers = 0;
+	uint64_t wb, target_size = bZeroDrive ? SelectedDrive.DiskSize : img_report.image_size;
+	uint64_t cur_value, last_value = UINT64_MAX, skipped_size = 0, resume_offset = 0;
+	DWORD delta_start, delta_end, status;
+	char manifest_path[MAX_PATH];
+	int64_t bled_ret;
+	FILE_ALLOCATED_RANGE_BUFFER* ranges = NULL;
+	DWORD nb_ranges = 0, range_cursor = 0;
+	uint8_t* buffer = NULL;
+	uint32_t zero_data, *cmp_buffer = NULL;
+	int throttle_fast_zeroing = 0, read_bufnum = 0, proc_bufnum = 1, queue_depth, max_depth;
+	uint64_t start, latency;
+	IO_HEATMAP* heatmap = NULL;
+	dd_tuner tuner = { -1 };
+	DWORD stride, ring, align;
+	BOOL tune_switch = FALSE;
+	uint8_t* tune_buffer;
+	// The bad blocks image pass must write every block, for the verification to test it
+	BOOL use_sparse_write = sparse_write && !image_badblocks_pass;
+	BOOL use_delta_write = delta_write && !image_badblocks_pass;
+
+	if (SelectedDrive.SectorSize < 512) {
+		uprintf("Unexpected sector size (%d) - Aborting", SelectedDrive.SectorSize);
+		return FALSE;
+	}
+	hash_on_write = FALSE;
+	image_written_size = 0;
+	memset(write_sum_str, 0, sizeof(write_sum_str));
+	FreeManifest(&write_manifest);
+
+	// We poked the MBR and other stuff, so we need to rewind
+	li.QuadPart = 0;
+	if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN))
+		uprintf("Warning: Unable to rewind image position - wrong data might be copied!");
+	UpdateProgressWithInfoInit(NULL, FALSE);
+	if (!bZeroDrive)
+		SetProgressSpeedHint(GetDeviceHistorySpeed("write image"));
+	heatmap = CreateIoHeatmap(SelectedDrive.DiskSize);
+
+	if (bZeroDrive && !fast_zeroing) {
+		// Plain zeroing goes through the zero-fill engine, which can keep several large
+		// writes in flight, or use a TRIM on devices that read trimmed blocks as zeroes
+		uprintf("Zeroing drive:");
+		if (!ZeroDriveRange(hPhysicalDrive, 0, target_size, ZF_ALLOW_TRIM, heatmap, zero_progress)) {
+			if (!IS_ERROR(FormatStatus))
+				FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT;
+			goto out;
+		}
+	} else if (bZeroDrive) {
+		uprintf(fast_zeroing ? "Fast-zeroing drive:" : "Zeroing drive:");
+		// Our buffer size must be a multiple of the sector size and *ALIGNED* to the sector size
+		buf_size = ((DD_BUFFER_SIZE + GetIoAlignment() - 1) / GetIoAlignment()) * GetIoAlignment();
+		buffer = (uint8_t*)AllocIoBuffer(buf_size);
+		if (buffer == NULL) {
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+			uprintf("Could not allocate disk zeroing buffer");
+			goto out;
+		}
+		assert((uintptr_t)buffer % SelectedDrive.SectorSize == 0);
+
+		// Clear buffer
+		memset(buffer, fast_zeroing ? 0xff : 0x00, buf_size);
+
+		if (fast_zeroing) {
+			cmp_buffer = (uint32_t*)AllocIoBuffer(buf_size);
+			if (cmp_buffer == NULL) {
+				FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+				uprintf("Could not allocate disk comparison buffer");
+				goto out;
+			}
+			assert((uintptr_t)cmp_buffer % SelectedDrive.SectorSize == 0);
+		}
+
+		read_size[0] = buf_size;
+		for (wb = 0, write_size = 0; wb < target_size; wb += write_size) {
+			UpdateProgressWithInfo(OP_FORMAT, fast_zeroing ? MSG_306 : MSG_286, wb, target_size);
+			cur_value = (wb * min(80, target_size)) / target_size;
+			if (cur_value != last_value) {
+				last_value = cur_value;
+				uprintfs("+");
+			}
+			// Don't overflow our projected size (mostly for VHDs)
+			if (wb + read_size[0] > target_size)
+				read_size[0] = (DWORD)(target_size - wb);
+
+			// WriteFile fails unless the size is a multiple of sector size
+			if (read_size[0] % SelectedDrive.SectorSize != 0)
+				read_size[0] = ((read_size[0] + SelectedDrive.SectorSize - 1) / SelectedDrive.SectorSize) * SelectedDrive.SectorSize;
+
+			// Fast-zeroing: Depending on your hardware, reading from flash may be much faster than writing, so
+			// we might speed things up by skipping empty blocks, or skipping the write if the data is the same.
+			// Notes: A block is declared empty when all bits are either 0 (zeros) or 1 (flash block erased).
+			// Also, a back-off strategy is used to limit reading.
+			if (throttle_fast_zeroing) {
+				throttle_fast_zeroing--;
+			} else if (fast_zeroing) {
+				CHECK_FOR_USER_CANCEL;
+
+				// Read block and compare against the block that needs to be written
+				s = ReadFile(hPhysicalDrive, cmp_buffer, read_size[0], &comp_size, NULL);
+				if ((!s) || (comp_size != read_size[0])) {
+					uprintf("\r\nRead error: Could not read data for fast zeroing comparison - %s", WindowsErrorString());
+					goto out;
+				}
+
+				// Check for an empty block by comparing with the first element
+				zero_data = cmp_buffer[0];
+				// Check all bits are the same
+				if ((zero_data == 0) || (zero_data == 0xffffffff)) {
+					// Compare the rest of the block against the first element
+					for (i = 1; (i < read_size[0] / sizeof(uint32_t)) && (cmp_buffer[i] == zero_data); i++);
+					if (i >= read_size[0] / sizeof(uint32_t)) {
+						// Block is empty, skip write
+						write_size = read_size[0];
+						continue;
+					}
+				}
+
+				// Move the file pointer position back for writing
+				li.QuadPart = wb;
+				if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
+					uprintf("\r\nError: Could not reset position - %s", WindowsErrorString());
+					goto out;
+				}
+				// Throttle read operations
+				throttle_fast_zeroing = 15;
+			}
+
+			for (i = 1; i <= WRITE_RETRIES; i++) {
+				CHECK_FOR_USER_CANCEL;
+				start = GetIoTimestamp();
+				s = WriteFile(hPhysicalDrive, buffer, read_size[0], &write_size, NULL);
+				if ((s) && (write_size == read_size[0])) {
+					latency = GetIoTimestamp() - start;
+					UpdateIoHeatmap(heatmap, TRUE, wb, write_size, latency, latency);
+					if (IsDriveUnhealthy(heatmap)) {
+						FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_DEVICE_HARDWARE_ERROR;
+						goto out;
+					}
+					break;
+				}
+				if (s)
+					uprintf("\r\nWrite error: Wrote %d bytes, expected %d bytes", write_size, read_size[0]);
+				else
+					uprintf("\r\nWrite error at sector %lld: %s", wb / SelectedDrive.SectorSize, WindowsErrorString());
 				if (i < WRITE_RETRIES) {
 					li.QuadPart = wb;
 					uprintf("Retrying in %d seconds...", WRITE_TIMEOUT / 1000);
-					Sleep(WRITE_TIMEOUT);
+					TraceTally("write retries", 1, 0, 0);
+					if (!CancellableSleep(WRITE_TIMEOUT))
+						goto out;
 					if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
 						uprintf("Write error: Could not reset position - %s", WindowsErrorString());
 						goto out;
@@ -1709,6 +2953,11 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 		}
 	} else if (img_report.compression_type != BLED_COMPRESSION_NONE) {
 		uprintf("Writing compressed image:");
+		// Verification of compressed images relies on the checksums of the decompressed data
+		hash_on_write = (enable_write_hashes || verify_write || enable_block_manifest || image_badblocks_pass) &&
+			(img_report.compression_type != BLED_COMPRESSION_VTSI);
+		if (hash_on_write && !OpenWriteHashStream())
+			goto out;
 		hSourceImage = CreateFileU(image_path, GENERIC_READ, FILE_SHARE_READ, NULL,
 			OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
 		if (hSourceImage == INVALID_HANDLE_VALUE) {
@@ -1716,57 +2965,231 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_OPEN_FAILED;
 			goto out;
 		}
-		sec_buf = (uint8_t*)_mm_malloc(SelectedDrive.SectorSize, SelectedDrive.SectorSize);
-		if (sec_buf == NULL) {
-			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
-			uprintf("Could not allocate disk write buffer");
-			goto out;
+		if ((img_report.compression_type != BLED_COMPRESSION_VTSI) && IsImageCached(hSourceImage)) {
+			uprintf("Using the decompressed data from the previous write of this image");
+			if (!OpenPipeline(hPhysicalDrive, heatmap, 0, FALSE))
+				goto out;
+			bled_ret = PipelineReadCache() ? (int64_t)image_cache.size : -1;
+			uprintfs("\r\n");
+			if ((!ClosePipeline(bled_ret >= 0)) && (bled_ret >= 0))
+				bled_ret = -1;
+		} else if (img_report.compression_type == BLED_COMPRESSION_VTSI) {
+			// VTSI images seek the target between segments, which the pipeline turns into
+			// writes at the offset of each segment, after merging the contiguous ones
+			if (!OpenPipeline(hPhysicalDrive, heatmap, 0, FALSE))
+				goto out;
+			bled_init(_uprintf, NULL, pipeline_write, update_progress, NULL, &FormatStatus);
+			bled_set_seek_function(pipeline_seek);
+			bled_set_alloc_functions(AllocIoBuffer, FreeIoBuffer);
+			bled_ret = bled_uncompress_with_handles(hSourceImage, hPhysicalDrive, img_report.compression_type);
+			bled_exit();
+			uprintfs("\r\n");
+			if ((!ClosePipeline(bled_ret >= 0)) && (bled_ret >= 0))
+				bled_ret = -1;
+		} else {
+			// When the drive fails a write, retry from the data that made it to the drive(s).
+			// Unless the data also needs to be hashed, bled skips the data before that point,
+			// without even decoding it for the formats that have restart points (xz blocks).
+			if (enable_image_cache)
+				OpenImageCache(hSourceImage);
+			for (i = 1; ; i++) {
+				if (!OpenPipeline(hPhysicalDrive, heatmap, resume_offset, FALSE))
+					goto out;
+				pipeline.skip = hash_on_write ? resume_offset : 0;
+				image_written_size = hash_on_write ? 0 : resume_offset;
+				bled_init(_uprintf, NULL, pipeline_write, update_progress, NULL, &FormatStatus);
+				// So that the decoder dictionaries get reused across retries rather than reallocated
+				bled_set_alloc_functions(AllocIoBuffer, FreeIoBuffer);
+				bled_ret = bled_uncompress_with_handles_from(hSourceImage, hPhysicalDrive,
+					img_report.compression_type, hash_on_write ? 0 : resume_offset);
+				bled_exit();
+				uprintfs("\r\n");
+				if ((!ClosePipeline(bled_ret >= 0)) && (bled_ret >= 0))
+					bled_ret = -1;
+				// Only a failure of the drive itself is worth a retry. In batch mode, the drives
+				// that were dropped would be left with a hole, so we don't retry there either.
+				if ((bled_ret >= 0) || (!pipeline.error) || (nb_batch_targets > 0) || (i >= WRITE_RETRIES) ||
+					(IS_ERROR(FormatStatus) && (SCODE_CODE(FormatStatus) == ERROR_CANCELLED)))
+					break;
+				// A retry doesn't decompress the data from the start, so it can't be cached
+				CloseImageCache(FALSE);
+				// The writes are reaped in order, so what was written is a contiguous prefix
+				resume_offset += pipeline.target[0].written;
+				uprintf("Retrying from offset %s in %d seconds...", SizeToHumanReadable(resume_offset, FALSE, FALSE),
+					WRITE_TIMEOUT / 1000);
+				TraceTally("write retries", 1, 0, 0);
+				if (!CancellableSleep(WRITE_TIMEOUT))
+					break;
+				// bled aborts as soon as FormatStatus is set, so clear the write error we are
+				// retrying from, unless the user cancelled in the meantime
+				status = FormatStatus;
+				if ((SCODE_CODE(status) == ERROR_CANCELLED) ||
+					(InterlockedCompareExchange((volatile LONG*)&FormatStatus, 0, (LONG)status) != (LONG)status))
+					break;
+				li.QuadPart = 0;
+				if (!SetFilePointerEx(hSourceImage, li, NULL, FILE_BEGIN)) {
+					uprintf("Could not rewind image: %s", WindowsErrorString());
+					break;
+				}
+				if (hash_on_write) {
+					CloseHashStream(FALSE);
+					if (!OpenWriteHashStream())
+						goto out;
+				}
+			}
+			CloseImageCache(bled_ret >= 0);
 		}
-		assert((uintptr_t)sec_buf % SelectedDrive.SectorSize == 0);
-		sec_buf_pos = 0;
-		bled_init(_uprintf, NULL, sector_write, update_progress, NULL, &FormatStatus);
-		bled_ret = bled_uncompress_with_handles(hSourceImage, hPhysicalDrive, img_report.compression_type);
-		bled_exit();
-		uprintfs("\r\n");
-		if ((bled_ret >= 0) && (sec_buf_pos != 0)) {
-			// A disk image that doesn't end up on disk boundary should be a rare
-			// enough case, so we dont bother checking the write operation and
-			// just issue a notice about it in the log.
-			uprintf("Notice: Compressed image data didn't end on block boundary.");
-			// Gonna assert that WriteFile() and _write() share the same file offset
-			WriteFile(hPhysicalDrive, sec_buf, SelectedDrive.SectorSize, &write_size, NULL);
-		}
-		safe_mm_free(sec_buf);
 		if ((bled_ret < 0) && (SCODE_CODE(FormatStatus) != ERROR_CANCELLED)) {
 			// Unfortunately, different compression backends return different negative error codes
 			uprintf("Could not write compressed image: %lld", bled_ret);
 			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT;
 			goto out;
 		}
+	} else if (img_report.is_dynamic_vhd) {
+		uprintf("Writing dynamic VHD image:");
+		// The unallocated blocks are not read from the image, so verification relies on checksums
+		hash_on_write = enable_write_hashes || verify_write || enable_block_manifest || image_badblocks_pass;
+		if (hash_on_write && !OpenWriteHashStream())
+			goto out;
+		if (!WriteVirtualDisk(hPhysicalDrive, heatmap)) {
+			if (!IS_ERROR(FormatStatus))
+				FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT;
+			goto out;
+		}
+	} else if (img_report.is_ffu) {
+		uprintf("Writing FFU image:");
+		if (!WriteFFU(hPhysicalDrive, heatmap)) {
+			if (!IS_ERROR(FormatStatus))
+				FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT;
+			goto out;
+		}
+	} else if (nb_batch_targets > 0) {
+		// In batch mode, the image is read once, into the pipeline that feeds all the drives
+		uprintf("Writing image:");
+		if (sparse_write || delta_write)
+			uprintf("Notice: %s writes are not used in batch mode", delta_write ? "Delta" : "Sparse");
+		hash_on_write = enable_write_hashes || enable_block_manifest;
+		if (hash_on_write && !OpenWriteHashStream())
+			goto out;
+		hSourceImage = CreateFileU(image_path, GENERIC_READ, FILE_SHARE_READ, NULL,
+			OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (hSourceImage == INVALID_HANDLE_VALUE) {
+			uprintf("Could not open image '%s': %s", image_path, WindowsErrorString());
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_OPEN_FAILED;
+			goto out;
+		}
+		if (!OpenPipeline(hPhysicalDrive, heatmap, 0, FALSE))
+			goto out;
+		s = PipelineReadImage(hSourceImage, target_size);
+		uprintfs("\r\n");
+		if ((!ClosePipeline(s)) || (!s)) {
+			if (!IS_ERROR(FormatStatus))
+				FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT;
+			goto out;
+		}
 	} else {
-		hSourceImage = CreateFileAsync(image_path, GENERIC_READ, FILE_SHARE_READ,
-			OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN);
+		hSourceImage = OpenSequentialFileAsync(image_path);
 		if (hSourceImage == NULL) {
 			uprintf("Could not open image '%s': %s", image_path, WindowsErrorString());
 			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_OPEN_FAILED;
 			goto out;
 		}
+		if (((ASYNC_FD*)hSourceImage)->bUnbuffered)
+			uprintf("Reading the image without going through the system cache");
 
-		// Our buffer size must be a multiple of the sector size and *ALIGNED* to the sector size
-		buf_size = ((DD_BUFFER_SIZE + SelectedDrive.SectorSize - 1) / SelectedDrive.SectorSize) * SelectedDrive.SectorSize;
-		buffer = (uint8_t*)_mm_malloc(buf_size * NUM_BUFFERS, SelectedDrive.SectorSize);
+		hash_on_write = enable_write_hashes || enable_block_manifest;
+		if (hash_on_write && !OpenWriteHashStream())
+			goto out;
+
+		// Use the parameters that were found best for this drive model, if any. Otherwise,
+		// tune them while writing the image, unless it is too small for that to matter or
+		// sparse or delta writes, that skip blocks, would throw the timings off.
+		buf_size = DD_BUFFER_SIZE;
+		max_depth = write_queue_depth;
+		if (GetTunedDriveIO(SelectedDrive.DeviceNumber, &buf_size, &max_depth))
+			uprintf("Using tuned write parameters for this drive: %s buffers, queue depth %d",
+				SizeToHumanReadable(buf_size, FALSE, FALSE), max_depth);
+		else if (!use_sparse_write && !use_delta_write && (target_size >= DD_TUNE_MIN_SIZE))
+			tuner.phase = 0;
+		// Our buffer size must be a multiple of the sector size and *ALIGNED* to the sector size.
+		// We actually go for the physical sector size, to avoid read-modify-write cycles in the device,
+		// and never go below the alignment that unbuffered reads of the image require.
+		align = max(GetIoAlignment(), UNBUFFERED_READ_ALIGNMENT);
+		buf_size = ((buf_size + align - 1) / align) * align;
+		// We need one buffer for the read that is in progress, on top of the ones for the in-flight
+		// writes. If we can't get enough memory for the requested queue depth, try a smaller one.
+		for (queue_depth = min(max_depth, MAX_ASYNC_QUEUE_DEPTH - 1); queue_depth > 0; queue_depth--) {
+			nb_buffers = queue_depth + 1;
+			buffer = (uint8_t*)AllocIoBuffer((size_t)buf_size * nb_buffers);
+			if (buffer != NULL)
+				break;
+		}
 		if (buffer == NULL) {
 			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
-			uprintf("Could not allocate disk write buffer");
+			uprintf("Could not allocate disk write buffer");
+			goto out;
+		}
+		assert((uintptr_t)buffer % SelectedDrive.SectorSize == 0);
+		if (queue_depth < max_depth)
+			uprintf("Notice: Reduced write queue depth to %d, due to memory constraints", queue_depth);
+		tuner.mem_size = (size_t)buf_size * nb_buffers;
+		// Tuning needs more memory, to try deeper queues with large requests
+		if ((tuner.phase >= 0) && (tuner.mem_size < DD_TUNE_BUFFER_SIZE)) {
+			tune_buffer = (uint8_t*)AllocIoBuffer(DD_TUNE_BUFFER_SIZE);
+			if (tune_buffer != NULL) {
+				FreeIoBuffer(buffer);
+				buffer = tune_buffer;
+				tuner.mem_size = DD_TUNE_BUFFER_SIZE;
+			}
+		}
+
+		hDriveQueue = BlockCreateQueue(hPhysicalDrive, GENERIC_READ | GENERIC_WRITE,
+			(tuner.phase >= 0) ? MAX_ASYNC_QUEUE_DEPTH : nb_buffers, heatmap);
+		if (hDriveQueue == NULL) {
+			uprintf("Could not create drive write queue: %s", WindowsErrorString());
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
 			goto out;
 		}
-		assert((uintptr_t)buffer % SelectedDrive.SectorSize == 0);
+		if (((ASYNC_QUEUE*)hDriveQueue)->bSync) {
+			uprintf("Notice: Could not reopen drive for overlapped I/O - Writes will be synchronous");
+			tuner.phase = -1;
+		} else if (tuner.phase < 0) {
+			uprintf("Using a write queue depth of %d", queue_depth);
+		} else {
+			uprintf("Tuning the write parameters for this drive");
+		}
+		// stride is the size of the requests (and of the buffers they use), and ring the number of
+		// buffers in use. These only change between tuning phases.
+		stride = buf_size;
+		ring = nb_buffers;
+		if (tuner.phase >= 0) {
+			tuner.max_size = buf_size;
+			GetTunePhase(&tuner, &stride, &ring);
+			tuner.start_time = GetIoTimestamp();
+			tuner.start_bytes = 0;
+		}
+
+		if (use_sparse_write || use_delta_write) {
+			cmp_buffer = (uint32_t*)AllocIoBuffer(buf_size);
+			if (cmp_buffer == NULL) {
+				FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+				uprintf("Could not allocate disk comparison buffer");
+				goto out;
+			}
+		}
+		// Delta writes also skip the blocks of zeros that the target already holds, so they
+		// take precedence over sparse writes
+		if (use_delta_write) {
+			uprintf("Using delta writes (only the data that differs from the target is written)");
+		} else if (use_sparse_write) {
+			nb_ranges = GetAllocatedRanges(image_path, &ranges);
+			uprintf("Using sparse writes (%d allocated range%s reported for the image)", nb_ranges, (nb_ranges == 1) ? "" : "s");
+		}
 
 		// Start the initial read
-		ReadFileAsync(hSourceImage, &buffer[read_bufnum * buf_size], buf_size);
+		ReadFileAsync(hSourceImage, &buffer[(size_t)read_bufnum * stride], stride);
 
-		read_size[proc_bufnum] = 1;	// To avoid early loop exit
-		for (wb = 0; read_size[proc_bufnum] != 0; wb += read_size[proc_bufnum]) {
+		for (wb = 0; ; wb += read_size[proc_bufnum]) {
 			// 0. Update the progress
 			UpdateProgressWithInfo(OP_FORMAT, MSG_261, wb, target_size);
 			cur_value = (wb * min(80, target_size)) / target_size;
@@ -1787,56 +3210,641 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 			// 2a) Don't overflow our projected size (mostly for VHDs)
 			if (wb + read_size[read_bufnum] > target_size)
 				read_size[read_bufnum] = (DWORD)(target_size - wb);
-			// 2b) WriteFile fails unless the size is a multiple of sector size
+			if (read_size[read_bufnum] == 0)
+				break;
+			// 2b) Hash the image data, before it gets padded
+			if (hash_on_write && !WriteHashStream(&buffer[(size_t)read_bufnum * stride], read_size[read_bufnum]))
+				goto out;
+			// 2c) WriteFile fails unless the size is a multiple of sector size
 			if (read_size[read_bufnum] % SelectedDrive.SectorSize != 0)
 				read_size[read_bufnum] = ((read_size[read_bufnum] + SelectedDrive.SectorSize - 1) /
 					SelectedDrive.SectorSize) * SelectedDrive.SectorSize;
 
-			// 3. Switch to the next reading buffer
+			// 3. Switch to the next reading buffer, once the write that used it has completed
 			proc_bufnum = read_bufnum;
-			read_bufnum = (read_bufnum + 1) % NUM_BUFFERS;
+			read_bufnum = (read_bufnum + 1) % ring;
+			if (!CompleteDriveWrite(hDriveQueue, read_bufnum, TRUE))
+				goto out;
 
-			// 3. Launch the next asynchronous read operation
-			ReadFileAsync(hSourceImage, &buffer[read_bufnum * buf_size], buf_size);
+			// 4. Launch the next asynchronous read operation, unless this is the end of a tuning
+			// phase, in which case the buffer layout is about to change
+			tune_switch = (tuner.phase >= 0) &&
+				(wb + read_size[proc_bufnum] - tuner.start_bytes >= TunePhaseSize(stride, ring));
+			if (!tune_switch)
+				ReadFileAsync(hSourceImage, &buffer[(size_t)read_bufnum * stride], stride);
+
+			// 5. For delta writes, only write the part of the block that differs from the target.
+			// If the whole block differs, back off from comparing the next blocks.
+			// For sparse writes, skip blocks of zeros that are already zeroed on the target.
+			// If the target doesn't read as zeros, back off from comparing the next blocks.
+			CHECK_FOR_USER_CANCEL;
+			delta_start = 0;
+			delta_end = read_size[proc_bufnum];
+			if (use_delta_write) {
+				if (throttle_fast_zeroing) {
+					throttle_fast_zeroing--;
+				} else if (!GetDeltaRange(hPhysicalDrive, &buffer[(size_t)proc_bufnum * stride], (uint8_t*)cmp_buffer,
+					read_size[proc_bufnum], wb, &delta_start, &delta_end)) {
+					delta_start = 0;
+					delta_end = read_size[proc_bufnum];
+					throttle_fast_zeroing = 4;
+				} else if (delta_end <= delta_start) {
+					skipped_size += read_size[proc_bufnum];
+					continue;
+				} else {
+					skipped_size += read_size[proc_bufnum] - (delta_end - delta_start);
+					if ((delta_start == 0) && (delta_end == read_size[proc_bufnum]))
+						throttle_fast_zeroing = 4;
+				}
+			} else if (use_sparse_write) {
+				if (throttle_fast_zeroing) {
+					throttle_fast_zeroing--;
+				} else if (IsSkippableBlock(hPhysicalDrive, &buffer[(size_t)proc_bufnum * stride], (uint8_t*)cmp_buffer,
+					read_size[proc_bufnum], wb, !IsRangeAllocated(ranges, nb_ranges, &range_cursor, wb, read_size[proc_bufnum]))) {
+					skipped_size += read_size[proc_bufnum];
+					continue;
+				} else if (IsBufferZero(&buffer[(size_t)proc_bufnum * stride], read_size[proc_bufnum])) {
+					throttle_fast_zeroing = 4;
+				}
+			}
 
-			// 4. Synchronously write the current data buffer
-			for (i = 1; i <= WRITE_RETRIES; i++) {
-				CHECK_FOR_USER_CANCEL;
-				s = WriteFile(hPhysicalDrive, &buffer[proc_bufnum * buf_size], read_size[proc_bufnum], &write_size, NULL);
-				if ((s) && (write_size == read_size[proc_bufnum]))
-					break;
-				if (s)
-					uprintf("\r\nWrite error: Wrote %d bytes, expected %d bytes", write_size, read_size[proc_bufnum]);
-				else
-					uprintf("\r\nWrite error at sector %lld: %s", wb / SelectedDrive.SectorSize, WindowsErrorString());
-				if (i < WRITE_RETRIES) {
-					li.QuadPart = wb;
-					uprintf("Retrying in %d seconds...", WRITE_TIMEOUT / 1000);
-					Sleep(WRITE_TIMEOUT);
-					if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
-						uprintf("Write error: Could not reset position - %s", WindowsErrorString());
+			// 6. Queue the asynchronous write of the current data buffer
+			if ((!IssueAsyncQueue(hDriveQueue, proc_bufnum, TRUE, &buffer[(size_t)proc_bufnum * stride + delta_start],
+				delta_end - delta_start, wb + delta_start)) && (!CompleteDriveWrite(hDriveQueue, proc_bufnum, TRUE)))
+				goto out;
+
+			// 7. At the end of a tuning phase, wait for all its writes to complete, so that it can be
+			// timed, then restart from the first buffer of the layout of the next phase
+			if (tune_switch) {
+				for (i = 0; i < ((ASYNC_QUEUE*)hDriveQueue)->dwDepth; i++) {
+					if (!CompleteDriveWrite(hDriveQueue, i, TRUE))
 						goto out;
-					}
-				} else {
-					FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT;
-					goto out;
 				}
-				Sleep(200);
+				NextTunePhase(&tuner, wb + read_size[proc_bufnum], &stride, &ring);
+				read_bufnum = 0;
+				ReadFileAsync(hSourceImage, buffer, stride);
 			}
-			if (i > WRITE_RETRIES)
+		}
+
+		// 8. Wait for all the remaining in-flight writes to complete
+		for (i = 0; i < ((ASYNC_QUEUE*)hDriveQueue)->dwDepth; i++) {
+			if (!CompleteDriveWrite(hDriveQueue, i, TRUE))
 				goto out;
 		}
+		// wb includes the padding of the last write, that isn't part of the image proper
+		image_written_size = min(wb, target_size);
 		uprintfs("\r\n");
+		if (use_delta_write)
+			uprintf("Delta writes: Skipped %s of data that was already on the target", SizeToHumanReadable(skipped_size, FALSE, FALSE));
+		else if (use_sparse_write)
+			uprintf("Sparse writes: Skipped %s of already zeroed data", SizeToHumanReadable(skipped_size, FALSE, FALSE));
+	}
+	if (hash_on_write && CloseHashStream(TRUE)) {
+		memcpy(write_sum_str, sum_str, sizeof(write_sum_str));
+		if (enable_write_hashes)
+			PrintHashStream("Checksums of the data written:");
+		if (write_manifest.complete) {
+			for (i = 0; i < sizeof(write_manifest.root); i++)
+				sprintf(&manifest_path[2 * i], "%02x", write_manifest.root[i]);
+			uprintf("Block manifest root hash: %s", manifest_path);
+			static_sprintf(manifest_path, "%s%s", image_path, MANIFEST_EXT);
+			if (SaveManifest(&write_manifest, manifest_path))
+				uprintf("Saved block manifest as '%s'", manifest_path);
+		}
 	}
 	RefreshDriveLayout(hPhysicalDrive);
 	ret = TRUE;
 out:
-	if (img_report.compression_type != BLED_COMPRESSION_NONE)
+	CloseHashStream(FALSE);
+	if ((img_report.compression_type != BLED_COMPRESSION_NONE) || (nb_batch_targets > 0))
 		safe_closehandle(hSourceImage);
 	else
 		CloseFileAsync(hSourceImage);
-	safe_mm_free(buffer);
-	safe_mm_free(cmp_buffer);
+	// Must be closed before the buffers get freed, as it waits for in-flight writes
+	CloseAsyncQueue(hDriveQueue);
+	safe_free_io_buffer(buffer);
+	safe_free_io_buffer(cmp_buffer);
+	free(ranges);
+	PrintIoHeatmap(heatmap, "");
+	SaveIoHeatmap(heatmap, SelectedDrive.DeviceNumber, bZeroDrive ? "zero" : "write");
+	free(heatmap);
+	return ret;
+}
+
+/*
+ * Flag the drives that negotiated a slower link than they support (USB 3 devices on USB 2
+ * ports or cables), so that they can be re-seated before a long multi-target operation.
+ */
+static void CheckBatchLinkSpeed(int i, DWORD index)
+{
+	if (DriveLowerSpeed[i] != 0)
+		uprintf("Batch: WARNING - Disk %d is a USB 3.%c device operating at lower speed, which re-plugging it "
+			"into a USB 3 port should fix", (int)(index - DRIVE_INDEX_MIN), '0' + DriveLowerSpeed[i] - 1);
+}
+
+/*
+ * Run the bad blocks check on the selected drive as well as on all the other drives from
+ * the device list, concurrently. Drives that sit behind the same hub are put in the same
+ * group, so that the scheduler can balance the bandwidth between them. The report that is
+ * returned is the one for the selected drive, and the log file gets the report of all drives.
+ */
+static BOOL BatchBadBlocks(HANDLE hPhysicalDrive, DWORD DriveIndex, int nb_passes,
+	int flash_type, badblocks_report* report, FILE* fd)
+{
+	int i, j, n = 1, num_devices = ComboBox_GetCount(hDeviceList);
+	bb_drive drive[MAX_DRIVES] = { 0 };
+	DWORD index;
+	char *hub;
+
+	// The selected drive always comes first
+	drive[0].hDrive = hPhysicalDrive;
+	drive[0].disk_size = SelectedDrive.DiskSize;
+	drive[0].index = DriveIndex - DRIVE_INDEX_MIN;
+	drive[0].id = DriveId.String[ComboBox_GetCurSel(hDeviceList)];
+	for (i = 0; i < num_devices; i++) {
+		index = (DWORD)ComboBox_GetItemData(hDeviceList, i);
+		hub = (i < (int)DriveHub.Index) ? DriveHub.String[i] : NULL;
+		for (j = 0; (hub != NULL) && (j < i) && (safe_stricmp(hub, DriveHub.String[j]) != 0); j++);
+		if (index == DriveIndex) {
+			drive[0].group = (hub != NULL) ? j : i;
+			drive[0].link_speed = DriveLinkSpeed[i];
+			CheckBatchLinkSpeed(i, index);
+			continue;
+		}
+		if (n >= (int)ARRAYSIZE(drive))
+			break;
+		CHECK_FOR_USER_CANCEL;
+		RemoveDriveLetters(index, FALSE, TRUE);
+		if (is_vds_available)
+			DeletePartition(index, 0, TRUE);
+		drive[n].hDrive = GetPhysicalHandle(index, TRUE, TRUE, FALSE);
+		if (drive[n].hDrive == INVALID_HANDLE_VALUE) {
+			uprintf("Batch: Skipping disk %d, as it could not be opened", (int)(index - DRIVE_INDEX_MIN));
+			continue;
+		}
+		drive[n].disk_size = GetDriveSize(index);
+		drive[n].id = (i < (int)DriveId.Index) ? DriveId.String[i] : NULL;
+		drive[n].index = index - DRIVE_INDEX_MIN;
+		drive[n].group = (hub != NULL) ? j : i;
+		drive[n].link_speed = DriveLinkSpeed[i];
+		CheckBatchLinkSpeed(i, index);
+		n++;
+	}
+	uprintf("Batch: Running bad blocks check on %d drive%s", n, (n == 1) ? "" : "s");
+	BadBlocksBatch(drive, n, nb_passes, flash_type, fd);
+
+out:
+	for (i = 1; i < n; i++) {
+		safe_unlockclose(drive[i].hDrive);
+		SaveIoHeatmap(drive[i].report.heatmap, drive[i].index, "badblocks");
+		FreeBadBlocksReport(&drive[i].report);
+	}
+	*report = drive[0].report;
+	return drive[0].completed;
+}
+
+/*
+ * Open the other drives from the device list, for a batch write of the image or a clone of the
+ * selected drive. Drives that are smaller than min_size, or that don't have the same sector size
+ * as the selected drive (which the pipeline buffers are sized and aligned for), are left out.
+ */
+static void OpenBatchTargets(DWORD DriveIndex, uint64_t min_size)
+{
+	int i, slowest = -1, num_devices = ComboBox_GetCount(hDeviceList);
+	BYTE geometry[256];
+	PDISK_GEOMETRY_EX DiskGeometry = (PDISK_GEOMETRY_EX)(void*)geometry;
+	DWORD index, size;
+	HANDLE hDrive;
+
+	nb_batch_targets = 0;
+	for (i = 0; (i < num_devices) && (nb_batch_targets < ARRAYSIZE(batch_target)); i++) {
+		index = (DWORD)ComboBox_GetItemData(hDeviceList, i);
+		if (index == DriveIndex) {
+			CheckBatchLinkSpeed(i, index);
+			if ((DriveLinkSpeed[i] != 0) && ((slowest < 0) || (DriveLinkSpeed[i] < DriveLinkSpeed[slowest])))
+				slowest = i;
+			continue;
+		}
+		if (IS_ERROR(FormatStatus) && (SCODE_CODE(FormatStatus) == ERROR_CANCELLED))
+			break;
+		RemoveDriveLetters(index, FALSE, TRUE);
+		if (is_vds_available)
+			DeletePartition(index, 0, TRUE);
+		hDrive = GetPhysicalHandle(index, TRUE, TRUE, FALSE);
+		if (hDrive == INVALID_HANDLE_VALUE) {
+			uprintf("Batch: Skipping disk %d, as it could not be opened", (int)(index - DRIVE_INDEX_MIN));
+			continue;
+		}
+		if ((!DeviceIoControl(hDrive, IOCTL_DISK_GET_DRIVE_GEOMETRY_EX, NULL, 0, geometry, sizeof(geometry), &size, NULL)) ||
+			(size == 0) || (DiskGeometry->Geometry.BytesPerSector != SelectedDrive.SectorSize) ||
+			((uint64_t)DiskGeometry->DiskSize.QuadPart < min_size)) {
+			uprintf("Batch: Skipping disk %d, as its size or sector size is not suitable", (int)(index - DRIVE_INDEX_MIN));
+			safe_unlockclose(hDrive);
+			continue;
+		}
+		batch_target[nb_batch_targets].hDrive = hDrive;
+		batch_target[nb_batch_targets].index = index - DRIVE_INDEX_MIN;
+		batch_target[nb_batch_targets].heatmap = CreateIoHeatmap(DiskGeometry->DiskSize.QuadPart);
+		nb_batch_targets++;
+		CheckBatchLinkSpeed(i, index);
+		if ((DriveLinkSpeed[i] != 0) && ((slowest < 0) || (DriveLinkSpeed[i] < DriveLinkSpeed[slowest])))
+			slowest = i;
+	}
+	// All the drives are fed from the same buffers, so the whole batch goes at the pace of the slowest link
+	if ((nb_batch_targets > 0) && (slowest >= 0))
+		uprintf("Batch: The write can't go faster than the link of disk %d (about %d MB/s)",
+			(int)((DWORD)ComboBox_GetItemData(hDeviceList, slowest) - DRIVE_INDEX_MIN), DriveLinkSpeed[slowest] / 1000);
+}
+
+static void CloseBatchTargets(void)
+{
+	DWORD i;
+
+	for (i = 0; i < nb_batch_targets; i++) {
+		safe_unlockclose(batch_target[i].hDrive);
+		SaveIoHeatmap(batch_target[i].heatmap, batch_target[i].index, "write");
+		free(batch_target[i].heatmap);
+	}
+	nb_batch_targets = 0;
+}
+
+/*
+ * Create the log file of a bad blocks check. Since %USERPROFILE% may
+ * have localized characters, we use the UTF-8 API.
+ */
+static FILE* OpenBadBlocksLog(char* logfile, size_t logfile_size)
+{
+	SYSTEMTIME lt;
+	FILE* fd;
+	char* userdir = getenvU("USERPROFILE");
+
+	safe_strcpy(logfile, logfile_size, userdir);
+	safe_free(userdir);
+	GetLocalTime(&lt);
+	safe_sprintf(&logfile[strlen(logfile)], logfile_size - strlen(logfile) - 1,
+		"\\rufus_%04d%02d%02d_%02d%02d%02d.log",
+		lt.wYear, lt.wMonth, lt.wDay, lt.wHour, lt.wMinute, lt.wSecond);
+	fd = fopenU(logfile, "w+");
+	if (fd == NULL) {
+		uprintf("Could not create log file for bad blocks check");
+	} else {
+		fprintf(fd, APPLICATION_NAME " bad blocks check started on: %04d.%02d.%02d %02d:%02d:%02d",
+		lt.wYear, lt.wMonth, lt.wDay, lt.wHour, lt.wMinute, lt.wSecond);
+		fflush(fd);
+	}
+	return fd;
+}
+
+/*
+ * Complete the log of a bad blocks check and, if bad blocks were found, ask the user whether
+ * to abort, retry or ignore. Otherwise, the log file is deleted. Returns the user's choice.
+ */
+static int ReportBadBlocks(FILE* fd, const char* logfile, BOOL found)
+{
+	SYSTEMTIME lt;
+	char* bb_msg;
+
+	if (!found) {
+		if (fd != NULL) {
+			fclose(fd);
+			DeleteFileU(logfile);
+		}
+		return IDOK;
+	}
+	bb_msg = lmprintf(MSG_011, report.bb_count, report.num_read_errors, report.num_write_errors,
+		report.num_corruption_errors);
+	if (fd != NULL) {
+		fprintf(fd, "%s", bb_msg);
+		GetLocalTime(&lt);
+		fprintf(fd, APPLICATION_NAME " bad blocks check ended on: %04d.%02d.%02d %02d:%02d:%02d",
+		lt.wYear, lt.wMonth, lt.wDay, lt.wHour, lt.wMinute, lt.wSecond);
+		fclose(fd);
+	}
+	return MessageBoxExU(hMainDialog, lmprintf(MSG_012, bb_msg, logfile),
+		lmprintf(MSG_010), MB_ABORTRETRYIGNORE|MB_ICONWARNING|MB_IS_RTL, selected_langid);
+}
+
+/*
+ * When the image write is the last pass of a bad blocks check, the verification doesn't stop
+ * at the first mismatch, but records all the bad blocks (in BADBLOCK_BLOCK_SIZE units) it finds.
+ */
+static uint32_t AddImagePassBadBlocks(uint64_t offset, uint64_t size, BOOL read_error)
+{
+	uint32_t i, nb_blocks = (uint32_t)((offset + size + BADBLOCK_BLOCK_SIZE - 1) / BADBLOCK_BLOCK_SIZE -
+		offset / BADBLOCK_BLOCK_SIZE);
+
+	for (i = 0; (image_pass_log_fd != NULL) && (i < nb_blocks); i++)
+		fprintf(image_pass_log_fd, "Block %llu: %s error\n", offset / BADBLOCK_BLOCK_SIZE + i,
+			read_error ? "read" : "corruption");
+	report.bb_count += nb_blocks;
+	if (read_error)
+		report.num_read_errors += nb_blocks;
+	else
+		report.num_corruption_errors += nb_blocks;
+	return nb_blocks;
+}
+
+static uint32_t CheckImagePassBlocks(const uint8_t* data, const uint8_t* ref, uint64_t offset, DWORD size)
+{
+	uint32_t nb_bad = 0;
+	DWORD pos, len;
+
+	for (pos = 0; pos < size; pos += len) {
+		len = (DWORD)min(size - pos, BADBLOCK_BLOCK_SIZE - ((offset + pos) % BADBLOCK_BLOCK_SIZE));
+		if (memcmp(&data[pos], &ref[pos], len) != 0) {
+			uprintf("\r\nBad Blocks: Data mismatch in block %lld (offset 0x%llx)",
+				(offset + pos) / BADBLOCK_BLOCK_SIZE, offset + pos);
+			nb_bad += AddImagePassBadBlocks(offset + pos, len, FALSE);
+		}
+	}
+	return nb_bad;
+}
+
+/*
+ * Verify the written data against a block manifest, by reading the chunks back from the drive
+ * and checking their hashes. This doesn't need the image, and it lets us report the first chunk
+ * that doesn't match. If interval is larger than 1, only one chunk out of every interval ones
+ * is checked, for a quick check of large images.
+ */
+static BOOL VerifyDriveManifest(HANDLE hPhysicalDrive, block_manifest* m, uint32_t interval)
+{
+	BOOL ret = FALSE;
+	HANDLE hDriveQueue = NULL;
+	DWORD i, slot, size, read_size, sec_size = SelectedDrive.SectorSize;
+	uint32_t chunk = 0, next_chunk, nb_checked = 0, nb_to_check, nb_bad = 0, slot_chunk[MAX_ASYNC_QUEUE_DEPTH];
+	uint64_t cur_value, last_value = UINT64_MAX;
+	uint8_t *buffer = NULL, sum[32];
+
+#define CHUNK_SIZE(c) ((DWORD)min(MANIFEST_CHUNK_SIZE, m->size - (uint64_t)(c) * MANIFEST_CHUNK_SIZE))
+#define CHUNK_READ_SIZE(c) (((CHUNK_SIZE(c) + sec_size - 1) / sec_size) * sec_size)
+	interval = max(interval, 1);
+	nb_to_check = (m->nb_chunks + interval - 1) / interval;
+	if (interval > 1)
+		uprintf("Verifying written data (block manifest, 1 chunk out of %d):", interval);
+	else
+		uprintf("Verifying written data (block manifest):");
+	UpdateProgressWithInfoInit(NULL, FALSE);
+
+	buffer = (uint8_t*)AllocIoBuffer((size_t)MANIFEST_CHUNK_SIZE * MAX_ASYNC_QUEUE_DEPTH);
+	if (buffer == NULL) {
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+		uprintf("Could not allocate verification buffers");
+		goto out;
+	}
+	// There is no heatmap for verification, but the reads still go to the timeline
+	hDriveQueue = BlockCreateQueue(hPhysicalDrive, GENERIC_READ, MAX_ASYNC_QUEUE_DEPTH, NULL);
+	if (hDriveQueue == NULL) {
+		uprintf("Could not create drive read queue: %s", WindowsErrorString());
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+		goto out;
+	}
+
+	// Small chunks can only keep the drive busy with a lot of reads in flight
+	for (i = 0, next_chunk = 0; (i < MAX_ASYNC_QUEUE_DEPTH) && (next_chunk < m->nb_chunks); i++, next_chunk += interval) {
+		slot_chunk[i] = chunk = next_chunk;
+		if (!IssueAsyncQueue(hDriveQueue, i, FALSE, &buffer[(size_t)i * MANIFEST_CHUNK_SIZE], CHUNK_READ_SIZE(chunk),
+			(uint64_t)chunk * MANIFEST_CHUNK_SIZE))
+			goto read_error;
+	}
+
+	for (slot = 0; nb_checked < nb_to_check; slot = (slot + 1) % MAX_ASYNC_QUEUE_DEPTH) {
+		// 0. Update the progress and check for cancel
+		UpdateProgressWithInfo(OP_FORMAT, MSG_325, nb_checked, nb_to_check);
+		cur_value = ((uint64_t)nb_checked * min(80, nb_to_check)) / nb_to_check;
+		if (cur_value != last_value) {
+			last_value = cur_value;
+			uprintfs("+");
+		}
+		CHECK_FOR_USER_CANCEL;
+
+		// 1. Wait for the oldest drive read to complete and check the hash of its chunk
+		chunk = slot_chunk[slot];
+		size = CHUNK_SIZE(chunk);
+		if ((!WaitAsyncQueue(hDriveQueue, slot, DRIVE_ACCESS_TIMEOUT, &read_size)) || (read_size < size))
+			goto read_error;
+		HashBuffer(CHECKSUM_SHA256, &buffer[(size_t)slot * MANIFEST_CHUNK_SIZE], size, sum);
+		if (memcmp(sum, m->chunk[chunk], sizeof(sum)) != 0) {
+			uprintf("\r\nVerification error: Data mismatch in chunk %d (offset 0x%llx)",
+				chunk, (uint64_t)chunk * MANIFEST_CHUNK_SIZE);
+			TraceTally("verify failures", 1, 0, 0);
+			if (!image_badblocks_pass) {
+				FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT;
+				goto out;
+			}
+			nb_bad += AddImagePassBadBlocks((uint64_t)chunk * MANIFEST_CHUNK_SIZE, size, FALSE);
+		}
+		nb_checked++;
+
+		// 2. Reuse the slot for the next chunk
+		if (next_chunk < m->nb_chunks) {
+			slot_chunk[slot] = chunk = next_chunk;
+			if (!IssueAsyncQueue(hDriveQueue, slot, FALSE, &buffer[(size_t)slot * MANIFEST_CHUNK_SIZE],
+				CHUNK_READ_SIZE(chunk), (uint64_t)chunk * MANIFEST_CHUNK_SIZE))
+				goto read_error;
+			next_chunk += interval;
+		}
+	}
+	uprintfs("\r\n");
+	if (nb_bad != 0) {
+		uprintf("Verification error: %d bad block%s in the written data", nb_bad, (nb_bad == 1) ? "" : "s");
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT;
+		goto out;
+	}
+	uprintf("Verified %d chunk%s (%s) of written data", nb_checked, (nb_checked == 1) ? "" : "s",
+		SizeToHumanReadable((interval > 1) ? (uint64_t)nb_checked * MANIFEST_CHUNK_SIZE : m->size, FALSE, FALSE));
+	ret = TRUE;
+	goto out;
+
+read_error:
+	uprintf("\r\nRead error in chunk %d: %s", chunk, WindowsErrorString());
+	if (image_badblocks_pass)
+		AddImagePassBadBlocks((uint64_t)chunk * MANIFEST_CHUNK_SIZE, CHUNK_SIZE(chunk), TRUE);
+	FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_READ_FAULT;
+
+out:
+	// Must be closed before the buffer gets freed, as it waits for in-flight reads
+	CloseAsyncQueue(hDriveQueue);
+	safe_free_io_buffer(buffer);
+	return ret;
+#undef CHUNK_READ_SIZE
+#undef CHUNK_SIZE
+}
+
+/*
+ * Read back the image data that was just written and check that it matches, using large
+ * overlapped reads, so that the comparison of a block runs while the next ones are read.
+ * Uncompressed images are compared block by block against the source, which lets us report
+ * the first sector that doesn't match. Compressed and dynamic VHD images are hashed as they
+ * are read and checked against the checksums that were computed on the data during write.
+ */
+static BOOL VerifyDrive(HANDLE hPhysicalDrive)
+{
+	BOOL ret = FALSE, use_hash = (img_report.compression_type != BLED_COMPRESSION_NONE) || img_report.is_dynamic_vhd;
+	HANDLE hSourceImage = NULL, hDriveQueue = NULL;
+	DWORD i, slot, size, read_size, src_size, buf_size, sec_size = SelectedDrive.SectorSize;
+	DWORD nb_buffers = 0, src_bufnum = 0;
+	uint32_t nb_bad = 0;
+	uint64_t rb = 0, next_offset, target_size = image_written_size;
+	uint64_t cur_value, last_value = UINT64_MAX;
+	uint8_t *buffer = NULL, *src_buffer = NULL;
+	int queue_depth;
+	char manifest_path[MAX_PATH];
+
+	if (img_report.compression_type == BLED_COMPRESSION_VTSI) {
+		uprintf("Notice: Write verification is not supported for VTSI images");
+		return TRUE;
+	}
+	if (img_report.is_ffu) {
+		uprintf("Notice: Write verification is not supported for FFU images, which are validated by their hashes instead");
+		return TRUE;
+	}
+	if (target_size == 0)
+		return TRUE;
+	// Unless we computed one during write, use the block manifest from a previous write of
+	// the same image, if any. Uncompressed images get their last sector padded on write.
+	if (!write_manifest.complete) {
+		static_sprintf(manifest_path, "%s%s", image_path, MANIFEST_EXT);
+		if (LoadManifest(&write_manifest, manifest_path))
+			uprintf("Using block manifest '%s'", manifest_path);
+	}
+	if (write_manifest.complete && (write_manifest.size <= target_size) && (target_size - write_manifest.size < sec_size))
+		return VerifyDriveManifest(hPhysicalDrive, &write_manifest, image_badblocks_pass ? 1 : verify_sample_interval);
+	if (use_hash && (write_sum_str[CHECKSUM_SHA256][0] == 0)) {
+		uprintf("Notice: No checksums were computed during write - Skipping verification");
+		return TRUE;
+	}
+
+	uprintf("Verifying written data (%s):", use_hash ? "checksum" : "compare");
+	UpdateProgressWithInfoInit(NULL, FALSE);
+
+	buf_size = ((DD_BUFFER_SIZE + sec_size - 1) / sec_size) * sec_size;
+	for (queue_depth = min(write_queue_depth, MAX_ASYNC_QUEUE_DEPTH - 1); queue_depth > 0; queue_depth--) {
+		nb_buffers = queue_depth + 1;
+		buffer = (uint8_t*)AllocIoBuffer((size_t)buf_size * nb_buffers);
+		if (buffer != NULL)
+			break;
+	}
+	if (!use_hash)
+		src_buffer = (uint8_t*)AllocIoBuffer((size_t)buf_size * 2);
+	if ((buffer == NULL) || (!use_hash && (src_buffer == NULL))) {
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+		uprintf("Could not allocate verification buffers");
+		goto out;
+	}
+
+	// There is no heatmap for verification, but the reads still go to the timeline
+	hDriveQueue = BlockCreateQueue(hPhysicalDrive, GENERIC_READ, nb_buffers, NULL);
+	if (hDriveQueue == NULL) {
+		uprintf("Could not create drive read queue: %s", WindowsErrorString());
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+		goto out;
+	}
+
+	if (use_hash) {
+		if (!OpenHashStream())
+			goto out;
+	} else {
+		hSourceImage = OpenSequentialFileAsync(image_path);
+		if (hSourceImage == NULL) {
+			uprintf("Could not open image '%s': %s", image_path, WindowsErrorString());
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_OPEN_FAILED;
+			goto out;
+		}
+		ReadFileAsync(hSourceImage, src_buffer, buf_size);
+	}
+
+	// Fill the queue with reads. Sizes are rounded up to the sector size, as required
+	// by unbuffered I/O, which also ensures that we read from the media and not the cache.
+	for (i = 0, next_offset = 0; (i < nb_buffers) && (next_offset < target_size); i++, next_offset += buf_size) {
+		read_size = (DWORD)min(buf_size, ((target_size - next_offset + sec_size - 1) / sec_size) * sec_size);
+		if (!IssueAsyncQueue(hDriveQueue, i, FALSE, &buffer[i * buf_size], read_size, next_offset))
+			goto read_error;
+	}
+
+	for (rb = 0, slot = 0; rb < target_size; rb += size, slot = (slot + 1) % nb_buffers) {
+		// 0. Update the progress and check for cancel
+		UpdateProgressWithInfo(OP_FORMAT, MSG_325, rb, target_size);
+		cur_value = (rb * min(80, target_size)) / target_size;
+		if (cur_value != last_value) {
+			last_value = cur_value;
+			uprintfs("+");
+		}
+		CHECK_FOR_USER_CANCEL;
+
+		// 1. Wait for the oldest drive read to complete
+		size = (DWORD)min(buf_size, target_size - rb);
+		if ((!WaitAsyncQueue(hDriveQueue, slot, DRIVE_ACCESS_TIMEOUT, &read_size)) || (read_size < size))
+			goto read_error;
+
+		// 2. Check the data, while the other drive reads are in flight
+		if (use_hash) {
+			if (!WriteHashStream(&buffer[slot * buf_size], size))
+				goto out;
+		} else {
+			if ((!WaitFileAsync(hSourceImage, DRIVE_ACCESS_TIMEOUT)) ||
+				(!GetSizeAsync(hSourceImage, &src_size)) || (src_size < size)) {
+				uprintf("\r\nRead error: Could not read image data for verification - %s", WindowsErrorString());
+				FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_READ_FAULT;
+				goto out;
+			}
+			src_bufnum ^= 1;
+			ReadFileAsync(hSourceImage, &src_buffer[src_bufnum * buf_size], buf_size);
+			if (image_badblocks_pass) {
+				nb_bad += CheckImagePassBlocks(&buffer[slot * buf_size], &src_buffer[(src_bufnum ^ 1) * buf_size], rb, size);
+			} else if (memcmp(&buffer[slot * buf_size], &src_buffer[(src_bufnum ^ 1) * buf_size], size) != 0) {
+				for (i = 0; buffer[slot * buf_size + i] == src_buffer[(src_bufnum ^ 1) * buf_size + i]; i++);
+				uprintf("\r\nVerification error: Data mismatch at sector %lld (offset 0x%llx)",
+					(rb + i) / sec_size, rb + i);
+				TraceTally("verify failures", 1, 0, 0);
+				FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT;
+				goto out;
+			}
+		}
+
+		// 3. Reuse the slot for the next drive read
+		if (next_offset < target_size) {
+			read_size = (DWORD)min(buf_size, ((target_size - next_offset + sec_size - 1) / sec_size) * sec_size);
+			if (!IssueAsyncQueue(hDriveQueue, slot, FALSE, &buffer[slot * buf_size], read_size, next_offset))
+				goto read_error;
+			next_offset += buf_size;
+		}
+	}
+	uprintfs("\r\n");
+	if (nb_bad != 0) {
+		uprintf("Verification error: %d bad block%s in the written data", nb_bad, (nb_bad == 1) ? "" : "s");
+		TraceTally("verify failures", nb_bad, 0, 0);
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT;
+		goto out;
+	}
+
+	if (use_hash) {
+		if (!CloseHashStream(TRUE))
+			goto out;
+		if (strcmp(sum_str[CHECKSUM_SHA256], write_sum_str[CHECKSUM_SHA256]) != 0) {
+			uprintf("Verification error: The checksum of the drive data does not match the one of the image");
+			uprintf("  Expected: %s", write_sum_str[CHECKSUM_SHA256]);
+			uprintf("  Found:    %s", sum_str[CHECKSUM_SHA256]);
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT;
+			goto out;
+		}
+	}
+	uprintf("Verified %s of written data", SizeToHumanReadable(target_size, FALSE, FALSE));
+	ret = TRUE;
+	goto out;
+
+read_error:
+	uprintf("\r\nRead error at sector %lld: %s", rb / sec_size, WindowsErrorString());
+	if (image_badblocks_pass)
+		AddImagePassBadBlocks(rb, min(buf_size, target_size - rb), TRUE);
+	FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_READ_FAULT;
+
+out:
+	CloseHashStream(FALSE);
+	CloseFileAsync(hSourceImage);
+	// Must be closed before the buffers get freed, as it waits for in-flight reads
+	CloseAsyncQueue(hDriveQueue);
+	safe_free_io_buffer(buffer);
+	safe_free_io_buffer(src_buffer);
 	return ret;
 }
 
@@ -1851,23 +3859,48 @@ out:
  *   Unlock the volume.
  *   Close the volume handle.
  */
+/*
+ * The persistence partition resides on a different part of the disk than the main one,
+ * and isn't a file system Windows will try to mount, so it can be formatted while the
+ * main partition is being formatted and populated.
+ */
+typedef struct {
+	DWORD DriveIndex;
+	uint64_t PartitionOffset;
+	USHORT FSType;
+	LPCSTR Label;
+	DWORD Flags;
+} persistence_format_job;
+
+static DWORD PersistenceFormatStage(JOB* job, void* context)
+{
+	persistence_format_job* p = (persistence_format_job*)context;
+
+	// Don't go through FormatPartition(), as it alters the actual_fs_type of the main format
+	return FormatExtFs(p->DriveIndex, p->PartitionOffset, 0, FileSystemLabel[p->FSType],
+		p->Label, p->Flags | FP_BACKGROUND) ? 0 : ERROR_WRITE_FAULT;
+}
+
 DWORD WINAPI FormatThread(void* param)
 {
 	int r;
-	BOOL ret, use_large_fat32, windows_to_go, actual_lock_drive = lock_drive;
+	BOOL ret, use_large_fat32, windows_to_go, use_persistence_file, actual_lock_drive = lock_drive;
+	BOOL short_names_enabled = FALSE, restore_short_names = FALSE;
 	// Windows 11 and VDS (which I suspect is what fmifs.dll's FormatEx() is now calling behind the scenes)
 	// require us to unlock the physical drive to format the drive, else access denied is returned.
 	BOOL need_logical = FALSE, must_unlock_physical = (use_vds || nWindowsVersion >= WINDOWS_11);
 	DWORD cr, DriveIndex = (DWORD)(uintptr_t)param, ClusterSize, Flags;
 	HANDLE hPhysicalDrive = INVALID_HANDLE_VALUE;
 	HANDLE hLogicalVolume = INVALID_HANDLE_VALUE;
-	SYSTEMTIME lt;
+	JOB* persistence_bg = NULL;
+	persistence_format_job persistence_job;
 	FILE* log_fd;
+	badblocks_report bb_base;
 	uint8_t *buffer = NULL, extra_partitions = 0;
-	char *bb_msg, *volume_name = NULL;
+	char *volume_name = NULL;
 	char drive_name[] = "?:\\";
 	char drive_letters[27], fs_name[32], label[64];
-	char logfile[MAX_PATH], *userdir;
+	char logfile[MAX_PATH];
 	char efi_dst[] = "?:\\efi\\boot\\bootx64.efi";
 	char kolibri_dst[] = "?:\\MTLD_F32";
 	char grub4dos_dst[] = "?:\\grldr";
@@ -1876,6 +3909,9 @@ DWORD WINAPI FormatThread(void* param)
 	windows_to_go = (image_options & IMOP_WINTOGO) && (boot_type == BT_IMAGE) && HAS_WINTOGO(img_report) &&
 		(ComboBox_GetCurItemData(hImageOption) == IMOP_WIN_TO_GO);
 	large_drive = (SelectedDrive.DiskSize > (1*TB));
+	// Persistence can also be provided through an ext formatted file on the main partition
+	use_persistence_file = (boot_type == BT_IMAGE) && !write_as_image && HAS_PERSISTENCE(img_report) &&
+		persistence_size && (fs_type < FS_EXT2) && ReadSettingBool(SETTING_USE_PERSISTENCE_FILE);
 	if (large_drive)
 		uprintf("Notice: Large drive detected (may produce short writes)");
 	// Find out if we need to add any extra partitions
@@ -1887,7 +3923,8 @@ DWORD WINAPI FormatThread(void* param)
 			  ((boot_type == BT_UEFI_NTFS) || ((boot_type == BT_IMAGE) && IS_EFI_BOOTABLE(img_report) &&
 			   ((target_type == TT_UEFI) || (windows_to_go) || (allow_dual_uefi_bios)))) )
 		extra_partitions = XP_UEFI_NTFS;
-	else if ((boot_type == BT_IMAGE) && !write_as_image && HAS_PERSISTENCE(img_report) && persistence_size)
+	else if ((boot_type == BT_IMAGE) && !write_as_image && HAS_PERSISTENCE(img_report) && persistence_size &&
+		!use_persistence_file)
 		extra_partitions = XP_CASPER;
 	else if (IsChecked(IDC_OLD_BIOS_FIXES))
 		extra_partitions = XP_COMPAT;
@@ -1900,7 +3937,16 @@ DWORD WINAPI FormatThread(void* param)
 	if ((nWindowsVersion >= WINDOWS_11) && extra_partitions)
 		actual_lock_drive = FALSE;
 
+	TraceStart(zero_drive ? (bench_drive ? "bench" : "zero") : (((boot_type == BT_IMAGE) && write_as_image) ?
+		"write" : "format"), SelectedDrive.DeviceNumber);
+	BeginVdsSession();
 	PrintInfoDebug(0, MSG_225);
+	// An image that was identified from the known images DB must have been checked in full
+	if ((boot_type == BT_IMAGE) && !CheckKnownImage()) {
+		if (!IS_USER_CANCEL)
+			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|APPERR(ERROR_ISO_SCAN);
+		goto out;
+	}
 	hPhysicalDrive = GetPhysicalHandle(DriveIndex, actual_lock_drive, FALSE, !actual_lock_drive);
 	if (hPhysicalDrive == INVALID_HANDLE_VALUE) {
 		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_OPEN_FAILED;
@@ -1927,7 +3973,11 @@ DWORD WINAPI FormatThread(void* param)
 	// for VDS to be able to delete the partitions that reside on it...
 	safe_unlockclose(hPhysicalDrive);
 	PrintInfo(0, MSG_239, lmprintf(MSG_307));
-	if (!is_vds_available || !DeletePartition(DriveIndex, 0, TRUE)) {
+	TraceBegin("delete partitions");
+	// Loading VDS to delete nothing can take seconds, so the fast path skips it for drives that have no partitions
+	if (fast_repartition && !HasPartitions(DriveIndex)) {
+		uprintf("No partition to delete");
+	} else if (!is_vds_available || !DeletePartition(DriveIndex, 0, TRUE)) {
 		uprintf("Warning: Could not delete partition(s): %s", is_vds_available ? WindowsErrorString() : "VDS is not available");
 		SetLastError(FormatStatus);
 		FormatStatus = 0;
@@ -1937,6 +3987,7 @@ DWORD WINAPI FormatThread(void* param)
 		// Also, since we couldn't clean the disk, we need to disable drive locking
 		actual_lock_drive = FALSE;
 	}
+	TraceEnd("delete partitions");
 
 	// An extra refresh of the (now empty) partition data here appears to be helpful
 	GetDrivePartitionData(SelectedDrive.DeviceNumber, fs_name, sizeof(fs_name), TRUE);
@@ -1969,12 +4020,17 @@ DWORD WINAPI FormatThread(void* param)
 
 	if (!zero_drive && !write_as_image) {
 		PrintInfoDebug(0, MSG_226);
+		TraceBegin("analyze");
 		AnalyzeMBR(hPhysicalDrive, "Drive", FALSE);
+		TraceEnd("analyze");
 		UpdateProgress(OP_ANALYZE_MBR, -1.0f);
 	}
 
 	if (zero_drive) {
-		WriteDrive(hPhysicalDrive, TRUE);
+		if (bench_drive)
+			BenchmarkDrive(hPhysicalDrive, DriveIndex);
+		else
+			WriteDrive(hPhysicalDrive, TRUE);
 		goto out;
 	}
 
@@ -1983,64 +4039,77 @@ DWORD WINAPI FormatThread(void* param)
 	// in InitializeDisk) is *NOT ENOUGH* to reset a disk and can render it inoperable for partitioning
 	// or formatting under Windows. See https://github.com/pbatard/rufus/issues/759 for details.
 	if ((boot_type != BT_IMAGE) || (img_report.is_iso && !write_as_image)) {
+		TraceBegin("clear");
+		// CreatePartition() resets the disk on its own, so, unless a bad blocks check is to use the
+		// drive before that, the fast path doesn't need us to reset it here.
 		if ((!ClearMBRGPT(hPhysicalDrive, SelectedDrive.DiskSize, SelectedDrive.SectorSize, use_large_fat32)) ||
-			(!InitializeDisk(hPhysicalDrive))) {
+			(!(fast_repartition && !IsChecked(IDC_BAD_BLOCKS)) && !InitializeDisk(hPhysicalDrive))) {
 			uprintf("Could not reset partitions");
 			FormatStatus = (LastWriteError != 0) ? LastWriteError : (ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_PARTITION_FAILURE);
 			goto out;
 		}
+		TraceEnd("clear");
 	}
 
+	// Don't let the bad blocks from a previous run leak into this one
+	FreeBadBlocksReport(&report);
+	// When writing an image, the last pass of a bad blocks check can be the write of the image,
+	// followed by its verification, which saves a full write pass and a full read pass. This only
+	// tests the part of the drive that the image covers, and only the image data, as a pattern.
+	image_badblocks_pass = badblocks_image_pass && IsChecked(IDC_BAD_BLOCKS) && (boot_type == BT_IMAGE) &&
+		write_as_image && !batch_badblocks && !img_report.is_ffu && (img_report.compression_type != BLED_COMPRESSION_VTSI) &&
+		(ComboBox_GetCurSel(hNBPasses) != BADBLOCK_CAPACITY_CHECK);
 	if (IsChecked(IDC_BAD_BLOCKS)) {
+		TraceBegin("bad blocks");
 		do {
 			int sel = ComboBox_GetCurSel(hNBPasses);
-			// create a log file for bad blocks report. Since %USERPROFILE% may
-			// have localized characters, we use the UTF-8 API.
-			userdir = getenvU("USERPROFILE");
-			static_strcpy(logfile, userdir);
-			safe_free(userdir);
-			GetLocalTime(&lt);
-			safe_sprintf(&logfile[strlen(logfile)], sizeof(logfile)-strlen(logfile)-1,
-				"\\rufus_%04d%02d%02d_%02d%02d%02d.log",
-				lt.wYear, lt.wMonth, lt.wDay, lt.wHour, lt.wMinute, lt.wSecond);
-			log_fd = fopenU(logfile, "w+");
-			if (log_fd == NULL) {
-				uprintf("Could not create log file for bad blocks check");
-			} else {
-				fprintf(log_fd, APPLICATION_NAME " bad blocks check started on: %04d.%02d.%02d %02d:%02d:%02d",
-				lt.wYear, lt.wMonth, lt.wDay, lt.wHour, lt.wMinute, lt.wSecond);
-				fflush(log_fd);
+			int nb_passes = ((sel >= 2) ? 4 : sel + 1) - (image_badblocks_pass ? 1 : 0);
+			if (sel == BADBLOCK_CAPACITY_CHECK) {
+				ULONGLONG real_size;
+				char real_str[32];
+				if (!CheckCapacity(hPhysicalDrive, SelectedDrive.DiskSize, SelectedDrive.SectorSize, &real_size)) {
+					uprintf("Capacity check: Check failed.");
+					if (!IS_ERROR(FormatStatus))
+						FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|APPERR(ERROR_BADBLOCKS_FAILURE);
+					ClearMBRGPT(hPhysicalDrive, SelectedDrive.DiskSize, SelectedDrive.SectorSize, FALSE);
+					goto out;
+				}
+				r = IDOK;
+				if (real_size < SelectedDrive.DiskSize) {
+					static_strcpy(real_str, SizeToHumanReadable(real_size, FALSE, FALSE));
+					r = MessageBoxExU(hMainDialog, lmprintf(MSG_329, real_str,
+						SizeToHumanReadable(SelectedDrive.DiskSize, FALSE, FALSE)),
+						lmprintf(MSG_010), MB_ABORTRETRYIGNORE|MB_ICONWARNING|MB_IS_RTL, selected_langid);
+				}
+				continue;
 			}
-
-			if (!BadBlocks(hPhysicalDrive, SelectedDrive.DiskSize, (sel >= 2) ? 4 : sel +1, sel, &report, log_fd)) {
+			if (nb_passes == 0) {
+				uprintf("Bad Blocks: Using the image write as the only pass");
+				r = IDOK;
+				break;
+			}
+			log_fd = OpenBadBlocksLog(logfile, sizeof(logfile));
+			FreeBadBlocksReport(&report);
+			if (!(batch_badblocks ?
+				BatchBadBlocks(hPhysicalDrive, DriveIndex, nb_passes, sel, &report, log_fd) :
+				BadBlocks(hPhysicalDrive, SelectedDrive.DiskSize, DriveId.String[ComboBox_GetCurSel(hDeviceList)],
+					nb_passes, sel, &report, log_fd))) {
 				uprintf("Bad blocks: Check failed.");
 				if (!IS_ERROR(FormatStatus))
 					FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|APPERR(ERROR_BADBLOCKS_FAILURE);
 				ClearMBRGPT(hPhysicalDrive, SelectedDrive.DiskSize, SelectedDrive.SectorSize, FALSE);
-				fclose(log_fd);
+				if (log_fd != NULL)
+					fclose(log_fd);
 				DeleteFileU(logfile);
 				goto out;
 			}
+			SaveIoHeatmap(report.heatmap, DriveIndex - DRIVE_INDEX_MIN, "badblocks");
 			uprintf("Bad Blocks: Check completed, %d bad block%s found. (%d/%d/%d errors)",
 				report.bb_count, (report.bb_count==1)?"":"s",
 				report.num_read_errors, report.num_write_errors, report.num_corruption_errors);
-			r = IDOK;
-			if (report.bb_count) {
-				bb_msg = lmprintf(MSG_011, report.bb_count, report.num_read_errors, report.num_write_errors,
-					report.num_corruption_errors);
-				fprintf(log_fd, "%s", bb_msg);
-				GetLocalTime(&lt);
-				fprintf(log_fd, APPLICATION_NAME " bad blocks check ended on: %04d.%02d.%02d %02d:%02d:%02d",
-				lt.wYear, lt.wMonth, lt.wDay, lt.wHour, lt.wMinute, lt.wSecond);
-				fclose(log_fd);
-				r = MessageBoxExU(hMainDialog, lmprintf(MSG_012, bb_msg, logfile),
-					lmprintf(MSG_010), MB_ABORTRETRYIGNORE|MB_ICONWARNING|MB_IS_RTL, selected_langid);
-			} else {
-				// We didn't get any errors => delete the log file
-				fclose(log_fd);
-				DeleteFileU(logfile);
-			}
+			r = ReportBadBlocks(log_fd, logfile, report.bb_count != 0);
 		} while (r == IDRETRY);
+		TraceEnd("bad blocks");
 		if (r == IDABORT) {
 			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_CANCELLED;
 			goto out;
@@ -2048,17 +4117,64 @@ DWORD WINAPI FormatThread(void* param)
 
 		// Especially after destructive badblocks test, you must zero the MBR/GPT completely
 		// before repartitioning. Else, all kind of bad things happen.
+		TraceBegin("clear");
 		if (!ClearMBRGPT(hPhysicalDrive, SelectedDrive.DiskSize, SelectedDrive.SectorSize, use_large_fat32)) {
 			uprintf("unable to zero MBR/GPT");
 			if (!IS_ERROR(FormatStatus))
 				FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
 			goto out;
 		}
+		TraceEnd("clear");
 	}
 
+	// Image writes are large and sequential, so they don't gain anything from the drive write
+	// cache, and we don't want the verification pass to be served from it either.
+	if (enable_write_cache && !((boot_type == BT_IMAGE) && write_as_image))
+		EnableDriveWriteCache(DriveIndex);
+
 	// Write an image file
 	if ((boot_type == BT_IMAGE) && write_as_image) {
-		WriteDrive(hPhysicalDrive, FALSE);
+		if (batch_write && (ComboBox_GetCount(hDeviceList) > 1)) {
+			if (img_report.compression_type == BLED_COMPRESSION_VTSI)
+				uprintf("Batch: VTSI images can only be written to the selected drive");
+			else if (img_report.is_dynamic_vhd || img_report.is_ffu)
+				uprintf("Batch: %s images can only be written to the selected drive", img_report.is_ffu ? "FFU" : "Dynamic VHD");
+			else
+				OpenBatchTargets(DriveIndex, max(img_report.image_size, img_report.projected_size));
+		}
+		// The bad blocks found by an image pass are reported as the ones of the other passes,
+		// including when it failed, and a retry restarts from the result of these passes.
+		bb_base = report;
+		do {
+			if (image_badblocks_pass) {
+				report.bb_count = bb_base.bb_count;
+				report.num_read_errors = bb_base.num_read_errors;
+				report.num_write_errors = bb_base.num_write_errors;
+				report.num_corruption_errors = bb_base.num_corruption_errors;
+				image_pass_log_fd = log_fd = OpenBadBlocksLog(logfile, sizeof(logfile));
+			}
+			TraceBegin("write image");
+			ret = WriteDrive(hPhysicalDrive, FALSE);
+			TraceEnd("write image");
+			if (ret && (verify_write || image_badblocks_pass)) {
+				TraceBegin("verify");
+				VerifyDrive(hPhysicalDrive);
+				TraceEnd("verify");
+			}
+			r = IDOK;
+			if (image_badblocks_pass) {
+				image_pass_log_fd = NULL;
+				uprintf("Bad Blocks: Image pass completed, %d bad block%s found in total. (%d/%d/%d errors)",
+					report.bb_count, (report.bb_count == 1) ? "" : "s",
+					report.num_read_errors, report.num_write_errors, report.num_corruption_errors);
+				r = ReportBadBlocks(log_fd, logfile, !IS_USER_CANCEL && (report.bb_count != bb_base.bb_count));
+				if (r == IDRETRY)
+					FormatStatus = 0;
+			}
+		} while (r == IDRETRY);
+		if (r == IDABORT)
+			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_CANCELLED;
+		CloseBatchTargets();
 
 		// Trying to mount accessible partitions after writing an image leads to the
 		// creation of the infamous 'System Volume Information' folder on ESPs, which
@@ -2082,11 +4198,13 @@ DWORD WINAPI FormatThread(void* param)
 	UpdateProgress(OP_ZERO_MBR, -1.0f);
 	CHECK_FOR_USER_CANCEL;
 
+	TraceBegin("partition");
 	if (!CreatePartition(hPhysicalDrive, partition_type, fs_type, (partition_type == PARTITION_STYLE_MBR)
 		&& (target_type == TT_UEFI), extra_partitions)) {
 		FormatStatus = (LastWriteError != 0) ? LastWriteError : (ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_PARTITION_FAILURE);
 		goto out;
 	}
+	TraceEnd("partition");
 	UpdateProgress(OP_PARTITION, -1.0f);
 
 	// Close the (unmounted) volume before formatting
@@ -2122,6 +4240,7 @@ DWORD WINAPI FormatThread(void* param)
 
 	// Wait for the logical drive we just created to appear
 	uprintf("Waiting for logical drive to reappear...");
+	TraceBegin("wait for logical");
 	Sleep(200);
 	if (!WaitForLogical(DriveIndex, partition_offset[PI_MAIN])) {
 		uprintf("Logical drive was not found - aborting");
@@ -2129,19 +4248,31 @@ DWORD WINAPI FormatThread(void* param)
 			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_TIMEOUT;
 		goto out;
 	}
+	TraceEnd("wait for logical");
 	CHECK_FOR_USER_CANCEL;
 
 	// Format Casper partition if required. Do it before we format anything with
 	// a file system that Windows will recognize, to avoid concurrent access.
+	// Unless the main partition is also ext (as the ext2fs code is not reentrant),
+	// this happens in the background, while the main partition is being processed.
 	if (extra_partitions & XP_CASPER) {
 		uint32_t ext_version = ReadSetting32(SETTING_USE_EXT_VERSION);
 		if ((ext_version < 2) || (ext_version > 4))
 			ext_version = 3;
 		uprintf("Using %s-like method to enable persistence", img_report.uses_casper ? "Ubuntu" : "Debian");
-		if (!FormatPartition(DriveIndex, partition_offset[PI_CASPER], 0, FS_EXT2 + (ext_version - 2),
-			img_report.uses_casper ? "casper-rw" : "persistence",
-			(img_report.uses_casper ? 0 : FP_CREATE_PERSISTENCE_CONF) |
-			(IsChecked(IDC_QUICK_FORMAT) ? FP_QUICK : 0))) {
+		persistence_job.DriveIndex = DriveIndex;
+		persistence_job.PartitionOffset = partition_offset[PI_CASPER];
+		persistence_job.FSType = FS_EXT2 + (ext_version - 2);
+		persistence_job.Label = img_report.uses_casper ? "casper-rw" : "persistence";
+		persistence_job.Flags = (img_report.uses_casper ? 0 : FP_CREATE_PERSISTENCE_CONF) |
+			(IsChecked(IDC_QUICK_FORMAT) ? FP_QUICK : 0);
+		if (fs_type < FS_EXT2) {
+			persistence_bg = CreateJob("persistence format", &persistence_job);
+			if ((AddJobStage(persistence_bg, "format", PersistenceFormatStage, 0) < 0) || !SubmitJob(persistence_bg))
+				safe_free_job(persistence_bg);
+		}
+		if ((persistence_bg == NULL) && !FormatPartition(DriveIndex, persistence_job.PartitionOffset, 0,
+			persistence_job.FSType, persistence_job.Label, persistence_job.Flags)) {
 			if (!IS_ERROR(FormatStatus))
 				FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
 			goto out;
@@ -2161,7 +4292,9 @@ DWORD WINAPI FormatThread(void* param)
 	if ((fs_type == FS_NTFS) && (enable_ntfs_compression))
 		Flags |= FP_COMPRESSION;
 
+	TraceBegin("format");
 	ret = FormatPartition(DriveIndex, partition_offset[PI_MAIN], ClusterSize, fs_type, label, Flags);
+	TraceEnd("format");
 	if (!ret) {
 		// Error will be set by FormatPartition() in FormatStatus
 		uprintf("Format error: %s", StrError(FormatStatus, TRUE));
@@ -2180,11 +4313,13 @@ DWORD WINAPI FormatThread(void* param)
 	// Thanks to Microsoft, we must fix the MBR AFTER the drive has been formatted
 	if ((partition_type == PARTITION_STYLE_MBR) || ((boot_type != BT_NON_BOOTABLE) && (partition_type == PARTITION_STYLE_GPT))) {
 		PrintInfoDebug(0, MSG_228);	// "Writing master boot record..."
+		TraceBegin("write mbr");
 		if ((!WriteMBR(hPhysicalDrive)) || (!WriteSBR(hPhysicalDrive))) {
 			if (!IS_ERROR(FormatStatus))
 				FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
 			goto out;
 		}
+		TraceEnd("write mbr");
 		UpdateProgress(OP_FIX_MBR, -1.0f);
 	}
 	Sleep(200);
@@ -2192,6 +4327,19 @@ DWORD WINAPI FormatThread(void* param)
 	// Try to continue
 	CHECK_FOR_USER_CANCEL;
 
+	// Lay out the ISO content directly on the fresh FAT32 volume, before it gets mounted,
+	// and let ExtractISO() only process what this left out. Failure is not fatal, unless
+	// the volume was altered, in which case FormatStatus is set.
+	if ((boot_type == BT_IMAGE) && (img_report.is_iso) && (!write_as_image) && (!windows_to_go) &&
+		(fs_type == FS_FAT32) && (!write_as_esp) && (image_path != NULL)) {
+		TraceBegin("write iso to fat32");
+		WriteISOToFAT32(DriveIndex, partition_offset[PI_MAIN], image_path);
+		TraceEnd("write iso to fat32");
+		if (IS_ERROR(FormatStatus))
+			goto out;
+		CHECK_FOR_USER_CANCEL;
+	}
+
 	volume_name = GetLogicalName(DriveIndex, partition_offset[PI_MAIN], TRUE, TRUE);
 	if (volume_name == NULL) {
 		uprintf("Could not get volume name");
@@ -2217,6 +4365,14 @@ DWORD WINAPI FormatThread(void* param)
 			uprintf("Could not disable file indexing: %s", WindowsErrorString());
 	}
 
+	// Short names only slow down the creation of the files we are about to extract. Windows To Go
+	// is left alone, since the OS it installs should get the short name setting it was set up with.
+	if ((fs_type == FS_NTFS) && (boot_type == BT_IMAGE) && !windows_to_go &&
+		SetShortNameCreation(DriveIndex, partition_offset[PI_MAIN], FALSE, &short_names_enabled)) {
+		uprintf("Disabled 8.3 short name creation");
+		restore_short_names = short_names_enabled;
+	}
+
 	// Refresh the drive label - This is needed as Windows may have altered it from
 	// the name we proposed, and we require an exact label, to patch config files.
 	if ((fs_type < FS_EXT2) && !GetVolumeInformationU(drive_name, img_report.usb_label,
@@ -2241,10 +4397,12 @@ DWORD WINAPI FormatThread(void* param)
 		} else if ( (boot_type == BT_SYSLINUX_V4) || (boot_type == BT_SYSLINUX_V6) ||
 			((boot_type == BT_IMAGE) && (HAS_SYSLINUX(img_report) || HAS_REACTOS(img_report)) &&
 				(!HAS_WINDOWS(img_report) || !allow_dual_uefi_bios)) ) {
+			TraceBegin("syslinux");
 			if (!InstallSyslinux(DriveIndex, drive_name[0], fs_type)) {
 				FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_INSTALL_FAILURE;
 				goto out;
 			}
+			TraceEnd("syslinux");
 		} else {
 			// We still have a lock, which we need to modify the volume boot record
 			// => no need to reacquire the lock...
@@ -2257,11 +4415,13 @@ DWORD WINAPI FormatThread(void* param)
 			// NB: if you unmount the logical volume here, XP will report error:
 			// [0x00000456] The media in the drive may have changed
 			PrintInfoDebug(0, MSG_229);
+			TraceBegin("write pbr");
 			if (!WritePBR(hLogicalVolume)) {
 				if (!IS_ERROR(FormatStatus))
 					FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
 				goto out;
 			}
+			TraceEnd("write pbr");
 			// We must close and unlock the volume to write files to it
 			safe_unlockclose(hLogicalVolume);
 		}
@@ -2274,19 +4434,23 @@ DWORD WINAPI FormatThread(void* param)
 	// We issue a complete remount of the filesystem on account of:
 	// - Ensuring the file explorer properly detects that the volume was updated
 	// - Ensuring that an NTFS system will be reparsed so that it becomes bootable
+	TraceBegin("remount");
 	if (!RemountVolume(drive_name, FALSE))
 		goto out;
+	TraceEnd("remount");
 	CHECK_FOR_USER_CANCEL;
 
 	if (boot_type != BT_NON_BOOTABLE) {
 		if ((boot_type == BT_MSDOS) || (boot_type == BT_FREEDOS)) {
 			UpdateProgress(OP_FILE_COPY, -1.0f);
 			PrintInfoDebug(0, MSG_230);
+			TraceBegin("extract dos");
 			if (!ExtractDOS(drive_name)) {
 				if (!IS_ERROR(FormatStatus))
 					FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_CANNOT_COPY;
 				goto out;
 			}
+			TraceEnd("extract dos");
 		} else if (boot_type == BT_GRUB4DOS) {
 			grub4dos_dst[0] = drive_name[0];
 			IGNORE_RETVAL(_chdirU(app_data_dir));
@@ -2299,18 +4463,54 @@ DWORD WINAPI FormatThread(void* param)
 			drive_name[2] = 0;	// Ensure our drive is something like 'D:'
 			if (windows_to_go) {
 				PrintInfoDebug(0, MSG_268);
+				TraceBegin("windows to go");
 				if (!SetupWinToGo(DriveIndex, drive_name, (extra_partitions & XP_ESP))) {
 					if (!IS_ERROR(FormatStatus))
 						FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | APPERR(ERROR_ISO_EXTRACT);
 					goto out;
 				}
+				TraceEnd("windows to go");
 			} else {
 				assert(!img_report.is_windows_img);
+				TraceBegin("extract iso");
 				if (!ExtractISO(image_path, drive_name, FALSE)) {
 					if (!IS_ERROR(FormatStatus))
 						FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|APPERR(ERROR_ISO_EXTRACT);
 					goto out;
 				}
+				TraceEnd("extract iso");
+				if (IS_FAT(fs_type) && img_report.has_4GB_file) {
+					TraceBegin("split wim");
+					if (!SplitWinInstall(drive_name)) {
+						if (!IS_ERROR(FormatStatus))
+							FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|APPERR(ERROR_ISO_EXTRACT);
+						goto out;
+					}
+					TraceEnd("split wim");
+				}
+				if (use_persistence_file) {
+					char persistence_path[16];
+					const char* persistence_label;
+					uint32_t ext_version = ReadSetting32(SETTING_USE_EXT_VERSION);
+					uint64_t persistence_file_size = persistence_size;
+					if ((ext_version < 2) || (ext_version > 4))
+						ext_version = 3;
+					// Debian looks for an image file that is named after the persistence label
+					persistence_label = img_report.uses_casper ? "casper-rw" : "persistence";
+					static_sprintf(persistence_path, "%c:\\%s", drive_name[0], persistence_label);
+					// FAT32 cannot have files that are 4 GB or larger
+					if (IS_FAT(fs_type))
+						persistence_file_size = min(persistence_file_size, 4 * GB - 4 * KB);
+					TraceBegin("persistence file");
+					if (!CreateExtPersistenceFile(persistence_path, persistence_file_size, FileSystemLabel[FS_EXT2 + (ext_version - 2)],
+						persistence_label, (img_report.uses_casper ? 0 : FP_CREATE_PERSISTENCE_CONF) |
+						(IsChecked(IDC_QUICK_FORMAT) ? FP_QUICK : 0))) {
+						if (!IS_ERROR(FormatStatus))
+							FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+						goto out;
+					}
+					TraceEnd("persistence file");
+				}
 				if (HAS_KOLIBRIOS(img_report)) {
 					kolibri_dst[0] = drive_name[0];
 					uprintf("Installing: %s (KolibriOS loader)", kolibri_dst);
@@ -2348,12 +4548,19 @@ DWORD WINAPI FormatThread(void* param)
 				}
 			}
 		}
+		if (restore_short_names) {
+			if (SetShortNameCreation(DriveIndex, partition_offset[PI_MAIN], TRUE, NULL))
+				uprintf("Re-enabled 8.3 short name creation");
+			restore_short_names = FALSE;
+		}
 		UpdateProgress(OP_FINALIZE, -1.0f);
 		PrintInfoDebug(0, MSG_233);
 		if (IsChecked(IDC_EXTENDED_LABEL))
 			SetAutorun(drive_name);
 		// Issue another complete remount before we exit, to ensure we're clean
+		TraceBegin("remount");
 		RemountVolume(drive_name, TRUE);
+		TraceEnd("remount");
 		// NTFS fixup (WinPE/AIK images don't seem to boot without an extra checkdisk)
 		if ((boot_type == BT_IMAGE) && (img_report.is_iso) && (fs_type == FS_NTFS)) {
 			// Try to ensure that all messages from Checkdisk will be in English
@@ -2362,20 +4569,42 @@ DWORD WINAPI FormatThread(void* param)
 				if (PRIMARYLANGID(GetThreadUILanguage()) != LANG_ENGLISH)
 					uprintf("Note: CheckDisk messages may be localized");
 			}
+			TraceBegin("checkdisk");
 			CheckDisk(drive_name[0]);
+			TraceEnd("checkdisk");
 			UpdateProgress(OP_FINALIZE, -1.0f);
 		}
 	}
 
 out:
+	if (restore_short_names)
+		SetShortNameCreation(DriveIndex, partition_offset[PI_MAIN], TRUE, NULL);
+	if (persistence_bg != NULL) {
+		// On error, the background format aborts on its next progress check
+		TraceBegin("wait for persistence");
+		if ((WaitJob(persistence_bg, INFINITE) != 0) && !IS_ERROR(FormatStatus)) {
+			uprintf("Could not format the persistence partition");
+			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+		}
+		TraceEnd("wait for persistence");
+		safe_free_job(persistence_bg);
+	}
+	TraceBegin("flush");
+	if (!RestoreDriveWriteCache() && !IS_ERROR(FormatStatus))
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+	TraceEnd("flush");
 	if ((boot_type == BT_IMAGE) && write_as_image) {
 		PrintInfo(0, MSG_320, lmprintf(MSG_307));
+		TraceBegin("rescan");
 		VdsRescan(VDS_RESCAN_REFRESH, 0, TRUE);
+		TraceEnd("rescan");
 	}
 	safe_free(volume_name);
 	safe_free(buffer);
+	TraceBegin("close");
 	safe_unlockclose(hLogicalVolume);
 	safe_unlockclose(hPhysicalDrive);	// This can take a while
+	TraceEnd("close");
 	if (IS_ERROR(FormatStatus)) {
 		volume_name = GetLogicalName(DriveIndex, partition_offset[PI_MAIN], TRUE, TRUE);
 		if (volume_name != NULL) {
@@ -2384,30 +4613,431 @@ out:
 			free(volume_name);
 		}
 	}
+	EndVdsSession();
+	TraceStop();
 	PostMessage(hMainDialog, UM_FORMAT_COMPLETED, (WPARAM)TRUE, 0);
 	ExitThread(0);
 }
 
-DWORD WINAPI SaveImageThread(void* param)
+/*
+ * Write a block of image data at offset, retrying on error. When sparse is set, the
+ * zeroed parts of the block are not written, so that they become sparse regions.
+ */
+static BOOL WriteImageData(HANDLE hDestImage, uint8_t* buf, DWORD size, uint64_t offset,
+	BOOL sparse, uint64_t* skipped_size)
 {
 	BOOL s;
-	DWORD rSize, wSize;
+	DWORD pos, run, chunk, wSize;
+	LARGE_INTEGER li;
+	int i;
+
+	for (pos = 0; pos < size; pos += run) {
+		chunk = min(IMG_SAVE_SPARSE_CHUNK, size - pos);
+		if (sparse && IsBufferZero(&buf[pos], chunk)) {
+			run = chunk;
+			*skipped_size += chunk;
+			continue;
+		}
+		// Write all the consecutive non-zero chunks at once
+		for (run = chunk; (pos + run < size) && !(sparse &&
+			IsBufferZero(&buf[pos + run], min(IMG_SAVE_SPARSE_CHUNK, size - pos - run)));
+			run += min(IMG_SAVE_SPARSE_CHUNK, size - pos - run));
+		for (i = 1; i <= WRITE_RETRIES; i++) {
+			CHECK_FOR_USER_CANCEL;
+			li.QuadPart = offset + pos;
+			if (!SetFilePointerEx(hDestImage, li, NULL, FILE_BEGIN)) {
+				uprintf("Write error: Could not set position - %s", WindowsErrorString());
+				goto out;
+			}
+			s = WriteFile(hDestImage, &buf[pos], run, &wSize, NULL);
+			if ((s) && (wSize == run))
+				break;
+			if (s)
+				uprintf("Write error: Wrote %d bytes, expected %d bytes", wSize, run);
+			else
+				uprintf("Write error: %s", WindowsErrorString());
+			if (i < WRITE_RETRIES) {
+				uprintf("Retrying in %d seconds...", WRITE_TIMEOUT / 1000);
+				TraceTally("write retries", 1, 0, 0);
+				if (!CancellableSleep(WRITE_TIMEOUT))
+					goto out;
+			}
+		}
+		if (i > WRITE_RETRIES) {
+			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+			goto out;
+		}
+	}
+	return TRUE;
+out:
+	return FALSE;
+}
+
+/*
+ * Rescue capture, for scratched optical media and failing flash drives, in the manner of GNU
+ * ddrescue: rather than aborting on the first read error, we first go through the media with
+ * large reads, skipping further and further ahead on consecutive errors, so that everything
+ * that can be read is captured at full speed, and only then come back for the areas that were
+ * skipped, and for the ones that failed, with smaller and smaller reads, down to the sector.
+ * The state of each area of the media is kept in a map file, next to the image, that uses the
+ * ddrescue format, so that an interrupted capture, or one with bad sectors left, can be resumed
+ * by saving to the same image again, in which case the bad sectors also get another try.
+ */
+#define RESCUE_NON_TRIED            '?'
+#define RESCUE_NON_TRIMMED          '*'
+#define RESCUE_NON_SCRAPED          '/'
+#define RESCUE_BAD_SECTOR           '-'
+#define RESCUE_FINISHED             '+'
+#define RESCUE_SPLIT_SIZE           (64 * KB)
+#define RESCUE_MAX_SKIP             (1 * GB)
+#define RESCUE_MAP_INTERVAL         5000		// How often the map file gets updated, in ms
+
+typedef struct {
+	uint64_t pos;
+	uint64_t size;
+	char status;
+} rescue_range;
+
+static struct {
+	rescue_range* range;			// Contiguous and sorted, covering [0, size[
+	size_t nb_ranges;
+	size_t max_ranges;
+	uint64_t size;
+	uint64_t current_pos;
+	uint64_t last_save;
+	char current_status;
+	int pass;
+	char path[MAX_PATH];
+} rescue_map;
+
+static void RescueFreeMap(void)
+{
+	safe_free(rescue_map.range);
+	memset(&rescue_map, 0, sizeof(rescue_map));
+}
+
+// Make sure that a range starts at pos, and return its index
+static size_t RescueSplit(uint64_t pos)
+{
+	rescue_range* r;
+	size_t i;
+
+	for (i = 0; (i < rescue_map.nb_ranges) && (rescue_map.range[i].pos + rescue_map.range[i].size <= pos); i++);
+	if ((i >= rescue_map.nb_ranges) || (rescue_map.range[i].pos == pos))
+		return i;
+	if (rescue_map.nb_ranges >= rescue_map.max_ranges) {
+		r = realloc(rescue_map.range, 2 * rescue_map.max_ranges * sizeof(rescue_range));
+		if (r == NULL)
+			return SIZE_MAX;
+		rescue_map.range = r;
+		rescue_map.max_ranges *= 2;
+	}
+	r = rescue_map.range;
+	memmove(&r[i + 2], &r[i + 1], (rescue_map.nb_ranges - i - 1) * sizeof(rescue_range));
+	r[i + 1].pos = pos;
+	r[i + 1].size = r[i].pos + r[i].size - pos;
+	r[i + 1].status = r[i].status;
+	r[i].size = pos - r[i].pos;
+	rescue_map.nb_ranges++;
+	return i + 1;
+}
+
+static void RescueRemove(size_t i, size_t count)
+{
+	memmove(&rescue_map.range[i], &rescue_map.range[i + count],
+		(rescue_map.nb_ranges - i - count) * sizeof(rescue_range));
+	rescue_map.nb_ranges -= count;
+}
+
+static BOOL RescueSetStatus(uint64_t pos, uint64_t size, char status)
+{
+	rescue_range* r;
+	size_t a, b;
+
+	a = RescueSplit(pos);
+	b = RescueSplit(pos + size);
+	if ((a == SIZE_MAX) || (b == SIZE_MAX)) {
+		uprintf("Rescue: Could not update the map");
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_NOT_ENOUGH_MEMORY;
+		return FALSE;
+	}
+	r = rescue_map.range;
+	r[a].size = size;
+	r[a].status = status;
+	RescueRemove(a + 1, b - a - 1);
+	// Merge with the neighbours that have the same status
+	if ((a + 1 < rescue_map.nb_ranges) && (r[a + 1].status == status)) {
+		r[a].size += r[a + 1].size;
+		RescueRemove(a + 1, 1);
+	}
+	if ((a > 0) && (r[a - 1].status == status)) {
+		r[a - 1].size += r[a].size;
+		RescueRemove(a, 1);
+	}
+	return TRUE;
+}
+
+// Find the first area with the requested status, that ends after *pos
+static BOOL RescueNext(char status, uint64_t* pos, uint64_t* size)
+{
+	size_t i;
+
+	for (i = 0; i < rescue_map.nb_ranges; i++) {
+		rescue_range* r = &rescue_map.range[i];
+		if ((r->status != status) || (r->pos + r->size <= *pos))
+			continue;
+		*pos = max(*pos, r->pos);
+		*size = r->pos + r->size - *pos;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+static uint64_t RescueGetSize(char status)
+{
+	uint64_t size = 0;
+	size_t i;
+
+	for (i = 0; i < rescue_map.nb_ranges; i++) {
+		if (rescue_map.range[i].status == status)
+			size += rescue_map.range[i].size;
+	}
+	return size;
+}
+
+/*
+ * Load the map of a previous capture of the same media, if any, or start a new one.
+ * The bad sectors of a previous run are set to be scraped again.
+ */
+static BOOL RescueLoadMap(const char* image_path, uint64_t size)
+{
+	FILE* fd;
+	char line[128], status;
+	uint64_t pos, len, expected = 0;
+	BOOL has_header = FALSE, valid = FALSE;
+	int pass;
+
+	RescueFreeMap();
+	rescue_map.max_ranges = 64;
+	rescue_map.range = calloc(rescue_map.max_ranges, sizeof(rescue_range));
+	if (rescue_map.range == NULL)
+		return FALSE;
+	rescue_map.size = size;
+	static_sprintf(rescue_map.path, "%s.map", image_path);
+
+	fd = fopenU(rescue_map.path, "r");
+	if (fd != NULL) {
+		while (fgets(line, sizeof(line), fd) != NULL) {
+			if ((line[0] == '#') || (line[0] == '\n') || (line[0] == '\r'))
+				continue;
+			if (!has_header) {
+				if (sscanf(line, "%" SCNi64 " %c %d", &pos, &status, &pass) != 3)
+					break;
+				has_header = TRUE;
+				continue;
+			}
+			if ((sscanf(line, "%" SCNi64 " %" SCNi64 " %c", &pos, &len, &status) != 3) || (pos != expected) ||
+				(len == 0) || (strchr("?*/-+", status) == NULL))
+				break;
+			if (status == RESCUE_BAD_SECTOR)
+				status = RESCUE_NON_SCRAPED;
+			expected += len;
+			if (expected > size)
+				break;
+			if ((rescue_map.nb_ranges != 0) && (rescue_map.range[rescue_map.nb_ranges - 1].status == status)) {
+				rescue_map.range[rescue_map.nb_ranges - 1].size += len;
+				continue;
+			}
+			if (rescue_map.nb_ranges >= rescue_map.max_ranges) {
+				rescue_range* r = realloc(rescue_map.range, 2 * rescue_map.max_ranges * sizeof(rescue_range));
+				if (r == NULL)
+					break;
+				rescue_map.range = r;
+				rescue_map.max_ranges *= 2;
+			}
+			rescue_map.range[rescue_map.nb_ranges].pos = pos;
+			rescue_map.range[rescue_map.nb_ranges].size = len;
+			rescue_map.range[rescue_map.nb_ranges++].status = status;
+		}
+		valid = has_header && (expected == size) && feof(fd);
+		fclose(fd);
+		if (valid)
+			uprintf("Rescue: Resuming from '%s' (%s left to read)", rescue_map.path,
+				SizeToHumanReadable(size - RescueGetSize(RESCUE_FINISHED), FALSE, FALSE));
+		else
+			uprintf("Rescue: Ignoring invalid or mismatched map '%s'", rescue_map.path);
+	}
+	if (!valid) {
+		rescue_map.range[0].pos = 0;
+		rescue_map.range[0].size = size;
+		rescue_map.range[0].status = RESCUE_NON_TRIED;
+		rescue_map.nb_ranges = 1;
+	}
+	return valid;
+}
+
+static void RescueSaveMap(BOOL bForce)
+{
+	FILE* fd;
+	char tmp_path[MAX_PATH + 4];
+	uint64_t now = GetTickCount64();
+	size_t i;
+
+	if (!bForce && (now < rescue_map.last_save + RESCUE_MAP_INTERVAL))
+		return;
+	rescue_map.last_save = now;
+	static_sprintf(tmp_path, "%s.tmp", rescue_map.path);
+	fd = fopenU(tmp_path, "w");
+	if (fd == NULL) {
+		uprintf("Rescue: Could not write map '%s'", tmp_path);
+		return;
+	}
+	fprintf(fd, "# Mapfile. Created by %s %d.%d\n", APPLICATION_NAME, rufus_version[0], rufus_version[1]);
+	fprintf(fd, "# current_pos  current_status  current_pass\n");
+	fprintf(fd, "0x%08" PRIX64 "     %c               %d\n", rescue_map.current_pos,
+		rescue_map.current_status, rescue_map.pass);
+	fprintf(fd, "#      pos        size  status\n");
+	for (i = 0; i < rescue_map.nb_ranges; i++)
+		fprintf(fd, "0x%08" PRIX64 "  0x%08" PRIX64 "  %c\n", rescue_map.range[i].pos,
+			rescue_map.range[i].size, rescue_map.range[i].status);
+	fclose(fd);
+	// Replace the previous map in one go, so that an interruption doesn't leave us with a partial one
+	if (!MoveFileExU(tmp_path, rescue_map.path, MOVEFILE_REPLACE_EXISTING))
+		uprintf("Rescue: Could not update map '%s': %s", rescue_map.path, WindowsErrorString());
+}
+
+static BOOL RescueRead(HANDLE hSource, uint8_t* buf, uint64_t pos, DWORD size)
+{
+	OVERLAPPED overlapped = { 0 };
+	DWORD read_size;
+
+	overlapped.Offset = (DWORD)pos;
+	overlapped.OffsetHigh = (DWORD)(pos >> 32);
+	return ReadFile(hSource, buf, size, &read_size, &overlapped) && (read_size == size);
+}
+
+/*
+ * Go through all the areas with status from, with reads of read_size, marking the ones that
+ * can't be read with status error. If skip is set, the area that follows a read error is left
+ * for later, starting with read_size and doubling with each consecutive error.
+ */
+static BOOL RescuePass(HANDLE hSource, HANDLE hDest, uint8_t* buf, DWORD read_size, char from, char error,
+	BOOL skip, BOOL sparse, uint64_t* skipped_size)
+{
+	uint64_t pos, len, skip_size = 0, done = RescueGetSize(RESCUE_FINISHED);
+	DWORD size;
+
+	rescue_map.current_status = from;
+	for (pos = 0; RescueNext(from, &pos, &len); pos += size) {
+		size = (DWORD)min(read_size, len);
+		rescue_map.current_pos = pos;
+		UpdateProgressWithInfo(OP_FORMAT, MSG_261, done, rescue_map.size);
+		CHECK_FOR_USER_CANCEL;
+		if (RescueRead(hSource, buf, pos, size)) {
+			if (!WriteImageData(hDest, buf, size, pos, sparse, skipped_size) ||
+				!RescueSetStatus(pos, size, RESCUE_FINISHED))
+				goto out;
+			done += size;
+			skip_size = 0;
+		} else {
+			if (!IS_ERROR(FormatStatus) || (SCODE_CODE(FormatStatus) != ERROR_CANCELLED))
+				uprintf("Rescue: Could not read %s at offset 0x%" PRIX64 ": %s",
+					SizeToHumanReadable(size, FALSE, FALSE), pos, WindowsErrorString());
+			CHECK_FOR_USER_CANCEL;
+			if (!RescueSetStatus(pos, size, error))
+				goto out;
+			if (skip) {
+				skip_size = (skip_size == 0) ? read_size : min(2 * skip_size, RESCUE_MAX_SKIP);
+				pos += skip_size;
+			}
+		}
+		RescueSaveMap(FALSE);
+	}
+	return TRUE;
+out:
+	return FALSE;
+}
+
+static BOOL RescueCapture(HANDLE hSource, HANDLE hDest, IMG_SAVE* img_save, uint8_t* buf, DWORD sector_size,
+	BOOL sparse, uint64_t* skipped_size)
+{
+	BOOL r = FALSE;
+	LARGE_INTEGER li;
+	uint64_t bad_size;
+
+	// The image is sized upfront, so that the areas that can't be read end up as zeros
+	li.QuadPart = img_save->DeviceSize;
+	if (!SetFilePointerEx(hDest, li, NULL, FILE_BEGIN) || !SetEndOfFile(hDest)) {
+		uprintf("Could not set image size: %s", WindowsErrorString());
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+		goto out;
+	}
+	// Pass 1: Large reads, skipping ahead on errors, and pass 2: Large reads of what was skipped
+	for (rescue_map.pass = 1; rescue_map.pass <= 2; rescue_map.pass++) {
+		if (!RescuePass(hSource, hDest, buf, img_save->BufSize, RESCUE_NON_TRIED, RESCUE_NON_TRIMMED,
+			rescue_map.pass == 1, sparse, skipped_size))
+			goto out;
+	}
+	// Pass 3: Split the areas that failed into smaller reads, and pass 4: Scrape what's left, by sector
+	if (RescueGetSize(RESCUE_NON_TRIMMED) != 0)
+		uprintf("Rescue: Splitting %s of unreadable areas...",
+			SizeToHumanReadable(RescueGetSize(RESCUE_NON_TRIMMED), FALSE, FALSE));
+	if (!RescuePass(hSource, hDest, buf, max(RESCUE_SPLIT_SIZE, sector_size), RESCUE_NON_TRIMMED,
+		RESCUE_NON_SCRAPED, FALSE, sparse, skipped_size))
+		goto out;
+	rescue_map.pass++;
+	if (RescueGetSize(RESCUE_NON_SCRAPED) != 0)
+		uprintf("Rescue: Scraping %s, one sector at a time...",
+			SizeToHumanReadable(RescueGetSize(RESCUE_NON_SCRAPED), FALSE, FALSE));
+	if (!RescuePass(hSource, hDest, buf, sector_size, RESCUE_NON_SCRAPED, RESCUE_BAD_SECTOR,
+		FALSE, sparse, skipped_size))
+		goto out;
+	rescue_map.current_pos = img_save->DeviceSize;
+	rescue_map.current_status = RESCUE_FINISHED;
+	bad_size = RescueGetSize(RESCUE_BAD_SECTOR);
+	if (bad_size != 0) {
+		uprintf("Rescue: %s could not be read, and was left zeroed in the image. Save to the same image to retry.",
+			SizeToHumanReadable(bad_size, FALSE, FALSE));
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_READ_FAULT;
+		goto out;
+	}
+	r = TRUE;
+
+out:
+	if (r) {
+		DeleteFileU(rescue_map.path);
+	} else {
+		RescueSaveMap(TRUE);
+		uprintf("Rescue: Map saved as '%s'", rescue_map.path);
+	}
+	return r;
+}
+
+DWORD WINAPI SaveImageThread(void* param)
+{
+	BOOL s, sparse = FALSE, dynamic_vhd = FALSE, rescue = FALSE, resume = FALSE;
+	DWORD rSize, wSize, size, slot, nb_buffers = IMG_SAVE_BUFFERS;
 	IMG_SAVE *img_save = (IMG_SAVE*)param;
 	HANDLE hPhysicalDrive = INVALID_HANDLE_VALUE;
-	HANDLE hDestImage = INVALID_HANDLE_VALUE;
+	HANDLE hDestImage = INVALID_HANDLE_VALUE, hReadQueue = NULL, hCompressor = INVALID_HANDLE_VALUE;
 	LARGE_INTEGER li;
 	uint8_t *buffer = NULL;
-	uint64_t wb;
-	int i;
+	uint64_t wb, chunk, nb_chunks, issued, skipped_size = 0;
 
+	TraceStart("save", SelectedDrive.DeviceNumber);
 	PrintInfoDebug(0, MSG_225);
 	switch (img_save->Type) {
 	case IMG_SAVE_TYPE_VHD:
+	case IMG_SAVE_TYPE_DYNAMIC_VHD:
+	case IMG_SAVE_TYPE_COMPRESSED:
 		hPhysicalDrive = GetPhysicalHandle(img_save->DeviceNum, TRUE, FALSE, FALSE);
 		break;
 	case IMG_SAVE_TYPE_ISO:
 		hPhysicalDrive = CreateFileA(img_save->DevicePath, GENERIC_READ, FILE_SHARE_READ,
 			NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (hPhysicalDrive != INVALID_HANDLE_VALUE)
+			SetOpticalReadSpeed(hPhysicalDrive, img_save->DeviceSize);
+		nb_buffers = IMG_SAVE_OPTICAL_BUFFERS;
 		break;
 	default:
 		uprintf("Invalid image type");
@@ -2417,96 +5047,307 @@ DWORD WINAPI SaveImageThread(void* param)
 		goto out;
 	}
 
-	// Write an image file
-	// We may have poked the MBR and other stuff, so need to rewind
-	li.QuadPart = 0;
-	if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN))
-		uprintf("Warning: Unable to rewind device position - wrong data might be copied!");
-	hDestImage = CreateFileU(img_save->ImagePath, GENERIC_WRITE, FILE_SHARE_WRITE, NULL,
-		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-	if (hDestImage == INVALID_HANDLE_VALUE) {
-		uprintf("Could not open image '%s': %s", img_save->ImagePath, WindowsErrorString());
-		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_OPEN_FAILED;
-		goto out;
+	if (img_save->Type == IMG_SAVE_TYPE_COMPRESSED) {
+		// The compressor creates the image file from the data we feed it
+		hCompressor = StartImageCompressor(img_save->ImagePath, img_save->Compression);
+		if (hCompressor == INVALID_HANDLE_VALUE) {
+			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_OPEN_FAILED;
+			goto out;
+		}
+	} else {
+		// Rescue mode only applies to raw images, that can be resumed from the areas left to read
+		rescue = rescue_capture && ((img_save->Type == IMG_SAVE_TYPE_ISO) || (img_save->Type == IMG_SAVE_TYPE_VHD));
+		if (rescue) {
+			resume = RescueLoadMap(img_save->ImagePath, img_save->DeviceSize);
+			if (rescue_map.range == NULL) {
+				FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_NOT_ENOUGH_MEMORY;
+				goto out;
+			}
+		}
+		// Write an image file
+		hDestImage = CreateFileU(img_save->ImagePath, GENERIC_WRITE, FILE_SHARE_WRITE, NULL,
+			resume ? OPEN_ALWAYS : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hDestImage == INVALID_HANDLE_VALUE) {
+			uprintf("Could not open image '%s': %s", img_save->ImagePath, WindowsErrorString());
+			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_OPEN_FAILED;
+			goto out;
+		}
+	}
+	if (img_save->Type == IMG_SAVE_TYPE_DYNAMIC_VHD) {
+		// Zeroed blocks of the device are simply not allocated in the VHD
+		dynamic_vhd = CreateDynamicVHD(hDestImage, img_save->DeviceSize);
+		if (!dynamic_vhd) {
+			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+			goto out;
+		}
+	} else if (hDestImage != INVALID_HANDLE_VALUE) {
+		// Zeroed areas of the device don't need to take any space in the image
+		sparse = DeviceIoControl(hDestImage, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &size, NULL);
+		if (!sparse)
+			uprintf("Notice: Could not create a sparse image file: %s", WindowsErrorString());
 	}
 
-	buffer = (uint8_t*)_mm_malloc(img_save->BufSize, 16);
+	// The buffers must be aligned for the unbuffered reads of the async queue
+	buffer = (uint8_t*)AllocIoBuffer((size_t)img_save->BufSize * nb_buffers);
 	if (buffer == NULL) {
 		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_NOT_ENOUGH_MEMORY;
 		uprintf("could not allocate buffer");
 		goto out;
 	}
+	if (rescue) {
+		uprintf("Rescue capture to image '%s'...", img_save->ImagePath);
+		UpdateProgressWithInfoInit(NULL, FALSE);
+		TraceBegin("rescue");
+		if (!RescueCapture(hPhysicalDrive, hDestImage, img_save, buffer,
+			(img_save->Type == IMG_SAVE_TYPE_ISO) ? 2048 : SelectedDrive.SectorSize, sparse, &skipped_size))
+			goto out;
+		TraceEnd("rescue");
+		wb = img_save->DeviceSize;
+		goto finalize;
+	}
+	// Reads are issued at explicit offsets, so we don't need to rewind the device (and optical
+	// drives, that don't appear to increment the sectors to read automatically, are fine too)
+	hReadQueue = BlockCreateQueue(hPhysicalDrive, GENERIC_READ, nb_buffers, NULL);
+	if (hReadQueue == NULL) {
+		uprintf("Could not create device read queue: %s", WindowsErrorString());
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_NOT_ENOUGH_MEMORY;
+		goto out;
+	}
+	if (((ASYNC_QUEUE*)hReadQueue)->bSync)
+		uprintf("Notice: Could not reopen device for overlapped I/O - Reads will be synchronous");
 
-	uprintf("Will use a buffer size of %s", SizeToHumanReadable(img_save->BufSize, FALSE, FALSE));
+	uprintf("Will use %d buffers of %s", nb_buffers, SizeToHumanReadable(img_save->BufSize, FALSE, FALSE));
 	uprintf("Saving to image '%s'...", img_save->ImagePath);
 
-	// Don't bother trying for something clever, using double buffering overlapped and whatnot:
-	// With Windows' default optimizations, sync read + sync write for sequential operations
-	// will be as fast, if not faster, than whatever async scheme you can come up with.
+	// Keep reads from the device in flight, on all the buffers but the one being written
+	// to the image, so that the copy is bound by the slower of the two rather than by both.
 	UpdateProgressWithInfoInit(NULL, FALSE);
-	for (wb = 0; ; wb += wSize) {
-		if (img_save->Type == IMG_SAVE_TYPE_ISO) {
-			// Optical drives do not appear to increment the sectors to read automatically
-			li.QuadPart = wb;
-			if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN))
-				uprintf("Warning: Unable to set device position - wrong data might be copied!");
-		}
-		s = ReadFile(hPhysicalDrive, buffer,
-			(DWORD)MIN(img_save->BufSize, img_save->DeviceSize - wb), &rSize, NULL);
-		if (!s) {
+	TraceBegin("copy");
+	nb_chunks = (img_save->DeviceSize + img_save->BufSize - 1) / img_save->BufSize;
+	for (issued = 0; (issued < nb_buffers) && (issued < nb_chunks); issued++) {
+		size = (DWORD)MIN(img_save->BufSize, img_save->DeviceSize - issued * img_save->BufSize);
+		if (!IssueAsyncQueue(hReadQueue, (DWORD)issued, FALSE, &buffer[(size_t)issued * img_save->BufSize],
+			size, issued * img_save->BufSize))
+			goto read_error;
+	}
+	for (wb = 0, chunk = 0; chunk < nb_chunks; chunk++, wb += rSize) {
+		slot = (DWORD)(chunk % nb_buffers);
+		size = (DWORD)MIN(img_save->BufSize, img_save->DeviceSize - wb);
+		UpdateProgressWithInfo(OP_FORMAT, MSG_261, wb, img_save->DeviceSize);
+		CHECK_FOR_USER_CANCEL;
+		if (!WaitAsyncQueue(hReadQueue, slot, DRIVE_ACCESS_TIMEOUT, &rSize))
+			goto read_error;
+		if (rSize != size) {
+			uprintf("Read error: Read %d bytes, expected %d bytes", rSize, size);
 			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_READ_FAULT;
-			uprintf("Read error: %s", WindowsErrorString());
 			goto out;
 		}
-		if (rSize == 0)
+		switch (img_save->Type) {
+		case IMG_SAVE_TYPE_DYNAMIC_VHD:
+			s = WriteDynamicVHD(&buffer[(size_t)slot * img_save->BufSize], rSize, wb, &skipped_size);
 			break;
-		UpdateProgressWithInfo(OP_FORMAT, MSG_261, wb, img_save->DeviceSize);
-		for (i = 1; i <= WRITE_RETRIES; i++) {
-			CHECK_FOR_USER_CANCEL;
-			s = WriteFile(hDestImage, buffer, rSize, &wSize, NULL);
-			if ((s) && (wSize == rSize))
-				break;
-			if (s)
-				uprintf("Write error: Wrote %d bytes, expected %d bytes", wSize, rSize);
-			else
-				uprintf("Write error: %s", WindowsErrorString());
-			if (i < WRITE_RETRIES) {
-				li.QuadPart = wb;
-				uprintf("Retrying in %d seconds...", WRITE_TIMEOUT / 1000);
-				Sleep(WRITE_TIMEOUT);
-				if (!SetFilePointerEx(hDestImage, li, NULL, FILE_BEGIN)) {
-					uprintf("Write error: Could not reset position - %s", WindowsErrorString());
-					goto out;
-				}
-			} else {
-				FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+		case IMG_SAVE_TYPE_COMPRESSED:
+			// Blocks until the compressor has consumed the data
+			s = WriteFile(hCompressor, &buffer[(size_t)slot * img_save->BufSize], rSize, &wSize, NULL) &&
+				(wSize == rSize);
+			if (!s)
+				uprintf("Could not feed the compressor: %s", WindowsErrorString());
+			break;
+		default:
+			if (!WriteImageData(hDestImage, &buffer[(size_t)slot * img_save->BufSize], rSize, wb, sparse, &skipped_size))
 				goto out;
-			}
-			Sleep(200);
+			s = TRUE;
+			break;
 		}
-		if (i > WRITE_RETRIES)
+		if (!s) {
+			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
 			goto out;
+		}
+		// The buffer is free again, so use it for the next read
+		if (issued < nb_chunks) {
+			size = (DWORD)MIN(img_save->BufSize, img_save->DeviceSize - issued * img_save->BufSize);
+			if (!IssueAsyncQueue(hReadQueue, slot, FALSE, &buffer[(size_t)slot * img_save->BufSize],
+				size, issued * img_save->BufSize))
+				goto read_error;
+			issued++;
+		}
+	}
+	TraceEnd("copy");
+
+finalize:
+	// Skipped zeroed areas at the end of the device must still be part of the image
+	li.QuadPart = wb;
+	if (sparse && (!SetFilePointerEx(hDestImage, li, NULL, FILE_BEGIN) || !SetEndOfFile(hDestImage))) {
+		uprintf("Could not set image size: %s", WindowsErrorString());
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+		goto out;
 	}
+	if (skipped_size != 0)
+		uprintf("Sparse image: Skipped %s of zeroed data", SizeToHumanReadable(skipped_size, FALSE, FALSE));
 	if (wb != img_save->DeviceSize) {
 		uprintf("Error: wrote %s, expected %s", SizeToHumanReadable(wb, FALSE, FALSE),
 			SizeToHumanReadable(img_save->DeviceSize, FALSE, FALSE));
 		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
 		goto out;
 	}
-	if (img_save->Type == IMG_SAVE_TYPE_VHD) {
+	TraceBegin("finalize");
+	switch (img_save->Type) {
+	case IMG_SAVE_TYPE_VHD:
 		uprintf("Appending VHD footer...");
 		if (!AppendVHDFooter(img_save->ImagePath)) {
 			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
 			goto out;
 		}
+		break;
+	case IMG_SAVE_TYPE_DYNAMIC_VHD:
+		uprintf("Writing dynamic VHD block allocation table and footer...");
+		dynamic_vhd = FALSE;
+		if (!CloseDynamicVHD(TRUE)) {
+			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+			goto out;
+		}
+		break;
+	case IMG_SAVE_TYPE_COMPRESSED:
+		uprintf("Waiting for the compressor to complete the image...");
+		s = StopImageCompressor(hCompressor, FALSE);
+		hCompressor = INVALID_HANDLE_VALUE;
+		if (!s) {
+			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+			goto out;
+		}
+		break;
 	}
+	TraceEnd("finalize");
 	uprintf("Operation complete (Wrote %s).", SizeToHumanReadable(wb, FALSE, FALSE));
+	goto out;
+
+read_error:
+	uprintf("Read error: %s", WindowsErrorString());
+	FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_READ_FAULT;
 
 out:
+	// Must be closed before the buffers get freed, as it waits for in-flight reads
+	CloseAsyncQueue(hReadQueue);
+	if (dynamic_vhd)
+		CloseDynamicVHD(FALSE);
+	if (hCompressor != INVALID_HANDLE_VALUE)
+		StopImageCompressor(hCompressor, TRUE);
 	safe_free(img_save->ImagePath);
-	safe_mm_free(buffer);
+	safe_free_io_buffer(buffer);
 	safe_closehandle(hDestImage);
+	RescueFreeMap();
 	safe_unlockclose(hPhysicalDrive);
+	TraceStop();
+	PostMessage(hMainDialog, UM_FORMAT_COMPLETED, (WPARAM)TRUE, 0);
+	ExitThread(0);
+}
+
+/*
+ * Return the size of the area of a drive that a clone needs to copy, which ends with the last
+ * partition, so that the free space that follows it doesn't have to be read and written. The
+ * backup GPT, that resides in the last MB of a GPT drive, is reported separately.
+ */
+static uint64_t GetCloneSize(HANDLE hDrive, uint64_t disk_size, BOOL* is_gpt)
+{
+	DWORD size, i;
+	BYTE layout[4096] = { 0 };
+	PDRIVE_LAYOUT_INFORMATION_EX DriveLayout = (PDRIVE_LAYOUT_INFORMATION_EX)(void*)layout;
+	uint64_t end = 0;
+
+	*is_gpt = FALSE;
+	if (!DeviceIoControl(hDrive, IOCTL_DISK_GET_DRIVE_LAYOUT_EX, NULL, 0, layout, sizeof(layout), &size, NULL) ||
+		(size == 0) || (DriveLayout->PartitionStyle == PARTITION_STYLE_RAW))
+		return disk_size;
+	for (i = 0; i < DriveLayout->PartitionCount; i++) {
+		if (DriveLayout->PartitionEntry[i].PartitionLength.QuadPart == 0)
+			continue;
+		end = max(end, (uint64_t)(DriveLayout->PartitionEntry[i].StartingOffset.QuadPart +
+			DriveLayout->PartitionEntry[i].PartitionLength.QuadPart));
+	}
+	if (end == 0)
+		return disk_size;
+	end = ((max(end, MB) + MB - 1) / MB) * MB;
+	*is_gpt = (DriveLayout->PartitionStyle == PARTITION_STYLE_GPT);
+	// No point in splitting the copy if there isn't any free space to skip
+	if (end + (*is_gpt ? MB : 0) >= disk_size) {
+		*is_gpt = FALSE;
+		return disk_size;
+	}
+	return end;
+}
+
+/*
+ * Clone the selected drive to all the other drives from the device list, by feeding the data
+ * we read from it to the write pipeline, so that we don't need an intermediate image and the
+ * targets get written concurrently. The first target is the one whose failure aborts the clone.
+ * Since blocks of zeros are only written to the targets that don't already read them back as
+ * zeros, a clone to freshly zeroed drives only needs to write the data of the source.
+ */
+DWORD WINAPI CloneDriveThread(void* param)
+{
+	BOOL is_gpt, r = FALSE;
+	DWORD i, SourceIndex = (DWORD)(uintptr_t)param, TargetIndex = 0;
+	HANDLE hSourceDrive, hTargetDrive = INVALID_HANDLE_VALUE;
+	IO_HEATMAP* heatmap = NULL;
+	uint64_t clone_size, total, done = 0;
+	char str[32];
+
+	TraceStart("clone", SelectedDrive.DeviceNumber);
+	PrintInfoDebug(0, MSG_225);
+	hSourceDrive = GetPhysicalHandle(SourceIndex, TRUE, FALSE, FALSE);
+	if (hSourceDrive == INVALID_HANDLE_VALUE) {
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_OPEN_FAILED;
+		goto out;
+	}
+	clone_size = GetCloneSize(hSourceDrive, SelectedDrive.DiskSize, &is_gpt);
+	total = clone_size + (is_gpt ? MB : 0);
+	uprintf("Clone: Copying %s of disk %d%s", SizeToHumanReadable(clone_size, FALSE, FALSE),
+		(int)(SourceIndex - DRIVE_INDEX_MIN), is_gpt ? ", as well as its backup GPT" : "");
+
+	// The backup GPT is copied at the same offset, so GPT targets must be as large as the source
+	OpenBatchTargets(SourceIndex, is_gpt ? SelectedDrive.DiskSize : clone_size);
+	if (nb_batch_targets == 0) {
+		uprintf("Clone: No suitable target drive");
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_OPEN_FAILED;
+		goto out;
+	}
+	hTargetDrive = batch_target[0].hDrive;
+	TargetIndex = batch_target[0].index;
+	heatmap = batch_target[0].heatmap;
+	for (i = 1; i < nb_batch_targets; i++)
+		batch_target[i - 1] = batch_target[i];
+	nb_batch_targets--;
+
+	if (!OpenPipeline(hTargetDrive, heatmap, 0, TRUE))
+		goto out;
+	UpdateProgressWithInfoInit(NULL, FALSE);
+	TraceBegin("copy");
+	r = PipelineReadDrive(hSourceDrive, 0, clone_size, &done, total) &&
+		(!is_gpt || PipelineReadDrive(hSourceDrive, SelectedDrive.DiskSize - MB, MB, &done, total));
+	if (!ClosePipeline(r)) {
+		uprintf("Clone: Disk %d: Write FAILED", (int)TargetIndex);
+		if (!IS_ERROR(FormatStatus))
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT;
+		r = FALSE;
+	}
+	TraceEnd("copy");
+	if (!r)
+		goto out;
+	RefreshDriveLayout(hTargetDrive);
+	static_strcpy(str, SizeToHumanReadable(pipeline.target[0].written, FALSE, FALSE));
+	uprintf("Clone: Disk %d: Wrote %s, and skipped %s of already zeroed data", (int)TargetIndex, str,
+		SizeToHumanReadable(pipeline.target[0].skipped, FALSE, FALSE));
+	uprintf("Operation complete (Copied %s).", SizeToHumanReadable(total, FALSE, FALSE));
+
+out:
+	CloseBatchTargets();
+	safe_unlockclose(hTargetDrive);
+	if (heatmap != NULL) {
+		SaveIoHeatmap(heatmap, TargetIndex, "write");
+		free(heatmap);
+	}
+	safe_unlockclose(hSourceDrive);
+	TraceStop();
 	PostMessage(hMainDialog, UM_FORMAT_COMPLETED, (WPARAM)TRUE, 0);
 	ExitThread(0);
 }
@@ -109,6 +109,106 @@ typedef BOOLEAN (WINAPI* EnableVolumeCompression_t)(
 	ULONG                CompressionFlags	// FILE_SYSTEM_PROP_FLAG
 );
 
+/* FAT32 boot sector and FSInfo, as used by FormatLargeFAT32() and WriteISOToFAT32() */
+#pragma pack(push, 1)
+typedef struct tagFAT_BOOTSECTOR32
+{
+	// Common fields.
+	BYTE sJmpBoot[3];
+	BYTE sOEMName[8];
+	WORD wBytsPerSec;
+	BYTE bSecPerClus;
+	WORD wRsvdSecCnt;
+	BYTE bNumFATs;
+	WORD wRootEntCnt;
+	WORD wTotSec16;           // if zero, use dTotSec32 instead
+	BYTE bMedia;
+	WORD wFATSz16;
+	WORD wSecPerTrk;
+	WORD wNumHeads;
+	DWORD dHiddSec;
+	DWORD dTotSec32;
+	// Fat 32/16 only
+	DWORD dFATSz32;
+	WORD wExtFlags;
+	WORD wFSVer;
+	DWORD dRootClus;
+	WORD wFSInfo;
+	WORD wBkBootSec;
+	BYTE Reserved[12];
+	BYTE bDrvNum;
+	BYTE Reserved1;
+	BYTE bBootSig;           // == 0x29 if next three fields are ok
+	DWORD dBS_VolID;
+	BYTE sVolLab[11];
+	BYTE sBS_FilSysType[8];
+} FAT_BOOTSECTOR32;
+
+typedef struct {
+	DWORD dLeadSig;         // 0x41615252
+	BYTE sReserved1[480];   // zeros
+	DWORD dStrucSig;        // 0x61417272
+	DWORD dFree_Count;      // 0xFFFFFFFF
+	DWORD dNxt_Free;        // 0xFFFFFFFF
+	BYTE sReserved2[12];    // zeros
+	DWORD dTrailSig;        // 0xAA550000
+} FAT_FSINFO;
+
+/* exFAT boot sector and system directory entries, as used by FormatExFAT() */
+typedef struct {
+	BYTE sJumpBoot[3];
+	BYTE sFileSystemName[8];
+	BYTE MustBeZero[53];
+	ULONGLONG qPartitionOffset;
+	ULONGLONG qVolumeLength;
+	DWORD dFatOffset;
+	DWORD dFatLength;
+	DWORD dClusterHeapOffset;
+	DWORD dClusterCount;
+	DWORD dFirstClusterOfRootDirectory;
+	DWORD dVolumeSerialNumber;
+	WORD wFileSystemRevision;
+	WORD wVolumeFlags;
+	BYTE bBytesPerSectorShift;
+	BYTE bSectorsPerClusterShift;
+	BYTE bNumberOfFats;
+	BYTE bDriveSelect;
+	BYTE bPercentInUse;
+	BYTE Reserved[7];
+	BYTE BootCode[390];
+	WORD wBootSignature;    // 0xAA55
+} EXFAT_BOOTSECTOR;
+
+typedef struct {
+	BYTE bEntryType;
+	union {
+		struct {
+			BYTE bCharacterCount;
+			WCHAR sVolumeLabel[11];
+			BYTE Reserved[8];
+		} Label;
+		struct {
+			BYTE bBitmapFlags;
+			BYTE Reserved[18];
+			DWORD dFirstCluster;
+			ULONGLONG qDataLength;
+		} Bitmap;
+		struct {
+			BYTE Reserved1[3];
+			DWORD dTableChecksum;
+			BYTE Reserved2[12];
+			DWORD dFirstCluster;
+			ULONGLONG qDataLength;
+		} UpcaseTable;
+	} u;
+} EXFAT_DIR_ENTRY;
+#pragma pack(pop)
+
 BOOL WritePBR(HANDLE hLogicalDrive);
+DWORD GetVolumeID(void);
 BOOL FormatLargeFAT32(DWORD DriveIndex, uint64_t PartitionOffset, DWORD ClusterSize, LPCSTR FSName, LPCSTR Label, DWORD Flags);
+BOOL FormatExFAT(DWORD DriveIndex, uint64_t PartitionOffset, DWORD ClusterSize, LPCSTR FSName, LPCSTR Label, DWORD Flags);
 BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LPCSTR FSName, LPCSTR Label, DWORD Flags);
+BOOL FormatExtFsImage(const char* path, DWORD BlockSize, LPCSTR FSName, LPCSTR Label, DWORD Flags);
+BOOL CreateExtPersistenceFile(const char* path, uint64_t size, LPCSTR FSName, LPCSTR Label, DWORD Flags);
+BOOL CopyToExtFs(DWORD DriveIndex, uint64_t PartitionOffset, const char* src_dir, const char* dst_dir);
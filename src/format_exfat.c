@@ -0,0 +1,342 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Direct exFAT formatting
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "rufus.h"
+#include "file.h"
+#include "drive.h"
+#include "format.h"
+#include "missing.h"
+#include "resource.h"
+#include "msapi_utf8.h"
+#include "localization.h"
+
+#define die(msg, err) do { uprintf(msg); \
+	FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|err; \
+	goto out; } while(0)
+
+/*
+ * See https://learn.microsoft.com/en-us/windows/win32/fileio/exfat-specification
+ */
+#define EXFAT_BOOT_REGION_SECTORS       12
+#define EXFAT_FIRST_CLUSTER             2
+#define EXFAT_MAX_CLUSTER_COUNT         0xFFFFFFF5
+#define EXFAT_MAX_CLUSTER_SIZE          (32 * MB)
+#define EXFAT_MAX_LABEL_LENGTH          11
+#define EXFAT_ENTRY_VOLUME_LABEL        0x83
+#define EXFAT_ENTRY_ALLOCATION_BITMAP   0x81
+#define EXFAT_ENTRY_UPCASE_TABLE        0x82
+#define EXFAT_UPCASE_RANGE_MARKER       0xFFFF
+
+#define ALIGN_UP(x, a)                  ((((x) + (a) - 1) / (a)) * (a))
+
+extern const char* FileSystemLabel[FS_MAX];
+
+/*
+ * The checksum used for the boot region and the up-case table. For the main boot
+ * sector, the VolumeFlags and PercentInUse fields are excluded.
+ */
+static uint32_t ExFATChecksum(const uint8_t* data, size_t size, BOOL bBootRegion)
+{
+	uint32_t checksum = 0;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (bBootRegion && ((i == 106) || (i == 107) || (i == 112)))
+			continue;
+		checksum = ((checksum & 1) ? 0x80000000 : 0) + (checksum >> 1) + data[i];
+	}
+	return checksum;
+}
+
+/*
+ * Build a compressed up-case table from the system's own case mapping, where each run of
+ * characters that map to themselves is stored as 0xFFFF followed by the length of the run.
+ * The returned table is allocated and must be freed.
+ */
+static WCHAR* GetExFATUpcaseTable(DWORD* Size)
+{
+	WCHAR *map, *table;
+	DWORD i, j, run, len = 0;
+
+	map = (WCHAR*)malloc(0x10000 * sizeof(WCHAR));
+	// A run that ends on 0xFFFF is always stored as a run, so one extra word is the worst case
+	table = (WCHAR*)malloc((0x10000 + 1) * sizeof(WCHAR));
+	if ((map == NULL) || (table == NULL)) {
+		safe_free(map);
+		safe_free(table);
+		return NULL;
+	}
+	for (i = 0; i < 0x10000; i++)
+		map[i] = (WCHAR)i;
+	CharUpperBuffW(map, 0x10000);
+	// Leave surrogates alone
+	for (i = 0xD800; i < 0xE000; i++)
+		map[i] = (WCHAR)i;
+
+	for (i = 0; i < 0x10000; i += run) {
+		for (run = 0; (i + run < 0x10000) && (run < 0x8000) && (map[i + run] == i + run); run++);
+		// 0xFFFF is our marker, so it must never be stored as a plain value
+		if ((run >= 3) || ((run != 0) && (i + run == 0x10000))) {
+			table[len++] = EXFAT_UPCASE_RANGE_MARKER;
+			table[len++] = (WCHAR)run;
+		} else {
+			run = max(run, 1);
+			for (j = 0; j < run; j++)
+				table[len++] = map[i + j];
+		}
+	}
+	free(map);
+	*Size = len * sizeof(WCHAR);
+	return table;
+}
+
+static DWORD GetExFATDefaultClusterSize(uint64_t PartitionSize)
+{
+	// https://support.microsoft.com/en-us/help/140365/default-cluster-size-for-ntfs-fat-and-exfat
+	if (PartitionSize <= 256 * MB)
+		return 4 * KB;
+	if (PartitionSize <= 32 * GB)
+		return 32 * KB;
+	return 128 * KB;
+}
+
+static void exfat_zero_progress(uint64_t done, uint64_t total)
+{
+	UpdateProgressWithInfo(OP_FORMAT, MSG_217, done, total);
+}
+
+static BOOL WriteExFATSectors(HANDLE hLogicalVolume, DWORD BytesPerSect, uint64_t Sector, uint64_t nSectors, const void* Buf)
+{
+	return (write_sectors(hLogicalVolume, BytesPerSect, Sector, nSectors, Buf) == (int64_t)(nSectors * BytesPerSect));
+}
+
+/*
+ * Lay out an exFAT file system directly: the boot regions, the FAT, and a cluster heap
+ * holding the allocation bitmap, the up-case table and an empty root directory. This
+ * only amounts to a few MB of writes, and avoids the overhead of going through the
+ * system's formatter. Only used for quick formats, as a full format must zero the volume.
+ */
+BOOL FormatExFAT(DWORD DriveIndex, uint64_t PartitionOffset, DWORD ClusterSize, LPCSTR FSName, LPCSTR Label, DWORD Flags)
+{
+	BOOL r = FALSE;
+	HANDLE hLogicalVolume = NULL;
+	DWORD i, cbRet, BytesPerSect, SectorsPerCluster, Shift, Alignment, UpcaseSize = 0;
+	DWORD FatOffset, FatLength, ClusterHeapOffset, ClusterCount, VolumeId;
+	DWORD BitmapClusters, UpcaseClusters, UsedClusters, FatSectors, BitmapSectors;
+	uint64_t VolumeLength, BitmapSize;
+	PARTITION_INFORMATION_EX xpiDrive;
+	EXFAT_BOOTSECTOR* pBootSect;
+	EXFAT_DIR_ENTRY* pDirEntry;
+	uint8_t *pBootRegion = NULL, *pBitmap = NULL, *pUpcase = NULL, *pRootDir = NULL;
+	uint32_t checksum, *pFat = NULL, *pChecksum;
+	WCHAR *wUpcaseTable = NULL, *wLabel = NULL;
+
+	if (safe_strcmp(FSName, FileSystemLabel[FS_EXFAT]) != 0) {
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_INVALID_PARAMETER;
+		goto out;
+	}
+	PrintInfoDebug(0, MSG_222, FSName);
+	uprintf("Formatting to %s (direct)", FSName);
+	UpdateProgressWithInfoInit(NULL, TRUE);
+	VolumeId = GetVolumeID();
+
+	// Open the drive and lock it
+	hLogicalVolume = GetLogicalHandle(DriveIndex, PartitionOffset, TRUE, TRUE, FALSE);
+	if (IS_ERROR(FormatStatus))
+		goto out;
+	if ((hLogicalVolume == INVALID_HANDLE_VALUE) || (hLogicalVolume == NULL))
+		die("Invalid logical volume handle", ERROR_INVALID_HANDLE);
+
+	// Try to disappear the volume while we're formatting it
+	UnmountVolume(hLogicalVolume);
+
+	if (!DeviceIoControl(hLogicalVolume, IOCTL_DISK_GET_PARTITION_INFO_EX, NULL, 0, &xpiDrive,
+		sizeof(xpiDrive), &cbRet, NULL)) {
+		uprintf("IOCTL_DISK_GET_PARTITION_INFO_EX error: %s", WindowsErrorString());
+		die("Failed to get partition info", ERROR_NOT_SUPPORTED);
+	}
+
+	BytesPerSect = max(SelectedDrive.SectorSize, 512);
+	if (!IS_POWER_OF_2(BytesPerSect) || (BytesPerSect > 4 * KB))
+		die("Unsupported sector size for exFAT", ERROR_NOT_SUPPORTED);
+	if (ClusterSize == 0)
+		ClusterSize = GetExFATDefaultClusterSize(xpiDrive.PartitionLength.QuadPart);
+	if (!IS_POWER_OF_2(ClusterSize) || (ClusterSize < BytesPerSect) || (ClusterSize > EXFAT_MAX_CLUSTER_SIZE))
+		die("Invalid exFAT cluster size", APPERR(ERROR_INVALID_CLUSTER_SIZE));
+	SectorsPerCluster = ClusterSize / BytesPerSect;
+	VolumeLength = xpiDrive.PartitionLength.QuadPart / BytesPerSect;
+
+	// Align the FAT and the cluster heap to the cluster size, or to 1 MB on larger
+	// volumes, which is what flash media tends to be happiest with.
+	Alignment = SectorsPerCluster;
+	if (xpiDrive.PartitionLength.QuadPart >= 256 * MB)
+		Alignment = max(Alignment, (DWORD)(1 * MB / BytesPerSect));
+	FatOffset = ALIGN_UP(2 * EXFAT_BOOT_REGION_SECTORS, Alignment);
+	if (VolumeLength <= FatOffset)
+		die("This drive is too small for exFAT", APPERR(ERROR_INVALID_VOLUME_SIZE));
+	// This overestimates the FAT by the clusters it takes itself, which is fine
+	ClusterCount = (DWORD)min((VolumeLength - FatOffset) / SectorsPerCluster, EXFAT_MAX_CLUSTER_COUNT + 1ULL);
+	FatLength = (DWORD)ALIGN_UP(ALIGN_UP(((uint64_t)ClusterCount + EXFAT_FIRST_CLUSTER) * 4, BytesPerSect) / BytesPerSect, Alignment);
+	ClusterHeapOffset = FatOffset + FatLength;
+	if (VolumeLength <= ClusterHeapOffset + SectorsPerCluster)
+		die("This drive is too small for exFAT", APPERR(ERROR_INVALID_VOLUME_SIZE));
+	if ((VolumeLength - ClusterHeapOffset) / SectorsPerCluster > EXFAT_MAX_CLUSTER_COUNT)
+		die("This drive has too many clusters for exFAT, try to specify a larger cluster size or use the default",
+			APPERR(ERROR_INVALID_CLUSTER_SIZE));
+	ClusterCount = (DWORD)((VolumeLength - ClusterHeapOffset) / SectorsPerCluster);
+
+	wUpcaseTable = GetExFATUpcaseTable(&UpcaseSize);
+	if (wUpcaseTable == NULL)
+		die("Failed to create up-case table", ERROR_NOT_ENOUGH_MEMORY);
+	BitmapSize = ((uint64_t)ClusterCount + 7) / 8;
+	BitmapClusters = (DWORD)((BitmapSize + ClusterSize - 1) / ClusterSize);
+	UpcaseClusters = (UpcaseSize + ClusterSize - 1) / ClusterSize;
+	// The allocation bitmap, the up-case table and the root directory, in that order
+	UsedClusters = BitmapClusters + UpcaseClusters + 1;
+	if (UsedClusters >= ClusterCount)
+		die("This drive is too small for exFAT", APPERR(ERROR_INVALID_VOLUME_SIZE));
+
+	FatSectors = ALIGN_UP((UsedClusters + EXFAT_FIRST_CLUSTER) * 4, BytesPerSect) / BytesPerSect;
+	BitmapSectors = ALIGN_UP((UsedClusters + 7) / 8, BytesPerSect) / BytesPerSect;
+	// coverity[tainted_data]
+	pBootRegion = (uint8_t*)calloc(EXFAT_BOOT_REGION_SECTORS, BytesPerSect);
+	pFat = (uint32_t*)calloc(FatSectors, BytesPerSect);
+	pBitmap = (uint8_t*)calloc(BitmapSectors, BytesPerSect);
+	pUpcase = (uint8_t*)calloc(UpcaseClusters, ClusterSize);
+	pRootDir = (uint8_t*)calloc(1, ClusterSize);
+	if ((pBootRegion == NULL) || (pFat == NULL) || (pBitmap == NULL) || (pUpcase == NULL) || (pRootDir == NULL))
+		die("Failed to allocate memory", ERROR_NOT_ENOUGH_MEMORY);
+
+	// Main boot sector
+	pBootSect = (EXFAT_BOOTSECTOR*)pBootRegion;
+	pBootSect->sJumpBoot[0] = 0xEB;
+	pBootSect->sJumpBoot[1] = 0x76;
+	pBootSect->sJumpBoot[2] = 0x90;
+	memcpy(pBootSect->sFileSystemName, "EXFAT   ", 8);
+	pBootSect->qPartitionOffset = xpiDrive.StartingOffset.QuadPart / BytesPerSect;
+	pBootSect->qVolumeLength = VolumeLength;
+	pBootSect->dFatOffset = FatOffset;
+	pBootSect->dFatLength = FatLength;
+	pBootSect->dClusterHeapOffset = ClusterHeapOffset;
+	pBootSect->dClusterCount = ClusterCount;
+	pBootSect->dFirstClusterOfRootDirectory = EXFAT_FIRST_CLUSTER + BitmapClusters + UpcaseClusters;
+	pBootSect->dVolumeSerialNumber = VolumeId;
+	pBootSect->wFileSystemRevision = 0x0100;
+	for (Shift = 0; (1UL << Shift) < BytesPerSect; Shift++);
+	pBootSect->bBytesPerSectorShift = (BYTE)Shift;
+	for (Shift = 0; (1UL << Shift) < SectorsPerCluster; Shift++);
+	pBootSect->bSectorsPerClusterShift = (BYTE)Shift;
+	pBootSect->bNumberOfFats = 1;
+	pBootSect->bDriveSelect = 0x80;
+	// We don't provide boot code, so just halt
+	memset(pBootSect->BootCode, 0xF4, sizeof(pBootSect->BootCode));
+	pBootSect->wBootSignature = 0xAA55;
+	// Extended boot sectors only need their signature. The OEM parameters and reserved sectors stay zeroed.
+	for (i = 1; i <= 8; i++)
+		*(uint32_t*)&pBootRegion[(i + 1) * BytesPerSect - 4] = 0xAA550000;
+	checksum = ExFATChecksum(pBootRegion, (EXFAT_BOOT_REGION_SECTORS - 1) * BytesPerSect, TRUE);
+	pChecksum = (uint32_t*)&pBootRegion[(EXFAT_BOOT_REGION_SECTORS - 1) * BytesPerSect];
+	for (i = 0; i < BytesPerSect / sizeof(uint32_t); i++)
+		pChecksum[i] = checksum;
+
+	// FAT chains and allocation bitmap for the clusters we use
+	pFat[0] = 0xFFFFFFF8;
+	pFat[1] = 0xFFFFFFFF;
+	for (i = EXFAT_FIRST_CLUSTER; i < EXFAT_FIRST_CLUSTER + UsedClusters; i++)
+		pFat[i] = i + 1;
+	pFat[EXFAT_FIRST_CLUSTER + BitmapClusters - 1] = 0xFFFFFFFF;
+	pFat[EXFAT_FIRST_CLUSTER + BitmapClusters + UpcaseClusters - 1] = 0xFFFFFFFF;
+	pFat[EXFAT_FIRST_CLUSTER + UsedClusters - 1] = 0xFFFFFFFF;
+	for (i = 0; i < UsedClusters; i++)
+		pBitmap[i / 8] |= 1 << (i % 8);
+
+	// Up-case table and root directory
+	memcpy(pUpcase, wUpcaseTable, UpcaseSize);
+	pDirEntry = (EXFAT_DIR_ENTRY*)pRootDir;
+	wLabel = utf8_to_wchar(Label);
+	if ((wLabel != NULL) && (wLabel[0] != 0)) {
+		pDirEntry->bEntryType = EXFAT_ENTRY_VOLUME_LABEL;
+		pDirEntry->u.Label.bCharacterCount = (BYTE)min(wcslen(wLabel), EXFAT_MAX_LABEL_LENGTH);
+		memcpy(pDirEntry->u.Label.sVolumeLabel, wLabel, pDirEntry->u.Label.bCharacterCount * sizeof(WCHAR));
+		pDirEntry++;
+	}
+	pDirEntry->bEntryType = EXFAT_ENTRY_ALLOCATION_BITMAP;
+	pDirEntry->u.Bitmap.dFirstCluster = EXFAT_FIRST_CLUSTER;
+	pDirEntry->u.Bitmap.qDataLength = BitmapSize;
+	pDirEntry++;
+	pDirEntry->bEntryType = EXFAT_ENTRY_UPCASE_TABLE;
+	pDirEntry->u.UpcaseTable.dTableChecksum = ExFATChecksum((uint8_t*)wUpcaseTable, UpcaseSize, FALSE);
+	pDirEntry->u.UpcaseTable.dFirstCluster = EXFAT_FIRST_CLUSTER + BitmapClusters;
+	pDirEntry->u.UpcaseTable.qDataLength = UpcaseSize;
+
+	// Now we're committed - print some info first
+	uprintf("Size : %s %llu sectors", SizeToHumanReadable(xpiDrive.PartitionLength.QuadPart, TRUE, FALSE), VolumeLength);
+	uprintf("Cluster size %d bytes, %d bytes per sector", ClusterSize, BytesPerSect);
+	uprintf("Volume ID is %x:%x", VolumeId >> 16, VolumeId & 0xffff);
+	uprintf("FAT at sector %d (%d sectors), cluster heap at sector %d", FatOffset, FatLength, ClusterHeapOffset);
+	uprintf("%d Total clusters, %d used by the file system", ClusterCount, UsedClusters);
+
+	// The unused parts of the FAT and bitmap must be zeroed, as well as the rest of the boot regions
+	uprintf("Clearing out the system area...");
+	if (!ZeroDriveRange(hLogicalVolume, 0, ((uint64_t)ClusterHeapOffset + (uint64_t)UsedClusters * SectorsPerCluster) *
+		BytesPerSect, ZF_ALLOW_TRIM, NULL, exfat_zero_progress)) {
+		CHECK_FOR_USER_CANCEL;
+		die("Error clearing the system area", ERROR_WRITE_FAULT);
+	}
+	CHECK_FOR_USER_CANCEL;
+
+	uprintf("Initializing boot regions, FAT and system clusters...");
+	if (!WriteExFATSectors(hLogicalVolume, BytesPerSect, 0, EXFAT_BOOT_REGION_SECTORS, pBootRegion) ||
+		!WriteExFATSectors(hLogicalVolume, BytesPerSect, EXFAT_BOOT_REGION_SECTORS, EXFAT_BOOT_REGION_SECTORS, pBootRegion) ||
+		!WriteExFATSectors(hLogicalVolume, BytesPerSect, FatOffset, FatSectors, pFat) ||
+		!WriteExFATSectors(hLogicalVolume, BytesPerSect, ClusterHeapOffset, BitmapSectors, pBitmap) ||
+		!WriteExFATSectors(hLogicalVolume, BytesPerSect, ClusterHeapOffset + (uint64_t)BitmapClusters * SectorsPerCluster,
+			(uint64_t)UpcaseClusters * SectorsPerCluster, pUpcase) ||
+		!WriteExFATSectors(hLogicalVolume, BytesPerSect, ClusterHeapOffset +
+			((uint64_t)BitmapClusters + UpcaseClusters) * SectorsPerCluster, SectorsPerCluster, pRootDir)) {
+		uprintf("Write error: %s", WindowsErrorString());
+		die("Could not write exFAT structures", ERROR_WRITE_FAULT);
+	}
+	UpdateProgressWithInfo(OP_FORMAT, MSG_217, 100, 100);
+
+	uprintf("Format completed.");
+	r = TRUE;
+
+out:
+	safe_closehandle(hLogicalVolume);
+	safe_free(wLabel);
+	safe_free(wUpcaseTable);
+	safe_free(pBootRegion);
+	safe_free(pFat);
+	safe_free(pBitmap);
+	safe_free(pUpcase);
+	safe_free(pRootDir);
+	return r;
+}
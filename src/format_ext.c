@@ -34,16 +34,32 @@
 #include "format.h"
 #include "missing.h"
 #include "resource.h"
+#include "settings.h"
 #include "msapi_utf8.h"
 #include "localization.h"
+#include "badblocks.h"
 #include "ext2fs/ext2fs.h"
+#include "ext2fs/crc16.h"
 
 extern const char* FileSystemLabel[FS_MAX];
 extern io_manager nt_io_manager;
 extern DWORD ext2_last_winerror(DWORD default_error);
+extern badblocks_report report;
 static float ext2_percent_start = 0.0f, ext2_percent_share = 0.5f;
+static BOOL ext2_background = FALSE;
 const float ext2_max_marker = 80.0f;
 
+// Number of block groups whose bitmaps and inode tables get packed together with ext4's
+// flex_bg (same as mke2fs). This can be overridden with the "ExtFlexBgSize" setting.
+#define EXT4_DEFAULT_FLEXBG_SIZE	16
+#define EXT4_MAX_FLEXBG_SIZE		(1 << 16)
+// On large ext4 volumes, only keep two backups of the superblock and group descriptors
+// (sparse_super2), as their copies in every sparse_super group add up to a lot of seeks
+// when the file system is closed. On very large ones, where the descriptors no longer fit
+// in a single write, also spread them across their meta groups (meta_bg).
+#define EXT4_SPARSE_SUPER2_MIN_SIZE	(1 * TB)
+#define EXT4_META_BG_MIN_SIZE		(16 * TB)
+
 typedef struct {
 	uint64_t max_size;
 	uint32_t block_size;
@@ -188,8 +204,8 @@ const char* error_message(errcode_t error_code)
 errcode_t ext2fs_print_progress(int64_t cur_value, int64_t max_value)
 {
 	static int64_t last_value = -1;
-	if (max_value == 0)
-		return 0;
+	if ((max_value == 0) || ext2_background)
+		return IS_ERROR(FormatStatus) ? EXT2_ET_CANCEL_REQUESTED : 0;
 	UpdateProgressWithInfo(OP_FORMAT, MSG_217, (uint64_t)((ext2_percent_start * max_value) + (ext2_percent_share * cur_value)), max_value);
 	cur_value = (int64_t)(((float)cur_value / (float)max_value) * min(ext2_max_marker, (float)max_value));
 	if (cur_value != last_value) {
@@ -224,7 +240,687 @@ const char* GetExtFsLabel(DWORD DriveIndex, uint64_t PartitionOffset)
 #define TEST_IMG_SIZE               4000		// Size in MB
 #define SET_EXT2_FORMAT_ERROR(x)    if (!IS_ERROR(FormatStatus)) FormatStatus = ext2_last_winerror(x)
 
-BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LPCSTR FSName, LPCSTR Label, DWORD Flags)
+/*
+ * Convert the bad blocks from the report of the last bad blocks check (which are in
+ * BADBLOCK_BLOCK_SIZE units, relative to the start of the disk) into a list of file
+ * system blocks for the partition we are about to format.
+ */
+static BOOL ext2fs_bb_range(ext2_filsys fs, uint64_t PartitionOffset, uint32_t i, blk64_t* start, blk64_t* end)
+{
+	// The u32 based list of ext2fs cannot hold more than 2^32 blocks
+	uint64_t fs_size = min(ext2fs_blocks_count(fs->super), 0x100000000ULL);
+	uint64_t lo = report.extents[i].start * BADBLOCK_BLOCK_SIZE;
+	uint64_t hi = (report.extents[i].start + report.extents[i].count) * BADBLOCK_BLOCK_SIZE;
+
+	if (hi <= PartitionOffset)
+		return FALSE;
+	*start = (lo < PartitionOffset) ? 0 : (lo - PartitionOffset) / fs->blocksize;
+	*end = min(ext2fs_div64_ceil(hi - PartitionOffset, fs->blocksize), fs_size);
+	return (*start < *end);
+}
+
+static errcode_t ext2fs_get_bb_list(ext2_filsys fs, uint64_t PartitionOffset, ext2_badblocks_list* ret)
+{
+	errcode_t r;
+	uint32_t i;
+	blk64_t blk, start, end, count = 0;
+	ext2_badblocks_list bb_list = NULL;
+
+	*ret = NULL;
+	if (report.extents == NULL)
+		return 0;
+	// Size the list upfront, since ext2fs only grows it by 100 blocks at a time
+	for (i = 0; i < report.num_extents; i++) {
+		if (ext2fs_bb_range(fs, PartitionOffset, i, &start, &end))
+			count += end - start;
+	}
+	if ((count == 0) || (count > INT32_MAX))
+		return 0;
+	r = ext2fs_badblocks_list_create(&bb_list, (int)count);
+	if (r != 0)
+		return r;
+	// The extents are sorted, so every block gets appended at the end of the list
+	for (i = 0; i < report.num_extents; i++) {
+		if (!ext2fs_bb_range(fs, PartitionOffset, i, &start, &end))
+			continue;
+		for (blk = start; blk < end; blk++) {
+			r = ext2fs_badblocks_list_add(bb_list, (blk_t)blk);
+			if (r != 0) {
+				ext2fs_badblocks_list_free(bb_list);
+				return r;
+			}
+		}
+	}
+	*ret = bb_list;
+	return 0;
+}
+
+/*
+ * Mark the bad blocks as used in the block bitmap, so that they don't get allocated.
+ * Mostly taken from handle_bad_blocks() in mke2fs.c.
+ */
+static BOOL ext2fs_handle_bad_blocks(ext2_filsys fs, ext2_badblocks_list bb_list)
+{
+	uint32_t i, j;
+	int group_bad;
+	dgrp_t group;
+	blk_t bb;
+	blk64_t blk, must_be_good, group_block;
+	ext2_badblocks_iterate bb_iter;
+
+	// The primary superblock and group descriptors *must* be good
+	must_be_good = fs->super->s_first_data_block + 1 + fs->desc_blocks;
+	for (blk = fs->super->s_first_data_block; blk <= must_be_good; blk++) {
+		if (ext2fs_badblocks_list_test(bb_list, (blk_t)blk)) {
+			uprintf("Block %lld in primary superblock/group descriptor area is bad - Aborting", blk);
+			return FALSE;
+		}
+	}
+
+	// See if any of the bad blocks are showing up in the backup superblocks and/or group descriptors
+	group_block = fs->super->s_first_data_block + fs->super->s_blocks_per_group;
+	for (i = 1; i < fs->group_desc_count; i++) {
+		group_bad = 0;
+		for (j = 0; j < fs->desc_blocks + 1; j++) {
+			if (ext2fs_badblocks_list_test(bb_list, (blk_t)(group_block + j))) {
+				if (!group_bad)
+					uprintf("Warning: The backup superblock/group descriptors at block %lld contain bad blocks", group_block);
+				group_bad++;
+				group = ext2fs_group_of_blk2(fs, group_block + j);
+				ext2fs_bg_free_blocks_count_set(fs, group, ext2fs_bg_free_blocks_count(fs, group) + 1);
+				ext2fs_group_desc_csum_set(fs, group);
+				ext2fs_free_blocks_count_add(fs->super, 1);
+			}
+		}
+		group_block += fs->super->s_blocks_per_group;
+	}
+
+	// Mark all the bad blocks as used
+	if (ext2fs_badblocks_list_iterate_begin(bb_list, &bb_iter) != 0) {
+		uprintf("Could not iterate bad blocks list");
+		return FALSE;
+	}
+	while (ext2fs_badblocks_list_iterate(bb_iter, &bb))
+		ext2fs_mark_block_bitmap2(fs->block_map, bb);
+	ext2fs_badblocks_list_iterate_end(bb_iter);
+	return TRUE;
+}
+
+/*
+ * Ext formatting templates
+ *
+ * When the "EnableExtTemplate" setting is set, the writes that make up the first ext format of
+ * a given size and type are recorded, and compacted into a sparse map of the metadata blocks
+ * once the file system has been closed. Further formats with the same parameters, such as the
+ * persistence partition of a batch of identical drives, then just replay the zeroing/discard
+ * operations and write the map back, in a few large writes, with the UUID, hash seed, label and
+ * timestamps patched in. So that the checksums of the bitmaps, inodes and directories don't
+ * depend on the UUID, metadata_csum file systems are created with csum_seed in this mode, which
+ * leaves us with just the superblocks and, for uninit_bg, the group descriptors to checksum.
+ */
+#define EXT_TMPL_UNIT               1024			// Superblock size, and smallest block size
+#define EXT_TMPL_MAX_DATA           (64 * MB)
+#define EXT_TMPL_FLAGS              (FP_QUICK | FP_CREATE_PERSISTENCE_CONF)
+#define JBD2_SB_UUID_OFFSET         0x30			// offsetof(journal_superblock_t, s_uuid)
+
+enum {
+	EXT_TMPL_OP_ZERO = 0,
+	EXT_TMPL_OP_DISCARD
+};
+
+typedef struct {
+	uint64_t unit;
+	uint64_t count;
+	uint32_t seq;
+	int type;
+} ext_tmpl_op;
+
+typedef struct {
+	uint64_t unit;
+	uint32_t seq;
+	uint32_t offset;
+} ext_tmpl_unit;
+
+typedef struct {
+	uint64_t unit;
+	uint32_t count;
+	uint32_t offset;
+} ext_tmpl_run;
+
+typedef struct {
+	// Parameters the template applies to
+	uint64_t size;
+	DWORD block_size;
+	DWORD flags;
+	char fs_name[8];
+	BOOL discard_zeroes;
+	// Recording state
+	BOOL failed;
+	uint32_t seq;
+	ext_tmpl_unit* unit;
+	uint32_t nb_units, max_units;
+	// Zero and discard operations, in the order they were issued
+	ext_tmpl_op* op;
+	uint32_t nb_ops, max_ops;
+	// Runs of written data, in units, sorted by location
+	ext_tmpl_run* run;
+	uint32_t nb_runs;
+	uint8_t* data;
+	uint32_t data_units, max_data_units;
+	// Locations of the fields we need to patch
+	uint64_t sb_unit[64];
+	uint32_t nb_sb;
+	uint64_t gdt_unit[64];
+	uint32_t nb_gdt, gdt_count, desc_size;
+	uint64_t jsb_unit;
+} ext_template;
+
+typedef struct {
+	io_channel real;
+	ext_template* tmpl;
+} tmpl_private_data;
+
+static ext_template* ext_tmpl = NULL;
+static ext_template* ext_tmpl_rec = NULL;
+
+static void ExtTmplFree(ext_template** tmpl)
+{
+	if (*tmpl == NULL)
+		return;
+	free((*tmpl)->unit);
+	free((*tmpl)->op);
+	free((*tmpl)->run);
+	free((*tmpl)->data);
+	safe_free(*tmpl);
+}
+
+static BOOL ExtTmplGrow(void** array, uint32_t* max, uint32_t needed, size_t elem_size)
+{
+	void* new_array;
+	uint32_t new_max;
+
+	if (needed <= *max)
+		return TRUE;
+	new_max = max(needed, 2 * (*max) + 64);
+	new_array = realloc(*array, (size_t)new_max * elem_size);
+	if (new_array == NULL)
+		return FALSE;
+	*array = new_array;
+	*max = new_max;
+	return TRUE;
+}
+
+static void ExtTmplRecordOp(ext_template* tmpl, int type, uint64_t offset, uint64_t len)
+{
+	ext_tmpl_op* last = (tmpl->nb_ops == 0) ? NULL : &tmpl->op[tmpl->nb_ops - 1];
+
+	if (tmpl->failed)
+		return;
+	if ((offset % EXT_TMPL_UNIT != 0) || (len % EXT_TMPL_UNIT != 0)) {
+		tmpl->failed = TRUE;
+		return;
+	}
+	// Coalesce with the previous operation, if nothing was written in between
+	if ((last != NULL) && (last->type == type) && (last->seq == tmpl->seq) &&
+		(last->unit + last->count == offset / EXT_TMPL_UNIT)) {
+		last->count += len / EXT_TMPL_UNIT;
+		return;
+	}
+	if (!ExtTmplGrow((void**)&tmpl->op, &tmpl->max_ops, tmpl->nb_ops + 1, sizeof(ext_tmpl_op))) {
+		tmpl->failed = TRUE;
+		return;
+	}
+	tmpl->op[tmpl->nb_ops].unit = offset / EXT_TMPL_UNIT;
+	tmpl->op[tmpl->nb_ops].count = len / EXT_TMPL_UNIT;
+	tmpl->op[tmpl->nb_ops].seq = ++tmpl->seq;
+	tmpl->op[tmpl->nb_ops].type = type;
+	tmpl->nb_ops++;
+}
+
+static void ExtTmplRecordWrite(ext_template* tmpl, uint64_t offset, uint32_t len, const void* buf)
+{
+	uint32_t i, n = len / EXT_TMPL_UNIT;
+
+	if (tmpl->failed)
+		return;
+	if (IsBufferZero(buf, len)) {
+		ExtTmplRecordOp(tmpl, EXT_TMPL_OP_ZERO, offset, len);
+		return;
+	}
+	if ((offset % EXT_TMPL_UNIT != 0) || (len % EXT_TMPL_UNIT != 0) ||
+		((uint64_t)tmpl->data_units + n > EXT_TMPL_MAX_DATA / EXT_TMPL_UNIT) ||
+		!ExtTmplGrow((void**)&tmpl->unit, &tmpl->max_units, tmpl->nb_units + n, sizeof(ext_tmpl_unit)) ||
+		!ExtTmplGrow((void**)&tmpl->data, &tmpl->max_data_units, tmpl->data_units + n, EXT_TMPL_UNIT)) {
+		tmpl->failed = TRUE;
+		return;
+	}
+	tmpl->seq++;
+	memcpy(&tmpl->data[(size_t)tmpl->data_units * EXT_TMPL_UNIT], buf, len);
+	for (i = 0; i < n; i++) {
+		tmpl->unit[tmpl->nb_units].unit = offset / EXT_TMPL_UNIT + i;
+		tmpl->unit[tmpl->nb_units].seq = tmpl->seq;
+		tmpl->unit[tmpl->nb_units].offset = tmpl->data_units++;
+		tmpl->nb_units++;
+	}
+}
+
+static int ExtTmplUnitCmp(const void* a, const void* b)
+{
+	const ext_tmpl_unit* ua = (const ext_tmpl_unit*)a;
+	const ext_tmpl_unit* ub = (const ext_tmpl_unit*)b;
+
+	if (ua->unit != ub->unit)
+		return (ua->unit < ub->unit) ? -1 : 1;
+	return (ua->seq < ub->seq) ? -1 : ((ua->seq > ub->seq) ? 1 : 0);
+}
+
+/*
+ * Turn the recorded writes into runs of the last data written to each unit, leaving out
+ * the units that were zeroed or discarded afterwards (the operations get replayed first).
+ */
+static BOOL ExtTmplCompact(ext_template* tmpl)
+{
+	uint32_t i, j, k, nb_data = 0;
+	uint8_t* data = NULL;
+	ext_tmpl_unit* u;
+
+	if (tmpl->failed)
+		return FALSE;
+	qsort(tmpl->unit, tmpl->nb_units, sizeof(ext_tmpl_unit), ExtTmplUnitCmp);
+	for (i = 0, j = 0; i < tmpl->nb_units; i++) {
+		u = &tmpl->unit[i];
+		if ((i + 1 < tmpl->nb_units) && (tmpl->unit[i + 1].unit == u->unit))
+			continue;
+		for (k = 0; k < tmpl->nb_ops; k++) {
+			if ((tmpl->op[k].seq > u->seq) && (u->unit >= tmpl->op[k].unit) &&
+				(u->unit < tmpl->op[k].unit + tmpl->op[k].count))
+				break;
+		}
+		if (k < tmpl->nb_ops)
+			continue;
+		tmpl->unit[j++] = *u;
+	}
+	tmpl->nb_units = j;
+
+	tmpl->run = calloc(max(tmpl->nb_units, 1), sizeof(ext_tmpl_run));
+	data = malloc(max((size_t)tmpl->nb_units, 1) * EXT_TMPL_UNIT);
+	if ((tmpl->run == NULL) || (data == NULL)) {
+		free(data);
+		return FALSE;
+	}
+	for (i = 0; i < tmpl->nb_units; i++) {
+		u = &tmpl->unit[i];
+		if ((tmpl->nb_runs == 0) || (tmpl->run[tmpl->nb_runs - 1].unit +
+			tmpl->run[tmpl->nb_runs - 1].count != u->unit)) {
+			tmpl->run[tmpl->nb_runs].unit = u->unit;
+			tmpl->run[tmpl->nb_runs].offset = nb_data;
+			tmpl->nb_runs++;
+		}
+		tmpl->run[tmpl->nb_runs - 1].count++;
+		memcpy(&data[(size_t)nb_data++ * EXT_TMPL_UNIT], &tmpl->data[(size_t)u->offset * EXT_TMPL_UNIT], EXT_TMPL_UNIT);
+	}
+	free(tmpl->data);
+	tmpl->data = data;
+	tmpl->data_units = nb_data;
+	safe_free(tmpl->unit);
+	tmpl->nb_units = 0;
+	uprintf("Created %s template: %d operation(s), %d run(s), %s of metadata", tmpl->fs_name, tmpl->nb_ops,
+		tmpl->nb_runs, SizeToHumanReadable((uint64_t)nb_data * EXT_TMPL_UNIT, FALSE, FALSE));
+	return TRUE;
+}
+
+// Return a pointer to the template data for [unit, unit + count), if it was written as part of a single run
+static uint8_t* ExtTmplData(ext_template* tmpl, uint64_t unit, uint32_t count)
+{
+	int lo = 0, hi = (int)tmpl->nb_runs - 1, mid;
+	ext_tmpl_run* run;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		run = &tmpl->run[mid];
+		if (unit < run->unit) {
+			hi = mid - 1;
+		} else if (unit >= run->unit + run->count) {
+			lo = mid + 1;
+		} else {
+			if (unit + count > run->unit + run->count)
+				return NULL;
+			return &tmpl->data[((size_t)run->offset + (size_t)(unit - run->unit)) * EXT_TMPL_UNIT];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Record where the superblocks, group descriptors and journal superblock are, before the file
+ * system gets closed. Note that the backup group descriptors are only patched for uninit_bg.
+ */
+static void ExtTmplSetLayout(ext_template* tmpl, ext2_filsys fs)
+{
+	dgrp_t i;
+	blk64_t super_blk, old_desc_blk, new_desc_blk, jblk;
+	uint32_t units_per_block = fs->blocksize / EXT_TMPL_UNIT;
+	struct ext2_inode inode;
+
+	tmpl->sb_unit[tmpl->nb_sb++] = SUPERBLOCK_OFFSET / EXT_TMPL_UNIT;
+	for (i = 0; i < fs->group_desc_count; i++) {
+		ext2fs_super_and_bgd_loc2(fs, i, &super_blk, &old_desc_blk, &new_desc_blk, NULL);
+		if ((i != 0) && (super_blk != 0)) {
+			if (tmpl->nb_sb >= ARRAYSIZE(tmpl->sb_unit))
+				goto fail;
+			tmpl->sb_unit[tmpl->nb_sb++] = super_blk * units_per_block;
+		}
+		if (ext2fs_has_feature_gdt_csum(fs->super) && !ext2fs_has_feature_metadata_csum(fs->super)) {
+			// Only ext2 and ext3 use uninit_bg, and they don't use meta_bg either
+			if (new_desc_blk != 0)
+				goto fail;
+			if (old_desc_blk != 0) {
+				if (tmpl->nb_gdt >= ARRAYSIZE(tmpl->gdt_unit))
+					goto fail;
+				tmpl->gdt_unit[tmpl->nb_gdt++] = old_desc_blk * units_per_block;
+			}
+		}
+	}
+	tmpl->gdt_count = fs->group_desc_count;
+	tmpl->desc_size = EXT2_DESC_SIZE(fs->super);
+	if (ext2fs_has_feature_journal(fs->super) && (fs->super->s_journal_inum != 0)) {
+		if ((ext2fs_read_inode(fs, fs->super->s_journal_inum, &inode) != 0) ||
+			(ext2fs_bmap2(fs, fs->super->s_journal_inum, &inode, NULL, 0, 0, NULL, &jblk) != 0))
+			goto fail;
+		tmpl->jsb_unit = jblk * units_per_block;
+	}
+	return;
+
+fail:
+	tmpl->failed = TRUE;
+}
+
+/*
+ * Patch the UUID, hash seed, label and timestamps of the template, and update the checksums
+ */
+static BOOL ExtTmplPatch(ext_template* tmpl, LPCSTR Label)
+{
+	uint8_t uuid[16], hash_seed[16], *p;
+	uint32_t i, group, size = tmpl->desc_size * tmpl->gdt_count;
+	uint32_t now = (uint32_t)time(NULL);
+	size_t offset = offsetof(struct ext2_group_desc, bg_checksum);
+	struct ext2_super_block* sb;
+	struct ext2_group_desc* desc;
+	__u16 crc;
+
+	IGNORE_RETVAL(CoCreateGuid((GUID*)uuid));
+	IGNORE_RETVAL(CoCreateGuid((GUID*)hash_seed));
+	for (i = 0; i < tmpl->nb_sb; i++) {
+		sb = (struct ext2_super_block*)ExtTmplData(tmpl, tmpl->sb_unit[i], 1);
+		if ((sb == NULL) || (sb->s_magic != EXT2_SUPER_MAGIC))
+			return FALSE;
+		memcpy(sb->s_uuid, uuid, sizeof(sb->s_uuid));
+		memcpy(sb->s_hash_seed, hash_seed, sizeof(sb->s_hash_seed));
+		memset(sb->s_volume_name, 0, sizeof(sb->s_volume_name));
+		if (Label != NULL)
+			static_strcpy(sb->s_volume_name, Label);
+		sb->s_mkfs_time = now;
+		sb->s_wtime = now;
+		sb->s_lastcheck = now;
+		if (ext2fs_has_feature_metadata_csum(sb))
+			sb->s_checksum = ext2fs_crc32c_le(~0, (unsigned char*)sb, offsetof(struct ext2_super_block, s_checksum));
+	}
+	// See ext2fs_group_desc_csum()
+	for (i = 0; i < tmpl->nb_gdt; i++) {
+		p = ExtTmplData(tmpl, tmpl->gdt_unit[i], (size + EXT_TMPL_UNIT - 1) / EXT_TMPL_UNIT);
+		if (p == NULL)
+			return FALSE;
+		for (group = 0; group < tmpl->gdt_count; group++) {
+			desc = (struct ext2_group_desc*)&p[group * tmpl->desc_size];
+			crc = ext2fs_crc16(~0, uuid, sizeof(uuid));
+			crc = ext2fs_crc16(crc, &group, sizeof(group));
+			crc = ext2fs_crc16(crc, desc, (unsigned int)offset);
+			if (offset + sizeof(desc->bg_checksum) < tmpl->desc_size)
+				crc = ext2fs_crc16(crc, (char*)desc + offset + sizeof(desc->bg_checksum),
+					(unsigned int)(tmpl->desc_size - offset - sizeof(desc->bg_checksum)));
+			desc->bg_checksum = crc;
+		}
+	}
+	if (tmpl->jsb_unit != 0) {
+		p = ExtTmplData(tmpl, tmpl->jsb_unit, 1);
+		if (p == NULL)
+			return FALSE;
+		memcpy(&p[JBD2_SB_UUID_OFFSET], uuid, sizeof(uuid));
+	}
+	return TRUE;
+}
+
+/*
+ * Stamp the current template onto the volume, if it applies.
+ * Returns 1 if the volume was formatted, 0 if it needs to go through a regular format and -1 on error.
+ */
+static int ExtTmplStamp(char* volume_name, uint64_t PartitionOffset, uint64_t size, DWORD BlockSize,
+	LPCSTR FSName, LPCSTR Label, DWORD Flags)
+{
+	int ret = 0;
+	uint32_t i;
+	BOOL discard_zeroes;
+	errcode_t r;
+	io_channel io = NULL;
+	ext_template* tmpl = ext_tmpl;
+
+	if ((tmpl == NULL) || (tmpl->size != size) || (tmpl->block_size != BlockSize) ||
+		(strcmp(tmpl->fs_name, FSName) != 0) || (tmpl->flags != (Flags & EXT_TMPL_FLAGS)))
+		return 0;
+	// The bad blocks would need their own allocation
+	for (i = 0; (report.extents != NULL) && (i < report.num_extents); i++) {
+		if (((report.extents[i].start + report.extents[i].count) * BADBLOCK_BLOCK_SIZE > PartitionOffset) &&
+			(report.extents[i].start * BADBLOCK_BLOCK_SIZE < PartitionOffset + size * BlockSize))
+			return 0;
+	}
+
+	r = nt_io_manager->open(volume_name, IO_FLAG_RW | IO_FLAG_EXCLUSIVE, &io);
+	if (r == 0)
+		r = io_channel_set_blksize(io, EXT_TMPL_UNIT);
+	if (r != 0)
+		goto out;
+	for (i = 0; i < tmpl->nb_ops; i++) {
+		if (tmpl->op[i].type == EXT_TMPL_OP_DISCARD) {
+			r = io_channel_discard(io, tmpl->op[i].unit, tmpl->op[i].count);
+			discard_zeroes = ((r == 0) && io_channel_discard_zeroes_data(io)) ? TRUE : FALSE;
+			// The template was created with or without zeroing the inode tables accordingly
+			if (discard_zeroes != tmpl->discard_zeroes) {
+				uprintf("Discard behaviour differs from %s template's - Not using it", FSName);
+				r = 0;
+				goto out;
+			}
+		} else {
+			ret = -1;
+			r = io_channel_zeroout(io, tmpl->op[i].unit, tmpl->op[i].count);
+			if (r != 0)
+				goto out;
+		}
+	}
+	ret = -1;
+	if (!ExtTmplPatch(tmpl, Label)) {
+		r = EXT2_ET_CORRUPT_SUPERBLOCK;
+		goto out;
+	}
+	for (i = 0; i < tmpl->nb_runs; i++) {
+		r = io_channel_write_blk64(io, tmpl->run[i].unit, (int)tmpl->run[i].count,
+			&tmpl->data[(size_t)tmpl->run[i].offset * EXT_TMPL_UNIT]);
+		if (r != 0)
+			goto out;
+	}
+	r = io_channel_flush(io);
+	if (r == 0)
+		ret = 1;
+
+out:
+	if (io != NULL)
+		io_channel_close(io);
+	if (ret == 1) {
+		uprintf("Formatted partition at offset %llu as %s, from template", PartitionOffset, FSName);
+	} else if (r != 0) {
+		uprintf("Could not apply %s template: %s", FSName, error_message(r));
+		// Nothing was written, so we can still try a regular format
+		if (ret == 0)
+			return 0;
+		SET_EXT2_FORMAT_ERROR(ERROR_WRITE_FAULT);
+	}
+	return ret;
+}
+
+/*
+ * I/O manager that records the writes issued to the nt_io channel it wraps
+ */
+static errcode_t tmpl_open(const char *name, int flags, io_channel *channel);
+static errcode_t tmpl_close(io_channel channel);
+static errcode_t tmpl_set_blksize(io_channel channel, int blksize);
+static errcode_t tmpl_read_blk64(io_channel channel, unsigned long long block, int count, void *data);
+static errcode_t tmpl_read_blk(io_channel channel, unsigned long block, int count, void *data);
+static errcode_t tmpl_write_blk64(io_channel channel, unsigned long long block, int count, const void *data);
+static errcode_t tmpl_write_blk(io_channel channel, unsigned long block, int count, const void *data);
+static errcode_t tmpl_flush(io_channel channel);
+static errcode_t tmpl_set_option(io_channel channel, const char *option, const char *arg);
+static errcode_t tmpl_discard(io_channel channel, unsigned long long block, unsigned long long count);
+static errcode_t tmpl_zeroout(io_channel channel, unsigned long long block, unsigned long long count);
+
+static struct struct_io_manager struct_tmpl_manager = {
+	.magic		= EXT2_ET_MAGIC_IO_MANAGER,
+	.name		= "Template I/O Manager",
+	.open		= tmpl_open,
+	.close		= tmpl_close,
+	.set_blksize	= tmpl_set_blksize,
+	.read_blk	= tmpl_read_blk,
+	.read_blk64	= tmpl_read_blk64,
+	.write_blk	= tmpl_write_blk,
+	.write_blk64	= tmpl_write_blk64,
+	.flush		= tmpl_flush,
+	.set_option	= tmpl_set_option,
+	.discard	= tmpl_discard,
+	.zeroout	= tmpl_zeroout
+};
+
+static io_manager tmpl_io_manager = &struct_tmpl_manager;
+
+static __inline tmpl_private_data* tmpl_data(io_channel channel)
+{
+	return (tmpl_private_data*)channel->private_data;
+}
+
+static errcode_t tmpl_open(const char *name, int flags, io_channel *channel)
+{
+	io_channel io = NULL;
+	tmpl_private_data* data = NULL;
+	errcode_t errcode = ENOMEM;
+
+	if (ext_tmpl_rec == NULL)
+		return EXT2_ET_INVALID_ARGUMENT;
+	io = (io_channel)calloc(1, sizeof(struct struct_io_channel));
+	data = (tmpl_private_data*)calloc(1, sizeof(tmpl_private_data));
+	if ((io == NULL) || (data == NULL))
+		goto out;
+	io->name = _strdup(name);
+	if (io->name == NULL)
+		goto out;
+	errcode = nt_io_manager->open(name, flags, &data->real);
+	if (errcode)
+		goto out;
+	io->magic = EXT2_ET_MAGIC_IO_CHANNEL;
+	io->manager = tmpl_io_manager;
+	io->block_size = data->real->block_size;
+	io->flags = data->real->flags;
+	io->refcount = 1;
+	io->private_data = data;
+	data->tmpl = ext_tmpl_rec;
+	*channel = io;
+	return 0;
+
+out:
+	if (io != NULL)
+		free(io->name);
+	free(io);
+	free(data);
+	return errcode;
+}
+
+static errcode_t tmpl_close(io_channel channel)
+{
+	errcode_t errcode;
+
+	if (--channel->refcount > 0)
+		return 0;
+	errcode = io_channel_close(tmpl_data(channel)->real);
+	free(channel->private_data);
+	free(channel->name);
+	free(channel);
+	return errcode;
+}
+
+static errcode_t tmpl_set_blksize(io_channel channel, int blksize)
+{
+	errcode_t errcode = io_channel_set_blksize(tmpl_data(channel)->real, blksize);
+
+	if (errcode == 0)
+		channel->block_size = blksize;
+	return errcode;
+}
+
+static errcode_t tmpl_read_blk64(io_channel channel, unsigned long long block, int count, void *buf)
+{
+	return io_channel_read_blk64(tmpl_data(channel)->real, block, count, buf);
+}
+
+static errcode_t tmpl_read_blk(io_channel channel, unsigned long block, int count, void *buf)
+{
+	return tmpl_read_blk64(channel, block, count, buf);
+}
+
+static errcode_t tmpl_write_blk64(io_channel channel, unsigned long long block, int count, const void *buf)
+{
+	errcode_t errcode = io_channel_write_blk64(tmpl_data(channel)->real, block, count, buf);
+
+	if (errcode == 0)
+		ExtTmplRecordWrite(tmpl_data(channel)->tmpl, block * channel->block_size,
+			(count < 0) ? (uint32_t)(-count) : (uint32_t)count * channel->block_size, buf);
+	return errcode;
+}
+
+static errcode_t tmpl_write_blk(io_channel channel, unsigned long block, int count, const void *buf)
+{
+	return tmpl_write_blk64(channel, block, count, buf);
+}
+
+static errcode_t tmpl_flush(io_channel channel)
+{
+	return io_channel_flush(tmpl_data(channel)->real);
+}
+
+static errcode_t tmpl_set_option(io_channel channel, const char *option, const char *arg)
+{
+	io_channel real = tmpl_data(channel)->real;
+
+	return real->manager->set_option(real, option, arg);
+}
+
+static errcode_t tmpl_discard(io_channel channel, unsigned long long block, unsigned long long count)
+{
+	errcode_t errcode = io_channel_discard(tmpl_data(channel)->real, block, count);
+
+	if (errcode == 0)
+		ExtTmplRecordOp(tmpl_data(channel)->tmpl, EXT_TMPL_OP_DISCARD, block * channel->block_size,
+			count * channel->block_size);
+	return errcode;
+}
+
+static errcode_t tmpl_zeroout(io_channel channel, unsigned long long block, unsigned long long count)
+{
+	errcode_t errcode = io_channel_zeroout(tmpl_data(channel)->real, block, count);
+
+	if (errcode == 0)
+		ExtTmplRecordOp(tmpl_data(channel)->tmpl, EXT_TMPL_OP_ZERO, block * channel->block_size,
+			count * channel->block_size);
+	return errcode;
+}
+
+// Format the volume, which is freed on exit, as ext2/3/4
+static BOOL FormatExtVolume(char* volume_name, uint64_t PartitionOffset, DWORD BlockSize, LPCSTR FSName, LPCSTR Label, DWORD Flags)
 {
 	// Mostly taken from mke2fs.conf
 	const float reserve_ratio = 0.05f;
@@ -236,41 +932,17 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 		{ 1024 * TB, 4096, 256, 4}	// "huge"
 	};
 
-	BOOL ret = FALSE;
-	char* volume_name = NULL;
-	int i, count;
+	BOOL ret = FALSE, lazy_itable_init, discard_zeroes = FALSE;
+	int i, count, run_count = 0, flexbg_size;
 	struct ext2_super_block features = { 0 };
 	io_manager manager = nt_io_manager;
 	blk_t journal_size;
-	blk64_t size = 0, cur;
+	blk64_t size = 0, cur, run_start = 0;
 	ext2_filsys ext2fs = NULL;
+	ext2_badblocks_list bb_list = NULL;
 	errcode_t r;
 	uint8_t* buf = NULL;
 
-#if defined(RUFUS_TEST)
-	// Create a disk image file to test
-	uint8_t zb[1024];
-	HANDLE h;
-	DWORD dwSize;
-	HCRYPTPROV hCryptProv = 0;
-	volume_name = strdup(TEST_IMG_PATH);
-	uprintf("Creating '%s'...", volume_name);
-	if (!CryptAcquireContext(&hCryptProv, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT) || !CryptGenRandom(hCryptProv, sizeof(zb), zb)) {
-		uprintf("Failed to randomize buffer - filling with constant value");
-		memset(zb, rand(), sizeof(zb));
-	}
-	CryptReleaseContext(hCryptProv, 0);
-	h = CreateFileU(volume_name, GENERIC_WRITE, FILE_SHARE_WRITE, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-	for (i = 0; i < TEST_IMG_SIZE * sizeof(zb); i++) {
-		if (!WriteFile(h, zb, sizeof(zb), &dwSize, NULL) || (dwSize != sizeof(zb))) {
-			uprintf("Write error: %s", WindowsErrorString());
-			break;
-		}
-	}
-	CloseHandle(h);
-#else
-	volume_name = GetExtPartitionName(DriveIndex, PartitionOffset);
-#endif
 	if ((volume_name == NULL) | (strlen(FSName) != 4) || (strncmp(FSName, "ext", 3) != 0)) {
 		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_INVALID_PARAMETER;
 		goto out;
@@ -278,16 +950,19 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 	if (strchr(volume_name, ' ') != NULL)
 		uprintf("Notice: Using physical device to access partition data");
 
-	if ((strcmp(FSName, FileSystemLabel[FS_EXT2]) != 0) && (strcmp(FSName, FileSystemLabel[FS_EXT3]) != 0)) {
-		if (strcmp(FSName, FileSystemLabel[FS_EXT4]) == 0)
-			uprintf("ext4 file system is not supported, defaulting to ext3");
-		else
-			uprintf("Invalid ext file system version requested, defaulting to ext3");
+	if ((strcmp(FSName, FileSystemLabel[FS_EXT2]) != 0) && (strcmp(FSName, FileSystemLabel[FS_EXT3]) != 0) &&
+		(strcmp(FSName, FileSystemLabel[FS_EXT4]) != 0)) {
+		uprintf("Invalid ext file system version requested, defaulting to ext3");
 		FSName = FileSystemLabel[FS_EXT3];
 	}
 
-	PrintInfoDebug(0, MSG_222, FSName);
-	UpdateProgressWithInfoInit(NULL, TRUE);
+	ext2_background = (Flags & FP_BACKGROUND) ? TRUE : FALSE;
+	if (ext2_background) {
+		uprintf("Formatting partition at offset %llu as %s in the background", PartitionOffset, FSName);
+	} else {
+		PrintInfoDebug(0, MSG_222, FSName);
+		UpdateProgressWithInfoInit(NULL, TRUE);
+	}
 
 	// Figure out the volume size and block size
 	r = ext2fs_get_device_size2(volume_name, KB, &size);
@@ -321,6 +996,31 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 		goto out;
 	}
 
+	// If we already created a file system with the same parameters, just stamp it onto this volume
+	if (ReadSettingBool(SETTING_ENABLE_EXT_TEMPLATE)) {
+		switch (ExtTmplStamp(volume_name, PartitionOffset, size, BlockSize, FSName, Label, Flags)) {
+		case 1:
+			if (!ext2_background)
+				UpdateProgressWithInfo(OP_FORMAT, MSG_217, 100, 100);
+			ret = TRUE;
+			goto out;
+		case -1:
+			goto out;
+		default:
+			break;
+		}
+		// Otherwise record this format, so that it can be used as the template for the next ones
+		ExtTmplFree(&ext_tmpl_rec);
+		ext_tmpl_rec = calloc(1, sizeof(ext_template));
+		if (ext_tmpl_rec != NULL) {
+			ext_tmpl_rec->size = size;
+			ext_tmpl_rec->block_size = BlockSize;
+			ext_tmpl_rec->flags = Flags & EXT_TMPL_FLAGS;
+			static_strcpy(ext_tmpl_rec->fs_name, FSName);
+			manager = tmpl_io_manager;
+		}
+	}
+
 	// Set the blocks, reserved blocks and inodes
 	ext2fs_blocks_count_set(&features, size);
 	ext2fs_r_blocks_count_set(&features, (blk64_t)(reserve_ratio * size));
@@ -339,6 +1039,43 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 	ext2fs_set_feature_xattr(&features);
 	if (FSName[3] != '2')
 		ext2fs_set_feature_journal(&features);
+	// On quick format, let the kernel initialize the inode tables lazily, as mke2fs does with
+	// lazy_itable_init, which requires the group descriptors to be checksummed (uninit_bg)
+	lazy_itable_init = (Flags & FP_QUICK) ? TRUE : FALSE;
+	if (lazy_itable_init)
+		ext2fs_set_feature_gdt_csum(&features);
+	if (FSName[3] == '4') {
+		// Same base feature set as mke2fs' ext4 profile. With flex_bg, the bitmaps and inode
+		// tables of consecutive groups are packed together, so that they can be written
+		// in large contiguous runs, instead of having to seek through every single group.
+		flexbg_size = ReadSetting32(SETTING_EXT_FLEX_BG_SIZE);
+		if ((flexbg_size < 2) || (flexbg_size > EXT4_MAX_FLEXBG_SIZE) || !IS_POWER_OF_2(flexbg_size))
+			flexbg_size = EXT4_DEFAULT_FLEXBG_SIZE;
+		ext2fs_set_feature_flex_bg(&features);
+		for (features.s_log_groups_per_flex = 0; (1 << features.s_log_groups_per_flex) < flexbg_size;
+			features.s_log_groups_per_flex++);
+		ext2fs_set_feature_extents(&features);
+		ext2fs_set_feature_64bit(&features);
+		ext2fs_set_feature_huge_file(&features);
+		ext2fs_set_feature_dir_nlink(&features);
+		if (features.s_inode_size >= sizeof(struct ext2_inode_large))
+			ext2fs_set_feature_extra_isize(&features);
+		// metadata_csum supersedes uninit_bg, and must not be used alongside it
+		ext2fs_clear_feature_gdt_csum(&features);
+		ext2fs_set_feature_metadata_csum(&features);
+		uprintf("Using flex_bg with %d groups per set", flexbg_size);
+		if (size * BlockSize >= EXT4_SPARSE_SUPER2_MIN_SIZE) {
+			// Same as mke2fs' num_backup_sb = 2, with the last group clamped by ext2fs_initialize()
+			ext2fs_set_feature_sparse_super2(&features);
+			features.s_backup_bgs[0] = 1;
+			features.s_backup_bgs[1] = ~0;
+			uprintf("Using sparse_super2 (superblock backups in the second and last groups only)");
+		}
+		if (size * BlockSize >= EXT4_META_BG_MIN_SIZE) {
+			ext2fs_set_feature_meta_bg(&features);
+			uprintf("Using meta_bg");
+		}
+	}
 	features.s_default_mount_opts = EXT2_DEFM_XATTR_USER | EXT2_DEFM_ACL;
 
 	// Now that we have set our base features, initialize a virtual superblock
@@ -349,6 +1086,18 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 		goto out;
 	}
 
+	// Discard the partition first, as mke2fs does, so that flash devices start with a clean
+	// FTL state. On devices that read discarded blocks back as zeroes (which the I/O manager
+	// checks on a sample of them), it also means we don't have to zero the inode tables or
+	// the journal at all, and that even a lazy init can tell the kernel they are zeroed.
+	r = io_channel_discard(ext2fs->io, 0, ext2fs_blocks_count(ext2fs->super));
+	if (r == 0) {
+		discard_zeroes = io_channel_discard_zeroes_data(ext2fs->io) ? TRUE : FALSE;
+		uprintf("Discarded the content of the partition%s", discard_zeroes ? " (reads back as zeroes)" : "");
+	}
+	if (ext_tmpl_rec != NULL)
+		ext_tmpl_rec->discard_zeroes = discard_zeroes;
+
 	// Zero 16 blocks of data from the start of our volume
 	buf = calloc(16, ext2fs->io->block_size);
 	assert(buf != NULL);
@@ -362,6 +1111,14 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 
 	// Finish setting up the file system
 	IGNORE_RETVAL(CoCreateGuid((GUID*)ext2fs->super->s_uuid));
+	if (ext2fs_has_feature_metadata_csum(ext2fs->super)) {
+		ext2fs->super->s_checksum_type = EXT2_CRC32C_CHKSUM;
+		// Templates get a new UUID, so the metadata checksums must not be derived from it
+		if (ext_tmpl_rec != NULL) {
+			ext2fs_set_feature_csum_seed(ext2fs->super);
+			ext2fs->super->s_checksum_seed = ext2fs_crc32c_le(~0, ext2fs->super->s_uuid, sizeof(ext2fs->super->s_uuid));
+		}
+	}
 	ext2fs_init_csum_seed(ext2fs);
 	ext2fs->super->s_def_hash_version = EXT2_HASH_HALF_MD4;
 	IGNORE_RETVAL(CoCreateGuid((GUID*)ext2fs->super->s_hash_seed));
@@ -371,6 +1128,23 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 	if (Label != NULL)
 		static_strcpy(ext2fs->super->s_volume_name, Label);
 
+	// Keep the blocks that the bad blocks check flagged out of the allocation
+	r = ext2fs_get_bb_list(ext2fs, PartitionOffset, &bb_list);
+	if (r != 0) {
+		SET_EXT2_FORMAT_ERROR(ERROR_NOT_ENOUGH_MEMORY);
+		uprintf("Could not create %s bad blocks list: %s", FSName, error_message(r));
+		goto out;
+	}
+	if (bb_list != NULL) {
+		if (ext_tmpl_rec != NULL)
+			ext_tmpl_rec->failed = TRUE;
+		uprintf("Marking %d bad block(s) as used", ext2fs_u32_list_count(bb_list));
+		if (!ext2fs_handle_bad_blocks(ext2fs, bb_list)) {
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | APPERR(ERROR_BADBLOCKS_FAILURE);
+			goto out;
+		}
+	}
+
 	r = ext2fs_allocate_tables(ext2fs);
 	if (r != 0) {
 		SET_EXT2_FORMAT_ERROR(ERROR_INVALID_DATA);
@@ -385,22 +1159,46 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 
 	ext2_percent_start = 0.0f;
 	ext2_percent_share = (FSName[3] == '2') ? 1.0f : 0.5f;
-	uprintf("Creating %d inode sets: [1 marker = %0.1f set(s)]", ext2fs->group_desc_count,
-		max((float)ext2fs->group_desc_count / ext2_max_marker, 1.0f));
+	uprintf("Creating %d inode sets%s: [1 marker = %0.1f set(s)]", ext2fs->group_desc_count,
+		lazy_itable_init ? " (lazy init)" : "", max((float)ext2fs->group_desc_count / ext2_max_marker, 1.0f));
 	for (i = 0; i < (int)ext2fs->group_desc_count; i++) {
 		if (ext2fs_print_progress((int64_t)i, (int64_t)ext2fs->group_desc_count))
 			goto out;
+		// With lazy init, only the part of the inode table that is in use needs zeroing
 		cur = ext2fs_inode_table_loc(ext2fs, i);
 		count = ext2fs_div_ceil((ext2fs->super->s_inodes_per_group - ext2fs_bg_itable_unused(ext2fs, i))
 			* EXT2_INODE_SIZE(ext2fs->super), EXT2_BLOCK_SIZE(ext2fs->super));
-		r = ext2fs_zero_blocks2(ext2fs, cur, count, &cur, &count);
+		// With flex_bg, the inode tables of a set follow each other, so we coalesce them
+		if (!discard_zeroes && (count > 0)) {
+			if ((run_count != 0) && (run_start + run_count != cur)) {
+				r = ext2fs_zero_blocks2(ext2fs, run_start, run_count, &run_start, &run_count);
+				if (r != 0) {
+					SET_EXT2_FORMAT_ERROR(ERROR_WRITE_FAULT);
+					uprintf("\r\nCould not zero inode sets at position %llu (%d blocks): %s", run_start, run_count, error_message(r));
+					goto out;
+				}
+				run_count = 0;
+			}
+			if (run_count == 0)
+				run_start = cur;
+			run_count += count;
+		}
+		// Tell the kernel whether it still has to zero the rest of the table
+		if (!lazy_itable_init || discard_zeroes) {
+			ext2fs_bg_flags_set(ext2fs, i, EXT2_BG_INODE_ZEROED);
+			ext2fs_group_desc_csum_set(ext2fs, i);
+		}
+	}
+	if (run_count != 0) {
+		r = ext2fs_zero_blocks2(ext2fs, run_start, run_count, &run_start, &run_count);
 		if (r != 0) {
 			SET_EXT2_FORMAT_ERROR(ERROR_WRITE_FAULT);
-			uprintf("\r\nCould not zero inode set at position %llu (%d blocks): %s", cur, count, error_message(r));
+			uprintf("\r\nCould not zero inode sets at position %llu (%d blocks): %s", run_start, run_count, error_message(r));
 			goto out;
 		}
 	}
-	uprintfs("\r\n");
+	if (!ext2_background)
+		uprintfs("\r\n");
 
 	// Create root and lost+found dirs
 	r = ext2fs_mkdir(ext2fs, EXT2_ROOT_INO, EXT2_ROOT_INO, 0);
@@ -429,7 +1227,7 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 		goto out;
 	}
 	ext2fs_inode_alloc_stats(ext2fs, EXT2_BAD_INO, 1);
-	r = ext2fs_update_bb_inode(ext2fs, NULL);
+	r = ext2fs_update_bb_inode(ext2fs, bb_list);
 	if (r != 0) {
 		SET_EXT2_FORMAT_ERROR(ERROR_WRITE_FAULT);
 		uprintf("Could not set inode stats: %s", error_message(r));
@@ -440,12 +1238,13 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 		// Create the journal
 		ext2_percent_start = 0.5f;
 		journal_size = ext2fs_default_journal_size(ext2fs_blocks_count(ext2fs->super));
-		journal_size /= 2;	// That journal init is really killing us!
 		uprintf("Creating %d journal blocks: [1 marker = %0.1f block(s)]", journal_size,
 			max((float)journal_size / ext2_max_marker, 1.0f));
-		// Even with EXT2_MKJOURNAL_LAZYINIT, this call is absolutely dreadful in terms of speed...
-		r = ext2fs_add_journal_inode(ext2fs, journal_size, EXT2_MKJOURNAL_NO_MNT_CHECK | ((Flags & FP_QUICK) ? EXT2_MKJOURNAL_LAZYINIT : 0));
-		uprintfs("\r\n");
+		// The journal is allocated as a single contiguous range, which is zeroed in one go
+		r = ext2fs_add_journal_inode(ext2fs, journal_size, EXT2_MKJOURNAL_NO_MNT_CHECK |
+			(((Flags & FP_QUICK) || discard_zeroes) ? EXT2_MKJOURNAL_LAZYINIT : 0));
+		if (!ext2_background)
+			uprintfs("\r\n");
 		if (r != 0) {
 			SET_EXT2_FORMAT_ERROR(ERROR_WRITE_FAULT);
 			uprintf("Could not create %s journal: %s", FSName, error_message(r));
@@ -473,6 +1272,12 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 		ext2fs_new_inode(ext2fs, EXT2_ROOT_INO, 010755, 0, &inode_id);
 		ext2fs_link(ext2fs, EXT2_ROOT_INO, name, inode_id, EXT2_FT_REG_FILE);
 		ext2fs_inode_alloc_stats(ext2fs, inode_id, 1);
+		// On ext4, have the file use an extent tree rather than block maps
+		if (ext2fs_has_feature_extents(ext2fs->super)) {
+			ext2_extent_handle_t handle;
+			if (ext2fs_extent_open2(ext2fs, inode_id, &inode, &handle) == 0)
+				ext2fs_extent_free(handle);
+		}
 		ext2fs_write_new_inode(ext2fs, inode_id, &inode);
 		ext2fs_file_open(ext2fs, inode_id, EXT2_FILE_WRITE, &ext2fd);
 		if ((ext2fs_file_write(ext2fd, data, fsize, &written) != 0) || (written != fsize))
@@ -483,19 +1288,677 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 	}
 
 	// Finally we can call close() to get the file system gets created
+	if (ext_tmpl_rec != NULL)
+		ExtTmplSetLayout(ext_tmpl_rec, ext2fs);
 	r = ext2fs_close(ext2fs);
 	if (r != 0) {
 		SET_EXT2_FORMAT_ERROR(ERROR_WRITE_FAULT);
 		uprintf("Could not create %s volume: %s", FSName, error_message(r));
 		goto out;
 	}
-	UpdateProgressWithInfo(OP_FORMAT, MSG_217, 100, 100);
+	if ((ext_tmpl_rec != NULL) && ExtTmplCompact(ext_tmpl_rec)) {
+		ExtTmplFree(&ext_tmpl);
+		ext_tmpl = ext_tmpl_rec;
+		ext_tmpl_rec = NULL;
+	}
+	if (!ext2_background)
+		UpdateProgressWithInfo(OP_FORMAT, MSG_217, 100, 100);
 	uprintf("Done");
 	ret = TRUE;
 
 out:
+	ext2_background = FALSE;
+	ExtTmplFree(&ext_tmpl_rec);
 	free(volume_name);
+	if (bb_list != NULL)
+		ext2fs_badblocks_list_free(bb_list);
 	ext2fs_free(ext2fs);
 	free(buf);
 	return ret;
 }
+
+BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LPCSTR FSName, LPCSTR Label, DWORD Flags)
+{
+	char* volume_name = NULL;
+
+#if defined(RUFUS_TEST)
+	// Create a disk image file to test
+	uint8_t zb[1024];
+	HANDLE h;
+	DWORD dwSize;
+	HCRYPTPROV hCryptProv = 0;
+	int i;
+	volume_name = strdup(TEST_IMG_PATH);
+	uprintf("Creating '%s'...", volume_name);
+	if (!CryptAcquireContext(&hCryptProv, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT) || !CryptGenRandom(hCryptProv, sizeof(zb), zb)) {
+		uprintf("Failed to randomize buffer - filling with constant value");
+		memset(zb, rand(), sizeof(zb));
+	}
+	CryptReleaseContext(hCryptProv, 0);
+	h = CreateFileU(volume_name, GENERIC_WRITE, FILE_SHARE_WRITE, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	for (i = 0; i < TEST_IMG_SIZE * sizeof(zb); i++) {
+		if (!WriteFile(h, zb, sizeof(zb), &dwSize, NULL) || (dwSize != sizeof(zb))) {
+			uprintf("Write error: %s", WindowsErrorString());
+			break;
+		}
+	}
+	CloseHandle(h);
+#else
+	volume_name = GetExtPartitionName(DriveIndex, PartitionOffset);
+#endif
+	return FormatExtVolume(volume_name, PartitionOffset, BlockSize, FSName, Label, Flags);
+}
+
+// Format an image file, rather than a partition, as ext2/3/4
+BOOL FormatExtFsImage(const char* path, DWORD BlockSize, LPCSTR FSName, LPCSTR Label, DWORD Flags)
+{
+	char* volume_name;
+
+	if (path == NULL)
+		return FALSE;
+	// nt_io opens files through their NT path
+	volume_name = malloc(strlen(path) + 5);
+	if (volume_name == NULL)
+		return FALSE;
+	sprintf(volume_name, "\\??\\%s", path);
+	return FormatExtVolume(volume_name, 0, BlockSize, FSName, Label, Flags);
+}
+
+/*
+ * Creating a file with SetFileValidData() requires SeManageVolumePrivilege, which administrators
+ * have, but which is not enabled by default.
+ */
+static BOOL EnableManageVolumePrivilege(void)
+{
+	HANDLE hToken = NULL;
+	TOKEN_PRIVILEGES tp = { 1 };
+	BOOL r = FALSE;
+
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &hToken))
+		return FALSE;
+	tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+	if (LookupPrivilegeValueW(NULL, L"SeManageVolumePrivilege", &tp.Privileges[0].Luid) &&
+		AdjustTokenPrivileges(hToken, FALSE, &tp, sizeof(tp), NULL, NULL) && (GetLastError() == ERROR_SUCCESS))
+		r = TRUE;
+	CloseHandle(hToken);
+	return r;
+}
+
+/*
+ * Create an ext formatted persistence file (e.g. 'casper-rw'), for distros that can use one
+ * on their main partition instead of a persistence partition. The file is preallocated and, if
+ * we can set its valid data length, the file system doesn't zero-fill it on our behalf when we
+ * write the backup superblocks, so that only the metadata ends up being written.
+ */
+BOOL CreateExtPersistenceFile(const char* path, uint64_t size, LPCSTR FSName, LPCSTR Label, DWORD Flags)
+{
+	BOOL r = FALSE;
+	HANDLE h;
+	LARGE_INTEGER li;
+
+	if ((path == NULL) || (size < MIN_EXT_SIZE))
+		return FALSE;
+	// Keep the file aligned to the largest block size we may use
+	size &= ~(4 * KB - 1ULL);
+	uprintf("Creating %s persistence file '%s' (%s)", FSName, path, SizeToHumanReadable(size, FALSE, FALSE));
+	h = CreatePreallocatedFile(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL, (LONGLONG)size);
+	li.QuadPart = (LONGLONG)size;
+	if ((h == INVALID_HANDLE_VALUE) || !SetFilePointerEx(h, li, NULL, FILE_BEGIN) || !SetEndOfFile(h)) {
+		uprintf("Could not create persistence file: %s", WindowsErrorString());
+		if (!IS_ERROR(FormatStatus))
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | GetLastError();
+		goto out;
+	}
+	if (!EnableManageVolumePrivilege() || !SetFileValidData(h, (LONGLONG)size))
+		uprintf("Note: Could not skip the zeroing of the persistence file: %s", WindowsErrorString());
+	safe_closehandle(h);
+	r = FormatExtFsImage(path, 0, FSName, Label, Flags);
+
+out:
+	safe_closehandle(h);
+	if (!r)
+		DeleteFileU(path);
+	return r;
+}
+
+/*
+ * Populating ext file systems
+ *
+ * Copy a Windows directory tree onto an ext volume that has just been created. The files are
+ * preallocated as contiguous extents with ext2fs_fallocate(), and their content is written
+ * straight to the blocks that were allocated, in large writes. Directories are written in one
+ * go, once all of their entries are known, as an htree (dir_index) if they need more than one
+ * block, with the entries of their leaves sorted by hash.
+ */
+#define EXT_COPY_BUFFER_SIZE        (4 * MB)
+#define EXT2_DX_ROOT_OFF            24			// Same as in link.c
+
+typedef struct {
+	char* name;
+	ext2_ino_t ino;
+	int type;
+	ext2_dirhash_t hash;
+	ext2_dirhash_t minor_hash;
+} ext_dirent;
+
+typedef struct {
+	ext_dirent* entry;
+	uint32_t nb_entries;
+	uint32_t max_entries;
+} ext_dirlist;
+
+static BOOL ExtDirListAdd(ext_dirlist* list, const char* name, int name_len, ext2_ino_t ino, int type)
+{
+	ext_dirent* new_entry;
+
+	if (list->nb_entries >= list->max_entries) {
+		new_entry = realloc(list->entry, (list->max_entries + 256) * sizeof(ext_dirent));
+		if (new_entry == NULL)
+			return FALSE;
+		list->entry = new_entry;
+		list->max_entries += 256;
+	}
+	new_entry = &list->entry[list->nb_entries];
+	memset(new_entry, 0, sizeof(ext_dirent));
+	new_entry->name = malloc(name_len + 1);
+	if (new_entry->name == NULL)
+		return FALSE;
+	memcpy(new_entry->name, name, name_len);
+	new_entry->name[name_len] = 0;
+	new_entry->ino = ino;
+	new_entry->type = type;
+	list->nb_entries++;
+	return TRUE;
+}
+
+static void ExtDirListFree(ext_dirlist* list)
+{
+	uint32_t i;
+
+	for (i = 0; i < list->nb_entries; i++)
+		free(list->entry[i].name);
+	safe_free(list->entry);
+	list->nb_entries = 0;
+	list->max_entries = 0;
+}
+
+static int ExtDirListProc(ext2_ino_t dir, int entry, struct ext2_dir_entry* dirent, int offset,
+	int blocksize, char* buf, void* priv_data)
+{
+	ext_dirlist* list = (ext_dirlist*)priv_data;
+
+	if ((entry == DIRENT_DOT_FILE) || (entry == DIRENT_DOT_DOT_FILE))
+		return 0;
+	if (!ExtDirListAdd(list, dirent->name, ext2fs_dirent_name_len(dirent), dirent->inode,
+		ext2fs_dirent_file_type(dirent)))
+		return DIRENT_ABORT;
+	return 0;
+}
+
+static int ExtDirentCmp(const void* a, const void* b)
+{
+	const ext_dirent* da = (const ext_dirent*)a;
+	const ext_dirent* db = (const ext_dirent*)b;
+
+	if (da->hash != db->hash)
+		return (da->hash < db->hash) ? -1 : 1;
+	if (da->minor_hash != db->minor_hash)
+		return (da->minor_hash < db->minor_hash) ? -1 : 1;
+	return 0;
+}
+
+static __inline uint32_t ExtTime(const FILETIME* ft)
+{
+	uint64_t t = ((uint64_t)ft->dwHighDateTime << 32) | ft->dwLowDateTime;
+
+	// FILETIME is in 100 ns units since 1601.01.01
+	return (t < 116444736000000000ULL) ? 0 : (uint32_t)((t - 116444736000000000ULL) / 10000000ULL);
+}
+
+/*
+ * Lay the entries out into directory blocks, starting at offset 'used' of the first block.
+ * If 'buf' is NULL, only return the number of blocks that are needed, and, if 'first' is not
+ * NULL, the index of the first entry of each block.
+ */
+static uint32_t ExtPackDirents(ext2_filsys fs, ext_dirlist* list, uint32_t used, char* buf, uint32_t* first)
+{
+	uint32_t i, nb_blocks = 1, rec_len, csum_size = 0;
+	uint32_t block_size = fs->blocksize;
+	struct ext2_dir_entry* dirent = NULL;
+	char* block = buf;
+
+	if (ext2fs_has_feature_metadata_csum(fs->super))
+		csum_size = sizeof(struct ext2_dir_entry_tail);
+	if (first != NULL)
+		first[0] = 0;
+	for (i = 0; i < list->nb_entries; i++) {
+		rec_len = EXT2_DIR_REC_LEN(strlen(list->entry[i].name));
+		if (used + rec_len > block_size - csum_size) {
+			if ((block != NULL) && (dirent != NULL))
+				ext2fs_set_rec_len(fs, block_size - csum_size - (uint32_t)((char*)dirent - block), dirent);
+			if ((block != NULL) && (csum_size != 0))
+				ext2fs_initialize_dirent_tail(fs, EXT2_DIRENT_TAIL(block, block_size));
+			if (first != NULL)
+				first[nb_blocks] = i;
+			nb_blocks++;
+			used = 0;
+			if (block != NULL)
+				block += block_size;
+		}
+		if (block != NULL) {
+			dirent = (struct ext2_dir_entry*)&block[used];
+			dirent->inode = list->entry[i].ino;
+			ext2fs_dirent_set_name_len(dirent, (int)strlen(list->entry[i].name));
+			ext2fs_dirent_set_file_type(dirent, list->entry[i].type);
+			memcpy(dirent->name, list->entry[i].name, strlen(list->entry[i].name));
+			ext2fs_set_rec_len(fs, rec_len, dirent);
+		}
+		used += rec_len;
+	}
+	if ((block != NULL) && (dirent != NULL))
+		ext2fs_set_rec_len(fs, block_size - csum_size - (uint32_t)((char*)dirent - block), dirent);
+	if ((block != NULL) && (csum_size != 0))
+		ext2fs_initialize_dirent_tail(fs, EXT2_DIRENT_TAIL(block, block_size));
+	return nb_blocks;
+}
+
+// Set up the '.' and '..' entries at the start of the first block of a directory
+static void ExtSetDotEntries(ext2_filsys fs, char* block, ext2_ino_t ino, ext2_ino_t parent, uint32_t dotdot_len)
+{
+	struct ext2_dir_entry* dirent = (struct ext2_dir_entry*)block;
+
+	dirent->inode = ino;
+	ext2fs_dirent_set_name_len(dirent, 1);
+	ext2fs_dirent_set_file_type(dirent, EXT2_FT_DIR);
+	dirent->name[0] = '.';
+	ext2fs_set_rec_len(fs, EXT2_DIR_REC_LEN(1), dirent);
+	dirent = (struct ext2_dir_entry*)&block[EXT2_DIR_REC_LEN(1)];
+	dirent->inode = parent;
+	ext2fs_dirent_set_name_len(dirent, 2);
+	ext2fs_dirent_set_file_type(dirent, EXT2_FT_DIR);
+	dirent->name[0] = '.';
+	dirent->name[1] = '.';
+	ext2fs_set_rec_len(fs, dotdot_len, dirent);
+}
+
+/*
+ * (Re)write a directory with all of its entries, replacing whatever blocks it had
+ */
+static errcode_t ExtWriteDir(ext2_filsys fs, ext2_ino_t ino, ext2_ino_t parent, struct ext2_inode* inode,
+	ext_dirlist* list, BOOL is_new)
+{
+	const uint32_t dot_len = EXT2_DIR_REC_LEN(1) + EXT2_DIR_REC_LEN(2);
+	uint32_t i, nb_blocks, nb_leaves = 0, limit, nb_subdirs = 0, csum_size = 0, *first = NULL;
+	uint32_t block_size = fs->blocksize;
+	int hash_alg = fs->super->s_def_hash_version;
+	char* buf = NULL;
+	blk64_t pblk;
+	errcode_t r;
+	struct ext2_dx_root_info* root;
+	struct ext2_dx_countlimit* countlimit;
+	struct ext2_dx_entry* dx_entry;
+
+	if (ext2fs_has_feature_metadata_csum(fs->super))
+		csum_size = sizeof(struct ext2_dir_entry_tail);
+	for (i = 0; i < list->nb_entries; i++) {
+		if (list->entry[i].type == EXT2_FT_DIR)
+			nb_subdirs++;
+	}
+
+	nb_blocks = ExtPackDirents(fs, list, dot_len, NULL, NULL);
+	limit = (block_size - EXT2_DX_ROOT_OFF - sizeof(struct ext2_dx_root_info)) / sizeof(struct ext2_dx_entry) -
+		(csum_size ? 1 : 0);
+	if ((nb_blocks > 1) && ext2fs_has_feature_dir_index(fs->super)) {
+		if (hash_alg <= EXT2_HASH_TEA && (fs->super->s_flags & EXT2_FLAGS_UNSIGNED_HASH))
+			hash_alg += 3;
+		for (i = 0; i < list->nb_entries; i++) {
+			r = ext2fs_dirhash2(hash_alg, list->entry[i].name, (int)strlen(list->entry[i].name), fs->encoding, 0,
+				fs->super->s_hash_seed, &list->entry[i].hash, &list->entry[i].minor_hash);
+			if (r != 0)
+				return r;
+		}
+		qsort(list->entry, list->nb_entries, sizeof(ext_dirent), ExtDirentCmp);
+		nb_leaves = ExtPackDirents(fs, list, 0, NULL, NULL);
+		// We only build single level trees, which can index about 500 leaves. Larger directories stay linear.
+		if (nb_leaves > limit)
+			nb_leaves = 0;
+	}
+	if (nb_leaves != 0)
+		nb_blocks = nb_leaves + 1;
+
+	buf = calloc(nb_blocks, block_size);
+	first = calloc(nb_blocks, sizeof(uint32_t));
+	if ((buf == NULL) || (first == NULL)) {
+		r = EXT2_ET_NO_MEMORY;
+		goto out;
+	}
+	if (nb_leaves == 0) {
+		ExtSetDotEntries(fs, buf, ino, parent, (list->nb_entries == 0) ? block_size - csum_size - EXT2_DIR_REC_LEN(1) :
+			EXT2_DIR_REC_LEN(2));
+		if (list->nb_entries == 0) {
+			if (csum_size != 0)
+				ext2fs_initialize_dirent_tail(fs, EXT2_DIRENT_TAIL(buf, block_size));
+		} else {
+			ExtPackDirents(fs, list, dot_len, buf, NULL);
+		}
+	} else {
+		// The root block of the tree only has '.' and '..', with the index in the space that '..' spans
+		ExtSetDotEntries(fs, buf, ino, parent, block_size - EXT2_DIR_REC_LEN(1));
+		root = (struct ext2_dx_root_info*)&buf[EXT2_DX_ROOT_OFF];
+		root->hash_version = fs->super->s_def_hash_version;
+		root->info_length = sizeof(struct ext2_dx_root_info);
+		root->indirect_levels = 0;
+		ExtPackDirents(fs, list, 0, &buf[block_size], first);
+		dx_entry = (struct ext2_dx_entry*)&buf[EXT2_DX_ROOT_OFF + sizeof(struct ext2_dx_root_info)];
+		countlimit = (struct ext2_dx_countlimit*)dx_entry;
+		countlimit->limit = ext2fs_cpu_to_le16((__u16)limit);
+		countlimit->count = ext2fs_cpu_to_le16((__u16)nb_leaves);
+		dx_entry[0].block = ext2fs_cpu_to_le32(1);
+		for (i = 1; i < nb_leaves; i++) {
+			ext2_dirhash_t hash = list->entry[first[i]].hash;
+			// Flag the leaves that carry on with the same hash as their predecessor
+			if (list->entry[first[i] - 1].hash == hash)
+				hash |= 1;
+			dx_entry[i].hash = ext2fs_cpu_to_le32(hash);
+			dx_entry[i].block = ext2fs_cpu_to_le32(i + 1);
+		}
+	}
+
+	// Replace the blocks of the directory
+	if (!is_new) {
+		r = ext2fs_punch(fs, ino, inode, NULL, 0, ~0ULL);
+		if (r != 0)
+			goto out;
+	}
+	inode->i_flags &= ~EXT2_INDEX_FL;
+	if (nb_leaves != 0)
+		inode->i_flags |= EXT2_INDEX_FL;
+	r = ext2fs_fallocate(fs, EXT2_FALLOCATE_FORCE_INIT, ino, inode, ~0ULL, 0, nb_blocks);
+	if (r != 0)
+		goto out;
+	for (i = 0; i < nb_blocks; i++) {
+		r = ext2fs_bmap2(fs, ino, inode, NULL, 0, i, NULL, &pblk);
+		if (r != 0)
+			goto out;
+		r = ext2fs_write_dir_block4(fs, pblk, &buf[(size_t)i * block_size], 0, ino);
+		if (r != 0)
+			goto out;
+	}
+	inode->i_links_count = 2 + nb_subdirs;
+	r = ext2fs_inode_size_set(fs, inode, (uint64_t)nb_blocks * block_size);
+	if (r == 0)
+		r = ext2fs_write_inode(fs, ino, inode);
+
+out:
+	free(first);
+	free(buf);
+	return r;
+}
+
+static errcode_t ExtCopyFile(ext2_filsys fs, ext2_ino_t dir, const char* path, WIN32_FIND_DATAW* wfd,
+	uint8_t* buf, ext2_ino_t* ret)
+{
+	uint64_t size = ((uint64_t)wfd->nFileSizeHigh << 32) | wfd->nFileSizeLow;
+	blk64_t lblk, pblk, next, nb_blocks = ext2fs_div64_ceil(size, fs->blocksize);
+	uint32_t i, j, n;
+	DWORD read_size, size_read;
+	HANDLE h;
+	errcode_t r;
+	ext2_ino_t ino;
+	struct ext2_inode inode = { 0 };
+
+	h = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (h == INVALID_HANDLE_VALUE) {
+		uprintf("Could not open '%s': %s", path, WindowsErrorString());
+		return EXT2_ET_FILE_NOT_FOUND;
+	}
+	r = ext2fs_new_inode(fs, dir, LINUX_S_IFREG | 0644, NULL, &ino);
+	if (r != 0)
+		goto out;
+	ext2fs_inode_alloc_stats2(fs, ino, +1, 0);
+	inode.i_mode = LINUX_S_IFREG | 0644;
+	inode.i_links_count = 1;
+	inode.i_atime = ExtTime(&wfd->ftLastAccessTime);
+	inode.i_mtime = ExtTime(&wfd->ftLastWriteTime);
+	inode.i_ctime = inode.i_mtime;
+	if (ext2fs_has_feature_extents(fs->super))
+		inode.i_flags |= EXT4_EXTENTS_FL;
+	r = ext2fs_inode_size_set(fs, &inode, size);
+	if ((r == 0) && (nb_blocks != 0))
+		r = ext2fs_fallocate(fs, EXT2_FALLOCATE_FORCE_INIT, ino, &inode, ~0ULL, 0, nb_blocks);
+	if (r == 0)
+		r = ext2fs_write_new_inode(fs, ino, &inode);
+	if (r != 0)
+		goto out;
+
+	for (lblk = 0; lblk < nb_blocks; lblk += n) {
+		read_size = (DWORD)min(size - lblk * fs->blocksize, EXT_COPY_BUFFER_SIZE);
+		if (!ReadFile(h, buf, read_size, &size_read, NULL) || (size_read != read_size)) {
+			uprintf("Could not read '%s': %s", path, WindowsErrorString());
+			r = EXT2_ET_SHORT_READ;
+			goto out;
+		}
+		n = (uint32_t)ext2fs_div64_ceil(read_size, fs->blocksize);
+		memset(&buf[read_size], 0, (size_t)n * fs->blocksize - read_size);
+		// Write each run of contiguous blocks at once
+		for (i = 0; i < n; i = j) {
+			r = ext2fs_bmap2(fs, ino, &inode, NULL, 0, lblk + i, NULL, &pblk);
+			for (j = i + 1; (r == 0) && (j < n); j++) {
+				r = ext2fs_bmap2(fs, ino, &inode, NULL, 0, lblk + j, NULL, &next);
+				if (next != pblk + (j - i))
+					break;
+			}
+			if (r == 0)
+				r = io_channel_write_blk64(fs->io, pblk, (int)(j - i), &buf[(size_t)i * fs->blocksize]);
+			if (r != 0)
+				goto out;
+		}
+	}
+	*ret = ino;
+
+out:
+	CloseHandle(h);
+	return r;
+}
+
+/*
+ * Copy the content of a Windows directory into an ext one, which is rewritten with both
+ * its existing and new entries.
+ */
+static errcode_t ExtCopyDir(ext2_filsys fs, ext2_ino_t ino, ext2_ino_t parent, const char* path,
+	BOOL is_new, uint8_t* buf)
+{
+	WIN32_FIND_DATAW wfd;
+	HANDLE hFind = INVALID_HANDLE_VALUE;
+	ext_dirlist list = { 0 };
+	uint32_t i, nb_existing;
+	errcode_t r;
+	ext2_ino_t child;
+	struct ext2_inode inode;
+	wchar_t* wpattern;
+	char *name = NULL, *child_path = NULL;
+	size_t name_len;
+
+	r = ext2fs_read_inode(fs, ino, &inode);
+	if ((r == 0) && !is_new)
+		r = ext2fs_dir_iterate2(fs, ino, 0, NULL, ExtDirListProc, &list);
+	if (r != 0)
+		goto out;
+	nb_existing = list.nb_entries;
+
+	child_path = malloc(strlen(path) + 3);
+	if (child_path == NULL) {
+		r = EXT2_ET_NO_MEMORY;
+		goto out;
+	}
+	sprintf(child_path, "%s\\*", path);
+	wpattern = utf8_to_wchar(child_path);
+	safe_free(child_path);
+	if (wpattern == NULL) {
+		r = EXT2_ET_NO_MEMORY;
+		goto out;
+	}
+	hFind = FindFirstFileW(wpattern, &wfd);
+	free(wpattern);
+	if (hFind == INVALID_HANDLE_VALUE) {
+		uprintf("Could not access '%s': %s", path, WindowsErrorString());
+		r = EXT2_ET_FILE_NOT_FOUND;
+		goto out;
+	}
+	do {
+		if (IS_ERROR(FormatStatus)) {
+			r = EXT2_ET_CANCEL_REQUESTED;
+			goto out;
+		}
+		if ((wcscmp(wfd.cFileName, L".") == 0) || (wcscmp(wfd.cFileName, L"..") == 0) ||
+			(wfd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+			continue;
+		safe_free(name);
+		safe_free(child_path);
+		name = wchar_to_utf8(wfd.cFileName);
+		if (name == NULL) {
+			r = EXT2_ET_NO_MEMORY;
+			goto out;
+		}
+		name_len = strlen(name);
+		if (name_len > EXT2_NAME_LEN) {
+			uprintf("Skipping '%s\\%s': Name is too long", path, name);
+			continue;
+		}
+		child_path = malloc(strlen(path) + name_len + 2);
+		if (child_path == NULL) {
+			r = EXT2_ET_NO_MEMORY;
+			goto out;
+		}
+		sprintf(child_path, "%s\\%s", path, name);
+		for (i = 0; (i < nb_existing) && (strcmp(list.entry[i].name, name) != 0); i++);
+		if (i < nb_existing) {
+			// Merge with the directories that are already there. Leave existing files alone.
+			if ((list.entry[i].type == EXT2_FT_DIR) && (wfd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+				r = ExtCopyDir(fs, list.entry[i].ino, ino, child_path, FALSE, buf);
+				if (r != 0)
+					goto out;
+			} else {
+				uprintf("Skipping '%s': Already exists", child_path);
+			}
+			continue;
+		}
+		if (wfd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			struct ext2_inode dir_inode = { 0 };
+			r = ext2fs_new_inode(fs, ino, LINUX_S_IFDIR | 0755, NULL, &child);
+			if (r != 0)
+				goto out;
+			ext2fs_inode_alloc_stats2(fs, child, +1, 1);
+			dir_inode.i_mode = LINUX_S_IFDIR | 0755;
+			dir_inode.i_links_count = 2;
+			dir_inode.i_atime = ExtTime(&wfd.ftLastAccessTime);
+			dir_inode.i_mtime = ExtTime(&wfd.ftLastWriteTime);
+			dir_inode.i_ctime = dir_inode.i_mtime;
+			if (ext2fs_has_feature_extents(fs->super))
+				dir_inode.i_flags |= EXT4_EXTENTS_FL;
+			r = ext2fs_write_new_inode(fs, child, &dir_inode);
+			if (r == 0)
+				r = ExtCopyDir(fs, child, ino, child_path, TRUE, buf);
+			if (r != 0)
+				goto out;
+			if (!ExtDirListAdd(&list, name, (int)name_len, child, EXT2_FT_DIR)) {
+				r = EXT2_ET_NO_MEMORY;
+				goto out;
+			}
+		} else {
+			r = ExtCopyFile(fs, ino, child_path, &wfd, buf, &child);
+			if (r != 0)
+				goto out;
+			if (!ExtDirListAdd(&list, name, (int)name_len, child, EXT2_FT_REG_FILE)) {
+				r = EXT2_ET_NO_MEMORY;
+				goto out;
+			}
+		}
+	} while (FindNextFileW(hFind, &wfd));
+
+	// The subdirectories may have updated our inode (through its block count, for instance)
+	r = ext2fs_read_inode(fs, ino, &inode);
+	if (r == 0)
+		r = ExtWriteDir(fs, ino, parent, &inode, &list, is_new);
+
+out:
+	if (hFind != INVALID_HANDLE_VALUE)
+		FindClose(hFind);
+	free(name);
+	free(child_path);
+	ExtDirListFree(&list);
+	return r;
+}
+
+/*
+ * Copy the content of src_dir to dst_dir ('/' separated, created if needed) on an ext partition
+ */
+BOOL CopyToExtFs(DWORD DriveIndex, uint64_t PartitionOffset, const char* src_dir, const char* dst_dir)
+{
+	BOOL ret = FALSE;
+	char *volume_name, *p, *dir = NULL;
+	uint8_t* buf = NULL;
+	errcode_t r;
+	ext2_filsys ext2fs = NULL;
+	ext2_ino_t ino = EXT2_ROOT_INO, parent = EXT2_ROOT_INO, child;
+
+	volume_name = GetExtPartitionName(DriveIndex, PartitionOffset);
+	if ((volume_name == NULL) || (src_dir == NULL) || (dst_dir == NULL))
+		goto out;
+	buf = AllocIoBuffer(EXT_COPY_BUFFER_SIZE);
+	dir = strdup(dst_dir);
+	if ((buf == NULL) || (dir == NULL)) {
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+		goto out;
+	}
+	r = ext2fs_open(volume_name, EXT2_FLAG_RW | EXT2_FLAG_64BITS, 0, 0, nt_io_manager, &ext2fs);
+	if (r == 0)
+		r = ext2fs_read_bitmaps(ext2fs);
+	if (r != 0) {
+		SET_EXT2_FORMAT_ERROR(ERROR_OPEN_FAILED);
+		uprintf("Could not open ext volume: %s", error_message(r));
+		goto out;
+	}
+	uprintf("Copying '%s' to ext volume '%s'", src_dir, dst_dir);
+
+	// Look up the destination, and create the directories that are missing
+	for (p = strtok(dir, "/"); p != NULL; p = strtok(NULL, "/")) {
+		r = ext2fs_lookup(ext2fs, ino, p, (int)strlen(p), NULL, &child);
+		if (r == EXT2_ET_FILE_NOT_FOUND) {
+			r = ext2fs_mkdir(ext2fs, ino, 0, p);
+			if (r == 0)
+				r = ext2fs_lookup(ext2fs, ino, p, (int)strlen(p), NULL, &child);
+		}
+		if (r != 0) {
+			SET_EXT2_FORMAT_ERROR(ERROR_PATH_NOT_FOUND);
+			uprintf("Could not create ext directory '%s': %s", p, error_message(r));
+			goto out;
+		}
+		parent = ino;
+		ino = child;
+	}
+
+	r = ExtCopyDir(ext2fs, ino, parent, src_dir, FALSE, buf);
+	if (r != 0) {
+		SET_EXT2_FORMAT_ERROR(ERROR_WRITE_FAULT);
+		uprintf("Could not copy '%s': %s", src_dir, error_message(r));
+		goto out;
+	}
+	r = ext2fs_close(ext2fs);
+	ext2fs = NULL;
+	if (r != 0) {
+		SET_EXT2_FORMAT_ERROR(ERROR_WRITE_FAULT);
+		uprintf("Could not close ext volume: %s", error_message(r));
+		goto out;
+	}
+	ret = TRUE;
+
+out:
+	if (ext2fs != NULL)
+		ext2fs_free(ext2fs);
+	safe_free_io_buffer(buf);
+	free(dir);
+	free(volume_name);
+	return ret;
+}
@@ -42,52 +42,6 @@
 	FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|err; \
 	goto out; } while(0)
 
-/* Large FAT32 */
-#pragma pack(push, 1)
-typedef struct tagFAT_BOOTSECTOR32
-{
-	// Common fields.
-	BYTE sJmpBoot[3];
-	BYTE sOEMName[8];
-	WORD wBytsPerSec;
-	BYTE bSecPerClus;
-	WORD wRsvdSecCnt;
-	BYTE bNumFATs;
-	WORD wRootEntCnt;
-	WORD wTotSec16;           // if zero, use dTotSec32 instead
-	BYTE bMedia;
-	WORD wFATSz16;
-	WORD wSecPerTrk;
-	WORD wNumHeads;
-	DWORD dHiddSec;
-	DWORD dTotSec32;
-	// Fat 32/16 only
-	DWORD dFATSz32;
-	WORD wExtFlags;
-	WORD wFSVer;
-	DWORD dRootClus;
-	WORD wFSInfo;
-	WORD wBkBootSec;
-	BYTE Reserved[12];
-	BYTE bDrvNum;
-	BYTE Reserved1;
-	BYTE bBootSig;           // == 0x29 if next three fields are ok
-	DWORD dBS_VolID;
-	BYTE sVolLab[11];
-	BYTE sBS_FilSysType[8];
-} FAT_BOOTSECTOR32;
-
-typedef struct {
-	DWORD dLeadSig;         // 0x41615252
-	BYTE sReserved1[480];   // zeros
-	DWORD dStrucSig;        // 0x61417272
-	DWORD dFree_Count;      // 0xFFFFFFFF
-	DWORD dNxt_Free;        // 0xFFFFFFFF
-	BYTE sReserved2[12];    // zeros
-	DWORD dTrailSig;        // 0xAA550000
-} FAT_FSINFO;
-#pragma pack(pop)
-
 /*
  * 28.2  CALCULATING THE VOLUME SERIAL NUMBER
  *
@@ -107,7 +61,7 @@ typedef struct {
  * -----
  * 1d02h
  */
-static DWORD GetVolumeID(void)
+DWORD GetVolumeID(void)
 {
 	SYSTEMTIME s;
 	DWORD d;
@@ -145,6 +99,11 @@ static DWORD GetFATSizeSectors(DWORD DskSize, DWORD ReservedSecCnt, DWORD SecPer
 	return (DWORD)FatSz;
 }
 
+static void fat32_zero_progress(uint64_t done, uint64_t total)
+{
+	UpdateProgressWithInfo(OP_FORMAT, MSG_217, done, total);
+}
+
 /*
  * Large FAT32 volume formatting from fat32format by Tom Thornhill
  * http://www.ridgecrop.demon.co.uk/index.htm?fat32format.htm
@@ -166,7 +125,6 @@ BOOL FormatLargeFAT32(DWORD DriveIndex, uint64_t PartitionOffset, DWORD ClusterS
 	DWORD BackupBootSect = 6;
 	DWORD VolumeId = 0; // calculated before format
 	char* VolumeName = NULL;
-	DWORD BurstSize = 128; // Zero in blocks of 64K typically
 
 	// Calculated later
 	DWORD FatSize = 0;
@@ -181,7 +139,6 @@ BOOL FormatLargeFAT32(DWORD DriveIndex, uint64_t PartitionOffset, DWORD ClusterS
 	FAT_BOOTSECTOR32* pFAT32BootSect = NULL;
 	FAT_FSINFO* pFAT32FsInfo = NULL;
 	DWORD* pFirstSectOfFat = NULL;
-	BYTE* pZeroSect = NULL;
 	char VolId[12] = "NO NAME    ";
 
 	// Debug temp vars
@@ -306,6 +263,15 @@ BOOL FormatLargeFAT32(DWORD DriveIndex, uint64_t PartitionOffset, DWORD ClusterS
 	FatSize = GetFATSizeSectors(pFAT32BootSect->dTotSec32, pFAT32BootSect->wRsvdSecCnt,
 		pFAT32BootSect->bSecPerClus, pFAT32BootSect->bNumFATs, BytesPerSect);
 
+	// Grow the FATs, if needed, so that the cluster heap starts on an erase block (or, at the very
+	// least, on a physical sector), as clusters would otherwise straddle them on flash media.
+	if (BytesPerSect == SelectedDrive.SectorSize) {
+		DWORD AlignSects = ((piDrive.StartingOffset.QuadPart % GetPartitionAlignment()) == 0) ?
+			GetPartitionAlignment() / BytesPerSect : GetIoAlignment() / BytesPerSect;
+		for (i = 0; (i < AlignSects) && ((ReservedSectCount + NumFATs * (FatSize + i)) % AlignSects != 0); i++);
+		if (i < AlignSects)
+			FatSize += i;
+	}
 	pFAT32BootSect->dFATSz32 = FatSize;
 	pFAT32BootSect->wExtFlags = 0;
 	pFAT32BootSect->wFSVer = 0;
@@ -407,19 +373,14 @@ BOOL FormatLargeFAT32(DWORD DriveIndex, uint64_t PartitionOffset, DWORD ClusterS
 	SystemAreaSize = ReservedSectCount + (NumFATs * FatSize) + SectorsPerCluster;
 	uprintf("Clearing out %d sectors for reserved sectors, FATs and root cluster...", SystemAreaSize);
 
-	// Not the most effective, but easy on RAM
-	pZeroSect = (BYTE*)calloc(BytesPerSect, BurstSize);
-	if (!pZeroSect) {
-		die("Failed to allocate memory", ERROR_NOT_ENOUGH_MEMORY);
-	}
-
-	for (i = 0; i < (SystemAreaSize + BurstSize - 1); i += BurstSize) {
-		UpdateProgressWithInfo(OP_FORMAT, MSG_217, (uint64_t)i, (uint64_t)(SystemAreaSize + BurstSize));
+	// Use large overlapped writes, or skip the writes altogether if the device is
+	// able to guarantee that trimmed sectors read back as zeroes.
+	if (!ZeroDriveRange(hLogicalVolume, 0, (uint64_t)SystemAreaSize * BytesPerSect, ZF_ALLOW_TRIM,
+		NULL, fat32_zero_progress)) {
 		CHECK_FOR_USER_CANCEL;
-		if (write_sectors(hLogicalVolume, BytesPerSect, i, BurstSize, pZeroSect) != (BytesPerSect * BurstSize)) {
-			die("Error clearing reserved sectors", ERROR_WRITE_FAULT);
-		}
+		die("Error clearing reserved sectors", ERROR_WRITE_FAULT);
 	}
+	CHECK_FOR_USER_CANCEL;
 
 	uprintf ("Initializing reserved sectors and FATs...");
 	// Now we should write the boot sector and fsinfo twice, once at 0 and once at the backup boot sect position
@@ -465,6 +426,5 @@ out:
 	safe_free(pFAT32BootSect);
 	safe_free(pFAT32FsInfo);
 	safe_free(pFirstSectOfFat);
-	safe_free(pZeroSect);
 	return r;
 }
@@ -0,0 +1,646 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Headless (command line) operations
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * In headless mode, the operation requested on the command line runs straight from
+ * WinMain(), without creating the main dialog. The device list is populated into a
+ * message-only combobox, so that the enumeration and format code can be used as is,
+ * and progress is reported on stdout, rather than through the dialog controls.
+ *
+ * Every line that is printed on stdout is a keyword, followed by key=value pairs:
+ *   device disk=1 size=15518924800 id="USB\VID_0781&PID_5583\4C530001230911112103" name="SanDisk Ultra Fit USB Device"
+ *   progress op=format percent=42.0
+ *   checksum type=sha256 value=...
+ *   perf engine=xz name="image.img.xz" result=success input=... bytes=... time_us=... (see perf.c)
+ *   history model="USB\VID_0781&PID_5583" port="USB 3.0" location="..." runs=12 failed=1 speed_mbps=... (see history.c)
+ *   server pipe="\\.\pipe\rufus" max_jobs=4 (see server.c)
+ *   result status=success code=0x00000000
+ */
+
+#ifdef _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#include <windows.h>
+#include <windowsx.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "rufus.h"
+#include "missing.h"
+#include "resource.h"
+#include "msapi_utf8.h"
+
+#include "drive.h"
+#include "dev.h"
+
+extern StrArray DriveId, DriveName, DriveLabel, DriveHub, DriveLocation;
+extern BOOL write_as_image, zero_drive, bench_drive, verify_write, enable_write_hashes, enable_extra_hashes;
+extern char sum_str[CHECKSUM_MAX][150];
+extern int default_thread_priority;
+BOOL headless = FALSE;
+
+static const char* op_name[OP_MAX] = { "analyze", "badblocks", "zero_mbr", "partition",
+	"format", "create_fs", "fix_mbr", "file_copy", "patch", "finalize" };
+static const char* checksum_name[CHECKSUM_MAX] = { "md5", "sha1", "sha256", "sha512", "blake3" };
+static HANDLE format_thread = NULL;
+
+static BOOL WINAPI HeadlessCtrlHandler(DWORD dwCtrlType)
+{
+	if ((dwCtrlType != CTRL_C_EVENT) && (dwCtrlType != CTRL_BREAK_EVENT))
+		return FALSE;
+	CancelOperation(format_thread);
+	StopJobServer();
+	return TRUE;
+}
+
+static void PrintProgress(const char* name, float percent)
+{
+	static const char* last_name = NULL;
+	static uint64_t last_refresh = 0;
+	static float last_percent = -1.0f;
+	uint64_t current_time = GetTickCount64();
+
+	// Don't flood the output, except to report a new operation or its completion
+	if ((name == last_name) && (percent < 100.0f) && ((percent == last_percent) ||
+		(current_time < last_refresh + 10 * MAX_REFRESH)))
+		return;
+	last_name = name;
+	last_percent = percent;
+	last_refresh = current_time;
+	printf("progress op=%s percent=%0.1f\n", name, min(percent, 100.0f));
+	fflush(stdout);
+}
+
+// Called by the progress functions instead of updating the UI
+void HeadlessProgress(int op, float percent)
+{
+	if ((op >= 0) && (op < OP_MAX) && (percent >= 0.0f))
+		PrintProgress(op_name[op], percent);
+}
+
+static void PrintResult(void)
+{
+	printf("result status=%s code=0x%08X\n", IS_ERROR(FormatStatus) ? ((SCODE_CODE(FormatStatus) == ERROR_CANCELLED) ?
+		"cancelled" : "failure") : "success", (unsigned int)FormatStatus);
+	fflush(stdout);
+}
+
+static void PrintChecksums(void)
+{
+	int i;
+
+	for (i = 0; i < (enable_extra_hashes ? CHECKSUM_MAX : CHECKSUM_EXTRA_FIRST); i++)
+		printf("checksum type=%s value=%s\n", checksum_name[i], sum_str[i]);
+	fflush(stdout);
+}
+
+/*
+ * Batch checksum mode: when the image is a directory, or a list of images (one path per line,
+ * in a .txt or .lst file), the SHA-256 of each image is computed and written to a SHA256SUMS
+ * file, in the same format as sha256sum, in that directory or the one of the list. Any image
+ * that has a <name>.sha256 or a SHA256SUMS next to it is also verified against it.
+ * The images are hashed on as many threads as there are cores, except for the ones that are
+ * on a rotational drive, that are hashed one at a time so that the heads don't thrash. The ones
+ * that are no larger than HASH_FILES_MAX_SIZE are all hashed first, together, by one of these
+ * threads, through HashFiles(), which can process several of them at once.
+ */
+static StrArray batch_file;
+static uint8_t (*batch_sum)[32] = NULL;
+static BOOL *batch_hashed = NULL, *batch_small = NULL;
+static uint32_t batch_nb_small;
+static volatile LONG batch_next;
+static volatile LONG64 batch_processed;
+
+static DWORD WINAPI BatchSumThread(void* param)
+{
+	LONG i;
+
+	while (!IS_ERROR(FormatStatus) && ((i = InterlockedIncrement(&batch_next) - 1) < (LONG)batch_file.Index)) {
+		if (!batch_small[i])
+			batch_hashed[i] = HashFileAsync(CHECKSUM_SHA256, batch_file.String[i], batch_sum[i], &batch_processed);
+	}
+	ExitThread(0);
+}
+
+static DWORD WINAPI BatchSmallSumThread(void* param)
+{
+	const char** path = calloc(batch_nb_small, sizeof(char*));
+	uint8_t (*sum)[32] = calloc(batch_nb_small, sizeof(*sum));
+	BOOL* hashed = calloc(batch_nb_small, sizeof(BOOL));
+	uint32_t i, j;
+
+	if ((path != NULL) && (sum != NULL) && (hashed != NULL)) {
+		for (i = 0, j = 0; i < batch_file.Index; i++) {
+			if (batch_small[i])
+				path[j++] = batch_file.String[i];
+		}
+		HashFiles(CHECKSUM_SHA256, path, batch_nb_small, (uint8_t*)sum, hashed, &batch_processed);
+		for (i = 0, j = 0; i < batch_file.Index; i++) {
+			if (!batch_small[i])
+				continue;
+			batch_hashed[i] = hashed[j];
+			memcpy(batch_sum[i], sum[j++], sizeof(batch_sum[i]));
+		}
+	}
+	free(path);
+	free(sum);
+	free(hashed);
+	// Then help with the large ones
+	return BatchSumThread(param);
+}
+
+BOOL IsImageFileName(const char* name)
+{
+	static const char* image_ext[] = { ".iso", ".img", ".vhd", ".vhdx", ".ffu", ".usb", ".bz2", ".bzip2",
+		".gz", ".lzma", ".xz", ".Z", ".zip", ".wim", ".esd", ".vtsi", ".zst" };
+	const char* ext = strrchr(name, '.');
+	int i;
+
+	for (i = 0; (ext != NULL) && (i < ARRAYSIZE(image_ext)); i++) {
+		if (_stricmp(ext, image_ext[i]) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+// Add the images from a directory, or from a list, to batch_file
+static BOOL GetBatchFiles(const char* path, BOOL is_dir)
+{
+	char str[MAX_PATH], *name;
+	FILE* fd;
+	HANDLE hFind;
+	WIN32_FIND_DATAW wfd;
+	wchar_t* wpattern;
+
+	if (!is_dir) {
+		fd = fopenU(path, "r");
+		if (fd == NULL)
+			return FALSE;
+		while (fgets(str, sizeof(str), fd) != NULL) {
+			str[strcspn(str, "\r\n")] = 0;
+			if ((str[0] != 0) && (str[0] != '#'))
+				StrArrayAdd(&batch_file, str, TRUE);
+		}
+		fclose(fd);
+		return TRUE;
+	}
+
+	static_sprintf(str, "%s\\*", path);
+	wpattern = utf8_to_wchar(str);
+	if (wpattern == NULL)
+		return FALSE;
+	hFind = FindFirstFileW(wpattern, &wfd);
+	free(wpattern);
+	if (hFind == INVALID_HANDLE_VALUE)
+		return (GetLastError() == ERROR_FILE_NOT_FOUND);
+	do {
+		if (wfd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			continue;
+		name = wchar_to_utf8(wfd.cFileName);
+		if ((name != NULL) && IsImageFileName(name)) {
+			static_sprintf(str, "%s\\%s", path, name);
+			StrArrayAdd(&batch_file, str, TRUE);
+		}
+		free(name);
+	} while (FindNextFileW(hFind, &wfd));
+	FindClose(hFind);
+	return TRUE;
+}
+
+/*
+ * Look for the expected SHA-256 of an image in a <name>.sha256, then in a SHA256SUMS next to it.
+ * Lines are "<hash>  <name>" or "<hash> *<name>", as produced by sha256sum, though a <name>.sha256
+ * may also only contain the hash.
+ */
+static BOOL GetExpectedSum(const char* path, char* expected)
+{
+	BOOL r = FALSE, single;
+	char sums_path[MAX_PATH], line[MAX_PATH + 80], *name;
+	const char* file_name = PathFindFileNameU(path);
+	FILE* fd;
+	int i;
+
+	static_sprintf(sums_path, "%s.sha256", path);
+	single = PathFileExistsU(sums_path);
+	if (!single)
+		static_sprintf(sums_path, "%.*sSHA256SUMS", (int)(file_name - path), path);
+	fd = fopenU(sums_path, "r");
+	if (fd == NULL)
+		return FALSE;
+	while (!r && (fgets(line, sizeof(line), fd) != NULL)) {
+		line[strcspn(line, "\r\n")] = 0;
+		for (i = 0; (i < 64) && isxdigitU(line[i]); i++);
+		if ((i != 64) || ((line[64] != 0) && (line[64] != ' ') && (line[64] != '\t')))
+			continue;
+		for (name = &line[64]; (*name == ' ') || (*name == '\t') || (*name == '*'); name++);
+		if ((single && (*name == 0)) || (_stricmp(PathFindFileNameU(name), file_name) == 0)) {
+			memcpy(expected, line, 64);
+			expected[64] = 0;
+			r = TRUE;
+		}
+	}
+	fclose(fd);
+	return r;
+}
+
+static BOOL HeadlessBatchChecksum(BOOL is_dir)
+{
+	BOOL r = FALSE;
+	char sums_path[MAX_PATH], hex[65], expected[65];
+	const char* base;
+	HANDLE worker[MAXIMUM_WAIT_OBJECTS];
+	SYSTEM_INFO si;
+	FILE* fd = NULL;
+	HANDLE hFile;
+	LARGE_INTEGER li;
+	uint64_t total_size = 0;
+	uint32_t i, j, num_workers = 0, nb_failed = 0, nb_mismatched = 0, nb_verified = 0;
+
+	StrArrayCreate(&batch_file, 64);
+	if (!GetBatchFiles(image_path, is_dir)) {
+		uprintf("Could not enumerate the images from '%s': %s", image_path, WindowsErrorString());
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_OPEN_FAILED;
+		goto out;
+	}
+	if (batch_file.Index == 0) {
+		uprintf("No image found in '%s'", image_path);
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_FILE_NOT_FOUND;
+		goto out;
+	}
+	batch_sum = calloc(batch_file.Index, sizeof(*batch_sum));
+	batch_hashed = calloc(batch_file.Index, sizeof(BOOL));
+	batch_small = calloc(batch_file.Index, sizeof(BOOL));
+	if ((batch_sum == NULL) || (batch_hashed == NULL) || (batch_small == NULL)) {
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+		goto out;
+	}
+	batch_nb_small = 0;
+	for (i = 0; i < batch_file.Index; i++) {
+		hFile = CreateFileU(batch_file.String[i], 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+		if ((hFile != INVALID_HANDLE_VALUE) && GetFileSizeEx(hFile, &li)) {
+			total_size += li.QuadPart;
+			batch_small[i] = (li.QuadPart <= HASH_FILES_MAX_SIZE);
+			batch_nb_small += batch_small[i] ? 1 : 0;
+		}
+		safe_closehandle(hFile);
+	}
+
+	// Only the first image is checked for the seek penalty, as they are usually all in the same place
+	GetSystemInfo(&si);
+	num_workers = IncursSeekPenalty(batch_file.String[0]) ? 1 :
+		min(batch_file.Index, min(MAXIMUM_WAIT_OBJECTS, max(1, si.dwNumberOfProcessors)));
+	uprintf("Computing the SHA-256 of %d image(s) with %d thread(s)", batch_file.Index, num_workers);
+	batch_next = 0;
+	batch_processed = 0;
+	for (i = 0; i < num_workers; i++) {
+		worker[i] = CreateThread(NULL, 0, ((i == 0) && (batch_nb_small != 0)) ? BatchSmallSumThread : BatchSumThread,
+			NULL, 0, NULL);
+		if (worker[i] == NULL) {
+			uprintf("Unable to start checksum thread: %s", WindowsErrorString());
+			break;
+		}
+		SetThreadPriority(worker[i], default_thread_priority);
+		SetThreadClass(worker[i], THREAD_CLASS_COMPUTE, i);
+	}
+	num_workers = i;
+	if (num_workers == 0) {
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | APPERR(ERROR_CANT_START_THREAD);
+		goto out;
+	}
+	while (WaitForMultipleObjects(num_workers, worker, TRUE, MAX_REFRESH) == WAIT_TIMEOUT)
+		PrintProgress("checksum", (total_size == 0) ? 100.0f : (100.0f * batch_processed) / (1.0f * total_size));
+	for (i = 0; i < num_workers; i++)
+		CloseHandle(worker[i]);
+	CHECK_FOR_USER_CANCEL;
+	PrintProgress("checksum", 100.0f);
+
+	// Don't overwrite a SHA256SUMS that we verified against
+	base = is_dir ? NULL : PathFindFileNameU(image_path);
+	if (is_dir)
+		static_sprintf(sums_path, "%s\\SHA256SUMS", image_path);
+	else
+		static_sprintf(sums_path, "%.*sSHA256SUMS", (int)(base - image_path), image_path);
+	if (PathFileExistsU(sums_path))
+		uprintf("'%s' already exists - Not overwriting it", sums_path);
+	else if ((fd = fopenU(sums_path, "wb")) == NULL)
+		uprintf("Could not create '%s'", sums_path);
+	for (i = 0; i < batch_file.Index; i++) {
+		if (!batch_hashed[i]) {
+			printf("checksum type=sha256 file=\"%s\" status=error\n", batch_file.String[i]);
+			nb_failed++;
+			continue;
+		}
+		for (j = 0; j < 32; j++)
+			safe_sprintf(&hex[2 * j], sizeof(hex) - 2 * j, "%02x", batch_sum[i][j]);
+		expected[0] = 0;
+		if (GetExpectedSum(batch_file.String[i], expected)) {
+			nb_verified++;
+			if (_stricmp(hex, expected) != 0) {
+				uprintf("Checksum mismatch for '%s' (expected %s)", batch_file.String[i], expected);
+				nb_mismatched++;
+			}
+		}
+		printf("checksum type=sha256 value=%s file=\"%s\" status=%s\n", hex, batch_file.String[i],
+			(expected[0] == 0) ? "computed" : ((_stricmp(hex, expected) == 0) ? "match" : "mismatch"));
+		if (fd != NULL)
+			fprintf(fd, "%s  %s\n", hex, is_dir ? PathFindFileNameU(batch_file.String[i]) : batch_file.String[i]);
+	}
+	fflush(stdout);
+	uprintf("%d image(s) hashed, %d verified, %d mismatched, %d failed", batch_file.Index - nb_failed,
+		nb_verified, nb_mismatched, nb_failed);
+	if (nb_mismatched != 0)
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_CRC;
+	else if (nb_failed != 0)
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_READ_FAULT;
+	else
+		r = TRUE;
+
+out:
+	if (fd != NULL)
+		fclose(fd);
+	safe_free(batch_sum);
+	safe_free(batch_hashed);
+	safe_free(batch_small);
+	StrArrayDestroy(&batch_file);
+	return r;
+}
+
+// Compute the checksums of the image, on the same threads as the ones used during write
+static BOOL HeadlessChecksum(void)
+{
+	BOOL r = FALSE;
+	HANDLE hFile = INVALID_HANDLE_VALUE;
+	LARGE_INTEGER li;
+	uint8_t* buf = NULL;
+	uint64_t rb;
+	DWORD size, attr;
+	const char* ext;
+
+	if (image_path == NULL) {
+		uprintf("No image was provided");
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_FILE_NOT_FOUND;
+		return FALSE;
+	}
+	attr = GetFileAttributesU(image_path);
+	ext = strrchr(image_path, '.');
+	if ((attr != INVALID_FILE_ATTRIBUTES) && (attr & FILE_ATTRIBUTE_DIRECTORY))
+		return HeadlessBatchChecksum(TRUE);
+	if ((ext != NULL) && ((_stricmp(ext, ".txt") == 0) || (_stricmp(ext, ".lst") == 0)))
+		return HeadlessBatchChecksum(FALSE);
+	hFile = CreateFileU(image_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if ((hFile == INVALID_HANDLE_VALUE) || (!GetFileSizeEx(hFile, &li))) {
+		uprintf("Could not open image '%s': %s", image_path, WindowsErrorString());
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_OPEN_FAILED;
+		goto out;
+	}
+	buf = (uint8_t*)malloc(DD_BUFFER_SIZE);
+	if (buf == NULL) {
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+		goto out;
+	}
+	if (!OpenHashStream())
+		goto out;
+	for (rb = 0; ; rb += size) {
+		PrintProgress("checksum", (li.QuadPart == 0) ? 100.0f : (100.0f * rb) / (1.0f * li.QuadPart));
+		CHECK_FOR_USER_CANCEL;
+		if (!ReadFile(hFile, buf, DD_BUFFER_SIZE, &size, NULL)) {
+			uprintf("Read error: %s", WindowsErrorString());
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_READ_FAULT;
+			goto out;
+		}
+		if (size == 0)
+			break;
+		if (!WriteHashStream(buf, size))
+			goto out;
+	}
+	if (!CloseHashStream(TRUE))
+		goto out;
+	PrintProgress("checksum", 100.0f);
+	PrintChecksums();
+	r = TRUE;
+
+out:
+	CloseHashStream(FALSE);
+	safe_closehandle(hFile);
+	free(buf);
+	return r;
+}
+
+// A device must match all the selection criteria that were provided
+static BOOL MatchDevice(int index, const headless_params* params)
+{
+	const char* id = (index < (int)DriveId.Index) ? DriveId.String[index] : NULL;
+	const char* serial;
+	char vid_pid[24];
+
+	if ((params->disk >= 0) && ((DWORD)ComboBox_GetItemData(hDeviceList, index) != DRIVE_INDEX_MIN + params->disk))
+		return FALSE;
+	if ((params->vid != 0) || (params->pid != 0)) {
+		static_sprintf(vid_pid, "VID_%04X&PID_%04X", params->vid, params->pid);
+		if ((id == NULL) || (StrStrIA(id, vid_pid) == NULL))
+			return FALSE;
+	}
+	if (params->serial != NULL) {
+		// The serial is the last part of the device instance ID
+		serial = (id == NULL) ? NULL : strrchr(id, '\\');
+		if ((serial == NULL) || (safe_stricmp(&serial[1], params->serial) != 0))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Enumerate the devices once, and set each DriveIndex[] to the index of the drive that the
+ * matching selection designates, or 0 if it doesn't designate exactly one. This is for the job
+ * server, which doesn't otherwise list the devices, so the combobox is created (and destroyed)
+ * by the calling thread.
+ */
+void GetHeadlessDriveIndexes(const headless_params** params, DWORD* DriveIndex, int nb_params)
+{
+	int i, j, nb_matches;
+
+	memset(DriveIndex, 0, nb_params * sizeof(DWORD));
+	hDeviceList = CreateWindowA("COMBOBOX", NULL, CBS_DROPDOWNLIST, 0, 0, 0, 0, HWND_MESSAGE, NULL, hMainInstance, NULL);
+	if ((hDeviceList == NULL) || (!GetDevices(0))) {
+		uprintf("Could not enumerate devices");
+		goto out;
+	}
+	for (j = 0; j < nb_params; j++) {
+		for (i = 0, nb_matches = 0; i < ComboBox_GetCount(hDeviceList); i++) {
+			if (MatchDevice(i, params[j])) {
+				DriveIndex[j] = (DWORD)ComboBox_GetItemData(hDeviceList, i);
+				nb_matches++;
+			}
+		}
+		if (nb_matches != 1)
+			DriveIndex[j] = 0;
+	}
+
+out:
+	if (hDeviceList != NULL)
+		DestroyWindow(hDeviceList);
+	hDeviceList = NULL;
+}
+
+/*
+ * Run a "list", "write", "zero", "bench", "checksum", "perf", "history" or "serve" operation and report
+ * the result on stdout.
+ * Returns 0 on success, or 1 on error.
+ */
+int RunHeadless(const headless_params* params)
+{
+	int i, sel = -1, nb_matches = 0;
+	DWORD DriveIndex;
+	HANDLE hThread;
+	char fs_name[32];
+
+	headless = TRUE;
+	FormatStatus = 0;
+	SetConsoleCtrlHandler(HeadlessCtrlHandler, TRUE);
+	StrArrayCreate(&DriveId, MAX_DRIVES);
+	StrArrayCreate(&DriveName, MAX_DRIVES);
+	StrArrayCreate(&DriveLabel, MAX_DRIVES);
+	StrArrayCreate(&DriveHub, MAX_DRIVES);
+	StrArrayCreate(&DriveLocation, MAX_DRIVES);
+	// The main dialog, that we don't create, would otherwise have set the checksum kernels
+	DetectChecksumAcceleration();
+
+	if (safe_stricmp(params->op, "checksum") == 0) {
+		HeadlessChecksum();
+		goto out;
+	}
+	if (safe_stricmp(params->op, "perf") == 0) {
+		RunPerformanceBenchmark(image_path);
+		goto out;
+	}
+	if (safe_stricmp(params->op, "history") == 0) {
+		PrintDeviceHistoryReport();
+		goto out;
+	}
+	if (safe_stricmp(params->op, "serve") == 0) {
+		if (!RunJobServer() && !IS_ERROR(FormatStatus))
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_PIPE_NOT_CONNECTED;
+		goto out;
+	}
+	if ((safe_stricmp(params->op, "list") != 0) && (safe_stricmp(params->op, "write") != 0) &&
+		(safe_stricmp(params->op, "zero") != 0) && (safe_stricmp(params->op, "bench") != 0)) {
+		uprintf("Unsupported headless operation '%s'", params->op);
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_INVALID_PARAMETER;
+		goto out;
+	}
+
+	// The enumeration code expects a combobox to add the devices to
+	hDeviceList = CreateWindowA("COMBOBOX", NULL, CBS_DROPDOWNLIST, 0, 0, 0, 0, HWND_MESSAGE, NULL, hMainInstance, NULL);
+	if ((hDeviceList == NULL) || (!GetDevices(0))) {
+		uprintf("Could not enumerate devices");
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_DEVICE_NOT_AVAILABLE;
+		goto out;
+	}
+	for (i = 0; i < ComboBox_GetCount(hDeviceList); i++) {
+		DriveIndex = (DWORD)ComboBox_GetItemData(hDeviceList, i);
+		if (safe_stricmp(params->op, "list") == 0) {
+			printf("device disk=%d size=%" PRIu64 " id=\"%s\" name=\"%s\"\n", (int)(DriveIndex - DRIVE_INDEX_MIN),
+				GetDriveSize(DriveIndex), (i < (int)DriveId.Index) ? DriveId.String[i] : "",
+				(i < (int)DriveName.Index) ? DriveName.String[i] : "");
+		} else if (MatchDevice(i, params)) {
+			sel = i;
+			nb_matches++;
+		}
+	}
+	fflush(stdout);
+	if (safe_stricmp(params->op, "list") == 0)
+		goto out;
+
+	// Never pick a drive that wasn't unambiguously designated
+	if (nb_matches != 1) {
+		if (nb_matches == 0)
+			uprintf("No device matches the selection");
+		else
+			uprintf("The selection matches %d devices - Please be more specific", nb_matches);
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_DEVICE_NOT_AVAILABLE;
+		goto out;
+	}
+	IGNORE_RETVAL(ComboBox_SetCurSel(hDeviceList, sel));
+	memset(&SelectedDrive, 0, sizeof(SelectedDrive));
+	SelectedDrive.DeviceNumber = (DWORD)ComboBox_GetItemData(hDeviceList, sel);
+	GetDrivePartitionData(SelectedDrive.DeviceNumber, fs_name, sizeof(fs_name), TRUE);
+
+	if (safe_stricmp(params->op, "write") == 0) {
+		if (image_path == NULL) {
+			uprintf("No image was provided");
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_FILE_NOT_FOUND;
+			goto out;
+		}
+		memset(&img_report, 0, sizeof(img_report));
+		img_report.is_bootable_img = IsBootableImage(image_path);
+		if ((img_report.image_size == 0) || (!img_report.is_bootable_img) || (img_report.is_windows_img)) {
+			uprintf("'%s' is not a disk image that can be written to a drive", image_path);
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_BAD_FORMAT;
+			goto out;
+		}
+		if (max(img_report.image_size, img_report.projected_size) > SelectedDrive.DiskSize) {
+			uprintf("The image is too large for the selected drive");
+			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_FILE_TOO_LARGE;
+			goto out;
+		}
+		boot_type = BT_IMAGE;
+		write_as_image = TRUE;
+		zero_drive = FALSE;
+	} else {
+		// The benchmark is run instead of the zeroing, as it is as destructive
+		boot_type = BT_NON_BOOTABLE;
+		write_as_image = FALSE;
+		zero_drive = TRUE;
+		bench_drive = (safe_stricmp(params->op, "bench") == 0);
+	}
+
+	uprintf("Headless %s of disk %d started", params->op, (int)(SelectedDrive.DeviceNumber - DRIVE_INDEX_MIN));
+	WaitForVdsCheck();
+	WaitForLGP();
+	hThread = CreateThread(NULL, 0, FormatThread, (LPVOID)(uintptr_t)SelectedDrive.DeviceNumber, 0, NULL);
+	if (hThread == NULL) {
+		uprintf("Unable to start formatting thread");
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | APPERR(ERROR_CANT_START_THREAD);
+		goto out;
+	}
+	SetThreadPriority(hThread, default_thread_priority);
+	format_thread = hThread;
+	WaitForSingleObject(hThread, INFINITE);
+	format_thread = NULL;
+	CloseHandle(hThread);
+	if (!IS_ERROR(FormatStatus) && write_as_image && enable_write_hashes)
+		PrintChecksums();
+
+out:
+	PrintResult();
+	if (hDeviceList != NULL)
+		DestroyWindow(hDeviceList);
+	hDeviceList = NULL;
+	StrArrayDestroy(&DriveId);
+	StrArrayDestroy(&DriveName);
+	StrArrayDestroy(&DriveLabel);
+	StrArrayDestroy(&DriveHub);
+	StrArrayDestroy(&DriveLocation);
+	SetConsoleCtrlHandler(HeadlessCtrlHandler, FALSE);
+	return IS_ERROR(FormatStatus) ? 1 : 0;
+}
@@ -0,0 +1,358 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Per device operation history
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Every operation that is traced (see trace.c) appends a line to HISTORY_FILE, in our app data
+ * directory, with the model and serial of the drive (i.e. its device instance ID, with and
+ * without its last part), the speed and location of the port it was plugged into, the image,
+ * and the time and bytes of each phase. This is what lets us:
+ * - predict how long a write will take, from what the same model achieved on the same type of
+ *   port, before we have enough measurements of our own to compute an ETA,
+ * - report the runs, failures and speed of each model and hub port ('-H history'), to spot a
+ *   slow batch of drives or a bad port on a duplicator hub.
+ * The history is a CSV file, so that it can be imported as is, and the file is renamed to .old
+ * once it grows past HISTORY_MAX_SIZE.
+ */
+
+#ifdef _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#include <windows.h>
+#include <windowsx.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "rufus.h"
+#include "missing.h"
+#include "msapi_utf8.h"
+
+#define HISTORY_FILE                "device_history.csv"
+#define HISTORY_MAX_SIZE            (4 * MB)
+#define HISTORY_NB_FIELDS           13
+#define HISTORY_SPEED_RUNS          8		// Successful runs that a speed prediction is based on
+#define HISTORY_MAX_GROUPS          128		// Model and port combinations in a report
+
+enum history_field {
+	HF_DATE = 0,
+	HF_OPERATION,
+	HF_STATUS,
+	HF_ERROR,
+	HF_MODEL,
+	HF_SERIAL,
+	HF_PORT,
+	HF_LOCATION,
+	HF_IMAGE,
+	HF_BYTES,
+	HF_DURATION,
+	HF_SPEED,
+	HF_PHASES,
+};
+
+static const char* history_header = "date,operation,status,error,model,serial,port,location,image,"
+	"bytes,duration_ms,speed_mbps,phases\n";
+
+typedef struct {
+	char model[MAX_PATH];
+	char port[16];
+	char location[MAX_PATH + 16];
+	uint32_t runs, failed;
+	uint64_t bytes, duration_ms;
+} history_group;
+
+extern StrArray DriveId, DriveLocation;
+extern const char* DriveSpeedName[MAX_DRIVES];
+
+// The identity of the drive of the current operation
+static struct {
+	BOOL valid;
+	char model[MAX_PATH];
+	char serial[MAX_PATH];
+	char port[16];
+	char location[MAX_PATH + 16];
+} history_device = { FALSE };
+
+static BOOL GetHistoryPath(char* path, size_t size)
+{
+	if (app_data_dir[0] == 0)
+		return FALSE;
+	safe_sprintf(path, size, "%s\\%s", app_data_dir, FILES_DIR);
+	IGNORE_RETVAL(_mkdirExU(path));
+	safe_sprintf(path, size, "%s\\%s\\%s", app_data_dir, FILES_DIR, HISTORY_FILE);
+	return TRUE;
+}
+
+// Read the whole history into a NUL terminated buffer, or return NULL if there is none
+static char* ReadHistory(void)
+{
+	char path[MAX_PATH], *buf = NULL;
+	long size;
+	FILE* fd;
+
+	if (!GetHistoryPath(path, sizeof(path)))
+		return NULL;
+	fd = fopenU(path, "rb");
+	if (fd == NULL)
+		return NULL;
+	fseek(fd, 0L, SEEK_END);
+	size = ftell(fd);
+	fseek(fd, 0L, SEEK_SET);
+	if ((size > 0) && (size <= 2 * HISTORY_MAX_SIZE))
+		buf = (char*)malloc((size_t)size + 1);
+	if ((buf != NULL) && (fread(buf, 1, (size_t)size, fd) != (size_t)size))
+		safe_free(buf);
+	if (buf != NULL)
+		buf[size] = 0;
+	fclose(fd);
+	return buf;
+}
+
+/*
+ * Split the line that starts at *p into its fields, in place, and move *p to the next line.
+ * Returns FALSE for lines that don't have the expected number of fields, such as the header.
+ */
+static BOOL ParseHistoryLine(char** p, char* field[HISTORY_NB_FIELDS])
+{
+	char *s = *p, *d;
+	int n = 0;
+
+	while (TRUE) {
+		if (n < HISTORY_NB_FIELDS)
+			field[n] = s;
+		n++;
+		if (*s == '"') {
+			// Quoted field, where a double quote is escaped as ""
+			for (d = s++; (*s != 0) && ((*s != '"') || (s[1] == '"')); s++, d++) {
+				if (*s == '"')
+					s++;
+				*d = *s;
+			}
+			if (*s == '"')
+				s++;
+			*d = 0;
+			// Anything between the closing quote and the separator is dropped
+			while ((*s != 0) && (*s != ',') && (*s != '\r') && (*s != '\n'))
+				s++;
+		} else {
+			while ((*s != 0) && (*s != ',') && (*s != '\r') && (*s != '\n'))
+				s++;
+		}
+		if (*s != ',')
+			break;
+		*s++ = 0;
+	}
+	while ((*s == '\r') || (*s == '\n'))
+		*s++ = 0;
+	*p = s;
+	return (n == HISTORY_NB_FIELDS) && (field[HF_DATE][0] >= '0') && (field[HF_DATE][0] <= '9');
+}
+
+static void WriteHistoryField(FILE* fd, const char* str, char sep)
+{
+	fputc('"', fd);
+	for (; (str != NULL) && (*str != 0); str++) {
+		if (*str == '"')
+			fputc('"', fd);
+		// Don't let a stray line break split the record
+		fputc(((*str == '\r') || (*str == '\n')) ? ' ' : *str, fd);
+	}
+	fputc('"', fd);
+	fputc(sep, fd);
+}
+
+// Get the bytes and duration of a phase, from a "name=ms/bytes;name=ms/bytes..." list
+static BOOL GetHistoryPhase(const char* phases, const char* name, uint64_t* duration_ms, uint64_t* bytes)
+{
+	size_t len = strlen(name);
+	const char* p;
+
+	for (p = phases; (p = strstr(p, name)) != NULL; p += len) {
+		if (((p == phases) || (p[-1] == ';')) && (p[len] == '='))
+			return (sscanf(&p[len + 1], "%" SCNu64 "/%" SCNu64, duration_ms, bytes) == 2);
+	}
+	return FALSE;
+}
+
+/*
+ * Record the identity of the drive at DriveIndex, for the operation that is starting.
+ * This must be done at the start, since the device list can be refreshed afterwards.
+ */
+void SelectDeviceHistory(DWORD DriveIndex)
+{
+	int i;
+	const char *id = NULL, *p;
+
+	history_device.valid = FALSE;
+	for (i = 0; i < ComboBox_GetCount(hDeviceList); i++) {
+		if ((DWORD)ComboBox_GetItemData(hDeviceList, i) == DriveIndex) {
+			id = (i < (int)DriveId.Index) ? DriveId.String[i] : NULL;
+			break;
+		}
+	}
+	if (id == NULL)
+		return;
+	// As with the tuned I/O parameters, the model is the device instance ID without its serial
+	p = strrchr(id, '\\');
+	if (p == NULL)
+		p = &id[strlen(id)];
+	safe_strcpy(history_device.model, sizeof(history_device.model), id);
+	history_device.model[min((size_t)(p - id), sizeof(history_device.model) - 1)] = 0;
+	safe_strcpy(history_device.serial, sizeof(history_device.serial), (*p == '\\') ? &p[1] : "");
+	static_strcpy(history_device.port, (DriveSpeedName[i] != NULL) ? DriveSpeedName[i] : "");
+	static_strcpy(history_device.location, (i < (int)DriveLocation.Index) ? DriveLocation.String[i] : "");
+	history_device.valid = TRUE;
+}
+
+/*
+ * Append the results of an operation to the history of the drive that was selected with
+ * SelectDeviceHistory(). phases is a "name=ms/bytes;..." list of the phases of the operation.
+ */
+void AddDeviceHistory(const char* job, DWORD status, uint64_t bytes, uint64_t duration_us, const char* phases)
+{
+	char path[MAX_PATH], old_path[MAX_PATH], str[32];
+	const char* result;
+	SYSTEMTIME lt;
+	FILE* fd;
+
+	if (!history_device.valid || !GetHistoryPath(path, sizeof(path)))
+		return;
+	history_device.valid = FALSE;
+	fd = fopenU(path, "ab");
+	if (fd == NULL)
+		return;
+	fseek(fd, 0L, SEEK_END);
+	if (ftell(fd) > HISTORY_MAX_SIZE) {
+		fclose(fd);
+		static_sprintf(old_path, "%s.old", path);
+		MoveFileExU(path, old_path, MOVEFILE_REPLACE_EXISTING);
+		fd = fopenU(path, "ab");
+		if (fd == NULL)
+			return;
+	}
+	if (ftell(fd) == 0)
+		fputs(history_header, fd);
+
+	if (!IS_ERROR(status))
+		result = "success";
+	else if (SCODE_CODE(status) == ERROR_CANCELLED)
+		result = "cancelled";
+	else
+		result = "failed";
+	GetLocalTime(&lt);
+	fprintf(fd, "%04d-%02d-%02d %02d:%02d:%02d,%s,%s,0x%08X,", lt.wYear, lt.wMonth, lt.wDay,
+		lt.wHour, lt.wMinute, lt.wSecond, job, result, (unsigned int)status);
+	WriteHistoryField(fd, history_device.model, ',');
+	WriteHistoryField(fd, history_device.serial, ',');
+	WriteHistoryField(fd, history_device.port, ',');
+	WriteHistoryField(fd, history_device.location, ',');
+	WriteHistoryField(fd, (image_path == NULL) ? NULL : PathFindFileNameU(image_path), ',');
+	static_sprintf(str, "%0.1f", (duration_us == 0) ? 0.0 : ((double)bytes / (double)MB) * 1000000.0 / (double)duration_us);
+	fprintf(fd, "%" PRIu64 ",%" PRIu64 ",%s,", bytes, duration_us / 1000, str);
+	WriteHistoryField(fd, phases, '\n');
+	fclose(fd);
+}
+
+/*
+ * Return the average speed (in bytes per second) of a phase, over the last successful runs
+ * of the same model as the drive selected with SelectDeviceHistory(), on the same type of
+ * port, or 0 if there aren't any.
+ */
+uint64_t GetDeviceHistorySpeed(const char* phase)
+{
+	char *buf, *p, *field[HISTORY_NB_FIELDS];
+	uint64_t duration_ms, bytes, speed[HISTORY_SPEED_RUNS], total = 0;
+	uint32_t i, nb_runs = 0;
+
+	if (!history_device.valid || (history_device.model[0] == 0))
+		return 0;
+	buf = ReadHistory();
+	if (buf == NULL)
+		return 0;
+	for (p = buf; *p != 0; ) {
+		if (!ParseHistoryLine(&p, field) || (strcmp(field[HF_STATUS], "success") != 0) ||
+			(_stricmp(field[HF_MODEL], history_device.model) != 0) ||
+			(strcmp(field[HF_PORT], history_device.port) != 0) ||
+			!GetHistoryPhase(field[HF_PHASES], phase, &duration_ms, &bytes) ||
+			(duration_ms < 1000) || (bytes == 0))
+			continue;
+		speed[nb_runs++ % HISTORY_SPEED_RUNS] = (bytes * 1000) / duration_ms;
+	}
+	free(buf);
+	if (nb_runs == 0)
+		return 0;
+	nb_runs = min(nb_runs, HISTORY_SPEED_RUNS);
+	for (i = 0; i < nb_runs; i++)
+		total += speed[i];
+	return total / nb_runs;
+}
+
+/*
+ * Print the number of runs, failures and average speed of each model and port location on stdout.
+ */
+void PrintDeviceHistoryReport(void)
+{
+	char *buf, *p, *field[HISTORY_NB_FIELDS];
+	uint32_t i, nb_groups = 0;
+	uint64_t duration_ms;
+	history_group* group;
+
+	group = (history_group*)calloc(HISTORY_MAX_GROUPS, sizeof(history_group));
+	buf = ReadHistory();
+	if ((group == NULL) || (buf == NULL)) {
+		uprintf("No device history");
+		goto out;
+	}
+	for (p = buf; *p != 0; ) {
+		if (!ParseHistoryLine(&p, field) || (strcmp(field[HF_STATUS], "cancelled") == 0))
+			continue;
+		for (i = 0; (i < nb_groups) && ((_stricmp(group[i].model, field[HF_MODEL]) != 0) ||
+			(strcmp(group[i].port, field[HF_PORT]) != 0) ||
+			(_stricmp(group[i].location, field[HF_LOCATION]) != 0)); i++);
+		if (i >= HISTORY_MAX_GROUPS)
+			continue;
+		if (i == nb_groups) {
+			static_strcpy(group[i].model, field[HF_MODEL]);
+			static_strcpy(group[i].port, field[HF_PORT]);
+			static_strcpy(group[i].location, field[HF_LOCATION]);
+			nb_groups++;
+		}
+		group[i].runs++;
+		if (strcmp(field[HF_STATUS], "success") != 0) {
+			group[i].failed++;
+			continue;
+		}
+		duration_ms = _strtoui64(field[HF_DURATION], NULL, 10);
+		if (duration_ms != 0) {
+			group[i].bytes += _strtoui64(field[HF_BYTES], NULL, 10);
+			group[i].duration_ms += duration_ms;
+		}
+	}
+	for (i = 0; i < nb_groups; i++)
+		printf("history model=\"%s\" port=\"%s\" location=\"%s\" runs=%d failed=%d speed_mbps=%0.1f\n",
+			group[i].model, group[i].port, group[i].location, group[i].runs, group[i].failed,
+			(group[i].duration_ms == 0) ? 0.0 : ((double)group[i].bytes / (double)MB) * 1000.0 / (double)group[i].duration_ms);
+	fflush(stdout);
+
+out:
+	free(buf);
+	free(group);
+}
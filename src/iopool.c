@@ -0,0 +1,247 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Shared I/O buffer pool
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The large buffers used for device and image I/O (write, verify, save, bad blocks, checksums,
+ * ISO extraction...) all come from this pool, rather than from _mm_malloc(), so that:
+ * - they are allocated with VirtualAlloc(), which makes them aligned to 64 KB, i.e. to any sector
+ *   size as well as to what unbuffered I/O requires,
+ * - they are pre-touched when they are first allocated, so that we don't take page faults in
+ *   the middle of the copy loops,
+ * - they are backed by large pages when the user has been granted SeLockMemoryPrivilege (which
+ *   is not the default, even for administrators), which saves on TLB misses,
+ * - buffers that are released are kept around for the next phase (e.g. the write buffers are
+ *   reused by the verification pass), up to IO_POOL_MAX_IDLE,
+ * - the total amount of memory they use is capped to a fraction of the physical RAM, so that
+ *   the queue depth of the callers gets reduced, instead of having the system start paging.
+ */
+
+#ifdef _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rufus.h"
+#include "missing.h"
+
+#define IO_POOL_MAX_ENTRIES         64
+#define IO_POOL_MAX_IDLE            (256 * MB)
+#define IO_POOL_MIN_BUDGET          (512 * MB)
+#define IO_POOL_GRANULARITY         (64 * KB)
+#define IO_POOL_PAGE_SIZE           (4 * KB)
+
+typedef struct {
+	uint8_t* ptr;
+	size_t size;
+	BOOL in_use;
+	BOOL large;
+} io_pool_entry;
+
+static struct {
+	SRWLOCK lock;
+	BOOL initialized;
+	size_t large_page_size;		// 0 if we can't use large pages
+	uint64_t budget;
+	uint64_t total;				// Bytes currently allocated, in use or idle
+	uint64_t idle;
+	uint64_t peak;
+	uint32_t nb_allocs, nb_reused;
+	io_pool_entry entry[IO_POOL_MAX_ENTRIES];
+} io_pool = { SRWLOCK_INIT };
+
+/*
+ * Large pages require SeLockMemoryPrivilege to be assigned to the user, through the
+ * "Lock pages in memory" policy. If it isn't, we silently go with regular pages.
+ */
+static size_t GetLargePageSize(void)
+{
+	HANDLE hToken = NULL;
+	TOKEN_PRIVILEGES tp = { 1 };
+	size_t size = GetLargePageMinimum();
+
+	if (size == 0)
+		return 0;
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &hToken))
+		return 0;
+	tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+	if (!LookupPrivilegeValueW(NULL, L"SeLockMemoryPrivilege", &tp.Privileges[0].Luid) ||
+		!AdjustTokenPrivileges(hToken, FALSE, &tp, sizeof(tp), NULL, NULL) ||
+		(GetLastError() != ERROR_SUCCESS))
+		size = 0;
+	CloseHandle(hToken);
+	return size;
+}
+
+static void InitIoBufferPool(void)
+{
+	MEMORYSTATUSEX ms = { sizeof(MEMORYSTATUSEX) };
+
+	io_pool.budget = IO_POOL_MIN_BUDGET;
+	if (GlobalMemoryStatusEx(&ms))
+		io_pool.budget = max(ms.ullTotalPhys / 4, IO_POOL_MIN_BUDGET);
+	io_pool.large_page_size = GetLargePageSize();
+	uprintf("I/O buffer pool: %s budget, %s pages", SizeToHumanReadable(io_pool.budget, FALSE, FALSE),
+		(io_pool.large_page_size != 0) ? "large" : "regular");
+	io_pool.initialized = TRUE;
+}
+
+// Must be called with the lock held
+static void ReleaseEntry(io_pool_entry* e)
+{
+	VirtualFree(e->ptr, 0, MEM_RELEASE);
+	io_pool.total -= e->size;
+	io_pool.idle -= e->size;
+	memset(e, 0, sizeof(io_pool_entry));
+}
+
+// Release the largest idle buffer. Must be called with the lock held.
+static BOOL ReleaseLargestIdle(void)
+{
+	int i, j = -1;
+
+	for (i = 0; i < IO_POOL_MAX_ENTRIES; i++) {
+		if ((io_pool.entry[i].ptr != NULL) && !io_pool.entry[i].in_use &&
+			((j < 0) || (io_pool.entry[i].size > io_pool.entry[j].size)))
+			j = i;
+	}
+	if (j < 0)
+		return FALSE;
+	ReleaseEntry(&io_pool.entry[j]);
+	return TRUE;
+}
+
+/*
+ * Get a buffer of at least <size> bytes, aligned to 64 KB, or NULL if the allocation would
+ * take us over the memory budget. As with _mm_malloc(), the content is not initialized.
+ */
+void* AllocIoBuffer(size_t size)
+{
+	uint8_t* ptr = NULL;
+	size_t i, alloc_size;
+	int j = -1;
+	BOOL large = FALSE;
+
+	if (size == 0)
+		return NULL;
+	AcquireSRWLockExclusive(&io_pool.lock);
+	if (!io_pool.initialized)
+		InitIoBufferPool();
+	io_pool.nb_allocs++;
+
+	// Reuse the smallest idle buffer that fits, as long as it's not more than twice what we need
+	for (i = 0; i < IO_POOL_MAX_ENTRIES; i++) {
+		io_pool_entry* e = &io_pool.entry[i];
+		if ((e->ptr != NULL) && !e->in_use && (e->size >= size) && (e->size / 2 <= size) &&
+			((j < 0) || (e->size < io_pool.entry[j].size)))
+			j = (int)i;
+	}
+	if (j >= 0) {
+		io_pool.entry[j].in_use = TRUE;
+		io_pool.idle -= io_pool.entry[j].size;
+		io_pool.nb_reused++;
+		ptr = io_pool.entry[j].ptr;
+		goto out;
+	}
+
+	alloc_size = (size + IO_POOL_GRANULARITY - 1) & ~((size_t)IO_POOL_GRANULARITY - 1);
+	if ((io_pool.large_page_size != 0) && (size >= io_pool.large_page_size)) {
+		alloc_size = (size + io_pool.large_page_size - 1) & ~(io_pool.large_page_size - 1);
+		large = TRUE;
+	}
+	// Make room for the new buffer, by dropping idle ones we can't use
+	while ((io_pool.total + alloc_size > io_pool.budget) && ReleaseLargestIdle());
+	if (io_pool.total + alloc_size > io_pool.budget)
+		goto out;
+	for (j = 0; (j < IO_POOL_MAX_ENTRIES) && (io_pool.entry[j].ptr != NULL); j++);
+	if ((j >= IO_POOL_MAX_ENTRIES) && ReleaseLargestIdle())
+		for (j = 0; (j < IO_POOL_MAX_ENTRIES) && (io_pool.entry[j].ptr != NULL); j++);
+	if (j >= IO_POOL_MAX_ENTRIES) {
+		uprintf("I/O buffer pool: Too many buffers in use");
+		goto out;
+	}
+
+	if (large) {
+		ptr = VirtualAlloc(NULL, alloc_size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+		// Physical memory may be too fragmented to provide contiguous large pages
+		if (ptr == NULL) {
+			alloc_size = (size + IO_POOL_GRANULARITY - 1) & ~((size_t)IO_POOL_GRANULARITY - 1);
+			large = FALSE;
+		}
+	}
+	if (ptr == NULL) {
+		ptr = VirtualAlloc(NULL, alloc_size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		if (ptr == NULL)
+			goto out;
+		// Large pages are always resident, but regular ones only get mapped on first access
+		for (i = 0; i < alloc_size; i += IO_POOL_PAGE_SIZE)
+			((volatile uint8_t*)ptr)[i] = 0;
+	}
+	io_pool.entry[j].ptr = ptr;
+	io_pool.entry[j].size = alloc_size;
+	io_pool.entry[j].in_use = TRUE;
+	io_pool.entry[j].large = large;
+	io_pool.total += alloc_size;
+	io_pool.peak = max(io_pool.peak, io_pool.total);
+
+out:
+	ReleaseSRWLockExclusive(&io_pool.lock);
+	return ptr;
+}
+
+/*
+ * Return a buffer to the pool. Idle buffers are only kept up to IO_POOL_MAX_IDLE.
+ */
+void FreeIoBuffer(void* buf)
+{
+	int i;
+
+	if (buf == NULL)
+		return;
+	AcquireSRWLockExclusive(&io_pool.lock);
+	for (i = 0; (i < IO_POOL_MAX_ENTRIES) && (io_pool.entry[i].ptr != buf); i++);
+	if ((i >= IO_POOL_MAX_ENTRIES) || !io_pool.entry[i].in_use) {
+		uprintf("I/O buffer pool: Attempted to free an unknown buffer %p", buf);
+	} else {
+		io_pool.entry[i].in_use = FALSE;
+		io_pool.idle += io_pool.entry[i].size;
+		while ((io_pool.idle > IO_POOL_MAX_IDLE) && ReleaseLargestIdle());
+	}
+	ReleaseSRWLockExclusive(&io_pool.lock);
+}
+
+/*
+ * Release all the idle buffers, once an operation has completed or when exiting.
+ */
+void FlushIoBufferPool(void)
+{
+	AcquireSRWLockExclusive(&io_pool.lock);
+	if (io_pool.nb_allocs != 0)
+		uprintf("I/O buffer pool: %d buffer requests (%d reused), %s peak usage", io_pool.nb_allocs,
+			io_pool.nb_reused, SizeToHumanReadable(io_pool.peak, FALSE, FALSE));
+	while (ReleaseLargestIdle());
+	io_pool.nb_allocs = 0;
+	io_pool.nb_reused = 0;
+	io_pool.peak = io_pool.total;
+	ReleaseSRWLockExclusive(&io_pool.lock);
+}
@@ -43,16 +43,32 @@
 #include <cdio/udf.h>
 
 #include "rufus.h"
+#include "file.h"
+#include "drive.h"
+#include "format.h"
 #include "libfat.h"
 #include "missing.h"
 #include "resource.h"
 #include "msapi_utf8.h"
 #include "localization.h"
+#include "winio.h"
 #include "bled/bled.h"
 
 // How often should we update the progress bar (in 2K blocks) as updating
 // the progress bar for every block will bring extraction to a crawl
 #define PROGRESS_THRESHOLD        128
+// Small files (up to extract_small_file_size) are written from a pool of threads, and the
+// amount of data that has been read from the ISO, but not yet written, is capped.
+#define ISO_EXTRACT_THREADS       4
+#define ISO_EXTRACT_MIN_THREADS   2
+#define ISO_EXTRACT_MAX_THREADS   16
+#define ISO_EXTRACT_ADAPT_FILES   64		// Files written between two adjustments of the number of writers
+#define ISO_EXTRACT_SLOW_FILE_US  10000		// Average create + close time above which we suspect an antivirus
+#define ISO_EXTRACT_MAX_FILE_SIZE (16 * MB)
+#define ISO_EXTRACT_MAX_PENDING   (64 * MB)
+// Larger files are copied in chunks of extract_buffer_size, through aligned buffers
+#define ISO_EXTRACT_MAX_BUFFER_SIZE (64 * MB)
+#define ISO_EXTRACT_ALIGNMENT     (64 * KB)
 #define FOUR_GIGABYTES            4294967296LL
 
 // Needed for UDF symbolic link testing
@@ -69,6 +85,12 @@ void cdio_destroy (CdIo_t* p_cdio) {}
 
 uint32_t GetInstallWimVersion(const char* iso);
 
+// A file (or the start of one) that a post-scan check needs, captured during the scan walk
+typedef struct {
+	uint8_t* data;
+	uint32_t size;
+} scan_probe;
+
 typedef struct {
 	BOOLEAN is_cfg;
 	BOOLEAN is_conf;
@@ -76,14 +98,18 @@ typedef struct {
 	BOOLEAN is_grub_cfg;
 	BOOLEAN is_menu_cfg;
 	BOOLEAN is_old_c32[NB_OLD_C32];
+	uint32_t name_type;			// NAME_### type of the base name, as set by check_iso_props()
+	scan_probe* probe;
+	uint32_t probe_size;
 } EXTRACT_PROPS;
 
 RUFUS_IMG_REPORT img_report;
 int64_t iso_blocking_status = -1;
 extern BOOL preserve_timestamps, enable_ntfs_compression;
+extern int extract_small_file_size, extract_buffer_size;
 extern char* archive_path;
 BOOL enable_iso = TRUE, enable_joliet = TRUE, enable_rockridge = TRUE, has_ldlinux_c32;
-#define ISO_BLOCKING(x) do {x; iso_blocking_status++; } while(0)
+#define ISO_BLOCKING(x) do {x; InterlockedIncrement64((volatile LONG64*)&iso_blocking_status); } while(0)
 static const char* psz_extract_dir;
 static const char* bootmgr_name = "bootmgr";
 static const char* bootmgr_efi_name = "bootmgr.efi";
@@ -102,6 +128,7 @@ static const char* wininst_name[] = { "install.wim", "install.esd", "install.swm
 // If the disc was mastered properly, GRUB/EFI will take care of itself
 static const char* grub_dirname = "/boot/grub/i386-pc";
 static const char* grub_cfg[] = { "grub.cfg", "loopback.cfg" };
+static const char* grub_normal_mod = "normal.mod";
 static const char* compatresources_dll = "compatresources.dll";
 static const char* menu_cfg = "menu.cfg";
 // NB: Do not alter the order of the array below without validating hardcoded indexes in check_iso_props
@@ -121,40 +148,290 @@ const char* old_c32_name[NB_OLD_C32] = OLD_C32_NAMES;
 static const int64_t old_c32_threshold[NB_OLD_C32] = OLD_C32_THRESHOLD;
 static uint8_t joliet_level = 0;
 static uint64_t total_blocks, nb_blocks;
-static BOOL scan_only = FALSE;
-static StrArray config_path, isolinux_path, modified_path;
+static BOOL scan_only = FALSE, scan_background = FALSE;
+static StrArray config_path, isolinux_path, modified_path, modified_md5;
+
+/*
+ * The files that the post-scan checks look into are small, so rather than reopening the
+ * image and looking each of them up again once the scan is done, we read them into memory
+ * while the scan walk is at them. Checks fall back to ExtractISOFile() for anything that
+ * could not be captured that way.
+ */
+#define SCAN_PROBE_MAX_SIZE       (4 * MB)
+#define SCAN_PROBE_MAX_ISOLINUX   16
+static struct {
+	scan_probe isolinux[SCAN_PROBE_MAX_ISOLINUX];	// Same order as isolinux_path
+	scan_probe txtsetup[ARRAYSIZE(pe_dirname)];
+	scan_probe wim_header;
+	scan_probe grub_normal_mod;
+	scan_probe compatresources;
+} scan_probes;
 
-// Ensure filenames do not contain invalid FAT32 or NTFS characters
+/*
+ * Ensure filenames do not contain invalid FAT32 or NTFS characters. Since pretty much all of
+ * them are fine as they are, the path itself is returned then, and we only allocate a copy
+ * when it needs to be altered. The result must be released with free_sanitized_filename().
+ */
 static __inline char* sanitize_filename(char* filename, BOOL* is_identical)
 {
-	size_t i, j;
+	size_t i, len = safe_strlen(filename);
 	char* ret = NULL;
-	char unauthorized[] = { '*', '?', '<', '>', ':', '|' };
+	const char unauthorized[] = "*?<>:|";
 
 	*is_identical = TRUE;
+	// Must start after the drive part (D:\...) so that we don't eliminate the first column
+	for (i = 2; (i < len) && (strchr(unauthorized, filename[i]) == NULL); i++);
+	if (i >= len)
+		return filename;
+
+	*is_identical = FALSE;
 	ret = safe_strdup(filename);
 	if (ret == NULL) {
 		uprintf("Could not allocate string for sanitized path");
 		return NULL;
 	}
-
-	// Must start after the drive part (D:\...) so that we don't eliminate the first column
-	for (i=2; i<safe_strlen(ret); i++) {
-		for (j=0; j<sizeof(unauthorized); j++) {
-			if (ret[i] == unauthorized[j]) {
-				ret[i] = '_';
-				*is_identical = FALSE;
-			}
-		}
+	for (; i < len; i++) {
+		if (strchr(unauthorized, ret[i]) != NULL)
+			ret[i] = '_';
 	}
 	return ret;
 }
 
+#define free_sanitized_filename(p, filename) do { if ((p) != (filename)) free(p); p = NULL; } while(0)
+
 static void log_handler (cdio_log_level_t level, const char *message)
 {
 	uprintf("libcdio: %s", message);
 }
 
+static iso_extension_mask_t get_iso_extension_mask(void)
+{
+	iso_extension_mask_t mask = ISO_EXTENSION_ALL;
+
+	// Perform our first scan with Joliet disabled (if Rock Ridge is enabled), so that we can find if
+	// there exists a Rock Ridge file with a name > 64 chars or if there are symlinks. If that is the
+	// case then we also disable Joliet during the extract phase.
+	if ((!enable_joliet) || (enable_rockridge && (scan_only || img_report.has_long_filename ||
+		(img_report.has_symlinks == SYMLINKS_RR)))) {
+		mask &= ~ISO_EXTENSION_JOLIET;
+	}
+	if (!enable_rockridge) {
+		mask &= ~ISO_EXTENSION_ROCK_RIDGE;
+	}
+	return mask;
+}
+
+static void free_scan_probes(void)
+{
+	scan_probe* probe = (scan_probe*)&scan_probes;
+	size_t i;
+
+	for (i = 0; i < sizeof(scan_probes) / sizeof(scan_probe); i++)
+		safe_free(probe[i].data);
+	memset(&scan_probes, 0, sizeof(scan_probes));
+}
+
+static __inline void set_scan_probe(EXTRACT_PROPS* props, scan_probe* probe, int64_t size)
+{
+	if ((probe->data == NULL) && (size > 0) && (size <= SCAN_PROBE_MAX_SIZE)) {
+		props->probe = probe;
+		props->probe_size = (uint32_t)size;
+	}
+}
+
+/*
+ * Read the part of a file a post-scan check needs, from either the current UDF dirent or
+ * the ISO LSN. Failure is not an error, as the check then falls back to ExtractISOFile().
+ */
+static void capture_scan_probe(EXTRACT_PROPS* props, udf_dirent_t* p_udf_dirent, iso9660_t* p_iso, lsn_t lsn)
+{
+	uint32_t nb, size;
+	int64_t read;
+	uint8_t* data;
+
+	if ((props->probe == NULL) || (props->probe->data != NULL))
+		return;
+	nb = (props->probe_size + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE;
+	// Add a byte so that text files are NUL terminated
+	data = (uint8_t*)calloc((size_t)nb * ISO_BLOCKSIZE + 1, 1);
+	if (data == NULL)
+		return;
+	if (p_udf_dirent != NULL) {
+		// udf_read_block() stops at the end of an extent, so we may need several calls
+		for (size = 0; size < props->probe_size; size += (uint32_t)read) {
+			read = udf_read_block(p_udf_dirent, &data[size], nb - size / UDF_BLOCKSIZE);
+			if (read <= 0) {
+				free(data);
+				return;
+			}
+		}
+	} else if (iso9660_iso_seek_read(p_iso, data, lsn, nb) != (long)nb * ISO_BLOCKSIZE) {
+		free(data);
+		return;
+	}
+	props->probe->data = data;
+	props->probe->size = props->probe_size;
+}
+
+/*
+ * Rather than going through a chain of string comparisons for every file of the image, on
+ * both the scan and extraction passes, the base names that the checks below look for are
+ * classified with a single lookup, in a hash table of these names that we build on first use.
+ * NB: A name must not appear in more than one of the lists, as an entry has a single index.
+ */
+enum {
+	NAME_SYSLINUX_CFG = 0x00001,
+	NAME_GRUB_CFG = 0x00002,
+	NAME_MENU_CFG = 0x00004,
+	NAME_OLD_C32 = 0x00008,
+	NAME_LDLINUX_SYS = 0x00010,
+	NAME_LDLINUX_C32 = 0x00020,
+	NAME_GRUB_NORMAL_MOD = 0x00040,
+	NAME_BOOTMGR = 0x00080,
+	NAME_BOOTMGR_EFI = 0x00100,
+	NAME_GRLDR = 0x00200,
+	NAME_KOLIBRI = 0x00400,
+	NAME_MANJARO_MARKER = 0x00800,
+	NAME_MD5SUM = 0x01000,
+	NAME_REACTOS = 0x02000,
+	NAME_EFI_BOOT = 0x04000,
+	NAME_WININST = 0x08000,
+	NAME_COMPATRESOURCES = 0x10000,
+	NAME_PE_FILE = 0x20000,
+	NAME_ISOLINUX_BIN = 0x40000,
+};
+
+#define NAME_TABLE_SIZE           128	// Must be a power of 2, and well above the number of names
+
+typedef struct {
+	const char* name;
+	uint32_t hash;
+	uint32_t type;
+	uint8_t index;
+} name_table_entry;
+
+static name_table_entry name_table[NAME_TABLE_SIZE];
+
+// FNV-1a of the lowercase version of a name
+static __inline uint32_t name_hash(const char* name)
+{
+	uint32_t hash = 2166136261U;
+
+	for (; *name != 0; name++)
+		hash = (hash ^ (uint8_t)tolower((uint8_t)*name)) * 16777619U;
+	return hash;
+}
+
+static void add_names(const char** name, size_t nb_names, uint32_t type)
+{
+	size_t i, j;
+	uint32_t hash;
+
+	for (i = 0; i < nb_names; i++) {
+		hash = name_hash(name[i]);
+		for (j = hash & (NAME_TABLE_SIZE - 1); name_table[j].name != NULL; j = (j + 1) & (NAME_TABLE_SIZE - 1)) {
+			if (_stricmp(name_table[j].name, name[i]) == 0)
+				break;
+		}
+		assert(name_table[j].name == NULL);
+		name_table[j].name = name[i];
+		name_table[j].hash = hash;
+		name_table[j].type = type;
+		name_table[j].index = (uint8_t)i;
+	}
+}
+
+static void init_name_table(void)
+{
+	static BOOL initialized = FALSE;
+
+	if (initialized)
+		return;
+	add_names(syslinux_cfg, ARRAYSIZE(syslinux_cfg), NAME_SYSLINUX_CFG);
+	add_names(grub_cfg, ARRAYSIZE(grub_cfg), NAME_GRUB_CFG);
+	add_names(&menu_cfg, 1, NAME_MENU_CFG);
+	add_names(old_c32_name, NB_OLD_C32, NAME_OLD_C32);
+	add_names(&ldlinux_name, 1, NAME_LDLINUX_SYS);
+	add_names(&ldlinux_c32, 1, NAME_LDLINUX_C32);
+	add_names(&grub_normal_mod, 1, NAME_GRUB_NORMAL_MOD);
+	add_names(&bootmgr_name, 1, NAME_BOOTMGR);
+	add_names(&bootmgr_efi_name, 1, NAME_BOOTMGR_EFI);
+	add_names(&grldr_name, 1, NAME_GRLDR);
+	add_names(&kolibri_name, 1, NAME_KOLIBRI);
+	add_names(&manjaro_marker, 1, NAME_MANJARO_MARKER);
+	add_names(md5sum_name, ARRAYSIZE(md5sum_name), NAME_MD5SUM);
+	add_names(&reactos_name, 1, NAME_REACTOS);
+	add_names(efi_bootname, ARRAYSIZE(efi_bootname), NAME_EFI_BOOT);
+	add_names(wininst_name, ARRAYSIZE(wininst_name), NAME_WININST);
+	add_names(&compatresources_dll, 1, NAME_COMPATRESOURCES);
+	add_names(pe_file, ARRAYSIZE(pe_file), NAME_PE_FILE);
+	add_names(isolinux_bin, ARRAYSIZE(isolinux_bin), NAME_ISOLINUX_BIN);
+	initialized = TRUE;
+}
+
+/*
+ * Return the NAME_### type of a base name (0 if it isn't one we look for), along with
+ * its index in the list it belongs to.
+ */
+static uint32_t classify_name(const char* psz_basename, uint8_t* index)
+{
+	size_t i;
+	uint32_t hash;
+
+	*index = 0;
+	if (psz_basename == NULL)
+		return 0;
+	hash = name_hash(psz_basename);
+	for (i = hash & (NAME_TABLE_SIZE - 1); name_table[i].name != NULL; i = (i + 1) & (NAME_TABLE_SIZE - 1)) {
+		if ((name_table[i].hash == hash) && (_stricmp(name_table[i].name, psz_basename) == 0)) {
+			*index = name_table[i].index;
+			return name_table[i].type;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Files that are read at boot time, by the firmware or by the boot loaders, and that we want
+ * to write before anything else, so that they get laid out contiguously at the start of the
+ * data area, rather than behind (or in between) thousands of small files.
+ */
+static const char* boot_payload_prefix[] = { "vmlinuz", "initrd", "initramfs", "bzimage", "boot.wim", "boot.sdi" };
+
+static BOOL is_boot_payload(const char* psz_basename, EXTRACT_PROPS *props)
+{
+	size_t i;
+
+	if (props->name_type & (NAME_BOOTMGR | NAME_BOOTMGR_EFI | NAME_EFI_BOOT | NAME_GRLDR | NAME_LDLINUX_C32 |
+		NAME_ISOLINUX_BIN | NAME_KOLIBRI | NAME_REACTOS))
+		return TRUE;
+	for (i = 0; i < ARRAYSIZE(boot_payload_prefix); i++) {
+		if (_strnicmp(psz_basename, boot_payload_prefix[i], strlen(boot_payload_prefix[i])) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+ * Write-time checks, that only depend on the name and location of a file
+ * Returns true if the file should not be extracted
+ */
+static BOOL check_write_props(const char* psz_dirname, const char* psz_basename, EXTRACT_PROPS *props)
+{
+	size_t len;
+
+	// Check for config files that may need patching
+	len = safe_strlen(psz_basename);
+	if ((len >= 4) && safe_stricmp(&psz_basename[len - 4], ".cfg") == 0) {
+		props->is_cfg = TRUE;
+		props->is_grub_cfg = ((props->name_type & NAME_GRUB_CFG) != 0);
+		props->is_menu_cfg = ((props->name_type & NAME_MENU_CFG) != 0);
+	}
+
+	// In case there's an ldlinux.sys on the ISO, prevent it from overwriting ours
+	return ((psz_dirname != NULL) && (psz_dirname[0] == 0) && (props->name_type & NAME_LDLINUX_SYS));
+}
+
 /*
  * Scan and set ISO properties
  * Returns true if the the current file does not need to be processed further
@@ -162,20 +439,25 @@ static void log_handler (cdio_log_level_t level, const char *message)
 static BOOL check_iso_props(const char* psz_dirname, int64_t file_length, const char* psz_basename,
 	const char* psz_fullpath, EXTRACT_PROPS *props)
 {
-	size_t i, j, len;
+	size_t i, len;
+	uint8_t index;
+	uint32_t name_type;
+	BOOL is_split_wim = FALSE;
 
-	// Check for an isolinux/syslinux config file anywhere
 	memset(props, 0, sizeof(EXTRACT_PROPS));
-	for (i = 0; i < ARRAYSIZE(syslinux_cfg); i++) {
-		if (safe_stricmp(psz_basename, syslinux_cfg[i]) == 0) {
-			props->is_cfg = TRUE;	// Required for "extlinux.conf"
-			props->is_syslinux_cfg = TRUE;
-			// Maintain a list of all the isolinux/syslinux config files identified so far
-			if ((scan_only) && (i < 3))
-				StrArrayAdd(&config_path, psz_fullpath, TRUE);
-			if ((scan_only) && (i == 1) && (safe_stricmp(psz_dirname, efi_dirname) == 0))
-				img_report.has_efi_syslinux = TRUE;
-		}
+	init_name_table();
+	name_type = classify_name(psz_basename, &index);
+	props->name_type = name_type;
+
+	// Check for an isolinux/syslinux config file anywhere
+	if (name_type & NAME_SYSLINUX_CFG) {
+		props->is_cfg = TRUE;	// Required for "extlinux.conf"
+		props->is_syslinux_cfg = TRUE;
+		// Maintain a list of all the isolinux/syslinux config files identified so far
+		if ((scan_only) && (index < 3))
+			StrArrayAdd(&config_path, psz_fullpath, TRUE);
+		if ((scan_only) && (index == 1) && (safe_stricmp(psz_dirname, efi_dirname) == 0))
+			img_report.has_efi_syslinux = TRUE;
 	}
 
 	// Check for archiso loader/entries/*.conf files
@@ -185,37 +467,29 @@ static BOOL check_iso_props(const char* psz_dirname, int64_t file_length, const
 	}
 
 	// Check for an old incompatible c32 file anywhere
-	for (i = 0; i < NB_OLD_C32; i++) {
-		if ((safe_stricmp(psz_basename, old_c32_name[i]) == 0) && (file_length <= old_c32_threshold[i]))
-			props->is_old_c32[i] = TRUE;
-	}
+	if ((name_type & NAME_OLD_C32) && (file_length <= old_c32_threshold[index]))
+		props->is_old_c32[index] = TRUE;
 
 	if (!scan_only) {	// Write-time checks
-		// Check for config files that may need patching
-		len = safe_strlen(psz_basename);
-		if ((len >= 4) && safe_stricmp(&psz_basename[len - 4], ".cfg") == 0) {
-			props->is_cfg = TRUE;
-			for (i = 0; i < ARRAYSIZE(grub_cfg); i++) {
-				if (safe_stricmp(psz_basename, grub_cfg[i]) == 0)
-					props->is_grub_cfg = TRUE;
-			}
-			if (safe_stricmp(psz_basename, menu_cfg) == 0) {
-				props->is_menu_cfg = TRUE;
-			}
-		}
-
-		// In case there's an ldlinux.sys on the ISO, prevent it from overwriting ours
-		if ((psz_dirname != NULL) && (psz_dirname[0] == 0) && (safe_stricmp(psz_basename, ldlinux_name) == 0)) {
+		if (check_write_props(psz_dirname, psz_basename, props)) {
 			uprintf("Skipping '%s' file from ISO image", psz_basename);
 			return TRUE;
 		}
+		// An install.wim that is too large for FAT32 is split by the format operation
+		if (IS_FAT(fs_type) && (file_length >= FOUR_GIGABYTES)) {
+			uprintf("Leaving '%s' to be split", psz_basename);
+			return TRUE;
+		}
 	} else {	// Scan-time checks
 		// Check for GRUB artifacts
-		if (safe_stricmp(psz_dirname, grub_dirname) == 0)
+		if (safe_stricmp(psz_dirname, grub_dirname) == 0) {
 			img_report.has_grub2 = TRUE;
+			if (name_type & NAME_GRUB_NORMAL_MOD)
+				set_scan_probe(props, &scan_probes.grub_normal_mod, file_length);
+		}
 
 		// Check for a syslinux v5.0+ file anywhere
-		if (safe_stricmp(psz_basename, ldlinux_c32) == 0) {
+		if (name_type & NAME_LDLINUX_C32) {
 			has_ldlinux_c32 = TRUE;
 		}
 
@@ -228,30 +502,28 @@ static BOOL check_iso_props(const char* psz_dirname, int64_t file_length, const
 
 		// Check for various files in root (psz_dirname = "")
 		if ((psz_dirname != NULL) && (psz_dirname[0] == 0)) {
-			if (safe_stricmp(psz_basename, bootmgr_name) == 0) {
+			if (name_type & NAME_BOOTMGR) {
 				img_report.has_bootmgr = TRUE;
 			}
-			if (safe_stricmp(psz_basename, bootmgr_efi_name) == 0) {
+			if (name_type & NAME_BOOTMGR_EFI) {
 				img_report.has_efi |= 1;
 				img_report.has_bootmgr_efi = TRUE;
 			}
-			if (safe_stricmp(psz_basename, grldr_name) == 0) {
+			if (name_type & NAME_GRLDR) {
 				img_report.has_grub4dos = TRUE;
 			}
-			if (safe_stricmp(psz_basename, kolibri_name) == 0) {
+			if (name_type & NAME_KOLIBRI) {
 				img_report.has_kolibrios = TRUE;
 			}
-			if (safe_stricmp(psz_basename, manjaro_marker) == 0) {
+			if (name_type & NAME_MANJARO_MARKER) {
 				img_report.disable_iso = TRUE;
 			}
-			for (i = 0; i < ARRAYSIZE(md5sum_name); i++) {
-				if (safe_stricmp(psz_basename, md5sum_name[i]) == 0)
-					img_report.has_md5sum = (uint8_t)(i + 1);
-			}
+			if (name_type & NAME_MD5SUM)
+				img_report.has_md5sum = (uint8_t)(index + 1);
 		}
 
 		// Check for ReactOS' setupldr.sys anywhere
-		if ((img_report.reactos_path[0] == 0) && (safe_stricmp(psz_basename, reactos_name) == 0))
+		if ((img_report.reactos_path[0] == 0) && (name_type & NAME_REACTOS))
 			static_strcpy(img_report.reactos_path, psz_fullpath);
 
 		// Check for the first 'efi*.img' we can find (that hopefully contains EFI boot files)
@@ -261,54 +533,65 @@ static BOOL check_iso_props(const char* psz_dirname, int64_t file_length, const
 			static_strcpy(img_report.efi_img_path, psz_fullpath);
 
 		// Check for the EFI boot entries
-		if (safe_stricmp(psz_dirname, efi_dirname) == 0) {
-			for (i = 0; i < ARRAYSIZE(efi_bootname); i++)
-				if (safe_stricmp(psz_basename, efi_bootname[i]) == 0)
-					img_report.has_efi |= (2 << i);	// start at 2 since "bootmgr.efi" is bit 0
-		}
+		if ((name_type & NAME_EFI_BOOT) && (safe_stricmp(psz_dirname, efi_dirname) == 0))
+			img_report.has_efi |= (2 << index);	// start at 2 since "bootmgr.efi" is bit 0
 
-		if (psz_dirname != NULL) {
+		if ((name_type & (NAME_WININST | NAME_COMPATRESOURCES)) && (psz_dirname != NULL)) {
 			if (safe_stricmp(&psz_dirname[max(0, ((int)safe_strlen(psz_dirname)) -
 				((int)strlen(sources_str)))], sources_str) == 0) {
 				// Check for "install.###" in "###/sources/"
-				for (i = 0; i < ARRAYSIZE(wininst_name); i++) {
-					if (safe_stricmp(psz_basename, wininst_name[i]) == 0) {
-						if (img_report.wininst_index < MAX_WININST) {
-							static_sprintf(img_report.wininst_path[img_report.wininst_index],
-								"?:%s", psz_fullpath);
-							img_report.wininst_index++;
-						}
-					}
+				if ((name_type & NAME_WININST) && (img_report.wininst_index < MAX_WININST)) {
+					// Only the first install.wim can be split into .swm parts, for FAT32
+					is_split_wim = (img_report.wininst_index == 0) && (index == 0);
+					static_sprintf(img_report.wininst_path[img_report.wininst_index],
+						"?:%s", psz_fullpath);
+					// GetInstallWimVersion() only needs the header of the first one
+					if (img_report.wininst_index == 0)
+						set_scan_probe(props, &scan_probes.wim_header, UDF_BLOCKSIZE);
+					img_report.wininst_index++;
 				}
 				// Check for "compatresources.dll" in "###/sources/"
-				if (safe_stricmp(psz_basename, compatresources_dll) == 0)
+				if (name_type & NAME_COMPATRESOURCES) {
 					img_report.has_compatresources_dll = TRUE;
+					// The version is read from the root one
+					if (safe_stricmp(psz_dirname, sources_str) == 0)
+						set_scan_probe(props, &scan_probes.compatresources, file_length);
+				}
 			}
 		}
 
 		// Check for PE (XP) specific files in "/i386", "/amd64" or "/minint"
-		for (i=0; i<ARRAYSIZE(pe_dirname); i++)
-			if (safe_stricmp(psz_dirname, pe_dirname[i]) == 0)
-				for (j=0; j<ARRAYSIZE(pe_file); j++)
-					if (safe_stricmp(psz_basename, pe_file[j]) == 0)
-						img_report.winpe |= (1<<j)<<(ARRAYSIZE(pe_dirname)*i);
-
-		for (i=0; i<ARRAYSIZE(isolinux_bin); i++) {
-			if (safe_stricmp(psz_basename, isolinux_bin[i]) == 0) {
-				// Maintain a list of all the isolinux.bin files found
-				StrArrayAdd(&isolinux_path, psz_fullpath, TRUE);
-			}
+		if (name_type & NAME_PE_FILE) {
+			for (i=0; i<ARRAYSIZE(pe_dirname); i++)
+				if (safe_stricmp(psz_dirname, pe_dirname[i]) == 0) {
+					img_report.winpe |= (1<<index)<<(ARRAYSIZE(pe_dirname)*i);
+					if (index == 2)	// txtsetup.sif
+						set_scan_probe(props, &scan_probes.txtsetup[i], file_length);
+				}
+		}
+
+		if (name_type & NAME_ISOLINUX_BIN) {
+			// Maintain a list of all the isolinux.bin files found
+			StrArrayAdd(&isolinux_path, psz_fullpath, TRUE);
+			if (isolinux_path.Index <= SCAN_PROBE_MAX_ISOLINUX)
+				set_scan_probe(props, &scan_probes.isolinux[isolinux_path.Index - 1], file_length);
 		}
 
 		for (i=0; i<NB_OLD_C32; i++) {
 			if (props->is_old_c32[i])
 				img_report.has_old_c32[i] = TRUE;
 		}
-		if (file_length >= FOUR_GIGABYTES)
+		if (file_length >= FOUR_GIGABYTES) {
 			img_report.has_4GB_file = TRUE;
+			if (!is_split_wim)
+				img_report.has_4GB_other_file = TRUE;
+		}
 		// Compute projected size needed (NB: ISO_BLOCKSIZE = UDF_BLOCKSIZE)
 		if (file_length != 0)
 			total_blocks += (file_length + (ISO_BLOCKSIZE - 1)) / ISO_BLOCKSIZE;
+		// As well as the number of clusters the file takes, for the cluster size advisor
+		for (i = 0; i < ISO_CLUSTER_STATS; i++)
+			img_report.nb_clusters[i] += (file_length + (512ULL << i) - 1) / (512ULL << i);
 		return TRUE;
 	}
 	return FALSE;
@@ -319,7 +602,9 @@ static void fix_config(const char* psz_fullpath, const char* psz_path, const cha
 {
 	BOOL modified = FALSE;
 	size_t i, nul_pos;
-	char *iso_label = NULL, *usb_label = NULL, *src, *dst;
+	char *iso_label = NULL, *usb_label = NULL, *src, *dst, md5_str[33];
+	uint8_t md5[16];
+	config_file* cfg;
 
 	nul_pos = safe_strlen(psz_fullpath);
 	src = safe_strdup(psz_fullpath);
@@ -328,21 +613,28 @@ static void fix_config(const char* psz_fullpath, const char* psz_path, const cha
 	for (i=0; i<nul_pos; i++)
 		if (src[i] == '/') src[i] = '\\';
 
+	// Apply all the patches to an in-memory copy, so that the file is only rewritten once
+	cfg = open_config_file(src);
+	if (cfg == NULL) {
+		free(src);
+		return;
+	}
+
 	// Add persistence to the kernel options
 	if ((boot_type == BT_IMAGE) && HAS_PERSISTENCE(img_report) && persistence_size) {
 		if ((props->is_grub_cfg) || (props->is_menu_cfg) || (props->is_syslinux_cfg)) {
-			if (replace_in_token_data(src, props->is_grub_cfg ? "linux" : "append",
-				"file=/cdrom/preseed", "persistent file=/cdrom/preseed", TRUE) != NULL) {
+			if (replace_in_config_data(cfg, props->is_grub_cfg ? "linux" : "append",
+				"file=/cdrom/preseed", "persistent file=/cdrom/preseed") != NULL) {
 				// Ubuntu & derivatives are assumed to use 'file=/cdrom/preseed/...'
 				// somewhere in their kernel options and use 'persistent' as keyword.
 				uprintf("  Added 'persistent' kernel option");
 				modified = TRUE;
 				// Also remove Ubuntu's "maybe-ubiquity" to avoid splash screen (GRUB only)
-				if ((props->is_grub_cfg) && replace_in_token_data(src, "linux",
-					"maybe-ubiquity", "", TRUE))
+				if ((props->is_grub_cfg) && replace_in_config_data(cfg, "linux",
+					"maybe-ubiquity", ""))
 					uprintf("  Removed 'maybe-ubiquity' kernel option");
-			} else if (replace_in_token_data(src, props->is_grub_cfg ? "linux" : "append",
-				"boot=live", "boot=live persistence", TRUE) != NULL) {
+			} else if (replace_in_config_data(cfg, props->is_grub_cfg ? "linux" : "append",
+				"boot=live", "boot=live persistence") != NULL) {
 				// Debian & derivatives are assumed to use 'boot=live' in
 				// their kernel options and use 'persistence' as keyword.
 				uprintf("  Added 'persistence' kernel option");
@@ -364,17 +656,17 @@ static void fix_config(const char* psz_fullpath, const char* psz_path, const cha
 		if ((iso_label != NULL) && (usb_label != NULL)) {
 			if (props->is_grub_cfg) {
 				// Older versions of GRUB EFI used "linuxefi", newer just use "linux"
-				if ((replace_in_token_data(src, "linux", iso_label, usb_label, TRUE) != NULL) ||
-					(replace_in_token_data(src, "linuxefi", iso_label, usb_label, TRUE) != NULL) ||
+				if ((replace_in_config_data(cfg, "linux", iso_label, usb_label) != NULL) ||
+					(replace_in_config_data(cfg, "linuxefi", iso_label, usb_label) != NULL) ||
 					// In their great wisdom, the openSUSE maintainers added a 'set linux=linux'
 					// line to their grub.cfg, which means that their kernel option token is no
 					// longer 'linux' but '$linux'... and we have to add a workaround for that.
-					(replace_in_token_data(src, "$linux", iso_label, usb_label, TRUE) != NULL)) {
+					(replace_in_config_data(cfg, "$linux", iso_label, usb_label) != NULL)) {
 					uprintf("  Patched %s: '%s' ➔ '%s'\n", src, iso_label, usb_label);
 					modified = TRUE;
 				}
-			} else if (replace_in_token_data(src, (props->is_conf) ? "options" : "append",
-				iso_label, usb_label, TRUE) != NULL) {
+			} else if (replace_in_config_data(cfg, (props->is_conf) ? "options" : "append",
+				iso_label, usb_label) != NULL) {
 				uprintf("  Patched %s: '%s' ➔ '%s'\n", src, iso_label, usb_label);
 				modified = TRUE;
 			}
@@ -383,8 +675,8 @@ static void fix_config(const char* psz_fullpath, const char* psz_path, const cha
 			// Red Hat derivatives have changed their CD-ROM detection policy which leads to the installation source
 			// not being found. So we need to use 'inst.repo' instead of 'inst.stage2' in the kernel options.
 			//
-			if (img_report.rh8_derivative && (replace_in_token_data(src, props->is_grub_cfg ?
-				"linuxefi" : "append", "inst.stage2", "inst.repo", TRUE) != NULL)) {
+			if (img_report.rh8_derivative && (replace_in_config_data(cfg, props->is_grub_cfg ?
+				"linuxefi" : "append", "inst.stage2", "inst.repo") != NULL)) {
 				uprintf("  Patched %s: '%s' ➔ '%s'\n", src, "inst.stage2", "inst.repo");
 				modified = TRUE;
 			}
@@ -393,16 +685,6 @@ static void fix_config(const char* psz_fullpath, const char* psz_path, const cha
 		safe_free(usb_label);
 	}
 
-	// Fix dual BIOS + EFI support for tails and other ISOs
-	if ( (props->is_syslinux_cfg) && (safe_stricmp(psz_path, efi_dirname) == 0) &&
-		 (safe_stricmp(psz_basename, syslinux_cfg[0]) == 0) &&
-		 (!img_report.has_efi_syslinux) && (dst = safe_strdup(src)) ) {
-		dst[nul_pos-12] = 's'; dst[nul_pos-11] = 'y'; dst[nul_pos-10] = 's';
-		CopyFileA(src, dst, TRUE);
-		uprintf("Duplicated %s to %s\n", src, dst);
-		free(dst);
-	}
-
 	// Workaround for FreeNAS
 	if (props->is_grub_cfg) {
 		iso_label = malloc(MAX_PATH);
@@ -410,7 +692,7 @@ static void fix_config(const char* psz_fullpath, const char* psz_path, const cha
 		if ((iso_label != NULL) && (usb_label != NULL)) {
 			safe_sprintf(iso_label, MAX_PATH, "cd9660:/dev/iso9660/%s", img_report.label);
 			safe_sprintf(usb_label, MAX_PATH, "msdosfs:/dev/msdosfs/%s", img_report.usb_label);
-			if (replace_in_token_data(src, "set", iso_label, usb_label, TRUE) != NULL) {
+			if (replace_in_config_data(cfg, "set", iso_label, usb_label) != NULL) {
 				uprintf("  Patched %s: '%s' ➔ '%s'\n", src, iso_label, usb_label);
 				modified = TRUE;
 			}
@@ -419,8 +701,25 @@ static void fix_config(const char* psz_fullpath, const char* psz_path, const cha
 		safe_free(usb_label);
 	}
 
-	if (modified)
+	// Keep the MD5 of the patched content, for update_md5sum()
+	if (!close_config_file(cfg, TRUE, TRUE, md5)) {
+		uprintf("Could not write patched '%s' - original file has been left unmodified\n", src);
+	} else if (modified) {
+		for (i = 0; i < sizeof(md5); i++)
+			sprintf(&md5_str[2 * i], "%02x", md5[i]);
 		StrArrayAdd(&modified_path, psz_fullpath, TRUE);
+		StrArrayAdd(&modified_md5, md5_str, TRUE);
+	}
+
+	// Fix dual BIOS + EFI support for tails and other ISOs
+	if ( (props->is_syslinux_cfg) && (safe_stricmp(psz_path, efi_dirname) == 0) &&
+		 (safe_stricmp(psz_basename, syslinux_cfg[0]) == 0) &&
+		 (!img_report.has_efi_syslinux) && (dst = safe_strdup(src)) ) {
+		dst[nul_pos-12] = 's'; dst[nul_pos-11] = 'y'; dst[nul_pos-10] = 's';
+		CopyFileA(src, dst, TRUE);
+		uprintf("Duplicated %s to %s\n", src, dst);
+		free(dst);
+	}
 
 	free(src);
 }
@@ -469,80 +768,599 @@ static LPFILETIME __inline to_filetime(time_t t)
 	return r;
 }
 
-// Helper function to restore the timestamp on a directory
-static void __inline set_directory_timestamp(char* path, LPFILETIME creation, LPFILETIME last_access, LPFILETIME modify)
+/*
+ * Timestamps are applied with a single FILE_BASIC_INFO update, where the zeroed fields (change
+ * time and attributes) are left alone. For files, this is done on the extraction handle.
+ * Directories get theirs once everything has been extracted, deepest first: their last write
+ * time would otherwise be reset by the creation of their children, and each directory entry
+ * only gets rewritten once.
+ */
+typedef struct {
+	char* path;
+	uint32_t depth;
+	FILETIME ft[3];
+} dir_timestamp;
+
+static struct {
+	dir_timestamp* entry;
+	uint32_t nb_entries, max_entries;
+} dir_timestamps = { 0 };
+
+static BOOL set_file_times(HANDLE h, const FILETIME* creation, const FILETIME* last_access, const FILETIME* modify)
 {
-	HANDLE dir_handle = CreateFileU(path, GENERIC_READ | GENERIC_WRITE,
-		FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
-	if ((dir_handle == INVALID_HANDLE_VALUE) || (!SetFileTime(dir_handle, creation, last_access, modify)))
-		uprintf("  Could not set timestamp for directory '%s': %s", path, WindowsErrorString());
-	safe_closehandle(dir_handle);
+	FILE_BASIC_INFO fbi = { 0 };
+
+	fbi.CreationTime.LowPart = creation->dwLowDateTime;
+	fbi.CreationTime.HighPart = creation->dwHighDateTime;
+	fbi.LastAccessTime.LowPart = last_access->dwLowDateTime;
+	fbi.LastAccessTime.HighPart = last_access->dwHighDateTime;
+	fbi.LastWriteTime.LowPart = modify->dwLowDateTime;
+	fbi.LastWriteTime.HighPart = modify->dwHighDateTime;
+	return SetFileInformationByHandle(h, FileBasicInfo, &fbi, sizeof(fbi));
 }
 
-// Returns 0 on success, nonzero on error
-static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const char *psz_path)
+// Record the timestamp of a directory, to be applied by apply_directory_timestamps()
+static void set_directory_timestamp(const char* path, LPFILETIME creation, LPFILETIME last_access, LPFILETIME modify)
 {
-	HANDLE file_handle = NULL;
-	DWORD buf_size, wr_size, err;
-	EXTRACT_PROPS props;
-	BOOL r, is_identical;
-	int length;
-	size_t i;
-	char tmp[128], *psz_fullpath = NULL, *psz_sanpath = NULL;
-	const char* psz_basename;
-	udf_dirent_t *p_udf_dirent2;
-	uint8_t buf[UDF_BLOCKSIZE];
-	int64_t read, file_length;
+	dir_timestamp* e;
+	const char* p;
+
+	if (dir_timestamps.nb_entries >= dir_timestamps.max_entries) {
+		e = realloc(dir_timestamps.entry, (dir_timestamps.max_entries + 256) * sizeof(dir_timestamp));
+		if (e == NULL) {
+			uprintf("  Could not record timestamp for directory '%s'", path);
+			return;
+		}
+		dir_timestamps.entry = e;
+		dir_timestamps.max_entries += 256;
+	}
+	e = &dir_timestamps.entry[dir_timestamps.nb_entries];
+	e->path = safe_strdup(path);
+	if (e->path == NULL)
+		return;
+	for (e->depth = 0, p = path; *p != 0; p++)
+		if ((*p == '/') || (*p == '\\'))
+			e->depth++;
+	e->ft[0] = *creation;
+	e->ft[1] = *last_access;
+	e->ft[2] = *modify;
+	dir_timestamps.nb_entries++;
+}
 
-	if ((p_udf_dirent == NULL) || (psz_path == NULL))
-		return 1;
+static int dir_timestamp_cmp(const void* a, const void* b)
+{
+	return (int)((const dir_timestamp*)b)->depth - (int)((const dir_timestamp*)a)->depth;
+}
 
-	if (psz_path[0] == 0)
-		UpdateProgressWithInfoInit(NULL, TRUE);
-	while ((p_udf_dirent = udf_readdir(p_udf_dirent)) != NULL) {
-		if (FormatStatus) goto out;
-		psz_basename = udf_get_filename(p_udf_dirent);
-		if (strlen(psz_basename) == 0)
-			continue;
-		length = (int)(3 + strlen(psz_path) + strlen(psz_basename) + strlen(psz_extract_dir) + 24);
-		psz_fullpath = (char*)calloc(sizeof(char), length);
-		if (psz_fullpath == NULL) {
-			uprintf("Error allocating file name");
-			goto out;
+// Apply the directory timestamps that were recorded, if 'apply' is set, and free them
+static void apply_directory_timestamps(BOOL apply)
+{
+	uint32_t i;
+	HANDLE h;
+
+	if (apply)
+		qsort(dir_timestamps.entry, dir_timestamps.nb_entries, sizeof(dir_timestamp), dir_timestamp_cmp);
+	for (i = 0; i < dir_timestamps.nb_entries; i++) {
+		if (apply) {
+			h = CreateFileU(dir_timestamps.entry[i].path, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE,
+				NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+			if ((h == INVALID_HANDLE_VALUE) || !set_file_times(h, &dir_timestamps.entry[i].ft[0],
+				&dir_timestamps.entry[i].ft[1], &dir_timestamps.entry[i].ft[2]))
+				uprintf("  Could not set timestamp for directory '%s': %s", dir_timestamps.entry[i].path,
+					WindowsErrorString());
+			safe_closehandle(h);
 		}
-		length = _snprintf(psz_fullpath, length, "%s%s/%s", psz_extract_dir, psz_path, psz_basename);
-		if (length < 0) {
+		free(dir_timestamps.entry[i].path);
+	}
+	safe_free(dir_timestamps.entry);
+	dir_timestamps.nb_entries = dir_timestamps.max_entries = 0;
+}
+
+/*
+ * Extraction of small files through a pool of writer threads.
+ * With ISOs that contain tens of thousands of small files, extraction is dominated by the
+ * latency of creating and closing files on the target, rather than by the data transfer.
+ * So, while the directory walk and the reading of the ISO remain on the calling thread
+ * (since neither the ISO9660 nor the UDF handles of libcdio can be shared across threads),
+ * the data of small files is handed over to writer threads, that create, preallocate,
+ * write and close them concurrently. Large files and config files, that may need to be
+ * patched once written, are still extracted inline.
+ */
+typedef struct extract_job {
+	struct extract_job* next;
+	char* path;
+	uint8_t* data;
+	DWORD size;
+	uint32_t nb_blocks;
+	BOOL set_time;
+	FILETIME ft[3];
+} extract_job;
+
+typedef struct {
+	uint32_t files;
+	uint64_t bytes;
+	uint64_t open_us, write_us, close_us;
+} extract_stats;
+
+static struct {
+	HANDLE thread[ISO_EXTRACT_MAX_THREADS];
+	int nb_threads;
+	int active;					// Writers that are allowed to take jobs, the others are parked
+	int ceiling;				// Number of writers past which we found that the device is saturated
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE job_ready;
+	CONDITION_VARIABLE job_done;
+	extract_job *head, *tail;
+	uint64_t pending_size;
+	int pending;
+	int64_t max_file_size;
+	BOOL stop;
+	volatile LONG error;
+	volatile LONG64 nb_blocks;
+	// Files, bytes and cumulated time, for the pool and for the unbuffered writes
+	volatile LONG64 tier_files[2], tier_bytes[2], tier_us[2];
+	extract_stats window, total;
+	uint64_t window_start;
+	double last_rate;
+	int last_active;
+} extract_pool = { 0 };
+
+#define EXTRACT_TIER_SMALL        0
+#define EXTRACT_TIER_LARGE        1
+
+static __inline void add_extract_tier(int tier, uint64_t bytes, uint64_t start)
+{
+	InterlockedIncrement64(&extract_pool.tier_files[tier]);
+	InterlockedExchangeAdd64(&extract_pool.tier_bytes[tier], bytes);
+	InterlockedExchangeAdd64(&extract_pool.tier_us[tier], GetIoTimestamp() - start);
+}
+
+// Number of blocks that have been extracted, both inline and from the pool
+static __inline uint64_t extracted_blocks(void)
+{
+	return nb_blocks + (uint64_t)extract_pool.nb_blocks;
+}
+
+// Write a job, and report the time spent creating (us[0]), writing (us[1]) and closing (us[2]) the file
+static BOOL write_extract_job(extract_job* job, uint64_t us[3])
+{
+	BOOL r = FALSE;
+	HANDLE file_handle;
+	DWORD wr_size, err;
+	int retry;
+	uint64_t t = GetIoTimestamp();
+
+	us[0] = us[1] = us[2] = 0;
+
+	// Antivirus software, or a duplicate name that is being written by another thread,
+	// may hold the file for a short time, so retry on sharing violations
+	for (retry = 0; ; retry++) {
+		file_handle = CreatePreallocatedFile(job->path, GENERIC_READ | GENERIC_WRITE,
+			FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, job->size);
+		if ((file_handle != INVALID_HANDLE_VALUE) || (GetLastError() != ERROR_SHARING_VIOLATION) ||
+			(retry >= WRITE_RETRIES))
+			break;
+		Sleep(100);
+	}
+	if (file_handle == INVALID_HANDLE_VALUE) {
+		err = GetLastError();
+		uprintf("  Unable to create file '%s': %s", job->path, WindowsErrorString());
+		if (((err == ERROR_ACCESS_DENIED) || (err == ERROR_INVALID_HANDLE)) &&
+			(safe_strcmp(&job->path[3], autorun_name) == 0)) {
+			uprintf(stupid_antivirus);
+			return TRUE;
+		}
+		return FALSE;
+	}
+	us[0] = GetIoTimestamp() - t;
+	t += us[0];
+	if (job->size != 0) {
+		ISO_BLOCKING(r = WriteFileWithRetry(file_handle, job->data, job->size, &wr_size, WRITE_RETRIES));
+		if (!r) {
+			uprintf("  Error writing file '%s': %s", job->path, WindowsErrorString());
 			goto out;
 		}
-		if (S_ISLNK(udf_get_posix_filemode(p_udf_dirent)))
-			img_report.has_symlinks = SYMLINKS_UDF;
-		if (udf_is_dir(p_udf_dirent)) {
-			if (!scan_only) {
-				psz_sanpath = sanitize_filename(psz_fullpath, &is_identical);
-				IGNORE_RETVAL(_mkdirU(psz_sanpath));
-				if (preserve_timestamps) {
-					set_directory_timestamp(psz_sanpath, to_filetime(udf_get_attribute_time(p_udf_dirent)),
-						to_filetime(udf_get_access_time(p_udf_dirent)), to_filetime(udf_get_modification_time(p_udf_dirent)));
-				}
-				safe_free(psz_sanpath);
-			}
-			p_udf_dirent2 = udf_opendir(p_udf_dirent);
-			if (p_udf_dirent2 != NULL) {
-				if (udf_extract_files(p_udf, p_udf_dirent2, &psz_fullpath[strlen(psz_extract_dir)]))
-					goto out;
-			}
-		} else {
-			file_length = udf_get_file_length(p_udf_dirent);
-			if (check_iso_props(psz_path, file_length, psz_basename, psz_fullpath, &props)) {
-				safe_free(psz_fullpath);
-				continue;
+	}
+	if ((job->set_time) && (!set_file_times(file_handle, &job->ft[0], &job->ft[1], &job->ft[2])))
+		uprintf("  Could not set timestamp for '%s': %s", job->path, WindowsErrorString());
+	r = TRUE;
+
+out:
+	us[1] = GetIoTimestamp() - t;
+	t += us[1];
+	// This is where real-time antivirus scanners usually go through the file
+	ISO_BLOCKING(safe_closehandle(file_handle));
+	us[2] = GetIoTimestamp() - t;
+	return r;
+}
+
+static void add_extract_worker(int index);
+
+/*
+ * Adjust the number of writers to where the time goes. With an antivirus that scans each file
+ * as it gets created or closed, most of the time of a writer is spent waiting for the scan,
+ * rather than on the device, so more writers mean more files scanned in parallel. But once the
+ * device is what limits us, more writers only mean more seeking, so we back off when adding a
+ * writer did not increase the rate at which files get written. Must be called with the lock held.
+ */
+static void adapt_extract_pool(void)
+{
+	uint64_t now = GetIoTimestamp(), overhead, total;
+	double rate;
+	extract_stats* w = &extract_pool.window;
+
+	if ((w->files < ISO_EXTRACT_ADAPT_FILES) || extract_pool.stop)
+		return;
+	overhead = w->open_us + w->close_us;
+	total = max(overhead + w->write_us, 1);
+	rate = (double)w->files * 1000000.0 / (double)max(now - extract_pool.window_start, 1);
+	if ((extract_pool.active > extract_pool.last_active) && (extract_pool.last_active != 0) &&
+		(rate < extract_pool.last_rate * 1.05) && (extract_pool.active > ISO_EXTRACT_MIN_THREADS)) {
+		// The last writer we added didn't help
+		extract_pool.ceiling = --extract_pool.active;
+		uprintf("  Extraction: Lowering the number of writers to %d (%0.0f files/s)", extract_pool.active, rate);
+	} else if ((4 * overhead > 3 * total) && (extract_pool.pending > extract_pool.active) &&
+		(extract_pool.active < extract_pool.ceiling)) {
+		if (extract_pool.active == extract_pool.nb_threads)
+			add_extract_worker(extract_pool.nb_threads);
+		if (extract_pool.active < extract_pool.nb_threads) {
+			extract_pool.active++;
+			WakeAllConditionVariable(&extract_pool.job_ready);
+			uprintf("  Extraction: Raising the number of writers to %d (creating and closing files take %d%% of their time)",
+				extract_pool.active, (int)(overhead * 100 / total));
+		}
+	}
+	extract_pool.last_rate = rate;
+	extract_pool.last_active = extract_pool.active;
+	memset(w, 0, sizeof(*w));
+	extract_pool.window_start = now;
+}
+
+static DWORD WINAPI ExtractWorkerThread(void* param)
+{
+	extract_job* job;
+	extract_stats* s;
+	uint64_t start, us[3] = { 0 };
+	int i, index = (int)(uintptr_t)param;
+	BOOL r;
+
+	for (;;) {
+		EnterCriticalSection(&extract_pool.lock);
+		while (((extract_pool.head == NULL) || (index >= extract_pool.active)) && (!extract_pool.stop))
+			SleepConditionVariableCS(&extract_pool.job_ready, &extract_pool.lock, INFINITE);
+		job = extract_pool.head;
+		if (job != NULL) {
+			extract_pool.head = job->next;
+			if (extract_pool.head == NULL)
+				extract_pool.tail = NULL;
+		}
+		LeaveCriticalSection(&extract_pool.lock);
+		if (job == NULL)
+			break;
+		// Once we have an error or a cancellation, just drain the queue
+		r = FALSE;
+		if ((!FormatStatus) && (!extract_pool.error)) {
+			start = GetIoTimestamp();
+			r = write_extract_job(job, us);
+			if (r) {
+				InterlockedExchangeAdd64(&extract_pool.nb_blocks, job->nb_blocks);
+				add_extract_tier(EXTRACT_TIER_SMALL, job->size, start);
+			} else {
+				InterlockedExchange(&extract_pool.error, 1);
 			}
-			print_extracted_file(psz_fullpath, file_length);
-			for (i = 0; i < NB_OLD_C32; i++) {
-				if (props.is_old_c32[i] && use_own_c32[i]) {
-					static_sprintf(tmp, "%s/syslinux-%s/%s", FILES_DIR, embedded_sl_version_str[0], old_c32_name[i]);
-					if (CopyFileU(tmp, psz_fullpath, FALSE)) {
-						uprintf("  Replaced with local version %s", IsFileInDB(tmp)?"✓":"✗");
+		}
+		EnterCriticalSection(&extract_pool.lock);
+		extract_pool.pending--;
+		extract_pool.pending_size -= job->size;
+		for (i = 0, s = &extract_pool.window; r && (i < 2); i++, s = &extract_pool.total) {
+			s->files++;
+			s->bytes += job->size;
+			s->open_us += us[0];
+			s->write_us += us[1];
+			s->close_us += us[2];
+		}
+		adapt_extract_pool();
+		WakeAllConditionVariable(&extract_pool.job_done);
+		LeaveCriticalSection(&extract_pool.lock);
+		free(job->data);
+		free(job);
+	}
+	ExitThread(0);
+}
+
+// Add a writer to the pool, as its thread number 'index'
+static void add_extract_worker(int index)
+{
+	if (index >= ISO_EXTRACT_MAX_THREADS)
+		return;
+	extract_pool.thread[index] = CreateThread(NULL, 0, ExtractWorkerThread, (void*)(uintptr_t)index, 0, NULL);
+	if (extract_pool.thread[index] == NULL) {
+		uprintf("Unable to start extraction thread: %s", WindowsErrorString());
+		return;
+	}
+	SetThreadClass(extract_pool.thread[index], THREAD_CLASS_COMPUTE, index);
+	extract_pool.nb_threads++;
+}
+
+static void start_extract_pool(void)
+{
+	int i;
+
+	memset(&extract_pool, 0, sizeof(extract_pool));
+	extract_pool.max_file_size = MIN((int64_t)extract_small_file_size * KB, ISO_EXTRACT_MAX_FILE_SIZE);
+	extract_pool.ceiling = ISO_EXTRACT_MAX_THREADS;
+	InitializeCriticalSection(&extract_pool.lock);
+	InitializeConditionVariable(&extract_pool.job_ready);
+	InitializeConditionVariable(&extract_pool.job_done);
+	for (i = 0; (i < ISO_EXTRACT_THREADS) && (extract_pool.nb_threads == i); i++)
+		add_extract_worker(i);
+	extract_pool.active = extract_pool.nb_threads;
+	extract_pool.window_start = GetIoTimestamp();
+	if (extract_pool.nb_threads == 0)
+		DeleteCriticalSection(&extract_pool.lock);
+}
+
+// Report how much of the time of the writers went into creating and closing files
+static void print_extract_overhead(void)
+{
+	extract_stats* t = &extract_pool.total;
+	uint64_t overhead = t->open_us + t->close_us;
+
+	if (t->files == 0)
+		return;
+	uprintf("Wrote %d files from %d writers: %0.1f ms per file to create and close, %0.1f ms to write",
+		t->files, extract_pool.nb_threads, (double)overhead / 1000.0 / t->files, (double)t->write_us / 1000.0 / t->files);
+	if (overhead / t->files >= ISO_EXTRACT_SLOW_FILE_US)
+		uprintf("Creating and closing files took %d%% of the writers' time, which is what happens when an antivirus "
+			"scans every file. Excluding the target drive from real-time scanning should speed up the extraction.",
+			(int)(overhead * 100 / max(overhead + t->write_us, 1)));
+}
+
+// Returns FALSE if any of the files that were handed to the pool could not be written
+static BOOL stop_extract_pool(void)
+{
+	int i;
+
+	TraceTally("unbuffered file writes", (uint32_t)extract_pool.tier_files[EXTRACT_TIER_LARGE],
+		extract_pool.tier_us[EXTRACT_TIER_LARGE], extract_pool.tier_bytes[EXTRACT_TIER_LARGE]);
+	if (extract_pool.nb_threads == 0)
+		return TRUE;
+	EnterCriticalSection(&extract_pool.lock);
+	extract_pool.stop = TRUE;
+	WakeAllConditionVariable(&extract_pool.job_ready);
+	LeaveCriticalSection(&extract_pool.lock);
+	// No writers get added once stop is set, so nb_threads can't change past this point
+	while (WaitForMultipleObjects(extract_pool.nb_threads, extract_pool.thread, TRUE, 250) == WAIT_TIMEOUT)
+		UpdateProgressWithInfo(OP_FILE_COPY, MSG_231, extracted_blocks(), total_blocks);
+	for (i = 0; i < extract_pool.nb_threads; i++)
+		CloseHandle(extract_pool.thread[i]);
+	extract_pool.nb_threads = 0;
+	DeleteCriticalSection(&extract_pool.lock);
+	TraceTally("pooled file writes", (uint32_t)extract_pool.tier_files[EXTRACT_TIER_SMALL],
+		extract_pool.tier_us[EXTRACT_TIER_SMALL], extract_pool.tier_bytes[EXTRACT_TIER_SMALL]);
+	print_extract_overhead();
+	return !extract_pool.error;
+}
+
+// Whether a file should be extracted through the pool, rather than inline
+static __inline BOOL use_extract_pool(int64_t file_length, EXTRACT_PROPS* props)
+{
+	return (extract_pool.nb_threads != 0) && (file_length <= extract_pool.max_file_size) &&
+		!props->is_cfg && !props->is_conf;
+}
+
+// Hand a file over to the pool. On success, ownership of path and data is transferred.
+static BOOL queue_extract_job(const char* path, uint8_t* data, DWORD size, LPFILETIME ft)
+{
+	extract_job* job;
+	size_t len = strlen(path) + 1;
+
+	// The path is stored right after the job, so that queuing a file only takes one allocation
+	job = calloc(1, sizeof(extract_job) + len);
+	if (job == NULL) {
+		uprintf("  Could not allocate extraction job");
+		return FALSE;
+	}
+	job->path = (char*)&job[1];
+	memcpy(job->path, path, len);
+	job->data = data;
+	job->size = size;
+	job->nb_blocks = (size + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE;
+	if (ft != NULL) {
+		job->set_time = TRUE;
+		memcpy(job->ft, ft, sizeof(job->ft));
+	}
+
+	EnterCriticalSection(&extract_pool.lock);
+	// Don't let the reads run too far ahead of the writes
+	while ((extract_pool.pending > 0) && (extract_pool.pending_size + size > ISO_EXTRACT_MAX_PENDING) &&
+		(!extract_pool.error) && (!FormatStatus)) {
+		if (!SleepConditionVariableCS(&extract_pool.job_done, &extract_pool.lock, 250)) {
+			LeaveCriticalSection(&extract_pool.lock);
+			UpdateProgressWithInfo(OP_FILE_COPY, MSG_231, extracted_blocks(), total_blocks);
+			EnterCriticalSection(&extract_pool.lock);
+		}
+	}
+	if ((extract_pool.error) || (FormatStatus)) {
+		LeaveCriticalSection(&extract_pool.lock);
+		free(job);
+		return FALSE;
+	}
+	if (extract_pool.tail == NULL)
+		extract_pool.head = job;
+	else
+		extract_pool.tail->next = job;
+	extract_pool.tail = job;
+	extract_pool.pending++;
+	extract_pool.pending_size += size;
+	WakeConditionVariable(&extract_pool.job_ready);
+	LeaveCriticalSection(&extract_pool.lock);
+	UpdateProgressWithInfo(OP_FILE_COPY, MSG_231, extracted_blocks(), total_blocks);
+	return TRUE;
+}
+
+/*
+ * Copy the data of a file from the image, with large contiguous reads into aligned
+ * buffers, that are written through an asynchronous queue so that the write of a
+ * chunk overlaps with the read of the next one. Either p_udf_dirent (UDF) or p_iso
+ * and lsn (ISO9660) must be provided.
+ * Since the queue uses unbuffered I/O, the last chunk is padded to the alignment and
+ * the file is truncated to its actual size once all the writes have completed.
+ */
+static BOOL extract_file_data(HANDLE file_handle, int64_t file_length, udf_dirent_t* p_udf_dirent,
+	iso9660_t* p_iso, lsn_t lsn, const char* psz_name)
+{
+	BOOL r = FALSE;
+	HANDLE hQueue = NULL;
+	LARGE_INTEGER li;
+	DWORD buf_size, chunk_size, write_size, size;
+	uint8_t* buffer = NULL;
+	int64_t read, offset;
+	uint64_t start = GetIoTimestamp();
+	int slot;
+
+	buf_size = (DWORD)((MIN(file_length, MIN((int64_t)extract_buffer_size * MB, ISO_EXTRACT_MAX_BUFFER_SIZE)) +
+		ISO_EXTRACT_ALIGNMENT - 1) & ~(ISO_EXTRACT_ALIGNMENT - 1));
+	buffer = (uint8_t*)AllocIoBuffer((size_t)buf_size * 2);
+	if (buffer == NULL) {
+		uprintf("  Could not allocate extraction buffer");
+		goto out;
+	}
+	hQueue = CreateAsyncQueue(file_handle, GENERIC_READ | GENERIC_WRITE, 2);
+	if (hQueue == NULL) {
+		uprintf("  Could not create extraction queue: %s", WindowsErrorString());
+		goto out;
+	}
+
+	for (offset = 0, slot = 0; offset < file_length; offset += chunk_size, slot = 1 - slot) {
+		if (FormatStatus) goto out;
+		chunk_size = (DWORD)MIN(file_length - offset, buf_size);
+		// The buffer for this slot may still be in use by the write we issued two chunks ago
+		if (((ASYNC_QUEUE*)hQueue)->Request[slot].bPending) {
+			ISO_BLOCKING(r = WaitAsyncQueue(hQueue, slot, DRIVE_ACCESS_TIMEOUT, &size));
+			if (!r) {
+				uprintf("  Error writing file: %s", WindowsErrorString());
+				goto out;
+			}
+			r = FALSE;
+		}
+		if (p_udf_dirent != NULL) {
+			// udf_read_block() stops at the end of an extent, so we may need several calls
+			for (size = 0; size < chunk_size; size += (DWORD)read) {
+				read = udf_read_block(p_udf_dirent, &buffer[slot * buf_size + size],
+					(chunk_size - size + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE);
+				if (read <= 0) {
+					uprintf("  Error reading UDF file %s", psz_name);
+					goto out;
+				}
+			}
+		} else {
+			size = (chunk_size + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE;
+			if (iso9660_iso_seek_read(p_iso, &buffer[slot * buf_size], lsn, size) != (long)size * ISO_BLOCKSIZE) {
+				uprintf("  Error reading ISO9660 file %s at LSN %lu", psz_name, (long unsigned int)lsn);
+				goto out;
+			}
+			lsn += size;
+		}
+		write_size = (DWORD)((chunk_size + ISO_EXTRACT_ALIGNMENT - 1) & ~(ISO_EXTRACT_ALIGNMENT - 1));
+		memset(&buffer[slot * buf_size + chunk_size], 0, write_size - chunk_size);
+		if (!IssueAsyncQueue(hQueue, slot, TRUE, &buffer[slot * buf_size], write_size, offset)) {
+			uprintf("  Error writing file: %s", WindowsErrorString());
+			goto out;
+		}
+		nb_blocks += (chunk_size + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE;
+		UpdateProgressWithInfo(OP_FILE_COPY, MSG_231, extracted_blocks(), total_blocks);
+	}
+	for (slot = 0; slot < 2; slot++) {
+		if (!((ASYNC_QUEUE*)hQueue)->Request[slot].bPending)
+			continue;
+		ISO_BLOCKING(r = WaitAsyncQueue(hQueue, slot, DRIVE_ACCESS_TIMEOUT, &size));
+		if (!r) {
+			uprintf("  Error writing file: %s", WindowsErrorString());
+			goto out;
+		}
+	}
+	// Remove the padding of the last chunk
+	li.QuadPart = file_length;
+	r = SetFilePointerEx(file_handle, li, NULL, FILE_BEGIN) && SetEndOfFile(file_handle);
+	if (!r)
+		uprintf("  Could not set file size: %s", WindowsErrorString());
+	else
+		add_extract_tier(EXTRACT_TIER_LARGE, file_length, start);
+
+out:
+	ISO_BLOCKING(CloseAsyncQueue(hQueue));
+	safe_free_io_buffer(buffer);
+	return r;
+}
+
+// Returns 0 on success, nonzero on error
+static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const char *psz_path)
+{
+	HANDLE file_handle = NULL;
+	DWORD err, pos;
+	EXTRACT_PROPS props;
+	BOOL r, is_identical;
+	int length;
+	size_t i;
+	char tmp[128], *psz_fullpath = NULL, *psz_sanpath = NULL;
+	const char* psz_basename;
+	udf_dirent_t *p_udf_dirent2;
+	uint8_t *data = NULL;
+	int64_t read, file_length;
+	FILETIME file_times[3];
+
+	if ((p_udf_dirent == NULL) || (psz_path == NULL))
+		return 1;
+
+	if (psz_path[0] == 0)
+		UpdateProgressWithInfoInit(NULL, TRUE);
+	while ((p_udf_dirent = udf_readdir(p_udf_dirent)) != NULL) {
+		if (FormatStatus || extract_pool.error) goto out;
+		psz_basename = udf_get_filename(p_udf_dirent);
+		if (strlen(psz_basename) == 0)
+			continue;
+		length = (int)(3 + strlen(psz_path) + strlen(psz_basename) + strlen(psz_extract_dir) + 24);
+		psz_fullpath = (char*)calloc(sizeof(char), length);
+		if (psz_fullpath == NULL) {
+			uprintf("Error allocating file name");
+			goto out;
+		}
+		length = _snprintf(psz_fullpath, length, "%s%s/%s", psz_extract_dir, psz_path, psz_basename);
+		if (length < 0) {
+			goto out;
+		}
+		if (S_ISLNK(udf_get_posix_filemode(p_udf_dirent)))
+			img_report.has_symlinks = SYMLINKS_UDF;
+		if (udf_is_dir(p_udf_dirent)) {
+			if (!scan_only) {
+				psz_sanpath = sanitize_filename(psz_fullpath, &is_identical);
+				IGNORE_RETVAL(_mkdirU(psz_sanpath));
+				if (preserve_timestamps) {
+					set_directory_timestamp(psz_sanpath, to_filetime(udf_get_attribute_time(p_udf_dirent)),
+						to_filetime(udf_get_access_time(p_udf_dirent)), to_filetime(udf_get_modification_time(p_udf_dirent)));
+				}
+				free_sanitized_filename(psz_sanpath, psz_fullpath);
+			}
+			p_udf_dirent2 = udf_opendir(p_udf_dirent);
+			if (p_udf_dirent2 != NULL) {
+				if (udf_extract_files(p_udf, p_udf_dirent2, &psz_fullpath[strlen(psz_extract_dir)]))
+					goto out;
+			}
+		} else {
+			file_length = udf_get_file_length(p_udf_dirent);
+			if (check_iso_props(psz_path, file_length, psz_basename, psz_fullpath, &props)) {
+				if (scan_only)
+					capture_scan_probe(&props, p_udf_dirent, NULL, 0);
+				safe_free(psz_fullpath);
+				continue;
+			}
+			print_extracted_file(psz_fullpath, file_length);
+			for (i = 0; i < NB_OLD_C32; i++) {
+				if (props.is_old_c32[i] && use_own_c32[i]) {
+					static_sprintf(tmp, "%s/syslinux-%s/%s", FILES_DIR, embedded_sl_version_str[0], old_c32_name[i]);
+					if (CopyFileU(tmp, psz_fullpath, FALSE)) {
+						uprintf("  Replaced with local version %s", IsFileInDB(tmp)?"✓":"✗");
 						break;
 					}
 					uprintf("  Could not replace file: %s", WindowsErrorString());
@@ -553,8 +1371,36 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 			psz_sanpath = sanitize_filename(psz_fullpath, &is_identical);
 			if (!is_identical)
 				uprintf("  File name sanitized to '%s'", psz_sanpath);
+			if (use_extract_pool(file_length, &props)) {
+				data = malloc((size_t)((file_length + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE) * UDF_BLOCKSIZE + 1);
+				if (data == NULL) {
+					uprintf("  Could not allocate file data");
+					goto out;
+				}
+				for (pos = 0; pos < (DWORD)file_length; pos += (DWORD)read) {
+					if (FormatStatus) goto out;
+					read = udf_read_block(p_udf_dirent, &data[pos],
+						((DWORD)file_length - pos + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE);
+					if (read <= 0) {
+						uprintf("  Error reading UDF file %s", &psz_fullpath[strlen(psz_extract_dir)]);
+						goto out;
+					}
+				}
+				if (preserve_timestamps) {
+					file_times[0] = *to_filetime(udf_get_attribute_time(p_udf_dirent));
+					file_times[1] = *to_filetime(udf_get_access_time(p_udf_dirent));
+					file_times[2] = *to_filetime(udf_get_modification_time(p_udf_dirent));
+				}
+				if (!queue_extract_job(psz_sanpath, data, (DWORD)file_length, preserve_timestamps ? file_times : NULL))
+					goto out;
+				free_sanitized_filename(psz_sanpath, psz_fullpath);
+				data = NULL;
+				safe_free(psz_fullpath);
+				continue;
+			}
+			// FILE_SHARE_WRITE is needed for the asynchronous queue to reopen the file
 			file_handle = CreatePreallocatedFile(psz_sanpath, GENERIC_READ | GENERIC_WRITE,
-				FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, file_length);
+				FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, file_length);
 			if (file_handle == INVALID_HANDLE_VALUE) {
 				err = GetLastError();
 				uprintf("  Unable to create file: %s", WindowsErrorString());
@@ -563,125 +1409,1043 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 					uprintf(stupid_antivirus);
 				else
 					goto out;
-			} else {
-				while (file_length > 0) {
-					if (FormatStatus) goto out;
-					memset(buf, 0, UDF_BLOCKSIZE);
-					read = udf_read_block(p_udf_dirent, buf, 1);
-					if (read < 0) {
-						uprintf("  Error reading UDF file %s", &psz_fullpath[strlen(psz_extract_dir)]);
-						goto out;
-					}
-					buf_size = (DWORD)MIN(file_length, read);
-					ISO_BLOCKING(r = WriteFileWithRetry(file_handle, buf, buf_size, &wr_size, WRITE_RETRIES));
-					if (!r) {
-						uprintf("  Error writing file: %s", WindowsErrorString());
-						goto out;
-					}
-					file_length -= read;
-					if (nb_blocks++ % PROGRESS_THRESHOLD == 0)
-						UpdateProgressWithInfo(OP_FILE_COPY, MSG_231, nb_blocks, total_blocks);
-				}
+			} else if ((file_length > 0) && !extract_file_data(file_handle, file_length, p_udf_dirent,
+				NULL, 0, &psz_fullpath[strlen(psz_extract_dir)])) {
+				goto out;
 			}
-			if ((preserve_timestamps) && (!SetFileTime(file_handle, to_filetime(udf_get_attribute_time(p_udf_dirent)),
+			if ((preserve_timestamps) && (!set_file_times(file_handle, to_filetime(udf_get_attribute_time(p_udf_dirent)),
 				to_filetime(udf_get_access_time(p_udf_dirent)), to_filetime(udf_get_modification_time(p_udf_dirent)))))
 				uprintf("  Could not set timestamp: %s", WindowsErrorString());
 
-			// If you have a fast USB 3.0 device, the default Windows buffering does an
-			// excellent job at compensating for our small blocks read/writes to max out the
-			// device's bandwidth.
-			// The drawback however is with cancellation. With a large file, CloseHandle()
-			// may take forever to complete and is not interruptible. We try to detect this.
-			ISO_BLOCKING(safe_closehandle(file_handle));
-			if (props.is_cfg || props.is_conf)
-				fix_config(psz_sanpath, psz_path, psz_basename, &props);
-			safe_free(psz_sanpath);
+			// With a large file, CloseHandle() may take forever to complete and is not
+			// interruptible, which prevents cancellation. We try to detect this.
+			ISO_BLOCKING(safe_closehandle(file_handle));
+			if (props.is_cfg || props.is_conf)
+				fix_config(psz_sanpath, psz_path, psz_basename, &props);
+			free_sanitized_filename(psz_sanpath, psz_fullpath);
+		}
+		safe_free(psz_fullpath);
+	}
+	return 0;
+
+out:
+	if (p_udf_dirent != NULL)
+		udf_dirent_free(p_udf_dirent);
+	ISO_BLOCKING(safe_closehandle(file_handle));
+	safe_free(data);
+	free_sanitized_filename(psz_sanpath, psz_fullpath);
+	safe_free(psz_fullpath);
+	return 1;
+}
+
+// This updates the MD5SUMS/md5sum.txt file that some distros (Ubuntu, Mint...)
+// use to validate the media. Because we may alter some of the validated files
+// to add persistence and whatnot, we need to alter the MD5 list as a result.
+// The format of the file is expected to always be "<MD5SUM> <FILE_PATH>" on
+// individual lines. The MD5 of the files we altered were computed by fix_config()
+// as they were written, so that we don't have to read them back from the drive.
+static void update_md5sum(void)
+{
+	BOOL display_header = TRUE;
+	intptr_t pos;
+	uint32_t i, md5_size;
+	char md5_path[64], *md5_data = NULL, *str_pos;
+
+	if (!img_report.has_md5sum || (modified_path.Index == 0))
+		goto out;
+
+	assert(img_report.has_md5sum <= ARRAYSIZE(md5sum_name));
+	if (img_report.has_md5sum > ARRAYSIZE(md5sum_name))
+		goto out;
+
+	static_sprintf(md5_path, "%s\\%s", psz_extract_dir, md5sum_name[img_report.has_md5sum - 1]);
+	md5_size = read_file(md5_path, (uint8_t**)&md5_data);
+	if (md5_size == 0)
+		goto out;
+
+	for (i = 0; (i < modified_path.Index) && (i < modified_md5.Index); i++) {
+		str_pos = strstr(md5_data, &modified_path.String[i][2]);
+		if (str_pos == NULL)
+			// File is not listed in md5 sums
+			continue;
+		if (display_header) {
+			uprintf("Updating %s:", md5_path);
+			display_header = FALSE;
+		}
+		uprintf("● %s", &modified_path.String[i][2]);
+		pos = str_pos - md5_data;
+		while ((pos > 0) && (md5_data[pos - 1] != '\n'))
+			pos--;
+		memcpy(&md5_data[pos], modified_md5.String[i], 32);
+	}
+
+	if (!display_header)
+		write_file(md5_path, md5_data, md5_size);
+	free(md5_data);
+
+out:
+	StrArrayDestroy(&modified_path);
+	StrArrayDestroy(&modified_md5);
+}
+
+/*
+ * Index of the ISO9660 file system, that is built during the scan so that the extraction
+ * doesn't have to parse all the directory records and process all the names again.
+ * Entries are stored in the order of the directory walk, which means that a directory
+ * always comes before its content, and all the names are offsets into a string arena.
+ */
+#define ISO_INDEX_DIR             0x01
+#define ISO_INDEX_SKIP            0x02
+#define ISO_INDEX_SYMLINK         0x04
+#define ISO_INDEX_PREBUILT        0x08	// Already written by WriteISOToFAT32()
+#define ISO_INDEX_BOOT            0x10	// Boot payload, to be written first
+
+typedef struct {
+	uint32_t dir;				// Offset of the path of the parent directory
+	uint32_t name;				// Offset of the name
+	uint32_t symlink;			// Offset of the Rock Ridge symbolic link target
+	uint32_t parent;			// Index of the parent directory entry (UINT32_MAX for root)
+	uint8_t flags;
+	lsn_t lsn;
+	int64_t size;
+	time_t mtime;
+	EXTRACT_PROPS props;
+} iso_index_entry;
+
+static struct {
+	BOOL building;
+	BOOL valid;
+	char src[MAX_PATH];
+	int64_t src_size;
+	time_t src_mtime;
+	iso_extension_mask_t mask;
+	uint8_t joliet_level;
+	iso_index_entry* entry;
+	uint32_t nb_entries, max_entries;
+	char* arena;
+	uint32_t arena_size, arena_max;
+	uint32_t cur_dir;
+	uint64_t prebuilt_blocks;
+} iso_index = { 0 };
+
+static void free_iso_index(void)
+{
+	safe_free(iso_index.entry);
+	safe_free(iso_index.arena);
+	memset(&iso_index, 0, sizeof(iso_index));
+	iso_index.cur_dir = UINT32_MAX;
+}
+
+static void clear_iso_index_prebuilt(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < iso_index.nb_entries; i++)
+		iso_index.entry[i].flags &= ~ISO_INDEX_PREBUILT;
+	iso_index.prebuilt_blocks = 0;
+}
+
+// The names from the index can only be used if they were produced with the same extensions
+static BOOL is_iso_index_usable(const char* src_iso, iso_extension_mask_t mask, uint8_t level)
+{
+	struct __stat64 src_stat;
+
+	return (iso_index.valid) && (strcmp(iso_index.src, src_iso) == 0) && (_stat64U(src_iso, &src_stat) == 0) &&
+		(iso_index.src_size == src_stat.st_size) && (iso_index.src_mtime == src_stat.st_mtime) &&
+		(iso_index.joliet_level == level) &&
+		((iso_index.mask & ~ISO_EXTENSION_JOLIET) == (mask & ~ISO_EXTENSION_JOLIET));
+}
+
+// Returns the offset of the string in the arena, or UINT32_MAX on error
+static uint32_t iso_index_add_string(const char* str)
+{
+	uint32_t offset, new_max, len = (uint32_t)strlen(str) + 1;
+	char* new_arena;
+
+	if (iso_index.arena_size + len > iso_index.arena_max) {
+		new_max = max(2 * iso_index.arena_max, iso_index.arena_max + len + 64 * KB);
+		new_arena = realloc(iso_index.arena, new_max);
+		if (new_arena == NULL)
+			return UINT32_MAX;
+		iso_index.arena = new_arena;
+		iso_index.arena_max = new_max;
+	}
+	offset = iso_index.arena_size;
+	memcpy(&iso_index.arena[offset], str, len);
+	iso_index.arena_size += len;
+	return offset;
+}
+
+// Add an entry to the index. *dir is the offset of the directory path, or UINT32_MAX if it
+// hasn't been added yet. On error, the index is dropped and we fall back to the directory walk.
+static void iso_index_add(uint32_t* dir, const char* psz_path, const char* psz_basename,
+	iso9660_stat_t* p_statbuf, uint8_t flags, EXTRACT_PROPS* props)
+{
+	iso_index_entry* e;
+
+	if (!iso_index.building)
+		return;
+	if (iso_index.nb_entries >= iso_index.max_entries) {
+		e = realloc(iso_index.entry, (iso_index.max_entries + 1024) * sizeof(iso_index_entry));
+		if (e == NULL)
+			goto error;
+		iso_index.entry = e;
+		iso_index.max_entries += 1024;
+	}
+	if (*dir == UINT32_MAX)
+		*dir = iso_index_add_string(psz_path);
+	e = &iso_index.entry[iso_index.nb_entries];
+	memset(e, 0, sizeof(iso_index_entry));
+	e->dir = *dir;
+	e->parent = iso_index.cur_dir;
+	e->name = iso_index_add_string(psz_basename);
+	if (p_statbuf->rr.psz_symlink != NULL) {
+		flags |= ISO_INDEX_SYMLINK;
+		e->symlink = iso_index_add_string(p_statbuf->rr.psz_symlink);
+	}
+	if ((e->dir == UINT32_MAX) || (e->name == UINT32_MAX) || (e->symlink == UINT32_MAX))
+		goto error;
+	if (!(flags & ISO_INDEX_DIR) && (props != NULL) && is_boot_payload(psz_basename, props))
+		flags |= ISO_INDEX_BOOT;
+	e->flags = flags;
+	e->lsn = p_statbuf->lsn;
+	e->size = p_statbuf->total_size;
+	e->mtime = mktime(&p_statbuf->tm);
+	if (props != NULL)
+		e->props = *props;
+	e->props.probe = NULL;
+	iso_index.nb_entries++;
+	return;
+
+error:
+	uprintf("  Could not add '%s' to the ISO index", psz_basename);
+	free_iso_index();
+}
+
+// Extract a single ISO9660 file. Returns 0 on success, nonzero on error
+static int iso_extract_file(iso9660_t* p_iso, char* psz_fullpath, const char* psz_path, const char* psz_basename,
+	lsn_t lsn, int64_t file_length, time_t mtime, EXTRACT_PROPS* props, const char* psz_symlink)
+{
+	HANDLE file_handle = NULL;
+	DWORD err, nb;
+	BOOL is_identical;
+	int r = 1;
+	char tmp[128], *psz_sanpath = NULL;
+	const char *psz_iso_name = &psz_fullpath[strlen(psz_extract_dir)];
+	uint8_t* data = NULL;
+	FILETIME file_times[3];
+	LPFILETIME ft;
+	size_t i;
+
+	print_extracted_file(psz_fullpath, file_length);
+	for (i = 0; i < NB_OLD_C32; i++) {
+		if (props->is_old_c32[i] && use_own_c32[i]) {
+			static_sprintf(tmp, "%s/syslinux-%s/%s", FILES_DIR, embedded_sl_version_str[0], old_c32_name[i]);
+			if (CopyFileU(tmp, psz_fullpath, FALSE)) {
+				uprintf("  Replaced with local version %s", IsFileInDB(tmp)?"✓":"✗");
+				break;
+			}
+			uprintf("  Could not replace file: %s", WindowsErrorString());
+		}
+	}
+	if (i < NB_OLD_C32)
+		return 0;
+	psz_sanpath = sanitize_filename(psz_fullpath, &is_identical);
+	if (!is_identical)
+		uprintf("  File name sanitized to '%s'", psz_sanpath);
+	if ((psz_symlink != NULL) && (file_length == 0))
+		uprintf("  Ignoring Rock Ridge symbolic link to '%s'", psz_symlink);
+	if (use_extract_pool(file_length, props)) {
+		nb = (DWORD)((file_length + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE);
+		data = malloc((size_t)nb * ISO_BLOCKSIZE + 1);
+		if (data == NULL) {
+			uprintf("  Could not allocate file data");
+			goto out;
+		}
+		if ((nb != 0) && (iso9660_iso_seek_read(p_iso, data, lsn, nb) != (long)nb * ISO_BLOCKSIZE)) {
+			uprintf("  Error reading ISO9660 file %s at LSN %lu",
+				psz_iso_name, (long unsigned int)lsn);
+			goto out;
+		}
+		file_times[0] = file_times[1] = file_times[2] = *to_filetime(mtime);
+		if (!queue_extract_job(psz_sanpath, data, (DWORD)file_length, preserve_timestamps ? file_times : NULL))
+			goto out;
+		data = NULL;
+		r = 0;
+		goto out;
+	}
+	// FILE_SHARE_WRITE is needed for the asynchronous queue to reopen the file
+	file_handle = CreatePreallocatedFile(psz_sanpath, GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, file_length);
+	if (file_handle == INVALID_HANDLE_VALUE) {
+		err = GetLastError();
+		uprintf("  Unable to create file: %s", WindowsErrorString());
+		if (((err == ERROR_ACCESS_DENIED) || (err == ERROR_INVALID_HANDLE)) &&
+			(safe_strcmp(&psz_sanpath[3], autorun_name) == 0))
+			uprintf(stupid_antivirus);
+		else
+			goto out;
+	} else if ((file_length > 0) && !extract_file_data(file_handle, file_length, NULL,
+		p_iso, lsn, psz_iso_name)) {
+		goto out;
+	}
+	if (preserve_timestamps) {
+		ft = to_filetime(mtime);
+		if (!set_file_times(file_handle, ft, ft, ft))
+			uprintf("  Could not set timestamp: %s", WindowsErrorString());
+	}
+	ISO_BLOCKING(safe_closehandle(file_handle));
+	if (props->is_cfg || props->is_conf)
+		fix_config(psz_sanpath, psz_path, psz_basename, props);
+	r = 0;
+
+out:
+	ISO_BLOCKING(safe_closehandle(file_handle));
+	safe_free(data);
+	free_sanitized_filename(psz_sanpath, psz_fullpath);
+	return r;
+}
+
+// Index entries for boot payloads first, then LSN order
+static int iso_index_lsn_cmp(const void* a, const void* b)
+{
+	const iso_index_entry *ea = &iso_index.entry[*(const uint32_t*)a], *eb = &iso_index.entry[*(const uint32_t*)b];
+
+	if ((ea->flags ^ eb->flags) & ISO_INDEX_BOOT)
+		return (ea->flags & ISO_INDEX_BOOT) ? -1 : 1;
+	return (ea->lsn < eb->lsn) ? -1 : ((ea->lsn > eb->lsn) ? 1 : 0);
+}
+
+// Extract all the files from the index that was built during the scan. The directories and
+// the boot payloads are processed first, in the order of the walk, and all the other files
+// then follow in the order of their LSN, so that the image is read (almost) sequentially.
+// Returns 0 on success, nonzero on error
+static int iso_extract_index(iso9660_t* p_iso)
+{
+	int r = 1;
+	iso_index_entry* e;
+	BOOL is_identical;
+	char psz_fullpath[MAX_PATH], *psz_sanpath;
+	const char *psz_path, *psz_basename;
+	LPFILETIME ft;
+	uint32_t i, k, nb_first = 0, *order;
+
+	order = malloc(max(iso_index.nb_entries, 1) * sizeof(uint32_t));
+	if (order == NULL) {
+		uprintf("Could not allocate the extraction order");
+		return 1;
+	}
+	for (i = 0; i < iso_index.nb_entries; i++) {
+		if (iso_index.entry[i].flags & (ISO_INDEX_DIR | ISO_INDEX_BOOT))
+			order[nb_first++] = i;
+	}
+	for (i = 0, k = nb_first; i < iso_index.nb_entries; i++) {
+		if (!(iso_index.entry[i].flags & (ISO_INDEX_DIR | ISO_INDEX_BOOT)))
+			order[k++] = i;
+	}
+	qsort(&order[nb_first], iso_index.nb_entries - nb_first, sizeof(uint32_t), iso_index_lsn_cmp);
+
+	UpdateProgressWithInfoInit(NULL, TRUE);
+	for (k = 0; k < iso_index.nb_entries; k++) {
+		if (FormatStatus || extract_pool.error)
+			goto out;
+		e = &iso_index.entry[order[k]];
+		psz_path = &iso_index.arena[e->dir];
+		psz_basename = &iso_index.arena[e->name];
+		// Leave some space for print_extracted_file() to append the size
+		if (_snprintf(psz_fullpath, sizeof(psz_fullpath) - 24, "%s%s/%s", psz_extract_dir, psz_path, psz_basename) < 0) {
+			uprintf("Path '%s/%s' is too long", psz_path, psz_basename);
+			goto out;
+		}
+		if ((e->flags & (ISO_INDEX_DIR | ISO_INDEX_PREBUILT)) == (ISO_INDEX_DIR | ISO_INDEX_PREBUILT)) {
+			continue;
+		} else if (e->flags & ISO_INDEX_DIR) {
+			psz_sanpath = sanitize_filename(psz_fullpath, &is_identical);
+			IGNORE_RETVAL(_mkdirU(psz_sanpath));
+			if (preserve_timestamps) {
+				ft = to_filetime(e->mtime);
+				set_directory_timestamp(psz_sanpath, ft, ft, ft);
+			}
+			free_sanitized_filename(psz_sanpath, psz_fullpath);
+		} else if (e->flags & ISO_INDEX_SKIP) {
+			uprintf("Skipping '%s' file from ISO image", psz_basename);
+		} else if (e->flags & ISO_INDEX_PREBUILT) {
+			continue;
+		} else if (IS_FAT(fs_type) && (e->size >= FOUR_GIGABYTES)) {
+			uprintf("Leaving '%s' to be split", psz_basename);
+		} else if (iso_extract_file(p_iso, psz_fullpath, psz_path, psz_basename, e->lsn, e->size, e->mtime,
+			&e->props, (e->flags & ISO_INDEX_SYMLINK) ? &iso_index.arena[e->symlink] : NULL) != 0) {
+			goto out;
+		}
+	}
+	r = 0;
+
+out:
+	free(order);
+	return r;
+}
+
+/*
+ * Offline FAT32 builder: in ISO mode, on a FAT32 partition that was just formatted, the
+ * directories and files from the ISO index are laid out directly on the locked volume,
+ * rather than created one by one through the Win32 file API, the file system driver and
+ * whatever antivirus is watching. Clusters are allocated in the order of the ISO LSNs, so
+ * that the file data is read from the image and written to the drive sequentially, except
+ * for the boot payloads, that we place first, right after the directories. This
+ * data is written before the directories and the FATs, so that, if we fail before we get
+ * to these, the volume is still the empty one we started with and the regular extraction
+ * can take over. Files that need to be patched or replaced are left out, for ExtractISO()
+ * to process, as it skips the entries that we marked as prebuilt.
+ */
+#define FAT_DIRENT_SIZE           32
+#define FAT_LFN_CHARS             13
+#define FAT_MAX_DIR_ENTRIES       65536
+#define FAT_ATTR_VOLUME_ID        0x08
+#define FAT_ATTR_DIRECTORY        0x10
+#define FAT_ATTR_ARCHIVE          0x20
+#define FAT_ATTR_LFN              0x0F
+#define FAT_NTRES_LOWER_BASE      0x08
+#define FAT_NTRES_LOWER_EXT       0x10
+#define FAT_EOC                   0x0FFFFFFF
+#define FAT_BUILD_BUFFER_SIZE     (8 * MB)
+
+#pragma pack(push, 1)
+typedef struct {
+	uint8_t name[11];
+	uint8_t attr;
+	uint8_t ntres;
+	uint8_t crt_time_tenth;
+	uint16_t crt_time;
+	uint16_t crt_date;
+	uint16_t lst_acc_date;
+	uint16_t fst_clus_hi;
+	uint16_t wrt_time;
+	uint16_t wrt_date;
+	uint16_t fst_clus_lo;
+	uint32_t file_size;
+} fat_dirent;
+
+typedef struct {
+	uint8_t ord;
+	uint16_t name1[5];
+	uint8_t attr;
+	uint8_t type;
+	uint8_t chksum;
+	uint16_t name2[6];
+	uint16_t fst_clus_lo;
+	uint16_t name3[2];
+} fat_lfn_dirent;
+#pragma pack(pop)
+
+typedef struct {
+	uint32_t parent;			// Index of the parent directory (fat_build.root for the root)
+	uint32_t cluster;			// First cluster (0 for empty files)
+	uint32_t nb_clusters;
+	uint32_t name;				// Offset of the UTF-16 name
+	uint16_t name_len;
+	uint8_t nb_lfn;				// Number of LFN entries (0 if the short name is the name)
+	uint8_t ntres;
+	uint8_t sfn[11];
+	BOOLEAN written;			// FALSE if the entry is left for ExtractISO()
+} fat_build_entry;
+
+static struct {
+	HANDLE hVolume;
+	DWORD bytes_per_sector, cluster_size;
+	uint64_t data_sector;		// First sector of cluster 2
+	uint32_t root;				// Index of the root in entry[] (i.e. the number of ISO index entries)
+	fat_build_entry* entry;
+	uint32_t *child_start, *child;	// The children of entry i are child[child_start[i]] to child[child_start[i + 1] - 1]
+	WCHAR* names;
+	uint32_t names_size, names_max;
+	uint8_t (*sfn_set)[11];
+	uint32_t sfn_set_mask;
+	BOOL has_label;
+	fat_dirent label;
+	uint8_t* buf;
+	uint32_t buf_pos, buf_cluster;
+} fat_build;
+
+static __inline BOOL is_sfn_char(WCHAR c)
+{
+	return ((c >= 'A') && (c <= 'Z')) || ((c >= '0') && (c <= '9')) ||
+		((c != 0) && (c < 0x80) && (strchr("!#$%&'()-@^_`{}~", (char)c) != NULL));
+}
+
+static void to_fat_time(time_t t, uint16_t* date, uint16_t* time)
+{
+	FILETIME ft;
+
+	if (!FileTimeToLocalFileTime(to_filetime(t), &ft) || !FileTimeToDosDateTime(&ft, date, time)) {
+		*date = (1 << 5) | 1;	// 1980.01.01
+		*time = 0;
+	}
+}
+
+static uint8_t fat_lfn_checksum(const uint8_t* sfn)
+{
+	uint8_t i, sum = 0;
+
+	for (i = 0; i < 11; i++)
+		sum = ((sum & 1) << 7) + (sum >> 1) + sfn[i];
+	return sum;
+}
+
+// Add a short name to the set of the current directory. Returns FALSE if that name is already in use.
+static BOOL fat_sfn_add(const uint8_t* sfn)
+{
+	uint32_t i, hash = 2166136261U;
+
+	for (i = 0; i < 11; i++)
+		hash = (hash ^ sfn[i]) * 16777619U;
+	for (i = hash & fat_build.sfn_set_mask; fat_build.sfn_set[i][0] != 0; i = (i + 1) & fat_build.sfn_set_mask) {
+		if (memcmp(fat_build.sfn_set[i], sfn, 11) == 0)
+			return FALSE;
+	}
+	memcpy(fat_build.sfn_set[i], sfn, 11);
+	return TRUE;
+}
+
+// Returns TRUE if a name can be used as is for a short name, with the case flags Windows uses
+static BOOL fat_exact_sfn(const WCHAR* name, uint32_t len, uint8_t* sfn, uint8_t* ntres)
+{
+	uint32_t i, j, dot = len;
+	uint8_t base_case = 0, ext_case = 0, *name_case;
+	WCHAR c;
+
+	for (i = 0; i < len; i++) {
+		if (name[i] == '.') {
+			if (dot != len)
+				return FALSE;
+			dot = i;
+		}
+	}
+	if ((dot == 0) || (dot > 8) || (dot + 1 == len) || (len - dot > 4))
+		return FALSE;
+	memset(sfn, ' ', 11);
+	for (i = 0, j = 0; i < len; i++) {
+		if (i == dot) {
+			j = 8;
+			continue;
+		}
+		c = name[i];
+		name_case = (i < dot) ? &base_case : &ext_case;
+		if ((c >= 'a') && (c <= 'z')) {
+			*name_case |= 2;
+			c -= 'a' - 'A';
+		} else if ((c >= 'A') && (c <= 'Z')) {
+			*name_case |= 1;
+		} else if (!is_sfn_char(c)) {
+			return FALSE;
+		}
+		sfn[j++] = (uint8_t)c;
+	}
+	if ((base_case == 3) || (ext_case == 3))
+		return FALSE;
+	*ntres = ((base_case == 2) ? FAT_NTRES_LOWER_BASE : 0) | ((ext_case == 2) ? FAT_NTRES_LOWER_EXT : 0);
+	return TRUE;
+}
+
+// Generate a "BASE~N.EXT" short name that isn't in use in the current directory
+static BOOL fat_generate_sfn(const WCHAR* name, uint32_t len, uint8_t* sfn)
+{
+	uint8_t base[8], ext[3];
+	char tail[8];
+	uint32_t i, n, dot, nb_base = 0, nb_ext = 0, tail_len, base_len;
+	WCHAR c;
+
+	// dot is the index right after the last '.', or 0 if there isn't one
+	for (dot = len; (dot > 0) && (name[dot - 1] != '.'); dot--);
+	for (i = 0; (i < ((dot == 0) ? len : dot - 1)) && (nb_base < sizeof(base)); i++) {
+		c = name[i];
+		if ((c == '.') || (c == ' '))
+			continue;
+		if ((c >= 'a') && (c <= 'z'))
+			c -= 'a' - 'A';
+		base[nb_base++] = is_sfn_char(c) ? (uint8_t)c : '_';
+	}
+	for (i = dot; (dot != 0) && (i < len) && (nb_ext < sizeof(ext)); i++) {
+		c = name[i];
+		if (c == ' ')
+			continue;
+		if ((c >= 'a') && (c <= 'z'))
+			c -= 'a' - 'A';
+		ext[nb_ext++] = is_sfn_char(c) ? (uint8_t)c : '_';
+	}
+	if (nb_base == 0)
+		base[nb_base++] = '_';
+	for (n = 1; n < 1000000; n++) {
+		tail_len = (uint32_t)_snprintf(tail, sizeof(tail), "~%u", n);
+		base_len = min(nb_base, 8 - tail_len);
+		memset(sfn, ' ', 11);
+		memcpy(sfn, base, base_len);
+		memcpy(&sfn[base_len], tail, tail_len);
+		memcpy(&sfn[8], ext, nb_ext);
+		if (fat_sfn_add(sfn))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+// Set the name an entry gets on FAT, with the same substitutions as sanitize_filename()
+static BOOL fat_set_name(fat_build_entry* fe, const char* name)
+{
+	WCHAR wname[256], *new_names;
+	uint32_t new_max;
+	int i, len;
+
+	len = MultiByteToWideChar(CP_UTF8, 0, name, -1, wname, ARRAYSIZE(wname)) - 1;
+	if (len <= 0)
+		return FALSE;
+	for (i = 0; i < len; i++) {
+		if ((wname[i] < 0x20) || (wname[i] == '"') || (wname[i] == '\\') || (wname[i] == '/'))
+			return FALSE;
+		if (wcschr(L"*?<>:|", wname[i]) != NULL)
+			wname[i] = '_';
+	}
+	// Windows would drop these
+	if ((wname[len - 1] == '.') || (wname[len - 1] == ' '))
+		return FALSE;
+	if (fat_build.names_size + len + 1 > fat_build.names_max) {
+		new_max = max(2 * fat_build.names_max, fat_build.names_max + len + 64 * KB);
+		new_names = realloc(fat_build.names, new_max * sizeof(WCHAR));
+		if (new_names == NULL)
+			return FALSE;
+		fat_build.names = new_names;
+		fat_build.names_max = new_max;
+	}
+	fe->name = fat_build.names_size;
+	fe->name_len = (uint16_t)len;
+	memcpy(&fat_build.names[fe->name], wname, (len + 1) * sizeof(WCHAR));
+	fat_build.names_size += len + 1;
+	return TRUE;
+}
+
+static int fat_name_cmp(const void* a, const void* b)
+{
+	return _wcsicmp(&fat_build.names[fat_build.entry[*(const uint32_t*)a].name],
+		&fat_build.names[fat_build.entry[*(const uint32_t*)b].name]);
+}
+
+// Assign the short names of the children of a directory, and return the number of clusters it needs
+static uint32_t fat_layout_dir(uint32_t d)
+{
+	uint32_t i, mask, nb_slots, nb = fat_build.child_start[d + 1] - fat_build.child_start[d];
+	uint32_t* child = &fat_build.child[fat_build.child_start[d]];
+	fat_build_entry* fe;
+	WCHAR* name;
+
+	qsort(child, nb, sizeof(uint32_t), fat_name_cmp);
+	for (i = 1; i < nb; i++) {
+		if (fat_name_cmp(&child[i - 1], &child[i]) == 0) {
+			uprintf("  '%s' has a name that FAT32 cannot tell apart from another one",
+				&iso_index.arena[iso_index.entry[child[i]].name]);
+			return 0;
 		}
-		safe_free(psz_fullpath);
 	}
-	return 0;
+	for (mask = 1; mask < 2 * nb + 2; mask <<= 1);
+	fat_build.sfn_set_mask = mask - 1;
+	memset(fat_build.sfn_set, 0, mask * sizeof(fat_build.sfn_set[0]));
+
+	// Reserve the short names that are actual names first, so that generated ones don't use them
+	for (i = 0; i < nb; i++) {
+		fe = &fat_build.entry[child[i]];
+		name = &fat_build.names[fe->name];
+		fe->nb_lfn = (fat_exact_sfn(name, fe->name_len, fe->sfn, &fe->ntres) && fat_sfn_add(fe->sfn)) ? 0 : 0xff;
+	}
+	nb_slots = (d == fat_build.root) ? (fat_build.has_label ? 1 : 0) : 2;
+	for (i = 0; i < nb; i++) {
+		fe = &fat_build.entry[child[i]];
+		if (fe->nb_lfn != 0) {
+			if (!fat_generate_sfn(&fat_build.names[fe->name], fe->name_len, fe->sfn))
+				return 0;
+			fe->ntres = 0;
+			fe->nb_lfn = (uint8_t)((fe->name_len + FAT_LFN_CHARS - 1) / FAT_LFN_CHARS);
+		}
+		nb_slots += 1 + fe->nb_lfn;
+	}
+	if (nb_slots > FAT_MAX_DIR_ENTRIES) {
+		uprintf("  Directory '%s' has too many entries for FAT32", (d == fat_build.root) ? "/" :
+			&iso_index.arena[iso_index.entry[d].name]);
+		return 0;
+	}
+	return max(1, (nb_slots * FAT_DIRENT_SIZE + fat_build.cluster_size - 1) / fat_build.cluster_size);
+}
 
-out:
-	if (p_udf_dirent != NULL)
-		udf_dirent_free(p_udf_dirent);
-	ISO_BLOCKING(safe_closehandle(file_handle));
-	safe_free(psz_sanpath);
-	safe_free(psz_fullpath);
-	return 1;
+static void fat_set_dirent(fat_dirent* de, const uint8_t* sfn, uint8_t attr, uint8_t ntres,
+	uint32_t cluster, uint32_t size, time_t mtime)
+{
+	memset(de, 0, sizeof(fat_dirent));
+	memcpy(de->name, sfn, sizeof(de->name));
+	de->attr = attr;
+	de->ntres = ntres;
+	to_fat_time(preserve_timestamps ? mtime : time(NULL), &de->wrt_date, &de->wrt_time);
+	de->crt_date = de->lst_acc_date = de->wrt_date;
+	de->crt_time = de->wrt_time;
+	de->fst_clus_hi = (uint16_t)(cluster >> 16);
+	de->fst_clus_lo = (uint16_t)cluster;
+	de->file_size = size;
 }
 
-// This updates the MD5SUMS/md5sum.txt file that some distros (Ubuntu, Mint...)
-// use to validate the media. Because we may alter some of the validated files
-// to add persistence and whatnot, we need to alter the MD5 list as a result.
-// The format of the file is expected to always be "<MD5SUM> <FILE_PATH>" on
-// individual lines.
-static void update_md5sum(void)
+// Fill the directory entries of a directory, in a zeroed buffer
+static void fat_fill_dir(uint32_t d, uint8_t* buf)
 {
-	BOOL display_header = TRUE;
-	intptr_t pos;
-	uint32_t i, j, size, md5_size;
-	uint8_t *buf = NULL, sum[16];
-	char md5_path[64], *md5_data = NULL, *str_pos;
+	fat_dirent* de = (fat_dirent*)buf;
+	fat_lfn_dirent* lfn;
+	fat_build_entry *fe, *parent;
+	iso_index_entry* e;
+	uint16_t chars[FAT_LFN_CHARS];
+	uint32_t i, j, k, pos;
+	uint8_t chksum;
+
+	if (d == fat_build.root) {
+		if (fat_build.has_label)
+			*de++ = fat_build.label;
+	} else {
+		fe = &fat_build.entry[d];
+		parent = &fat_build.entry[fe->parent];
+		fat_set_dirent(de++, (const uint8_t*)".          ", FAT_ATTR_DIRECTORY, 0, fe->cluster, 0,
+			iso_index.entry[d].mtime);
+		fat_set_dirent(de++, (const uint8_t*)"..         ", FAT_ATTR_DIRECTORY, 0,
+			(fe->parent == fat_build.root) ? 0 : parent->cluster, 0, iso_index.entry[d].mtime);
+	}
+	for (i = fat_build.child_start[d]; i < fat_build.child_start[d + 1]; i++) {
+		fe = &fat_build.entry[fat_build.child[i]];
+		e = &iso_index.entry[fat_build.child[i]];
+		chksum = fat_lfn_checksum(fe->sfn);
+		// The LFN entries are stored in reverse order, before the short name entry
+		for (k = fe->nb_lfn; k > 0; k--) {
+			lfn = (fat_lfn_dirent*)de++;
+			for (j = 0; j < FAT_LFN_CHARS; j++) {
+				pos = (k - 1) * FAT_LFN_CHARS + j;
+				chars[j] = (pos < fe->name_len) ? fat_build.names[fe->name + pos] : ((pos == fe->name_len) ? 0 : 0xffff);
+			}
+			lfn->ord = (uint8_t)(k | ((k == fe->nb_lfn) ? 0x40 : 0));
+			lfn->attr = FAT_ATTR_LFN;
+			lfn->chksum = chksum;
+			memcpy(lfn->name1, &chars[0], sizeof(lfn->name1));
+			memcpy(lfn->name2, &chars[5], sizeof(lfn->name2));
+			memcpy(lfn->name3, &chars[11], sizeof(lfn->name3));
+		}
+		fat_set_dirent(de++, fe->sfn, (e->flags & ISO_INDEX_DIR) ? FAT_ATTR_DIRECTORY : FAT_ATTR_ARCHIVE,
+			fe->ntres, fe->cluster, (e->flags & ISO_INDEX_DIR) ? 0 : (uint32_t)e->size, e->mtime);
+	}
+}
+
+// Write out the clusters accumulated in our buffer
+static BOOL fat_flush(void)
+{
+	DWORD spc = fat_build.cluster_size / fat_build.bytes_per_sector;
+
+	if (fat_build.buf_pos == 0)
+		return TRUE;
+	if (write_sectors(fat_build.hVolume, fat_build.bytes_per_sector, fat_build.data_sector +
+		(uint64_t)(fat_build.buf_cluster - 2) * spc, fat_build.buf_pos / fat_build.bytes_per_sector,
+		fat_build.buf) != (int64_t)fat_build.buf_pos)
+		return FALSE;
+	fat_build.buf_cluster += fat_build.buf_pos / fat_build.cluster_size;
+	fat_build.buf_pos = 0;
+	return TRUE;
+}
+
+// Directories are processed root first, then in the order of the index
+static __inline uint32_t fat_dir_at(uint32_t k)
+{
+	return (k == 0) ? fat_build.root : k - 1;
+}
+
+static __inline BOOL fat_is_dir(uint32_t d)
+{
+	return (d == fat_build.root) || (fat_build.entry[d].written && (iso_index.entry[d].flags & ISO_INDEX_DIR));
+}
+
+/*
+ * Lay out the content of an ISO on a freshly formatted FAT32 partition. Returns TRUE if the
+ * content was written, in which case ExtractISO() only processes what we left out, and FALSE
+ * if it wasn't, in which case FormatStatus is only set if the volume is no longer usable.
+ */
+BOOL WriteISOToFAT32(DWORD DriveIndex, uint64_t PartitionOffset, const char* src_iso)
+{
+	BOOL r = FALSE, committed = FALSE;
+	FAT_BOOTSECTOR32* bs = NULL;
+	FAT_FSINFO* fsinfo = NULL;
+	fat_dirent* de;
+	iso_index_entry* e;
+	fat_build_entry* fe;
+	iso9660_t* p_iso = NULL;
+	uint32_t i, j, k, d, nb, max_children = 0, max_cluster, next_cluster, nb_files = 0, *files = NULL, *fat = NULL;
+	uint32_t spc, fat_sectors, data_left, padded_left, chunk, valid, blocks;
+	uint64_t cluster_count;
+	lsn_t lsn;
 
-	if (!img_report.has_md5sum)
+	scan_only = FALSE;
+	memset(&fat_build, 0, sizeof(fat_build));
+	clear_iso_index_prebuilt();
+	if ((src_iso == NULL) || (iso_index.nb_entries == 0) || img_report.has_4GB_other_file)
+		return FALSE;
+	// Use the same extensions as ExtractISO() will, so that it picks up from our index
+	p_iso = iso9660_open_ext(src_iso, get_iso_extension_mask());
+	if ((p_iso == NULL) || !is_iso_index_usable(src_iso, get_iso_extension_mask(), iso9660_ifs_get_joliet_level(p_iso)))
 		goto out;
 
-	assert(img_report.has_md5sum <= ARRAYSIZE(md5sum_name));
-	if (img_report.has_md5sum > ARRAYSIZE(md5sum_name))
+	fat_build.hVolume = GetLogicalHandle(DriveIndex, PartitionOffset, TRUE, TRUE, FALSE);
+	if ((fat_build.hVolume == INVALID_HANDLE_VALUE) || (fat_build.hVolume == NULL)) {
+		fat_build.hVolume = NULL;
+		goto out;
+	}
+	UnmountVolume(fat_build.hVolume);
+	bs = (FAT_BOOTSECTOR32*)_mm_malloc(4 * KB, 4 * KB);
+	fsinfo = (FAT_FSINFO*)_mm_malloc(4 * KB, 4 * KB);
+	if ((bs == NULL) || (fsinfo == NULL) || (read_sectors(fat_build.hVolume, 512, 0, 1, bs) != 512))
+		goto out;
+	fat_build.bytes_per_sector = bs->wBytsPerSec;
+	fat_build.cluster_size = bs->bSecPerClus * bs->wBytsPerSec;
+	// We need clusters that are a multiple of the ISO block size, for our reads to fit
+	if ((bs->wBytsPerSec < 512) || (bs->wBytsPerSec > 4 * KB) || (bs->dFATSz32 == 0) || (bs->dRootClus != 2) ||
+		(bs->bNumFATs == 0) || (memcmp(bs->sBS_FilSysType, "FAT32   ", 8) != 0) ||
+		(fat_build.cluster_size < ISO_BLOCKSIZE) || (FAT_BUILD_BUFFER_SIZE % fat_build.cluster_size != 0))
+		goto out;
+	if ((bs->wBytsPerSec != 512) && (read_sectors(fat_build.hVolume, bs->wBytsPerSec, 0, 1, bs) != bs->wBytsPerSec))
+		goto out;
+	spc = bs->bSecPerClus;
+	fat_build.data_sector = bs->wRsvdSecCnt + (uint64_t)bs->bNumFATs * bs->dFATSz32;
+	cluster_count = (bs->dTotSec32 - fat_build.data_sector) / spc;
+	max_cluster = (uint32_t)min(cluster_count + 1, 0x0FFFFFF6);
+	if ((read_sectors(fat_build.hVolume, bs->wBytsPerSec, bs->wFSInfo, 1, fsinfo) != bs->wBytsPerSec) ||
+		(fsinfo->dLeadSig != 0x41615252) || (fsinfo->dStrucSig != 0x61417272))
 		goto out;
 
-	static_sprintf(md5_path, "%s\\%s", psz_extract_dir, md5sum_name[img_report.has_md5sum - 1]);
-	md5_size = read_file(md5_path, (uint8_t**)&md5_data);
-	if (md5_size == 0)
+	fat_build.buf = (uint8_t*)AllocIoBuffer(FAT_BUILD_BUFFER_SIZE);
+	if (fat_build.buf == NULL)
+		goto out;
+	// Only proceed with a root directory that has, at most, a volume label
+	if (read_sectors(fat_build.hVolume, bs->wBytsPerSec, fat_build.data_sector, spc, fat_build.buf)
+		!= (int64_t)fat_build.cluster_size)
 		goto out;
+	for (de = (fat_dirent*)fat_build.buf; (uint8_t*)de < &fat_build.buf[fat_build.cluster_size]; de++) {
+		if (de->name[0] == 0)
+			break;
+		if (de->name[0] == 0xe5)
+			continue;
+		if ((de->attr != FAT_ATTR_VOLUME_ID) || fat_build.has_label)
+			goto out;
+		fat_build.label = *de;
+		fat_build.has_label = TRUE;
+	}
 
-	for (i = 0; i < modified_path.Index; i++) {
-		str_pos = strstr(md5_data, &modified_path.String[i][2]);
-		if (str_pos == NULL)
-			// File is not listed in md5 sums
+	// Set the names and the tree
+	fat_build.root = iso_index.nb_entries;
+	fat_build.entry = (fat_build_entry*)calloc(fat_build.root + 1, sizeof(fat_build_entry));
+	fat_build.child_start = (uint32_t*)calloc(fat_build.root + 2, sizeof(uint32_t));
+	fat_build.child = (uint32_t*)calloc(fat_build.root, sizeof(uint32_t));
+	files = (uint32_t*)calloc(fat_build.root, sizeof(uint32_t));
+	if ((fat_build.entry == NULL) || (fat_build.child_start == NULL) || (fat_build.child == NULL) || (files == NULL))
+		goto out;
+	for (i = 0; i < fat_build.root; i++) {
+		e = &iso_index.entry[i];
+		fe = &fat_build.entry[i];
+		// The entries that need patching, replacing or skipping are left for ExtractISO()
+		if (e->flags & ISO_INDEX_SKIP)
 			continue;
-		if (display_header) {
-			uprintf("Updating %s:", md5_path);
-			display_header = FALSE;
+		if (!(e->flags & ISO_INDEX_DIR)) {
+			if (e->props.is_cfg || e->props.is_conf || (e->flags & ISO_INDEX_SYMLINK) || (e->size >= FOUR_GIGABYTES))
+				continue;
+			for (j = 0; (j < NB_OLD_C32) && !(e->props.is_old_c32[j] && use_own_c32[j]); j++);
+			if (j < NB_OLD_C32)
+				continue;
 		}
-		uprintf("● %s", &modified_path.String[i][2]);
-		pos = str_pos - md5_data;
-		size = read_file(modified_path.String[i], &buf);
-		if (size == 0)
+		fe->parent = (e->parent == UINT32_MAX) ? fat_build.root : e->parent;
+		if (!fat_build.entry[fe->parent].written && (fe->parent != fat_build.root))
+			goto out;
+		if (!fat_set_name(fe, &iso_index.arena[e->name])) {
+			uprintf("  '%s/%s' cannot be written as is on FAT32", &iso_index.arena[e->dir], &iso_index.arena[e->name]);
+			goto out;
+		}
+		fe->written = TRUE;
+		fat_build.child_start[fe->parent + 1]++;
+		if (!(e->flags & ISO_INDEX_DIR) && (e->size > 0))
+			files[nb_files++] = i;
+	}
+	for (d = 0; d <= fat_build.root; d++) {
+		max_children = max(max_children, fat_build.child_start[d + 1]);
+		fat_build.child_start[d + 1] += fat_build.child_start[d];
+	}
+	// Use the sizes we just set as the insertion positions, so that child_start[] ends where it should
+	for (d = fat_build.root + 1; d > 0; d--)
+		fat_build.child_start[d] = fat_build.child_start[d - 1];
+	for (i = 0; i < fat_build.root; i++) {
+		if (fat_build.entry[i].written)
+			fat_build.child[fat_build.child_start[fat_build.entry[i].parent + 1]++] = i;
+	}
+	for (nb = 1; nb < 2 * max_children + 2; nb <<= 1);
+	fat_build.sfn_set = calloc(nb, sizeof(fat_build.sfn_set[0]));
+	if (fat_build.sfn_set == NULL)
+		goto out;
+
+	// Allocate the clusters: the root and the other directories first, then the boot payloads and
+	// then all the other files, in LSN order, so that the former are contiguous and near the start
+	next_cluster = 2;
+	for (k = 0; k <= fat_build.root; k++) {
+		d = fat_dir_at(k);
+		if (!fat_is_dir(d))
 			continue;
-		HashBuffer(CHECKSUM_MD5, buf, size, sum);
-		free(buf);
-		while ((pos > 0) && (md5_data[pos - 1] != '\n'))
-			pos--;
-		for (j = 0; j < 16; j++) {
-			md5_data[pos + 2 * j] =     ((sum[j] >> 4) < 10) ? ('0' + (sum[j] >> 4)) : ('a' - 0xa + (sum[j] >> 4));
-			md5_data[pos + 2 * j + 1] = ((sum[j] & 15) < 10) ? ('0' + (sum[j] & 15)) : ('a' - 0xa + (sum[j] & 15));
+		fe = &fat_build.entry[d];
+		fe->nb_clusters = fat_layout_dir(d);
+		if (fe->nb_clusters == 0)
+			goto out;
+		fe->cluster = next_cluster;
+		next_cluster += fe->nb_clusters;
+	}
+	if (next_cluster > max_cluster + 1)
+		goto out;
+	qsort(files, nb_files, sizeof(uint32_t), iso_index_lsn_cmp);
+	fat_build.buf_cluster = next_cluster;
+	for (i = 0; i < nb_files; i++) {
+		fe = &fat_build.entry[files[i]];
+		fe->nb_clusters = (uint32_t)((iso_index.entry[files[i]].size + fat_build.cluster_size - 1) / fat_build.cluster_size);
+		fe->cluster = next_cluster;
+		if ((uint64_t)next_cluster + fe->nb_clusters > (uint64_t)max_cluster + 1) {
+			uprintf("  Not enough space for an offline FAT32 layout");
+			goto out;
 		}
+		next_cluster += fe->nb_clusters;
 	}
 
-	write_file(md5_path, md5_data, md5_size);
-	free(md5_data);
+	// Only proceed with a FAT that has nothing allocated besides the root, and that covers our layout
+	fat_sectors = (next_cluster * sizeof(uint32_t) + bs->wBytsPerSec - 1) / bs->wBytsPerSec;
+	fat = (uint32_t*)_mm_malloc((size_t)fat_sectors * bs->wBytsPerSec, 4 * KB);
+	if ((fat == NULL) || (fat_sectors > bs->dFATSz32) || (read_sectors(fat_build.hVolume, bs->wBytsPerSec,
+		bs->wRsvdSecCnt, fat_sectors, fat) != (int64_t)fat_sectors * bs->wBytsPerSec))
+		goto out;
+	if ((fat[2] & FAT_EOC) < 0x0FFFFFF8)
+		goto out;
+	for (i = 3; i < fat_sectors * bs->wBytsPerSec / sizeof(uint32_t); i++) {
+		if ((fat[i] & FAT_EOC) != 0)
+			goto out;
+	}
+	uprintf("Writing the ISO content directly onto the FAT32 volume (%d clusters)...", next_cluster - 2);
+
+	// Write the file data
+	for (i = 0; i < nb_files; i++) {
+		e = &iso_index.entry[files[i]];
+		fe = &fat_build.entry[files[i]];
+		lsn = e->lsn;
+		data_left = (uint32_t)e->size;
+		for (padded_left = fe->nb_clusters * fat_build.cluster_size; padded_left > 0; padded_left -= chunk) {
+			if (FormatStatus)
+				goto out;
+			chunk = min(padded_left, FAT_BUILD_BUFFER_SIZE - fat_build.buf_pos);
+			valid = min(chunk, data_left);
+			blocks = (valid + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE;
+			if ((blocks != 0) && (iso9660_iso_seek_read(p_iso, &fat_build.buf[fat_build.buf_pos], lsn, blocks)
+				!= (long)blocks * ISO_BLOCKSIZE)) {
+				uprintf("  Error reading ISO9660 file %s at LSN %lu", &iso_index.arena[e->name], (long unsigned int)lsn);
+				goto out;
+			}
+			memset(&fat_build.buf[fat_build.buf_pos + valid], 0, chunk - valid);
+			lsn += blocks;
+			data_left -= valid;
+			fat_build.buf_pos += chunk;
+			nb_blocks += blocks;
+			if ((fat_build.buf_pos == FAT_BUILD_BUFFER_SIZE) && !fat_flush())
+				goto out;
+			UpdateProgressWithInfo(OP_FILE_COPY, MSG_231, extracted_blocks(), total_blocks);
+		}
+	}
+	if (!fat_flush())
+		goto out;
+
+	// From here on, a failure leaves the volume in a state that the extraction cannot help with
+	committed = TRUE;
+	fat_build.buf_cluster = 2;
+	for (k = 0; k <= fat_build.root; k++) {
+		d = fat_dir_at(k);
+		if (!fat_is_dir(d))
+			continue;
+		fe = &fat_build.entry[d];
+		if (fat_build.buf_pos + fe->nb_clusters * fat_build.cluster_size > FAT_BUILD_BUFFER_SIZE) {
+			if (!fat_flush())
+				goto out;
+		}
+		memset(&fat_build.buf[fat_build.buf_pos], 0, fe->nb_clusters * fat_build.cluster_size);
+		fat_fill_dir(d, &fat_build.buf[fat_build.buf_pos]);
+		fat_build.buf_pos += fe->nb_clusters * fat_build.cluster_size;
+	}
+	if (!fat_flush())
+		goto out;
+
+	// Write the FATs, keeping the reserved entries that the format set
+	for (i = 0; i <= fat_build.root; i++) {
+		fe = &fat_build.entry[i];
+		if (fe->nb_clusters == 0)
+			continue;
+		for (j = 0; j < fe->nb_clusters - 1; j++)
+			fat[fe->cluster + j] = fe->cluster + j + 1;
+		fat[fe->cluster + j] = FAT_EOC;
+	}
+	for (i = 0; i < bs->bNumFATs; i++) {
+		if (write_sectors(fat_build.hVolume, bs->wBytsPerSec, bs->wRsvdSecCnt + (uint64_t)i * bs->dFATSz32,
+			fat_sectors, fat) != (int64_t)fat_sectors * bs->wBytsPerSec)
+			goto out;
+	}
+	fsinfo->dFree_Count = (DWORD)(cluster_count - (next_cluster - 2));
+	fsinfo->dNxt_Free = next_cluster;
+	if (write_sectors(fat_build.hVolume, bs->wBytsPerSec, bs->wFSInfo, 1, fsinfo) != bs->wBytsPerSec)
+		goto out;
+	if ((bs->wBkBootSec != 0) && (bs->wBkBootSec != 0xffff))
+		write_sectors(fat_build.hVolume, bs->wBytsPerSec, bs->wBkBootSec + bs->wFSInfo, 1, fsinfo);
+
+	for (i = 0; i < fat_build.root; i++) {
+		if (fat_build.entry[i].written)
+			iso_index.entry[i].flags |= ISO_INDEX_PREBUILT;
+	}
+	iso_index.prebuilt_blocks = nb_blocks;
+	uprintf("Wrote %d files directly onto the volume", nb_files);
+	r = TRUE;
 
 out:
-	StrArrayDestroy(&modified_path);
+	if (!r) {
+		if (committed) {
+			uprintf("Could not complete the offline FAT32 layout");
+			if (!IS_ERROR(FormatStatus))
+				FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT;
+		} else if (fat_build.hVolume != NULL) {
+			uprintf("Using regular file extraction instead of an offline FAT32 layout");
+		}
+		nb_blocks = 0;
+	}
+	if (fat_build.hVolume != NULL) {
+		// Have the file system driver pick up what we wrote
+		UnmountVolume(fat_build.hVolume);
+		safe_unlockclose(fat_build.hVolume);
+	}
+	if (p_iso != NULL)
+		iso9660_close(p_iso);
+	safe_mm_free(bs);
+	safe_mm_free(fsinfo);
+	safe_mm_free(fat);
+	safe_free_io_buffer(fat_build.buf);
+	safe_free(fat_build.entry);
+	safe_free(fat_build.child_start);
+	safe_free(fat_build.child);
+	safe_free(fat_build.names);
+	safe_free(fat_build.sfn_set);
+	safe_free(files);
+	return r;
 }
 
 // Returns 0 on success, >0 on error, <0 to ignore current dir
 static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 {
-	HANDLE file_handle = NULL;
-	DWORD buf_size, wr_size, err;
 	EXTRACT_PROPS props;
 	BOOL is_symlink, is_identical;
 	int length, r = 1;
-	char tmp[128], psz_fullpath[MAX_PATH], *psz_basename = NULL, *psz_sanpath = NULL;
+	char psz_fullpath[MAX_PATH], *psz_basename = NULL, *psz_sanpath = NULL;
 	const char *psz_iso_name = &psz_fullpath[strlen(psz_extract_dir)];
-	unsigned char buf[ISO_BLOCKSIZE];
 	CdioListNode_t* p_entnode;
 	iso9660_stat_t *p_statbuf;
 	CdioISO9660FileList_t* p_entlist;
-	size_t i;
-	lsn_t lsn;
+	uint32_t index_dir = UINT32_MAX, index_parent = UINT32_MAX;
 	int64_t file_length;
 
 	if ((p_iso == NULL) || (psz_path == NULL))
@@ -701,26 +2465,14 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 	if (psz_path[0] == 0)
 		UpdateProgressWithInfoInit(NULL, TRUE);
 	_CDIO_LIST_FOREACH(p_entnode, p_entlist) {
-		if (FormatStatus) goto out;
+		if (FormatStatus || extract_pool.error) goto out;
 		p_statbuf = (iso9660_stat_t*) _cdio_list_node_data(p_entnode);
 		if (scan_only && (p_statbuf->rr.b3_rock == yep) && enable_rockridge) {
-			if (p_statbuf->rr.u_su_fields & ISO_ROCK_SUF_PL) {
-				if (!img_report.has_deep_directories)
-					uprintf("  Note: The selected ISO uses Rock Ridge 'deep directories'.\r\n"
-						"  Because of this, it may take a very long time to scan or extract...");
+			// Rock Ridge 'deep directories' require an LSN lookup for each relocated directory,
+			// which libcdio serves from an index it builds on first use, so we can scan in full.
+			if ((p_statbuf->rr.u_su_fields & ISO_ROCK_SUF_PL) && !img_report.has_deep_directories) {
+				uprintf("  Note: The selected ISO uses Rock Ridge 'deep directories'");
 				img_report.has_deep_directories = TRUE;
-				// Due to the nature of the parsing of Rock Ridge deep directories
-				// which requires performing a *very costly* search of the whole
-				// ISO9660 file system to find the matching LSN, ISOs with loads of
-				// deep directory entries (e.g. OPNsense) are very slow to parse...
-				// To speed up the scan process, and since we expect deep directory
-				// entries to appear below anything we care for, we cut things
-				// short by telling the parent not to bother any further once we
-				// find that we are dealing with a deep directory.
-				r = -1;
-				// Add at least one extra block, since we're skipping content.
-				total_blocks++;
-				goto out;
 			}
 		}
 		// Eliminate . and .. entries
@@ -738,12 +2490,12 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 			is_symlink = (p_statbuf->rr.psz_symlink != NULL);
 			if (is_symlink)
 				img_report.has_symlinks = SYMLINKS_RR;
-			if (scan_only)
-				safe_free(p_statbuf->rr.psz_symlink);
 		} else {
 			iso9660_name_translate_ext(p_statbuf->filename, psz_basename, joliet_level);
 		}
 		if (p_statbuf->type == _STAT_DIR) {
+			if (is_symlink)
+				safe_free(p_statbuf->rr.psz_symlink);
 			if (!scan_only) {
 				psz_sanpath = sanitize_filename(psz_fullpath, &is_identical);
 				IGNORE_RETVAL(_mkdirU(psz_sanpath));
@@ -751,9 +2503,15 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 					LPFILETIME ft = to_filetime(mktime(&p_statbuf->tm));
 					set_directory_timestamp(psz_sanpath, ft, ft, ft);
 				}
-				safe_free(psz_sanpath);
+				free_sanitized_filename(psz_sanpath, psz_fullpath);
+			} else {
+				iso_index_add(&index_dir, psz_path, psz_basename, p_statbuf, ISO_INDEX_DIR, NULL);
+				index_parent = iso_index.cur_dir;
+				iso_index.cur_dir = iso_index.nb_entries - 1;
 			}
 			r = iso_extract_files(p_iso, psz_iso_name);
+			if (scan_only)
+				iso_index.cur_dir = index_parent;
 			if (r > 0)
 				goto out;
 			if (r < 0)	// Stop processing current dir
@@ -761,103 +2519,409 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 		} else {
 			file_length = p_statbuf->total_size;
 			if (check_iso_props(psz_path, file_length, psz_basename, psz_fullpath, &props)) {
-				continue;
-			}
-			print_extracted_file(psz_fullpath, file_length);
-			for (i = 0; i < NB_OLD_C32; i++) {
-				if (props.is_old_c32[i] && use_own_c32[i]) {
-					static_sprintf(tmp, "%s/syslinux-%s/%s", FILES_DIR, embedded_sl_version_str[0], old_c32_name[i]);
-					if (CopyFileU(tmp, psz_fullpath, FALSE)) {
-						uprintf("  Replaced with local version %s", IsFileInDB(tmp)?"✓":"✗");
-						break;
-					}
-					uprintf("  Could not replace file: %s", WindowsErrorString());
+				if (scan_only) {
+					capture_scan_probe(&props, NULL, p_iso, p_statbuf->lsn);
+					iso_index_add(&index_dir, psz_path, psz_basename, p_statbuf,
+						check_write_props(psz_path, psz_basename, &props) ? ISO_INDEX_SKIP : 0, &props);
 				}
-			}
-			if (i < NB_OLD_C32)
+				if (is_symlink)
+					safe_free(p_statbuf->rr.psz_symlink);
 				continue;
-			psz_sanpath = sanitize_filename(psz_fullpath, &is_identical);
-			if (!is_identical)
-				uprintf("  File name sanitized to '%s'", psz_sanpath);
-			if (is_symlink) {
-				if (file_length == 0)
-					uprintf("  Ignoring Rock Ridge symbolic link to '%s'", p_statbuf->rr.psz_symlink);
-				safe_free(p_statbuf->rr.psz_symlink);
-			}
-			file_handle = CreatePreallocatedFile(psz_sanpath, GENERIC_READ | GENERIC_WRITE,
-				FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, file_length);
-			if (file_handle == INVALID_HANDLE_VALUE) {
-				err = GetLastError();
-				uprintf("  Unable to create file: %s", WindowsErrorString());
-				if (((err == ERROR_ACCESS_DENIED) || (err == ERROR_INVALID_HANDLE)) &&
-					(safe_strcmp(&psz_sanpath[3], autorun_name) == 0))
-					uprintf(stupid_antivirus);
-				else
-					goto out;
-			} else for (i = 0; file_length > 0; i++) {
-				if (FormatStatus) goto out;
-				memset(buf, 0, ISO_BLOCKSIZE);
-				lsn = p_statbuf->lsn + (lsn_t)i;
-				if (iso9660_iso_seek_read(p_iso, buf, lsn, 1) != ISO_BLOCKSIZE) {
-					uprintf("  Error reading ISO9660 file %s at LSN %lu",
-						psz_iso_name, (long unsigned int)lsn);
-					goto out;
-				}
-				buf_size = (DWORD)MIN(file_length, ISO_BLOCKSIZE);
-				ISO_BLOCKING(r = WriteFileWithRetry(file_handle, buf, buf_size, &wr_size, WRITE_RETRIES));
-				if (!r) {
-					uprintf("  Error writing file: %s", WindowsErrorString());
-					goto out;
-				}
-				file_length -= ISO_BLOCKSIZE;
-				if (nb_blocks++ % PROGRESS_THRESHOLD == 0)
-					UpdateProgressWithInfo(OP_FILE_COPY, MSG_231, nb_blocks, total_blocks);
-			}
-			if (preserve_timestamps) {
-				LPFILETIME ft = to_filetime(mktime(&p_statbuf->tm));
-				if (!SetFileTime(file_handle, ft, ft, ft))
-					uprintf("  Could not set timestamp: %s", WindowsErrorString());
 			}
-			ISO_BLOCKING(safe_closehandle(file_handle));
-			if (props.is_cfg || props.is_conf)
-				fix_config(psz_sanpath, psz_path, psz_basename, &props);
-			safe_free(psz_sanpath);
+			r = iso_extract_file(p_iso, psz_fullpath, psz_path, psz_basename, p_statbuf->lsn, file_length,
+				mktime(&p_statbuf->tm), &props, p_statbuf->rr.psz_symlink);
+			if (is_symlink)
+				safe_free(p_statbuf->rr.psz_symlink);
+			if (r != 0)
+				goto out;
+		}
+	}
+	r = 0;
+
+out:
+	iso9660_filelist_free(p_entlist);
+	free_sanitized_filename(psz_sanpath, psz_fullpath);
+	return r;
+}
+
+void GetGrubVersion(char* buf, size_t buf_size)
+{
+	char *p, unauthorized[] = {'<', '>', ':', '|', '*', '?', '\\', '/'};
+	size_t i;
+	// The version follows the NUL terminated format string that uses it
+	const char grub_version_str[] = "GRUB  version %s";
+
+	p = FindBytes(buf, buf_size, grub_version_str, sizeof(grub_version_str));
+	if (p != NULL) {
+		p += sizeof(grub_version_str);
+		// The version may not be NUL terminated if it's at the very end of the buffer
+		i = min(strnlen(p, &buf[buf_size] - p), sizeof(img_report.grub2_version) - 1);
+		memcpy(img_report.grub2_version, p, i);
+		img_report.grub2_version[i] = 0;
+	}
+	// Sanitize the string
+	for (p = &img_report.grub2_version[0]; *p; p++) {
+		for (i=0; i<sizeof(unauthorized); i++) {
+			if (*p == unauthorized[i])
+				*p = '_';
 		}
 	}
-	r = 0;
+	// <Shakes fist angrily> "KASPERSKYYYYYY!!!..." (https://github.com/pbatard/rufus/issues/467)
+	// But seriously, these guys should know better than "security" through obscurity...
+	if (img_report.grub2_version[0] == '0')
+		img_report.grub2_version[0] = 0;
+}
+
+/*
+ * Scan cache: the same images tend to get selected over and over, so the results of a
+ * successful scan (the image report, along with the ISO index) are saved in the app data
+ * directory, to be reused when the same image gets selected again. An image is identified
+ * by its path, size and modification time, as well as a hash of its first and last MB
+ * (the former of which includes the PVD), which is also what the known images DB uses.
+ */
+#define SCAN_CACHE_MAGIC          "RfSC"
+#define SCAN_CACHE_VERSION        2
+#define SCAN_CACHE_HASH_SPAN      (1 * MB)
+#define SCAN_CACHE_MAX_ENTRIES    (16 * 1024 * 1024)
+
+typedef struct {
+	// Identity of the image and of the code that scanned it
+	char magic[4];
+	uint32_t version;
+	uint16_t rufus_version[3];
+	uint8_t options;
+	uint32_t report_size;
+	uint32_t entry_size;
+	char src[MAX_PATH];
+	int64_t src_size;
+	int64_t src_mtime;
+	uint8_t hash[32];
+	// Scan results (the image report follows this header, then the index entries and arena)
+	uint64_t total_blocks;
+	BOOLEAN has_ldlinux_c32;
+	BOOLEAN has_index;
+	uint8_t index_joliet_level;
+	iso_extension_mask_t index_mask;
+	uint32_t nb_entries;
+	uint32_t arena_size;
+} scan_cache_header;
+
+static scan_cache_header scan_cache_id;
+static char scan_cache_path[MAX_PATH];
+
+// Set the identity of an image, along with the path of its cache file
+static BOOL scan_cache_init(const char* src_iso)
+{
+	BOOL r = FALSE;
+	HANDLE h;
+	LARGE_INTEGER li;
+	DWORD size, head, rd;
+	uint8_t* buf = NULL;
+	uint32_t hash = 2166136261U;
+	const char* p;
+	struct __stat64 src_stat;
+
+	memset(&scan_cache_id, 0, sizeof(scan_cache_id));
+	scan_cache_path[0] = 0;
+	if ((app_data_dir[0] == 0) || (strlen(src_iso) >= sizeof(scan_cache_id.src)) ||
+		(_stat64U(src_iso, &src_stat) != 0) || (src_stat.st_size <= 0))
+		return FALSE;
+	memcpy(scan_cache_id.magic, SCAN_CACHE_MAGIC, sizeof(scan_cache_id.magic));
+	scan_cache_id.version = SCAN_CACHE_VERSION;
+	memcpy(scan_cache_id.rufus_version, rufus_version, sizeof(scan_cache_id.rufus_version));
+	scan_cache_id.options = (enable_joliet ? 1 : 0) | (enable_rockridge ? 2 : 0);
+	scan_cache_id.report_size = sizeof(RUFUS_IMG_REPORT);
+	scan_cache_id.entry_size = sizeof(iso_index_entry);
+	static_strcpy(scan_cache_id.src, src_iso);
+	scan_cache_id.src_size = src_stat.st_size;
+	scan_cache_id.src_mtime = src_stat.st_mtime;
+
+	size = (DWORD)min(src_stat.st_size, 2 * SCAN_CACHE_HASH_SPAN);
+	head = min(size, SCAN_CACHE_HASH_SPAN);
+	buf = (uint8_t*)malloc(size);
+	if (buf == NULL)
+		goto out;
+	h = CreateFileU(src_iso, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (h == INVALID_HANDLE_VALUE)
+		goto out;
+	r = ReadFile(h, buf, head, &rd, NULL) && (rd == head);
+	if (r && (size > head)) {
+		li.QuadPart = src_stat.st_size - (size - head);
+		r = SetFilePointerEx(h, li, NULL, FILE_BEGIN) &&
+			ReadFile(h, &buf[head], size - head, &rd, NULL) && (rd == size - head);
+	}
+	CloseHandle(h);
+	r = r && HashBuffer(CHECKSUM_SHA256, buf, size, scan_cache_id.hash);
+	if (!r)
+		goto out;
+
+	// FNV-1a of the path, as with the bad blocks journals
+	for (p = src_iso; *p != 0; p++)
+		hash = (hash ^ (uint8_t)tolower((uint8_t)*p)) * 16777619U;
+	static_sprintf(scan_cache_path, "%s\\%s", app_data_dir, FILES_DIR);
+	IGNORE_RETVAL(_mkdirExU(scan_cache_path));
+	static_sprintf(scan_cache_path, "%s\\%s\\scan_%08X.cache", app_data_dir, FILES_DIR, hash);
+
+out:
+	free(buf);
+	return r;
+}
+
+// Restore the results of a previous scan of the image identified by scan_cache_init()
+static BOOL load_scan_cache(void)
+{
+	BOOL r = FALSE;
+	FILE* fd;
+	scan_cache_header hdr;
+	RUFUS_IMG_REPORT report;
+	iso_index_entry* entry = NULL;
+	char* arena = NULL;
+
+	if (scan_cache_path[0] == 0)
+		return FALSE;
+	fd = fopenU(scan_cache_path, "rb");
+	if (fd == NULL)
+		return FALSE;
+	if ((fread(&hdr, sizeof(hdr), 1, fd) != 1) ||
+		(memcmp(&hdr, &scan_cache_id, offsetof(scan_cache_header, total_blocks)) != 0) ||
+		(fread(&report, sizeof(report), 1, fd) != 1))
+		goto out;
+	if (hdr.has_index) {
+		if ((hdr.nb_entries == 0) || (hdr.nb_entries > SCAN_CACHE_MAX_ENTRIES) || (hdr.arena_size == 0))
+			goto out;
+		entry = (iso_index_entry*)malloc((size_t)hdr.nb_entries * sizeof(iso_index_entry));
+		arena = (char*)malloc(hdr.arena_size);
+		if ((entry == NULL) || (arena == NULL) ||
+			(fread(entry, sizeof(iso_index_entry), hdr.nb_entries, fd) != hdr.nb_entries) ||
+			(fread(arena, 1, hdr.arena_size, fd) != hdr.arena_size) || (arena[hdr.arena_size - 1] != 0))
+			goto out;
+	}
+
+	img_report = report;
+	total_blocks = hdr.total_blocks;
+	has_ldlinux_c32 = hdr.has_ldlinux_c32;
+	free_iso_index();
+	if (hdr.has_index) {
+		static_strcpy(iso_index.src, hdr.src);
+		iso_index.src_size = hdr.src_size;
+		iso_index.src_mtime = (time_t)hdr.src_mtime;
+		iso_index.mask = hdr.index_mask;
+		iso_index.joliet_level = hdr.index_joliet_level;
+		iso_index.entry = entry;
+		iso_index.nb_entries = iso_index.max_entries = hdr.nb_entries;
+		iso_index.arena = arena;
+		iso_index.arena_size = iso_index.arena_max = hdr.arena_size;
+		iso_index.valid = TRUE;
+		entry = NULL;
+		arena = NULL;
+	}
+	r = TRUE;
+
+out:
+	fclose(fd);
+	free(entry);
+	free(arena);
+	return r;
+}
+
+static void save_scan_cache(void)
+{
+	BOOL r;
+	FILE* fd;
+	scan_cache_header hdr = scan_cache_id;
+	char tmp[MAX_PATH];
+
+	if (scan_cache_path[0] == 0)
+		return;
+	hdr.total_blocks = total_blocks;
+	hdr.has_ldlinux_c32 = has_ldlinux_c32;
+	hdr.has_index = iso_index.valid && (iso_index.nb_entries != 0);
+	if (hdr.has_index) {
+		hdr.index_joliet_level = iso_index.joliet_level;
+		hdr.index_mask = iso_index.mask;
+		hdr.nb_entries = iso_index.nb_entries;
+		hdr.arena_size = iso_index.arena_size;
+	}
+
+	// Write to a temporary file first, so that a crash cannot leave us with a truncated cache
+	static_sprintf(tmp, "%s.tmp", scan_cache_path);
+	fd = fopenU(tmp, "wb");
+	if (fd == NULL)
+		return;
+	r = (fwrite(&hdr, sizeof(hdr), 1, fd) == 1) && (fwrite(&img_report, sizeof(img_report), 1, fd) == 1);
+	if (r && hdr.has_index)
+		r = (fwrite(iso_index.entry, sizeof(iso_index_entry), hdr.nb_entries, fd) == hdr.nb_entries) &&
+			(fwrite(iso_index.arena, 1, hdr.arena_size, fd) == hdr.arena_size);
+	fclose(fd);
+	if (!r || !MoveFileExU(tmp, scan_cache_path, MOVEFILE_REPLACE_EXISTING)) {
+		uprintf("  Could not save scan results to '%s'", scan_cache_path);
+		DeleteFileU(tmp);
+	}
+}
 
-out:
-	ISO_BLOCKING(safe_closehandle(file_handle));
-	iso9660_filelist_free(p_entlist);
-	safe_free(psz_sanpath);
-	return r;
+/*
+ * Known images DB: a signed file, that we get from FILES_URL along with the update check, with
+ * the scan results of the images that get selected the most (Windows, Ubuntu, Fedora releases...),
+ * as produced by this version of Rufus. When an image has the same size and fingerprint as one of
+ * these, we use these results instead of going through the image, and only check the SHA-256 of
+ * the whole image in the background, before it gets written. The DB has no ISO index, so the
+ * extraction still goes through the image's file system.
+ */
+#define KNOWN_IMAGES_MAGIC        "RfKI"
+#define KNOWN_IMAGES_VERSION      1
+#define KNOWN_IMAGES_MAX_SIZE     (4 * MB)
+
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint16_t rufus_version[3];
+	uint8_t options;
+	uint32_t report_size;
+	uint32_t nb_entries;
+} known_images_header;
+
+typedef struct {
+	int64_t size;
+	uint8_t hash[32];				// SHA-256 of the first and last MB, as for the scan cache
+	uint8_t sha256[32];				// SHA-256 of the whole image
+	uint64_t total_blocks;
+	BOOLEAN has_ldlinux_c32;
+	RUFUS_IMG_REPORT report;
+} known_image_entry;
+
+/*
+ * Since the check runs on its own, it is only stopped by reset_known_image(), and not by the
+ * cancellation of an operation, which would otherwise fail it for good.
+ */
+static struct {
+	HANDLE hThread;
+	volatile BOOL abort;
+	volatile LONG status;			// 0 while checking, 1 if the image matched, -1 if it didn't
+	char* path;
+	uint8_t sha256[32];
+} known_image = { NULL };
+
+static DWORD WINAPI KnownImageCheckThread(void* param)
+{
+	uint8_t sum[32];
+	LONG status = -1;
+
+	SetThreadClass(GetCurrentThread(), THREAD_CLASS_BACKGROUND, 0);
+	if (HashFileAsyncEx(CHECKSUM_SHA256, known_image.path, sum, NULL, &known_image.abort)) {
+		if (memcmp(sum, known_image.sha256, sizeof(sum)) == 0)
+			status = 1;
+		else
+			uprintf("WARNING: '%s' is not the known image it was identified as!", known_image.path);
+	}
+	if (!known_image.abort)
+		InterlockedExchange(&known_image.status, status);
+	ExitThread(0);
 }
 
-void GetGrubVersion(char* buf, size_t buf_size)
+// Forget about the image we previously identified, if any, after stopping its check
+static void reset_known_image(void)
 {
-	char *p, unauthorized[] = {'<', '>', ':', '|', '*', '?', '\\', '/'};
-	size_t i;
-	const char grub_version_str[] = "GRUB  version %s";
+	if (known_image.hThread != NULL) {
+		known_image.abort = TRUE;
+		WaitForSingleObject(known_image.hThread, INFINITE);
+		safe_closehandle(known_image.hThread);
+	}
+	known_image.abort = FALSE;
+	InterlockedExchange(&known_image.status, 0);
+	safe_free(known_image.path);
+}
 
-	for (i=0; i<buf_size; i++) {
-		if (memcmp(&buf[i], grub_version_str, sizeof(grub_version_str)) == 0) {
-			static_strcpy(img_report.grub2_version, &buf[i + sizeof(grub_version_str)]);
-			break;
-		}
+// Look up the image identified by scan_cache_init() in the known images DB
+static BOOL load_known_image(void)
+{
+	BOOL r = FALSE;
+	FILE* fd;
+	char path[MAX_PATH];
+	uint8_t *buf = NULL, *sig = NULL;
+	size_t i, buf_len = 0, sig_len = 0;
+	known_images_header* hdr;
+	known_image_entry* entry;
+
+	if (scan_cache_path[0] == 0)
+		return FALSE;
+	static_sprintf(path, "%s\\%s\\%s", app_data_dir, FILES_DIR, KNOWN_IMAGES_DB);
+	fd = fopenU(path, "rb");
+	if (fd == NULL)
+		return FALSE;
+	buf = (uint8_t*)malloc(KNOWN_IMAGES_MAX_SIZE);
+	if (buf != NULL)
+		buf_len = fread(buf, 1, KNOWN_IMAGES_MAX_SIZE, fd);
+	fclose(fd);
+	strcat(path, ".sig");
+	fd = fopenU(path, "rb");
+	if (fd != NULL) {
+		sig = (uint8_t*)malloc(RSA_SIGNATURE_SIZE + 1);
+		if (sig != NULL)
+			sig_len = fread(sig, 1, RSA_SIGNATURE_SIZE + 1, fd);
+		fclose(fd);
 	}
-	// Sanitize the string
-	for (p = &img_report.grub2_version[0]; *p; p++) {
-		for (i=0; i<sizeof(unauthorized); i++) {
-			if (*p == unauthorized[i])
-				*p = '_';
-		}
+	hdr = (known_images_header*)buf;
+	// The DB is no more trusted than the server it came from, so we check its signature every time
+	if ((buf_len < sizeof(known_images_header)) || (buf_len >= KNOWN_IMAGES_MAX_SIZE) ||
+		(sig_len != RSA_SIGNATURE_SIZE) || !ValidateOpensslSignature(buf, (DWORD)buf_len, sig, (DWORD)sig_len)) {
+		uprintf("  Ignoring known images DB, as it could not be validated");
+		goto out;
 	}
-	// <Shakes fist angrily> "KASPERSKYYYYYY!!!..." (https://github.com/pbatard/rufus/issues/467)
-	// But seriously, these guys should know better than "security" through obscurity...
-	if (img_report.grub2_version[0] == '0')
-		img_report.grub2_version[0] = 0;
+	if ((memcmp(hdr->magic, KNOWN_IMAGES_MAGIC, sizeof(hdr->magic)) != 0) || (hdr->version != KNOWN_IMAGES_VERSION) ||
+		(memcmp(hdr->rufus_version, rufus_version, sizeof(hdr->rufus_version)) != 0) ||
+		(hdr->options != scan_cache_id.options) || (hdr->report_size != sizeof(RUFUS_IMG_REPORT)) ||
+		(buf_len != sizeof(known_images_header) + (size_t)hdr->nb_entries * sizeof(known_image_entry)))
+		goto out;
+
+	entry = (known_image_entry*)&buf[sizeof(known_images_header)];
+	for (i = 0; (i < hdr->nb_entries) && ((entry[i].size != scan_cache_id.src_size) ||
+		(memcmp(entry[i].hash, scan_cache_id.hash, sizeof(entry[i].hash)) != 0)); i++);
+	if (i >= hdr->nb_entries)
+		goto out;
+
+	known_image.path = safe_strdup(scan_cache_id.src);
+	if (known_image.path == NULL)
+		goto out;
+	memcpy(known_image.sha256, entry[i].sha256, sizeof(known_image.sha256));
+	known_image.hThread = CreateThread(NULL, 0, KnownImageCheckThread, NULL, 0, NULL);
+	if (known_image.hThread == NULL) {
+		uprintf("  Unable to start known image check thread");
+		safe_free(known_image.path);
+		goto out;
+	}
+	img_report = entry[i].report;
+	total_blocks = entry[i].total_blocks;
+	has_ldlinux_c32 = entry[i].has_ldlinux_c32;
+	free_iso_index();
+	r = TRUE;
+
+out:
+	free(buf);
+	free(sig);
+	return r;
+}
+
+/*
+ * Wait for the background check of an image that was identified from the known images DB, if
+ * any. Returns FALSE if the image is not the one it was identified as, or couldn't be checked,
+ * or if the operation was cancelled while waiting, in which case the check carries on, for the
+ * next attempt.
+ */
+BOOL CheckKnownImage(void)
+{
+	if (known_image.hThread == NULL)
+		return TRUE;
+	if (known_image.status == 0)
+		uprintf("Waiting for the validation of the image...");
+	while ((known_image.status == 0) && (WaitForSingleObject(known_image.hThread, 100) == WAIT_TIMEOUT)) {
+		if (IS_USER_CANCEL)
+			return FALSE;
+	}
+	return (known_image.status > 0);
 }
 
+static BOOL has_efi_img_bootloaders(iso9660_t* p_iso, const char* iso_path);
+
 BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 {
 	size_t i, j, size, sl_index = 0;
@@ -868,12 +2932,13 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 	iso9660_pvd_t pvd;
 	udf_t* p_udf = NULL;
 	udf_dirent_t* p_udf_root;
-	char *tmp, *buf, *ext;
+	char *tmp, *buf, ext[32];
 	char path[MAX_PATH], path2[16];
 	const char* basedir[] = { "i386", "amd64", "minint" };
 	const char* tmp_sif = ".\\txtsetup.sif~";
 	iso_extension_mask_t iso_extension_mask = ISO_EXTENSION_ALL;
 	char* spacing = "  ";
+	struct __stat64 src_stat;
 
 	if ((!enable_iso) || (src_iso == NULL) || (dest_dir == NULL))
 		return FALSE;
@@ -886,13 +2951,29 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 	// Change progress style to marquee for scanning
 	if (scan_only) {
 		uprintf("ISO analysis:");
-		SendMessage(hMainDialog, UM_PROGRESS_INIT, PBS_MARQUEE, 0);
+		// A new scan means that the image may have changed
+		CloseISOSession();
+		reset_known_image();
+		if (scan_cache_init(src_iso) && load_scan_cache()) {
+			uprintf("  Using the results from a previous scan of this image");
+			return TRUE;
+		}
+		// The known images DB check is for the image being written, not for the library
+		if (!scan_background && load_known_image()) {
+			uprintf("  Using the results from the known images DB for this image");
+			return TRUE;
+		}
+		if (!scan_background)
+			SendMessage(hMainDialog, UM_PROGRESS_INIT, PBS_MARQUEE, 0);
 		total_blocks = 0;
 		has_ldlinux_c32 = FALSE;
+		free_iso_index();
+		free_scan_probes();
 		// String array of all isolinux/syslinux locations
 		StrArrayCreate(&config_path, 8);
 		StrArrayCreate(&isolinux_path, 8);
-		PrintInfo(0, MSG_202);
+		if (!scan_background)
+			PrintInfo(0, MSG_202);
 	} else {
 		uprintf("Extracting files...\n");
 		IGNORE_RETVAL(_chdirU(app_data_dir));
@@ -904,6 +2985,8 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 		nb_blocks = 0;
 		iso_blocking_status = 0;
 		StrArrayCreate(&modified_path, 8);
+		StrArrayCreate(&modified_md5, 8);
+		start_extract_pool();
 	}
 
 	// First try to open as UDF - fallback to ISO if it failed
@@ -927,17 +3010,7 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 	goto out;
 
 try_iso:
-	// Perform our first scan with Joliet disabled (if Rock Ridge is enabled), so that we can find if
-	// there exists a Rock Ridge file with a name > 64 chars or if there are symlinks. If that is the
-	// case then we also disable Joliet during the extract phase.
-	if ((!enable_joliet) || (enable_rockridge && (scan_only || img_report.has_long_filename ||
-		(img_report.has_symlinks == SYMLINKS_RR)))) {
-		iso_extension_mask &= ~ISO_EXTENSION_JOLIET;
-	}
-	if (!enable_rockridge) {
-		iso_extension_mask &= ~ISO_EXTENSION_ROCK_RIDGE;
-	}
-
+	iso_extension_mask = get_iso_extension_mask();
 	p_iso = iso9660_open_ext(src_iso, iso_extension_mask);
 	if (p_iso == NULL) {
 		uprintf("%s'%s' doesn't look like an ISO image", spacing, src_iso);
@@ -947,21 +3020,43 @@ try_iso:
 	uprintf("%sImage is an ISO9660 image", spacing);
 	joliet_level = iso9660_ifs_get_joliet_level(p_iso);
 	if (scan_only) {
+		if (_stat64U(src_iso, &src_stat) != 0)
+			memset(&src_stat, 0, sizeof(src_stat));
 		if (iso9660_ifs_get_volume_id(p_iso, &tmp)) {
 			static_strcpy(img_report.label, tmp);
 			safe_free(tmp);
 		} else
 			img_report.label[0] = 0;
+		static_strcpy(iso_index.src, src_iso);
+		iso_index.src_size = src_stat.st_size;
+		iso_index.src_mtime = src_stat.st_mtime;
+		iso_index.mask = iso_extension_mask;
+		iso_index.joliet_level = joliet_level;
+		iso_index.building = TRUE;
+		r = iso_extract_files(p_iso, "");
+		iso_index.valid = iso_index.building && (r == 0);
+		iso_index.building = FALSE;
+		goto out;
+	}
+	if (iso_extension_mask & (ISO_EXTENSION_JOLIET|ISO_EXTENSION_ROCK_RIDGE))
+		uprintf("%sThis image will be extracted using %s extensions (if present)", spacing,
+			(iso_extension_mask & ISO_EXTENSION_JOLIET)?"Joliet":"Rock Ridge");
+	else
+		uprintf("%sThis image will not be extracted using any ISO extensions", spacing);
+	if (is_iso_index_usable(src_iso, iso_extension_mask, joliet_level)) {
+		uprintf("Using the ISO index from the scan (%u entries)", iso_index.nb_entries);
+		nb_blocks = iso_index.prebuilt_blocks;
+		r = iso_extract_index(p_iso);
 	} else {
-		if (iso_extension_mask & (ISO_EXTENSION_JOLIET|ISO_EXTENSION_ROCK_RIDGE))
-			uprintf("%sThis image will be extracted using %s extensions (if present)", spacing,
-				(iso_extension_mask & ISO_EXTENSION_JOLIET)?"Joliet":"Rock Ridge");
-		else
-			uprintf("%sThis image will not be extracted using any ISO extensions", spacing);
+		r = iso_extract_files(p_iso, "");
 	}
-	r = iso_extract_files(p_iso, "");
 
 out:
+	// Wait for the files that are still being written
+	if ((!scan_only) && (!stop_extract_pool()) && (r == 0))
+		r = 1;
+	if (!scan_only)
+		clear_iso_index_prebuilt();
 	iso_blocking_status = -1;
 	if (scan_only) {
 		struct __stat64 stat;
@@ -1006,20 +3101,28 @@ out:
 			for (i=0; i<isolinux_path.Index; i++) {
 				char isolinux_tmp[MAX_PATH];
 				static_sprintf(isolinux_tmp, "%s\\isolinux.tmp", temp_dir);
-				size = (size_t)ExtractISOFile(src_iso, isolinux_path.String[i], isolinux_tmp, FILE_ATTRIBUTE_NORMAL);
+				if ((i < SCAN_PROBE_MAX_ISOLINUX) && (scan_probes.isolinux[i].data != NULL)) {
+					size = scan_probes.isolinux[i].size;
+				} else {
+					size = (size_t)ExtractISOFile(src_iso, isolinux_path.String[i], isolinux_tmp, FILE_ATTRIBUTE_NORMAL);
+				}
 				if (size == 0) {
 					uprintf("  Could not access %s", isolinux_path.String[i]);
 				} else {
 					buf = (char*)calloc(size, 1);
 					if (buf == NULL) break;
-					fd = fopen(isolinux_tmp, "rb");
-					if (fd == NULL) {
-						free(buf);
-						continue;
+					if ((i < SCAN_PROBE_MAX_ISOLINUX) && (scan_probes.isolinux[i].data != NULL)) {
+						memcpy(buf, scan_probes.isolinux[i].data, size);
+					} else {
+						fd = fopen(isolinux_tmp, "rb");
+						if (fd == NULL) {
+							free(buf);
+							continue;
+						}
+						fread(buf, 1, size, fd);
+						fclose(fd);
 					}
-					fread(buf, 1, size, fd);
-					fclose(fd);
-					sl_version = GetSyslinuxVersion(buf, size, &ext);
+					sl_version = GetSyslinuxVersion(buf, size, ext, sizeof(ext));
 					if (img_report.sl_version == 0) {
 						static_strcpy(img_report.sl_version_ext, ext);
 						img_report.sl_version = sl_version;
@@ -1058,16 +3161,21 @@ out:
 					img_report.sl_version_str);
 			}
 		}
-		if (!IS_EFI_BOOTABLE(img_report) && HAS_EFI_IMG(img_report) && HasEfiImgBootLoaders()) {
+		// We can only reuse our handle if the EFI img path was found by walking it
+		if (!IS_EFI_BOOTABLE(img_report) && HAS_EFI_IMG(img_report) &&
+			((p_udf == NULL) ? has_efi_img_bootloaders(p_iso, src_iso) : HasEfiImgBootLoaders())) {
 			img_report.has_efi = 0x8000;
 		}
 		if (HAS_WINPE(img_report)) {
 			// In case we have a WinPE 1.x based iso, we extract and parse txtsetup.sif
 			// during scan, to see if /minint was provided for OsLoadOptions, as it decides
 			// whether we should use 0x80 or 0x81 as the disk ID in the MBR
-			static_sprintf(path, "/%s/txtsetup.sif",
-				basedir[((img_report.winpe&WINPE_I386) == WINPE_I386)?0:((img_report.winpe&WINPE_AMD64) == WINPE_AMD64?1:2)]);
-			ExtractISOFile(src_iso, path, tmp_sif, FILE_ATTRIBUTE_NORMAL);
+			i = ((img_report.winpe&WINPE_I386) == WINPE_I386)?0:((img_report.winpe&WINPE_AMD64) == WINPE_AMD64?1:2);
+			static_sprintf(path, "/%s/txtsetup.sif", basedir[i]);
+			if (scan_probes.txtsetup[i].data != NULL)
+				write_file(tmp_sif, scan_probes.txtsetup[i].data, scan_probes.txtsetup[i].size);
+			else
+				ExtractISOFile(src_iso, path, tmp_sif, FILE_ATTRIBUTE_NORMAL);
 			tmp = get_token_data_file("OsLoadOptions", tmp_sif);
 			if (tmp != NULL) {
 				for (i=0; i<strlen(tmp); i++)
@@ -1079,13 +3187,19 @@ out:
 			safe_free(tmp);
 		}
 		if (HAS_WININST(img_report)) {
-			img_report.wininst_version = GetInstallWimVersion(src_iso);
+			// The version is the 4th DWORD of the WIM header
+			if (scan_probes.wim_header.data != NULL)
+				img_report.wininst_version = bswap_uint32(((uint32_t*)scan_probes.wim_header.data)[3]);
+			else
+				img_report.wininst_version = GetInstallWimVersion(src_iso);
 		}
 		if (img_report.has_grub2) {
 			// In case we have a GRUB2 based iso, we extract boot/grub/i386-pc/normal.mod to parse its version
 			img_report.grub2_version[0] = 0;
+			if (scan_probes.grub_normal_mod.data != NULL) {
+				GetGrubVersion((char*)scan_probes.grub_normal_mod.data, scan_probes.grub_normal_mod.size);
 			// coverity[swapped_arguments]
-			if (GetTempFileNameU(temp_dir, APPLICATION_NAME, 0, path) != 0) {
+			} else if (GetTempFileNameU(temp_dir, APPLICATION_NAME, 0, path) != 0) {
 				size = (size_t)ExtractISOFile(src_iso, "boot/grub/i386-pc/normal.mod", path, FILE_ATTRIBUTE_NORMAL);
 				buf = (char*)calloc(size, 1);
 				fd = fopen(path, "rb");
@@ -1115,7 +3229,11 @@ out:
 			UINT value_len = 0;
 			// coverity[swapped_arguments]
 			if (GetTempFileNameU(temp_dir, APPLICATION_NAME, 0, path) != 0) {
-				size = (size_t)ExtractISOFile(src_iso, "sources/compatresources.dll", path, FILE_ATTRIBUTE_NORMAL);
+				// The version API needs a file, but we can at least avoid looking the DLL up again
+				if (scan_probes.compatresources.data != NULL)
+					write_file(path, scan_probes.compatresources.data, scan_probes.compatresources.size);
+				else
+					ExtractISOFile(src_iso, "sources/compatresources.dll", path, FILE_ATTRIBUTE_NORMAL);
 				ver_size = GetFileVersionInfoSizeU(path, &ver_handle);
 				if (ver_size != 0) {
 					buf = malloc(ver_size);
@@ -1137,7 +3255,11 @@ out:
 		}
 		StrArrayDestroy(&config_path);
 		StrArrayDestroy(&isolinux_path);
-		SendMessage(hMainDialog, UM_PROGRESS_EXIT, 0, 0);
+		free_scan_probes();
+		if ((r == 0) && (FormatStatus == 0))
+			save_scan_cache();
+		if (!scan_background)
+			SendMessage(hMainDialog, UM_PROGRESS_EXIT, 0, 0);
 	} else {
 		// Solus and other ISOs only provide EFI boot files in a FAT efi.img
 		if (img_report.has_efi == 0x8000)
@@ -1183,15 +3305,162 @@ out:
 			bled_exit();
 		}
 	}
+	// Now that no more files get added, the directories can get their timestamps
+	if (!scan_only)
+		apply_directory_timestamps((r == 0) && !FormatStatus);
 	if (p_iso != NULL)
 		iso9660_close(p_iso);
 	if (p_udf != NULL)
 		udf_close(p_udf);
-	if ((r != 0) && (FormatStatus == 0))
+	if ((r != 0) && (FormatStatus == 0) && !scan_background)
 		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|APPERR((scan_only?ERROR_ISO_SCAN:ERROR_ISO_EXTRACT));
 	return (r == 0);
 }
 
+/*
+ * Scan an image that isn't the selected one, for the sole purpose of filling the scan cache,
+ * so that the scan is instant when the image does get selected. Since the scan goes through
+ * the same globals as the one of the selected image, the caller must hold image_scan_lock and
+ * make sure that no image is selected, and we clear these globals once done. The progress and
+ * status aren't updated, and FormatStatus is left alone on error.
+ */
+BOOL ScanISOInBackground(const char* src_iso)
+{
+	BOOL r;
+
+	scan_background = TRUE;
+	r = ExtractISO(src_iso, "", TRUE);
+	scan_background = FALSE;
+	CloseISOSession();
+	free_iso_index();
+	memset(&img_report, 0, sizeof(img_report));
+	total_blocks = 0;
+	has_ldlinux_c32 = FALSE;
+	return r;
+}
+
+/*
+ * The single file accesses below, that are issued against the image we are working on all
+ * along the scan and the format operation, go through an image session. This keeps the UDF
+ * and ISO9660 handles of the image open, along with the location of the ISO9660 files that
+ * were looked up, so that each access doesn't have to reopen the image and walk its
+ * directories again. Note that, since libcdio keeps the UDF read position in the udf_t and
+ * has no means of rewinding a dirent, UDF files are still looked up from the cached root.
+ */
+#define ISO_SESSION_MAX_PATHS     32
+static struct {
+	SRWLOCK lock;
+	char* src;
+	BOOL udf_tried;
+	udf_t* p_udf;
+	udf_dirent_t* p_udf_root;
+	iso9660_t* p_iso;
+	uint32_t nb_paths;
+	struct {
+		char* path;
+		lsn_t lsn;
+		int64_t size;
+	} path[ISO_SESSION_MAX_PATHS];
+} iso_session = { SRWLOCK_INIT };
+
+// Must be called with the session lock held
+static void close_iso_session(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < iso_session.nb_paths; i++)
+		safe_free(iso_session.path[i].path);
+	iso_session.nb_paths = 0;
+	if (iso_session.p_udf_root != NULL)
+		udf_dirent_free(iso_session.p_udf_root);
+	iso_session.p_udf_root = NULL;
+	if (iso_session.p_udf != NULL)
+		udf_close(iso_session.p_udf);
+	iso_session.p_udf = NULL;
+	if (iso_session.p_iso != NULL)
+		iso9660_close(iso_session.p_iso);
+	iso_session.p_iso = NULL;
+	iso_session.udf_tried = FALSE;
+	safe_free(iso_session.src);
+}
+
+// Must be called with the session lock held
+static BOOL select_iso_session(const char* iso)
+{
+	if ((iso_session.src != NULL) && (strcmp(iso_session.src, iso) == 0))
+		return TRUE;
+	close_iso_session();
+	iso_session.src = safe_strdup(iso);
+	return (iso_session.src != NULL);
+}
+
+// Return the root of the UDF file system of the session image, or NULL if it isn't UDF
+static udf_dirent_t* get_session_udf_root(const char* iso)
+{
+	if (!select_iso_session(iso))
+		return NULL;
+	if (!iso_session.udf_tried) {
+		iso_session.udf_tried = TRUE;
+		iso_session.p_udf = udf_open(iso);
+		if (iso_session.p_udf == NULL)
+			return NULL;
+		iso_session.p_udf_root = udf_get_root(iso_session.p_udf, true, 0);
+		if (iso_session.p_udf_root == NULL)
+			uprintf("Could not locate UDF root directory");
+	}
+	return iso_session.p_udf_root;
+}
+
+static iso9660_t* get_session_iso(const char* iso)
+{
+	if (!select_iso_session(iso))
+		return NULL;
+	// Make sure to enable extensions, else we may not match the name of the file we are looking
+	// for since Rock Ridge may be needed to translate something like 'I386_PC' into 'i386-pc'...
+	if (iso_session.p_iso == NULL)
+		iso_session.p_iso = iso9660_open_ext(iso, ISO_EXTENSION_MASK);
+	return iso_session.p_iso;
+}
+
+// Look up the location of an ISO9660 file of the session image
+static BOOL get_session_iso_file(const char* iso_file, lsn_t* lsn, int64_t* size)
+{
+	uint32_t i;
+	iso9660_stat_t* p_statbuf;
+
+	for (i = 0; i < iso_session.nb_paths; i++) {
+		if (strcmp(iso_session.path[i].path, iso_file) == 0) {
+			*lsn = iso_session.path[i].lsn;
+			*size = iso_session.path[i].size;
+			return TRUE;
+		}
+	}
+	p_statbuf = iso9660_ifs_stat_translate(iso_session.p_iso, iso_file);
+	if (p_statbuf == NULL)
+		return FALSE;
+	*lsn = p_statbuf->lsn;
+	*size = p_statbuf->total_size;
+	safe_free(p_statbuf->rr.psz_symlink);
+	free(p_statbuf);
+	if (iso_session.nb_paths < ISO_SESSION_MAX_PATHS) {
+		iso_session.path[i].path = safe_strdup(iso_file);
+		if (iso_session.path[i].path != NULL) {
+			iso_session.path[i].lsn = *lsn;
+			iso_session.path[i].size = *size;
+			iso_session.nb_paths++;
+		}
+	}
+	return TRUE;
+}
+
+// Release the handles of the image we last accessed single files from
+void CloseISOSession(void)
+{
+	AcquireSRWLockExclusive(&iso_session.lock);
+	close_iso_session();
+	ReleaseSRWLockExclusive(&iso_session.lock);
+}
+
 int64_t ExtractISOFile(const char* iso, const char* iso_file, const char* dest_file, DWORD attributes)
 {
 	size_t i;
@@ -1200,12 +3469,11 @@ int64_t ExtractISOFile(const char* iso, const char* iso_file, const char* dest_f
 	char buf[UDF_BLOCKSIZE];
 	DWORD buf_size, wr_size;
 	iso9660_t* p_iso = NULL;
-	udf_t* p_udf = NULL;
 	udf_dirent_t *p_udf_root = NULL, *p_udf_file = NULL;
-	iso9660_stat_t *p_statbuf = NULL;
-	lsn_t lsn;
+	lsn_t lsn, file_lsn;
 	HANDLE file_handle = INVALID_HANDLE_VALUE;
 
+	AcquireSRWLockExclusive(&iso_session.lock);
 	file_handle = CreateFileU(dest_file, GENERIC_READ | GENERIC_WRITE,
 		FILE_SHARE_READ, NULL, CREATE_ALWAYS, attributes, NULL);
 	if (file_handle == INVALID_HANDLE_VALUE) {
@@ -1214,13 +3482,10 @@ int64_t ExtractISOFile(const char* iso, const char* iso_file, const char* dest_f
 	}
 
 	// First try to open as UDF - fallback to ISO if it failed
-	p_udf = udf_open(iso);
-	if (p_udf == NULL)
-		goto try_iso;
-
-	p_udf_root = udf_get_root(p_udf, true, 0);
+	p_udf_root = get_session_udf_root(iso);
 	if (p_udf_root == NULL) {
-		uprintf("Could not locate UDF root directory");
+		if (iso_session.p_udf == NULL)
+			goto try_iso;
 		goto out;
 	}
 	p_udf_file = udf_fopen(p_udf_root, iso_file);
@@ -1247,24 +3512,20 @@ int64_t ExtractISOFile(const char* iso, const char* iso_file, const char* dest_f
 	goto out;
 
 try_iso:
-	// Make sure to enable extensions, else we may not match the name of the file we are looking
-	// for since Rock Ridge may be needed to translate something like 'I386_PC' into 'i386-pc'...
-	p_iso = iso9660_open_ext(iso, ISO_EXTENSION_MASK);
+	p_iso = get_session_iso(iso);
 	if (p_iso == NULL) {
 		uprintf("Unable to open image '%s'", iso);
 		goto out;
 	}
 
-	p_statbuf = iso9660_ifs_stat_translate(p_iso, iso_file);
-	if (p_statbuf == NULL) {
+	if (!get_session_iso_file(iso_file, &file_lsn, &file_length)) {
 		uprintf("Could not get ISO-9660 file information for file %s", iso_file);
 		goto out;
 	}
 
-	file_length = p_statbuf->total_size;
 	for (i = 0; file_length > 0; i++) {
 		memset(buf, 0, ISO_BLOCKSIZE);
-		lsn = p_statbuf->lsn + (lsn_t)i;
+		lsn = file_lsn + (lsn_t)i;
 		if (iso9660_iso_seek_read(p_iso, buf, lsn, 1) != ISO_BLOCKSIZE) {
 			uprintf("  Error reading ISO9660 file %s at LSN %lu", iso_file, (long unsigned int)lsn);
 			goto out;
@@ -1280,90 +3541,116 @@ try_iso:
 
 out:
 	safe_closehandle(file_handle);
-	if (p_statbuf != NULL)
-		safe_free(p_statbuf->rr.psz_symlink);
-	safe_free(p_statbuf);
-	if (p_udf_root != NULL)
-		udf_dirent_free(p_udf_root);
 	if (p_udf_file != NULL)
 		udf_dirent_free(p_udf_file);
-	if (p_iso != NULL)
-		iso9660_close(p_iso);
-	if (p_udf != NULL)
-		udf_close(p_udf);
+	ReleaseSRWLockExclusive(&iso_session.lock);
 	return r;
 }
 
-uint32_t GetInstallWimVersion(const char* iso)
+/*
+ * Read size bytes, from offset, of a file residing in an ISO image, without having to go
+ * through the whole file. Returns the number of bytes read, which is less than size if the
+ * file ends before, or -1 on error.
+ */
+int64_t ReadISOFileRange(const char* iso, const char* iso_file, uint64_t offset, void* buf, uint32_t size)
 {
-	char *wim_path = NULL, *p, buf[UDF_BLOCKSIZE] = { 0 };
-	uint32_t* wim_header = (uint32_t*)buf, r = 0xffffffff;
+	char *path = NULL, *p, block[UDF_BLOCKSIZE];
+	uint8_t* dst = (uint8_t*)buf;
+	uint32_t skip;
+	ssize_t read_size;
+	int64_t file_length, r = -1;
 	iso9660_t* p_iso = NULL;
-	udf_t* p_udf = NULL;
 	udf_dirent_t *p_udf_root = NULL, *p_udf_file = NULL;
-	iso9660_stat_t *p_statbuf = NULL;
+	lsn_t lsn;
 
-	wim_path = safe_strdup(&img_report.wininst_path[0][2]);
-	if (wim_path == NULL)
+	AcquireSRWLockExclusive(&iso_session.lock);
+	path = safe_strdup(iso_file);
+	if (path == NULL)
 		goto out;
 	// UDF indiscriminately accepts slash or backslash delimiters,
 	// but ISO-9660 requires slash
-	for (p = wim_path; *p != 0; p++)
+	for (p = path; *p != 0; p++)
 		if (*p == '\\') *p = '/';
 
 	// First try to open as UDF - fallback to ISO if it failed
-	p_udf = udf_open(iso);
-	if (p_udf == NULL)
-		goto try_iso;
-
-	p_udf_root = udf_get_root(p_udf, true, 0);
+	p_udf_root = get_session_udf_root(iso);
 	if (p_udf_root == NULL) {
-		uprintf("Could not locate UDF root directory");
+		if (iso_session.p_udf == NULL)
+			goto try_iso;
 		goto out;
 	}
-	p_udf_file = udf_fopen(p_udf_root, wim_path);
+	p_udf_file = udf_fopen(p_udf_root, path);
 	if (!p_udf_file) {
-		uprintf("Could not locate file %s in ISO image", wim_path);
+		uprintf("Could not locate file %s in ISO image", path);
 		goto out;
 	}
-	if (udf_read_block(p_udf_file, buf, 1) != UDF_BLOCKSIZE) {
-		uprintf("Error reading UDF file %s", wim_path);
+	file_length = udf_get_file_length(p_udf_file);
+	if (offset >= (uint64_t)file_length) {
+		r = 0;
+		goto out;
+	}
+	size = (uint32_t)MIN(size, (uint64_t)file_length - offset);
+	skip = (uint32_t)(offset % UDF_BLOCKSIZE);
+	if (!udf_seek(p_udf_file, offset - skip)) {
+		uprintf("Could not seek UDF file %s", path);
 		goto out;
 	}
-	r = wim_header[3];
+	for (r = 0; r < size; skip = 0) {
+		read_size = udf_read_block(p_udf_file, block, 1);
+		if (read_size <= (ssize_t)skip) {
+			uprintf("Error reading UDF file %s", path);
+			r = -1;
+			goto out;
+		}
+		read_size = MIN(read_size - (ssize_t)skip, (ssize_t)(size - r));
+		memcpy(&dst[r], &block[skip], read_size);
+		r += read_size;
+	}
 	goto out;
 
 try_iso:
-	p_iso = iso9660_open_ext(iso, ISO_EXTENSION_MASK);
+	p_iso = get_session_iso(iso);
 	if (p_iso == NULL) {
 		uprintf("Could not open image '%s'", iso);
 		goto out;
 	}
-	p_statbuf = iso9660_ifs_stat_translate(p_iso, wim_path);
-	if (p_statbuf == NULL) {
-		uprintf("Could not get ISO-9660 file information for file %s", wim_path);
+	if (!get_session_iso_file(path, &lsn, &file_length)) {
+		uprintf("Could not get ISO-9660 file information for file %s", path);
 		goto out;
 	}
-	if (iso9660_iso_seek_read(p_iso, buf, p_statbuf->lsn, 1) != ISO_BLOCKSIZE) {
-		uprintf("Error reading ISO-9660 file %s at LSN %d", wim_path, p_statbuf->lsn);
+	if (offset >= (uint64_t)file_length) {
+		r = 0;
 		goto out;
 	}
-	r = wim_header[3];
+	size = (uint32_t)MIN(size, (uint64_t)file_length - offset);
+	skip = (uint32_t)(offset % ISO_BLOCKSIZE);
+	lsn += (lsn_t)(offset / ISO_BLOCKSIZE);
+	for (r = 0; r < size; skip = 0, lsn++) {
+		if (iso9660_iso_seek_read(p_iso, block, lsn, 1) != ISO_BLOCKSIZE) {
+			uprintf("Error reading ISO-9660 file %s at LSN %d", path, lsn);
+			r = -1;
+			goto out;
+		}
+		read_size = MIN(ISO_BLOCKSIZE - skip, size - (uint32_t)r);
+		memcpy(&dst[r], &block[skip], read_size);
+		r += read_size;
+	}
 
 out:
-	if (p_statbuf != NULL)
-		safe_free(p_statbuf->rr.psz_symlink);
-	safe_free(p_statbuf);
-	if (p_udf_root != NULL)
-		udf_dirent_free(p_udf_root);
 	if (p_udf_file != NULL)
 		udf_dirent_free(p_udf_file);
-	if (p_iso != NULL)
-		iso9660_close(p_iso);
-	if (p_udf != NULL)
-		udf_close(p_udf);
-	safe_free(wim_path);
-	return bswap_uint32(r);
+	ReleaseSRWLockExclusive(&iso_session.lock);
+	safe_free(path);
+	return r;
+}
+
+uint32_t GetInstallWimVersion(const char* iso)
+{
+	uint32_t wim_header[4];
+
+	if (ReadISOFileRange(iso, &img_report.wininst_path[0][2], 0, wim_header, sizeof(wim_header)) != sizeof(wim_header))
+		return 0xffffffff;
+	return bswap_uint32(wim_header[3]);
 }
 
 #define ISO_NB_BLOCKS 16
@@ -1371,6 +3658,11 @@ typedef struct {
 	iso9660_t*      p_iso;
 	lsn_t           lsn;
 	libfat_sector_t sec_start;
+	// Mapped view of the img, when we could get one, in which case buf is unused
+	HANDLE          hMapping;
+	uint8_t*        view;
+	uint8_t*        img;
+	uint64_t        img_size;
 	// Use a multi block buffer, to improve sector reads
 	uint8_t         buf[ISO_BLOCKSIZE * ISO_NB_BLOCKS];
 } iso9660_readfat_private;
@@ -1383,6 +3675,15 @@ int iso9660_readfat(intptr_t pp, void *buf, size_t secsize, libfat_sector_t sec)
 {
 	iso9660_readfat_private* p_private = (iso9660_readfat_private*)pp;
 
+	if (p_private->img != NULL) {
+		if ((sec + 1) * secsize > p_private->img_size) {
+			uprintf("iso9660_readfat: Sector %llu is past the end of %s", sec, img_report.efi_img_path);
+			return 0;
+		}
+		memcpy(buf, &p_private->img[sec * secsize], secsize);
+		return (int)secsize;
+	}
+
 	if (sizeof(p_private->buf) % secsize != 0) {
 		uprintf("iso9660_readfat: Sector size %d is not a divisor of %d", secsize, sizeof(p_private->buf));
 		return 0;
@@ -1404,49 +3705,122 @@ int iso9660_readfat(intptr_t pp, void *buf, size_t secsize, libfat_sector_t sec)
 }
 
 /*
- * Returns TRUE if an EFI bootloader exists in the img.
+ * Map the FAT img straight from the ISO file, so that the sectors libfat asks for, as well as
+ * the content of the files we extract, come from the view rather than through the multi block
+ * buffer. This is only done for images that reside on a fixed disk, since an I/O error on a
+ * mapped view raises an exception instead of failing a read.
  */
-BOOL HasEfiImgBootLoaders(void)
+static void map_fat_img(iso9660_readfat_private* p_private, const char* iso_path, uint64_t img_size)
 {
-	BOOL ret = FALSE;
-	iso9660_t* p_iso = NULL;
-	iso9660_stat_t* p_statbuf = NULL;
-	iso9660_readfat_private* p_private = NULL;
-	int32_t dc, c;
-	struct libfat_filesystem *lf_fs = NULL;
-	struct libfat_direntry direntry;
-	char name[12] = { 0 };
-	int i, j, k;
+	SYSTEM_INFO si;
+	HANDLE hFile;
+	wchar_t *wpath, volume[MAX_PATH];
+	uint64_t offset, base;
+	BOOL fixed = FALSE;
 
-	if ((image_path == NULL) || !HAS_EFI_IMG(img_report))
-		return FALSE;
-
-	p_iso = iso9660_open_ext(image_path, ISO_EXTENSION_MASK);
-	if (p_iso == NULL) {
-		uprintf("Could not open image '%s' as an ISO-9660 file system", image_path);
-		goto out;
+	if ((iso_path == NULL) || (img_size == 0) || (img_size > 1 * GB))
+		return;
+	wpath = utf8_to_wchar(iso_path);
+	if ((wpath != NULL) && GetVolumePathNameW(wpath, volume, ARRAYSIZE(volume)))
+		fixed = (GetDriveTypeW(volume) == DRIVE_FIXED);
+	free(wpath);
+	if (!fixed)
+		return;
+	hFile = CreateFileU(iso_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return;
+	// The mapping keeps its own reference to the file
+	p_private->hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(hFile);
+	if (p_private->hMapping == NULL)
+		return;
+	// Views must start on an allocation granularity boundary
+	GetSystemInfo(&si);
+	offset = (uint64_t)p_private->lsn * ISO_BLOCKSIZE;
+	base = offset - (offset % si.dwAllocationGranularity);
+	p_private->view = MapViewOfFile(p_private->hMapping, FILE_MAP_READ, (DWORD)(base >> 32), (DWORD)base,
+		(SIZE_T)(offset - base + img_size));
+	if (p_private->view == NULL) {
+		safe_closehandle(p_private->hMapping);
+		return;
 	}
+	p_private->img = &p_private->view[offset - base];
+	p_private->img_size = img_size;
+}
+
+static void close_fat_img(struct libfat_filesystem* lf_fs, iso9660_readfat_private* p_private)
+{
+	if (lf_fs != NULL)
+		libfat_close(lf_fs);
+	if (p_private == NULL)
+		return;
+	if (p_private->view != NULL)
+		UnmapViewOfFile(p_private->view);
+	safe_closehandle(p_private->hMapping);
+	free(p_private);
+}
+
+/*
+ * Open the FAT img of an already opened ISO-9660 image, that resides at iso_path.
+ */
+static struct libfat_filesystem* open_fat_img(iso9660_t* p_iso, const char* iso_path,
+	iso9660_readfat_private** pp_private)
+{
+	struct libfat_filesystem* lf_fs = NULL;
+	iso9660_stat_t* p_statbuf;
+	iso9660_readfat_private* p_private;
+
+	*pp_private = NULL;
 	p_statbuf = iso9660_ifs_stat_translate(p_iso, img_report.efi_img_path);
 	if (p_statbuf == NULL) {
 		uprintf("Could not get ISO-9660 file information for file %s\n", img_report.efi_img_path);
-		goto out;
+		return NULL;
 	}
-	p_private = malloc(sizeof(iso9660_readfat_private));
+	p_private = calloc(1, sizeof(iso9660_readfat_private));
 	if (p_private == NULL)
 		goto out;
 	p_private->p_iso = p_iso;
 	p_private->lsn = p_statbuf->lsn;
-	p_private->sec_start = 0;
+	map_fat_img(p_private, iso_path, p_statbuf->total_size);
 	// Populate our initial buffer
-	if (iso9660_iso_seek_read(p_private->p_iso, p_private->buf, p_private->lsn, ISO_NB_BLOCKS) != ISO_NB_BLOCKS * ISO_BLOCKSIZE) {
+	if ((p_private->img == NULL) && (iso9660_iso_seek_read(p_private->p_iso, p_private->buf, p_private->lsn,
+		ISO_NB_BLOCKS) != ISO_NB_BLOCKS * ISO_BLOCKSIZE)) {
 		uprintf("Error reading ISO-9660 file %s at LSN %lu\n", img_report.efi_img_path, (long unsigned int)p_private->lsn);
 		goto out;
 	}
 	lf_fs = libfat_open(iso9660_readfat, (intptr_t)p_private);
-	if (lf_fs == NULL) {
+	if (lf_fs == NULL)
 		uprintf("FAT access error");
+
+out:
+	if (lf_fs == NULL)
+		close_fat_img(NULL, p_private);
+	else
+		*pp_private = p_private;
+	safe_free(p_statbuf->rr.psz_symlink);
+	free(p_statbuf);
+	return lf_fs;
+}
+
+/*
+ * Returns TRUE if an EFI bootloader exists in the img, from an already opened ISO-9660 image.
+ */
+static BOOL has_efi_img_bootloaders(iso9660_t* p_iso, const char* iso_path)
+{
+	BOOL ret = FALSE;
+	iso9660_readfat_private* p_private = NULL;
+	int32_t dc, c;
+	struct libfat_filesystem *lf_fs = NULL;
+	struct libfat_direntry direntry;
+	char name[12] = { 0 };
+	int i, j, k;
+
+	if ((p_iso == NULL) || !HAS_EFI_IMG(img_report))
+		return FALSE;
+
+	lf_fs = open_fat_img(p_iso, iso_path, &p_private);
+	if (lf_fs == NULL)
 		goto out;
-	}
 
 	// Navigate to /EFI/BOOT
 	if (libfat_searchdir(lf_fs, 0, "EFI        ", &direntry) < 0)
@@ -1478,14 +3852,27 @@ BOOL HasEfiImgBootLoaders(void)
 	}
 
 out:
-	if (lf_fs != NULL)
-		libfat_close(lf_fs);
-	if (p_statbuf != NULL)
-		safe_free(p_statbuf->rr.psz_symlink);
-	safe_free(p_statbuf);
-	safe_free(p_private);
-	if (p_iso != NULL)
-		iso9660_close(p_iso);
+	close_fat_img(lf_fs, p_private);
+	return ret;
+}
+
+/*
+ * Returns TRUE if an EFI bootloader exists in the img.
+ */
+BOOL HasEfiImgBootLoaders(void)
+{
+	BOOL ret;
+	iso9660_t* p_iso;
+
+	if ((image_path == NULL) || !HAS_EFI_IMG(img_report))
+		return FALSE;
+
+	AcquireSRWLockExclusive(&iso_session.lock);
+	p_iso = get_session_iso(image_path);
+	if (p_iso == NULL)
+		uprintf("Could not open image '%s' as an ISO-9660 file system", image_path);
+	ret = has_efi_img_bootloaders(p_iso, image_path);
+	ReleaseSRWLockExclusive(&iso_session.lock);
 	return ret;
 }
 
@@ -1493,17 +3880,16 @@ BOOL DumpFatDir(const char* path, int32_t cluster)
 {
 	// We don't have concurrent calls to this function, so a static lf_fs is fine
 	static struct libfat_filesystem *lf_fs = NULL;
+	static iso9660_readfat_private* p_private = NULL;
 	void* buf;
 	char *target = NULL, *name = NULL;
 	BOOL ret = FALSE;
 	HANDLE handle = NULL;
-	DWORD size, written;
+	DWORD size, expected, written, n;
 	libfat_diritem_t diritem = { 0 };
 	libfat_dirpos_t dirpos = { cluster, -1, 0 };
-	libfat_sector_t s;
+	libfat_sector_t s, next;
 	iso9660_t* p_iso = NULL;
-	iso9660_stat_t* p_statbuf = NULL;
-	iso9660_readfat_private* p_private = NULL;
 
 	if (path == NULL)
 		return -1;
@@ -1517,27 +3903,9 @@ BOOL DumpFatDir(const char* path, int32_t cluster)
 			uprintf("Could not open image '%s' as an ISO-9660 file system", image_path);
 			goto out;
 		}
-		p_statbuf = iso9660_ifs_stat_translate(p_iso, img_report.efi_img_path);
-		if (p_statbuf == NULL) {
-			uprintf("Could not get ISO-9660 file information for file %s\n", img_report.efi_img_path);
-			goto out;
-		}
-		p_private = malloc(sizeof(iso9660_readfat_private));
-		if (p_private == NULL)
+		lf_fs = open_fat_img(p_iso, image_path, &p_private);
+		if (lf_fs == NULL)
 			goto out;
-		p_private->p_iso = p_iso;
-		p_private->lsn = p_statbuf->lsn;
-		p_private->sec_start = 0;
-		// Populate our initial buffer
-		if (iso9660_iso_seek_read(p_private->p_iso, p_private->buf, p_private->lsn, ISO_NB_BLOCKS) != ISO_NB_BLOCKS * ISO_BLOCKSIZE) {
-			uprintf("Error reading ISO-9660 file %s at LSN %lu\n", img_report.efi_img_path, (long unsigned int)p_private->lsn);
-			goto out;
-		}
-		lf_fs = libfat_open(iso9660_readfat, (intptr_t)p_private);
-		if (lf_fs == NULL) {
-			uprintf("FAT access error");
-			goto out;
-		}
 	}
 
 	do {
@@ -1577,19 +3945,27 @@ BOOL DumpFatDir(const char* path, int32_t cluster)
 				written = 0;
 				s = libfat_clustertosector(lf_fs, dirpos.cluster);
 				while ((s != 0) && (s < 0xFFFFFFFFULL) && (written < diritem.size)) {
-					buf = libfat_get_sector(lf_fs, s);
+					// With a mapped img, each run of contiguous sectors is written from the view at once
+					next = libfat_nextsector(lf_fs, s);
+					for (n = 1; (p_private->img != NULL) && (next == s + n) &&
+						((uint64_t)n * LIBFAT_SECTOR_SIZE < diritem.size - written); n++)
+						next = libfat_nextsector(lf_fs, next);
+					if (p_private->img != NULL)
+						buf = ((s + n) * LIBFAT_SECTOR_SIZE <= p_private->img_size) ?
+							&p_private->img[s * LIBFAT_SECTOR_SIZE] : NULL;
+					else
+						buf = libfat_get_sector(lf_fs, s);
 					if (buf == NULL)
 						FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_SECTOR_NOT_FOUND;
 					if (FormatStatus)
 						goto out;
-					size = MIN(LIBFAT_SECTOR_SIZE, diritem.size - written);
-					if (!WriteFileWithRetry(handle, buf, size, &size, WRITE_RETRIES) ||
-						(size != MIN(LIBFAT_SECTOR_SIZE, diritem.size - written))) {
+					expected = (DWORD)MIN((uint64_t)n * LIBFAT_SECTOR_SIZE, diritem.size - written);
+					if (!WriteFileWithRetry(handle, buf, expected, &size, WRITE_RETRIES) || (size != expected)) {
 						uprintf("Could not write '%s': %s", target, WindowsErrorString());
 						break;
 					}
 					written += size;
-					s = libfat_nextsector(lf_fs, s);
+					s = next;
 					// Trust me, you *REALLY* want to invoke libfat_flush() here
 					libfat_flush(lf_fs);
 				}
@@ -1605,14 +3981,9 @@ BOOL DumpFatDir(const char* path, int32_t cluster)
 
 out:
 	if (cluster == 0) {
-		if (lf_fs != NULL) {
-			libfat_close(lf_fs);
-			lf_fs = NULL;
-		}
-		if (p_statbuf != NULL)
-			safe_free(p_statbuf->rr.psz_symlink);
-		safe_free(p_statbuf);
-		safe_free(p_private);
+		close_fat_img(lf_fs, p_private);
+		lf_fs = NULL;
+		p_private = NULL;
 		if (p_iso != NULL)
 			iso9660_close(p_iso);
 	}
@@ -0,0 +1,307 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Job engine
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A job is a set of stages, that are run by a shared pool of worker threads, against a
+ * context that belongs to the job (rather than through globals), so that several jobs can
+ * be in flight at once. A stage can only depend on the stages that were added before it,
+ * and is started as soon as all of them have succeeded, which means that independent stages
+ * of the same job can run in parallel.
+ * Cancellation is cooperative: once a job is cancelled, or once one of its stages fails, the
+ * stages that haven't started yet are skipped, and the running ones are expected to check
+ * IsJobCancelled() and bail out on their own.
+ */
+
+#ifdef _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rufus.h"
+#include "missing.h"
+
+#define JOB_MAX_STAGES              32
+#define JOB_MAX_WORKERS             4
+
+enum job_stage_state {
+	JOB_STAGE_PENDING = 0,
+	JOB_STAGE_RUNNING,
+	JOB_STAGE_DONE,
+	JOB_STAGE_SKIPPED,
+};
+
+typedef struct {
+	const char* name;
+	JOB_STAGE run;
+	uint32_t depends_on;			// Bitmask of the stages that must succeed first
+	int state;
+	DWORD result;
+} job_stage;
+
+struct job {
+	const char* name;
+	void* context;
+	volatile LONG cancelled;
+	DWORD status;					// Result of the first stage that failed, if any
+	int nb_stages;
+	int nb_finished;
+	job_stage stage[JOB_MAX_STAGES];
+	HANDLE hDone;
+	HWND hNotify;
+	UINT notify_msg;
+	BOOL submitted;
+	JOB* next;
+};
+
+static struct {
+	SRWLOCK lock;
+	CONDITION_VARIABLE work_ready;
+	int nb_workers;
+	JOB* active;					// Jobs that have been submitted and haven't completed
+} job_engine = { SRWLOCK_INIT, CONDITION_VARIABLE_INIT };
+
+/*
+ * Create a job, that runs its stages against context, which must remain valid until the job
+ * has completed. The name is only used for logging.
+ */
+JOB* CreateJob(const char* name, void* context)
+{
+	JOB* job = (JOB*)calloc(1, sizeof(JOB));
+
+	if (job == NULL)
+		return NULL;
+	job->hDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (job->hDone == NULL) {
+		free(job);
+		return NULL;
+	}
+	job->name = name;
+	job->context = context;
+	return job;
+}
+
+/*
+ * Add a stage to a job that hasn't been submitted yet. depends_on is a bitmask of the indexes
+ * of the stages (as returned by this function) that must have succeeded before this one can
+ * start. A stage should return 0 on success, or a Windows error code.
+ * Returns the index of the new stage, or -1 on error.
+ */
+int AddJobStage(JOB* job, const char* name, JOB_STAGE stage, uint32_t depends_on)
+{
+	if ((job == NULL) || (stage == NULL) || job->submitted || (job->nb_stages >= JOB_MAX_STAGES) ||
+		((depends_on >> job->nb_stages) != 0))
+		return -1;
+	job->stage[job->nb_stages].name = name;
+	job->stage[job->nb_stages].run = stage;
+	job->stage[job->nb_stages].depends_on = depends_on;
+	return job->nb_stages++;
+}
+
+/*
+ * Have msg posted to hWnd when the job completes, with the job status as WPARAM and the job as LPARAM.
+ */
+void SetJobNotify(JOB* job, HWND hWnd, UINT msg)
+{
+	if ((job == NULL) || job->submitted)
+		return;
+	job->hNotify = hWnd;
+	job->notify_msg = msg;
+}
+
+// Must be called with the lock held
+static void SkipPendingStages(JOB* job)
+{
+	int i;
+
+	for (i = 0; i < job->nb_stages; i++) {
+		if (job->stage[i].state == JOB_STAGE_PENDING) {
+			job->stage[i].state = JOB_STAGE_SKIPPED;
+			job->nb_finished++;
+		}
+	}
+}
+
+// Must be called with the lock held
+static void CompleteJob(JOB* job)
+{
+	JOB** p;
+
+	for (p = &job_engine.active; (*p != NULL) && (*p != job); p = &(*p)->next);
+	if (*p != NULL)
+		*p = job->next;
+	if (job->hNotify != NULL)
+		PostMessage(job->hNotify, job->notify_msg, (WPARAM)job->status, (LPARAM)job);
+	SetEvent(job->hDone);
+}
+
+// Find a stage that can be started, and mark it as running. Must be called with the lock held.
+static BOOL GetReadyStage(JOB** job, int* index)
+{
+	JOB* j;
+	int i, k;
+
+	for (j = job_engine.active; j != NULL; j = j->next) {
+		for (i = 0; i < j->nb_stages; i++) {
+			if (j->stage[i].state != JOB_STAGE_PENDING)
+				continue;
+			for (k = 0; (k < i) && (!(j->stage[i].depends_on & (1U << k)) ||
+				(j->stage[k].state == JOB_STAGE_DONE)); k++);
+			if (k < i)
+				continue;
+			j->stage[i].state = JOB_STAGE_RUNNING;
+			*job = j;
+			*index = i;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static DWORD WINAPI JobWorkerThread(void* param)
+{
+	JOB* job;
+	int i;
+	DWORD r;
+
+	AcquireSRWLockExclusive(&job_engine.lock);
+	while (TRUE) {
+		if (!GetReadyStage(&job, &i)) {
+			SleepConditionVariableSRW(&job_engine.work_ready, &job_engine.lock, INFINITE, 0);
+			continue;
+		}
+		ReleaseSRWLockExclusive(&job_engine.lock);
+		r = job->stage[i].run(job, job->context);
+		AcquireSRWLockExclusive(&job_engine.lock);
+		job->stage[i].result = r;
+		job->stage[i].state = JOB_STAGE_DONE;
+		job->nb_finished++;
+		if (r != 0) {
+			uprintf("Job '%s': Stage '%s' failed (0x%08X)", job->name, job->stage[i].name, r);
+			if (job->status == 0)
+				job->status = r;
+			InterlockedExchange(&job->cancelled, 1);
+		}
+		if (job->cancelled)
+			SkipPendingStages(job);
+		if (job->nb_finished == job->nb_stages)
+			CompleteJob(job);
+		// The completion of this stage may have unblocked others
+		WakeAllConditionVariable(&job_engine.work_ready);
+	}
+	return 0;
+}
+
+/*
+ * Queue a job for execution. The worker threads are started on first use, and stay around,
+ * waiting for jobs, until we exit. Returns FALSE if the job can't be run, in which case the
+ * caller should fall back to doing the work itself.
+ */
+BOOL SubmitJob(JOB* job)
+{
+	BOOL r = FALSE;
+	HANDLE hThread;
+
+	if ((job == NULL) || job->submitted || (job->nb_stages == 0))
+		return FALSE;
+	AcquireSRWLockExclusive(&job_engine.lock);
+	while (job_engine.nb_workers < JOB_MAX_WORKERS) {
+		hThread = CreateThread(NULL, 0, JobWorkerThread, NULL, 0, NULL);
+		if (hThread == NULL) {
+			uprintf("Unable to start job worker thread: %s", WindowsErrorString());
+			break;
+		}
+		SetThreadPriority(hThread, default_thread_priority);
+		CloseHandle(hThread);
+		job_engine.nb_workers++;
+	}
+	if (job_engine.nb_workers != 0) {
+		job->submitted = TRUE;
+		job->next = job_engine.active;
+		job_engine.active = job;
+		WakeAllConditionVariable(&job_engine.work_ready);
+		r = TRUE;
+	}
+	ReleaseSRWLockExclusive(&job_engine.lock);
+	return r;
+}
+
+/*
+ * Request the cancellation of a job. The stages that haven't started are skipped and the
+ * job status is set to ERROR_CANCELLED, unless a stage had already failed.
+ */
+void CancelJob(JOB* job)
+{
+	if (job == NULL)
+		return;
+	AcquireSRWLockExclusive(&job_engine.lock);
+	InterlockedExchange(&job->cancelled, 1);
+	if (job->submitted && (job->nb_finished < job->nb_stages)) {
+		if (job->status == 0)
+			job->status = ERROR_CANCELLED;
+		SkipPendingStages(job);
+		if (job->nb_finished == job->nb_stages)
+			CompleteJob(job);
+	}
+	ReleaseSRWLockExclusive(&job_engine.lock);
+}
+
+/*
+ * To be polled by the stages that take a while, so that they can abort early.
+ */
+BOOL IsJobCancelled(JOB* job)
+{
+	return (job != NULL) && (job->cancelled != 0);
+}
+
+/*
+ * Wait for a job to complete. Returns the job status (0 on success), or WAIT_TIMEOUT.
+ */
+DWORD WaitJob(JOB* job, DWORD timeout)
+{
+	DWORD r;
+
+	if ((job == NULL) || !job->submitted)
+		return ERROR_INVALID_PARAMETER;
+	if (WaitForSingleObject(job->hDone, timeout) != WAIT_OBJECT_0)
+		return WAIT_TIMEOUT;
+	AcquireSRWLockShared(&job_engine.lock);
+	r = job->status;
+	ReleaseSRWLockShared(&job_engine.lock);
+	return r;
+}
+
+/*
+ * Free a job, after cancelling it and waiting for its running stages, if it hasn't completed.
+ */
+void FreeJob(JOB* job)
+{
+	if (job == NULL)
+		return;
+	if (job->submitted) {
+		CancelJob(job);
+		WaitForSingleObject(job->hDone, INFINITE);
+	}
+	CloseHandle(job->hDone);
+	free(job);
+}
@@ -88,6 +88,13 @@ extern "C" {
   ssize_t udf_read_block(const udf_dirent_t *p_udf_dirent, 
 			 void * buf, size_t count);
 
+  /**
+    Set the position from which the next udf_read_block() reads, as a
+    byte offset from the start of the file. Return false if the offset
+    lies past the end of the file.
+  */
+  bool udf_seek(const udf_dirent_t *p_udf_dirent, int64_t i_offset);
+
   /**
     Advances p_udf_direct to the the next directory entry in the
     pointed to by p_udf_dir. It also returns this as the value.  NULL
@@ -104,6 +104,20 @@ bool cdio_charset_to_utf8(const char *src, size_t src_len, cdio_utf8_t **dst,
  */
 wchar_t* cdio_utf8_to_wchar(const char* str);
 
+/** \brief Convert an UCS-2BE string to UTF-8 into a caller provided buffer
+ *  \param src Source string
+ *  \param src_len Length of the source string, in bytes
+ *  \param dst Destination buffer
+ *  \param dst_size Size of the destination buffer, including the NUL terminator
+ *  \returns the length of the converted string, or -1 if the conversion was
+ *  unsuccessful (including when dst is too small).
+ *  This avoids the allocations of cdio_charset_to_utf8() when converting a large
+ *  number of short strings, such as the names from ISO directory records.
+ *  This is a convenience function available on Windows platforms only.
+ */
+int cdio_ucs2be_to_utf8_no_alloc(const char *src, size_t src_len, cdio_utf8_t *dst,
+                                 size_t dst_size);
+
 #include <stdio.h> /* for FILE */
 /** \brief Provides an UTF-8 compliant version of fopen for Windows
  *  The parameters and return value are the same as fopen().
@@ -91,18 +91,144 @@ static inline int _stati64_utf8(const char *path, struct _stati64 *buffer) {
 
 #define CDIO_STDIO_BUFSIZE (128*1024)
 
+/* On Windows, images that reside on a fixed drive are read through views of a
+   file mapping rather than through fread(), which avoids the copies into the
+   stdio buffers as well as one system call per read. The views are remapped as
+   reads move outside of them and are kept small on 32 bit, for address space. */
+#if defined(_WIN32)
+#include <windows.h>
+#if defined(_WIN64)
+#define CDIO_MMAP_WINDOW (1024*1024*1024)
+#else
+#define CDIO_MMAP_WINDOW (64*1024*1024)
+#endif
+#endif
+
 typedef struct {
   char *pathname;
   FILE *fd;
   char *fd_buf;
   off_t st_size; /* used only for source */
+#if defined(_WIN32)
+  bool b_mmap;
+  HANDLE h_file;
+  HANDLE h_mapping;
+  uint8_t *p_view;
+  off_t view_offset;
+  size_t view_size;
+  off_t position;
+#endif
 } _UserData;
 
+#if defined(_WIN32)
+/* Only use a file mapping for files on fixed drives, since a read error on a
+   mapped view raises an exception rather than returning an error code. */
+static bool
+_mmap_is_usable(const char *pathname, off_t st_size)
+{
+  wchar_t* wpath;
+  wchar_t wroot[MAX_PATH];
+  bool r = false;
+
+  if (st_size <= 0)
+    return false;
+  wpath = cdio_utf8_to_wchar(pathname);
+  if (wpath == NULL)
+    return false;
+  if (GetVolumePathNameW(wpath, wroot, MAX_PATH))
+    r = (GetDriveTypeW(wroot) == DRIVE_FIXED);
+  cdio_free(wpath);
+  return r;
+}
+
+static void
+_mmap_close(_UserData *ud)
+{
+  if (ud->p_view != NULL)
+    UnmapViewOfFile(ud->p_view);
+  ud->p_view = NULL;
+  ud->view_size = 0;
+  if (ud->h_mapping != NULL)
+    CloseHandle(ud->h_mapping);
+  ud->h_mapping = NULL;
+  if (ud->h_file != INVALID_HANDLE_VALUE)
+    CloseHandle(ud->h_file);
+  ud->h_file = INVALID_HANDLE_VALUE;
+}
+
+static bool
+_mmap_open(_UserData *ud)
+{
+  wchar_t* wpath = cdio_utf8_to_wchar(ud->pathname);
+
+  if (wpath == NULL)
+    return false;
+  ud->h_file = CreateFileW(wpath, GENERIC_READ, FILE_SHARE_READ, NULL,
+                           OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  cdio_free(wpath);
+  if (ud->h_file == INVALID_HANDLE_VALUE)
+    return false;
+  ud->h_mapping = CreateFileMappingW(ud->h_file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (ud->h_mapping == NULL) {
+    _mmap_close(ud);
+    return false;
+  }
+  ud->position = 0;
+  return true;
+}
+
+static ssize_t
+_mmap_read(_UserData *ud, void *buf, size_t count)
+{
+  size_t size, read_count = 0;
+  off_t view_end;
+
+  while (read_count < count && ud->position < ud->st_size) {
+    view_end = ud->view_offset + (off_t)ud->view_size;
+    if (ud->p_view == NULL || ud->position < ud->view_offset || ud->position >= view_end) {
+      if (ud->p_view != NULL)
+        UnmapViewOfFile(ud->p_view);
+      /* The window is a multiple of the allocation granularity */
+      ud->view_offset = ud->position & ~((off_t)CDIO_MMAP_WINDOW - 1);
+      ud->view_size = (size_t)(((ud->st_size - ud->view_offset) < CDIO_MMAP_WINDOW) ?
+                               (ud->st_size - ud->view_offset) : CDIO_MMAP_WINDOW);
+      ud->p_view = MapViewOfFile(ud->h_mapping, FILE_MAP_READ,
+                                 (DWORD)((uint64_t)ud->view_offset >> 32),
+                                 (DWORD)ud->view_offset, ud->view_size);
+      if (ud->p_view == NULL) {
+        cdio_error ("MapViewOfFile (): error %lu", GetLastError());
+        ud->view_size = 0;
+        break;
+      }
+      view_end = ud->view_offset + (off_t)ud->view_size;
+    }
+    size = (size_t)(view_end - ud->position);
+    if (size > count - read_count)
+      size = count - read_count;
+    memcpy((uint8_t*)buf + read_count, &ud->p_view[ud->position - ud->view_offset], size);
+    read_count += size;
+    ud->position += size;
+  }
+  if (read_count != count)
+    cdio_debug ("_mmap_read (): EOF encountered");
+
+  return read_count;
+}
+#endif
+
 static int
 _stdio_open (void *user_data)
 {
   _UserData *const ud = user_data;
 
+#if defined(_WIN32)
+  if (ud->b_mmap) {
+    if (_mmap_open(ud))
+      return 0;
+    cdio_debug ("could not map `%s', falling back to stdio", ud->pathname);
+    ud->b_mmap = false;
+  }
+#endif
   if ((ud->fd = CDIO_FOPEN (ud->pathname, "rb")))
     {
       ud->fd_buf = calloc (1, CDIO_STDIO_BUFSIZE);
@@ -117,6 +243,12 @@ _stdio_close(void *user_data)
 {
   _UserData *const ud = user_data;
 
+#if defined(_WIN32)
+  if (ud->b_mmap) {
+    _mmap_close(ud);
+    return 0;
+  }
+#endif
   if (fclose (ud->fd))
     cdio_error ("fclose (): %s", strerror (errno));
 
@@ -138,6 +270,10 @@ _stdio_free(void *user_data)
 
   if (ud->fd) /* should be NULL anyway... */
     _stdio_close(user_data);
+#if defined(_WIN32)
+  if (ud->b_mmap)
+    _mmap_close(ud);
+#endif
 
   free(ud);
 }
@@ -163,6 +299,29 @@ _stdio_seek(void *p_user_data, off_t i_offset, int whence)
 {
   _UserData *const ud = p_user_data;
   int ret;
+#if defined(_WIN32)
+  if (ud->b_mmap) {
+    switch (whence) {
+    case SEEK_SET:
+      break;
+    case SEEK_CUR:
+      i_offset += ud->position;
+      break;
+    case SEEK_END:
+      i_offset += ud->st_size;
+      break;
+    default:
+      errno = EINVAL;
+      return DRIVER_OP_ERROR;
+    }
+    if (i_offset < 0) {
+      errno = EINVAL;
+      return DRIVER_OP_ERROR;
+    }
+    ud->position = i_offset;
+    return 0;
+  }
+#endif
 #if !defined(HAVE_FSEEKO) && !defined(HAVE_FSEEKO64)
   /* Detect if off_t is lossy-truncated to long to avoid data corruption */
   if ( (sizeof(off_t) > sizeof(long)) && (i_offset != (off_t)((long)i_offset)) ) {
@@ -210,6 +369,10 @@ _stdio_read(void *user_data, void *buf, size_t count)
   _UserData *const ud = user_data;
   long read_count;
 
+#if defined(_WIN32)
+  if (ud->b_mmap)
+    return _mmap_read(ud, buf, count);
+#endif
   read_count = fread(buf, 1, count, ud->fd);
 
   if (read_count != count)
@@ -270,6 +433,10 @@ cdio_stdio_new(const char pathname[])
 
   ud->pathname = pathdup;
   ud->st_size  = statbuf.st_size; /* let's hope it doesn't change... */
+#if defined(_WIN32)
+  ud->h_file = INVALID_HANDLE_VALUE;
+  ud->b_mmap = _mmap_is_usable(pathdup, ud->st_size);
+#endif
 
   funcs.open   = _stdio_open;
   funcs.seek   = _stdio_seek;
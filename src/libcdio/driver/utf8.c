@@ -346,6 +346,29 @@ bool cdio_charset_to_utf8(const char *src, size_t src_len, cdio_utf8_t **dst,
 
   return (*dst != NULL);
 }
+
+int cdio_ucs2be_to_utf8_no_alloc(const char *src, size_t src_len, cdio_utf8_t *dst,
+                                 size_t dst_size)
+{
+  /* ISO-9660 directory records can't hold more than 255 bytes of filename */
+  wchar_t le_src[128];
+  size_t i;
+  int len;
+
+  src_len >>= 1;
+  if (src == NULL || dst == NULL || dst_size < 2 || src_len < 1 || src_len > 128 ||
+      ((src[0] == 0) && (src[1] == 0)))
+    return -1;
+
+  for (i=0; i<src_len; i++)
+    le_src[i] = (wchar_t)((((uint8_t)src[2*i]) << 8) | ((uint8_t)src[2*i+1]));
+  len = WideCharToMultiByte(CP_UTF8, 0, le_src, (int)src_len, dst, (int)dst_size - 1, NULL, NULL);
+  if (len <= 0)
+    return -1;
+  dst[len] = 0;
+
+  return len;
+}
 #else
 # error "The iconv library is needed to build drivers, but it is not detected"
 #endif /* HAVE_ICONV */
@@ -94,8 +94,14 @@ struct _iso9660_s {
 			         different.
 			     */
   bool b_have_superblock;   /**< Superblock has been read in? */
+  void *p_dd_lsn_index;     /**< LSN index for Rock Ridge deep directory
+                                 lookups, built on first use. */
 };
 
+#ifdef HAVE_ROCK
+static void _iso9660_dd_lsn_index_free(void *p_index);
+#endif
+
 static long int iso9660_seek_read_framesize (const iso9660_t *p_iso,
 					     void *ptr, lsn_t start,
 					     long int size,
@@ -286,6 +292,9 @@ bool
 iso9660_close (iso9660_t *p_iso)
 {
   if (NULL != p_iso) {
+#ifdef HAVE_ROCK
+    _iso9660_dd_lsn_index_free(p_iso->p_dd_lsn_index);
+#endif
     cdio_stdio_destroy(p_iso->stream);
     p_iso->stream = NULL;
     free(p_iso);
@@ -903,6 +912,13 @@ _iso9660_dir_to_statbuf (iso9660_dir_t *p_iso9660_dir,
       else if (u_joliet_level) {
 	int i_inlen = i_fname;
 	cdio_utf8_t *p_psz_out = NULL;
+#ifdef _WIN32
+	/* Convert straight into the statbuf, to save two allocations per entry */
+	if (cdio_ucs2be_to_utf8_no_alloc(&p_iso9660_dir->filename.str[1], i_inlen,
+					 p_stat->filename, i_fname + 1) > 0)
+	  ;
+	else
+#endif
 	if (cdio_charset_to_utf8(&p_iso9660_dir->filename.str[1], i_inlen,
                              &p_psz_out, "UCS-2BE")) {
           strncpy(p_stat->filename, p_psz_out, i_fname);
@@ -1776,6 +1792,157 @@ iso9660_ifs_find_lsn(iso9660_t *p_iso, lsn_t i_lsn)
 }
 
 #ifdef HAVE_ROCK
+/*
+  Rock Ridge deep directories require an LSN lookup for each Child Link,
+  and a lookup through find_lsn_recurse() walks the whole file system.
+  So, for ISOs with many relocated directories, we walk the file system
+  only once, on first lookup, to build a hash index of LSN to stat, which
+  is then used for all the subsequent lookups against the same image.
+ */
+typedef struct {
+  lsn_t           lsn;
+  iso9660_stat_t *p_stat;
+} dd_lsn_entry_t;
+
+typedef struct {
+  size_t          i_size;   /* Always a power of 2 */
+  size_t          i_count;
+  dd_lsn_entry_t *p_entry;
+} dd_lsn_index_t;
+
+static void
+_iso9660_dd_lsn_index_free(void *p_index)
+{
+  dd_lsn_index_t *p_dd_index = (dd_lsn_index_t *) p_index;
+  size_t i;
+
+  if (p_dd_index == NULL)
+    return;
+  for (i = 0; i < p_dd_index->i_size; i++)
+    iso9660_stat_free(p_dd_index->p_entry[i].p_stat);
+  free(p_dd_index->p_entry);
+  free(p_dd_index);
+}
+
+/* Duplicate a stat, along with its name and symlink */
+static iso9660_stat_t *
+_iso9660_stat_dup(const iso9660_stat_t *p_stat)
+{
+  const unsigned int len = sizeof(iso9660_stat_t) + strlen(p_stat->filename) + 1;
+  iso9660_stat_t *p_dup = calloc(1, len);
+
+  if (!p_dup) {
+    cdio_warn("Couldn't calloc(1, %d)", len);
+    return NULL;
+  }
+  memcpy(p_dup, p_stat, len);
+  if (p_stat->rr.psz_symlink != NULL) {
+    p_dup->rr.psz_symlink = strdup(p_stat->rr.psz_symlink);
+    if (p_dup->rr.psz_symlink == NULL) {
+      free(p_dup);
+      return NULL;
+    }
+  }
+  return p_dup;
+}
+
+static size_t
+_iso9660_dd_lsn_slot(const dd_lsn_index_t *p_dd_index, lsn_t lsn)
+{
+  size_t i = ((uint32_t) lsn * 2654435761U) & (p_dd_index->i_size - 1);
+
+  while (p_dd_index->p_entry[i].p_stat != NULL && p_dd_index->p_entry[i].lsn != lsn)
+    i = (i + 1) & (p_dd_index->i_size - 1);
+  return i;
+}
+
+/* Only the first entry for an LSN is kept, as with find_lsn_recurse() */
+static bool
+_iso9660_dd_lsn_index_add(dd_lsn_index_t *p_dd_index, const iso9660_stat_t *p_stat)
+{
+  dd_lsn_entry_t *p_old;
+  size_t i, i_old_size;
+
+  if (2 * (p_dd_index->i_count + 1) > p_dd_index->i_size) {
+    p_old = p_dd_index->p_entry;
+    i_old_size = p_dd_index->i_size;
+    p_dd_index->i_size = (i_old_size == 0) ? 1024 : 2 * i_old_size;
+    p_dd_index->p_entry = calloc(p_dd_index->i_size, sizeof(dd_lsn_entry_t));
+    if (p_dd_index->p_entry == NULL) {
+      p_dd_index->p_entry = p_old;
+      p_dd_index->i_size = i_old_size;
+      return false;
+    }
+    for (i = 0; i < i_old_size; i++) {
+      if (p_old[i].p_stat != NULL)
+        p_dd_index->p_entry[_iso9660_dd_lsn_slot(p_dd_index, p_old[i].lsn)] = p_old[i];
+    }
+    free(p_old);
+  }
+  i = _iso9660_dd_lsn_slot(p_dd_index, p_stat->lsn);
+  if (p_dd_index->p_entry[i].p_stat != NULL)
+    return true;
+  p_dd_index->p_entry[i].p_stat = _iso9660_stat_dup(p_stat);
+  if (p_dd_index->p_entry[i].p_stat == NULL)
+    return false;
+  p_dd_index->p_entry[i].lsn = p_stat->lsn;
+  p_dd_index->i_count++;
+  return true;
+}
+
+/* Same traversal order as find_lsn_recurse(), so that lookups return the same entries */
+static bool
+_iso9660_dd_lsn_index_recurse(void *p_image, iso9660_readdir_t iso9660_readdir,
+                              const char psz_path[], dd_lsn_index_t *p_dd_index)
+{
+  CdioISO9660FileList_t *entlist = iso9660_readdir (p_image, psz_path);
+  CdioISO9660DirList_t *dirlist;
+  CdioListNode_t *entnode;
+  bool r = true;
+
+  if (entlist == NULL)
+    return false;
+  dirlist = iso9660_dirlist_new();
+
+  _CDIO_LIST_FOREACH (entnode, entlist)
+    {
+      iso9660_stat_t *statbuf = _cdio_list_node_data (entnode);
+      const char *psz_filename  = (char *) statbuf->filename;
+      unsigned int len = strlen(psz_path) + strlen(psz_filename) + 2;
+      char *psz_dirname;
+
+      if (statbuf->type == _STAT_DIR
+          && strcmp ((char *) statbuf->filename, ".")
+          && strcmp ((char *) statbuf->filename, "..")) {
+        psz_dirname = calloc(1, len);
+        if (psz_dirname == NULL) {
+          r = false;
+          break;
+        }
+        snprintf (psz_dirname, len, "%s%s/", psz_path, psz_filename);
+        _cdio_list_append (dirlist, psz_dirname);
+      }
+      if (!_iso9660_dd_lsn_index_add(p_dd_index, statbuf)) {
+        r = false;
+        break;
+      }
+    }
+  iso9660_filelist_free (entlist);
+
+  if (r) {
+    _CDIO_LIST_FOREACH (entnode, dirlist)
+      {
+        if (!_iso9660_dd_lsn_index_recurse(p_image, iso9660_readdir,
+                                           _cdio_list_node_data (entnode), p_dd_index)) {
+          r = false;
+          break;
+        }
+      }
+  }
+  iso9660_dirlist_free(dirlist);
+  return r;
+}
+
 /* Some compilers complain if the prototype is not defined */
 iso9660_stat_t *
 _iso9660_dd_find_lsn(void* p_image, lsn_t i_lsn);
@@ -1789,12 +1956,15 @@ _iso9660_dd_find_lsn(void* p_image, lsn_t i_lsn)
   void* p_image_dd;
   iso9660_readdir_t* f_readdir;
   iso9660_stat_t* ret;
-  size_t size;
+  dd_lsn_index_t* p_dd_index;
+  iso9660_t* p_iso = NULL;
+  size_t size, i;
 
   switch(p_header->u_type) {
   case CDIO_HEADER_TYPE_ISO:
     size = sizeof(iso9660_t);
     f_readdir = (iso9660_readdir_t*)iso9660_ifs_readdir;
+    p_iso = (iso9660_t*)p_image;
     break;
   case CDIO_HEADER_TYPE_CDIO:
     size = sizeof(CdIo_t);
@@ -1805,6 +1975,16 @@ _iso9660_dd_find_lsn(void* p_image, lsn_t i_lsn)
     return NULL;
   }
 
+  /* Use the LSN index if we have one */
+  if (p_iso != NULL && p_iso->p_dd_lsn_index != NULL) {
+    p_dd_index = (dd_lsn_index_t*)p_iso->p_dd_lsn_index;
+    if (p_dd_index->i_size == 0)
+      return NULL;
+    i = _iso9660_dd_lsn_slot(p_dd_index, i_lsn);
+    return (p_dd_index->p_entry[i].p_stat == NULL) ? NULL :
+      _iso9660_stat_dup(p_dd_index->p_entry[i].p_stat);
+  }
+
   /* Work with a duplicate to allow concurrency. */
   p_image_dd = calloc(1, size);
   if (!p_image_dd) {
@@ -1816,6 +1996,19 @@ _iso9660_dd_find_lsn(void* p_image, lsn_t i_lsn)
   /* Disable the deep directory flag so we can process all entries */
   p_header = (cdio_header_t*)p_image_dd;
   p_header->u_flags |= CDIO_HEADER_FLAGS_DISABLE_RR_DD;
+
+  /* Build the LSN index on first lookup, and use it for this one too */
+  if (p_iso != NULL) {
+    p_dd_index = calloc(1, sizeof(dd_lsn_index_t));
+    if (p_dd_index != NULL && _iso9660_dd_lsn_index_recurse(p_image_dd, f_readdir, "/", p_dd_index)) {
+      p_iso->p_dd_lsn_index = p_dd_index;
+      free(p_image_dd);
+      return _iso9660_dd_find_lsn(p_image, i_lsn);
+    }
+    cdio_warn("Could not build deep directory LSN index");
+    _iso9660_dd_lsn_index_free(p_dd_index);
+  }
+
   ret = find_lsn_recurse(p_image_dd, f_readdir, "/", i_lsn, &psz_full_filename);
   if (psz_full_filename != NULL)
     free(psz_full_filename);
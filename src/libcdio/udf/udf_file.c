@@ -220,6 +220,22 @@ offset_to_lba(const udf_dirent_t *p_udf_dirent, off_t i_offset,
   }
 }
 
+/**
+  Set the position from which the next udf_read_block() reads, as a
+  byte offset from the start of the file. The offset should be a
+  multiple of UDF_BLOCKSIZE. Return false if it lies past the end of
+  the file.
+*/
+bool
+udf_seek(const udf_dirent_t *p_udf_dirent, int64_t i_offset)
+{
+  if (!p_udf_dirent || i_offset < 0 ||
+      (uint64_t)i_offset > udf_get_file_length(p_udf_dirent))
+    return false;
+  p_udf_dirent->p_udf->i_position = (off_t)i_offset;
+  return true;
+}
+
 /**
   Attempts to read up to count bytes from UDF directory entry
   p_udf_dirent into the buffer starting at buf. buf should be a
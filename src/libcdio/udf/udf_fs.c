@@ -326,19 +326,16 @@ udf_new_dirent(udf_file_entry_t *p_udf_fe, udf_t *p_udf,
   return p_udf_dirent;
 }
 
-/*!
-  Seek to a position i_start and then read i_blocks. Number of blocks read is
-  returned. One normally expects the return to be equal to i_blocks.
+/*
+  Read i_blocks sectors from the stream, without going through the cache.
 */
-driver_return_code_t
-udf_read_sectors (const udf_t *p_udf, void *ptr, lsn_t i_start,
-		 long i_blocks)
+static driver_return_code_t
+udf_read_stream_sectors (const udf_t *p_udf, void *ptr, lsn_t i_start,
+			 long i_blocks, /*out*/ long *pi_read)
 {
   driver_return_code_t ret;
-  long i_read;
   off_t i_byte_offset;
 
-  if (!p_udf) return 0;
   /* Without the cast, i_start * UDF_BLOCKSIZE may be evaluated as 32 bit */
   i_byte_offset = ((off_t)i_start) * UDF_BLOCKSIZE;
   /* Since we're using SEEK_SET, the value must be positive */
@@ -347,13 +344,74 @@ udf_read_sectors (const udf_t *p_udf, void *ptr, lsn_t i_start,
       cdio_warn("Large File Support is required to access streams of 2 GB or more");
     return DRIVER_OP_BAD_PARAMETER;
   }
+  ret = cdio_stream_seek (p_udf->stream, i_byte_offset, SEEK_SET);
+  if (DRIVER_OP_SUCCESS != ret) return ret;
+  *pi_read = cdio_stream_read (p_udf->stream, ptr, UDF_BLOCKSIZE, i_blocks);
+  return (*pi_read) ? DRIVER_OP_SUCCESS : DRIVER_OP_ERROR;
+}
+
+/*
+  Single sector reads (file entries, descriptors) go through a small LRU cache,
+  that fetches the whole aligned run of sectors a sector belongs to, so that the
+  reads of adjacent file entries, as performed when walking a directory, are
+  coalesced. Anything larger, such as file data, bypasses the cache.
+  Returns true if the sector was served from (or loaded into) the cache.
+*/
+static bool
+udf_read_cached_sector (const udf_t *p_udf, void *ptr, lsn_t i_start)
+{
+  udf_sector_cache_t *p_cache = p_udf->p_cache;
+  udf_cache_line_t *p_line, *p_lru = NULL;
+  lsn_t i_line_start = i_start - (i_start % UDF_CACHE_LINE_BLOCKS);
+  long i_read = 0;
+  int i;
+
+  if (p_cache == NULL || i_start < 0)
+    return false;
+  p_cache->i_clock++;
+  for (i = 0; i < UDF_CACHE_LINES; i++) {
+    p_line = &p_cache->line[i];
+    if (p_line->i_blocks != 0 && p_line->i_start == i_line_start) {
+      if ((uint32_t)(i_start - i_line_start) >= p_line->i_blocks)
+	return false;
+      p_line->i_last_use = p_cache->i_clock;
+      memcpy(ptr, &p_line->data[(i_start - i_line_start) * UDF_BLOCKSIZE], UDF_BLOCKSIZE);
+      return true;
+    }
+    if (p_lru == NULL || p_line->i_last_use < p_lru->i_last_use)
+      p_lru = &p_cache->line[i];
+  }
+
+  /* Miss: load the line, with the sectors that follow as read-ahead */
+  p_lru->i_blocks = 0;
+  if (DRIVER_OP_SUCCESS != udf_read_stream_sectors(p_udf, p_lru->data, i_line_start,
+						   UDF_CACHE_LINE_BLOCKS, &i_read))
+    return false;
+  p_lru->i_start = i_line_start;
+  p_lru->i_blocks = (uint32_t)(i_read / UDF_BLOCKSIZE);
+  p_lru->i_last_use = p_cache->i_clock;
+  if ((uint32_t)(i_start - i_line_start) >= p_lru->i_blocks)
+    return false;
+  memcpy(ptr, &p_lru->data[(i_start - i_line_start) * UDF_BLOCKSIZE], UDF_BLOCKSIZE);
+  return true;
+}
+
+/*!
+  Seek to a position i_start and then read i_blocks. Number of blocks read is
+  returned. One normally expects the return to be equal to i_blocks.
+*/
+driver_return_code_t
+udf_read_sectors (const udf_t *p_udf, void *ptr, lsn_t i_start,
+		 long i_blocks)
+{
+  long i_read;
+
+  if (!p_udf) return 0;
 
   if (p_udf->b_stream) {
-    ret = cdio_stream_seek (p_udf->stream, i_byte_offset, SEEK_SET);
-    if (DRIVER_OP_SUCCESS != ret) return ret;
-    i_read = cdio_stream_read (p_udf->stream, ptr, UDF_BLOCKSIZE, i_blocks);
-    if (i_read) return DRIVER_OP_SUCCESS;
-    return DRIVER_OP_ERROR;
+    if (i_blocks == 1 && udf_read_cached_sector(p_udf, ptr, i_start))
+      return DRIVER_OP_SUCCESS;
+    return udf_read_stream_sectors(p_udf, ptr, i_start, i_blocks, &i_read);
   } else {
     return cdio_read_data_sectors(p_udf->cdio, ptr, i_start, UDF_BLOCKSIZE,
 				  i_blocks);
@@ -386,6 +444,8 @@ udf_open (const char *psz_path)
     if (!p_udf->stream)
       goto error;
     p_udf->b_stream = true;
+    /* Not having a cache is not an error */
+    p_udf->p_cache = (udf_sector_cache_t *) calloc(1, sizeof(udf_sector_cache_t));
   }
 
   /*
@@ -436,6 +496,7 @@ udf_open (const char *psz_path)
 
  error:
   cdio_stdio_destroy(p_udf->stream);
+  free(p_udf->p_cache);
   free(p_udf);
   return NULL;
 }
@@ -651,6 +712,7 @@ udf_close (udf_t *p_udf)
   } else {
     cdio_destroy(p_udf->cdio);
   }
+  free_and_null(p_udf->p_cache);
 
   /* Get rid of root directory if allocated. */
 
@@ -34,6 +34,23 @@
 
 /* Implementation of opaque types */
 
+/* Small LRU cache of aligned sector runs, for the single sector reads of file
+   entries and descriptors, that are usually adjacent on the image. */
+#define UDF_CACHE_LINES        16
+#define UDF_CACHE_LINE_BLOCKS  16
+
+typedef struct {
+  lsn_t                 i_start;      /* First sector of the line */
+  uint32_t              i_blocks;     /* Number of valid sectors */
+  uint32_t              i_last_use;
+  uint8_t               data[UDF_CACHE_LINE_BLOCKS * UDF_BLOCKSIZE];
+} udf_cache_line_t;
+
+typedef struct {
+  uint32_t              i_clock;
+  udf_cache_line_t      line[UDF_CACHE_LINES];
+} udf_sector_cache_t;
+
 struct udf_s {
   bool                  b_stream;     /* Use stream pointer, else use p_cdio */
   off_t                 i_position;   /* Position in file if positive */
@@ -45,6 +62,7 @@ struct udf_s {
   uint32_t              i_part_start; /* start of Partition Descriptor */
   uint32_t              lvd_lba;      /* sector of Logical Volume Descriptor */
   uint32_t              fsd_offset;   /* lba of fileset descriptor */
+  udf_sector_cache_t    *p_cache;     /* Metadata sector cache, if any */
 };
 
 #endif /* CDIO_UDF_UDF_PRIVATE_H_ */
@@ -0,0 +1,241 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Image library indexer
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * When the user has set an image library directory (SETTING_IMAGE_LIBRARY_DIR), the images it
+ * contains are processed in the background, at low CPU and I/O priority, so that selecting one
+ * of them doesn't require a scan and pressing the hash button doesn't require reading it again:
+ * - the scan results (image report and ISO index) go to the scan cache, through the same code
+ *   as the scan of the selected image. Since that code works on the globals of the selected
+ *   image, an image is only scanned while no image is selected and no operation is in progress,
+ *   with image_scan_lock held, which ImageScanThread() also takes, and is otherwise retried later.
+ * - the checksums go to the sums cache, and can be computed at any time.
+ * The directory is then watched for changes, and an image that is still being copied, which
+ * we can't open without sharing write access, is processed once the copy has completed.
+ */
+
+#ifdef _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rufus.h"
+#include "missing.h"
+#include "settings.h"
+
+#define LIBRARY_SETTLE_TIME         2000	// Let a burst of changes settle before enumerating
+#define LIBRARY_RETRY_INTERVAL      30000	// For images we couldn't process yet
+#define LIBRARY_POLL_INTERVAL       300000	// When the directory can't be watched
+
+SRWLOCK image_scan_lock = SRWLOCK_INIT;
+
+static struct {
+	HANDLE hThread;
+	HANDLE hStop;
+	volatile BOOL stop;
+	char* dir;
+	StrArray done;					// "<path>|<size>|<write time>" of the images we processed
+} library = { NULL };
+
+// An image that is still being written to can't be opened without sharing write access
+static BOOL IsImageComplete(const char* path)
+{
+	HANDLE h = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (h == INVALID_HANDLE_VALUE)
+		return FALSE;
+	CloseHandle(h);
+	return TRUE;
+}
+
+// Process one image. Returns FALSE if it needs to be retried later.
+static BOOL IndexImage(const char* path)
+{
+	BOOL scanned = FALSE;
+	char sums[CHECKSUM_MAX][150];
+
+	if (!IsImageComplete(path))
+		return FALSE;
+	AcquireSRWLockExclusive(&image_scan_lock);
+	if ((image_path == NULL) && !op_in_progress) {
+		uprintf("Image library: Scanning '%s'", path);
+		ScanISOInBackground(path);
+		scanned = TRUE;
+	}
+	ReleaseSRWLockExclusive(&image_scan_lock);
+	if (library.stop)
+		return FALSE;
+	if (!LoadFileSums(path, NULL)) {
+		uprintf("Image library: Computing the checksums of '%s'", path);
+		if (!ComputeFileSums(path, sums, &library.stop))
+			return FALSE;
+		SaveFileSums(path, sums, CHECKSUM_MAX);
+	}
+	return scanned;
+}
+
+// Process the images that were added or modified since the last call. Returns FALSE if some need a retry.
+static BOOL IndexLibrary(void)
+{
+	BOOL r = TRUE;
+	char str[MAX_PATH], key[MAX_PATH + 48], *name;
+	HANDLE hFind;
+	WIN32_FIND_DATAW wfd;
+	wchar_t* wpattern;
+
+	static_sprintf(str, "%s\\*", library.dir);
+	wpattern = utf8_to_wchar(str);
+	if (wpattern == NULL)
+		return FALSE;
+	hFind = FindFirstFileW(wpattern, &wfd);
+	free(wpattern);
+	if (hFind == INVALID_HANDLE_VALUE)
+		return (GetLastError() == ERROR_FILE_NOT_FOUND);
+	do {
+		if (wfd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			continue;
+		name = wchar_to_utf8(wfd.cFileName);
+		if ((name != NULL) && IsImageFileName(name)) {
+			static_sprintf(str, "%s\\%s", library.dir, name);
+			static_sprintf(key, "%s|%lu%08lx|%08lx%08lx", str, wfd.nFileSizeHigh, wfd.nFileSizeLow,
+				wfd.ftLastWriteTime.dwHighDateTime, wfd.ftLastWriteTime.dwLowDateTime);
+			if (StrArrayFind(&library.done, key) < 0) {
+				if (IndexImage(str))
+					StrArrayAdd(&library.done, key, TRUE);
+				else
+					r = FALSE;
+			}
+		}
+		free(name);
+	} while (!library.stop && FindNextFileW(hFind, &wfd));
+	FindClose(hFind);
+	return r;
+}
+
+static DWORD WINAPI ImageLibraryThread(void* param)
+{
+	BOOL watching = FALSE, pending;
+	uint8_t changes[4 * KB];
+	DWORD size, timeout;
+	HANDLE hDir, hWait[2];
+	OVERLAPPED ov = { 0 };
+
+	SetThreadClass(GetCurrentThread(), THREAD_CLASS_BACKGROUND, 0);
+	// The scans read through libcdio, so lower the priority of all of our I/O
+	SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+	ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	hDir = CreateFileU(library.dir, FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+	if ((hDir == INVALID_HANDLE_VALUE) || (ov.hEvent == NULL)) {
+		uprintf("Image library: Could not open '%s': %s", library.dir, WindowsErrorString());
+		goto out;
+	}
+	uprintf("Image library: Indexing '%s'", library.dir);
+	hWait[0] = library.hStop;
+	hWait[1] = ov.hEvent;
+
+	while (!library.stop) {
+		// Watch for changes before we enumerate, so that none can be missed
+		if (!watching) {
+			ResetEvent(ov.hEvent);
+			watching = ReadDirectoryChangesW(hDir, changes, sizeof(changes), FALSE, FILE_NOTIFY_CHANGE_FILE_NAME |
+				FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE, NULL, &ov, NULL);
+		}
+		pending = !IndexLibrary();
+		timeout = pending ? LIBRARY_RETRY_INTERVAL : (watching ? INFINITE : LIBRARY_POLL_INTERVAL);
+		if (WaitForMultipleObjects(2, hWait, FALSE, timeout) == WAIT_OBJECT_0)
+			break;
+		if (watching && (WaitForSingleObject(ov.hEvent, 0) == WAIT_OBJECT_0)) {
+			GetOverlappedResult(hDir, &ov, &size, FALSE);
+			watching = FALSE;
+			// A copy in progress produces a stream of notifications, that we don't need to go through
+			if (WaitForSingleObject(library.hStop, LIBRARY_SETTLE_TIME) == WAIT_OBJECT_0)
+				break;
+		}
+	}
+
+out:
+	if (watching) {
+		CancelIo(hDir);
+		GetOverlappedResult(hDir, &ov, &size, TRUE);
+	}
+	if (hDir != INVALID_HANDLE_VALUE)
+		CloseHandle(hDir);
+	safe_closehandle(ov.hEvent);
+	ExitThread(0);
+}
+
+/*
+ * Start indexing the image library directory, if the user has set one.
+ */
+BOOL StartImageLibrary(void)
+{
+	char* dir;
+
+	if (library.hThread != NULL)
+		return TRUE;
+	dir = ReadSettingStr(SETTING_IMAGE_LIBRARY_DIR);
+	if ((dir == NULL) || (dir[0] == 0))
+		return FALSE;
+	library.dir = safe_strdup(dir);
+	library.hStop = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if ((library.dir == NULL) || (library.hStop == NULL))
+		goto error;
+	// Let the user use "C:\Images\" as well as "C:\Images"
+	if (library.dir[strlen(library.dir) - 1] == '\\')
+		library.dir[strlen(library.dir) - 1] = 0;
+	library.stop = FALSE;
+	StrArrayCreate(&library.done, 16);
+	library.hThread = CreateThread(NULL, 0, ImageLibraryThread, NULL, 0, NULL);
+	if (library.hThread != NULL)
+		return TRUE;
+	uprintf("Unable to start image library thread");
+	StrArrayDestroy(&library.done);
+
+error:
+	safe_free(library.dir);
+	safe_closehandle(library.hStop);
+	return FALSE;
+}
+
+/*
+ * Stop the indexer, which doesn't usually take long, since the checksum computation checks
+ * for the stop request and a scan only takes a few seconds. An indexer that is still busy
+ * past the timeout is left to be interrupted by our exit.
+ */
+void StopImageLibrary(void)
+{
+	if (library.hThread == NULL)
+		return;
+	library.stop = TRUE;
+	SetEvent(library.hStop);
+	if (WaitForSingleObject(library.hThread, 5000) != WAIT_OBJECT_0) {
+		uprintf("Image library: Indexer did not stop in time");
+		return;
+	}
+	safe_closehandle(library.hThread);
+	safe_closehandle(library.hStop);
+	StrArrayDestroy(&library.done);
+	safe_free(library.dir);
+}
@@ -163,6 +163,7 @@ void apply_localization(int dlg_id, HWND hDlg);
 void reset_localization(int dlg_id);
 void free_dialog_list(void);
 char* lmprintf(uint32_t msg_id, ...);
+void set_embedded_loc_data(const char* data, size_t size);
 BOOL get_supported_locales(const char* filename);
 BOOL get_loc_data_file(const char* filename, loc_cmd* lcmd);
 void free_locale_list(void);
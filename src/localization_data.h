@@ -102,6 +102,7 @@ const loc_control_id control_id[] = {
 	LOC_CTRL(IDC_SHA1),
 	LOC_CTRL(IDC_SHA256),
 	LOC_CTRL(IDC_SHA512),
+	LOC_CTRL(IDC_BLAKE3),
 	LOC_CTRL(IDC_SELECTION_ICON),
 	LOC_CTRL(IDC_SELECTION_TEXT),
 	LOC_CTRL(IDC_SELECTION_LINE),
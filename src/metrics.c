@@ -0,0 +1,341 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Metrics exporter
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * When the user has set a metrics file (SETTING_METRICS_FILE), the counters and histograms of
+ * the operations we ran (results, bytes, speed, time spent in each phase, write retries and
+ * verification failures) are written there, in the Prometheus text format, so that the stations
+ * of an imaging fleet can be monitored through the textfile collector of node_exporter or
+ * windows_exporter, which expect the file to have a .prom extension.
+ * The counters are fed from the summary of the timeline (see trace.c), once an operation is
+ * over, and the progress of the operation in progress is only polled, by our own thread, every
+ * METRICS_INTERVAL, so none of this adds anything to the I/O path.
+ * The file is replaced atomically, so that a collector never gets to read a partial one.
+ */
+
+#ifdef _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "rufus.h"
+#include "missing.h"
+#include "msapi_utf8.h"
+#include "settings.h"
+
+#define METRICS_INTERVAL            15000
+#define METRICS_MAX_JOBS            8
+#define METRICS_MAX_PHASES          64
+#define METRICS_MAX_DISKS           16
+#define METRICS_NB_BUCKETS          10
+
+enum metrics_result {
+	MR_SUCCESS = 0,
+	MR_CANCELLED,
+	MR_FAILED,
+	MR_MAX
+};
+
+static const char* metrics_result_name[MR_MAX] = { "success", "cancelled", "failed" };
+// Histogram buckets, in seconds for the durations and MB/s for the speeds
+static const double duration_bucket[METRICS_NB_BUCKETS] = { 10, 30, 60, 120, 300, 600, 1200, 1800, 3600, 7200 };
+static const double speed_bucket[METRICS_NB_BUCKETS] = { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000 };
+
+typedef struct {
+	uint64_t count[METRICS_NB_BUCKETS + 1];
+	double sum;
+} metrics_histogram;
+
+typedef struct {
+	char name[32];
+	uint64_t result[MR_MAX];
+	metrics_histogram duration;
+} metrics_job;
+
+typedef struct {
+	char name[32];
+	uint64_t count;
+	uint64_t duration_us;
+	uint64_t bytes;
+} metrics_phase;
+
+typedef struct {
+	DWORD disk;
+	double speed;
+} metrics_disk;
+
+static struct {
+	SRWLOCK lock;
+	HANDLE hThread;
+	HANDLE hUpdate;
+	volatile BOOL stop;
+	char* path;
+	BOOL dirty;
+	uint64_t written, read, retries, verify_failures;
+	uint32_t nb_jobs, nb_phases, nb_disks;
+	metrics_job job[METRICS_MAX_JOBS];
+	metrics_phase phase[METRICS_MAX_PHASES];
+	metrics_disk disk[METRICS_MAX_DISKS];
+	metrics_histogram speed;
+} metrics = { SRWLOCK_INIT };
+
+static void AddToHistogram(metrics_histogram* h, const double* bucket, double value)
+{
+	size_t i;
+
+	for (i = 0; (i < METRICS_NB_BUCKETS) && (value > bucket[i]); i++);
+	h->count[i]++;
+	h->sum += value;
+}
+
+static void WriteHistogram(FILE* fd, const char* name, const char* label, const metrics_histogram* h,
+	const double* bucket)
+{
+	size_t i;
+	uint64_t total = 0;
+	const char* sep = (label[0] == 0) ? "" : ",";
+
+	// Prometheus buckets are cumulative
+	for (i = 0; i < METRICS_NB_BUCKETS; i++) {
+		total += h->count[i];
+		fprintf(fd, "%s_bucket{%s%sle=\"%g\"} %" PRIu64 "\n", name, label, sep, bucket[i], total);
+	}
+	total += h->count[METRICS_NB_BUCKETS];
+	fprintf(fd, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name, label, sep, total);
+	fprintf(fd, "%s_sum{%s} %0.3f\n%s_count{%s} %" PRIu64 "\n", name, label, h->sum, name, label, total);
+}
+
+static void WriteMetrics(void)
+{
+	uint32_t i, j;
+	uint64_t written, read, elapsed_us;
+	BOOL in_progress;
+	char tmp[MAX_PATH + 8], label[64];
+	FILE* fd;
+
+	in_progress = TraceGetProgress(&written, &read, &elapsed_us);
+	static_sprintf(tmp, "%s.tmp", metrics.path);
+	fd = fopenU(tmp, "w");
+	if (fd == NULL)
+		return;
+	AcquireSRWLockShared(&metrics.lock);
+	fprintf(fd, "# HELP rufus_operation_in_progress Whether an operation is in progress.\n"
+		"# TYPE rufus_operation_in_progress gauge\nrufus_operation_in_progress %d\n", in_progress ? 1 : 0);
+	fprintf(fd, "# HELP rufus_operation_bytes Bytes written and read by the operation in progress.\n"
+		"# TYPE rufus_operation_bytes gauge\n");
+	fprintf(fd, "rufus_operation_bytes{direction=\"write\"} %" PRIu64 "\n", written);
+	fprintf(fd, "rufus_operation_bytes{direction=\"read\"} %" PRIu64 "\n", read);
+	fprintf(fd, "# HELP rufus_operation_seconds Time since the operation in progress started.\n"
+		"# TYPE rufus_operation_seconds gauge\nrufus_operation_seconds %0.3f\n", elapsed_us / 1000000.0);
+
+	fprintf(fd, "# HELP rufus_operations_total Operations that completed, by type and result.\n"
+		"# TYPE rufus_operations_total counter\n");
+	for (i = 0; i < metrics.nb_jobs; i++) {
+		for (j = 0; j < MR_MAX; j++)
+			fprintf(fd, "rufus_operations_total{operation=\"%s\",result=\"%s\"} %" PRIu64 "\n",
+				metrics.job[i].name, metrics_result_name[j], metrics.job[i].result[j]);
+	}
+	fprintf(fd, "# HELP rufus_operation_duration_seconds Duration of the operations that completed.\n"
+		"# TYPE rufus_operation_duration_seconds histogram\n");
+	for (i = 0; i < metrics.nb_jobs; i++) {
+		static_sprintf(label, "operation=\"%s\"", metrics.job[i].name);
+		WriteHistogram(fd, "rufus_operation_duration_seconds", label, &metrics.job[i].duration, duration_bucket);
+	}
+
+	fprintf(fd, "# HELP rufus_bytes_total Bytes written to and read from the drives.\n"
+		"# TYPE rufus_bytes_total counter\n");
+	fprintf(fd, "rufus_bytes_total{direction=\"write\"} %" PRIu64 "\n", metrics.written);
+	fprintf(fd, "rufus_bytes_total{direction=\"read\"} %" PRIu64 "\n", metrics.read);
+	fprintf(fd, "# HELP rufus_write_speed_mbps Average write speed of the operations that succeeded.\n"
+		"# TYPE rufus_write_speed_mbps histogram\n");
+	WriteHistogram(fd, "rufus_write_speed_mbps", "", &metrics.speed, speed_bucket);
+	fprintf(fd, "# HELP rufus_disk_write_speed_mbps Average write speed of the last operation on each disk.\n"
+		"# TYPE rufus_disk_write_speed_mbps gauge\n");
+	for (i = 0; i < metrics.nb_disks; i++)
+		fprintf(fd, "rufus_disk_write_speed_mbps{disk=\"%d\"} %0.1f\n", (int)metrics.disk[i].disk, metrics.disk[i].speed);
+	fprintf(fd, "# HELP rufus_write_retries_total Drive writes that had to be retried.\n"
+		"# TYPE rufus_write_retries_total counter\nrufus_write_retries_total %" PRIu64 "\n", metrics.retries);
+	fprintf(fd, "# HELP rufus_verify_failures_total Verification passes that found a mismatch.\n"
+		"# TYPE rufus_verify_failures_total counter\nrufus_verify_failures_total %" PRIu64 "\n",
+		metrics.verify_failures);
+
+	fprintf(fd, "# HELP rufus_phase_seconds_total Time spent in each phase of the operations.\n"
+		"# TYPE rufus_phase_seconds_total counter\n");
+	for (i = 0; i < metrics.nb_phases; i++)
+		fprintf(fd, "rufus_phase_seconds_total{phase=\"%s\"} %0.3f\n", metrics.phase[i].name,
+			metrics.phase[i].duration_us / 1000000.0);
+	fprintf(fd, "# HELP rufus_phase_bytes_total Bytes processed in each phase of the operations.\n"
+		"# TYPE rufus_phase_bytes_total counter\n");
+	for (i = 0; i < metrics.nb_phases; i++)
+		fprintf(fd, "rufus_phase_bytes_total{phase=\"%s\"} %" PRIu64 "\n", metrics.phase[i].name, metrics.phase[i].bytes);
+	fprintf(fd, "# HELP rufus_phase_count_total Number of times each phase was run.\n"
+		"# TYPE rufus_phase_count_total counter\n");
+	for (i = 0; i < metrics.nb_phases; i++)
+		fprintf(fd, "rufus_phase_count_total{phase=\"%s\"} %" PRIu64 "\n", metrics.phase[i].name, metrics.phase[i].count);
+	metrics.dirty = in_progress;
+	ReleaseSRWLockShared(&metrics.lock);
+
+	if ((fclose(fd) != 0) || !MoveFileExU(tmp, metrics.path, MOVEFILE_REPLACE_EXISTING))
+		DeleteFileU(tmp);
+}
+
+static DWORD WINAPI MetricsExporterThread(void* param)
+{
+	uint64_t written, read, elapsed_us;
+
+	SetThreadClass(GetCurrentThread(), THREAD_CLASS_BACKGROUND, 0);
+	while (!metrics.stop) {
+		// An idle station has nothing new to report
+		if (metrics.dirty || TraceGetProgress(&written, &read, &elapsed_us))
+			WriteMetrics();
+		WaitForSingleObject(metrics.hUpdate, METRICS_INTERVAL);
+	}
+	ExitThread(0);
+}
+
+/*
+ * Start the exporter, if the user has set a metrics file.
+ */
+BOOL StartMetricsExporter(void)
+{
+	char* path;
+
+	if (metrics.hThread != NULL)
+		return TRUE;
+	path = ReadSettingStr(SETTING_METRICS_FILE);
+	if ((path == NULL) || (path[0] == 0))
+		return FALSE;
+	metrics.path = safe_strdup(path);
+	metrics.hUpdate = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if ((metrics.path == NULL) || (metrics.hUpdate == NULL))
+		goto error;
+	metrics.stop = FALSE;
+	// Let the collector see that we are up, even before our first operation
+	metrics.dirty = TRUE;
+	metrics.hThread = CreateThread(NULL, 0, MetricsExporterThread, NULL, 0, NULL);
+	if (metrics.hThread != NULL) {
+		uprintf("Exporting metrics to '%s'", metrics.path);
+		return TRUE;
+	}
+	uprintf("Unable to start metrics exporter thread");
+
+error:
+	safe_free(metrics.path);
+	safe_closehandle(metrics.hUpdate);
+	return FALSE;
+}
+
+/*
+ * Stop the exporter, after writing the metrics of the last operation, if they haven't been yet.
+ */
+void StopMetricsExporter(void)
+{
+	if (metrics.hThread == NULL)
+		return;
+	metrics.stop = TRUE;
+	SetEvent(metrics.hUpdate);
+	if (WaitForSingleObject(metrics.hThread, 5000) != WAIT_OBJECT_0) {
+		uprintf("Metrics exporter did not stop in time");
+		return;
+	}
+	if (metrics.dirty)
+		WriteMetrics();
+	safe_closehandle(metrics.hThread);
+	safe_closehandle(metrics.hUpdate);
+	safe_free(metrics.path);
+}
+
+/*
+ * Add a phase from the summary of an operation. The write retries and verification failures
+ * are tallied as phases by the write code, and get their own counters here.
+ */
+void AddPhaseMetrics(const char* name, uint32_t count, uint64_t duration_us, uint64_t bytes)
+{
+	uint32_t i;
+
+	if (metrics.hThread == NULL)
+		return;
+	AcquireSRWLockExclusive(&metrics.lock);
+	if (strcmp(name, "write retries") == 0) {
+		metrics.retries += count;
+	} else if (strcmp(name, "verify failures") == 0) {
+		metrics.verify_failures += count;
+	} else {
+		for (i = 0; (i < metrics.nb_phases) && (strcmp(metrics.phase[i].name, name) != 0); i++);
+		if (i < METRICS_MAX_PHASES) {
+			if (i == metrics.nb_phases) {
+				static_strcpy(metrics.phase[i].name, name);
+				metrics.nb_phases++;
+			}
+			metrics.phase[i].count += count;
+			metrics.phase[i].duration_us += duration_us;
+			metrics.phase[i].bytes += bytes;
+		}
+	}
+	ReleaseSRWLockExclusive(&metrics.lock);
+}
+
+/*
+ * Add an operation that completed, and have the metrics written out right away.
+ */
+void AddJobMetrics(const char* job, DWORD disk, DWORD status, uint64_t written, uint64_t read, uint64_t duration_us)
+{
+	uint32_t i;
+	double speed;
+
+	if (metrics.hThread == NULL)
+		return;
+	AcquireSRWLockExclusive(&metrics.lock);
+	for (i = 0; (i < metrics.nb_jobs) && (strcmp(metrics.job[i].name, job) != 0); i++);
+	if (i < METRICS_MAX_JOBS) {
+		if (i == metrics.nb_jobs) {
+			static_strcpy(metrics.job[i].name, job);
+			metrics.nb_jobs++;
+		}
+		if (!IS_ERROR(status))
+			metrics.job[i].result[MR_SUCCESS]++;
+		else if (SCODE_CODE(status) == ERROR_CANCELLED)
+			metrics.job[i].result[MR_CANCELLED]++;
+		else
+			metrics.job[i].result[MR_FAILED]++;
+		AddToHistogram(&metrics.job[i].duration, duration_bucket, duration_us / 1000000.0);
+	}
+	metrics.written += written;
+	metrics.read += read;
+	if (!IS_ERROR(status) && (written != 0) && (duration_us != 0)) {
+		speed = ((double)written / (double)MB) * 1000000.0 / (double)duration_us;
+		AddToHistogram(&metrics.speed, speed_bucket, speed);
+		for (i = 0; (i < metrics.nb_disks) && (metrics.disk[i].disk != disk); i++);
+		if (i < METRICS_MAX_DISKS) {
+			if (i == metrics.nb_disks)
+				metrics.nb_disks++;
+			metrics.disk[i].disk = disk;
+			metrics.disk[i].speed = speed;
+		}
+	}
+	metrics.dirty = TRUE;
+	ReleaseSRWLockExclusive(&metrics.lock);
+	SetEvent(metrics.hUpdate);
+}
@@ -21,6 +21,7 @@
 #include <stdint.h>
 
 #include "../rufus.h"
+#include "../drive.h"
 #include "file.h"
 
 extern unsigned long ulBytesPerSector;
@@ -30,8 +31,7 @@ int64_t write_sectors(HANDLE hDrive, uint64_t SectorSize,
                       uint64_t StartSector, uint64_t nSectors,
                       const void *pBuf)
 {
-   LARGE_INTEGER ptr;
-   DWORD Size;
+   DWORD Size, Written;
 
    if((nSectors*SectorSize) > 0xFFFFFFFFUL)
    {
@@ -40,36 +40,16 @@ int64_t write_sectors(HANDLE hDrive, uint64_t SectorSize,
    }
    Size = (DWORD)(nSectors*SectorSize);
 
-   ptr.QuadPart = StartSector*SectorSize;
-   if(!SetFilePointerEx(hDrive, ptr, NULL, FILE_BEGIN))
+   /* BlockIo() sets LastWriteError and handles the retries, as well as the short writes of github #787 */
+   if(!BlockIo(hDrive, TRUE, (void*)pBuf, Size, StartSector*SectorSize, WRITE_RETRIES, NULL, &Written))
    {
-      uprintf("write_sectors: Could not access sector 0x%08" PRIx64 " - %s\n", StartSector, WindowsErrorString());
-      return -1;
-   }
-
-   LastWriteError = 0;
-   if(!WriteFileWithRetry(hDrive, pBuf, Size, &Size, WRITE_RETRIES))
-   {
-      LastWriteError = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|GetLastError();
       uprintf("write_sectors: Write error %s\n", WindowsErrorString());
-      uprintf("  StartSector: 0x%08" PRIx64 ", nSectors: 0x%" PRIx64 ", SectorSize: 0x%" PRIx64 "\n", StartSector, nSectors, SectorSize);
-      return -1;
-   }
-   if (Size != nSectors*SectorSize)
-   {
-      /* Some large drives return 0, even though all the data was written - See github #787 */
-      if (large_drive && Size == 0) {
-         uprintf("Warning: Possible short write\n");
-         return 0;
-      }
-      uprintf("write_sectors: Write error\n");
-      LastWriteError = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
-      uprintf("  Wrote: %d, Expected: %" PRIu64 "\n", Size, nSectors*SectorSize);
+      uprintf("  Wrote: %d, Expected: %" PRIu64 "\n", Written, nSectors*SectorSize);
       uprintf("  StartSector: 0x%08" PRIx64 ", nSectors: 0x%" PRIx64 ", SectorSize: 0x%" PRIx64 "\n", StartSector, nSectors, SectorSize);
       return -1;
    }
 
-   return (int64_t)Size;
+   return (int64_t)Written;
 }
 
 /* Returns the number of bytes read or -1 on error */
@@ -77,7 +57,6 @@ int64_t read_sectors(HANDLE hDrive, uint64_t SectorSize,
                      uint64_t StartSector, uint64_t nSectors,
                      void *pBuf)
 {
-   LARGE_INTEGER ptr;
    DWORD Size;
 
    if((nSectors*SectorSize) > 0xFFFFFFFFUL)
@@ -85,16 +64,8 @@ int64_t read_sectors(HANDLE hDrive, uint64_t SectorSize,
       uprintf("read_sectors: nSectors x SectorSize is too big\n");
       return -1;
    }
-   Size = (DWORD)(nSectors*SectorSize);
-
-   ptr.QuadPart = StartSector*SectorSize;
-   if(!SetFilePointerEx(hDrive, ptr, NULL, FILE_BEGIN))
-   {
-      uprintf("read_sectors: Could not access sector 0x%08" PRIx64 " - %s\n", StartSector, WindowsErrorString());
-      return -1;
-   }
 
-   if((!ReadFile(hDrive, pBuf, Size, &Size, NULL)) || (Size != nSectors*SectorSize))
+   if(!BlockIo(hDrive, FALSE, pBuf, (DWORD)(nSectors*SectorSize), StartSector*SectorSize, 0, NULL, &Size))
    {
       uprintf("read_sectors: Read error %s\n", (GetLastError()!=ERROR_SUCCESS)?WindowsErrorString():"");
       uprintf("  Read: %d, Expected: %" PRIu64 "\n",  Size, nSectors*SectorSize);
@@ -110,12 +81,79 @@ int64_t read_sectors(HANDLE hDrive, uint64_t SectorSize,
 * fp->_offset: a file offset
 */
 
+/*
+ * fp->_buffer: an optional copy of the first fp->_buffer_len bytes of the file, set
+ * by cache_data(), so that identifying a boot record doesn't issue one read per
+ * signature that gets tested.
+ */
+int cache_data(FILE *fp, void *pBuf, uint64_t Len)
+{
+   FAKE_FD* fd = (FAKE_FD*)fp;
+
+   fd->_buffer = NULL;
+   fd->_buffer_len = 0;
+   if(!read_data(fp, 0, pBuf, Len))
+      return 0;
+   fd->_buffer = pBuf;
+   fd->_buffer_len = Len;
+   return 1;
+} /* cache_data */
+
+/*
+ * fp->_staged: set by stage_data(), so that the boot records the write_* calls
+ * assemble in several chunks, end up being written with a single aligned write
+ * from flush_data(), instead of a read-modify-write cycle per chunk.
+ */
+int stage_data(FILE *fp, void *pBuf, uint64_t Len)
+{
+   FAKE_FD* fd = (FAKE_FD*)fp;
+
+   fd->_staged = 0;
+   fd->_dirty_start = fd->_dirty_end = 0;
+   if((Len == 0) || (Len % ulBytesPerSector != 0))
+   {
+      uprintf("stage_data: Len must be a multiple of the sector size\n");
+      return 0;
+   }
+   if(!cache_data(fp, pBuf, Len))
+      return 0;
+   fd->_staged = 1;
+   return 1;
+} /* stage_data */
+
+int flush_data(FILE *fp)
+{
+   FAKE_FD* fd = (FAKE_FD*)fp;
+   uint64_t StartSector, EndSector;
+   int r = 1;
+
+   if((fd->_staged) && (fd->_dirty_end > fd->_dirty_start))
+   {
+      StartSector = fd->_dirty_start/ulBytesPerSector;
+      EndSector   = (fd->_dirty_end+ulBytesPerSector-1)/ulBytesPerSector;
+      if(write_sectors((HANDLE)fd->_handle, ulBytesPerSector,
+                       fd->_offset/ulBytesPerSector + StartSector, EndSector - StartSector,
+                       (unsigned char*)fd->_buffer + StartSector*ulBytesPerSector) <= 0)
+         r = 0;
+   }
+   fd->_buffer = NULL;
+   fd->_buffer_len = 0;
+   fd->_staged = 0;
+   fd->_dirty_start = fd->_dirty_end = 0;
+   return r;
+} /* flush_data */
+
 int contains_data(FILE *fp, uint64_t Position,
 	const void *pData, uint64_t Len)
 {
    int r = 0;
-   unsigned char *aucBuf = _mm_malloc(MAX_DATA_LEN, 16);
+   FAKE_FD* fd = (FAKE_FD*)fp;
+   unsigned char *aucBuf;
 
+   if((fd->_buffer != NULL) && (Position + Len <= fd->_buffer_len))
+      return (memcmp(pData, (unsigned char*)fd->_buffer + Position, (size_t)Len) == 0);
+
+   aucBuf = _mm_malloc(MAX_DATA_LEN, 16);
    if(aucBuf == NULL)
       return 0;
 
@@ -136,11 +174,18 @@ int read_data(FILE *fp, uint64_t Position,
               void *pData, uint64_t Len)
 {
    int r = 0;
-   unsigned char *aucBuf = _mm_malloc(MAX_DATA_LEN, 16);
+   unsigned char *aucBuf;
    FAKE_FD* fd = (FAKE_FD*)fp;
    HANDLE hDrive = (HANDLE)fd->_handle;
    uint64_t StartSector, EndSector, NumSectors;
 
+   if((fd->_buffer != NULL) && (Position + Len <= fd->_buffer_len))
+   {
+      memcpy(pData, (unsigned char*)fd->_buffer + Position, (size_t)Len);
+      return 1;
+   }
+
+   aucBuf = _mm_malloc(MAX_DATA_LEN, 16);
    if (aucBuf == NULL)
       return 0;
 
@@ -180,12 +225,29 @@ int write_data(FILE *fp, uint64_t Position,
                const void *pData, uint64_t Len)
 {
    int r = 0;
-   /* Windows' WriteFile() may require a buffer that is aligned to the sector size */
-   unsigned char *aucBuf = _mm_malloc(MAX_DATA_LEN, 4096);
+   unsigned char *aucBuf;
    FAKE_FD* fd = (FAKE_FD*)fp;
    HANDLE hDrive = (HANDLE)fd->_handle;
    uint64_t StartSector, EndSector, NumSectors;
 
+   if((fd->_staged) && (Position + Len <= fd->_buffer_len))
+   {
+      memcpy((unsigned char*)fd->_buffer + Position, pData, (size_t)Len);
+      if(fd->_dirty_end <= fd->_dirty_start)
+      {
+         fd->_dirty_start = Position;
+         fd->_dirty_end = Position + Len;
+      }
+      else
+      {
+         fd->_dirty_start = min(fd->_dirty_start, Position);
+         fd->_dirty_end = max(fd->_dirty_end, Position + Len);
+      }
+      return 1;
+   }
+
+   /* Windows' WriteFile() may require a buffer that is aligned to the sector size */
+   aucBuf = _mm_malloc(MAX_DATA_LEN, 4096);
    if (aucBuf == NULL)
       return 0;
 
@@ -219,6 +281,12 @@ int write_data(FILE *fp, uint64_t Position,
                      NumSectors, aucBuf) <= 0)
       goto out;
 
+   /* Keep the cached copy, if any, in sync with what we wrote */
+   Position -= fd->_offset;
+   if((fd->_buffer != NULL) && (Position < fd->_buffer_len))
+      memcpy((unsigned char*)fd->_buffer + Position, pData,
+             (size_t)min(Len, fd->_buffer_len - Position));
+
    r = 1;
 
 out:
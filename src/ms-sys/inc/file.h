@@ -6,12 +6,33 @@
 /* Max valid value of uiLen for contains_data */
 #define MAX_DATA_LEN 65536
 
+/* Size of the boot record area that cache_data should read to identify an MBR or PBR */
+#define BR_CACHE_LEN 8192
+
 /* We hijack the FILE structure for our own needs */
 typedef struct {
 	void *_handle;
 	uint64_t _offset;
+	void *_buffer;
+	uint64_t _buffer_len;
+	int _staged;
+	uint64_t _dirty_start;
+	uint64_t _dirty_end;
 } FAKE_FD;
 
+/* Reads Len bytes from the start of the file into pBuf, after which all the
+   reads that fall within that range are served from memory. */
+int cache_data(FILE *fp, void *pBuf, uint64_t Len);
+
+/* Same as cache_data, but the writes that fall within that range are also only
+   applied to memory, until flush_data is called. pBuf must be aligned to the
+   sector size and Len must be a multiple of it. */
+int stage_data(FILE *fp, void *pBuf, uint64_t Len);
+
+/* Writes all the sectors that were modified since stage_data was called, in a
+   single operation, and stops serving reads and writes from memory. */
+int flush_data(FILE *fp);
+
 /* Checks if a file contains a data pattern of length Len at position
    Position. The file pointer will change when calling this function! */
 int contains_data(FILE *fp, uint64_t Position,
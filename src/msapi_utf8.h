@@ -79,6 +79,9 @@ extern "C" {
 #define wconvert(p)     wchar_t* w ## p = utf8_to_wchar(p)
 #define walloc(p, size) wchar_t* w ## p = (p == NULL)?NULL:(wchar_t*)calloc(size, sizeof(wchar_t))
 #define wfree(p) sfree(w ## p)
+// Same as the above, for paths, that don't go through the heap unless they are longer than MAX_PATH
+#define wpconvert(p)    wchar_t w ## p ## _buf[MAX_PATH]; wchar_t* w ## p = utf8_to_wchar_buf(p, w ## p ## _buf, MAX_PATH)
+#define wpfree(p)       do {if (w ## p != w ## p ## _buf) free(w ## p); w ## p = NULL;} while(0)
 
 /*
  * Converts an UTF-16 string to UTF8 (allocate returned string)
@@ -140,6 +143,20 @@ static __inline wchar_t* utf8_to_wchar(const char* str)
 	return wstr;
 }
 
+/*
+ * Converts an UTF8 string to UTF-16, into wbuf if it fits there, and into an allocated
+ * string otherwise, which lets the callers keep the common case off the heap
+ * Returns NULL on error
+ */
+static __inline wchar_t* utf8_to_wchar_buf(const char* str, wchar_t* wbuf, int wbuf_size)
+{
+	if (str == NULL)
+		return NULL;
+	if (utf8_to_wchar_no_alloc(str, wbuf, wbuf_size) > 0)
+		return wbuf;
+	return (GetLastError() == ERROR_INSUFFICIENT_BUFFER) ? utf8_to_wchar(str) : NULL;
+}
+
 /*
 * Converts an non NUL-terminated UTF-16 string of length len to UTF8 (allocate returned string)
 * Returns NULL on error
@@ -484,11 +501,11 @@ static __inline HANDLE CreateFileU(const char* lpFileName, DWORD dwDesiredAccess
 {
 	HANDLE ret = INVALID_HANDLE_VALUE;
 	DWORD err = ERROR_INVALID_DATA;
-	wconvert(lpFileName);
+	wpconvert(lpFileName);
 	ret = CreateFileW(wlpFileName, dwDesiredAccess, dwShareMode, lpSecurityAttributes,
 		dwCreationDisposition, dwFlagsAndAttributes, hTemplateFile);
 	err = GetLastError();
-	wfree(lpFileName);
+	wpfree(lpFileName);
 	SetLastError(err);
 	return ret;
 }
@@ -497,10 +514,10 @@ static __inline BOOL CreateDirectoryU(const char* lpPathName, LPSECURITY_ATTRIBU
 {
 	BOOL ret = FALSE;
 	DWORD err = ERROR_INVALID_DATA;
-	wconvert(lpPathName);
+	wpconvert(lpPathName);
 	ret = CreateDirectoryW(wlpPathName, lpSecurityAttributes);
 	err = GetLastError();
-	wfree(lpPathName);
+	wpfree(lpPathName);
 	SetLastError(err);
 	return ret;
 }
@@ -509,12 +526,12 @@ static __inline BOOL CopyFileU(const char* lpExistingFileName, const char* lpNew
 {
 	BOOL ret = FALSE;
 	DWORD err = ERROR_INVALID_DATA;
-	wconvert(lpExistingFileName);
-	wconvert(lpNewFileName);
+	wpconvert(lpExistingFileName);
+	wpconvert(lpNewFileName);
 	ret = CopyFileW(wlpExistingFileName, wlpNewFileName, bFailIfExists);
 	err = GetLastError();
-	wfree(lpExistingFileName);
-	wfree(lpNewFileName);
+	wpfree(lpExistingFileName);
+	wpfree(lpNewFileName);
 	SetLastError(err);
 	return ret;
 }
@@ -523,10 +540,10 @@ static __inline BOOL DeleteFileU(const char* lpFileName)
 {
 	BOOL ret = FALSE;
 	DWORD err = ERROR_INVALID_DATA;
-	wconvert(lpFileName);
+	wpconvert(lpFileName);
 	ret = DeleteFileW(wlpFileName);
 	err = GetLastError();
-	wfree(lpFileName);
+	wpfree(lpFileName);
 	SetLastError(err);
 	return ret;
 }
@@ -534,9 +551,9 @@ static __inline BOOL DeleteFileU(const char* lpFileName)
 static __inline BOOL PathFileExistsU(char* szPath)
 {
 	BOOL ret;
-	wconvert(szPath);
+	wpconvert(szPath);
 	ret = PathFileExistsW(wszPath);
-	wfree(szPath);
+	wpfree(szPath);
 	return ret;
 }
 
@@ -773,7 +790,7 @@ out:
 static __inline DWORD GetFileAttributesU(const char* lpFileName)
 {
 	DWORD ret = 0xFFFFFFFF, err = ERROR_INVALID_DATA;
-	wconvert(lpFileName);
+	wpconvert(lpFileName);
 	// Unlike Microsoft's version, ours doesn't fail if the string is quoted
 	if ((wlpFileName[0] == L'"') && (wlpFileName[wcslen(wlpFileName) - 1] == L'"')) {
 		wlpFileName[wcslen(wlpFileName) - 1] = 0;
@@ -782,7 +799,7 @@ static __inline DWORD GetFileAttributesU(const char* lpFileName)
 		ret = GetFileAttributesW(wlpFileName);
 	}
 	err = GetLastError();
-	wfree(lpFileName);
+	wpfree(lpFileName);
 	SetLastError(err);
 	return ret;
 }
@@ -790,7 +807,7 @@ static __inline DWORD GetFileAttributesU(const char* lpFileName)
 static __inline BOOL SetFileAttributesU(const char* lpFileName, DWORD dwFileAttributes)
 {
 	BOOL ret = FALSE, err = ERROR_INVALID_DATA;
-	wconvert(lpFileName);
+	wpconvert(lpFileName);
 	// Unlike Microsoft's version, ours doesn't fail if the string is quoted
 	if ((wlpFileName[0] == L'"') && (wlpFileName[wcslen(wlpFileName) - 1] == L'"')) {
 		wlpFileName[wcslen(wlpFileName) - 1] = 0;
@@ -799,7 +816,7 @@ static __inline BOOL SetFileAttributesU(const char* lpFileName, DWORD dwFileAttr
 		ret = SetFileAttributesW(wlpFileName, dwFileAttributes);
 	}
 	err = GetLastError();
-	wfree(lpFileName);
+	wpfree(lpFileName);
 	SetLastError(err);
 	return ret;
 }
@@ -1049,31 +1066,31 @@ static __inline int _chdirU(const char *dirname)
 static __inline FILE* fopenU(const char* filename, const char* mode)
 {
 	FILE* ret = NULL;
-	wconvert(filename);
-	wconvert(mode);
+	wpconvert(filename);
+	wpconvert(mode);
 	ret = _wfopen(wfilename, wmode);
-	wfree(filename);
-	wfree(mode);
+	wpfree(filename);
+	wpfree(mode);
 	return ret;
 }
 
 static __inline int _openU(const char *filename, int oflag, int pmode)
 {
 	int ret = -1;
-	wconvert(filename);
+	wpconvert(filename);
 	ret = _wopen(wfilename, oflag, pmode);
-	wfree(filename);
+	wpfree(filename);
 	return ret;
 }
 #else
 static __inline FILE* fopenU(const char* filename, const char* mode)
 {
 	FILE* ret = NULL;
-	wconvert(filename);
-	wconvert(mode);
+	wpconvert(filename);
+	wpconvert(mode);
 	_wfopen_s(&ret, wfilename, wmode);
-	wfree(filename);
-	wfree(mode);
+	wpfree(filename);
+	wpfree(mode);
 	return ret;
 }
 
@@ -1081,14 +1098,14 @@ static __inline int _openU(const char *filename, int oflag , int pmode)
 {
 	int ret = -1;
 	int shflag = _SH_DENYNO;
-	wconvert(filename);
+	wpconvert(filename);
 	// Try to match the share flag to the oflag
 	if ((oflag & 0x03) == _O_RDONLY)
 		shflag = _SH_DENYWR;
 	else if ((oflag & 0x03) == _O_WRONLY)
 		shflag = _SH_DENYRD;
 	_wsopen_s(&ret, wfilename, oflag, shflag, pmode);
-	wfree(filename);
+	wpfree(filename);
 	return ret;
 }
 #endif
@@ -1096,27 +1113,27 @@ static __inline int _openU(const char *filename, int oflag , int pmode)
 static __inline int _unlinkU(const char* path)
 {
 	int ret;
-	wconvert(path);
+	wpconvert(path);
 	ret = _wunlink(wpath);
-	wfree(path);
+	wpfree(path);
 	return ret;
 }
 
 static __inline int _stat64U(const char *path, struct __stat64 *buffer)
 {
 	int ret;
-	wconvert(path);
+	wpconvert(path);
 	ret = _wstat64(wpath, buffer);
-	wfree(path);
+	wpfree(path);
 	return ret;
 }
 
 static __inline int _accessU(const char* path, int mode)
 {
 	int ret;
-	wconvert(path);
+	wpconvert(path);
 	ret = _waccess(wpath, mode);
-	wfree(path);
+	wpfree(path);
 	return ret;
 }
 
@@ -1154,10 +1171,10 @@ static __inline char* getenvU(const char* varname)
 
 static __inline int _mkdirU(const char* dirname)
 {
-	wconvert(dirname);
+	wpconvert(dirname);
 	int ret;
 	ret = _wmkdir(wdirname);
-	wfree(dirname);
+	wpfree(dirname);
 	return ret;
 }
 
@@ -1166,7 +1183,7 @@ static __inline int _mkdirExU(const char* dirname)
 {
 	int ret = -1, trailing_slash = -1;
 	size_t i, len;
-	wconvert(dirname);
+	wpconvert(dirname);
 	len = wcslen(wdirname);
 	while (trailing_slash && (len > 0)) {
 		if ((wdirname[len - 1] == '\\') || (wdirname[len - 1] == '/'))
@@ -1185,36 +1202,36 @@ static __inline int _mkdirExU(const char* dirname)
 	}
 	ret = 0;
 out:
-	wfree(dirname);
+	wpfree(dirname);
 	return ret;
 }
 
 static __inline int _rmdirU(const char* dirname)
 {
-	wconvert(dirname);
+	wpconvert(dirname);
 	int ret;
 	ret = _wrmdir(wdirname);
-	wfree(dirname);
+	wpfree(dirname);
 	return ret;
 }
 
 static __inline BOOL MoveFileU(const char* lpExistingFileName, const char* lpNewFileName)
 {
-	wconvert(lpExistingFileName);
-	wconvert(lpNewFileName);
+	wpconvert(lpExistingFileName);
+	wpconvert(lpNewFileName);
 	BOOL ret = MoveFileW(wlpExistingFileName, wlpNewFileName);
-	wfree(lpNewFileName);
-	wfree(lpExistingFileName);
+	wpfree(lpNewFileName);
+	wpfree(lpExistingFileName);
 	return ret;
 }
 
 static __inline BOOL MoveFileExU(const char* lpExistingFileName, const char* lpNewFileName, DWORD dwFlags)
 {
-	wconvert(lpExistingFileName);
-	wconvert(lpNewFileName);
+	wpconvert(lpExistingFileName);
+	wpconvert(lpNewFileName);
 	BOOL ret = MoveFileExW(wlpExistingFileName, wlpNewFileName, dwFlags);
-	wfree(lpNewFileName);
-	wfree(lpExistingFileName);
+	wpfree(lpNewFileName);
+	wpfree(lpExistingFileName);
 	return ret;
 }
 
@@ -25,6 +25,7 @@
 
 #include <windows.h>
 #include <wininet.h>
+#include <winioctl.h>
 #include <netlistmgr.h>
 #include <stdio.h>
 #include <malloc.h>
@@ -42,7 +43,21 @@
 #include "settings.h"
 
 /* Maximum download chunk size, in bytes */
-#define DOWNLOAD_BUFFER_SIZE    (10*KB)
+#define DOWNLOAD_BUFFER_SIZE    (1*MB)
+/* Minimum size a file download must have, to be split between multiple connections */
+#define DOWNLOAD_SEGMENT_MIN    (64*MB)
+/* Default and maximum number of connections for segmented downloads */
+#define DOWNLOAD_CONNECTIONS    4
+#define DOWNLOAD_MAX_CONNECTIONS 8
+/* How many times we reissue a request that got dropped, from where it stopped */
+#define DOWNLOAD_RETRIES        4
+/* Size of the range request we use to probe a download mirror */
+#define DOWNLOAD_PROBE_SIZE     (64*KB)
+/* How much slower than the fastest one a download source can be, for us to still use it */
+#define DOWNLOAD_PROBE_SLACK    3
+/* Maximum number of signed files we can prefetch, and maximum size of a prefetched file */
+#define MAX_PREFETCH            4
+#define MAX_PREFETCH_SIZE       (4*MB)
 /* Default delay between update checks (1 day) */
 #define DEFAULT_UPDATE_INTERVAL (24*3600)
 
@@ -55,8 +70,64 @@ extern HANDLE dialog_handle;
 extern BOOL is_x86_32;
 static DWORD error_code, fido_len = 0;
 static BOOL force_update_check = FALSE;
+/* Signed download script that was fetched ahead of the user asking for it */
+static struct {
+	SRWLOCK lock;
+	BYTE* buf;
+	DWORD buf_len;
+} fido_prefetch = { SRWLOCK_INIT };
 static const char* request_headers = "Accept-Encoding: gzip, deflate";
 
+/* A server that we download a file from, being either the one from the URL or a mirror */
+typedef struct {
+	const char* url;
+	HINTERNET hConnection;
+	char hostname[64];
+	char url_path[128];
+	DWORD flags;
+	BOOL is_primary;		// Set for the server from the URL, which we fall back to
+	uint64_t size;			// Size of the file, as reported by the server
+	uint64_t probe_time;		// How long the probe of the server took, in ms
+} download_source;
+
+typedef struct {
+	download_source* src;
+	HINTERNET hSession;
+	const char** accept_types;
+} download_probe;
+
+/* Shared download data, for the (possibly multiple) segments of a single file */
+typedef struct {
+	download_source* primary;
+	const char** accept_types;
+	HANDLE hFile;
+	BYTE* buffer;
+	uint64_t total_size;
+	BOOL accept_ranges;
+	HWND hProgressDialog;
+	volatile LONG64 downloaded;
+} download_context;
+
+typedef struct {
+	download_context* ctx;
+	download_source* src;
+	HINTERNET hRequest;		// Request that was already issued for the start of the file, if any
+	uint64_t start;
+	uint64_t end;			// Exclusive
+	volatile uint64_t pos;
+	BOOL report_progress;
+} download_segment;
+
+/* Signed files (and their signature) that were downloaded ahead of the user needing them */
+static struct {
+	char* url;
+	BYTE* buf;
+	DWORD buf_len;
+	BYTE* sig;
+	DWORD sig_len;
+} prefetch[MAX_PREFETCH] = { 0 };
+static HANDLE prefetch_thread = NULL;
+
 /*
  * FormatMessage does not handle internet errors
  * https://docs.microsoft.com/en-us/windows/desktop/wininet/wininet-errors
@@ -311,6 +382,313 @@ out:
 	return hSession;
 }
 
+/*
+ * Download the [pos, end) range of a file, into a buffer or at the matching offset of a file.
+ * If the connection gets dropped, the transfer resumes from where it left off, provided that
+ * the server supports range requests.
+ */
+static BOOL DownloadSegment(download_segment* seg)
+{
+	download_context* ctx = seg->ctx;
+	char headers[96];
+	BYTE* buf = NULL;
+	int retry;
+	DWORD dwSize, dwStatus, dwDownloaded, dwWritten;
+	HINTERNET hRequest = seg->hRequest;
+	OVERLAPPED overlapped = { 0 };
+
+	PF_TYPE_DECL(WINAPI, BOOL, InternetReadFile, (HINTERNET, LPVOID, DWORD, LPDWORD));
+	PF_TYPE_DECL(WINAPI, BOOL, InternetCloseHandle, (HINTERNET));
+	PF_TYPE_DECL(WINAPI, HINTERNET, HttpOpenRequestA, (HINTERNET, LPCSTR, LPCSTR, LPCSTR, LPCSTR, LPCSTR*, DWORD, DWORD_PTR));
+	PF_TYPE_DECL(WINAPI, BOOL, HttpSendRequestA, (HINTERNET, LPCSTR, DWORD, LPVOID, DWORD));
+	PF_TYPE_DECL(WINAPI, BOOL, HttpQueryInfoA, (HINTERNET, DWORD, LPVOID, LPDWORD, LPDWORD));
+	PF_INIT_OR_OUT(InternetReadFile, WinInet);
+	PF_INIT_OR_OUT(InternetCloseHandle, WinInet);
+	PF_INIT_OR_OUT(HttpOpenRequestA, WinInet);
+	PF_INIT_OR_OUT(HttpSendRequestA, WinInet);
+	PF_INIT_OR_OUT(HttpQueryInfoA, WinInet);
+
+	seg->hRequest = NULL;
+	buf = malloc(DOWNLOAD_BUFFER_SIZE);
+	if (buf == NULL)
+		goto out;
+
+	for (retry = 0; (seg->pos < seg->end) && (retry <= DOWNLOAD_RETRIES); retry++) {
+		if (IS_ERROR(FormatStatus))
+			break;
+		// (Re)issue the request for the part of the segment that we don't have yet
+		if (hRequest == NULL) {
+			if (!ctx->accept_ranges)
+				break;
+			if (retry != 0) {
+				// Don't insist with a mirror that dropped us, when we can use the main server
+				if (seg->src != ctx->primary) {
+					uprintf("Download from '%s' failed - Using the main server", seg->src->hostname);
+					seg->src = ctx->primary;
+				}
+				uprintf("Resuming download from offset 0x%llx...", seg->pos);
+				Sleep(1000);
+			}
+			// We need the server data as is, for the ranges to match, so no gzip/deflate here
+			static_sprintf(headers, "Range: bytes=%llu-%llu", seg->pos, seg->end - 1);
+			hRequest = pfHttpOpenRequestA(seg->src->hConnection, "GET", seg->src->url_path, NULL, NULL,
+				ctx->accept_types, seg->src->flags, (DWORD_PTR)NULL);
+			if (hRequest == NULL)
+				continue;
+			dwSize = sizeof(dwStatus);
+			if (!pfHttpSendRequestA(hRequest, headers, -1L, NULL, 0) ||
+				!pfHttpQueryInfoA(hRequest, HTTP_QUERY_STATUS_CODE | HTTP_QUERY_FLAG_NUMBER, &dwStatus, &dwSize, NULL) ||
+				(dwStatus != 206)) {
+				uprintf("Could not issue range request: %s", WinInetErrorString());
+				pfInternetCloseHandle(hRequest);
+				hRequest = NULL;
+				continue;
+			}
+		}
+		while (seg->pos < seg->end) {
+			// User may have cancelled the download
+			if (IS_ERROR(FormatStatus))
+				break;
+			if (!pfInternetReadFile(hRequest, buf, DOWNLOAD_BUFFER_SIZE, &dwDownloaded) || (dwDownloaded == 0))
+				break;
+			dwDownloaded = (DWORD)min(dwDownloaded, seg->end - seg->pos);
+			if (ctx->hFile != INVALID_HANDLE_VALUE) {
+				overlapped.Offset = (DWORD)seg->pos;
+				overlapped.OffsetHigh = (DWORD)(seg->pos >> 32);
+				if (!WriteFile(ctx->hFile, buf, dwDownloaded, &dwWritten, &overlapped) || (dwWritten != dwDownloaded)) {
+					uprintf("Error writing downloaded data: %s", WindowsErrorString());
+					FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_WRITE_FAULT;
+					break;
+				}
+			} else {
+				memcpy(&ctx->buffer[seg->pos], buf, dwDownloaded);
+			}
+			seg->pos += dwDownloaded;
+			InterlockedExchangeAdd64(&ctx->downloaded, dwDownloaded);
+			if (seg->report_progress && (ctx->hProgressDialog != NULL))
+				UpdateProgressWithInfo(OP_NOOP, MSG_241, ctx->downloaded, ctx->total_size);
+		}
+		pfInternetCloseHandle(hRequest);
+		hRequest = NULL;
+	}
+
+out:
+	if ((hRequest != NULL) && (pfInternetCloseHandle != NULL))
+		pfInternetCloseHandle(hRequest);
+	free(buf);
+	return (seg->pos == seg->end);
+}
+
+static DWORD WINAPI DownloadSegmentThread(LPVOID param)
+{
+	ExitThread((DWORD)DownloadSegment((download_segment*)param));
+}
+
+/*
+ * Issue a small range request to a download source, to measure how fast it responds and
+ * check that it serves the same file. A connection is opened, and kept, for sources that
+ * don't have one already.
+ */
+static BOOL ProbeDownloadSource(download_probe* probe)
+{
+	download_source* src = probe->src;
+	char headers[64], strsize[64], *p;
+	BYTE* buf = NULL;
+	BOOL r = FALSE, connected = FALSE;
+	DWORD dwSize, dwStatus, dwDownloaded, dwTotal = 0;
+	uint64_t start = GetTickCount64();
+	HINTERNET hRequest = NULL;
+	URL_COMPONENTSA UrlParts = {sizeof(URL_COMPONENTSA), NULL, 1, (INTERNET_SCHEME)0,
+		src->hostname, sizeof(src->hostname), 0, NULL, 1, src->url_path, sizeof(src->url_path), NULL, 1};
+
+	PF_TYPE_DECL(WINAPI, BOOL, InternetCrackUrlA, (LPCSTR, DWORD, DWORD, LPURL_COMPONENTSA));
+	PF_TYPE_DECL(WINAPI, HINTERNET, InternetConnectA, (HINTERNET, LPCSTR, INTERNET_PORT, LPCSTR, LPCSTR, DWORD, DWORD, DWORD_PTR));
+	PF_TYPE_DECL(WINAPI, BOOL, InternetReadFile, (HINTERNET, LPVOID, DWORD, LPDWORD));
+	PF_TYPE_DECL(WINAPI, BOOL, InternetCloseHandle, (HINTERNET));
+	PF_TYPE_DECL(WINAPI, HINTERNET, HttpOpenRequestA, (HINTERNET, LPCSTR, LPCSTR, LPCSTR, LPCSTR, LPCSTR*, DWORD, DWORD_PTR));
+	PF_TYPE_DECL(WINAPI, BOOL, HttpSendRequestA, (HINTERNET, LPCSTR, DWORD, LPVOID, DWORD));
+	PF_TYPE_DECL(WINAPI, BOOL, HttpQueryInfoA, (HINTERNET, DWORD, LPVOID, LPDWORD, LPDWORD));
+	PF_INIT_OR_OUT(InternetCrackUrlA, WinInet);
+	PF_INIT_OR_OUT(InternetConnectA, WinInet);
+	PF_INIT_OR_OUT(InternetReadFile, WinInet);
+	PF_INIT_OR_OUT(InternetCloseHandle, WinInet);
+	PF_INIT_OR_OUT(HttpOpenRequestA, WinInet);
+	PF_INIT_OR_OUT(HttpSendRequestA, WinInet);
+	PF_INIT_OR_OUT(HttpQueryInfoA, WinInet);
+
+	if (src->hConnection == NULL) {
+		if ( (!pfInternetCrackUrlA(src->url, (DWORD)safe_strlen(src->url), 0, &UrlParts))
+		  || (UrlParts.lpszHostName == NULL) || (UrlParts.lpszUrlPath == NULL))
+			goto out;
+		src->hostname[sizeof(src->hostname) - 1] = 0;
+		src->flags = INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTP|INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTPS|
+			INTERNET_FLAG_NO_COOKIES|INTERNET_FLAG_NO_UI|INTERNET_FLAG_NO_CACHE_WRITE|INTERNET_FLAG_HYPERLINK|
+			((UrlParts.nScheme==INTERNET_SCHEME_HTTPS)?INTERNET_FLAG_SECURE:0);
+		src->hConnection = pfInternetConnectA(probe->hSession, UrlParts.lpszHostName, UrlParts.nPort,
+			NULL, NULL, INTERNET_SERVICE_HTTP, 0, (DWORD_PTR)NULL);
+		if (src->hConnection == NULL)
+			goto out;
+		connected = TRUE;
+	}
+	buf = malloc(DOWNLOAD_PROBE_SIZE);
+	if (buf == NULL)
+		goto out;
+	static_sprintf(headers, "Range: bytes=0-%d", DOWNLOAD_PROBE_SIZE - 1);
+	hRequest = pfHttpOpenRequestA(src->hConnection, "GET", src->url_path, NULL, NULL,
+		probe->accept_types, src->flags, (DWORD_PTR)NULL);
+	dwSize = sizeof(dwStatus);
+	if ((hRequest == NULL) || !pfHttpSendRequestA(hRequest, headers, -1L, NULL, 0) ||
+		!pfHttpQueryInfoA(hRequest, HTTP_QUERY_STATUS_CODE | HTTP_QUERY_FLAG_NUMBER, &dwStatus, &dwSize, NULL) ||
+		(dwStatus != 206))
+		goto out;
+	// The range response is of the form "bytes 0-65535/<file size>"
+	dwSize = sizeof(strsize);
+	if (!pfHttpQueryInfoA(hRequest, HTTP_QUERY_CONTENT_RANGE, (LPVOID)strsize, &dwSize, NULL) ||
+		((p = strchr(strsize, '/')) == NULL))
+		goto out;
+	src->size = (uint64_t)atoll(&p[1]);
+	while ((dwTotal < DOWNLOAD_PROBE_SIZE) && pfInternetReadFile(hRequest, &buf[dwTotal],
+		DOWNLOAD_PROBE_SIZE - dwTotal, &dwDownloaded) && (dwDownloaded != 0))
+		dwTotal += dwDownloaded;
+	r = (dwTotal == min(src->size, DOWNLOAD_PROBE_SIZE));
+	src->probe_time = max(GetTickCount64() - start, 1);
+
+out:
+	if ((hRequest != NULL) && (pfInternetCloseHandle != NULL))
+		pfInternetCloseHandle(hRequest);
+	if (!r) {
+		if (connected)
+			pfInternetCloseHandle(src->hConnection);
+		if (connected || !src->is_primary)
+			src->hConnection = NULL;
+		src->probe_time = UINT64_MAX;
+	}
+	free(buf);
+	return r;
+}
+
+static DWORD WINAPI ProbeDownloadSourceThread(LPVOID param)
+{
+	ExitThread((DWORD)ProbeDownloadSource((download_probe*)param));
+}
+
+static int download_source_cmp(const void* a, const void* b)
+{
+	const download_source* sa = (const download_source*)a;
+	const download_source* sb = (const download_source*)b;
+
+	return (sa->probe_time > sb->probe_time) - (sa->probe_time < sb->probe_time);
+}
+
+// Return the mirrors we know of for an URL, which come from the (signed) version file
+static int GetDownloadMirrors(const char* url, const char** mirror)
+{
+	int i, n = 0;
+
+	if ((update.download_url != NULL) && (strcmp(url, update.download_url) == 0)) {
+		for (i = 0; (i < MAX_DOWNLOAD_MIRRORS) && (update.download_mirror[i] != NULL); i++)
+			mirror[n++] = update.download_mirror[i];
+	}
+	return n;
+}
+
+/*
+ * Probe the main server of a download, in source[0], along with its mirrors, concurrently, and
+ * keep up to max_sources of the ones that respond the fastest, to spread the segments over.
+ * The mirrors must report the same file size, and what we get from them goes through the same
+ * validation as a download from the main server. The retained sources are sorted from fastest
+ * to slowest and their number is returned. If the main server isn't one of them, it is placed
+ * right after them, so that we can still fall back to it.
+ */
+static int SelectDownloadSources(HINTERNET hSession, const char** accept_types, download_source* source, int max_sources)
+{
+	const char* mirror[MAX_DOWNLOAD_MIRRORS];
+	int i, n = 0, nb_sources = GetDownloadMirrors(source[0].url, mirror) + 1;
+	HANDLE hThread[MAX_DOWNLOAD_MIRRORS + 1] = { 0 };
+	download_probe probe[MAX_DOWNLOAD_MIRRORS + 1] = { 0 };
+	download_source primary = { 0 };
+
+	PF_TYPE_DECL(WINAPI, BOOL, InternetCloseHandle, (HINTERNET));
+	PF_INIT(InternetCloseHandle, WinInet);
+
+	if ((nb_sources == 1) || (pfInternetCloseHandle == NULL))
+		return 1;
+	for (i = 1; i < nb_sources; i++)
+		source[i].url = mirror[i - 1];
+	for (i = 0; i < nb_sources; i++) {
+		probe[i].src = &source[i];
+		probe[i].hSession = hSession;
+		probe[i].accept_types = accept_types;
+		hThread[i] = CreateThread(NULL, 0, ProbeDownloadSourceThread, &probe[i], 0, NULL);
+		if (hThread[i] == NULL)
+			ProbeDownloadSource(&probe[i]);
+	}
+	for (i = 0; i < nb_sources; i++) {
+		if (hThread[i] != NULL)
+			WaitForSingleObject(hThread[i], INFINITE);
+		safe_closehandle(hThread[i]);
+		if ((!source[i].is_primary) && (source[i].size != source[0].size))
+			source[i].probe_time = UINT64_MAX;
+	}
+
+	qsort(source, nb_sources, sizeof(download_source), download_source_cmp);
+	for (i = 0; i < nb_sources; i++) {
+		if ((n < max_sources) && (source[i].probe_time != UINT64_MAX) &&
+			(source[i].probe_time <= DOWNLOAD_PROBE_SLACK * source[0].probe_time)) {
+			vuprintf("Using download source '%s' (%lld ms)", source[i].is_primary ? "main server" :
+				source[i].hostname, source[i].probe_time);
+			if (i != n)
+				source[n] = source[i];
+			n++;
+		} else if (source[i].is_primary) {
+			primary = source[i];
+		} else if (source[i].hConnection != NULL) {
+			pfInternetCloseHandle(source[i].hConnection);
+		}
+	}
+	for (i = n; i < nb_sources; i++)
+		memset(&source[i], 0, sizeof(download_source));
+	if (primary.is_primary) {
+		source[n] = primary;
+		if (n == 0)
+			n++;
+	}
+	if (n > 1)
+		uprintf("Downloading from %d sources", n);
+	return n;
+}
+
+/*
+ * Feed the hash stream with the data from the file being downloaded, as far as it is contiguous
+ * from the start. This reads back data that was just written, and is therefore still in cache,
+ * so that the checksums are available as soon as the download completes.
+ */
+static BOOL HashDownloadedData(HANDLE hFile, download_segment* seg, int nb_segments, uint64_t* hashed, BYTE* buf)
+{
+	int i;
+	uint64_t total_size = seg[nb_segments - 1].end;
+	DWORD size;
+	OVERLAPPED overlapped = { 0 };
+
+	for (i = 0; (i < nb_segments) && (*hashed < total_size); ) {
+		if (*hashed >= seg[i].end) {
+			i++;
+			continue;
+		}
+		if (seg[i].pos <= *hashed)
+			break;
+		size = (DWORD)min(seg[i].pos - *hashed, DOWNLOAD_BUFFER_SIZE);
+		overlapped.Offset = (DWORD)*hashed;
+		overlapped.OffsetHigh = (DWORD)(*hashed >> 32);
+		if (!ReadFile(hFile, buf, size, &size, &overlapped) || (size == 0) || !WriteHashStream(buf, size)) {
+			uprintf("Could not hash downloaded data: %s", WindowsErrorString());
+			return FALSE;
+		}
+		*hashed += size;
+	}
+	return TRUE;
+}
+
 /*
  * Download a file or fill a buffer from an URL
  * Mostly taken from http://support.microsoft.com/kb/234913
@@ -320,20 +698,29 @@ out:
  * and also attempt to indicate progress using an IDC_PROGRESS control
  * Note that when a buffer is used, the actual size of the buffer is one more than its reported
  * size (with the extra byte set to 0) to accommodate for calls that need a NUL-terminated buffer.
+ * File downloads go through a '.part' file, which is kept on failure if the server supports range
+ * requests, so that a subsequent download of the same file can resume from where it stopped.
+ * Large files are also split into segments that get downloaded over parallel connections.
  */
 uint64_t DownloadToFileOrBuffer(const char* url, const char* file, BYTE** buffer, HWND hProgressDialog, BOOL bTaskBarProgress)
 {
 	const char* accept_types[] = {"*/*\0", NULL};
 	const char* short_name;
-	unsigned char buf[DOWNLOAD_BUFFER_SIZE];
-	char hostname[64], urlpath[128], strsize[32];
-	BOOL r = FALSE;
-	DWORD dwSize, dwWritten, dwDownloaded;
-	HANDLE hFile = INVALID_HANDLE_VALUE;
+	char hostname[64], urlpath[128], strsize[32], *part_file = NULL;
+	BYTE* hash_buf = NULL;
+	BOOL r = FALSE, hashing = FALSE;
+	int i, nb_segments = 1;
+	DWORD dwSize, dwFlags;
+	HANDLE hFile = INVALID_HANDLE_VALUE, hThread[DOWNLOAD_MAX_CONNECTIONS] = { 0 };
 	HINTERNET hSession = NULL, hConnection = NULL, hRequest = NULL;
 	URL_COMPONENTSA UrlParts = {sizeof(URL_COMPONENTSA), NULL, 1, (INTERNET_SCHEME)0,
 		hostname, sizeof(hostname), 0, NULL, 1, urlpath, sizeof(urlpath), NULL, 1};
-	uint64_t size = 0, total_size = 0;
+	uint64_t size = 0, total_size = 0, segment_size, hashed = 0;
+	LARGE_INTEGER li;
+	download_context ctx = { 0 };
+	download_segment seg[DOWNLOAD_MAX_CONNECTIONS] = { 0 };
+	download_source source[MAX_DOWNLOAD_MIRRORS + 1] = { 0 };
+	int nb_sources = 1;
 
 	// Can't link with wininet.lib because of sideloading issues
 	PF_TYPE_DECL(WINAPI, BOOL, InternetCrackUrlA, (LPCSTR, DWORD, DWORD, LPURL_COMPONENTSA));
@@ -386,10 +773,10 @@ uint64_t DownloadToFileOrBuffer(const char* url, const char* file, BYTE** buffer
 		goto out;
 	}
 
-	hRequest = pfHttpOpenRequestA(hConnection, "GET", UrlParts.lpszUrlPath, NULL, NULL, accept_types,
-		INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTP|INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTPS|
+	dwFlags = INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTP|INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTPS|
 		INTERNET_FLAG_NO_COOKIES|INTERNET_FLAG_NO_UI|INTERNET_FLAG_NO_CACHE_WRITE|INTERNET_FLAG_HYPERLINK|
-		((UrlParts.nScheme==INTERNET_SCHEME_HTTPS)?INTERNET_FLAG_SECURE:0), (DWORD_PTR)NULL);
+		((UrlParts.nScheme==INTERNET_SCHEME_HTTPS)?INTERNET_FLAG_SECURE:0);
+	hRequest = pfHttpOpenRequestA(hConnection, "GET", UrlParts.lpszUrlPath, NULL, NULL, accept_types, dwFlags, (DWORD_PTR)NULL);
 	if (hRequest == NULL) {
 		uprintf("Could not open URL %s: %s", url, WinInetErrorString());
 		goto out;
@@ -425,12 +812,47 @@ uint64_t DownloadToFileOrBuffer(const char* url, const char* file, BYTE** buffer
 		PrintStatus(5000, MSG_085, msg);
 	}
 
+	// Range requests are only usable if the server supports them and sends us the data as is
+	dwSize = sizeof(strsize);
+	ctx.accept_ranges = pfHttpQueryInfoA(hRequest, HTTP_QUERY_ACCEPT_RANGES, (LPVOID)strsize, &dwSize, NULL) &&
+		(_stricmp(strsize, "bytes") == 0);
+	dwSize = sizeof(strsize);
+	if (pfHttpQueryInfoA(hRequest, HTTP_QUERY_CONTENT_ENCODING, (LPVOID)strsize, &dwSize, NULL))
+		ctx.accept_ranges = FALSE;
+
 	if (file != NULL) {
-		hFile = CreateFileU(file, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-		if (hFile == INVALID_HANDLE_VALUE) {
-			uprintf("Unable to create file '%s': %s", short_name, WinInetErrorString());
+		part_file = malloc(strlen(file) + 6);
+		if (part_file == NULL)
 			goto out;
+		sprintf(part_file, "%s.part", file);
+		// See if we have a partial download we can resume from
+		hFile = CreateFileU(part_file, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hFile != INVALID_HANDLE_VALUE) {
+			if (ctx.accept_ranges && GetFileSizeEx(hFile, &li) && (li.QuadPart > 0) && ((uint64_t)li.QuadPart < total_size)) {
+				size = (uint64_t)li.QuadPart;
+				uprintf("Resuming partial download of '%s' (%s)", short_name, SizeToHumanReadable(size, FALSE, FALSE));
+			} else {
+				safe_closehandle(hFile);
+			}
 		}
+		if (hFile == INVALID_HANDLE_VALUE) {
+			hFile = CreatePreallocatedFile(part_file, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+				FILE_ATTRIBUTE_NORMAL, total_size);
+			if (hFile == INVALID_HANDLE_VALUE) {
+				uprintf("Unable to create file '%s': %s", short_name, WinInetErrorString());
+				goto out;
+			}
+			if (ctx.accept_ranges && (total_size >= DOWNLOAD_SEGMENT_MIN)) {
+				nb_segments = ReadSetting32(SETTING_DOWNLOAD_CONNECTIONS);
+				if (nb_segments <= 0)
+					nb_segments = DOWNLOAD_CONNECTIONS;
+				nb_segments = min(nb_segments, DOWNLOAD_MAX_CONNECTIONS);
+			}
+			// Segments are written out of order, which we don't want NTFS to zero fill for
+			if ((nb_segments > 1) && !DeviceIoControl(hFile, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &dwSize, NULL))
+				nb_segments = 1;
+		}
+		SetFileIoPriority(hFile, TRUE);
 	} else {
 		if (buffer == NULL) {
 			uprintf("No buffer pointer provided for download");
@@ -444,28 +866,80 @@ uint64_t DownloadToFileOrBuffer(const char* url, const char* file, BYTE** buffer
 		}
 	}
 
-	// Keep checking for data until there is nothing left.
-	while (1) {
-		// User may have cancelled the download
-		if (IS_ERROR(FormatStatus))
-			goto out;
-		if (!pfInternetReadFile(hRequest, buf, sizeof(buf), &dwDownloaded) || (dwDownloaded == 0))
-			break;
-		if (hProgressDialog != NULL)
-			UpdateProgressWithInfo(OP_NOOP, MSG_241, size, total_size);
-		if (file != NULL) {
-			if (!WriteFile(hFile, buf, dwDownloaded, &dwWritten, NULL)) {
-				uprintf("Error writing file '%s': %s", short_name, WinInetErrorString());
-				goto out;
-			} else if (dwDownloaded != dwWritten) {
-				uprintf("Error writing file '%s': Only %d/%d bytes written", short_name, dwWritten, dwDownloaded);
-				goto out;
+	// The server from the URL is our first source, and, if the file has mirrors, we may add them
+	source[0].url = url;
+	source[0].hConnection = hConnection;
+	static_strcpy(source[0].hostname, hostname);
+	static_strcpy(source[0].url_path, urlpath);
+	source[0].flags = dwFlags;
+	source[0].is_primary = TRUE;
+	source[0].size = total_size;
+	if (ctx.accept_ranges)
+		nb_sources = SelectDownloadSources(hSession, accept_types, source, nb_segments);
+	for (i = 0; (i < ARRAYSIZE(source)) && (!source[i].is_primary); i++);
+	assert(i < ARRAYSIZE(source));
+	ctx.primary = &source[i];
+	ctx.accept_types = accept_types;
+	ctx.hFile = hFile;
+	ctx.buffer = (buffer != NULL) ? *buffer : NULL;
+	ctx.total_size = total_size;
+	ctx.hProgressDialog = hProgressDialog;
+	ctx.downloaded = size;
+	segment_size = (total_size / nb_segments) & ~(DOWNLOAD_BUFFER_SIZE - 1);
+	for (i = 0; i < nb_segments; i++) {
+		seg[i].ctx = &ctx;
+		seg[i].src = &source[i % nb_sources];
+		seg[i].start = i * segment_size;
+		seg[i].end = (i == nb_segments - 1) ? total_size : (i + 1) * segment_size;
+		seg[i].pos = (i == 0) ? size : seg[i].start;
+	}
+	// The request we already issued is good for the first segment, unless we are resuming
+	if ((size == 0) && seg[0].src->is_primary) {
+		seg[0].hRequest = hRequest;
+		hRequest = NULL;
+	}
+
+	if (file == NULL) {
+		seg[0].report_progress = TRUE;
+		DownloadSegment(&seg[0]);
+	} else {
+		if (nb_segments > 1)
+			uprintf("Using %d connections", nb_segments);
+		// Hash the file as it gets downloaded, so that we don't have to read it again for its checksums
+		hash_buf = malloc(DOWNLOAD_BUFFER_SIZE);
+		hashing = (hash_buf != NULL) && OpenHashStream();
+		for (i = 0; i < nb_segments; i++) {
+			hThread[i] = CreateThread(NULL, 0, DownloadSegmentThread, &seg[i], 0, NULL);
+			if (hThread[i] == NULL) {
+				uprintf("Unable to start download thread: %s", WindowsErrorString());
+				// Have the download threads that were already started stop
+				FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_NOT_ENOUGH_MEMORY;
+				nb_segments = i;
+				break;
 			}
-		} else {
-			memcpy(&(*buffer)[size], buf, dwDownloaded);
 		}
-		size += dwDownloaded;
+		while (WaitForMultipleObjects(nb_segments, hThread, TRUE, 100) == WAIT_TIMEOUT) {
+			if (hProgressDialog != NULL)
+				UpdateProgressWithInfo(OP_NOOP, MSG_241, ctx.downloaded, total_size);
+			if (hashing)
+				hashing = HashDownloadedData(hFile, seg, nb_segments, &hashed, hash_buf);
+		}
+		for (i = 0; i < nb_segments; i++)
+			safe_closehandle(hThread[i]);
+		if (seg[0].hRequest != NULL)
+			pfInternetCloseHandle(seg[0].hRequest);
+	}
+	size = 0;
+	for (i = 0; i < DOWNLOAD_MAX_CONNECTIONS; i++)
+		size += seg[i].pos - seg[i].start;
+	// Only the first segment is contiguous from the start, and therefore usable for resume
+	if ((size != total_size) && (hFile != INVALID_HANDLE_VALUE)) {
+		li.QuadPart = seg[0].pos;
+		if (SetFilePointerEx(hFile, li, NULL, FILE_BEGIN))
+			SetEndOfFile(hFile);
 	}
+	if (IS_ERROR(FormatStatus))
+		goto out;
 
 	if (size != total_size) {
 		uprintf("Could not download complete file - read: %lld bytes, expected: %lld bytes", size, total_size);
@@ -474,7 +948,28 @@ uint64_t DownloadToFileOrBuffer(const char* url, const char* file, BYTE** buffer
 	} else {
 		DownloadStatus = 200;
 		r = TRUE;
-		if (hProgressDialog != NULL) {
+		if (hFile != INVALID_HANDLE_VALUE) {
+			if (hashing && HashDownloadedData(hFile, seg, nb_segments, &hashed, hash_buf) && (hashed == total_size)) {
+				hashing = FALSE;
+				if (CloseHashStream(TRUE))
+					PrintHashStream("Download checksums:");
+				else
+					hashed = 0;
+			}
+			if (nb_segments > 1) {
+				FILE_SET_SPARSE_BUFFER sparse = { FALSE };
+				DeviceIoControl(hFile, FSCTL_SET_SPARSE, &sparse, sizeof(sparse), NULL, 0, &dwSize, NULL);
+			}
+			FlushFileBuffers(hFile);
+			safe_closehandle(hFile);
+			if (!MoveFileExU(part_file, file, MOVEFILE_REPLACE_EXISTING)) {
+				uprintf("Could not rename '%s': %s", PathFindFileNameU(part_file), WindowsErrorString());
+				r = FALSE;
+			} else if (hashed == total_size) {
+				SetFileSums(file);
+			}
+		}
+		if (r && (hProgressDialog != NULL)) {
 			UpdateProgressWithInfo(OP_NOOP, MSG_241, total_size, total_size);
 			uprintf("Successfully downloaded '%s'", short_name);
 		}
@@ -488,13 +983,22 @@ out:
 		CloseHandle(hFile);
 	}
 	if (!r) {
-		if (file != NULL)
-			DeleteFileU(file);
+		// Keep partial downloads that can be resumed, unless the user cancelled
+		if ((part_file != NULL) && (!ctx.accept_ranges || (SCODE_CODE(FormatStatus) == ERROR_CANCELLED)))
+			DeleteFileU(part_file);
 		if (buffer != NULL)
 			safe_free(*buffer);
 	}
+	if (hashing)
+		CloseHashStream(FALSE);
+	free(hash_buf);
+	free(part_file);
 	if (hRequest)
 		pfInternetCloseHandle(hRequest);
+	for (i = 0; i < ARRAYSIZE(source); i++) {
+		if ((source[i].hConnection != NULL) && (!source[i].is_primary))
+			pfInternetCloseHandle(source[i].hConnection);
+	}
 	if (hConnection)
 		pfInternetCloseHandle(hConnection);
 	if (hSession)
@@ -504,10 +1008,264 @@ out:
 	return r ? size : 0;
 }
 
+/*
+ * The files we download from FILES_URL can also be looked up in a shared cache directory (such
+ * as a LAN share used by multiple imaging PCs), that follows the same layout as FILES_URL, with
+ * each file next to its '.sig'. Since this cache is no more trusted than the server, content we
+ * read from it is only used if its signature validates, or if its SHA-256 is in our hash DB.
+ * Returns the size of the file, or 0 if it could not be read or validated.
+ */
+static char* GetFilesCachePath(const char* file, const char* ext)
+{
+	static char path[MAX_PATH];
+	char* cache_dir = ReadSettingStr(SETTING_FILES_CACHE_DIR);
+	size_t i;
+
+	if ((cache_dir == NULL) || (cache_dir[0] == 0) || (file == NULL))
+		return NULL;
+	if (_snprintf(path, sizeof(path), "%s\\%s%s", cache_dir, file, ext) < 0)
+		return NULL;
+	path[sizeof(path) - 1] = 0;
+	for (i = 0; i < strlen(path); i++) {
+		if (path[i] == '/')
+			path[i] = '\\';
+	}
+	return path;
+}
+
+static DWORD ReadFileFromCache(const char* path, BYTE** buf)
+{
+	DWORD size = 0;
+	HANDLE hFile;
+	LARGE_INTEGER li;
+
+	*buf = NULL;
+	hFile = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return 0;
+	// The files we deal with here are all well below 100 MB
+	if (GetFileSizeEx(hFile, &li) && (li.QuadPart > 0) && (li.QuadPart < 100 * MB)) {
+		*buf = malloc((size_t)li.QuadPart + 1);
+		if ((*buf == NULL) || !ReadFile(hFile, *buf, (DWORD)li.QuadPart, &size, NULL) || (size != li.QuadPart)) {
+			safe_free(*buf);
+			size = 0;
+		} else {
+			(*buf)[size] = 0;
+		}
+	}
+	CloseHandle(hFile);
+	return size;
+}
+
+static DWORD ReadFromFilesCache(const char* file, BYTE** buf)
+{
+	char* path;
+	BYTE* sig = NULL;
+	DWORD buf_len, sig_len = 0;
+
+	path = GetFilesCachePath(file, "");
+	if (path == NULL)
+		return 0;
+	buf_len = ReadFileFromCache(path, buf);
+	if (buf_len == 0)
+		return 0;
+	path = GetFilesCachePath(file, ".sig");
+	if (path != NULL)
+		sig_len = ReadFileFromCache(path, &sig);
+	if (((sig_len != RSA_SIGNATURE_SIZE) || !ValidateOpensslSignature(*buf, buf_len, sig, sig_len)) &&
+		!IsBufferInDB(*buf, buf_len)) {
+		uprintf("Ignoring cached '%s', as it could not be validated ✗", file);
+		safe_free(*buf);
+		buf_len = 0;
+	} else {
+		uprintf("Using '%s' from the shared cache", file);
+	}
+	free(sig);
+	return buf_len;
+}
+
+// Add a file we just downloaded and validated, along with its signature, to the shared cache
+static void WriteToFilesCache(const char* file, BYTE* buf, DWORD buf_len, BYTE* sig, DWORD sig_len)
+{
+	const char* ext[2] = { "", ".sig" };
+	char *path, *p;
+	BYTE* data[2] = { buf, sig };
+	DWORD i, size, len[2] = { buf_len, sig_len };
+	HANDLE hFile;
+
+	for (i = 0; i < 2; i++) {
+		path = GetFilesCachePath(file, ext[i]);
+		if (path == NULL)
+			return;
+		// Create the directory the file goes to, if needed
+		p = strrchr(path, '\\');
+		if (p != NULL) {
+			*p = 0;
+			SHCreateDirectoryExU(NULL, path, NULL);
+			*p = '\\';
+		}
+		hFile = CreateFileU(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hFile == INVALID_HANDLE_VALUE) {
+			uprintf("Could not add '%s' to the shared cache: %s", file, WindowsErrorString());
+			return;
+		}
+		if (!WriteFile(hFile, data[i], len[i], &size, NULL) || (size != len[i])) {
+			CloseHandle(hFile);
+			DeleteFileU(path);
+			return;
+		}
+		CloseHandle(hFile);
+	}
+}
+
+/*
+ * Fetch a small file into a buffer. Unlike DownloadToFileOrBuffer(), this doesn't report progress
+ * or touch any of the global status variables, so that it can run alongside other operations.
+ */
+static DWORD FetchToBuffer(HINTERNET hSession, const char* url, BYTE** buffer)
+{
+	DWORD dwSize, dwStatus = 0, dwDownloaded, len = 0;
+	HINTERNET hRequest;
+
+	PF_TYPE_DECL(WINAPI, HINTERNET, InternetOpenUrlA, (HINTERNET, LPCSTR, LPCSTR, DWORD, DWORD, DWORD_PTR));
+	PF_TYPE_DECL(WINAPI, BOOL, InternetReadFile, (HINTERNET, LPVOID, DWORD, LPDWORD));
+	PF_TYPE_DECL(WINAPI, BOOL, InternetCloseHandle, (HINTERNET));
+	PF_TYPE_DECL(WINAPI, BOOL, HttpQueryInfoA, (HINTERNET, DWORD, LPVOID, LPDWORD, LPDWORD));
+	PF_INIT_OR_OUT(InternetOpenUrlA, WinInet);
+	PF_INIT_OR_OUT(InternetReadFile, WinInet);
+	PF_INIT_OR_OUT(InternetCloseHandle, WinInet);
+	PF_INIT_OR_OUT(HttpQueryInfoA, WinInet);
+
+	*buffer = NULL;
+	hRequest = pfInternetOpenUrlA(hSession, url, NULL, 0, INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTP |
+		INTERNET_FLAG_NO_COOKIES | INTERNET_FLAG_NO_UI | INTERNET_FLAG_NO_CACHE_WRITE, (DWORD_PTR)NULL);
+	if (hRequest == NULL)
+		goto out;
+	dwSize = sizeof(dwStatus);
+	if (!pfHttpQueryInfoA(hRequest, HTTP_QUERY_STATUS_CODE | HTTP_QUERY_FLAG_NUMBER, &dwStatus, &dwSize, NULL) ||
+		(dwStatus != 200))
+		goto out;
+	*buffer = malloc(MAX_PREFETCH_SIZE + 1);
+	if (*buffer == NULL)
+		goto out;
+	while ((len < MAX_PREFETCH_SIZE) && pfInternetReadFile(hRequest, &(*buffer)[len], MAX_PREFETCH_SIZE - len, &dwDownloaded) &&
+		(dwDownloaded != 0))
+		len += dwDownloaded;
+	// Files that don't fit are left for the regular download
+	if (len >= MAX_PREFETCH_SIZE)
+		len = 0;
+	if (len == 0)
+		safe_free(*buffer);
+	else
+		(*buffer)[len] = 0;
+
+out:
+	if (hRequest != NULL)
+		pfInternetCloseHandle(hRequest);
+	return len;
+}
+
+static DWORD WINAPI PrefetchThread(LPVOID param)
+{
+	char url_sig[256];
+	int i;
+	HINTERNET hSession;
+
+	PF_TYPE_DECL(WINAPI, BOOL, InternetCloseHandle, (HINTERNET));
+	PF_INIT(InternetCloseHandle, WinInet);
+
+	SetThreadClass(GetCurrentThread(), THREAD_CLASS_BACKGROUND, 0);
+	hSession = GetInternetSession(FALSE);
+	if ((hSession == NULL) || (pfInternetCloseHandle == NULL))
+		ExitThread(0);
+	for (i = 0; (i < MAX_PREFETCH) && (prefetch[i].url != NULL); i++) {
+		static_sprintf(url_sig, "%s.sig", prefetch[i].url);
+		prefetch[i].buf_len = FetchToBuffer(hSession, prefetch[i].url, &prefetch[i].buf);
+		if (prefetch[i].buf_len != 0)
+			prefetch[i].sig_len = FetchToBuffer(hSession, url_sig, &prefetch[i].sig);
+		if (prefetch[i].sig_len != 0)
+			uprintf("Prefetched %s", prefetch[i].url);
+	}
+	pfInternetCloseHandle(hSession);
+	CoUninitialize();
+	ExitThread(0);
+}
+
+static void FreePrefetchedFile(int i)
+{
+	safe_free(prefetch[i].url);
+	safe_free(prefetch[i].buf);
+	safe_free(prefetch[i].sig);
+	prefetch[i].buf_len = 0;
+	prefetch[i].sig_len = 0;
+}
+
+/*
+ * Start downloading, in the background, signed files that are likely to be requested through
+ * DownloadSignedFile() later on (such as the Syslinux or GRUB files for the image that was just
+ * selected), so that the user doesn't have to wait for the server when they are.
+ */
+BOOL PrefetchSignedFiles(const char** url, int nb_urls)
+{
+	int i;
+
+	if ((prefetch_thread != NULL) && (WaitForSingleObject(prefetch_thread, 0) == WAIT_TIMEOUT))
+		return FALSE;
+	safe_closehandle(prefetch_thread);
+	// Don't connect anywhere if the user opted out of update checks
+	if (ReadSetting32(SETTING_UPDATE_INTERVAL) == -1)
+		return FALSE;
+	for (i = 0; i < MAX_PREFETCH; i++) {
+		FreePrefetchedFile(i);
+		if (i < nb_urls)
+			prefetch[i].url = safe_strdup(url[i]);
+	}
+	if (nb_urls == 0)
+		return TRUE;
+	prefetch_thread = CreateThread(NULL, 0, PrefetchThread, NULL, 0, NULL);
+	if (prefetch_thread == NULL) {
+		uprintf("Unable to start prefetch thread");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// Take ownership of a prefetched file, if we have a valid one for this URL
+static DWORD GetPrefetchedFile(const char* url, BYTE** buf, BYTE** sig, DWORD* sig_len)
+{
+	int i;
+	DWORD buf_len = 0;
+
+	if (prefetch_thread != NULL) {
+		for (i = 0; (i < MAX_PREFETCH) && (safe_strcmp(url, prefetch[i].url) != 0); i++);
+		if (i >= MAX_PREFETCH)
+			return 0;
+		// Wait for the prefetch to complete, since it should be ahead of what we would do
+		if (WaitForSingleObject(prefetch_thread, DRIVE_ACCESS_TIMEOUT) != WAIT_OBJECT_0)
+			return 0;
+		safe_closehandle(prefetch_thread);
+	}
+	for (i = 0; i < MAX_PREFETCH; i++) {
+		if ((safe_strcmp(url, prefetch[i].url) != 0) || (prefetch[i].sig_len != RSA_SIGNATURE_SIZE) ||
+			!ValidateOpensslSignature(prefetch[i].buf, prefetch[i].buf_len, prefetch[i].sig, prefetch[i].sig_len))
+			continue;
+		*buf = prefetch[i].buf;
+		buf_len = prefetch[i].buf_len;
+		*sig = prefetch[i].sig;
+		*sig_len = prefetch[i].sig_len;
+		prefetch[i].buf = NULL;
+		prefetch[i].sig = NULL;
+		FreePrefetchedFile(i);
+		uprintf("Using prefetched %s", url);
+		break;
+	}
+	return buf_len;
+}
+
 // Download and validate a signed file. The file must have a corresponding '.sig' on the server.
 DWORD DownloadSignedFile(const char* url, const char* file, HWND hProgressDialog, BOOL bPromptOnError)
 {
-	char* url_sig = NULL;
+	char *url_sig = NULL, *mirror_url = NULL, *mirror;
 	BYTE *buf = NULL, *sig = NULL;
 	DWORD buf_len = 0, sig_len = 0;
 	DWORD ret = 0;
@@ -515,6 +1273,45 @@ DWORD DownloadSignedFile(const char* url, const char* file, HWND hProgressDialog
 
 	assert(url != NULL);
 
+	// Use the file if we already fetched it in the background
+	buf_len = GetPrefetchedFile(url, &buf, &sig, &sig_len);
+	if (buf_len != 0)
+		goto valid;
+
+	// If we have a shared cache, see if it already has the file
+	buf_len = ReadFromFilesCache(file, &buf);
+	if (buf_len != 0) {
+		DownloadStatus = 206;
+		goto write;
+	}
+
+	// If a mirror of FILES_URL was provided, try it first
+	mirror = ReadSettingStr(SETTING_FILES_MIRROR_URL);
+	if ((mirror != NULL) && (mirror[0] != 0) && (strncmp(url, FILES_URL "/", sizeof(FILES_URL)) == 0)) {
+		mirror_url = malloc(strlen(mirror) + strlen(url) + 2);
+		url_sig = malloc(strlen(mirror) + strlen(url) + 6);
+		if ((mirror_url != NULL) && (url_sig != NULL)) {
+			sprintf(mirror_url, "%s/%s", mirror, &url[sizeof(FILES_URL)]);
+			sprintf(url_sig, "%s.sig", mirror_url);
+			buf_len = (DWORD)DownloadToFileOrBuffer(mirror_url, NULL, &buf, hProgressDialog, FALSE);
+			if (buf_len != 0)
+				sig_len = (DWORD)DownloadToFileOrBuffer(url_sig, NULL, &sig, NULL, FALSE);
+			if ((buf_len != 0) && (sig_len == RSA_SIGNATURE_SIZE) && ValidateOpensslSignature(buf, buf_len, sig, sig_len)) {
+				uprintf("Downloaded from mirror '%s'", mirror);
+				goto valid;
+			}
+			if (SCODE_CODE(FormatStatus) == ERROR_CANCELLED)
+				goto out;
+			uprintf("Could not get a valid file from the mirror - Using the main server");
+		}
+		safe_free(buf);
+		safe_free(sig);
+		safe_free(url_sig);
+		buf_len = 0;
+		sig_len = 0;
+		FormatStatus = 0;
+	}
+
 	url_sig = malloc(strlen(url) + 5);
 	if (url_sig == NULL) {
 		uprintf("Could not allocate signature URL");
@@ -536,8 +1333,11 @@ DWORD DownloadSignedFile(const char* url, const char* file, HWND hProgressDialog
 		goto out;
 	}
 
+valid:
 	uprintf("Download signature is valid ✓");
 	DownloadStatus = 206;	// Partial content
+	WriteToFilesCache(file, buf, buf_len, sig, sig_len);
+write:
 	hFile = CreateFileU(file, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
 	if (hFile == INVALID_HANDLE_VALUE) {
 		uprintf("Unable to create file '%s': %s", PathFindFileNameU(file), WinInetErrorString());
@@ -564,6 +1364,7 @@ out:
 			lmprintf(MSG_044), MB_OK | MB_ICONERROR | MB_IS_RTL, selected_langid);
 	}
 	safe_closehandle(hFile);
+	free(mirror_url);
 	free(url_sig);
 	free(buf);
 	free(sig);
@@ -602,6 +1403,64 @@ static __inline uint64_t to_uint64_t(uint16_t x[4]) {
 	return ret;
 }
 
+/*
+ * Refresh the known images DB (see iso.c), along with its signature. Since the DB holds the
+ * scan results of a specific version, most versions are not expected to have one.
+ */
+static void FetchKnownImagesDB(void)
+{
+	char url[256], path[MAX_PATH];
+	BYTE *buf = NULL, *sig = NULL;
+	DWORD buf_len, sig_len = 0;
+	FILE* fd;
+	HINTERNET hSession;
+
+	PF_TYPE_DECL(WINAPI, BOOL, InternetCloseHandle, (HINTERNET));
+	PF_INIT_OR_OUT(InternetCloseHandle, WinInet);
+
+	if (app_data_dir[0] == 0)
+		return;
+	hSession = GetInternetSession(FALSE);
+	if (hSession == NULL)
+		return;
+	static_sprintf(url, "%s/known_images_%d.%d.db", FILES_URL, rufus_version[0], rufus_version[1]);
+	buf_len = FetchToBuffer(hSession, url, &buf);
+	if (buf_len != 0) {
+		static_strcat(url, ".sig");
+		sig_len = FetchToBuffer(hSession, url, &sig);
+	}
+	pfInternetCloseHandle(hSession);
+	if (buf_len == 0)
+		goto out;
+	if ((sig_len != RSA_SIGNATURE_SIZE) || !ValidateOpensslSignature(buf, buf_len, sig, sig_len)) {
+		uprintf("Known images DB signature is invalid ✗");
+		goto out;
+	}
+	static_sprintf(path, "%s\\%s", app_data_dir, FILES_DIR);
+	IGNORE_RETVAL(_mkdirExU(path));
+	// The signature goes first, so that a DB that got interrupted fails validation
+	static_sprintf(path, "%s\\%s\\%s.sig", app_data_dir, FILES_DIR, KNOWN_IMAGES_DB);
+	fd = fopenU(path, "wb");
+	if ((fd == NULL) || (fwrite(sig, 1, sig_len, fd) != sig_len))
+		goto write_error;
+	fclose(fd);
+	path[strlen(path) - 4] = 0;
+	fd = fopenU(path, "wb");
+	if ((fd == NULL) || (fwrite(buf, 1, buf_len, fd) != buf_len))
+		goto write_error;
+	fclose(fd);
+	uprintf("Updated the known images DB");
+	goto out;
+
+write_error:
+	if (fd != NULL)
+		fclose(fd);
+	uprintf("Could not save known images DB to '%s'", path);
+out:
+	free(buf);
+	free(sig);
+}
+
 /*
  * Background thread to check for updates
  */
@@ -810,6 +1669,8 @@ static DWORD WINAPI CheckForUpdatesThread(LPVOID param)
 		vuprintf("  version: %d.%d.%d (%s)", update.version[0], update.version[1], update.version[2], channel[k]);
 		vuprintf("  platform_min: %d.%d", update.platform_min[0], update.platform_min[1]);
 		vuprintf("  url: %s", update.download_url);
+		for (i = 0; (i < MAX_DOWNLOAD_MIRRORS) && (update.download_mirror[i] != NULL); i++)
+			vuprintf("  mirror: %s", update.download_mirror[i]);
 
 		found_new_version = ((to_uint64_t(update.version) > to_uint64_t(rufus_version)) || (force_update))
 			&& ((os_version.dwMajorVersion > update.platform_min[0])
@@ -839,6 +1700,8 @@ out:
 	default:
 		break;
 	}
+	if (status >= 3)
+		FetchKnownImagesDB();
 	// Start the new download after cleanup
 	if (found_new_version) {
 		// User may have started an operation while we were checking
@@ -875,6 +1738,47 @@ BOOL CheckForUpdates(BOOL force)
 /*
  * Download an ISO through Fido
  */
+/*
+ * Fetch and validate the compressed download script in the background, once we know that
+ * the ISO download feature is available, so that the user doesn't have to wait for GitHub
+ * on top of PowerShell when they use it. This uses FetchToBuffer(), which doesn't alter the
+ * global status, and leaves the decompression to DownloadISOThread(), so that we don't get
+ * in the way of an operation that may be using bled.
+ */
+void PrefetchFidoScript(void)
+{
+	char sig_url[128];
+	BYTE* sig = NULL;
+	DWORD sig_len = 0;
+	HINTERNET hSession;
+
+	PF_TYPE_DECL(WINAPI, BOOL, InternetCloseHandle, (HINTERNET));
+	PF_INIT(InternetCloseHandle, WinInet);
+
+	if ((fido_url == NULL) || (fido_script != NULL) || (pfInternetCloseHandle == NULL))
+		return;
+	AcquireSRWLockExclusive(&fido_prefetch.lock);
+	if (fido_prefetch.buf != NULL)
+		goto out;
+	hSession = GetInternetSession(FALSE);
+	if (hSession == NULL)
+		goto out;
+	static_sprintf(sig_url, "%s.sig", fido_url);
+	fido_prefetch.buf_len = FetchToBuffer(hSession, fido_url, &fido_prefetch.buf);
+	if (fido_prefetch.buf_len != 0)
+		sig_len = FetchToBuffer(hSession, sig_url, &sig);
+	pfInternetCloseHandle(hSession);
+	if ((sig_len != RSA_SIGNATURE_SIZE) || !ValidateOpensslSignature(fido_prefetch.buf, fido_prefetch.buf_len, sig, sig_len)) {
+		safe_free(fido_prefetch.buf);
+		fido_prefetch.buf_len = 0;
+	} else {
+		uprintf("Prefetched download script");
+	}
+	free(sig);
+out:
+	ReleaseSRWLockExclusive(&fido_prefetch.lock);
+}
+
 static DWORD WINAPI DownloadISOThread(LPVOID param)
 {
 	char locale_str[1024], cmdline[sizeof(locale_str) + 512], pipe[MAX_GUID_STRING_LENGTH + 16] = "\\\\.\\pipe\\";
@@ -910,24 +1814,34 @@ static DWORD WINAPI DownloadISOThread(LPVOID param)
 	// In test mode, just use our local script
 	static_strcpy(script_path, "D:\\Projects\\Fido\\Fido.ps1");
 #else
-	// If we don't have the script, download it
+	// If we don't have the script, use the one that was prefetched (and already validated) or download it
 	if (fido_script == NULL) {
-		dwCompressedSize = (DWORD)DownloadToFileOrBuffer(fido_url, NULL, &compressed, hMainDialog, FALSE);
-		if (dwCompressedSize == 0)
-			goto out;
-		static_sprintf(sig_url, "%s.sig", fido_url);
-		dwSize = (DWORD)DownloadToFileOrBuffer(sig_url, NULL, &sig, NULL, FALSE);
-		if ((dwSize != RSA_SIGNATURE_SIZE) || (!ValidateOpensslSignature(compressed, dwCompressedSize, sig, dwSize))) {
-			uprintf("FATAL: Download signature is invalid ✗");
-			FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | APPERR(ERROR_BAD_SIGNATURE);
-			SendMessage(hProgress, PBM_SETSTATE, (WPARAM)PBST_ERROR, 0);
-			SetTaskbarProgressState(TASKBAR_ERROR);
-			safe_free(compressed);
+		AcquireSRWLockExclusive(&fido_prefetch.lock);
+		compressed = fido_prefetch.buf;
+		dwCompressedSize = fido_prefetch.buf_len;
+		fido_prefetch.buf = NULL;
+		fido_prefetch.buf_len = 0;
+		ReleaseSRWLockExclusive(&fido_prefetch.lock);
+		if (compressed != NULL) {
+			uprintf("Using prefetched download script");
+		} else {
+			dwCompressedSize = (DWORD)DownloadToFileOrBuffer(fido_url, NULL, &compressed, hMainDialog, FALSE);
+			if (dwCompressedSize == 0)
+				goto out;
+			static_sprintf(sig_url, "%s.sig", fido_url);
+			dwSize = (DWORD)DownloadToFileOrBuffer(sig_url, NULL, &sig, NULL, FALSE);
+			if ((dwSize != RSA_SIGNATURE_SIZE) || (!ValidateOpensslSignature(compressed, dwCompressedSize, sig, dwSize))) {
+				uprintf("FATAL: Download signature is invalid ✗");
+				FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | APPERR(ERROR_BAD_SIGNATURE);
+				SendMessage(hProgress, PBM_SETSTATE, (WPARAM)PBST_ERROR, 0);
+				SetTaskbarProgressState(TASKBAR_ERROR);
+				safe_free(compressed);
+				free(sig);
+				goto out;
+			}
 			free(sig);
-			goto out;
+			uprintf("Download signature is valid ✓");
 		}
-		free(sig);
-		uprintf("Download signature is valid ✓");
 		uncompressed_size = *((uint64_t*)&compressed[5]);
 		if ((uncompressed_size < 1 * MB) && (bled_init(_uprintf, NULL, NULL, NULL, NULL, &FormatStatus) >= 0)) {
 			fido_script = malloc((size_t)uncompressed_size);
@@ -26,6 +26,7 @@
 #include <windows.h>
 #include <stdio.h>
 #include <wchar.h>
+#include <ctype.h>
 #include <string.h>
 #include <malloc.h>
 #include <io.h>
@@ -196,15 +197,64 @@ static void get_loc_data_line(char* line)
 		free_loc_cmd(lcmd);
 }
 
+/*
+ * Localization data is parsed from memory: the embedded loc file is used directly
+ * from the resource, and an external one is read in full when it gets opened.
+ */
+typedef struct {
+	const char* data;
+	long size;
+	long pos;
+	BOOL allocated;
+} loc_stream;
+
+static const char* embedded_loc_data = NULL;
+static long embedded_loc_size = 0;
+
+void set_embedded_loc_data(const char* data, size_t size)
+{
+	embedded_loc_data = data;
+	embedded_loc_size = (long)size;
+}
+
+static __inline int loc_getc(loc_stream* ls)
+{
+	return (ls->pos < ls->size) ? (uint8_t)ls->data[ls->pos++] : EOF;
+}
+
+/* Same as fgets() */
+static char* loc_gets(char* line, int size, loc_stream* ls)
+{
+	int i = 0;
+
+	if ((size <= 0) || (ls->pos >= ls->size))
+		return NULL;
+	while ((i < size - 1) && (ls->pos < ls->size)) {
+		line[i] = ls->data[ls->pos++];
+		if (line[i++] == '\n')
+			break;
+	}
+	line[i] = 0;
+	return line;
+}
+
+static void close_loc_file(loc_stream* ls)
+{
+	if (ls == NULL)
+		return;
+	if (ls->allocated)
+		free((char*)ls->data);
+	free(ls);
+}
+
 /*
  * Open a localization file and store its file name, with special case
  * when dealing with the embedded loc file.
  */
-FILE* open_loc_file(const char* filename)
+static loc_stream* open_loc_file(const char* filename)
 {
-	FILE* fd = NULL;
-	wchar_t *wfilename = NULL;
-	const char* tmp_ext = ".tmp";
+	loc_stream* ls;
+	uint8_t* buf = NULL;
 
 	if (filename == NULL)
 		return NULL;
@@ -212,24 +262,25 @@ FILE* open_loc_file(const char* filename)
 	if (loc_filename != embedded_loc_filename) {
 		safe_free(loc_filename);
 	}
-	if (safe_strcmp(tmp_ext, &filename[safe_strlen(filename)-4]) == 0) {
+	ls = calloc(1, sizeof(loc_stream));
+	if (ls == NULL)
+		return NULL;
+	if (strcmp(filename, embedded_loc_filename) == 0) {
 		loc_filename = embedded_loc_filename;
+		ls->data = embedded_loc_data;
+		ls->size = embedded_loc_size;
 	} else {
 		loc_filename = safe_strdup(filename);
+		ls->size = (long)read_file(filename, &buf);
+		ls->data = (const char*)buf;
+		ls->allocated = TRUE;
 	}
-	wfilename = utf8_to_wchar(filename);
-	if (wfilename == NULL) {
-		uprintf(conversion_error, filename);
-		goto out;
-	}
-	fd = _wfopen(wfilename, L"rb");
-	if (fd == NULL) {
+	if (ls->data == NULL) {
 		uprintf("localization: could not open '%s'\n", filename);
+		safe_free(ls);
 	}
 
-out:
-	safe_free(wfilename);
-	return fd;
+	return ls;
 }
 
 /*
@@ -238,7 +289,7 @@ out:
  */
 BOOL get_supported_locales(const char* filename)
 {
-	FILE* fd = NULL;
+	loc_stream* fd = NULL;
 	BOOL r = FALSE;
 	char line[1024];
 	size_t i, j, k;
@@ -252,11 +303,11 @@ BOOL get_supported_locales(const char* filename)
 		goto out;
 
 	// Check that the file doesn't contain a BOM and was saved in DOS mode
-	i = fread(line, 1, sizeof(line), fd);
-	if (i < sizeof(line)) {
+	if ((size_t)fd->size < sizeof(line)) {
 		uprintf("Invalid loc file: the file is too small!");
 		goto out;
 	}
+	memcpy(line, fd->data, sizeof(line));
 	if (((uint8_t)line[0]) > 0x80) {
 		uprintf("Invalid loc file: the file should not have a BOM (Byte Order Mark)");
 		goto out;
@@ -267,15 +318,15 @@ BOOL get_supported_locales(const char* filename)
 		uprintf("Invalid loc file: the file MUST be saved in DOS mode (CR/LF)");
 		goto out;
 	}
-	fseek(fd, 0, SEEK_SET);
+	fd->pos = 0;
 
 	loc_line_nr = 0;
 	line[0] = 0;
 	free_locale_list();
 	do {
 		// adjust the last block
-		end_of_block = ftell(fd);
-		if (fgets(line, sizeof(line), fd) == NULL)
+		end_of_block = fd->pos;
+		if (loc_gets(line, sizeof(line), fd) == NULL)
 			break;
 		loc_line_nr++;
 		// Skip leading spaces
@@ -301,7 +352,7 @@ BOOL get_supported_locales(const char* filename)
 					last_lcmd->num[1] = (int32_t)end_of_block;
 				}
 			}
-			lcmd->num[0] = (int32_t)ftell(fd);
+			lcmd->num[0] = (int32_t)fd->pos;
 			// Add our locale command to the locale list
 			list_add_tail(&lcmd->list, &locale_list);
 			uprintf("localization: found locale '%s'\n", lcmd->txt[0]);
@@ -357,7 +408,7 @@ BOOL get_supported_locales(const char* filename)
 			list_del(&last_lcmd->list);
 			free_loc_cmd(last_lcmd);
 		} else {
-			last_lcmd->num[1] = (int32_t)ftell(fd);
+			last_lcmd->num[1] = (int32_t)fd->pos;
 		}
 	}
 	r = !list_empty(&locale_list);
@@ -365,8 +416,7 @@ BOOL get_supported_locales(const char* filename)
 		uprintf("localization: '%s' contains no valid locale sections\n", filename);
 
 out:
-	if (fd != NULL)
-		fclose(fd);
+	close_loc_file(fd);
 	return r;
 }
 
@@ -377,7 +427,7 @@ out:
 BOOL get_loc_data_file(const char* filename, loc_cmd* lcmd)
 {
 	size_t bufsize = 1024;
-	static FILE* fd = NULL;
+	static loc_stream* fd = NULL;
 	static BOOL populate_default = FALSE;
 	char *buf = NULL;
 	size_t i = 0;
@@ -406,7 +456,7 @@ BOOL get_loc_data_file(const char* filename, loc_cmd* lcmd)
 	if (reentrant) {
 		// Called, from a 'b' command - no need to reopen the file,
 		// just save the current offset and current line number
-		cur_offset = ftell(fd);
+		cur_offset = fd->pos;
 		old_loc_line_nr = loc_line_nr;
 	} else {
 		if ((filename == NULL) || (filename[0] == 0))
@@ -435,13 +485,14 @@ BOOL get_loc_data_file(const char* filename, loc_cmd* lcmd)
 		goto out;
 	}
 
-	if (fseek(fd, offset, SEEK_SET) != 0) {
+	if ((offset < 0) || (offset > fd->size)) {
 		uprintf("localization: could not rewind\n");
 		goto out;
 	}
+	fd->pos = offset;
 
 	do {	// custom readline handling for string collation, realloc, line numbers, etc.
-		c = getc(fd);
+		c = loc_getc(fd);
 		switch(c) {
 		case EOF:
 			buf[i] = 0;
@@ -527,7 +578,7 @@ BOOL get_loc_data_file(const char* filename, loc_cmd* lcmd)
 			}
 			break;
 		}
-		if ((c == EOF) || (ftell(fd) > end_offset))
+		if ((c == EOF) || (fd->pos > end_offset))
 			break;
 		// Have at least 2 chars extra, for \r\n sequences
 		if (i >= bufsize-2) {
@@ -548,13 +599,15 @@ BOOL get_loc_data_file(const char* filename, loc_cmd* lcmd)
 out:
 	// Don't close on a reentrant call
 	if (reentrant) {
-		if ((cur_offset < 0) || (fseek(fd, cur_offset, SEEK_SET) != 0)) {
+		if (cur_offset < 0) {
 			uprintf("localization: unable to reset reentrant position\n");
 			ret = FALSE;
+		} else {
+			fd->pos = cur_offset;
 		}
 		loc_line_nr = old_loc_line_nr;
 	} else if (fd != NULL) {
-		fclose(fd);
+		close_loc_file(fd);
 		fd = NULL;
 	}
 	safe_free(buf);
@@ -674,37 +727,46 @@ out:
 }
 
 /*
- * replace or add 'data' for token 'token' in config file 'filename'
+ * replace or add 'data[i]' for each token 'token[i]' in config file 'filename', with a
+ * single rewrite of the file
  */
-char* set_token_data_file(const char* token, const char* data, const char* filename)
+static BOOL set_tokens_data_file(const char** token, const char** data, size_t nb_tokens, const char* filename)
 {
 	const wchar_t* outmode[] = { L"w", L"w, ccs=UTF-8", L"w, ccs=UTF-16LE" };
-	wchar_t *wtoken = NULL, *wfilename = NULL, *wtmpname = NULL, *wdata = NULL, bom = 0;
+	wchar_t **wtoken = NULL, *wfilename = NULL, *wtmpname = NULL, **wdata = NULL, bom = 0;
 	wchar_t buf[1024];
 	FILE *fd_in = NULL, *fd_out = NULL;
-	size_t i, size;
+	size_t i, j, k, len, size;
 	int mode = 0;
-	char *ret = NULL, tmp[2];
+	BOOL ret = FALSE, *found = NULL;
+	char tmp[2];
 
-	if ((filename == NULL) || (token == NULL) || (data == NULL))
-		return NULL;
-	if ((filename[0] == 0) || (token[0] == 0) || (data[0] == 0))
-		return NULL;
+	if ((filename == NULL) || (filename[0] == 0) || (token == NULL) || (data == NULL) || (nb_tokens == 0))
+		return FALSE;
 
 	wfilename = utf8_to_wchar(filename);
 	if (wfilename == NULL) {
 		uprintf(conversion_error, filename);
 		goto out;
 	}
-	wtoken = utf8_to_wchar(token);
-	if (wtoken == NULL) {
-		uprintf(conversion_error, token);
-		goto out;
-	}
-	wdata = utf8_to_wchar(data);
-	if (wdata == NULL) {
-		uprintf(conversion_error, data);
+	wtoken = (wchar_t**)calloc(nb_tokens, sizeof(wchar_t*));
+	wdata = (wchar_t**)calloc(nb_tokens, sizeof(wchar_t*));
+	found = (BOOL*)calloc(nb_tokens, sizeof(BOOL));
+	if ((wtoken == NULL) || (wdata == NULL) || (found == NULL))
 		goto out;
+	for (j = 0; j < nb_tokens; j++) {
+		if ((token[j] == NULL) || (data[j] == NULL) || (token[j][0] == 0) || (data[j][0] == 0))
+			goto out;
+		wtoken[j] = utf8_to_wchar(token[j]);
+		if (wtoken[j] == NULL) {
+			uprintf(conversion_error, token[j]);
+			goto out;
+		}
+		wdata[j] = utf8_to_wchar(data[j]);
+		if (wdata[j] == NULL) {
+			uprintf(conversion_error, data[j]);
+			goto out;
+		}
 	}
 
 	fd_in = _wfopen(wfilename, L"r, ccs=UNICODE");
@@ -756,24 +818,20 @@ char* set_token_data_file(const char* token, const char* data, const char* filen
 			continue;
 		}
 
-		// Our token should begin a line
-		if (_wcsnicmp(&buf[i], wtoken, wcslen(wtoken)) != 0) {
-			fputws(buf, fd_out);
-			continue;
+		// One of our tokens should begin a line, followed by spaces and an equal sign
+		for (j = 0, k = 0; j < nb_tokens; j++) {
+			len = wcslen(wtoken[j]);
+			if (_wcsnicmp(&buf[i], wtoken[j], len) != 0)
+				continue;
+			k = i + len + wcsspn(&buf[i + len], wspace);
+			if (buf[k] == L'=')
+				break;
 		}
-
-		// Token was found, move past token
-		i += wcslen(wtoken);
-
-		// Skip spaces
-		i += wcsspn(&buf[i], wspace);
-
-		// Check for an equal sign
-		if (buf[i] != L'=') {
+		if (j >= nb_tokens) {
 			fputws(buf, fd_out);
 			continue;
 		}
-		i++;
+		i = k + 1;
 
 		// Skip spaces after equal sign
 		i += wcsspn(&buf[i], wspace);
@@ -784,23 +842,28 @@ char* set_token_data_file(const char* token, const char* data, const char* filen
 
 		// Now output the new data
 		// coverity[invalid_type]
-		fwprintf_s(fd_out, L"%s\n", wdata);
-		ret = (char*)data;
+		fwprintf_s(fd_out, L"%s\n", wdata[j]);
+		found[j] = TRUE;
 	}
 
-	if (ret == NULL) {
-		// Didn't find an existing token => append it
-		// coverity[invalid_type]
-		fwprintf_s(fd_out, L"%s = %s\n", wtoken, wdata);
-		ret = (char*)data;
+	for (j = 0; j < nb_tokens; j++) {
+		if (!found[j]) {
+			// Didn't find an existing token => append it
+			// coverity[invalid_type]
+			fwprintf_s(fd_out, L"%s = %s\n", wtoken[j], wdata[j]);
+		}
 	}
+	ret = TRUE;
 
 out:
 	if (fd_in != NULL) fclose(fd_in);
 	if (fd_out != NULL) fclose(fd_out);
 
-	// If an insertion occurred, delete existing file and use the new one
-	if (ret != NULL) {
+	// If an insertion occurred, replace the existing file with the new one, preferably
+	// through a rename, so that the file is never left in a partially written state
+	if (ret && MoveFileExW(wtmpname, wfilename, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+		safe_free(wtmpname);
+	} else if (ret) {
 		// We're in Windows text mode => Remove CRs if requested
 		fd_in = _wfopen(wtmpname, L"rb");
 		fd_out = _wfopen(wfilename, L"wb");
@@ -813,21 +876,236 @@ out:
 			fclose(fd_out);
 		} else {
 			uprintf("Could not write '%s' - original file has been left unmodified\n", filename);
-			ret = NULL;
+			ret = FALSE;
 			if (fd_in != NULL) fclose(fd_in);
 			if (fd_out != NULL) fclose(fd_out);
 		}
 	}
 	if (wtmpname != NULL)
 		_wunlink(wtmpname);
+	for (j = 0; (wtoken != NULL) && (wdata != NULL) && (j < nb_tokens); j++) {
+		safe_free(wtoken[j]);
+		safe_free(wdata[j]);
+	}
 	safe_free(wfilename);
 	safe_free(wtmpname);
 	safe_free(wtoken);
 	safe_free(wdata);
+	safe_free(found);
 
 	return ret;
 }
 
+/*
+ * replace or add 'data' for token 'token' in config file 'filename'
+ */
+char* set_token_data_file(const char* token, const char* data, const char* filename)
+{
+	return set_tokens_data_file(&token, &data, 1, filename) ? (char*)data : NULL;
+}
+
+/*
+ * In-memory cache of the tokens from a settings file, so that we don't have to reopen and parse the
+ * whole file for every setting we read. Changes are applied to the cache immediately, and written to
+ * the file once no other change has occurred for SETTINGS_FLUSH_DELAY ms (or on exit), since setting
+ * toggles tend to come in bursts, and each write rewrites the whole file.
+ * The cache must first be accessed from the main thread, before any other thread uses settings.
+ */
+#define SETTINGS_FLUSH_DELAY        2000
+#define SETTINGS_CACHE_SIZE         127
+typedef struct {
+	char* token;			// As first seen, since the hash table key is lowercase
+	char* data;
+	BOOL dirty;
+} token_cache_entry;
+static struct {
+	char* filename;
+	htab_table htab;
+	HANDLE timer;
+	CRITICAL_SECTION lock;
+} token_cache = { NULL, HTAB_EMPTY, NULL };
+
+// Tokens are case insensitive
+static uint32_t token_cache_index(const char* token)
+{
+	char key[128];
+	size_t i;
+
+	for (i = 0; (token[i] != 0) && (i < sizeof(key) - 1); i++)
+		key[i] = (char)tolower(token[i]);
+	key[i] = 0;
+	return htab_hash(key, &token_cache.htab);
+}
+
+static token_cache_entry* token_cache_get_entry(const char* token)
+{
+	uint32_t i = token_cache_index(token);
+	token_cache_entry* entry;
+
+	if (i == 0)
+		return NULL;
+	if (token_cache.htab.table[i].data == NULL) {
+		entry = (token_cache_entry*)calloc(1, sizeof(token_cache_entry));
+		if (entry == NULL)
+			return NULL;
+		entry->token = safe_strdup(token);
+		if (entry->token == NULL) {
+			free(entry);
+			return NULL;
+		}
+		token_cache.htab.table[i].data = entry;
+	}
+	return (token_cache_entry*)token_cache.htab.table[i].data;
+}
+
+// Parse all the "token = data" lines of the file, keeping the first occurrence of each token
+static BOOL token_cache_load(const char* filename)
+{
+	wchar_t *wfilename, buf[1024], line[1024], *wtoken, *wdata;
+	char* token;
+	size_t i, len;
+	FILE* fd;
+	token_cache_entry* entry;
+
+	if (token_cache.filename != NULL)
+		return (strcmp(filename, token_cache.filename) == 0);
+	if (!htab_create(SETTINGS_CACHE_SIZE, &token_cache.htab))
+		return FALSE;
+	InitializeCriticalSection(&token_cache.lock);
+	token_cache.filename = safe_strdup(filename);
+	wfilename = utf8_to_wchar(filename);
+	fd = (wfilename == NULL) ? NULL : _wfopen(wfilename, L"r, ccs=UNICODE");
+	safe_free(wfilename);
+	if (fd == NULL)
+		return TRUE;
+	while (fgetws(buf, ARRAYSIZE(buf), fd) != NULL) {
+		i = wcsspn(buf, wspace);
+		if ((buf[i] == ';') || (buf[i] == '['))
+			continue;
+		len = wcscspn(&buf[i], L" \t=\r\n");
+		if ((len == 0) || (buf[i + len] == 0))
+			continue;
+		wcscpy(line, buf);
+		buf[i + len] = 0;
+		wtoken = &buf[i];
+		wdata = get_token_data_line(wtoken, line);
+		if (wdata == NULL)
+			continue;
+		token = wchar_to_utf8(wtoken);
+		entry = (token == NULL) ? NULL : token_cache_get_entry(token);
+		if ((entry != NULL) && (entry->data == NULL))
+			entry->data = wchar_to_utf8(wdata);
+		free(token);
+	}
+	fclose(fd);
+	return TRUE;
+}
+
+// Write all the pending changes to the settings file, in a single rewrite
+void flush_token_data_file_cache(void)
+{
+	uint32_t i, nb_dirty = 0;
+	token_cache_entry* entry;
+	token_cache_entry* dirty[SETTINGS_CACHE_SIZE + 1];
+	const char *token[SETTINGS_CACHE_SIZE + 1], *data[SETTINGS_CACHE_SIZE + 1];
+
+	if (token_cache.filename == NULL)
+		return;
+	EnterCriticalSection(&token_cache.lock);
+	for (i = 1; (i <= token_cache.htab.size) && (nb_dirty < ARRAYSIZE(dirty)); i++) {
+		entry = (token_cache_entry*)token_cache.htab.table[i].data;
+		if ((entry == NULL) || !entry->dirty)
+			continue;
+		dirty[nb_dirty] = entry;
+		token[nb_dirty] = entry->token;
+		data[nb_dirty++] = entry->data;
+	}
+	if ((nb_dirty != 0) && set_tokens_data_file(token, data, nb_dirty, token_cache.filename)) {
+		for (i = 0; i < nb_dirty; i++)
+			dirty[i]->dirty = FALSE;
+	}
+	LeaveCriticalSection(&token_cache.lock);
+}
+
+static VOID CALLBACK token_cache_timer_callback(PVOID lpParameter, BOOLEAN TimerOrWaitFired)
+{
+	flush_token_data_file_cache();
+}
+
+/*
+ * Cached versions of get_token_data_file() and set_token_data_file(), for settings files
+ */
+char* get_token_data_file_cached(const char* token, const char* filename)
+{
+	char* ret = NULL;
+	token_cache_entry* entry;
+
+	if ((filename == NULL) || (token == NULL) || (token[0] == 0))
+		return NULL;
+	if (!token_cache_load(filename))
+		return get_token_data_file(token, filename);
+	EnterCriticalSection(&token_cache.lock);
+	entry = token_cache_get_entry(token);
+	if (entry != NULL)
+		ret = safe_strdup(entry->data);
+	LeaveCriticalSection(&token_cache.lock);
+	return ret;
+}
+
+char* set_token_data_file_cached(const char* token, const char* data, const char* filename)
+{
+	char* ret = NULL;
+	token_cache_entry* entry;
+
+	if ((filename == NULL) || (token == NULL) || (data == NULL) || (token[0] == 0) || (data[0] == 0))
+		return NULL;
+	if (!token_cache_load(filename))
+		return set_token_data_file(token, data, filename);
+	EnterCriticalSection(&token_cache.lock);
+	entry = token_cache_get_entry(token);
+	if (entry != NULL) {
+		ret = (char*)data;
+		// Don't rewrite the file for values that haven't changed
+		if (safe_strcmp(entry->data, data) != 0) {
+			free(entry->data);
+			entry->data = safe_strdup(data);
+			entry->dirty = TRUE;
+			if (((token_cache.timer == NULL) && !CreateTimerQueueTimer(&token_cache.timer, NULL,
+				token_cache_timer_callback, NULL, SETTINGS_FLUSH_DELAY, 0, WT_EXECUTEONLYONCE)) ||
+				((token_cache.timer != NULL) && !ChangeTimerQueueTimer(NULL, token_cache.timer, SETTINGS_FLUSH_DELAY, 0))) {
+				// No timer => write the change immediately
+				if (set_token_data_file(token, data, filename) != NULL)
+					entry->dirty = FALSE;
+			}
+		}
+	}
+	LeaveCriticalSection(&token_cache.lock);
+	return ret;
+}
+
+// Flush pending changes and release the cache
+void destroy_token_data_file_cache(void)
+{
+	uint32_t i;
+
+	if (token_cache.filename == NULL)
+		return;
+	if (token_cache.timer != NULL)
+		DeleteTimerQueueTimer(NULL, token_cache.timer, INVALID_HANDLE_VALUE);
+	token_cache.timer = NULL;
+	flush_token_data_file_cache();
+	for (i = 1; i <= token_cache.htab.size; i++) {
+		if (token_cache.htab.table[i].data != NULL) {
+			free(((token_cache_entry*)token_cache.htab.table[i].data)->token);
+			free(((token_cache_entry*)token_cache.htab.table[i].data)->data);
+		}
+		safe_free(token_cache.htab.table[i].data);
+	}
+	htab_destroy(&token_cache.htab);
+	DeleteCriticalSection(&token_cache.lock);
+	safe_free(token_cache.filename);
+}
+
 /*
  * Parse a buffer (ANSI or UTF-8) and return the data for the 'n'th occurrence of 'token'
  * The returned string is UTF-8 and MUST be freed by the caller
@@ -902,7 +1180,7 @@ static __inline char* get_sanitized_token_data_buffer(const char* token, unsigne
  */
 void parse_update(char* buf, size_t len)
 {
-	size_t i;
+	size_t i, j;
 	char *data = NULL, *token;
 	char allowed_rtf_chars[] = "abcdefghijklmnopqrstuvwxyz|~-_:*'";
 	char allowed_std_chars[] = "\r\n ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789!\"$%^&+=<>(){}[].,;#@/?";
@@ -932,6 +1210,8 @@ void parse_update(char* buf, size_t len)
 	update.platform_min[1] = 2;	// XP or later
 	safe_free(update.download_url);
 	safe_free(update.release_notes);
+	for (i=0; i<MAX_DOWNLOAD_MIRRORS; i++)
+		safe_free(update.download_mirror[i]);
 	if ((data = get_sanitized_token_data_buffer("version", 1, buf, len)) != NULL) {
 		for (i=0; (i<3) && ((token = strtok((i==0)?data:NULL, ".")) != NULL); i++) {
 			update.version[i] = (uint16_t)atoi(token);
@@ -948,6 +1228,18 @@ void parse_update(char* buf, size_t len)
 	update.download_url = get_sanitized_token_data_buffer(download_url_name, 1, buf, len);
 	if (update.download_url == NULL)
 		update.download_url = get_sanitized_token_data_buffer("download_url", 1, buf, len);
+	// Mirrors are full URLs of the same file, provided with the same arch specific/generic fallback
+	for (j=0; (j<2) && (update.download_mirror[0] == NULL); j++) {
+		if (j == 0)
+			static_sprintf(download_url_name, "download_mirror_%s", arch_names[GetCpuArch()]);
+		else
+			static_strcpy(download_url_name, "download_mirror");
+		for (i=0; i<MAX_DOWNLOAD_MIRRORS; i++) {
+			update.download_mirror[i] = get_sanitized_token_data_buffer(download_url_name, (unsigned int)i+1, buf, len);
+			if (update.download_mirror[i] == NULL)
+				break;
+		}
+	}
 	update.release_notes = get_sanitized_token_data_buffer("release_notes", 1, buf, len);
 }
 
@@ -1260,6 +1552,243 @@ out:
 	return ret;
 }
 
+/*
+ * Load a text config file (ANSI or UNICODE) in memory, so that multiple replace_in_config_data()
+ * can be applied to it with a single read of the file, and a single write when it is closed.
+ * Lines are split and decoded as with replace_in_token_data(), so that the result is the same.
+ */
+config_file* open_config_file(const char* filename)
+{
+	wchar_t buf[1024], bom = 0, **new_line;
+	FILE* fd = NULL;
+	config_file* cfg;
+
+	if ((filename == NULL) || (filename[0] == 0))
+		return NULL;
+	cfg = (config_file*)calloc(1, sizeof(config_file));
+	if (cfg == NULL)
+		return NULL;
+	cfg->wfilename = utf8_to_wchar(filename);
+	if (cfg->wfilename == NULL) {
+		uprintf(conversion_error, filename);
+		goto error;
+	}
+	fd = _wfopen(cfg->wfilename, L"r, ccs=UNICODE");
+	if (fd == NULL) {
+		uprintf("Could not open file '%s'\n", filename);
+		goto error;
+	}
+	if (fread(&bom, sizeof(bom), 1, fd) == 1) {
+		if (bom == 0xFEFF)
+			cfg->mode = 2;	// UTF-16 (LE)
+		else if (bom == 0xBBEF)
+			cfg->mode = 1;	// UTF-8
+	}
+	fseek(fd, 0, SEEK_SET);
+	while (fgetws(buf, ARRAYSIZE(buf), fd) != NULL) {
+		if (cfg->nb_lines >= cfg->max_lines) {
+			cfg->max_lines = (cfg->max_lines == 0) ? 64 : 2 * cfg->max_lines;
+			new_line = (wchar_t**)realloc(cfg->line, cfg->max_lines * sizeof(wchar_t*));
+			if (new_line == NULL)
+				goto error;
+			cfg->line = new_line;
+		}
+		cfg->line[cfg->nb_lines] = _wcsdup(buf);
+		if (cfg->line[cfg->nb_lines] == NULL)
+			goto error;
+		cfg->nb_lines++;
+	}
+	fclose(fd);
+	return cfg;
+
+error:
+	if (fd != NULL)
+		fclose(fd);
+	close_config_file(cfg, FALSE, FALSE, NULL);
+	return NULL;
+}
+
+/*
+ * Same as replace_in_token_data(), on a config file that was loaded with open_config_file()
+ */
+char* replace_in_config_data(config_file* cfg, const char* token, const char* src, const char* rep)
+{
+	wchar_t *wtoken = NULL, *wsrc = NULL, *wrep = NULL, *line, *new_line, *torep;
+	size_t i, j, k, n, ns, len, start;
+	char* ret = NULL;
+
+	if ((cfg == NULL) || (token == NULL) || (src == NULL) || (rep == NULL))
+		return NULL;
+	if ((token[0] == 0) || (src[0] == 0) || (strcmp(src, rep) == 0))
+		return NULL;
+	wtoken = utf8_to_wchar(token);
+	wsrc = utf8_to_wchar(src);
+	wrep = utf8_to_wchar(rep);
+	if ((wtoken == NULL) || (wsrc == NULL) || (wrep == NULL))
+		goto out;
+
+	for (k = 0; k < cfg->nb_lines; k++) {
+		line = cfg->line[k];
+		// Skip leading spaces. Our token should begin a line.
+		i = wcsspn(line, wspace);
+		if (_wcsnicmp(&line[i], wtoken, wcslen(wtoken)) != 0)
+			continue;
+		// Move past token, and make sure there's at least one whitespace after it
+		i += wcslen(wtoken);
+		ns = wcsspn(&line[i], wspace);
+		if (ns == 0)
+			continue;
+		i += ns;
+		// Count the occurrences we replace
+		for (n = 0, j = i; (n < MAX_OCCURRENCES) && ((torep = wcsstr(&line[j], wsrc)) != NULL); n++)
+			j = (torep - line) + wcslen(wsrc);
+		if (n == 0)
+			continue;
+		len = wcslen(line) + n * wcslen(wrep) + 1;
+		new_line = (wchar_t*)malloc(len * sizeof(wchar_t));
+		if (new_line == NULL)
+			goto out;
+		// Copy the fragments before each occurrence, followed by the replacement string
+		for (new_line[0] = 0, j = 0, start = i; n > 0; n--) {
+			torep = wcsstr(&line[start], wsrc);
+			wcsncat(new_line, &line[j], torep - &line[j]);
+			wcscat(new_line, wrep);
+			j = start = (torep - line) + wcslen(wsrc);
+		}
+		wcscat(new_line, &line[j]);
+		free(cfg->line[k]);
+		cfg->line[k] = new_line;
+		cfg->modified = TRUE;
+		ret = (char*)rep;
+	}
+
+out:
+	safe_free(wtoken);
+	safe_free(wsrc);
+	safe_free(wrep);
+	return ret;
+}
+
+/*
+ * Append data to a buffer that grows as needed
+ */
+static BOOL append_to_buffer(uint8_t** buf, size_t* len, size_t* max_len, const void* data, size_t size)
+{
+	uint8_t* new_buf;
+
+	if (*len + size > *max_len) {
+		*max_len = max(2 * *max_len, *len + size + 4 * KB);
+		new_buf = (uint8_t*)realloc(*buf, *max_len);
+		if (new_buf == NULL)
+			return FALSE;
+		*buf = new_buf;
+	}
+	memcpy(&(*buf)[*len], data, size);
+	*len += size;
+	return TRUE;
+}
+
+/*
+ * Release a config file loaded with open_config_file(), after writing it back to disk if it
+ * was modified and 'write' is set. The new content goes to a temporary file that then replaces
+ * the original one, with the same encoding as we read. Line endings are LF with 'dos2unix', and
+ * CRLF otherwise. If the file is written and 'md5' isn't NULL, it receives the MD5 of the new
+ * content, which saves callers that need it from reading the file back. Returns TRUE if the file
+ * didn't need to be written, or was written successfully.
+ */
+BOOL close_config_file(config_file* cfg, BOOL write, BOOL dos2unix, uint8_t* md5)
+{
+	const uint8_t bom_utf8[] = { 0xEF, 0xBB, 0xBF };
+	const wchar_t bom_utf16 = 0xFEFF;
+	BOOL r = TRUE;
+	wchar_t *wtmpname = NULL, *line;
+	FILE* fd = NULL;
+	char* str = NULL;
+	uint8_t c, *data = NULL;
+	size_t i, j, len = 0, max_len = 0;
+
+	if (cfg == NULL)
+		return FALSE;
+	if (!write || !cfg->modified)
+		goto out;
+
+	// Produce the whole content in memory, so that it can be written, and hashed, in one go
+	r = FALSE;
+	if ((cfg->mode == 1) && !append_to_buffer(&data, &len, &max_len, bom_utf8, sizeof(bom_utf8)))
+		goto out;
+	if ((cfg->mode == 2) && !append_to_buffer(&data, &len, &max_len, &bom_utf16, sizeof(bom_utf16)))
+		goto out;
+	for (i = 0; i < cfg->nb_lines; i++) {
+		line = cfg->line[i];
+		if (cfg->mode == 1) {
+			str = wchar_to_utf8(line);
+			if (str == NULL)
+				goto out;
+			for (j = 0; str[j] != 0; j++) {
+				// Text mode reads only leave us with LF line endings
+				if ((str[j] == '\n') && !dos2unix && !append_to_buffer(&data, &len, &max_len, "\r", 1))
+					goto out;
+				if (!append_to_buffer(&data, &len, &max_len, &str[j], 1))
+					goto out;
+			}
+			safe_free(str);
+			continue;
+		}
+		for (j = 0; line[j] != 0; j++) {
+			if ((line[j] == L'\n') && !dos2unix && !((cfg->mode == 2) ?
+				append_to_buffer(&data, &len, &max_len, L"\r", sizeof(wchar_t)) :
+				append_to_buffer(&data, &len, &max_len, "\r", 1)))
+				goto out;
+			if (cfg->mode == 2) {
+				if (!append_to_buffer(&data, &len, &max_len, &line[j], sizeof(wchar_t)))
+					goto out;
+			} else {
+				// ANSI text was read as one wchar per byte
+				c = (uint8_t)line[j];
+				if (!append_to_buffer(&data, &len, &max_len, &c, 1))
+					goto out;
+			}
+		}
+	}
+
+	wtmpname = (wchar_t*)calloc(wcslen(cfg->wfilename) + 2, sizeof(wchar_t));
+	if (wtmpname == NULL)
+		goto out;
+	wcscpy(wtmpname, cfg->wfilename);
+	wtmpname[wcslen(wtmpname)] = '~';
+	fd = _wfopen(wtmpname, L"wb");
+	if (fd == NULL) {
+		uprintf("Could not open temporary output file '%S'\n", wtmpname);
+		goto out;
+	}
+	r = (fwrite(data, 1, len, fd) == len);
+	r = (fclose(fd) == 0) && r;
+	fd = NULL;
+	if (r && !MoveFileExW(wtmpname, cfg->wfilename, MOVEFILE_REPLACE_EXISTING)) {
+		uprintf("Could not replace '%S': %s\n", cfg->wfilename, WindowsErrorString());
+		r = FALSE;
+	}
+	if (r && (md5 != NULL))
+		HashBuffer(CHECKSUM_MD5, data, len, md5);
+
+out:
+	if (fd != NULL)
+		fclose(fd);
+	if (wtmpname != NULL) {
+		if (!r)
+			_wunlink(wtmpname);
+		free(wtmpname);
+	}
+	free(str);
+	free(data);
+	for (i = 0; i < cfg->nb_lines; i++)
+		free(cfg->line[i]);
+	free(cfg->line);
+	free(cfg->wfilename);
+	free(cfg);
+	return r;
+}
+
 /*
  * Replace all 'c' characters in string 'src' with the substring 'rep'
  * The returned string is allocated and must be freed by the caller.
@@ -1295,10 +1824,11 @@ char* replace_char(const char* src, const char c, const char* rep)
 }
 
 /*
- * Internal recursive call for get_data_from_asn1(). Returns FALSE on error, TRUE otherwise.
+ * Internal recursive call for get_data_from_asn1_table(). Walks the buffer only once, whatever the
+ * number of queries, and returns FALSE on error or once all the queries have been answered.
  */
-static BOOL get_data_from_asn1_internal(const uint8_t* buf, size_t buf_len, const void* oid,
-			size_t oid_len, uint8_t asn1_type, void** data, size_t* data_len, BOOL* matched)
+static BOOL get_data_from_asn1_internal(const uint8_t* buf, size_t buf_len, asn1_query* query,
+			size_t nb_queries, size_t* nb_pending)
 {
 	size_t pos = 0, len, len_len, i;
 	uint8_t tag;
@@ -1342,18 +1872,22 @@ static BOOL get_data_from_asn1_internal(const uint8_t* buf, size_t buf_len, cons
 
 		if (len != 0) {
 			if (is_sequence) {
-				if (!get_data_from_asn1_internal(&buf[pos], len, oid, oid_len, asn1_type, data, data_len, matched))
-					return FALSE;	// error
-				if (*data != NULL)
-					return TRUE;
+				if (!get_data_from_asn1_internal(&buf[pos], len, query, nb_queries, nb_pending))
+					return FALSE;	// error or done
 			} else if (is_universal_tag) {	// Only process tags that belong to the UNIVERSAL class
-				// NB: 0x06 = "OID" tag
-				if ((!*matched) && (tag == 0x06) && (len == oid_len) && (memcmp(&buf[pos], oid, oid_len) == 0)) {
-					*matched = TRUE;
-				} else if ((*matched) && (tag == asn1_type)) {
-					*data_len = len;
-					*data = (void*)&buf[pos];
-					return TRUE;
+				for (i = 0; i < nb_queries; i++) {
+					if (query[i].data != NULL)
+						continue;
+					// NB: 0x06 = "OID" tag
+					if ((!query[i].matched) && (tag == 0x06) && (len == query[i].oid_len) &&
+						(memcmp(&buf[pos], query[i].oid, len) == 0)) {
+						query[i].matched = TRUE;
+					} else if ((query[i].matched) && (tag == query[i].asn1_type)) {
+						query[i].data_len = len;
+						query[i].data = &buf[pos];
+						if (--(*nb_pending) == 0)
+							return FALSE;
+					}
 				}
 			}
 			pos += len;
@@ -1442,35 +1976,58 @@ err:
 	return NULL;
 }
 
+/*
+ * Parse an ASN.1 binary buffer and, for each entry of the 'query' table, return a pointer to the first
+ * instance of data of type 'asn1_type' that follows the DER encoded OID 'oid'. If 'oid' is NULL, the first
+ * data element of type 'asn1_type' is returned. The buffer is only walked once, whatever the number of
+ * queries. Note: Only the UNIVERSAL class is supported for 'asn1_type' (other classes are ignored).
+ * Returns the number of queries that were answered.
+ */
+size_t get_data_from_asn1_table(const uint8_t* buf, size_t buf_len, asn1_query* query, size_t nb_queries)
+{
+	size_t i, nb_pending = nb_queries;
+
+	for (i = 0; i < nb_queries; i++) {
+		query[i].matched = (query[i].oid == NULL) || (query[i].oid_len == 0);
+		query[i].data = NULL;
+		query[i].data_len = 0;
+	}
+
+	if (buf_len >= 65536) {
+		uprintf("get_data_from_asn1: Buffers larger than 64KB are not supported");
+		return 0;
+	}
+
+	// No need to check for the return value as the data of unanswered queries is always NULL
+	if (nb_pending != 0)
+		get_data_from_asn1_internal(buf, buf_len, query, nb_queries, &nb_pending);
+	return nb_queries - nb_pending;
+}
+
 /*
  * Parse an ASN.1 binary buffer and return a pointer to the first instance of OID data of type 'asn1_type',
  * matching the OID 'oid_str' (expressed as an OID string). If successful, the length or the returned data
  * is placed in 'data_len'. Note: Only the UNIVERSAL class is supported for 'asn1_type' (other classes are
  * ignored). If 'oid_str' is NULL or empty, the first data element of type 'asn1_type' is returned.
+ * If you know the OID beforehand, prefer get_data_from_asn1_table(), which avoids the OID conversion.
  */
 void* get_data_from_asn1(const uint8_t* buf, size_t buf_len, const char* oid_str, uint8_t asn1_type, size_t* data_len)
 {
-	void* data = NULL;
+	asn1_query query = { NULL, 0, asn1_type };
 	uint8_t* oid = NULL;
-	size_t oid_len = 0;
-	BOOL matched = ((oid_str == NULL) || (oid_str[0] == 0));
-
-	if (buf_len >= 65536) {
-		uprintf("get_data_from_asn1: Buffers larger than 64KB are not supported");
-		return NULL;
-	}
 
-	if (!matched) {
+	if ((oid_str != NULL) && (oid_str[0] != 0)) {
 		// We have an OID string to convert
-		oid = oid_from_str(oid_str, &oid_len);
+		oid = oid_from_str(oid_str, &query.oid_len);
 		if (oid == NULL) {
 			uprintf("get_data_from_asn1: Could not convert OID string '%s'", oid_str);
 			return NULL;
 		}
+		query.oid = oid;
 	}
 
-	// No need to check for the return value as data is always NULL on error
-	get_data_from_asn1_internal(buf, buf_len, oid, oid_len, asn1_type, &data, data_len, &matched);
+	get_data_from_asn1_table(buf, buf_len, &query, 1);
 	free(oid);
-	return data;
+	*data_len = query.data_len;
+	return (void*)query.data;
 }
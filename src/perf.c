@@ -0,0 +1,338 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Processing engines performance benchmark
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The performance benchmark measures the throughput of our processing engines, without
+ * needing a target drive, so that releases and machines can be compared against each other.
+ * It runs against a corpus, which is a directory of images, and measures:
+ * - the bled decompressors, for every compressed image of the corpus (the output is discarded)
+ * - the ISO extraction, for every ISO of the corpus, into a temporary directory
+ * - the checksum kernels, on an in-memory buffer, for both the accelerated and portable ones
+ * - the ext formatter, through nt_io, on a temporary image file
+ * Every run is reported on stdout, in the headless mode format, with its wall clock time, the
+ * CPU time of the whole process (as some engines are multithreaded) and the peak memory use
+ * above what the process was using when the run started:
+ *   perf engine=xz name="debian.img.xz" result=success input=... bytes=... time_us=...
+ *        cpu_us=... speed_mbps=... peak_memory=...
+ * The FAT32 and exFAT formatters are not measured, as they require an actual volume.
+ */
+
+#ifdef _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <psapi.h>
+
+#include "rufus.h"
+#include "missing.h"
+#include "msapi_utf8.h"
+
+#include "drive.h"
+#include "format.h"
+#include "winio.h"
+#include "bled/bled.h"
+
+extern const char* FileSystemLabel[FS_MAX];
+
+#define PERF_HASH_SIZE              (256 * MB)	// Size of the buffer the checksum kernels are run on
+#define PERF_EXT_IMAGE_SIZE         (4 * GB)
+#define PERF_MEMORY_INTERVAL        5			// Memory use sampling interval (in ms)
+
+static const struct {
+	const char* ext;
+	const char* engine;
+	int type;
+} perf_assoc[] = {
+	{ ".zip", "zip", BLED_COMPRESSION_ZIP },
+	{ ".Z", "lzw", BLED_COMPRESSION_LZW },
+	{ ".gz", "gzip", BLED_COMPRESSION_GZIP },
+	{ ".lzma", "lzma", BLED_COMPRESSION_LZMA },
+	{ ".bz2", "bzip2", BLED_COMPRESSION_BZIP2 },
+	{ ".xz", "xz", BLED_COMPRESSION_XZ },
+	{ ".vtsi", "vtsi", BLED_COMPRESSION_VTSI },
+	{ ".zst", "zstd", BLED_COMPRESSION_ZSTD },
+};
+
+typedef struct {
+	HANDLE hThread;
+	HANDLE hStop;
+	uint64_t start_us;
+	uint64_t start_cpu;
+	uint64_t base_memory;
+	volatile uint64_t peak_memory;
+} perf_probe;
+
+static uint64_t GetProcessMemory(void)
+{
+	PROCESS_MEMORY_COUNTERS pmc = { 0 };
+
+	pmc.cb = sizeof(pmc);
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+		return 0;
+	return (uint64_t)pmc.PagefileUsage;
+}
+
+// Returns the user and kernel time of all the threads of the process, in microseconds
+static uint64_t GetProcessCpuTime(void)
+{
+	FILETIME creation_time, exit_time, kernel_time, user_time;
+
+	if (!GetProcessTimes(GetCurrentProcess(), &creation_time, &exit_time, &kernel_time, &user_time))
+		return 0;
+	return ((((uint64_t)kernel_time.dwHighDateTime << 32) | kernel_time.dwLowDateTime) +
+		(((uint64_t)user_time.dwHighDateTime << 32) | user_time.dwLowDateTime)) / 10;
+}
+
+static void PerfSampleMemory(perf_probe* probe)
+{
+	uint64_t mem = GetProcessMemory();
+
+	if (mem > probe->peak_memory)
+		probe->peak_memory = mem;
+}
+
+static DWORD WINAPI PerfMemoryThread(void* param)
+{
+	perf_probe* probe = (perf_probe*)param;
+
+	while (WaitForSingleObject(probe->hStop, PERF_MEMORY_INTERVAL) == WAIT_TIMEOUT)
+		PerfSampleMemory(probe);
+	return 0;
+}
+
+static void PerfStart(perf_probe* probe)
+{
+	memset(probe, 0, sizeof(*probe));
+	probe->base_memory = GetProcessMemory();
+	probe->peak_memory = probe->base_memory;
+	// Without a sampling thread, we can still report the memory that is in use at the end
+	probe->hStop = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (probe->hStop != NULL)
+		probe->hThread = CreateThread(NULL, 0, PerfMemoryThread, probe, 0, NULL);
+	probe->start_cpu = GetProcessCpuTime();
+	probe->start_us = GetIoTimestamp();
+}
+
+static void PerfStop(perf_probe* probe, const char* engine, const char* name, BOOL success,
+	uint64_t input, uint64_t bytes)
+{
+	uint64_t duration_us = GetIoTimestamp() - probe->start_us;
+	uint64_t cpu_us = GetProcessCpuTime() - probe->start_cpu;
+
+	if (probe->hThread != NULL) {
+		SetEvent(probe->hStop);
+		WaitForSingleObject(probe->hThread, INFINITE);
+		CloseHandle(probe->hThread);
+	}
+	safe_closehandle(probe->hStop);
+	PerfSampleMemory(probe);
+
+	uprintf("  %-8s %-32s %10s/s %s", engine, name, SizeToHumanReadable((duration_us == 0) ? 0 :
+		(bytes * 1000000ULL) / duration_us, FALSE, FALSE), success ? "" : "(FAILED)");
+	printf("perf engine=%s name=\"%s\" result=%s input=%" PRIu64 " bytes=%" PRIu64 " time_us=%" PRIu64
+		" cpu_us=%" PRIu64 " speed_mbps=%0.1f peak_memory=%" PRIu64 "\n", engine, name,
+		success ? "success" : "failure", input, bytes, duration_us, cpu_us,
+		(duration_us == 0) ? 0.0 : (1.0 * bytes) / (1.0 * MB) / (duration_us / 1000000.0),
+		probe->peak_memory - probe->base_memory);
+	fflush(stdout);
+}
+
+// The decompressed data is discarded
+static int perf_write(int fd, const void* buf, unsigned int count)
+{
+	return (int)count;
+}
+
+static void PerfDecompress(const char* path, const char* name, int i)
+{
+	perf_probe probe;
+	HANDLE hSrc, hDst;
+	LARGE_INTEGER li = { 0 };
+	int64_t r;
+
+	hSrc = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	hDst = CreateFileA("NUL", GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	if ((hSrc == INVALID_HANDLE_VALUE) || (hDst == INVALID_HANDLE_VALUE) || (!GetFileSizeEx(hSrc, &li))) {
+		uprintf("Could not open '%s': %s", path, WindowsErrorString());
+		goto out;
+	}
+	PerfStart(&probe);
+	bled_init(_uprintf, NULL, perf_write, NULL, NULL, &FormatStatus);
+	bled_set_alloc_functions(AllocIoBuffer, FreeIoBuffer);
+	r = bled_uncompress_with_handles(hSrc, hDst, perf_assoc[i].type);
+	bled_exit();
+	PerfStop(&probe, perf_assoc[i].engine, name, (r >= 0), li.QuadPart, (r >= 0) ? (uint64_t)r : 0);
+
+out:
+	safe_closehandle(hSrc);
+	safe_closehandle(hDst);
+}
+
+static void PerfExtractISO(const char* path, const char* name)
+{
+	perf_probe probe;
+	char dest_dir[MAX_PATH];
+	struct __stat64 st;
+	uint64_t size;
+	BOOL r;
+
+	memset(&img_report, 0, sizeof(img_report));
+	if ((_stat64U(path, &st) != 0) || (!ExtractISO(path, "", TRUE))) {
+		uprintf("'%s' is not an ISO image that we can extract", name);
+		return;
+	}
+	size = (uint64_t)st.st_size;
+	static_sprintf(dest_dir, "%s%s_perf", temp_dir, APPLICATION_NAME);
+	SHDeleteDirectoryExU(NULL, dest_dir, FOF_SILENT | FOF_NOERRORUI | FOF_NOCONFIRMATION);
+	if (!CreateDirectoryU(dest_dir, NULL)) {
+		uprintf("Could not create '%s': %s", dest_dir, WindowsErrorString());
+		return;
+	}
+	static_strcat(dest_dir, "\\");
+	PerfStart(&probe);
+	r = ExtractISO(path, dest_dir, FALSE);
+	PerfStop(&probe, "iso", name, r, size, size);
+	dest_dir[strlen(dest_dir) - 1] = 0;
+	SHDeleteDirectoryExU(NULL, dest_dir, FOF_SILENT | FOF_NOERRORUI | FOF_NOCONFIRMATION);
+	memset(&img_report, 0, sizeof(img_report));
+}
+
+static void PerfChecksums(void)
+{
+	static const char* checksum_name[CHECKSUM_MAX] = { "md5", "sha1", "sha256", "sha512", "blake3" };
+	perf_probe probe;
+	uint8_t sum[64], *buf;
+	uint64_t seed = 0x9e3779b97f4a7c15ULL, *p;
+	size_t i;
+	int type;
+	BOOL r;
+
+	buf = (uint8_t*)_mm_malloc(PERF_HASH_SIZE, 64);
+	if (buf == NULL) {
+		uprintf("Could not allocate the checksum benchmark buffer");
+		return;
+	}
+	// Incompressible data, so that there is no chance of anything taking a shortcut
+	for (p = (uint64_t*)buf, i = 0; i < PERF_HASH_SIZE / sizeof(uint64_t); i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		p[i] = seed;
+	}
+	for (type = 0; type < CHECKSUM_MAX; type++) {
+		if (IS_ERROR(FormatStatus))
+			break;
+		PerfStart(&probe);
+		r = HashBuffer(type, buf, PERF_HASH_SIZE, sum);
+		PerfStop(&probe, checksum_name[type], IsChecksumAccelerated(type) ? "accelerated" : "generic",
+			r, PERF_HASH_SIZE, PERF_HASH_SIZE);
+		if (!IsChecksumAccelerated(type))
+			continue;
+		PerfStart(&probe);
+		r = HashBufferGeneric(type, buf, PERF_HASH_SIZE, sum);
+		PerfStop(&probe, checksum_name[type], "generic", r, PERF_HASH_SIZE, PERF_HASH_SIZE);
+	}
+	_mm_free(buf);
+}
+
+static void PerfFormatExt(void)
+{
+	perf_probe probe;
+	char path[MAX_PATH];
+	HANDLE h;
+	LARGE_INTEGER li;
+	BOOL r;
+
+	static_sprintf(path, "%s%s_perf.img", temp_dir, APPLICATION_NAME);
+	h = CreateFileU(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	li.QuadPart = PERF_EXT_IMAGE_SIZE;
+	if ((h == INVALID_HANDLE_VALUE) || (!SetFilePointerEx(h, li, NULL, FILE_BEGIN)) || (!SetEndOfFile(h))) {
+		uprintf("Could not create '%s': %s", path, WindowsErrorString());
+		safe_closehandle(h);
+		DeleteFileU(path);
+		return;
+	}
+	safe_closehandle(h);
+	PerfStart(&probe);
+	r = FormatExtFsImage(path, 0, FileSystemLabel[FS_EXT4], "perf", FP_QUICK);
+	PerfStop(&probe, "ext4", "format", r, PERF_EXT_IMAGE_SIZE, PERF_EXT_IMAGE_SIZE);
+	DeleteFileU(path);
+}
+
+/*
+ * Run the engines against the images from corpus_dir, and the ones that don't need an
+ * image against their own data. Returns FALSE if the corpus cannot be accessed.
+ */
+BOOL RunPerformanceBenchmark(const char* corpus_dir)
+{
+	WIN32_FIND_DATAW wfd;
+	HANDLE hFind;
+	char path[MAX_PATH], *name;
+	wchar_t* wpattern;
+	const char* ext;
+	int i;
+
+	uprintf("Engine performance:");
+	PerfChecksums();
+	if (IS_ERROR(FormatStatus))
+		return FALSE;
+	PerfFormatExt();
+	if (corpus_dir == NULL)
+		return TRUE;
+
+	static_sprintf(path, "%s\\*", corpus_dir);
+	wpattern = utf8_to_wchar(path);
+	if (wpattern == NULL)
+		return FALSE;
+	hFind = FindFirstFileW(wpattern, &wfd);
+	free(wpattern);
+	if (hFind == INVALID_HANDLE_VALUE) {
+		uprintf("Could not access the '%s' corpus: %s", corpus_dir, WindowsErrorString());
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_PATH_NOT_FOUND;
+		return FALSE;
+	}
+	do {
+		if (IS_ERROR(FormatStatus))
+			break;
+		if (wfd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			continue;
+		name = wchar_to_utf8(wfd.cFileName);
+		ext = (name == NULL) ? NULL : strrchr(name, '.');
+		if (ext != NULL) {
+			static_sprintf(path, "%s\\%s", corpus_dir, name);
+			if (_stricmp(ext, ".iso") == 0)
+				PerfExtractISO(path, name);
+			for (i = 0; i < ARRAYSIZE(perf_assoc); i++) {
+				if (strcmp(ext, perf_assoc[i].ext) == 0) {
+					PerfDecompress(path, name, i);
+					break;
+				}
+			}
+		}
+		free(name);
+	} while (FindNextFileW(hFind, &wfd));
+	FindClose(hFind);
+	return !IS_ERROR(FormatStatus);
+}
@@ -35,12 +35,19 @@
 #include "localization.h"
 
 #define ENCODING (X509_ASN_ENCODING | PKCS_7_ASN_ENCODING)
+// Number of Authenticode validation results we keep, per file hash
+#define SIGNATURE_CACHE_SIZE        8
+// How long we wait for a revocation check, once the cryptographic validation has passed
+#define REVOCATION_CHECK_TIMEOUT    5000
 
 // MinGW doesn't seem to have this one
 #if !defined(szOID_NESTED_SIGNATURE)
 #define szOID_NESTED_SIGNATURE "1.3.6.1.4.1.311.2.4.1"
 #endif
 
+// DER encoded szOID_TIMESTAMP_TOKEN ("1.2.840.113549.1.9.16.1.4")
+static const uint8_t timestamp_token_oid[] = { 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x09, 0x10, 0x01, 0x04 };
+
 // Signatures names we accept. Must be the the exact name, including capitalization,
 // that CertGetNameStringA(CERT_NAME_ATTR_TYPE, szOID_COMMON_NAME) returns.
 const char* cert_name[3] = { "Akeo Consulting", "Akeo Systems", "Pete Batard" };
@@ -53,6 +60,27 @@ typedef struct {
 	LPWSTR lpszMoreInfoLink;
 } SPROG_PUBLISHERINFO, *PSPROG_PUBLISHERINFO;
 
+typedef struct {
+	uint8_t hash[32];
+	LONG result;
+} signature_cache_entry;
+
+static struct {
+	SRWLOCK lock;
+	uint32_t index;
+	uint32_t nb_entries;
+	signature_cache_entry entry[SIGNATURE_CACHE_SIZE];
+} signature_cache = { SRWLOCK_INIT, 0, 0 };
+
+// Shared between ValidateSignature() and the revocation check thread, whichever is last frees it
+typedef struct {
+	volatile LONG refcount;
+	volatile LONG result;
+	BOOL has_hash;
+	uint8_t hash[32];
+	wchar_t* path;
+} revocation_check;
+
 // https://msdn.microsoft.com/en-us/library/ee442238.aspx
 typedef struct {
 	BLOBHEADER BlobHeader;
@@ -348,8 +376,10 @@ static uint64_t GetRFC3161TimeStamp(PCMSG_SIGNER_INFO pSignerInfo)
 	DWORD n, dwSize = 0;
 	PCRYPT_CONTENT_INFO pCounterSignerInfo = NULL;
 	uint64_t ts = 0ULL;
-	uint8_t *timestamp_token;
-	size_t timestamp_token_size;
+	// 0x04 = "Octet String" ASN.1 tag
+	asn1_query timestamp_token = { timestamp_token_oid, sizeof(timestamp_token_oid), 0x04 };
+	// 0x18 = "Generalized Time" ASN.1 tag
+	asn1_query timestamp = { NULL, 0, 0x18 };
 	char* timestamp_str;
 	size_t timestamp_str_size;
 
@@ -376,15 +406,12 @@ static uint64_t GetRFC3161TimeStamp(PCMSG_SIGNER_INFO pSignerInfo)
 			}
 
 			// Get the RFC 3161 timestamp message
-			timestamp_token = get_data_from_asn1(pCounterSignerInfo->Content.pbData,
-				pCounterSignerInfo->Content.cbData, szOID_TIMESTAMP_TOKEN,
-				// 0x04 = "Octet String" ASN.1 tag
-				0x04, &timestamp_token_size);
-			if (timestamp_token) {
-				timestamp_str = get_data_from_asn1(timestamp_token, timestamp_token_size, NULL,
-					// 0x18 = "Generalized Time" ASN.1 tag
-					0x18, &timestamp_str_size);
-				if (timestamp_str) {
+			if (get_data_from_asn1_table(pCounterSignerInfo->Content.pbData,
+				pCounterSignerInfo->Content.cbData, &timestamp_token, 1) == 1) {
+				// The timestamp is encapsulated in the octet string, so it needs its own pass
+				if (get_data_from_asn1_table(timestamp_token.data, timestamp_token.data_len, &timestamp, 1) == 1) {
+					timestamp_str = (char*)timestamp.data;
+					timestamp_str_size = timestamp.data_len;
 					// As per RFC 3161 The syntax is: YYYYMMDDhhmmss[.s...]Z
 					if ((timestamp_str_size < 14) || (timestamp_str[timestamp_str_size - 1] != 'Z')) {
 						// Sanity checks
@@ -482,11 +509,15 @@ uint64_t GetSignatureTimeStamp(const char* path)
 	DWORD dwSize, dwEncoding, dwContentType, dwFormatType;
 	PCMSG_SIGNER_INFO pSignerInfo = NULL;
 	DWORD dwSignerInfo = 0;
-	wchar_t *szFileName;
+	wchar_t *szFileName = NULL;
 	uint64_t timestamp = 0ULL, nested_timestamp;
+	// The runtime executable can't change while we are running, so we only need to look it up once
+	static uint64_t runtime_timestamp = 0ULL;
 
 	// If the path is NULL, get the signature of the current runtime
 	if (path == NULL) {
+		if (runtime_timestamp != 0ULL)
+			return runtime_timestamp;
 		szFileName = calloc(MAX_PATH, sizeof(wchar_t));
 		if (szFileName == NULL)
 			goto out;
@@ -558,6 +589,9 @@ uint64_t GetSignatureTimeStamp(const char* path)
 		}
 	}
 
+	if (path == NULL)
+		runtime_timestamp = timestamp;
+
 out:
 	safe_free(mpath);
 	safe_free(szFileName);
@@ -569,16 +603,121 @@ out:
 	return timestamp;
 }
 
-// From https://msdn.microsoft.com/en-us/library/windows/desktop/aa382384.aspx
-LONG ValidateSignature(HWND hDlg, const char* path)
+static BOOL GetCachedSignatureResult(const uint8_t* hash, LONG* result)
+{
+	BOOL found = FALSE;
+	uint32_t i;
+
+	AcquireSRWLockShared(&signature_cache.lock);
+	for (i = 0; i < signature_cache.nb_entries; i++) {
+		if (memcmp(signature_cache.entry[i].hash, hash, sizeof(signature_cache.entry[i].hash)) == 0) {
+			*result = signature_cache.entry[i].result;
+			found = TRUE;
+			break;
+		}
+	}
+	ReleaseSRWLockShared(&signature_cache.lock);
+	return found;
+}
+
+static void SetCachedSignatureResult(const uint8_t* hash, LONG result)
+{
+	uint32_t i;
+
+	AcquireSRWLockExclusive(&signature_cache.lock);
+	for (i = 0; i < signature_cache.nb_entries; i++) {
+		if (memcmp(signature_cache.entry[i].hash, hash, sizeof(signature_cache.entry[i].hash)) == 0)
+			break;
+	}
+	if (i >= signature_cache.nb_entries) {
+		// Recycle the oldest entry once the cache is full
+		i = signature_cache.index;
+		signature_cache.index = (signature_cache.index + 1) % SIGNATURE_CACHE_SIZE;
+		if (signature_cache.nb_entries < SIGNATURE_CACHE_SIZE)
+			signature_cache.nb_entries++;
+		memcpy(signature_cache.entry[i].hash, hash, sizeof(signature_cache.entry[i].hash));
+	}
+	signature_cache.entry[i].result = result;
+	ReleaseSRWLockExclusive(&signature_cache.lock);
+}
+
+/*
+ * Call on WinVerifyTrust, with or without revocation checks. Without revocation checks, only
+ * the locally cached URL data is used, so that the call cannot block on the network.
+ */
+static LONG VerifyTrust(const wchar_t* path, BOOL check_revocation)
 {
-	LONG r;
 	WINTRUST_DATA trust_data = { 0 };
 	WINTRUST_FILE_INFO trust_file = { 0 };
 	GUID guid_generic_verify =	// WINTRUST_ACTION_GENERIC_VERIFY_V2
 		{ 0xaac56b, 0xcd44, 0x11d0,{ 0x8c, 0xc2, 0x0, 0xc0, 0x4f, 0xc2, 0x95, 0xee } };
+
+	trust_file.cbStruct = sizeof(trust_file);
+	trust_file.pcwszFilePath = path;
+
+	trust_data.cbStruct = sizeof(trust_data);
+	// NB: WTD_UI_ALL can result in ERROR_SUCCESS even if the signature validation fails,
+	// because it still prompts the user to run untrusted software, even after explicitly
+	// notifying them that the signature invalid (and of course Microsoft had to make
+	// that UI prompt a bit too similar to the other benign prompt you get when running
+	// trusted software, which, as per cert.org's assessment, may confuse non-security
+	// conscious-users who decide to gloss over these kind of notifications).
+	trust_data.dwUIChoice = WTD_UI_NONE;
+	if (check_revocation) {
+		// We just downloaded from the Internet, so we should be able to check revocation
+		trust_data.fdwRevocationChecks = WTD_REVOKE_WHOLECHAIN;
+		// 0x400 = WTD_MOTW  for Windows 8.1 or later
+		trust_data.dwProvFlags = WTD_REVOCATION_CHECK_CHAIN | 0x400;
+	} else {
+		trust_data.fdwRevocationChecks = WTD_REVOKE_NONE;
+		trust_data.dwProvFlags = WTD_CACHE_ONLY_URL_RETRIEVAL | 0x400;
+	}
+	trust_data.dwUnionChoice = WTD_CHOICE_FILE;
+	trust_data.pFile = &trust_file;
+
+	return WinVerifyTrustEx(INVALID_HANDLE_VALUE, &guid_generic_verify, &trust_data);
+}
+
+static void ReleaseRevocationCheck(revocation_check* check)
+{
+	if (InterlockedDecrement(&check->refcount) == 0) {
+		free(check->path);
+		free(check);
+	}
+}
+
+static DWORD WINAPI RevocationCheckThread(LPVOID param)
+{
+	revocation_check* check = (revocation_check*)param;
+	LONG r;
+
+	SetThreadClass(GetCurrentThread(), THREAD_CLASS_BACKGROUND, 0);
+	r = VerifyTrust(check->path, TRUE);
+	if (r != ERROR_SUCCESS)
+		uprintf("PKI: Revocation check failed: %s", WinPKIErrorString());
+	if (check->has_hash)
+		SetCachedSignatureResult(check->hash, r);
+	InterlockedExchange(&check->result, r);
+	ReleaseRevocationCheck(check);
+	return 0;
+}
+
+/*
+ * From https://msdn.microsoft.com/en-us/library/windows/desktop/aa382384.aspx
+ * Since revocation checks can block on the network for a long time, we first validate the
+ * signature cryptographically, and then only wait a limited amount of time for the revocation
+ * check, which carries on in the background. Completed results are cached per file hash.
+ */
+LONG ValidateSignature(HWND hDlg, const char* path)
+{
+	LONG r;
+	HANDLE hThread;
+	revocation_check* check;
+	wchar_t* wpath;
 	char *signature_name;
 	size_t i;
+	uint8_t hash[32];
+	BOOL has_hash;
 	uint64_t current_ts, update_ts;
 
 	// Check the signature name. Make it specific enough (i.e. don't simply check for "Akeo")
@@ -603,30 +742,57 @@ LONG ValidateSignature(HWND hDlg, const char* path)
 			return TRUST_E_EXPLICIT_DISTRUST;
 	}
 
-	trust_file.cbStruct = sizeof(trust_file);
-	trust_file.pcwszFilePath = utf8_to_wchar(path);
-	if (trust_file.pcwszFilePath == NULL) {
+	wpath = utf8_to_wchar(path);
+	if (wpath == NULL) {
 		uprintf("PKI: Unable to convert '%s' to UTF16", path);
 		return ERROR_SEVERITY_ERROR | FAC(FACILITY_CERT) | ERROR_NOT_ENOUGH_MEMORY;
 	}
 
-	trust_data.cbStruct = sizeof(trust_data);
-	// NB: WTD_UI_ALL can result in ERROR_SUCCESS even if the signature validation fails,
-	// because it still prompts the user to run untrusted software, even after explicitly
-	// notifying them that the signature invalid (and of course Microsoft had to make
-	// that UI prompt a bit too similar to the other benign prompt you get when running
-	// trusted software, which, as per cert.org's assessment, may confuse non-security
-	// conscious-users who decide to gloss over these kind of notifications).
-	trust_data.dwUIChoice = WTD_UI_NONE;
-	// We just downloaded from the Internet, so we should be able to check revocation
-	trust_data.fdwRevocationChecks = WTD_REVOKE_WHOLECHAIN;
-	// 0x400 = WTD_MOTW  for Windows 8.1 or later
-	trust_data.dwProvFlags = WTD_REVOCATION_CHECK_CHAIN | 0x400;
-	trust_data.dwUnionChoice = WTD_CHOICE_FILE;
-	trust_data.pFile = &trust_file;
+	has_hash = HashFile(CHECKSUM_SHA256, path, hash);
+	if (has_hash && GetCachedSignatureResult(hash, &r)) {
+		uprintf("PKI: Using cached signature validation result for '%s'", path);
+	} else {
+		r = VerifyTrust(wpath, FALSE);
+		if (r != ERROR_SUCCESS) {
+			// The offline validation may fail if part of the chain needs to be retrieved, so
+			// don't take it as final and run the complete validation before reporting an error
+			r = VerifyTrust(wpath, TRUE);
+			if (has_hash)
+				SetCachedSignatureResult(hash, r);
+		} else {
+			check = calloc(1, sizeof(revocation_check));
+			if (check == NULL) {
+				safe_free(wpath);
+				return ERROR_SEVERITY_ERROR | FAC(FACILITY_CERT) | ERROR_NOT_ENOUGH_MEMORY;
+			}
+			check->refcount = 2;
+			check->result = ERROR_IO_PENDING;
+			check->has_hash = has_hash;
+			memcpy(check->hash, hash, sizeof(hash));
+			check->path = wpath;
+			wpath = NULL;
+			hThread = CreateThread(NULL, 0, RevocationCheckThread, check, 0, NULL);
+			if (hThread == NULL) {
+				uprintf("PKI: Unable to start revocation check thread: %s", WindowsErrorString());
+				r = VerifyTrust(check->path, TRUE);
+				if (has_hash)
+					SetCachedSignatureResult(hash, r);
+				check->refcount = 1;
+				ReleaseRevocationCheck(check);
+			} else {
+				if (WaitForSingleObject(hThread, REVOCATION_CHECK_TIMEOUT) == WAIT_OBJECT_0)
+					r = check->result;
+				else
+					uprintf("PKI: Revocation check is taking too long - continuing in the background");
+				CloseHandle(hThread);
+				ReleaseRevocationCheck(check);
+			}
+		}
+	}
+	safe_free(wpath);
+	// WinPKIErrorString() uses the last error code, which we may have obtained from the cache or another thread
+	SetLastError((DWORD)r);
 
-	r = WinVerifyTrustEx(INVALID_HANDLE_VALUE, &guid_generic_verify, &trust_data);
-	safe_free(trust_file.pcwszFilePath);
 	switch (r) {
 	case ERROR_SUCCESS:
 		// hDlg = INVALID_HANDLE_VALUE is used when validating the Fido PS1 script
@@ -56,6 +56,16 @@ static PVOID PhHeapHandle = NULL;
 static wchar_t* _wHandleName;
 static BOOL _bPartialMatch, _bIgnoreSelf, _bQuiet;
 static BYTE access_mask;
+// Index of the "File" object type, which remains constant until the next reboot (0 = not known yet)
+static USHORT file_type_index = 0;
+// Commandlines of the processes we reported, kept between searches
+#define MAX_CMDLINE_CACHE 32
+static struct {
+	ULONG_PTR pid;
+	FILETIME creation_time;
+	char cmdline[MAX_PATH];
+} cmdline_cache[MAX_CMDLINE_CACHE];
+static int cmdline_cache_next = 0;
 extern StrArray BlockingProcess;
 
 /*
@@ -418,6 +428,53 @@ out:
 	return wcmdline;
 }
 
+/**
+ * Look up the index of the "File" object type, so that the handles that belong to other
+ * object types (which are the vast majority) can be skipped without having to query them.
+ *
+ * \return The object type index, or 0 on error.
+ */
+static USHORT GetFileObjectTypeIndex(void)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	POBJECT_TYPES_INFORMATION types = NULL;
+	POBJECT_TYPE_INFORMATION type;
+	ULONG i, bufferSize = 0x1000, returnSize;
+	USHORT index = 0;
+
+	PF_INIT_OR_SET_STATUS(NtQueryObject, Ntdll);
+	if (!NT_SUCCESS(status))
+		return 0;
+
+	while (TRUE) {
+		types = PhAllocate(bufferSize);
+		if (types == NULL)
+			return 0;
+		status = pfNtQueryObject(NULL, ObjectTypesInformation, types, bufferSize, &returnSize);
+		if (status != STATUS_INFO_LENGTH_MISMATCH || bufferSize >= 1 * MB)
+			break;
+		PhFree(types);
+		bufferSize *= 2;
+	}
+	if (!NT_SUCCESS(status))
+		goto out;
+
+	type = PH_FIRST_OBJECT_TYPE(types);
+	for (i = 0; i < types->NumberOfTypes; i++) {
+		if (type->TypeName.Buffer != NULL && type->TypeName.Length == 4 * sizeof(WCHAR) &&
+			wcsncmp(type->TypeName.Buffer, L"File", 4) == 0) {
+			// Before Windows 8.1, TypeIndex is not populated and the index is the position + 2
+			index = (type->TypeIndex != 0) ? type->TypeIndex : (USHORT)(i + 2);
+			break;
+		}
+		type = PH_NEXT_OBJECT_TYPE(type);
+	}
+
+out:
+	PhFree(types);
+	return index;
+}
+
 static DWORD WINAPI SearchProcessThread(LPVOID param)
 {
 	const char *access_rights_str[8] = { "n", "r", "w", "rw", "x", "rx", "wx", "rwx" };
@@ -432,12 +489,13 @@ static DWORD WINAPI SearchProcessThread(LPVOID param)
 	USHORT wHandleNameLen;
 	HANDLE dupHandle = NULL;
 	HANDLE processHandle = NULL;
-	BOOLEAN bFound = FALSE, bGotCmdLine, verbose = !_bQuiet;
+	BOOLEAN bFound = FALSE, bFoundBefore, bGotCmdLine, verbose = !_bQuiet;
 	ULONG access_rights = 0;
 	DWORD size;
 	char cmdline[MAX_PATH] = { 0 };
 	wchar_t wexe_path[MAX_PATH], *wcmdline;
-	int cur_pid;
+	int j, cur_pid;
+	FILETIME creation_time, dummy;
 
 	PF_INIT_OR_SET_STATUS(NtQueryObject, Ntdll);
 	PF_INIT_OR_SET_STATUS(NtDuplicateObject, NtDll);
@@ -456,6 +514,9 @@ static DWORD WINAPI SearchProcessThread(LPVOID param)
 		goto out;
 	}
 
+	if (file_type_index == 0)
+		file_type_index = GetFileObjectTypeIndex();
+
 	pid[0] = (ULONG_PTR)0;
 	cur_pid = 1;
 
@@ -514,6 +575,10 @@ static DWORD WINAPI SearchProcessThread(LPVOID param)
 		if ((handleInfo->GrantedAccess & 0x23) == 0)
 			continue;
 
+		// Only File objects can reference our target, so don't waste time on anything else
+		if ((file_type_index != 0) && (handleInfo->ObjectTypeIndex != file_type_index))
+			continue;
+
 		// Open the process to which the handle we are after belongs, if not already opened
 		if (pid[0] != pid[1]) {
 			status = PhOpenProcess(&processHandle, PROCESS_DUP_HANDLE | PROCESS_QUERY_INFORMATION | PROCESS_VM_READ,
@@ -546,6 +611,10 @@ static DWORD WINAPI SearchProcessThread(LPVOID param)
 		if (GetFileType(dupHandle) != FILE_TYPE_DISK)
 			continue;
 
+		// If we couldn't look up the File object type index, we now know what it is
+		if (file_type_index == 0)
+			file_type_index = handleInfo->ObjectTypeIndex;
+
 		// A loop is needed because the I/O subsystem likes to give us the wrong return lengths...
 		do {
 			ULONG returnSize;
@@ -580,6 +649,7 @@ static DWORD WINAPI SearchProcessThread(LPVOID param)
 			continue;
 
 		// If we are here, we have a process accessing our target!
+		bFoundBefore = bFound;
 		bFound = TRUE;
 
 		// Keep a mask of all the access rights being used
@@ -593,8 +663,26 @@ static DWORD WINAPI SearchProcessThread(LPVOID param)
 		if (cmdline[0] == 0)
 			vuprintf("WARNING: The following process(es) or service(s) are accessing %S:", _wHandleName);
 
-		// Where possible, try to get the full command line
+		// We already have the commandline if this process had another matching handle
+		if (bFoundBefore)
+			continue;
+
+		// Reuse the commandline from a previous search, provided that the PID wasn't recycled
 		bGotCmdLine = FALSE;
+		creation_time.dwLowDateTime = creation_time.dwHighDateTime = 0;
+		GetProcessTimes(processHandle, &creation_time, &dummy, &dummy, &dummy);
+		for (j = 0; j < MAX_CMDLINE_CACHE; j++) {
+			if ((cmdline_cache[j].pid == handleInfo->UniqueProcessId) &&
+				(CompareFileTime(&cmdline_cache[j].creation_time, &creation_time) == 0)) {
+				static_strcpy(cmdline, cmdline_cache[j].cmdline);
+				bGotCmdLine = TRUE;
+				break;
+			}
+		}
+		if (bGotCmdLine)
+			continue;
+
+		// Where possible, try to get the full command line
 		size = MAX_PATH;
 		wcmdline = GetProcessCommandLine(processHandle);
 		if (wcmdline != NULL) {
@@ -626,6 +714,14 @@ static DWORD WINAPI SearchProcessThread(LPVOID param)
 		if (!bGotCmdLine) {
 			static_sprintf(cmdline, "Unknown_Process_%" PRIu64,
 				(ULONGLONG)handleInfo->UniqueProcessId);
+		} else if (creation_time.dwLowDateTime != 0 || creation_time.dwHighDateTime != 0) {
+			j = cmdline_cache_next;
+			cmdline_cache_next = (cmdline_cache_next + 1) % MAX_CMDLINE_CACHE;
+			// Invalidate the entry while it is being updated, in case we get terminated on timeout
+			cmdline_cache[j].pid = 0;
+			cmdline_cache[j].creation_time = creation_time;
+			static_strcpy(cmdline_cache[j].cmdline, cmdline);
+			cmdline_cache[j].pid = handleInfo->UniqueProcessId;
 		}
 	}
 
@@ -657,6 +753,7 @@ BYTE SearchProcess(char* HandleName, DWORD dwTimeOut, BOOL bPartialMatch, BOOL b
 {
 	HANDLE handle;
 	DWORD res = 0;
+	uint64_t start_time = GetTickCount64();
 
 	_wHandleName = utf8_to_wchar(HandleName);
 	_bPartialMatch = bPartialMatch;
@@ -682,6 +779,8 @@ BYTE SearchProcess(char* HandleName, DWORD dwTimeOut, BOOL bPartialMatch, BOOL b
 	}
 out:
 	free(_wHandleName);
+	if (EtwEnabled(ETW_LEVEL_INFO, ETW_KEYWORD_PROCESS))
+		EtwProcessScan(HandleName, GetTickCount64() - start_time, access_mask);
 	return access_mask;
 }
 
@@ -70,6 +70,7 @@ static int matchmetachar(char c, const char* str);
 static int matchrange(char c, const char* str);
 static int matchdot(char c);
 static int ismetachar(char c);
+static int matchprefix(const char* pattern, const char* text);
 
 
 
@@ -79,6 +80,22 @@ int re_match(const char* pattern, const char* text, int* matchlength)
   return re_matchp(re_compile(pattern), text, matchlength);
 }
 
+int re_matchany(const char** patterns, int nb_patterns, const char* text, int* matchlength)
+{
+  int i;
+
+  *matchlength = 0;
+  for (i = 0; i < nb_patterns; i++)
+  {
+    /* re_compile() uses a static buffer, so patterns must be compiled and matched one at a time */
+    if (matchprefix(patterns[i], text) && (re_matchp(re_compile(patterns[i]), text, matchlength) >= 0))
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
 int re_matchp(re_t pattern, const char* text, int* matchlength)
 {
   *matchlength = 0;
@@ -327,6 +344,33 @@ static int matchdot(char c)
   return c != '\n' && c != '\r';
 #endif
 }
+/* Quick check of the mandatory literal characters at the start of an anchored pattern */
+static int matchprefix(const char* pattern, const char* text)
+{
+  if (pattern[0] != '^')
+  {
+    return 1;
+  }
+  while (*++pattern != '\0')
+  {
+    if (   (*pattern == '.') || (*pattern == '$') || (*pattern == '[') || (*pattern == '\\')
+        || (*pattern == '*') || (*pattern == '+') || (*pattern == '?') || (*pattern == '|'))
+    {
+      break;
+    }
+    /* The character is optional if followed by a quantifier */
+    if ((pattern[1] == '*') || (pattern[1] == '?'))
+    {
+      break;
+    }
+    if (*pattern != *text++)
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
 static int ismetachar(char c)
 {
   return ((c == 's') || (c == 'S') || (c == 'w') || (c == 'W') || (c == 'd') || (c == 'D'));
@@ -58,6 +58,12 @@ int re_matchp(re_t pattern, const char* text, int* matchlength);
 int re_match(const char* pattern, const char* text, int* matchlength);
 
 
+/* Return the index of the first of nb_patterns txt patterns that matches text, or -1 if none do.
+   Anchored patterns whose literal prefix doesn't match the start of text are skipped without
+   being compiled, so that large pattern sets remain cheap to check. */
+int re_matchany(const char** patterns, int nb_patterns, const char* text, int* matchlength);
+
+
 #ifdef __cplusplus
 }
 #endif
@@ -64,7 +64,7 @@ static const char* ep_reg = "Software\\Microsoft\\Windows\\CurrentVersion\\Polic
 static const char* vs_reg = "Software\\Microsoft\\VisualStudio";
 static const char* arch_name[MAX_ARCHS] = {
 	"x86_32", "Itanic", "x86_64", "ARM", "ARM64", "EBC","Risc-V 32", "Risc-V 64", "Risc-V 128" };
-static BOOL existing_key = FALSE;	// For LGP set/restore
+static BOOL existing_key = FALSE, lgp_set = FALSE;	// For LGP set/restore
 static BOOL size_check = TRUE;
 static BOOL log_displayed = FALSE;
 static BOOL img_provided = FALSE;
@@ -80,14 +80,19 @@ static int selected_pt = -1, selected_fs = FS_UNKNOWN, preselected_fs = FS_UNKNO
 static int image_index = 0, select_index = 0;
 static RECT relaunch_rc = { -65536, -65536, 0, 0};
 static UINT uMBRChecked = BST_UNCHECKED;
-static HANDLE format_thread = NULL;
+static HANDLE format_thread = NULL, vds_check_thread = NULL, lgp_thread = NULL;
 static HWND hSelectImage = NULL, hStart = NULL;
 static char szTimer[12] = "00:00:00";
 static unsigned int timer;
 static char uppercase_select[2][64], uppercase_start[64], uppercase_close[64], uppercase_cancel[64];
+static struct {
+	const char* name;
+	LARGE_INTEGER time;
+} startup_phase[16];
+static int nb_startup_phases = 0;
 
 extern HANDLE update_check_thread, wim_thread;
-extern BOOL enable_iso, enable_joliet, enable_rockridge, enable_extra_hashes;
+extern BOOL enable_iso, enable_joliet, enable_rockridge, enable_extra_hashes, enable_write_hashes;
 extern BYTE* fido_script;
 extern HWND hFidoDlg;
 extern uint8_t* grub2_buf;
@@ -119,13 +124,19 @@ BOOL op_in_progress = TRUE, right_to_left_mode = FALSE, has_uefi_csm = FALSE, it
 BOOL enable_HDDs = FALSE, enable_VHDs = TRUE, enable_ntfs_compression = FALSE, no_confirmation_on_cancel = FALSE, lock_drive = TRUE;
 BOOL advanced_mode_device, advanced_mode_format, allow_dual_uefi_bios, detect_fakes, enable_vmdk, force_large_fat32, usb_debug;
 BOOL use_fake_units, preserve_timestamps = FALSE, fast_zeroing = FALSE, app_changed_size = FALSE;
-BOOL zero_drive = FALSE, list_non_usb_removable_drives = FALSE, enable_file_indexing, large_drive = FALSE;
+BOOL zero_drive = FALSE, bench_drive = FALSE, list_non_usb_removable_drives = FALSE, enable_file_indexing, large_drive = FALSE;
 BOOL write_as_image = FALSE, write_as_esp = FALSE, use_vds = FALSE, ignore_boot_marker = FALSE;
-BOOL appstore_version = FALSE, is_vds_available = TRUE;
+BOOL appstore_version = FALSE, is_vds_available = TRUE, sparse_write = FALSE, verify_write = FALSE, batch_badblocks = FALSE;
+BOOL batch_write = FALSE, compact_apply = TRUE, enable_image_cache = FALSE, delta_write = FALSE, enable_block_manifest = FALSE;
+BOOL export_heatmap = FALSE, export_timeline = FALSE, save_dynamic_vhd = FALSE, enable_write_cache = FALSE;
+BOOL rescue_capture = FALSE, fast_repartition = FALSE, badblocks_image_pass = FALSE;
 float fScale = 1.0f;
 int dialog_showing = 0, selection_default = BT_IMAGE, persistence_unit_selection = -1, imop_win_sel = 0;
 int default_fs, fs_type, boot_type, partition_type, target_type; // file system, boot type, partition type, target type
-int force_update = 0, default_thread_priority = THREAD_PRIORITY_ABOVE_NORMAL;
+int force_update = 0, default_thread_priority = THREAD_PRIORITY_ABOVE_NORMAL, write_queue_depth = DD_QUEUE_DEPTH;
+int checksum_buffer_size = CHECKSUM_BUFFER_SIZE, image_cache_ram_size = IMAGE_CACHE_RAM_SIZE, verify_sample_interval = 1;
+int extract_small_file_size = EXTRACT_SMALL_FILE_SIZE, extract_buffer_size = EXTRACT_BUFFER_SIZE;
+int health_min_speed = 0, health_max_latency = 0;
 char szFolderPath[MAX_PATH], app_dir[MAX_PATH], system_dir[MAX_PATH], temp_dir[MAX_PATH], sysnative_dir[MAX_PATH];
 char app_data_dir[MAX_PATH], user_dir[MAX_PATH];
 char embedded_sl_version_str[2][12] = { "?.??", "?.??" };
@@ -133,7 +144,11 @@ char embedded_sl_version_ext[2][32];
 char ClusterSizeLabel[MAX_CLUSTER_SIZES][64];
 char msgbox[1024], msgbox_title[32], *ini_file = NULL, *image_path = NULL, *short_image_path;
 char *archive_path = NULL, image_option_txt[128], *fido_url = NULL;
-StrArray DriveId, DriveName, DriveLabel, DriveHub, BlockingProcess, ImageList;
+StrArray DriveId, DriveName, DriveLabel, DriveHub, DriveLocation, BlockingProcess, ImageList;
+const char* DriveSpeedName[MAX_DRIVES];
+// Throughput ceiling of the USB link of each drive in KB/s (0 if unknown), and whether it's below what the drive supports
+uint32_t DriveLinkSpeed[MAX_DRIVES];
+uint8_t DriveLowerSpeed[MAX_DRIVES];
 // Number of steps for each FS for FCC_STRUCTURE_PROGRESS
 const int nb_steps[FS_MAX] = { 5, 5, 12, 1, 10, 1, 1, 1, 1 };
 const char* flash_type[BADLOCKS_PATTERN_TYPES] = { "SLC", "MLC", "TLC" };
@@ -175,8 +190,8 @@ static void SetAllowedFileSystems(void)
 		break;
 	case BT_IMAGE:
 		allowed_filesystem[FS_NTFS] = TRUE;
-		// Don't allow anything besides NTFS if the image has a >4GB file
-		if ((image_path != NULL) && (img_report.has_4GB_file))
+		// Don't allow anything besides NTFS if the image has a >4GB file, that we can't split
+		if ((image_path != NULL) && (img_report.has_4GB_file) && !HAS_SPLIT_WIM(img_report))
 			break;
 		if (!HAS_WINDOWS(img_report) || (target_type != TT_BIOS) || allow_dual_uefi_bios) {
 			if (!HAS_WINTOGO(img_report) || (ComboBox_GetCurItemData(hImageOption) != IMOP_WIN_TO_GO)) {
@@ -359,12 +374,50 @@ static void SetPartitionSchemeAndTargetSystem(BOOL only_target)
 	SendMessage(hMainDialog, UM_UPDATE_CSM_TOOLTIP, 0, 0);
 }
 
+/*
+ * In ISO mode, the files are written once and then mostly read, so that larger clusters mean
+ * shorter FAT chains and allocation bitmaps to go through, as well as fewer file system writes
+ * that are smaller than the flash pages of the device. Using the number of clusters that the
+ * files of the image take for each cluster size, that we got from the scan, recommend the largest
+ * allowed size, never smaller than the default, for which the space lost to partially filled
+ * clusters remains acceptable. Clusters larger than the erase block of the drive don't reduce
+ * the write amplification any further, so we don't go past that either.
+ */
+static ULONG GetAdvisedClusterSize(int FSType, uint64_t* slack)
+{
+	int i;
+	ULONG size, advised = SelectedDrive.ClusterSize[FSType].Default, max_size = CLUSTER_ADVISOR_MAX_SIZE;
+	uint64_t used, data_size = img_report.projected_size;
+
+	*slack = 0;
+	if ((boot_type != BT_IMAGE) || (image_path == NULL) || !img_report.is_iso || (data_size == 0) ||
+		(img_report.nb_clusters[0] == 0) || ((FSType != FS_FAT16) && (FSType != FS_FAT32) &&
+		(FSType != FS_NTFS) && (FSType != FS_EXFAT)))
+		return advised;
+	if (SelectedDrive.EraseBlockSize != 0)
+		max_size = min(max_size, SelectedDrive.EraseBlockSize);
+	for (i = 0; i < ISO_CLUSTER_STATS; i++) {
+		size = 512 << i;
+		if ((size <= advised) || !(size & SelectedDrive.ClusterSize[FSType].Allowed))
+			continue;
+		used = img_report.nb_clusters[i] * size;
+		// The slack only grows with the cluster size
+		if ((size > max_size) || (used > data_size + (data_size * CLUSTER_ADVISOR_MAX_SLACK) / 100) ||
+			(used >= (uint64_t)SelectedDrive.DiskSize))
+			break;
+		advised = size;
+		*slack = (used > data_size) ? used - data_size : 0;
+	}
+	return advised;
+}
+
 // Populate the Allocation unit size field
 static BOOL SetClusterSizes(int FSType)
 {
-	char* szClustSize;
+	char* szClustSize, str[32], str2[32];
 	int i, k, default_index = 0;
-	ULONG j;
+	ULONG j, advised;
+	uint64_t slack;
 
 	IGNORE_RETVAL(ComboBox_ResetContent(hClusterSize));
 
@@ -377,18 +430,26 @@ static BOOL SetClusterSizes(int FSType)
 		return FALSE;
 	}
 
+	advised = GetAdvisedClusterSize(FSType, &slack);
 	for (i = 0, j = 0x100, k = 0; j<0x10000000; i++, j <<= 1) {
 		if (j & SelectedDrive.ClusterSize[FSType].Allowed) {
 			if (j == SelectedDrive.ClusterSize[FSType].Default) {
 				szClustSize = lmprintf(MSG_030, ClusterSizeLabel[i]);
-				default_index = k;
 			} else {
 				szClustSize = ClusterSizeLabel[i];
 			}
+			if (j == advised)
+				default_index = k;
 			IGNORE_RETVAL(ComboBox_SetItemData(hClusterSize, ComboBox_AddStringU(hClusterSize, szClustSize), j));
 			k++;
 		}
 	}
+	if (advised != SelectedDrive.ClusterSize[FSType].Default) {
+		static_strcpy(str, SizeToHumanReadable(SelectedDrive.ClusterSize[FSType].Default, FALSE, FALSE));
+		static_strcpy(str2, SizeToHumanReadable(slack, FALSE, FALSE));
+		uprintf("Selecting a cluster size of %s rather than %s for this image, with %s lost to partial clusters",
+			SizeToHumanReadable(advised, FALSE, FALSE), str, str2);
+	}
 
 	IGNORE_RETVAL(ComboBox_SetCurSel(hClusterSize, default_index));
 	return TRUE;
@@ -546,6 +607,8 @@ static BOOL SetFileSystemAndClusterSize(char* fs_name)
 			SelectedDrive.ClusterSize[FS_EXT2].Default = 1;
 			SelectedDrive.ClusterSize[FS_EXT3].Allowed = SINGLE_CLUSTERSIZE_DEFAULT;
 			SelectedDrive.ClusterSize[FS_EXT3].Default = 1;
+			SelectedDrive.ClusterSize[FS_EXT4].Allowed = SINGLE_CLUSTERSIZE_DEFAULT;
+			SelectedDrive.ClusterSize[FS_EXT4].Default = 1;
 		}
 
 		// ReFS (only applicable for a select number of Windows platforms and editions)
@@ -660,8 +723,9 @@ static void SetFSFromISO(void)
 		}
 	}
 
-	// The presence of a 4GB file forces the use of NTFS as default FS if available
-	if (img_report.has_4GB_file && (fs_mask & (1 << FS_NTFS))) {
+	// The presence of a 4GB file, besides an install.wim that we can split, forces the use of NTFS
+	// as default FS if available
+	if (img_report.has_4GB_file && !HAS_SPLIT_WIM(img_report) && (fs_mask & (1 << FS_NTFS))) {
 		preferred_fs = FS_NTFS;
 	}
 
@@ -999,7 +1063,12 @@ BOOL CALLBACK LogCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam)
 		style = GetWindowLongPtr(hLog, GWL_STYLE);
 		style &= ~(ES_RIGHT);
 		SetWindowLongPtr(hLog, GWL_STYLE, style);
+		// Output the messages that were logged before we were created
+		FlushLog();
 		break;
+	case UM_LOG_FLUSH:
+		FlushLog();
+		return TRUE;
 	case WM_COMMAND:
 		switch (LOWORD(wParam)) {
 		case IDCANCEL:
@@ -1010,17 +1079,13 @@ BOOL CALLBACK LogCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam)
 			SendMessage(hMainDialog, WM_NEXTDLGCTL, (WPARAM)GetDlgItem(hMainDialog, IDCANCEL), TRUE);
 			return TRUE;
 		case IDC_LOG_CLEAR:
-			SetWindowTextA(hLog, "");
+			ClearLog();
 			return TRUE;
 		case IDC_LOG_SAVE:
-			log_size = GetWindowTextLengthU(hLog);
-			if (log_size <= 0)
-				break;
-			log_buffer = (char*)malloc(log_size);
+			// The log window may only display the tail of the log, so save the full log
+			log_buffer = GetLogText(&log_size);
 			if (log_buffer != NULL) {
-				log_size = GetDlgItemTextU(hDlg, IDC_LOG_EDIT, log_buffer, log_size);
 				if (log_size != 0) {
-					log_size--;	// remove NUL terminator
 					filepath =  FileDialog(TRUE, user_dir, &log_ext, 0);
 					if (filepath != NULL)
 						FileIO(TRUE, filepath, &log_buffer, &log_size);
@@ -1061,7 +1126,7 @@ static void CALLBACK ClockTimer(HWND hWnd, UINT uMsg, UINT_PTR idEvent, DWORD dw
 static void CALLBACK RefreshTimer(HWND hWnd, UINT uMsg, UINT_PTR idEvent, DWORD dwTime)
 {
 	// DO NOT USE WM_DEVICECHANGE - IT MAY BE FILTERED OUT BY WINDOWS!
-	SendMessage(hWnd, UM_MEDIA_CHANGE, 0, 0);
+	SendMessage(hWnd, UM_DEVICE_REFRESH, 0, 0);
 }
 
 // Detect and notify about a blocking operation during ISO extraction cancellation
@@ -1114,6 +1179,7 @@ static void DisplayISOProps(void)
 	}
 
 	PRINT_ISO_PROP(img_report.has_4GB_file, "  Has a >4GB file");
+	PRINT_ISO_PROP(HAS_SPLIT_WIM(img_report), "  Can split its >4GB install.wim for FAT32");
 	PRINT_ISO_PROP(img_report.has_long_filename, "  Has a >64 chars filename");
 	PRINT_ISO_PROP(img_report.has_deep_directories, "  Has a Rock Ridge deep directory");
 	PRINT_ISO_PROP(HAS_SYSLINUX(img_report), "  Uses: Syslinux/Isolinux v%s", img_report.sl_version_str);
@@ -1274,12 +1340,18 @@ DWORD WINAPI ImageScanThread(LPVOID param)
 
 	if (image_path == NULL)
 		goto out;
+	// The scan reads through libcdio and bled, so lower the priority of all of our I/O rather
+	// than that of a handle. This lasts until the thread exits.
+	SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
 	PrintInfoDebug(0, MSG_202);
 	user_notified = FALSE;
 	EnableControls(FALSE, FALSE);
+	// Wait for the image library indexer, which scans through the same globals, to be done
+	AcquireSRWLockExclusive(&image_scan_lock);
 	memset(&img_report, 0, sizeof(img_report));
 	img_report.is_iso = (BOOLEAN)ExtractISO(image_path, "", TRUE);
 	img_report.is_bootable_img = IsBootableImage(image_path);
+	ReleaseSRWLockExclusive(&image_scan_lock);
 	ComboBox_ResetContent(hImageOption);
 	imop_win_sel = 0;
 
@@ -1330,12 +1402,8 @@ DWORD WINAPI ImageScanThread(LPVOID param)
 	if (img_report.is_iso) {
 		DisplayISOProps();
 
-		for (i = 0; i < ARRAYSIZE(redhat8_derivative); i++) {
-			if (re_match(redhat8_derivative[i], img_report.label, &len) >= 0) {
-				img_report.rh8_derivative = TRUE;
-				break;
-			}
-		}
+		if (re_matchany(redhat8_derivative, ARRAYSIZE(redhat8_derivative), img_report.label, &len) >= 0)
+			img_report.rh8_derivative = TRUE;
 
 		// If we have an ISOHybrid, but without an ISO method we support, disable ISO support altogether
 		if (IS_DD_BOOTABLE(img_report) && (img_report.disable_iso ||
@@ -1367,6 +1435,7 @@ DWORD WINAPI ImageScanThread(LPVOID param)
 		UpdateImage(dont_display_image_name);
 		ToggleImageOptions();
 		EnableControls(TRUE, FALSE);
+		PrefetchBootFiles();
 		// Set Target and FS accordingly
 		if (img_report.is_iso || img_report.is_windows_img) {
 			IGNORE_RETVAL(ComboBox_SetCurSel(hBootType, image_index));
@@ -1397,6 +1466,44 @@ out:
 	ExitThread(0);
 }
 
+/*
+ * Prefetch the Syslinux and GRUB files that BootCheckThread() will ask to download for this image,
+ * if we don't have them already. The URLs must match the ones BootCheckThread() uses.
+ */
+static void PrefetchBootFiles(void)
+{
+	// One GRUB core.img and two Syslinux ldlinux files at most
+	char url[3][MAX_PATH];
+	const char* url_list[3];
+	const char* ldlinux_ext[2] = { "sys", "bss" };
+	char path[MAX_PATH];
+	int i, nb_urls = 0;
+
+	if (!img_report.is_iso)
+		return;
+	if ((img_report.has_grub2) && (img_report.grub2_version[0] != 0) &&
+		(strcmp(img_report.grub2_version, GRUB2_PACKAGE_VERSION) != 0)) {
+		static_sprintf(path, "%s\\%s\\grub-%s\\core.img", app_data_dir, FILES_DIR, img_report.grub2_version);
+		if (!PathFileExistsU(path))
+			static_sprintf(url[nb_urls++], "%s/grub-%s/core.img", FILES_URL, img_report.grub2_version);
+	}
+	if (HAS_SYSLINUX(img_report) && (SL_MAJOR(img_report.sl_version) >= 5) &&
+		((img_report.sl_version != embedded_sl_version[1]) ||
+		(safe_strcmp(img_report.sl_version_ext, embedded_sl_version_ext[1]) != 0))) {
+		for (i = 0; i < 2; i++) {
+			static_sprintf(path, "%s\\%s\\syslinux-%s%s\\ldlinux.%s", app_data_dir, FILES_DIR,
+				img_report.sl_version_str, img_report.sl_version_ext, ldlinux_ext[i]);
+			to_windows_path(path);
+			if (!PathFileExistsU(path))
+				static_sprintf(url[nb_urls++], "%s/syslinux-%s%s/ldlinux.%s", FILES_URL,
+					img_report.sl_version_str, img_report.sl_version_ext, ldlinux_ext[i]);
+		}
+	}
+	for (i = 0; i < nb_urls; i++)
+		url_list[i] = url[i];
+	PrefetchSignedFiles(url_list, nb_urls);
+}
+
 // Likewise, boot check will block message processing => use a thread
 static DWORD WINAPI BootCheckThread(LPVOID param)
 {
@@ -1521,7 +1628,7 @@ static DWORD WINAPI BootCheckThread(LPVOID param)
 			MessageBoxExU(hMainDialog, lmprintf(MSG_189), lmprintf(MSG_099), MB_OK | MB_ICONERROR | MB_IS_RTL, selected_langid);
 			goto out;
 		}
-		if ((IS_FAT(fs_type)) && (img_report.has_4GB_file)) {
+		if ((IS_FAT(fs_type)) && (img_report.has_4GB_file) && !HAS_SPLIT_WIM(img_report)) {
 			// This ISO image contains a file larger than 4GB file (FAT32)
 			MessageBoxExU(hMainDialog, lmprintf(MSG_100), lmprintf(MSG_099), MB_OK | MB_ICONERROR | MB_IS_RTL, selected_langid);
 			goto out;
@@ -1816,7 +1923,8 @@ static void InitDialog(HWND hDlg)
 	DWORD len;
 	HDC hDC;
 	int i, lfHeight;
-	char tmp[128], *token, *buf, *ext, *msg;
+	char tmp[128], *token, *msg;
+	const char* buf;
 	static char* resource[2] = { MAKEINTRESOURCEA(IDR_SL_LDLINUX_V4_SYS), MAKEINTRESOURCEA(IDR_SL_LDLINUX_V6_SYS) };
 
 #ifdef RUFUS_TEST
@@ -1894,15 +2002,14 @@ static void InitDialog(HWND hDlg)
 	uprintf(APPLICATION_NAME " " APPLICATION_ARCH " v%d.%d.%d%s%s", rufus_version[0], rufus_version[1], rufus_version[2],
 		IsAlphaOrBeta(), (ini_file != NULL)?"(Portable)": (appstore_version ? "(AppStore version)" : ""));
 	for (i = 0; i < ARRAYSIZE(resource); i++) {
-		len = 0;
-		buf = (char*)GetResource(hMainInstance, resource[i], _RT_RCDATA, "ldlinux_sys", &len, TRUE);
+		// No need to duplicate the resource, as GetSyslinuxVersion() doesn't modify it
+		buf = (const char*)GetResource(hMainInstance, resource[i], _RT_RCDATA, "ldlinux_sys", &len, FALSE);
 		if (buf == NULL) {
 			uprintf("Warning: could not read embedded Syslinux v%d version", i+4);
 		} else {
-			embedded_sl_version[i] = GetSyslinuxVersion(buf, len, &ext);
+			embedded_sl_version[i] = GetSyslinuxVersion(buf, len, embedded_sl_version_ext[i],
+				sizeof(embedded_sl_version_ext[i]));
 			static_sprintf(embedded_sl_version_str[i], "%d.%02d", SL_MAJOR(embedded_sl_version[i]), SL_MINOR(embedded_sl_version[i]));
-			static_strcpy(embedded_sl_version_ext[i], ext);
-			free(buf);
 		}
 	}
 	uprintf("Windows version: %s", WindowsVersionStr);
@@ -1910,15 +2017,13 @@ static void InitDialog(HWND hDlg)
 		embedded_sl_version_str[1], embedded_sl_version_ext[1]);
 	uprintf("Grub versions: %s, %s", GRUB4DOS_VERSION, GRUB2_PACKAGE_VERSION);
 	uprintf("System locale ID: 0x%04X (%s)", GetUserDefaultUILanguage(), GetCurrentMUI());
+	DetectChecksumAcceleration();
 	ubflush();
 	if (selected_locale->ctrl_id & LOC_NEEDS_UPDATE) {
 		uprintf("NOTE: The %s translation requires an update, but the current translator hasn't submitted "
 			"one. Because of this, some messages will only be displayed in English.", selected_locale->txt[1]);
 		uprintf("If you think you can help update this translation, please e-mail the author of this application");
 	}
-	if (!is_vds_available)
-		uprintf("Notice: Windows VDS is unavailable");
-
 	CreateTaskbarList();
 	SetTaskbarProgressState(TASKBAR_NORMAL);
 
@@ -1930,6 +2035,7 @@ static void InitDialog(HWND hDlg)
 		msg = (i == 1) ? lmprintf(MSG_034, 1) : lmprintf(MSG_035, (i == 2) ? 2 : 4, (i == 2) ? "" : lmprintf(MSG_087, flash_type[i - 3]));
 		IGNORE_RETVAL(ComboBox_AddStringU(hNBPasses, msg));
 	}
+	IGNORE_RETVAL(ComboBox_AddStringU(hNBPasses, lmprintf(MSG_326)));
 	IGNORE_RETVAL(ComboBox_SetCurSel(hNBPasses, 0));
 	SetPassesTooltip();
 
@@ -1948,6 +2054,7 @@ static void InitDialog(HWND hDlg)
 	StrArrayCreate(&DriveName, MAX_DRIVES);
 	StrArrayCreate(&DriveLabel, MAX_DRIVES);
 	StrArrayCreate(&DriveHub, MAX_DRIVES);
+	StrArrayCreate(&DriveLocation, MAX_DRIVES);
 	StrArrayCreate(&BlockingProcess, 16);
 	StrArrayCreate(&ImageList, 16);
 	// Set various checkboxes
@@ -2017,8 +2124,10 @@ static void SaveVHD(void)
 	static IMG_SAVE img_save = { 0 };
 	char filename[128];
 	char path[MAX_PATH];
+	const char* ext;
 	int DriveIndex = ComboBox_GetCurSel(hDeviceList);
-	EXT_DECL(img_ext, filename, __VA_GROUP__("*.vhd"), __VA_GROUP__(lmprintf(MSG_095)));
+	EXT_DECL(img_ext, filename, __VA_GROUP__("*.vhd", "*.img.xz", "*.img.zst"),
+		__VA_GROUP__(lmprintf(MSG_095), lmprintf(MSG_333, "xz"), lmprintf(MSG_333, "zstd")));
 	ULARGE_INTEGER free_space;
 
 	if ((DriveIndex < 0) || (format_thread != NULL))
@@ -2031,13 +2140,27 @@ static void SaveVHD(void)
 	img_save.BufSize = DD_BUFFER_SIZE;
 	img_save.DeviceSize = SelectedDrive.DiskSize;
 	if (img_save.ImagePath != NULL) {
+		// Compressed images are produced according to their extension, and dynamic
+		// VHDs, that only allocate the non-zero blocks of the drive, are a setting
+		img_save.Compression = BLED_COMPRESSION_NONE;
+		ext = strrchr(img_save.ImagePath, '.');
+		if (safe_stricmp(ext, ".xz") == 0)
+			img_save.Compression = BLED_COMPRESSION_XZ;
+		else if (safe_stricmp(ext, ".zst") == 0)
+			img_save.Compression = BLED_COMPRESSION_ZSTD;
+		if (img_save.Compression != BLED_COMPRESSION_NONE)
+			img_save.Type = IMG_SAVE_TYPE_COMPRESSED;
+		else if (save_dynamic_vhd)
+			img_save.Type = IMG_SAVE_TYPE_DYNAMIC_VHD;
 		// Reset all progress bars
 		SendMessage(hMainDialog, UM_PROGRESS_INIT, 0, 0);
 		FormatStatus = 0;
 		free_space.QuadPart = 0;
+		// Only a fixed VHD is known to need as much space as the drive
 		if ((GetVolumePathNameA(img_save.ImagePath, path, sizeof(path)))
 			&& (GetDiskFreeSpaceExA(path, &free_space, NULL, NULL))
-			&& ((LONGLONG)free_space.QuadPart > (SelectedDrive.DiskSize + 512))) {
+			&& ((img_save.Type != IMG_SAVE_TYPE_VHD) ||
+			((LONGLONG)free_space.QuadPart > (SelectedDrive.DiskSize + 512)))) {
 			// Disable all controls except cancel
 			EnableControls(FALSE, FALSE);
 			FormatStatus = 0;
@@ -2081,10 +2204,9 @@ static void SaveISO(void)
 		uprintf("No dumpable optical media found.");
 		return;
 	}
-	// Adjust the buffer size according to the disc size so that we get a decent speed.
-	for (img_save.BufSize = 32 * MB;
-		(img_save.BufSize > 8 * MB) && (img_save.DeviceSize <= img_save.BufSize * 64);
-		img_save.BufSize /= 2);
+	// With the reads queued, the drive streams as long as there are requests in flight, and
+	// moderately sized ones get the first data written to the image sooner.
+	img_save.BufSize = IMG_SAVE_OPTICAL_BUFSIZE;
 	if ((img_save.Label != NULL) && (img_save.Label[0] != 0))
 		static_sprintf(filename, "%s.iso", img_save.Label);
 	uprintf("ISO media size %s", SizeToHumanReadable(img_save.DeviceSize, FALSE, FALSE));
@@ -2110,11 +2232,123 @@ static void SaveISO(void)
 	}
 }
 
+/*
+ * Clone the selected drive to all the other listed drives, straight from the drive
+ * rather than through an intermediate image.
+ */
+static void CloneDrive(void)
+{
+	char drive_list[1024] = "", tmp[MAX_PATH];
+	int i, DriveIndex = ComboBox_GetCurSel(hDeviceList);
+
+	if ((DriveIndex < 0) || op_in_progress || (format_thread != NULL))
+		return;
+	if (ComboBox_GetCount(hDeviceList) < 2) {
+		uprintf("Clone: At least one other device is needed");
+		return;
+	}
+	for (i = 0; i < ComboBox_GetCount(hDeviceList); i++) {
+		if ((i == DriveIndex) || (ComboBox_GetLBTextU(hDeviceList, i, tmp) <= 0))
+			continue;
+		static_strcat(drive_list, "\n- ");
+		static_strcat(drive_list, tmp);
+	}
+	if (MessageBoxExU(hMainDialog, lmprintf(MSG_334, drive_list),
+		APPLICATION_NAME, MB_OKCANCEL | MB_ICONWARNING | MB_IS_RTL, selected_langid) == IDCANCEL)
+		return;
+	SendMessage(hMainDialog, UM_PROGRESS_INIT, 0, 0);
+	FormatStatus = 0;
+	// Disable all controls except cancel
+	EnableControls(FALSE, FALSE);
+	InitProgress(TRUE);
+	format_thread = CreateThread(NULL, 0, CloneDriveThread,
+		(LPVOID)(uintptr_t)ComboBox_GetItemData(hDeviceList, DriveIndex), 0, NULL);
+	if (format_thread != NULL) {
+		SetThreadPriority(format_thread, default_thread_priority);
+		uprintf("\r\nClone operation started");
+		PrintInfo(0, -1);
+		SendMessage(hMainDialog, UM_TIMER_START, 0, 0);
+	} else {
+		uprintf("Unable to start clone thread");
+		FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | APPERR(ERROR_CANT_START_THREAD);
+		PostMessage(hMainDialog, UM_FORMAT_COMPLETED, (WPARAM)FALSE, 0);
+	}
+}
+
+// Record the time at which a named phase of the application startup completed.
+static void StartupPhase(const char* name)
+{
+	if (nb_startup_phases >= ARRAYSIZE(startup_phase))
+		return;
+	startup_phase[nb_startup_phases].name = name;
+	QueryPerformanceCounter(&startup_phase[nb_startup_phases++].time);
+}
+
+// Log the duration of the startup phases. This is only done once, as we don't
+// want to report the relaunches that occur when switching languages.
+static void LogStartupPhases(void)
+{
+	static BOOL logged = FALSE;
+	char str[512] = "", phase[64];
+	int i;
+	LARGE_INTEGER freq;
+
+	if (logged || (nb_startup_phases < 2) || !QueryPerformanceFrequency(&freq))
+		return;
+	logged = TRUE;
+	for (i = 1; i < nb_startup_phases; i++) {
+		static_sprintf(phase, "%s%s %.1f ms", (i == 1) ? "" : ", ", startup_phase[i].name,
+			(startup_phase[i].time.QuadPart - startup_phase[i - 1].time.QuadPart) * 1000.0f / freq.QuadPart);
+		static_strcat(str, phase);
+	}
+	uprintf("Startup timings: %s (total %.1f ms)", str,
+		(startup_phase[i - 1].time.QuadPart - startup_phase[0].time.QuadPart) * 1000.0f / freq.QuadPart);
+}
+
+// Loading the VDS service can take seconds, so we check for its availability in the background.
+static DWORD WINAPI VdsCheckThread(LPVOID param)
+{
+	is_vds_available = IsVdsAvailable(FALSE);
+	if (!is_vds_available) {
+		use_vds = FALSE;
+		uprintf("Notice: Windows VDS is unavailable");
+	}
+	ExitThread(0);
+}
+
+// Wait for the VDS availability check to complete. Must be called before using is_vds_available.
+void WaitForVdsCheck(void)
+{
+	if (vds_check_thread == NULL)
+		return;
+	WaitForSingleObject(vds_check_thread, INFINITE);
+	safe_closehandle(vds_check_thread);
+}
+
+// Saving a Local Group Policy can take seconds, so we set ours once for the session, in the background.
+static DWORD WINAPI LGPThread(LPVOID param)
+{
+	// We use local group policies rather than direct registry manipulation
+	// 0x9e disables removable and fixed drive notifications
+	lgp_set = SetLGP(FALSE, &existing_key, ep_reg, "NoDriveTypeAutorun", 0x9e);
+	ExitThread(0);
+}
+
+// Wait for our policy to be in place before an operation, or before we restore it.
+void WaitForLGP(void)
+{
+	if (lgp_thread == NULL)
+		return;
+	WaitForSingleObject(lgp_thread, INFINITE);
+	safe_closehandle(lgp_thread);
+}
+
 // Check for conflicting processes accessing the drive.
 // If bPrompt is true, ask the user whether they want to proceed.
 // dwTimeOut is the maximum amount of time we allow for this call to execute (in ms)
 // If bPrompt is false, the return value is the amount of time remaining before
-// dwTimeOut would expire (or zero if we spent more than dwTimeout in this procedure).
+// dwTimeOut would expire (or zero if we spent more than dwTimeout in this procedure),
+// capped to a fifth of dwTimeOut if no conflicting process was found.
 // If bPrompt is true, the return value is 0 on error, dwTimeOut on success.
 DWORD CheckDriveAccess(DWORD dwTimeOut, BOOL bPrompt)
 {
@@ -2179,6 +2413,9 @@ DWORD CheckDriveAccess(DWORD dwTimeOut, BOOL bPrompt)
 	} else {
 		ret = (DWORD)(GetTickCount64() - start_time);
 		ret = (dwTimeOut > ret) ? (dwTimeOut - ret) : 0;
+		// Nobody is holding the drive, so there's little point in waiting much longer
+		if (proceed)
+			ret = min(ret, dwTimeOut / 5);
 	}
 
 out:
@@ -2214,13 +2451,14 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 	static uint64_t LastRefresh = 0;
 	static BOOL first_log_display = TRUE, isMarquee = FALSE, queued_hotplug_event = FALSE;
 	static ULONG ulRegister = 0;
+	static HDEVNOTIFY hDiskNotify = NULL;
 	static LPITEMIDLIST pidlDesktop = NULL;
 	static SHChangeNotifyEntry NotifyEntry;
-	static DWORD_PTR thread_affinity[CHECKSUM_MAX + 1];
 	static HFONT hyperlink_font = NULL;
 	LONG lPos;
-	BOOL set_selected_fs;
+	BOOL set_selected_fs, incremental_refresh = FALSE;
 	DRAWITEMSTRUCT* pDI;
+	DEV_BROADCAST_HDR* pBroadcast;
 	LPTOOLTIPTEXT lpttt;
 	NMBCDROPDOWN* pDropDown;
 	HDROP droppedFileInfo;
@@ -2272,7 +2510,7 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 					MB_YESNO|MB_ICONWARNING|MB_IS_RTL, selected_langid) == IDYES)) {
 					// Operation may have completed in the meantime
 					if (format_thread != NULL) {
-						FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_CANCELLED;
+						CancelOperation(format_thread);
 						PrintInfo(0, MSG_201);
 						uprintf("Cancelling");
 						//  Start a timer to detect blocking operations during ISO file extraction
@@ -2288,17 +2526,15 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 				return (INT_PTR)TRUE;
 			} else if (op_in_progress) {
 				// User might be trying to cancel during preliminary checks
-				FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_CANCELLED;
+				CancelOperation(NULL);
 				PrintInfo(0, MSG_201);
 				EnableWindow(GetDlgItem(hDlg, IDCANCEL), TRUE);
 				return (INT_PTR)TRUE;
 			}
 
 			// Save the current log to %LocalAppData%\Rufus\rufus.log
-			log_size = GetWindowTextLengthU(hLog);
-			if ((!user_deleted_rufus_dir) && (log_size > 0) && ((log_buffer = (char*)malloc(log_size)) != NULL)) {
-				log_size = GetDlgItemTextU(hLogDialog, IDC_LOG_EDIT, log_buffer, log_size);
-				if (log_size-- > 1) {
+			if ((!user_deleted_rufus_dir) && ((log_buffer = GetLogText(&log_size)) != NULL)) {
+				if (log_size != 0) {
 					IGNORE_RETVAL(_chdirU(app_data_dir));
 					IGNORE_RETVAL(_mkdir(FILES_DIR));
 					IGNORE_RETVAL(_chdir(FILES_DIR));
@@ -2309,15 +2545,22 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 
 			if (ulRegister != 0)
 				SHChangeNotifyDeregister(ulRegister);
+			if (hDiskNotify != NULL)
+				UnregisterDeviceNotification(hDiskNotify);
 			PostQuitMessage(0);
 			StrArrayDestroy(&DriveId);
 			StrArrayDestroy(&DriveName);
 			StrArrayDestroy(&DriveLabel);
 			StrArrayDestroy(&DriveHub);
+			StrArrayDestroy(&DriveLocation);
 			StrArrayDestroy(&BlockingProcess);
 			StrArrayDestroy(&ImageList);
+			CloseISOSession();
+			FreeImageCache();
 			DestroyAllTooltips();
 			DestroyWindow(hLogDialog);
+			hLogDialog = NULL;
+			hLog = NULL;
 			GetWindowRect(hDlg, &relaunch_rc);
 			EndDialog(hDlg, 0);
 			break;
@@ -2561,7 +2804,7 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 				} else {
 					char* old_image_path = image_path;
 					// If declared globaly, lmprintf(MSG_036) would be called on each message...
-					EXT_DECL(img_ext, NULL, __VA_GROUP__("*.iso;*.img;*.vhd;*.usb;*.bz2;*.bzip2;*.gz;*.lzma;*.xz;*.Z;*.zip;*.wim;*.esd;*.vtsi"),
+					EXT_DECL(img_ext, NULL, __VA_GROUP__("*.iso;*.img;*.vhd;*.vhdx;*.ffu;*.usb;*.bz2;*.bzip2;*.gz;*.lzma;*.xz;*.Z;*.zip;*.wim;*.esd;*.vtsi;*.zst"),
 						__VA_GROUP__(lmprintf(MSG_036)));
 					image_path = FileDialog(FALSE, NULL, &img_ext, 0);
 					if (image_path == NULL) {
@@ -2633,6 +2876,15 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 			MyDialogBox(hMainInstance, IDD_UPDATE_POLICY, hDlg, UpdateCallback);
 			break;
 		case IDC_HASH:
+			// No need to hash the image again if it hasn't changed since we last did, or
+			// since the image library indexer did
+			if ((format_thread == NULL) && !HasFileSums(image_path) && LoadFileSums(image_path, sum_str))
+				SetFileSums(image_path);
+			if ((format_thread == NULL) && HasFileSums(image_path)) {
+				uprintf("\r\nUsing the checksums previously computed for '%s'", image_path);
+				MyDialogBox(hMainInstance, IDD_CHECKSUM, hMainDialog, ChecksumCallback);
+				break;
+			}
 			if ((format_thread == NULL) && (image_path != NULL)) {
 				FormatStatus = 0;
 				no_confirmation_on_cancel = TRUE;
@@ -2640,8 +2892,7 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 				// Disable all controls except cancel
 				EnableControls(FALSE, FALSE);
 				InitProgress(FALSE);
-				SetThreadAffinity(thread_affinity, CHECKSUM_MAX + 1);
-				format_thread = CreateThread(NULL, 0, SumThread, (LPVOID)thread_affinity, 0, NULL);
+				format_thread = CreateThread(NULL, 0, SumThread, NULL, 0, NULL);
 				if (format_thread != NULL) {
 					SetThreadPriority(format_thread, default_thread_priority);
 					PrintInfo(0, -1);
@@ -2700,6 +2951,11 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 		SetWindowTextU(GetDlgItem(hDlg, IDC_SELECT), uppercase_select[0]);
 		SendMessage(hDlg, WM_COMMAND, IDC_SELECT, 0);
 		break;
+	case UM_DEVICE_REFRESH:
+		// Sent by our refresh timer, with no indication of which device changed, so only
+		// probe the devices that are new or that we got a notification for in the meantime.
+		incremental_refresh = TRUE;
+		// Fall through
 	case UM_MEDIA_CHANGE:
 		wParam = DBT_CUSTOMEVENT;
 		// Fall through
@@ -2718,12 +2974,29 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 			switch (wParam) {
 			case DBT_DEVICEARRIVAL:
 			case DBT_DEVICEREMOVECOMPLETE:
+				// We know which disk or volume this is about, so just have that disk probed again
+				pBroadcast = (DEV_BROADCAST_HDR*)lParam;
+				if ((pBroadcast != NULL) && (pBroadcast->dbch_devicetype == DBT_DEVTYP_DEVICEINTERFACE)) {
+					if (IsWindowUnicode(hDlg)) {
+						wchar_to_utf8_no_alloc(((DEV_BROADCAST_DEVICEINTERFACE_W*)pBroadcast)->dbcc_name, tmp, sizeof(tmp));
+						InvalidateDevice(tmp);
+					} else {
+						InvalidateDevice(((DEV_BROADCAST_DEVICEINTERFACE_A*)pBroadcast)->dbcc_name);
+					}
+				} else if ((pBroadcast != NULL) && (pBroadcast->dbch_devicetype == DBT_DEVTYP_VOLUME)) {
+					InvalidateDriveLetters(((DEV_BROADCAST_VOLUME*)pBroadcast)->dbcv_unitmask);
+				}
+				incremental_refresh = TRUE;
+				// Fall through
 			case DBT_CUSTOMEVENT:	// Sent by our timer refresh function or for card reader media change
 				LastRefresh = GetTickCount64();
 				KillTimer(hMainDialog, TID_REFRESH_TIMER);
 				if (!op_in_progress) {
 					queued_hotplug_event = FALSE;
-					GetDevices((DWORD)ComboBox_GetCurItemData(hDeviceList));
+					if (incremental_refresh)
+						RefreshDevices((DWORD)ComboBox_GetCurItemData(hDeviceList));
+					else
+						GetDevices((DWORD)ComboBox_GetCurItemData(hDeviceList));
 					user_changed_label = FALSE;
 					EnableControls(TRUE, FALSE);
 					if (ComboBox_GetCurSel(hDeviceList) < 0) {
@@ -2764,12 +3037,15 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 		log_displayed = FALSE;
 		hLogDialog = MyCreateDialog(hMainInstance, IDD_LOG, hDlg, (DLGPROC)LogCallback);
 		InitDialog(hDlg);
+		StartupPhase("dialog init");
 		GetDevices(0);
+		StartupPhase("device enumeration");
 		EnableControls(TRUE, FALSE);
 		UpdateImage(FALSE);
 		// The AppStore version does not need the internal check for updates
 		if (!appstore_version)
 			CheckForUpdates(FALSE);
+		StartImageLibrary();
 		// Register MEDIA_INSERTED/MEDIA_REMOVED notifications for card readers
 		if (SUCCEEDED(SHGetSpecialFolderLocation(0, CSIDL_DESKTOP, &pidlDesktop))) {
 			NotifyEntry.pidl = pidlDesktop;
@@ -2779,6 +3055,10 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 			ulRegister = SHChangeNotifyRegister(hDlg, 0x0001 | 0x0002 | 0x8000,
 				SHCNE_MEDIAINSERTED | SHCNE_MEDIAREMOVED, UM_MEDIA_CHANGE, 1, &NotifyEntry);
 		}
+		// Register for disk arrival/removal, so that hotplug only needs to probe the disk it is about
+		hDiskNotify = RegisterDiskNotifications(hDlg);
+		if (hDiskNotify == NULL)
+			uprintf("Could not register for disk notifications: %s", WindowsErrorString());
 		// Bring our Window on top. We have to go through all *THREE* of these, or Far Manager hides our window :(
 		SetWindowPos(hMainDialog, HWND_TOPMOST, 0, 0, 0, 0, SWP_NOSIZE | SWP_NOMOVE);
 		SetWindowPos(hMainDialog, HWND_NOTOPMOST, 0, 0, 0, 0, SWP_NOSIZE | SWP_NOMOVE);
@@ -3009,6 +3289,33 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 		if (MessageBoxExU(hMainDialog, lmprintf(MSG_003, tmp),
 			APPLICATION_NAME, MB_OKCANCEL | MB_ICONWARNING | MB_IS_RTL, selected_langid) == IDCANCEL)
 			goto aborted_start;
+		if (batch_badblocks && IsChecked(IDC_BAD_BLOCKS) && (ComboBox_GetCount(hDeviceList) > 1) &&
+			(ComboBox_GetCurSel(hNBPasses) != BADBLOCK_CAPACITY_CHECK)) {
+			char drive_list[1024] = "";
+			nDeviceIndex = ComboBox_GetCurSel(hDeviceList);
+			for (i = 0; i < ComboBox_GetCount(hDeviceList); i++) {
+				if ((i == nDeviceIndex) || (ComboBox_GetLBTextU(hDeviceList, i, tmp) <= 0))
+					continue;
+				static_strcat(drive_list, "\n- ");
+				static_strcat(drive_list, tmp);
+			}
+			if (MessageBoxExU(hMainDialog, lmprintf(MSG_330, drive_list),
+				APPLICATION_NAME, MB_OKCANCEL | MB_ICONWARNING | MB_IS_RTL, selected_langid) == IDCANCEL)
+				goto aborted_start;
+		}
+		if (batch_write && (boot_type == BT_IMAGE) && write_as_image && (ComboBox_GetCount(hDeviceList) > 1)) {
+			char drive_list[1024] = "";
+			nDeviceIndex = ComboBox_GetCurSel(hDeviceList);
+			for (i = 0; i < ComboBox_GetCount(hDeviceList); i++) {
+				if ((i == nDeviceIndex) || (ComboBox_GetLBTextU(hDeviceList, i, tmp) <= 0))
+					continue;
+				static_strcat(drive_list, "\n- ");
+				static_strcat(drive_list, tmp);
+			}
+			if (MessageBoxExU(hMainDialog, lmprintf(MSG_331, drive_list),
+				APPLICATION_NAME, MB_OKCANCEL | MB_ICONWARNING | MB_IS_RTL, selected_langid) == IDCANCEL)
+				goto aborted_start;
+		}
 		if ((SelectedDrive.nPartitions > 1) && (MessageBoxExU(hMainDialog, lmprintf(MSG_093),
 			lmprintf(MSG_094), MB_OKCANCEL | MB_ICONWARNING | MB_IS_RTL, selected_langid) == IDCANCEL))
 			goto aborted_start;
@@ -3019,6 +3326,8 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 
 		nDeviceIndex = ComboBox_GetCurSel(hDeviceList);
 		DeviceNum = (DWORD)ComboBox_GetItemData(hDeviceList, nDeviceIndex);
+		WaitForVdsCheck();
+		WaitForLGP();
 		InitProgress(zero_drive || write_as_image);
 		format_thread = CreateThread(NULL, 0, FormatThread, (LPVOID)(uintptr_t)DeviceNum, 0, NULL);
 		if (format_thread == NULL) {
@@ -3036,6 +3345,7 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 			break;
 	aborted_start:
 		zero_drive = FALSE;
+		bench_drive = FALSE;
 		if (queued_hotplug_event)
 			SendMessage(hDlg, UM_MEDIA_CHANGE, 0, 0);
 		if (wParam == BOOTCHECK_CANCEL) {
@@ -3048,7 +3358,10 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 
 	case UM_FORMAT_COMPLETED:
 		zero_drive = FALSE;
+		bench_drive = FALSE;
 		format_thread = NULL;
+		// Don't hold on to the I/O buffers while we are idle
+		FlushIoBufferPool();
 		// Stop the timer
 		KillTimer(hMainDialog, TID_APP_TIMER);
 		// Close the cancel MessageBox and Blocking notification if active
@@ -3133,7 +3446,8 @@ static void PrintUsage(char* appname)
 	char fname[_MAX_FNAME];
 
 	_splitpath(appname, NULL, NULL, fname, NULL);
-	printf("\nUsage: %s [-x] [-g] [-h] [-f FILESYSTEM] [-i PATH] [-l LOCALE] [-w TIMEOUT]\n", fname);
+	printf("\nUsage: %s [-x] [-g] [-h] [-f FILESYSTEM] [-i PATH] [-l LOCALE] [-w TIMEOUT] [-t PATH] [-z SIZE]\n", fname);
+	printf("       %s -H OPERATION [-d DISK] [-s SERIAL] [-u VID:PID] [-i PATH] [-v] [-c] [-o PATH] [-t PATH] [-z SIZE]\n", fname);
 	printf("  -x, --extra-devs\n");
 	printf("     List extra devices, such as USB HDDs\n");
 	printf("  -g, --gui\n");
@@ -3147,6 +3461,34 @@ static void PrintUsage(char* appname)
 	printf("  -w TIMEOUT, --wait=TIMEOUT\n");
 	printf("     Wait TIMEOUT tens of seconds for the global application mutex to be released.\n");
 	printf("     Used when launching a newer version of " APPLICATION_NAME " from a running application.\n");
+	printf("  -H OPERATION, --headless=OPERATION\n");
+	printf("     Run OPERATION without any user interaction and exit. OPERATION is one of:\n");
+	printf("     'list' (list the devices), 'write' (write the DD image from -i), 'zero' (zero the drive),\n");
+	printf("     'bench' (benchmark the drive, which destroys its data), 'checksum' (hash the image from\n");
+	printf("     -i or, if -i is a directory or a .txt list of images, create or verify their SHA256SUMS)\n");
+	printf("     'perf' (measure the decompression, checksum, ISO extraction and formatting engines,\n");
+	printf("     on the images from the -i directory, without using a drive), 'history' (report the\n");
+	printf("     runs, failures and speed of each drive model and hub port, from past operations) or\n");
+	printf("     'serve' (run the write, zero and bench jobs that local clients submit on the \\\\.\\pipe\\\n");
+	printf("     " APPLICATION_NAME " named pipe, on several drives at once, until interrupted).\n");
+	printf("     Progress and results are printed on stdout and the exit code is 0 on success.\n");
+	printf("  -d DISK, --disk=DISK\n");
+	printf("     Select the target of a headless operation by its physical disk number\n");
+	printf("  -s SERIAL, --serial=SERIAL\n");
+	printf("     Select the target of a headless operation by its serial number\n");
+	printf("  -u VID:PID, --vid-pid=VID:PID\n");
+	printf("     Select the target of a headless operation by its USB vendor and product IDs\n");
+	printf("  -v, --verify\n");
+	printf("     Read back and compare the written data, in headless mode\n");
+	printf("  -c, --hash\n");
+	printf("     Print the checksums of the written data, in headless mode\n");
+	printf("  -o PATH, --log=PATH\n");
+	printf("     Also append the log messages to the file pointed by PATH\n");
+	printf("  -t PATH, --target=PATH\n");
+	printf("     Attach the .vhd or .vhdx from PATH, which is created if needed, as a drive that can\n");
+	printf("     be selected (in headless mode, it is the target if no other disk selection is made)\n");
+	printf("  -z SIZE, --target-size=SIZE\n");
+	printf("     The size, in GB, of the virtual target to create (default 16)\n");
 	printf("  -h, --help\n");
 	printf("     This usage guide.\n");
 }
@@ -3206,19 +3548,23 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 	const char* rufus_loc = "rufus.loc";
 	wchar_t kernel32_path[MAX_PATH];
 	int i, opt, option_index = 0, argc = 0, si = 0, lcid = GetUserDefaultUILanguage();
-	int wait_for_mutex = 0;
+	int wait_for_mutex = 0, exit_code = 0;
+	unsigned int vid, pid;
+	headless_params hl_params = { NULL, NULL, -1, 0, 0 };
+	const char* target_path = NULL;
+	uint64_t target_size = VIRTUAL_TARGET_SIZE;
 	FILE* fd;
-	BOOL attached_console = FALSE, external_loc_file = FALSE, lgp_set = FALSE, automount = TRUE;
-	BOOL disable_hogger = FALSE, previous_enable_HDDs = FALSE, vc = IsRegistryNode(REGKEY_HKCU, vs_reg);
-	BOOL alt_pressed = FALSE, alt_command = FALSE;
+	BOOL attached_console = FALSE, automount = TRUE;
+	BOOL disable_hogger = FALSE, is_job_worker = FALSE, previous_enable_HDDs = FALSE, vc = IsRegistryNode(REGKEY_HKCU, vs_reg);
+	BOOL alt_pressed = FALSE, alt_command = FALSE, hl_verify = FALSE, hl_hash = FALSE;
 	BYTE *loc_data;
-	DWORD loc_size, u = 0, size = sizeof(u);
+	DWORD loc_size, u = 0, size = sizeof(u), stdout_type;
 	char tmp_path[MAX_PATH] = "", loc_file[MAX_PATH] = "", ini_path[MAX_PATH] = "", ini_flags[] = "rb";
 	char *tmp, *locale_name = NULL, **argv = NULL;
 	wchar_t **wenv, **wargv;
 	PF_TYPE_DECL(CDECL, int, __wgetmainargs, (int*, wchar_t***, wchar_t***, int, int*));
 	PF_TYPE_DECL(WINAPI, BOOL, SetDefaultDllDirectories, (DWORD));
-	HANDLE mutex = NULL, hogmutex = NULL, hFile = NULL;
+	HANDLE mutex = NULL, hogmutex = NULL;
 	HWND hDlg = NULL;
 	HDC hDC;
 	MSG msg;
@@ -3230,9 +3576,20 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 		{"locale",     required_argument, NULL, 'l'},
 		{"filesystem", required_argument, NULL, 'f'},
 		{"wait",       required_argument, NULL, 'w'},
+		{"headless",   required_argument, NULL, 'H'},
+		{"disk",       required_argument, NULL, 'd'},
+		{"serial",     required_argument, NULL, 's'},
+		{"vid-pid",    required_argument, NULL, 'u'},
+		{"verify",     no_argument,       NULL, 'v'},
+		{"hash",       no_argument,       NULL, 'c'},
+		{"log",        required_argument, NULL, 'o'},
+		{"target",     required_argument, NULL, 't'},
+		{"target-size",required_argument, NULL, 'z'},
 		{0, 0, NULL, 0}
 	};
 
+	StartupPhase("start");
+
 	// Disable loading system DLLs from the current directory (sideloading mitigation)
 	// PS: You know that official MSDN documentation for SetDllDirectory() that explicitly
 	// indicates that "If the parameter is an empty string (""), the call removes the current
@@ -3260,6 +3617,7 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 		pfSetDefaultDllDirectories(LOAD_LIBRARY_SEARCH_SYSTEM32);
 
 	uprintf("*** " APPLICATION_NAME " init ***\n");
+	EtwRegister();
 	its_a_me_mario = GetUserNameA((char*)(uintptr_t)&u, &size) && (u == 7104878);
 	// coverity[pointless_string_compare]
 	is_x86_32 = (strcmp(APPLICATION_ARCH, "x86") == 0);
@@ -3360,14 +3718,17 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 					uprintf("Enabling console line hogger");
 					attached_console = TRUE;
 					IGNORE_RETVAL(freopen("CONIN$", "r", stdin));
-					IGNORE_RETVAL(freopen("CONOUT$", "w", stdout));
+					// Keep stdout if it was redirected, as scripts may want to parse the headless mode output
+					stdout_type = GetFileType(GetStdHandle(STD_OUTPUT_HANDLE));
+					if ((stdout_type != FILE_TYPE_DISK) && (stdout_type != FILE_TYPE_PIPE))
+						IGNORE_RETVAL(freopen("CONOUT$", "w", stdout));
 					IGNORE_RETVAL(freopen("CONOUT$", "w", stderr));
 					_flushall();
 					hogmutex = SetHogger();
 				}
 			}
 
-			while ((opt = getopt_long(argc, argv, "xghf:i:w:l:", long_options, &option_index)) != EOF) {
+			while ((opt = getopt_long(argc, argv, "xghf:i:w:l:H:d:s:u:vco:t:z:", long_options, &option_index)) != EOF) {
 				switch (opt) {
 				case 'x':
 					enable_HDDs = TRUE;
@@ -3413,6 +3774,41 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 				case 'w':
 					wait_for_mutex = atoi(optarg);
 					break;
+				case 'H':
+					hl_params.op = optarg;
+					break;
+				case 'd':
+					hl_params.disk = atoi(optarg);
+					break;
+				case 's':
+					hl_params.serial = optarg;
+					break;
+				case 'u':
+					if (sscanf(optarg, "%x:%x", &vid, &pid) == 2) {
+						hl_params.vid = (uint16_t)vid;
+						hl_params.pid = (uint16_t)pid;
+					} else {
+						printf("Invalid VID:PID '%s'\n", optarg);
+					}
+					break;
+				case 'v':
+					hl_verify = TRUE;
+					break;
+				case 'c':
+					hl_hash = TRUE;
+					break;
+				case 'o':
+					if (!SetLogFile(optarg))
+						printf("Could not open log file '%s'\n", optarg);
+					break;
+				case 't':
+					target_path = optarg;
+					break;
+				case 'z':
+					target_size = strtoull(optarg, NULL, 0) * GB;
+					if (target_size == 0)
+						target_size = VIRTUAL_TARGET_SIZE;
+					break;
 				case 'h':
 					PrintUsage(argv[0]);
 					goto out;
@@ -3462,20 +3858,83 @@ skip_args_processing:
 	advanced_mode_format = ReadSettingBool(SETTING_ADVANCED_MODE_FORMAT);
 	preserve_timestamps = ReadSettingBool(SETTING_PRESERVE_TIMESTAMPS);
 	use_fake_units = !ReadSettingBool(SETTING_USE_PROPER_SIZE_UNITS);
-	is_vds_available = IsVdsAvailable(FALSE);
-	use_vds = ReadSettingBool(SETTING_USE_VDS) && is_vds_available;
+	use_vds = ReadSettingBool(SETTING_USE_VDS);
+	vds_check_thread = CreateThread(NULL, 0, VdsCheckThread, NULL, 0, NULL);
+	if (vds_check_thread == NULL) {
+		is_vds_available = IsVdsAvailable(FALSE);
+		use_vds = use_vds && is_vds_available;
+	}
 	usb_debug = ReadSettingBool(SETTING_ENABLE_USB_DEBUG);
 	cdio_loglevel_default = usb_debug ? CDIO_LOG_DEBUG : CDIO_LOG_WARN;
 	detect_fakes = !ReadSettingBool(SETTING_DISABLE_FAKE_DRIVES_CHECK);
+	compact_apply = !ReadSettingBool(SETTING_DISABLE_COMPACT_APPLY);
 	allow_dual_uefi_bios = ReadSettingBool(SETTING_ENABLE_WIN_DUAL_EFI_BIOS);
 	force_large_fat32 = ReadSettingBool(SETTING_FORCE_LARGE_FAT32_FORMAT);
 	enable_vmdk = ReadSettingBool(SETTING_ENABLE_VMDK_DETECTION);
 	enable_file_indexing = ReadSettingBool(SETTING_ENABLE_FILE_INDEXING);
 	enable_VHDs = !ReadSettingBool(SETTING_DISABLE_VHDS);
 	enable_extra_hashes = ReadSettingBool(SETTING_ENABLE_EXTRA_HASHES);
+	enable_write_hashes = ReadSettingBool(SETTING_ENABLE_WRITE_HASHES);
 	ignore_boot_marker = ReadSettingBool(SETTING_IGNORE_BOOT_MARKER);
+	sparse_write = ReadSettingBool(SETTING_ENABLE_SPARSE_WRITE);
+	delta_write = ReadSettingBool(SETTING_ENABLE_DELTA_WRITE);
+	verify_write = ReadSettingBool(SETTING_VERIFY_WRITES);
+	enable_block_manifest = ReadSettingBool(SETTING_ENABLE_BLOCK_MANIFEST);
+	export_heatmap = ReadSettingBool(SETTING_ENABLE_IO_HEATMAP);
+	export_timeline = ReadSettingBool(SETTING_ENABLE_TIMELINE_EXPORT);
+	save_dynamic_vhd = ReadSettingBool(SETTING_ENABLE_DYNAMIC_VHD);
+	enable_write_cache = ReadSettingBool(SETTING_ENABLE_WRITE_CACHE);
+	rescue_capture = ReadSettingBool(SETTING_ENABLE_RESCUE_CAPTURE);
+	fast_repartition = ReadSettingBool(SETTING_ENABLE_FAST_REPARTITION);
+	badblocks_image_pass = ReadSettingBool(SETTING_BADBLOCKS_IMAGE_PASS);
+	// The headless mode options apply on top of the persistent settings
+	verify_write |= hl_verify;
+	enable_write_hashes |= hl_hash;
 	// We want above normal priority by default, so we offset the value.
 	default_thread_priority = ReadSetting32(SETTING_DEFAULT_THREAD_PRIORITY) + THREAD_PRIORITY_ABOVE_NORMAL;
+	write_queue_depth = ReadSetting32(SETTING_WRITE_QUEUE_DEPTH);
+	if (write_queue_depth <= 0)
+		write_queue_depth = DD_QUEUE_DEPTH;
+	checksum_buffer_size = ReadSetting32(SETTING_CHECKSUM_BUFFER_SIZE);
+	if (checksum_buffer_size <= 0)
+		checksum_buffer_size = CHECKSUM_BUFFER_SIZE;
+	enable_image_cache = ReadSettingBool(SETTING_ENABLE_IMAGE_CACHE);
+	image_cache_ram_size = ReadSetting32(SETTING_IMAGE_CACHE_RAM_SIZE);
+	if (image_cache_ram_size <= 0)
+		image_cache_ram_size = IMAGE_CACHE_RAM_SIZE;
+	verify_sample_interval = ReadSetting32(SETTING_VERIFY_SAMPLE_INTERVAL);
+	if (verify_sample_interval <= 0)
+		verify_sample_interval = 1;
+	extract_small_file_size = ReadSetting32(SETTING_EXTRACT_SMALL_FILE_SIZE);
+	if (extract_small_file_size <= 0)
+		extract_small_file_size = EXTRACT_SMALL_FILE_SIZE;
+	extract_buffer_size = ReadSetting32(SETTING_EXTRACT_BUFFER_SIZE);
+	if (extract_buffer_size <= 0)
+		extract_buffer_size = EXTRACT_BUFFER_SIZE;
+	// Drive health limits, in MB/s and ms, that are disabled unless set
+	health_min_speed = ReadSetting32(SETTING_HEALTH_MIN_WRITE_SPEED);
+	health_max_latency = ReadSetting32(SETTING_HEALTH_MAX_WRITE_LATENCY);
+	if ((health_min_speed > 0) || (health_max_latency > 0))
+		uprintf("Drive health limits: %d MB/s minimum write speed, %d ms maximum 99th percentile write latency",
+			max(health_min_speed, 0), max(health_max_latency, 0));
+
+	// The virtual target gets listed as a VHD, so these must be listed for it to be selectable
+	if (target_path != NULL) {
+		i = AttachVirtualTarget(target_path, target_size);
+		if (i < 0) {
+			// Never let a headless operation fall back to a real drive
+			if (hl_params.op != NULL) {
+				exit_code = 1;
+				goto out;
+			}
+		} else {
+			enable_VHDs = TRUE;
+			if ((hl_params.disk < 0) && (hl_params.serial == NULL) && (hl_params.vid == 0) && (hl_params.pid == 0))
+				hl_params.disk = i;
+		}
+	}
+
+	StartupPhase("settings");
 
 	// Initialize the global scaling, in case we need it before we initialize the dialog
 	hDC = GetDC(NULL);
@@ -3489,24 +3948,16 @@ skip_args_processing:
 	if (GetFileAttributesU(rufus_loc) == INVALID_FILE_ATTRIBUTES) {
 		uprintf("loc file not found in current directory - embedded one will be used");
 
+		// The loc data is parsed straight from the resource, so there's no need to extract it
 		loc_data = (BYTE*)GetResource(hMainInstance, MAKEINTRESOURCEA(IDR_LC_RUFUS_LOC), _RT_RCDATA, "embedded.loc", &loc_size, FALSE);
-		if ( (GetTempFileNameU(temp_dir, APPLICATION_NAME, 0, loc_file) == 0) || (loc_file[0] == 0) ) {
-			// Last ditch effort to get a loc file - just extract it to the current directory
-			static_strcpy(loc_file, rufus_loc);
-		}
-
-		hFile = CreateFileU(loc_file, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ,
-			NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-		if ((hFile == INVALID_HANDLE_VALUE) || (!WriteFileWithRetry(hFile, loc_data, loc_size, &size, WRITE_RETRIES))) {
-			uprintf("localization: unable to extract '%s': %s", loc_file, WindowsErrorString());
-			safe_closehandle(hFile);
+		if (loc_data == NULL) {
+			uprintf("localization: unable to access the embedded loc data");
 			goto out;
 		}
-		uprintf("localization: extracted data to '%s'", loc_file);
-		safe_closehandle(hFile);
+		set_embedded_loc_data((const char*)loc_data, loc_size);
+		static_strcpy(loc_file, embedded_loc_filename);
 	} else {
 		static_sprintf(loc_file, "%s\\%s", app_dir, rufus_loc);
-		external_loc_file = TRUE;
 		uprintf("using external loc file '%s'", loc_file);
 	}
 
@@ -3518,6 +3969,7 @@ skip_args_processing:
 		goto out;
 	}
 	selected_langid = get_language_id(selected_locale);
+	StartupPhase("locales");
 
 	// Set the Windows version
 	GetWindowsVersion();
@@ -3553,7 +4005,9 @@ skip_args_processing:
 		Sleep(100);
 		mutex = CreateMutexA(NULL, TRUE, "Global/" APPLICATION_NAME);
 	}
-	if ((mutex == NULL) || (GetLastError() == ERROR_ALREADY_EXISTS)) {
+	// The instances that run the jobs of the job server are meant to run alongside it, on distinct drives
+	is_job_worker = (hl_params.op != NULL) && (GetEnvironmentVariableA("RUFUS_JOB", NULL, 0) != 0);
+	if (!is_job_worker && ((mutex == NULL) || (GetLastError() == ERROR_ALREADY_EXISTS))) {
 		// Load the translation before we print the error
 		get_loc_data_file(loc_file, selected_locale);
 		right_to_left_mode = ((selected_locale->ctrl_id) & LOC_RIGHT_TO_LEFT);
@@ -3577,9 +4031,12 @@ skip_args_processing:
 	// the Windows Services preventing access to the disk or volume we want to format.
 	EnablePrivileges();
 
-	// We use local group policies rather than direct registry manipulation
-	// 0x9e disables removable and fixed drive notifications
-	lgp_set = SetLGP(FALSE, &existing_key, ep_reg, "NoDriveTypeAutorun", 0x9e);
+	// The instances that run the jobs of the job server leave the policy to the server
+	if (!is_job_worker) {
+		lgp_thread = CreateThread(NULL, 0, LGPThread, NULL, 0, NULL);
+		if (lgp_thread == NULL)
+			lgp_set = SetLGP(FALSE, &existing_key, ep_reg, "NoDriveTypeAutorun", 0x9e);
+	}
 
 	// Re-enable AutoMount if needed
 	if (!GetAutoMount(&automount)) {
@@ -3602,6 +4059,16 @@ relaunch:
 	SetProcessDefaultLayout(right_to_left_mode ? LAYOUT_RTL : 0);
 	if (get_loc_data_file(loc_file, selected_locale))
 		WriteSettingStr(SETTING_LOCALE, selected_locale->txt[0]);
+	StartupPhase("system setup");
+
+	// Only one instance can own the metrics file, and the job instances run alongside the server
+	if (!is_job_worker)
+		StartMetricsExporter();
+	// Headless mode runs the requested operation and exits, without creating the main dialog
+	if (hl_params.op != NULL) {
+		exit_code = RunHeadless(&hl_params);
+		goto out;
+	}
 
 	if (!vc) {
 		if (MessageBoxExU(NULL, lmprintf(MSG_296), lmprintf(MSG_295),
@@ -3638,6 +4105,8 @@ relaunch:
 
 	ShowWindow(hDlg, SW_SHOWNORMAL);
 	UpdateWindow(hDlg);
+	StartupPhase("display");
+	LogStartupPhases();
 
 	// Do our own event processing and process "magic" commands
 	while(GetMessage(&msg, NULL, 0, 0)) {
@@ -3782,7 +4251,7 @@ relaunch:
 				GetDevices(0);
 				continue;
 			}
-			// Alt-H => Toggle computation of SHA512 digest
+			// Alt-H => Toggle computation of the SHA512 and BLAKE3 digests
 			if ((msg.message == WM_SYSKEYDOWN) && (msg.wParam == 'H')) {
 				enable_extra_hashes = !enable_extra_hashes;
 				WriteSettingBool(SETTING_ENABLE_EXTRA_HASHES, enable_extra_hashes);
@@ -3893,6 +4362,7 @@ relaunch:
 			}
 			// Alt-V => Use VDS facilities for formatting
 			if ((msg.message == WM_SYSKEYDOWN) && (msg.wParam == 'V')) {
+				WaitForVdsCheck();
 				if (is_vds_available) {
 					use_vds = !use_vds;
 					WriteSettingBool(SETTING_USE_VDS, use_vds);
@@ -3942,6 +4412,21 @@ relaunch:
 			}
 
 			// Other hazardous cheat modes require Ctrl + Alt
+			// Ctrl-Alt-C => Clone the selected drive to all the other listed drives - CAUTION!!!
+			if ((msg.message == WM_KEYDOWN) && (msg.wParam == 'C') &&
+				(GetKeyState(VK_CONTROL) & 0x8000) && (GetKeyState(VK_MENU) & 0x8000)) {
+				CloneDrive();
+				continue;
+			}
+			// Ctrl-Alt-K => Benchmark the drive, and tune the image write parameters for its model
+			if ((msg.message == WM_KEYDOWN) && (msg.wParam == 'K') &&
+				(GetKeyState(VK_CONTROL) & 0x8000) && (GetKeyState(VK_MENU) & 0x8000)) {
+				zero_drive = TRUE;
+				bench_drive = TRUE;
+				// Simulate a button click for Start
+				PostMessage(hDlg, WM_COMMAND, (WPARAM)IDC_START, 0);
+				continue;
+			}
 			// Ctrl-Alt-F => List non USB removable drives such as eSATA, etc - CAUTION!!!
 			if ((msg.message == WM_KEYDOWN) && (msg.wParam == 'F') &&
 				(GetKeyState(VK_CONTROL) & 0x8000) && (GetKeyState(VK_MENU) & 0x8000)) {
@@ -3962,6 +4447,82 @@ relaunch:
 				continue;
 			}
 
+			// Ctrl-Alt-S => Toggle sparse writes, for DD images
+			// When enabled, blocks of zeros from the image are not written if the matching
+			// area of the target drive already reads back as zeros.
+			if ((msg.message == WM_KEYDOWN) && (msg.wParam == 'S') &&
+				(GetKeyState(VK_CONTROL) & 0x8000) && (GetKeyState(VK_MENU) & 0x8000)) {
+				sparse_write = !sparse_write;
+				WriteSettingBool(SETTING_ENABLE_SPARSE_WRITE, sparse_write);
+				PrintStatusTimeout("Sparse writes", sparse_write);
+				continue;
+			}
+
+			// Ctrl-Alt-D => Toggle dynamic VHDs when saving a drive, where zeroed blocks are not allocated
+			if ((msg.message == WM_KEYDOWN) && (msg.wParam == 'D') &&
+				(GetKeyState(VK_CONTROL) & 0x8000) && (GetKeyState(VK_MENU) & 0x8000)) {
+				save_dynamic_vhd = !save_dynamic_vhd;
+				WriteSettingBool(SETTING_ENABLE_DYNAMIC_VHD, save_dynamic_vhd);
+				PrintStatusTimeout("Dynamic VHDs", save_dynamic_vhd);
+				continue;
+			}
+
+			// Ctrl-Alt-H => Toggle the computation of the checksums of DD images while they are written
+			if ((msg.message == WM_KEYDOWN) && (msg.wParam == 'H') &&
+				(GetKeyState(VK_CONTROL) & 0x8000) && (GetKeyState(VK_MENU) & 0x8000)) {
+				enable_write_hashes = !enable_write_hashes;
+				WriteSettingBool(SETTING_ENABLE_WRITE_HASHES, enable_write_hashes);
+				PrintStatusTimeout("Checksums on write", enable_write_hashes);
+				continue;
+			}
+
+			// Ctrl-Alt-V => Toggle the verification of DD images, by reading back the drive after write
+			if ((msg.message == WM_KEYDOWN) && (msg.wParam == 'V') &&
+				(GetKeyState(VK_CONTROL) & 0x8000) && (GetKeyState(VK_MENU) & 0x8000)) {
+				verify_write = !verify_write;
+				WriteSettingBool(SETTING_VERIFY_WRITES, verify_write);
+				PrintStatusTimeout("Verify after write", verify_write);
+				continue;
+			}
+
+			// Ctrl-Alt-M => Toggle the export of the I/O heatmap of bad blocks checks and image writes,
+			// as CSV and JSON files, next to the bad blocks log
+			if ((msg.message == WM_KEYDOWN) && (msg.wParam == 'M') &&
+				(GetKeyState(VK_CONTROL) & 0x8000) && (GetKeyState(VK_MENU) & 0x8000)) {
+				export_heatmap = !export_heatmap;
+				WriteSettingBool(SETTING_ENABLE_IO_HEATMAP, export_heatmap);
+				PrintStatusTimeout("I/O heatmap export", export_heatmap);
+				continue;
+			}
+
+			// Ctrl-Alt-J => Toggle the export of the timeline of format and save operations, as a
+			// Chrome trace event JSON file, next to the bad blocks log
+			if ((msg.message == WM_KEYDOWN) && (msg.wParam == 'J') &&
+				(GetKeyState(VK_CONTROL) & 0x8000) && (GetKeyState(VK_MENU) & 0x8000)) {
+				export_timeline = !export_timeline;
+				WriteSettingBool(SETTING_ENABLE_TIMELINE_EXPORT, export_timeline);
+				PrintStatusTimeout("Timeline export", export_timeline);
+				continue;
+			}
+
+			// Ctrl-Alt-B => Toggle batch bad blocks checks, where all the listed drives are tested
+			// concurrently with the selected one - CAUTION!!!
+			if ((msg.message == WM_KEYDOWN) && (msg.wParam == 'B') &&
+				(GetKeyState(VK_CONTROL) & 0x8000) && (GetKeyState(VK_MENU) & 0x8000)) {
+				batch_badblocks = !batch_badblocks;
+				PrintStatusTimeout("Batch bad blocks check", batch_badblocks);
+				continue;
+			}
+
+			// Ctrl-Alt-W => Toggle batch image writes, where the image is also written to all the
+			// other listed drives, concurrently with the selected one - CAUTION!!!
+			if ((msg.message == WM_KEYDOWN) && (msg.wParam == 'W') &&
+				(GetKeyState(VK_CONTROL) & 0x8000) && (GetKeyState(VK_MENU) & 0x8000)) {
+				batch_write = !batch_write;
+				PrintStatusTimeout("Batch image write", batch_write);
+				continue;
+			}
+
 			// Ctrl-Alt-Y => Force update check to be successful and ignore timestamp errors
 			if ((msg.message == WM_KEYDOWN) && (msg.wParam == 'Y') &&
 				(GetKeyState(VK_CONTROL) & 0x8000) && (GetKeyState(VK_MENU) & 0x8000)) {
@@ -4003,16 +4564,20 @@ out:
 	// Kill the update check thread if running
 	if (update_check_thread != NULL)
 		TerminateThread(update_check_thread, 1);
-	if ((!external_loc_file) && (loc_file[0] != 0))
-		DeleteFileU(loc_file);
+	StopImageLibrary();
+	StopMetricsExporter();
 	DestroyAllTooltips();
 	ClrAlertPromptHook();
 	exit_localization();
+	// Write any setting change that is still pending
+	destroy_token_data_file_cache();
 	safe_free(image_path);
 	safe_free(archive_path);
 	safe_free(locale_name);
 	safe_free(update.download_url);
 	safe_free(update.release_notes);
+	for (i = 0; i < MAX_DOWNLOAD_MIRRORS; i++)
+		safe_free(update.download_mirror[i]);
 	safe_free(grub2_buf);
 	safe_free(fido_url);
 	safe_free(fido_script);
@@ -4020,10 +4585,12 @@ out:
 		for (i=0; i<argc; i++) safe_free(argv[i]);
 		safe_free(argv);
 	}
+	WaitForLGP();
 	if (lgp_set)
 		SetLGP(TRUE, &existing_key, ep_reg, "NoDriveTypeAutorun", 0);
 	if ((!automount) && (!SetAutoMount(FALSE)))
 		uprintf("Failed to restore AutoMount to disabled");
+	DetachVirtualTarget();
 	ubflush();
 	_chdirU(app_dir);
 	// Unconditional delete with retry, just in case...
@@ -4031,15 +4598,19 @@ out:
 		Sleep(200);
 	CloseHandle(mutex);
 	CoUninitialize();
+	FlushIoBufferPool();
+	EtwUnregister();
 	CLOSE_OPENED_LIBRARIES;
 	if (attached_console) {
 		SetWindowPos(GetConsoleWindow(), HWND_TOP, 0, 0, 0, 0, SWP_NOSIZE | SWP_NOMOVE);
 		FreeConsole();
 	}
 	uprintf("*** " APPLICATION_NAME " exit ***\n");
+	FlushLog();
+	SetLogFile(NULL);
 #ifdef _CRTDBG_MAP_ALLOC
 	_CrtDumpMemoryLeaks();
 #endif
 
-	return 0;
+	return exit_code;
 }
@@ -47,6 +47,8 @@
 #define APPLICATION_ARCH            "(Unknown Arch)"
 #endif
 #define COMPANY_NAME                "Akeo Consulting"
+#define CLUSTER_ADVISOR_MAX_SIZE    (64*1024)	// Largest cluster size we recommend for ISO mode
+#define CLUSTER_ADVISOR_MAX_SLACK   3			// Percentage of the ISO data we accept to lose to partial clusters
 #define STR_NO_LABEL                "NO_LABEL"
 // Yes, there exist characters between these seemingly empty quotes!
 #define LEFT_TO_RIGHT_MARK          "‎"
@@ -58,6 +60,8 @@
 #define RIGHT_TO_LEFT_OVERRIDE      "‮"
 #define DRIVE_ACCESS_TIMEOUT        15000		// How long we should retry drive access (in ms)
 #define DRIVE_ACCESS_RETRIES        150			// How many times we should retry
+#define DRIVE_ACCESS_MIN_DELAY      10			// Initial delay between drive access retries (in ms)
+#define DRIVE_ACCESS_MAX_DELAY      500			// Maximum delay between drive access retries (in ms)
 #define DRIVE_INDEX_MIN             0x00000080
 #define DRIVE_INDEX_MAX             0x000000C0
 #define MIN_DRIVE_SIZE              8			// Minimum size a drive must have, to be formattable (in MB)
@@ -68,9 +72,12 @@
 #define MAX_TOOLTIPS                128
 #define MAX_SIZE_SUFFIXES           6			// bytes, KB, MB, GB, TB, PB
 #define MAX_CLUSTER_SIZES           18
+#define ISO_CLUSTER_STATS           13			// Cluster sizes, from 512 bytes to 2 MB, for which we count the ISO clusters
 #define MAX_PROGRESS                0xFFFF
 #define PATCH_PROGRESS_TOTAL        207
 #define MAX_LOG_SIZE                0x7FFFFFFE
+#define LOG_RING_SIZE               (32 * MB)		// How much of the log we keep in memory (and save)
+#define LOG_WINDOW_SIZE             (1024 * 1024)	// How many characters of the log the log window displays
 #define MAX_REFRESH                 25			// How long we should wait to refresh UI elements (in ms)
 #define MAX_GUID_STRING_LENGTH      40
 #define MAX_PARTITIONS              16			// Maximum number of partitions we handle
@@ -79,6 +86,7 @@
 #define MAX_DEFAULT_LIST_CARD_SIZE  200			// Size above which we don't list a card without enable HDD or Alt-F (in GB)
 #define MAX_SECTORS_TO_CLEAR        128			// nb sectors to zap when clearing the MBR/GPT (must be >34)
 #define MAX_WININST                 4			// Max number of install[.wim|.esd] we can handle on an image
+#define MAX_DOWNLOAD_MIRRORS        4			// Max number of mirrors we use for a download
 #define MBR_UEFI_MARKER             0x49464555	// 'U', 'E', 'F', 'I', as a 32 bit little endian longword
 #define MORE_INFO_URL               0xFFFF
 #define PROJECTED_SIZE_RATIO        110			// Percentage by which we inflate projected_size to prevent persistence overflow
@@ -102,12 +110,32 @@
 #define BADCLOCK_PATTERN_MLC        {0x00, 0xff, 0x33, 0xcc}
 #define BADBLOCK_PATTERN_TLC        {0x00, 0xff, 0x1c71c7, 0xe38e38}
 #define BADBLOCK_BLOCK_SIZE         (512 * 1024)
+#define BADBLOCK_CAPACITY_CHECK     BADLOCKS_PATTERN_TYPES	// Passes dropdown index of the quick capacity check
 #define LARGE_FAT32_SIZE            (32 * 1073741824LL)	// Size at which we need to use fat32format
 #define UDF_FORMAT_SPEED            3.1f		// Speed estimate at which we expect UDF drives to be formatted (GB/s)
 #define UDF_FORMAT_WARN             20			// Duration (in seconds) above which we warn about long UDF formatting times
 #define MAX_FAT32_SIZE              2.0f		// Threshold above which we disable FAT32 formatting (in TB)
 #define FAT32_CLUSTER_THRESHOLD     1.011f		// For FAT32, cluster size changes don't occur at power of 2 boundaries but slightly above
 #define DD_BUFFER_SIZE              (32 * 1024 * 1024)	// Minimum size of buffer to use for DD operations
+#define HASH_FILE_BUFFER_SIZE       (4 * 1024 * 1024)	// Size of each of the two buffers HashFileAsync() reads into
+#define HASH_FILES_MAX_SIZE         (1 * 1024 * 1024)	// Largest file that HashFiles() reads in one go, rather than through HashFileAsync()
+#define DD_QUEUE_DEPTH              2			// Default number of concurrent writes for DD operations
+#define DD_BATCH_LAG_BUFFERS        8			// How many DD buffers a drive can fall behind the others in batch write mode
+#define DD_TUNE_MIN_SIZE            (2 * GB)	// Minimum image size for the DD write parameters to be tuned on the fly
+#define VIRTUAL_TARGET_SIZE         (16 * GB)	// Default size of the virtual target disks we create
+#define DD_TUNE_PHASE_SIZE          (64 * MB)	// Minimum amount of data to write with each set of parameters when tuning
+#define DD_TUNE_BUFFER_SIZE         (128 * MB)	// Size of the buffer when tuning, to try deeper queues with large requests
+#define DD_TUNE_SIZE_DEPTH          4			// Queue depth used when tuning the request size
+#define DD_TUNE_TOLERANCE           0.95f		// Prefer smaller parameters within that ratio of the best throughput
+#define IMG_SAVE_BUFFERS            3			// Number of buffers for saving a drive to an image (reads in flight + 1)
+#define IMG_SAVE_OPTICAL_BUFFERS    8			// Same for optical media, with smaller reads to keep the drive streaming
+#define IMG_SAVE_OPTICAL_BUFSIZE    (4 * MB)	// Size of each read from optical media (a multiple of the 2048 bytes sector)
+#define IMG_SAVE_SPARSE_CHUNK       (64 * 1024)	// Zeroed chunks of that size are left sparse in saved images
+#define DELTA_WRITE_CHUNK           (1024 * 1024)	// Granularity at which delta writes compare the image with the target
+#define CHECKSUM_BUFFER_SIZE        2			// Default size of each checksum ring buffer (in MB)
+#define IMAGE_CACHE_RAM_SIZE        1024		// Default RAM budget for the decompressed image cache (in MB)
+#define EXTRACT_SMALL_FILE_SIZE     1024		// Default size up to which extracted files go through the writer pool (in KB)
+#define EXTRACT_BUFFER_SIZE         4			// Default size of the chunks that larger extracted files are written in (in MB)
 #define UBUFFER_SIZE                4096
 #define RSA_SIGNATURE_SIZE          256
 #define CBN_SELCHANGE_INTERNAL      (CBN_SELCHANGE + 256)
@@ -119,6 +147,7 @@
 #define DOWNLOAD_URL                RUFUS_URL "/downloads"
 #define FILES_URL                   RUFUS_URL "/files"
 #define FILES_DIR                   APPLICATION_NAME
+#define KNOWN_IMAGES_DB             "known_images.db"
 #define FIDO_VERSION                "z1"
 #define SECURE_BOOT_MORE_INFO_URL   "https://github.com/pbatard/rufus/wiki/FAQ#Why_do_I_need_to_disable_Secure_Boot_to_use_UEFINTFS"
 #define WPPRECORDER_MORE_INFO_URL   "https://github.com/pbatard/rufus/wiki/FAQ#BSODs_with_Windows_To_Go_drives_created_from_Windows_10_1809_ISOs"
@@ -135,7 +164,8 @@
 #define PERCENTAGE(percent, value)  ((1ULL * percent * value) / 100ULL)
 #define IsChecked(CheckBox_ID)      (IsDlgButtonChecked(hMainDialog, CheckBox_ID) == BST_CHECKED)
 #define MB_IS_RTL                   (right_to_left_mode?MB_RTLREADING|MB_RIGHT:0)
-#define CHECK_FOR_USER_CANCEL       if (IS_ERROR(FormatStatus) && (SCODE_CODE(FormatStatus) == ERROR_CANCELLED)) goto out
+#define IS_USER_CANCEL              (IS_ERROR(FormatStatus) && (SCODE_CODE(FormatStatus) == ERROR_CANCELLED))
+#define CHECK_FOR_USER_CANCEL       if (IS_USER_CANCEL) goto out
 // Bit masks used for the display of additional image options in the UI
 #define IMOP_WINTOGO                0x01
 #define IMOP_PERSISTENCE            0x02
@@ -172,6 +202,10 @@
 
 extern void _uprintf(const char *format, ...);
 extern void _uprintfs(const char *str);
+extern void FlushLog(void);
+extern BOOL SetLogFile(const char* path);
+extern char* GetLogText(DWORD* size);
+extern void ClearLog(void);
 #define uprintf(...) _uprintf(__VA_ARGS__)
 #define uprintfs(s) _uprintfs(s)
 #define vuprintf(...) do { if (verbose) _uprintf(__VA_ARGS__); } while(0)
@@ -201,6 +235,8 @@ enum user_message_type {
 	UM_SELECT_ISO,
 	UM_TIMER_START,
 	UM_FORMAT_START,
+	UM_DEVICE_REFRESH,
+	UM_LOG_FLUSH,
 	// Start of the WM IDs for the language menu items
 	UM_LANGUAGE_MENU = WM_APP + 0x100
 };
@@ -302,13 +338,39 @@ enum image_option_type {
 	IMOP_MAX
 };
 
+// The extra checksums, that are only computed when enable_extra_hashes is set, must come last
 enum checksum_type {
 	CHECKSUM_MD5 = 0,
 	CHECKSUM_SHA1,
 	CHECKSUM_SHA256,
 	CHECKSUM_SHA512,
+	CHECKSUM_BLAKE3,
 	CHECKSUM_MAX
 };
+#define CHECKSUM_EXTRA_FIRST        CHECKSUM_SHA512
+
+// The kind of work a thread does, for SetThreadClass()
+enum thread_class {
+	THREAD_CLASS_COMPUTE = 0,				// Hashing, decompression, extraction
+	THREAD_CLASS_IO,						// Mostly waits on the drive or on other threads
+	THREAD_CLASS_BACKGROUND,				// Work nobody waits on (prefetch, revocation checks)
+};
+
+/*
+ * Block manifest, with the SHA-256 of each MANIFEST_CHUNK_SIZE chunk of the data written
+ * to a drive, and a root hash, that is the SHA-256 of all the chunk hashes in sequence.
+ */
+#define MANIFEST_CHUNK_SIZE         (1024 * 1024)
+#define MANIFEST_EXT                ".blocksums"
+typedef struct {
+	uint64_t size;						// Size of the data covered
+	uint64_t stamp[2];					// Size and last write time of the image it was computed for
+	uint32_t nb_chunks;
+	uint32_t max_chunks;
+	uint8_t (*chunk)[32];
+	uint8_t root[32];
+	BOOL complete;
+} block_manifest;
 
 /* Special handling for old .c32 files we need to replace */
 #define NB_OLD_C32          2
@@ -329,6 +391,7 @@ enum checksum_type {
 #define HAS_BOOTMGR(r)      (HAS_BOOTMGR_BIOS(r) || HAS_BOOTMGR_EFI(r))
 #define HAS_REGULAR_EFI(r)  (r.has_efi & 0x7FFE)
 #define HAS_WININST(r)      (r.wininst_index != 0)
+#define HAS_SPLIT_WIM(r)    (r.has_4GB_file && !r.has_4GB_other_file)
 #define HAS_WINPE(r)        (((r.winpe & WINPE_I386) == WINPE_I386)||((r.winpe & WINPE_AMD64) == WINPE_AMD64)||((r.winpe & WINPE_MININT) == WINPE_MININT))
 #define HAS_WINDOWS(r)      (HAS_BOOTMGR(r) || (r.uses_minint) || HAS_WINPE(r))
 #define HAS_WIN7_EFI(r)     ((r.has_efi == 1) && HAS_WININST(r))
@@ -360,11 +423,14 @@ typedef struct {
 	uint64_t image_size;
 	uint64_t archive_size;
 	uint64_t projected_size;
+	uint64_t nb_clusters[ISO_CLUSTER_STATS];	// Clusters the ISO files take, for each cluster size from 512 bytes
 	int64_t mismatch_size;
 	uint32_t wininst_version;
 	BOOLEAN is_iso;
 	uint8_t is_bootable_img;
 	BOOLEAN is_vhd;
+	BOOLEAN is_dynamic_vhd;		// Dynamic VHD or VHDX, to be written through its block allocation map
+	BOOLEAN is_ffu;
 	BOOLEAN is_windows_img;
 	BOOLEAN disable_iso;
 	BOOLEAN rh8_derivative;
@@ -374,6 +440,7 @@ typedef struct {
 	uint8_t wininst_index;
 	uint8_t has_symlinks;
 	BOOLEAN has_4GB_file;
+	BOOLEAN has_4GB_other_file;			// A >4GB file that isn't an install.wim we can split
 	BOOLEAN has_long_filename;
 	BOOLEAN has_deep_directories;
 	BOOLEAN has_bootmgr;
@@ -406,15 +473,54 @@ typedef struct {
 	uint32_t platform_min[2];		// minimum platform version required
 	char* download_url;
 	char* release_notes;
+	char* download_mirror[MAX_DOWNLOAD_MIRRORS];	// Alternate URLs of the same file as download_url
 } RUFUS_UPDATE;
 
+/* Block allocation map of a dynamic VHD or VHDX image */
+typedef struct {
+	uint64_t disk_size;
+	uint32_t block_size;
+	uint32_t nb_blocks;
+	uint64_t* block;		// Image offset of the data of each block, or 0 for a block that reads as zeros
+} VDISK_MAP;
+
+/* Write descriptors of a Full Flash Update image. The payload blocks of each entry follow the ones
+ * of the previous entry, and are written at each of its locations. */
+typedef struct {
+	uint32_t block_index;
+	BOOLEAN from_end;		// The block index is from the end of the disk
+} FFU_LOCATION;
+
+typedef struct {
+	uint32_t nb_blocks;
+	uint32_t nb_locations;
+	FFU_LOCATION* location;
+} FFU_ENTRY;
+
+typedef struct {
+	uint32_t block_size;
+	uint32_t chunk_size;
+	uint32_t nb_hashes;		// 0 when the data can't be validated
+	uint32_t first_hash;	// Index of the hash of the first payload chunk
+	uint32_t nb_entries;
+	uint64_t payload_offset;
+	uint64_t payload_size;
+	uint64_t disk_size;		// Minimum size of the target disk
+	uint8_t* hash_table;
+	FFU_ENTRY* entry;
+	FFU_LOCATION* location;
+} FFU_IMAGE;
+
 #define IMG_SAVE_TYPE_VHD 1
 #define IMG_SAVE_TYPE_ISO 2
+#define IMG_SAVE_TYPE_DYNAMIC_VHD 3
+#define IMG_SAVE_TYPE_COMPRESSED 4
 
 typedef struct {
 	DWORD Type;
 	DWORD DeviceNum;
 	DWORD BufSize;
+	BOOLEAN Compression;
 	LONGLONG DeviceSize;
 	char* DevicePath;
 	char* ImagePath;
@@ -491,7 +597,7 @@ extern HWND hInfo, hProgress, hDiskID;
 extern WORD selected_langid;
 extern DWORD FormatStatus, DownloadStatus, MainThreadId, LastWriteError;
 extern BOOL use_own_c32[NB_OLD_C32], detect_fakes, op_in_progress, right_to_left_mode;
-extern BOOL allow_dual_uefi_bios, large_drive, usb_debug;
+extern BOOL allow_dual_uefi_bios, large_drive, usb_debug, headless;
 extern int64_t iso_blocking_status;
 extern uint8_t image_options;
 extern uint16_t rufus_version[3], embedded_sl_version[2];
@@ -524,6 +630,7 @@ extern void _UpdateProgressWithInfo(int op, int msg, uint64_t processed, uint64_
 #define UpdateProgressWithInfo(op, msg, processed, total) _UpdateProgressWithInfo(op, msg, processed, total, FALSE)
 #define UpdateProgressWithInfoForce(op, msg, processed, total) _UpdateProgressWithInfo(op, msg, processed, total, TRUE)
 #define UpdateProgressWithInfoInit(hProgressDialog, bNoAltMode) UpdateProgressWithInfo(OP_INIT, (int)bNoAltMode, (uint64_t)(uintptr_t)hProgressDialog, 0);
+extern void SetProgressSpeedHint(uint64_t speed);
 extern const char* StrError(DWORD error_code, BOOL use_default_locale);
 extern char* GuidToString(const GUID* guid);
 extern GUID* StringToGuid(const char* str);
@@ -551,13 +658,19 @@ extern SIZE GetTextSize(HWND hCtrl, char* txt);
 extern BOOL ExtractAppIcon(const char* filename, BOOL bSilent);
 extern BOOL ExtractDOS(const char* path);
 extern BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan);
+extern BOOL ScanISOInBackground(const char* src_iso);
+extern BOOL WriteISOToFAT32(DWORD DriveIndex, uint64_t PartitionOffset, const char* src_iso);
 extern int64_t ExtractISOFile(const char* iso, const char* iso_file, const char* dest_file, DWORD attributes);
+extern int64_t ReadISOFileRange(const char* iso, const char* iso_file, uint64_t offset, void* buf, uint32_t size);
+extern void CloseISOSession(void);
+extern BOOL CheckKnownImage(void);
+extern void FreeImageCache(void);
 extern BOOL HasEfiImgBootLoaders(void);
 extern BOOL DumpFatDir(const char* path, int32_t cluster);
 extern char* MountISO(const char* path);
 extern void UnMountISO(void);
 extern BOOL InstallSyslinux(DWORD drive_index, char drive_letter, int fs);
-extern uint16_t GetSyslinuxVersion(char* buf, size_t buf_size, char** ext);
+extern uint16_t GetSyslinuxVersion(const char* buf, size_t buf_size, char* ext, size_t ext_size);
 extern BOOL SetAutorun(const char* path);
 extern char* FileDialog(BOOL save, char* path, const ext_t* ext, DWORD options);
 extern BOOL FileIO(BOOL save, char* path, char** buffer, DWORD* size);
@@ -572,8 +685,11 @@ extern LONG GetEntryWidth(HWND hDropDown, const char* entry);
 extern uint64_t DownloadToFileOrBuffer(const char* url, const char* file, BYTE** buffer, HWND hProgressDialog, BOOL bTaskBarProgress);
 extern DWORD DownloadSignedFile(const char* url, const char* file, HWND hProgressDialog, BOOL PromptOnError);
 extern HANDLE DownloadSignedFileThreaded(const char* url, const char* file, HWND hProgressDialog, BOOL bPromptOnError);
+extern BOOL PrefetchSignedFiles(const char** url, int nb_urls);
 extern INT_PTR CALLBACK UpdateCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam);
+extern INT_PTR CALLBACK ChecksumCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam);
 extern void SetFidoCheck(void);
+extern void PrefetchFidoScript(void);
 extern BOOL SetUpdateCheck(void);
 extern BOOL CheckForUpdates(BOOL force);
 extern void DownloadNewVersion(void);
@@ -585,21 +701,69 @@ extern uint32_t write_file(const char* path, const uint8_t* buf, const uint32_t
 extern char* get_token_data_file_indexed(const char* token, const char* filename, int index);
 #define get_token_data_file(token, filename) get_token_data_file_indexed(token, filename, 1)
 extern char* set_token_data_file(const char* token, const char* data, const char* filename);
+extern char* get_token_data_file_cached(const char* token, const char* filename);
+extern char* set_token_data_file_cached(const char* token, const char* data, const char* filename);
+extern void flush_token_data_file_cache(void);
+extern void destroy_token_data_file_cache(void);
 extern char* get_token_data_buffer(const char* token, unsigned int n, const char* buffer, size_t buffer_size);
 extern char* insert_section_data(const char* filename, const char* section, const char* data, BOOL dos2unix);
 extern char* replace_in_token_data(const char* filename, const char* token, const char* src, const char* rep, BOOL dos2unix);
+typedef struct {
+	wchar_t* wfilename;
+	int mode;
+	BOOL modified;
+	size_t nb_lines;
+	size_t max_lines;
+	wchar_t** line;
+} config_file;
+extern config_file* open_config_file(const char* filename);
+extern char* replace_in_config_data(config_file* cfg, const char* token, const char* src, const char* rep);
+extern BOOL close_config_file(config_file* cfg, BOOL write, BOOL dos2unix, uint8_t* md5);
 extern char* replace_char(const char* src, const char c, const char* rep);
 extern void parse_update(char* buf, size_t len);
+/* A get_data_from_asn1_table() query, with 'oid' being the DER encoded value of the OID */
+typedef struct {
+	const uint8_t* oid;
+	size_t oid_len;
+	uint8_t asn1_type;
+	BOOL matched;
+	const uint8_t* data;
+	size_t data_len;
+} asn1_query;
+extern size_t get_data_from_asn1_table(const uint8_t* buf, size_t buf_len, asn1_query* query, size_t nb_queries);
 extern void* get_data_from_asn1(const uint8_t* buf, size_t buf_len, const char* oid_str, uint8_t asn1_type, size_t* data_len);
+/* An image of a WIM, as reported by GetWimImageInfo() */
+typedef struct {
+	int index;
+	int build;
+	char* name;
+	char* description;
+} wim_image_info;
 extern uint8_t WimExtractCheck(BOOL bSilent);
 extern BOOL WimExtractFile(const char* wim_image, int index, const char* src, const char* dst, BOOL bSilent);
 extern BOOL WimExtractFile_API(const char* image, int index, const char* src, const char* dst, BOOL bSilent);
 extern BOOL WimExtractFile_7z(const char* image, int index, const char* src, const char* dst, BOOL bSilent);
+extern int GetWimImageInfo(const char* image, const char* iso_file, wim_image_info** info);
+extern void FreeWimImageInfo(wim_image_info* info, int nb_images);
 extern BOOL WimApplyImage(const char* image, int index, const char* dst);
+extern BOOL WimSplitImage(const char* image, const char* dst, uint64_t part_size);
 extern char* WimMountImage(const char* image, int index);
 extern BOOL WimUnmountImage(const char* image, int index);
 extern uint8_t IsBootableImage(const char* path);
 extern BOOL AppendVHDFooter(const char* vhd_path);
+extern BOOL CreateDynamicVHD(HANDLE hVHD, uint64_t disk_size);
+extern int AttachVirtualTarget(const char* path, uint64_t disk_size);
+extern void DetachVirtualTarget(void);
+extern BOOL WriteDynamicVHD(const uint8_t* buf, DWORD size, uint64_t offset, uint64_t* skipped_size);
+extern BOOL CloseDynamicVHD(BOOL finalize);
+extern HANDLE StartImageCompressor(const char* image_path, uint8_t compression_type);
+extern BOOL StopImageCompressor(HANDLE hPipe, BOOL abort);
+extern VDISK_MAP* GetVirtualDiskMap(HANDLE handle);
+extern void FreeVirtualDiskMap(VDISK_MAP* map);
+extern BOOL IsFFUImage(HANDLE handle);
+extern FFU_IMAGE* GetFFUImage(HANDLE handle);
+extern void FreeFFUImage(FFU_IMAGE* ffu);
+extern BOOL CheckFFUChunks(const FFU_IMAGE* ffu, uint32_t chunk, const uint8_t* buf, DWORD size);
 extern int SetWinToGoIndex(void);
 extern int IsHDD(DWORD DriveIndex, uint16_t vid, uint16_t pid, const char* strid);
 extern char* GetSignatureName(const char* path, const char* country_code, BOOL bSilent);
@@ -609,9 +773,31 @@ extern BOOL ValidateOpensslSignature(BYTE* pbBuffer, DWORD dwBufferLen, BYTE* pb
 extern BOOL IsFontAvailable(const char* font_name);
 extern BOOL WriteFileWithRetry(HANDLE hFile, LPCVOID lpBuffer, DWORD nNumberOfBytesToWrite,
 	LPDWORD lpNumberOfBytesWritten, DWORD nNumRetries);
-extern BOOL SetThreadAffinity(DWORD_PTR* thread_affinity, size_t num_threads);
+extern int GetComputeCoreCount(void);
+extern BOOL SetThreadClass(HANDLE hThread, int thread_class, int index);
+extern BOOL SetFileIoPriority(HANDLE hFile, BOOL bLow);
+extern BOOL IsBufferZero(const void* buf, size_t len);
 extern BOOL HashFile(const unsigned type, const char* path, uint8_t* sum);
 extern BOOL HashBuffer(const unsigned type, const uint8_t* buf, const size_t len, uint8_t* sum);
+extern BOOL HashBufferGeneric(const unsigned type, const uint8_t* buf, const size_t len, uint8_t* sum);
+extern BOOL IsChecksumAccelerated(const unsigned type);
+extern BOOL HashFileAsync(const unsigned type, const char* path, uint8_t* sum, volatile LONG64* processed);
+extern BOOL HashFileAsyncEx(const unsigned type, const char* path, uint8_t* sum, volatile LONG64* processed,
+	volatile BOOL* abort);
+extern BOOL HashFiles(const unsigned type, const char** path, const uint32_t nb_files, uint8_t* sum, BOOL* hashed, volatile LONG64* processed);
+extern BOOL OpenHashStream(void);
+extern BOOL OpenHashStreamEx(block_manifest* manifest);
+extern BOOL WriteHashStream(const uint8_t* buf, size_t len);
+extern BOOL CloseHashStream(BOOL finalize);
+extern void PrintHashStream(const char* heading);
+extern void SetFileSums(const char* path);
+extern BOOL HasFileSums(const char* path);
+extern void SaveFileSums(const char* path, char sums[CHECKSUM_MAX][150], uint32_t nb_sums);
+extern BOOL LoadFileSums(const char* path, char sums[CHECKSUM_MAX][150]);
+extern BOOL ComputeFileSums(const char* path, char sums[CHECKSUM_MAX][150], volatile BOOL* abort);
+extern void FreeManifest(block_manifest* manifest);
+extern BOOL SaveManifest(block_manifest* manifest, const char* path);
+extern BOOL LoadManifest(block_manifest* manifest, const char* path);
 extern BOOL IsFileInDB(const char* path);
 extern BOOL IsBufferInDB(const unsigned char* buf, const size_t len);
 #define printbits(x) _printbits(sizeof(x), &x, 0)
@@ -623,20 +809,108 @@ extern void SetAlertPromptMessages(void);
 extern BOOL SetAlertPromptHook(void);
 extern void ClrAlertPromptHook(void);
 extern DWORD CheckDriveAccess(DWORD dwTimeOut, BOOL bPrompt);
+extern void WaitForVdsCheck(void);
+extern void WaitForLGP(void);
 extern BYTE SearchProcess(char* HandleName, DWORD dwTimeout, BOOL bPartialMatch, BOOL bIgnoreSelf, BOOL bQuiet);
 extern BOOL EnablePrivileges(void);
 extern void FlashTaskbar(HANDLE handle);
 extern DWORD WaitForSingleObjectWithMessages(HANDLE hHandle, DWORD dwMilliseconds);
+extern void RegisterCancellableIo(HANDLE h);
+extern void UnregisterCancellableIo(HANDLE h);
+extern void CancelOperation(HANDLE hThread);
+extern BOOL CancellableSleep(DWORD dwMilliseconds);
 extern HICON CreateMirroredIcon(HICON hiconOrg);
 extern HANDLE CreatePreallocatedFile(const char* lpFileName, DWORD dwDesiredAccess,
 	DWORD dwShareMode, LPSECURITY_ATTRIBUTES lpSecurityAttributes, DWORD dwCreationDisposition,
 	DWORD dwFlagsAndAttributes, LONGLONG fileSize);
+extern void DetectChecksumAcceleration(void);
 #define GetTextWidth(hDlg, id) GetTextSize(GetDlgItem(hDlg, id), NULL).cx
 
 DWORD WINAPI FormatThread(void* param);
 DWORD WINAPI SaveImageThread(void* param);
+DWORD WINAPI CloneDriveThread(void* param);
 DWORD WINAPI SumThread(void* param);
 
+/* Headless mode parameters, from the command line */
+typedef struct {
+	const char* op;			// "list", "write", "zero", "bench", "checksum", "perf", "history" or "serve"
+	const char* serial;		// Device serial (may be NULL)
+	int disk;				// Disk number (-1 if not specified)
+	uint16_t vid, pid;		// USB VID:PID (0:0 if not specified)
+} headless_params;
+extern int RunHeadless(const headless_params* params);
+extern void GetHeadlessDriveIndexes(const headless_params** params, DWORD* DriveIndex, int nb_params);
+extern BOOL IsImageFileName(const char* name);
+extern void HeadlessProgress(int op, float percent);
+extern BOOL RunPerformanceBenchmark(const char* corpus_dir);
+
+/* Operation timeline */
+extern void TraceStart(const char* job, DWORD DeviceNumber);
+extern void TraceBegin(const char* name);
+extern void TraceEnd(const char* name);
+extern void TraceIo(BOOL bWrite, ULONG64 u64Offset, DWORD dwSize, ULONG64 u64LatencyUs);
+extern void TraceTally(const char* name, uint32_t count, uint64_t duration_us, uint64_t bytes);
+extern BOOL TraceGetProgress(uint64_t* written, uint64_t* read, uint64_t* elapsed_us);
+extern void TraceStop(void);
+
+/* Device history */
+extern void SelectDeviceHistory(DWORD DriveIndex);
+extern void AddDeviceHistory(const char* job, DWORD status, uint64_t bytes, uint64_t duration_us, const char* phases);
+extern uint64_t GetDeviceHistorySpeed(const char* phase);
+extern void PrintDeviceHistoryReport(void);
+
+/* Metrics exporter */
+extern BOOL StartMetricsExporter(void);
+extern void StopMetricsExporter(void);
+extern void AddPhaseMetrics(const char* name, uint32_t count, uint64_t duration_us, uint64_t bytes);
+extern void AddJobMetrics(const char* job, DWORD disk, DWORD status, uint64_t written, uint64_t read, uint64_t duration_us);
+
+/* Shared I/O buffer pool */
+extern void* AllocIoBuffer(size_t size);
+extern void FreeIoBuffer(void* buf);
+extern void FlushIoBufferPool(void);
+#define safe_free_io_buffer(p) do {FreeIoBuffer((void*)p); p = NULL;} while(0)
+
+/* Job engine */
+typedef struct job JOB;
+typedef DWORD (*JOB_STAGE)(JOB* job, void* context);
+extern JOB* CreateJob(const char* name, void* context);
+extern int AddJobStage(JOB* job, const char* name, JOB_STAGE stage, uint32_t depends_on);
+extern void SetJobNotify(JOB* job, HWND hWnd, UINT msg);
+extern BOOL SubmitJob(JOB* job);
+extern void CancelJob(JOB* job);
+extern BOOL IsJobCancelled(JOB* job);
+extern DWORD WaitJob(JOB* job, DWORD timeout);
+extern void FreeJob(JOB* job);
+#define safe_free_job(j) do {FreeJob(j); j = NULL;} while(0)
+
+/* Local job server */
+extern BOOL RunJobServer(void);
+extern void StopJobServer(void);
+
+/* Image library indexer */
+extern SRWLOCK image_scan_lock;
+extern BOOL StartImageLibrary(void);
+extern void StopImageLibrary(void);
+
+/* ETW provider */
+#define ETW_LEVEL_INFO              4
+#define ETW_LEVEL_VERBOSE           5
+#define ETW_KEYWORD_PHASE           0x01
+#define ETW_KEYWORD_IO              0x02
+#define ETW_KEYWORD_LOCK            0x04
+#define ETW_KEYWORD_PROCESS         0x08
+extern UCHAR etw_level;
+extern ULONGLONG etw_keywords;
+#define EtwEnabled(level, keyword)  ((etw_level >= (level)) && ((etw_keywords & (keyword)) != 0))
+extern void EtwRegister(void);
+extern void EtwUnregister(void);
+extern void EtwJob(BOOL bStart, const char* job, DWORD disk, DWORD status);
+extern void EtwPhase(BOOL bStart, const char* name, uint64_t bytes, uint64_t duration_us);
+extern void EtwIo(BOOL bWrite, uint64_t offset, DWORD size, uint64_t latency_us);
+extern void EtwLockWait(const char* path, uint64_t wait_ms, BOOL success);
+extern void EtwProcessScan(const char* device, uint64_t duration_ms, DWORD access_mask);
+
 /* Hash tables */
 typedef struct htab_entry {
 	uint32_t used;
@@ -665,6 +939,7 @@ extern int32_t StrArrayFind(StrArray* arr, const char* str);
 extern void StrArrayClear(StrArray* arr);
 extern void StrArrayDestroy(StrArray* arr);
 #define IsStrArrayEmpty(arr) (arr.Index == 0)
+extern char* FindBytes(const char* buf, size_t buf_size, const void* pattern, size_t len);
 
 /*
  * typedefs for the function prototypes. Use the something like:
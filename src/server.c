@@ -0,0 +1,652 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Local job server
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The '-H serve' headless operation accepts jobs from local clients on SERVER_PIPE_NAME, so
+ * that an orchestrator can keep all the drives of a station busy, without anyone having to
+ * wait for an operation to complete before starting the next one.
+ * A client sends one job per line, followed by an empty line, e.g.:
+ *   write image="D:\Images\debian.iso" serial=4C530001230911112103 verify=1
+ *   zero disk=2
+ * where the target is selected with disk=, serial= and/or vid_pid=, as with -d, -s and -u, and
+ * the other options are verify=1 (-v), hash=1 (-c) and log="path" (-o). Every job is reported as
+ * "job id=<n> status=queued" and then, once it runs, all of its headless output is relayed with
+ * a "job id=<n> " prefix, until "job id=<n> status=<success|failure|cancelled> code=<exit code>".
+ * The connection is closed once the last job of the client has completed.
+ * Since an operation works on the globals of the selected drive and image, each job runs in a
+ * headless instance of our own, and up to SETTING_SERVER_MAX_JOBS of these run at the same time,
+ * one per drive. Since different selections can designate the same drive, the target of a job is
+ * resolved to a drive index before it runs, and the instance is then also given that disk number,
+ * so that it can't end up on another drive. These instances are told apart by RUFUS_JOB being
+ * set in their environment.
+ */
+
+#ifdef _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rufus.h"
+#include "missing.h"
+#include "msapi_utf8.h"
+#include "settings.h"
+
+#define SERVER_PIPE_NAME            "\\\\.\\pipe\\" APPLICATION_NAME
+#define SERVER_MAX_QUEUE            128
+#define SERVER_MAX_LINE             (MAX_PATH + 256)
+#define SERVER_PIPE_SIZE            4096
+
+enum server_job_state {
+	JS_QUEUED = 0,
+	JS_RUNNING,
+};
+
+typedef struct {
+	HANDLE hPipe;
+	CRITICAL_SECTION lock;			// Serializes the writes to the pipe
+	volatile LONG nb_pending;		// Jobs that haven't completed, plus one until the job list is read
+	HANDLE hDone;
+} server_client;
+
+typedef struct {
+	uint32_t id;
+	int state;
+	char op[16];
+	char image[MAX_PATH];
+	char target[128];				// The -d, -s and -u options
+	char serial[65];
+	headless_params sel;			// The same selection, for GetHeadlessDriveIndexes()
+	DWORD DriveIndex;				// 0 until resolved
+	char log[MAX_PATH];
+	BOOL verify, hash;
+	server_client* client;
+	HANDLE hProcess;
+	HANDLE hOutput;					// Read end of the standard output of the instance
+} server_job;
+
+extern BOOL enable_HDDs;
+
+static struct {
+	SRWLOCK lock;
+	HANDLE hStop;
+	HANDLE hWake;					// Signaled when a job is queued or completes
+	volatile BOOL stop;
+	volatile LONG nb_clients;
+	uint32_t next_id;
+	int nb_running, max_running;
+	int nb_jobs;
+	server_job* job[SERVER_MAX_QUEUE];
+} server = { SRWLOCK_INIT };
+
+// I/O on the pipe, which is opened for overlapped I/O, so that we can stop waiting for a client
+static BOOL PipeIo(HANDLE hPipe, BOOL write, void* buf, DWORD size, DWORD* done)
+{
+	BOOL r;
+	OVERLAPPED ov = { 0 };
+
+	ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (ov.hEvent == NULL)
+		return FALSE;
+	r = write ? WriteFile(hPipe, buf, size, NULL, &ov) : ReadFile(hPipe, buf, size, NULL, &ov);
+	if (!r && (GetLastError() == ERROR_IO_PENDING)) {
+		HANDLE hWait[2] = { ov.hEvent, server.hStop };
+		// Writes are always completed, so that a job that is still running can report its result
+		if (write || (WaitForMultipleObjects(2, hWait, FALSE, INFINITE) == WAIT_OBJECT_0)) {
+			r = GetOverlappedResult(hPipe, &ov, done, TRUE);
+		} else {
+			CancelIo(hPipe);
+			GetOverlappedResult(hPipe, &ov, done, TRUE);
+			r = FALSE;
+		}
+	} else if (r) {
+		r = GetOverlappedResult(hPipe, &ov, done, TRUE);
+	}
+	CloseHandle(ov.hEvent);
+	return r && (*done != 0);
+}
+
+static void ClientPrintf(server_client* client, const char* format, ...)
+{
+	char str[SERVER_MAX_LINE + 64];
+	DWORD size;
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(str, sizeof(str) - 1, format, args);
+	va_end(args);
+	str[sizeof(str) - 2] = 0;
+	static_strcat(str, "\n");
+	// If the client went away, the jobs it submitted still run to completion
+	EnterCriticalSection(&client->lock);
+	PipeIo(client->hPipe, TRUE, str, (DWORD)strlen(str), &size);
+	LeaveCriticalSection(&client->lock);
+}
+
+static void ReleaseClient(server_client* client)
+{
+	if (InterlockedDecrement(&client->nb_pending) == 0)
+		SetEvent(client->hDone);
+}
+
+/*
+ * Get the next key=value pair of a job line, where the value may be quoted. Since the values end
+ * up quoted on the command line of an elevated instance, the ones that contain a quote or a control
+ * character, or that end with a backslash (which would escape the closing quote), are rejected.
+ */
+static char* GetJobValue(char** line, char** key)
+{
+	char *s = *line, *value, *c;
+
+	while ((*s == ' ') || (*s == '\t'))
+		s++;
+	if (*s == 0)
+		return NULL;
+	*key = s;
+	while ((*s != 0) && (*s != '=') && (*s != ' ') && (*s != '\t'))
+		s++;
+	if (*s != '=')
+		return NULL;
+	*s++ = 0;
+	if (*s == '"') {
+		value = ++s;
+		while ((*s != 0) && (*s != '"'))
+			s++;
+		if (*s != '"')
+			return NULL;
+	} else {
+		value = s;
+		while ((*s != 0) && (*s != ' ') && (*s != '\t'))
+			s++;
+	}
+	if (*s != 0)
+		*s++ = 0;
+	for (c = value; *c != 0; c++) {
+		if ((*c == '"') || ((uint8_t)*c < 0x20) || (*c == 0x7f))
+			return NULL;
+	}
+	if ((c != value) && (c[-1] == '\\'))
+		return NULL;
+	*line = s;
+	return value;
+}
+
+// Parse a job line. Returns NULL and sets error if the job is invalid.
+static server_job* ParseJob(char* line, const char** error)
+{
+	server_job* job = (server_job*)calloc(1, sizeof(server_job));
+	char *op, *key, *value;
+	unsigned int vid, pid;
+
+	*error = "out of memory";
+	if (job == NULL)
+		return NULL;
+	*error = "invalid syntax";
+	job->sel.disk = -1;
+	while ((*line == ' ') || (*line == '\t'))
+		line++;
+	op = line;
+	while ((*line != 0) && (*line != ' ') && (*line != '\t'))
+		line++;
+	if (*line != 0)
+		*line++ = 0;
+	if ((strcmp(op, "write") != 0) && (strcmp(op, "zero") != 0) && (strcmp(op, "bench") != 0)) {
+		*error = "unsupported operation";
+		goto error;
+	}
+	static_strcpy(job->op, op);
+	while ((value = GetJobValue(&line, &key)) != NULL) {
+		if (strcmp(key, "image") == 0) {
+			if (strlen(value) >= sizeof(job->image))
+				goto error;
+			static_strcpy(job->image, value);
+		} else if (strcmp(key, "disk") == 0) {
+			if (!isdigitU(value[0]))
+				goto error;
+			job->sel.disk = atoi(value);
+			safe_sprintf(&job->target[strlen(job->target)], sizeof(job->target) - strlen(job->target), "-d %d ", atoi(value));
+		} else if (strcmp(key, "serial") == 0) {
+			if ((value[0] == 0) || (strlen(value) >= sizeof(job->serial)))
+				goto error;
+			static_strcpy(job->serial, value);
+			job->sel.serial = job->serial;
+			safe_sprintf(&job->target[strlen(job->target)], sizeof(job->target) - strlen(job->target), "-s \"%s\" ", value);
+		} else if (strcmp(key, "vid_pid") == 0) {
+			if (sscanf(value, "%x:%x", &vid, &pid) != 2)
+				goto error;
+			job->sel.vid = (uint16_t)vid;
+			job->sel.pid = (uint16_t)pid;
+			safe_sprintf(&job->target[strlen(job->target)], sizeof(job->target) - strlen(job->target), "-u %04X:%04X ",
+				vid & 0xffff, pid & 0xffff);
+		} else if (strcmp(key, "verify") == 0) {
+			job->verify = (atoi(value) != 0);
+		} else if (strcmp(key, "hash") == 0) {
+			job->hash = (atoi(value) != 0);
+		} else if (strcmp(key, "log") == 0) {
+			if (strlen(value) >= sizeof(job->log))
+				goto error;
+			static_strcpy(job->log, value);
+		} else {
+			*error = "unknown option";
+			goto error;
+		}
+	}
+	while ((*line == ' ') || (*line == '\t'))
+		line++;
+	if (*line != 0)
+		goto error;
+	// Never let a destructive operation pick a drive on its own
+	if (job->target[0] == 0) {
+		*error = "no target";
+		goto error;
+	}
+	if ((strcmp(op, "write") == 0) && !PathFileExistsU(job->image)) {
+		*error = "image not found";
+		goto error;
+	}
+	return job;
+
+error:
+	free(job);
+	return NULL;
+}
+
+// Start the headless instance of a job. Must be called with the lock held.
+static BOOL StartJob(server_job* job)
+{
+	BOOL r = FALSE;
+	char exe[MAX_PATH], cmd[3 * MAX_PATH + 256], id[16];
+	HANDLE hWrite = NULL;
+	SECURITY_ATTRIBUTES sa = { sizeof(SECURITY_ATTRIBUTES), NULL, TRUE };
+	STARTUPINFOA si = { sizeof(STARTUPINFOA) };
+	PROCESS_INFORMATION pi = { 0 };
+
+	if ((GetModuleFileNameU(NULL, exe, sizeof(exe)) == 0) ||
+		!CreatePipe(&job->hOutput, &hWrite, &sa, SERVER_PIPE_SIZE))
+		goto out;
+	// Only the write end is for the instance
+	SetHandleInformation(job->hOutput, HANDLE_FLAG_INHERIT, 0);
+	// -g, so that the instance doesn't try to take over the console
+	static_sprintf(cmd, "\"%s\" -g -H %s %s%s%s%s", exe, job->op, job->target,
+		job->verify ? "-v " : "", job->hash ? "-c " : "", enable_HDDs ? "-x " : "");
+	// Pin the instance to the drive we serialize on
+	if (job->sel.disk < 0)
+		safe_sprintf(&cmd[strlen(cmd)], sizeof(cmd) - strlen(cmd), "-d %d ", (int)(job->DriveIndex - DRIVE_INDEX_MIN));
+	if (job->image[0] != 0)
+		safe_sprintf(&cmd[strlen(cmd)], sizeof(cmd) - strlen(cmd), "-i \"%s\" ", job->image);
+	if (job->log[0] != 0)
+		safe_sprintf(&cmd[strlen(cmd)], sizeof(cmd) - strlen(cmd), "-o \"%s\" ", job->log);
+	si.dwFlags = STARTF_USESTDHANDLES;
+	si.hStdOutput = hWrite;
+	si.hStdError = hWrite;
+	si.hStdInput = NULL;
+	// We are the only thread that starts processes, so this is what the instance inherits
+	static_sprintf(id, "%d", job->id);
+	SetEnvironmentVariableA("RUFUS_JOB", id);
+	r = CreateProcessU(NULL, cmd, NULL, NULL, TRUE, NORMAL_PRIORITY_CLASS | CREATE_NO_WINDOW,
+		NULL, app_dir, &si, &pi);
+	SetEnvironmentVariableA("RUFUS_JOB", NULL);
+	if (!r) {
+		uprintf("Job %d: Unable to start '%s': %s", job->id, cmd, WindowsErrorString());
+		goto out;
+	}
+	CloseHandle(pi.hThread);
+	job->hProcess = pi.hProcess;
+	uprintf("Job %d: Started '%s'", job->id, cmd);
+
+out:
+	// Close our copy of the write end, so that we get EOF when the instance exits
+	safe_closehandle(hWrite);
+	if (!r)
+		safe_closehandle(job->hOutput);
+	return r;
+}
+
+// Remove a job from the queue. Must be called with the lock held.
+static void RemoveJob(server_job* job)
+{
+	int i;
+
+	for (i = 0; (i < server.nb_jobs) && (server.job[i] != job); i++);
+	if (i >= server.nb_jobs)
+		return;
+	server.nb_jobs--;
+	memmove(&server.job[i], &server.job[i + 1], (server.nb_jobs - i) * sizeof(server_job*));
+}
+
+static void CompleteJob(server_job* job, const char* status, DWORD code)
+{
+	server_client* client = job->client;
+
+	ClientPrintf(client, "job id=%d status=%s code=0x%08X", job->id, status, (unsigned int)code);
+	uprintf("Job %d: %s (0x%08X)", job->id, status, (unsigned int)code);
+	AcquireSRWLockExclusive(&server.lock);
+	if (job->state == JS_RUNNING)
+		server.nb_running--;
+	RemoveJob(job);
+	ReleaseSRWLockExclusive(&server.lock);
+	safe_closehandle(job->hProcess);
+	safe_closehandle(job->hOutput);
+	free(job);
+	SetEvent(server.hWake);
+	ReleaseClient(client);
+}
+
+// Relay the output of a job to its client, until the instance exits
+static DWORD WINAPI JobOutputThread(void* param)
+{
+	server_job* job = (server_job*)param;
+	char buf[SERVER_PIPE_SIZE], line[SERVER_MAX_LINE];
+	size_t len = 0;
+	DWORD i, size, code = 1;
+
+	while (ReadFile(job->hOutput, buf, sizeof(buf), &size, NULL) && (size != 0)) {
+		for (i = 0; i < size; i++) {
+			if ((buf[i] == '\n') || (len >= sizeof(line) - 1)) {
+				line[len] = 0;
+				if ((len != 0) && (line[len - 1] == '\r'))
+					line[--len] = 0;
+				if (len != 0)
+					ClientPrintf(job->client, "job id=%d %s", job->id, line);
+				len = 0;
+				if (buf[i] == '\n')
+					continue;
+			}
+			line[len++] = buf[i];
+		}
+	}
+	WaitForSingleObject(job->hProcess, INFINITE);
+	GetExitCodeProcess(job->hProcess, &code);
+	CompleteJob(job, (code == 0) ? "success" : "failure", code);
+	ExitThread(0);
+}
+
+/*
+ * Resolve the target of the queued jobs that haven't been yet, with a single enumeration.
+ * Jobs that don't designate exactly one drive fail, as they would in the headless instance.
+ * Only this thread removes queued jobs, so they can be accessed without holding the lock.
+ */
+static void ResolveJobTargets(void)
+{
+	int i, nb_unresolved = 0;
+	server_job* unresolved[SERVER_MAX_QUEUE];
+	const headless_params* sel[SERVER_MAX_QUEUE];
+	DWORD DriveIndex[SERVER_MAX_QUEUE];
+
+	AcquireSRWLockShared(&server.lock);
+	for (i = 0; i < server.nb_jobs; i++) {
+		if ((server.job[i]->state == JS_QUEUED) && (server.job[i]->DriveIndex == 0)) {
+			sel[nb_unresolved] = &server.job[i]->sel;
+			unresolved[nb_unresolved++] = server.job[i];
+		}
+	}
+	ReleaseSRWLockShared(&server.lock);
+	if (nb_unresolved == 0)
+		return;
+	GetHeadlessDriveIndexes(sel, DriveIndex, nb_unresolved);
+	for (i = 0; i < nb_unresolved; i++) {
+		unresolved[i]->DriveIndex = DriveIndex[i];
+		if (unresolved[i]->DriveIndex == 0) {
+			uprintf("Job %d: No single device matches '%s'", unresolved[i]->id, unresolved[i]->target);
+			CompleteJob(unresolved[i], "failure", ERROR_DEVICE_NOT_AVAILABLE);
+		}
+	}
+}
+
+// Start the queued jobs, in order, as long as we are under the limit and their drive is free
+static DWORD WINAPI JobSchedulerThread(void* param)
+{
+	int i, j;
+	server_job* job;
+	HANDLE hThread;
+	DWORD err;
+
+	while (!server.stop) {
+		ResolveJobTargets();
+		AcquireSRWLockExclusive(&server.lock);
+		for (i = 0; (i < server.nb_jobs) && (server.nb_running < server.max_running); i++) {
+			job = server.job[i];
+			// Jobs that were queued after we resolved the targets wait for the next pass
+			if ((job->state != JS_QUEUED) || (job->DriveIndex == 0))
+				continue;
+			for (j = 0; (j < server.nb_jobs) && ((server.job[j]->state != JS_RUNNING) ||
+				(server.job[j]->DriveIndex != job->DriveIndex)); j++);
+			if (j < server.nb_jobs)
+				continue;
+			if (StartJob(job)) {
+				hThread = CreateThread(NULL, 0, JobOutputThread, job, 0, NULL);
+				if (hThread != NULL) {
+					job->state = JS_RUNNING;
+					server.nb_running++;
+					CloseHandle(hThread);
+					continue;
+				}
+				err = GetLastError();
+				// The instance can't be left running without anyone to wait for it
+				TerminateProcess(job->hProcess, ERROR_CANCELLED);
+			} else {
+				err = GetLastError();
+			}
+			ReleaseSRWLockExclusive(&server.lock);
+			CompleteJob(job, "failure", err);
+			AcquireSRWLockExclusive(&server.lock);
+			// The queue has changed
+			i = -1;
+		}
+		ReleaseSRWLockExclusive(&server.lock);
+		WaitForSingleObject(server.hWake, INFINITE);
+	}
+
+	// Drop the jobs that haven't started, and let the running ones complete
+	while (TRUE) {
+		AcquireSRWLockExclusive(&server.lock);
+		for (i = 0; (i < server.nb_jobs) && (server.job[i]->state != JS_QUEUED); i++);
+		job = (i < server.nb_jobs) ? server.job[i] : NULL;
+		j = server.nb_running;
+		ReleaseSRWLockExclusive(&server.lock);
+		if (job != NULL)
+			CompleteJob(job, "cancelled", ERROR_CANCELLED);
+		else if (j == 0)
+			break;
+		else
+			WaitForSingleObject(server.hWake, INFINITE);
+	}
+	ExitThread(0);
+}
+
+// Read the jobs of a client, then wait for them to complete
+static DWORD WINAPI ClientThread(void* param)
+{
+	server_client* client = (server_client*)param;
+	server_job* job;
+	const char* error;
+	char buf[SERVER_PIPE_SIZE], line[SERVER_MAX_LINE];
+	size_t len = 0;
+	DWORD i, size;
+	BOOL done = FALSE, overflow = FALSE;
+
+	while (!done && PipeIo(client->hPipe, FALSE, buf, sizeof(buf), &size)) {
+		for (i = 0; (i < size) && !done; i++) {
+			if (buf[i] == '\r')
+				continue;
+			if (buf[i] != '\n') {
+				// Drop the rest of a line that is too long, rather than run a truncated job
+				if (len < sizeof(line) - 1)
+					line[len++] = buf[i];
+				else
+					overflow = TRUE;
+				continue;
+			}
+			line[len] = 0;
+			// An empty line ends the list of jobs
+			if (len == 0) {
+				done = TRUE;
+				break;
+			}
+			len = 0;
+			if (overflow) {
+				overflow = FALSE;
+				ClientPrintf(client, "job status=rejected error=\"line too long\"");
+				continue;
+			}
+			job = ParseJob(line, &error);
+			if (job == NULL) {
+				ClientPrintf(client, "job status=rejected error=\"%s\"", error);
+				continue;
+			}
+			job->client = client;
+			AcquireSRWLockExclusive(&server.lock);
+			if (server.stop || (server.nb_jobs >= SERVER_MAX_QUEUE)) {
+				ReleaseSRWLockExclusive(&server.lock);
+				ClientPrintf(client, "job status=rejected error=\"%s\"", server.stop ? "server is stopping" : "queue is full");
+				free(job);
+				continue;
+			}
+			job->id = ++server.next_id;
+			server.job[server.nb_jobs++] = job;
+			InterlockedIncrement(&client->nb_pending);
+			ReleaseSRWLockExclusive(&server.lock);
+			ClientPrintf(client, "job id=%d status=queued", job->id);
+			SetEvent(server.hWake);
+		}
+	}
+	ReleaseClient(client);
+	WaitForSingleObject(client->hDone, INFINITE);
+	FlushFileBuffers(client->hPipe);
+	DisconnectNamedPipe(client->hPipe);
+	CloseHandle(client->hPipe);
+	CloseHandle(client->hDone);
+	DeleteCriticalSection(&client->lock);
+	free(client);
+	InterlockedDecrement(&server.nb_clients);
+	ExitThread(0);
+}
+
+/*
+ * Stop accepting clients, drop the jobs that haven't started and wait for the running ones.
+ */
+void StopJobServer(void)
+{
+	if (server.hStop == NULL)
+		return;
+	server.stop = TRUE;
+	SetEvent(server.hStop);
+	SetEvent(server.hWake);
+}
+
+/*
+ * Run the job server until it is stopped with Ctrl-C. Returns FALSE on error.
+ */
+BOOL RunJobServer(void)
+{
+	BOOL r = FALSE;
+	SYSTEM_INFO si;
+	HANDLE hPipe = INVALID_HANDLE_VALUE, hScheduler = NULL, hThread, hWait[2];
+	OVERLAPPED ov = { 0 };
+	server_client* client;
+	DWORD size;
+
+	GetSystemInfo(&si);
+	// Each job decompresses, hashes and verifies on threads of its own
+	server.max_running = ReadSetting32(SETTING_SERVER_MAX_JOBS);
+	if (server.max_running <= 0)
+		server.max_running = max(si.dwNumberOfProcessors / 2, 1);
+	server.max_running = min(server.max_running, MAX_DRIVES);
+	server.hStop = CreateEvent(NULL, TRUE, FALSE, NULL);
+	server.hWake = CreateEvent(NULL, FALSE, FALSE, NULL);
+	ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if ((server.hStop == NULL) || (server.hWake == NULL) || (ov.hEvent == NULL))
+		goto out;
+	hScheduler = CreateThread(NULL, 0, JobSchedulerThread, NULL, 0, NULL);
+	if (hScheduler == NULL) {
+		uprintf("Unable to start job scheduler thread");
+		goto out;
+	}
+	uprintf("Job server: Listening on '%s', running up to %d job(s) at once", SERVER_PIPE_NAME, server.max_running);
+	printf("server pipe=\"%s\" max_jobs=%d\n", SERVER_PIPE_NAME, server.max_running);
+	fflush(stdout);
+	hWait[0] = server.hStop;
+	hWait[1] = ov.hEvent;
+
+	while (!server.stop) {
+		// The default security of a pipe only lets administrators and the creator write to it
+		hPipe = CreateNamedPipeA(SERVER_PIPE_NAME, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+			PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+			PIPE_UNLIMITED_INSTANCES, SERVER_PIPE_SIZE, SERVER_PIPE_SIZE, 0, NULL);
+		if (hPipe == INVALID_HANDLE_VALUE) {
+			uprintf("Job server: Could not create pipe: %s", WindowsErrorString());
+			break;
+		}
+		ResetEvent(ov.hEvent);
+		if (!ConnectNamedPipe(hPipe, &ov)) {
+			if (GetLastError() == ERROR_IO_PENDING) {
+				if (WaitForMultipleObjects(2, hWait, FALSE, INFINITE) != WAIT_OBJECT_0 + 1) {
+					CancelIo(hPipe);
+					break;
+				}
+				if (!GetOverlappedResult(hPipe, &ov, &size, FALSE)) {
+					safe_closehandle(hPipe);
+					continue;
+				}
+			} else if (GetLastError() != ERROR_PIPE_CONNECTED) {
+				safe_closehandle(hPipe);
+				continue;
+			}
+		}
+		client = (server_client*)calloc(1, sizeof(server_client));
+		if (client != NULL) {
+			client->hPipe = hPipe;
+			client->nb_pending = 1;
+			client->hDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+			InitializeCriticalSection(&client->lock);
+			InterlockedIncrement(&server.nb_clients);
+			hThread = (client->hDone == NULL) ? NULL : CreateThread(NULL, 0, ClientThread, client, 0, NULL);
+			if (hThread != NULL) {
+				CloseHandle(hThread);
+				hPipe = INVALID_HANDLE_VALUE;
+				continue;
+			}
+			InterlockedDecrement(&server.nb_clients);
+			safe_closehandle(client->hDone);
+			DeleteCriticalSection(&client->lock);
+			free(client);
+		}
+		safe_closehandle(hPipe);
+	}
+	r = server.stop;
+
+out:
+	if (hPipe != INVALID_HANDLE_VALUE)
+		CloseHandle(hPipe);
+	if (hScheduler != NULL) {
+		StopJobServer();
+		uprintf("Job server: Waiting for the running jobs to complete...");
+		WaitForSingleObject(hScheduler, INFINITE);
+		CloseHandle(hScheduler);
+	}
+	// The clients go away once they have been told about the completion of their last job
+	for (size = 0; (server.nb_clients > 0) && (size < 50); size++)
+		Sleep(100);
+	safe_closehandle(ov.hEvent);
+	return r;
+}
@@ -30,33 +30,65 @@ extern char* ini_file;
 #define SETTING_ADVANCED_MODE               "AdvancedMode"
 #define SETTING_ADVANCED_MODE_DEVICE        "ShowAdvancedDriveProperties"
 #define SETTING_ADVANCED_MODE_FORMAT        "ShowAdvancedFormatOptions"
+#define SETTING_BADBLOCKS_IMAGE_PASS        "BadBlocksImagePass"
+#define SETTING_CHECKSUM_BUFFER_SIZE        "ChecksumBufferSize"
 #define SETTING_COMM_CHECK                  "CommCheck64"
 #define SETTING_DEFAULT_THREAD_PRIORITY     "DefaultThreadPriority"
+#define SETTING_DISABLE_COMPACT_APPLY       "DisableCompactApply"
 #define SETTING_DISABLE_FAKE_DRIVES_CHECK   "DisableFakeDrivesCheck"
 #define SETTING_DISABLE_LGP                 "DisableLGP"
 #define SETTING_DISABLE_SECURE_BOOT_NOTICE  "DisableSecureBootNotice"
 #define SETTING_DISABLE_VHDS                "DisableVHDs"
+#define SETTING_DOWNLOAD_CONNECTIONS        "DownloadConnections"
+#define SETTING_ENABLE_BLOCK_MANIFEST       "EnableBlockManifest"
+#define SETTING_ENABLE_DELTA_WRITE          "EnableDeltaWrite"
+#define SETTING_ENABLE_DYNAMIC_VHD          "EnableDynamicVHD"
 #define SETTING_ENABLE_EXTRA_HASHES         "EnableExtraHashes"
+#define SETTING_ENABLE_EXT_TEMPLATE         "EnableExtTemplate"
+#define SETTING_ENABLE_FAST_REPARTITION     "EnableFastRepartition"
 #define SETTING_ENABLE_FILE_INDEXING        "EnableFileIndexing"
+#define SETTING_ENABLE_IMAGE_CACHE          "EnableImageCache"
+#define SETTING_ENABLE_IO_HEATMAP           "EnableIoHeatmap"
+#define SETTING_ENABLE_RESCUE_CAPTURE       "EnableRescueCapture"
+#define SETTING_ENABLE_SPARSE_WRITE         "EnableSparseWrite"
+#define SETTING_ENABLE_TIMELINE_EXPORT      "EnableTimelineExport"
 #define SETTING_ENABLE_USB_DEBUG            "EnableUsbDebug"
 #define SETTING_ENABLE_VMDK_DETECTION       "EnableVmdkDetection"
+#define SETTING_ENABLE_WRITE_CACHE          "EnableWriteCache"
 #define SETTING_ENABLE_WIN_DUAL_EFI_BIOS    "EnableWindowsDualUefiBiosMode"
+#define SETTING_ENABLE_WRITE_HASHES         "EnableWriteHashes"
+#define SETTING_EXTRACT_BUFFER_SIZE         "ExtractBufferSize"
+#define SETTING_EXTRACT_SMALL_FILE_SIZE     "ExtractSmallFileSize"
+#define SETTING_EXT_FLEX_BG_SIZE            "ExtFlexBgSize"
+#define SETTING_FILES_CACHE_DIR             "FilesCacheDirectory"
+#define SETTING_FILES_MIRROR_URL            "FilesMirrorUrl"
 #define SETTING_FORCE_LARGE_FAT32_FORMAT    "ForceLargeFat32Formatting"
+#define SETTING_HEALTH_MAX_WRITE_LATENCY    "HealthMaxWriteLatency"
+#define SETTING_HEALTH_MIN_WRITE_SPEED      "HealthMinWriteSpeed"
 #define SETTING_IGNORE_BOOT_MARKER          "IgnoreBootMarker"
+#define SETTING_IMAGE_LIBRARY_DIR           "ImageLibraryDir"
+#define SETTING_IMAGE_CACHE_RAM_SIZE        "ImageCacheRamSize"
 #define SETTING_INCLUDE_BETAS               "CheckForBetas"
 #define SETTING_LAST_UPDATE                 "LastUpdateCheck"
 #define SETTING_LOCALE                      "Locale"
+#define SETTING_METRICS_FILE                "MetricsFile"
+#define SETTING_SERVER_MAX_JOBS             "ServerMaxJobs"
 #define SETTING_UPDATE_INTERVAL             "UpdateCheckInterval"
 #define SETTING_USE_EXT_VERSION             "UseExtVersion"
+#define SETTING_USE_PERSISTENCE_FILE        "UsePersistenceFile"
 #define SETTING_USE_PROPER_SIZE_UNITS       "UseProperSizeUnits"
 #define SETTING_USE_UDF_VERSION             "UseUdfVersion"
 #define SETTING_USE_VDS                     "UseVds"
+#define SETTING_TUNED_DRIVE_IO              "TunedDriveIO"	// Prefix, followed by the drive model hash
 #define SETTING_PRESERVE_TIMESTAMPS         "PreserveTimestamps"
 #define SETTING_VERBOSE_UPDATES             "VerboseUpdateCheck"
+#define SETTING_VERIFY_SAMPLE_INTERVAL      "VerifySampleInterval"
+#define SETTING_VERIFY_WRITES               "VerifyWrites"
+#define SETTING_WRITE_QUEUE_DEPTH           "WriteQueueDepth"
 
 
 static __inline BOOL CheckIniKey(const char* key) {
-	char* str = get_token_data_file(key, ini_file);
+	char* str = get_token_data_file_cached(key, ini_file);
 	BOOL ret = (str != NULL);
 	safe_free(str);
 	return ret;
@@ -68,7 +100,7 @@ static __inline BOOL CheckIniKey(const char* key) {
 
 static __inline int64_t ReadIniKey64(const char* key) {
 	int64_t val = 0;
-	char* str = get_token_data_file(key, ini_file);
+	char* str = get_token_data_file_cached(key, ini_file);
 	if (str != NULL) {
 		val = _strtoi64(str, NULL, 0);
 		free(str);
@@ -78,12 +110,12 @@ static __inline int64_t ReadIniKey64(const char* key) {
 static __inline BOOL WriteIniKey64(const char* key, int64_t val) {
 	char str[24];
 	static_sprintf(str, "%" PRIi64, val);
-	return (set_token_data_file(key, str, ini_file) != NULL);
+	return (set_token_data_file_cached(key, str, ini_file) != NULL);
 }
 
 static __inline int32_t ReadIniKey32(const char* key) {
 	int32_t val = 0;
-	char* str = get_token_data_file(key, ini_file);
+	char* str = get_token_data_file_cached(key, ini_file);
 	if (str != NULL) {
 		val = strtol(str, NULL, 0);
 		free(str);
@@ -93,14 +125,14 @@ static __inline int32_t ReadIniKey32(const char* key) {
 static __inline BOOL WriteIniKey32(const char* key, int32_t val) {
 	char str[12];
 	static_sprintf(str, "%d", val);
-	return (set_token_data_file(key, str, ini_file) != NULL);
+	return (set_token_data_file_cached(key, str, ini_file) != NULL);
 }
 
 static __inline char* ReadIniKeyStr(const char* key) {
 	static char str[512];
 	char* val;
 	str[0] = 0;
-	val = get_token_data_file(key, ini_file);
+	val = get_token_data_file_cached(key, ini_file);
 	if (val != NULL) {
 		static_strcpy(str, val);
 		free(val);
@@ -109,7 +141,7 @@ static __inline char* ReadIniKeyStr(const char* key) {
 }
 
 static __inline BOOL WriteIniKeyStr(const char* key, const char* val) {
-	return (set_token_data_file(key, val, ini_file) != NULL);
+	return (set_token_data_file_cached(key, val, ini_file) != NULL);
 }
 
 /* Helpers for boolean operations */
@@ -30,6 +30,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <stddef.h>
+#include <stdlib.h>
 
 #include "rufus.h"
 #include "missing.h"
@@ -395,6 +396,102 @@ BOOL SmartGetVersion(HANDLE hdevice)
 }
 #endif
 
+/*
+ * Sorted views of the VID and VID:PID score tables, so that we can binary search them.
+ * The tables themselves are not strictly ordered (exceptions are grouped separately),
+ * so the views are built on first use, keeping only the first entry for duplicates,
+ * which is the one a linear search would match.
+ * The string identifiers are likewise indexed by their (uppercase) first character, as
+ * they are matched against the start of the device name, in the order of the table.
+ * Since IsHDD() is called from the device probe threads, the views and the index are
+ * built through a one-time initialization, that the other callers wait on.
+ */
+static INIT_ONCE score_tables_once = INIT_ONCE_STATIC_INIT;
+static const vid_score_t* vid_sorted[ARRAYSIZE(vid_score)];
+static const vidpid_score_t* vidpid_sorted[ARRAYSIZE(vidpid_score)];
+static size_t nb_vid_sorted = 0, nb_vidpid_sorted = 0;
+static uint8_t str_index[ARRAYSIZE(str_score)], str_index_start[257];
+
+static int vid_score_cmp(const void* a, const void* b)
+{
+	const vid_score_t *x = *(const vid_score_t**)a, *y = *(const vid_score_t**)b;
+	if (x->vid != y->vid)
+		return (x->vid < y->vid) ? -1 : 1;
+	return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+static int vidpid_score_cmp(const void* a, const void* b)
+{
+	const vidpid_score_t *x = *(const vidpid_score_t**)a, *y = *(const vidpid_score_t**)b;
+	uint32_t kx = ((uint32_t)x->vid << 16) | x->pid, ky = ((uint32_t)y->vid << 16) | y->pid;
+	if (kx != ky)
+		return (kx < ky) ? -1 : 1;
+	return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+static BOOL CALLBACK InitScoreTables(PINIT_ONCE InitOnce, PVOID Parameter, PVOID* Context)
+{
+	size_t i, j, k;
+
+	for (i = 0, j = 0; i < 256; i++) {
+		str_index_start[i] = (uint8_t)j;
+		for (k = 0; k < ARRAYSIZE(str_score); k++)
+			if ((size_t)toupper((uint8_t)str_score[k].name[0]) == i)
+				str_index[j++] = (uint8_t)k;
+	}
+	str_index_start[256] = (uint8_t)j;
+
+	for (i = 0; i < ARRAYSIZE(vid_score); i++)
+		vid_sorted[i] = &vid_score[i];
+	qsort(vid_sorted, ARRAYSIZE(vid_sorted), sizeof(vid_sorted[0]), vid_score_cmp);
+	for (i = 0; i < ARRAYSIZE(vid_sorted); i++)
+		if ((nb_vid_sorted == 0) || (vid_sorted[nb_vid_sorted - 1]->vid != vid_sorted[i]->vid))
+			vid_sorted[nb_vid_sorted++] = vid_sorted[i];
+
+	for (i = 0; i < ARRAYSIZE(vidpid_score); i++)
+		vidpid_sorted[i] = &vidpid_score[i];
+	qsort(vidpid_sorted, ARRAYSIZE(vidpid_sorted), sizeof(vidpid_sorted[0]), vidpid_score_cmp);
+	for (i = 0; i < ARRAYSIZE(vidpid_sorted); i++)
+		if ((nb_vidpid_sorted == 0) || (vidpid_sorted[nb_vidpid_sorted - 1]->vid != vidpid_sorted[i]->vid) ||
+			(vidpid_sorted[nb_vidpid_sorted - 1]->pid != vidpid_sorted[i]->pid))
+			vidpid_sorted[nb_vidpid_sorted++] = vidpid_sorted[i];
+	return TRUE;
+}
+
+static const vid_score_t* FindVidScore(uint16_t vid)
+{
+	size_t lo = 0, hi = nb_vid_sorted, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (vid_sorted[mid]->vid == vid)
+			return vid_sorted[mid];
+		if (vid_sorted[mid]->vid < vid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+static const vidpid_score_t* FindVidPidScore(uint16_t vid, uint16_t pid)
+{
+	size_t lo = 0, hi = nb_vidpid_sorted, mid;
+	uint32_t key = ((uint32_t)vid << 16) | pid, cur;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		cur = ((uint32_t)vidpid_sorted[mid]->vid << 16) | vidpid_sorted[mid]->pid;
+		if (cur == key)
+			return vidpid_sorted[mid];
+		if (cur < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
 /*
  * This attempts to detect whether a drive is an USB HDD or an USB Flash Drive (UFD).
  * A positive score means that we think it's an USB HDD, zero or negative means that
@@ -441,9 +538,14 @@ BOOL SmartGetVersion(HANDLE hdevice)
 int IsHDD(DWORD DriveIndex, uint16_t vid, uint16_t pid, const char* strid)
 {
 	int score = 0;
-	size_t i, mlen, ilen;
+	size_t i, j, mlen, ilen;
+	uint8_t c;
 	BOOL wc;
 	uint64_t drive_size;
+	const vid_score_t* vs;
+	const vidpid_score_t* vps;
+
+	InitOnceExecuteOnce(&score_tables_once, InitScoreTables, NULL, NULL);
 
 	// Boost the score if fixed, as these are *generally* HDDs
 	if (GetDriveTypeFromIndex(DriveIndex) == DRIVE_FIXED)
@@ -459,10 +561,12 @@ int IsHDD(DWORD DriveIndex, uint16_t vid, uint16_t pid, const char* strid)
 	// Check the string against well known HDD identifiers
 	if (strid != NULL) {
 		ilen = strlen(strid);
-		for (i=0; i<ARRAYSIZE(str_score); i++) {
+		c = (uint8_t)toupper((uint8_t)strid[0]);
+		for (j = str_index_start[c]; j < str_index_start[c + 1]; j++) {
+			i = str_index[j];
 			mlen = strlen(str_score[i].name);
 			if (mlen > ilen)
-				break;
+				continue;
 			wc = (str_score[i].name[mlen-1] == '#');
 			if ( (_strnicmp(strid, str_score[i].name, mlen-((wc)?1:0)) == 0)
 			  && ((!wc) || ((strid[mlen] >= '0') && (strid[mlen] <= '9'))) ) {
@@ -480,20 +584,14 @@ int IsHDD(DWORD DriveIndex, uint16_t vid, uint16_t pid, const char* strid)
 	}
 
 	// Check against known VIDs
-	for (i=0; i<ARRAYSIZE(vid_score); i++) {
-		if (vid == vid_score[i].vid) {
-			score += vid_score[i].score;
-			break;
-		}
-	}
+	vs = FindVidScore(vid);
+	if (vs != NULL)
+		score += vs->score;
 
 	// Check against known VID:PIDs
-	for (i=0; i<ARRAYSIZE(vidpid_score); i++) {
-		if ((vid == vidpid_score[i].vid) && (pid == vidpid_score[i].pid)) {
-			score += vidpid_score[i].score;
-			break;
-		}
-	}
+	vps = FindVidPidScore(vid, pid);
+	if (vps != NULL)
+		score += vps->score;
 
 	duprintf("  Score: %d\n", score);
 	return score;
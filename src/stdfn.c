@@ -25,6 +25,13 @@
 #include <sddl.h>
 #include <gpedit.h>
 #include <assert.h>
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#include <emmintrin.h>
+#elif defined(_M_ARM64) && defined(_MSC_VER)
+#include <arm64_neon.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #include "rufus.h"
 #include "missing.h"
@@ -487,7 +494,8 @@ int32_t StrArrayAdd(StrArray* arr, const char* str, BOOL duplicate)
 	if ((arr == NULL) || (arr->String == NULL) || (str == NULL))
 		return -1;
 	if (arr->Index == arr->Max) {
-		arr->Max *= 2;
+		// Don't get stuck on a zero-sized array
+		arr->Max = (arr->Max == 0) ? 8 : 2 * arr->Max;
 		old_table = arr->String;
 		arr->String = (char**)realloc(arr->String, arr->Max*sizeof(char*));
 		if (arr->String == NULL) {
@@ -534,6 +542,28 @@ void StrArrayDestroy(StrArray* arr)
 		safe_free(arr->String);
 }
 
+/*
+ * Find the first occurrence of a byte pattern in a buffer, or return NULL. This is what we
+ * use to look for version strings in bootloader binaries, which can be a few MB: candidates
+ * are located with memchr(), which the CRT vectorizes, so that only the bytes that match the
+ * first byte of the pattern go through a comparison, and we never read past the end of buf.
+ */
+char* FindBytes(const char* buf, size_t buf_size, const void* pattern, size_t len)
+{
+	const char *p = buf, *end;
+	const char first = *(const char*)pattern;
+
+	if ((buf == NULL) || (len == 0) || (buf_size < len))
+		return NULL;
+	end = &buf[buf_size - len];
+	while ((p <= end) && ((p = memchr(p, first, end - p + 1)) != NULL)) {
+		if (memcmp(&p[1], &((const char*)pattern)[1], len - 1) == 0)
+			return (char*)p;
+		p++;
+	}
+	return NULL;
+}
+
 /*
  * Retrieve the SID of the current user. The returned PSID must be freed by the caller using LocalFree()
  */
@@ -655,7 +685,10 @@ out:
 }
 
 /*
- * Get a resource from the RC. If needed that resource can be duplicated.
+ * Get a resource from the RC. Unless duplicate is set, this is a read-only view into
+ * the mapped module, that must not be freed, and that should be preferred by callers
+ * that only read the resource or write it out as is.
+ * If needed (e.g. for patching) that resource can be duplicated.
  * If duplicate is true and len is non-zero, the a zeroed buffer of 'len'
  * size is allocated for the resource. Else the buffer is allocate for
  * the resource size.
@@ -944,37 +977,181 @@ BOOL SetLGP(BOOL bRestore, BOOL* bExistingKey, const char* szPath, const char* s
 }
 
 /*
- * This call tries to evenly balance the affinities for an array of
- * num_threads, according to the number of cores at our disposal...
+ * Thread placement, according to the CPU topology.
+ * Compute heavy threads (hashing, decompression, extraction) each get a physical core of
+ * their own, from the most performant ones first (i.e. the P-cores of hybrid CPUs) and from
+ * the NUMA node we run on, so that they only end up sharing a core with an SMT sibling once
+ * all the physical cores are in use. The first core is handed out last, as this is the one
+ * the system tends to service interrupts on. Threads that mostly wait on I/O go the other
+ * way round: to the E-cores of hybrid CPUs, and to that first core otherwise.
+ * Background threads, that nobody waits on, are placed as I/O threads, but also get a lower
+ * priority and EcoQoS (Windows 10 1709 or later), and their own I/O, if they set their class
+ * themselves, goes at background priority, so that they don't slow down an active write.
  */
-BOOL SetThreadAffinity(DWORD_PTR* thread_affinity, size_t num_threads)
+#define MAX_CPU_CORES               256
+#define THREAD_POWER_THROTTLING     3		// ThreadPowerThrottling
+#define THREAD_POWER_THROTTLING_EXECUTION_SPEED 0x1
+
+typedef struct {
+	ULONG Version;
+	ULONG ControlMask;
+	ULONG StateMask;
+} power_throttling_state;
+
+typedef struct {
+	GROUP_AFFINITY affinity;
+	int index;
+	BYTE efficiency;
+	BOOL local;					// On the same NUMA node as the process
+} cpu_core;
+
+static struct {
+	SRWLOCK lock;
+	BOOL initialized;
+	int nb_cores;
+	int nb_fast_cores;			// Cores with the highest efficiency class
+	cpu_core core[MAX_CPU_CORES];	// In the order compute threads should get them
+} cpu_topology = { SRWLOCK_INIT };
+
+static int CpuCoreCmp(const void* a, const void* b)
 {
-	size_t i, j, pc;
-	DWORD_PTR affinity, dummy;
+	const cpu_core *ca = (const cpu_core*)a, *cb = (const cpu_core*)b;
+
+	if (ca->efficiency != cb->efficiency)
+		return (ca->efficiency > cb->efficiency) ? -1 : 1;
+	if (ca->local != cb->local)
+		return ca->local ? -1 : 1;
+	if ((ca->index == 0) != (cb->index == 0))
+		return (ca->index == 0) ? 1 : -1;
+	return ca->index - cb->index;
+}
 
-	memset(thread_affinity, 0, num_threads * sizeof(DWORD_PTR));
-	if (!GetProcessAffinityMask(GetCurrentProcess(), &affinity, &dummy))
-		return FALSE;
-	uuprintf("\r\nThread affinities:");
-	uuprintf("  avail:\t%s", printbitslz(affinity));
+// Must be called with the lock held
+static void InitCpuTopology(void)
+{
+	SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX *info = NULL, *p;
+	PROCESSOR_NUMBER pn;
+	GROUP_AFFINITY numa = { 0 };
+	DWORD_PTR process_affinity, system_affinity;
+	DWORD size = 0, pos;
+	USHORT node;
+	WORD group;
+	int i;
+
+	cpu_topology.initialized = TRUE;
+	if (!GetProcessAffinityMask(GetCurrentProcess(), &process_affinity, &system_affinity))
+		process_affinity = ~(DWORD_PTR)0;
+	// The process affinity mask only applies to the group we run on
+	GetCurrentProcessorNumberEx(&pn);
+	group = pn.Group;
+	if (GetNumaProcessorNodeEx(&pn, &node))
+		GetNumaNodeProcessorMaskEx(node, &numa);
+
+	if (GetLogicalProcessorInformationEx(RelationProcessorCore, NULL, &size) ||
+		(GetLastError() != ERROR_INSUFFICIENT_BUFFER))
+		goto out;
+	info = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)malloc(size);
+	if ((info == NULL) || !GetLogicalProcessorInformationEx(RelationProcessorCore, info, &size))
+		goto out;
+	for (pos = 0; (pos < size) && (cpu_topology.nb_cores < MAX_CPU_CORES); pos += p->Size) {
+		cpu_core* c = &cpu_topology.core[cpu_topology.nb_cores];
+		p = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)&((uint8_t*)info)[pos];
+		c->affinity = p->Processor.GroupMask[0];
+		if (c->affinity.Group == group)
+			c->affinity.Mask &= process_affinity;
+		if (c->affinity.Mask == 0)
+			continue;
+		c->index = cpu_topology.nb_cores++;
+		// The efficiency class is 0 on CPUs that aren't hybrid (or OSes that predate them)
+		c->efficiency = p->Processor.EfficiencyClass;
+		c->local = (c->affinity.Group == numa.Group) && ((c->affinity.Mask & numa.Mask) != 0);
+	}
+	qsort(cpu_topology.core, cpu_topology.nb_cores, sizeof(cpu_core), CpuCoreCmp);
+	for (i = 0; (i < cpu_topology.nb_cores) &&
+		(cpu_topology.core[i].efficiency == cpu_topology.core[0].efficiency); i++);
+	cpu_topology.nb_fast_cores = i;
+	uuprintf("CPU topology: %d core(s), %d of which in the highest efficiency class",
+		cpu_topology.nb_cores, cpu_topology.nb_fast_cores);
 
-	// If we don't have enough virtual cores to evenly spread our load forget it
-	pc = popcnt64(affinity);
-	if (pc < num_threads)
-		return FALSE;
+out:
+	free(info);
+}
+
+/*
+ * Return the number of physical cores compute threads can each have to themselves.
+ * This is never less than 1, even if the topology could not be retrieved.
+ */
+int GetComputeCoreCount(void)
+{
+	int r;
+
+	AcquireSRWLockExclusive(&cpu_topology.lock);
+	if (!cpu_topology.initialized)
+		InitCpuTopology();
+	r = max(cpu_topology.nb_fast_cores, 1);
+	ReleaseSRWLockExclusive(&cpu_topology.lock);
+	return r;
+}
 
-	// Spread the affinity as evenly as we can
-	thread_affinity[num_threads - 1] = affinity;
-	for (i = 0; i < num_threads - 1; i++) {
-		for (j = 0; j < pc / num_threads; j++) {
-			thread_affinity[i] |= affinity & (-1LL * affinity);
-			affinity ^= affinity & (-1LL * affinity);
+/*
+ * Place a thread according to the work it does (see above). For compute threads,
+ * index is the rank of the thread in its pool, so that workers that run in parallel
+ * get different cores. Threads are left alone if the topology is unknown.
+ */
+BOOL SetThreadClass(HANDLE hThread, int thread_class, int index)
+{
+	BOOL r = FALSE;
+	GROUP_AFFINITY affinity;
+	power_throttling_state throttling = { 1, THREAD_POWER_THROTTLING_EXECUTION_SPEED, THREAD_POWER_THROTTLING_EXECUTION_SPEED };
+	int i;
+	PF_TYPE_DECL(WINAPI, BOOL, SetThreadInformation, (HANDLE, int, LPVOID, DWORD));
+
+	if (thread_class == THREAD_CLASS_BACKGROUND) {
+		PF_INIT(SetThreadInformation, Kernel32);
+		SetThreadPriority(hThread, THREAD_PRIORITY_BELOW_NORMAL);
+		if (pfSetThreadInformation != NULL)
+			pfSetThreadInformation(hThread, THREAD_POWER_THROTTLING, &throttling, sizeof(throttling));
+		// Background processing mode can only be entered by the thread itself
+		if (GetThreadId(hThread) == GetCurrentThreadId())
+			SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+	}
+
+	AcquireSRWLockExclusive(&cpu_topology.lock);
+	if (!cpu_topology.initialized)
+		InitCpuTopology();
+	if (cpu_topology.nb_cores == 0)
+		goto out;
+	if (thread_class == THREAD_CLASS_COMPUTE) {
+		affinity = cpu_topology.core[index % cpu_topology.nb_cores].affinity;
+	} else if (cpu_topology.nb_fast_cores < cpu_topology.nb_cores) {
+		// Any of the less performant cores that are in the same group as the last one
+		affinity = cpu_topology.core[cpu_topology.nb_cores - 1].affinity;
+		for (i = cpu_topology.nb_fast_cores; i < cpu_topology.nb_cores; i++) {
+			if (cpu_topology.core[i].affinity.Group == affinity.Group)
+				affinity.Mask |= cpu_topology.core[i].affinity.Mask;
 		}
-		uuprintf("  thr_%d:\t%s", i, printbitslz(thread_affinity[i]));
-		thread_affinity[num_threads - 1] ^= thread_affinity[i];
+	} else {
+		affinity = cpu_topology.core[cpu_topology.nb_cores - 1].affinity;
 	}
-	uuprintf("  thr_%d:\t%s", i, printbitslz(thread_affinity[i]));
-	return TRUE;
+	memset(affinity.Reserved, 0, sizeof(affinity.Reserved));
+	r = SetThreadGroupAffinity(hThread, &affinity, NULL);
+
+out:
+	ReleaseSRWLockExclusive(&cpu_topology.lock);
+	return r;
+}
+
+/*
+ * Lower the I/O priority of a handle (or restore it), so that reading an image to hash or
+ * scan it, or saving a download, yields to the writes of an operation on a drive.
+ */
+BOOL SetFileIoPriority(HANDLE hFile, BOOL bLow)
+{
+	FILE_IO_PRIORITY_HINT_INFO hint = { bLow ? IoPriorityHintLow : IoPriorityHintNormal };
+
+	if ((hFile == NULL) || (hFile == INVALID_HANDLE_VALUE))
+		return FALSE;
+	return SetFileInformationByHandle(hFile, FileIoPriorityHintInfo, &hint, sizeof(hint));
 }
 
 /*
@@ -1113,3 +1290,53 @@ BOOL UnmountRegistryHive(const HKEY key, const char* pszHiveName)
 
 	return (status == ERROR_SUCCESS);
 }
+
+/*
+ * Check whether a buffer only contains zeros.
+ * On x86, this uses SSE2, and on ARM64 NEON, to process 64 bytes per iteration.
+ */
+BOOL IsBufferZero(const void* buf, size_t len)
+{
+	const uint8_t* p = (const uint8_t*)buf;
+	size_t i = 0;
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+	__m128i acc;
+	// Process the unaligned head bytewise
+	for (; (i < len) && (((uintptr_t)&p[i]) & 15); i++)
+		if (p[i] != 0)
+			return FALSE;
+	for (; i + 64 <= len; i += 64) {
+		acc = _mm_or_si128(_mm_or_si128(_mm_load_si128((const __m128i*)&p[i]),
+			_mm_load_si128((const __m128i*)&p[i + 16])),
+			_mm_or_si128(_mm_load_si128((const __m128i*)&p[i + 32]),
+			_mm_load_si128((const __m128i*)&p[i + 48])));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF)
+			return FALSE;
+	}
+#elif defined(_M_ARM64) || defined(__aarch64__)
+	uint8x16_t acc;
+	for (; (i < len) && (((uintptr_t)&p[i]) & 15); i++)
+		if (p[i] != 0)
+			return FALSE;
+	for (; i + 64 <= len; i += 64) {
+		acc = vorrq_u8(vorrq_u8(vld1q_u8(&p[i]), vld1q_u8(&p[i + 16])),
+			vorrq_u8(vld1q_u8(&p[i + 32]), vld1q_u8(&p[i + 48])));
+		if (vmaxvq_u8(acc) != 0)
+			return FALSE;
+	}
+#else
+	for (; (i < len) && (((uintptr_t)&p[i]) & 7); i++)
+		if (p[i] != 0)
+			return FALSE;
+	for (; i + 32 <= len; i += 32) {
+		if ((*(const uint64_t*)&p[i] | *(const uint64_t*)&p[i + 8] |
+			*(const uint64_t*)&p[i + 16] | *(const uint64_t*)&p[i + 24]) != 0)
+			return FALSE;
+	}
+#endif
+	for (; i < len; i++)
+		if (p[i] != 0)
+			return FALSE;
+	return TRUE;
+}
@@ -28,11 +28,13 @@
 #include <string.h>
 #include <stdlib.h>
 #include <winternl.h>
+#include <stddef.h>
 #include <assert.h>
 #include <ctype.h>
 #include <math.h>
 
 #include "rufus.h"
+#include "missing.h"
 #include "resource.h"
 #include "msapi_utf8.h"
 #include "localization.h"
@@ -46,11 +48,232 @@ HWND hStatus;
 size_t ubuffer_pos = 0;
 char ubuffer[UBUFFER_SIZE];	// Buffer for ubpushf() messages we don't log right away
 
+/*
+ * Log messages are queued on a lock-free list by the threads that produce them, and
+ * drained in batches by the log dialog, so that no worker ever has to wait on the edit
+ * control. A zeroed SLIST_HEADER is an empty list, so the queue needs no initialization.
+ */
+typedef struct {
+	SLIST_ENTRY entry;
+	size_t len;
+	char str[1];
+} log_entry;
+
+static SLIST_HEADER log_queue;
+static SRWLOCK log_flush_lock = SRWLOCK_INIT;
+static volatile LONG log_flush_posted = 0;
+static HANDLE hLogFile = INVALID_HANDLE_VALUE;
+
+/*
+ * The log proper is kept in a ring buffer, that grows up to LOG_RING_SIZE before the oldest
+ * messages start being overwritten, and that is what gets saved. The log window only displays
+ * the most recent part of it, so that appending to the edit control doesn't get slower and
+ * slower as the log grows. Both are protected by log_flush_lock.
+ */
+static struct {
+	char* buf;
+	size_t size;
+	size_t start;
+	size_t len;
+	BOOL wrapped;
+} log_ring = { 0 };
+
+static void AppendLogRing(const char* str, size_t len)
+{
+	size_t size, pos, n;
+	char* buf;
+
+	// We can only grow the ring as long as its content is contiguous from the start
+	if ((log_ring.len + len > log_ring.size) && (log_ring.size < LOG_RING_SIZE) && (log_ring.start == 0)) {
+		size = min(max(max(2 * log_ring.size, log_ring.len + len), 64 * KB), LOG_RING_SIZE);
+		buf = (char*)realloc(log_ring.buf, size);
+		if (buf != NULL) {
+			log_ring.buf = buf;
+			log_ring.size = size;
+		}
+	}
+	if (log_ring.size == 0)
+		return;
+	if (len > log_ring.size) {
+		str = &str[len - log_ring.size];
+		len = log_ring.size;
+	}
+	pos = (log_ring.start + log_ring.len) % log_ring.size;
+	n = min(len, log_ring.size - pos);
+	memcpy(&log_ring.buf[pos], str, n);
+	memcpy(log_ring.buf, &str[n], len - n);
+	log_ring.len += len;
+	if (log_ring.len > log_ring.size) {
+		log_ring.start = (log_ring.start + log_ring.len - log_ring.size) % log_ring.size;
+		log_ring.len = log_ring.size;
+		log_ring.wrapped = TRUE;
+	}
+}
+
+// Append a batch of messages to the log window, after trimming its oldest lines if needed
+static void AppendLogWindow(const char* str)
+{
+	wchar_t* wstr = utf8_to_wchar(str);
+	int len, line;
+
+	if (wstr == NULL)
+		return;
+	// Trim by large chunks, to keep the cost of the (full text) trimming low
+	len = GetWindowTextLengthW(hLog);
+	if ((len > LOG_WINDOW_SIZE / 2) && (len + wcslen(wstr) > LOG_WINDOW_SIZE)) {
+		line = Edit_LineFromChar(hLog, len - LOG_WINDOW_SIZE / 2);
+		Edit_SetSel(hLog, 0, Edit_LineIndex(hLog, line + 1));
+		Edit_ReplaceSel(hLog, L"");
+	}
+	Edit_SetSel(hLog, MAX_LOG_SIZE, MAX_LOG_SIZE);
+	Edit_ReplaceSel(hLog, wstr);
+	// Make sure the message scrolls into view
+	// (Or see code commented in LogProc:WM_SHOWWINDOW for a less forceful scroll)
+	Edit_Scroll(hLog, Edit_GetLineCount(hLog), 0);
+	free(wstr);
+}
+
+static void QueueLog(const char* str, size_t len)
+{
+	log_entry* e = (log_entry*)_aligned_malloc(offsetof(log_entry, str) + len + 1, MEMORY_ALLOCATION_ALIGNMENT);
+
+	if (e == NULL)
+		return;
+	e->len = len;
+	memcpy(e->str, str, len + 1);
+	InterlockedPushEntrySList(&log_queue, &e->entry);
+	// Without a dialog to process them (early init, headless mode), messages are output
+	// right away. Otherwise, only the UI thread flushes them, as the log window must never
+	// be accessed from a worker holding the flush lock, and only one wake up message needs
+	// to be pending at any time. If that message can't be posted (full message queue), the
+	// entries stay queued, and the next message tries to post it again.
+	if (hLogDialog == NULL)
+		FlushLog();
+	else if ((InterlockedExchange(&log_flush_posted, 1) == 0) && (!PostMessage(hLogDialog, UM_LOG_FLUSH, 0, 0)))
+		InterlockedExchange(&log_flush_posted, 0);
+}
+
+// Output all the queued log messages to the debug facility, the log window and the log file
+void FlushLog(void)
+{
+	PSLIST_ENTRY list, next, prev = NULL;
+	log_entry* e;
+	char* batch;
+	wchar_t* wstr;
+	size_t size = 0, pos = 0;
+	DWORD written;
+
+	AcquireSRWLockExclusive(&log_flush_lock);
+	// Clear the wake up flag first, so that messages queued from now on post a new one
+	InterlockedExchange(&log_flush_posted, 0);
+	// The list comes back in LIFO order, so reverse it
+	for (list = InterlockedFlushSList(&log_queue); list != NULL; list = next) {
+		next = list->Next;
+		list->Next = prev;
+		prev = list;
+		size += ((log_entry*)list)->len;
+	}
+	if (prev == NULL)
+		goto out;
+
+	batch = (char*)malloc(size + 1);
+	for (list = prev; list != NULL; list = next) {
+		next = list->Next;
+		e = (log_entry*)list;
+		// Yay, Windows 10 *FINALLY* added actual Unicode support for OutputDebugStringW()!
+		wstr = utf8_to_wchar(e->str);
+		// Send output to Windows debug facility
+		OutputDebugStringW(wstr);
+		free(wstr);
+		if (batch != NULL) {
+			memcpy(&batch[pos], e->str, e->len);
+			pos += e->len;
+		} else if (hLogFile != INVALID_HANDLE_VALUE) {
+			WriteFile(hLogFile, e->str, (DWORD)e->len, &written, NULL);
+		}
+		_aligned_free(e);
+	}
+	if (batch == NULL)
+		goto out;
+	batch[pos] = '\0';
+
+	if (hLogFile != INVALID_HANDLE_VALUE)
+		WriteFile(hLogFile, batch, (DWORD)pos, &written, NULL);
+	AppendLogRing(batch, pos);
+	// Send output to our log Window
+	if ((hLog != NULL) && (hLog != INVALID_HANDLE_VALUE))
+		AppendLogWindow(batch);
+	free(batch);
+
+out:
+	ReleaseSRWLockExclusive(&log_flush_lock);
+}
+
+/*
+ * Return a copy of the log, as far back as the ring buffer goes, which must be freed
+ * by the caller. If the oldest messages have been dropped, we start at the first full line.
+ */
+char* GetLogText(DWORD* size)
+{
+	char* buf = NULL;
+	size_t skip = 0, len, n;
+
+	FlushLog();
+	AcquireSRWLockExclusive(&log_flush_lock);
+	if (log_ring.wrapped) {
+		for (; (skip < log_ring.len) && (log_ring.buf[(log_ring.start + skip) % log_ring.size] != '\n'); skip++);
+		skip = min(skip + 1, log_ring.len);
+	}
+	len = log_ring.len - skip;
+	buf = (char*)malloc(len + 1);
+	if (buf != NULL) {
+		if (len != 0) {
+			skip = (log_ring.start + skip) % log_ring.size;
+			n = min(len, log_ring.size - skip);
+			memcpy(buf, &log_ring.buf[skip], n);
+			memcpy(&buf[n], log_ring.buf, len - n);
+		}
+		buf[len] = '\0';
+		if (size != NULL)
+			*size = (DWORD)len;
+	}
+	ReleaseSRWLockExclusive(&log_flush_lock);
+	return buf;
+}
+
+// Clear both the log window and the log that gets saved
+void ClearLog(void)
+{
+	FlushLog();
+	AcquireSRWLockExclusive(&log_flush_lock);
+	log_ring.start = 0;
+	log_ring.len = 0;
+	log_ring.wrapped = FALSE;
+	if ((hLog != NULL) && (hLog != INVALID_HANDLE_VALUE))
+		SetWindowTextA(hLog, "");
+	ReleaseSRWLockExclusive(&log_flush_lock);
+}
+
+// Also append the log messages to a file (or stop doing so if path is NULL)
+BOOL SetLogFile(const char* path)
+{
+	AcquireSRWLockExclusive(&log_flush_lock);
+	safe_closehandle(hLogFile);
+	hLogFile = INVALID_HANDLE_VALUE;
+	if (path != NULL) {
+		hLogFile = CreateFileU(path, FILE_APPEND_DATA, FILE_SHARE_READ, NULL, OPEN_ALWAYS,
+			FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hLogFile == NULL)
+			hLogFile = INVALID_HANDLE_VALUE;
+	}
+	ReleaseSRWLockExclusive(&log_flush_lock);
+	return (path == NULL) || (hLogFile != INVALID_HANDLE_VALUE);
+}
+
 void _uprintf(const char *format, ...)
 {
-	static char buf[4096];
+	char buf[4096];
 	char* p = buf;
-	wchar_t* wbuf;
 	va_list args;
 	int n;
 
@@ -67,32 +290,12 @@ void _uprintf(const char *format, ...)
 	*p++ = '\n';
 	*p   = '\0';
 
-	// Yay, Windows 10 *FINALLY* added actual Unicode support for OutputDebugStringW()!
-	wbuf = utf8_to_wchar(buf);
-	// Send output to Windows debug facility
-	OutputDebugStringW(wbuf);
-	if ((hLog != NULL) && (hLog != INVALID_HANDLE_VALUE)) {
-		// Send output to our log Window
-		Edit_SetSel(hLog, MAX_LOG_SIZE, MAX_LOG_SIZE);
-		Edit_ReplaceSel(hLog, wbuf);
-		// Make sure the message scrolls into view
-		// (Or see code commented in LogProc:WM_SHOWWINDOW for a less forceful scroll)
-		Edit_Scroll(hLog, Edit_GetLineCount(hLog), 0);
-	}
-	free(wbuf);
+	QueueLog(buf, p - buf);
 }
 
 void _uprintfs(const char* str)
 {
-	wchar_t* wstr;
-	wstr = utf8_to_wchar(str);
-	OutputDebugStringW(wstr);
-	if ((hLog != NULL) && (hLog != INVALID_HANDLE_VALUE)) {
-		Edit_SetSel(hLog, MAX_LOG_SIZE, MAX_LOG_SIZE);
-		Edit_ReplaceSel(hLog, wstr);
-		Edit_Scroll(hLog, Edit_GetLineCount(hLog), 0);
-	}
-	free(wstr);
+	QueueLog(str, strlen(str));
 }
 
 uint32_t read_file(const char* path, uint8_t** buf)
@@ -906,9 +1109,10 @@ BOOL WriteFileWithRetry(HANDLE hFile, LPCVOID lpBuffer, DWORD nNumberOfBytesToWr
 		if (!readFilePointer)
 			break;
 		if (nTry < nNumRetries) {
-			uprintf("Retrying in %d seconds...", WRITE_TIMEOUT / 1000);
+			uprintf("Retrying in up to %d seconds...", WRITE_TIMEOUT / 1000);
 			// Don't sit idly but use the downtime to check for conflicting processes...
-			Sleep(CheckDriveAccess(WRITE_TIMEOUT, FALSE));
+			if (!CancellableSleep(CheckDriveAccess(WRITE_TIMEOUT, FALSE)))
+				break;
 		}
 	}
 	if (SCODE_CODE(GetLastError()) == ERROR_SUCCESS)
@@ -952,6 +1156,106 @@ DWORD WaitForSingleObjectWithMessages(HANDLE hHandle, DWORD dwMilliseconds)
 	return res;
 }
 
+/*
+ * User cancellation.
+ * On top of setting FormatStatus, which is what CHECK_FOR_USER_CANCEL tests, a cancel signals
+ * an event, which the retry delays wait on instead of sleeping, and aborts the I/O that is in
+ * flight: the synchronous calls of the thread that runs the operation, as well as the
+ * overlapped requests on the handles that were registered with RegisterCancellableIo(). The
+ * aborted calls fail with ERROR_OPERATION_ABORTED, and their callers then see the cancel on
+ * their next check, instead of having to wait for a slow device to complete a large write.
+ */
+#define MAX_CANCELLABLE_IO          32
+
+static HANDLE hCancelEvent = NULL;
+static struct {
+	SRWLOCK lock;
+	HANDLE handle[MAX_CANCELLABLE_IO];
+} cancellable_io = { SRWLOCK_INIT };
+
+static HANDLE GetCancelEvent(void)
+{
+	HANDLE h;
+
+	if (hCancelEvent == NULL) {
+		h = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if ((h != NULL) && (InterlockedCompareExchangePointer(&hCancelEvent, h, NULL) != NULL))
+			CloseHandle(h);
+	}
+	return hCancelEvent;
+}
+
+// Abort any overlapped I/O on h when the user cancels, until UnregisterCancellableIo() is called
+void RegisterCancellableIo(HANDLE h)
+{
+	int i;
+
+	AcquireSRWLockExclusive(&cancellable_io.lock);
+	for (i = 0; (i < MAX_CANCELLABLE_IO) && (cancellable_io.handle[i] != NULL); i++);
+	if (i < MAX_CANCELLABLE_IO)
+		cancellable_io.handle[i] = h;
+	ReleaseSRWLockExclusive(&cancellable_io.lock);
+}
+
+// Must be called before the handle is closed
+void UnregisterCancellableIo(HANDLE h)
+{
+	int i;
+
+	AcquireSRWLockExclusive(&cancellable_io.lock);
+	for (i = 0; i < MAX_CANCELLABLE_IO; i++) {
+		if (cancellable_io.handle[i] == h)
+			cancellable_io.handle[i] = NULL;
+	}
+	ReleaseSRWLockExclusive(&cancellable_io.lock);
+}
+
+/*
+ * Cancel the current operation. hThread, if not NULL, is the thread running it, the
+ * synchronous I/O of which is aborted.
+ */
+void CancelOperation(HANDLE hThread)
+{
+	int i;
+
+	FormatStatus = ERROR_SEVERITY_ERROR | FAC(FACILITY_STORAGE) | ERROR_CANCELLED;
+	SetEvent(GetCancelEvent());
+	if (hThread != NULL)
+		CancelSynchronousIo(hThread);
+	AcquireSRWLockShared(&cancellable_io.lock);
+	for (i = 0; i < MAX_CANCELLABLE_IO; i++) {
+		if (cancellable_io.handle[i] != NULL)
+			CancelIoEx(cancellable_io.handle[i], NULL);
+	}
+	ReleaseSRWLockShared(&cancellable_io.lock);
+}
+
+/*
+ * A Sleep() that returns early, with FALSE, if the user cancels.
+ */
+BOOL CancellableSleep(DWORD dwMilliseconds)
+{
+	HANDLE h = GetCancelEvent();
+	uint64_t CurTime, EndTime = GetTickCount64() + dwMilliseconds;
+
+	if (h == NULL) {
+		Sleep(dwMilliseconds);
+		return !IS_USER_CANCEL;
+	}
+	while (!IS_USER_CANCEL) {
+		// The event may still be set from an operation that was cancelled earlier, and
+		// since a cancel sets FormatStatus first, resetting it here can't lose a new one
+		ResetEvent(h);
+		if (IS_USER_CANCEL)
+			break;
+		CurTime = GetTickCount64();
+		if (CurTime >= EndTime)
+			return TRUE;
+		WaitForSingleObject(h, (DWORD)(EndTime - CurTime));
+	}
+	return FALSE;
+}
+
 #define STATUS_SUCCESS					((NTSTATUS)0x00000000L)
 #define STATUS_NOT_IMPLEMENTED			((NTSTATUS)0xC0000002L)
 #define FILE_ATTRIBUTE_VALID_FLAGS		0x00007FB7
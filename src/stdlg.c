@@ -1541,6 +1541,7 @@ static DWORD WINAPI CheckForFidoThread(LPVOID param)
 		SetWindowLongPtr(hCtrl, GWL_STYLE, style);
 		RedrawWindow(hCtrl, NULL, NULL, RDW_ALLCHILDREN | RDW_UPDATENOW);
 		InvalidateRect(hCtrl, NULL, TRUE);
+		PrefetchFidoScript();
 	}
 
 out:
@@ -1728,7 +1729,7 @@ INT_PTR CALLBACK NewVersionCallback(HWND hDlg, UINT message, WPARAM wParam, LPAR
 		case IDC_DOWNLOAD:	// Also doubles as abort and launch function
 			switch(download_status) {
 			case 1:		// Abort
-				FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_CANCELLED;
+				CancelOperation(NULL);
 				download_status = 0;
 				hThread = NULL;
 				break;
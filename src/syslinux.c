@@ -53,29 +53,59 @@ uint32_t LIBFAT_SECTOR_SIZE = 512;
 uint32_t LIBFAT_SECTOR_MASK = 511;
 
 /*
- * Wrapper for ReadFile suitable for libfat
+ * libfat issues its reads one sector at a time, which, through a volume handle, results
+ * in one synchronous I/O round trip per FAT or directory sector. To avoid that, we read
+ * ahead into a private window, that can then serve the sectors that follow.
  */
-int libfat_readfile(intptr_t pp, void *buf, size_t secsize, libfat_sector_t sector)
+#define LIBFAT_READAHEAD_SIZE	(64 * KB)
+typedef struct {
+	HANDLE handle;
+	libfat_sector_t sec_start;
+	DWORD nb_secs;
+	uint8_t* buf;
+} libfat_readfile_private;
+
+static BOOL libfat_readfile_window(libfat_readfile_private* p, size_t secsize, libfat_sector_t sector, DWORD size)
 {
-	LARGE_INTEGER offset;
 	DWORD bytes_read;
 
-	offset.QuadPart = (LONGLONG) sector * secsize;
-	if (!SetFilePointerEx((HANDLE) pp, offset, NULL, FILE_BEGIN)) {
-		uprintf("Could not set pointer to position %llu: %s", offset.QuadPart, WindowsErrorString());
-		return 0;
+	p->nb_secs = 0;
+	// A short read-ahead is fine, as long as we got the sector we were after
+	if (!BlockIo(p->handle, FALSE, p->buf, size, (uint64_t)sector * secsize, 0, NULL, &bytes_read) &&
+		(bytes_read == 0)) {
+		// Only report an error for single sector reads, since the read-ahead may legitimately fail near the end of the volume
+		if (size == secsize)
+			uprintf("Could not read sector %llu: %s", sector, WindowsErrorString());
+		return FALSE;
 	}
 
-	if (!ReadFile((HANDLE) pp, buf, (DWORD) secsize, &bytes_read, NULL)) {
-		uprintf("Could not read sector %llu: %s", sector, WindowsErrorString());
-		return 0;
+	if (bytes_read < secsize) {
+		if (size == secsize)
+			uprintf("Sector %llu: Read %d bytes instead of %d requested", sector, bytes_read, secsize);
+		return FALSE;
 	}
 
-	if (bytes_read != secsize) {
-		uprintf("Sector %llu: Read %d bytes instead of %d requested", sector, bytes_read, secsize);
-		return 0;
+	p->sec_start = sector;
+	p->nb_secs = (DWORD)(bytes_read / secsize);
+	return TRUE;
+}
+
+/*
+ * Wrapper for ReadFile suitable for libfat
+ */
+int libfat_readfile(intptr_t pp, void *buf, size_t secsize, libfat_sector_t sector)
+{
+	libfat_readfile_private* p = (libfat_readfile_private*)pp;
+
+	if ((p->nb_secs == 0) || (sector < p->sec_start) || (sector >= p->sec_start + p->nb_secs)) {
+		// Fall back to reading the single sector if the read-ahead failed
+		if ((secsize > LIBFAT_READAHEAD_SIZE) ||
+			(!libfat_readfile_window(p, secsize, sector, (DWORD)(LIBFAT_READAHEAD_SIZE - (LIBFAT_READAHEAD_SIZE % secsize))) &&
+			 !libfat_readfile_window(p, secsize, sector, (DWORD)secsize)))
+			return 0;
 	}
 
+	memcpy(buf, &p->buf[(sector - p->sec_start) * secsize], secsize);
 	return (int)secsize;
 }
 
@@ -107,6 +137,7 @@ BOOL InstallSyslinux(DWORD drive_index, char drive_letter, int file_system)
 	char path[MAX_PATH], tmp[64];
 	const char *errmsg;
 	struct libfat_filesystem *lf_fs;
+	libfat_readfile_private lf_private = { INVALID_HANDLE_VALUE, 0, 0, NULL };
 	libfat_sector_t s, *secp;
 	libfat_sector_t *sectors = NULL;
 	int ldlinux_sectors;
@@ -266,7 +297,12 @@ BOOL InstallSyslinux(DWORD drive_index, char drive_letter, int file_system)
 	case FS_FAT16:
 	case FS_FAT32:
 	case FS_EXFAT:
-		lf_fs = libfat_open(libfat_readfile, (intptr_t) d_handle);
+		// Must be aligned, as the volume handle may not be buffered
+		lf_private.handle = d_handle;
+		lf_private.buf = _mm_malloc(LIBFAT_READAHEAD_SIZE, 4096);
+		if (lf_private.buf == NULL)
+			goto out;
+		lf_fs = libfat_open(libfat_readfile, (intptr_t) &lf_private);
 		if (lf_fs == NULL) {
 			uprintf("Syslinux FAT access error");
 			goto out;
@@ -387,6 +423,7 @@ BOOL InstallSyslinux(DWORD drive_index, char drive_letter, int file_system)
 
 out:
 	safe_mm_free(sectbuf);
+	safe_mm_free(lf_private.buf);
 	safe_free(syslinux_ldlinux[0]);
 	safe_free(syslinux_ldlinux[1]);
 	safe_free(sectors);
@@ -395,60 +432,70 @@ out:
 	return r;
 }
 
-uint16_t GetSyslinuxVersion(char* buf, size_t buf_size, char** ext)
+/*
+ * Get the version of a Syslinux binary, along with its extra version string, which is
+ * copied into ext. buf is not modified, so that it can be a view into a resource.
+ */
+uint16_t GetSyslinuxVersion(const char* buf, size_t buf_size, char* ext, size_t ext_size)
 {
-	size_t i, j, k;
+	size_t i, j, k, n;
 	char *p;
 	uint16_t version;
 	const char LINUX[] = { 'L', 'I', 'N', 'U', 'X', ' ' };
-	static char* nullstr = "";
 	char unauthorized[] = {'<', '>', ':', '|', '*', '?', '\\', '/'};
 
-	*ext = nullstr;
+	if (ext_size == 0)
+		return 0;
+	ext[0] = 0;
 	if (buf_size < 256)
 		return 0;
 
 	// Start at 64 to avoid the short incomplete version at the beginning of ldlinux.sys
 	for (i=64; i<buf_size-64; i++) {
-		if (memcmp(&buf[i], LINUX, sizeof(LINUX)) == 0) {
-			// Check for ISO or SYS prefix
-			if (!( ((buf[i-3] == 'I') && (buf[i-2] == 'S') && (buf[i-1] == 'O'))
-			    || ((buf[i-3] == 'S') && (buf[i-2] == 'Y') && (buf[i-1] == 'S')) ))
-			  continue;
-			i += sizeof(LINUX);
-			version = (((uint8_t)strtoul(&buf[i], &p, 10))<<8) + (uint8_t)strtoul(&p[1], &p, 10);
-			if (version == 0)
-				continue;
-			p[safe_strlen(p)] = 0;
-			// Ensure that our extra version string starts with a slash
-			*p = '/';
-			// Remove the x.yz- duplicate if present
-			for (j=0; (buf[i+j] == p[1+j]) && (buf[i+j] != ' '); j++);
-			if (p[j+1] == '-')
-				j++;
-			if (j >= 4) {
-				p[j] = '/';
-				p = &p[j];
-			}
-			for (j=safe_strlen(p)-1; j>0; j--) {
-				// Arch Linux affixes a star for their version - who knows what else is out there...
-				if ((p[j] == ' ') || (p[j] == '*'))
-					p[j] = 0;
-				else
-					break;
-			}
-			// Sanitize the string
-			for (j=1; j<safe_strlen(p); j++) {
-				// Some people are bound to have invalid chars in their date strings
-				for (k=0; k<sizeof(unauthorized); k++) {
-					if (p[j] == unauthorized[k])
-						p[j] = '_';
-				}
+		// Only the start of the marker needs to be before the last 64 bytes
+		p = FindBytes(&buf[i], buf_size - 64 - i + sizeof(LINUX) - 1, LINUX, sizeof(LINUX));
+		if (p == NULL)
+			break;
+		i = (size_t)(p - buf);
+		// Check for ISO or SYS prefix
+		if (!( ((buf[i-3] == 'I') && (buf[i-2] == 'S') && (buf[i-1] == 'O'))
+		    || ((buf[i-3] == 'S') && (buf[i-2] == 'Y') && (buf[i-1] == 'S')) ))
+			continue;
+		i += sizeof(LINUX);
+		version = (((uint8_t)strtoul(&buf[i], &p, 10))<<8) + (uint8_t)strtoul(&p[1], &p, 10);
+		if (version == 0)
+			continue;
+		// Skip the x.yz- duplicate if present
+		for (j=0; (buf[i+j] == p[1+j]) && (buf[i+j] != ' '); j++);
+		if (p[j+1] == '-')
+			j++;
+		if (j < 4)
+			j = 0;
+		p = &p[j];
+		n = min(strnlen(p, buf_size - (size_t)(p - buf)), ext_size - 1);
+		memcpy(ext, p, n);
+		ext[n] = 0;
+		// Ensure that our extra version string starts with a slash
+		ext[0] = '/';
+		for (j=n-1; (n != 0) && (j>0); j--) {
+			// Arch Linux affixes a star for their version - who knows what else is out there...
+			if ((ext[j] == ' ') || (ext[j] == '*'))
+				ext[j] = 0;
+			else
+				break;
+		}
+		// Sanitize the string
+		for (j=1; j<safe_strlen(ext); j++) {
+			// Some people are bound to have invalid chars in their date strings
+			for (k=0; k<sizeof(unauthorized); k++) {
+				if (ext[j] == unauthorized[k])
+					ext[j] = '_';
 			}
-			// If all we have is a slash, return the empty string for the extra version
-			*ext = (p[1] == 0)?nullstr:p;
-			return version;
 		}
+		// If all we have is a slash, return the empty string for the extra version
+		if (ext[1] == 0)
+			ext[0] = 0;
+		return version;
 	}
 	return 0;
 }
@@ -17,6 +17,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <malloc.h>
 #include "libfatint.h"
 
@@ -27,12 +28,19 @@
  * For good measure, we'll go further and align our buffers on a 16-byte boundary.
  * Also, since struct libfat_sector's data[0] is our buffer, this means we must BOTH
  * align that member in the struct declaration, and use aligned malloc/free.
+ *
+ * Cached sectors are never evicted (other than by libfat_flush()), since callers
+ * may hold on to the pointer we return while they look up other sectors. Lookups
+ * go through a hash of the sector number, as a large FAT can result in a lot of
+ * sectors being cached.
  */
 void *libfat_get_sector(struct libfat_filesystem *fs, libfat_sector_t n)
 {
     struct libfat_sector *ls;
+    struct libfat_sector **bucket =
+	&fs->sector_hash[n & (LIBFAT_SECTOR_HASH_SIZE - 1)];
 
-    for (ls = fs->sectors; ls; ls = ls->next) {
+    for (ls = *bucket; ls; ls = ls->hnext) {
 	if (ls->n == n)
 	    return ls->data;	/* Found in cache */
     }
@@ -56,6 +64,8 @@ void *libfat_get_sector(struct libfat_filesystem *fs, libfat_sector_t n)
     ls->n = n;
     ls->next = fs->sectors;
     fs->sectors = ls;
+    ls->hnext = *bucket;
+    *bucket = ls;
 
     return ls->data;
 }
@@ -66,6 +76,7 @@ void libfat_flush(struct libfat_filesystem *fs)
 
     lsnext = fs->sectors;
     fs->sectors = NULL;
+    memset(fs->sector_hash, 0, sizeof(fs->sector_hash));
 
     for (ls = lsnext; ls; ls = lsnext) {
 	lsnext = ls->next;
@@ -30,9 +30,13 @@
 #define ALIGN_END(m)
 #endif
 
+/* Number of buckets used to look up cached sectors (must be a power of 2) */
+#define LIBFAT_SECTOR_HASH_SIZE 256
+
 ALIGN_START(16) struct libfat_sector {
 	libfat_sector_t n;		/* Sector number */
 	struct libfat_sector *next;	/* Next in list */
+	struct libfat_sector *hnext;	/* Next in hash bucket */
 	/* data[0] MUST be aligned to at least 8 bytes - see cache.c */
 	ALIGN_START(16) char data[0] ALIGN_END(16);
 } ALIGN_END(16);
@@ -59,6 +63,7 @@ struct libfat_filesystem {
     libfat_sector_t end;	/* End of filesystem */
 
     struct libfat_sector *sectors;
+    struct libfat_sector *sector_hash[LIBFAT_SECTOR_HASH_SIZE];
 };
 
 #endif /* LIBFATINT_H */
@@ -18,6 +18,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include "libfatint.h"
 #include "ulint.h"
 
@@ -36,6 +37,7 @@ libfat_open(int (*readfunc) (intptr_t, void *, size_t, libfat_sector_t),
 	goto barf;
 
     fs->sectors = NULL;
+    memset(fs->sector_hash, 0, sizeof(fs->sector_hash));
     fs->read = readfunc;
     fs->readptr = readptr;
 
@@ -0,0 +1,442 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Operation timeline tracing
+ * Copyright © 2026 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The timeline records when each phase of an operation (partitioning, formatting, writing
+ * the boot records, extracting the ISO, etc.) begins and ends, as well as the read and write
+ * requests that complete on our async queues. Consecutive requests of the same thread are
+ * coalesced into batches of up to TRACE_IO_BATCH_US, to keep the timeline small. Once the
+ * operation is over, a summary of the time and bytes of each phase is printed to the log and,
+ * if requested, the whole timeline is exported in the Chrome trace event format, which can be
+ * loaded in chrome://tracing, https://ui.perfetto.dev or https://www.speedscope.app.
+ * The phases are also added to the history of the device (see history.c) and to the metrics
+ * that are exported for monitoring (see metrics.c).
+ */
+
+#ifdef _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "rufus.h"
+#include "missing.h"
+#include "msapi_utf8.h"
+
+#include "winio.h"
+
+#define TRACE_MAX_EVENTS            16384
+#define TRACE_RESERVED_EVENTS       256		// Events that I/O batches can't use, so that phases are never dropped
+#define TRACE_MAX_PHASES            48		// Distinct phase names in the summary
+#define TRACE_MAX_OPEN              16		// Phases that can be open at the same time
+#define TRACE_MAX_STREAMS           16		// Threads that can have a batch of requests in progress
+#define TRACE_IO_BATCH_US           250000
+
+typedef struct {
+	const char* name;
+	char ph;						// 'B' (begin), 'E' (end) or 'X' (complete, for I/O batches)
+	DWORD tid;
+	uint64_t ts;
+	uint64_t dur;
+	uint64_t bytes;
+	uint32_t requests;
+} trace_event;
+
+typedef struct {
+	const char* name;
+	uint32_t count;
+	uint64_t total_us;
+	uint64_t bytes;
+} trace_phase;
+
+typedef struct {
+	const char* name;
+	DWORD tid;
+	uint64_t start;
+	uint64_t bytes;
+} trace_open;
+
+typedef struct {
+	BOOL write;
+	DWORD tid;
+	uint64_t start;
+	uint64_t end;
+	uint64_t bytes;
+	uint32_t requests;
+} trace_stream;
+
+extern BOOL export_timeline;
+static CRITICAL_SECTION trace_lock;
+static BOOL trace_lock_init = FALSE;
+static const char* trace_job = NULL;
+static DWORD trace_device;
+static uint64_t trace_origin;
+static trace_event* trace_list = NULL;
+static uint32_t nb_trace_events, nb_trace_dropped;
+static trace_phase trace_phases[TRACE_MAX_PHASES];
+static uint32_t nb_trace_phases;
+static trace_open trace_stack[TRACE_MAX_OPEN];
+static uint32_t nb_trace_open;
+static trace_stream trace_streams[TRACE_MAX_STREAMS];
+
+static void TraceAddEvent(const char* name, char ph, DWORD tid, uint64_t ts, uint64_t dur,
+	uint64_t bytes, uint32_t requests)
+{
+	trace_event* e;
+
+	if (nb_trace_events >= TRACE_MAX_EVENTS - ((ph == 'X') ? TRACE_RESERVED_EVENTS : 0)) {
+		nb_trace_dropped++;
+		return;
+	}
+	e = &trace_list[nb_trace_events++];
+	e->name = name;
+	e->ph = ph;
+	e->tid = tid;
+	e->ts = ts - trace_origin;
+	e->dur = dur;
+	e->bytes = bytes;
+	e->requests = requests;
+}
+
+static void TraceAddPhase(const char* name, uint32_t count, uint64_t duration, uint64_t bytes)
+{
+	uint32_t i;
+
+	for (i = 0; (i < nb_trace_phases) && (strcmp(trace_phases[i].name, name) != 0); i++);
+	if (i >= TRACE_MAX_PHASES)
+		return;
+	if (i == nb_trace_phases) {
+		trace_phases[i].name = name;
+		nb_trace_phases++;
+	}
+	trace_phases[i].count += count;
+	trace_phases[i].total_us += duration;
+	trace_phases[i].bytes += bytes;
+}
+
+// Close a batch of requests, and account for its bytes in all the phases that are open
+static void TraceFlushStream(trace_stream* stream)
+{
+	uint32_t i;
+	const char* name = stream->write ? "write requests" : "read requests";
+
+	if (stream->requests == 0)
+		return;
+	TraceAddEvent(name, 'X', stream->tid, stream->start, stream->end - stream->start,
+		stream->bytes, stream->requests);
+	TraceAddPhase(name, 1, stream->end - stream->start, stream->bytes);
+	for (i = 0; i < nb_trace_open; i++)
+		trace_stack[i].bytes += stream->bytes;
+	stream->requests = 0;
+}
+
+static void TraceEndPhase(uint32_t index, uint64_t now)
+{
+	trace_open* phase = &trace_stack[index];
+
+	TraceAddEvent(phase->name, 'E', phase->tid, now, 0, phase->bytes, 0);
+	TraceAddPhase(phase->name, 1, now - phase->start, phase->bytes);
+	if (EtwEnabled(ETW_LEVEL_INFO, ETW_KEYWORD_PHASE))
+		EtwPhase(FALSE, phase->name, phase->bytes, now - phase->start);
+	nb_trace_open--;
+	memmove(phase, phase + 1, (nb_trace_open - index) * sizeof(trace_open));
+}
+
+/*
+ * Start recording the timeline of an operation
+ */
+void TraceStart(const char* job, DWORD DeviceNumber)
+{
+	if (!trace_lock_init) {
+		InitializeCriticalSection(&trace_lock);
+		trace_lock_init = TRUE;
+	}
+	EnterCriticalSection(&trace_lock);
+	safe_free(trace_list);
+	trace_list = (trace_event*)malloc(TRACE_MAX_EVENTS * sizeof(trace_event));
+	if (trace_list == NULL)
+		uprintf("Could not allocate the timeline - Timings will not be reported");
+	trace_job = job;
+	trace_device = DeviceNumber;
+	nb_trace_events = nb_trace_dropped = nb_trace_phases = nb_trace_open = 0;
+	memset(trace_streams, 0, sizeof(trace_streams));
+	trace_origin = GetIoTimestamp();
+	LeaveCriticalSection(&trace_lock);
+	SelectDeviceHistory(DeviceNumber);
+	if (EtwEnabled(ETW_LEVEL_INFO, ETW_KEYWORD_PHASE))
+		EtwJob(TRUE, job, DeviceNumber, 0);
+	TraceBegin(job);
+}
+
+/*
+ * Begin and end a phase of the operation. Phases can be nested, and a phase that is
+ * still open when the operation stops (e.g. because it failed) ends at that time.
+ */
+void TraceBegin(const char* name)
+{
+	uint64_t now = GetIoTimestamp();
+	DWORD tid = GetCurrentThreadId();
+
+	if (trace_list == NULL)
+		return;
+	EnterCriticalSection(&trace_lock);
+	if ((trace_list != NULL) && (nb_trace_open < TRACE_MAX_OPEN)) {
+		if (EtwEnabled(ETW_LEVEL_INFO, ETW_KEYWORD_PHASE))
+			EtwPhase(TRUE, name, 0, 0);
+		TraceAddEvent(name, 'B', tid, now, 0, 0, 0);
+		trace_stack[nb_trace_open].name = name;
+		trace_stack[nb_trace_open].tid = tid;
+		trace_stack[nb_trace_open].start = now;
+		trace_stack[nb_trace_open].bytes = 0;
+		nb_trace_open++;
+	}
+	LeaveCriticalSection(&trace_lock);
+}
+
+void TraceEnd(const char* name)
+{
+	int i;
+	uint64_t now = GetIoTimestamp();
+	DWORD tid = GetCurrentThreadId();
+
+	if (trace_list == NULL)
+		return;
+	EnterCriticalSection(&trace_lock);
+	for (i = (trace_list == NULL) ? -1 : (int)nb_trace_open - 1; i >= 0; i--) {
+		if ((trace_stack[i].tid == tid) && (strcmp(trace_stack[i].name, name) == 0)) {
+			TraceEndPhase(i, now);
+			break;
+		}
+	}
+	LeaveCriticalSection(&trace_lock);
+}
+
+/*
+ * Add work that isn't a phase of its own to the summary, such as the files that were extracted
+ * through a given method. Since that work may be spread across threads, the duration is the
+ * time that was cumulated by all of them, rather than the time it took.
+ */
+void TraceTally(const char* name, uint32_t count, uint64_t duration_us, uint64_t bytes)
+{
+	if ((trace_list == NULL) || (count == 0))
+		return;
+	EnterCriticalSection(&trace_lock);
+	if (trace_list != NULL)
+		TraceAddPhase(name, count, duration_us, bytes);
+	LeaveCriticalSection(&trace_lock);
+}
+
+/*
+ * Record a completed I/O request. This is meant to be called from an async queue monitor.
+ */
+void TraceIo(BOOL bWrite, ULONG64 u64Offset, DWORD dwSize, ULONG64 u64LatencyUs)
+{
+	int i, free_slot = -1;
+	uint64_t now = GetIoTimestamp();
+	DWORD tid = GetCurrentThreadId();
+	trace_stream* stream;
+
+	if (EtwEnabled(ETW_LEVEL_VERBOSE, ETW_KEYWORD_IO))
+		EtwIo(bWrite, u64Offset, dwSize, u64LatencyUs);
+	if (trace_list == NULL)
+		return;
+	EnterCriticalSection(&trace_lock);
+	if (trace_list == NULL)
+		goto out;
+	for (i = 0; i < TRACE_MAX_STREAMS; i++) {
+		if ((trace_streams[i].requests != 0) && (trace_streams[i].tid == tid) &&
+			(trace_streams[i].write == bWrite))
+			break;
+		if ((free_slot < 0) && (trace_streams[i].requests == 0))
+			free_slot = i;
+	}
+	if (i >= TRACE_MAX_STREAMS) {
+		// Too many concurrent threads => start a batch in the oldest stream
+		if (free_slot < 0) {
+			for (free_slot = 0, i = 1; i < TRACE_MAX_STREAMS; i++)
+				if (trace_streams[i].start < trace_streams[free_slot].start)
+					free_slot = i;
+			TraceFlushStream(&trace_streams[free_slot]);
+		}
+		i = free_slot;
+	}
+	stream = &trace_streams[i];
+	if ((stream->requests != 0) && (now - stream->start > TRACE_IO_BATCH_US))
+		TraceFlushStream(stream);
+	if (stream->requests == 0) {
+		stream->write = bWrite;
+		stream->tid = tid;
+		stream->start = now - min(u64LatencyUs, now - trace_origin);
+		stream->bytes = 0;
+	}
+	stream->end = now;
+	stream->bytes += dwSize;
+	stream->requests++;
+out:
+	LeaveCriticalSection(&trace_lock);
+}
+
+/*
+ * Get the bytes that were written and read so far by the operation in progress, and the time
+ * since it started. Returns FALSE if there is no operation in progress.
+ */
+BOOL TraceGetProgress(uint64_t* written, uint64_t* read, uint64_t* elapsed_us)
+{
+	uint32_t i;
+
+	*written = *read = *elapsed_us = 0;
+	if (!trace_lock_init || (trace_list == NULL))
+		return FALSE;
+	EnterCriticalSection(&trace_lock);
+	if (trace_list != NULL) {
+		for (i = 0; i < nb_trace_phases; i++) {
+			if (strcmp(trace_phases[i].name, "write requests") == 0)
+				*written += trace_phases[i].bytes;
+			else if (strcmp(trace_phases[i].name, "read requests") == 0)
+				*read += trace_phases[i].bytes;
+		}
+		// Include the batches that haven't been flushed yet
+		for (i = 0; i < TRACE_MAX_STREAMS; i++) {
+			if (trace_streams[i].requests != 0)
+				*(trace_streams[i].write ? written : read) += trace_streams[i].bytes;
+		}
+		*elapsed_us = GetIoTimestamp() - trace_origin;
+	}
+	LeaveCriticalSection(&trace_lock);
+	return (*elapsed_us != 0);
+}
+
+// Time, in a unit that is readable for the summary
+static char* TraceTime(uint64_t us)
+{
+	static char str[32];
+
+	if (us < 10000)
+		static_sprintf(str, "%d µs", (int)us);
+	else if (us < 100000000)
+		static_sprintf(str, "%0.1f ms", (double)us / 1000.0);
+	else
+		static_sprintf(str, "%0.1f s", (double)us / 1000000.0);
+	return str;
+}
+
+static BOOL TraceExport(const char* path)
+{
+	uint32_t i;
+	FILE* fd;
+	trace_event* e;
+
+	fd = fopenU(path, "w");
+	if (fd == NULL) {
+		uprintf("Could not create '%s': %s", path, WindowsErrorString());
+		return FALSE;
+	}
+	fprintf(fd, "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"version\":\"%d.%d.%d\",\"operation\":\"%s\","
+		"\"dropped_events\":%d},\n\"traceEvents\":[\n", rufus_version[0], rufus_version[1], rufus_version[2],
+		trace_job, nb_trace_dropped);
+	fprintf(fd, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"" APPLICATION_NAME " %s\"}}",
+		trace_job);
+	for (i = 0; i < nb_trace_events; i++) {
+		e = &trace_list[i];
+		fprintf(fd, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%" PRIu64,
+			e->name, (e->ph == 'X') ? "io" : "phase", e->ph, (int)e->tid, e->ts);
+		if (e->ph == 'X')
+			fprintf(fd, ",\"dur\":%" PRIu64 ",\"args\":{\"bytes\":%" PRIu64 ",\"requests\":%d}}",
+				e->dur, e->bytes, e->requests);
+		else if (e->ph == 'E')
+			fprintf(fd, ",\"args\":{\"bytes\":%" PRIu64 "}}", e->bytes);
+		else
+			fprintf(fd, "}");
+	}
+	fprintf(fd, "\n]}\n");
+	fclose(fd);
+	uprintf("Exported the timeline to '%s'", path);
+	return TRUE;
+}
+
+/*
+ * Stop recording, print the summary of the phases to the log and export the timeline
+ */
+void TraceStop(void)
+{
+	uint32_t i;
+	uint64_t now = GetIoTimestamp(), bytes = 0, read_bytes = 0, duration = 0;
+	char path[MAX_PATH], speed[32], phases[TRACE_MAX_PHASES * 48], *userdir;
+	SYSTEMTIME lt;
+	trace_phase* p;
+
+	if (trace_list == NULL)
+		return;
+	EnterCriticalSection(&trace_lock);
+	for (i = 0; i < TRACE_MAX_STREAMS; i++)
+		TraceFlushStream(&trace_streams[i]);
+	while (nb_trace_open > 0)
+		TraceEndPhase(nb_trace_open - 1, now);
+	LeaveCriticalSection(&trace_lock);
+	if (EtwEnabled(ETW_LEVEL_INFO, ETW_KEYWORD_PHASE))
+		EtwJob(FALSE, trace_job, trace_device, FormatStatus);
+
+	uprintf("Timeline of the %s operation:", trace_job);
+	uprintf("  %-24s %6s %12s %12s %12s", "Phase", "Count", "Time", "Bytes", "Speed");
+	for (i = 0; i < nb_trace_phases; i++) {
+		p = &trace_phases[i];
+		if (p->bytes == 0)
+			static_strcpy(speed, "-");
+		else
+			static_sprintf(speed, "%0.1f MB/s", ((double)p->bytes / (double)MB) * 1000000.0 / (double)max(p->total_us, 1));
+		uprintf("  %-24s %6d %12s %12s %12s", p->name, p->count, TraceTime(p->total_us),
+			(p->bytes == 0) ? "-" : SizeToHumanReadable(p->bytes, FALSE, FALSE), speed);
+	}
+	if (nb_trace_dropped != 0)
+		uprintf("  (%d events were dropped from the timeline)", nb_trace_dropped);
+
+	phases[0] = 0;
+	for (i = 0; i < nb_trace_phases; i++) {
+		p = &trace_phases[i];
+		if (strcmp(p->name, trace_job) == 0)
+			duration = p->total_us;
+		else if (strcmp(p->name, "write requests") == 0)
+			bytes = p->bytes;
+		else if (strcmp(p->name, "read requests") == 0)
+			read_bytes = p->bytes;
+		safe_sprintf(&phases[strlen(phases)], sizeof(phases) - strlen(phases), "%s%s=%" PRIu64 "/%" PRIu64,
+			(i == 0) ? "" : ";", p->name, p->total_us / 1000, p->bytes);
+		AddPhaseMetrics(p->name, p->count, p->total_us, p->bytes);
+	}
+	// Operations that don't write, such as saving a drive to an image, are measured by what they read
+	AddDeviceHistory(trace_job, FormatStatus, (bytes != 0) ? bytes : read_bytes, duration, phases);
+	AddJobMetrics(trace_job, trace_device, FormatStatus, bytes, read_bytes, duration);
+
+	if (export_timeline) {
+		userdir = getenvU("USERPROFILE");
+		GetLocalTime(&lt);
+		static_sprintf(path, "%s\\rufus_%04d%02d%02d_%02d%02d%02d_disk%d_%s_timeline.json", userdir,
+			lt.wYear, lt.wMonth, lt.wDay, lt.wHour, lt.wMinute, lt.wSecond, (int)trace_device, trace_job);
+		safe_free(userdir);
+		TraceExport(path);
+	}
+	EnterCriticalSection(&trace_lock);
+	safe_free(trace_list);
+	LeaveCriticalSection(&trace_lock);
+}
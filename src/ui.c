@@ -1247,6 +1247,10 @@ void UpdateProgress(int op, float percent)
 		duprintf("UpdateProgress: invalid op %d\n", op);
 		return;
 	}
+	if (headless) {
+		HeadlessProgress(op, percent);
+		return;
+	}
 	if (percent > 100.1f) {
 		// duprintf("UpdateProgress(%d): invalid percentage %0.2f\n", op, percent);
 		return;
@@ -1385,11 +1389,108 @@ static void bar_update(struct bar_progress* bp, uint64_t howmuch, uint64_t dltim
 		hist->pos = 0;
 }
 
+/*
+ * The I/O loops only publish their progress here, which is then picked up by a sampler
+ * thread at PROGRESS_SAMPLE_INTERVAL, so that the speed/ETA computations and the cross
+ * thread messages to the UI stay out of the data path, however often progress is reported.
+ */
+static struct {
+	volatile LONG64 processed;
+	volatile LONG64 total;
+	volatile LONG op;
+	volatile LONG msg;
+	volatile LONG pending;
+} progress_sample = { 0 };
+static CRITICAL_SECTION progress_lock;
+static HANDLE hProgressSampleEvent = NULL;
+static BOOL progress_sampler_active = FALSE;
+static volatile uint64_t progress_speed_hint = 0;
+static void RefreshProgressWithInfo(int op, int msg, uint64_t processed, uint64_t total, BOOL force);
+
+static DWORD WINAPI ProgressSamplerThread(void* param)
+{
+	while (WaitForSingleObject(hProgressSampleEvent, INFINITE) == WAIT_OBJECT_0) {
+		// Coalesce everything that was published during an interval into a single refresh
+		do {
+			Sleep(PROGRESS_SAMPLE_INTERVAL);
+			EnterCriticalSection(&progress_lock);
+			if (InterlockedExchange(&progress_sample.pending, 0))
+				RefreshProgressWithInfo(progress_sample.op, progress_sample.msg,
+					(uint64_t)progress_sample.processed, (uint64_t)progress_sample.total, FALSE);
+			LeaveCriticalSection(&progress_lock);
+		} while (progress_sample.pending);
+	}
+	return 0;
+}
+
+static void InitProgressSampler(void)
+{
+	// 0 = not initialized, 1 = initializing, 2 = initialized
+	static volatile LONG state = 0;
+	HANDLE hThread;
+
+	if (InterlockedCompareExchange(&state, 1, 0) == 0) {
+		InitializeCriticalSection(&progress_lock);
+		hProgressSampleEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (hProgressSampleEvent != NULL) {
+			hThread = CreateThread(NULL, 0, ProgressSamplerThread, NULL, 0, NULL);
+			if (hThread != NULL) {
+				progress_sampler_active = TRUE;
+				CloseHandle(hThread);
+			} else {
+				uprintf("Could not create progress sampler thread: %s", WindowsErrorString());
+			}
+		}
+		InterlockedExchange(&state, 2);
+	}
+	while (state != 2)
+		Sleep(0);
+}
+
 // This updates the progress bar as well as the data displayed on it so that we can
 // display percentage completed, rate of transfer and estimated remaining duration.
 // During init (op = OP_INIT) an optional HWND can be passed on which to look for
-// a progress bar. Part of the code (eta, speed) comes from GNU wget.
+// a progress bar.
+// Unless forced, or for the final update of an operation, this only publishes the
+// progress values, that the sampler thread then displays at a lower frequency.
 void _UpdateProgressWithInfo(int op, int msg, uint64_t processed, uint64_t total, BOOL force)
+{
+	if (headless) {
+		if (total != 0)
+			HeadlessProgress(op, (float)((100.0 * processed) / (1.0 * total)));
+		return;
+	}
+
+	if ((op != OP_INIT) && (!force) && (processed < total) && (progress_sampler_active)) {
+		progress_sample.op = op;
+		progress_sample.msg = msg;
+		InterlockedExchange64(&progress_sample.total, (LONG64)total);
+		InterlockedExchange64(&progress_sample.processed, (LONG64)processed);
+		if (!progress_sample.pending) {
+			InterlockedExchange(&progress_sample.pending, 1);
+			SetEvent(hProgressSampleEvent);
+		}
+		return;
+	}
+
+	InitProgressSampler();
+	EnterCriticalSection(&progress_lock);
+	// Anything that was published before this update is now stale
+	InterlockedExchange(&progress_sample.pending, 0);
+	RefreshProgressWithInfo(op, msg, processed, total, force);
+	LeaveCriticalSection(&progress_lock);
+}
+
+// Set the speed (in bytes per second) the operation is expected to run at, from the device
+// history, so that we can display an ETA before we have enough measurements of our own.
+// This must be called after UpdateProgressWithInfoInit(), which resets it.
+void SetProgressSpeedHint(uint64_t speed)
+{
+	progress_speed_hint = speed;
+}
+
+// Must be called with progress_lock held. Part of the code (eta, speed) comes from GNU wget.
+static void RefreshProgressWithInfo(int op, int msg, uint64_t processed, uint64_t total, BOOL force)
 {
 	static int last_update_progress_type = UPT_PERCENT;
 	static struct bar_progress bp = { 0 };
@@ -1407,6 +1508,7 @@ void _UpdateProgressWithInfo(int op, int msg, uint64_t processed, uint64_t total
 		last_update_progress_type = UPT_PERCENT;
 		percent = 0.0f;
 		speed = 0;
+		progress_speed_hint = 0;
 		memset(&bp, 0, sizeof(bp));
 		bp.total_length = total;
 		hProgressBar = NULL;
@@ -1479,6 +1581,10 @@ void _UpdateProgressWithInfo(int op, int msg, uint64_t processed, uint64_t total
 					bp.last_eta_time = dl_total_time;
 				}
 				static_sprintf(msg_data, "%d:%02d:%02d", eta / 3600, (uint16_t)((eta % 3600) / 60), (uint16_t)(eta % 60));
+			} else if ((progress_speed_hint != 0) && (bp.total_length > processed) &&
+				((bp.total_length - processed) / progress_speed_hint < INT_MAX - 1)) {
+				uint32_t eta = (uint32_t)((bp.total_length - processed) / progress_speed_hint);
+				static_sprintf(msg_data, "%d:%02d:%02d", eta / 3600, (uint16_t)((eta % 3600) / 60), (uint16_t)(eta % 60));
 			} else {
 			skip_eta:
 				static_sprintf(msg_data, "-:--:--");
@@ -1558,6 +1664,10 @@ void SetPassesTooltip(void)
 	{ BADBLOCK_PATTERN_ONE_PASS, BADBLOCK_PATTERN_TWO_PASSES, BADBLOCK_PATTERN_SLC,
 	  BADCLOCK_PATTERN_MLC, BADBLOCK_PATTERN_TLC };
 	int sel = ComboBox_GetCurSel(hNBPasses);
+	if (sel == BADBLOCK_CAPACITY_CHECK) {
+		CreateTooltip(hNBPasses, lmprintf(MSG_327), -1);
+		return;
+	}
 	CreateTooltip(hNBPasses, lmprintf(MSG_153 + ((sel >= 2) ? 3 : sel),
 		pattern[sel][0], pattern[sel][1], pattern[sel][2], pattern[sel][3]), -1);
 }
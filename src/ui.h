@@ -71,6 +71,9 @@ enum update_progress_type {
 // This allows ETA to change approximately once per second.
 #define ETA_REFRESH_INTERVAL 990
 
+// How often the progress published by the I/O loops is sampled and displayed (10 Hz).
+#define PROGRESS_SAMPLE_INTERVAL 100
+
 extern HWND hMultiToolbar, hSaveToolbar, hHashToolbar, hAdvancedDeviceToolbar, hAdvancedFormatToolbar;
 extern HFONT hInfoFont;
 extern UINT_PTR UM_LANGUAGE_MENU_MAX;
@@ -22,6 +22,7 @@
 #include <io.h>
 #include <rpc.h>
 #include <time.h>
+#include <virtdisk.h>
 
 #include "rufus.h"
 #include "missing.h"
@@ -49,11 +50,43 @@
 #define VHD_FOOTER_TYPE_DYNAMIC_HARD_DISK	0x00000003
 #define VHD_FOOTER_TYPE_DIFFER_HARD_DISK	0x00000004
 
+#define VHD_DYNAMIC_COOKIE					{ 'c', 'x', 's', 'p', 'a', 'r', 's', 'e' }
+#define VHD_DYNAMIC_HEADER_VERSION_V1_0		0x00010000
+#define VHD_DYNAMIC_HEADER_OFFSET			512
+#define VHD_DYNAMIC_BAT_OFFSET				(VHD_DYNAMIC_HEADER_OFFSET + 1024)
+#define VHD_DYNAMIC_BLOCK_SIZE				(2 * 1024 * 1024)
+
+#define COMPRESSOR_PIPE_SIZE				(1024 * 1024)
+
+#define VHDX_SIGNATURE						0x656C696678646876ULL	// "vhdxfile"
+#define VHDX_HEADER_SIGNATURE				0x64616568				// "head"
+#define VHDX_REGION_SIGNATURE				0x69676572				// "regi"
+#define VHDX_METADATA_SIGNATURE				0x617461646174656DULL	// "metadata"
+#define VHDX_HEADER1_OFFSET					(64 * 1024)
+#define VHDX_HEADER2_OFFSET					(128 * 1024)
+#define VHDX_REGION_TABLE_OFFSET			(192 * 1024)
+#define VHDX_MAX_REGION_ENTRIES				2047
+#define VHDX_MAX_METADATA_ENTRIES			2047
+#define VHDX_FILE_PARAMETERS_HAS_PARENT		0x00000002
+#define VHDX_PAYLOAD_BLOCK_STATE_MASK		0x07
+#define VHDX_PAYLOAD_BLOCK_FULLY_PRESENT	6
+#define VHDX_PAYLOAD_BLOCK_PARTIALLY_PRESENT	7
+
+#define FFU_SECURITY_SIGNATURE				"SignedImage "
+#define FFU_IMAGE_SIGNATURE					"ImageFlash  "
+#define FFU_ALG_SHA256						0x0000800C	// CALG_SHA_256
+#define FFU_STORE_HEADER_V1_SIZE			248
+#define FFU_DISK_BEGIN						0
+#define FFU_DISK_END						2
+#define FFU_MAX_DESCRIPTORS_SIZE			(64 * MB)
+
 #define WIM_MAGIC							0x0000004D4957534DULL	// "MSWIM\0\0\0"
 #define WIM_HAS_API_EXTRACT					1
 #define WIM_HAS_7Z_EXTRACT					2
 #define WIM_HAS_API_APPLY					4
 #define WIM_HAS_EXTRACT(r)					(r & (WIM_HAS_API_EXTRACT|WIM_HAS_7Z_EXTRACT))
+#define WIM_RESHDR_FLAG_COMPRESSED			0x04
+#define WIM_MAX_XML_SIZE					(16 * MB)
 
 #define SECONDS_SINCE_JAN_1ST_2000			946684800
 
@@ -68,6 +101,7 @@
 #define WIM_FLAG_SHARE_WRITE				0x00000040
 #define WIM_FLAG_FILEINFO					0x00000080
 #define WIM_FLAG_NO_RP_FIX					0x00000100
+#define WIM_FLAG_APPLY_COMPACT				0x00004000	// Windows 10 or later
 
 // Bitmask for the kind of progress we want to report in the WIM progress callback
 #define WIM_REPORT_PROGRESS					0x00000001
@@ -130,8 +164,163 @@ typedef struct vhd_footer {
 	uint8_t		saved_state;
 	uint8_t		reserved[427];
 } vhd_footer;
+
+// VHD Dynamic disk header (Big Endian)
+typedef struct vhd_dynamic_header {
+	char		cookie[8];
+	uint64_t	data_offset;
+	uint64_t	table_offset;
+	uint32_t	header_version;
+	uint32_t	max_table_entries;
+	uint32_t	block_size;
+	uint32_t	checksum;
+	uuid_t		parent_unique_id;
+	uint32_t	parent_timestamp;
+	uint32_t	reserved1;
+	uint16_t	parent_unicode_name[256];
+	uint8_t		parent_locator_entry[8][24];
+	uint8_t		reserved2[256];
+} vhd_dynamic_header;
+
+/*
+ * VHDX structures (Little Endian)
+ * https://docs.microsoft.com/en-us/openspecs/windows_protocols/ms-vhdx/83e061f8-f6e2-4de1-91bd-5d518a43d477
+ */
+typedef struct vhdx_header {
+	uint32_t	signature;
+	uint32_t	checksum;
+	uint64_t	sequence_number;
+	GUID		file_write_guid;
+	GUID		data_write_guid;
+	GUID		log_guid;
+	uint16_t	log_version;
+	uint16_t	version;
+	uint32_t	log_length;
+	uint64_t	log_offset;
+} vhdx_header;
+
+typedef struct vhdx_region_table_header {
+	uint32_t	signature;
+	uint32_t	checksum;
+	uint32_t	entry_count;
+	uint32_t	reserved;
+} vhdx_region_table_header;
+
+typedef struct vhdx_region_table_entry {
+	GUID		guid;
+	uint64_t	file_offset;
+	uint32_t	length;
+	uint32_t	required;
+} vhdx_region_table_entry;
+
+typedef struct vhdx_metadata_table_header {
+	uint64_t	signature;
+	uint16_t	reserved;
+	uint16_t	entry_count;
+	uint32_t	reserved2[5];
+} vhdx_metadata_table_header;
+
+typedef struct vhdx_metadata_table_entry {
+	GUID		item_id;
+	uint32_t	offset;
+	uint32_t	length;
+	uint32_t	flags;
+	uint32_t	reserved;
+} vhdx_metadata_table_entry;
+
+/*
+ * FFU structures (Little Endian)
+ * https://docs.microsoft.com/en-us/windows-hardware/manufacture/mobile/ffu-image-format
+ */
+typedef struct ffu_security_header {
+	uint32_t	size;
+	char		signature[12];
+	uint32_t	chunk_size_kb;
+	uint32_t	alg_id;
+	uint32_t	catalog_size;
+	uint32_t	hash_table_size;
+} ffu_security_header;
+
+typedef struct ffu_image_header {
+	uint32_t	size;
+	char		signature[12];
+	uint32_t	manifest_length;
+	uint32_t	chunk_size;
+} ffu_image_header;
+
+typedef struct ffu_store_header {
+	uint32_t	update_type;
+	uint16_t	major_version;
+	uint16_t	minor_version;
+	uint16_t	full_flash_major_version;
+	uint16_t	full_flash_minor_version;
+	char		platform_id[192];
+	uint32_t	block_size;
+	uint32_t	write_descriptor_count;
+	uint32_t	write_descriptor_length;
+	uint32_t	validate_descriptor_count;
+	uint32_t	validate_descriptor_length;
+	uint32_t	initial_table_index;
+	uint32_t	initial_table_count;
+	uint32_t	flash_only_table_index;
+	uint32_t	flash_only_table_count;
+	uint32_t	final_table_index;
+	uint32_t	final_table_count;
+	// Version 2 only
+	uint16_t	nb_stores;
+	uint16_t	store_index;
+	uint64_t	store_payload_size;
+	uint16_t	device_path_length;
+} ffu_store_header;
+
+typedef struct ffu_block_data_entry {
+	uint32_t	location_count;
+	uint32_t	block_count;
+} ffu_block_data_entry;
+
+typedef struct ffu_disk_location {
+	uint32_t	access_method;
+	uint32_t	block_index;
+} ffu_disk_location;
+
+// WIM header, from https://docs.microsoft.com/en-us/previous-versions/windows/desktop/legacy/aa387941(v=vs.85)
+typedef struct wim_reshdr {
+	uint8_t		size[7];
+	uint8_t		flags;
+	uint64_t	offset;
+	uint64_t	original_size;
+} wim_reshdr;
+
+typedef struct wim_header {
+	uint64_t	tag;
+	uint32_t	size;
+	uint32_t	version;
+	uint32_t	flags;
+	uint32_t	compression_size;
+	GUID		guid;
+	uint16_t	part_number;
+	uint16_t	total_parts;
+	uint32_t	image_count;
+	wim_reshdr	offset_table;
+	wim_reshdr	xml_data;
+	wim_reshdr	boot_metadata;
+	uint32_t	boot_index;
+	wim_reshdr	integrity;
+	uint8_t		unused[60];
+} wim_header;
 #pragma pack(pop)
 
+static const GUID vhdx_bat_guid =
+	{ 0x2dc27766, 0xf623, 0x4200, { 0x9d, 0x64, 0x11, 0x5e, 0x9b, 0xfd, 0x4a, 0x08 } };
+static const GUID vhdx_metadata_guid =
+	{ 0x8b7ca206, 0x4790, 0x4b9a, { 0xb8, 0xfe, 0x57, 0x5f, 0x05, 0x0f, 0x88, 0x6e } };
+static const GUID vhdx_file_parameters_guid =
+	{ 0xcaa16737, 0xfa36, 0x4d43, { 0xb3, 0xb6, 0x33, 0xf0, 0xaa, 0x44, 0xe7, 0x6b } };
+static const GUID vhdx_virtual_disk_size_guid =
+	{ 0x2fa54224, 0xcd1b, 0x4876, { 0xb2, 0x11, 0x5d, 0xbe, 0xd8, 0x3b, 0xf4, 0xb8 } };
+static const GUID vhdx_logical_sector_size_guid =
+	{ 0x8141bf1d, 0xa96f, 0x4709, { 0xba, 0x47, 0xf2, 0x33, 0xa8, 0xfa, 0xab, 0x5f } };
+
 // WIM API Prototypes
 #define WIM_GENERIC_READ            GENERIC_READ
 #define WIM_OPEN_EXISTING           OPEN_EXISTING
@@ -144,6 +333,7 @@ PF_TYPE_DECL(WINAPI, BOOL, WIMUnmountImage, (PCWSTR, PCWSTR, DWORD, BOOL));
 PF_TYPE_DECL(WINAPI, BOOL, WIMApplyImage, (HANDLE, PCWSTR, DWORD));
 PF_TYPE_DECL(WINAPI, BOOL, WIMExtractImagePath, (HANDLE, PWSTR, PWSTR, DWORD));
 PF_TYPE_DECL(WINAPI, BOOL, WIMGetImageInformation, (HANDLE, PVOID, PDWORD));
+PF_TYPE_DECL(WINAPI, BOOL, WIMSplitFile, (HANDLE, PCWSTR, PLARGE_INTEGER, DWORD));
 PF_TYPE_DECL(WINAPI, BOOL, WIMCloseHandle, (HANDLE));
 PF_TYPE_DECL(WINAPI, DWORD, WIMRegisterMessageCallback, (HANDLE, FARPROC, PVOID));
 PF_TYPE_DECL(WINAPI, DWORD, WIMUnregisterMessageCallback, (HANDLE, FARPROC));
@@ -152,7 +342,7 @@ PF_TYPE_DECL(RPC_ENTRY, RPC_STATUS, UuidCreate, (UUID __RPC_FAR*));
 uint32_t wim_nb_files, wim_proc_files, wim_extra_files;
 HANDLE wim_thread = NULL;
 extern int default_thread_priority;
-extern BOOL ignore_boot_marker;
+extern BOOL ignore_boot_marker, verify_write, compact_apply;
 
 static uint8_t wim_flags = 0;
 static uint32_t progress_report_mask;
@@ -161,8 +351,22 @@ static wchar_t wmount_path[MAX_PATH] = { 0 }, wmount_track[MAX_PATH] = { 0 };
 static char sevenzip_path[MAX_PATH];
 static const char conectix_str[] = VHD_FOOTER_COOKIE;
 static BOOL count_files;
+// When set, the WIM apply progress is on the file data, and the "files" above are KB of data
+static uint64_t wim_total_bytes = 0, wim_proc_bytes = 0;
+// Dynamic VHD and compressed image save
+static struct {
+	HANDLE handle;
+	vhd_footer* footer;
+	uint32_t* bat;
+	uint32_t nb_blocks;
+	uint64_t bat_size;
+	uint64_t next_block;
+	uint8_t bitmap[VHD_DYNAMIC_BLOCK_SIZE / 512 / 8];
+} dyn_vhd = { 0 };
+static PROCESS_INFORMATION compressor_pi = { 0 };
 // Apply/Mount image functionality
 static const char *_image, *_dst;
+static uint64_t _part_size;
 static int _index, progress_op = OP_FILE_COPY, progress_msg = MSG_267;
 
 static BOOL Get7ZipPath(void)
@@ -175,15 +379,13 @@ static BOOL Get7ZipPath(void)
 	return FALSE;
 }
 
-BOOL AppendVHDFooter(const char* vhd_path)
+/*
+ * Fill a VHD footer for a disk of 'size' bytes, including its CHS geometry and checksum
+ */
+static void SetVHDFooter(vhd_footer* footer, uint64_t size, uint32_t disk_type, uint64_t data_offset)
 {
 	const char creator_os[4] = VHD_FOOTER_CREATOR_HOST_OS_WINDOWS;
 	const char creator_app[4] = { 'r', 'u', 'f', 's' };
-	BOOL r = FALSE;
-	DWORD size;
-	LARGE_INTEGER li;
-	HANDLE handle = INVALID_HANDLE_VALUE;
-	vhd_footer* footer = NULL;
 	uint64_t totalSectors;
 	uint16_t cylinders = 0;
 	uint8_t heads, sectorsPerTrack;
@@ -192,35 +394,23 @@ BOOL AppendVHDFooter(const char* vhd_path)
 	size_t i;
 
 	PF_INIT(UuidCreate, Rpcrt4);
-	handle = CreateFileU(vhd_path, GENERIC_WRITE, FILE_SHARE_WRITE, NULL,
-		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-	li.QuadPart = 0;
-	if ((handle == INVALID_HANDLE_VALUE) || (!SetFilePointerEx(handle, li, &li, FILE_END))) {
-		uprintf("Could not open image '%s': %s", vhd_path, WindowsErrorString());
-		goto out;
-	}
-	footer = (vhd_footer*)calloc(1, sizeof(vhd_footer));
-	if (footer == NULL) {
-		uprintf("Could not allocate VHD footer");
-		goto out;
-	}
-
+	memset(footer, 0, sizeof(vhd_footer));
 	memcpy(footer->cookie, conectix_str, sizeof(footer->cookie));
 	footer->features = bswap_uint32(VHD_FOOTER_FEATURES_RESERVED);
 	footer->file_format_version = bswap_uint32(VHD_FOOTER_FILE_FORMAT_V1_0);
-	footer->data_offset = bswap_uint64(VHD_FOOTER_DATA_OFFSET_FIXED_DISK);
+	footer->data_offset = bswap_uint64(data_offset);
 	footer->timestamp = bswap_uint32((uint32_t)(_time64(NULL) - SECONDS_SINCE_JAN_1ST_2000));
 	memcpy(footer->creator_app, creator_app, sizeof(creator_app));
 	footer->creator_version = bswap_uint32((rufus_version[0]<<16)|rufus_version[1]);
 	memcpy(footer->creator_host_os, creator_os, sizeof(creator_os));
-	footer->original_size = bswap_uint64(li.QuadPart);
+	footer->original_size = bswap_uint64(size);
 	footer->current_size = footer->original_size;
-	footer->disk_type = bswap_uint32(VHD_FOOTER_TYPE_FIXED_HARD_DISK);
+	footer->disk_type = bswap_uint32(disk_type);
 	if ((pfUuidCreate == NULL) || (pfUuidCreate(&footer->unique_id) != RPC_S_OK))
 		uprintf("Warning: could not set VHD UUID");
 
 	// Compute CHS, as per the VHD specs
-	totalSectors = li.QuadPart / 512;
+	totalSectors = size / 512;
 	if (totalSectors > 65535 * 16 * 255) {
 		totalSectors = 65535 * 16 * 255;
 	}
@@ -258,6 +448,29 @@ BOOL AppendVHDFooter(const char* vhd_path)
 	for (checksum=0, i=0; i<sizeof(vhd_footer); i++)
 		checksum += ((uint8_t*)footer)[i];
 	footer->checksum = bswap_uint32(~checksum);
+}
+
+BOOL AppendVHDFooter(const char* vhd_path)
+{
+	BOOL r = FALSE;
+	DWORD size;
+	LARGE_INTEGER li;
+	HANDLE handle = INVALID_HANDLE_VALUE;
+	vhd_footer* footer = NULL;
+
+	handle = CreateFileU(vhd_path, GENERIC_WRITE, FILE_SHARE_WRITE, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	li.QuadPart = 0;
+	if ((handle == INVALID_HANDLE_VALUE) || (!SetFilePointerEx(handle, li, &li, FILE_END))) {
+		uprintf("Could not open image '%s': %s", vhd_path, WindowsErrorString());
+		goto out;
+	}
+	footer = (vhd_footer*)calloc(1, sizeof(vhd_footer));
+	if (footer == NULL) {
+		uprintf("Could not allocate VHD footer");
+		goto out;
+	}
+	SetVHDFooter(footer, li.QuadPart, VHD_FOOTER_TYPE_FIXED_HARD_DISK, VHD_FOOTER_DATA_OFFSET_FIXED_DISK);
 
 	if (!WriteFileWithRetry(handle, footer, sizeof(vhd_footer), &size, WRITE_RETRIES)) {
 		uprintf("Could not write VHD footer: %s", WindowsErrorString());
@@ -271,6 +484,678 @@ out:
 	return r;
 }
 
+/*
+ * Write 'size' bytes at 'offset' of a file, retrying on error.
+ */
+static BOOL WriteVHDData(HANDLE handle, const void* buf, DWORD size, uint64_t offset)
+{
+	DWORD wSize;
+	LARGE_INTEGER li;
+
+	li.QuadPart = offset;
+	if (!SetFilePointerEx(handle, li, NULL, FILE_BEGIN)) {
+		uprintf("Could not set VHD position: %s", WindowsErrorString());
+		return FALSE;
+	}
+	if (!WriteFileWithRetry(handle, buf, size, &wSize, WRITE_RETRIES)) {
+		uprintf("Could not write VHD data: %s", WindowsErrorString());
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Dynamic VHD writer, for saving a drive without allocating its zeroed blocks.
+ * The layout is: footer copy, dynamic disk header, BAT, allocated blocks, footer.
+ * Blocks must be provided in sequence, as they are allocated in the order they come.
+ */
+BOOL CreateDynamicVHD(HANDLE hVHD, uint64_t disk_size)
+{
+	const char cxsparse_str[] = VHD_DYNAMIC_COOKIE;
+	uint32_t checksum, i;
+	vhd_dynamic_header* header = NULL;
+
+	memset(&dyn_vhd, 0, sizeof(dyn_vhd));
+	dyn_vhd.handle = hVHD;
+	dyn_vhd.nb_blocks = (uint32_t)((disk_size + VHD_DYNAMIC_BLOCK_SIZE - 1) / VHD_DYNAMIC_BLOCK_SIZE);
+	dyn_vhd.bat_size = ((uint64_t)dyn_vhd.nb_blocks * sizeof(uint32_t) + 511) & ~511ULL;
+	dyn_vhd.next_block = VHD_DYNAMIC_BAT_OFFSET + dyn_vhd.bat_size;
+	dyn_vhd.footer = (vhd_footer*)calloc(1, sizeof(vhd_footer));
+	// Unallocated BAT entries are 0xFFFFFFFF
+	dyn_vhd.bat = (uint32_t*)malloc((size_t)dyn_vhd.bat_size);
+	header = (vhd_dynamic_header*)calloc(1, sizeof(vhd_dynamic_header));
+	if ((dyn_vhd.footer == NULL) || (dyn_vhd.bat == NULL) || (header == NULL)) {
+		uprintf("Could not allocate dynamic VHD structures");
+		goto out;
+	}
+	memset(dyn_vhd.bat, 0xFF, (size_t)dyn_vhd.bat_size);
+	memset(dyn_vhd.bitmap, 0xFF, sizeof(dyn_vhd.bitmap));
+	SetVHDFooter(dyn_vhd.footer, disk_size, VHD_FOOTER_TYPE_DYNAMIC_HARD_DISK, VHD_DYNAMIC_HEADER_OFFSET);
+
+	memcpy(header->cookie, cxsparse_str, sizeof(header->cookie));
+	header->data_offset = bswap_uint64(VHD_FOOTER_DATA_OFFSET_FIXED_DISK);
+	header->table_offset = bswap_uint64(VHD_DYNAMIC_BAT_OFFSET);
+	header->header_version = bswap_uint32(VHD_DYNAMIC_HEADER_VERSION_V1_0);
+	header->max_table_entries = bswap_uint32(dyn_vhd.nb_blocks);
+	header->block_size = bswap_uint32(VHD_DYNAMIC_BLOCK_SIZE);
+	for (checksum = 0, i = 0; i < sizeof(vhd_dynamic_header); i++)
+		checksum += ((uint8_t*)header)[i];
+	header->checksum = bswap_uint32(~checksum);
+
+	if (!WriteVHDData(hVHD, dyn_vhd.footer, sizeof(vhd_footer), 0) ||
+		!WriteVHDData(hVHD, header, sizeof(vhd_dynamic_header), VHD_DYNAMIC_HEADER_OFFSET))
+		goto out;
+	free(header);
+	return TRUE;
+
+out:
+	free(header);
+	safe_free(dyn_vhd.footer);
+	safe_free(dyn_vhd.bat);
+	return FALSE;
+}
+
+BOOL WriteDynamicVHD(const uint8_t* buf, DWORD size, uint64_t offset, uint64_t* skipped_size)
+{
+	DWORD pos, len;
+	uint32_t block;
+
+	if ((dyn_vhd.bat == NULL) || (offset % VHD_DYNAMIC_BLOCK_SIZE != 0))
+		return FALSE;
+	for (pos = 0; pos < size; pos += len) {
+		len = min(VHD_DYNAMIC_BLOCK_SIZE, size - pos);
+		block = (uint32_t)((offset + pos) / VHD_DYNAMIC_BLOCK_SIZE);
+		if (block >= dyn_vhd.nb_blocks)
+			return FALSE;
+		if (IsBufferZero(&buf[pos], len)) {
+			*skipped_size += len;
+			continue;
+		}
+		// Each allocated block is its sector bitmap, followed by the data. The unwritten
+		// part of a last partial block is zeroed when the file is extended for the footer.
+		if (!WriteVHDData(dyn_vhd.handle, dyn_vhd.bitmap, sizeof(dyn_vhd.bitmap), dyn_vhd.next_block) ||
+			!WriteVHDData(dyn_vhd.handle, &buf[pos], len, dyn_vhd.next_block + sizeof(dyn_vhd.bitmap)))
+			return FALSE;
+		dyn_vhd.bat[block] = bswap_uint32((uint32_t)(dyn_vhd.next_block / 512));
+		dyn_vhd.next_block += sizeof(dyn_vhd.bitmap) + VHD_DYNAMIC_BLOCK_SIZE;
+	}
+	return TRUE;
+}
+
+BOOL CloseDynamicVHD(BOOL finalize)
+{
+	BOOL r = !finalize;
+
+	if (dyn_vhd.bat == NULL)
+		return FALSE;
+	if (finalize) {
+		r = WriteVHDData(dyn_vhd.handle, dyn_vhd.bat, (DWORD)dyn_vhd.bat_size, VHD_DYNAMIC_BAT_OFFSET) &&
+			WriteVHDData(dyn_vhd.handle, dyn_vhd.footer, sizeof(vhd_footer), dyn_vhd.next_block) &&
+			SetEndOfFile(dyn_vhd.handle);
+		if (r)
+			uprintf("Dynamic VHD: Allocated %s for %d blocks of %s", SizeToHumanReadable(dyn_vhd.next_block, FALSE, FALSE),
+				dyn_vhd.nb_blocks, SizeToHumanReadable(VHD_DYNAMIC_BLOCK_SIZE, FALSE, FALSE));
+	}
+	safe_free(dyn_vhd.footer);
+	safe_free(dyn_vhd.bat);
+	return r;
+}
+
+/*
+ * Start a 7-Zip process that compresses its standard input into image_path, using
+ * its multithreaded encoders. Returns the pipe the image data is to be written to.
+ * NB: The zstd encoder is only available in the 7-Zip-zstd fork.
+ */
+HANDLE StartImageCompressor(const char* image_path, uint8_t compression_type)
+{
+	char cmdline[3 * MAX_PATH];
+	STARTUPINFOA si = { 0 };
+	SECURITY_ATTRIBUTES sa = { sizeof(SECURITY_ATTRIBUTES), NULL, TRUE };
+	HANDLE hRead = INVALID_HANDLE_VALUE, hWrite = INVALID_HANDLE_VALUE, hNul = INVALID_HANDLE_VALUE;
+
+	if (!Get7ZipPath()) {
+		uprintf("7-Zip is required to save compressed images, but it could not be found");
+		SetLastError(ERROR_FILE_NOT_FOUND);
+		return INVALID_HANDLE_VALUE;
+	}
+	// 7-Zip can't update a single file archive, so an existing one needs to go first
+	DeleteFileU(image_path);
+	hNul = CreateFileA("NUL", GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, &sa, OPEN_EXISTING, 0, NULL);
+	if (!CreatePipe(&hRead, &hWrite, &sa, COMPRESSOR_PIPE_SIZE)) {
+		uprintf("Could not set compressor pipe: %s", WindowsErrorString());
+		goto out;
+	}
+	// Our end of the pipe must not be inherited, else 7-Zip never sees the end of the stream
+	SetHandleInformation(hWrite, HANDLE_FLAG_INHERIT, 0);
+	si.cb = sizeof(si);
+	si.dwFlags = STARTF_USESHOWWINDOW | STARTF_USESTDHANDLES;
+	si.wShowWindow = SW_HIDE;
+	si.hStdInput = hRead;
+	si.hStdOutput = hNul;
+	si.hStdError = hNul;
+	static_sprintf(cmdline, "\"%s\" a -t%s -mmt=on -si -bd -y \"%s\"", sevenzip_path,
+		(compression_type == BLED_COMPRESSION_ZSTD) ? "zstd" : "xz", image_path);
+	uprintf("Compressing with: %s", cmdline);
+	memset(&compressor_pi, 0, sizeof(compressor_pi));
+	if (!CreateProcessU(NULL, cmdline, NULL, NULL, TRUE, NORMAL_PRIORITY_CLASS | CREATE_NO_WINDOW,
+		NULL, NULL, &si, &compressor_pi)) {
+		uprintf("Unable to launch 7-Zip: %s", WindowsErrorString());
+		safe_closehandle(hWrite);
+	}
+
+out:
+	safe_closehandle(hRead);
+	safe_closehandle(hNul);
+	return hWrite;
+}
+
+/*
+ * Close the compressor pipe and wait for 7-Zip to complete the image, or kill it on abort.
+ */
+BOOL StopImageCompressor(HANDLE hPipe, BOOL abort)
+{
+	DWORD ret = ERROR_INVALID_HANDLE;
+
+	safe_closehandle(hPipe);
+	if (compressor_pi.hProcess == NULL)
+		return FALSE;
+	if (abort)
+		TerminateProcess(compressor_pi.hProcess, ERROR_CANCELLED);
+	WaitForSingleObject(compressor_pi.hProcess, INFINITE);
+	if (!GetExitCodeProcess(compressor_pi.hProcess, &ret))
+		ret = GetLastError();
+	CloseHandle(compressor_pi.hProcess);
+	CloseHandle(compressor_pi.hThread);
+	memset(&compressor_pi, 0, sizeof(compressor_pi));
+	if (!abort && (ret != 0))
+		uprintf("7-Zip exited with error code %d", ret);
+	return (ret == 0);
+}
+
+static BOOL ReadVHDData(HANDLE handle, void* buf, DWORD size, uint64_t offset)
+{
+	DWORD rSize;
+	LARGE_INTEGER li;
+
+	li.QuadPart = offset;
+	return SetFilePointerEx(handle, li, NULL, FILE_BEGIN) &&
+		ReadFile(handle, buf, size, &rSize, NULL) && (rSize == size);
+}
+
+static VDISK_MAP* AllocVirtualDiskMap(uint64_t disk_size, uint32_t block_size)
+{
+	VDISK_MAP* map;
+
+	if ((disk_size == 0) || (block_size == 0) || (block_size % 512 != 0) ||
+		((disk_size + block_size - 1) / block_size > UINT32_MAX))
+		return NULL;
+	map = (VDISK_MAP*)calloc(1, sizeof(VDISK_MAP));
+	if (map == NULL)
+		return NULL;
+	map->disk_size = disk_size;
+	map->block_size = block_size;
+	map->nb_blocks = (uint32_t)((disk_size + block_size - 1) / block_size);
+	map->block = (uint64_t*)calloc(map->nb_blocks, sizeof(uint64_t));
+	if (map->block == NULL)
+		safe_free(map);
+	return map;
+}
+
+void FreeVirtualDiskMap(VDISK_MAP* map)
+{
+	if (map == NULL)
+		return;
+	free(map->block);
+	free(map);
+}
+
+/*
+ * Read the block allocation table of a dynamic VHD, from the footer at the end of the image
+ */
+static VDISK_MAP* GetDynamicVHDMap(HANDLE handle, vhd_footer* footer)
+{
+	const char cxsparse_str[] = VHD_DYNAMIC_COOKIE;
+	VDISK_MAP* map = NULL;
+	vhd_dynamic_header* header = NULL;
+	uint32_t *bat = NULL, i, block_size, bat_entries, bitmap_size;
+
+	header = (vhd_dynamic_header*)malloc(sizeof(vhd_dynamic_header));
+	if ((header == NULL) || !ReadVHDData(handle, header, sizeof(vhd_dynamic_header), bswap_uint64(footer->data_offset)) ||
+		(memcmp(header->cookie, cxsparse_str, sizeof(header->cookie)) != 0)) {
+		uprintf("  Could not read dynamic VHD header");
+		goto out;
+	}
+	block_size = bswap_uint32(header->block_size);
+	bat_entries = bswap_uint32(header->max_table_entries);
+	map = AllocVirtualDiskMap(bswap_uint64(footer->current_size), block_size);
+	if ((map == NULL) || (bat_entries < map->nb_blocks)) {
+		uprintf("  Invalid dynamic VHD parameters");
+		goto out;
+	}
+	bat = (uint32_t*)malloc((size_t)map->nb_blocks * sizeof(uint32_t));
+	if ((bat == NULL) || !ReadVHDData(handle, bat, map->nb_blocks * sizeof(uint32_t), bswap_uint64(header->table_offset))) {
+		uprintf("  Could not read dynamic VHD block allocation table");
+		goto out;
+	}
+	// The data of each block comes after its sector bitmap, which is padded to a sector
+	bitmap_size = ((block_size / 512 / 8) + 511) & ~511;
+	for (i = 0; i < map->nb_blocks; i++) {
+		if (bat[i] != 0xFFFFFFFF)
+			map->block[i] = (uint64_t)bswap_uint32(bat[i]) * 512 + bitmap_size;
+	}
+	free(bat);
+	free(header);
+	return map;
+
+out:
+	free(bat);
+	free(header);
+	FreeVirtualDiskMap(map);
+	return NULL;
+}
+
+/*
+ * Read the block allocation table of a VHDX, as described by its metadata region.
+ * NB: We don't validate the CRC-32C checksums of the structures, and we don't replay the
+ * log, so images that were not closed cleanly (with a log GUID set) are rejected.
+ */
+static VDISK_MAP* GetVHDXMap(HANDLE handle)
+{
+	const GUID null_guid = { 0 };
+	VDISK_MAP* map = NULL;
+	vhdx_header header[2];
+	vhdx_region_table_header region_header;
+	vhdx_region_table_entry* region = NULL;
+	vhdx_metadata_table_header metadata_header;
+	vhdx_metadata_table_entry* metadata = NULL;
+	uint64_t bat_offset = 0, metadata_offset = 0, disk_size = 0, entry, *bat = NULL;
+	uint32_t i, h, block_size = 0, sector_size = 0, file_flags = 0, chunk_ratio, bat_entries, state;
+
+	if (!ReadVHDData(handle, &header[0], sizeof(vhdx_header), VHDX_HEADER1_OFFSET) ||
+		!ReadVHDData(handle, &header[1], sizeof(vhdx_header), VHDX_HEADER2_OFFSET)) {
+		uprintf("  Could not read VHDX headers");
+		goto out;
+	}
+	// The current header is the valid one with the highest sequence number
+	if (header[0].signature != VHDX_HEADER_SIGNATURE)
+		h = 1;
+	else if (header[1].signature != VHDX_HEADER_SIGNATURE)
+		h = 0;
+	else
+		h = (header[1].sequence_number > header[0].sequence_number) ? 1 : 0;
+	if (header[h].signature != VHDX_HEADER_SIGNATURE) {
+		uprintf("  Invalid VHDX headers");
+		goto out;
+	}
+	if (memcmp(&header[h].log_guid, &null_guid, sizeof(GUID)) != 0) {
+		uprintf("  VHDX image has a log that needs to be replayed - Please mount it in Windows once first");
+		goto out;
+	}
+
+	if (!ReadVHDData(handle, &region_header, sizeof(region_header), VHDX_REGION_TABLE_OFFSET) ||
+		(region_header.signature != VHDX_REGION_SIGNATURE) || (region_header.entry_count > VHDX_MAX_REGION_ENTRIES)) {
+		uprintf("  Could not read VHDX region table");
+		goto out;
+	}
+	region = (vhdx_region_table_entry*)malloc(region_header.entry_count * sizeof(vhdx_region_table_entry));
+	if ((region == NULL) || !ReadVHDData(handle, region, region_header.entry_count * sizeof(vhdx_region_table_entry),
+		VHDX_REGION_TABLE_OFFSET + sizeof(region_header)))
+		goto out;
+	for (i = 0; i < region_header.entry_count; i++) {
+		if (memcmp(&region[i].guid, &vhdx_bat_guid, sizeof(GUID)) == 0)
+			bat_offset = region[i].file_offset;
+		else if (memcmp(&region[i].guid, &vhdx_metadata_guid, sizeof(GUID)) == 0)
+			metadata_offset = region[i].file_offset;
+	}
+	if ((bat_offset == 0) || (metadata_offset == 0)) {
+		uprintf("  VHDX image is missing its BAT or metadata region");
+		goto out;
+	}
+
+	if (!ReadVHDData(handle, &metadata_header, sizeof(metadata_header), metadata_offset) ||
+		(metadata_header.signature != VHDX_METADATA_SIGNATURE) || (metadata_header.entry_count > VHDX_MAX_METADATA_ENTRIES)) {
+		uprintf("  Could not read VHDX metadata table");
+		goto out;
+	}
+	metadata = (vhdx_metadata_table_entry*)malloc(metadata_header.entry_count * sizeof(vhdx_metadata_table_entry));
+	if ((metadata == NULL) || !ReadVHDData(handle, metadata, metadata_header.entry_count * sizeof(vhdx_metadata_table_entry),
+		metadata_offset + sizeof(metadata_header)))
+		goto out;
+	for (i = 0; i < metadata_header.entry_count; i++) {
+		if (memcmp(&metadata[i].item_id, &vhdx_file_parameters_guid, sizeof(GUID)) == 0) {
+			if (!ReadVHDData(handle, &block_size, sizeof(block_size), metadata_offset + metadata[i].offset) ||
+				!ReadVHDData(handle, &file_flags, sizeof(file_flags), metadata_offset + metadata[i].offset + 4))
+				goto out;
+		} else if (memcmp(&metadata[i].item_id, &vhdx_virtual_disk_size_guid, sizeof(GUID)) == 0) {
+			if (!ReadVHDData(handle, &disk_size, sizeof(disk_size), metadata_offset + metadata[i].offset))
+				goto out;
+		} else if (memcmp(&metadata[i].item_id, &vhdx_logical_sector_size_guid, sizeof(GUID)) == 0) {
+			if (!ReadVHDData(handle, &sector_size, sizeof(sector_size), metadata_offset + metadata[i].offset))
+				goto out;
+		}
+	}
+	if (file_flags & VHDX_FILE_PARAMETERS_HAS_PARENT) {
+		uprintf("  Differencing VHDX images are not supported");
+		goto out;
+	}
+	map = AllocVirtualDiskMap(disk_size, block_size);
+	if ((map == NULL) || (sector_size == 0) || (((1ULL << 23) * sector_size) % block_size != 0)) {
+		uprintf("  Invalid VHDX parameters");
+		goto out;
+	}
+
+	// The BAT interleaves a sector bitmap entry after each chunk of payload blocks
+	chunk_ratio = (uint32_t)(((1ULL << 23) * sector_size) / block_size);
+	bat_entries = map->nb_blocks + (map->nb_blocks - 1) / chunk_ratio;
+	bat = (uint64_t*)malloc((size_t)bat_entries * sizeof(uint64_t));
+	if ((bat == NULL) || !ReadVHDData(handle, bat, bat_entries * sizeof(uint64_t), bat_offset)) {
+		uprintf("  Could not read VHDX block allocation table");
+		goto out;
+	}
+	for (i = 0; i < map->nb_blocks; i++) {
+		entry = bat[i + i / chunk_ratio];
+		state = (uint32_t)(entry & VHDX_PAYLOAD_BLOCK_STATE_MASK);
+		if (state == VHDX_PAYLOAD_BLOCK_FULLY_PRESENT) {
+			map->block[i] = (entry >> 20) * MB;
+		} else if (state == VHDX_PAYLOAD_BLOCK_PARTIALLY_PRESENT) {
+			uprintf("  Invalid VHDX block state");
+			goto out;
+		}
+		// All the other states (not present, undefined, zero, unmapped) read as zeros
+	}
+	free(bat);
+	free(metadata);
+	free(region);
+	return map;
+
+out:
+	free(bat);
+	free(metadata);
+	free(region);
+	FreeVirtualDiskMap(map);
+	return NULL;
+}
+
+/*
+ * Get the block allocation map of a dynamic VHD or VHDX image, so that it can be
+ * written to a drive without having to be converted to a fixed image first.
+ */
+VDISK_MAP* GetVirtualDiskMap(HANDLE handle)
+{
+	LARGE_INTEGER li;
+	vhd_footer footer;
+	uint64_t signature = 0;
+
+	if (ReadVHDData(handle, &signature, sizeof(signature), 0) && (signature == VHDX_SIGNATURE))
+		return GetVHDXMap(handle);
+	if (!GetFileSizeEx(handle, &li) || (li.QuadPart < sizeof(vhd_footer)) ||
+		!ReadVHDData(handle, &footer, sizeof(footer), li.QuadPart - sizeof(vhd_footer)) ||
+		(memcmp(footer.cookie, conectix_str, sizeof(footer.cookie)) != 0) ||
+		(bswap_uint32(footer.disk_type) != VHD_FOOTER_TYPE_DYNAMIC_HARD_DISK))
+		return NULL;
+	return GetDynamicVHDMap(handle, &footer);
+}
+
+/*
+ * Analyze a dynamic VHD or VHDX image, by looking for a boot marker in its first virtual sector
+ */
+static uint8_t AnalyzeVirtualDisk(HANDLE handle, const char* type)
+{
+	uint8_t buf[512] = { 0 }, is_bootable_img;
+	uint32_t i, nb_allocated = 0;
+	VDISK_MAP* map = GetVirtualDiskMap(handle);
+
+	if (map == NULL) {
+		uprintf("  Unsupported type of %s image", type);
+		return 0;
+	}
+	if ((map->block[0] != 0) && !ReadVHDData(handle, buf, sizeof(buf), map->block[0])) {
+		uprintf("  Could not read %s image data", type);
+		FreeVirtualDiskMap(map);
+		return 0;
+	}
+	img_report.image_size = map->disk_size;
+	img_report.is_vhd = TRUE;
+	img_report.is_dynamic_vhd = TRUE;
+	is_bootable_img = ((buf[0x1FE] == 0x55) && (buf[0x1FF] == 0xAA)) ? 1 : (ignore_boot_marker ? 2 : 0);
+	for (i = 0; i < map->nb_blocks; i++)
+		nb_allocated += (map->block[i] != 0) ? 1 : 0;
+	uprintf("  Image is a Dynamic %s file, with %d of its %d blocks of %s allocated", type,
+		nb_allocated, map->nb_blocks, SizeToHumanReadable(map->block_size, FALSE, FALSE));
+	if (is_bootable_img != 1)
+		uprintf("  Image does not have a Boot Marker");
+	FreeVirtualDiskMap(map);
+	return is_bootable_img;
+}
+
+void FreeFFUImage(FFU_IMAGE* ffu)
+{
+	if (ffu == NULL)
+		return;
+	free(ffu->hash_table);
+	free(ffu->entry);
+	free(ffu->location);
+	free(ffu);
+}
+
+/*
+ * Validate the data of consecutive FFU chunks, starting at chunk index 'chunk',
+ * against the SHA-256 hash table of the image
+ */
+BOOL CheckFFUChunks(const FFU_IMAGE* ffu, uint32_t chunk, const uint8_t* buf, DWORD size)
+{
+	uint8_t sum[32];
+	DWORD pos, len;
+
+	if (ffu->nb_hashes == 0)
+		return TRUE;
+	for (pos = 0; pos < size; pos += len, chunk++) {
+		len = min(ffu->chunk_size, size - pos);
+		if ((chunk >= ffu->nb_hashes) || !HashBuffer(CHECKSUM_SHA256, &buf[pos], len, sum) ||
+			(memcmp(sum, &ffu->hash_table[(size_t)chunk * sizeof(sum)], sizeof(sum)) != 0)) {
+			uprintf("FFU chunk %d does not match its hash", chunk);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+BOOL IsFFUImage(HANDLE handle)
+{
+	ffu_security_header security_header;
+
+	return ReadVHDData(handle, &security_header, sizeof(security_header), 0) &&
+		(memcmp(security_header.signature, FFU_SECURITY_SIGNATURE, sizeof(security_header.signature)) == 0);
+}
+
+/*
+ * Parse the headers and the write descriptors of a Full Flash Update image. The data of the
+ * headers is validated against the hash table here, and the payload chunks are left for the
+ * writer to validate as it reads them. Only single store images are supported.
+ */
+FFU_IMAGE* GetFFUImage(HANDLE handle)
+{
+	FFU_IMAGE* ffu = NULL;
+	ffu_security_header security_header;
+	ffu_image_header image_header;
+	ffu_store_header store_header;
+	ffu_block_data_entry* block_entry;
+	ffu_disk_location* disk_location;
+	uint8_t* buf = NULL;
+	uint64_t hashed_offset, store_offset, store_header_size, end;
+	uint32_t i, j, k, pos, payload_blocks = 0, nb_locations = 0;
+	LARGE_INTEGER li;
+
+	if (!GetFileSizeEx(handle, &li) ||
+		!ReadVHDData(handle, &security_header, sizeof(security_header), 0) ||
+		(memcmp(security_header.signature, FFU_SECURITY_SIGNATURE, sizeof(security_header.signature)) != 0) ||
+		(security_header.chunk_size_kb == 0) || (security_header.chunk_size_kb > 64 * 1024)) {
+		uprintf("  Invalid FFU security header");
+		goto out;
+	}
+	ffu = (FFU_IMAGE*)calloc(1, sizeof(FFU_IMAGE));
+	if (ffu == NULL)
+		goto out;
+	ffu->chunk_size = security_header.chunk_size_kb * 1024;
+	// Everything that follows the security header, its catalog and its hash table is hashed
+	hashed_offset = ((uint64_t)security_header.size + security_header.catalog_size + security_header.hash_table_size
+		+ ffu->chunk_size - 1) / ffu->chunk_size * ffu->chunk_size;
+	if (security_header.alg_id != FFU_ALG_SHA256) {
+		uprintf("  Notice: FFU image does not use SHA-256 hashes - Its data will not be validated");
+	} else if (security_header.hash_table_size != 0) {
+		ffu->hash_table = (uint8_t*)malloc(security_header.hash_table_size);
+		if ((ffu->hash_table == NULL) || !ReadVHDData(handle, ffu->hash_table, security_header.hash_table_size,
+			(uint64_t)security_header.size + security_header.catalog_size)) {
+			uprintf("  Could not read FFU hash table");
+			goto out;
+		}
+		ffu->nb_hashes = security_header.hash_table_size / 32;
+	}
+
+	if (!ReadVHDData(handle, &image_header, sizeof(image_header), hashed_offset) ||
+		(memcmp(image_header.signature, FFU_IMAGE_SIGNATURE, sizeof(image_header.signature)) != 0)) {
+		uprintf("  Invalid FFU image header");
+		goto out;
+	}
+	store_offset = (hashed_offset + image_header.size + image_header.manifest_length + ffu->chunk_size - 1)
+		/ ffu->chunk_size * ffu->chunk_size;
+	memset(&store_header, 0, sizeof(store_header));
+	if (!ReadVHDData(handle, &store_header, FFU_STORE_HEADER_V1_SIZE, store_offset)) {
+		uprintf("  Could not read FFU store header");
+		goto out;
+	}
+	store_header_size = FFU_STORE_HEADER_V1_SIZE;
+	if (store_header.major_version >= 2) {
+		if (!ReadVHDData(handle, &store_header.nb_stores, sizeof(store_header) - FFU_STORE_HEADER_V1_SIZE,
+			store_offset + FFU_STORE_HEADER_V1_SIZE))
+			goto out;
+		if (store_header.nb_stores > 1) {
+			uprintf("  FFU images with multiple stores (%d) are not supported", store_header.nb_stores);
+			goto out;
+		}
+		store_header_size = sizeof(store_header) + (uint64_t)store_header.device_path_length * sizeof(wchar_t);
+	}
+	ffu->block_size = store_header.block_size;
+	if ((ffu->block_size == 0) || (ffu->block_size % 512 != 0) ||
+		(store_header.write_descriptor_length > FFU_MAX_DESCRIPTORS_SIZE) ||
+		(store_header.validate_descriptor_length > FFU_MAX_DESCRIPTORS_SIZE)) {
+		uprintf("  Invalid FFU store header");
+		goto out;
+	}
+	ffu->payload_offset = (store_offset + store_header_size + store_header.validate_descriptor_length +
+		store_header.write_descriptor_length + ffu->chunk_size - 1) / ffu->chunk_size * ffu->chunk_size;
+	if ((ffu->payload_offset > (uint64_t)li.QuadPart) || ((ffu->payload_offset - hashed_offset) % ffu->chunk_size != 0) ||
+		(ffu->payload_offset - hashed_offset > 4 * FFU_MAX_DESCRIPTORS_SIZE)) {
+		uprintf("  Invalid FFU store layout");
+		goto out;
+	}
+	ffu->first_hash = (uint32_t)((ffu->payload_offset - hashed_offset) / ffu->chunk_size);
+
+	// Read all of the headers, to validate them, and parse the write descriptors
+	buf = (uint8_t*)malloc((size_t)(ffu->payload_offset - hashed_offset));
+	if ((buf == NULL) || !ReadVHDData(handle, buf, (DWORD)(ffu->payload_offset - hashed_offset), hashed_offset)) {
+		uprintf("  Could not read FFU headers");
+		goto out;
+	}
+	if (!CheckFFUChunks(ffu, 0, buf, (DWORD)(ffu->payload_offset - hashed_offset))) {
+		uprintf("  FFU headers are corrupted");
+		goto out;
+	}
+	pos = (uint32_t)(store_offset - hashed_offset + store_header_size + store_header.validate_descriptor_length);
+	end = (uint64_t)pos + store_header.write_descriptor_length;
+	for (i = 0, k = pos; i < store_header.write_descriptor_count; i++) {
+		block_entry = (ffu_block_data_entry*)&buf[k];
+		if ((k + sizeof(ffu_block_data_entry) > end) ||
+			(k + sizeof(ffu_block_data_entry) + (uint64_t)block_entry->location_count * sizeof(ffu_disk_location) > end)) {
+			uprintf("  Invalid FFU write descriptors");
+			goto out;
+		}
+		nb_locations += block_entry->location_count;
+		k += sizeof(ffu_block_data_entry) + block_entry->location_count * sizeof(ffu_disk_location);
+	}
+	ffu->nb_entries = store_header.write_descriptor_count;
+	ffu->entry = (FFU_ENTRY*)calloc(ffu->nb_entries, sizeof(FFU_ENTRY));
+	ffu->location = (FFU_LOCATION*)calloc(max(nb_locations, 1), sizeof(FFU_LOCATION));
+	if ((ffu->entry == NULL) || (ffu->location == NULL))
+		goto out;
+	for (i = 0, k = pos, nb_locations = 0; i < ffu->nb_entries; i++) {
+		block_entry = (ffu_block_data_entry*)&buf[k];
+		disk_location = (ffu_disk_location*)&buf[k + sizeof(ffu_block_data_entry)];
+		ffu->entry[i].nb_blocks = block_entry->block_count;
+		ffu->entry[i].nb_locations = block_entry->location_count;
+		ffu->entry[i].location = &ffu->location[nb_locations];
+		for (j = 0; j < block_entry->location_count; j++, nb_locations++) {
+			if ((disk_location[j].access_method != FFU_DISK_BEGIN) && (disk_location[j].access_method != FFU_DISK_END)) {
+				uprintf("  Unsupported FFU disk access method %d", disk_location[j].access_method);
+				goto out;
+			}
+			ffu->location[nb_locations].block_index = disk_location[j].block_index;
+			ffu->location[nb_locations].from_end = (disk_location[j].access_method == FFU_DISK_END);
+			// Blocks that are located from the end of the disk don't tell us anything about its size
+			if (!ffu->location[nb_locations].from_end)
+				ffu->disk_size = max(ffu->disk_size,
+					((uint64_t)disk_location[j].block_index + block_entry->block_count) * ffu->block_size);
+		}
+		payload_blocks += block_entry->block_count;
+		k += sizeof(ffu_block_data_entry) + block_entry->location_count * sizeof(ffu_disk_location);
+	}
+	ffu->payload_size = (uint64_t)payload_blocks * ffu->block_size;
+	if (ffu->payload_offset + ffu->payload_size > (uint64_t)li.QuadPart) {
+		uprintf("  FFU image is truncated");
+		goto out;
+	}
+	if ((ffu->nb_hashes != 0) && (ffu->block_size % ffu->chunk_size != 0)) {
+		uprintf("  Notice: FFU block size is not a multiple of its chunk size - Its data will not be validated");
+		ffu->nb_hashes = 0;
+	}
+	free(buf);
+	return ffu;
+
+out:
+	free(buf);
+	FreeFFUImage(ffu);
+	return NULL;
+}
+
+/*
+ * Analyze an FFU image, by looking for a boot marker in the payload of its first disk block
+ */
+static uint8_t AnalyzeFFU(HANDLE handle)
+{
+	uint8_t buf[512] = { 0 }, is_bootable_img;
+	uint32_t i, j;
+	uint64_t payload = 0;
+	FFU_IMAGE* ffu = GetFFUImage(handle);
+
+	if (ffu == NULL) {
+		uprintf("  Unsupported type of FFU image");
+		return 0;
+	}
+	for (i = 0; i < ffu->nb_entries; payload += (uint64_t)ffu->entry[i].nb_blocks * ffu->block_size, i++) {
+		for (j = 0; j < ffu->entry[i].nb_locations; j++) {
+			if (!ffu->entry[i].location[j].from_end && (ffu->entry[i].location[j].block_index == 0))
+				break;
+		}
+		if (j < ffu->entry[i].nb_locations)
+			break;
+	}
+	if ((i < ffu->nb_entries) && !ReadVHDData(handle, buf, sizeof(buf), ffu->payload_offset + payload)) {
+		uprintf("  Could not read FFU image data");
+		FreeFFUImage(ffu);
+		return 0;
+	}
+	img_report.image_size = ffu->disk_size;
+	img_report.is_ffu = TRUE;
+	is_bootable_img = ((buf[0x1FE] == 0x55) && (buf[0x1FF] == 0xAA)) ? 1 : (ignore_boot_marker ? 2 : 0);
+	uprintf("  Image is a Full Flash Update file, with %s of payload in %d blocks of %s (%s)",
+		SizeToHumanReadable(ffu->payload_size, FALSE, FALSE), (uint32_t)(ffu->payload_size / ffu->block_size),
+		SizeToHumanReadable(ffu->block_size, FALSE, FALSE), (ffu->nb_hashes != 0) ? "hashed" : "not hashed");
+	if (is_bootable_img != 1)
+		uprintf("  Image does not have a Boot Marker");
+	FreeFFUImage(ffu);
+	return is_bootable_img;
+}
+
 typedef struct {
 	const char* ext;
 	bled_compression_type type;
@@ -284,6 +1169,7 @@ static comp_assoc file_assoc[] = {
 	{ ".bz2", BLED_COMPRESSION_BZIP2 },
 	{ ".xz", BLED_COMPRESSION_XZ },
 	{ ".vtsi", BLED_COMPRESSION_VTSI },
+	{ ".zst", BLED_COMPRESSION_ZSTD },
 };
 
 // For now we consider that an image that matches a known extension is bootable
@@ -310,7 +1196,17 @@ BOOL IsCompressedBootableImage(const char* path)
 				return FALSE;
 			FormatStatus = 0;
 			bled_init(_uprintf, NULL, NULL, NULL, NULL, &FormatStatus);
+			// An LZMA probe allocates the whole dictionary, which the write can then reuse
+			bled_set_alloc_functions(AllocIoBuffer, FreeIoBuffer);
 			dc = bled_uncompress_to_buffer(path, (char*)buf, MBR_SIZE, file_assoc[i].type);
+			if (dc == MBR_SIZE) {
+				// Some containers record the uncompressed size, which we can use to check the target
+				img_report.projected_size = bled_get_uncompressed_size(path, file_assoc[i].type);
+				if ((int64_t)img_report.projected_size > 0)
+					uprintf("  Uncompressed size: %s", SizeToHumanReadable(img_report.projected_size, FALSE, FALSE));
+				else
+					img_report.projected_size = 0;
+			}
 			bled_exit();
 			if (dc != MBR_SIZE) {
 				free(buf);
@@ -360,6 +1256,14 @@ uint8_t IsBootableImage(const char* path)
 	img_report.is_windows_img = ReadFile(handle, &wim_magic, size, &size, NULL) && (wim_magic == WIM_MAGIC);
 	if (img_report.is_windows_img)
 		goto out;
+	if ((img_report.compression_type == BLED_COMPRESSION_NONE) && (wim_magic == VHDX_SIGNATURE)) {
+		is_bootable_img = AnalyzeVirtualDisk(handle, "VHDX");
+		goto out;
+	}
+	if ((img_report.compression_type == BLED_COMPRESSION_NONE) && IsFFUImage(handle)) {
+		is_bootable_img = AnalyzeFFU(handle);
+		goto out;
+	}
 
 	size = sizeof(vhd_footer);
 	if ((img_report.compression_type == BLED_COMPRESSION_NONE) && (img_report.image_size >= (512 + size))) {
@@ -373,7 +1277,8 @@ uint8_t IsBootableImage(const char* path)
 		if (memcmp(footer->cookie, conectix_str, sizeof(footer->cookie)) == 0) {
 			img_report.image_size -= sizeof(vhd_footer);
 			if ( (bswap_uint32(footer->file_format_version) != VHD_FOOTER_FILE_FORMAT_V1_0)
-			  || (bswap_uint32(footer->disk_type) != VHD_FOOTER_TYPE_FIXED_HARD_DISK)) {
+			  || ((bswap_uint32(footer->disk_type) != VHD_FOOTER_TYPE_FIXED_HARD_DISK)
+			  && (bswap_uint32(footer->disk_type) != VHD_FOOTER_TYPE_DYNAMIC_HARD_DISK))) {
 				uprintf("  Unsupported type of VHD image");
 				is_bootable_img = 0;
 				goto out;
@@ -386,6 +1291,10 @@ uint8_t IsBootableImage(const char* path)
 			checksum = ~checksum;
 			if (checksum != old_checksum)
 				uprintf("  Warning: VHD footer seems corrupted (checksum: %04X, expected: %04X)", old_checksum, checksum);
+			if (bswap_uint32(footer->disk_type) == VHD_FOOTER_TYPE_DYNAMIC_HARD_DISK) {
+				is_bootable_img = AnalyzeVirtualDisk(handle, "VHD");
+				goto out;
+			}
 			// Need to remove the footer from our payload
 			uprintf("  Image is a Fixed Hard Disk VHD file");
 			img_report.is_vhd = TRUE;
@@ -425,7 +1334,7 @@ DWORD WINAPI WimProgressCallback(DWORD dwMsgId, WPARAM wParam, LPARAM lParam, PV
 #endif
 		if (count_files) {
 			wim_nb_files++;
-		} else {
+		} else if (wim_total_bytes == 0) {
 			// At the end of an actual apply, the WIM API re-lists a bunch of directories it already processed,
 			// so, even as we try to compensate, we might end up with more entries than counted - ignore those.
 			if (wim_proc_files < wim_nb_files)
@@ -450,6 +1359,11 @@ DWORD WINAPI WimProgressCallback(DWORD dwMsgId, WPARAM wParam, LPARAM lParam, PV
 		} else {
 			size = (((uint64_t)pFileData->nFileSizeHigh) << 32) + pFileData->nFileSizeLow;
 			uprintf("Extracting: %S (%s)", (PWSTR)wParam, SizeToHumanReadable(size, FALSE, FALSE));
+			if (wim_total_bytes != 0) {
+				wim_proc_bytes = min(wim_proc_bytes + size, wim_total_bytes);
+				wim_proc_files = (uint32_t)(wim_proc_bytes / KB);
+				UpdateProgressWithInfo(progress_op, progress_msg, wim_proc_files, wim_nb_files);
+			}
 		}
 		break;
 	case WIM_MSG_RETRY:
@@ -807,12 +1721,292 @@ BOOL WimExtractFile(const char* image, int index, const char* src, const char* d
 		  || ((wim_flags & WIM_HAS_API_EXTRACT) && WimExtractFile_API(image, index, src, dst, bSilent)) );
 }
 
+// Read part of a WIM, that is either a file or, if iso_file is not NULL, a file residing in an ISO
+static BOOL ReadWimRange(const char* image, const char* iso_file, uint64_t offset, void* buf, uint32_t size)
+{
+	BOOL r;
+	HANDLE handle;
+	DWORD rSize;
+	LARGE_INTEGER li;
+
+	if (iso_file != NULL)
+		return (ReadISOFileRange(image, iso_file, offset, buf, size) == (int64_t)size);
+	handle = CreateFileU(image, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+		return FALSE;
+	li.QuadPart = offset;
+	r = SetFilePointerEx(handle, li, NULL, FILE_BEGIN) && ReadFile(handle, buf, size, &rSize, NULL) && (rSize == size);
+	CloseHandle(handle);
+	return r;
+}
+
+/*
+ * Read the XML data of a WIM, which, even on a solid-compressed ESD, is always stored as an
+ * uncompressed resource that the header points to. This only requires reading the header and
+ * the XML, at most a few hundred KB, rather than having wimgapi or 7-Zip go through the image.
+ * The returned UTF-16 string must be freed by the caller.
+ */
+static wchar_t* ReadWimXml(const char* image, const char* iso_file)
+{
+	wim_header header;
+	wchar_t* xml;
+	uint64_t size = 0;
+	int i;
+
+	if (!ReadWimRange(image, iso_file, 0, &header, sizeof(header)) ||
+		(header.tag != WIM_MAGIC) || (header.xml_data.flags & WIM_RESHDR_FLAG_COMPRESSED))
+		return NULL;
+	for (i = 0; i < sizeof(header.xml_data.size); i++)
+		size |= ((uint64_t)header.xml_data.size[i]) << (8 * i);
+	if ((size < 2 * sizeof(wchar_t)) || (size > WIM_MAX_XML_SIZE))
+		return NULL;
+	xml = (wchar_t*)calloc((size_t)size + sizeof(wchar_t), 1);
+	if ((xml != NULL) && !ReadWimRange(image, iso_file, header.xml_data.offset, xml, (uint32_t)size))
+		safe_free(xml);
+	return xml;
+}
+
+/*
+ * A minimal pull parser for the WIM XML data, which is machine generated and simple enough that
+ * we only need to report the elements and their text. The names of the elements are terminated
+ * in place, so that xml_parser.path[] can point to the ones we are in.
+ */
+#define XML_MAX_DEPTH						8
+
+typedef enum {
+	XML_END = 0,
+	XML_OPEN,
+	XML_CLOSE,
+	XML_TEXT,
+} xml_event;
+
+typedef struct {
+	wchar_t* p;
+	int depth;
+	BOOL pending_close;						// For <ELEMENT/>
+	const wchar_t* path[XML_MAX_DEPTH];
+	wchar_t* attr;							// The attributes of an XML_OPEN element
+	wchar_t* text;							// The text of an XML_TEXT event
+	size_t text_len;
+} xml_parser;
+
+static xml_event XmlNext(xml_parser* x)
+{
+	wchar_t *name, *end;
+	size_t len;
+
+	if (x->pending_close) {
+		x->pending_close = FALSE;
+		x->depth--;
+		return XML_CLOSE;
+	}
+	while (*x->p != 0) {
+		if (*x->p != L'<') {
+			x->text = x->p;
+			end = wcschr(x->p, L'<');
+			x->p = (end == NULL) ? &x->p[wcslen(x->p)] : end;
+			x->text_len = x->p - x->text;
+			// Ignore the indentation
+			if (wcsspn(x->text, L" \t\r\n\xfeff") >= x->text_len)
+				continue;
+			return XML_TEXT;
+		}
+		if (wcsncmp(x->p, L"<!--", 4) == 0) {
+			end = wcsstr(x->p, L"-->");
+			if (end == NULL)
+				break;
+			x->p = &end[3];
+			continue;
+		}
+		end = wcschr(x->p, L'>');
+		if (end == NULL)
+			break;
+		*end = 0;
+		name = &x->p[1];
+		x->p = &end[1];
+		// Skip declarations and processing instructions
+		if ((*name == L'?') || (*name == L'!'))
+			continue;
+		if (*name == L'/') {
+			name++;
+			name[wcscspn(name, L" \t\r\n")] = 0;
+			if (x->depth > 0)
+				x->depth--;
+			return XML_CLOSE;
+		}
+		if ((end > name) && (end[-1] == L'/')) {
+			end[-1] = 0;
+			x->pending_close = TRUE;
+		}
+		len = wcscspn(name, L" \t\r\n");
+		x->attr = &name[len];
+		if (*x->attr != 0)
+			*x->attr++ = 0;
+		if (x->depth < XML_MAX_DEPTH)
+			x->path[x->depth] = name;
+		x->depth++;
+		return XML_OPEN;
+	}
+	return XML_END;
+}
+
+// Check that we are in the elements given by the NULL terminated list of names, from the root one
+static BOOL XmlIsIn(xml_parser* x, ...)
+{
+	const wchar_t* name;
+	va_list args;
+	int i;
+
+	va_start(args, x);
+	for (i = 0; (name = va_arg(args, const wchar_t*)) != NULL; i++) {
+		if ((i >= x->depth) || (i >= XML_MAX_DEPTH) || (wcscmp(x->path[i], name) != 0))
+			break;
+	}
+	va_end(args);
+	return (name == NULL) && (i == x->depth);
+}
+
+// Return the UTF-8 text of an XML_TEXT event, with the predefined entities decoded
+static char* XmlText(xml_parser* x)
+{
+	static const struct { const wchar_t* name; wchar_t c; } entity[] = {
+		{ L"&lt;", L'<' }, { L"&gt;", L'>' }, { L"&quot;", L'"' }, { L"&apos;", L'\'' }, { L"&amp;", L'&' } };
+	wchar_t* str = (wchar_t*)calloc(x->text_len + 1, sizeof(wchar_t));
+	char* r;
+	size_t i, j, k, len;
+
+	if (str == NULL)
+		return NULL;
+	for (i = 0, j = 0; i < x->text_len; j++) {
+		str[j] = x->text[i++];
+		if (str[j] != L'&')
+			continue;
+		for (k = 0; k < ARRAYSIZE(entity); k++) {
+			len = wcslen(entity[k].name) - 1;
+			if ((i + len <= x->text_len) && (wcsncmp(&x->text[i], &entity[k].name[1], len) == 0)) {
+				str[j] = entity[k].c;
+				i += len;
+				break;
+			}
+		}
+	}
+	r = wchar_to_utf8(str);
+	free(str);
+	return r;
+}
+
+/*
+ * Get the index, name, description and build of the images of a WIM, that is either a file or,
+ * if iso_file is not NULL, a file residing in an ISO. Returns the number of images, or -1 on
+ * error. The array must be freed with FreeWimImageInfo().
+ */
+int GetWimImageInfo(const char* image, const char* iso_file, wim_image_info** info)
+{
+	xml_parser x = { 0 };
+	wchar_t *xml, *attr;
+	wim_image_info *images = NULL, *cur = NULL, *tmp;
+	int nb_images = 0;
+	xml_event ev;
+
+	*info = NULL;
+	xml = ReadWimXml(image, iso_file);
+	if (xml == NULL) {
+		uprintf("Could not read the XML data of %s", (iso_file != NULL) ? iso_file : image);
+		return -1;
+	}
+	x.p = xml;
+	while ((ev = XmlNext(&x)) != XML_END) {
+		if ((ev == XML_CLOSE) && (x.depth == 1)) {
+			cur = NULL;
+		} else if ((ev == XML_OPEN) && XmlIsIn(&x, L"WIM", L"IMAGE", NULL)) {
+			if (nb_images % 16 == 0) {
+				tmp = (wim_image_info*)realloc(images, (nb_images + 16) * sizeof(wim_image_info));
+				if (tmp == NULL) {
+					FreeWimImageInfo(images, nb_images);
+					nb_images = -1;
+					images = NULL;
+					break;
+				}
+				images = tmp;
+			}
+			cur = &images[nb_images++];
+			memset(cur, 0, sizeof(wim_image_info));
+			attr = wcsstr(x.attr, L"INDEX=\"");
+			cur->index = (attr == NULL) ? nb_images : _wtoi(&attr[7]);
+		} else if ((ev == XML_TEXT) && (cur != NULL)) {
+			if (XmlIsIn(&x, L"WIM", L"IMAGE", L"DISPLAYNAME", NULL) && (cur->name == NULL)) {
+				cur->name = XmlText(&x);
+			} else if (XmlIsIn(&x, L"WIM", L"IMAGE", L"DESCRIPTION", NULL) && (cur->description == NULL)) {
+				cur->description = XmlText(&x);
+			} else if (XmlIsIn(&x, L"WIM", L"IMAGE", L"WINDOWS", L"VERSION", L"BUILD", NULL)) {
+				cur->build = _wtoi(x.text);
+			}
+		}
+	}
+	free(xml);
+	*info = images;
+	return nb_images;
+}
+
+void FreeWimImageInfo(wim_image_info* info, int nb_images)
+{
+	int i;
+
+	if (info == NULL)
+		return;
+	for (i = 0; i < nb_images; i++) {
+		free(info[i].name);
+		free(info[i].description);
+	}
+	free(info);
+}
+
+/*
+ * Get the number of files and directories, as well as the size of the file data, of a WIM
+ * image index, from the XML data of the WIM. This is much faster than counting the files
+ * with a WIMApplyImage() pass that doesn't apply anything, and gives us the size that we
+ * need to report a progress that follows the amount of data being applied.
+ */
+static BOOL GetWimImageStats(const char* image, int index, uint32_t* nb_files, uint64_t* total_bytes)
+{
+	BOOL r = FALSE;
+	wchar_t *xml, *start, *end, *p, tag[32];
+
+	xml = ReadWimXml(image, NULL);
+	if (xml == NULL)
+		return FALSE;
+
+	// The XML is UTF-16, and we are only after a few elements of one image, so don't bother with a parser
+	_snwprintf(tag, ARRAYSIZE(tag), L"<IMAGE INDEX=\"%d\">", index);
+	start = wcsstr(xml, tag);
+	end = (start == NULL) ? NULL : wcsstr(start, L"</IMAGE>");
+	if (end == NULL)
+		goto out;
+	*end = 0;
+	*nb_files = 0;
+	p = wcsstr(start, L"<DIRCOUNT>");
+	if (p != NULL)
+		*nb_files += (uint32_t)wcstoul(&p[10], NULL, 10);
+	p = wcsstr(start, L"<FILECOUNT>");
+	if (p != NULL)
+		*nb_files += (uint32_t)wcstoul(&p[11], NULL, 10);
+	p = wcsstr(start, L"<TOTALBYTES>");
+	if (p == NULL)
+		goto out;
+	*total_bytes = _wcstoui64(&p[12], NULL, 10);
+	r = (*total_bytes != 0);
+
+out:
+	free(xml);
+	return r;
+}
+
 // Apply a WIM image using wimgapi.dll (Windows 7 or later)
 // https://docs.microsoft.com/en-us/previous-versions/msdn10/dd851944(v=msdn.10)
 // To get progress, we must run this call within its own thread
 static DWORD WINAPI WimApplyImageThread(LPVOID param)
 {
-	BOOL r = FALSE;
+	BOOL r = FALSE, compact;
 	HANDLE hWim = NULL;
 	HANDLE hImage = NULL;
 	wchar_t wtemp[MAX_PATH] = {0};
@@ -864,23 +2058,44 @@ static DWORD WINAPI WimApplyImageThread(LPVOID param)
 
 	uprintf("Applying Windows image...");
 	UpdateProgressWithInfoInit(NULL, TRUE);
-	// Run a first pass using WIM_FLAG_NO_APPLY to count the files
 	wim_nb_files = 0;
 	wim_proc_files = 0;
 	wim_extra_files = 0;
-	count_files = TRUE;
-	if (!pfWIMApplyImage(hImage, wdst, WIM_FLAG_NO_APPLY)) {
-		uprintf("  Could not count the files to apply: %s", WindowsErrorString());
-		goto out;
-	}
-	// The latest Windows 10 ISOs have a ~17.5% discrepancy between the number of
-	// files and directories actually applied vs. the ones counted when not applying.
-	// Therefore, we add a 'safe' 20% to our counted files to compensate for yet
-	// another dismal Microsoft progress reporting API...
-	wim_nb_files += wim_nb_files / 5;
-	count_files = FALSE;
-	// Actual apply
-	if (!pfWIMApplyImage(hImage, wdst, WIM_FLAG_FILEINFO)) {
+	wim_proc_bytes = 0;
+	if (GetWimImageStats(_image, _index, &wim_nb_files, &wim_total_bytes)) {
+		uprintf("  %d files and directories, for %s of data", wim_nb_files,
+			SizeToHumanReadable(wim_total_bytes, FALSE, FALSE));
+		// Progress is on the KB of data applied, with the same 20% that is kept for the
+		// steps that follow the apply, as with the file count below
+		wim_nb_files = (uint32_t)(wim_total_bytes / KB);
+		wim_nb_files += wim_nb_files / 5;
+	} else {
+		wim_nb_files = 0;
+		wim_total_bytes = 0;
+		// Run a first pass using WIM_FLAG_NO_APPLY to count the files
+		count_files = TRUE;
+		if (!pfWIMApplyImage(hImage, wdst, WIM_FLAG_NO_APPLY)) {
+			uprintf("  Could not count the files to apply: %s", WindowsErrorString());
+			goto out;
+		}
+		// The latest Windows 10 ISOs have a ~17.5% discrepancy between the number of
+		// files and directories actually applied vs. the ones counted when not applying.
+		// Therefore, we add a 'safe' 20% to our counted files to compensate for yet
+		// another dismal Microsoft progress reporting API...
+		wim_nb_files += wim_nb_files / 5;
+		count_files = FALSE;
+	}
+	// Actual apply, where the file hashes are also checked when verification is enabled
+	if (verify_write)
+		uprintf("  Applied files will be verified against their hashes");
+	// Like DISM's /Compact, have the system files written as WOF compressed files (XPRESS4K),
+	// which is a lot less data to write to the target. This requires Windows 10 or later for
+	// both the host, that does the writing, and the image, that needs to be able to read them.
+	compact = compact_apply && (nWindowsVersion >= WINDOWS_10) && (img_report.win_version.major >= 10);
+	if (compact)
+		uprintf("  System files will be applied compressed (Compact OS)");
+	if (!pfWIMApplyImage(hImage, wdst, WIM_FLAG_FILEINFO | (verify_write ? WIM_FLAG_VERIFY : 0) |
+		(compact ? WIM_FLAG_APPLY_COMPACT : 0))) {
 		uprintf("  Could not apply image: %s", WindowsErrorString());
 		goto out;
 	}
@@ -889,6 +2104,8 @@ static DWORD WINAPI WimApplyImageThread(LPVOID param)
 		uprintf("Notice: An extra %d files and directories were applied, from the %d expected",
 			wim_extra_files, wim_nb_files);
 	// Re-use extra files as the final progress step
+	if (wim_total_bytes != 0)
+		wim_proc_files = (uint32_t)(wim_total_bytes / KB);
 	wim_extra_files = (wim_nb_files - wim_proc_files) / 3;
 	UpdateProgressWithInfo(OP_FILE_COPY, MSG_267, wim_proc_files + wim_extra_files, wim_nb_files);
 	r = TRUE;
@@ -901,6 +2118,7 @@ out:
 	}
 	if (pfWIMUnregisterMessageCallback != NULL)
 		pfWIMUnregisterMessageCallback(NULL, (FARPROC)WimProgressCallback);
+	wim_total_bytes = 0;
 	safe_free(wimage);
 	safe_free(wdst);
 	ExitThread((DWORD)r);
@@ -925,3 +2143,205 @@ BOOL WimApplyImage(const char* image, int index, const char* dst)
 	wim_thread = NULL;
 	return dw;
 }
+
+// Split a WIM image into parts of at most _part_size bytes using wimgapi.dll, where _dst is
+// the path of the first part (.swm) and the following ones get their number appended to it.
+// The parts are written directly, without any temporary copy of the image being made.
+// To get progress, we must run this call within its own thread
+static DWORD WINAPI WimSplitImageThread(LPVOID param)
+{
+	BOOL r = FALSE;
+	HANDLE hWim = NULL;
+	LARGE_INTEGER part_size;
+	wchar_t wtemp[MAX_PATH] = {0};
+	wchar_t* wimage = utf8_to_wchar(_image);
+	wchar_t* wdst = utf8_to_wchar(_dst);
+
+	PF_INIT_OR_OUT(WIMRegisterMessageCallback, Wimgapi);
+	PF_INIT_OR_OUT(WIMCreateFile, Wimgapi);
+	PF_INIT_OR_OUT(WIMSetTemporaryPath, Wimgapi);
+	PF_INIT_OR_OUT(WIMSplitFile, Wimgapi);
+	PF_INIT_OR_OUT(WIMCloseHandle, Wimgapi);
+	PF_INIT_OR_OUT(WIMUnregisterMessageCallback, Wimgapi);
+
+	uprintf("Splitting: %s", _image);
+
+	progress_report_mask = WIM_REPORT_PROGRESS;
+	progress_op = OP_FILE_COPY;
+	progress_msg = MSG_231;
+	progress_offset = 0;
+	progress_total = 100;
+	if (pfWIMRegisterMessageCallback(NULL, (FARPROC)WimProgressCallback, NULL) == INVALID_CALLBACK_VALUE) {
+		uprintf("  Could not set progress callback: %s", WindowsErrorString());
+		goto out;
+	}
+
+	if (GetTempPathW(ARRAYSIZE(wtemp), wtemp) == 0) {
+		uprintf("  Could not fetch temp path: %s", WindowsErrorString());
+		goto out;
+	}
+
+	hWim = pfWIMCreateFile(wimage, WIM_GENERIC_READ, WIM_OPEN_EXISTING,
+		(img_report.wininst_version >= SPECIAL_WIM_VERSION) ? WIM_UNDOCUMENTED_BULLSHIT : 0, 0, NULL);
+	if (hWim == NULL) {
+		uprintf("  Could not access image: %s", WindowsErrorString());
+		goto out;
+	}
+
+	if (!pfWIMSetTemporaryPath(hWim, wtemp)) {
+		uprintf("  Could not set temp path: %s", WindowsErrorString());
+		goto out;
+	}
+
+	UpdateProgressWithInfoInit(NULL, TRUE);
+	part_size.QuadPart = _part_size;
+	if (!pfWIMSplitFile(hWim, wdst, &part_size, 0)) {
+		// ERROR_MORE_DATA means that a single resource is larger than our parts
+		uprintf("  Could not split image into '%s': %s", _dst, WindowsErrorString());
+		goto out;
+	}
+	r = TRUE;
+
+out:
+	if (hWim != NULL) {
+		uprintf("Closing: %s", _image);
+		pfWIMCloseHandle(hWim);
+	}
+	if (pfWIMUnregisterMessageCallback != NULL)
+		pfWIMUnregisterMessageCallback(NULL, (FARPROC)WimProgressCallback);
+	safe_free(wimage);
+	safe_free(wdst);
+	ExitThread((DWORD)r);
+}
+
+BOOL WimSplitImage(const char* image, const char* dst, uint64_t part_size)
+{
+	DWORD dw = 0;
+	_image = image;
+	_dst = dst;
+	_part_size = part_size;
+
+	wim_thread = CreateThread(NULL, 0, WimSplitImageThread, NULL, 0, NULL);
+	if (wim_thread == NULL) {
+		uprintf("Unable to start split-image thread");
+		return FALSE;
+	}
+	SetThreadPriority(wim_thread, default_thread_priority);
+	WaitForSingleObject(wim_thread, INFINITE);
+	if (!GetExitCodeThread(wim_thread, &dw))
+		dw = 0;
+	wim_thread = NULL;
+	return dw;
+}
+
+/*
+ * Virtual target: a VHD or VHDX, that is created as a dynamic (sparse) disk if it doesn't
+ * exist, and that gets attached read-write, so that it is listed, and can be formatted or
+ * written to, like any other drive. This allows the whole of FormatThread() to be exercised
+ * and profiled on RAM disks or NVMe, without the variability of USB, and compared against
+ * actual devices. The disk stays attached for as long as we keep its handle open.
+ */
+PF_TYPE_DECL(WINAPI, DWORD, CreateVirtualDisk, (PVIRTUAL_STORAGE_TYPE, PCWSTR, VIRTUAL_DISK_ACCESS_MASK,
+	PSECURITY_DESCRIPTOR, CREATE_VIRTUAL_DISK_FLAG, ULONG, PCREATE_VIRTUAL_DISK_PARAMETERS, LPOVERLAPPED, PHANDLE));
+PF_TYPE_DECL(WINAPI, DWORD, OpenVirtualDisk, (PVIRTUAL_STORAGE_TYPE, PCWSTR,
+	VIRTUAL_DISK_ACCESS_MASK, OPEN_VIRTUAL_DISK_FLAG, POPEN_VIRTUAL_DISK_PARAMETERS, PHANDLE));
+PF_TYPE_DECL(WINAPI, DWORD, AttachVirtualDisk, (HANDLE, PSECURITY_DESCRIPTOR,
+	ATTACH_VIRTUAL_DISK_FLAG, ULONG, PATTACH_VIRTUAL_DISK_PARAMETERS, LPOVERLAPPED));
+PF_TYPE_DECL(WINAPI, DWORD, DetachVirtualDisk, (HANDLE, DETACH_VIRTUAL_DISK_FLAG, ULONG));
+PF_TYPE_DECL(WINAPI, DWORD, GetVirtualDiskPhysicalPath, (HANDLE, PULONG, PWSTR));
+
+static HANDLE virtual_target = INVALID_HANDLE_VALUE;
+
+/*
+ * Attach the VHD or VHDX from path, after creating it with a size of disk_size, if it doesn't
+ * exist yet. Returns the physical disk number it was attached as, or -1 on error.
+ */
+int AttachVirtualTarget(const char* path, uint64_t disk_size)
+{
+	VIRTUAL_STORAGE_TYPE vtype = { VIRTUAL_STORAGE_TYPE_DEVICE_VHD, VIRTUAL_STORAGE_TYPE_VENDOR_MICROSOFT };
+	CREATE_VIRTUAL_DISK_PARAMETERS cparams = { 0 };
+	ATTACH_VIRTUAL_DISK_PARAMETERS aparams = { 0 };
+	HANDLE handle = INVALID_HANDLE_VALUE;
+	DWORD r;
+	wchar_t wtmp[128];
+	ULONG size = sizeof(wtmp);
+	char physical_path[128];
+	const char* ext = (path == NULL) ? NULL : strrchr(path, '.');
+	int disk = -1;
+	wconvert(path);
+
+	PF_INIT_OR_OUT(CreateVirtualDisk, VirtDisk);
+	PF_INIT_OR_OUT(OpenVirtualDisk, VirtDisk);
+	PF_INIT_OR_OUT(AttachVirtualDisk, VirtDisk);
+	PF_INIT_OR_OUT(GetVirtualDiskPhysicalPath, VirtDisk);
+
+	// Raw images can't be attached by Windows, but a raw image with a VHD footer is a fixed VHD
+	if ((ext == NULL) || ((_stricmp(ext, ".vhd") != 0) && (_stricmp(ext, ".vhdx") != 0))) {
+		uprintf("Virtual target '%s' must be a .vhd or .vhdx", path);
+		goto out;
+	}
+	if (_stricmp(ext, ".vhdx") == 0)
+		vtype.DeviceId = VIRTUAL_STORAGE_TYPE_DEVICE_VHDX;
+	DetachVirtualTarget();
+
+	if (GetFileAttributesU(path) == INVALID_FILE_ATTRIBUTES) {
+		cparams.Version = CREATE_VIRTUAL_DISK_VERSION_2;
+		cparams.Version2.MaximumSize = disk_size;
+		r = pfCreateVirtualDisk(&vtype, wpath, VIRTUAL_DISK_ACCESS_NONE, NULL, CREATE_VIRTUAL_DISK_FLAG_NONE,
+			0, &cparams, NULL, &handle);
+		if (r != ERROR_SUCCESS) {
+			SetLastError(r);
+			uprintf("Could not create virtual target '%s': %s", path, WindowsErrorString());
+			goto out;
+		}
+		safe_closehandle(handle);
+		uprintf("Created %s virtual target '%s'", SizeToHumanReadable(disk_size, FALSE, FALSE), path);
+	}
+
+	r = pfOpenVirtualDisk(&vtype, wpath, VIRTUAL_DISK_ACCESS_ATTACH_RW | VIRTUAL_DISK_ACCESS_GET_INFO |
+		VIRTUAL_DISK_ACCESS_DETACH, OPEN_VIRTUAL_DISK_FLAG_NONE, NULL, &virtual_target);
+	if (r != ERROR_SUCCESS) {
+		SetLastError(r);
+		uprintf("Could not open virtual target '%s': %s", path, WindowsErrorString());
+		goto out;
+	}
+	aparams.Version = ATTACH_VIRTUAL_DISK_VERSION_1;
+	r = pfAttachVirtualDisk(virtual_target, NULL, ATTACH_VIRTUAL_DISK_FLAG_NONE, 0, &aparams, NULL);
+	if (r != ERROR_SUCCESS) {
+		SetLastError(r);
+		uprintf("Could not attach virtual target '%s': %s", path, WindowsErrorString());
+		goto out;
+	}
+	r = pfGetVirtualDiskPhysicalPath(virtual_target, &size, wtmp);
+	if (r != ERROR_SUCCESS) {
+		SetLastError(r);
+		uprintf("Could not obtain physical path for virtual target '%s': %s", path, WindowsErrorString());
+		goto out;
+	}
+	wchar_to_utf8_no_alloc(wtmp, physical_path, sizeof(physical_path));
+	// The path is \\.\PhysicalDriveN
+	if ((strlen(physical_path) < 18) || (sscanf(&physical_path[17], "%d", &disk) != 1))
+		disk = -1;
+	if (disk < 0)
+		uprintf("Unexpected physical path '%s' for virtual target '%s'", physical_path, path);
+	else
+		uprintf("Attached virtual target '%s' as disk %d", path, disk);
+
+out:
+	if (disk < 0)
+		DetachVirtualTarget();
+	wfree(path);
+	return disk;
+}
+
+void DetachVirtualTarget(void)
+{
+	PF_INIT_OR_OUT(DetachVirtualDisk, VirtDisk);
+
+	if ((virtual_target == NULL) || (virtual_target == INVALID_HANDLE_VALUE))
+		goto out;
+	pfDetachVirtualDisk(virtual_target, DETACH_VIRTUAL_DISK_FLAG_NONE, 0);
+out:
+	safe_closehandle(virtual_target);
+	virtual_target = INVALID_HANDLE_VALUE;
+}
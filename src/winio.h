@@ -19,10 +19,15 @@
 */
 
 #include <windows.h>
+#include <assert.h>
 #include "msapi_utf8.h"
 
 #pragma once
 
+// Defined in stdio.c: the overlapped requests on registered handles are aborted on user cancel
+extern void RegisterCancellableIo(HANDLE h);
+extern void UnregisterCancellableIo(HANDLE h);
+
 // https://docs.microsoft.com/en-us/windows/win32/api/minwinbase/ns-minwinbase-overlapped
 // See Microsoft? It's not THAT hard to define an OVERLAPPED struct in a manner that
 // doesn't qualify as an example of "Crimes against humanity" in the Geneva convention.
@@ -34,17 +39,25 @@ typedef struct {
 } NOW_THATS_WHAT_I_CALL_AN_OVERLAPPED;
 
 // File Descriptor for asynchronous accesses.
-// The status field is a threestate value reflecting the result
+// The status field is a value reflecting the result
 // of the current asynchronous read operation:
+//  2: The end of the file was reached before the read
 //  1: Read was successful and completed synchronously
 // -1: Read is pending asynchronously
 //  0: Read Error
 typedef struct {
 	HANDLE                              hFile;
 	INT                                 iStatus;
+	BOOL                                bUnbuffered;
 	NOW_THATS_WHAT_I_CALL_AN_OVERLAPPED Overlapped;
 } ASYNC_FD;
 
+// Files that are at least this large are read without going through the system cache, so that
+// they don't evict everything else from it, and don't get copied from the cache to our buffers.
+#define UNBUFFERED_READ_MIN_SIZE            (2ULL * 1024 * 1024 * 1024)
+// Alignment of the buffers and sizes of unbuffered reads (i.e. the largest sector size we expect)
+#define UNBUFFERED_READ_ALIGNMENT           4096
+
 /// <summary>
 /// Open a file for asynchronous access. The values for the flags are the same as the ones
 /// for the native CreateFile() call. Note that FILE_FLAG_OVERLAPPED will always be added
@@ -76,6 +89,33 @@ static __inline HANDLE CreateFileAsync(LPCSTR lpFileName, DWORD dwDesiredAccess,
 	return fd;
 }
 
+/// <summary>
+/// Open a file for sequential asynchronous reads. If the file is larger than
+/// UNBUFFERED_READ_MIN_SIZE, it is reopened with FILE_FLAG_NO_BUFFERING, in which
+/// case the read buffers and sizes must be aligned to UNBUFFERED_READ_ALIGNMENT.
+/// If the file can't be reopened that way, the cached handle is kept.
+/// </summary>
+/// <param name="lpFileName">The name of the file to open</param>
+/// <returns>Non NULL on success</returns>
+static __inline HANDLE OpenSequentialFileAsync(LPCSTR lpFileName)
+{
+	HANDLE hUnbuffered;
+	LARGE_INTEGER liSize;
+	ASYNC_FD* fd = (ASYNC_FD*)CreateFileAsync(lpFileName, GENERIC_READ, FILE_SHARE_READ,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN);
+	if ((fd == NULL) || !GetFileSizeEx(fd->hFile, &liSize) ||
+		((ULONG64)liSize.QuadPart < UNBUFFERED_READ_MIN_SIZE))
+		return fd;
+	hUnbuffered = CreateFileU(lpFileName, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING, NULL);
+	if (hUnbuffered != INVALID_HANDLE_VALUE) {
+		CloseHandle(fd->hFile);
+		fd->hFile = hUnbuffered;
+		fd->bUnbuffered = TRUE;
+	}
+	return fd;
+}
+
 /// <summary>
 /// Close a previously opened asynchronous file
 /// </summary>
@@ -101,10 +141,20 @@ static __inline BOOL ReadFileAsync(HANDLE h, LPVOID lpBuffer, DWORD nNumberOfByt
 {
 	ASYNC_FD* fd = (ASYNC_FD*)h;
 	fd->Overlapped.bOffsetUpdated = FALSE;
+	// Unbuffered reads can only be issued at aligned offsets, which we no longer
+	// have once a short read, at the end of the file, has been completed
+	if (fd->bUnbuffered) {
+		assert(((uintptr_t)lpBuffer % UNBUFFERED_READ_ALIGNMENT == 0) &&
+			(nNumberOfBytesToRead % UNBUFFERED_READ_ALIGNMENT == 0));
+		if (fd->Overlapped.Offset % UNBUFFERED_READ_ALIGNMENT != 0) {
+			fd->iStatus = 2;
+			return TRUE;
+		}
+	}
 	if (!ReadFile(fd->hFile, lpBuffer, nNumberOfBytesToRead, NULL,
 		(OVERLAPPED*)&fd->Overlapped))
-		// TODO: Is it possible to get ERROR_HANDLE_EOF here?
-		fd->iStatus = (GetLastError() == ERROR_IO_PENDING) ? -1 : 0;
+		fd->iStatus = (GetLastError() == ERROR_IO_PENDING) ? -1 :
+			((GetLastError() == ERROR_HANDLE_EOF) ? 2 : 0);
 	else
 		fd->iStatus = 1;
 	return (fd->iStatus != 0);
@@ -155,10 +205,10 @@ static __inline BOOL WaitFileAsync(HANDLE h, DWORD dwTimeout)
 static __inline BOOL GetSizeAsync(HANDLE h, LPDWORD lpNumberOfBytes)
 {
 	ASYNC_FD* fd = (ASYNC_FD*)h;
-	// Previous call to [Read/Write]FileAsync() failed
-	if (fd->iStatus == 0) {
+	// Previous call to [Read/Write]FileAsync() failed, or found the end of the file
+	if ((fd->iStatus == 0) || (fd->iStatus == 2)) {
 		*lpNumberOfBytes = 0;
-		return FALSE;
+		return (fd->iStatus == 2);
 	}
 	// Detect if we already read the size and updated the offset
 	if (fd->Overlapped.bOffsetUpdated) {
@@ -173,3 +223,264 @@ static __inline BOOL GetSizeAsync(HANDLE h, LPDWORD lpNumberOfBytes)
 	fd->Overlapped.bOffsetUpdated = TRUE;
 	return TRUE;
 }
+
+// Maximum number of concurrent requests we allow on an asynchronous queue
+#define MAX_ASYNC_QUEUE_DEPTH 16
+
+/// <summary>
+/// Return a monotonic timestamp, in microseconds, for the timing of I/O requests.
+/// </summary>
+static __inline ULONG64 GetIoTimestamp(VOID)
+{
+	static LARGE_INTEGER liFrequency = { 0 };
+	LARGE_INTEGER liCounter;
+	if (liFrequency.QuadPart == 0)
+		QueryPerformanceFrequency(&liFrequency);
+	QueryPerformanceCounter(&liCounter);
+	return (ULONG64)(liCounter.QuadPart / liFrequency.QuadPart) * 1000000ULL +
+		(ULONG64)(liCounter.QuadPart % liFrequency.QuadPart) * 1000000ULL / liFrequency.QuadPart;
+}
+
+// Optional callback, invoked for each request of an asynchronous queue that completed
+// successfully. u64LatencyUs is the time from issue to completion, and u64BusyUs the
+// part of it that didn't overlap with the previous request (i.e. the time the device
+// took for this request alone), which is what throughput should be computed from.
+typedef VOID (*ASYNC_QUEUE_MONITOR)(LPVOID lpContext, BOOL bWrite, ULONG64 u64Offset,
+	DWORD dwSize, ULONG64 u64LatencyUs, ULONG64 u64BusyUs);
+
+// A single request slot of an asynchronous queue.
+// The status field uses the same threestate values as ASYNC_FD.
+typedef struct {
+	NOW_THATS_WHAT_I_CALL_AN_OVERLAPPED Overlapped;
+	LPVOID                              lpBuffer;
+	DWORD                               dwSize;
+	DWORD                               dwTransferred;
+	INT                                 iStatus;
+	BOOL                                bPending;
+	BOOL                                bWrite;
+	ULONG64                             u64Issued;
+} ASYNC_REQUEST;
+
+// Queue of asynchronous requests, that can be kept in flight simultaneously
+// against a single file or device handle. If the handle could not be (re)opened
+// for overlapped access, bSync is set and all requests complete synchronously.
+typedef struct {
+	HANDLE                              hFile;
+	BOOL                                bSync;
+	DWORD                               dwDepth;
+	ASYNC_QUEUE_MONITOR                 pfnMonitor;
+	LPVOID                              lpMonitorContext;
+	ULONG64                             u64LastCompletion;
+	ASYNC_REQUEST                       Request[MAX_ASYNC_QUEUE_DEPTH];
+} ASYNC_QUEUE;
+
+/// <summary>
+/// Create an asynchronous request queue for an existing file or device handle.
+/// The handle is reopened with FILE_FLAG_OVERLAPPED and FILE_FLAG_NO_BUFFERING
+/// (which means that buffers, sizes and offsets must be aligned to the sector size).
+/// If the handle cannot be reopened, the original handle is used and requests
+/// are processed synchronously, so that the caller doesn't need a separate code path.
+/// The in-flight requests of the queue are aborted if the user cancels the operation.
+/// </summary>
+/// <param name="hFile">The handle to the file or device the queue applies to</param>
+/// <param name="dwDesiredAccess">The requested access to the file or device</param>
+/// <param name="dwDepth">The number of request slots (max MAX_ASYNC_QUEUE_DEPTH)</param>
+/// <returns>Non NULL on success</returns>
+static __inline HANDLE CreateAsyncQueue(HANDLE hFile, DWORD dwDesiredAccess, DWORD dwDepth)
+{
+	DWORD i;
+	ASYNC_QUEUE* q;
+
+	if ((dwDepth == 0) || (dwDepth > MAX_ASYNC_QUEUE_DEPTH)) {
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return NULL;
+	}
+	q = calloc(sizeof(ASYNC_QUEUE), 1);
+	if (q == NULL) {
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return NULL;
+	}
+	q->dwDepth = dwDepth;
+	for (i = 0; i < dwDepth; i++) {
+		q->Request[i].Overlapped.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+		if (q->Request[i].Overlapped.hEvent == NULL) {
+			while (i-- > 0)
+				CloseHandle(q->Request[i].Overlapped.hEvent);
+			free(q);
+			return NULL;
+		}
+	}
+	q->hFile = ReOpenFile(hFile, dwDesiredAccess, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING);
+	if (q->hFile == INVALID_HANDLE_VALUE) {
+		q->hFile = hFile;
+		q->bSync = TRUE;
+	} else {
+		RegisterCancellableIo(q->hFile);
+	}
+	return q;
+}
+
+/// <summary>
+/// Set a monitor callback, that gets invoked with the timing of each completed request.
+/// </summary>
+/// <param name="h">An async queue handle, created by a call to CreateAsyncQueue()</param>
+/// <param name="pfnMonitor">The callback, or NULL to disable monitoring</param>
+/// <param name="lpContext">The context that is passed to the callback</param>
+static __inline VOID SetAsyncQueueMonitor(HANDLE h, ASYNC_QUEUE_MONITOR pfnMonitor, LPVOID lpContext)
+{
+	ASYNC_QUEUE* q = (ASYNC_QUEUE*)h;
+	if (q == NULL)
+		return;
+	q->pfnMonitor = pfnMonitor;
+	q->lpMonitorContext = lpContext;
+	q->u64LastCompletion = 0;
+}
+
+/// <summary>
+/// Cancel the in-flight request on a specific slot of an asynchronous queue, if any,
+/// and wait for the cancellation to complete so that the slot and its buffer can be reused.
+/// </summary>
+/// <param name="h">An async queue handle, created by a call to CreateAsyncQueue()</param>
+/// <param name="dwSlot">The index of the request slot to cancel</param>
+static __inline VOID CancelAsyncRequest(HANDLE h, DWORD dwSlot)
+{
+	DWORD size;
+	ASYNC_QUEUE* q = (ASYNC_QUEUE*)h;
+	ASYNC_REQUEST* req = &q->Request[dwSlot];
+	if (!req->bPending)
+		return;
+	if (req->iStatus < 0) {
+		CancelIoEx(q->hFile, (OVERLAPPED*)&req->Overlapped);
+		GetOverlappedResult(q->hFile, (OVERLAPPED*)&req->Overlapped, &size, TRUE);
+	}
+	req->bPending = FALSE;
+}
+
+/// <summary>
+/// Cancel all the in-flight requests of an asynchronous queue and wait for them to complete.
+/// </summary>
+/// <param name="h">An async queue handle, created by a call to CreateAsyncQueue()</param>
+static __inline VOID CancelAsyncQueue(HANDLE h)
+{
+	DWORD i;
+	ASYNC_QUEUE* q = (ASYNC_QUEUE*)h;
+	if (q == NULL)
+		return;
+	for (i = 0; i < q->dwDepth; i++)
+		CancelAsyncRequest(h, i);
+}
+
+/// <summary>
+/// Close a previously created asynchronous queue, after cancelling any in-flight request.
+/// Note that, unless it was used as a synchronous fallback, the original handle that
+/// was provided to CreateAsyncQueue() is left untouched and must be closed separately.
+/// </summary>
+/// <param name="h">An async queue handle, created by a call to CreateAsyncQueue()</param>
+static __inline VOID CloseAsyncQueue(HANDLE h)
+{
+	DWORD i;
+	ASYNC_QUEUE* q = (ASYNC_QUEUE*)h;
+	if (q == NULL)
+		return;
+	CancelAsyncQueue(h);
+	if (!q->bSync) {
+		UnregisterCancellableIo(q->hFile);
+		CloseHandle(q->hFile);
+	}
+	for (i = 0; i < q->dwDepth; i++)
+		CloseHandle(q->Request[i].Overlapped.hEvent);
+	free(q);
+}
+
+/// <summary>
+/// Issue a read or write request on a specific slot of an asynchronous queue.
+/// The request must be reaped with WaitAsyncQueue() before the slot can be reused.
+/// </summary>
+/// <param name="h">An async queue handle, created by a call to CreateAsyncQueue()</param>
+/// <param name="dwSlot">The index of the request slot to use</param>
+/// <param name="bWrite">TRUE for a write request, FALSE for a read request</param>
+/// <param name="lpBuffer">The data buffer</param>
+/// <param name="dwSize">Number of bytes to read or write</param>
+/// <param name="u64Offset">The file or device offset the request applies to</param>
+/// <returns>TRUE on success, FALSE on error</returns>
+static __inline BOOL IssueAsyncQueue(HANDLE h, DWORD dwSlot, BOOL bWrite, LPVOID lpBuffer,
+	DWORD dwSize, ULONG64 u64Offset)
+{
+	BOOL r;
+	ASYNC_QUEUE* q = (ASYNC_QUEUE*)h;
+	ASYNC_REQUEST* req = &q->Request[dwSlot];
+
+	assert(dwSlot < q->dwDepth);
+	assert(!req->bPending);
+	req->lpBuffer = lpBuffer;
+	req->dwSize = dwSize;
+	req->dwTransferred = 0;
+	req->bWrite = bWrite;
+	req->Overlapped.Offset = u64Offset;
+	if (q->pfnMonitor != NULL)
+		req->u64Issued = GetIoTimestamp();
+	r = bWrite ?
+		WriteFile(q->hFile, lpBuffer, dwSize, &req->dwTransferred, (OVERLAPPED*)&req->Overlapped) :
+		ReadFile(q->hFile, lpBuffer, dwSize, &req->dwTransferred, (OVERLAPPED*)&req->Overlapped);
+	if (!r)
+		req->iStatus = (GetLastError() == ERROR_IO_PENDING) ? -1 : 0;
+	else
+		req->iStatus = 1;
+	req->bPending = (req->iStatus != 0);
+	return req->bPending;
+}
+
+/// <summary>
+/// Wait for the request on a specific slot of an asynchronous queue to complete.
+/// This function also succeeds if the request already completed synchronously.
+/// </summary>
+/// <param name="h">An async queue handle, created by a call to CreateAsyncQueue()</param>
+/// <param name="dwSlot">The index of the request slot to wait on</param>
+/// <param name="dwTimeout">A timeout value, in ms</param>
+/// <param name="lpNumberOfBytes">A pointer that receives the number of bytes transferred</param>
+/// <returns>TRUE on success, FALSE on error or timeout</returns>
+static __inline BOOL WaitAsyncQueue(HANDLE h, DWORD dwSlot, DWORD dwTimeout, LPDWORD lpNumberOfBytes)
+{
+	ULONG64 u64Now;
+	ASYNC_QUEUE* q = (ASYNC_QUEUE*)h;
+	ASYNC_REQUEST* req = &q->Request[dwSlot];
+
+	*lpNumberOfBytes = 0;
+	if (!req->bPending) {
+		SetLastError(ERROR_NO_MORE_ITEMS);
+		return FALSE;
+	}
+	if (req->iStatus < 0) {
+		if (WaitForSingleObject(req->Overlapped.hEvent, dwTimeout) != WAIT_OBJECT_0) {
+			SetLastError(ERROR_TIMEOUT);
+			return FALSE;
+		}
+		req->bPending = FALSE;
+		if (!GetOverlappedResult(q->hFile, (OVERLAPPED*)&req->Overlapped, &req->dwTransferred, FALSE))
+			return FALSE;
+	}
+	req->bPending = FALSE;
+	*lpNumberOfBytes = req->dwTransferred;
+	if (q->pfnMonitor != NULL) {
+		u64Now = GetIoTimestamp();
+		q->pfnMonitor(q->lpMonitorContext, req->bWrite, req->Overlapped.Offset, req->dwTransferred,
+			u64Now - req->u64Issued, u64Now - max(req->u64Issued, q->u64LastCompletion));
+		q->u64LastCompletion = u64Now;
+	}
+	return TRUE;
+}
+
+/// <summary>
+/// Return the number of request slots that are currently in flight on an asynchronous queue.
+/// </summary>
+/// <param name="h">An async queue handle, created by a call to CreateAsyncQueue()</param>
+/// <returns>The number of pending requests</returns>
+static __inline DWORD GetAsyncQueuePending(HANDLE h)
+{
+	DWORD i, n = 0;
+	ASYNC_QUEUE* q = (ASYNC_QUEUE*)h;
+	for (i = 0; i < q->dwDepth; i++)
+		n += q->Request[i].bPending ? 1 : 0;
+	return n;
+}